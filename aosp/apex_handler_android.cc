@@ -15,6 +15,7 @@
 //
 
 #include <memory>
+#include <string>
 #include <utility>
 
 #include <base/files/file_util.h>
@@ -44,6 +45,17 @@ android::apex::CompressedApexInfoList CreateCompressedApexInfoList(
   return compressed_apex_info_list;
 }
 
+// Returns a key identifying the compressed APEXes of |list|.
+std::string GetCompressedApexKey(
+    const android::apex::CompressedApexInfoList& list) {
+  std::string key;
+  for (const auto& info : list.apexInfos) {
+    key += info.moduleName + ":" + std::to_string(info.versionCode) + ":" +
+           std::to_string(info.decompressedSize) + ";";
+  }
+  return key;
+}
+
 }  // namespace
 
 std::unique_ptr<ApexHandlerInterface>
@@ -57,6 +69,19 @@ ApexHandlerInterface::CreateApexHandler() {
 
 android::base::Result<uint64_t> ApexHandlerAndroid::CalculateSize(
     const std::vector<ApexInfo>& apex_infos) const {
+  auto compressed_apex_info_list = CreateCompressedApexInfoList(apex_infos);
+  if (compressed_apex_info_list.apexInfos.empty()) {
+    return 0;
+  }
+  const std::string key = GetCompressedApexKey(compressed_apex_info_list);
+  {
+    std::lock_guard<std::mutex> lock(size_cache_mutex_);
+    auto it = size_cache_.find(key);
+    if (it != size_cache_.end()) {
+      return it->second;
+    }
+  }
+
   // We might not need to decompress every APEX. Communicate with apexd to get
   // accurate requirement.
   auto apex_service = GetApexService();
@@ -64,7 +89,6 @@ android::base::Result<uint64_t> ApexHandlerAndroid::CalculateSize(
     return android::base::Error() << "Failed to get hold of apexservice";
   }
 
-  auto compressed_apex_info_list = CreateCompressedApexInfoList(apex_infos);
   int64_t size_from_apexd = 0;
   auto result = apex_service->calculateSizeForCompressedApex(
       compressed_apex_info_list, &size_from_apexd);
@@ -72,6 +96,8 @@ android::base::Result<uint64_t> ApexHandlerAndroid::CalculateSize(
     return android::base::Error()
            << "Failed to get size required from apexservice";
   }
+  std::lock_guard<std::mutex> lock(size_cache_mutex_);
+  size_cache_[key] = size_from_apexd;
   return size_from_apexd;
 }
 
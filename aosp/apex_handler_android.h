@@ -17,7 +17,9 @@
 #ifndef SYSTEM_UPDATE_ENGINE_AOSP_APEX_HANDLER_ANDROID_H_
 #define SYSTEM_UPDATE_ENGINE_AOSP_APEX_HANDLER_ANDROID_H_
 
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -32,12 +34,18 @@ namespace chromeos_update_engine {
 
 class ApexHandlerAndroid : virtual public ApexHandlerInterface {
  public:
+  // The size apexd requires for a set of compressed APEXes is cached, as it
+  // doesn't change until the next boot. May be called from any thread.
   android::base::Result<uint64_t> CalculateSize(
       const std::vector<ApexInfo>& apex_infos) const;
   bool AllocateSpace(const std::vector<ApexInfo>& apex_infos) const;
 
  private:
   android::sp<android::apex::IApexService> GetApexService() const;
+
+  // The sizes returned by apexd, by the compressed APEXes they are for.
+  mutable std::mutex size_cache_mutex_;
+  mutable std::map<std::string, uint64_t> size_cache_;
 };
 
 class FlattenedApexHandlerAndroid : virtual public ApexHandlerInterface {
@@ -55,6 +55,32 @@ TEST(ApexHandlerAndroidTest, CalculateSizeUpdatableApex) {
   ASSERT_EQ(*result, 3u);
 }
 
+TEST(ApexHandlerAndroidTest, CalculateSizeCachedUpdatableApex) {
+  ApexHandlerAndroid apex_handler;
+  std::vector<ApexInfo> apex_infos;
+  apex_infos.push_back(CreateApexInfo("sample1", 1, true, 1));
+  apex_infos.push_back(CreateApexInfo("sample2", 2, true, 2));
+  auto result = apex_handler.CalculateSize(apex_infos);
+  ASSERT_TRUE(result.ok());
+  auto cached_result = apex_handler.CalculateSize(apex_infos);
+  ASSERT_TRUE(cached_result.ok());
+  ASSERT_EQ(*result, *cached_result);
+
+  // A different version of an APEX isn't the same set of APEXes.
+  apex_infos[1] = CreateApexInfo("sample2", 3, true, 4);
+  result = apex_handler.CalculateSize(apex_infos);
+  ASSERT_TRUE(result.ok());
+  ASSERT_EQ(*result, 5u);
+}
+
+TEST(ApexHandlerAndroidTest, CalculateSizeUncompressedUpdatableApex) {
+  ApexHandlerAndroid apex_handler;
+  auto result = apex_handler.CalculateSize(
+      {CreateApexInfo("uncompressed", 1, false, 4)});
+  ASSERT_TRUE(result.ok());
+  ASSERT_EQ(*result, 0u);
+}
+
 TEST(ApexHandlerAndroidTest, AllocateSpaceUpdatableApex) {
   ApexHandlerAndroid apex_handler;
   std::vector<ApexInfo> apex_infos;
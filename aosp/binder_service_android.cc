@@ -56,6 +56,9 @@ void BinderUpdateEngineAndroidService::SendPayloadApplicationComplete(
 
 Status BinderUpdateEngineAndroidService::bind(
     const android::sp<IUpdateEngineCallback>& callback, bool* return_value) {
+  // The status isn't known until the service delegate was initialized.
+  service_delegate_->Init();
+
   // Send an status update on connection (except when no update sent so far).
   // Even though the status update is oneway, it still returns an erroneous
   // status in case of a selinux denial. We should at least check this status
@@ -261,4 +264,19 @@ Status BinderUpdateEngineAndroidService::setPerformanceMode(bool enable) {
   return Status::ok();
 }
 
+Status BinderUpdateEngineAndroidService::setMergePolicy(int32_t policy) {
+  if (policy != IUpdateEngine::MERGE_POLICY_DEFAULT &&
+      policy != IUpdateEngine::MERGE_POLICY_THROTTLED &&
+      policy != IUpdateEngine::MERGE_POLICY_FAST) {
+    return Status::fromExceptionCode(
+        Status::EX_ILLEGAL_ARGUMENT,
+        android::String8::format("Unknown merge policy %d", policy));
+  }
+  Error error;
+  if (!service_delegate_->SetMergePolicy(static_cast<MergePolicy>(policy),
+                                         &error))
+    return ErrorPtrToStatus(error);
+  return Status::ok();
+}
+
 }  // namespace chromeos_update_engine
@@ -80,6 +80,7 @@ class BinderUpdateEngineAndroidService : public android::os::BnUpdateEngine,
   android::binder::Status cleanupSuccessfulUpdate(
       const android::sp<android::os::IUpdateEngineCallback>& callback) override;
   android::binder::Status setPerformanceMode(bool enable) override;
+  android::binder::Status setMergePolicy(int32_t policy) override;
 
  private:
   // Remove the passed |callback| from the list of registered callbacks. Called
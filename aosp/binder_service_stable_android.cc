@@ -65,6 +65,7 @@ Status BinderUpdateEngineAndroidStableService::bind(
   }
 
   // See BinderUpdateEngineAndroidService::bind.
+  service_delegate_->Init();
   if (last_status_ != -1) {
     auto status = callback->onStatusUpdate(last_status_, last_progress_);
     if (!status.isOk()) {
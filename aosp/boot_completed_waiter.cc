@@ -0,0 +1,68 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/aosp/boot_completed_waiter.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <thread>
+
+#include <android-base/properties.h>
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// How long the thread waits for the property at once, before checking whether
+// it still needs to.
+constexpr auto kBootCompletedWaitTimeout = std::chrono::seconds(60);
+
+}  // namespace
+
+std::shared_ptr<BootCompletedWaiter> BootCompletedWaiter::Start() {
+  auto waiter = std::make_shared<BootCompletedWaiter>();
+  waiter->event_fd_.reset(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  if (waiter->event_fd_ < 0) {
+    PLOG(ERROR) << "Unable to create an eventfd";
+    return nullptr;
+  }
+  std::thread([waiter]() { waiter->Wait(); }).detach();
+  return waiter;
+}
+
+bool BootCompletedWaiter::IsBootCompleted() {
+  return android::base::GetBoolProperty(kBootCompletedProp, false);
+}
+
+void BootCompletedWaiter::Wait() {
+#ifdef __BIONIC__
+  while (!cancelled_) {
+    if (android::base::WaitForProperty(
+            kBootCompletedProp, "1", kBootCompletedWaitTimeout)) {
+      uint64_t value = 1;
+      if (write(event_fd_.get(), &value, sizeof(value)) < 0) {
+        PLOG(WARNING) << "Unable to signal the eventfd";
+      }
+      return;
+    }
+  }
+#endif
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,55 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_AOSP_BOOT_COMPLETED_WAITER_H_
+#define UPDATE_ENGINE_AOSP_BOOT_COMPLETED_WAITER_H_
+
+#include <atomic>
+#include <memory>
+
+#include <android-base/unique_fd.h>
+
+namespace chromeos_update_engine {
+
+// The property set once the device completed its boot.
+constexpr char kBootCompletedProp[] = "sys.boot_completed";
+
+// Waits for |kBootCompletedProp| on a thread of its own and signals an
+// eventfd once it is set, for the message loop to watch.
+class BootCompletedWaiter {
+ public:
+  // Starts the thread, which holds a reference to the waiter until it ends.
+  // Returns nullptr on failure.
+  static std::shared_ptr<BootCompletedWaiter> Start();
+
+  // Returns whether |kBootCompletedProp| is set.
+  static bool IsBootCompleted();
+
+  int event_fd() const { return event_fd_.get(); }
+
+  // The thread ends, at the latest after the timeout of the wait in progress.
+  void Cancel() { cancelled_ = true; }
+
+ private:
+  void Wait();
+
+  android::base::unique_fd event_fd_;
+  std::atomic<bool> cancelled_{false};
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_AOSP_BOOT_COMPLETED_WAITER_H_
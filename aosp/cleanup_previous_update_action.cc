@@ -18,12 +18,14 @@
 #include <algorithm>
 #include <chrono>
 #include <functional>
+#include <memory>
 #include <string>
 #include <type_traits>
 
 #include <android-base/chrono_utils.h>
 #include <android-base/properties.h>
 #include <base/bind.h>
+#include <base/threading/thread_task_runner_handle.h>
 #include <libsnapshot/snapshot.h>
 
 #ifndef __ANDROID_RECOVERY__
@@ -39,7 +41,6 @@ using android::snapshot::SnapshotMergeStats;
 using android::snapshot::UpdateState;
 using brillo::MessageLoop;
 
-constexpr char kBootCompletedProp[] = "sys.boot_completed";
 constexpr auto&& kMergeDelaySecondsProp = "ro.virtual_ab.merge_delay_seconds";
 constexpr size_t kMaxMergeDelaySeconds = 600;
 // Interval to check sys.boot_completed.
@@ -47,8 +48,14 @@ constexpr auto kCheckBootCompletedInterval = base::TimeDelta::FromSeconds(2);
 // Interval to check IBootControl::isSlotMarkedSuccessful
 constexpr auto kCheckSlotMarkedSuccessfulInterval =
     base::TimeDelta::FromSeconds(2);
-// Interval to call SnapshotManager::ProcessUpdateState
+// Interval to call SnapshotManager::ProcessUpdateState, until the merge
+// throughput is known.
 constexpr auto kWaitForMergeInterval = base::TimeDelta::FromSeconds(2);
+// Bounds of the interval to call SnapshotManager::ProcessUpdateState once the
+// merge throughput is known.
+constexpr auto kMinWaitForMergeInterval =
+    base::TimeDelta::FromMilliseconds(200);
+constexpr auto kMaxWaitForMergeInterval = base::TimeDelta::FromSeconds(30);
 
 #ifdef __ANDROID_RECOVERY__
 static constexpr bool kIsRecovery = true;
@@ -132,6 +139,8 @@ void CleanupPreviousUpdateAction::CheckTaskScheduled(std::string_view name) {
 void CleanupPreviousUpdateAction::StopActionInternal() {
   LOG(INFO) << "Stopping/suspending/completing CleanupPreviousUpdateAction";
   running_ = false;
+  waiting_for_merge_delay_ = false;
+  StopWatchingBootCompleted();
 
   if (scheduled_task_.IsScheduled()) {
     if (scheduled_task_.Cancel()) {
@@ -179,9 +188,11 @@ void CleanupPreviousUpdateAction::WaitBootCompletedOrSchedule() {
   AcknowledgeTaskExecuted();
   TEST_AND_RETURN(running_);
   if (!kIsRecovery &&
-      !android::base::GetBoolProperty(kBootCompletedProp, false)) {
-    // repeat
-    ScheduleWaitBootCompleted();
+      !BootCompletedWaiter::IsBootCompleted()) {
+    if (!WatchBootCompleted()) {
+      // repeat
+      ScheduleWaitBootCompleted();
+    }
     return;
   }
 
@@ -193,6 +204,40 @@ void CleanupPreviousUpdateAction::WaitBootCompletedOrSchedule() {
   CheckSlotMarkedSuccessfulOrSchedule();
 }
 
+bool CleanupPreviousUpdateAction::WatchBootCompleted() {
+#ifdef __BIONIC__
+  StopWatchingBootCompleted();
+  // Watching file descriptors needs a base::SingleThreadTaskRunner, which
+  // brillo::FakeMessageLoop doesn't have.
+  if (!base::ThreadTaskRunnerHandle::IsSet())
+    return false;
+  boot_completed_waiter_ = BootCompletedWaiter::Start();
+  if (!boot_completed_waiter_)
+    return false;
+  boot_completed_controller_ = base::FileDescriptorWatcher::WatchReadable(
+      boot_completed_waiter_->event_fd(),
+      base::BindRepeating(&CleanupPreviousUpdateAction::OnBootCompleted,
+                          base::Unretained(this)));
+  LOG(INFO) << "Waiting for " << kBootCompletedProp;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void CleanupPreviousUpdateAction::OnBootCompleted() {
+  StopWatchingBootCompleted();
+  WaitBootCompletedOrSchedule();
+}
+
+void CleanupPreviousUpdateAction::StopWatchingBootCompleted() {
+  boot_completed_controller_.reset();
+  if (boot_completed_waiter_) {
+    boot_completed_waiter_->Cancel();
+    boot_completed_waiter_.reset();
+  }
+}
+
 void CleanupPreviousUpdateAction::ScheduleWaitMarkBootSuccessful() {
   TEST_AND_RETURN(running_);
   if (!scheduled_task_.PostTask(
@@ -210,24 +255,58 @@ void CleanupPreviousUpdateAction::CheckForMergeDelay() {
     StartMerge();
     return;
   }
-  const auto merge_delay_seconds =
-      std::clamp<int>(android::base::GetIntProperty(kMergeDelaySecondsProp, 0),
-                      0,
-                      kMaxMergeDelaySeconds);
-  if (merge_delay_seconds != 0) {
-    LOG(INFO) << "Merge is ready to start, but " << kMergeDelaySecondsProp
-              << " is set, delaying merge by " << merge_delay_seconds
-              << " seconds";
+  if (merge_ready_time_.is_null())
+    merge_ready_time_ = base::TimeTicks::Now();
+  base::TimeDelta merge_delay;
+  switch (delegate_ ? delegate_->GetMergePolicy() : MergePolicy::kDefault) {
+    case MergePolicy::kDefault: {
+      const auto merge_delay_seconds = std::clamp<int>(
+          android::base::GetIntProperty(kMergeDelaySecondsProp, 0),
+          0,
+          kMaxMergeDelaySeconds);
+      if (merge_delay_seconds != 0) {
+        LOG(INFO) << "Merge is ready to start, but " << kMergeDelaySecondsProp
+                  << " is set, delaying merge by " << merge_delay_seconds
+                  << " seconds";
+      }
+      merge_delay = base::TimeDelta::FromSeconds(merge_delay_seconds);
+      break;
+    }
+    case MergePolicy::kThrottled:
+      LOG(INFO) << "Merge is ready to start, but the device is in use, "
+                << "delaying merge by up to " << kMaxMergeDeferral;
+      merge_delay = kMaxMergeDeferral;
+      break;
+    case MergePolicy::kFast:
+      LOG(INFO) << "Merge is ready to start and the device is idle.";
+      break;
   }
+  // The delay counts from the time the merge got ready, so that changes of
+  // the policy don't hold it off for longer.
+  merge_delay = std::max(
+      merge_delay - (base::TimeTicks::Now() - merge_ready_time_),
+      base::TimeDelta());
+  waiting_for_merge_delay_ = true;
   if (!scheduled_task_.PostTask(
           FROM_HERE,
-          [this]() { StartMerge(); },
-          base::TimeDelta::FromSeconds(merge_delay_seconds))) {
+          [this]() {
+            waiting_for_merge_delay_ = false;
+            StartMerge();
+          },
+          merge_delay)) {
     LOG(ERROR) << "Unable to schedule " << __FUNCTION__;
     processor_->ActionComplete(this, ErrorCode::kError);
   }
 }
 
+void CleanupPreviousUpdateAction::OnMergePolicyChanged() {
+  if (!running_ || !waiting_for_merge_delay_)
+    return;
+  LOG(INFO) << "Merge policy changed, rescheduling the merge.";
+  scheduled_task_.Cancel();
+  CheckForMergeDelay();
+}
+
 void CleanupPreviousUpdateAction::CheckSlotMarkedSuccessfulOrSchedule() {
   AcknowledgeTaskExecuted();
   TEST_AND_RETURN(running_);
@@ -299,11 +378,30 @@ void CleanupPreviousUpdateAction::ScheduleWaitForMerge() {
           FROM_HERE,
           base::Bind(&CleanupPreviousUpdateAction::WaitForMergeOrSchedule,
                      base::Unretained(this)),
-          kWaitForMergeInterval)) {
+          GetWaitForMergeInterval(base::TimeTicks::Now()))) {
     CheckTaskScheduled("WaitForMerge");
   }
 }
 
+base::TimeDelta CleanupPreviousUpdateAction::GetWaitForMergeInterval(
+    base::TimeTicks now) {
+  if (merge_start_percentage_ < 0 ||
+      merge_percentage_ < merge_start_percentage_) {
+    merge_start_percentage_ = merge_percentage_;
+    merge_start_time_ = now;
+    return kWaitForMergeInterval;
+  }
+  const double elapsed_seconds = (now - merge_start_time_).InSecondsF();
+  const double merged_percentage = merge_percentage_ - merge_start_percentage_;
+  if (elapsed_seconds <= 0 || merged_percentage <= 0)
+    return kWaitForMergeInterval;
+  const double seconds_left =
+      (100 - merge_percentage_) * elapsed_seconds / merged_percentage;
+  return std::clamp(base::TimeDelta::FromSecondsD(seconds_left / 2),
+                    kMinWaitForMergeInterval,
+                    kMaxWaitForMergeInterval);
+}
+
 void CleanupPreviousUpdateAction::WaitForMergeOrSchedule() {
   AcknowledgeTaskExecuted();
   TEST_AND_RETURN(running_);
@@ -392,6 +490,7 @@ void CleanupPreviousUpdateAction::WaitForMergeOrSchedule() {
 bool CleanupPreviousUpdateAction::OnMergePercentageUpdate() {
   double percentage = 0.0;
   snapshot_->GetUpdateState(&percentage);
+  merge_percentage_ = percentage;
   if (delegate_) {
     // libsnapshot uses [0, 100] percentage but update_engine uses [0, 1].
     delegate_->OnCleanupProgressUpdate(percentage / 100);
@@ -540,11 +639,17 @@ void CleanupPreviousUpdateAction::ReportMergeStats() {
   auto target_build_fingerprint =
       android::base::GetProperty("ro.build.fingerprint", "");
 
+  // The atom has no field for the merge throughput, it is logged along.
+  const int64_t merge_throughput =
+      passed_ms.count() > 0
+          ? report.total_cow_size_bytes() * 1000 / passed_ms.count()
+          : 0;
   LOG(INFO) << "Reporting merge stats: "
             << android::snapshot::UpdateState_Name(report.state()) << " in "
             << passed_ms.count() << "ms (resumed " << report.resume_count()
             << " times), using " << report.cow_file_size()
-            << " bytes of COW image.";
+            << " bytes of COW image, merged at " << merge_throughput
+            << " bytes/s.";
   statsd::stats_write(statsd::SNAPSHOT_MERGE_REPORTED,
                       static_cast<int32_t>(report.state()),
                       static_cast<int64_t>(passed_ms.count()),
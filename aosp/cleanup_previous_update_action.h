@@ -21,10 +21,14 @@
 #include <string>
 #include <string_view>
 
+#include <base/files/file_descriptor_watcher_posix.h>
+#include <base/time/time.h>
 #include <brillo/message_loops/message_loop.h>
+#include <gtest/gtest_prod.h>
 #include <libsnapshot/snapshot.h>
 #include <libsnapshot/snapshot_stats.h>
 
+#include "update_engine/aosp/boot_completed_waiter.h"
 #include "update_engine/common/action.h"
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/cleanup_previous_update_action_delegate.h"
@@ -54,6 +58,13 @@ class CleanupPreviousUpdateAction : public Action<CleanupPreviousUpdateAction> {
       CleanupPreviousUpdateActionDelegateInterface* delegate);
   ~CleanupPreviousUpdateAction();
 
+  // The longest the merge is held off by MergePolicy::kThrottled.
+  static constexpr auto kMaxMergeDeferral = base::TimeDelta::FromMinutes(10);
+
+  // Called by the delegate whenever the merge policy changed, to start the
+  // merge sooner or later if it is waiting to start.
+  void OnMergePolicyChanged();
+
   void PerformAction() override;
   void SuspendAction() override;
   void ResumeAction() override;
@@ -67,6 +78,8 @@ class CleanupPreviousUpdateAction : public Action<CleanupPreviousUpdateAction> {
       OutputObjectType;
 
  private:
+  FRIEND_TEST(CleanupPreviousUpdateActionTest, WaitForMergeIntervalTest);
+
   PrefsInterface* prefs_;
   BootControlInterface* boot_control_;
   android::snapshot::ISnapshotManager* snapshot_;
@@ -78,6 +91,21 @@ class CleanupPreviousUpdateAction : public Action<CleanupPreviousUpdateAction> {
   android::snapshot::ISnapshotMergeStats* merge_stats_;
   ScopedTaskId scheduled_task_;
 
+  // Whether the merge is ready to start, waiting for the delay of the merge
+  // policy, and since when.
+  bool waiting_for_merge_delay_{false};
+  base::TimeTicks merge_ready_time_;
+
+  std::shared_ptr<BootCompletedWaiter> boot_completed_waiter_;
+  std::unique_ptr<base::FileDescriptorWatcher::Controller>
+      boot_completed_controller_;
+
+  // The last merge percentage reported by libsnapshot, and the first one
+  // seen with the time it was, to estimate the merge throughput.
+  double merge_percentage_{0};
+  double merge_start_percentage_{-1};
+  base::TimeTicks merge_start_time_;
+
   // Helpers for task management.
   void AcknowledgeTaskExecuted();
   void CheckTaskScheduled(std::string_view name);
@@ -86,12 +114,21 @@ class CleanupPreviousUpdateAction : public Action<CleanupPreviousUpdateAction> {
   void StartActionInternal();
   void ScheduleWaitBootCompleted();
   void WaitBootCompletedOrSchedule();
+  // Starts waiting for the boot to complete without polling, if possible.
+  // Returns whether it did, OnBootCompleted() being called once it is.
+  bool WatchBootCompleted();
+  void OnBootCompleted();
+  void StopWatchingBootCompleted();
   void ScheduleWaitMarkBootSuccessful();
   void CheckSlotMarkedSuccessfulOrSchedule();
   void CheckForMergeDelay();
   void StartMerge();
   void ScheduleWaitForMerge();
   void WaitForMergeOrSchedule();
+  // Returns how long to wait before checking the merge again at |now|: about
+  // half the time left at the throughput seen so far, so that the end of the
+  // merge is noticed soon without waking up often while it goes on.
+  base::TimeDelta GetWaitForMergeInterval(base::TimeTicks now);
   void InitiateMergeAndWait();
   void ReportMergeStats();
 
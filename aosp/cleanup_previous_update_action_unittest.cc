@@ -40,6 +40,7 @@ using testing::Return;
 class MockCleanupPreviousUpdateActionDelegate final
     : public CleanupPreviousUpdateActionDelegateInterface {
   MOCK_METHOD(void, OnCleanupProgressUpdate, (double), (override));
+  MOCK_METHOD(MergePolicy, GetMergePolicy, (), (override));
 };
 
 class MockActionProcessor : public ActionProcessor {
@@ -171,4 +172,56 @@ TEST_F(CleanupPreviousUpdateActionTest, VabSlotNotReady) {
       << "Merge should not be started until slot is marked successful";
 }
 
+TEST_F(CleanupPreviousUpdateActionTest, MergePolicyChangedTest) {
+  // The merge held off while the device is in use starts once it is idle.
+  EXPECT_CALL(mock_snapshot_, EnsureMetadataMounted())
+      .Times(AtLeast(1))
+      .WillRepeatedly(
+          []() { return std::make_unique<MockAutoDevice>("mock_device"); });
+  EXPECT_CALL(dynamic_control_, GetVirtualAbFeatureFlag())
+      .Times(AtLeast(1))
+      .WillRepeatedly(Return(LAUNCH));
+  EXPECT_CALL(boot_control_, IsSlotMarkedSuccessful(_))
+      .WillRepeatedly(Return(true));
+  EXPECT_CALL(mock_delegate_, GetMergePolicy())
+      .WillOnce(Return(MergePolicy::kThrottled))
+      .WillRepeatedly(Return(MergePolicy::kFast));
+  EXPECT_CALL(mock_stats_, Start()).Times(1).WillRepeatedly(Return(true));
+  EXPECT_CALL(mock_snapshot_, ProcessUpdateState(_, _))
+      .Times(AtLeast(1))
+      .WillRepeatedly(Return(UpdateState::MergeCompleted));
+  EXPECT_CALL(mock_processor_, ActionComplete(&action_, ErrorCode::kSuccess))
+      .Times(1);
+  action_.PerformAction();
+  action_.OnMergePolicyChanged();
+  while (loop_.PendingTasks()) {
+    ASSERT_TRUE(loop_.RunOnce(true));
+  }
+}
+
+TEST_F(CleanupPreviousUpdateActionTest, WaitForMergeIntervalTest) {
+  const base::TimeTicks start = base::TimeTicks::Now();
+  // The throughput isn't known at first.
+  action_.merge_percentage_ = 10;
+  EXPECT_EQ(base::TimeDelta::FromSeconds(2),
+            action_.GetWaitForMergeInterval(start));
+
+  // 1% per second, 80 seconds left.
+  action_.merge_percentage_ = 20;
+  EXPECT_EQ(base::TimeDelta::FromSeconds(30),
+            action_.GetWaitForMergeInterval(
+                start + base::TimeDelta::FromSeconds(10)));
+
+  // 2 seconds left.
+  action_.merge_percentage_ = 98;
+  EXPECT_EQ(base::TimeDelta::FromSeconds(1),
+            action_.GetWaitForMergeInterval(
+                start + base::TimeDelta::FromSeconds(88)));
+
+  action_.merge_percentage_ = 99.9;
+  EXPECT_EQ(base::TimeDelta::FromMilliseconds(200),
+            action_.GetWaitForMergeInterval(
+                start + base::TimeDelta::FromSeconds(90)));
+}
+
 }  // namespace chromeos_update_engine
@@ -18,19 +18,25 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include <sys/mman.h>
 #include <sys/stat.h>
 
 #include <base/files/file_path.h>
+#include <base/time/time.h>
 #include <libsnapshot/cow_writer.h>
 #include <gflags/gflags.h>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/operations_section.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_generator/cow_size_estimator.h"
 #include "update_engine/update_metadata.pb.h"
@@ -47,6 +53,10 @@ DEFINE_string(vabc_compression_param,
               "",
               "Compression parameter for VABC. Default is use what's specified "
               "in OTA package");
+DEFINE_int32(threads,
+             1,
+             "Number of partitions converted concurrently, 0 to use one "
+             "thread per CPU");
 
 namespace chromeos_update_engine {
 
@@ -159,10 +169,16 @@ int main(int argc, char* argv[]) {
     LOG(ERROR) << "Failed to parse manifest!";
     return 5;
   }
+  const size_t data_begin = payload_metadata.GetMetadataSize() +
+                            payload_metadata.GetMetadataSignatureSize();
+  if (data_begin > static_cast<uint64_t>(payload_size) ||
+      !chromeos_update_engine::ParseOperationsSections(
+          payload + data_begin, payload_size - data_begin, &manifest)) {
+    LOG(ERROR) << "Failed to parse the operations sections!";
+    return 5;
+  }
 
-  size_t estimated_total_cow_size = 0;
-  size_t actual_total_cow_size = 0;
-
+  std::vector<const chromeos_update_engine::PartitionUpdate*> to_convert;
   for (const auto& partition : manifest.partitions()) {
     if (partition.estimate_cow_size() == 0) {
       continue;
@@ -171,8 +187,54 @@ int main(int argc, char* argv[]) {
         partitions.count(partition.partition_name()) == 0) {
       continue;
     }
-    LOG(INFO) << partition.partition_name();
-    if (!ProcessPartition(manifest, partition, images_dir)) {
+    to_convert.push_back(&partition);
+  }
+
+  // Each partition is written to a COW image of its own, so they are
+  // converted independently. The largest ones go first, to not be left
+  // running alone at the end.
+  std::vector<size_t> order(to_convert.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return to_convert[a]->new_partition_info().size() >
+           to_convert[b]->new_partition_info().size();
+  });
+  size_t num_threads = FLAGS_threads > 0
+                           ? FLAGS_threads
+                           : std::max(std::thread::hardware_concurrency(), 1U);
+  num_threads = std::max<size_t>(std::min(num_threads, to_convert.size()), 1);
+  // Not std::vector<bool>, its elements can't be written concurrently.
+  std::vector<uint8_t> converted(to_convert.size(), false);
+  std::vector<base::TimeDelta> durations(to_convert.size());
+  std::atomic<size_t> next_partition{0};
+  auto convert = [&]() {
+    for (size_t next = next_partition++; next < order.size();
+         next = next_partition++) {
+      const size_t i = order[next];
+      const auto& partition = *to_convert[i];
+      LOG(INFO) << "Converting " << partition.partition_name();
+      const auto start = base::TimeTicks::Now();
+      converted[i] = ProcessPartition(manifest, partition, images_dir);
+      durations[i] = base::TimeTicks::Now() - start;
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+    threads.emplace_back(convert);
+  }
+  convert();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  size_t estimated_total_cow_size = 0;
+  size_t actual_total_cow_size = 0;
+  for (size_t i = 0; i < to_convert.size(); i++) {
+    const auto& partition = *to_convert[i];
+    if (!converted[i]) {
+      LOG(ERROR) << "Failed to convert " << partition.partition_name();
       return 6;
     }
     base::FilePath img_dir{images_dir};
@@ -186,7 +248,8 @@ int main(int argc, char* argv[]) {
               << ", estimated COW size is "
               << (actual_cow_size - partition.estimate_cow_size()) * 100.0f /
                      actual_cow_size
-              << "% smaller";
+              << "% smaller, converted in "
+              << chromeos_update_engine::utils::FormatTimeDelta(durations[i]);
     estimated_total_cow_size += partition.estimate_cow_size();
     actual_total_cow_size += actual_cow_size;
   }
@@ -77,8 +77,10 @@ bool DaemonStateAndroid::Initialize() {
 
 bool DaemonStateAndroid::StartUpdater() {
   // The DaemonState in Android is a passive daemon. It will only start applying
-  // an update when instructed to do so from the exposed binder API.
-  update_attempter_->Init();
+  // an update when instructed to do so from the exposed binder API. What
+  // remains from the previous update waits for the boot to complete, unless a
+  // client asks for it sooner.
+  update_attempter_->InitWhenBootCompleted();
   return true;
 }
 
@@ -17,6 +17,7 @@
 #include "update_engine/aosp/dynamic_partition_control_android.h"
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>  // NOLINT(build/c++11) - using libsnapshot / liblp API
 #include <cstdint>
 #include <map>
@@ -24,6 +25,7 @@
 #include <set>
 #include <string>
 #include <string_view>
+#include <thread>  // NOLINT(build/c++11)
 #include <utility>
 #include <vector>
 
@@ -94,13 +96,18 @@ constexpr char kVirtualAbUserspaceSnapshotsEnabled[] =
 // there is one.
 constexpr char kVirtualAbCompressionRetrofit[] = "";
 constexpr char kPostinstallFstabPrefix[] = "ro.postinstall.fstab.prefix";
+// How dm-verity handles the corrupted blocks of the running slot.
+constexpr char kVerityMode[] = "ro.boot.veritymode";
 // Map timeout for dynamic partitions.
 constexpr std::chrono::milliseconds kMapTimeout{1000};
 // Map timeout for dynamic partitions with snapshots. Since several devices
 // needs to be mapped, this timeout is longer than |kMapTimeout|.
 constexpr std::chrono::milliseconds kMapSnapshotTimeout{10000};
+// The most partitions mapped at once by MapPartitionsForSlot().
+constexpr size_t kMaxParallelMappings = 8;
 
 DynamicPartitionControlAndroid::~DynamicPartitionControlAndroid() {
+  prewarmed_metadata_ = {};
   UnmapAllPartitions();
   metadata_device_.reset();
 }
@@ -172,13 +179,21 @@ bool DynamicPartitionControlAndroid::OptimizeOperation(
     const InstallOperation& operation,
     InstallOperation* optimized) {
   switch (operation.type()) {
-    case InstallOperation::SOURCE_COPY:
-      return target_supports_snapshot_ &&
-             GetVirtualAbFeatureFlag().IsEnabled() &&
-             mapped_devices_.count(partition_name +
-                                   SlotSuffixForSlotNumber(target_slot_)) > 0 &&
-             OptimizeSourceCopyOperation(operation, optimized);
-      break;
+    case InstallOperation::SOURCE_COPY: {
+      if (!target_supports_snapshot_ ||
+          !GetVirtualAbFeatureFlag().IsEnabled()) {
+        return false;
+      }
+      {
+        std::lock_guard<std::mutex> lock(mapped_devices_mutex_);
+        if (mapped_devices_.count(partition_name +
+                                  SlotSuffixForSlotNumber(target_slot_)) ==
+            0) {
+          return false;
+        }
+      }
+      return OptimizeSourceCopyOperation(operation, optimized);
+    }
     default:
       break;
   }
@@ -220,6 +235,7 @@ bool DynamicPartitionControlAndroid::MapPartitionInternal(
   LOG(INFO) << "Succesfully mapped " << target_partition_name
             << " to device mapper (force_writable = " << force_writable
             << "); device path at " << *path;
+  std::lock_guard<std::mutex> lock(mapped_devices_mutex_);
   mapped_devices_.insert(target_partition_name);
   return true;
 }
@@ -232,7 +248,12 @@ bool DynamicPartitionControlAndroid::MapPartitionOnDeviceMapper(
     std::string* path) {
   DmDeviceState state = GetState(target_partition_name);
   if (state == DmDeviceState::ACTIVE) {
-    if (mapped_devices_.find(target_partition_name) != mapped_devices_.end()) {
+    bool mapped = false;
+    {
+      std::lock_guard<std::mutex> lock(mapped_devices_mutex_);
+      mapped = mapped_devices_.count(target_partition_name) > 0;
+    }
+    if (mapped) {
       if (GetDmDevicePathByName(target_partition_name, path)) {
         LOG(INFO) << target_partition_name
                   << " is mapped on device mapper: " << *path;
@@ -296,18 +317,24 @@ bool DynamicPartitionControlAndroid::UnmapPartitionOnDeviceMapper(
     LOG(INFO) << "Successfully unmapped " << target_partition_name
               << " from device mapper.";
   }
+  std::lock_guard<std::mutex> lock(mapped_devices_mutex_);
   mapped_devices_.erase(target_partition_name);
   return true;
 }
 
 bool DynamicPartitionControlAndroid::UnmapAllPartitions() {
   snapshot_->UnmapAllSnapshots();
-  if (mapped_devices_.empty()) {
-    return false;
-  }
+  all_partitions_mapped_ = false;
   // UnmapPartitionOnDeviceMapper removes objects from mapped_devices_, hence
   // a copy is needed for the loop.
-  std::set<std::string> mapped = mapped_devices_;
+  std::set<std::string> mapped;
+  {
+    std::lock_guard<std::mutex> lock(mapped_devices_mutex_);
+    mapped = mapped_devices_;
+  }
+  if (mapped.empty()) {
+    return false;
+  }
   LOG(INFO) << "Destroying [" << Join(mapped, ", ") << "] from device mapper";
   for (const auto& partition_name : mapped) {
     ignore_result(UnmapPartitionOnDeviceMapper(partition_name));
@@ -316,6 +343,8 @@ bool DynamicPartitionControlAndroid::UnmapAllPartitions() {
 }
 
 void DynamicPartitionControlAndroid::Cleanup() {
+  // Waits for the metadata still being loaded, if any.
+  prewarmed_metadata_ = {};
   UnmapAllPartitions();
   metadata_device_.reset();
   if (GetVirtualAbFeatureFlag().IsEnabled()) {
@@ -963,7 +992,10 @@ bool DynamicPartitionControlAndroid::PrepareSnapshotPartitionsForUpdate(
   base::FilePath device_dir(device_dir_str);
   auto super_device =
       device_dir.Append(GetSuperPartitionName(source_slot)).value();
-  auto builder = LoadMetadataBuilder(super_device, source_slot);
+  auto builder = TakePrewarmedMetadata(super_device, source_slot);
+  if (builder == nullptr) {
+    builder = LoadMetadataBuilder(super_device, source_slot);
+  }
   if (builder == nullptr) {
     LOG(ERROR) << "No metadata at "
                << BootControlInterface::SlotName(source_slot);
@@ -1255,6 +1287,7 @@ DynamicPartitionControlAndroid::GetDynamicPartitionDevice(
 
 void DynamicPartitionControlAndroid::set_fake_mapped_devices(
     const std::set<std::string>& fake) {
+  std::lock_guard<std::mutex> lock(mapped_devices_mutex_);
   mapped_devices_ = fake;
 }
 
@@ -1419,6 +1452,73 @@ bool DynamicPartitionControlAndroid::ExpectMetadataMounted() {
   return metadata_device_ != nullptr;
 }
 
+void DynamicPartitionControlAndroid::PrewarmForUpdate(uint32_t source_slot,
+                                                      uint32_t target_slot) {
+  // Only snapshot updates load the metadata of the source slot as is.
+  if (!GetDynamicPartitionsFeatureFlag().IsEnabled() ||
+      !GetVirtualAbFeatureFlag().IsEnabled() || source_slot == target_slot) {
+    return;
+  }
+  std::string device_dir_str;
+  if (!GetDeviceDir(&device_dir_str)) {
+    return;
+  }
+  // Waits for the metadata loaded by a previous call, if any.
+  prewarmed_metadata_ = {};
+  prewarmed_super_device_ = base::FilePath(device_dir_str)
+                                .Append(GetSuperPartitionName(source_slot))
+                                .value();
+  prewarmed_slot_ = source_slot;
+  LOG(INFO) << "Loading the metadata of slot "
+            << BootControlInterface::SlotName(source_slot)
+            << " ahead of preparing the partitions.";
+  prewarmed_metadata_ =
+      std::async(std::launch::async,
+                 [this, super_device = prewarmed_super_device_, source_slot]() {
+                   return LoadMetadataBuilder(super_device, source_slot);
+                 });
+}
+
+bool DynamicPartitionControlAndroid::GetVerityDevicePath(
+    const std::string& partition_name, std::string* path) {
+  // With "logging" or "disabled", the reads of corrupted blocks succeed.
+  // Those fail with "eio", and restart the device with "enforcing", which
+  // boots in "eio" mode afterwards.
+  const std::string verity_mode = GetProperty(kVerityMode, "");
+  if (verity_mode != "enforcing" && verity_mode != "eio") {
+    return false;
+  }
+  // The names fs_mgr gives the verity devices from the mount points, the one
+  // of the root filesystem being "vroot-verity".
+  std::vector<std::string> names = {partition_name + "-verity"};
+  if (partition_name == "system") {
+    names.push_back("vroot-verity");
+  }
+  for (const auto& name : names) {
+    if (GetState(name) == DmDeviceState::ACTIVE &&
+        GetDmDevicePathByName(name, path)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+std::unique_ptr<MetadataBuilder>
+DynamicPartitionControlAndroid::TakePrewarmedMetadata(
+    const std::string& super_device, uint32_t slot) {
+  if (!prewarmed_metadata_.valid()) {
+    return nullptr;
+  }
+  auto builder = prewarmed_metadata_.get();
+  if (super_device != prewarmed_super_device_ || slot != prewarmed_slot_) {
+    LOG(INFO) << "Discarding the metadata of slot "
+              << BootControlInterface::SlotName(prewarmed_slot_) << " in "
+              << prewarmed_super_device_ << " loaded ahead.";
+    return nullptr;
+  }
+  return builder;
+}
+
 bool DynamicPartitionControlAndroid::EnsureMetadataMounted() {
   // No need to mount metadata for non-Virtual A/B devices.
   if (!GetVirtualAbFeatureFlag().IsEnabled()) {
@@ -1448,6 +1548,9 @@ DynamicPartitionControlAndroid::OpenCowWriter(
       .partition_name = partition_name + suffix,
       .force_writable = true,
       .timeout_ms = kMapSnapshotTimeout};
+  // snapuserd doesn't see the data written after the snapshots were mapped,
+  // so the next MapAllPartitions() maps them again.
+  all_partitions_mapped_ = false;
   // TODO(zhangkelvin) Open an APPEND mode CowWriter once there's an API to do
   // it.
   return snapshot_->OpenSnapshotWriter(params, label);
@@ -1484,7 +1587,81 @@ std::optional<base::FilePath> DynamicPartitionControlAndroid::GetSuperDevice() {
 }
 
 bool DynamicPartitionControlAndroid::MapAllPartitions() {
-  return snapshot_->MapAllSnapshots(kMapSnapshotTimeout);
+  if (all_partitions_mapped_) {
+    LOG(INFO) << "All partitions are already mapped.";
+    return true;
+  }
+  all_partitions_mapped_ = snapshot_->MapAllSnapshots(kMapSnapshotTimeout);
+  return all_partitions_mapped_;
+}
+
+bool DynamicPartitionControlAndroid::MapPartitionsForSlot(
+    const std::vector<std::string>& partition_names,
+    uint32_t slot,
+    uint32_t current_slot) {
+  // Only the target partitions are mapped when looked up, except with VABC
+  // where they are read through snapuserd, mapped by MapAllPartitions().
+  if (!GetDynamicPartitionsFeatureFlag().IsEnabled() || slot == current_slot ||
+      !is_target_dynamic_ || UpdateUsesSnapshotCompression()) {
+    return true;
+  }
+  std::string device_dir_str;
+  TEST_AND_RETURN_FALSE(GetDeviceDir(&device_dir_str));
+  const std::string super_device = base::FilePath(device_dir_str)
+                                       .Append(GetSuperPartitionName(slot))
+                                       .value();
+  auto builder = LoadMetadataBuilder(super_device, slot);
+  if (builder == nullptr) {
+    LOG(ERROR) << "No metadata in slot "
+               << BootControlInterface::SlotName(slot);
+    return false;
+  }
+
+  std::vector<std::string> to_map;
+  for (const auto& partition_name : partition_names) {
+    const auto partition_name_suffix =
+        partition_name + SlotSuffixForSlotNumber(slot);
+    // Static partitions aren't mapped, and the devices left mapped from
+    // before the update are unmapped first when looked up.
+    if (builder->FindPartition(partition_name_suffix) == nullptr ||
+        GetState(partition_name_suffix) != DmDeviceState::INVALID) {
+      continue;
+    }
+    to_map.push_back(partition_name_suffix);
+  }
+  if (to_map.empty()) {
+    return true;
+  }
+
+  // Most of the time of a mapping is spent waiting for the device node to
+  // show up, so the dm-linear devices are mapped in parallel. Snapshots are
+  // mapped one at a time under a lock of libsnapshot anyway.
+  const bool use_snapshot =
+      GetVirtualAbFeatureFlag().IsEnabled() && target_supports_snapshot_ &&
+      ExpectMetadataMounted();
+  const size_t num_threads =
+      use_snapshot ? 1 : std::min(to_map.size(), kMaxParallelMappings);
+  LOG(INFO) << "Mapping [" << Join(to_map, ", ") << "] with " << num_threads
+            << " threads";
+  std::atomic<size_t> next{0};
+  std::atomic<bool> success{true};
+  auto map_partitions = [&]() {
+    for (size_t i = next++; i < to_map.size(); i = next++) {
+      std::string path;
+      if (!MapPartitionOnDeviceMapper(
+              super_device, to_map[i], slot, true /* force_writable */, &path))
+        success = false;
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < num_threads; i++) {
+    threads.emplace_back(map_partitions);
+  }
+  map_partitions();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return success;
 }
 
 bool DynamicPartitionControlAndroid::IsDynamicPartition(
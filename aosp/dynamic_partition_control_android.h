@@ -18,7 +18,9 @@
 #define UPDATE_ENGINE_AOSP_DYNAMIC_PARTITION_CONTROL_ANDROID_H_
 
 #include <array>
+#include <future>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 #include <string_view>
@@ -114,6 +116,12 @@ class DynamicPartitionControlAndroid : public DynamicPartitionControlInterface {
 
   bool MapAllPartitions() override;
   bool UnmapAllPartitions() override;
+  bool MapPartitionsForSlot(const std::vector<std::string>& partition_names,
+                            uint32_t slot,
+                            uint32_t current_slot) override;
+  void PrewarmForUpdate(uint32_t source_slot, uint32_t target_slot) override;
+  bool GetVerityDevicePath(const std::string& partition_name,
+                           std::string* path) override;
 
   bool IsDynamicPartition(const std::string& part_name, uint32_t slot) override;
 
@@ -338,7 +346,17 @@ class DynamicPartitionControlAndroid : public DynamicPartitionControlInterface {
   // target_supports_snapshot_ and is_target_dynamic_.
   bool SetTargetBuildVars(const DeltaArchiveManifest& manifest);
 
+  // Returns the metadata of |super_device| at slot |slot| loaded by
+  // PrewarmForUpdate(), or nullptr if it loaded none or another one.
+  std::unique_ptr<android::fs_mgr::MetadataBuilder> TakePrewarmedMetadata(
+      const std::string& super_device, uint32_t slot);
+
+  // |mapped_devices_| is also updated by the threads of
+  // MapPartitionsForSlot().
+  std::mutex mapped_devices_mutex_;
   std::set<std::string> mapped_devices_;
+  // Whether MapAllPartitions() mapped the snapshots, which are still mapped.
+  bool all_partitions_mapped_ = false;
   const FeatureFlag dynamic_partitions_;
   const FeatureFlag virtual_ab_;
   const FeatureFlag virtual_ab_compression_;
@@ -357,6 +375,13 @@ class DynamicPartitionControlAndroid : public DynamicPartitionControlInterface {
   // to change in the future. And certaintly won't change at runtime.
   std::array<std::vector<std::string>, 2> dynamic_partition_list_{};
 
+  // The metadata of the source slot being loaded by PrewarmForUpdate() on a
+  // thread of its own, and where it is loaded from.
+  std::future<std::unique_ptr<android::fs_mgr::MetadataBuilder>>
+      prewarmed_metadata_;
+  std::string prewarmed_super_device_;
+  uint32_t prewarmed_slot_ = UINT32_MAX;
+
   DISALLOW_COPY_AND_ASSIGN(DynamicPartitionControlAndroid);
 };
 
@@ -546,6 +546,57 @@ TEST_P(DynamicPartitionControlAndroidTestP,
   EXPECT_EQ(GetDevice(T("bar")), bar_device);
 }
 
+TEST_P(DynamicPartitionControlAndroidTestP, MapPartitionsForSlot) {
+  SetMetadata(source(),
+              {{S("system"), 2_GiB},
+               {S("vendor"), 1_GiB},
+               {S("product"), 1_GiB},
+               {T("system"), 2_GiB},
+               {T("vendor"), 1_GiB},
+               {T("product"), 1_GiB}});
+  SetMetadata(target(),
+              {{S("system"), 2_GiB},
+               {S("vendor"), 1_GiB},
+               {S("product"), 1_GiB},
+               {T("system"), 2_GiB},
+               {T("vendor"), 1_GiB},
+               {T("product"), 1_GiB}});
+  EXPECT_TRUE(dynamicControl().PreparePartitionsForUpdate(
+      source(),
+      target(),
+      PartitionSizesToManifest(
+          {{"system", 2_GiB}, {"vendor", 1_GiB}, {"product", 1_GiB}}),
+      false,
+      nullptr,
+      nullptr));
+
+  // The source partitions are never mapped.
+  EXPECT_CALL(dynamicControl(),
+              MapPartitionOnDeviceMapper(_, _, source(), _, _))
+      .Times(0);
+  EXPECT_TRUE(dynamicControl().MapPartitionsForSlot(
+      {"system", "vendor"}, source(), source()));
+
+  EXPECT_CALL(dynamicControl(), GetState(AnyOf(T("system"), T("vendor"))))
+      .WillRepeatedly(Return(DmDeviceState::INVALID));
+  // Left mapped from before the update, unmapped once looked up.
+  EXPECT_CALL(dynamicControl(), GetState(T("product")))
+      .WillRepeatedly(Return(DmDeviceState::ACTIVE));
+  for (const auto& name : {T("system"), T("vendor")}) {
+    EXPECT_CALL(dynamicControl(),
+                MapPartitionOnDeviceMapper(
+                    GetSuperDevice(target()), name, target(), true, _))
+        .WillOnce(Return(true));
+  }
+  EXPECT_CALL(dynamicControl(),
+              MapPartitionOnDeviceMapper(_, T("product"), _, _, _))
+      .Times(0);
+  // Static partition "bar" isn't mapped either.
+  EXPECT_CALL(dynamicControl(), GetState(T("bar"))).Times(0);
+  EXPECT_TRUE(dynamicControl().MapPartitionsForSlot(
+      {"system", "vendor", "product", "bar"}, target(), source()));
+}
+
 INSTANTIATE_TEST_CASE_P(DynamicPartitionControlAndroidTest,
                         DynamicPartitionControlAndroidTestP,
                         testing::Values(TestParam{0, 1}, TestParam{1, 0}));
@@ -1064,6 +1115,21 @@ TEST_P(SnapshotPartitionTestP, PreparePartitions) {
   EXPECT_EQ(0u, required_size);
 }
 
+// Test that the metadata loaded by PrewarmForUpdate() is used to prepare the
+// partitions, instead of being loaded again.
+TEST_P(SnapshotPartitionTestP, PreparePartitionsPrewarmed) {
+  ExpectCreateUpdateSnapshots(android::snapshot::Return::Ok());
+  EXPECT_CALL(dynamicControl(),
+              LoadMetadataBuilder(GetSuperDevice(source()), source()))
+      .WillOnce(Invoke([](auto, auto) {
+        return NewFakeMetadata(PartitionSuffixSizesToManifest({}));
+      }));
+  dynamicControl().PrewarmForUpdate(source(), target());
+  uint64_t required_size = 0;
+  EXPECT_TRUE(PreparePartitionsForUpdate(&required_size));
+  EXPECT_EQ(0u, required_size);
+}
+
 // Test that if not enough space, required size returned by SnapshotManager is
 // passed up.
 TEST_P(SnapshotPartitionTestP, PreparePartitionsNoSpace) {
@@ -17,7 +17,9 @@
 #include "update_engine/aosp/hardware_android.h"
 
 #include <sys/types.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <string_view>
@@ -44,6 +46,7 @@
 using android::base::GetBoolProperty;
 using android::base::GetIntProperty;
 using android::base::GetProperty;
+using android::base::GetUintProperty;
 using std::string;
 
 namespace chromeos_update_engine {
@@ -58,6 +61,29 @@ const char kPropBootHardwareSKU[] = "ro.boot.hardware.sku";
 const char kPropBootRevision[] = "ro.boot.revision";
 const char kPropBuildDateUTC[] = "ro.build.date.utc";
 
+// Overrides the puffpatch cache budget, in MiB.
+const char kPropPuffpatchCacheSizeMb[] = "ro.update_engine.puffpatch_cache_mb";
+
+// Without the property, puffpatch may cache up to this fraction of the RAM,
+// within these bounds. The lower bound is the budget it had before, the upper
+// one keeps the update from pushing apps out of memory.
+constexpr uint64_t kPuffpatchCacheRamFraction = 256;
+constexpr uint64_t kMinPuffpatchCacheBudget = 5 * 1024 * 1024;
+constexpr uint64_t kMaxPuffpatchCacheBudget = 256 * 1024 * 1024;
+
+// The CPUs background updates download, apply, verify and merge on, in the
+// format of the cpuset files, such as the little cores of the device.
+const char kPropBackgroundCpus[] = "ro.update_engine.background_cpus";
+
+// Limits the rate background updates download the payload at, in KiB/s.
+const char kPropMaxDownloadRateKb[] = "ro.update_engine.max_download_rate_kb";
+
+// The I/O priority level of the best effort class the phases run at. Hashing
+// the partitions reads them as fast as the storage allows, so it runs below
+// the rest of the update.
+constexpr int kDownloadIoLevel = 6;
+constexpr int kBackgroundIoLevel = 7;
+
 string GetPartitionBuildDate(const string& partition_name) {
   return android::base::GetProperty("ro." + partition_name + ".build.date.utc",
                                     "");
@@ -372,4 +398,52 @@ const char* HardwareAndroid::GetPartitionMountOptions(
   }
 }
 
+size_t HardwareAndroid::GetPuffpatchCacheBudget() const {
+  const int64_t size_mb = GetIntProperty<int64_t>(kPropPuffpatchCacheSizeMb, 0);
+  if (size_mb > 0) {
+    return size_mb * 1024 * 1024;
+  }
+  const long pages = sysconf(_SC_PHYS_PAGES);
+  const long page_size = sysconf(_SC_PAGESIZE);
+  if (pages <= 0 || page_size <= 0) {
+    return kMinPuffpatchCacheBudget;
+  }
+  const uint64_t ram_size = static_cast<uint64_t>(pages) * page_size;
+  return std::clamp(ram_size / kPuffpatchCacheRamFraction,
+                    kMinPuffpatchCacheBudget,
+                    kMaxPuffpatchCacheBudget);
+}
+
+ResourcePolicy HardwareAndroid::GetResourcePolicy(UpdatePhase phase) const {
+  ResourcePolicy policy;
+  // There are no foreground apps to leave the device to in recovery.
+  if constexpr (constants::kIsRecovery) {
+    return policy;
+  }
+  switch (phase) {
+    case UpdatePhase::kIdle:
+      return policy;
+    case UpdatePhase::kDownload:
+      policy.io_class = IoPriorityClass::kBestEffort;
+      policy.io_level = kDownloadIoLevel;
+      policy.max_download_rate =
+          GetUintProperty<uint64_t>(kPropMaxDownloadRateKb, 0) * 1024;
+      break;
+    case UpdatePhase::kVerify:
+    case UpdatePhase::kMerge:
+    case UpdatePhase::kSourceIndex:
+      policy.io_class = IoPriorityClass::kBestEffort;
+      policy.io_level = kBackgroundIoLevel;
+      break;
+    case UpdatePhase::kPostinstall:
+      // The postinstall programs, such as dexopt, set their own priorities.
+      return policy;
+  }
+  const string cpus = GetProperty(kPropBackgroundCpus, "");
+  if (!cpus.empty() && !utils::ParseCpuList(cpus, &policy.cpus)) {
+    LOG(WARNING) << "Ignoring invalid " << kPropBackgroundCpus << "=" << cpus;
+  }
+  return policy;
+}
+
 }  // namespace chromeos_update_engine
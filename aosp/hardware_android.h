@@ -66,6 +66,8 @@ class HardwareAndroid : public HardwareInterface {
       const std::string& new_version) const override;
   [[nodiscard]] const char* GetPartitionMountOptions(
       const std::string& partition_name) const override;
+  size_t GetPuffpatchCacheBudget() const override;
+  ResourcePolicy GetResourcePolicy(UpdatePhase phase) const override;
 
  private:
   DISALLOW_COPY_AND_ASSIGN(HardwareAndroid);
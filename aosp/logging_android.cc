@@ -20,11 +20,17 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <functional>
 #include <iomanip>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
 #include <vector>
 
 #include <android-base/file.h>
@@ -53,6 +59,12 @@ namespace {
 constexpr char kSystemLogsRoot[] = "/data/misc/update_engine_log";
 constexpr size_t kLogCount = 5;
 
+// The most bytes of log messages held before they are written to the log
+// file, the amount woken up for and the longest they are held.
+constexpr size_t kMaxPendingLogBytes = 1024 * 1024;
+constexpr size_t kLogFlushThresholdBytes = 64 * 1024;
+constexpr std::chrono::seconds kLogFlushInterval(1);
+
 // Keep the most recent |kLogCount| logs but remove the old ones in
 // "/data/misc/update_engine_log/".
 void DeleteOldLogs(const string& kLogsRoot) {
@@ -119,14 +131,107 @@ const char* LogPriorityToCString(int priority) {
 
 using LoggerFunction = std::function<void(const struct __android_log_message*)>;
 
+// Writes the messages logged to a log file from a thread of its own, so that
+// the threads logging don't wait for the disk. The messages are held in a
+// buffer until then, up to |kMaxPendingLogBytes|. The messages not fitting
+// are dropped, and the number of bytes dropped logged instead. A fatal
+// message is written right away along with the ones held, as the process
+// aborts right after.
+class LogFileWriter {
+ public:
+  explicit LogFileWriter(android::base::unique_fd fd)
+      : fd_(std::move(fd)), thread_(&LogFileWriter::FlushLoop, this) {}
+
+  // Writes the messages still held.
+  ~LogFileWriter() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+  }
+
+  void Write(string message, bool fatal) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (fatal) {
+      // Taking |write_mutex_| while holding |mutex_| waits for the messages
+      // being written by the thread, which came before.
+      pending_ += message;
+      string data = TakePending();
+      std::lock_guard<std::mutex> write_lock(write_mutex_);
+      WriteToFd(data);
+      return;
+    }
+    if (message.size() > kMaxPendingLogBytes - pending_.size()) {
+      dropped_bytes_ += message.size();
+      return;
+    }
+    pending_ += message;
+    if (pending_.size() >= kLogFlushThresholdBytes)
+      cond_.notify_one();
+  }
+
+ private:
+  void FlushLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_ || !pending_.empty() || dropped_bytes_ > 0) {
+      cond_.wait_for(lock, kLogFlushInterval, [this] {
+        return stopping_ || pending_.size() >= kLogFlushThresholdBytes;
+      });
+      if (pending_.empty() && dropped_bytes_ == 0)
+        continue;
+      string data = TakePending();
+      std::unique_lock<std::mutex> write_lock(write_mutex_);
+      lock.unlock();
+      WriteToFd(data);
+      write_lock.unlock();
+      lock.lock();
+    }
+  }
+
+  // Returns the messages held, followed by the number of bytes dropped if
+  // any. Must be called with |mutex_| held.
+  string TakePending() {
+    string data;
+    data.swap(pending_);
+    if (dropped_bytes_ > 0) {
+      data += base::StringPrintf("[%zu bytes of log messages dropped]\n",
+                                 dropped_bytes_);
+      dropped_bytes_ = 0;
+    }
+    return data;
+  }
+
+  // Can't log, as the messages would come back to this writer.
+  void WriteToFd(std::string_view data) {
+    ignore_result(android::base::WriteFully(fd_, data.data(), data.size()));
+    fsync(fd_);
+  }
+
+  android::base::unique_fd fd_;
+
+  // Protects the members below.
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  string pending_;
+  size_t dropped_bytes_{0};
+  bool stopping_{false};
+
+  // Held while writing to |fd_|, taken while holding |mutex_|.
+  std::mutex write_mutex_;
+
+  std::thread thread_;
+};
+
 class FileLogger {
  public:
   explicit FileLogger(const string& path) {
-    fd_.reset(TEMP_FAILURE_RETRY(
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(
         open(path.c_str(),
              O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW,
              0644)));
-    if (fd_ == -1) {
+    if (fd == -1) {
       // Use ALOGE that logs to logd before __android_log_set_logger.
       ALOGE("Cannot open persistent log %s: %s", path.c_str(), strerror(errno));
       return;
@@ -134,36 +239,33 @@ class FileLogger {
     // The log file will have AID_LOG as group ID; this GID is inherited from
     // the parent directory "/data/misc/update_engine_log" which sets the SGID
     // bit.
-    if (fchmod(fd_.get(), 0640) == -1) {
+    if (fchmod(fd.get(), 0640) == -1) {
       // Use ALOGE that logs to logd before __android_log_set_logger.
       ALOGE("Cannot chmod 0640 persistent log %s: %s",
             path.c_str(),
             strerror(errno));
       return;
     }
+    writer_ = std::make_shared<LogFileWriter>(std::move(fd));
   }
-  // Copy-constructor needed to be converted to std::function.
-  FileLogger(const FileLogger& other) { fd_.reset(dup(other.fd_)); }
   void operator()(const struct __android_log_message* log_message) {
-    if (fd_ == -1) {
+    if (!writer_) {
       return;
     }
 
     std::string_view message_str =
         log_message->message != nullptr ? log_message->message : "";
 
-    WriteToFd(GetPrefix(log_message));
-    WriteToFd(message_str);
-    WriteToFd("\n");
-    fsync(fd_);
+    string line = GetPrefix(log_message);
+    line.append(message_str.data(), message_str.size());
+    line += "\n";
+    writer_->Write(std::move(line),
+                   log_message->priority == ANDROID_LOG_FATAL);
   }
 
  private:
-  android::base::unique_fd fd_;
-  void WriteToFd(std::string_view message) {
-    ignore_result(
-        android::base::WriteFully(fd_, message.data(), message.size()));
-  }
+  // Shared by the copies made converting to std::function.
+  std::shared_ptr<LogFileWriter> writer_;
 
   string GetPrefix(const struct __android_log_message* log_message) {
     std::stringstream ss;
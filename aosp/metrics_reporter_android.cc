@@ -67,6 +67,14 @@ bool IsFECEnabled(const chromeos_update_engine::InstallPlan* install_plan) {
       [](const auto& partition) { return partition.fec_size > 0; });
 }
 
+// Returns the throughput in KiB/s of |bytes| over |duration|, or 0 if the
+// phase didn't run.
+int64_t GetThroughputKBps(int64_t bytes, base::TimeDelta duration) {
+  if (duration.InMilliseconds() <= 0)
+    return 0;
+  return bytes * 1000 / 1024 / duration.InMilliseconds();
+}
+
 }  // namespace
 
 namespace chromeos_update_engine {
@@ -196,4 +204,32 @@ void MetricsReporterAndroid::ReportAbnormallyTerminatedUpdateAttemptMetrics() {
   LOG(INFO) << "Abnormally terminated update attempt result " << attempt_result;
 }
 
+void MetricsReporterAndroid::ReportInstallOperationStats(
+    const OperationStats& stats) {
+  // There is no statsd atom for these yet.
+  LOG(INFO) << "Install operation times:\n" << stats.ToString();
+}
+
+void MetricsReporterAndroid::ReportUpdatePhaseMetrics(
+    const metrics::UpdatePhaseMetrics& phase_metrics) {
+  // There is no statsd atom for these yet.
+  LOG(INFO) << "Update phases: download "
+            << phase_metrics.download_bytes / kNumBytesInOneMiB << " MiB in "
+            << phase_metrics.download_duration.InSeconds() << "s ("
+            << GetThroughputKBps(phase_metrics.download_bytes,
+                                 phase_metrics.download_duration)
+            << " KiB/s), apply "
+            << phase_metrics.apply_bytes / kNumBytesInOneMiB << " MiB in "
+            << phase_metrics.apply_duration.InSeconds() << "s ("
+            << GetThroughputKBps(phase_metrics.apply_bytes,
+                                 phase_metrics.apply_duration)
+            << " KiB/s), verify "
+            << phase_metrics.verify_bytes / kNumBytesInOneMiB << " MiB in "
+            << phase_metrics.verify_duration.InSeconds() << "s ("
+            << GetThroughputKBps(phase_metrics.verify_bytes,
+                                 phase_metrics.verify_duration)
+            << " KiB/s), postinstall "
+            << phase_metrics.postinstall_duration.InSeconds() << "s";
+}
+
 };  // namespace chromeos_update_engine
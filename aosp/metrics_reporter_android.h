@@ -95,6 +95,11 @@ class MetricsReporterAndroid : public MetricsReporterInterface {
   void ReportEnterpriseUpdateSeenToDownloadDays(
       bool has_time_restriction_policy, int time_to_update_days) override {}
 
+  void ReportInstallOperationStats(const OperationStats& stats) override;
+
+  void ReportUpdatePhaseMetrics(
+      const metrics::UpdatePhaseMetrics& phase_metrics) override;
+
  private:
   DynamicPartitionControlInterface* dynamic_partition_control_{};
   const InstallPlan* install_plan_{};
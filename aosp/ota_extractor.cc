@@ -14,11 +14,15 @@
 // limitations under the License.
 //
 
-#include <array>
+#include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
 #include <iterator>
+#include <map>
 #include <memory>
+#include <thread>
+#include <vector>
 
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -31,15 +35,23 @@
 #include <xz.h>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/common/error_code_utils.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
+#include "update_engine/payload_consumer/operations_section.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_consumer/verity_writer_android.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/update_metadata.pb.h"
 
-DEFINE_string(payload, "", "Path to payload.bin");
+DEFINE_string(payload,
+              "",
+              "Path to payload.bin, or - to stream it from the standard input, "
+              "e.g. piped from a download. The images are written as the "
+              "payload is read.");
 DEFINE_string(
     input_dir,
     "",
@@ -53,6 +65,11 @@ DEFINE_string(partitions,
               "",
               "Comma separated list of partitions to extract, leave empty for "
               "extracting all partitions");
+DEFINE_int32(threads,
+             1,
+             "Number of threads to extract the partitions on. The partitions, "
+             "and the operations of each partition, are extracted in "
+             "parallel. 0 for one per CPU.");
 
 using chromeos_update_engine::DeltaArchiveManifest;
 using chromeos_update_engine::PayloadMetadata;
@@ -62,8 +79,9 @@ namespace chromeos_update_engine {
 void WriteVerity(const PartitionUpdate& partition,
                  FileDescriptorPtr fd,
                  const size_t block_size) {
-  // 512KB buffer, arbitrary value. Larger buffers may improve performance.
-  static constexpr size_t BUFFER_SIZE = 1024 * 512;
+  // 2MB buffer, large enough for the hash tree blocks of each read to be
+  // hashed on several threads.
+  static constexpr size_t BUFFER_SIZE = 1024 * 1024 * 2;
   if (partition.hash_tree_extent().num_blocks() == 0 &&
       partition.fec_extent().num_blocks() == 0) {
     return;
@@ -73,7 +91,7 @@ void WriteVerity(const PartitionUpdate& partition,
   CHECK(install_part.ParseVerityConfig(partition));
   VerityWriterAndroid writer;
   CHECK(writer.Init(install_part));
-  std::array<uint8_t, BUFFER_SIZE> buffer;
+  std::vector<uint8_t> buffer(BUFFER_SIZE);
   const auto data_size =
       install_part.hash_tree_data_offset + install_part.hash_tree_data_size;
   size_t offset = 0;
@@ -93,22 +111,198 @@ void WriteVerity(const PartitionUpdate& partition,
   return;
 }
 
-bool ExtractImagesFromOTA(const DeltaArchiveManifest& manifest,
-                          const PayloadMetadata& metadata,
-                          int payload_fd,
-                          size_t payload_offset,
-                          std::string_view input_dir,
-                          std::string_view output_dir,
-                          const std::set<std::string>& partitions) {
-  InstallOperationExecutor executor(manifest.block_size());
-  const size_t data_begin = metadata.GetMetadataSize() +
-                            metadata.GetMetadataSignatureSize() +
-                            payload_offset;
+// A payload read in order, from a pipe such as the standard input.
+class PayloadStream {
+ public:
+  static constexpr size_t kStreamBufferSize = 1024 * 1024;
+
+  explicit PayloadStream(int fd);
+
+  // Appends the next |count| bytes of the payload to |out|.
+  bool Read(size_t count, brillo::Blob* out);
+
+  // Skips the next |count| bytes of the payload.
+  bool Skip(uint64_t count);
+
+  // The offset of the next byte to read.
+  uint64_t offset() const { return offset_; }
+
+ private:
+  int fd_;
+  uint64_t offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadStream);
+};
+
+namespace {
+
+// The work of a partition, shared by the threads running its operations.
+struct PartitionJob {
+  const PartitionUpdate* partition;
+  std::string output_path;
+  // Empty for a full partition update.
+  std::string input_path;
+  // The number of work items of the partition not done yet. The thread doing
+  // the last one finishes the partition.
+  std::atomic<size_t> items_left{0};
+};
+
+// A range of operations of a partition, run one after the other.
+struct WorkItem {
+  PartitionJob* job;
+  int first_op;
+  int num_ops;
+};
+
+// The state of a thread of the extraction: its files of every partition, as
+// the file descriptors have a file offset of their own while they are read.
+class ExtractionWorker {
+ public:
+  explicit ExtractionWorker(const DeltaArchiveManifest& manifest)
+      : manifest_(manifest),
+        hash_algorithm_(GetDataHashAlgorithm(manifest)),
+        executor_(manifest.block_size()) {}
+
+  // Runs the operations of |item|, whose data is in |data|, the data blobs of
+  // the payload.
+  bool Run(const WorkItem& item, const uint8_t* data, size_t data_size) {
+    for (int i = item.first_op; i < item.first_op + item.num_ops; i++) {
+      const InstallOperation& op = item.job->partition->operations(i);
+      // The data is read straight from the mapped payload.
+      TEST_AND_RETURN_FALSE(op.data_offset() <= data_size &&
+                            op.data_length() <= data_size - op.data_offset());
+      TEST_AND_RETURN_FALSE(
+          RunOperation(item.job, op, data + op.data_offset()));
+    }
+    return true;
+  }
+
+  // Runs |op| of the partition of |job|, whose data is |op_data|.
+  bool RunOperation(const PartitionJob* job,
+                    const InstallOperation& op,
+                    const uint8_t* op_data) {
+    auto& fds = fds_[job];
+    if (!fds.out_fd) {
+      fds.out_fd = std::make_shared<EintrSafeFileDescriptor>();
+      TEST_AND_RETURN_FALSE_ERRNO(
+          fds.out_fd->Open(job->output_path.c_str(), O_RDWR));
+      fds.in_fd = std::make_shared<EintrSafeFileDescriptor>();
+      if (!job->input_path.empty()) {
+        CHECK(fds.in_fd->Open(job->input_path.c_str(), O_RDONLY))
+            << " failed to open " << job->input_path;
+      }
+    }
+    return ExecuteOperation(op, op_data, fds.out_fd, fds.in_fd);
+  }
+
+ private:
+  struct PartitionFds {
+    FileDescriptorPtr out_fd;
+    FileDescriptorPtr in_fd;
+  };
+
+  bool ExecuteOperation(const InstallOperation& op,
+                        const uint8_t* op_data,
+                        FileDescriptorPtr out_fd,
+                        FileDescriptorPtr in_fd) {
+    if (op.has_src_sha256_hash()) {
+      brillo::Blob actual_hash;
+      TEST_AND_RETURN_FALSE(fd_utils::ReadAndHashExtents(in_fd,
+                                                         op.src_extents(),
+                                                         manifest_.block_size(),
+                                                         &actual_hash,
+                                                         hash_algorithm_));
+      CHECK_EQ(HexEncode(ToStringView(actual_hash)),
+               HexEncode(op.src_sha256_hash()));
+    }
+
+    if (op.has_data_sha256_hash()) {
+      brillo::Blob actual_hash;
+      TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
+          op_data, op.data_length(), &actual_hash, hash_algorithm_));
+      CHECK_EQ(HexEncode(ToStringView(actual_hash)),
+               HexEncode(op.data_sha256_hash()));
+    }
+    auto direct_writer = std::make_unique<DirectExtentWriter>(out_fd);
+    if (op.type() == InstallOperation::ZERO) {
+      TEST_AND_RETURN_FALSE(executor_.ExecuteZeroOrDiscardOperation(
+          op, std::move(direct_writer)));
+    } else if (op.type() == InstallOperation::REPLACE ||
+               op.type() == InstallOperation::REPLACE_BZ ||
+               op.type() == InstallOperation::REPLACE_XZ ||
+               op.type() == InstallOperation::REPLACE_ZSTD) {
+      TEST_AND_RETURN_FALSE(executor_.ExecuteReplaceOperation(
+          op, std::move(direct_writer), op_data));
+    } else if (op.type() == InstallOperation::SOURCE_COPY) {
+      CHECK(in_fd->IsOpen());
+      TEST_AND_RETURN_FALSE(executor_.ExecuteSourceCopyOperation(
+          op, std::move(direct_writer), in_fd));
+    } else {
+      CHECK(in_fd->IsOpen());
+      TEST_AND_RETURN_FALSE(executor_.ExecuteDiffOperation(
+          op, std::move(direct_writer), in_fd, op_data, op.data_length()));
+    }
+    return true;
+  }
+
+  const DeltaArchiveManifest& manifest_;
+  const HashAlgorithm hash_algorithm_;
+  InstallOperationExecutor executor_;
+  std::map<const PartitionJob*, PartitionFds> fds_;
+};
+
+// Returns whether the operations of |partition| write blocks of their own,
+// so that they can run in any order.
+bool HasDisjointDstExtents(const PartitionUpdate& partition) {
+  ExtentRanges written;
+  for (const auto& op : partition.operations()) {
+    for (const auto& extent : op.dst_extents()) {
+      if (written.OverlapsWithExtent(extent))
+        return false;
+    }
+    written.AddRepeatedExtents(op.dst_extents());
+  }
+  return true;
+}
+
+// Writes the verity data of the extracted partition, and checks its hash.
+bool FinishPartition(const PartitionJob& job,
+                     size_t block_size,
+                     HashAlgorithm hash_algorithm) {
+  const PartitionUpdate& partition = *job.partition;
+  auto out_fd = std::make_shared<EintrSafeFileDescriptor>();
+  TEST_AND_RETURN_FALSE_ERRNO(out_fd->Open(job.output_path.c_str(), O_RDWR));
+  WriteVerity(partition, out_fd, block_size);
+  out_fd->Close();
+  int err = truncate64(job.output_path.c_str(),
+                       partition.new_partition_info().size());
+  if (err) {
+    PLOG(ERROR) << "Failed to truncate " << job.output_path << " to "
+                << partition.new_partition_info().size();
+  }
+  brillo::Blob actual_hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfFile(
+      job.output_path, &actual_hash, hash_algorithm));
+  CHECK_EQ(HexEncode(ToStringView(actual_hash)),
+           HexEncode(partition.new_partition_info().hash()))
+      << " Partition " << partition.partition_name()
+      << " hash mismatches. Either the source image or OTA package is "
+         "corrupted.";
+  LOG(INFO) << "Extracted partition " << partition.partition_name();
+  return true;
+}
+
+// Creates the output images of the partitions to extract, and returns their
+// jobs in the order of the manifest.
+bool CreatePartitionJobs(const DeltaArchiveManifest& manifest,
+                         std::string_view input_dir,
+                         std::string_view output_dir,
+                         const std::set<std::string>& partitions,
+                         std::vector<std::unique_ptr<PartitionJob>>* jobs) {
   const base::FilePath output_dir_path(
       base::StringPiece(output_dir.data(), output_dir.size()));
   const base::FilePath input_dir_path(
       base::StringPiece(input_dir.data(), input_dir.size()));
-  std::vector<unsigned char> blob;
   for (const auto& partition : manifest.partitions()) {
     if (!partitions.empty() &&
         partitions.count(partition.partition_name()) == 0) {
@@ -116,79 +310,175 @@ bool ExtractImagesFromOTA(const DeltaArchiveManifest& manifest,
     }
     LOG(INFO) << "Extracting partition " << partition.partition_name()
               << " size: " << partition.new_partition_info().size();
-    const auto output_path =
+    auto job = std::make_unique<PartitionJob>();
+    job->partition = &partition;
+    job->output_path =
         output_dir_path.Append(partition.partition_name() + ".img").value();
-    auto out_fd =
-        std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>();
+    EintrSafeFileDescriptor out_fd;
     TEST_AND_RETURN_FALSE_ERRNO(
-        out_fd->Open(output_path.c_str(), O_RDWR | O_CREAT, 0644));
-    auto in_fd =
-        std::make_shared<chromeos_update_engine::EintrSafeFileDescriptor>();
+        out_fd.Open(job->output_path.c_str(), O_RDWR | O_CREAT, 0644));
+    out_fd.Close();
     if (partition.has_old_partition_info()) {
-      const auto input_path =
+      job->input_path =
           input_dir_path.Append(partition.partition_name() + ".img").value();
       LOG(INFO) << "Incremental OTA detected for partition "
                 << partition.partition_name() << " opening source image "
-                << input_path;
-      CHECK(in_fd->Open(input_path.c_str(), O_RDONLY))
-          << " failed to open " << input_path;
+                << job->input_path;
     }
+    jobs->push_back(std::move(job));
+  }
+  return true;
+}
 
-    for (const auto& op : partition.operations()) {
-      if (op.has_src_sha256_hash()) {
-        brillo::Blob actual_hash;
-        TEST_AND_RETURN_FALSE(fd_utils::ReadAndHashExtents(
-            in_fd, op.src_extents(), manifest.block_size(), &actual_hash));
-        CHECK_EQ(HexEncode(ToStringView(actual_hash)),
-                 HexEncode(op.src_sha256_hash()));
-      }
+}  // namespace
 
-      blob.resize(op.data_length());
-      const auto op_data_offset = data_begin + op.data_offset();
-      ssize_t bytes_read = 0;
-      TEST_AND_RETURN_FALSE(utils::PReadAll(
-          payload_fd, blob.data(), blob.size(), op_data_offset, &bytes_read));
-      if (op.has_data_sha256_hash()) {
-        brillo::Blob actual_hash;
-        TEST_AND_RETURN_FALSE(
-            HashCalculator::RawHashOfData(blob, &actual_hash));
-        CHECK_EQ(HexEncode(ToStringView(actual_hash)),
-                 HexEncode(op.data_sha256_hash()));
+bool ExtractImagesFromOTA(const DeltaArchiveManifest& manifest,
+                          const PayloadMetadata& metadata,
+                          const uint8_t* payload,
+                          size_t payload_size,
+                          std::string_view input_dir,
+                          std::string_view output_dir,
+                          const std::set<std::string>& partitions,
+                          size_t threads) {
+  const size_t data_begin =
+      metadata.GetMetadataSize() + metadata.GetMetadataSignatureSize();
+  TEST_AND_RETURN_FALSE(data_begin <= payload_size);
+  std::vector<std::unique_ptr<PartitionJob>> jobs;
+  TEST_AND_RETURN_FALSE(
+      CreatePartitionJobs(manifest, input_dir, output_dir, partitions, &jobs));
+
+  // The operations of every partition are split in work items, handed out to
+  // the threads in order. The operations of a partition run in parallel
+  // unless some of them write the same blocks.
+  std::vector<WorkItem> items;
+  for (const auto& job : jobs) {
+    const PartitionUpdate& partition = *job->partition;
+    const int num_ops = partition.operations_size();
+    if (threads > 1 && num_ops > 1 && HasDisjointDstExtents(partition)) {
+      for (int i = 0; i < num_ops; i++) {
+        items.push_back({job.get(), i, 1});
       }
-      auto direct_writer = std::make_unique<DirectExtentWriter>(out_fd);
-      if (op.type() == InstallOperation::ZERO) {
-        TEST_AND_RETURN_FALSE(executor.ExecuteZeroOrDiscardOperation(
-            op, std::move(direct_writer)));
-      } else if (op.type() == InstallOperation::REPLACE ||
-                 op.type() == InstallOperation::REPLACE_BZ ||
-                 op.type() == InstallOperation::REPLACE_XZ) {
-        TEST_AND_RETURN_FALSE(executor.ExecuteReplaceOperation(
-            op, std::move(direct_writer), blob.data()));
-      } else if (op.type() == InstallOperation::SOURCE_COPY) {
-        CHECK(in_fd->IsOpen());
-        TEST_AND_RETURN_FALSE(executor.ExecuteSourceCopyOperation(
-            op, std::move(direct_writer), in_fd));
-      } else {
-        CHECK(in_fd->IsOpen());
-        TEST_AND_RETURN_FALSE(executor.ExecuteDiffOperation(
-            op, std::move(direct_writer), in_fd, blob.data(), blob.size()));
+      job->items_left = num_ops;
+    } else {
+      items.push_back({job.get(), 0, num_ops});
+      job->items_left = 1;
+    }
+  }
+
+  std::atomic<size_t> next_item{0};
+  std::atomic<bool> failed{false};
+  auto work = [&]() {
+    ExtractionWorker worker(manifest);
+    while (!failed) {
+      const size_t index = next_item++;
+      if (index >= items.size())
+        return;
+      const WorkItem& item = items[index];
+      if (!worker.Run(
+              item, payload + data_begin, payload_size - data_begin) ||
+          (--item.job->items_left == 0 &&
+           !FinishPartition(*item.job,
+                            manifest.block_size(),
+                            GetDataHashAlgorithm(manifest)))) {
+        failed = true;
       }
     }
-    WriteVerity(partition, out_fd, manifest.block_size());
-    int err =
-        truncate64(output_path.c_str(), partition.new_partition_info().size());
-    if (err) {
-      PLOG(ERROR) << "Failed to truncate " << output_path << " to "
-                  << partition.new_partition_info().size();
+  };
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < std::min(threads, items.size()); i++) {
+    workers.emplace_back(work);
+  }
+  work();
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  return !failed;
+}
+
+PayloadStream::PayloadStream(int fd) : fd_(fd) {}
+
+bool PayloadStream::Read(size_t count, brillo::Blob* out) {
+  const size_t size = out->size();
+  out->resize(size + count);
+  size_t bytes_read = 0;
+  bool eof = false;
+  TEST_AND_RETURN_FALSE_ERRNO(
+      utils::ReadAll(fd_, out->data() + size, count, &bytes_read, &eof));
+  if (bytes_read != count) {
+    LOG(ERROR) << "The payload ended at offset " << offset_ + bytes_read
+               << ", expected " << count - bytes_read << " more bytes.";
+    return false;
+  }
+  offset_ += count;
+  return true;
+}
+
+bool PayloadStream::Skip(uint64_t count) {
+  brillo::Blob buffer;
+  while (count > 0) {
+    const size_t bytes_to_read =
+        std::min<uint64_t>(count, kStreamBufferSize);
+    buffer.clear();
+    TEST_AND_RETURN_FALSE(Read(bytes_to_read, &buffer));
+    count -= bytes_to_read;
+  }
+  return true;
+}
+
+bool ReadPayloadMetadata(PayloadStream* stream,
+                         PayloadMetadata* metadata,
+                         DeltaArchiveManifest* manifest) {
+  brillo::Blob payload;
+  TEST_AND_RETURN_FALSE(stream->Read(kMaxPayloadHeaderSize, &payload));
+  ErrorCode error = ErrorCode::kSuccess;
+  if (metadata->ParsePayloadHeader(payload, &error) !=
+      MetadataParseResult::kSuccess) {
+    LOG(ERROR) << "Payload header parse failed: "
+               << utils::ErrorCodeToString(error);
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(stream->Read(metadata->GetMetadataSize() +
+                                         metadata->GetMetadataSignatureSize() -
+                                         kMaxPayloadHeaderSize,
+                                     &payload));
+  TEST_AND_RETURN_FALSE(metadata->GetManifest(payload, manifest));
+  return true;
+}
+
+bool ExtractImagesFromStream(const DeltaArchiveManifest& manifest,
+                             PayloadStream* stream,
+                             std::string_view input_dir,
+                             std::string_view output_dir,
+                             const std::set<std::string>& partitions) {
+  std::vector<std::unique_ptr<PartitionJob>> jobs;
+  TEST_AND_RETURN_FALSE(
+      CreatePartitionJobs(manifest, input_dir, output_dir, partitions, &jobs));
+
+  // The operations run in the order of the manifest, which is the order of
+  // their data in the payload, as they do on the device. The data of the
+  // partitions not extracted is skipped.
+  const uint64_t data_begin = stream->offset();
+  ExtractionWorker worker(manifest);
+  brillo::Blob op_data;
+  for (const auto& job : jobs) {
+    for (const auto& op : job->partition->operations()) {
+      op_data.clear();
+      if (op.data_length() > 0) {
+        const uint64_t position = stream->offset() - data_begin;
+        if (op.data_offset() < position) {
+          LOG(ERROR) << "The data of an operation of "
+                     << job->partition->partition_name() << " at offset "
+                     << op.data_offset() << " was already read, at offset "
+                     << position << ". The payload can't be streamed.";
+          return false;
+        }
+        TEST_AND_RETURN_FALSE(stream->Skip(op.data_offset() - position));
+        TEST_AND_RETURN_FALSE(stream->Read(op.data_length(), &op_data));
+      }
+      TEST_AND_RETURN_FALSE(worker.RunOperation(job.get(), op, op_data.data()));
     }
-    brillo::Blob actual_hash;
-    TEST_AND_RETURN_FALSE(
-        HashCalculator::RawHashOfFile(output_path, &actual_hash));
-    CHECK_EQ(HexEncode(ToStringView(actual_hash)),
-             HexEncode(partition.new_partition_info().hash()))
-        << " Partition " << partition.partition_name()
-        << " hash mismatches. Either the source image or OTA package is "
-           "corrupted.";
+    TEST_AND_RETURN_FALSE(FinishPartition(
+        *job, manifest.block_size(), GetDataHashAlgorithm(manifest)));
   }
   return true;
 }
@@ -206,6 +496,38 @@ bool IsIncrementalOTA(const DeltaArchiveManifest& manifest) {
   return false;
 }
 
+// Extracts the images of |partitions| from the payload streamed on the
+// standard input, at --payload_offset.
+bool ExtractImagesFromStandardInput(const std::set<std::string>& partitions) {
+  chromeos_update_engine::PayloadStream stream(STDIN_FILENO);
+  if (!stream.Skip(FLAGS_payload_offset)) {
+    LOG(ERROR) << "Failed to read up to the payload at offset "
+               << FLAGS_payload_offset;
+    return false;
+  }
+  PayloadMetadata payload_metadata;
+  DeltaArchiveManifest manifest;
+  if (!chromeos_update_engine::ReadPayloadMetadata(
+          &stream, &payload_metadata, &manifest)) {
+    LOG(ERROR) << "Failed to read the payload metadata!";
+    return false;
+  }
+  if (IsIncrementalOTA(manifest) && FLAGS_input_dir.empty()) {
+    LOG(ERROR) << "The payload is an incremental OTA, --input_dir parameter "
+                  "is required.";
+    return false;
+  }
+  for (const auto& partition : manifest.partitions()) {
+    if (partition.has_operations_section()) {
+      LOG(ERROR) << "Payloads with operations sections can't be extracted "
+                    "from the standard input.";
+      return false;
+    }
+  }
+  return chromeos_update_engine::ExtractImagesFromStream(
+      manifest, &stream, FLAGS_input_dir, FLAGS_output_dir, partitions);
+}
+
 }  // namespace
 
 int main(int argc, char* argv[]) {
@@ -224,6 +546,9 @@ int main(int argc, char* argv[]) {
   if (!partitions.empty()) {
     LOG(INFO) << "Extracting " << android::base::Join(partitions, ", ");
   }
+  if (FLAGS_payload == "-") {
+    return !ExtractImagesFromStandardInput(partitions);
+  }
   int payload_fd = open(FLAGS_payload.c_str(), O_RDONLY | O_CLOEXEC);
   if (payload_fd < 0) {
     PLOG(ERROR) << "Failed to open payload file";
@@ -265,16 +590,31 @@ int main(int argc, char* argv[]) {
     LOG(ERROR) << "Failed to parse manifest!";
     return 1;
   }
+  const size_t data_begin = payload_metadata.GetMetadataSize() +
+                            payload_metadata.GetMetadataSignatureSize();
+  if (data_begin >
+          static_cast<uint64_t>(payload_size - FLAGS_payload_offset) ||
+      !chromeos_update_engine::ParseOperationsSections(
+          payload + FLAGS_payload_offset + data_begin,
+          payload_size - FLAGS_payload_offset - data_begin,
+          &manifest)) {
+    LOG(ERROR) << "Failed to parse the operations sections!";
+    return 1;
+  }
   if (IsIncrementalOTA(manifest) && FLAGS_input_dir.empty()) {
     LOG(ERROR) << FLAGS_payload
                << " is an incremental OTA, --input_dir parameter is required.";
     return 1;
   }
+  const size_t threads =
+      FLAGS_threads > 0 ? FLAGS_threads
+                        : std::max(std::thread::hardware_concurrency(), 1u);
   return !ExtractImagesFromOTA(manifest,
                                payload_metadata,
-                               payload_fd,
-                               FLAGS_payload_offset,
+                               payload + FLAGS_payload_offset,
+                               payload_size - FLAGS_payload_offset,
                                FLAGS_input_dir,
                                FLAGS_output_dir,
-                               partitions);
+                               partitions,
+                               threads);
 }
@@ -23,6 +23,7 @@
 #include <string>
 #include <vector>
 
+#include "update_engine/common/cleanup_previous_update_action_delegate.h"
 #include "update_engine/common/error.h"
 
 namespace chromeos_update_engine {
@@ -48,6 +49,11 @@ class ServiceDelegateAndroidInterface {
  public:
   virtual ~ServiceDelegateAndroidInterface() = default;
 
+  // Restores the status of the previous update attempt, unless it already
+  // was. The service may defer it until the boot completed, so it is called
+  // before the status is sent to a client binding to the service.
+  virtual void Init() = 0;
+
   // Start an update attempt to download an apply the provided |payload_url| if
   // no other update is running. The extra |key_value_pair_headers| will be
   // included when fetching the payload. Returns whether the update was started
@@ -132,6 +138,9 @@ class ServiceDelegateAndroidInterface {
 
   virtual bool SetPerformanceMode(bool enable, Error* error) = 0;
 
+  // Sets when the snapshots of the previous update are merged.
+  virtual bool SetMergePolicy(MergePolicy policy, Error* error) = 0;
+
  protected:
   ServiceDelegateAndroidInterface() = default;
 };
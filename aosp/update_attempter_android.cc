@@ -17,9 +17,11 @@
 #include "update_engine/aosp/update_attempter_android.h"
 
 #include <algorithm>
+#include <future>
 #include <map>
 #include <memory>
 #include <ostream>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -29,6 +31,8 @@
 #include <base/bind.h>
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/threading/thread_task_runner_handle.h>
 #include <brillo/data_encoding.h>
 #include <brillo/message_loops/message_loop.h>
 #include <brillo/strings/string_utils.h>
@@ -45,6 +49,9 @@
 #include "update_engine/common/file_fetcher.h"
 #include "update_engine/common/metrics_reporter_interface.h"
 #include "update_engine/common/network_selector.h"
+#include "update_engine/common/parallel_http_fetcher.h"
+#include "update_engine/common/peer_cache_http_fetcher.h"
+#include "update_engine/common/trace.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/metrics_utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
@@ -70,7 +77,6 @@ using android::base::unique_fd;
 using base::Bind;
 using base::Time;
 using base::TimeDelta;
-using base::TimeTicks;
 using std::string;
 using std::vector;
 using update_engine::UpdateEngineStatus;
@@ -79,10 +85,19 @@ namespace chromeos_update_engine {
 
 namespace {
 
-// Minimum threshold to broadcast an status update in progress and time.
+// Minimum threshold to broadcast an status update in progress and time, and
+// the longest a change of progress waits to be broadcast.
 const double kBroadcastThresholdProgress = 0.01;  // 1%
+const int kBroadcastMinIntervalMs = 500;
 const int kBroadcastThresholdSeconds = 10;
 
+// The most connections a payload is downloaded over at once.
+constexpr unsigned kMaxDownloadConnections = 8;
+
+// Set to trace the updates as if their payloads had the TRACE_OPERATIONS
+// header.
+constexpr char kTraceProperty[] = "debug.update_engine.trace";
+
 // Log and set the error on the passed ErrorPtr.
 bool LogAndSetGenericError(Error* error,
                            int line_number,
@@ -156,6 +171,57 @@ std::string GetCurrentBuildVersion() {
   return android::base::GetProperty("ro.build.fingerprint", "");
 }
 
+// The partitions updated by the payloads, as listed by the build.
+vector<string> GetAbOtaPartitions() {
+  string partitions =
+      android::base::GetProperty("ro.vendor.build.ab_ota_partitions", "");
+  if (partitions.empty()) {
+    partitions = android::base::GetProperty("ro.product.ab_ota_partitions", "");
+  }
+  return base::SplitString(
+      partitions, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+}
+
+// Sets up |install_plan| to apply the payload as fast as the device can, for
+// recovery and sideload where nothing else runs. It takes all the cores and a
+// few hundred MiB of memory, given back under memory pressure, and only
+// checkpoints between partitions since starting over there is cheap. The
+// payload headers still override this.
+void UseThroughputProfile(InstallPlan* install_plan) {
+  const size_t cores = std::max(std::thread::hardware_concurrency(), 1U);
+  install_plan->batched_writes = true;
+  install_plan->pipelined_apply = true;
+  install_plan->apply_workers = cores;
+  install_plan->verify_workers = cores;
+  install_plan->use_direct_io = true;
+  install_plan->overlap_verification = true;
+  install_plan->source_cache_size = 128 * 1024 * 1024;
+  install_plan->source_prefetch_ops = 32;
+  install_plan->source_prefetch_bytes = 128 * 1024 * 1024;
+  install_plan->write_combine_size = 64 * 1024 * 1024;
+  install_plan->source_copy_batch_size = 64 * 1024 * 1024;
+  install_plan->cow_write_queue_size = 64 * 1024 * 1024;
+  install_plan->fec_buffer_size = 128 * 1024 * 1024;
+  install_plan->memory_pressure_aware = true;
+  install_plan->minimal_checkpoints = true;
+}
+
+UpdatePhase GetUpdatePhase(UpdateStatus status) {
+  switch (status) {
+    case UpdateStatus::UPDATE_AVAILABLE:
+    case UpdateStatus::DOWNLOADING:
+      return UpdatePhase::kDownload;
+    case UpdateStatus::VERIFYING:
+      return UpdatePhase::kVerify;
+    case UpdateStatus::FINALIZING:
+      return UpdatePhase::kPostinstall;
+    case UpdateStatus::CLEANUP_PREVIOUS_UPDATE:
+      return UpdatePhase::kMerge;
+    default:
+      return UpdatePhase::kIdle;
+  }
+}
+
 }  // namespace
 
 UpdateAttempterAndroid::UpdateAttempterAndroid(
@@ -169,10 +235,20 @@ UpdateAttempterAndroid::UpdateAttempterAndroid(
       boot_control_(boot_control),
       hardware_(hardware),
       apex_handler_android_(std::move(apex_handler)),
+      progress_coalescer_(
+          TimeDelta::FromMilliseconds(kBroadcastMinIntervalMs),
+          kBroadcastThresholdProgress,
+          TimeDelta::FromSeconds(kBroadcastThresholdSeconds)),
       processor_(new ActionProcessor()),
       clock_(new Clock()),
       metric_bytes_downloaded_(kPrefsCurrentBytesDownloaded, prefs_),
-      metric_total_bytes_downloaded_(kPrefsTotalBytesDownloaded, prefs_) {
+      metric_total_bytes_downloaded_(kPrefsTotalBytesDownloaded, prefs_),
+      resource_governor_(hardware_) {
+  // Updated all along the download, and only used for the metrics.
+  prefs_->SetDurability(kPrefsCurrentBytesDownloaded,
+                        PrefsInterface::Durability::kDeferred);
+  prefs_->SetDurability(kPrefsTotalBytesDownloaded,
+                        PrefsInterface::Durability::kDeferred);
   metrics_reporter_ = metrics::CreateMetricsReporter(
       boot_control_->GetDynamicPartitionControl(), &install_plan_);
   network_selector_ = network::CreateNetworkSelector();
@@ -183,6 +259,7 @@ UpdateAttempterAndroid::~UpdateAttempterAndroid() {
   // Release ourselves as the ActionProcessor's delegate to prevent
   // re-scheduling the updates due to the processing stopped.
   processor_->set_delegate(nullptr);
+  StopWatchingBootCompleted();
 }
 
 [[nodiscard]] static bool DidSystemReboot(PrefsInterface* prefs) {
@@ -214,7 +291,52 @@ std::ostream& operator<<(std::ostream& out, OTAResult result) {
   return out;
 }
 
+void UpdateAttempterAndroid::InitWhenBootCompleted() {
+  // Recovery doesn't set the property. Watching file descriptors needs a
+  // base::SingleThreadTaskRunner, which brillo::FakeMessageLoop doesn't have.
+  if (constants::kIsRecovery || BootCompletedWaiter::IsBootCompleted() ||
+      !base::ThreadTaskRunnerHandle::IsSet()) {
+    Init();
+    return;
+  }
+#ifdef __BIONIC__
+  boot_completed_waiter_ = BootCompletedWaiter::Start();
+  if (boot_completed_waiter_) {
+    boot_completed_controller_ = base::FileDescriptorWatcher::WatchReadable(
+        boot_completed_waiter_->event_fd(),
+        base::BindRepeating(&UpdateAttempterAndroid::OnBootCompleted,
+                            base::Unretained(this)));
+    LOG(INFO) << "Waiting for " << kBootCompletedProp << " to initialize.";
+    return;
+  }
+#endif
+  Init();
+}
+
+void UpdateAttempterAndroid::OnBootCompleted() {
+  StopWatchingBootCompleted();
+  Init();
+}
+
+void UpdateAttempterAndroid::StopWatchingBootCompleted() {
+  boot_completed_controller_.reset();
+  if (boot_completed_waiter_) {
+    boot_completed_waiter_->Cancel();
+    boot_completed_waiter_.reset();
+  }
+}
+
+void UpdateAttempterAndroid::InitIfDeferred() {
+  if (boot_completed_waiter_)
+    Init();
+}
+
 void UpdateAttempterAndroid::Init() {
+  if (initialized_)
+    return;
+  initialized_ = true;
+  StopWatchingBootCompleted();
+
   // In case of update_engine restart without a reboot we need to restore the
   // reboot needed state.
   if (UpdateCompletedOnThisBoot()) {
@@ -244,6 +366,7 @@ bool UpdateAttempterAndroid::ApplyPayload(
     int64_t payload_size,
     const vector<string>& key_value_pair_headers,
     Error* error) {
+  InitIfDeferred();
   if (status_ == UpdateStatus::UPDATED_NEED_REBOOT) {
     return LogAndSetError(error,
                           __LINE__,
@@ -269,6 +392,10 @@ bool UpdateAttempterAndroid::ApplyPayload(
 
   // Setup the InstallPlan based on the request.
   install_plan_ = InstallPlan();
+  if constexpr (constants::kIsRecovery) {
+    LOG(INFO) << "Applying the payload at full throughput in recovery.";
+    UseThroughputProfile(&install_plan_);
+  }
 
   install_plan_.download_url = payload_url;
   install_plan_.version = "";
@@ -364,20 +491,61 @@ bool UpdateAttempterAndroid::ApplyPayload(
   HttpFetcher* fetcher = nullptr;
   if (FileFetcher::SupportedUrl(payload_url)) {
     DLOG(INFO) << "Using FileFetcher for file URL.";
-    fetcher = new FileFetcher();
+    FileFetcher* file_fetcher = new FileFetcher();
+    file_fetcher->set_use_mmap(!headers[kPayloadMmapPayload].empty());
+    fetcher = file_fetcher;
   } else {
 #ifdef _UE_SIDELOAD
     LOG(FATAL) << "Unsupported sideload URI: " << payload_url;
     return false;  // NOLINT, unreached but analyzer might not know.
                    // Suppress warnings about null 'fetcher' after this.
 #else
-    LibcurlHttpFetcher* libcurl_fetcher = new LibcurlHttpFetcher(hardware_);
-    if (!headers[kPayloadDownloadRetry].empty()) {
-      libcurl_fetcher->set_max_retry_count(
-          atoi(headers[kPayloadDownloadRetry].c_str()));
+    unsigned connections = 1;
+    if (!headers[kPayloadDownloadConnections].empty() &&
+        (!base::StringToUint(headers[kPayloadDownloadConnections],
+                             &connections) ||
+         connections == 0)) {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadDownloadConnections << "="
+                   << headers[kPayloadDownloadConnections];
+      connections = 1;
+    }
+    connections = std::min(connections, kMaxDownloadConnections);
+    vector<std::unique_ptr<HttpFetcher>> libcurl_fetchers;
+    for (unsigned i = 0; i < connections; i++) {
+      auto libcurl_fetcher = std::make_unique<LibcurlHttpFetcher>(hardware_);
+      if (!headers[kPayloadDownloadRetry].empty()) {
+        libcurl_fetcher->set_max_retry_count(
+            atoi(headers[kPayloadDownloadRetry].c_str()));
+      }
+      libcurl_fetcher->set_server_to_check(ServerToCheck::kDownload);
+      libcurl_fetcher->set_compressed_transfer(
+          !headers[kPayloadCompressedTransfer].empty());
+      libcurl_fetchers.push_back(std::move(libcurl_fetcher));
+    }
+    vector<string> mirror_urls =
+        brillo::string_utils::Split(headers[kPayloadDownloadMirrors], ",");
+    if (libcurl_fetchers.size() == 1 && mirror_urls.empty()) {
+      fetcher = libcurl_fetchers[0].release();
+    } else {
+      LOG(INFO) << "Downloading over " << connections << " connections from "
+                << mirror_urls.size() + 1 << " servers.";
+      auto parallel_fetcher =
+          std::make_unique<ParallelHttpFetcher>(std::move(libcurl_fetchers));
+      parallel_fetcher->set_mirror_urls(std::move(mirror_urls));
+      fetcher = parallel_fetcher.release();
+    }
+    if (!headers[kPayloadPeerCacheUrl].empty()) {
+      LOG(INFO) << "Getting the payload data from "
+                << headers[kPayloadPeerCacheUrl] << " when possible.";
+      // The origin is there to fall back on, so fail fast like p2p does.
+      auto peer_fetcher = std::make_unique<LibcurlHttpFetcher>(hardware_);
+      peer_fetcher->set_max_retry_count(kDownloadP2PMaxRetryCount);
+      peer_fetcher->set_connect_timeout(kDownloadP2PConnectTimeoutSeconds);
+      fetcher =
+          new PeerCacheHttpFetcher(std::move(peer_fetcher),
+                                   std::unique_ptr<HttpFetcher>(fetcher),
+                                   headers[kPayloadPeerCacheUrl]);
     }
-    libcurl_fetcher->set_server_to_check(ServerToCheck::kDownload);
-    fetcher = libcurl_fetcher;
 #endif  // _UE_SIDELOAD
   }
   // Setup extra headers.
@@ -394,6 +562,9 @@ bool UpdateAttempterAndroid::ApplyPayload(
   if (!headers[kPayloadVABCNone].empty()) {
     install_plan_.vabc_none = true;
   }
+  if (!headers[kPayloadVABCAutoCompression].empty()) {
+    install_plan_.vabc_auto_compression = true;
+  }
   if (!headers[kPayloadEnableThreading].empty()) {
     const auto res = android::base::ParseBool(headers[kPayloadEnableThreading]);
     if (res != android::base::ParseBoolResult::kError) {
@@ -404,6 +575,156 @@ bool UpdateAttempterAndroid::ApplyPayload(
   if (!headers[kPayloadBatchedWrites].empty()) {
     install_plan_.batched_writes = true;
   }
+  if (!headers[kPayloadPipelinedApply].empty()) {
+    install_plan_.pipelined_apply = true;
+  }
+  if (!headers[kPayloadApplyWorkers].empty()) {
+    unsigned apply_workers = 0;
+    if (base::StringToUint(headers[kPayloadApplyWorkers], &apply_workers) &&
+        apply_workers > 0) {
+      install_plan_.apply_workers = apply_workers;
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadApplyWorkers << "="
+                   << headers[kPayloadApplyWorkers];
+    }
+  }
+  if (!headers[kPayloadUseIoUring].empty()) {
+    install_plan_.use_io_uring = true;
+  }
+  if (!headers[kPayloadUseDirectIo].empty()) {
+    install_plan_.use_direct_io = true;
+  }
+  if (!headers[kPayloadVerifyWorkers].empty()) {
+    unsigned verify_workers = 0;
+    if (base::StringToUint(headers[kPayloadVerifyWorkers], &verify_workers) &&
+        verify_workers > 0) {
+      install_plan_.verify_workers = verify_workers;
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadVerifyWorkers << "="
+                   << headers[kPayloadVerifyWorkers];
+    }
+  }
+  if (!headers[kPayloadOverlapVerification].empty()) {
+    install_plan_.overlap_verification = true;
+  }
+  if (!headers[kPayloadStreamReplace].empty()) {
+    install_plan_.stream_replace_operations = true;
+  }
+  if (!headers[kPayloadSourceCacheMb].empty()) {
+    unsigned source_cache_mb = 0;
+    if (base::StringToUint(headers[kPayloadSourceCacheMb], &source_cache_mb)) {
+      install_plan_.source_cache_size =
+          static_cast<size_t>(source_cache_mb) * 1024 * 1024;
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadSourceCacheMb << "="
+                   << headers[kPayloadSourceCacheMb];
+    }
+  }
+  if (!headers[kPayloadSourcePrefetchOps].empty()) {
+    unsigned prefetch_ops = 0;
+    if (base::StringToUint(headers[kPayloadSourcePrefetchOps],
+                           &prefetch_ops)) {
+      install_plan_.source_prefetch_ops = prefetch_ops;
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadSourcePrefetchOps << "="
+                   << headers[kPayloadSourcePrefetchOps];
+    }
+  }
+  if (!headers[kPayloadSourcePrefetchMb].empty()) {
+    unsigned prefetch_mb = 0;
+    if (base::StringToUint(headers[kPayloadSourcePrefetchMb], &prefetch_mb) &&
+        prefetch_mb > 0) {
+      install_plan_.source_prefetch_bytes =
+          static_cast<uint64_t>(prefetch_mb) * 1024 * 1024;
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadSourcePrefetchMb << "="
+                   << headers[kPayloadSourcePrefetchMb];
+    }
+  }
+  if (!headers[kPayloadWriteCombineMb].empty()) {
+    unsigned write_combine_mb = 0;
+    if (base::StringToUint(headers[kPayloadWriteCombineMb],
+                           &write_combine_mb)) {
+      install_plan_.write_combine_size =
+          static_cast<size_t>(write_combine_mb) * 1024 * 1024;
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadWriteCombineMb << "="
+                   << headers[kPayloadWriteCombineMb];
+    }
+  }
+  if (!headers[kPayloadSourceCopyBatchMb].empty()) {
+    unsigned batch_mb = 0;
+    if (base::StringToUint(headers[kPayloadSourceCopyBatchMb], &batch_mb)) {
+      install_plan_.source_copy_batch_size =
+          static_cast<uint64_t>(batch_mb) * 1024 * 1024;
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadSourceCopyBatchMb << "="
+                   << headers[kPayloadSourceCopyBatchMb];
+    }
+  }
+  if (!headers[kPayloadKernelCopy].empty()) {
+    install_plan_.kernel_copy = true;
+  }
+  if (!headers[kPayloadVeritySourceReads].empty()) {
+    install_plan_.verity_source_reads = true;
+  }
+  if (!headers[kPayloadFecFromSource].empty()) {
+    install_plan_.fec_from_source = true;
+  }
+  if (!headers[kPayloadHashTreeFromSource].empty()) {
+    install_plan_.hash_tree_from_source = true;
+  }
+  if (!headers[kPayloadVerityRootVerification].empty()) {
+    install_plan_.verity_root_verification = true;
+  }
+  if (!headers[kPayloadFecBufferMb].empty()) {
+    unsigned buffer_mb = 0;
+    if (base::StringToUint(headers[kPayloadFecBufferMb], &buffer_mb)) {
+      install_plan_.fec_buffer_size =
+          static_cast<size_t>(buffer_mb) * 1024 * 1024;
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadFecBufferMb << "="
+                   << headers[kPayloadFecBufferMb];
+    }
+  }
+  if (!headers[kPayloadPostinstallCacheWarming].empty()) {
+    install_plan_.postinstall_cache_warming = true;
+  }
+  if (!headers[kPayloadInlineHashTree].empty()) {
+    install_plan_.inline_hash_tree = true;
+  }
+  if (!headers[kPayloadMemoryPressureAware].empty()) {
+    install_plan_.memory_pressure_aware = true;
+  }
+  if (!headers[kPayloadSpillPayload].empty()) {
+    install_plan_.spill_payload = true;
+  }
+  if (!headers[kPayloadCowWriteQueueMb].empty()) {
+    unsigned queue_mb = 0;
+    if (base::StringToUint(headers[kPayloadCowWriteQueueMb], &queue_mb)) {
+      install_plan_.cow_write_queue_size =
+          static_cast<size_t>(queue_mb) * 1024 * 1024;
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadCowWriteQueueMb << "="
+                   << headers[kPayloadCowWriteQueueMb];
+    }
+  }
+  if (!headers[kPayloadReplaceCheckpointMb].empty()) {
+    unsigned checkpoint_mb = 0;
+    if (base::StringToUint(headers[kPayloadReplaceCheckpointMb],
+                           &checkpoint_mb)) {
+      install_plan_.replace_checkpoint_size =
+          static_cast<uint64_t>(checkpoint_mb) * 1024 * 1024;
+    } else {
+      LOG(WARNING) << "Ignoring invalid " << kPayloadReplaceCheckpointMb << "="
+                   << headers[kPayloadReplaceCheckpointMb];
+    }
+  }
+  if (!headers[kPayloadTraceOperations].empty() ||
+      android::base::GetBoolProperty(kTraceProperty, false)) {
+    install_plan_.trace_operations = true;
+  }
+  SetTracingEnabled(install_plan_.trace_operations);
 
   BuildUpdateActions(fetcher);
 
@@ -422,6 +743,7 @@ bool UpdateAttempterAndroid::ApplyPayload(
     int64_t payload_size,
     const vector<string>& key_value_pair_headers,
     Error* error) {
+  InitIfDeferred();
   // update_engine state must be checked before modifying payload_fd_ otherwise
   // already running update will be terminated (existing file descriptor will be
   // closed)
@@ -473,6 +795,7 @@ bool UpdateAttempterAndroid::CancelUpdate(Error* error) {
 }
 
 bool UpdateAttempterAndroid::ResetStatus(Error* error) {
+  InitIfDeferred();
   LOG(INFO) << "Attempting to reset state from "
             << UpdateStatusToString(status_) << " to UpdateStatus::IDLE";
   if (processor_->IsRunning()) {
@@ -605,7 +928,7 @@ bool UpdateAttempterAndroid::VerifyPayloadParseManifest(
     }
   }
 
-  auto payload_verifier = PayloadVerifier::CreateInstanceFromZipPath(
+  auto payload_verifier = PayloadVerifier::GetCachedInstanceFromZipPath(
       constants::kUpdateCertificatesPath);
   if (!payload_verifier) {
     return LogAndSetError(error,
@@ -677,7 +1000,8 @@ bool UpdateAttempterAndroid::VerifyPayloadApplicable(
       if (!fd_utils::ReadAndHashExtents(fd,
                                         operation.src_extents(),
                                         manifest.block_size(),
-                                        &source_hash)) {
+                                        &source_hash,
+                                        GetDataHashAlgorithm(manifest))) {
         return LogAndSetGenericError(
             error, __LINE__, __FILE__, "Failed to hash " + partition_path);
       }
@@ -698,16 +1022,63 @@ bool UpdateAttempterAndroid::SetPerformanceMode(bool enable,
   if (performance_mode_ == enable)
     return true;
   bool ret;
-  if (enable)
+  // The task profiles of the performance mode replace the resource policies.
+  if (enable) {
+    resource_governor_.SetPerformanceMode(true);
     ret = SetTaskProfiles(0, {"ProcessCapacityMax", "HighIoPriority", "MaxPerformance"});
-  else
+  } else {
     ret = SetTaskProfiles(0, {"OtaProfiles"});
+    resource_governor_.SetPerformanceMode(false);
+  }
   if (!ret)
     return LogAndSetGenericError(error, __LINE__, __FILE__, "Could not change profiles");
   performance_mode_ = enable;
   return true;
 }
 
+bool UpdateAttempterAndroid::SetMergePolicy(MergePolicy policy, Error* error) {
+  LOG(INFO) << "Setting the merge policy to " << static_cast<int>(policy);
+  if (merge_policy_ == policy)
+    return true;
+  merge_policy_ = policy;
+  UpdateSourceHashIndexer();
+  AbstractAction* action = processor_->current_action();
+  if (action && action->Type() == CleanupPreviousUpdateAction::StaticType()) {
+    static_cast<CleanupPreviousUpdateAction*>(action)->OnMergePolicyChanged();
+  }
+  return true;
+}
+
+void UpdateAttempterAndroid::UpdateSourceHashIndexer() {
+  if (!initialized_ || status_ != UpdateStatus::IDLE ||
+      merge_policy_ != MergePolicy::kFast) {
+    if (source_hash_indexer_)
+      source_hash_indexer_->Stop();
+    resource_governor_.EnterPhase(GetUpdatePhase(status_));
+    return;
+  }
+  if (!source_hash_indexer_) {
+    const BootControlInterface::Slot slot = boot_control_->GetCurrentSlot();
+    vector<SourceHashIndexer::Partition> partitions;
+    for (const string& name : GetAbOtaPartitions()) {
+      string path;
+      if (boot_control_->GetPartitionDevice(name, slot, &path))
+        partitions.push_back({name, std::move(path)});
+    }
+    source_hash_indexer_ = std::make_unique<SourceHashIndexer>(
+        prefs_,
+        slot,
+        hardware_->GetBuildTimestamp(),
+        std::move(partitions),
+        base::Bind(&UpdateAttempterAndroid::UpdateSourceHashIndexer,
+                   base::Unretained(this)));
+  }
+  source_hash_indexer_->Start();
+  resource_governor_.EnterPhase(source_hash_indexer_->done()
+                                    ? GetUpdatePhase(status_)
+                                    : UpdatePhase::kSourceIndex);
+}
+
 void UpdateAttempterAndroid::ProcessingDone(const ActionProcessor* processor,
                                             ErrorCode code) {
   LOG(INFO) << "Processing Done.";
@@ -774,6 +1145,7 @@ void UpdateAttempterAndroid::ActionCompleted(ActionProcessor* processor,
   // download_progress_ is actually used by other actions, such as
   // filesystem_verify_action. Therefore we always clear it.
   download_progress_ = 0;
+  RecordPhaseMetrics(action);
   if (type == PostinstallRunnerAction::StaticType()) {
     bool succeeded =
         code == ErrorCode::kSuccess || code == ErrorCode::kUpdatedButNotActive;
@@ -789,6 +1161,10 @@ void UpdateAttempterAndroid::ActionCompleted(ActionProcessor* processor,
   if (type == DownloadAction::StaticType()) {
     auto download_action = static_cast<DownloadAction*>(action);
     install_plan_ = *download_action->install_plan();
+    if (!install_plan_.operation_stats.empty()) {
+      metrics_reporter_->ReportInstallOperationStats(
+          install_plan_.operation_stats);
+    }
     SetStatusAndNotify(UpdateStatus::VERIFYING);
   } else if (type == FilesystemVerifierAction::StaticType()) {
     SetStatusAndNotify(UpdateStatus::FINALIZING);
@@ -812,6 +1188,7 @@ void UpdateAttempterAndroid::BytesReceived(uint64_t bytes_progressed,
   // Update the bytes downloaded in prefs.
   metric_bytes_downloaded_ += bytes_progressed;
   metric_total_bytes_downloaded_ += bytes_progressed;
+  phase_metrics_.download_bytes += bytes_progressed;
 }
 
 bool UpdateAttempterAndroid::ShouldCancel(ErrorCode* cancel_reason) {
@@ -825,13 +1202,11 @@ void UpdateAttempterAndroid::DownloadComplete() {
 }
 
 void UpdateAttempterAndroid::ProgressUpdate(double progress) {
-  // Self throttle based on progress. Also send notifications if progress is
-  // too slow.
-  if (progress == 1.0 ||
-      progress - download_progress_ >= kBroadcastThresholdProgress ||
-      TimeTicks::Now() - last_notify_time_ >=
-          TimeDelta::FromSeconds(kBroadcastThresholdSeconds)) {
-    download_progress_ = progress;
+  // Self throttle based on progress and time. The latest progress is still
+  // reported to the clients asking for the status.
+  download_progress_ = progress;
+  if (progress_coalescer_.ShouldNotify(
+          status_, progress, clock_->GetMonotonicTime())) {
     SetStatusAndNotify(status_);
   }
 }
@@ -844,6 +1219,8 @@ void UpdateAttempterAndroid::OnVerifyProgressUpdate(double progress) {
 void UpdateAttempterAndroid::ScheduleProcessingStart() {
   LOG(INFO) << "Scheduling an action processor start.";
   processor_->set_delegate(this);
+  phase_metrics_ = metrics::UpdatePhaseMetrics();
+  phase_start_time_ = clock_->GetMonotonicTime();
   brillo::MessageLoop::current()->PostTask(
       FROM_HERE,
       Bind([](ActionProcessor* processor) { processor->StartProcessing(); },
@@ -867,6 +1244,14 @@ void UpdateAttempterAndroid::TerminateUpdateAndNotify(ErrorCode error_code) {
 
   boot_control_->GetDynamicPartitionControl()->Cleanup();
 
+  if (error_code == ErrorCode::kNewRootfsVerificationError ||
+      error_code == ErrorCode::kDownloadOperationExecutionError) {
+    // The source partitions may not be what the index tells anymore, they
+    // are hashed again.
+    ClearSourceHashIndex(prefs_);
+    source_hash_indexer_.reset();
+  }
+
   download_progress_ = 0;
   UpdateStatus new_status =
       (error_code == ErrorCode::kSuccess ? UpdateStatus::UPDATED_NEED_REBOOT
@@ -897,6 +1282,7 @@ void UpdateAttempterAndroid::TerminateUpdateAndNotify(ErrorCode error_code) {
 
 void UpdateAttempterAndroid::SetStatusAndNotify(UpdateStatus status) {
   status_ = status;
+  UpdateSourceHashIndexer();
   size_t payload_size =
       install_plan_.payloads.empty() ? 0 : install_plan_.payloads[0].size;
   UpdateEngineStatus status_to_send = {.status = status_,
@@ -906,7 +1292,8 @@ void UpdateAttempterAndroid::SetStatusAndNotify(UpdateStatus status) {
   for (auto observer : daemon_state_->service_observers()) {
     observer->SendStatusUpdate(status_to_send);
   }
-  last_notify_time_ = TimeTicks::Now();
+  progress_coalescer_.Notified(
+      status_, download_progress_, clock_->GetMonotonicTime());
 }
 
 void UpdateAttempterAndroid::BuildUpdateActions(HttpFetcher* fetcher) {
@@ -928,6 +1315,7 @@ void UpdateAttempterAndroid::BuildUpdateActions(HttpFetcher* fetcher) {
                                        update_certificates_path_);
   download_action->set_delegate(this);
   download_action->set_base_offset(base_offset_);
+  download_action->set_resource_governor(&resource_governor_);
   auto filesystem_verifier_action = std::make_unique<FilesystemVerifierAction>(
       boot_control_->GetDynamicPartitionControl());
   auto postinstall_runner_action =
@@ -1027,6 +1415,7 @@ void UpdateAttempterAndroid::CollectAndReportUpdateMetricsOnUpdateFinished(
       DownloadSource::kNumDownloadSources,
       metrics::DownloadErrorCode::kUnset,
       metrics::ConnectionType::kUnset);
+  metrics_reporter_->ReportUpdatePhaseMetrics(phase_metrics_);
 
   if (error_code == ErrorCode::kSuccess) {
     int64_t reboot_count =
@@ -1066,6 +1455,39 @@ void UpdateAttempterAndroid::CollectAndReportUpdateMetricsOnUpdateFinished(
   }
 }
 
+void UpdateAttempterAndroid::RecordPhaseMetrics(AbstractAction* action) {
+  // The actions run one after the other, so each one took the time since the
+  // previous one completed.
+  Time now = clock_->GetMonotonicTime();
+  TimeDelta duration = now - phase_start_time_;
+  phase_start_time_ = now;
+
+  const string type = action->Type();
+  if (type == DownloadAction::StaticType()) {
+    phase_metrics_.download_duration = duration;
+    const InstallPlan* install_plan =
+        static_cast<DownloadAction*>(action)->install_plan();
+    phase_metrics_.apply_bytes = 0;
+    for (const auto& partition : install_plan->partitions)
+      phase_metrics_.apply_bytes += partition.target_size;
+    phase_metrics_.apply_duration = TimeDelta();
+    for (const auto& [op_type, phases] :
+         install_plan->operation_stats.histograms) {
+      for (size_t i = 0; i < kNumOperationPhases; i++) {
+        if (static_cast<OperationPhase>(i) != OperationPhase::kWaitForData)
+          phase_metrics_.apply_duration += phases[i].total;
+      }
+    }
+  } else if (type == FilesystemVerifierAction::StaticType()) {
+    phase_metrics_.verify_duration = duration;
+    phase_metrics_.verify_bytes = 0;
+    for (const auto& partition : install_plan_.partitions)
+      phase_metrics_.verify_bytes += partition.target_size;
+  } else if (type == PostinstallRunnerAction::StaticType()) {
+    phase_metrics_.postinstall_duration = duration;
+  }
+}
+
 bool UpdateAttempterAndroid::OTARebootSucceeded() const {
   const auto current_slot = boot_control_->GetCurrentSlot();
   const string current_version = GetCurrentBuildVersion();
@@ -1224,6 +1646,7 @@ uint64_t UpdateAttempterAndroid::AllocateSpaceForPayload(
     const std::string& metadata_filename,
     const vector<string>& key_value_pair_headers,
     Error* error) {
+  InitIfDeferred();
   std::map<string, string> headers;
   if (!ParseKeyValuePairHeaders(key_value_pair_headers, &headers, error)) {
     return 0;
@@ -1239,11 +1662,32 @@ uint64_t UpdateAttempterAndroid::AllocateSpaceForPayload(
     return 0;
   }
 
+  // apexd walks the compressed APEXes to tell the size their decompression
+  // requires, at the same time as the partitions are prepared.
   std::vector<ApexInfo> apex_infos(manifest.apex_info().begin(),
                                    manifest.apex_info().end());
-  uint64_t apex_size_required = 0;
+  std::future<android::base::Result<uint64_t>> apex_size_result;
   if (apex_handler_android_ != nullptr) {
-    auto result = apex_handler_android_->CalculateSize(apex_infos);
+    apex_size_result = std::async(std::launch::async, [this, &apex_infos]() {
+      return apex_handler_android_->CalculateSize(apex_infos);
+    });
+  }
+
+  string payload_id = GetPayloadId(headers);
+  uint64_t required_size = 0;
+  ErrorCode error_code{};
+
+  const bool prepared =
+      DeltaPerformer::PreparePartitionsForUpdate(prefs_,
+                                                 boot_control_,
+                                                 GetTargetSlot(),
+                                                 manifest,
+                                                 payload_id,
+                                                 &required_size,
+                                                 &error_code);
+  uint64_t apex_size_required = 0;
+  if (apex_size_result.valid()) {
+    auto result = apex_size_result.get();
     if (!result.ok()) {
       LogAndSetGenericError(
           error,
@@ -1254,18 +1698,7 @@ uint64_t UpdateAttempterAndroid::AllocateSpaceForPayload(
     }
     apex_size_required = *result;
   }
-
-  string payload_id = GetPayloadId(headers);
-  uint64_t required_size = 0;
-  ErrorCode error_code{};
-
-  if (!DeltaPerformer::PreparePartitionsForUpdate(prefs_,
-                                                  boot_control_,
-                                                  GetTargetSlot(),
-                                                  manifest,
-                                                  payload_id,
-                                                  &required_size,
-                                                  &error_code)) {
+  if (!prepared) {
     if (error_code == ErrorCode::kOverlayfsenabledError) {
       LogAndSetError(error,
                      __LINE__,
@@ -1300,6 +1733,7 @@ uint64_t UpdateAttempterAndroid::AllocateSpaceForPayload(
 void UpdateAttempterAndroid::CleanupSuccessfulUpdate(
     std::unique_ptr<CleanupSuccessfulUpdateCallbackInterface> callback,
     Error* error) {
+  InitIfDeferred();
   if (cleanup_previous_update_code_.has_value()) {
     LOG(INFO) << "CleanupSuccessfulUpdate has previously completed with "
               << utils::ErrorCodeToString(*cleanup_previous_update_code_);
@@ -1321,6 +1755,7 @@ void UpdateAttempterAndroid::CleanupSuccessfulUpdate(
 
 bool UpdateAttempterAndroid::setShouldSwitchSlotOnReboot(
     const std::string& metadata_filename, Error* error) {
+  InitIfDeferred();
   LOG(INFO) << "setShouldSwitchSlotOnReboot(" << metadata_filename << ")";
   if (processor_->IsRunning()) {
     return LogAndSetGenericError(
@@ -1371,6 +1806,7 @@ bool UpdateAttempterAndroid::setShouldSwitchSlotOnReboot(
       return LogAndSetGenericError(
           error, __LINE__, __FILE__, "Failed to PreparePartitionsForUpdate");
     }
+    install_plan_.hash_algorithm = GetDataHashAlgorithm(manifest);
     if (!install_plan_.ParsePartitions(manifest.partitions(),
                                        boot_control_,
                                        manifest.block_size(),
@@ -1402,6 +1838,7 @@ bool UpdateAttempterAndroid::setShouldSwitchSlotOnReboot(
 }
 
 bool UpdateAttempterAndroid::resetShouldSwitchSlotOnReboot(Error* error) {
+  InitIfDeferred();
   if (processor_->IsRunning()) {
     return LogAndSetGenericError(
         error,
@@ -24,9 +24,11 @@
 #include <vector>
 
 #include <android-base/unique_fd.h>
+#include <base/files/file_descriptor_watcher_posix.h>
 #include <base/time/time.h>
 
 #include "update_engine/aosp/apex_handler_interface.h"
+#include "update_engine/aosp/boot_completed_waiter.h"
 #include "update_engine/aosp/service_delegate_android_interface.h"
 #include "update_engine/client_library/include/update_engine/update_status.h"
 #include "update_engine/common/action_processor.h"
@@ -39,9 +41,12 @@
 #include "update_engine/common/metrics_reporter_interface.h"
 #include "update_engine/common/network_selector_interface.h"
 #include "update_engine/common/prefs_interface.h"
+#include "update_engine/common/progress_coalescer.h"
+#include "update_engine/common/resource_governor.h"
 #include "update_engine/metrics_utils.h"
 #include "update_engine/payload_consumer/filesystem_verifier_action.h"
 #include "update_engine/payload_consumer/postinstall_runner_action.h"
+#include "update_engine/payload_consumer/source_hash_index.h"
 
 namespace chromeos_update_engine {
 
@@ -69,10 +74,15 @@ class UpdateAttempterAndroid
                          std::unique_ptr<ApexHandlerInterface> apex_handler);
   ~UpdateAttempterAndroid() override;
 
-  // Further initialization to be done post construction.
-  void Init();
+  // Calls Init() once the boot completed, keeping the work on the previous
+  // update out of the way of the boot, or right away if the boot already
+  // completed or can't be waited for.
+  void InitWhenBootCompleted();
 
   // ServiceDelegateAndroidInterface overrides.
+  // Further initialization to be done post construction. Only the first call
+  // does anything.
+  void Init() override;
   bool ApplyPayload(const std::string& payload_url,
                     int64_t payload_offset,
                     int64_t payload_size,
@@ -101,6 +111,7 @@ class UpdateAttempterAndroid
   bool resetShouldSwitchSlotOnReboot(Error* error) override;
 
   bool SetPerformanceMode(bool enable, Error* error) override;
+  bool SetMergePolicy(MergePolicy policy, Error* error) override;
 
   // ActionProcessorDelegate methods:
   void ProcessingDone(const ActionProcessor* processor,
@@ -125,6 +136,7 @@ class UpdateAttempterAndroid
 
   // CleanupPreviousUpdateActionDelegateInterface
   void OnCleanupProgressUpdate(double progress) override;
+  MergePolicy GetMergePolicy() override { return merge_policy_; }
 
   // Check the result of an OTA update. Intended to be called after reboot, this
   // will use prefs on disk to determine if OTA was installed, or rolledback.
@@ -161,6 +173,11 @@ class UpdateAttempterAndroid
   // all observers.
   void SetStatusAndNotify(UpdateStatus status);
 
+  // Hashes the partitions of the current slot for the source hash index
+  // while the device is idle and no update is going on, and pauses once it
+  // isn't anymore. Enters the resource phase of the status otherwise.
+  void UpdateSourceHashIndexer();
+
   // Helper method to construct the sequence of actions to be performed for
   // applying an update using a given HttpFetcher. The ownership of |fetcher| is
   // passed to this function.
@@ -194,6 +211,10 @@ class UpdateAttempterAndroid
   //   |kPrefsSystemUpdatedMarker|
   void CollectAndReportUpdateMetricsOnUpdateFinished(ErrorCode error_code);
 
+  // Accounts the time since the previous action completed, and the bytes it
+  // went through, to the phase of the update attempt |action| is, if any.
+  void RecordPhaseMetrics(AbstractAction* action);
+
   // This function is called after update_engine is started after device
   // reboots. If update_engine is restarted w/o device reboot, this function
   // would not be called.
@@ -235,6 +256,15 @@ class UpdateAttempterAndroid
   // Enqueue and run a CleanupPreviousUpdateAction.
   void ScheduleCleanupPreviousUpdate();
 
+  // Called once |kBootCompletedProp| is set, to Init().
+  void OnBootCompleted();
+  void StopWatchingBootCompleted();
+
+  // Calls Init() if it waits for the boot to complete. Called by the entry
+  // points depending on the status, so that a request coming before the boot
+  // completed is served right away.
+  void InitIfDeferred();
+
   // Notify and clear |cleanup_previous_update_callbacks_|.
   void NotifyCleanupPreviousUpdateCallbacksAndClear();
 
@@ -253,10 +283,17 @@ class UpdateAttempterAndroid
 
   std::unique_ptr<ApexHandlerInterface> apex_handler_android_;
 
-  // Last status notification timestamp used for throttling. Use monotonic
-  // TimeTicks to ensure that notifications are sent even if the system clock is
-  // set back in the middle of an update.
-  base::TimeTicks last_notify_time_;
+  // Whether Init() was called, and the wait for the boot to complete before
+  // it is.
+  bool initialized_{false};
+  std::shared_ptr<BootCompletedWaiter> boot_completed_waiter_;
+  std::unique_ptr<base::FileDescriptorWatcher::Controller>
+      boot_completed_controller_;
+
+  // Throttles the status notifications of progress updates, on the monotonic
+  // time to ensure that notifications are sent even if the system clock is set
+  // back in the middle of an update.
+  ProgressCoalescer progress_coalescer_;
 
   // The processor for running Actions.
   std::unique_ptr<ActionProcessor> processor_;
@@ -293,8 +330,23 @@ class UpdateAttempterAndroid
   metrics_utils::PersistedValue<int64_t> metric_bytes_downloaded_;
   metrics_utils::PersistedValue<int64_t> metric_total_bytes_downloaded_;
 
+  // The phases of the current update attempt, reported when it finishes, and
+  // the monotonic time the phase in progress started at.
+  metrics::UpdatePhaseMetrics phase_metrics_;
+  base::Time phase_start_time_;
+
   bool performance_mode_ = false;
 
+  // Set by the client from the use of the device.
+  MergePolicy merge_policy_ = MergePolicy::kDefault;
+
+  // Applies the resource policy of the phase the update is in.
+  ResourceGovernor resource_governor_;
+
+  // Indexes the hashes of the partitions of the current slot, once there is
+  // no update going on for the first time.
+  std::unique_ptr<SourceHashIndexer> source_hash_indexer_;
+
   DISALLOW_COPY_AND_ASSIGN(UpdateAttempterAndroid);
 };
 
@@ -44,11 +44,14 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/metrics_utils.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/postinstall_runner_action.h"
 #include "update_engine/update_metadata.pb.h"
 
 using base::Time;
 using base::TimeDelta;
 using testing::_;
+using testing::AllOf;
+using testing::Field;
 using update_engine::UpdateStatus;
 
 namespace chromeos_update_engine {
@@ -75,6 +78,10 @@ class UpdateAttempterAndroidTest : public ::testing::Test {
     update_attempter_android_.status_ = status;
   }
 
+  void SetPhaseStartTime(Time time) {
+    update_attempter_android_.phase_start_time_ = time;
+  }
+
   void AddPayload(InstallPlan::Payload&& payload) {
     update_attempter_android_.install_plan_.payloads.push_back(
         std::move(payload));
@@ -186,6 +193,35 @@ TEST_F(UpdateAttempterAndroidTest, ReportMetricsOnUpdateTerminated) {
   EXPECT_TRUE(prefs_.Exists(kPrefsSystemUpdatedMarker));
 }
 
+TEST_F(UpdateAttempterAndroidTest, ReportPhaseMetricsOnUpdateTerminated) {
+  Time start_time = Time::FromInternalValue(1000000);
+  clock_->SetMonotonicTime(start_time);
+  SetPhaseStartTime(start_time);
+  update_attempter_android_.BytesReceived(20, 20, 50);
+  update_attempter_android_.BytesReceived(30, 50, 50);
+
+  // The postinstall step completes 5 seconds after the previous action.
+  clock_->SetMonotonicTime(start_time + TimeDelta::FromSeconds(5));
+  PostinstallRunnerAction postinstall_action(&boot_control_, &hardware_);
+  update_attempter_android_.ActionCompleted(
+      nullptr, &postinstall_action, ErrorCode::kSuccess);
+
+  EXPECT_CALL(
+      *metrics_reporter_,
+      ReportUpdatePhaseMetrics(AllOf(
+          Field(&metrics::UpdatePhaseMetrics::download_bytes, 50),
+          Field(&metrics::UpdatePhaseMetrics::postinstall_duration,
+                TimeDelta::FromSeconds(5)),
+          Field(&metrics::UpdatePhaseMetrics::verify_duration, TimeDelta()))))
+      .Times(1);
+
+  InstallPlan::Payload payload;
+  payload.size = 50;
+  AddPayload(std::move(payload));
+  SetUpdateStatus(UpdateStatus::UPDATE_AVAILABLE);
+  update_attempter_android_.ProcessingDone(nullptr, ErrorCode::kSuccess);
+}
+
 TEST_F(UpdateAttempterAndroidTest, ReportMetricsForBytesDownloaded) {
   // Check both prefs are updated correctly.
   update_attempter_android_.BytesReceived(20, 50, 200);
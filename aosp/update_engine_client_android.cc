@@ -170,6 +170,11 @@ int UpdateEngineClientAndroid::OnInit() {
               "Wait for previous update to merge. "
               "Only available after rebooting to new slot.");
   DEFINE_bool(perf_mode, false, "Enable perf mode.");
+  DEFINE_string(merge_policy,
+                "",
+                "Set when the previous update merges, one of \"default\", "
+                "\"throttled\" while the device is in use, or \"fast\" "
+                "while it is idle.");
   // Boilerplate init commands.
   base::CommandLine::Init(argc_, argv_);
   brillo::FlagHelper::Init(argc_, argv_, "Android Update Engine Client");
@@ -282,6 +287,24 @@ int UpdateEngineClientAndroid::OnInit() {
     return ExitWhenIdle(status);
   }
 
+  if (!FLAGS_merge_policy.empty()) {
+    int32_t policy;
+    if (FLAGS_merge_policy == "default") {
+      policy = android::os::IUpdateEngine::MERGE_POLICY_DEFAULT;
+    } else if (FLAGS_merge_policy == "throttled") {
+      policy = android::os::IUpdateEngine::MERGE_POLICY_THROTTLED;
+    } else if (FLAGS_merge_policy == "fast") {
+      policy = android::os::IUpdateEngine::MERGE_POLICY_FAST;
+    } else {
+      LOG(ERROR) << "Unknown merge policy " << FLAGS_merge_policy;
+      return 1;
+    }
+    Status status = service_->setMergePolicy(policy);
+    // Goes on waiting for the merge with --merge.
+    if (!status.isOk() || !FLAGS_merge)
+      return ExitWhenIdle(status);
+  }
+
   if (FLAGS_merge) {
     // Register a callback object with the service.
     cleanup_callback_ = new UECallback(this);
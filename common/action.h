@@ -21,6 +21,7 @@
 
 #include <memory>
 #include <string>
+#include <utility>
 
 #include <base/logging.h>
 #include <base/macros.h>
@@ -110,11 +111,12 @@ class AbstractAction {
     processor_ = processor;
   }
 
-  // Returns true iff the action is the current action of its ActionProcessor.
+  // Returns true iff the action is one of the actions processing on its
+  // ActionProcessor.
   bool IsRunning() const {
     if (!processor_)
       return false;
-    return processor_->current_action() == this;
+    return processor_->IsActionRunning(this);
   }
 
   // Called on asynchronous actions if canceled. Actions may implement if
@@ -205,6 +207,13 @@ class Action : public AbstractAction {
     out_pipe_->set_contents(out_obj);
   }
 
+  // Moves the object passed into the output pipe, for an Action done with it.
+  void SetOutputObject(
+      typename ActionTraits<SubClass>::OutputObjectType&& out_obj) {
+    CHECK(HasOutputPipe());
+    out_pipe_->set_contents(std::move(out_obj));
+  }
+
   // Returns a reference to the object sitting in the output pipe.
   const typename ActionTraits<SubClass>::OutputObjectType& GetOutputObject() {
     CHECK(HasOutputPipe());
@@ -22,6 +22,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <utility>
 
 #include <base/logging.h>
 #include <base/macros.h>
@@ -64,6 +65,9 @@ class ActionPipe {
   // Stores a copy of the passed object in this pipe.
   void set_contents(const ObjectType& contents) { contents_ = contents; }
 
+  // Moves the passed object into this pipe.
+  void set_contents(ObjectType&& contents) { contents_ = std::move(contents); }
+
   // Bonds two Actions together with a new ActionPipe. The ActionPipe is
   // jointly owned by the two Actions and will be automatically destroyed
   // when the last Action is destroyed.
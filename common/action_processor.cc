@@ -16,16 +16,20 @@
 
 #include "update_engine/common/action_processor.h"
 
+#include <algorithm>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <base/logging.h>
 
 #include "update_engine/common/action.h"
 #include "update_engine/common/error_code_utils.h"
+#include "update_engine/common/trace.h"
 
 using std::string;
 using std::unique_ptr;
+using std::vector;
 
 namespace chromeos_update_engine {
 
@@ -35,33 +39,71 @@ ActionProcessor::~ActionProcessor() {
 }
 
 void ActionProcessor::EnqueueAction(unique_ptr<AbstractAction> action) {
+  // Waits on all the actions before it, for them to run one after the other.
+  vector<const AbstractAction*> dependencies;
+  for (const auto& running : running_actions_)
+    dependencies.push_back(running.get());
+  for (const auto& queued : actions_)
+    dependencies.push_back(queued.action.get());
+  EnqueueAction(std::move(action), std::move(dependencies));
+}
+
+void ActionProcessor::EnqueueAction(
+    unique_ptr<AbstractAction> action,
+    vector<const AbstractAction*> dependencies) {
   action->SetProcessor(this);
-  actions_.push_back(std::move(action));
+  actions_.push_back({std::move(action), std::move(dependencies)});
 }
 
 bool ActionProcessor::IsRunning() const {
-  return current_action_ != nullptr || suspended_;
+  return !running_actions_.empty() || suspended_;
+}
+
+bool ActionProcessor::IsActionRunning(const AbstractAction* action) const {
+  return std::any_of(running_actions_.begin(),
+                     running_actions_.end(),
+                     [action](const unique_ptr<AbstractAction>& running) {
+                       return running.get() == action;
+                     });
+}
+
+bool ActionProcessor::IsReady(const QueuedAction& queued) const {
+  for (const AbstractAction* dependency : queued.dependencies) {
+    if (IsActionRunning(dependency))
+      return false;
+    for (const auto& other : actions_) {
+      if (other.action.get() == dependency)
+        return false;
+    }
+  }
+  return true;
 }
 
 void ActionProcessor::StartProcessing() {
   CHECK(!IsRunning());
-  if (!actions_.empty()) {
-    current_action_ = std::move(actions_.front());
-    actions_.pop_front();
-    LOG(INFO) << "ActionProcessor: starting " << current_action_->Type();
-    current_action_->PerformAction();
+  if (!actions_.empty())
+    StartNextActionOrFinish();
+}
+
+void ActionProcessor::TerminateRunningActions() {
+  // An action may call ActionComplete() while terminating, which ignores the
+  // actions no longer in |running_actions_|.
+  vector<unique_ptr<AbstractAction>> running;
+  running.swap(running_actions_);
+  for (const auto& action : running) {
+    action->TerminateProcessing();
+    UE_TRACE_ASYNC_END(action->Type().c_str(), 0);
   }
 }
 
 void ActionProcessor::StopProcessing() {
   CHECK(IsRunning());
-  if (current_action_) {
-    current_action_->TerminateProcessing();
-  }
-  LOG(INFO) << "ActionProcessor: aborted "
-            << (current_action_ ? current_action_->Type() : "")
+  string types;
+  for (const auto& action : running_actions_)
+    types += (types.empty() ? "" : ", ") + action->Type();
+  TerminateRunningActions();
+  LOG(INFO) << "ActionProcessor: aborted " << types
             << (suspended_ ? " while suspended" : "");
-  current_action_.reset();
   suspended_ = false;
   // Delete all the actions before calling the delegate.
   actions_.clear();
@@ -70,18 +112,25 @@ void ActionProcessor::StopProcessing() {
 }
 
 void ActionProcessor::SuspendProcessing() {
-  // No current_action_ when not suspended means that the action processor was
+  // No running action when not suspended means that the action processor was
   // never started or already finished.
-  if (suspended_ || !current_action_) {
+  if (suspended_ || running_actions_.empty()) {
     LOG(WARNING) << "Called SuspendProcessing while not processing.";
     return;
   }
   suspended_ = true;
 
-  // If there's a current action we should notify it that it should suspend, but
-  // the action can ignore that and terminate at any point.
-  LOG(INFO) << "ActionProcessor: suspending " << current_action_->Type();
-  current_action_->SuspendAction();
+  // The running actions should be notified that they should suspend, but they
+  // can ignore that and terminate at any point.
+  vector<AbstractAction*> running;
+  for (const auto& action : running_actions_)
+    running.push_back(action.get());
+  for (AbstractAction* action : running) {
+    if (!IsActionRunning(action))
+      continue;
+    LOG(INFO) << "ActionProcessor: suspending " << action->Type();
+    action->SuspendAction();
+  }
 }
 
 void ActionProcessor::ResumeProcessing() {
@@ -90,58 +139,102 @@ void ActionProcessor::ResumeProcessing() {
     return;
   }
   suspended_ = false;
-  if (current_action_) {
-    // The current_action_ did not call ActionComplete while suspended, so we
-    // should notify it of the resume operation.
-    LOG(INFO) << "ActionProcessor: resuming " << current_action_->Type();
-    current_action_->ResumeAction();
-  } else {
+  if (running_actions_.empty()) {
     // The last action called ActionComplete while suspended, so there is
     // already a log message with the type of the finished action. We simply
     // state that we are resuming processing and the next function will log the
     // start of the next action or processing completion.
     LOG(INFO) << "ActionProcessor: resuming processing";
-    StartNextActionOrFinish(suspended_error_code_);
   }
+  // The actions which did not call ActionComplete while suspended should be
+  // notified of the resume operation.
+  vector<AbstractAction*> running;
+  for (const auto& action : running_actions_)
+    running.push_back(action.get());
+  for (AbstractAction* action : running) {
+    if (!IsActionRunning(action))
+      continue;
+    LOG(INFO) << "ActionProcessor: resuming " << action->Type();
+    action->ResumeAction();
+  }
+  // Starts the actions whose dependencies completed while suspended.
+  if (!suspended_)
+    StartNextActionOrFinish();
 }
 
 void ActionProcessor::ActionComplete(AbstractAction* actionptr,
                                      ErrorCode code) {
-  CHECK_EQ(actionptr, current_action_.get());
+  auto it = std::find_if(running_actions_.begin(),
+                         running_actions_.end(),
+                         [actionptr](const unique_ptr<AbstractAction>& action) {
+                           return action.get() == actionptr;
+                         });
+  if (it == running_actions_.end()) {
+    // Completed while being terminated.
+    LOG(INFO) << "ActionProcessor: " << actionptr->Type()
+              << " completed while terminated, ignoring.";
+    return;
+  }
   if (delegate_)
     delegate_->ActionCompleted(this, actionptr, code);
-  string old_type = current_action_->Type();
-  current_action_->ActionCompleted(code);
-  current_action_.reset();
-  LOG(INFO) << "ActionProcessor: finished "
-            << (actions_.empty() ? "last action " : "") << old_type
-            << (suspended_ ? " while suspended" : "") << " with code "
-            << utils::ErrorCodeToString(code);
-  if (!actions_.empty() && code != ErrorCode::kSuccess) {
+  string old_type = actionptr->Type();
+  actionptr->ActionCompleted(code);
+  UE_TRACE_ASYNC_END(old_type.c_str(), 0);
+  // Looks the action up again, the delegate may have stopped the processing.
+  it = std::find_if(running_actions_.begin(),
+                    running_actions_.end(),
+                    [actionptr](const unique_ptr<AbstractAction>& action) {
+                      return action.get() == actionptr;
+                    });
+  if (it == running_actions_.end())
+    return;
+  running_actions_.erase(it);
+  bool last = actions_.empty() && running_actions_.empty();
+  LOG(INFO) << "ActionProcessor: finished " << (last ? "last action " : "")
+            << old_type << (suspended_ ? " while suspended" : "")
+            << " with code " << utils::ErrorCodeToString(code);
+  if (!last && code != ErrorCode::kSuccess) {
     LOG(INFO) << "ActionProcessor: Aborting processing due to failure.";
     actions_.clear();
+    TerminateRunningActions();
   }
+  last_error_code_ = code;
   if (suspended_) {
-    // If an action finished while suspended we don't start the next action (or
-    // terminate the processing) until the processor is resumed. This condition
-    // will be flagged by a nullptr current_action_ while suspended_ is true.
-    suspended_error_code_ = code;
+    // If an action finished while suspended we don't start the next actions
+    // (or terminate the processing) until the processor is resumed.
     return;
   }
-  StartNextActionOrFinish(code);
+  StartNextActionOrFinish();
 }
 
-void ActionProcessor::StartNextActionOrFinish(ErrorCode code) {
-  if (actions_.empty()) {
-    if (delegate_) {
-      delegate_->ProcessingDone(this, code);
-    }
+void ActionProcessor::StartNextActionOrFinish() {
+  // An action completing during its PerformAction() gets back here, leaving
+  // the loop below to go on.
+  if (starting_actions_)
     return;
+  starting_actions_ = true;
+  while (!suspended_) {
+    auto it = std::find_if(
+        actions_.begin(), actions_.end(), [this](const QueuedAction& queued) {
+          return IsReady(queued);
+        });
+    if (it == actions_.end())
+      break;
+    AbstractAction* action = it->action.get();
+    running_actions_.push_back(std::move(it->action));
+    actions_.erase(it);
+    LOG(INFO) << "ActionProcessor: starting " << action->Type();
+    UE_TRACE_ASYNC_BEGIN(action->Type().c_str(), 0);
+    action->PerformAction();
   }
-  current_action_ = std::move(actions_.front());
-  actions_.pop_front();
-  LOG(INFO) << "ActionProcessor: starting " << current_action_->Type();
-  current_action_->PerformAction();
+  starting_actions_ = false;
+  if (suspended_ || !running_actions_.empty())
+    return;
+  // Dependencies are enqueued before the actions waiting on them, so there is
+  // always one ready while some are queued.
+  DCHECK(actions_.empty());
+  if (delegate_)
+    delegate_->ProcessingDone(this, last_error_code_);
 }
 
 }  // namespace chromeos_update_engine
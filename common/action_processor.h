@@ -36,6 +36,8 @@
 // See action.h for an overview of this class and other Action* classes.
 
 // An ActionProcessor keeps a queue of Actions and processes them in order.
+// Actions may instead be enqueued with the actions they depend on, in which
+// case those not depending on each other run at the same time.
 
 namespace chromeos_update_engine {
 
@@ -48,19 +50,19 @@ class ActionProcessor {
 
   virtual ~ActionProcessor();
 
-  // Starts processing the first Action in the queue. If there's a delegate,
-  // when all processing is complete, ProcessingDone() will be called on the
-  // delegate.
+  // Starts processing the Actions in the queue which don't wait on another.
+  // If there's a delegate, when all processing is complete, ProcessingDone()
+  // will be called on the delegate.
   virtual void StartProcessing();
 
-  // Aborts processing. If an Action is running, it will have
-  // TerminateProcessing() called on it. The Action that was running and all the
-  // remaining actions will be lost and must be re-enqueued if this Processor is
-  // to use it.
+  // Aborts processing. The Actions running will have TerminateProcessing()
+  // called on them. The Actions that were running and all the remaining
+  // actions will be lost and must be re-enqueued if this Processor is to use
+  // them.
   void StopProcessing();
 
-  // Suspend the processing. If an Action is running, it will have the
-  // SuspendProcessing() called on it, and it should suspend operations until
+  // Suspend the processing. The Actions running will have the
+  // SuspendProcessing() called on them, and should suspend operations until
   // ResumeProcessing() is called on this class to continue. While suspended,
   // no new actions will be started. Calling SuspendProcessing while the
   // processing is suspended or not running this method performs no action.
@@ -74,15 +76,29 @@ class ActionProcessor {
   // stopped.
   bool IsRunning() const;
 
-  // Adds another Action to the end of the queue.
+  // Adds another Action to the end of the queue, started once all the
+  // actions enqueued before it completed.
   virtual void EnqueueAction(std::unique_ptr<AbstractAction> action);
 
+  // Adds another Action to the queue, started once the actions in
+  // |dependencies|, which must have been enqueued before it, completed. An
+  // Action without dependencies starts right away. An Action failing aborts
+  // the processing, terminating the others still running.
+  void EnqueueAction(std::unique_ptr<AbstractAction> action,
+                     std::vector<const AbstractAction*> dependencies);
+
   // Sets/gets the current delegate. Set to null to remove a delegate.
   ActionProcessorDelegate* delegate() const { return delegate_; }
   void set_delegate(ActionProcessorDelegate* delegate) { delegate_ = delegate; }
 
-  // Returns a pointer to the current Action that's processing.
-  AbstractAction* current_action() const { return current_action_.get(); }
+  // Returns a pointer to the current Action that's processing, the earliest
+  // enqueued of them if several are.
+  AbstractAction* current_action() const {
+    return running_actions_.empty() ? nullptr : running_actions_.front().get();
+  }
+
+  // Returns whether |action| is one of the Actions processing.
+  bool IsActionRunning(const AbstractAction* action) const;
 
   // Called by an action to notify processor that it's done. Caller passes self.
   // But this call deletes the action if there no other object has a reference
@@ -93,22 +109,42 @@ class ActionProcessor {
  private:
   FRIEND_TEST(ActionProcessorTest, ChainActionsTest);
 
-  // Continue processing actions (if any) after the last action terminated with
-  // the passed error code. If there are no more actions to process, the
-  // processing will terminate.
-  void StartNextActionOrFinish(ErrorCode code);
+  FRIEND_TEST(ActionProcessorTest, DependenciesTest);
+
+  // An Action waiting to be processed, and those it waits on.
+  struct QueuedAction {
+    std::unique_ptr<AbstractAction> action;
+    std::vector<const AbstractAction*> dependencies;
+  };
+
+  // Continue processing actions (if any) after the last action terminated,
+  // starting those whose dependencies completed. If there are no more actions
+  // to process, the processing will terminate with |last_error_code_|.
+  void StartNextActionOrFinish();
+
+  // Returns whether the dependencies of |queued| all completed, none of them
+  // being queued or running anymore.
+  bool IsReady(const QueuedAction& queued) const;
+
+  // Terminates the Actions running, and forgets about them.
+  void TerminateRunningActions();
 
   // Actions that have not yet begun processing, in the order in which
-  // they'll be processed.
-  std::deque<std::unique_ptr<AbstractAction>> actions_;
+  // they were enqueued.
+  std::deque<QueuedAction> actions_;
 
-  // A pointer to the currently processing Action, if any.
-  std::unique_ptr<AbstractAction> current_action_;
+  // The currently processing Actions, in the order in which they were
+  // enqueued.
+  std::vector<std::unique_ptr<AbstractAction>> running_actions_;
 
-  // The ErrorCode reported by an action that was suspended but finished while
-  // being suspended. This error code is stored here to be reported back to the
+  // The ErrorCode reported by the last action completed. When the action
+  // finished while the processing was suspended, it is reported back to the
   // delegate once the processor is resumed.
-  ErrorCode suspended_error_code_{ErrorCode::kSuccess};
+  ErrorCode last_error_code_{ErrorCode::kSuccess};
+
+  // Whether StartNextActionOrFinish() is starting actions, which may complete
+  // during their PerformAction().
+  bool starting_actions_{false};
 
   // Whether the action processor is or should be suspended.
   bool suspended_{false};
@@ -165,9 +165,9 @@ TEST_F(ActionProcessorTest, ChainActionsTest) {
   action_processor_.EnqueueAction(std::move(action2));
 
   EXPECT_EQ(action_processor_.actions_.size(), 3u);
-  EXPECT_EQ(action_processor_.actions_[0].get(), action0_ptr);
-  EXPECT_EQ(action_processor_.actions_[1].get(), action1_ptr);
-  EXPECT_EQ(action_processor_.actions_[2].get(), action2_ptr);
+  EXPECT_EQ(action_processor_.actions_[0].action.get(), action0_ptr);
+  EXPECT_EQ(action_processor_.actions_[1].action.get(), action1_ptr);
+  EXPECT_EQ(action_processor_.actions_[2].action.get(), action2_ptr);
 
   action_processor_.StartProcessing();
   EXPECT_EQ(action0_ptr, action_processor_.current_action());
@@ -268,4 +268,97 @@ TEST_F(ActionProcessorTest, StoppedWhileSuspendedTest) {
   EXPECT_EQ(nullptr, action_processor_.current_action());
 }
 
+TEST_F(ActionProcessorTest, DependenciesTest) {
+  action_processor_.set_delegate(nullptr);
+
+  auto action0 = std::make_unique<ActionProcessorTestAction>();
+  auto action1 = std::make_unique<ActionProcessorTestAction>();
+  auto action2 = std::make_unique<ActionProcessorTestAction>();
+  auto action0_ptr = action0.get();
+  auto action1_ptr = action1.get();
+  auto action2_ptr = action2.get();
+  action_processor_.EnqueueAction(std::move(action0), {});
+  action_processor_.EnqueueAction(std::move(action1), {});
+  action_processor_.EnqueueAction(std::move(action2),
+                                  {action0_ptr, action1_ptr});
+
+  // The two independent actions run at the same time.
+  action_processor_.StartProcessing();
+  EXPECT_TRUE(action0_ptr->IsRunning());
+  EXPECT_TRUE(action1_ptr->IsRunning());
+  EXPECT_EQ(action0_ptr, action_processor_.current_action());
+  EXPECT_EQ(action_processor_.actions_.size(), 1u);
+
+  // The last one waits on both.
+  action1_ptr->CompleteAction();
+  EXPECT_EQ(action0_ptr, action_processor_.current_action());
+  EXPECT_EQ(action_processor_.actions_.size(), 1u);
+  action0_ptr->CompleteAction();
+  EXPECT_EQ(action2_ptr, action_processor_.current_action());
+  EXPECT_TRUE(action_processor_.actions_.empty());
+
+  action2_ptr->CompleteAction();
+  EXPECT_EQ(nullptr, action_processor_.current_action());
+  EXPECT_FALSE(action_processor_.IsRunning());
+}
+
+TEST_F(ActionProcessorTest, FailureTerminatesRunningActionsTest) {
+  auto next_action = std::make_unique<ActionProcessorTestAction>();
+  auto next_action_ptr = next_action.get();
+  action_processor_.EnqueueAction(std::move(mock_action_), {});
+  action_processor_.EnqueueAction(std::move(action_), {});
+  action_processor_.EnqueueAction(std::move(next_action),
+                                  {mock_action_ptr_, action_ptr_});
+
+  EXPECT_CALL(*mock_action_ptr_, PerformAction());
+  action_processor_.StartProcessing();
+  EXPECT_TRUE(mock_action_ptr_->IsRunning());
+  EXPECT_TRUE(action_ptr_->IsRunning());
+  EXPECT_FALSE(next_action_ptr->IsRunning());
+
+  // The other action running is terminated, and the one waiting dropped.
+  EXPECT_CALL(*mock_action_ptr_, TerminateProcessing());
+  action_processor_.ActionComplete(action_ptr_, ErrorCode::kError);
+  EXPECT_TRUE(delegate_.processing_done_called_);
+  EXPECT_EQ(ErrorCode::kError, delegate_.action_exit_code_);
+  EXPECT_FALSE(action_processor_.IsRunning());
+  EXPECT_EQ(nullptr, action_processor_.current_action());
+}
+
+TEST_F(ActionProcessorTest, SuspendResumeRunningActionsTest) {
+  auto mock_action2 = std::make_unique<testing::StrictMock<MockAction>>();
+  auto mock_action2_ptr = mock_action2.get();
+  EXPECT_CALL(*mock_action2_ptr, Type()).Times(testing::AnyNumber());
+  action_processor_.EnqueueAction(std::move(mock_action_), {});
+  action_processor_.EnqueueAction(std::move(mock_action2), {});
+
+  EXPECT_CALL(*mock_action_ptr_, PerformAction());
+  EXPECT_CALL(*mock_action2_ptr, PerformAction());
+  action_processor_.StartProcessing();
+
+  EXPECT_CALL(*mock_action_ptr_, SuspendAction());
+  EXPECT_CALL(*mock_action2_ptr, SuspendAction());
+  action_processor_.SuspendProcessing();
+
+  // The action completed while suspended isn't resumed, and the processing
+  // only finishes once the other one completes after the resume.
+  action_processor_.ActionComplete(mock_action_ptr_, ErrorCode::kSuccess);
+  EXPECT_CALL(*mock_action2_ptr, ResumeAction());
+  action_processor_.ResumeProcessing();
+  EXPECT_FALSE(delegate_.processing_done_called_);
+  EXPECT_TRUE(action_processor_.IsRunning());
+
+  action_processor_.set_delegate(nullptr);
+  action_processor_.ActionComplete(mock_action2_ptr, ErrorCode::kSuccess);
+  EXPECT_FALSE(action_processor_.IsRunning());
+}
+
+TEST_F(ActionProcessorTest, MoveOutputObjectTest) {
+  ActionProcessorTestAction action;
+  BondActions(action_.get(), &action);
+  string output(1000, 'x');
+  action_->SetOutputObject(std::move(output));
+  EXPECT_EQ(string(1000, 'x'), action.GetInputObject());
+}
+
 }  // namespace chromeos_update_engine
@@ -19,12 +19,28 @@
 
 namespace chromeos_update_engine {
 
+// When the snapshots of the previous update are merged, depending on the use
+// of the device.
+enum class MergePolicy {
+  // The merge starts once the boot completed, after the merge delay of the
+  // device if any.
+  kDefault = 0,
+  // The device is in interactive use: the merge is held off, for at most
+  // CleanupPreviousUpdateAction::kMaxMergeDeferral.
+  kThrottled = 1,
+  // The device is idle, with the screen off or charging: the merge starts
+  // right away, without the merge delay of the device.
+  kFast = 2,
+};
+
 // Delegate interface for CleanupPreviousUpdateAction.
 class CleanupPreviousUpdateActionDelegateInterface {
  public:
   virtual ~CleanupPreviousUpdateActionDelegateInterface() {}
   // |progress| is within [0, 1]
   virtual void OnCleanupProgressUpdate(double progress) = 0;
+  // The current merge policy.
+  virtual MergePolicy GetMergePolicy() = 0;
 };
 
 }  // namespace chromeos_update_engine
@@ -134,6 +134,12 @@ static constexpr const auto& kPrefsUpdateStateNextDataOffset =
     "update-state-next-data-offset";
 static constexpr const auto& kPrefsUpdateStateNextOperation =
     "update-state-next-operation";
+static constexpr const auto& kPrefsUpdateStatePartialOperationBytes =
+    "update-state-partial-operation-bytes";
+static constexpr const auto& kPrefsUpdateStatePartialOperationHashContext =
+    "update-state-partial-operation-hash-context";
+static constexpr const auto& kPrefsUpdateStateOperationsSection =
+    "update-state-operations-section";
 static constexpr const auto& kPrefsUpdateStatePayloadIndex =
     "update-state-payload-index";
 static constexpr const auto& kPrefsUpdateStateSHA256Context =
@@ -146,7 +152,13 @@ static constexpr const auto& kPrefsUpdateBootTimestampStart =
     "update-boot-timestamp-start";
 static constexpr const auto& kPrefsUpdateTimestampStart =
     "update-timestamp-start";
+static constexpr const auto& kPrefsSourceHashIndex = "source-hash-index";
+static constexpr const auto& kPrefsSpillCacheBegin = "spill-cache-begin";
+static constexpr const auto& kPrefsSpillCacheEnd = "spill-cache-end";
+static constexpr const auto& kPrefsSpillCachePath = "spill-cache-path";
 static constexpr const auto& kPrefsUrlSwitchCount = "url-switch-count";
+static constexpr const auto& kPrefsVabcCompressionDisabled =
+    "vabc-compression-disabled";
 static constexpr const auto& kPrefsVerityWritten = "verity-written";
 static constexpr const auto& kPrefsWallClockScatteringWaitPeriod =
     "wall-clock-wait-period";
@@ -180,15 +192,96 @@ static constexpr const auto& kPayloadPropertyNetworkProxy = "NETWORK_PROXY";
 // Set Virtual AB Compression's compression algorithm to "none", but still use
 // userspace snapshots and snapuserd for update installation.
 static constexpr const auto& kPayloadVABCNone = "VABC_NONE";
+// Set the compression algorithm of Virtual AB Compression to "none" if there
+// is plenty of space for the uncompressed COW
+static constexpr const auto& kPayloadVABCAutoCompression =
+    "VABC_AUTO_COMPRESSION";
 // Enable/Disable VABC, falls back on plain VAB
 static constexpr const auto& kPayloadDisableVABC = "DISABLE_VABC";
 // Enable multi-threaded compression for VABC
 static constexpr const auto& kPayloadEnableThreading = "ENABLE_THREADING";
 // Enable batched writes for VABC
 static constexpr const auto& kPayloadBatchedWrites = "BATCHED_WRITES";
+// Apply install operations in the background while downloading
+static constexpr const auto& kPayloadPipelinedApply = "PIPELINED_APPLY";
+// Number of threads applying install operations with PIPELINED_APPLY
+static constexpr const auto& kPayloadApplyWorkers = "APPLY_WORKERS";
+// Use io_uring for batched partition I/O
+static constexpr const auto& kPayloadUseIoUring = "USE_IO_URING";
+// Read and write partitions with O_DIRECT, bypassing the page cache
+static constexpr const auto& kPayloadUseDirectIo = "USE_DIRECT_IO";
+// Number of partitions hashed concurrently after the update is applied
+static constexpr const auto& kPayloadVerifyWorkers = "VERIFY_WORKERS";
+// Hash each partition in the background as soon as it was written
+static constexpr const auto& kPayloadOverlapVerification =
+    "OVERLAP_VERIFICATION";
+// Apply large REPLACE operations while their data is still being received
+static constexpr const auto& kPayloadStreamReplace = "STREAM_REPLACE";
+// Size in MiB of the cache of source partition blocks
+static constexpr const auto& kPayloadSourceCacheMb = "SOURCE_CACHE_MB";
+// Number of operations, and MiB of their source data, read ahead
+static constexpr const auto& kPayloadSourcePrefetchOps = "SOURCE_PREFETCH_OPS";
+static constexpr const auto& kPayloadSourcePrefetchMb = "SOURCE_PREFETCH_MB";
+// MiB of target partition writes combined before being written out
+static constexpr const auto& kPayloadWriteCombineMb = "WRITE_COMBINE_MB";
+// MiB of source data of consecutive SOURCE_COPY operations applied at once
+static constexpr const auto& kPayloadSourceCopyBatchMb = "SOURCE_COPY_BATCH_MB";
+// Copy SOURCE_COPY blocks with copy_file_range() where the kernel supports it
+static constexpr const auto& kPayloadKernelCopy = "KERNEL_COPY";
+// Read the source partitions through their dm-verity devices, which the
+// kernel checks, instead of checking the source hashes of the operations
+static constexpr const auto& kPayloadVeritySourceReads = "VERITY_SOURCE_READS";
+// Update the FEC data of the partitions from the one of the source partitions
+static constexpr const auto& kPayloadFecFromSource = "FEC_FROM_SOURCE";
+// Update the hash trees of the partitions from the ones of the source
+// partitions
+static constexpr const auto& kPayloadHashTreeFromSource =
+    "HASH_TREE_FROM_SOURCE";
+// Check the partitions against the root digest of the hash tree built while
+// writing their verity data instead of hashing them again
+static constexpr const auto& kPayloadVerityRootVerification =
+    "VERITY_ROOT_VERIFICATION";
+// MiB of partition data held in memory for encoding the FEC data without
+// reading it again
+static constexpr const auto& kPayloadFecBufferMb = "FEC_BUFFER_MB";
+// Drop the partitions verified from the page cache, and read ahead the files
+// their postinstall programs read instead
+static constexpr const auto& kPayloadPostinstallCacheWarming =
+    "POSTINSTALL_CACHE_WARMING";
+// Build the hash tree of the VABC partitions from the data written to their
+// COW image, reading only the blocks not written back for it
+static constexpr const auto& kPayloadInlineHashTree = "INLINE_HASH_TREE";
+// Shrink the memory held to apply the payload while the device is short of it
+static constexpr const auto& kPayloadMemoryPressureAware =
+    "MEMORY_PRESSURE_AWARE";
+// Receive the payload in a cache file ahead of the apply, so that the apply
+// doesn't hold back the download and a resume doesn't download it again
+static constexpr const auto& kPayloadSpillPayload = "SPILL_PAYLOAD";
+// MiB of blocks queued up to be compressed into the COW image on a worker
+static constexpr const auto& kPayloadCowWriteQueueMb = "COW_WRITE_QUEUE_MB";
+// Emit trace sections for the actions, the install operations and their
+// phases, and the checkpoints, fsyncs, hashing and COW writes of the update
+static constexpr const auto& kPayloadTraceOperations = "TRACE_OPERATIONS";
+// Map local payload files in memory instead of reading them
+static constexpr const auto& kPayloadMmapPayload = "MMAP_PAYLOAD";
+// MiB of REPLACE operation data after which its progress is checkpointed
+static constexpr const auto& kPayloadReplaceCheckpointMb =
+    "REPLACE_CHECKPOINT_MB";
 
 // Max retry count for download
 static constexpr const auto& kPayloadDownloadRetry = "DOWNLOAD_RETRY";
+// Set to ask the servers to compress the payload in transit, which makes the
+// metadata of large payloads quicker to download on slow links
+static constexpr const auto& kPayloadCompressedTransfer =
+    "COMPRESSED_TRANSFER";
+// Number of connections the payload is downloaded over at once
+static constexpr const auto& kPayloadDownloadConnections =
+    "DOWNLOAD_CONNECTIONS";
+// Comma separated URLs of mirrors of the payload, downloaded from at once
+static constexpr const auto& kPayloadDownloadMirrors = "DOWNLOAD_MIRRORS";
+// URL of a copy of the payload on the local network, such as a cache or a
+// peer, the data blobs are downloaded from when they match their hash
+static constexpr const auto& kPayloadPeerCacheUrl = "PEER_CACHE_URL";
 
 // Set "SWITCH_SLOT_ON_REBOOT=0" to skip marking the updated partitions active.
 // The default is 1 (always switch slot if update succeeded).
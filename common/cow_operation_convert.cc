@@ -32,57 +32,114 @@ void push_back(std::vector<CowOperation>* converted, const CowOperation& op) {
   }
 }
 
-std::vector<CowOperation> ConvertToCowOperations(
+CowOperationGenerator::CowOperationGenerator(
     const ::google::protobuf::RepeatedPtrField<
         ::chromeos_update_engine::InstallOperation>& operations,
     const ::google::protobuf::RepeatedPtrField<CowMergeOperation>&
-        merge_operations) {
-  ExtentRanges merge_extents;
-  std::vector<CowOperation> converted;
+        merge_operations)
+    : operations_(operations), merge_operations_(merge_operations) {
+  for (const auto& merge_op : merge_operations_) {
+    if (merge_op.type() == CowMergeOperation::COW_COPY) {
+      merge_extents_.AddExtent(merge_op.dst_extent());
+    }
+  }
+}
 
+bool CowOperationGenerator::Next(CowOperation* op) {
   // We want all CowCopy ops to be done first, before any COW_REPLACE happen.
-  // Therefore we add these ops in 2 separate loops. This is because during
-  // merge, a CowReplace might modify a block needed by CowCopy, so we always
-  // perform CowCopy first.
+  // This is because during merge, a CowReplace might modify a block needed by
+  // CowCopy, so we always perform CowCopy first.
+  if (NextCopy(op)) {
+    return true;
+  }
+  CowOperation block;
+  while (NextReplaceBlock(&block)) {
+    if (!pending_replace_) {
+      pending_replace_ = block;
+    } else if (IsConsecutive(*pending_replace_, block)) {
+      pending_replace_->block_count += block.block_count;
+    } else {
+      *op = *pending_replace_;
+      pending_replace_ = block;
+      return true;
+    }
+  }
+  if (pending_replace_) {
+    *op = *pending_replace_;
+    pending_replace_.reset();
+    return true;
+  }
+  return false;
+}
 
-  // This loop handles CowCopy blocks within SOURCE_COPY, and the next loop
-  // converts the leftover blocks to CowReplace?
-  for (const auto& merge_op : merge_operations) {
-    if (merge_op.type() != CowMergeOperation::COW_COPY) {
-      continue;
+bool CowOperationGenerator::NextCopy(CowOperation* op) {
+  while (merge_blocks_left_ == 0) {
+    if (merge_op_index_ >= merge_operations_.size()) {
+      return false;
+    }
+    if (merge_operations_[merge_op_index_].type() ==
+        CowMergeOperation::COW_COPY) {
+      merge_blocks_left_ =
+          merge_operations_[merge_op_index_].src_extent().num_blocks();
     }
-    merge_extents.AddExtent(merge_op.dst_extent());
-    const auto& src_extent = merge_op.src_extent();
-    const auto& dst_extent = merge_op.dst_extent();
-    // Add blocks in reverse order, because snapused specifically prefers this
-    // ordering. Since we already eliminated all self-overlapping SOURCE_COPY
-    // during delta generation, this should be safe to do.
-    for (uint64_t i = src_extent.num_blocks(); i > 0; i--) {
-      auto src_block = src_extent.start_block() + i - 1;
-      auto dst_block = dst_extent.start_block() + i - 1;
-      converted.push_back({CowOperation::CowCopy, src_block, dst_block, 1});
+    if (merge_blocks_left_ == 0) {
+      merge_op_index_++;
     }
   }
-  // COW_REPLACE are added after COW_COPY, because replace might modify blocks
-  // needed by COW_COPY. Please don't merge this loop with the previous one.
-  for (const auto& operation : operations) {
-    if (operation.type() != InstallOperation::SOURCE_COPY) {
-      continue;
+  const auto& merge_op = merge_operations_[merge_op_index_];
+  // Add blocks in reverse order, because snapused specifically prefers this
+  // ordering. Since we already eliminated all self-overlapping SOURCE_COPY
+  // during delta generation, this should be safe to do.
+  merge_blocks_left_--;
+  *op = {CowOperation::CowCopy,
+         merge_op.src_extent().start_block() + merge_blocks_left_,
+         merge_op.dst_extent().start_block() + merge_blocks_left_,
+         1};
+  if (merge_blocks_left_ == 0) {
+    merge_op_index_++;
+  }
+  return true;
+}
+
+bool CowOperationGenerator::NextReplaceBlock(CowOperation* op) {
+  while (true) {
+    if (!src_it_) {
+      while (op_index_ < operations_.size() &&
+             operations_[op_index_].type() != InstallOperation::SOURCE_COPY) {
+        op_index_++;
+      }
+      if (op_index_ >= operations_.size()) {
+        return false;
+      }
+      src_it_.emplace(operations_[op_index_].src_extents());
+      dst_it_.emplace(operations_[op_index_].dst_extents());
     }
-    const auto& src_extents = operation.src_extents();
-    const auto& dst_extents = operation.dst_extents();
-    BlockIterator it1{src_extents};
-    BlockIterator it2{dst_extents};
-    while (!it1.is_end() && !it2.is_end()) {
-      const auto src_block = *it1;
-      const auto dst_block = *it2;
-      if (!merge_extents.ContainsBlock(dst_block)) {
-        push_back(&converted,
-                  {CowOperation::CowReplace, src_block, dst_block, 1});
+    while (!src_it_->is_end() && !dst_it_->is_end()) {
+      const auto src_block = **src_it_;
+      const auto dst_block = **dst_it_;
+      ++*src_it_;
+      ++*dst_it_;
+      if (!merge_extents_.ContainsBlock(dst_block)) {
+        *op = {CowOperation::CowReplace, src_block, dst_block, 1};
+        return true;
       }
-      ++it1;
-      ++it2;
     }
+    src_it_.reset();
+    dst_it_.reset();
+    op_index_++;
+  }
+}
+
+std::vector<CowOperation> ConvertToCowOperations(
+    const ::google::protobuf::RepeatedPtrField<
+        ::chromeos_update_engine::InstallOperation>& operations,
+    const ::google::protobuf::RepeatedPtrField<CowMergeOperation>&
+        merge_operations) {
+  CowOperationGenerator generator(operations, merge_operations);
+  std::vector<CowOperation> converted;
+  CowOperation op;
+  while (generator.Next(&op)) {
+    converted.push_back(op);
   }
   return converted;
 }
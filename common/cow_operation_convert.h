@@ -17,10 +17,13 @@
 #ifndef __COW_OPERATION_CONVERT_H
 #define __COW_OPERATION_CONVERT_H
 
+#include <optional>
 #include <vector>
 
 #include <libsnapshot/cow_format.h>
 
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -59,6 +62,46 @@ constexpr bool IsConsecutive(const CowOperation& op1, const CowOperation& op2) {
          op1.src_block + op1.block_count == op2.src_block;
 }
 
+// Yields the CowOperations ConvertToCowOperations() returns, in the same
+// order, one at a time. Only the destination extents of the COW_COPY merge
+// operations are held in memory, so partitions with millions of blocks can be
+// converted without building the whole list, and its first operations can be
+// used right away. |operations| and |merge_operations| must outlive it.
+class CowOperationGenerator {
+ public:
+  CowOperationGenerator(
+      const ::google::protobuf::RepeatedPtrField<
+          ::chromeos_update_engine::InstallOperation>& operations,
+      const ::google::protobuf::RepeatedPtrField<CowMergeOperation>&
+          merge_operations);
+
+  // Stores the next CowOperation in |op| and returns true, or returns false
+  // once all of them were yielded.
+  bool Next(CowOperation* op);
+
+ private:
+  // Yields the COW_COPY blocks of the merge operations.
+  bool NextCopy(CowOperation* op);
+  // Yields the SOURCE_COPY blocks not covered by them, one at a time.
+  bool NextReplaceBlock(CowOperation* op);
+
+  const ::google::protobuf::RepeatedPtrField<
+      ::chromeos_update_engine::InstallOperation>& operations_;
+  const ::google::protobuf::RepeatedPtrField<CowMergeOperation>&
+      merge_operations_;
+  ExtentRanges merge_extents_;
+
+  // The next merge operation, and how many of its blocks are left.
+  int merge_op_index_{0};
+  uint64_t merge_blocks_left_{0};
+  // The next SOURCE_COPY operation, and where its blocks are at.
+  int op_index_{0};
+  std::optional<BlockIterator> src_it_;
+  std::optional<BlockIterator> dst_it_;
+  // The COW_REPLACE run the next blocks may still be added to.
+  std::optional<CowOperation> pending_replace_;
+};
+
 void push_back(std::vector<CowOperation>* converted, const CowOperation& op);
 
 }  // namespace chromeos_update_engine
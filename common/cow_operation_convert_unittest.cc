@@ -297,4 +297,38 @@ TEST_F(CowOperationConvertTest, CowReplaceDifferenceSrc) {
   VerifyCowMergeOp(cow_ops);
 }
 
+// The generator yields the operations one at a time, COW_COPY first, and
+// coalesces COW_REPLACE across install operations.
+TEST_F(CowOperationConvertTest, Generator) {
+  AddOperation(
+      &operations_, InstallOperation::SOURCE_COPY, {{30, 4}}, {{0, 4}});
+  AddOperation(&operations_, InstallOperation::REPLACE, {}, {{10, 1}});
+  AddOperation(
+      &operations_, InstallOperation::SOURCE_COPY, {{34, 2}}, {{4, 2}});
+  AddMergeOperation(
+      &merge_operations_, CowMergeOperation::COW_COPY, {30, 2}, {0, 2});
+  AddMergeOperation(
+      &merge_operations_, CowMergeOperation::COW_XOR, {50, 1}, {20, 1});
+
+  CowOperationGenerator generator(operations_, merge_operations_);
+  std::vector<CowOperation> cow_ops;
+  CowOperation op;
+  while (generator.Next(&op)) {
+    cow_ops.push_back(op);
+  }
+  ASSERT_EQ(cow_ops.size(), 3UL);
+  ASSERT_EQ(cow_ops[0].op, CowOperation::CowCopy);
+  ASSERT_EQ(cow_ops[0].src_block, 31UL);
+  ASSERT_EQ(cow_ops[0].dst_block, 1UL);
+  ASSERT_EQ(cow_ops[1].op, CowOperation::CowCopy);
+  ASSERT_EQ(cow_ops[1].src_block, 30UL);
+  ASSERT_EQ(cow_ops[1].dst_block, 0UL);
+  ASSERT_EQ(cow_ops[2].op, CowOperation::CowReplace);
+  ASSERT_EQ(cow_ops[2].src_block, 32UL);
+  ASSERT_EQ(cow_ops[2].dst_block, 2UL);
+  ASSERT_EQ(cow_ops[2].block_count, 4UL);
+  ASSERT_FALSE(generator.Next(&op));
+  VerifyCowMergeOp(cow_ops);
+}
+
 }  // namespace chromeos_update_engine
@@ -25,9 +25,14 @@
 #include <string>
 #include <utility>
 
+#include <base/time/time.h>
+#include <brillo/message_loops/message_loop.h>
+
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/http_fetcher.h"
 #include "update_engine/common/multi_range_http_fetcher.h"
+#include "update_engine/common/payload_spill_cache.h"
+#include "update_engine/common/resource_governor.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_consumer/install_plan.h"
 
@@ -59,6 +64,12 @@ class DownloadActionDelegate {
   // while applying or downloading the partial payload will result in this
   // method not being called.
   virtual void DownloadComplete() = 0;
+
+  // Called periodically while downloading with the rates, in bytes per
+  // second, at which the payload was received and applied over the last
+  // period. The download is paused while the apply is too far behind.
+  virtual void ThroughputUpdated(uint64_t received_bytes_per_second,
+                                 uint64_t applied_bytes_per_second) {}
 };
 
 class PrefsInterface;
@@ -108,6 +119,11 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
 
   void set_base_offset(int64_t base_offset) { base_offset_ = base_offset; }
 
+  // Limits the download to the rate of the policy |governor| applies, if any.
+  void set_resource_governor(const ResourceGovernor* governor) {
+    resource_governor_ = governor;
+  }
+
   HttpFetcher* http_fetcher() { return http_fetcher_.get(); }
 
  private:
@@ -118,6 +134,65 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   // Start downloading the current payload using delta_performer.
   void StartDownloading();
 
+  // Passes |length| bytes of the payload to |delta_performer_|. Terminates
+  // the processing and returns false if it fails.
+  bool WriteToDeltaPerformer(const void* bytes, size_t length);
+
+  // Completes the action once the transfer ended and everything received
+  // was applied.
+  void CompleteDownload(bool successful);
+
+  // Opens |spill_cache_| to receive the payload from |offset| on when
+  // |install_plan_.spill_payload| is set, and applies it from there. Returns
+  // the offset to download the rest of the payload from, past the bytes an
+  // earlier attempt cached, or |offset| if there is no cache.
+  uint64_t StartSpillCache(uint64_t offset);
+
+  // Applies the next bytes of |spill_cache_|, and goes on later while there
+  // are more of them. Completes the download once all of them were applied
+  // after the transfer completed.
+  void ApplySpilledBytes();
+
+  // Posts a call to ApplySpilledBytes() after |delay|, unless one is pending.
+  void ScheduleSpilledApply(base::TimeDelta delay = base::TimeDelta());
+
+  // Stops applying from |spill_cache_|, and closes it with the bytes received
+  // recorded for a later attempt.
+  void StopSpillCache();
+
+  // Pauses the transfer while too much of the received data is queued to be
+  // applied, instead of holding more of it in memory.
+  void UpdateFlowControl();
+
+  // Resumes the transfer paused by UpdateFlowControl() once the apply caught
+  // up, or checks again later.
+  void CheckQueuedBytes();
+
+  // Forgets about the transfer being paused by UpdateFlowControl() and
+  // UpdateRateLimit().
+  void StopFlowControl();
+
+  // Whether any of SuspendAction(), UpdateFlowControl() and UpdateRateLimit()
+  // wants the transfer paused.
+  bool IsTransferPaused() const {
+    return suspended_ || throttled_ || rate_limited_;
+  }
+
+  // Accounts for |length| more bytes received, and pauses the transfer while
+  // it is ahead of the rate limit of the resource policy.
+  void UpdateRateLimit(size_t length);
+
+  // Resumes the transfer paused by UpdateRateLimit().
+  void EndRateLimitPause();
+
+  // Tells the fetcher the hashes of the data blobs of the payload, once its
+  // manifest is valid, for it to check the bytes it gets from a cache.
+  void AddVerifiedRanges();
+
+  // Accounts for |length| more bytes received, and reports the throughput
+  // once per period.
+  void UpdateThroughput(size_t length);
+
   // Pointer to the current payload in install_plan_.payloads.
   InstallPlan::Payload* payload_{nullptr};
 
@@ -147,12 +222,56 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   uint64_t bytes_total_{0};
   bool download_active_{false};
 
+  // Whether the transfer is paused by SuspendAction(), by
+  // UpdateFlowControl() while the apply is behind, and by UpdateRateLimit()
+  // while the download is too fast. It only resumes once none wants it paused
+  // anymore.
+  bool suspended_{false};
+  bool throttled_{false};
+  bool rate_limited_{false};
+  brillo::MessageLoop::TaskId queued_bytes_check_id_{
+      brillo::MessageLoop::kTaskIdNull};
+  brillo::MessageLoop::TaskId rate_limit_id_{brillo::MessageLoop::kTaskIdNull};
+
+  const ResourceGovernor* resource_governor_{nullptr};
+  // The bytes received since |rate_limit_start_|, held to the rate limit.
+  base::TimeTicks rate_limit_start_;
+  uint64_t rate_limit_bytes_{0};
+
+  // The bytes received since |throughput_start_|, and the bytes queued to be
+  // applied then.
+  base::TimeTicks throughput_start_;
+  uint64_t throughput_received_bytes_{0};
+  size_t throughput_queued_bytes_{0};
+
   // Loaded from prefs before downloading any payload.
   size_t resume_payload_index_{0};
 
   // Offset of the payload in the download URL, used by UpdateAttempterAndroid.
   int64_t base_offset_{0};
 
+  // For a payload applied by a previous attempt, of which only the metadata is
+  // downloaded, the end of the part of the metadata requested so far. Zero
+  // once all of the metadata was requested.
+  uint64_t metadata_range_end_{0};
+
+  // Whether the fetcher was told the hashes of the data blobs of the payload.
+  bool verified_ranges_added_{false};
+
+  // Holds the payload received from the network until it is applied, when
+  // |install_plan_.spill_payload| is set, so that a slow apply doesn't hold
+  // back the download. For a new download, it starts once the manifest was
+  // parsed, which resets whatever was cached before.
+  std::unique_ptr<PayloadSpillCache> spill_cache_;
+  bool spill_pending_{false};
+  // The offset in the payload of the next byte to apply from |spill_cache_|,
+  // and whether the transfer of the rest of the payload completed.
+  uint64_t spill_apply_offset_{0};
+  bool spill_transfer_complete_{false};
+  brillo::Blob spill_buffer_;
+  brillo::MessageLoop::TaskId spill_apply_id_{
+      brillo::MessageLoop::kTaskIdNull};
+
   // The path to the zip file with X509 certificates.
   const std::string update_certificates_path_;
 
@@ -181,11 +181,36 @@ class DynamicPartitionControlInterface {
   virtual bool IsDynamicPartition(const std::string& part_name,
                                   uint32_t slot) = 0;
 
-  // Create virtual block devices for all partitions.
+  // Create virtual block devices for all partitions. The devices are kept
+  // until UnmapAllPartitions(), or until a COW writer is opened, so calling
+  // it again meanwhile reuses them.
   virtual bool MapAllPartitions() = 0;
   // Unmap virtual block devices for all partitions.
   virtual bool UnmapAllPartitions() = 0;
 
+  // Map the partitions |partition_names|, unsuffixed, at slot |slot| at once,
+  // ahead of looking up their devices one by one, which then reuse the
+  // mappings. |current_slot| is the slot booted from. The partitions this
+  // doesn't map are mapped when looked up, as without it.
+  virtual bool MapPartitionsForSlot(
+      const std::vector<std::string>& partition_names,
+      uint32_t slot,
+      uint32_t current_slot) = 0;
+
+  // Starts the parts of PreparePartitionsForUpdate() for an update from
+  // |source_slot| to |target_slot| which don't depend on the manifest, for
+  // them to be done while the manifest is received. Nothing is changed on the
+  // device: PreparePartitionsForUpdate() uses what was done if it is for the
+  // same slots, and does it again otherwise.
+  virtual void PrewarmForUpdate(uint32_t source_slot, uint32_t target_slot) = 0;
+
+  // Sets |path| to the dm-verity device partition |partition_name| of the
+  // running slot is mounted from, whose reads the kernel checks against the
+  // hash tree of the partition, failing those of the blocks it can't correct.
+  // Returns false if there is none, or if dm-verity doesn't fail such reads.
+  virtual bool GetVerityDevicePath(const std::string& partition_name,
+                                   std::string* path) = 0;
+
   // Return if snapshot compression is enabled for this update.
   // This function should only be called after preparing for an update
   // (PreparePartitionsForUpdate), and before merging
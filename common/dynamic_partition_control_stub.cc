@@ -117,6 +117,21 @@ bool DynamicPartitionControlStub::UnmapAllPartitions() {
   return false;
 }
 
+bool DynamicPartitionControlStub::MapPartitionsForSlot(
+    const std::vector<std::string>& partition_names,
+    uint32_t slot,
+    uint32_t current_slot) {
+  return true;
+}
+
+void DynamicPartitionControlStub::PrewarmForUpdate(uint32_t source_slot,
+                                                   uint32_t target_slot) {}
+
+bool DynamicPartitionControlStub::GetVerityDevicePath(
+    const std::string& partition_name, std::string* path) {
+  return false;
+}
+
 bool DynamicPartitionControlStub::IsDynamicPartition(
     const std::string& part_name, uint32_t slot) {
   return false;
@@ -78,6 +78,12 @@ class DynamicPartitionControlStub final
 
   bool MapAllPartitions() override;
   bool UnmapAllPartitions() override;
+  bool MapPartitionsForSlot(const std::vector<std::string>& partition_names,
+                            uint32_t slot,
+                            uint32_t current_slot) override;
+  void PrewarmForUpdate(uint32_t source_slot, uint32_t target_slot) override;
+  bool GetVerityDevicePath(const std::string& partition_name,
+                           std::string* path) override;
 
   bool IsDynamicPartition(const std::string& part_name, uint32_t slot) override;
   bool UpdateUsesSnapshotCompression() override;
@@ -227,6 +227,22 @@ class FakeHardware : public HardwareInterface {
 #endif
   }
 
+  size_t GetPuffpatchCacheBudget() const override {
+    return puffpatch_cache_budget_;
+  }
+  void SetPuffpatchCacheBudget(size_t bytes) {
+    puffpatch_cache_budget_ = bytes;
+  }
+
+  ResourcePolicy GetResourcePolicy(UpdatePhase phase) const override {
+    auto policy = resource_policies_.find(phase);
+    return policy == resource_policies_.end() ? ResourcePolicy()
+                                              : policy->second;
+  }
+  void SetResourcePolicy(UpdatePhase phase, const ResourcePolicy& policy) {
+    resource_policies_[phase] = policy;
+  }
+
  private:
   bool is_official_build_{true};
   bool is_normal_boot_mode_{true};
@@ -247,6 +263,8 @@ class FakeHardware : public HardwareInterface {
   int64_t build_timestamp_{0};
   bool first_active_omaha_ping_sent_{false};
   bool warm_reset_{false};
+  size_t puffpatch_cache_budget_{5 * 1024 * 1024};
+  std::map<UpdatePhase, ResourcePolicy> resource_policies_;
   mutable std::map<std::string, std::string> partition_timestamps_;
 
   DISALLOW_COPY_AND_ASSIGN(FakeHardware);
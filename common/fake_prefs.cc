@@ -19,6 +19,7 @@
 #include <algorithm>
 #include <utility>
 
+#include <base/strings/string_number_conversions.h>
 #include <gtest/gtest.h>
 
 using std::string;
@@ -107,6 +108,37 @@ bool FakePrefs::Delete(std::string_view key) {
   return true;
 }
 
+bool FakePrefs::SetKeys(const Changes& changes) {
+  for (const auto& [key, value] : changes) {
+    if (!value) {
+      Delete(key);
+      continue;
+    }
+    const auto it = values_.find(key);
+    int64_t int64_value = 0;
+    const bool is_int64 = base::StringToInt64(*value, &int64_value);
+    const PrefType type = it != values_.end() ? it->second.type
+                          : is_int64          ? PrefType::kInt64
+                                              : PrefType::kString;
+    switch (type) {
+      case PrefType::kString:
+        SetString(key, *value);
+        break;
+      case PrefType::kInt64:
+        if (!is_int64)
+          return false;
+        SetInt64(key, int64_value);
+        break;
+      case PrefType::kBool:
+        if (*value != "true" && *value != "false")
+          return false;
+        SetBoolean(key, *value == "true");
+        break;
+    }
+  }
+  return true;
+}
+
 bool FakePrefs::Delete(std::string_view key, const vector<string>& nss) {
   bool success = Delete(key);
   for (const auto& ns : nss) {
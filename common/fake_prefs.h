@@ -62,6 +62,10 @@ class FakePrefs : public PrefsInterface {
   bool StartTransaction() override { return false; }
   bool CancelTransaction() override { return false; }
   bool SubmitTransaction() override { return false; }
+  // Keeps the type of the keys already set, and sets the others as integers
+  // when their values are, since the callers of SetKeys() can't tell them
+  // apart.
+  bool SetKeys(const Changes& changes) override;
 
  private:
   enum class PrefType {
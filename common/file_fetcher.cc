@@ -16,6 +16,11 @@
 
 #include "update_engine/common/file_fetcher.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <string>
 
@@ -23,6 +28,7 @@
 #include <base/format_macros.h>
 #include <base/location.h>
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
 #include <brillo/streams/file_stream.h>
@@ -30,11 +36,16 @@
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/platform_constants.h"
 
+using brillo::MessageLoop;
 using std::string;
 
 namespace {
 
-size_t kReadBufferSize = 16 * 1024;
+// How many reads ahead of the current one the kernel is asked to read.
+constexpr size_t kReadAheadReads = 4;
+// Large enough that most operations have all of their data in one chunk, and
+// so are applied without being copied.
+size_t kMappedChunkSize = 4 * 1024 * 1024;
 
 }  // namespace
 
@@ -69,18 +80,33 @@ void FileFetcher::BeginTransfer(const string& url) {
   }
 
   string file_path;
-
+  int fd = -1;
   if (base::StartsWith(url, "fd://", base::CompareCase::INSENSITIVE_ASCII)) {
-    int fd = std::stoi(url.substr(strlen("fd://")));
+    fd = std::stoi(url.substr(strlen("fd://")));
     file_path = url;
-    stream_ = brillo::FileStream::FromFileDescriptor(fd, false, nullptr);
   } else {
     file_path = url.substr(strlen("file://"));
-    stream_ =
-        brillo::FileStream::Open(base::FilePath(file_path),
-                                 brillo::Stream::AccessMode::READ,
-                                 brillo::FileStream::Disposition::OPEN_EXISTING,
-                                 nullptr);
+  }
+
+  if (use_mmap_ && MapFile(fd, file_path)) {
+    http_response_code_ = kHttpResponseOk;
+    bytes_copied_ = 0;
+    transfer_in_progress_ = true;
+    ScheduleRead();
+    return;
+  }
+
+  if (fd >= 0) {
+    stream_ = brillo::FileStream::FromFileDescriptor(fd, false, nullptr);
+  } else {
+    // Opened here rather than by brillo::FileStream::Open() for the file
+    // descriptor to give the kernel hints about the reads.
+    fd = HANDLE_EINTR(open(file_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd >= 0) {
+      stream_ = brillo::FileStream::FromFileDescriptor(fd, true, nullptr);
+      if (!stream_)
+        IGNORE_EINTR(close(fd));
+    }
   }
 
   if (!stream_) {
@@ -95,6 +121,13 @@ void FileFetcher::BeginTransfer(const string& url) {
 
   if (offset_)
     stream_->SetPosition(offset_, nullptr);
+  stream_fd_ = fd;
+  // Fails for pipes and sockets, which don't need it anyway.
+  posix_fadvise(stream_fd_,
+                offset_,
+                std::max<int64_t>(data_length_, 0),
+                POSIX_FADV_SEQUENTIAL);
+  read_ahead_end_ = offset_;
   bytes_copied_ = 0;
   transfer_in_progress_ = true;
   ScheduleRead();
@@ -112,7 +145,16 @@ void FileFetcher::ScheduleRead() {
   if (transfer_paused_ || ongoing_read_ || !transfer_in_progress_)
     return;
 
-  buffer_.resize(kReadBufferSize);
+  if (map_) {
+    mapped_read_task_ = MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::Bind(&FileFetcher::OnMappedReadCallback,
+                   base::Unretained(this)));
+    ongoing_read_ = true;
+    return;
+  }
+
+  buffer_.resize(read_size_);
   size_t bytes_to_read = buffer_.size();
   if (data_length_ >= 0) {
     bytes_to_read = std::min(static_cast<uint64_t>(bytes_to_read),
@@ -123,6 +165,7 @@ void FileFetcher::ScheduleRead() {
     OnReadDoneCallback(0);
     return;
   }
+  ReadAhead();
 
   ongoing_read_ = stream_->ReadAsync(
       buffer_.data(),
@@ -154,6 +197,56 @@ void FileFetcher::OnReadDoneCallback(size_t bytes_read) {
   }
 }
 
+void FileFetcher::OnMappedReadCallback() {
+  mapped_read_task_ = MessageLoop::kTaskIdNull;
+  const size_t bytes_read = static_cast<size_t>(std::min<uint64_t>(
+      kMappedChunkSize, mapped_length_ - bytes_copied_));
+  if (bytes_read == 0) {
+    OnReadDoneCallback(0);
+    return;
+  }
+  ongoing_read_ = false;
+  const uint8_t* data = mapped_data_ + bytes_copied_;
+  bytes_copied_ += bytes_read;
+  if (delegate_ && !delegate_->ReceivedBytes(this, data, bytes_read))
+    return;
+  if (!map_)
+    return;
+
+  // The delegate copies whatever it keeps, so the pages it went through
+  // don't need to stay in memory.
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  const size_t consumed =
+      (data + bytes_read - static_cast<const uint8_t*>(map_)) / page_size *
+      page_size;
+  if (consumed > map_released_) {
+    madvise(static_cast<uint8_t*>(map_) + map_released_,
+            consumed - map_released_,
+            MADV_DONTNEED);
+    map_released_ = consumed;
+  }
+  ScheduleRead();
+}
+
+void FileFetcher::ReadAhead() {
+  if (stream_fd_ < 0)
+    return;
+  // Asked again once half of the window was read, so that a few reads are
+  // always being done by the kernel while the delegate handles the data.
+  const uint64_t position = offset_ + bytes_copied_;
+  const uint64_t window = kReadAheadReads * read_size_;
+  if (read_ahead_end_ >= position + window / 2)
+    return;
+  uint64_t end = position + window;
+  if (data_length_ >= 0)
+    end = std::min(end, offset_ + data_length_);
+  if (end <= read_ahead_end_)
+    return;
+  const uint64_t start = std::max(read_ahead_end_, position);
+  posix_fadvise(stream_fd_, start, end - start, POSIX_FADV_WILLNEED);
+  read_ahead_end_ = end;
+}
+
 void FileFetcher::OnReadErrorCallback(const brillo::Error* error) {
   LOG(ERROR) << "Asynchronous read failed: " << error->GetMessage();
   CleanUp();
@@ -178,12 +271,69 @@ void FileFetcher::Unpause() {
   ScheduleRead();
 }
 
+bool FileFetcher::MapFile(int fd, const string& file_path) {
+  int file_fd = fd;
+  if (fd < 0) {
+    file_fd = HANDLE_EINTR(open(file_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (file_fd < 0)
+      return false;
+  }
+  struct stat stbuf {};
+  uint64_t length = 0;
+  if (fstat(file_fd, &stbuf) == 0 && S_ISREG(stbuf.st_mode) &&
+      static_cast<uint64_t>(stbuf.st_size) > offset_) {
+    length = stbuf.st_size - offset_;
+    if (data_length_ >= 0)
+      length = std::min(length, static_cast<uint64_t>(data_length_));
+  }
+  // Mappings start at a page boundary.
+  const uint64_t page_size = sysconf(_SC_PAGESIZE);
+  const uint64_t map_offset = offset_ / page_size * page_size;
+  void* map = MAP_FAILED;
+  if (length > 0) {
+    map_size_ = offset_ - map_offset + length;
+    map = mmap(nullptr, map_size_, PROT_READ, MAP_SHARED, file_fd, map_offset);
+    PLOG_IF(WARNING, map == MAP_FAILED)
+        << "Unable to map " << file_path << ", reading it instead";
+  }
+  if (fd < 0)
+    IGNORE_EINTR(close(file_fd));
+  if (map == MAP_FAILED) {
+    map_size_ = 0;
+    return false;
+  }
+  madvise(map, map_size_, MADV_SEQUENTIAL);
+  map_ = map;
+  mapped_data_ = static_cast<const uint8_t*>(map_) + (offset_ - map_offset);
+  mapped_length_ = length;
+  map_released_ = 0;
+  return true;
+}
+
+void FileFetcher::UnmapFile() {
+  if (mapped_read_task_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(mapped_read_task_);
+    mapped_read_task_ = MessageLoop::kTaskIdNull;
+  }
+  if (map_) {
+    munmap(map_, map_size_);
+    map_ = nullptr;
+  }
+  map_size_ = 0;
+  mapped_data_ = nullptr;
+  mapped_length_ = 0;
+  map_released_ = 0;
+}
+
 void FileFetcher::CleanUp() {
+  UnmapFile();
   if (stream_) {
     stream_->CancelPendingAsyncOperations();
     stream_->CloseBlocking(nullptr);
     stream_.reset();
   }
+  stream_fd_ = -1;
+  read_ahead_end_ = 0;
   // Destroying the |stream_| releases the callback, so we don't have any
   // ongoing read at this point.
   ongoing_read_ = false;
@@ -23,6 +23,7 @@
 
 #include <base/logging.h>
 #include <base/macros.h>
+#include <brillo/message_loops/message_loop.h>
 #include <brillo/streams/stream.h>
 
 #include "update_engine/common/http_fetcher.h"
@@ -34,6 +35,9 @@ namespace chromeos_update_engine {
 
 class FileFetcher : public HttpFetcher {
  public:
+  // The default size of the reads from the file.
+  static constexpr size_t kDefaultReadSize = 1024 * 1024;  // bytes
+
   // Returns whether the passed url is supported.
   static bool SupportedUrl(const std::string& url);
 
@@ -79,10 +83,24 @@ class FileFetcher : public HttpFetcher {
   void set_connect_timeout(int connect_timeout_seconds) override {}
   void set_max_retry_count(int max_retry_count) override {}
 
+  // Whether regular files are mapped in memory and passed to the delegate
+  // straight from the mapping, instead of being read into |buffer_| first.
+  // Falls back to reading when the file can't be mapped. The file must not
+  // be truncated during the transfer.
+  void set_use_mmap(bool use_mmap) { use_mmap_ = use_mmap; }
+
+  // Sets the size of the reads from the file, when it isn't mapped. The
+  // kernel is asked to read a few times as much ahead, so that a read doesn't
+  // wait for the storage.
+  void set_read_size(size_t read_size) { read_size_ = read_size; }
+
  private:
   // Cleans up the fetcher, resetting its status to a newly constructed one.
   void CleanUp();
 
+  // Asks the kernel to read the file ahead of the next reads from |stream_|.
+  void ReadAhead();
+
   // Schedule a new asynchronous read if the stream is not paused and no other
   // read is in process. This method can be called at any point.
   void ScheduleRead();
@@ -92,6 +110,14 @@ class FileFetcher : public HttpFetcher {
   void OnReadDoneCallback(size_t bytes_read);
   void OnReadErrorCallback(const brillo::Error* error);
 
+  // Maps the part of the file |fd|, or |file_path| if |fd| is negative, to
+  // transfer. Returns whether it was mapped.
+  bool MapFile(int fd, const std::string& file_path);
+  void UnmapFile();
+  // Passes the next chunk of the mapping to the delegate, scheduled by
+  // ScheduleRead() in place of a read from |stream_|.
+  void OnMappedReadCallback();
+
   // Whether the transfer was started and didn't finish yet.
   bool transfer_in_progress_{false};
 
@@ -112,9 +138,26 @@ class FileFetcher : public HttpFetcher {
   int64_t data_length_{-1};
 
   brillo::StreamPtr stream_;
+  // The file descriptor of |stream_|, which owns it, or -1 if unknown.
+  int stream_fd_{-1};
+  // The offset in the file up to which the kernel was asked to read ahead.
+  uint64_t read_ahead_end_{0};
 
   // The buffer used for reading from the stream.
   brillo::Blob buffer_;
+  size_t read_size_{kDefaultReadSize};
+
+  bool use_mmap_{false};
+  // The mapping of the file, when it's transferred from memory instead of
+  // |stream_|, the data to transfer in it, and how much of the mapping
+  // was already given back to the kernel.
+  void* map_{nullptr};
+  size_t map_size_{0};
+  const uint8_t* mapped_data_{nullptr};
+  uint64_t mapped_length_{0};
+  size_t map_released_{0};
+  brillo::MessageLoop::TaskId mapped_read_task_{
+      brillo::MessageLoop::kTaskIdNull};
 
   DISALLOW_COPY_AND_ASSIGN(FileFetcher);
 };
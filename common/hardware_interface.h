@@ -26,6 +26,7 @@
 #include <base/time/time.h>
 
 #include "update_engine/common/error_code.h"
+#include "update_engine/common/resource_policy.h"
 
 namespace chromeos_update_engine {
 
@@ -163,6 +164,15 @@ class HardwareInterface {
 
   virtual const char* GetPartitionMountOptions(
       const std::string& partition_name) const = 0;
+
+  // Returns the most memory puffpatch may use to cache the deflate streams it
+  // decodes from the source of one PUFFDIFF operation. Operations whose source
+  // needs less are given less.
+  virtual size_t GetPuffpatchCacheBudget() const = 0;
+
+  // Returns how update_engine should use the CPUs, the storage and the network
+  // of the device during |phase| of a background update.
+  virtual ResourcePolicy GetResourcePolicy(UpdatePhase phase) const = 0;
 };
 
 }  // namespace chromeos_update_engine
@@ -18,6 +18,8 @@
 
 #include <fcntl.h>
 
+#include <algorithm>
+
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
 
@@ -27,7 +29,19 @@ using std::string;
 
 namespace chromeos_update_engine {
 
-HashCalculator::HashCalculator() : valid_(false) {
+namespace {
+// Bytes hashed by each calculator in turn in UpdateAll(), small enough to
+// stay in the CPU cache.
+constexpr size_t kUpdateAllSliceSize = 64 * 1024;
+}  // namespace
+
+HashCalculator::HashCalculator(HashAlgorithm algorithm)
+    : algorithm_(algorithm), valid_(false) {
+  if (algorithm_ == HashAlgorithm::kBlake2b256) {
+    BLAKE2B256_Init(&blake2b_ctx_);
+    valid_ = true;
+    return;
+  }
   valid_ = (SHA256_Init(&ctx_) == 1);
   LOG_IF(ERROR, !valid_) << "SHA256_Init failed";
 }
@@ -37,12 +51,30 @@ HashCalculator::HashCalculator() : valid_(false) {
 bool HashCalculator::Update(const void* data, size_t length) {
   TEST_AND_RETURN_FALSE(valid_);
   TEST_AND_RETURN_FALSE(raw_hash_.empty());
+  if (algorithm_ == HashAlgorithm::kBlake2b256) {
+    BLAKE2B256_Update(&blake2b_ctx_, data, length);
+    return true;
+  }
   static_assert(sizeof(size_t) <= sizeof(unsigned long),  // NOLINT(runtime/int)
                 "length param may be truncated in SHA256_Update");
   TEST_AND_RETURN_FALSE(SHA256_Update(&ctx_, data, length) == 1);
   return true;
 }
 
+bool HashCalculator::UpdateAll(const std::vector<HashCalculator*>& calculators,
+                               const void* data,
+                               size_t length) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  bool success = true;
+  for (size_t offset = 0; offset < length; offset += kUpdateAllSliceSize) {
+    const size_t size = std::min(kUpdateAllSliceSize, length - offset);
+    for (HashCalculator* calculator : calculators) {
+      success = calculator->Update(bytes + offset, size) && success;
+    }
+  }
+  return success;
+}
+
 off_t HashCalculator::UpdateFile(const string& name, off_t length) {
   int fd = HANDLE_EINTR(open(name.c_str(), O_RDONLY));
   if (fd < 0) {
@@ -75,6 +107,11 @@ off_t HashCalculator::UpdateFile(const string& name, off_t length) {
 // calls OpenSSL's SHA256_Final().
 bool HashCalculator::Finalize() {
   TEST_AND_RETURN_FALSE(raw_hash_.empty());
+  if (algorithm_ == HashAlgorithm::kBlake2b256) {
+    raw_hash_.resize(BLAKE2B256_DIGEST_LENGTH);
+    BLAKE2B256_Final(raw_hash_.data(), &blake2b_ctx_);
+    return true;
+  }
   raw_hash_.resize(SHA256_DIGEST_LENGTH);
   TEST_AND_RETURN_FALSE(SHA256_Final(raw_hash_.data(), &ctx_) == 1);
   return true;
@@ -82,8 +119,9 @@ bool HashCalculator::Finalize() {
 
 bool HashCalculator::RawHashOfBytes(const void* data,
                                     size_t length,
-                                    brillo::Blob* out_hash) {
-  HashCalculator calc;
+                                    brillo::Blob* out_hash,
+                                    HashAlgorithm algorithm) {
+  HashCalculator calc(algorithm);
   TEST_AND_RETURN_FALSE(calc.Update(data, length));
   TEST_AND_RETURN_FALSE(calc.Finalize());
   *out_hash = calc.raw_hash();
@@ -91,19 +129,23 @@ bool HashCalculator::RawHashOfBytes(const void* data,
 }
 
 bool HashCalculator::RawHashOfData(const brillo::Blob& data,
-                                   brillo::Blob* out_hash) {
-  return RawHashOfBytes(data.data(), data.size(), out_hash);
+                                   brillo::Blob* out_hash,
+                                   HashAlgorithm algorithm) {
+  return RawHashOfBytes(data.data(), data.size(), out_hash, algorithm);
 }
 
-bool HashCalculator::RawHashOfFile(const string& name, brillo::Blob* out_hash) {
+bool HashCalculator::RawHashOfFile(const string& name,
+                                   brillo::Blob* out_hash,
+                                   HashAlgorithm algorithm) {
   const auto file_size = utils::FileSize(name);
-  return RawHashOfFile(name, file_size, out_hash) == file_size;
+  return RawHashOfFile(name, file_size, out_hash, algorithm) == file_size;
 }
 
 off_t HashCalculator::RawHashOfFile(const string& name,
                                     off_t length,
-                                    brillo::Blob* out_hash) {
-  HashCalculator calc;
+                                    brillo::Blob* out_hash,
+                                    HashAlgorithm algorithm) {
+  HashCalculator calc(algorithm);
   off_t res = calc.UpdateFile(name, length);
   if (res < 0) {
     return res;
@@ -116,10 +158,19 @@ off_t HashCalculator::RawHashOfFile(const string& name,
 }
 
 string HashCalculator::GetContext() const {
+  if (algorithm_ == HashAlgorithm::kBlake2b256) {
+    return string(reinterpret_cast<const char*>(&blake2b_ctx_),
+                  sizeof(blake2b_ctx_));
+  }
   return string(reinterpret_cast<const char*>(&ctx_), sizeof(ctx_));
 }
 
 bool HashCalculator::SetContext(const string& context) {
+  if (algorithm_ == HashAlgorithm::kBlake2b256) {
+    TEST_AND_RETURN_FALSE(context.size() == sizeof(blake2b_ctx_));
+    memcpy(&blake2b_ctx_, context.data(), sizeof(blake2b_ctx_));
+    return true;
+  }
   TEST_AND_RETURN_FALSE(context.size() == sizeof(ctx_));
   memcpy(&ctx_, context.data(), sizeof(ctx_));
   return true;
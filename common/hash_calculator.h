@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_COMMON_HASH_CALCULATOR_H_
 #define UPDATE_ENGINE_COMMON_HASH_CALCULATOR_H_
 
+#include <openssl/blake2.h>
 #include <openssl/sha.h>
 #include <unistd.h>
 
@@ -35,15 +36,35 @@
 
 namespace chromeos_update_engine {
 
+// The algorithms of the hashes of the data, all with 32 bytes hashes. The
+// signatures are always over SHA-256 hashes.
+enum class HashAlgorithm {
+  kSha256,
+  // BLAKE2b with 256 bits hashes, several times faster than SHA-256 on CPUs
+  // without SHA instructions.
+  kBlake2b256,
+};
+
 class HashCalculator {
  public:
-  HashCalculator();
+  explicit HashCalculator(HashAlgorithm algorithm = HashAlgorithm::kSha256);
+
+  HashAlgorithm algorithm() const { return algorithm_; }
 
   // Update is called with all of the data that should be hashed in order.
   // Update will read |length| bytes of |data|.
   // Returns true on success.
   bool Update(const void* data, size_t length);
 
+  // Updates each of |calculators| with the same |length| bytes of |data|,
+  // whatever their algorithm.
+  // The data is hashed a slice at a time, so that all but the first
+  // calculator read it from the CPU cache instead of memory. Returns true if
+  // every update succeeded.
+  static bool UpdateAll(const std::vector<HashCalculator*>& calculators,
+                        const void* data,
+                        size_t length);
+
   // Updates the hash with up to |length| bytes of data from |file|. If |length|
   // is negative, reads in and updates with the whole file. Returns the number
   // of bytes that the hash was updated with, or -1 on error.
@@ -70,12 +91,18 @@ class HashCalculator {
 
   static bool RawHashOfBytes(const void* data,
                              size_t length,
-                             brillo::Blob* out_hash);
-  static bool RawHashOfData(const brillo::Blob& data, brillo::Blob* out_hash);
+                             brillo::Blob* out_hash,
+                             HashAlgorithm algorithm = HashAlgorithm::kSha256);
+  static bool RawHashOfData(const brillo::Blob& data,
+                            brillo::Blob* out_hash,
+                            HashAlgorithm algorithm = HashAlgorithm::kSha256);
   static off_t RawHashOfFile(const std::string& name,
                              off_t length,
-                             brillo::Blob* out_hash);
-  static bool RawHashOfFile(const std::string& name, brillo::Blob* out_hash);
+                             brillo::Blob* out_hash,
+                             HashAlgorithm algorithm = HashAlgorithm::kSha256);
+  static bool RawHashOfFile(const std::string& name,
+                            brillo::Blob* out_hash,
+                            HashAlgorithm algorithm = HashAlgorithm::kSha256);
   static std::string SHA256Digest(std::string_view blob);
 
   static std::string SHA256Digest(std::vector<unsigned char> blob);
@@ -86,11 +113,14 @@ class HashCalculator {
   // Finalize is called.
   brillo::Blob raw_hash_;
 
+  const HashAlgorithm algorithm_;
+
   // Init success
   bool valid_;
 
-  // The hash state used by OpenSSL
+  // The hash state used by OpenSSL, the one of |algorithm_|.
   SHA256_CTX ctx_{};
+  BLAKE2B_CTX blake2b_ctx_{};
   DISALLOW_COPY_AND_ASSIGN(HashCalculator);
 };
 
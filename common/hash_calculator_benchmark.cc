@@ -0,0 +1,47 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// HashCalculator::Update() for buffers of every size, as the operations and
+// the partitions are hashed by the chunks they are read and written in.
+
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/hash_calculator.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kBytesPerIteration = 16 * 1024 * 1024;
+
+void BM_HashCalculatorUpdate(benchmark::State& state) {
+  const brillo::Blob buffer(state.range(0), 0x5a);
+  for (auto _ : state) {
+    HashCalculator hasher;
+    for (size_t done = 0; done < kBytesPerIteration; done += buffer.size())
+      hasher.Update(buffer.data(), buffer.size());
+    hasher.Finalize();
+    benchmark::DoNotOptimize(hasher.raw_hash());
+  }
+  state.SetBytesProcessed(state.iterations() * kBytesPerIteration);
+}
+
+}  // namespace
+
+BENCHMARK(BM_HashCalculatorUpdate)->RangeMultiplier(4)->Range(64, 4 << 20);
+
+}  // namespace chromeos_update_engine
@@ -42,6 +42,13 @@ static const uint8_t kExpectedRawHash[] = {
     0xa9, 0x01, 0xc5, 0x17, 0x6b, 0x10, 0xa6, 0xd8, 0x39, 0x61, 0xdd,
     0x3c, 0x1a, 0xc8, 0x8b, 0x59, 0xb2, 0xdc, 0x32, 0x7a, 0xa4};
 
+// $ python3 -c "import hashlib; print(hashlib.blake2b(b'hi', digest_size=32)
+//   .hexdigest())"
+static const uint8_t kExpectedBlake2bRawHash[] = {
+    0x68, 0x15, 0xcb, 0x4a, 0xeb, 0x15, 0x80, 0xa9, 0x1e, 0xf6, 0x73,
+    0xe6, 0x3f, 0xf0, 0x3b, 0xdb, 0x6e, 0x85, 0x5c, 0x3a, 0x89, 0x6d,
+    0xb3, 0xf2, 0x76, 0x5e, 0x03, 0x28, 0x1a, 0x61, 0x13, 0x4a};
+
 class HashCalculatorTest : public ::testing::Test {};
 
 TEST_F(HashCalculatorTest, SimpleTest) {
@@ -77,6 +84,51 @@ TEST_F(HashCalculatorTest, ContextTest) {
   EXPECT_EQ(raw_hash, calc_next.raw_hash());
 }
 
+TEST_F(HashCalculatorTest, Blake2bTest) {
+  const brillo::Blob raw_hash(std::begin(kExpectedBlake2bRawHash),
+                              std::end(kExpectedBlake2bRawHash));
+  HashCalculator calc(HashAlgorithm::kBlake2b256);
+  EXPECT_EQ(HashAlgorithm::kBlake2b256, calc.algorithm());
+  EXPECT_TRUE(calc.Update("h", 1));
+  const string context = calc.GetContext();
+  EXPECT_TRUE(calc.Update("i", 1));
+  EXPECT_TRUE(calc.Finalize());
+  EXPECT_EQ(raw_hash, calc.raw_hash());
+
+  HashCalculator calc_next(HashAlgorithm::kBlake2b256);
+  EXPECT_TRUE(calc_next.SetContext(context));
+  EXPECT_TRUE(calc_next.Update("i", 1));
+  EXPECT_TRUE(calc_next.Finalize());
+  EXPECT_EQ(raw_hash, calc_next.raw_hash());
+  // The context of one algorithm isn't taken by the other.
+  EXPECT_FALSE(HashCalculator().SetContext(context));
+
+  brillo::Blob hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+      "hi", 2, &hash, HashAlgorithm::kBlake2b256));
+  EXPECT_EQ(raw_hash, hash);
+}
+
+TEST_F(HashCalculatorTest, UpdateAllTest) {
+  // More than one slice, and not a multiple of it.
+  brillo::Blob data(200 * 1024 + 5);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = i * 31;
+  }
+  brillo::Blob expected_hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(data, &expected_hash));
+
+  HashCalculator calc1;
+  HashCalculator calc2;
+  calc2.Update(data.data(), 100);
+  EXPECT_TRUE(HashCalculator::UpdateAll(
+      {&calc1, &calc2}, data.data(), data.size()));
+  EXPECT_TRUE(calc1.Finalize());
+  EXPECT_TRUE(calc2.Finalize());
+  EXPECT_EQ(expected_hash, calc1.raw_hash());
+  EXPECT_NE(expected_hash, calc2.raw_hash());
+}
+
 TEST_F(HashCalculatorTest, BigTest) {
   HashCalculator calc;
 
@@ -140,6 +140,14 @@ class HttpFetcher {
   // Get the total number of bytes downloaded by fetcher.
   virtual size_t GetBytesDownloaded() = 0;
 
+  // Tells the fetcher the SHA-256 hash of the bytes of the file in
+  // [offset, offset + length), for fetchers which may get them from less
+  // trusted sources and check them before passing them on. Ignored by
+  // default.
+  virtual void AddVerifiedRange(off_t offset,
+                                size_t length,
+                                const brillo::Blob& sha256_hash) {}
+
  protected:
   // The URL we're actively fetching from
   std::string url_;
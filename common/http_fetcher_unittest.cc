@@ -80,6 +80,11 @@ const int kMediumLength = 1000;
 const int kFlakyTruncateLength = 29000;
 const int kFlakySleepEvery = 3;
 const int kFlakySleepSecs = 10;
+const int kShapedBytesPerSec = 400000;
+const int kShapedRttMs = 50;
+const int kShapedJitterMs = 10;
+const int kShapedStallEvery = 40000;
+const int kShapedStallMs = 20;
 
 }  // namespace
 
@@ -361,6 +366,36 @@ class FileFetcherFactory : public AnyHttpFetcherFactory {
   ScopedTempFile temp_file_{"ue_file_fetcher.XXXXXX"};
 };
 
+class MmapFileFetcherFactory : public FileFetcherFactory {
+ public:
+  // Necessary to unhide the definition in the base class.
+  using AnyHttpFetcherFactory::NewLargeFetcher;
+  HttpFetcher* NewLargeFetcher() override {
+    FileFetcher* ret = new FileFetcher();
+    ret->set_use_mmap(true);
+    return ret;
+  }
+
+  // Necessary to unhide the definition in the base class.
+  using AnyHttpFetcherFactory::NewSmallFetcher;
+  HttpFetcher* NewSmallFetcher() override { return NewLargeFetcher(); }
+};
+
+class SmallReadsFileFetcherFactory : public FileFetcherFactory {
+ public:
+  // Necessary to unhide the definition in the base class.
+  using AnyHttpFetcherFactory::NewLargeFetcher;
+  HttpFetcher* NewLargeFetcher() override {
+    FileFetcher* ret = new FileFetcher();
+    ret->set_read_size(4096);
+    return ret;
+  }
+
+  // Necessary to unhide the definition in the base class.
+  using AnyHttpFetcherFactory::NewSmallFetcher;
+  HttpFetcher* NewSmallFetcher() override { return NewLargeFetcher(); }
+};
+
 class MultiRangeHttpFetcherOverFileFetcherFactory : public FileFetcherFactory {
  public:
   // Necessary to unhide the definition in the base class.
@@ -425,6 +460,8 @@ typedef ::testing::Types<LibcurlHttpFetcherFactory,
                          MockHttpFetcherFactory,
                          MultiRangeHttpFetcherFactory,
                          FileFetcherFactory,
+                         MmapFileFetcherFactory,
+                         SmallReadsFileFetcherFactory,
                          MultiRangeHttpFetcherOverFileFetcherFactory>
     HttpFetcherTestTypes;
 TYPED_TEST_CASE(HttpFetcherTest, HttpFetcherTestTypes);
@@ -785,6 +822,49 @@ TYPED_TEST(HttpFetcherTest, FlakyTest) {
   }
 }
 
+TYPED_TEST(HttpFetcherTest, ShapedTest) {
+  if (this->test_.IsMock() || !this->test_.IsHttpSupported())
+    return;
+  HttpFetcherTestDelegate delegate;
+  unique_ptr<HttpFetcher> fetcher(this->test_.NewLargeFetcher());
+  fetcher->set_delegate(&delegate);
+
+  unique_ptr<HttpServer> server(this->test_.CreateServer());
+  ASSERT_TRUE(server->started_);
+
+  const base::TimeTicks start_time = base::TimeTicks::Now();
+  this->loop_.PostTask(
+      FROM_HERE,
+      base::Bind(&StartTransfer,
+                 fetcher.get(),
+                 LocalServerUrlForPath(
+                     server->GetPort(),
+                     base::StringPrintf("/shaped/%d/%d/%d/%d/%d/%d",
+                                        kBigLength,
+                                        kShapedBytesPerSec,
+                                        kShapedRttMs,
+                                        kShapedJitterMs,
+                                        kShapedStallEvery,
+                                        kShapedStallMs))));
+  this->loop_.Run();
+  const base::TimeDelta elapsed = base::TimeTicks::Now() - start_time;
+  LOG(INFO) << "Shaped transfer of " << delegate.data.size() << " bytes took "
+            << elapsed.InMilliseconds() << " ms";
+
+  ASSERT_EQ(kBigLength, static_cast<int>(delegate.data.size()));
+  for (int i = 0; i < kBigLength; i += 10) {
+    // Assert so that we don't flood the screen w/ EXPECT errors on failure.
+    ASSERT_EQ(delegate.data.substr(i, 10), "abcdefghij");
+  }
+  // The server can't deliver the bytes faster than its bandwidth, nor skip
+  // the latency and the stalls.
+  EXPECT_GE(elapsed,
+            base::TimeDelta::FromMilliseconds(
+                kBigLength * 1000 / kShapedBytesPerSec + kShapedRttMs -
+                kShapedJitterMs +
+                kBigLength / kShapedStallEvery * kShapedStallMs));
+}
+
 // This delegate kills the server attached to it after receiving any bytes.
 // This can be used for testing what happens when you try to fetch data and
 // the server dies.
@@ -0,0 +1,106 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/memory_pressure_monitor.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/string_util.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr char kPsiMemoryPath[] = "/proc/pressure/memory";
+constexpr char kMeminfoPath[] = "/proc/meminfo";
+
+// Returns the words of the first line of the file at |path| starting with
+// |key|, without it, or nothing if there is none.
+std::vector<std::string> ReadLine(const std::string& path,
+                                  const std::string& key) {
+  std::string content;
+  if (!base::ReadFileToString(base::FilePath(path), &content)) {
+    return {};
+  }
+  for (const auto& line : base::SplitString(
+           content, "\n", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    auto words = base::SplitString(
+        line, " \t", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY);
+    if (!words.empty() && words[0] == key) {
+      words.erase(words.begin());
+      return words;
+    }
+  }
+  return {};
+}
+}  // namespace
+
+MemoryPressureMonitor::MemoryPressureMonitor()
+    : MemoryPressureMonitor(kPsiMemoryPath, kMeminfoPath) {}
+
+MemoryPressureMonitor::MemoryPressureMonitor(std::string psi_path,
+                                             std::string meminfo_path)
+    : psi_path_(std::move(psi_path)), meminfo_path_(std::move(meminfo_path)) {}
+
+MemoryPressureMonitor::Level MemoryPressureMonitor::GetLevel() const {
+  Level level = Level::kNone;
+  // some avg10=12.34 avg60=5.00 avg300=1.00 total=123456
+  for (const auto& word : ReadLine(psi_path_, "some")) {
+    double stall_percent;
+    if (!base::StartsWith(word, "avg10=") ||
+        !base::StringToDouble(word.substr(6), &stall_percent)) {
+      continue;
+    }
+    if (stall_percent >= kCriticalStallPercent) {
+      level = Level::kCritical;
+    } else if (stall_percent >= kModerateStallPercent) {
+      level = Level::kModerate;
+    }
+    break;
+  }
+  // MemAvailable:    1234567 kB
+  const auto available = ReadLine(meminfo_path_, "MemAvailable:");
+  uint64_t available_kb;
+  if (available.size() == 2 && available[1] == "kB" &&
+      base::StringToUint64(available[0], &available_kb)) {
+    const uint64_t available_bytes = available_kb * 1024;
+    if (available_bytes < kCriticalAvailableBytes) {
+      level = Level::kCritical;
+    } else if (available_bytes < kModerateAvailableBytes) {
+      level = std::max(level, Level::kModerate);
+    }
+  }
+  return level;
+}
+
+const char* MemoryPressureMonitor::LevelName(Level level) {
+  switch (level) {
+    case Level::kNone:
+      return "none";
+    case Level::kModerate:
+      return "moderate";
+    case Level::kCritical:
+      return "critical";
+  }
+  return "unknown";
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,66 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_MEMORY_PRESSURE_MONITOR_H_
+#define UPDATE_ENGINE_COMMON_MEMORY_PRESSURE_MONITOR_H_
+
+#include <string>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// Tells how short of memory the device is, from the share of the time tasks
+// were stalled on memory over the last 10 seconds reported by the kernel
+// pressure stall information, and from the amount of memory available. Either
+// may be missing, like the pressure on kernels without PSI, in which case the
+// level comes from the other one.
+class MemoryPressureMonitor {
+ public:
+  enum class Level {
+    kNone,
+    // Better give back the memory held for speed.
+    kModerate,
+    // Hold as little memory as possible.
+    kCritical,
+  };
+
+  // The stall percentages and available bytes from which each level starts.
+  static constexpr double kModerateStallPercent = 10;
+  static constexpr double kCriticalStallPercent = 40;
+  static constexpr size_t kModerateAvailableBytes = 256 * 1024 * 1024;
+  static constexpr size_t kCriticalAvailableBytes = 96 * 1024 * 1024;
+
+  MemoryPressureMonitor();
+  // Reads the pressure from |psi_path| and the available memory from
+  // |meminfo_path|, in the formats of /proc/pressure/memory and /proc/meminfo.
+  MemoryPressureMonitor(std::string psi_path, std::string meminfo_path);
+
+  // Reads the current level.
+  Level GetLevel() const;
+
+  static const char* LevelName(Level level);
+
+ private:
+  const std::string psi_path_;
+  const std::string meminfo_path_;
+
+  DISALLOW_COPY_AND_ASSIGN(MemoryPressureMonitor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_MEMORY_PRESSURE_MONITOR_H_
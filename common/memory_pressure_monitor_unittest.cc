@@ -0,0 +1,81 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/memory_pressure_monitor.h"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+using Level = MemoryPressureMonitor::Level;
+
+class MemoryPressureMonitorTest : public ::testing::Test {
+ protected:
+  Level GetLevel(const string& psi, const string& meminfo) {
+    EXPECT_TRUE(test_utils::WriteFileString(psi_file_.path(), psi));
+    EXPECT_TRUE(test_utils::WriteFileString(meminfo_file_.path(), meminfo));
+    return MemoryPressureMonitor(psi_file_.path(), meminfo_file_.path())
+        .GetLevel();
+  }
+
+  static string Psi(const string& some_avg10) {
+    return "some avg10=" + some_avg10 +
+           " avg60=0.00 avg300=0.00 total=1234\n"
+           "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n";
+  }
+
+  static string Meminfo(const string& available_kb) {
+    return "MemTotal:        7838840 kB\n"
+           "MemFree:          191644 kB\n"
+           "MemAvailable:    " +
+           available_kb + " kB\n";
+  }
+
+  ScopedTempFile psi_file_{"psi.XXXXXX"};
+  ScopedTempFile meminfo_file_{"meminfo.XXXXXX"};
+};
+
+TEST_F(MemoryPressureMonitorTest, NoPressureTest) {
+  EXPECT_EQ(Level::kNone, GetLevel(Psi("0.00"), Meminfo("4000000")));
+}
+
+TEST_F(MemoryPressureMonitorTest, StallTest) {
+  EXPECT_EQ(Level::kModerate, GetLevel(Psi("12.50"), Meminfo("4000000")));
+  EXPECT_EQ(Level::kCritical, GetLevel(Psi("45.00"), Meminfo("4000000")));
+}
+
+TEST_F(MemoryPressureMonitorTest, AvailableMemoryTest) {
+  EXPECT_EQ(Level::kModerate, GetLevel(Psi("0.00"), Meminfo("200000")));
+  EXPECT_EQ(Level::kCritical, GetLevel(Psi("0.00"), Meminfo("50000")));
+  // The highest of the two levels.
+  EXPECT_EQ(Level::kCritical, GetLevel(Psi("45.00"), Meminfo("200000")));
+}
+
+TEST_F(MemoryPressureMonitorTest, MissingFilesTest) {
+  EXPECT_EQ(Level::kModerate, GetLevel("", Meminfo("200000")));
+  EXPECT_EQ(Level::kModerate, GetLevel(Psi("12.50"), ""));
+  EXPECT_EQ(Level::kNone,
+            MemoryPressureMonitor("/nonexistent", "/nonexistent").GetLevel());
+}
+
+}  // namespace chromeos_update_engine
@@ -33,6 +33,27 @@ namespace chromeos_update_engine {
 enum class ServerToCheck;
 enum class CertificateCheckResult;
 
+namespace metrics {
+
+// How long the phases of an update attempt took, and how many bytes each of
+// them went through. The phases the attempt didn't get to are left at zero.
+struct UpdatePhaseMetrics {
+  // The payload bytes received, and the time from the start of the download
+  // until all of them were applied.
+  int64_t download_bytes{0};
+  base::TimeDelta download_duration;
+  // The bytes written to the target partitions, and the time spent on the
+  // install operations out of |download_duration|, not waiting for data.
+  int64_t apply_bytes{0};
+  base::TimeDelta apply_duration;
+  // The bytes of the target partitions read back to verify them.
+  int64_t verify_bytes{0};
+  base::TimeDelta verify_duration;
+  base::TimeDelta postinstall_duration;
+};
+
+}  // namespace metrics
+
 class MetricsReporterInterface {
  public:
   virtual ~MetricsReporterInterface() = default;
@@ -233,6 +254,17 @@ class MetricsReporterInterface {
   //
   virtual void ReportEnterpriseUpdateSeenToDownloadDays(
       bool has_time_restriction_policy, int time_to_update_days) = 0;
+
+  // Helper function to report how long applying the install operations of the
+  // payload took, by operation type and phase. Reported once the payload is
+  // applied, when the time of the operations was collected.
+  virtual void ReportInstallOperationStats(const OperationStats& stats) = 0;
+
+  // Helper function to report the duration and the throughput of each phase
+  // of an update attempt, after the completion of the attempt. Reported along
+  // with ReportUpdateAttemptMetrics().
+  virtual void ReportUpdatePhaseMetrics(
+      const metrics::UpdatePhaseMetrics& phase_metrics) = 0;
 };
 
 namespace metrics {
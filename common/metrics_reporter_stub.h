@@ -90,6 +90,11 @@ class MetricsReporterStub : public MetricsReporterInterface {
   void ReportEnterpriseUpdateSeenToDownloadDays(
       bool has_time_restriction_policy, int time_to_update_days) override {}
 
+  void ReportInstallOperationStats(const OperationStats& stats) override {}
+
+  void ReportUpdatePhaseMetrics(
+      const metrics::UpdatePhaseMetrics& phase_metrics) override {}
+
  private:
   DISALLOW_COPY_AND_ASSIGN(MetricsReporterStub);
 };
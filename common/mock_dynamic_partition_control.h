@@ -53,6 +53,15 @@ class MockDynamicPartitionControl : public DynamicPartitionControlInterface {
               (override));
   MOCK_METHOD(bool, MapAllPartitions, (), (override));
   MOCK_METHOD(bool, UnmapAllPartitions, (), (override));
+  MOCK_METHOD(bool,
+              MapPartitionsForSlot,
+              (const std::vector<std::string>&, uint32_t, uint32_t),
+              (override));
+  MOCK_METHOD(void, PrewarmForUpdate, (uint32_t, uint32_t), (override));
+  MOCK_METHOD(bool,
+              GetVerityDevicePath,
+              (const std::string&, std::string*),
+              (override));
 
   MOCK_METHOD(bool,
               OptimizeOperation,
@@ -39,6 +39,10 @@ MockHttpFetcher::~MockHttpFetcher() {
 
 void MockHttpFetcher::BeginTransfer(const std::string& url) {
   EXPECT_FALSE(never_use_);
+  if (!failing_url_.empty()) {
+    fail_transfer_ = url == failing_url_;
+    http_response_code_ = fail_transfer_ ? failing_http_response_code_ : 0;
+  }
   if (fail_transfer_ || data_.empty()) {
     // No data to send, just notify of completion..
     SignalTransferComplete();
@@ -100,6 +104,8 @@ void MockHttpFetcher::TerminateTransfer() {
     MessageLoop::current()->CancelTask(timeout_id_);
     timeout_id_ = MessageLoop::kTaskIdNull;
   }
+  // As with LibcurlHttpFetcher, the next transfer doesn't start paused.
+  paused_ = false;
   if (delegate_) {
     delegate_->TransferTerminated(this);
   }
@@ -105,6 +105,13 @@ class MockHttpFetcher : public HttpFetcher {
   // Fail the transfer. This simulates a network failure.
   void FailTransfer(int http_response_code);
 
+  // Fail the transfers from |url| only, and no others. This simulates a
+  // server being down.
+  void FailTransfersFrom(const std::string& url, int http_response_code) {
+    failing_url_ = url;
+    failing_http_response_code_ = http_response_code;
+  }
+
   // If set to true, this will EXPECT fail on BeginTransfer
   void set_never_use(bool never_use) { never_use_ = never_use; }
 
@@ -147,6 +154,10 @@ class MockHttpFetcher : public HttpFetcher {
   // Set to true if the transfer should fail.
   bool fail_transfer_{false};
 
+  // The URL whose transfers fail, if not empty, and with which response code.
+  std::string failing_url_;
+  int failing_http_response_code_{0};
+
   // Set to true if BeginTransfer should EXPECT fail.
   bool never_use_{false};
 
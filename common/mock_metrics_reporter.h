@@ -90,6 +90,11 @@ class MockMetricsReporter : public MetricsReporterInterface {
 
   MOCK_METHOD2(ReportEnterpriseUpdateSeenToDownloadDays,
                void(bool has_time_restriction_policy, int time_to_update_days));
+
+  MOCK_METHOD1(ReportInstallOperationStats, void(const OperationStats& stats));
+
+  MOCK_METHOD1(ReportUpdatePhaseMetrics,
+               void(const metrics::UpdatePhaseMetrics& phase_metrics));
 };
 
 }  // namespace chromeos_update_engine
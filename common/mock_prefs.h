@@ -50,6 +50,7 @@ class MockPrefs : public PrefsInterface {
   MOCK_METHOD(bool, StartTransaction, (), (override));
   MOCK_METHOD(bool, CancelTransaction, (), (override));
   MOCK_METHOD(bool, SubmitTransaction, (), (override));
+  MOCK_METHOD(bool, SetKeys, (const Changes& changes), (override));
 };
 
 }  // namespace chromeos_update_engine
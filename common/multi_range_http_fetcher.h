@@ -122,6 +122,12 @@ class MultiRangeHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
     base_fetcher_->set_max_retry_count(max_retry_count);
   }
 
+  void AddVerifiedRange(off_t offset,
+                        size_t length,
+                        const brillo::Blob& sha256_hash) override {
+    base_fetcher_->AddVerifiedRange(offset, length, sha256_hash);
+  }
+
  private:
   // A range object defining the offset and length of a download chunk.  Zero
   // length indicates an unspecified end offset (note that it is impossible to
@@ -0,0 +1,404 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/parallel_http_fetcher.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <base/bind.h>
+#include <base/location.h>
+#include <base/logging.h>
+
+using brillo::MessageLoop;
+using std::string;
+
+namespace chromeos_update_engine {
+
+ParallelHttpFetcher::ParallelHttpFetcher(
+    std::vector<std::unique_ptr<HttpFetcher>> fetchers, size_t chunk_size)
+    : workers_(fetchers.size()), chunk_size_(chunk_size) {
+  CHECK(!workers_.empty());
+  CHECK_GT(chunk_size_, 0u);
+  for (size_t i = 0; i < fetchers.size(); i++) {
+    workers_[i].fetcher = std::move(fetchers[i]);
+    workers_[i].fetcher->set_delegate(this);
+    workers_[i].mirror = i;
+  }
+}
+
+ParallelHttpFetcher::~ParallelHttpFetcher() {
+  if (advance_task_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(advance_task_);
+  }
+}
+
+void ParallelHttpFetcher::BeginTransfer(const string& url) {
+  CHECK(!transfer_active_) << "BeginTransfer but already active.";
+  url_ = url;
+  urls_ = {url};
+  urls_.insert(urls_.end(), mirror_urls_.begin(), mirror_urls_.end());
+  for (auto& worker : workers_) {
+    worker.mirror %= urls_.size();
+  }
+  http_response_code_ = 0;
+  auxiliary_error_code_ = ErrorCode::kSuccess;
+  next_offset_ = offset_;
+  all_started_ = false;
+  terminating_ = failed_ = false;
+  transfer_active_ = true;
+  ScheduleAdvance();
+}
+
+void ParallelHttpFetcher::TerminateTransfer() {
+  if (!transfer_active_) {
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferTerminated(this);
+    return;
+  }
+  terminating_ = true;
+  TerminateWorkers();
+  ScheduleAdvance();
+}
+
+void ParallelHttpFetcher::SetHeader(const string& header_name,
+                                    const string& header_value) {
+  for (auto& worker : workers_) {
+    worker.fetcher->SetHeader(header_name, header_value);
+  }
+}
+
+bool ParallelHttpFetcher::GetHeader(const string& header_name,
+                                    string* header_value) const {
+  return workers_[0].fetcher->GetHeader(header_name, header_value);
+}
+
+void ParallelHttpFetcher::Pause() {
+  if (paused_)
+    return;
+  paused_ = true;
+  for (auto& worker : workers_) {
+    if (worker.active && !worker.terminating)
+      worker.fetcher->Pause();
+  }
+}
+
+void ParallelHttpFetcher::Unpause() {
+  if (!paused_)
+    return;
+  paused_ = false;
+  for (auto& worker : workers_) {
+    if (worker.active && !worker.terminating)
+      worker.fetcher->Unpause();
+  }
+  ScheduleAdvance();
+}
+
+void ParallelHttpFetcher::set_idle_seconds(int seconds) {
+  for (auto& worker : workers_) {
+    worker.fetcher->set_idle_seconds(seconds);
+  }
+}
+
+void ParallelHttpFetcher::set_retry_seconds(int seconds) {
+  for (auto& worker : workers_) {
+    worker.fetcher->set_retry_seconds(seconds);
+  }
+}
+
+void ParallelHttpFetcher::SetProxies(const std::deque<string>& proxies) {
+  HttpFetcher::SetProxies(proxies);
+  for (auto& worker : workers_) {
+    worker.fetcher->SetProxies(proxies);
+  }
+}
+
+void ParallelHttpFetcher::set_low_speed_limit(int low_speed_bps,
+                                              int low_speed_sec) {
+  for (auto& worker : workers_) {
+    worker.fetcher->set_low_speed_limit(low_speed_bps, low_speed_sec);
+  }
+}
+
+void ParallelHttpFetcher::set_connect_timeout(int connect_timeout_seconds) {
+  for (auto& worker : workers_) {
+    worker.fetcher->set_connect_timeout(connect_timeout_seconds);
+  }
+}
+
+void ParallelHttpFetcher::set_max_retry_count(int max_retry_count) {
+  for (auto& worker : workers_) {
+    worker.fetcher->set_max_retry_count(max_retry_count);
+  }
+}
+
+size_t ParallelHttpFetcher::GetBytesDownloaded() {
+  size_t bytes_downloaded = 0;
+  for (auto& worker : workers_) {
+    bytes_downloaded += worker.fetcher->GetBytesDownloaded();
+  }
+  return bytes_downloaded;
+}
+
+bool ParallelHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
+                                        const void* bytes,
+                                        size_t length) {
+  Worker* worker = GetWorker(fetcher);
+  if (terminating_ || failed_ || worker->done) {
+    TerminateWorker(worker);
+    return false;
+  }
+  size_t size = length;
+  if (worker->length > 0)
+    size = std::min(size, worker->length - worker->received);
+  worker->received += size;
+  if (!paused_ && !chunks_.empty() && chunks_.front() == worker &&
+      worker->buffer.empty()) {
+    // The delegate may terminate the transfer from this call, in which case
+    // the workers are asked to terminate too.
+    if (delegate_)
+      delegate_->ReceivedBytes(this, bytes, size);
+  } else {
+    const auto data = static_cast<const uint8_t*>(bytes);
+    worker->buffer.insert(worker->buffer.end(), data, data + size);
+  }
+  if (worker->length > 0 && worker->received >= worker->length) {
+    worker->done = true;
+    TerminateWorker(worker);
+    ScheduleAdvance();
+  }
+  return !worker->terminating;
+}
+
+void ParallelHttpFetcher::TransferComplete(HttpFetcher* fetcher,
+                                           bool successful) {
+  Worker* worker = GetWorker(fetcher);
+  worker->active = false;
+  if (!worker->done && !worker->terminating) {
+    // A chunk without a length ends with the file, others once all their
+    // bytes were received.
+    if (worker->length == 0 && successful) {
+      worker->done = true;
+    } else {
+      LOG(ERROR) << "Transfer of " << worker->received << " bytes at "
+                 << worker->offset + worker->received << " from "
+                 << urls_[worker->mirror] << " ended early.";
+      if (worker->failovers + 1 < urls_.size()) {
+        worker->failovers++;
+        worker->mirror = (worker->mirror + 1) % urls_.size();
+        worker->failover = true;
+        LOG(INFO) << "Resuming it from " << urls_[worker->mirror];
+      } else {
+        Fail(worker);
+      }
+    }
+  }
+  if (!failed_)
+    http_response_code_ = fetcher->http_response_code();
+  ScheduleAdvance();
+}
+
+void ParallelHttpFetcher::TransferTerminated(HttpFetcher* fetcher) {
+  Worker* worker = GetWorker(fetcher);
+  worker->active = false;
+  if (!failed_)
+    http_response_code_ = fetcher->http_response_code();
+  ScheduleAdvance();
+}
+
+ParallelHttpFetcher::Worker* ParallelHttpFetcher::GetWorker(
+    HttpFetcher* fetcher) {
+  const auto it = std::find_if(
+      workers_.begin(), workers_.end(), [fetcher](const Worker& worker) {
+        return worker.fetcher.get() == fetcher;
+      });
+  CHECK(it != workers_.end());
+  return &*it;
+}
+
+void ParallelHttpFetcher::Fail(Worker* worker) {
+  if (!failed_) {
+    failed_ = true;
+    http_response_code_ = worker->fetcher->http_response_code();
+    auxiliary_error_code_ = worker->fetcher->GetAuxiliaryErrorCode();
+  }
+  ScheduleAdvance();
+}
+
+void ParallelHttpFetcher::ScheduleAdvance() {
+  if (advance_task_ != MessageLoop::kTaskIdNull)
+    return;
+  advance_task_ = MessageLoop::current()->PostTask(
+      FROM_HERE,
+      base::Bind(&ParallelHttpFetcher::Advance, base::Unretained(this)));
+}
+
+void ParallelHttpFetcher::Advance() {
+  advance_task_ = MessageLoop::kTaskIdNull;
+  if (!transfer_active_)
+    return;
+  const bool any_active =
+      std::any_of(workers_.begin(), workers_.end(), [](const Worker& worker) {
+        return worker.active;
+      });
+
+  if (terminating_ || failed_) {
+    TerminateWorkers();
+    // Wait for all the workers to end, so that they can be started again.
+    if (any_active)
+      return;
+    const bool terminated = terminating_;
+    Reset();
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_) {
+      if (terminated)
+        delegate_->TransferTerminated(this);
+      else
+        delegate_->TransferComplete(this, false);
+    }
+    return;
+  }
+  if (paused_)
+    return;
+
+  while (!chunks_.empty()) {
+    Worker* worker = chunks_.front();
+    if (!worker->buffer.empty()) {
+      brillo::Blob bytes;
+      bytes.swap(worker->buffer);
+      if (delegate_)
+        delegate_->ReceivedBytes(this, bytes.data(), bytes.size());
+      if (terminating_ || paused_) {
+        ScheduleAdvance();
+        return;
+      }
+    }
+    if (!worker->done)
+      break;
+    worker->queued = false;
+    chunks_.pop_front();
+  }
+
+  for (auto& worker : workers_) {
+    if (worker.failover && !worker.active) {
+      worker.failover = false;
+      BeginChunkTransfer(&worker);
+    }
+  }
+  for (auto& worker : workers_) {
+    if (worker.active || worker.queued)
+      continue;
+    if (!all_started_)
+      StartChunk(&worker);
+    else if (!SplitChunk(&worker))
+      break;
+  }
+
+  if (all_started_ && chunks_.empty() && !any_active && !failed_) {
+    Reset();
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferComplete(this, true);
+  }
+}
+
+void ParallelHttpFetcher::StartChunk(Worker* worker) {
+  worker->offset = next_offset_;
+  if (length_ > 0) {
+    const off_t end = offset_ + length_;
+    worker->length =
+        std::min(chunk_size_, static_cast<size_t>(end - next_offset_));
+    next_offset_ += worker->length;
+    all_started_ = next_offset_ >= end;
+  } else {
+    worker->length = 0;
+    all_started_ = true;
+  }
+  worker->received = 0;
+  worker->done = false;
+  worker->queued = true;
+  worker->failovers = 0;
+  chunks_.push_back(worker);
+  BeginChunkTransfer(worker);
+}
+
+bool ParallelHttpFetcher::SplitChunk(Worker* worker) {
+  Worker* owner = nullptr;
+  size_t owner_bytes_left = 0;
+  for (Worker* chunk : chunks_) {
+    if (!chunk->active || chunk->terminating || chunk->length == 0)
+      continue;
+    const size_t bytes_left = chunk->length - chunk->received;
+    if (bytes_left > owner_bytes_left) {
+      owner = chunk;
+      owner_bytes_left = bytes_left;
+    }
+  }
+  // Halves of less than a quarter of a chunk aren't worth a new request.
+  if (!owner || owner_bytes_left / 2 < chunk_size_ / 4)
+    return false;
+
+  const size_t owner_length = owner->received + owner_bytes_left / 2;
+  worker->offset = owner->offset + owner_length;
+  worker->length = owner->length - owner_length;
+  owner->length = owner_length;
+  worker->received = 0;
+  worker->done = false;
+  worker->queued = true;
+  worker->failovers = 0;
+  chunks_.insert(std::find(chunks_.begin(), chunks_.end(), owner) + 1, worker);
+  LOG(INFO) << "Moving " << worker->length << " bytes at " << worker->offset
+            << " to another connection.";
+  BeginChunkTransfer(worker);
+  return true;
+}
+
+void ParallelHttpFetcher::BeginChunkTransfer(Worker* worker) {
+  worker->active = true;
+  worker->terminating = false;
+  HttpFetcher* fetcher = worker->fetcher.get();
+  fetcher->SetOffset(worker->offset + worker->received);
+  if (worker->length > 0)
+    fetcher->SetLength(worker->length - worker->received);
+  else
+    fetcher->UnsetLength();
+  fetcher->BeginTransfer(urls_[worker->mirror]);
+}
+
+void ParallelHttpFetcher::TerminateWorker(Worker* worker) {
+  if (worker->active && !worker->terminating) {
+    worker->terminating = true;
+    worker->fetcher->TerminateTransfer();
+  }
+}
+
+void ParallelHttpFetcher::TerminateWorkers() {
+  for (auto& worker : workers_) {
+    TerminateWorker(&worker);
+  }
+}
+
+void ParallelHttpFetcher::Reset() {
+  transfer_active_ = terminating_ = failed_ = false;
+  chunks_.clear();
+  for (auto& worker : workers_) {
+    worker.queued = worker.failover = false;
+    brillo::Blob().swap(worker.buffer);
+  }
+}
+
+}  // namespace chromeos_update_engine
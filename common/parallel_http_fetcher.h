@@ -0,0 +1,186 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_PARALLEL_HTTP_FETCHER_H_
+#define UPDATE_ENGINE_COMMON_PARALLEL_HTTP_FETCHER_H_
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <brillo/message_loops/message_loop.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/http_fetcher.h"
+
+namespace chromeos_update_engine {
+
+// An HttpFetcher downloading a range over several fetchers at once, each with
+// a connection of its own, to get more of the bandwidth of links where a
+// single connection is limited by the latency. The range is split in chunks
+// handed out in order to the fetchers as they become idle. The bytes of the
+// first chunk not delivered yet go straight to the delegate, and those of the
+// following chunks are held until their turn, so the delegate still receives
+// the range in order. At most one chunk per fetcher is held at a time.
+//
+// Once all the chunks are handed out, a fetcher becoming idle takes over the
+// second half of the chunk with the most bytes left, so that the end of the
+// range isn't left to the slowest connection.
+//
+// The file may be served by mirrors as well, which the fetchers are spread
+// over. A chunk whose transfer fails is resumed from the next mirror, and
+// only fails the whole transfer once it failed on all of them.
+//
+// A range without a length, whose end isn't known, is downloaded by a single
+// fetcher. Meant to be the base fetcher of a MultiRangeHttpFetcher, which
+// passes it the ranges one at a time.
+class ParallelHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
+ public:
+  static constexpr size_t kDefaultChunkSize = 4 * 1024 * 1024;  // bytes
+
+  // Takes ownership of |fetchers|, which must not be empty.
+  explicit ParallelHttpFetcher(
+      std::vector<std::unique_ptr<HttpFetcher>> fetchers,
+      size_t chunk_size = kDefaultChunkSize);
+  ~ParallelHttpFetcher() override;
+
+  // Sets the URLs of the mirrors of the file passed to BeginTransfer().
+  void set_mirror_urls(std::vector<std::string> mirror_urls) {
+    mirror_urls_ = std::move(mirror_urls);
+  }
+
+  // HttpFetcher overrides.
+  void SetOffset(off_t offset) override { offset_ = offset; }
+  void SetLength(size_t length) override { length_ = length; }
+  void UnsetLength() override { length_ = 0; }
+
+  void BeginTransfer(const std::string& url) override;
+  void TerminateTransfer() override;
+
+  void SetHeader(const std::string& header_name,
+                 const std::string& header_value) override;
+  bool GetHeader(const std::string& header_name,
+                 std::string* header_value) const override;
+
+  void Pause() override;
+  void Unpause() override;
+
+  void set_idle_seconds(int seconds) override;
+  void set_retry_seconds(int seconds) override;
+  void SetProxies(const std::deque<std::string>& proxies) override;
+  void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override;
+  void set_connect_timeout(int connect_timeout_seconds) override;
+  void set_max_retry_count(int max_retry_count) override;
+
+  size_t GetBytesDownloaded() override;
+
+ private:
+  // One of the fetchers, and the chunk it was last given.
+  struct Worker {
+    std::unique_ptr<HttpFetcher> fetcher;
+    off_t offset{0};
+    // Zero for a chunk up to the end of the file.
+    size_t length{0};
+    size_t received{0};
+    // The bytes received while the worker isn't the first of |chunks_|.
+    brillo::Blob buffer;
+    // Between BeginTransfer() and the end of the transfer.
+    bool active{false};
+    // Whether the worker was asked to terminate its transfer.
+    bool terminating{false};
+    // Whether all the bytes of the chunk were received.
+    bool done{false};
+    // Whether the chunk is in |chunks_|, waiting to be delivered.
+    bool queued{false};
+    // The index in |urls_| of the URL the worker downloads from.
+    size_t mirror{0};
+    // The number of mirrors the chunk was resumed from after a failure, and
+    // whether it is waiting to be resumed.
+    size_t failovers{0};
+    bool failover{false};
+  };
+
+  // HttpFetcherDelegate overrides, for the transfers of the workers. They only
+  // update the state of the worker, leaving the rest to Advance().
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override;
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override;
+  void TransferTerminated(HttpFetcher* fetcher) override;
+
+  Worker* GetWorker(HttpFetcher* fetcher);
+
+  // Fails the whole transfer with the response code of |worker|.
+  void Fail(Worker* worker);
+
+  // Posts a call to Advance(), if none is pending.
+  void ScheduleAdvance();
+
+  // Delivers the held bytes of the chunks whose turn came, gives the next
+  // chunks to the idle workers and tells the delegate once the transfer ended.
+  void Advance();
+
+  // Gives |worker| the next chunk of the range and starts its transfer.
+  void StartChunk(Worker* worker);
+
+  // Gives idle |worker| the second half of the chunk with the most bytes left,
+  // if worth it, and starts its transfer. Returns whether it did.
+  bool SplitChunk(Worker* worker);
+
+  // Starts the transfer of the bytes of the chunk of |worker| not received
+  // yet, from its mirror.
+  void BeginChunkTransfer(Worker* worker);
+
+  // Asks |worker|, or every worker, still transferring to terminate.
+  void TerminateWorker(Worker* worker);
+  void TerminateWorkers();
+
+  // Forgets the transfer, once all the workers ended.
+  void Reset();
+
+  std::vector<Worker> workers_;
+  const size_t chunk_size_;
+
+  std::vector<std::string> mirror_urls_;
+  // The URL passed to BeginTransfer() followed by |mirror_urls_|.
+  std::vector<std::string> urls_;
+
+  // The range to download, set by SetOffset() and SetLength().
+  off_t offset_{0};
+  size_t length_{0};
+
+  // The offset of the next chunk to hand out, and whether there is none left.
+  off_t next_offset_{0};
+  bool all_started_{false};
+
+  // The workers given a chunk not delivered yet, in the order of the chunks.
+  std::deque<Worker*> chunks_;
+
+  bool transfer_active_{false};
+  bool paused_{false};
+  bool terminating_{false};
+  bool failed_{false};
+
+  brillo::MessageLoop::TaskId advance_task_{brillo::MessageLoop::kTaskIdNull};
+
+  DISALLOW_COPY_AND_ASSIGN(ParallelHttpFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_PARALLEL_HTTP_FETCHER_H_
@@ -0,0 +1,235 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/parallel_http_fetcher.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/bind.h>
+#include <base/location.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/mock_http_fetcher.h"
+#include "update_engine/common/multi_range_http_fetcher.h"
+#include "update_engine/common/test_utils.h"
+
+using brillo::MessageLoop;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kDataSize = 300000;
+constexpr size_t kChunkSize = 50000;
+
+class TestDelegate : public HttpFetcherDelegate {
+ public:
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    data.insert(data.end(),
+                static_cast<const uint8_t*>(bytes),
+                static_cast<const uint8_t*>(bytes) + length);
+    if (pause_once) {
+      // Pauses the transfer for a turn of the loop.
+      pause_once = false;
+      fetcher->Pause();
+      MessageLoop::current()->PostTask(
+          FROM_HERE,
+          base::Bind(&HttpFetcher::Unpause, base::Unretained(fetcher)));
+    }
+    if (terminate_after > 0 && data.size() >= terminate_after) {
+      fetcher->TerminateTransfer();
+      return false;
+    }
+    return true;
+  }
+
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    complete = true;
+    success = successful;
+    http_response_code = fetcher->http_response_code();
+    MessageLoop::current()->BreakLoop();
+  }
+
+  void TransferTerminated(HttpFetcher* fetcher) override {
+    terminated = true;
+    MessageLoop::current()->BreakLoop();
+  }
+
+  brillo::Blob data;
+  bool pause_once{false};
+  // Terminates the transfer once this many bytes were received, if not zero.
+  size_t terminate_after{0};
+  bool complete{false};
+  bool success{false};
+  bool terminated{false};
+  int http_response_code{0};
+};
+
+}  // namespace
+
+class ParallelHttpFetcherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    data_.resize(kDataSize);
+    test_utils::FillWithData(&data_);
+  }
+
+  void TearDown() override { EXPECT_FALSE(loop_.PendingTasks()); }
+
+  // Returns a fetcher over |num_fetchers| mock fetchers of |data_|, the
+  // |failing_fetcher|-th of which fails its transfers if set.
+  std::unique_ptr<ParallelHttpFetcher> MakeFetcher(size_t num_fetchers,
+                                                   int failing_fetcher = -1) {
+    vector<std::unique_ptr<HttpFetcher>> fetchers;
+    for (size_t i = 0; i < num_fetchers; i++) {
+      auto fetcher =
+          std::make_unique<MockHttpFetcher>(data_.data(), data_.size());
+      if (static_cast<int>(i) == failing_fetcher)
+        fetcher->FailTransfer(kHttpResponseNotFound);
+      fetchers.push_back(std::move(fetcher));
+    }
+    return std::make_unique<ParallelHttpFetcher>(std::move(fetchers),
+                                                 kChunkSize);
+  }
+
+  void Run(HttpFetcher* fetcher) {
+    fetcher->set_delegate(&delegate_);
+    fetcher->BeginTransfer("http://fake_url");
+    loop_.Run();
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  brillo::Blob data_;
+  TestDelegate delegate_;
+};
+
+TEST_F(ParallelHttpFetcherTest, DeliversRangeInOrderTest) {
+  auto fetcher = MakeFetcher(3);
+  fetcher->SetOffset(1000);
+  fetcher->SetLength(250001);
+  Run(fetcher.get());
+  EXPECT_TRUE(delegate_.complete);
+  EXPECT_TRUE(delegate_.success);
+  EXPECT_EQ(brillo::Blob(data_.begin() + 1000, data_.begin() + 251001),
+            delegate_.data);
+}
+
+TEST_F(ParallelHttpFetcherTest, PauseTest) {
+  auto fetcher = MakeFetcher(3);
+  fetcher->SetLength(kDataSize);
+  delegate_.pause_once = true;
+  Run(fetcher.get());
+  EXPECT_TRUE(delegate_.success);
+  EXPECT_EQ(data_, delegate_.data);
+}
+
+TEST_F(ParallelHttpFetcherTest, RangeWithoutLengthTest) {
+  auto fetcher = MakeFetcher(3);
+  fetcher->SetOffset(5000);
+  fetcher->UnsetLength();
+  Run(fetcher.get());
+  EXPECT_TRUE(delegate_.success);
+  EXPECT_EQ(brillo::Blob(data_.begin() + 5000, data_.end()), delegate_.data);
+}
+
+TEST_F(ParallelHttpFetcherTest, FailedChunkTest) {
+  auto fetcher = MakeFetcher(3, 1);
+  fetcher->SetLength(kDataSize);
+  Run(fetcher.get());
+  EXPECT_TRUE(delegate_.complete);
+  EXPECT_FALSE(delegate_.success);
+  EXPECT_EQ(kHttpResponseNotFound, delegate_.http_response_code);
+  // Nothing past the chunk of the failed fetcher was delivered.
+  EXPECT_LE(delegate_.data.size(), kChunkSize);
+}
+
+TEST_F(ParallelHttpFetcherTest, TerminateTest) {
+  auto fetcher = MakeFetcher(3);
+  fetcher->SetLength(kDataSize);
+  delegate_.terminate_after = 1;
+  Run(fetcher.get());
+  EXPECT_TRUE(delegate_.terminated);
+  EXPECT_FALSE(delegate_.complete);
+}
+
+TEST_F(ParallelHttpFetcherTest, SplitsTailChunkTest) {
+  // Two chunks for three fetchers: the idle one takes over half of the first.
+  vector<std::unique_ptr<HttpFetcher>> fetchers;
+  vector<MockHttpFetcher*> mock_fetchers;
+  for (size_t i = 0; i < 3; i++) {
+    auto fetcher =
+        std::make_unique<MockHttpFetcher>(data_.data(), data_.size());
+    mock_fetchers.push_back(fetcher.get());
+    fetchers.push_back(std::move(fetcher));
+  }
+  ParallelHttpFetcher fetcher(std::move(fetchers), 200000);
+  fetcher.SetLength(kDataSize);
+  Run(&fetcher);
+  EXPECT_TRUE(delegate_.success);
+  EXPECT_EQ(data_, delegate_.data);
+  EXPECT_GT(mock_fetchers[2]->GetBytesDownloaded(), 0u);
+}
+
+TEST_F(ParallelHttpFetcherTest, MirrorFailoverTest) {
+  vector<std::unique_ptr<HttpFetcher>> fetchers;
+  for (size_t i = 0; i < 2; i++) {
+    auto fetcher =
+        std::make_unique<MockHttpFetcher>(data_.data(), data_.size());
+    fetcher->FailTransfersFrom("http://fake_url", kHttpResponseNotFound);
+    fetchers.push_back(std::move(fetcher));
+  }
+  ParallelHttpFetcher fetcher(std::move(fetchers), kChunkSize);
+  fetcher.set_mirror_urls({"http://fake_mirror"});
+  fetcher.SetLength(kDataSize);
+  Run(&fetcher);
+  EXPECT_TRUE(delegate_.success);
+  EXPECT_EQ(data_, delegate_.data);
+}
+
+TEST_F(ParallelHttpFetcherTest, FailedOnAllMirrorsTest) {
+  auto fetcher = MakeFetcher(2, 0);
+  fetcher->set_mirror_urls({"http://fake_mirror"});
+  fetcher->SetLength(kDataSize);
+  Run(fetcher.get());
+  EXPECT_TRUE(delegate_.complete);
+  EXPECT_FALSE(delegate_.success);
+  EXPECT_EQ(kHttpResponseNotFound, delegate_.http_response_code);
+}
+
+TEST_F(ParallelHttpFetcherTest, MultiRangeTest) {
+  MultiRangeHttpFetcher fetcher(MakeFetcher(2).release());
+  fetcher.AddRange(0, 120000);
+  fetcher.AddRange(200000, 30000);
+  fetcher.AddRange(280000);
+  Run(&fetcher);
+  EXPECT_TRUE(delegate_.success);
+  brillo::Blob expected(data_.begin(), data_.begin() + 120000);
+  expected.insert(
+      expected.end(), data_.begin() + 200000, data_.begin() + 230000);
+  expected.insert(expected.end(), data_.begin() + 280000, data_.end());
+  EXPECT_EQ(expected, delegate_.data);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,149 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/payload_spill_cache.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+std::unique_ptr<PayloadSpillCache> PayloadSpillCache::Open(
+    PrefsInterface* prefs,
+    const std::string& path,
+    uint64_t payload_size,
+    uint64_t offset) {
+  if (offset > payload_size) {
+    LOG(ERROR) << "Offset " << offset << " past the end of the payload";
+    return nullptr;
+  }
+  std::string cached_path;
+  int64_t begin = 0, end = 0;
+  if (prefs->GetString(kPrefsSpillCachePath, &cached_path) &&
+      cached_path == path && prefs->GetInt64(kPrefsSpillCacheBegin, &begin) &&
+      prefs->GetInt64(kPrefsSpillCacheEnd, &end) && begin >= 0 &&
+      static_cast<uint64_t>(begin) <= offset &&
+      offset <= static_cast<uint64_t>(end) &&
+      utils::FileSize(path) == static_cast<off_t>(payload_size)) {
+    const int fd = HANDLE_EINTR(open(path.c_str(), O_RDWR | O_CLOEXEC));
+    if (fd >= 0) {
+      LOG(INFO) << "Using the " << end - offset << " bytes of the payload "
+                << "cached in " << path << " from " << offset;
+      return std::unique_ptr<PayloadSpillCache>(
+          new PayloadSpillCache(prefs, fd, payload_size, offset, end));
+    }
+    PLOG(WARNING) << "Unable to open " << path;
+  }
+
+  // Forget about the bytes cached before writing over them.
+  Delete(prefs);
+  const int fd = HANDLE_EINTR(
+      open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to create " << path;
+    return nullptr;
+  }
+  // Allocates the space for the rest of the payload right away, rather than
+  // running out of it in the middle of the download.
+  if (HANDLE_EINTR(ftruncate(fd, payload_size)) != 0 ||
+      HANDLE_EINTR(fallocate(fd, 0, offset, payload_size - offset)) != 0) {
+    PLOG(ERROR) << "Unable to allocate " << payload_size - offset
+                << " bytes for " << path;
+    IGNORE_EINTR(close(fd));
+    base::DeleteFile(base::FilePath(path));
+    return nullptr;
+  }
+  if (!prefs->SetString(kPrefsSpillCachePath, path) ||
+      !prefs->SetInt64(kPrefsSpillCacheBegin, offset) ||
+      !prefs->SetInt64(kPrefsSpillCacheEnd, offset)) {
+    LOG(ERROR) << "Unable to record the cache in " << path;
+    IGNORE_EINTR(close(fd));
+    Delete(prefs);
+    return nullptr;
+  }
+  LOG(INFO) << "Caching the payload in " << path << " from " << offset;
+  return std::unique_ptr<PayloadSpillCache>(
+      new PayloadSpillCache(prefs, fd, payload_size, offset, offset));
+}
+
+void PayloadSpillCache::Delete(PrefsInterface* prefs) {
+  std::string path;
+  if (!prefs->GetString(kPrefsSpillCachePath, &path)) {
+    return;
+  }
+  if (!path.empty() && !base::DeleteFile(base::FilePath(path))) {
+    PLOG(WARNING) << "Unable to delete " << path;
+  }
+  prefs->Delete(kPrefsSpillCacheEnd);
+  prefs->Delete(kPrefsSpillCacheBegin);
+  prefs->Delete(kPrefsSpillCachePath);
+}
+
+PayloadSpillCache::PayloadSpillCache(PrefsInterface* prefs,
+                                     int fd,
+                                     uint64_t payload_size,
+                                     uint64_t begin,
+                                     uint64_t end)
+    : prefs_(prefs),
+      fd_(fd),
+      payload_size_(payload_size),
+      begin_(begin),
+      end_(end),
+      synced_end_(end) {}
+
+PayloadSpillCache::~PayloadSpillCache() {
+  IGNORE_EINTR(close(fd_));
+}
+
+bool PayloadSpillCache::Append(const void* data, size_t length) {
+  TEST_AND_RETURN_FALSE(length <= payload_size_ - end_);
+  TEST_AND_RETURN_FALSE(utils::PWriteAll(fd_, data, length, end_));
+  end_ += length;
+  if (end_ - synced_end_ >= kSyncInterval) {
+    TEST_AND_RETURN_FALSE(Sync());
+  }
+  return true;
+}
+
+bool PayloadSpillCache::Read(uint64_t offset, void* data, size_t length) const {
+  TEST_AND_RETURN_FALSE(offset >= begin_ && offset <= end_ &&
+                        length <= end_ - offset);
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(
+      utils::PReadAll(fd_, data, length, offset, &bytes_read));
+  TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == length);
+  return true;
+}
+
+bool PayloadSpillCache::Sync() {
+  if (synced_end_ == end_) {
+    return true;
+  }
+  TEST_AND_RETURN_FALSE_ERRNO(HANDLE_EINTR(fdatasync(fd_)) == 0);
+  TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsSpillCacheEnd, end_));
+  synced_end_ = end_;
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,91 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_PAYLOAD_SPILL_CACHE_H_
+#define UPDATE_ENGINE_COMMON_PAYLOAD_SPILL_CACHE_H_
+
+#include <memory>
+#include <string>
+
+#include <base/macros.h>
+
+#include "update_engine/common/prefs_interface.h"
+
+namespace chromeos_update_engine {
+
+// A file holding a contiguous part of the payload, at the same offsets as in
+// the payload, for the DownloadAction to receive it from the network ahead of
+// the apply, and for a later attempt to apply it without downloading it again.
+//
+// The bytes are recorded in the prefs as they are synced to disk, every
+// |kSyncInterval| bytes, so that a later attempt only keeps those which made
+// it to disk.
+class PayloadSpillCache {
+ public:
+  // The bytes appended between two syncs of the file.
+  static constexpr uint64_t kSyncInterval = 16 * 1024 * 1024;
+
+  // Opens the cache file at |path| to hold the bytes of a payload of
+  // |payload_size| bytes from |offset| on. The bytes from |offset| on cached
+  // there by an earlier attempt, as recorded in |prefs|, are kept. Otherwise,
+  // the cache starts empty at |offset|, with the file allocated for the rest
+  // of the payload. Returns nullptr on failure, like when there is no space
+  // for it.
+  static std::unique_ptr<PayloadSpillCache> Open(PrefsInterface* prefs,
+                                                 const std::string& path,
+                                                 uint64_t payload_size,
+                                                 uint64_t offset);
+
+  // Deletes the cache file recorded in |prefs|, if any, and its record.
+  static void Delete(PrefsInterface* prefs);
+
+  ~PayloadSpillCache();
+
+  // Appends |length| bytes to the cache, syncing it once |kSyncInterval|
+  // bytes were appended since the last sync.
+  bool Append(const void* data, size_t length);
+
+  // Reads the |length| cached bytes at |offset|.
+  bool Read(uint64_t offset, void* data, size_t length) const;
+
+  // Syncs the cached bytes to disk, and records them in the prefs.
+  bool Sync();
+
+  // The offsets in the payload of the first cached byte and past the last.
+  uint64_t begin() const { return begin_; }
+  uint64_t end() const { return end_; }
+
+ private:
+  PayloadSpillCache(PrefsInterface* prefs,
+                    int fd,
+                    uint64_t payload_size,
+                    uint64_t begin,
+                    uint64_t end);
+
+  PrefsInterface* prefs_;
+  int fd_;
+  const uint64_t payload_size_;
+  const uint64_t begin_;
+  uint64_t end_;
+  // The end of the bytes synced to disk.
+  uint64_t synced_end_;
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadSpillCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_PAYLOAD_SPILL_CACHE_H_
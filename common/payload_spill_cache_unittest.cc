@@ -0,0 +1,125 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/payload_spill_cache.h"
+
+#include <string>
+
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/fake_prefs.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kPayloadSize = 4096 * 16;
+}  // namespace
+
+class PayloadSpillCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(temp_dir_.CreateUniqueTempDir());
+    path_ = temp_dir_.GetPath().Append("spill_cache").value();
+    payload_.resize(kPayloadSize);
+    test_utils::FillWithData(&payload_);
+  }
+
+  brillo::Blob ReadCache(const PayloadSpillCache& cache) {
+    brillo::Blob data(cache.end() - cache.begin());
+    EXPECT_TRUE(cache.Read(cache.begin(), data.data(), data.size()));
+    return data;
+  }
+
+  base::ScopedTempDir temp_dir_;
+  std::string path_;
+  brillo::Blob payload_;
+  FakePrefs prefs_;
+};
+
+TEST_F(PayloadSpillCacheTest, AppendAndReadTest) {
+  auto cache = PayloadSpillCache::Open(&prefs_, path_, kPayloadSize, 100);
+  ASSERT_NE(nullptr, cache);
+  EXPECT_EQ(kPayloadSize, static_cast<size_t>(utils::FileSize(path_)));
+  EXPECT_EQ(100u, cache->begin());
+  EXPECT_EQ(100u, cache->end());
+  ASSERT_TRUE(cache->Append(payload_.data() + 100, 1000));
+  ASSERT_TRUE(cache->Append(payload_.data() + 1100, 2000));
+  EXPECT_EQ(3100u, cache->end());
+  EXPECT_EQ(brillo::Blob(payload_.begin() + 100, payload_.begin() + 3100),
+            ReadCache(*cache));
+  // Nothing is cached outside of the range.
+  uint8_t byte;
+  EXPECT_FALSE(cache->Read(99, &byte, 1));
+  EXPECT_FALSE(cache->Read(3100, &byte, 1));
+  // Nor past the end of the payload.
+  ASSERT_TRUE(cache->Append(payload_.data() + 3100, kPayloadSize - 3100));
+  EXPECT_FALSE(cache->Append(&byte, 1));
+}
+
+TEST_F(PayloadSpillCacheTest, ResumeTest) {
+  {
+    auto cache = PayloadSpillCache::Open(&prefs_, path_, kPayloadSize, 0);
+    ASSERT_NE(nullptr, cache);
+    ASSERT_TRUE(cache->Append(payload_.data(), 5000));
+    ASSERT_TRUE(cache->Sync());
+    // Not synced, so not kept.
+    ASSERT_TRUE(cache->Append(payload_.data() + 5000, 1000));
+  }
+  auto cache = PayloadSpillCache::Open(&prefs_, path_, kPayloadSize, 2000);
+  ASSERT_NE(nullptr, cache);
+  EXPECT_EQ(2000u, cache->begin());
+  EXPECT_EQ(5000u, cache->end());
+  EXPECT_EQ(brillo::Blob(payload_.begin() + 2000, payload_.begin() + 5000),
+            ReadCache(*cache));
+}
+
+TEST_F(PayloadSpillCacheTest, ResumePastTheCacheTest) {
+  {
+    auto cache = PayloadSpillCache::Open(&prefs_, path_, kPayloadSize, 0);
+    ASSERT_NE(nullptr, cache);
+    ASSERT_TRUE(cache->Append(payload_.data(), 5000));
+    ASSERT_TRUE(cache->Sync());
+  }
+  // The bytes in between are missing, so the cache starts over.
+  auto cache = PayloadSpillCache::Open(&prefs_, path_, kPayloadSize, 6000);
+  ASSERT_NE(nullptr, cache);
+  EXPECT_EQ(6000u, cache->begin());
+  EXPECT_EQ(6000u, cache->end());
+}
+
+TEST_F(PayloadSpillCacheTest, DeleteTest) {
+  {
+    auto cache = PayloadSpillCache::Open(&prefs_, path_, kPayloadSize, 0);
+    ASSERT_NE(nullptr, cache);
+    ASSERT_TRUE(cache->Append(payload_.data(), 5000));
+    ASSERT_TRUE(cache->Sync());
+  }
+  PayloadSpillCache::Delete(&prefs_);
+  EXPECT_FALSE(utils::FileExists(path_.c_str()));
+  EXPECT_FALSE(prefs_.Exists(kPrefsSpillCachePath));
+  EXPECT_FALSE(prefs_.Exists(kPrefsSpillCacheEnd));
+  auto cache = PayloadSpillCache::Open(&prefs_, path_, kPayloadSize, 0);
+  ASSERT_NE(nullptr, cache);
+  EXPECT_EQ(0u, cache->end());
+}
+
+}  // namespace chromeos_update_engine
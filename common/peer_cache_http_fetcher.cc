@@ -0,0 +1,265 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/peer_cache_http_fetcher.h"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/hash_calculator.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The end of a segment up to the end of the file.
+constexpr off_t kNoEnd = std::numeric_limits<off_t>::max();
+}  // namespace
+
+PeerCacheHttpFetcher::PeerCacheHttpFetcher(
+    std::unique_ptr<HttpFetcher> peer_fetcher,
+    std::unique_ptr<HttpFetcher> origin_fetcher,
+    string peer_url)
+    : peer_fetcher_(std::move(peer_fetcher)),
+      origin_fetcher_(std::move(origin_fetcher)),
+      peer_url_(std::move(peer_url)) {
+  peer_fetcher_->set_delegate(this);
+  origin_fetcher_->set_delegate(this);
+}
+
+void PeerCacheHttpFetcher::BeginTransfer(const string& url) {
+  CHECK(!transfer_active_) << "BeginTransfer but already active.";
+  url_ = url;
+  http_response_code_ = 0;
+  position_ = offset_;
+  transfer_active_ = true;
+  terminating_ = ending_segment_ = false;
+  StartSegment();
+}
+
+void PeerCacheHttpFetcher::TerminateTransfer() {
+  if (!transfer_active_) {
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferTerminated(this);
+    return;
+  }
+  terminating_ = true;
+  // A segment being ended calls back once terminated, which ends the transfer.
+  if (!ending_segment_)
+    segment_fetcher_->TerminateTransfer();
+}
+
+void PeerCacheHttpFetcher::Pause() {
+  if (paused_)
+    return;
+  paused_ = true;
+  if (transfer_active_ && !ending_segment_)
+    segment_fetcher_->Pause();
+}
+
+void PeerCacheHttpFetcher::Unpause() {
+  if (!paused_)
+    return;
+  paused_ = false;
+  if (transfer_active_ && !ending_segment_)
+    segment_fetcher_->Unpause();
+}
+
+void PeerCacheHttpFetcher::AddVerifiedRange(off_t offset,
+                                            size_t length,
+                                            const brillo::Blob& sha256_hash) {
+  if (length == 0 || length > kMaxVerifiedRangeSize ||
+      sha256_hash.size() != kSHA256Size) {
+    return;
+  }
+  verified_ranges_[offset] = {length, sha256_hash};
+  // A segment from the origin now ends where the range starts, for the range
+  // to come from the cache.
+  if (transfer_active_ && !peer_failed_ && !ending_segment_ &&
+      segment_fetcher_ == origin_fetcher_.get() && offset >= position_ &&
+      offset < segment_end_) {
+    segment_end_ = offset;
+  }
+}
+
+bool PeerCacheHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
+                                         const void* bytes,
+                                         size_t length) {
+  if (fetcher != segment_fetcher_ || terminating_ || ending_segment_)
+    return false;
+  const auto data = static_cast<const uint8_t*>(bytes);
+  const off_t received_end = position_ + peer_buffer_.size();
+  const size_t size =
+      std::min(length, static_cast<size_t>(segment_end_ - received_end));
+  if (fetcher == origin_fetcher_.get()) {
+    position_ += size;
+    // The delegate may terminate the transfer, or add verified ranges, from
+    // this call.
+    if (size > 0 && delegate_)
+      delegate_->ReceivedBytes(this, data, size);
+  } else {
+    peer_buffer_.insert(peer_buffer_.end(), data, data + size);
+    if (!DeliverVerifiedRanges()) {
+      LOG(WARNING) << "Data at " << position_ << " from " << peer_url_
+                   << " doesn't match its hash, getting the rest from the "
+                   << "origin.";
+      peer_failed_ = true;
+      peer_buffer_.clear();
+      EndSegment();
+      return false;
+    }
+  }
+  if (!transfer_active_ || terminating_)
+    return false;
+  if (position_ + static_cast<off_t>(peer_buffer_.size()) >= segment_end_) {
+    EndSegment();
+    return false;
+  }
+  return true;
+}
+
+void PeerCacheHttpFetcher::TransferComplete(HttpFetcher* fetcher,
+                                            bool successful) {
+  if (fetcher != segment_fetcher_)
+    return;
+  http_response_code_ = fetcher->http_response_code();
+  if (terminating_ || ending_segment_) {
+    TransferTerminated(fetcher);
+    return;
+  }
+  if (fetcher == peer_fetcher_.get()) {
+    if (!successful || position_ < segment_end_) {
+      LOG(WARNING) << "Transfer from " << peer_url_ << " failed at "
+                   << position_ << ", getting the rest from the origin.";
+      peer_failed_ = true;
+      peer_buffer_.clear();
+    }
+    StartSegment();
+    return;
+  }
+  if (segment_end_ == kNoEnd) {
+    CompleteTransfer(successful);
+  } else if (!successful || position_ < segment_end_) {
+    CompleteTransfer(false);
+  } else {
+    StartSegment();
+  }
+}
+
+void PeerCacheHttpFetcher::TransferTerminated(HttpFetcher* fetcher) {
+  if (fetcher != segment_fetcher_)
+    return;
+  if (terminating_) {
+    transfer_active_ = terminating_ = ending_segment_ = false;
+    segment_fetcher_ = nullptr;
+    brillo::Blob().swap(peer_buffer_);
+    // Note that after the callback returns this object may be destroyed.
+    if (delegate_)
+      delegate_->TransferTerminated(this);
+  } else if (ending_segment_) {
+    ending_segment_ = false;
+    StartSegment();
+  } else {
+    TransferComplete(fetcher, false);
+  }
+}
+
+bool PeerCacheHttpFetcher::DeliverVerifiedRanges() {
+  while (transfer_active_ && !terminating_ && !peer_buffer_.empty()) {
+    const auto it = verified_ranges_.find(position_);
+    if (it == verified_ranges_.end())
+      return false;
+    const size_t length = it->second.length;
+    if (peer_buffer_.size() < length)
+      return true;
+    brillo::Blob hash;
+    if (!HashCalculator::RawHashOfBytes(peer_buffer_.data(), length, &hash) ||
+        hash != it->second.sha256_hash) {
+      return false;
+    }
+    // Taken out of |peer_buffer_| first, as the delegate may end the transfer.
+    brillo::Blob range_data(peer_buffer_.begin(),
+                            peer_buffer_.begin() + length);
+    peer_buffer_.erase(peer_buffer_.begin(), peer_buffer_.begin() + length);
+    position_ += length;
+    if (delegate_)
+      delegate_->ReceivedBytes(this, range_data.data(), range_data.size());
+  }
+  return true;
+}
+
+void PeerCacheHttpFetcher::StartSegment() {
+  const off_t end = length_ > 0 ? offset_ + length_ : kNoEnd;
+  if (position_ >= end) {
+    CompleteTransfer(true);
+    return;
+  }
+  brillo::Blob().swap(peer_buffer_);
+
+  string url = url_;
+  auto it = peer_failed_ ? verified_ranges_.end()
+                         : verified_ranges_.lower_bound(position_);
+  if (it != verified_ranges_.end() && it->first == position_ &&
+      position_ + static_cast<off_t>(it->second.length) <= end) {
+    // All the verified ranges following each other from here.
+    segment_end_ = position_;
+    while (it != verified_ranges_.end() && it->first == segment_end_ &&
+           segment_end_ + static_cast<off_t>(it->second.length) <= end) {
+      segment_end_ += it->second.length;
+      it++;
+    }
+    segment_fetcher_ = peer_fetcher_.get();
+    url = peer_url_;
+  } else {
+    if (it != verified_ranges_.end() && it->first == position_)
+      it++;
+    segment_end_ =
+        it != verified_ranges_.end() ? std::min(it->first, end) : end;
+    segment_fetcher_ = origin_fetcher_.get();
+  }
+
+  segment_fetcher_->SetOffset(position_);
+  if (segment_end_ != kNoEnd)
+    segment_fetcher_->SetLength(segment_end_ - position_);
+  else
+    segment_fetcher_->UnsetLength();
+  // Paused before it starts, as it may call back right away.
+  if (paused_)
+    segment_fetcher_->Pause();
+  segment_fetcher_->BeginTransfer(url);
+}
+
+void PeerCacheHttpFetcher::EndSegment() {
+  ending_segment_ = true;
+  segment_fetcher_->TerminateTransfer();
+}
+
+void PeerCacheHttpFetcher::CompleteTransfer(bool successful) {
+  transfer_active_ = terminating_ = ending_segment_ = false;
+  segment_fetcher_ = nullptr;
+  brillo::Blob().swap(peer_buffer_);
+  // Note that after the callback returns this object may be destroyed.
+  if (delegate_)
+    delegate_->TransferComplete(this, successful);
+}
+
+}  // namespace chromeos_update_engine
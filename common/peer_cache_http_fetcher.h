@@ -0,0 +1,171 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_PEER_CACHE_HTTP_FETCHER_H_
+#define UPDATE_ENGINE_COMMON_PEER_CACHE_HTTP_FETCHER_H_
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/http_fetcher.h"
+
+namespace chromeos_update_engine {
+
+// An HttpFetcher getting the bytes of the file it knows the hash of from a
+// cache on the local network, or a peer which downloaded the same file, and
+// the others from the origin server, in order to save on the WAN bandwidth
+// when several devices download the same payload.
+//
+// The bytes of every range added with AddVerifiedRange() are held until all of
+// them were received from the cache and checked against their hash. A range
+// which doesn't match, or the cache failing the transfer, makes the fetcher
+// get the rest of the file from the origin. Ranges added during a transfer
+// are used for the parts of it not started yet, so the data blobs of a
+// payload come from the cache once its manifest was received from the origin.
+class PeerCacheHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
+ public:
+  // Ranges larger than this come from the origin, instead of being held in
+  // memory until checked.
+  static constexpr size_t kMaxVerifiedRangeSize = 16 * 1024 * 1024;  // bytes
+
+  // Takes ownership of the fetchers. |peer_fetcher| downloads the file from
+  // |peer_url| and |origin_fetcher| from the URL passed to BeginTransfer().
+  // The headers and the connection settings only apply to |origin_fetcher|,
+  // the caller sets up |peer_fetcher|.
+  PeerCacheHttpFetcher(std::unique_ptr<HttpFetcher> peer_fetcher,
+                       std::unique_ptr<HttpFetcher> origin_fetcher,
+                       std::string peer_url);
+  ~PeerCacheHttpFetcher() override = default;
+
+  // HttpFetcher overrides.
+  void SetOffset(off_t offset) override { offset_ = offset; }
+  void SetLength(size_t length) override { length_ = length; }
+  void UnsetLength() override { length_ = 0; }
+
+  void BeginTransfer(const std::string& url) override;
+  void TerminateTransfer() override;
+
+  void SetHeader(const std::string& header_name,
+                 const std::string& header_value) override {
+    origin_fetcher_->SetHeader(header_name, header_value);
+  }
+  bool GetHeader(const std::string& header_name,
+                 std::string* header_value) const override {
+    return origin_fetcher_->GetHeader(header_name, header_value);
+  }
+
+  void Pause() override;
+  void Unpause() override;
+
+  void set_idle_seconds(int seconds) override {
+    origin_fetcher_->set_idle_seconds(seconds);
+  }
+  void set_retry_seconds(int seconds) override {
+    origin_fetcher_->set_retry_seconds(seconds);
+  }
+  void SetProxies(const std::deque<std::string>& proxies) override {
+    HttpFetcher::SetProxies(proxies);
+    origin_fetcher_->SetProxies(proxies);
+  }
+  void set_low_speed_limit(int low_speed_bps, int low_speed_sec) override {
+    origin_fetcher_->set_low_speed_limit(low_speed_bps, low_speed_sec);
+  }
+  void set_connect_timeout(int connect_timeout_seconds) override {
+    origin_fetcher_->set_connect_timeout(connect_timeout_seconds);
+  }
+  void set_max_retry_count(int max_retry_count) override {
+    origin_fetcher_->set_max_retry_count(max_retry_count);
+  }
+
+  size_t GetBytesDownloaded() override {
+    return peer_fetcher_->GetBytesDownloaded() +
+           origin_fetcher_->GetBytesDownloaded();
+  }
+
+  void AddVerifiedRange(off_t offset,
+                        size_t length,
+                        const brillo::Blob& sha256_hash) override;
+
+ private:
+  struct VerifiedRange {
+    size_t length;
+    brillo::Blob sha256_hash;
+  };
+
+  // HttpFetcherDelegate overrides, for the transfers of the segments.
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override;
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override;
+  void TransferTerminated(HttpFetcher* fetcher) override;
+
+  // Passes the held bytes of the verified ranges received in full to the
+  // delegate, if they match their hash. Returns false if one doesn't.
+  bool DeliverVerifiedRanges();
+
+  // Starts the transfer of the next segment of the file from |position_|:
+  // the verified ranges following each other from there, or the bytes up to
+  // the next verified range.
+  void StartSegment();
+
+  // Ends the transfer of the current segment, which goes on from the next one.
+  void EndSegment();
+
+  // Ends the whole transfer and tells the delegate.
+  void CompleteTransfer(bool successful);
+
+  std::unique_ptr<HttpFetcher> peer_fetcher_;
+  std::unique_ptr<HttpFetcher> origin_fetcher_;
+  const std::string peer_url_;
+
+  // The verified ranges, by offset in the file.
+  std::map<off_t, VerifiedRange> verified_ranges_;
+
+  // Set once the cache failed, to get everything else from the origin.
+  bool peer_failed_{false};
+
+  // The range to download, set by SetOffset() and SetLength().
+  off_t offset_{0};
+  size_t length_{0};
+
+  // The offset in the file of the next byte to pass to the delegate.
+  off_t position_{0};
+
+  // The fetcher of the current segment, and the offset in the file where the
+  // segment ends, the largest off_t for a segment up to the end of the file.
+  HttpFetcher* segment_fetcher_{nullptr};
+  off_t segment_end_{0};
+  // The bytes of the current segment received from the cache and not
+  // delivered yet, starting at |position_|.
+  brillo::Blob peer_buffer_;
+
+  bool transfer_active_{false};
+  bool paused_{false};
+  bool terminating_{false};
+  // Whether the current segment is being terminated, for the next one to
+  // start once it is.
+  bool ending_segment_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(PeerCacheHttpFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_PEER_CACHE_HTTP_FETCHER_H_
@@ -0,0 +1,160 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/peer_cache_http_fetcher.h"
+
+#include <functional>
+#include <memory>
+
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/mock_http_fetcher.h"
+#include "update_engine/common/test_utils.h"
+
+using brillo::MessageLoop;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kDataSize = 300000;
+
+class TestDelegate : public HttpFetcherDelegate {
+ public:
+  bool ReceivedBytes(HttpFetcher* fetcher,
+                     const void* bytes,
+                     size_t length) override {
+    data.insert(data.end(),
+                static_cast<const uint8_t*>(bytes),
+                static_cast<const uint8_t*>(bytes) + length);
+    if (on_received_bytes)
+      on_received_bytes();
+    return true;
+  }
+
+  void TransferComplete(HttpFetcher* fetcher, bool successful) override {
+    complete = true;
+    success = successful;
+    MessageLoop::current()->BreakLoop();
+  }
+
+  void TransferTerminated(HttpFetcher* fetcher) override {
+    MessageLoop::current()->BreakLoop();
+  }
+
+  brillo::Blob data;
+  // Called after every call to ReceivedBytes(), if set.
+  std::function<void()> on_received_bytes;
+  bool complete{false};
+  bool success{false};
+};
+
+}  // namespace
+
+class PeerCacheHttpFetcherTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    data_.resize(kDataSize);
+    test_utils::FillWithData(&data_);
+    SetPeerData(data_);
+  }
+
+  void TearDown() override { EXPECT_FALSE(loop_.PendingTasks()); }
+
+  // Sets the file served by the cache.
+  void SetPeerData(const brillo::Blob& peer_data) {
+    auto peer_fetcher =
+        std::make_unique<MockHttpFetcher>(peer_data.data(), peer_data.size());
+    peer_fetcher_ = peer_fetcher.get();
+    fetcher_ = std::make_unique<PeerCacheHttpFetcher>(
+        std::move(peer_fetcher),
+        std::make_unique<MockHttpFetcher>(data_.data(), data_.size()),
+        "http://fake_peer");
+  }
+
+  // Adds the verified range of |data_| of |length| bytes at |offset|.
+  void AddVerifiedRange(off_t offset, size_t length) {
+    brillo::Blob hash;
+    ASSERT_TRUE(
+        HashCalculator::RawHashOfBytes(data_.data() + offset, length, &hash));
+    fetcher_->AddVerifiedRange(offset, length, hash);
+  }
+
+  void Run() {
+    fetcher_->set_delegate(&delegate_);
+    fetcher_->BeginTransfer("http://fake_url");
+    loop_.Run();
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  brillo::Blob data_;
+  MockHttpFetcher* peer_fetcher_{nullptr};
+  std::unique_ptr<PeerCacheHttpFetcher> fetcher_;
+  TestDelegate delegate_;
+};
+
+TEST_F(PeerCacheHttpFetcherTest, ServesVerifiedRangesFromPeerTest) {
+  AddVerifiedRange(10000, 50000);
+  AddVerifiedRange(60000, 50000);
+  fetcher_->SetLength(200000);
+  Run();
+  EXPECT_TRUE(delegate_.success);
+  EXPECT_EQ(brillo::Blob(data_.begin(), data_.begin() + 200000),
+            delegate_.data);
+  EXPECT_GT(peer_fetcher_->GetBytesDownloaded(), 0u);
+}
+
+TEST_F(PeerCacheHttpFetcherTest, HashMismatchTest) {
+  brillo::Blob peer_data = data_;
+  peer_data[70000]++;
+  SetPeerData(peer_data);
+  AddVerifiedRange(10000, 50000);
+  AddVerifiedRange(60000, 50000);
+  AddVerifiedRange(110000, 50000);
+  fetcher_->SetLength(200000);
+  Run();
+  EXPECT_TRUE(delegate_.success);
+  EXPECT_EQ(brillo::Blob(data_.begin(), data_.begin() + 200000),
+            delegate_.data);
+}
+
+TEST_F(PeerCacheHttpFetcherTest, PeerFailureTest) {
+  peer_fetcher_->FailTransfer(kHttpResponseNotFound);
+  AddVerifiedRange(10000, 50000);
+  fetcher_->SetLength(200000);
+  Run();
+  EXPECT_TRUE(delegate_.success);
+  EXPECT_EQ(brillo::Blob(data_.begin(), data_.begin() + 200000),
+            delegate_.data);
+}
+
+TEST_F(PeerCacheHttpFetcherTest, RangesAddedDuringTransferTest) {
+  // As the data blobs of a payload once its manifest is received.
+  delegate_.on_received_bytes = [this] {
+    delegate_.on_received_bytes = nullptr;
+    AddVerifiedRange(200000, 50000);
+  };
+  fetcher_->UnsetLength();
+  Run();
+  EXPECT_TRUE(delegate_.success);
+  EXPECT_EQ(data_, delegate_.data);
+  EXPECT_GT(peer_fetcher_->GetBytesDownloaded(), 0u);
+}
+
+}  // namespace chromeos_update_engine
@@ -16,17 +16,24 @@
 
 #include "update_engine/common/prefs.h"
 
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
 #include <algorithm>
 #include <filesystem>
-#include <unistd.h>
+#include <set>
 
 #include <android-base/file.h>
+#include <android-base/unique_fd.h>
 #include <base/files/file_enumerator.h>
 #include <base/files/file_util.h>
+#include <base/location.h>
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
+#include <base/strings/stringprintf.h>
 
 #include "update_engine/common/utils.h"
 
@@ -37,6 +44,13 @@ namespace chromeos_update_engine {
 
 namespace {
 
+// Starts with a dot, which isn't allowed in keys.
+constexpr char kJournalFileName[] = ".transaction_journal";
+constexpr char kJournalHeader[] = "update_engine prefs journal 1\n";
+
+// How long the keys of deferred durability stay in memory only.
+constexpr int kDeferredWriteDelaySeconds = 10;
+
 void DeleteEmptyDirectories(const base::FilePath& path) {
   base::FileEnumerator path_enum(
       path, false /* recursive */, base::FileEnumerator::DIRECTORIES);
@@ -55,17 +69,43 @@ void DeleteEmptyDirectories(const base::FilePath& path) {
 }  // namespace
 
 bool PrefsBase::GetString(const std::string_view key, string* value) const {
-  return storage_->GetKey(key, value);
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  const std::optional<string>& cached_value = GetCachedKey(key);
+  if (!cached_value)
+    return false;
+  *value = *cached_value;
+  return true;
+}
+
+const std::optional<string>& PrefsBase::GetCachedKey(
+    std::string_view key) const {
+  auto it = cache_.find(key);
+  if (it == cache_.end()) {
+    string value;
+    std::optional<string> cached_value;
+    if (storage_->GetKey(key, &value))
+      cached_value = std::move(value);
+    it = cache_.emplace(string{key}, std::move(cached_value)).first;
+  }
+  return it->second;
 }
 
 bool PrefsBase::SetString(std::string_view key, std::string_view value) {
-  TEST_AND_RETURN_FALSE(storage_->SetKey(key, value));
-  const auto observers_for_key = observers_.find(key);
-  if (observers_for_key != observers_.end()) {
-    std::vector<ObserverInterface*> copy_observers(observers_for_key->second);
-    for (ObserverInterface* observer : copy_observers)
-      observer->OnPrefSet(key);
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    if (!transaction_active_ &&
+        deferred_keys_.find(key) != deferred_keys_.end()) {
+      DeferWrite(key);
+    } else if (!storage_->SetKey(key, value)) {
+      const auto it = cache_.find(key);
+      if (it != cache_.end())
+        cache_.erase(it);
+      return false;
+    }
+    cache_.insert_or_assign(string{key}, string{value});
   }
+  for (ObserverInterface* observer : GetObservers(key))
+    observer->OnPrefSet(key);
   return true;
 }
 
@@ -112,17 +152,26 @@ bool PrefsBase::SetBoolean(std::string_view key, const bool value) {
 }
 
 bool PrefsBase::Exists(std::string_view key) const {
-  return storage_->KeyExists(key);
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  return GetCachedKey(key).has_value();
 }
 
 bool PrefsBase::Delete(std::string_view key) {
-  TEST_AND_RETURN_FALSE(storage_->DeleteKey(key));
-  const auto observers_for_key = observers_.find(key);
-  if (observers_for_key != observers_.end()) {
-    std::vector<ObserverInterface*> copy_observers(observers_for_key->second);
-    for (ObserverInterface* observer : copy_observers)
-      observer->OnPrefDeleted(key);
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    if (!transaction_active_ &&
+        deferred_keys_.find(key) != deferred_keys_.end()) {
+      DeferWrite(key);
+    } else if (!storage_->DeleteKey(key)) {
+      const auto it = cache_.find(key);
+      if (it != cache_.end())
+        cache_.erase(it);
+      return false;
+    }
+    cache_.insert_or_assign(string{key}, std::nullopt);
   }
+  for (ObserverInterface* observer : GetObservers(key))
+    observer->OnPrefDeleted(key);
   return true;
 }
 
@@ -145,15 +194,29 @@ bool PrefsBase::Delete(std::string_view pref_key, const vector<string>& nss) {
 }
 
 bool PrefsBase::GetSubKeys(std::string_view ns, vector<string>* keys) const {
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  // Doesn't see the deferred writes not flushed yet, which are for keys
+  // outside of namespaces in practice.
   return storage_->GetSubKeys(ns, keys);
 }
 
+std::vector<PrefsInterface::ObserverInterface*> PrefsBase::GetObservers(
+    std::string_view key) const {
+  std::lock_guard<std::mutex> lock(observers_mutex_);
+  const auto observers_for_key = observers_.find(key);
+  if (observers_for_key == observers_.end())
+    return {};
+  return observers_for_key->second;
+}
+
 void PrefsBase::AddObserver(std::string_view key, ObserverInterface* observer) {
+  std::lock_guard<std::mutex> lock(observers_mutex_);
   observers_[std::string{key}].push_back(observer);
 }
 
 void PrefsBase::RemoveObserver(std::string_view key,
                                ObserverInterface* observer) {
+  std::lock_guard<std::mutex> lock(observers_mutex_);
   std::vector<ObserverInterface*>& observers_for_key =
       observers_[std::string{key}];
   auto observer_it =
@@ -169,85 +232,168 @@ string PrefsInterface::CreateSubKey(const vector<string>& ns_and_key) {
 // Prefs
 
 bool Prefs::Init(const base::FilePath& prefs_dir) {
+  ResetCache();
   return file_storage_.Init(prefs_dir);
 }
 
 bool PrefsBase::StartTransaction() {
-  return storage_->CreateTemporaryPrefs();
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  // The deferred keys changed in the transaction are written with it.
+  FlushDeferredWritesLocked();
+  transaction_active_ = storage_->StartTransaction();
+  return transaction_active_;
 }
 
 bool PrefsBase::CancelTransaction() {
-  return storage_->DeleteTemporaryPrefs();
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  if (transaction_active_) {
+    // The cache has the values of the transaction.
+    cache_.clear();
+    transaction_active_ = false;
+  }
+  return storage_->CancelTransaction();
 }
 
 bool PrefsBase::SubmitTransaction() {
-  return storage_->SwapPrefs();
-}
-
-std::string Prefs::FileStorage::GetTemporaryDir() const {
-  return prefs_dir_.value() + "_tmp";
-}
-
-bool Prefs::FileStorage::CreateTemporaryPrefs() {
-  // Delete any existing prefs_tmp
-  DeleteTemporaryPrefs();
-  // Get the paths to the source and destination directories.
-  std::filesystem::path source_directory(prefs_dir_.value());
-  std::filesystem::path destination_directory(GetTemporaryDir());
-
-  if (!std::filesystem::exists(source_directory)) {
-    LOG(ERROR) << "prefs directory does not exist: " << source_directory;
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  transaction_active_ = false;
+  if (!storage_->SubmitTransaction()) {
+    cache_.clear();
     return false;
   }
-  // Copy the directory.
-  std::filesystem::copy(source_directory, destination_directory);
-
   return true;
 }
 
-bool Prefs::FileStorage::DeleteTemporaryPrefs() {
-  std::filesystem::path destination_directory(GetTemporaryDir());
-
-  if (std::filesystem::exists(destination_directory)) {
-    return std::filesystem::remove_all(destination_directory);
+bool PrefsBase::SetKeys(const Changes& changes) {
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    const bool success = storage_->SetKeys(changes);
+    for (const auto& [key, value] : changes) {
+      // The keys of deferred durability are written with the others.
+      const auto dirty = dirty_keys_.find(key);
+      if (dirty != dirty_keys_.end())
+        dirty_keys_.erase(dirty);
+      if (success) {
+        cache_.insert_or_assign(key, value);
+        continue;
+      }
+      const auto it = cache_.find(key);
+      if (it != cache_.end())
+        cache_.erase(it);
+    }
+    if (!success)
+      return false;
+  }
+  for (const auto& [key, value] : changes) {
+    for (ObserverInterface* observer : GetObservers(key)) {
+      if (value)
+        observer->OnPrefSet(key);
+      else
+        observer->OnPrefDeleted(key);
+    }
   }
   return true;
 }
 
-bool Prefs::FileStorage::SwapPrefs() {
-  if (!utils::DeleteDirectory(prefs_dir_.value().c_str())) {
-    LOG(ERROR) << "Failed to remove prefs dir " << prefs_dir_;
-    return false;
+void PrefsBase::SetDurability(std::string_view key, Durability durability) {
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  if (durability == Durability::kDeferred) {
+    deferred_keys_.emplace(key);
+    return;
   }
-  if (rename(GetTemporaryDir().c_str(), prefs_dir_.value().c_str()) != 0) {
-    LOG(ERROR) << "Error replacing prefs with prefs_tmp" << strerror(errno);
-    return false;
-  }
-  if (!utils::FsyncDirectory(
-          android::base::Dirname(prefs_dir_.value()).c_str())) {
-    PLOG(ERROR) << "Failed to fsync prefs parent dir after swapping prefs";
+  const auto it = deferred_keys_.find(key);
+  if (it != deferred_keys_.end())
+    deferred_keys_.erase(it);
+  if (dirty_keys_.find(key) != dirty_keys_.end())
+    FlushDeferredWritesLocked();
+}
+
+void PrefsBase::DeferWrite(std::string_view key) {
+  dirty_keys_.emplace(key);
+  // Without a message loop, the writes wait for the next flush.
+  if (flush_task_.IsScheduled() || !brillo::MessageLoop::current())
+    return;
+  LOG_IF(WARNING,
+         !flush_task_.PostTask(
+             FROM_HERE,
+             [this] { FlushDeferredWrites(); },
+             base::TimeDelta::FromSeconds(kDeferredWriteDelaySeconds)))
+      << "Unable to schedule the deferred pref writes.";
+}
+
+bool PrefsBase::FlushDeferredWrites() {
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  return FlushDeferredWritesLocked();
+}
+
+bool PrefsBase::FlushDeferredWritesLocked() {
+  flush_task_.Cancel();
+  bool success = true;
+  for (const string& key : dirty_keys_) {
+    const std::optional<string>& value = cache_.find(key)->second;
+    if (!(value ? storage_->SetKey(key, *value) : storage_->DeleteKey(key))) {
+      LOG(ERROR) << "Failed to write the deferred pref " << key;
+      success = false;
+    }
   }
-  return true;
+  dirty_keys_.clear();
+  return success;
+}
+
+void PrefsBase::ResetCache() {
+  std::lock_guard<std::mutex> lock(cache_mutex_);
+  FlushDeferredWritesLocked();
+  cache_.clear();
 }
 
 bool Prefs::FileStorage::Init(const base::FilePath& prefs_dir) {
   prefs_dir_ = prefs_dir;
-  if (!std::filesystem::exists(prefs_dir_.value())) {
-    LOG(INFO) << "Prefs dir does not exist, possibly due to an interrupted "
-                 "transaction.";
-    if (std::filesystem::exists(GetTemporaryDir())) {
-      SwapPrefs();
+  // Older versions made the changes of a transaction in a copy of the prefs
+  // directory, then swapped it with the directory.
+  const string temporary_dir = prefs_dir_.value() + "_tmp";
+  if (std::filesystem::exists(temporary_dir)) {
+    if (!std::filesystem::exists(prefs_dir_.value())) {
+      LOG(INFO) << "Prefs dir does not exist, possibly due to an interrupted "
+                   "transaction.";
+      if (rename(temporary_dir.c_str(), prefs_dir_.value().c_str()) != 0)
+        PLOG(ERROR) << "Error replacing prefs with " << temporary_dir;
+    } else {
+      utils::DeleteDirectory(temporary_dir.c_str());
     }
   }
 
   // Delete empty directories. Ignore errors when deleting empty directories.
   DeleteEmptyDirectories(prefs_dir_);
+
+  // Write the keys of the last transactions again, in case the update engine
+  // stopped before their files were synced.
+  Changes changes;
+  if (!ReadJournal(&changes)) {
+    LOG(ERROR) << "Ignoring the corrupted prefs journal.";
+    unlink(prefs_dir_.Append(kJournalFileName).value().c_str());
+    return true;
+  }
+  for (const auto& [key, value] : changes) {
+    LOG_IF(ERROR, !WriteKey(key, value, false))
+        << "Failed to replay pref " << key << " from the journal";
+  }
+  journaled_ = std::move(changes);
   return true;
 }
 
 bool Prefs::FileStorage::GetKey(std::string_view key, string* value) const {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (transaction_active_) {
+    const auto it = pending_.find(key);
+    if (it != pending_.end()) {
+      if (!it->second)
+        return false;
+      *value = *it->second;
+      return true;
+    }
+  }
   if (!base::ReadFileToString(filename, value)) {
     return false;
   }
@@ -258,6 +404,8 @@ bool Prefs::FileStorage::GetSubKeys(std::string_view ns,
                                     vector<string>* keys) const {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(ns, &filename));
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::set<string> sub_keys;
   base::FileEnumerator namespace_enum(
       prefs_dir_, true, base::FileEnumerator::FILES);
   for (base::FilePath f = namespace_enum.Next(); !f.empty();
@@ -265,40 +413,222 @@ bool Prefs::FileStorage::GetSubKeys(std::string_view ns,
     auto filename_str = filename.value();
     if (f.value().compare(0, filename_str.length(), filename_str) == 0) {
       // Only return the key portion excluding the |prefs_dir_| with slash.
-      keys->push_back(f.value().substr(
+      sub_keys.insert(f.value().substr(
           prefs_dir_.AsEndingWithSeparator().value().length()));
     }
   }
+  if (transaction_active_) {
+    for (const auto& [key, value] : pending_) {
+      if (key.compare(0, ns.size(), ns) != 0)
+        continue;
+      if (value)
+        sub_keys.insert(key);
+      else
+        sub_keys.erase(key);
+    }
+  }
+  keys->insert(keys->end(), sub_keys.begin(), sub_keys.end());
   return true;
 }
 
 bool Prefs::FileStorage::SetKey(std::string_view key, std::string_view value) {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
-  if (!base::DirectoryExists(filename.DirName())) {
-    // Only attempt to create the directory if it doesn't exist to avoid calls
-    // to parent directories where we might not have permission to write to.
-    TEST_AND_RETURN_FALSE(base::CreateDirectory(filename.DirName()));
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (transaction_active_) {
+    pending_[string{key}] = string{value};
+    return true;
   }
-  TEST_AND_RETURN_FALSE(
-      utils::WriteStringToFileAtomic(filename.value(), value));
-  return true;
+  if (journaled_.find(key) != journaled_.end()) {
+    // Replaying the journal would revert the key.
+    TEST_AND_RETURN_FALSE(FlushJournal());
+  }
+  return WriteKey(key, string{value}, true);
 }
 
 bool Prefs::FileStorage::KeyExists(std::string_view key) const {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (transaction_active_) {
+    const auto it = pending_.find(key);
+    if (it != pending_.end())
+      return it->second.has_value();
+  }
   return base::PathExists(filename);
 }
 
 bool Prefs::FileStorage::DeleteKey(std::string_view key) {
   base::FilePath filename;
   TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (transaction_active_) {
+    pending_[string{key}] = std::nullopt;
+    return true;
+  }
+  if (journaled_.find(key) != journaled_.end()) {
+    TEST_AND_RETURN_FALSE(FlushJournal());
+  }
+  return WriteKey(key, std::nullopt, true);
+}
+
+bool Prefs::FileStorage::StartTransaction() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  LOG_IF(WARNING, transaction_active_)
+      << "Dropping the changes of the unfinished prefs transaction.";
+  transaction_active_ = true;
+  pending_.clear();
+  return true;
+}
+
+bool Prefs::FileStorage::CancelTransaction() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  transaction_active_ = false;
+  pending_.clear();
+  return true;
+}
+
+bool Prefs::FileStorage::SubmitTransaction() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  TEST_AND_RETURN_FALSE(transaction_active_);
+  transaction_active_ = false;
+  Changes changes = std::move(pending_);
+  pending_.clear();
+  return CommitChanges(changes);
+}
+
+bool Prefs::FileStorage::SetKeys(const Changes& changes) {
+  for (const auto& [key, value] : changes) {
+    base::FilePath filename;
+    TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  // The keys of the transaction in progress are written when it is
+  // submitted, after these.
+  return CommitChanges(changes);
+}
+
+bool Prefs::FileStorage::CommitChanges(const Changes& changes) {
+  if (changes.empty())
+    return true;
+
+  // The journal keeps the changes of the previous transactions, whose files
+  // may not be synced either.
+  Changes journal = journaled_;
+  for (const auto& [key, value] : changes)
+    journal[key] = value;
+  if (!base::DirectoryExists(prefs_dir_))
+    TEST_AND_RETURN_FALSE(base::CreateDirectory(prefs_dir_));
+  TEST_AND_RETURN_FALSE(WriteJournal(journal));
+  journaled_ = std::move(journal);
+
+  // The journal is durable, so the files don't have to be synced.
+  bool success = true;
+  for (const auto& [key, value] : changes) {
+    if (!WriteKey(key, value, false)) {
+      LOG(ERROR) << "Failed to write pref " << key;
+      success = false;
+    }
+  }
+  return success;
+}
+
+bool Prefs::FileStorage::WriteKey(std::string_view key,
+                                  const std::optional<string>& value,
+                                  bool sync) {
+  base::FilePath filename;
+  TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+  if (!value) {
 #if BASE_VER < 800000
-  TEST_AND_RETURN_FALSE(base::DeleteFile(filename, false));
+    TEST_AND_RETURN_FALSE(base::DeleteFile(filename, false));
 #else
-  TEST_AND_RETURN_FALSE(base::DeleteFile(filename));
+    TEST_AND_RETURN_FALSE(base::DeleteFile(filename));
 #endif
+    return true;
+  }
+  if (!base::DirectoryExists(filename.DirName())) {
+    // Only attempt to create the directory if it doesn't exist to avoid calls
+    // to parent directories where we might not have permission to write to.
+    TEST_AND_RETURN_FALSE(base::CreateDirectory(filename.DirName()));
+  }
+  if (sync) {
+    TEST_AND_RETURN_FALSE(
+        utils::WriteStringToFileAtomic(filename.value(), *value));
+    return true;
+  }
+  // Still renamed, for a reader to never see a partially written value.
+  const string tmp_path = filename.value() + ".tmp";
+  TEST_AND_RETURN_FALSE(
+      utils::WriteFile(tmp_path.c_str(), value->data(), value->size()));
+  if (rename(tmp_path.c_str(), filename.value().c_str()) != 0) {
+    PLOG(ERROR) << "rename failed from " << tmp_path << " to " << filename;
+    return false;
+  }
+  return true;
+}
+
+bool Prefs::FileStorage::WriteJournal(const Changes& changes) {
+  string journal = kJournalHeader;
+  for (const auto& [key, value] : changes) {
+    if (value) {
+      base::StringAppendF(&journal, "S %s %zu\n", key.c_str(), value->size());
+      journal += *value;
+    } else {
+      base::StringAppendF(&journal, "D %s\n", key.c_str());
+    }
+  }
+  return utils::WriteStringToFileAtomic(
+      prefs_dir_.Append(kJournalFileName).value(), journal);
+}
+
+bool Prefs::FileStorage::ReadJournal(Changes* changes) const {
+  string journal;
+  if (!base::ReadFileToString(prefs_dir_.Append(kJournalFileName), &journal))
+    return true;
+  TEST_AND_RETURN_FALSE(base::StartsWith(journal, kJournalHeader));
+  size_t pos = strlen(kJournalHeader);
+  while (pos < journal.size()) {
+    const size_t end = journal.find('\n', pos);
+    TEST_AND_RETURN_FALSE(end != string::npos);
+    const vector<string> fields = base::SplitString(
+        journal.substr(pos, end - pos),
+        " ",
+        base::KEEP_WHITESPACE,
+        base::SPLIT_WANT_ALL);
+    pos = end + 1;
+    if (fields.size() == 2 && fields[0] == "D") {
+      (*changes)[fields[1]] = std::nullopt;
+      continue;
+    }
+    size_t size = 0;
+    TEST_AND_RETURN_FALSE(fields.size() == 3 && fields[0] == "S" &&
+                          base::StringToSizeT(fields[2], &size) &&
+                          size <= journal.size() - pos);
+    (*changes)[fields[1]] = journal.substr(pos, size);
+    pos += size;
+  }
+  return true;
+}
+
+bool Prefs::FileStorage::FlushJournal() {
+  std::set<string> dirs;
+  for (const auto& [key, value] : journaled_) {
+    base::FilePath filename;
+    TEST_AND_RETURN_FALSE(GetFileNameForKey(key, &filename));
+    dirs.insert(filename.DirName().value());
+    if (!value)
+      continue;
+    android::base::unique_fd fd(TEMP_FAILURE_RETRY(
+        open(filename.value().c_str(), O_RDONLY | O_CLOEXEC)));
+    TEST_AND_RETURN_FALSE_ERRNO(fd != -1 && fsync(fd) == 0);
+  }
+  for (const string& dir : dirs)
+    TEST_AND_RETURN_FALSE(utils::FsyncDirectory(dir.c_str()));
+  TEST_AND_RETURN_FALSE_ERRNO(
+      unlink(prefs_dir_.Append(kJournalFileName).value().c_str()) == 0 ||
+      errno == ENOENT);
+  TEST_AND_RETURN_FALSE(utils::FsyncDirectory(prefs_dir_.value().c_str()));
+  journaled_.clear();
   return true;
 }
 
@@ -309,14 +639,8 @@ bool Prefs::FileStorage::GetFileNameForKey(std::string_view key,
   for (char c : key)
     TEST_AND_RETURN_FALSE(base::IsAsciiAlpha(c) || base::IsAsciiDigit(c) ||
                           c == '_' || c == '-' || c == kKeySeparator);
-  if (std::filesystem::exists(GetTemporaryDir())) {
-    *filename =
-        base::FilePath(GetTemporaryDir())
-            .Append(base::FilePath::StringPieceType(key.data(), key.size()));
-  } else {
-    *filename = prefs_dir_.Append(
-        base::FilePath::StringPieceType(key.data(), key.size()));
-  }
+  *filename = prefs_dir_.Append(
+      base::FilePath::StringPieceType(key.data(), key.size()));
   return true;
 }
 
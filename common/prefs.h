@@ -19,6 +19,9 @@
 
 #include <functional>
 #include <map>
+#include <mutex>
+#include <optional>
+#include <set>
 #include <string>
 #include <string_view>
 #include <vector>
@@ -27,11 +30,17 @@
 
 #include "gtest/gtest_prod.h"  // for FRIEND_TEST
 #include "update_engine/common/prefs_interface.h"
+#include "update_engine/common/scoped_task_id.h"
 
 namespace chromeos_update_engine {
 
 // Implements a preference store by storing the value associated with a key
 // in a given storage passed during construction.
+//
+// The values read and written are cached, so that reading a key again
+// doesn't go to the storage. The keys of deferred durability are only written
+// to the storage some time after they are set, once for all the changes made
+// in between. The derived classes flush them before destroying the storage.
 class PrefsBase : public PrefsInterface {
  public:
   // Storage interface used to set and retrieve keys.
@@ -60,16 +69,24 @@ class PrefsBase : public PrefsInterface {
     // key was deleted.
     virtual bool DeleteKey(std::string_view key) = 0;
 
-    // Makes a copy of prefs directory called prefs_tmp, which is modified
-    // during update_engine checkpointing
-    virtual bool CreateTemporaryPrefs() { return false; }
-
-    // Deletes prefs_tmp directory
-    virtual bool DeleteTemporaryPrefs() { return false; }
-
-    // Replaces prefs with prefs_tmp to make update_engine checkpointing more
-    // atomic
-    virtual bool SwapPrefs() { return false; }
+    // Starts holding the keys set or deleted until SubmitTransaction(),
+    // which persists them all at once, or CancelTransaction(), which drops
+    // them. Returns false if the storage doesn't support transactions, in
+    // which case the keys are changed right away.
+    virtual bool StartTransaction() { return false; }
+    virtual bool CancelTransaction() { return false; }
+    virtual bool SubmitTransaction() { return false; }
+
+    // Persists all the keys of |changes| at once, outside of the transaction
+    // in progress, if any. The storages without transactions change them one
+    // at a time.
+    virtual bool SetKeys(const Changes& changes) {
+      for (const auto& [key, value] : changes) {
+        if (!(value ? SetKey(key, *value) : DeleteKey(key)))
+          return false;
+      }
+      return true;
+    }
 
    private:
     DISALLOW_COPY_AND_ASSIGN(StorageInterface);
@@ -87,6 +104,9 @@ class PrefsBase : public PrefsInterface {
   bool StartTransaction() override;
   bool CancelTransaction() override;
   bool SubmitTransaction() override;
+  bool SetKeys(const Changes& changes) override;
+  void SetDurability(std::string_view key, Durability durability) override;
+  bool FlushDeferredWrites() override;
 
   bool Exists(std::string_view key) const override;
   bool Delete(std::string_view key) override;
@@ -100,24 +120,67 @@ class PrefsBase : public PrefsInterface {
   void RemoveObserver(std::string_view key,
                       ObserverInterface* observer) override;
 
+ protected:
+  // Flushes the deferred writes and forgets the cached values, for the store
+  // to use another storage or the storage to be changed underneath.
+  void ResetCache();
+
  private:
+  // Returns the cached value of |key|, reading it from the storage on the
+  // first call. Called with |cache_mutex_| held.
+  const std::optional<std::string>& GetCachedKey(std::string_view key) const;
+
+  // Marks |key| as changed in the cache only, and schedules a flush if none
+  // is. Called with |cache_mutex_| held.
+  void DeferWrite(std::string_view key);
+
+  // Same as FlushDeferredWrites(), with |cache_mutex_| held.
+  bool FlushDeferredWritesLocked();
+
+  // Returns a copy of the observers of |key|, for them to be called without
+  // holding |observers_mutex_|.
+  std::vector<ObserverInterface*> GetObservers(std::string_view key) const;
+
   // The registered observers watching for changes.
   std::map<std::string, std::vector<ObserverInterface*>, std::less<>>
       observers_;
+  mutable std::mutex observers_mutex_;
 
   // The concrete implementation of the storage used for the keys.
   StorageInterface* storage_;
 
+  // Guards the members below, and the calls to |storage_|.
+  mutable std::mutex cache_mutex_;
+  // The values of the keys read or written so far, nullopt for the keys which
+  // don't exist.
+  mutable std::map<std::string, std::optional<std::string>, std::less<>>
+      cache_;
+  // The keys of deferred durability, and those changed in |cache_| only.
+  std::set<std::string, std::less<>> deferred_keys_;
+  std::set<std::string, std::less<>> dirty_keys_;
+  // Whether the storage has a transaction in progress.
+  bool transaction_active_{false};
+  // The task flushing |dirty_keys_|.
+  ScopedTaskId flush_task_;
+
   DISALLOW_COPY_AND_ASSIGN(PrefsBase);
 };
 
 // Implements a preference store by storing the value associated with
 // a key in a separate file named after the key under a preference
 // store directory.
+//
+// The keys changed in a transaction are written together in a journal file,
+// with a single fsync, before being written to their own files without one.
+// The journal is replayed on Init() after a crash. It grows with the keys
+// changed by the following transactions, which are usually the same few
+// checkpointing keys, and is only flushed to the files of its keys when one
+// of them is changed outside of a transaction.
 
 class Prefs : public PrefsBase {
  public:
   Prefs() : PrefsBase(&file_storage_) {}
+  ~Prefs() override { FlushDeferredWrites(); }
 
   // Initializes the store by associating this object with |prefs_dir|
   // as the preference store directory. Returns true on success, false
@@ -142,9 +205,10 @@ class Prefs : public PrefsBase {
     bool SetKey(std::string_view key, std::string_view value) override;
     bool KeyExists(std::string_view key) const override;
     bool DeleteKey(std::string_view key) override;
-    bool CreateTemporaryPrefs() override;
-    bool DeleteTemporaryPrefs() override;
-    bool SwapPrefs() override;
+    bool StartTransaction() override;
+    bool CancelTransaction() override;
+    bool SubmitTransaction() override;
+    bool SetKeys(const Changes& changes) override;
 
    private:
     FRIEND_TEST(PrefsTest, GetFileNameForKey);
@@ -156,11 +220,35 @@ class Prefs : public PrefsBase {
     bool GetFileNameForKey(std::string_view key,
                            base::FilePath* filename) const;
 
-    // Returns path of prefs_tmp used during update_engine checkpointing
-    std::string GetTemporaryDir() const;
+    // Writes |value| to the file of |key|, or deletes it if nullopt, with
+    // an fsync only if |sync|.
+    bool WriteKey(std::string_view key,
+                  const std::optional<std::string>& value,
+                  bool sync);
+
+    // Journals |changes| with the changes already in the journal, then writes
+    // them to the files of their keys. Called with |mutex_| held.
+    bool CommitChanges(const Changes& changes);
+
+    // Writes |changes| to the journal, replacing it atomically.
+    bool WriteJournal(const Changes& changes);
+    // Reads the journal into |changes|. Returns false if it is corrupted.
+    bool ReadJournal(Changes* changes) const;
+    // Syncs the files of the keys in |journaled_| and deletes the journal,
+    // for the keys to be changed without it.
+    bool FlushJournal();
 
     // Preference store directory.
     base::FilePath prefs_dir_;
+
+    // Guards the members below, and the files of the keys.
+    mutable std::mutex mutex_;
+    // The changes of the transaction in progress, if any.
+    bool transaction_active_{false};
+    Changes pending_;
+    // The changes in the journal, written to the files of their keys but
+    // maybe not synced yet.
+    Changes journaled_;
   };
 
   // The concrete file storage implementation.
@@ -175,6 +263,7 @@ class Prefs : public PrefsBase {
 class MemoryPrefs : public PrefsBase {
  public:
   MemoryPrefs() : PrefsBase(&mem_storage_) {}
+  ~MemoryPrefs() override { FlushDeferredWrites(); }
 
  private:
   class MemoryStorage : public PrefsBase::StorageInterface {
@@ -19,7 +19,11 @@
 
 #include <stdint.h>
 
+#include <functional>
+#include <map>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <vector>
 
 namespace chromeos_update_engine {
@@ -43,6 +47,22 @@ class PrefsInterface {
     virtual void OnPrefDeleted(std::string_view key) = 0;
   };
 
+  // How soon a key set or deleted outside of a transaction is persisted.
+  enum class Durability {
+    // Before Set*() or Delete() returns. The default.
+    kImmediate,
+    // Within a few seconds, at the latest when FlushDeferredWrites() is
+    // called or the store is destroyed. For the keys whose latest values
+    // can be lost in a crash, such as metrics counters, and written too often
+    // to be synced every time.
+    kDeferred,
+  };
+
+  // The new value of each key changed by SetKeys(), or nullopt for the keys
+  // it deletes.
+  using Changes =
+      std::map<std::string, std::optional<std::string>, std::less<>>;
+
   virtual ~PrefsInterface() = default;
 
   // Gets a string |value| associated with |key|. Returns true on
@@ -105,17 +125,39 @@ class PrefsInterface {
   virtual void RemoveObserver(std::string_view key,
                               ObserverInterface* observer) = 0;
 
-  // create tmp_prefs to write to during checkpointing. Flush will replace prefs
-  // with tmp_prefs
+  // Starts a transaction: the keys set or deleted until SubmitTransaction()
+  // are persisted all at once, so that checkpointing never leaves a mix of
+  // old and new values. Returns false if the store doesn't support them, in
+  // which case the keys are changed one at a time.
   virtual bool StartTransaction() = 0;
 
-  // cancel any pending transaction by deleting tmp_prefs
+  // Drops the changes of the transaction in progress, if any.
   virtual bool CancelTransaction() = 0;
 
-  // swap prefs with tmp_prefs checkpointing will use new tmp prefs to resume
-  // updates, otherwise we fall back on old prefs
+  // Atomically persists the changes of the transaction in progress.
   virtual bool SubmitTransaction() = 0;
 
+  // Sets and deletes the keys of |changes| all at once, in a transaction of
+  // their own which leaves the one in progress and the deferred writes
+  // alone. Unlike the transactions, may be called off the thread of the
+  // message loop. The stores which don't support transactions change the keys
+  // one at a time.
+  virtual bool SetKeys(const Changes& changes) {
+    for (const auto& [key, value] : changes) {
+      if (!(value ? SetString(key, *value) : Delete(key)))
+        return false;
+    }
+    return true;
+  }
+
+  // Sets the durability of |key|, for the stores which support deferring
+  // writes.
+  virtual void SetDurability(std::string_view key, Durability durability) {}
+
+  // Persists the keys of deferred durability set or deleted since they last
+  // were. Returns whether all of them were.
+  virtual bool FlushDeferredWrites() { return true; }
+
  protected:
   // Key separator used to create sub key and get file names,
   static const char kKeySeparator = '/';
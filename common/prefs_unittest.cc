@@ -584,6 +584,119 @@ TEST_F(PrefsTest, MultiNamespaceKeyTest) {
   MultiNamespaceKeyTest();
 }
 
+TEST_F(PrefsTest, TransactionTest) {
+  const string kOtherKey = "other-key";
+  ASSERT_TRUE(prefs_.SetString(kOtherKey, "old"));
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 1234));
+  EXPECT_TRUE(prefs_.Delete(kOtherKey));
+  // The changes are visible, but not written yet.
+  int64_t value = 0;
+  EXPECT_TRUE(prefs_.GetInt64(kKey, &value));
+  EXPECT_EQ(1234, value);
+  EXPECT_FALSE(prefs_.Exists(kOtherKey));
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append(kKey)));
+  EXPECT_TRUE(base::PathExists(prefs_dir_.Append(kOtherKey)));
+  EXPECT_TRUE(prefs_.SubmitTransaction());
+
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir_));
+  EXPECT_TRUE(prefs.GetInt64(kKey, &value));
+  EXPECT_EQ(1234, value);
+  EXPECT_FALSE(prefs.Exists(kOtherKey));
+}
+
+TEST_F(PrefsTest, CancelTransactionTest) {
+  ASSERT_TRUE(prefs_.SetString(kKey, "old"));
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "new"));
+  EXPECT_TRUE(prefs_.CancelTransaction());
+  string value;
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ("old", value);
+  EXPECT_FALSE(prefs_.SubmitTransaction());
+}
+
+TEST_F(PrefsTest, TransactionReplayedOnInitTest) {
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "new\nvalue"));
+  EXPECT_TRUE(prefs_.SubmitTransaction());
+  // As if the file of the key wasn't synced before a crash.
+  ASSERT_TRUE(SetValue(kKey, "old"));
+
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir_));
+  string value;
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ("new\nvalue", value);
+}
+
+TEST_F(PrefsTest, SetAfterTransactionNotRevertedTest) {
+  ASSERT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "transaction"));
+  EXPECT_TRUE(prefs_.SubmitTransaction());
+  EXPECT_TRUE(prefs_.SetString(kKey, "later"));
+
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(prefs_dir_));
+  string value;
+  EXPECT_TRUE(prefs.GetString(kKey, &value));
+  EXPECT_EQ("later", value);
+}
+
+TEST_F(PrefsTest, ReadsAreCachedTest) {
+  ASSERT_TRUE(SetValue(kKey, "old"));
+  string value;
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  // Only seen after a write through the prefs.
+  ASSERT_TRUE(SetValue(kKey, "changed underneath"));
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ("old", value);
+  EXPECT_TRUE(prefs_.SetString(kKey, "new"));
+  EXPECT_TRUE(prefs_.GetString(kKey, &value));
+  EXPECT_EQ("new", value);
+}
+
+TEST_F(PrefsTest, DeferredWriteTest) {
+  prefs_.SetDurability(kKey, PrefsInterface::Durability::kDeferred);
+  EXPECT_TRUE(prefs_.SetInt64(kKey, 5));
+  int64_t value = 0;
+  EXPECT_TRUE(prefs_.GetInt64(kKey, &value));
+  EXPECT_EQ(5, value);
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append(kKey)));
+
+  EXPECT_TRUE(prefs_.FlushDeferredWrites());
+  string file_value;
+  EXPECT_TRUE(base::ReadFileToString(prefs_dir_.Append(kKey), &file_value));
+  EXPECT_EQ("5", file_value);
+
+  EXPECT_TRUE(prefs_.Delete(kKey));
+  EXPECT_FALSE(prefs_.Exists(kKey));
+  EXPECT_TRUE(base::PathExists(prefs_dir_.Append(kKey)));
+  EXPECT_TRUE(prefs_.FlushDeferredWrites());
+  EXPECT_FALSE(base::PathExists(prefs_dir_.Append(kKey)));
+}
+
+TEST_F(PrefsTest, DeferredWriteFlushedTest) {
+  {
+    Prefs prefs;
+    ASSERT_TRUE(prefs.Init(prefs_dir_));
+    prefs.SetDurability(kKey, PrefsInterface::Durability::kDeferred);
+    EXPECT_TRUE(prefs.SetString(kKey, "destroyed"));
+  }
+  string value;
+  EXPECT_TRUE(base::ReadFileToString(prefs_dir_.Append(kKey), &value));
+  EXPECT_EQ("destroyed", value);
+
+  // Starting a transaction flushes the deferred writes too.
+  prefs_.SetDurability(kKey, PrefsInterface::Durability::kDeferred);
+  EXPECT_TRUE(prefs_.SetString(kKey, "before transaction"));
+  EXPECT_TRUE(prefs_.StartTransaction());
+  EXPECT_TRUE(base::ReadFileToString(prefs_dir_.Append(kKey), &value));
+  EXPECT_EQ("before transaction", value);
+  EXPECT_TRUE(prefs_.CancelTransaction());
+}
+
 class MemoryPrefsTest : public BasePrefsTest {
  protected:
   void SetUp() override { common_prefs_ = &prefs_; }
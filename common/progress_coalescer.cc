@@ -0,0 +1,49 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/progress_coalescer.h"
+
+#include <cmath>
+
+using update_engine::UpdateStatus;
+
+namespace chromeos_update_engine {
+
+bool ProgressCoalescer::ShouldNotify(UpdateStatus status,
+                                     double progress,
+                                     base::Time now) const {
+  if (!notified_ || status != status_)
+    return true;
+  if (progress == progress_)
+    return false;
+  if (progress == 1.0)
+    return true;
+  const base::TimeDelta elapsed = now - time_;
+  if (std::abs(progress - progress_) >= min_delta_ && elapsed >= min_interval_)
+    return true;
+  return elapsed >= max_interval_;
+}
+
+void ProgressCoalescer::Notified(UpdateStatus status,
+                                 double progress,
+                                 base::Time now) {
+  notified_ = true;
+  status_ = status;
+  progress_ = progress;
+  time_ = now;
+}
+
+}  // namespace chromeos_update_engine
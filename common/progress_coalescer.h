@@ -0,0 +1,71 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_PROGRESS_COALESCER_H_
+#define UPDATE_ENGINE_COMMON_PROGRESS_COALESCER_H_
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/client_library/include/update_engine/update_status.h"
+
+namespace chromeos_update_engine {
+
+// Decides which of the progress updates of an update are worth notifying the
+// clients about, so that the many progress callbacks of the download and of
+// the verification don't each result in binder calls to all of them.
+//
+// A change of status, and the progress reaching 1, are always notified. The
+// other changes of progress are notified once they moved the progress by at
+// least the minimum delta and the minimum interval passed since the last
+// notification, or once the maximum interval passed, for a progress too slow
+// to ever move by the minimum delta.
+class ProgressCoalescer {
+ public:
+  ProgressCoalescer(base::TimeDelta min_interval,
+                    double min_delta,
+                    base::TimeDelta max_interval)
+      : min_interval_(min_interval),
+        min_delta_(min_delta),
+        max_interval_(max_interval) {}
+
+  // Returns whether |status| and |progress| should be notified at |now|.
+  bool ShouldNotify(update_engine::UpdateStatus status,
+                    double progress,
+                    base::Time now) const;
+
+  // Records that |status| and |progress| were notified at |now|.
+  void Notified(update_engine::UpdateStatus status,
+                double progress,
+                base::Time now);
+
+ private:
+  const base::TimeDelta min_interval_;
+  const double min_delta_;
+  const base::TimeDelta max_interval_;
+
+  // What was notified last, and when. Nothing was before the first Notified().
+  bool notified_{false};
+  update_engine::UpdateStatus status_{update_engine::UpdateStatus::IDLE};
+  double progress_{0};
+  base::Time time_;
+
+  DISALLOW_COPY_AND_ASSIGN(ProgressCoalescer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_PROGRESS_COALESCER_H_
@@ -0,0 +1,82 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/progress_coalescer.h"
+
+#include <gtest/gtest.h>
+
+using base::Time;
+using base::TimeDelta;
+using update_engine::UpdateStatus;
+
+namespace chromeos_update_engine {
+
+class ProgressCoalescerTest : public ::testing::Test {
+ protected:
+  ProgressCoalescer coalescer_{TimeDelta::FromMilliseconds(500),
+                               0.01,
+                               TimeDelta::FromSeconds(10)};
+  Time start_ = Time::FromInternalValue(1000000);
+};
+
+TEST_F(ProgressCoalescerTest, FirstNotificationTest) {
+  EXPECT_TRUE(coalescer_.ShouldNotify(UpdateStatus::IDLE, 0, start_));
+}
+
+TEST_F(ProgressCoalescerTest, StatusChangeTest) {
+  coalescer_.Notified(UpdateStatus::DOWNLOADING, 0.5, start_);
+  // A new status is notified right away, even with the same progress.
+  EXPECT_TRUE(coalescer_.ShouldNotify(UpdateStatus::VERIFYING, 0.5, start_));
+}
+
+TEST_F(ProgressCoalescerTest, MinDeltaAndIntervalTest) {
+  coalescer_.Notified(UpdateStatus::DOWNLOADING, 0.5, start_);
+  const Time later = start_ + TimeDelta::FromSeconds(1);
+  EXPECT_FALSE(coalescer_.ShouldNotify(UpdateStatus::DOWNLOADING, 0.5, later));
+  EXPECT_FALSE(
+      coalescer_.ShouldNotify(UpdateStatus::DOWNLOADING, 0.505, later));
+  EXPECT_TRUE(coalescer_.ShouldNotify(UpdateStatus::DOWNLOADING, 0.52, later));
+  // Too soon after the last notification, whatever the progress.
+  const Time soon = start_ + TimeDelta::FromMilliseconds(100);
+  EXPECT_FALSE(coalescer_.ShouldNotify(UpdateStatus::DOWNLOADING, 0.6, soon));
+}
+
+TEST_F(ProgressCoalescerTest, ProgressGoingBackTest) {
+  // The verification starts over from 0 with the same status.
+  coalescer_.Notified(UpdateStatus::VERIFYING, 1.0, start_);
+  EXPECT_TRUE(coalescer_.ShouldNotify(
+      UpdateStatus::VERIFYING, 0.1, start_ + TimeDelta::FromSeconds(1)));
+}
+
+TEST_F(ProgressCoalescerTest, FinalProgressTest) {
+  coalescer_.Notified(UpdateStatus::DOWNLOADING, 0.995, start_);
+  EXPECT_TRUE(coalescer_.ShouldNotify(UpdateStatus::DOWNLOADING, 1.0, start_));
+  coalescer_.Notified(UpdateStatus::DOWNLOADING, 1.0, start_);
+  EXPECT_FALSE(
+      coalescer_.ShouldNotify(UpdateStatus::DOWNLOADING, 1.0, start_));
+}
+
+TEST_F(ProgressCoalescerTest, MaxIntervalTest) {
+  coalescer_.Notified(UpdateStatus::DOWNLOADING, 0.5, start_);
+  EXPECT_FALSE(coalescer_.ShouldNotify(UpdateStatus::DOWNLOADING,
+                                       0.501,
+                                       start_ + TimeDelta::FromSeconds(9)));
+  EXPECT_TRUE(coalescer_.ShouldNotify(UpdateStatus::DOWNLOADING,
+                                      0.501,
+                                      start_ + TimeDelta::FromSeconds(10)));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,140 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/resource_governor.h"
+
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <base/files/file_enumerator.h>
+#include <base/files/file_path.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// From linux/ioprio.h, which not all the kernel headers have.
+constexpr int kIoprioWhoProcess = 1;
+constexpr int kIoprioClassShift = 13;
+
+constexpr char kTasksPath[] = "/proc/self/task";
+
+// Returns the ids of all the threads of the daemon.
+std::vector<pid_t> GetThreadIds() {
+  std::vector<pid_t> tids;
+  base::FileEnumerator tasks(base::FilePath(kTasksPath),
+                             false /* recursive */,
+                             base::FileEnumerator::DIRECTORIES);
+  for (base::FilePath task = tasks.Next(); !task.empty(); task = tasks.Next()) {
+    int tid = 0;
+    if (base::StringToInt(task.BaseName().value(), &tid))
+      tids.push_back(tid);
+  }
+  return tids;
+}
+
+bool SetIoPriority(pid_t tid, IoPriorityClass io_class, int io_level) {
+  const int ioprio = (static_cast<int>(io_class) << kIoprioClassShift) |
+                     (io_class == IoPriorityClass::kNone ? 0 : io_level);
+  return syscall(SYS_ioprio_set, kIoprioWhoProcess, tid, ioprio) == 0;
+}
+
+bool SetAffinity(pid_t tid, const std::vector<int>& cpus) {
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  if (cpus.empty()) {
+    // The kernel only keeps the CPUs the cpuset of the daemon allows.
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, &cpu_set);
+  } else {
+    for (int cpu : cpus) {
+      if (cpu >= 0 && cpu < CPU_SETSIZE)
+        CPU_SET(cpu, &cpu_set);
+    }
+  }
+  return sched_setaffinity(tid, sizeof(cpu_set), &cpu_set) == 0;
+}
+
+}  // namespace
+
+const char* UpdatePhaseToString(UpdatePhase phase) {
+  switch (phase) {
+    case UpdatePhase::kIdle:
+      return "idle";
+    case UpdatePhase::kDownload:
+      return "download";
+    case UpdatePhase::kVerify:
+      return "verify";
+    case UpdatePhase::kPostinstall:
+      return "postinstall";
+    case UpdatePhase::kMerge:
+      return "merge";
+    case UpdatePhase::kSourceIndex:
+      return "source-index";
+  }
+  return "unknown";
+}
+
+ResourceGovernor::~ResourceGovernor() {
+  Apply(ResourcePolicy());
+}
+
+void ResourceGovernor::EnterPhase(UpdatePhase phase) {
+  if (phase == phase_)
+    return;
+  phase_ = phase;
+  if (!performance_mode_)
+    Apply(hardware_->GetResourcePolicy(phase_));
+}
+
+void ResourceGovernor::SetPerformanceMode(bool enable) {
+  if (enable == performance_mode_)
+    return;
+  performance_mode_ = enable;
+  Apply(performance_mode_ ? ResourcePolicy()
+                          : hardware_->GetResourcePolicy(phase_));
+}
+
+void ResourceGovernor::Apply(const ResourcePolicy& policy) {
+  if (policy == applied_)
+    return;
+  const bool io_changed = policy.io_class != applied_.io_class ||
+                          policy.io_level != applied_.io_level;
+  const bool cpus_changed = policy.cpus != applied_.cpus;
+  std::string cpus = policy.cpus.empty() ? "all" : "";
+  for (int cpu : policy.cpus)
+    cpus += (cpus.empty() ? "" : ",") + base::NumberToString(cpu);
+  LOG(INFO) << "Applying the resource policy of the "
+            << UpdatePhaseToString(phase_) << " phase: I/O class "
+            << static_cast<int>(policy.io_class) << " level "
+            << policy.io_level << ", CPUs " << cpus << ", download rate "
+            << policy.max_download_rate;
+  for (pid_t tid : GetThreadIds()) {
+    if (io_changed && !SetIoPriority(tid, policy.io_class, policy.io_level))
+      PLOG(WARNING) << "Failed to set the I/O priority of thread " << tid;
+    if (cpus_changed && !SetAffinity(tid, policy.cpus))
+      PLOG(WARNING) << "Failed to set the CPU affinity of thread " << tid;
+  }
+  applied_ = policy;
+}
+
+}  // namespace chromeos_update_engine
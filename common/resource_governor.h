@@ -0,0 +1,71 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_RESOURCE_GOVERNOR_H_
+#define UPDATE_ENGINE_COMMON_RESOURCE_GOVERNOR_H_
+
+#include <base/macros.h>
+
+#include "update_engine/common/hardware_interface.h"
+#include "update_engine/common/resource_policy.h"
+
+namespace chromeos_update_engine {
+
+// Applies the ResourcePolicy the hardware gives for each phase of the update
+// to all the threads of the daemon: their I/O priority and the CPUs they may
+// run on. The threads started later inherit them from the thread starting
+// them. The download rate of the policy is enforced by the DownloadAction,
+// which reads it from policy().
+//
+// In performance mode, the policies are not applied, and the threads get back
+// the resources they had, so that the task profiles of the performance mode
+// apply.
+class ResourceGovernor {
+ public:
+  explicit ResourceGovernor(HardwareInterface* hardware)
+      : hardware_(hardware) {}
+  // Gives the threads back the resources they had.
+  ~ResourceGovernor();
+
+  // Applies the policy of |phase|, if it changed.
+  void EnterPhase(UpdatePhase phase);
+
+  // Stops applying the policies while |enable|. Call before changing the task
+  // profiles when enabling it, and after when disabling it.
+  void SetPerformanceMode(bool enable);
+
+  UpdatePhase phase() const { return phase_; }
+
+  // The policy currently applied.
+  const ResourcePolicy& policy() const { return applied_; }
+
+ private:
+  // Applies |policy| to all the threads, for what differs from |applied_|.
+  void Apply(const ResourcePolicy& policy);
+
+  HardwareInterface* hardware_;
+
+  UpdatePhase phase_{UpdatePhase::kIdle};
+  bool performance_mode_{false};
+  // The default policy changes nothing.
+  ResourcePolicy applied_;
+
+  DISALLOW_COPY_AND_ASSIGN(ResourceGovernor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_RESOURCE_GOVERNOR_H_
@@ -0,0 +1,116 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/resource_governor.h"
+
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/fake_hardware.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+cpu_set_t GetAffinity() {
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  EXPECT_EQ(0, sched_getaffinity(0, sizeof(cpu_set), &cpu_set));
+  return cpu_set;
+}
+
+int GetFirstCpu(const cpu_set_t& cpu_set) {
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &cpu_set))
+      return cpu;
+  }
+  return -1;
+}
+
+}  // namespace
+
+class ResourceGovernorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    initial_affinity_ = GetAffinity();
+    cpu_ = GetFirstCpu(initial_affinity_);
+    ASSERT_GE(cpu_, 0);
+    ResourcePolicy policy;
+    policy.io_class = IoPriorityClass::kBestEffort;
+    policy.io_level = 7;
+    policy.cpus = {cpu_};
+    policy.max_download_rate = 1024;
+    hardware_.SetResourcePolicy(UpdatePhase::kVerify, policy);
+  }
+
+  // Whether the thread runs only on |cpu_|.
+  bool OnlyOnCpu() {
+    cpu_set_t cpu_set = GetAffinity();
+    return CPU_COUNT(&cpu_set) == 1 && CPU_ISSET(cpu_, &cpu_set);
+  }
+
+  bool HasInitialAffinity() {
+    cpu_set_t cpu_set = GetAffinity();
+    return CPU_EQUAL(&cpu_set, &initial_affinity_);
+  }
+
+  FakeHardware hardware_;
+  ResourceGovernor governor_{&hardware_};
+  cpu_set_t initial_affinity_;
+  int cpu_{-1};
+};
+
+TEST_F(ResourceGovernorTest, AppliesPhasePolicyTest) {
+  governor_.EnterPhase(UpdatePhase::kVerify);
+  EXPECT_EQ(UpdatePhase::kVerify, governor_.phase());
+  EXPECT_EQ(1024u, governor_.policy().max_download_rate);
+  EXPECT_TRUE(OnlyOnCpu());
+  // The best effort class, level 7.
+  EXPECT_EQ((2 << 13) | 7, syscall(SYS_ioprio_get, 1, 0));
+
+  governor_.EnterPhase(UpdatePhase::kIdle);
+  EXPECT_EQ(ResourcePolicy(), governor_.policy());
+  EXPECT_TRUE(HasInitialAffinity());
+}
+
+TEST_F(ResourceGovernorTest, PerformanceModeTest) {
+  governor_.EnterPhase(UpdatePhase::kVerify);
+  governor_.SetPerformanceMode(true);
+  EXPECT_EQ(ResourcePolicy(), governor_.policy());
+  EXPECT_TRUE(HasInitialAffinity());
+
+  // The phase changes while in performance mode apply once it is disabled.
+  governor_.EnterPhase(UpdatePhase::kDownload);
+  governor_.EnterPhase(UpdatePhase::kVerify);
+  EXPECT_EQ(ResourcePolicy(), governor_.policy());
+  governor_.SetPerformanceMode(false);
+  EXPECT_EQ(1024u, governor_.policy().max_download_rate);
+  EXPECT_TRUE(OnlyOnCpu());
+}
+
+TEST_F(ResourceGovernorTest, RestoresOnDestructionTest) {
+  {
+    ResourceGovernor governor(&hardware_);
+    governor.EnterPhase(UpdatePhase::kVerify);
+    EXPECT_TRUE(OnlyOnCpu());
+  }
+  EXPECT_TRUE(HasInitialAffinity());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,78 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_RESOURCE_POLICY_H_
+#define UPDATE_ENGINE_COMMON_RESOURCE_POLICY_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace chromeos_update_engine {
+
+// The phases of an update, which use the resources of the device differently.
+enum class UpdatePhase {
+  kIdle,
+  // The payload is downloaded and applied to the target partitions.
+  kDownload,
+  // The target partitions are hashed, and their verity data written.
+  kVerify,
+  // The postinstall programs run.
+  kPostinstall,
+  // The snapshots of the previous update are merged.
+  kMerge,
+  // The partitions of the current slot are hashed while the device is idle,
+  // for the next update from it.
+  kSourceIndex,
+};
+
+const char* UpdatePhaseToString(UpdatePhase phase);
+
+// The I/O scheduling classes of ioprio_set(2). kNone gives the threads the
+// default priority derived from their CPU nice value.
+enum class IoPriorityClass : int {
+  kNone = 0,
+  kRealtime = 1,
+  kBestEffort = 2,
+  kIdle = 3,
+};
+
+// How the threads of update_engine use the device during an update phase, so
+// that a background update doesn't get in the way of the foreground apps.
+struct ResourcePolicy {
+  bool operator==(const ResourcePolicy& that) const {
+    return io_class == that.io_class && io_level == that.io_level &&
+           cpus == that.cpus && max_download_rate == that.max_download_rate;
+  }
+  bool operator!=(const ResourcePolicy& that) const { return !(*this == that); }
+
+  // The I/O priority of the threads, a level from 0 (highest) to 7 within
+  // |io_class|.
+  IoPriorityClass io_class{IoPriorityClass::kNone};
+  int io_level{0};
+
+  // The CPUs the threads run on, such as the little cores of the device. Any
+  // of them when empty.
+  std::vector<int> cpus;
+
+  // The bytes per second the payload is downloaded at during kDownload. No
+  // limit when zero.
+  uint64_t max_download_rate{0};
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_RESOURCE_POLICY_H_
@@ -17,10 +17,12 @@
 #include "update_engine/common/subprocess.h"
 
 #include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <chrono>
 #include <memory>
 #include <string>
@@ -104,8 +106,42 @@ bool LaunchProcess(const vector<string>& cmd,
   return proc->Start();
 }
 
+void SetNonBlocking(int fd) {
+  int fd_flags = fcntl(fd, F_GETFL, 0) | O_NONBLOCK;
+  if (HANDLE_EINTR(fcntl(fd, F_SETFL, fd_flags)) < 0) {
+    LOG(ERROR) << "Unable to set non-blocking I/O mode on fd " << fd << ".";
+  }
+}
+
 }  // namespace
 
+void Subprocess::OutputBuffer::Append(const char* data, size_t size) {
+  total_size_ += size;
+  if (size >= capacity_) {
+    buffer_.assign(data + size - capacity_, data + size);
+    start_ = 0;
+    return;
+  }
+  // Fill the buffer up to its capacity first, then overwrite the oldest bytes.
+  size_t fill = std::min(size, capacity_ - buffer_.size());
+  buffer_.insert(buffer_.end(), data, data + fill);
+  data += fill;
+  size -= fill;
+  while (size > 0) {
+    size_t chunk = std::min(size, capacity_ - start_);
+    std::copy(data, data + chunk, buffer_.begin() + start_);
+    start_ = (start_ + chunk) % capacity_;
+    data += chunk;
+    size -= chunk;
+  }
+}
+
+string Subprocess::OutputBuffer::ToString() const {
+  string output(buffer_.begin() + start_, buffer_.end());
+  output.append(buffer_.begin(), buffer_.begin() + start_);
+  return output;
+}
+
 void Subprocess::Init(
     brillo::AsynchronousSignalHandlerInterface* async_signal_handler) {
   if (subprocess_singleton_ == this)
@@ -117,26 +153,106 @@ void Subprocess::Init(
 }
 
 Subprocess::~Subprocess() {
+  if (io_thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(io_mutex_);
+      io_thread_exit_ = true;
+    }
+    WakeIoThread();
+    io_thread_.join();
+  }
+  for (int fd : wake_pipe_) {
+    if (fd >= 0)
+      IGNORE_EINTR(close(fd));
+  }
   if (subprocess_singleton_ == this)
     subprocess_singleton_ = nullptr;
 }
 
-void Subprocess::OnStdoutReady(SubprocessRecord* record) {
-  char buf[1024];
+bool Subprocess::ReadOutput(int fd, OutputBuffer* output) {
+  char buf[4096];
   size_t bytes_read;
   do {
     bytes_read = 0;
     bool eof;
-    bool ok = utils::ReadAll(
-        record->stdout_fd, buf, base::size(buf), &bytes_read, &eof);
-    record->stdout_str.append(buf, bytes_read);
+    bool ok = utils::ReadAll(fd, buf, base::size(buf), &bytes_read, &eof);
+    output->Append(buf, bytes_read);
     if (!ok || eof) {
       // There was either an error or an EOF condition, so we are done watching
       // the file descriptor.
-      record->stdout_controller.reset();
-      return;
+      return false;
     }
   } while (bytes_read);
+  return true;
+}
+
+void Subprocess::WatchOutput(int fd, OutputBuffer* output) {
+  SetNonBlocking(fd);
+  {
+    std::lock_guard<std::mutex> lock(io_mutex_);
+    watched_fds_[fd] = output;
+  }
+  WakeIoThread();
+}
+
+void Subprocess::StopWatchingOutput(SubprocessRecord* record) {
+  {
+    std::lock_guard<std::mutex> lock(io_mutex_);
+    watched_fds_.erase(record->stdout_fd);
+    watched_fds_.erase(record->stderr_fd);
+  }
+  WakeIoThread();
+  // Make sure we read any remaining process output. The I/O thread doesn't use
+  // the record anymore.
+  if (record->stdout_fd >= 0)
+    ReadOutput(record->stdout_fd, &record->stdout_output);
+  if (record->stderr_fd >= 0)
+    ReadOutput(record->stderr_fd, &record->stderr_output);
+}
+
+void Subprocess::WakeIoThread() {
+  if (wake_pipe_[1] < 0)
+    return;
+  const char c = 0;
+  // The pipe being full is fine, the thread has a wake up pending already.
+  if (HANDLE_EINTR(write(wake_pipe_[1], &c, 1)) < 0 && errno != EAGAIN)
+    PLOG(ERROR) << "Failed to wake the subprocess I/O thread up";
+}
+
+void Subprocess::IoThreadLoop() {
+  vector<pollfd> fds;
+  while (true) {
+    fds.clear();
+    {
+      std::lock_guard<std::mutex> lock(io_mutex_);
+      if (io_thread_exit_)
+        return;
+      fds.push_back({wake_pipe_[0], POLLIN, 0});
+      for (const auto& fd_output : watched_fds_)
+        fds.push_back({fd_output.first, POLLIN, 0});
+    }
+    if (HANDLE_EINTR(poll(fds.data(), fds.size(), -1)) < 0) {
+      PLOG(ERROR) << "Failed to poll the subprocess output pipes";
+      return;
+    }
+    if (fds[0].revents != 0) {
+      char buf[64];
+      while (HANDLE_EINTR(read(wake_pipe_[0], buf, sizeof(buf))) > 0) {
+      }
+    }
+    std::lock_guard<std::mutex> lock(io_mutex_);
+    for (size_t i = 1; i < fds.size(); i++) {
+      if (fds[i].revents == 0)
+        continue;
+      // The fd may have stopped being watched, and even been reused, while
+      // polling; only the fds still watched are read.
+      auto fd_output = watched_fds_.find(fds[i].fd);
+      if (fd_output == watched_fds_.end())
+        continue;
+      if (!ReadOutput(fd_output->first, fd_output->second))
+        watched_fds_.erase(fd_output);
+    }
+  }
 }
 
 void Subprocess::ChildExitedCallback(const siginfo_t& info) {
@@ -145,10 +261,7 @@ void Subprocess::ChildExitedCallback(const siginfo_t& info) {
     return;
   SubprocessRecord* record = pid_record->second.get();
 
-  // Make sure we read any remaining process output and then close the pipe.
-  OnStdoutReady(record);
-
-  record->stdout_controller.reset();
+  StopWatchingOutput(record);
 
   // Don't print any log if the subprocess exited with exit code 0.
   if (info.si_code != CLD_EXITED) {
@@ -159,11 +272,23 @@ void Subprocess::ChildExitedCallback(const siginfo_t& info) {
               << " exited with si_status: " << info.si_status;
   }
 
-  if (!record->stdout_str.empty()) {
-    LOG(INFO) << "Subprocess output:\n" << record->stdout_str;
+  if (record->stdout_output.dropped_bytes() > 0) {
+    LOG(INFO) << "Dropped the first " << record->stdout_output.dropped_bytes()
+              << " bytes of the subprocess output";
+  }
+  const string stdout_str = record->stdout_output.ToString();
+  if (!stdout_str.empty()) {
+    LOG(INFO) << "Subprocess output:\n" << stdout_str;
+  }
+  const string stderr_str = record->stderr_output.ToString();
+  if (!stderr_str.empty()) {
+    LOG(INFO) << "Subprocess stderr:\n" << stderr_str;
   }
   if (!record->callback.is_null()) {
-    record->callback.Run(info.si_status, record->stdout_str);
+    record->callback.Run(info.si_status, stdout_str);
+  }
+  if (!record->output_callback.is_null()) {
+    record->output_callback.Run(info.si_status, stdout_str, stderr_str);
   }
   // Release and close all the pipes after calling the callback so our
   // redirected pipes are still alive. Releasing the process first makes
@@ -184,7 +309,34 @@ pid_t Subprocess::ExecFlags(const vector<string>& cmd,
                             uint32_t flags,
                             const vector<int>& output_pipes,
                             const ExecCallback& callback) {
-  unique_ptr<SubprocessRecord> record(new SubprocessRecord(callback));
+  return ExecInternal(cmd,
+                      flags,
+                      output_pipes,
+                      std::make_unique<SubprocessRecord>(
+                          callback, ExecOutputCallback()));
+}
+
+pid_t Subprocess::ExecWithOutput(const vector<string>& cmd,
+                                 uint32_t flags,
+                                 const ExecOutputCallback& callback) {
+  return ExecInternal(
+      cmd,
+      flags,
+      {STDERR_FILENO},
+      std::make_unique<SubprocessRecord>(ExecCallback(), callback));
+}
+
+pid_t Subprocess::ExecInternal(const vector<string>& cmd,
+                               uint32_t flags,
+                               const vector<int>& output_pipes,
+                               unique_ptr<SubprocessRecord> record) {
+  if (!io_thread_.joinable()) {
+    if (pipe2(wake_pipe_, O_CLOEXEC | O_NONBLOCK) != 0) {
+      PLOG(ERROR) << "Failed to create the subprocess I/O thread pipe";
+      return 0;
+    }
+    io_thread_ = std::thread(&Subprocess::IoThreadLoop, this);
+  }
 
   if (!LaunchProcess(cmd, flags, output_pipes, &record->proc)) {
     LOG(ERROR) << "Failed to launch subprocess";
@@ -197,18 +349,14 @@ pid_t Subprocess::ExecFlags(const vector<string>& cmd,
       pid,
       base::Bind(&Subprocess::ChildExitedCallback, base::Unretained(this))));
 
+  // Capture the subprocess output, and its stderr if asked to.
   record->stdout_fd = record->proc.GetPipe(STDOUT_FILENO);
-  // Capture the subprocess output. Make our end of the pipe non-blocking.
-  int fd_flags = fcntl(record->stdout_fd, F_GETFL, 0) | O_NONBLOCK;
-  if (HANDLE_EINTR(fcntl(record->stdout_fd, F_SETFL, fd_flags)) < 0) {
-    LOG(ERROR) << "Unable to set non-blocking I/O mode on fd "
-               << record->stdout_fd << ".";
+  WatchOutput(record->stdout_fd, &record->stdout_output);
+  if (!record->output_callback.is_null()) {
+    record->stderr_fd = record->proc.GetPipe(STDERR_FILENO);
+    WatchOutput(record->stderr_fd, &record->stderr_output);
   }
 
-  record->stdout_controller = base::FileDescriptorWatcher::WatchReadable(
-      record->stdout_fd,
-      base::BindRepeating(&Subprocess::OnStdoutReady, record.get()));
-
   subprocess_records_[pid] = std::move(record);
   return pid;
 }
@@ -242,6 +390,7 @@ void Subprocess::KillExec(pid_t pid) {
   if (pid_record == subprocess_records_.end())
     return;
   pid_record->second->callback.Reset();
+  pid_record->second->output_callback.Reset();
   // We don't care about output/return code, so we use SIGKILL here to ensure it
   // will be killed, SIGTERM might lead to leaked subprocess.
   CHECK_EQ(pid_record->second->proc.pid(), pid);
@@ -336,13 +485,15 @@ bool Subprocess::SynchronousExecFlags(const vector<string>& cmd,
 void Subprocess::FlushBufferedLogsAtExit() {
   if (!subprocess_records_.empty()) {
     LOG(INFO) << "We are exiting, but there are still in flight subprocesses!";
+    std::lock_guard<std::mutex> lock(io_mutex_);
     for (auto& pid_record : subprocess_records_) {
       SubprocessRecord* record = pid_record.second.get();
       // Make sure we read any remaining process output.
-      OnStdoutReady(record);
-      if (!record->stdout_str.empty()) {
+      ReadOutput(record->stdout_fd, &record->stdout_output);
+      const string stdout_str = record->stdout_output.ToString();
+      if (!stdout_str.empty()) {
         LOG(INFO) << "Subprocess(" << pid_record.first << ") output:\n"
-                  << record->stdout_str;
+                  << stdout_str;
       }
     }
   }
@@ -21,11 +21,12 @@
 
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <base/callback.h>
-#include <base/files/file_descriptor_watcher_posix.h>
 #include <base/logging.h>
 #include <base/macros.h>
 #include <brillo/asynchronous_signal_handler_interface.h>
@@ -48,6 +49,10 @@
 // To create the Subprocess singleton just instantiate it with and call Init().
 // You can't have two Subprocess instances initialized at the same time.
 
+// The output of the subprocesses is read on an I/O thread of the Subprocess,
+// so that processes writing a lot of it don't keep the main loop busy. Only
+// the last kMaxOutputSize bytes of each output are kept.
+
 namespace chromeos_update_engine {
 
 class Subprocess {
@@ -57,9 +62,16 @@ class Subprocess {
     kRedirectStderrToStdout = 1 << 1,
   };
 
+  // The number of bytes of the output of a subprocess kept, on each of stdout
+  // and stderr. The oldest bytes are dropped past this.
+  static constexpr size_t kMaxOutputSize = 1024 * 1024;
+
   // Callback type used when an async process terminates. It receives the exit
   // code and the stdout output (and stderr if redirected).
   using ExecCallback = base::Callback<void(int, const std::string&)>;
+  // Same as ExecCallback, with the stdout and the stderr output apart.
+  using ExecOutputCallback =
+      base::Callback<void(int, const std::string&, const std::string&)>;
 
   Subprocess() = default;
 
@@ -81,6 +93,14 @@ class Subprocess {
                   const std::vector<int>& output_pipes,
                   const ExecCallback& callback);
 
+  // Launches a process in the background, like ExecFlags(), and calls the
+  // passed |callback| with its stdout and stderr output apart when it exits.
+  // This is the asynchronous version of SynchronousExecFlags(), to use instead
+  // of it on the main loop of the daemon.
+  pid_t ExecWithOutput(const std::vector<std::string>& cmd,
+                       uint32_t flags,
+                       const ExecOutputCallback& callback);
+
   // Kills the running process with SIGTERM and ignores the callback.
   void KillExec(pid_t pid);
 
@@ -93,7 +113,8 @@ class Subprocess {
 
   // Executes a command synchronously. Returns true on success. If |stdout_str|
   // is non-null, the process output is stored in it, otherwise the output is
-  // logged.
+  // logged. This blocks the calling thread until the process exits; the
+  // daemon should use ExecWithOutput() instead.
   static bool SynchronousExec(const std::vector<std::string>& cmd,
                               int* return_code,
                               std::string* stdout_str,
@@ -115,28 +136,72 @@ class Subprocess {
  private:
   FRIEND_TEST(SubprocessTest, CancelTest);
 
+  // Keeps the last |capacity| bytes appended to it, in a buffer which grows up
+  // to |capacity| and then wraps around.
+  class OutputBuffer {
+   public:
+    explicit OutputBuffer(size_t capacity) : capacity_(capacity) {}
+
+    void Append(const char* data, size_t size);
+
+    // Returns the bytes kept, oldest first.
+    std::string ToString() const;
+
+    // The number of bytes appended which aren't kept anymore.
+    size_t dropped_bytes() const { return total_size_ - buffer_.size(); }
+
+   private:
+    const size_t capacity_;
+    std::vector<char> buffer_;
+    // The position of the oldest byte in |buffer_|, once it is full.
+    size_t start_{0};
+    size_t total_size_{0};
+  };
+
   struct SubprocessRecord {
-    explicit SubprocessRecord(const ExecCallback& callback)
-        : callback(callback) {}
+    SubprocessRecord(const ExecCallback& callback,
+                     const ExecOutputCallback& output_callback)
+        : callback(callback), output_callback(output_callback) {}
 
-    // The callback supplied by the caller.
+    // The callback supplied by the caller, either one.
     ExecCallback callback;
+    ExecOutputCallback output_callback;
 
     // The ProcessImpl instance managing the child process. Destroying this
     // will close our end of the pipes we have open.
     brillo::ProcessImpl proc;
 
-    // These are used to monitor the stdout of the running process, including
-    // the stderr if it was redirected.
-    std::unique_ptr<base::FileDescriptorWatcher::Controller> stdout_controller;
-
+    // Our end of the stdout pipe of the running process, including the stderr
+    // if it was redirected, and of the stderr pipe if it is captured apart, or
+    // -1. Only read on the I/O thread while in |watched_fds_|.
     int stdout_fd{-1};
-    std::string stdout_str;
+    int stderr_fd{-1};
+    OutputBuffer stdout_output{kMaxOutputSize};
+    OutputBuffer stderr_output{kMaxOutputSize};
   };
 
-  // Callback which runs whenever there is input available on the subprocess
-  // stdout pipe.
-  static void OnStdoutReady(SubprocessRecord* record);
+  pid_t ExecInternal(const std::vector<std::string>& cmd,
+                     uint32_t flags,
+                     const std::vector<int>& output_pipes,
+                     std::unique_ptr<SubprocessRecord> record);
+
+  // Reads the output available on |fd| into |output|. Returns false once |fd|
+  // reached EOF or failed, and shouldn't be watched anymore.
+  static bool ReadOutput(int fd, OutputBuffer* output);
+
+  // Hands |fd| over to the I/O thread, which reads its output into |output|,
+  // starting the thread if needed.
+  void WatchOutput(int fd, OutputBuffer* output);
+
+  // Stops reading the output pipes of |record| on the I/O thread, and reads
+  // what's left of it on the calling thread.
+  void StopWatchingOutput(SubprocessRecord* record);
+
+  // Wakes the I/O thread up so that it picks up the changes of |watched_fds_|.
+  void WakeIoThread();
+
+  // Main function of |io_thread_|, until |io_thread_exit_| is set.
+  void IoThreadLoop();
 
   // Callback for when any subprocess terminates. This calls the user
   // requested callback.
@@ -152,6 +217,16 @@ class Subprocess {
   // Used to watch for child processes.
   brillo::ProcessReaper process_reaper_;
 
+  // Reads the output pipes of the subprocesses in |watched_fds_|.
+  std::thread io_thread_;
+  // Written to wake |io_thread_| up, and read by it.
+  int wake_pipe_[2]{-1, -1};
+  // Guards |watched_fds_|, |io_thread_exit_| and the output buffers of the
+  // watched records.
+  std::mutex io_mutex_;
+  std::map<int, OutputBuffer*> watched_fds_;
+  bool io_thread_exit_{false};
+
   DISALLOW_COPY_AND_ASSIGN(Subprocess);
 };
 
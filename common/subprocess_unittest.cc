@@ -26,6 +26,7 @@
 #include <vector>
 
 #include <base/bind.h>
+#include <base/files/file_descriptor_watcher_posix.h>
 #include <base/files/scoped_temp_dir.h>
 #include <base/location.h>
 #if BASE_VER < 780000  // Android
@@ -98,6 +99,28 @@ void ExpectedResults(int expected_return_code,
   MessageLoop::current()->BreakLoop();
 }
 
+void ExpectedOutputs(int expected_return_code,
+                     const string& expected_stdout,
+                     const string& expected_stderr,
+                     int return_code,
+                     const string& stdout_str,
+                     const string& stderr_str) {
+  EXPECT_EQ(expected_return_code, return_code);
+  EXPECT_EQ(expected_stdout, stdout_str);
+  EXPECT_EQ(expected_stderr, stderr_str);
+  MessageLoop::current()->BreakLoop();
+}
+
+void ExpectedOutputTail(const string& expected_tail,
+                        int return_code,
+                        const string& output) {
+  EXPECT_EQ(0, return_code);
+  EXPECT_EQ(Subprocess::kMaxOutputSize, output.size());
+  EXPECT_TRUE(
+      base::EndsWith(output, expected_tail, base::CompareCase::SENSITIVE));
+  MessageLoop::current()->BreakLoop();
+}
+
 void ExpectedEnvVars(int return_code, const string& output) {
   EXPECT_EQ(0, return_code);
   const std::set<string> allowed_envs = {"LD_LIBRARY_PATH", "PATH"};
@@ -165,6 +188,23 @@ TEST_F(SubprocessTest, StderrNotIncludedInOutputTest) {
   loop_.Run();
 }
 
+TEST_F(SubprocessTest, ExecWithOutputTest) {
+  ASSERT_TRUE(subprocess_.ExecWithOutput(
+      {kBinPath "/sh", "-c", "echo on stdout; echo on stderr >&2; exit 3"},
+      0,
+      base::Bind(&ExpectedOutputs, 3, "on stdout\n", "on stderr\n")));
+  loop_.Run();
+}
+
+TEST_F(SubprocessTest, OutputIsBoundedTest) {
+  // Only the end of an output larger than the limit is kept.
+  const string cmd = base::StringPrintf(
+      "yes | head -c %zu; echo end", 2 * Subprocess::kMaxOutputSize);
+  ASSERT_TRUE(subprocess_.Exec({kBinPath "/sh", "-c", cmd},
+                               base::Bind(&ExpectedOutputTail, "y\nend\n")));
+  loop_.Run();
+}
+
 TEST_F(SubprocessTest, PipeRedirectFdTest) {
   pid_t pid;
   pid = subprocess_.ExecFlags(
@@ -0,0 +1,37 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/trace.h"
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+namespace internal {
+std::atomic<bool> tracing_enabled{false};
+}  // namespace internal
+
+void SetTracingEnabled(bool enabled) {
+  if (internal::tracing_enabled.exchange(enabled) != enabled) {
+    LOG(INFO) << (enabled ? "Enabling" : "Disabling") << " trace events"
+#if !USE_TRACING
+              << ", which this build doesn't emit"
+#endif  // !USE_TRACING
+        ;
+  }
+}
+
+}  // namespace chromeos_update_engine
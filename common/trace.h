@@ -0,0 +1,123 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_TRACE_H_
+#define UPDATE_ENGINE_COMMON_TRACE_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+#if USE_TRACING
+#include <cutils/trace.h>
+#endif  // USE_TRACING
+
+// Trace events lining up the work of the update with the rest of the system
+// in Perfetto or systrace, as atrace events. They are only emitted once
+// enabled with SetTracingEnabled(), and the macros compile to nothing without
+// USE_TRACING.
+//
+//  UE_TRACE_SCOPE(name): a section from here to the end of the scope, on the
+//      current thread.
+//  UE_TRACE_ASYNC_BEGIN(name, cookie) and UE_TRACE_ASYNC_END(name, cookie): a
+//      section which may start and end on different threads, or span several
+//      message loop tasks, told apart from the others of the same name by
+//      |cookie|.
+//  UE_TRACE_COUNTER(name, value): the value of a counter track.
+//
+// The names must be string literals, or strings outliving the macro call.
+
+namespace chromeos_update_engine {
+
+namespace internal {
+extern std::atomic<bool> tracing_enabled;
+}  // namespace internal
+
+inline bool IsTracingEnabled() {
+  return internal::tracing_enabled.load(std::memory_order_relaxed);
+}
+
+void SetTracingEnabled(bool enabled);
+
+#if USE_TRACING
+class ScopedTraceSection {
+ public:
+  explicit ScopedTraceSection(const char* name) : active_(IsTracingEnabled()) {
+    if (active_)
+      atrace_begin(ATRACE_TAG_ALWAYS, name);
+  }
+  ~ScopedTraceSection() {
+    if (active_)
+      atrace_end(ATRACE_TAG_ALWAYS);
+  }
+
+ private:
+  // Whether the section was begun, so that it's ended even if tracing got
+  // disabled meanwhile.
+  const bool active_;
+
+  ScopedTraceSection(const ScopedTraceSection&) = delete;
+  ScopedTraceSection& operator=(const ScopedTraceSection&) = delete;
+};
+#endif  // USE_TRACING
+
+}  // namespace chromeos_update_engine
+
+#if USE_TRACING
+
+#define UE_TRACE_CONCAT_INNER(a, b) a##b
+#define UE_TRACE_CONCAT(a, b) UE_TRACE_CONCAT_INNER(a, b)
+
+#define UE_TRACE_SCOPE(name)                   \
+  ::chromeos_update_engine::ScopedTraceSection \
+  UE_TRACE_CONCAT(ue_trace_section_, __COUNTER__)(name)
+
+#define UE_TRACE_ASYNC_BEGIN(name, cookie)                    \
+  do {                                                        \
+    if (::chromeos_update_engine::IsTracingEnabled())         \
+      atrace_async_begin(ATRACE_TAG_ALWAYS, (name), (cookie)); \
+  } while (0)
+
+#define UE_TRACE_ASYNC_END(name, cookie)                    \
+  do {                                                      \
+    if (::chromeos_update_engine::IsTracingEnabled())       \
+      atrace_async_end(ATRACE_TAG_ALWAYS, (name), (cookie)); \
+  } while (0)
+
+#define UE_TRACE_COUNTER(name, value)                    \
+  do {                                                   \
+    if (::chromeos_update_engine::IsTracingEnabled())    \
+      atrace_int64(ATRACE_TAG_ALWAYS, (name), (value));  \
+  } while (0)
+
+#else  // USE_TRACING
+
+#define UE_TRACE_SCOPE(name) \
+  do {                       \
+  } while (0)
+#define UE_TRACE_ASYNC_BEGIN(name, cookie) \
+  do {                                     \
+  } while (0)
+#define UE_TRACE_ASYNC_END(name, cookie) \
+  do {                                   \
+  } while (0)
+#define UE_TRACE_COUNTER(name, value) \
+  do {                                \
+  } while (0)
+
+#endif  // USE_TRACING
+
+#endif  // UPDATE_ENGINE_COMMON_TRACE_H_
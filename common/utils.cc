@@ -34,8 +34,15 @@
 #include <time.h>
 #include <unistd.h>
 
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <algorithm>
 #include <filesystem>
+#include <set>
 #include <utility>
 #include <vector>
 
@@ -470,6 +477,35 @@ bool WriteStringToFileAtomic(const std::string& path,
   return FsyncDirectory(std::filesystem::path(path).parent_path().c_str());
 }
 
+bool IsZero(const void* buffer, size_t size) {
+  const uint8_t* data = static_cast<const uint8_t*>(buffer);
+  size_t i = 0;
+#if defined(__aarch64__)
+  uint8x16_t acc = vdupq_n_u8(0);
+  for (; i + 16 <= size; i += 16) {
+    acc = vorrq_u8(acc, vld1q_u8(data + i));
+  }
+  if (vmaxvq_u8(acc) != 0) {
+    return false;
+  }
+#elif defined(__SSE2__)
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= size; i += 16) {
+    acc = _mm_or_si128(
+        acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)));
+  }
+  if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff) {
+    return false;
+  }
+#endif
+  for (; i < size; i++) {
+    if (data[i] != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
 void HexDumpArray(const uint8_t* const arr, const size_t length) {
   LOG(INFO) << "Logging array of length: " << length;
   const unsigned int bytes_per_line = 16;
@@ -1063,20 +1099,19 @@ bool ReadExtents(FileDescriptorPtr fd,
   brillo::Blob data(out_data_size);
   ssize_t bytes_read = 0;
 
+  std::vector<FileIoRequest> requests;
+  requests.reserve(extents.size());
   for (const Extent& extent : extents) {
-    ssize_t bytes_read_this_iteration = 0;
     ssize_t bytes = extent.num_blocks() * block_size;
     TEST_LE(bytes_read + bytes, out_data_size);
-    TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
-                                          &data[bytes_read],
-                                          bytes,
-                                          extent.start_block() * block_size,
-                                          &bytes_read_this_iteration));
-    TEST_AND_RETURN_FALSE(bytes_read_this_iteration == bytes);
-    bytes_read += bytes_read_this_iteration;
+    requests.push_back({static_cast<off64_t>(extent.start_block() * block_size),
+                        &data[bytes_read],
+                        static_cast<size_t>(bytes)});
+    bytes_read += bytes;
   }
   TEST_AND_RETURN_FALSE(out_data_size == bytes_read);
-  *out_data = data;
+  TEST_AND_RETURN_FALSE_ERRNO(fd->ReadBatch(requests));
+  *out_data = std::move(data);
   return true;
 }
 
@@ -1215,6 +1250,25 @@ std::string_view GetReadonlyZeroString(size_t size) {
   return {zero_block->data(), size};
 }
 
+bool ParseCpuList(const string& cpu_list, vector<int>* cpus) {
+  std::set<int> cpu_set;
+  for (const auto& range : base::SplitString(
+           cpu_list, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_NONEMPTY)) {
+    const vector<string> bounds = base::SplitString(
+        range, "-", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+    int first = 0, last = 0;
+    TEST_AND_RETURN_FALSE(bounds.size() <= 2);
+    TEST_AND_RETURN_FALSE(base::StringToInt(bounds.front(), &first));
+    TEST_AND_RETURN_FALSE(base::StringToInt(bounds.back(), &last));
+    TEST_AND_RETURN_FALSE(0 <= first && first <= last);
+    for (int cpu = first; cpu <= last; cpu++)
+      cpu_set.insert(cpu);
+  }
+  TEST_AND_RETURN_FALSE(!cpu_set.empty());
+  cpus->assign(cpu_set.begin(), cpu_set.end());
+  return true;
+}
+
 }  // namespace utils
 
 std::string HexEncode(const brillo::Blob& blob) noexcept {
@@ -248,6 +248,10 @@ std::string ToString(PayloadType payload_type);
 int FuzzInt(int value, unsigned int range);
 
 // Log a string in hex to LOG(INFO). Useful for debugging.
+// Returns whether all of the |size| bytes at |data| are zero, 16 bytes at a
+// time where the CPU allows.
+bool IsZero(const void* data, size_t size);
+
 void HexDumpArray(const uint8_t* const arr, const size_t length);
 inline void HexDumpString(const std::string& str) {
   HexDumpArray(reinterpret_cast<const uint8_t*>(str.data()), str.size());
@@ -421,6 +425,10 @@ std::unique_ptr<android::base::MappedFile> GetReadonlyZeroBlock(size_t size);
 
 std::string_view GetReadonlyZeroString(size_t size);
 
+// Parses a list of CPUs in the format of the cpuset files, such as "0-3,6",
+// into |cpus|, sorted. Returns false if |cpu_list| isn't such a list.
+bool ParseCpuList(const std::string& cpu_list, std::vector<int>* cpus);
+
 }  // namespace utils
 
 // Utility class to close a file descriptor
@@ -0,0 +1,84 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// utils::ReadExtents() on a file in the page cache, reading the same number
+// of blocks split in more and more extents spread over the file.
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kFileBlocks = 16384;
+constexpr size_t kBlocksPerIteration = 4096;
+
+// The file the benchmarks read, created on first use.
+const ScopedTempFile& BenchmarkFile() {
+  static const ScopedTempFile* file = [] {
+    auto* file = new ScopedTempFile("ReadExtentsBenchmark.XXXXXX");
+    brillo::Blob data(kFileBlocks * kBlockSize);
+    std::generate(data.begin(), data.end(), std::mt19937(42));
+    CHECK(utils::WriteFile(file->path().c_str(), data.data(), data.size()));
+    return file;
+  }();
+  return *file;
+}
+
+// |kBlocksPerIteration| blocks in extents of |extent_blocks| blocks, at
+// random places of the file.
+vector<Extent> RandomExtents(size_t extent_blocks) {
+  vector<Extent> extents;
+  for (size_t i = 0; i < kFileBlocks / extent_blocks; i++)
+    extents.push_back(ExtentForRange(i * extent_blocks, extent_blocks));
+  std::shuffle(extents.begin(), extents.end(), std::mt19937(42));
+  extents.resize(kBlocksPerIteration / extent_blocks);
+  return extents;
+}
+
+// The argument is the number of blocks per extent, the fewer the more
+// fragmented the data read.
+void BM_ReadExtents(benchmark::State& state) {
+  const vector<Extent> extents = RandomExtents(state.range(0));
+  const auto& file = BenchmarkFile();
+  brillo::Blob data;
+  for (auto _ : state) {
+    if (!utils::ReadExtents(file.path(), extents, &data, kBlockSize)) {
+      state.SkipWithError("ReadExtents() failed");
+      break;
+    }
+    benchmark::DoNotOptimize(data.data());
+  }
+  state.SetBytesProcessed(state.iterations() * kBlocksPerIteration *
+                          kBlockSize);
+}
+
+}  // namespace
+
+BENCHMARK(BM_ReadExtents)->RangeMultiplier(4)->Range(1, kBlocksPerIteration);
+
+}  // namespace chromeos_update_engine
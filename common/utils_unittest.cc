@@ -474,4 +474,20 @@ TEST(UtilsTest, ValidatePerPartitionTimestamp) {
   ASSERT_EQ(ErrorCode::kSuccess, utils::IsTimestampNewer("10", ""));
 }
 
+TEST(UtilsTest, ParseCpuListTest) {
+  vector<int> cpus;
+  EXPECT_TRUE(utils::ParseCpuList("3", &cpus));
+  EXPECT_EQ(vector<int>({3}), cpus);
+  EXPECT_TRUE(utils::ParseCpuList("6,0-3", &cpus));
+  EXPECT_EQ(vector<int>({0, 1, 2, 3, 6}), cpus);
+  EXPECT_TRUE(utils::ParseCpuList(" 4-5 , 5\n", &cpus));
+  EXPECT_EQ(vector<int>({4, 5}), cpus);
+
+  EXPECT_FALSE(utils::ParseCpuList("", &cpus));
+  EXPECT_FALSE(utils::ParseCpuList("a", &cpus));
+  EXPECT_FALSE(utils::ParseCpuList("3-1", &cpus));
+  EXPECT_FALSE(utils::ParseCpuList("1-2-3", &cpus));
+  EXPECT_FALSE(utils::ParseCpuList("-1", &cpus));
+}
+
 }  // namespace chromeos_update_engine
@@ -21,7 +21,9 @@
 #include <algorithm>
 #include <string>
 
+#include <base/bind.h>
 #include <base/files/file_path.h>
+#include <base/location.h>
 #include <base/metrics/statistics_recorder.h>
 #include <base/strings/stringprintf.h>
 
@@ -29,13 +31,34 @@
 #include "update_engine/common/error_code_utils.h"
 #include "update_engine/common/multi_range_http_fetcher.h"
 #include "update_engine/common/prefs_interface.h"
+#include "update_engine/common/trace.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 
 using base::FilePath;
+using brillo::MessageLoop;
 using std::string;
 
 namespace chromeos_update_engine {
 
+namespace {
+// How often to check whether the apply caught up while the transfer is paused
+// for it.
+const int kQueuedBytesCheckIntervalMs = 50;
+// The period over which the throughput is measured.
+const int kThroughputPeriodSeconds = 10;
+// The period over which the download is held to the rate limit, so that it
+// doesn't catch up for the time it was paused for other reasons.
+const int kRateLimitPeriodSeconds = 2;
+// The shortest pause for the rate limit, to not pause for every chunk.
+const int kRateLimitMinPauseMs = 100;
+// The name of the spill cache file in the non-volatile directory.
+const char kSpillCacheFileName[] = "payload_spill_cache";
+// The bytes applied from the spill cache at a time, between which the
+// message loop gets to receive more of the payload.
+const size_t kSpillApplyChunkSize = 1024 * 1024;
+}  // namespace
+
 DownloadAction::DownloadAction(PrefsInterface* prefs,
                                BootControlInterface* boot_control,
                                HardwareInterface* hardware,
@@ -51,7 +74,10 @@ DownloadAction::DownloadAction(PrefsInterface* prefs,
       delegate_(nullptr),
       update_certificates_path_(std::move(update_certificates_path)) {}
 
-DownloadAction::~DownloadAction() {}
+DownloadAction::~DownloadAction() {
+  StopFlowControl();
+  StopSpillCache();
+}
 
 void DownloadAction::PerformAction() {
   http_fetcher_->set_delegate(this);
@@ -123,6 +149,13 @@ bool DownloadAction::LoadCachedManifest(int64_t manifest_size) {
 void DownloadAction::StartDownloading() {
   download_active_ = true;
   http_fetcher_->ClearRanges();
+  metadata_range_end_ = 0;
+  verified_ranges_added_ = false;
+  throughput_start_ = base::TimeTicks();
+  StopSpillCache();
+  // The spill cache holds a single range of the payload at the same offsets.
+  const bool can_spill = install_plan_.spill_payload && payload_->size > 0 &&
+                         !payload_->already_applied;
 
   if (delta_performer_ != nullptr) {
     LOG(INFO) << "Using writer for test.";
@@ -146,7 +179,9 @@ void DownloadAction::StartDownloading() {
     prefs_->GetInt64(kPrefsManifestSignatureSize, &manifest_signature_size);
 
     // TODO(zhangkelvin) Add unittest for success and fallback route
-    if (!LoadCachedManifest(manifest_metadata_size + manifest_signature_size)) {
+    const bool manifest_cached =
+        LoadCachedManifest(manifest_metadata_size + manifest_signature_size);
+    if (!manifest_cached) {
       if (delta_performer_) {
         // Create a new DeltaPerformer to reset all its state
         delta_performer_ =
@@ -162,6 +197,7 @@ void DownloadAction::StartDownloading() {
       http_fetcher_->AddRange(base_offset_,
                               manifest_metadata_size + manifest_signature_size);
     }
+    AddVerifiedRanges();
 
     // If there're remaining unprocessed data blobs, fetch them. Be careful
     // not to request data beyond the end of the payload to avoid 416 HTTP
@@ -170,13 +206,27 @@ void DownloadAction::StartDownloading() {
     prefs_->GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset);
     uint64_t resume_offset =
         manifest_metadata_size + manifest_signature_size + next_data_offset;
+    if (can_spill && manifest_cached && resume_offset <= payload_->size) {
+      resume_offset = StartSpillCache(resume_offset);
+    }
     if (!payload_->size) {
       http_fetcher_->AddRange(base_offset_ + resume_offset);
     } else if (resume_offset < payload_->size) {
       http_fetcher_->AddRange(base_offset_ + resume_offset,
                               payload_->size - resume_offset);
     }
+  } else if (payload_->already_applied) {
+    // Only the manifest of a payload applied by a previous attempt is parsed,
+    // so don't download its data blobs. The size of the metadata signature is
+    // only known from the header, the rest of the metadata is requested once
+    // the header is received.
+    metadata_range_end_ = std::max(payload_->metadata_size,
+                                   kMaxPayloadHeaderSize);
+    if (payload_->size)
+      metadata_range_end_ = std::min(metadata_range_end_, payload_->size);
+    http_fetcher_->AddRange(base_offset_, metadata_range_end_);
   } else {
+    spill_pending_ = can_spill;
     if (payload_->size) {
       http_fetcher_->AddRange(base_offset_, payload_->size);
     } else {
@@ -190,19 +240,27 @@ void DownloadAction::StartDownloading() {
 }
 
 void DownloadAction::SuspendAction() {
-  http_fetcher_->Pause();
+  if (!IsTransferPaused())
+    http_fetcher_->Pause();
+  suspended_ = true;
 }
 
 void DownloadAction::ResumeAction() {
-  http_fetcher_->Unpause();
+  suspended_ = false;
+  if (!IsTransferPaused())
+    http_fetcher_->Unpause();
+  if (spill_cache_)
+    ScheduleSpilledApply();
 }
 
 void DownloadAction::TerminateProcessing() {
+  StopSpillCache();
   if (delta_performer_) {
     delta_performer_->Close();
     delta_performer_.reset();
   }
   download_active_ = false;
+  StopFlowControl();
   // Terminates the transfer. The action is terminated, if necessary, when the
   // TransferTerminated callback is received.
   http_fetcher_->TerminateTransfer();
@@ -215,34 +273,319 @@ void DownloadAction::SeekToOffset(off_t offset) {
 bool DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
                                    const void* bytes,
                                    size_t length) {
+  UE_TRACE_SCOPE("received_bytes");
   bytes_received_ += length;
   uint64_t bytes_downloaded_total =
       bytes_received_previous_payloads_ + bytes_received_;
+  UE_TRACE_COUNTER("bytes_downloaded", bytes_downloaded_total);
   if (delegate_ && download_active_) {
     delegate_->BytesReceived(
         length, bytes_downloaded_total - base_offset_, bytes_total_);
   }
-  if (delta_performer_ && !delta_performer_->Write(bytes, length, &code_)) {
-    if (code_ != ErrorCode::kSuccess) {
-      LOG(ERROR) << "Error " << utils::ErrorCodeToString(code_) << " (" << code_
-                 << ") in DeltaPerformer's Write method when "
-                 << "processing the received payload -- Terminating processing";
-    } else {
-      LOG(ERROR) << "Unknown error in DeltaPerformer's Write method when "
-                 << "processing the received payload -- Terminating processing";
+  if (spill_cache_) {
+    if (!spill_cache_->Append(bytes, length)) {
+      LOG(ERROR) << "Unable to cache the received payload -- Terminating "
+                 << "processing";
       code_ = ErrorCode::kDownloadWriteError;
+      TerminateProcessing();
+      return false;
     }
-    // Don't tell the action processor that the action is complete until we get
-    // the TransferTerminated callback. Otherwise, this and the HTTP fetcher
-    // objects may get destroyed before all callbacks are complete.
-    TerminateProcessing();
+    ScheduleSpilledApply();
+    UpdateRateLimit(length);
+    return true;
+  }
+  if (delta_performer_ && !WriteToDeltaPerformer(bytes, length)) {
     return false;
   }
+  if (spill_pending_ && delta_performer_ &&
+      delta_performer_->IsManifestValid()) {
+    // The rest of the transfer goes to the cache, from where it was received
+    // so far.
+    spill_pending_ = false;
+    PayloadSpillCache::Delete(prefs_);
+    StartSpillCache(bytes_received_ - base_offset_);
+  }
 
+  if (metadata_range_end_ && delta_performer_ &&
+      delta_performer_->IsHeaderParsed()) {
+    // The fetcher moves on to the added range once done with the current one.
+    const uint64_t metadata_end = delta_performer_->GetFullMetadataSize();
+    if (metadata_end > metadata_range_end_) {
+      http_fetcher_->AddRange(base_offset_ + metadata_range_end_,
+                              metadata_end - metadata_range_end_);
+    }
+    metadata_range_end_ = 0;
+  }
+  AddVerifiedRanges();
+  UpdateThroughput(length);
+  UpdateFlowControl();
+  UpdateRateLimit(length);
   return true;
 }
 
+bool DownloadAction::WriteToDeltaPerformer(const void* bytes, size_t length) {
+  if (delta_performer_->Write(bytes, length, &code_)) {
+    return true;
+  }
+  if (code_ != ErrorCode::kSuccess) {
+    LOG(ERROR) << "Error " << utils::ErrorCodeToString(code_) << " (" << code_
+               << ") in DeltaPerformer's Write method when "
+               << "processing the received payload -- Terminating processing";
+  } else {
+    LOG(ERROR) << "Unknown error in DeltaPerformer's Write method when "
+               << "processing the received payload -- Terminating processing";
+    code_ = ErrorCode::kDownloadWriteError;
+  }
+  // Don't tell the action processor that the action is complete until we get
+  // the TransferTerminated callback. Otherwise, this and the HTTP fetcher
+  // objects may get destroyed before all callbacks are complete.
+  TerminateProcessing();
+  return false;
+}
+
+uint64_t DownloadAction::StartSpillCache(uint64_t offset) {
+  base::FilePath dir;
+  if (!hardware_->GetNonVolatileDirectory(&dir)) {
+    LOG(WARNING) << "No directory for the spill cache";
+    return offset;
+  }
+  spill_cache_ = PayloadSpillCache::Open(
+      prefs_, dir.Append(kSpillCacheFileName).value(), payload_->size, offset);
+  if (!spill_cache_) {
+    LOG(WARNING) << "Applying the payload as it is received instead";
+    return offset;
+  }
+  spill_apply_offset_ = offset;
+  spill_transfer_complete_ = false;
+  ScheduleSpilledApply();
+  return spill_cache_->end();
+}
+
+void DownloadAction::ScheduleSpilledApply(base::TimeDelta delay) {
+  if (spill_apply_id_ != MessageLoop::kTaskIdNull)
+    return;
+  spill_apply_id_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&DownloadAction::ApplySpilledBytes, base::Unretained(this)),
+      delay);
+}
+
+void DownloadAction::ApplySpilledBytes() {
+  spill_apply_id_ = MessageLoop::kTaskIdNull;
+  // ResumeAction() goes on.
+  if (!spill_cache_ || !delta_performer_ || suspended_)
+    return;
+  // Wait for the pipeline to catch up rather than blocking on it, which
+  // would hold back the transfer as well.
+  if (delta_performer_->GetQueuedBytes() >=
+      DeltaPerformer::kQueuedBytesHighWatermark) {
+    ScheduleSpilledApply(
+        base::TimeDelta::FromMilliseconds(kQueuedBytesCheckIntervalMs));
+    return;
+  }
+  const size_t length = std::min<uint64_t>(
+      spill_cache_->end() - spill_apply_offset_, kSpillApplyChunkSize);
+  if (length > 0) {
+    spill_buffer_.resize(length);
+    if (!spill_cache_->Read(
+            spill_apply_offset_, spill_buffer_.data(), length)) {
+      LOG(ERROR) << "Unable to read the cached payload -- Terminating "
+                 << "processing";
+      code_ = ErrorCode::kDownloadWriteError;
+      PayloadSpillCache::Delete(prefs_);
+      TerminateProcessing();
+      return;
+    }
+    spill_apply_offset_ += length;
+    if (!WriteToDeltaPerformer(spill_buffer_.data(), length)) {
+      // Download the payload again next time, in case the cache is what is
+      // wrong with it.
+      PayloadSpillCache::Delete(prefs_);
+      return;
+    }
+    AddVerifiedRanges();
+  }
+  if (spill_apply_offset_ < spill_cache_->end()) {
+    ScheduleSpilledApply();
+  } else if (spill_transfer_complete_) {
+    CompleteDownload(true);
+  }
+}
+
+void DownloadAction::StopSpillCache() {
+  if (spill_apply_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(spill_apply_id_);
+    spill_apply_id_ = MessageLoop::kTaskIdNull;
+  }
+  if (spill_cache_ && !spill_cache_->Sync()) {
+    LOG(WARNING) << "Unable to sync the spill cache";
+  }
+  spill_cache_.reset();
+  spill_pending_ = false;
+}
+
+void DownloadAction::AddVerifiedRanges() {
+  if (verified_ranges_added_ || !delta_performer_ ||
+      !delta_performer_->IsManifestValid() || payload_->already_applied) {
+    return;
+  }
+  verified_ranges_added_ = true;
+  // The fetchers check the ranges against SHA-256 hashes.
+  if (install_plan_.hash_algorithm != HashAlgorithm::kSha256)
+    return;
+  // The data blobs follow the metadata and its signature.
+  const uint64_t data_offset =
+      base_offset_ + delta_performer_->GetFullMetadataSize();
+  for (const auto& partition : delta_performer_->partitions()) {
+    for (const auto& op : partition.operations()) {
+      if (op.data_length() == 0 || !op.has_data_sha256_hash())
+        continue;
+      http_fetcher_->AddVerifiedRange(
+          data_offset + op.data_offset(),
+          op.data_length(),
+          brillo::Blob(op.data_sha256_hash().begin(),
+                       op.data_sha256_hash().end()));
+    }
+  }
+}
+
+void DownloadAction::UpdateFlowControl() {
+  if (throttled_ || !delta_performer_)
+    return;
+  const size_t queued_bytes = delta_performer_->GetQueuedBytes();
+  if (queued_bytes < DeltaPerformer::kQueuedBytesHighWatermark)
+    return;
+  LOG(INFO) << "Pausing the download while " << queued_bytes
+            << " bytes are waiting to be applied.";
+  if (!IsTransferPaused())
+    http_fetcher_->Pause();
+  throttled_ = true;
+  queued_bytes_check_id_ = MessageLoop::current()->PostDelayedTask(
+      FROM_HERE,
+      base::Bind(&DownloadAction::CheckQueuedBytes, base::Unretained(this)),
+      base::TimeDelta::FromMilliseconds(kQueuedBytesCheckIntervalMs));
+}
+
+void DownloadAction::CheckQueuedBytes() {
+  queued_bytes_check_id_ = MessageLoop::kTaskIdNull;
+  if (delta_performer_ && delta_performer_->GetQueuedBytes() >
+                              DeltaPerformer::kQueuedBytesLowWatermark) {
+    queued_bytes_check_id_ = MessageLoop::current()->PostDelayedTask(
+        FROM_HERE,
+        base::Bind(&DownloadAction::CheckQueuedBytes, base::Unretained(this)),
+        base::TimeDelta::FromMilliseconds(kQueuedBytesCheckIntervalMs));
+    return;
+  }
+  LOG(INFO) << "Resuming the download.";
+  throttled_ = false;
+  if (!IsTransferPaused())
+    http_fetcher_->Unpause();
+}
+
+void DownloadAction::StopFlowControl() {
+  if (queued_bytes_check_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(queued_bytes_check_id_);
+    queued_bytes_check_id_ = MessageLoop::kTaskIdNull;
+  }
+  throttled_ = false;
+  if (rate_limit_id_ != MessageLoop::kTaskIdNull) {
+    MessageLoop::current()->CancelTask(rate_limit_id_);
+    rate_limit_id_ = MessageLoop::kTaskIdNull;
+  }
+  rate_limited_ = false;
+  rate_limit_start_ = base::TimeTicks();
+}
+
+void DownloadAction::UpdateRateLimit(size_t length) {
+  if (!resource_governor_ || rate_limited_)
+    return;
+  const uint64_t max_rate = resource_governor_->policy().max_download_rate;
+  if (max_rate == 0) {
+    rate_limit_start_ = base::TimeTicks();
+    return;
+  }
+  const base::TimeTicks now = base::TimeTicks::Now();
+  if (rate_limit_start_.is_null()) {
+    rate_limit_start_ = now;
+    rate_limit_bytes_ = 0;
+  }
+  rate_limit_bytes_ += length;
+  const base::TimeDelta elapsed = now - rate_limit_start_;
+  const base::TimeDelta ahead =
+      base::TimeDelta::FromSecondsD(rate_limit_bytes_ * 1.0 / max_rate) -
+      elapsed;
+  if (ahead >= base::TimeDelta::FromMilliseconds(kRateLimitMinPauseMs)) {
+    if (!IsTransferPaused())
+      http_fetcher_->Pause();
+    rate_limited_ = true;
+    rate_limit_id_ = MessageLoop::current()->PostDelayedTask(
+        FROM_HERE,
+        base::Bind(&DownloadAction::EndRateLimitPause, base::Unretained(this)),
+        ahead);
+  } else if (elapsed >= base::TimeDelta::FromSeconds(kRateLimitPeriodSeconds)) {
+    rate_limit_start_ = now;
+    rate_limit_bytes_ = 0;
+  }
+}
+
+void DownloadAction::EndRateLimitPause() {
+  rate_limit_id_ = MessageLoop::kTaskIdNull;
+  rate_limited_ = false;
+  if (!IsTransferPaused())
+    http_fetcher_->Unpause();
+}
+
+void DownloadAction::UpdateThroughput(size_t length) {
+  if (!delta_performer_)
+    return;
+  const base::TimeTicks now = base::TimeTicks::Now();
+  if (throughput_start_.is_null()) {
+    throughput_start_ = now;
+    throughput_received_bytes_ = 0;
+    throughput_queued_bytes_ = delta_performer_->GetQueuedBytes();
+  }
+  throughput_received_bytes_ += length;
+  const base::TimeDelta elapsed = now - throughput_start_;
+  if (elapsed < base::TimeDelta::FromSeconds(kThroughputPeriodSeconds))
+    return;
+
+  // The bytes received and not queued anymore were applied. Those held for
+  // an operation whose data isn't complete yet count as applied too.
+  const size_t queued_bytes = delta_performer_->GetQueuedBytes();
+  const uint64_t consumed_bytes =
+      throughput_received_bytes_ + throughput_queued_bytes_;
+  const uint64_t applied_bytes =
+      consumed_bytes > queued_bytes ? consumed_bytes - queued_bytes : 0;
+  const double seconds = elapsed.InSecondsF();
+  const auto received_rate =
+      static_cast<uint64_t>(throughput_received_bytes_ / seconds);
+  const auto applied_rate = static_cast<uint64_t>(applied_bytes / seconds);
+  LOG(INFO) << "Received " << received_rate << " bytes/s, applied "
+            << applied_rate << " bytes/s, " << queued_bytes
+            << " bytes waiting to be applied.";
+  if (delegate_)
+    delegate_->ThroughputUpdated(received_rate, applied_rate);
+
+  throughput_start_ = now;
+  throughput_received_bytes_ = 0;
+  throughput_queued_bytes_ = queued_bytes;
+}
+
 void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
+  UE_TRACE_SCOPE("transfer_complete");
+  StopFlowControl();
+  if (spill_cache_ && successful) {
+    // The download completes once the rest of the cache was applied.
+    LOG_IF(WARNING, !spill_cache_->Sync()) << "Unable to sync the spill cache";
+    spill_transfer_complete_ = true;
+    ScheduleSpilledApply();
+    return;
+  }
+  CompleteDownload(successful);
+}
+
+void DownloadAction::CompleteDownload(bool successful) {
+  StopSpillCache();
   if (delta_performer_) {
     LOG_IF(WARNING, delta_performer_->Close() != 0)
         << "Error closing the writer.";
@@ -254,6 +597,8 @@ void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
     if (delta_performer_ && !payload_->already_applied)
       code = delta_performer_->VerifyPayload(payload_->hash, payload_->size);
     if (code == ErrorCode::kSuccess) {
+      // The payload was applied, its spill cache isn't needed anymore.
+      PayloadSpillCache::Delete(prefs_);
       CHECK_EQ(install_plan_.payloads.size(), 1UL);
       // All payloads have been applied and verified.
       if (delegate_)
@@ -274,6 +619,12 @@ void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
   // Write the path to the output pipe if we're successful.
   if (code == ErrorCode::kSuccess && HasOutputPipe())
     SetOutputObject(install_plan_);
+  // The partitions hashed in the background are left to the next action, or
+  // stop being hashed if the update failed.
+  for (auto& partition : install_plan_.partitions) {
+    partition.target_hasher.reset();
+    partition.inline_hash_tree_builder.reset();
+  }
   processor_->ActionComplete(this, code);
 }
 
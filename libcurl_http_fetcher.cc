@@ -22,6 +22,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <set>
 #include <string>
 
 #include <base/bind.h>
@@ -57,6 +58,37 @@ namespace {
 
 const int kNoNetworkRetrySeconds = 10;
 
+// Idle connections are probed after this long, then every interval, so that
+// connections kept for the next transfers are dropped once the peer is gone.
+const int kKeepAliveIdleSeconds = 30;
+const int kKeepAliveIntervalSeconds = 15;
+
+// The connections, TLS sessions and DNS records of all the fetchers, so that a
+// transfer reuses those of the previous ones: retries, resumed ranges and the
+// separate fetches of the metadata skip the TCP and TLS handshakes. All the
+// fetchers run on the message loop, so the share needs no locking.
+CURLSH* GetCurlShare() {
+  static CURLSH* const share = [] {
+    CURLSH* share = curl_share_init();
+    CHECK(share);
+    for (const auto data : {CURL_LOCK_DATA_CONNECT,
+                            CURL_LOCK_DATA_SSL_SESSION,
+                            CURL_LOCK_DATA_DNS}) {
+      CHECK_EQ(curl_share_setopt(share, CURLSHOPT_SHARE, data), CURLSHE_OK);
+    }
+    return share;
+  }();
+  return share;
+}
+
+// The fetchers alive. A shared connection may be closed by the transfer of
+// another fetcher than the one which opened it, or after it is gone.
+std::set<LibcurlHttpFetcher*>& LiveFetchers() {
+  static std::set<LibcurlHttpFetcher*>* fetchers =
+      new std::set<LibcurlHttpFetcher*>();
+  return *fetchers;
+}
+
 // libcurl's CURLOPT_SOCKOPTFUNCTION callback function. Called after the socket
 // is created but before it is connected. This callback tags the created socket
 // so the network usage can be tracked in Android.
@@ -75,16 +107,17 @@ int LibcurlSockoptCallback(void* /* clientp */,
 }  // namespace
 
 // static
-int LibcurlHttpFetcher::LibcurlCloseSocketCallback(void* clientp,
+int LibcurlHttpFetcher::LibcurlCloseSocketCallback(void* /* clientp */,
                                                    curl_socket_t item) {
 #ifdef __ANDROID__
   qtaguid_untagSocket(item);
 #endif  // __ANDROID__
 
-  LibcurlHttpFetcher* fetcher = static_cast<LibcurlHttpFetcher*>(clientp);
-  // Stop watching the socket before closing it.
-  for (size_t t = 0; t < base::size(fetcher->fd_controller_maps_); ++t) {
-    fetcher->fd_controller_maps_[t].erase(item);
+  // Stop watching the socket before closing it, whichever fetcher watches it.
+  for (LibcurlHttpFetcher* fetcher : LiveFetchers()) {
+    for (size_t t = 0; t < base::size(fetcher->fd_controller_maps_); ++t) {
+      fetcher->fd_controller_maps_[t].erase(item);
+    }
   }
 
   // Documentation for this callback says to return 0 on success or 1 on error.
@@ -101,12 +134,14 @@ LibcurlHttpFetcher::LibcurlHttpFetcher(HardwareInterface* hardware)
     low_speed_time_seconds_ = kDownloadDevModeLowSpeedTimeSeconds;
   if (hardware_->IsOOBEEnabled() && !hardware_->IsOOBEComplete(nullptr))
     max_retry_count_ = kDownloadMaxRetryCountOobeNotComplete;
+  LiveFetchers().insert(this);
 }
 
 LibcurlHttpFetcher::~LibcurlHttpFetcher() {
   LOG_IF(ERROR, transfer_in_progress_)
       << "Destroying the fetcher while a transfer is in progress.";
   CleanUp();
+  LiveFetchers().erase(this);
 }
 
 bool LibcurlHttpFetcher::GetProxyType(const string& proxy,
@@ -154,7 +189,29 @@ void LibcurlHttpFetcher::ResumeTransfer(const string& url) {
       curl_handle_, CURLOPT_SOCKOPTFUNCTION, LibcurlSockoptCallback);
   curl_easy_setopt(
       curl_handle_, CURLOPT_CLOSESOCKETFUNCTION, LibcurlCloseSocketCallback);
-  curl_easy_setopt(curl_handle_, CURLOPT_CLOSESOCKETDATA, this);
+
+  // Reuse the connections and TLS sessions of the previous transfers, and
+  // keep them alive for the next ones. HTTP/2 is negotiated where the server
+  // and libcurl support it.
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_SHARE, GetCurlShare()),
+           CURLE_OK);
+  if (curl_easy_setopt(
+          curl_handle_, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS) !=
+      CURLE_OK) {
+    VLOG(1) << "HTTP/2 not supported by libcurl.";
+  }
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_TCP_KEEPALIVE, 1), CURLE_OK);
+  if (compressed_transfer_ &&
+      curl_easy_setopt(curl_handle_, CURLOPT_TRANSFER_ENCODING, 1L) !=
+          CURLE_OK) {
+    VLOG(1) << "Compressed transfers not supported by libcurl.";
+  }
+  CHECK_EQ(curl_easy_setopt(
+               curl_handle_, CURLOPT_TCP_KEEPIDLE, kKeepAliveIdleSeconds),
+           CURLE_OK);
+  CHECK_EQ(curl_easy_setopt(
+               curl_handle_, CURLOPT_TCP_KEEPINTVL, kKeepAliveIntervalSeconds),
+           CURLE_OK);
 
   CHECK(HasProxy());
   bool is_direct = (GetCurrentProxy() == kNoProxy);
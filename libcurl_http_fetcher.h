@@ -157,6 +157,13 @@ class LibcurlHttpFetcher : public HttpFetcher {
     is_update_check_ = is_update_check;
   }
 
+  // Whether the server is asked to compress the response in transit, with a
+  // Transfer-Encoding libcurl decodes. Unlike a Content-Encoding, it leaves
+  // the requested ranges refer to the bytes of the file.
+  void set_compressed_transfer(bool compressed_transfer) {
+    compressed_transfer_ = compressed_transfer;
+  }
+
  private:
   FRIEND_TEST(LibcurlHttpFetcherTest, HostResolvedTest);
 
@@ -321,6 +328,8 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // True if this object is for update check.
   bool is_update_check_{false};
 
+  bool compressed_transfer_{false};
+
   // Internal state machine.
   UnresolvedHostStateMachine unresolved_host_state_machine_;
 
@@ -41,6 +41,42 @@ struct [[nodiscard]] Result : public std::variant<Err, Res> {
   constexpr Res&& GetResult() && { return std::get<Res>(*this); }
 };
 
+// How a ring is set up, beyond its queue depth.
+struct IoUringOptions {
+  // Extra IORING_SETUP_* flags.
+  unsigned flags = 0;
+  // Whether a kernel thread polls the submission queue, so that submitting
+  // doesn't take a syscall while it is awake. The thread sleeps once idle for
+  // |sq_thread_idle_ms|, or the kernel default if 0, and Submit() wakes it
+  // up. Older kernels only allow it for privileged processes, and only on
+  // registered files.
+  bool sq_poll = false;
+  unsigned sq_thread_idle_ms = 0;
+  // The CPU the polling thread is pinned to, or -1 to let it run anywhere.
+  int sq_thread_cpu = -1;
+  // Whether the kernel runs the completion work of the task at its next
+  // syscall, rather than interrupting it (IORING_SETUP_COOP_TASKRUN). The
+  // kernel doesn't allow it with |sq_poll|.
+  bool coop_taskrun = false;
+};
+
+// What the running kernel supports, as found by IoUringInterface::Probe().
+struct IoUringCapabilities {
+  // Whether io_uring is supported at all. None of the others are without it.
+  bool supported = false;
+  // The IORING_FEAT_* flags of the kernel.
+  uint32_t features = 0;
+  // Whether this process can set up rings with the matching IoUringOptions.
+  bool sq_poll = false;
+  bool sq_poll_affinity = false;
+  bool coop_taskrun = false;
+  // Whether PrepPollMultishot() is supported.
+  bool multishot_poll = false;
+  // Whether the fixed-buffer and vectored operations are supported.
+  bool read_write_fixed = false;
+  bool readv_writev = false;
+};
+
 class IoUringInterface {
  public:
   virtual ~IoUringInterface() {}
@@ -53,6 +89,11 @@ class IoUringInterface {
   // Register a set of file descriptors to kernel.
   virtual Errno RegisterFiles(const int* files, size_t files_size) = 0;
   virtual Errno UnregisterFiles() = 0;
+
+  // Register an eventfd the kernel signals whenever a CQE is posted, so that
+  // completions can be waited for along with other file descriptors.
+  virtual Errno RegisterEventFd(int event_fd) = 0;
+  virtual Errno UnregisterEventFd() = 0;
   // Append a submission entry into this io_uring. This does not submit the
   // operation to the kernel. For that, call |IoUringInterface::Submit()|
   virtual IoUringSQE PrepRead(int fd, void *buf, unsigned nbytes,
@@ -62,6 +103,33 @@ class IoUringInterface {
   virtual IoUringSQE PrepWrite(int fd, const void *buf, unsigned nbytes,
                                uint64_t offset) = 0;
 
+  // Same as PrepRead()/PrepWrite(), for buffers within the |buf_index|-th
+  // buffer passed to RegisterBuffers(), which the kernel doesn't need to map
+  // and pin for every operation.
+  virtual IoUringSQE PrepReadFixed(int fd, void *buf, unsigned nbytes,
+                                   uint64_t offset, int buf_index) = 0;
+  virtual IoUringSQE PrepWriteFixed(int fd, const void *buf, unsigned nbytes,
+                                    uint64_t offset, int buf_index) = 0;
+
+  // Vectored reads and writes, from |offset| in the file into or from the
+  // |nr_vecs| buffers of |iovecs|. The iovecs must stay valid until the
+  // operation is submitted, and the buffers until it completes.
+  virtual IoUringSQE PrepReadv(int fd, const struct iovec *iovecs,
+                               unsigned nr_vecs, uint64_t offset) = 0;
+  virtual IoUringSQE PrepWritev(int fd, const struct iovec *iovecs,
+                                unsigned nr_vecs, uint64_t offset) = 0;
+
+  // Flushes |fd| to the storage. |fsync_flags| may be IORING_FSYNC_DATASYNC
+  // to only flush the data, like fdatasync().
+  virtual IoUringSQE PrepFsync(int fd, unsigned fsync_flags) = 0;
+
+  // Polls |fd| for the events of |poll_mask|, such as POLLIN, posting a CQE
+  // every time they happen until the poll is removed. IoUringCQE::HasMore()
+  // is false on the last CQE, if the kernel stops polling on its own.
+  virtual IoUringSQE PrepPollMultishot(int fd, unsigned poll_mask) = 0;
+  // Removes the poll whose SQE was given |user_data|.
+  virtual IoUringSQE PrepPollRemove(uint64_t user_data) = 0;
+
   // Return number of SQEs available in the queue. If this is 0, subsequent
   // calls to Prep*() functions will fail.
   virtual size_t SQELeft() const = 0;
@@ -79,6 +147,13 @@ class IoUringInterface {
 
   static std::unique_ptr<IoUringInterface> CreateLinuxIoUring(int queue_depth,
                                                               int flags);
+  // Returns nullptr and sets errno if the kernel doesn't support |options|.
+  static std::unique_ptr<IoUringInterface> CreateLinuxIoUring(
+      int queue_depth, const IoUringOptions& options);
+
+  // Finds which of the features above the kernel supports, by setting up
+  // small rings. Meant to be called once, rather than before every ring.
+  static IoUringCapabilities Probe();
 };
 
 }  // namespace io_uring_cpp
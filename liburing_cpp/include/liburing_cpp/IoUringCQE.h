@@ -24,8 +24,14 @@
 namespace io_uring_cpp {
 
 struct IoUringCQE {
+  // IORING_CQE_F_MORE, not included here for the users without the kernel
+  // headers defining it.
+  static constexpr uint32_t kFlagMore = 1U << 1;
+
   int32_t res;
   uint32_t flags;
+  // Whether more CQEs follow for the same multishot operation.
+  constexpr bool HasMore() const { return flags & kFlagMore; }
   template <typename T>
   T GetData() const {
     static_assert(
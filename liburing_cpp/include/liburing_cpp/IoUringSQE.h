@@ -56,6 +56,12 @@ std::ostream &operator<<(std::ostream &, Errno err);
 struct [[nodiscard]] IoUringSQE {
   constexpr IoUringSQE(void *p) : sqe(p) {}
   IoUringSQE &SetFlags(unsigned int flags);
+  // Makes the fd of the operation an index in the files passed to
+  // RegisterFiles(), rather than a file descriptor.
+  IoUringSQE &SetFixedFile();
+  // Makes the next SQE start only once this one completed successfully. The
+  // rest of the chain is canceled if it fails.
+  IoUringSQE &SetLink();
   template <typename T>
   IoUringSQE &SetData(const T &data) {
     static_assert(
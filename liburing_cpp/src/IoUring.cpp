@@ -16,7 +16,10 @@
 
 #include <asm-generic/errno-base.h>
 #include <liburing_cpp/IoUring.h>
+#include <poll.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <iostream>
@@ -25,6 +28,14 @@
 #include "liburing.h"
 #include "liburing_cpp/IoUringCQE.h"
 
+// Missing from older kernel headers.
+#ifndef IORING_SETUP_COOP_TASKRUN
+#define IORING_SETUP_COOP_TASKRUN (1U << 8)
+#endif
+#ifndef IORING_CQE_F_MORE
+#define IORING_CQE_F_MORE (1U << 1)
+#endif
+
 namespace io_uring_cpp {
 
 template <typename T>
@@ -82,6 +93,14 @@ class IoUring final : public IoUringInterface {
     return ret;
   }
 
+  Errno RegisterEventFd(int event_fd) override {
+    return Errno(io_uring_register_eventfd(&ring, event_fd));
+  }
+
+  Errno UnregisterEventFd() override {
+    return Errno(io_uring_unregister_eventfd(&ring));
+  }
+
   IoUringSQE PrepRead(int fd, void* buf, unsigned nbytes,
                       uint64_t offset) override {
     auto sqe = io_uring_get_sqe(&ring);
@@ -101,6 +120,71 @@ class IoUring final : public IoUringInterface {
     return IoUringSQE{static_cast<void*>(sqe)};
   }
 
+  IoUringSQE PrepReadFixed(int fd, void* buf, unsigned nbytes, uint64_t offset,
+                           int buf_index) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_read_fixed(sqe, fd, buf, nbytes, offset, buf_index);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
+  IoUringSQE PrepWriteFixed(int fd, const void* buf, unsigned nbytes,
+                            uint64_t offset, int buf_index) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_write_fixed(sqe, fd, buf, nbytes, offset, buf_index);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
+
+  IoUringSQE PrepReadv(int fd, const struct iovec* iovecs, unsigned nr_vecs,
+                       uint64_t offset) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_readv(sqe, fd, iovecs, nr_vecs, offset);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
+  IoUringSQE PrepWritev(int fd, const struct iovec* iovecs, unsigned nr_vecs,
+                        uint64_t offset) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_writev(sqe, fd, iovecs, nr_vecs, offset);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
+
+  IoUringSQE PrepFsync(int fd, unsigned fsync_flags) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_fsync(sqe, fd, fsync_flags);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
+
+  IoUringSQE PrepPollMultishot(int fd, unsigned poll_mask) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_poll_multishot(sqe, fd, poll_mask);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
+
+  IoUringSQE PrepPollRemove(uint64_t user_data) override {
+    auto sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr) {
+      return IoUringSQE{nullptr};
+    }
+    io_uring_prep_poll_remove(sqe, user_data);
+    return IoUringSQE{static_cast<void*>(sqe)};
+  }
+
   size_t SQELeft() const override { return io_uring_sq_space_left(&ring); }
   size_t SQEReady() const override { return io_uring_sq_ready(&ring); }
 
@@ -177,6 +261,63 @@ std::ostream& operator<<(std::ostream& out, Errno err) {
   return out;
 }
 
+namespace {
+
+struct io_uring_params ToParams(const IoUringOptions& options) {
+  struct io_uring_params params {};
+  params.flags = options.flags;
+  if (options.sq_poll) {
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = options.sq_thread_idle_ms;
+    if (options.sq_thread_cpu >= 0) {
+      params.flags |= IORING_SETUP_SQ_AFF;
+      params.sq_thread_cpu = options.sq_thread_cpu;
+    }
+  }
+  if (options.coop_taskrun) {
+    params.flags |= IORING_SETUP_COOP_TASKRUN;
+  }
+  return params;
+}
+
+// Whether a ring can be set up with |options|.
+bool Supports(const IoUringOptions& options) {
+  struct io_uring ring {};
+  struct io_uring_params params = ToParams(options);
+  if (io_uring_queue_init_params(2, &ring, &params) != 0) {
+    return false;
+  }
+  io_uring_queue_exit(&ring);
+  return true;
+}
+
+// Whether a multishot poll of an eventfd posts a CQE for every write, with
+// more to follow. Kernels without multishot polls reject the SQE.
+bool SupportsMultishotPoll(struct io_uring* ring) {
+  const int event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (event_fd < 0) {
+    return false;
+  }
+  bool supported = false;
+  struct io_uring_sqe* sqe = io_uring_get_sqe(ring);
+  if (sqe != nullptr) {
+    io_uring_prep_poll_multishot(sqe, event_fd, POLLIN);
+    const uint64_t value = 1;
+    struct io_uring_cqe* cqe = nullptr;
+    if (io_uring_submit(ring) == 1 &&
+        write(event_fd, &value, sizeof(value)) == sizeof(value) &&
+        io_uring_wait_cqe(ring, &cqe) == 0) {
+      supported = cqe->res > 0 && (cqe->flags & IORING_CQE_F_MORE);
+      io_uring_cqe_seen(ring, cqe);
+    }
+  }
+  // Exiting the ring cancels the poll before the eventfd goes away.
+  close(event_fd);
+  return supported;
+}
+
+}  // namespace
+
 std::unique_ptr<IoUringInterface> IoUringInterface::CreateLinuxIoUring(
     int queue_depth, int flags) {
   struct io_uring ring {};
@@ -188,4 +329,49 @@ std::unique_ptr<IoUringInterface> IoUringInterface::CreateLinuxIoUring(
   return std::unique_ptr<IoUringInterface>(new IoUring(ring));
 }
 
+std::unique_ptr<IoUringInterface> IoUringInterface::CreateLinuxIoUring(
+    int queue_depth, const IoUringOptions& options) {
+  struct io_uring ring {};
+  struct io_uring_params params = ToParams(options);
+  const auto err = io_uring_queue_init_params(queue_depth, &ring, &params);
+  if (err) {
+    errno = -err;
+    return {};
+  }
+  return std::unique_ptr<IoUringInterface>(new IoUring(ring));
+}
+
+IoUringCapabilities IoUringInterface::Probe() {
+  IoUringCapabilities capabilities;
+  struct io_uring ring {};
+  struct io_uring_params params {};
+  if (io_uring_queue_init_params(2, &ring, &params) != 0) {
+    return capabilities;
+  }
+  capabilities.supported = true;
+  capabilities.features = params.features;
+  struct io_uring_probe* probe = io_uring_get_probe_ring(&ring);
+  if (probe != nullptr) {
+    capabilities.read_write_fixed =
+        io_uring_opcode_supported(probe, IORING_OP_READ_FIXED) &&
+        io_uring_opcode_supported(probe, IORING_OP_WRITE_FIXED);
+    capabilities.readv_writev =
+        io_uring_opcode_supported(probe, IORING_OP_READV) &&
+        io_uring_opcode_supported(probe, IORING_OP_WRITEV);
+    io_uring_free_probe(probe);
+  }
+  capabilities.multishot_poll = SupportsMultishotPoll(&ring);
+  io_uring_queue_exit(&ring);
+
+  IoUringOptions options;
+  options.sq_poll = true;
+  capabilities.sq_poll = Supports(options);
+  options.sq_thread_cpu = 0;
+  capabilities.sq_poll_affinity = capabilities.sq_poll && Supports(options);
+  options = {};
+  options.coop_taskrun = true;
+  capabilities.coop_taskrun = Supports(options);
+  return capabilities;
+}
+
 }  // namespace io_uring_cpp
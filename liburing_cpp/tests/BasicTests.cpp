@@ -21,6 +21,8 @@
 #include <stdio.h>
 
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/utsname.h>
 #include <unistd.h>
@@ -191,4 +193,196 @@ TEST_F(IoUringTest, ExtentRead) {
   for (int i = 0; i < data.size(); ++i) {
     ASSERT_EQ(data[i], i % 256);
   }
-}
\ No newline at end of file
+}
+TEST_F(IoUringTest, FixedBufferReadWrite) {
+  const int fd = fileno(fp);
+  std::vector<unsigned char> write_buf(kBlockSize, 'B');
+  std::vector<unsigned char> read_buf(kBlockSize);
+  const std::array<struct iovec, 2> iovecs{{
+      {write_buf.data(), write_buf.size()},
+      {read_buf.data(), read_buf.size()},
+  }};
+  ASSERT_TRUE(ring->RegisterBuffers(iovecs.data(), iovecs.size()).IsOk());
+
+  ASSERT_TRUE(ring->PrepWriteFixed(fd, write_buf.data(), kBlockSize, 0, 0)
+                  .SetLink()
+                  .IsOk());
+  ASSERT_TRUE(
+      ring->PrepReadFixed(fd, read_buf.data(), kBlockSize, 0, 1).IsOk());
+  const auto ret = ring->SubmitAndWait(2);
+  ASSERT_TRUE(ret.IsOk()) << ret.ErrMsg();
+  const auto cqes = ring->PopCQE(2);
+  ASSERT_TRUE(cqes.IsOk()) << cqes.GetError();
+  for (const auto& cqe : cqes.GetResult()) {
+    ASSERT_EQ(cqe.res, static_cast<int>(kBlockSize));
+  }
+  ASSERT_EQ(write_buf, read_buf);
+  ASSERT_TRUE(ring->UnregisterBuffers().IsOk());
+}
+
+TEST_F(IoUringTest, VectoredReadWrite) {
+  const int fd = fileno(fp);
+  std::string first(kBlockSize, 'C');
+  std::string second(kBlockSize, 'D');
+  const std::array<struct iovec, 2> write_iovecs{{
+      {first.data(), first.size()},
+      {second.data(), second.size()},
+  }};
+  ASSERT_TRUE(
+      ring->PrepWritev(fd, write_iovecs.data(), write_iovecs.size(), 0)
+          .IsOk());
+  auto ret = ring->SubmitAndWait(1);
+  ASSERT_TRUE(ret.IsOk()) << ret.ErrMsg();
+  auto cqe = ring->PopCQE();
+  ASSERT_TRUE(cqe.IsOk()) << cqe.GetError();
+  ASSERT_EQ(cqe.GetResult().res, static_cast<int>(2 * kBlockSize));
+
+  // Read back in the opposite order.
+  std::string read_first(kBlockSize, 0);
+  std::string read_second(kBlockSize, 0);
+  const std::array<struct iovec, 2> read_iovecs{{
+      {read_second.data(), read_second.size()},
+      {read_first.data(), read_first.size()},
+  }};
+  ASSERT_TRUE(
+      ring->PrepReadv(fd, read_iovecs.data(), read_iovecs.size(), 0).IsOk());
+  ret = ring->SubmitAndWait(1);
+  ASSERT_TRUE(ret.IsOk()) << ret.ErrMsg();
+  cqe = ring->PopCQE();
+  ASSERT_TRUE(cqe.IsOk()) << cqe.GetError();
+  ASSERT_EQ(cqe.GetResult().res, static_cast<int>(2 * kBlockSize));
+  ASSERT_EQ(read_second, first);
+  ASSERT_EQ(read_first, second);
+}
+
+TEST_F(IoUringTest, FixedFileWriteAndFsync) {
+  const int fd = fileno(fp);
+  ASSERT_TRUE(ring->RegisterFiles(&fd, 1).IsOk());
+  std::string buffer(kBlockSize, 'E');
+  // Index 0 of the registered files, flushed once written.
+  ASSERT_TRUE(ring->PrepWrite(0, buffer.data(), buffer.size(), 0)
+                  .SetFixedFile()
+                  .SetLink()
+                  .IsOk());
+  ASSERT_TRUE(ring->PrepFsync(0, 0).SetFixedFile().IsOk());
+  const auto ret = ring->SubmitAndWait(2);
+  ASSERT_TRUE(ret.IsOk()) << ret.ErrMsg();
+  const auto cqes = ring->PopCQE(2);
+  ASSERT_TRUE(cqes.IsOk()) << cqes.GetError();
+  for (const auto& cqe : cqes.GetResult()) {
+    ASSERT_GE(cqe.res, 0) << strerror(-cqe.res);
+  }
+  ASSERT_TRUE(ring->UnregisterFiles().IsOk());
+
+  std::string read_buf(kBlockSize, 0);
+  ASSERT_EQ(pread(fd, read_buf.data(), read_buf.size(), 0),
+            static_cast<ssize_t>(kBlockSize));
+  ASSERT_EQ(read_buf, buffer);
+}
+
+TEST_F(IoUringTest, Probe) {
+  const auto capabilities = IoUringInterface::Probe();
+  ASSERT_TRUE(capabilities.supported);
+  // Both were added before the oldest kernel the tests run on.
+  ASSERT_TRUE(capabilities.read_write_fixed);
+  ASSERT_TRUE(capabilities.readv_writev);
+  if (capabilities.sq_poll_affinity) {
+    ASSERT_TRUE(capabilities.sq_poll);
+  }
+}
+
+TEST_F(IoUringTest, SqPollWriteRead) {
+  if (!IoUringInterface::Probe().sq_poll) {
+    GTEST_SKIP() << "SQPOLL isn't supported";
+  }
+  IoUringOptions options;
+  options.sq_poll = true;
+  options.sq_thread_idle_ms = 10;
+  auto sq_poll_ring = IoUringInterface::CreateLinuxIoUring(16, options);
+  ASSERT_NE(sq_poll_ring, nullptr) << strerror(errno);
+
+  // Older kernels only poll for operations on registered files.
+  const int fd = fileno(fp);
+  ASSERT_TRUE(sq_poll_ring->RegisterFiles(&fd, 1).IsOk());
+  std::string buffer(kBlockSize, 'F');
+  std::string read_buf(kBlockSize, 0);
+  ASSERT_TRUE(sq_poll_ring->PrepWrite(0, buffer.data(), buffer.size(), 0)
+                  .SetFixedFile()
+                  .SetLink()
+                  .IsOk());
+  ASSERT_TRUE(sq_poll_ring->PrepRead(0, read_buf.data(), read_buf.size(), 0)
+                  .SetFixedFile()
+                  .IsOk());
+  const auto ret = sq_poll_ring->SubmitAndWait(2);
+  ASSERT_TRUE(ret.IsOk()) << ret.ErrMsg();
+  const auto cqes = sq_poll_ring->PopCQE(2);
+  ASSERT_TRUE(cqes.IsOk()) << cqes.GetError();
+  for (const auto& cqe : cqes.GetResult()) {
+    ASSERT_EQ(cqe.res, static_cast<int>(kBlockSize));
+  }
+  ASSERT_EQ(read_buf, buffer);
+}
+
+TEST_F(IoUringTest, CoopTaskrunRead) {
+  if (!IoUringInterface::Probe().coop_taskrun) {
+    GTEST_SKIP() << "IORING_SETUP_COOP_TASKRUN isn't supported";
+  }
+  IoUringOptions options;
+  options.coop_taskrun = true;
+  auto coop_ring = IoUringInterface::CreateLinuxIoUring(16, options);
+  ASSERT_NE(coop_ring, nullptr) << strerror(errno);
+
+  const int fd = fileno(fp);
+  ASSERT_NO_FATAL_FAILURE(WriteTestData(fd, 0, kBlockSize));
+  std::vector<unsigned char> data(kBlockSize);
+  ASSERT_TRUE(coop_ring->PrepRead(fd, data.data(), data.size(), 0).IsOk());
+  const auto ret = coop_ring->SubmitAndWait(1);
+  ASSERT_TRUE(ret.IsOk()) << ret.ErrMsg();
+  const auto cqe = coop_ring->PopCQE();
+  ASSERT_TRUE(cqe.IsOk()) << cqe.GetError();
+  ASSERT_EQ(cqe.GetResult().res, static_cast<int>(kBlockSize));
+  for (size_t i = 0; i < data.size(); ++i) {
+    ASSERT_EQ(data[i], i % 256);
+  }
+}
+
+TEST_F(IoUringTest, MultishotPoll) {
+  if (!IoUringInterface::Probe().multishot_poll) {
+    GTEST_SKIP() << "Multishot polls aren't supported";
+  }
+  const int event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  ASSERT_GE(event_fd, 0) << strerror(errno);
+  constexpr uint64_t kPollData = 42;
+  ASSERT_TRUE(
+      ring->PrepPollMultishot(event_fd, POLLIN).SetData(kPollData).IsOk());
+  auto ret = ring->Submit();
+  ASSERT_TRUE(ret.IsOk()) << ret.ErrMsg();
+
+  // A single poll completes every time the eventfd is signaled.
+  for (int i = 0; i < 2; i++) {
+    uint64_t value = 1;
+    ASSERT_EQ(write(event_fd, &value, sizeof(value)), sizeof(value));
+    const auto cqe = ring->PopCQE();
+    ASSERT_TRUE(cqe.IsOk()) << cqe.GetError();
+    ASSERT_EQ(cqe.GetResult().GetData<uint64_t>(), kPollData);
+    ASSERT_TRUE(cqe.GetResult().res & POLLIN);
+    ASSERT_TRUE(cqe.GetResult().HasMore());
+    ASSERT_EQ(read(event_fd, &value, sizeof(value)), sizeof(value));
+  }
+
+  ASSERT_TRUE(ring->PrepPollRemove(kPollData).SetData(uint64_t{0}).IsOk());
+  ret = ring->SubmitAndWait(2);
+  ASSERT_TRUE(ret.IsOk()) << ret.ErrMsg();
+  const auto cqes = ring->PopCQE(2);
+  ASSERT_TRUE(cqes.IsOk()) << cqes.GetError();
+  for (const auto& cqe : cqes.GetResult()) {
+    if (cqe.GetData<uint64_t>() == kPollData) {
+      // The last CQE of the poll.
+      ASSERT_EQ(cqe.res, -ECANCELED);
+      ASSERT_FALSE(cqe.HasMore());
+    } else {
+      ASSERT_EQ(cqe.res, 0);
+    }
+  }
+  close(event_fd);
+}
@@ -0,0 +1,204 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "block_compressor.h"
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <lz4.h>
+#include <lz4hc.h>
+#include <zstd.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+class Lz4BlockCompressor : public BlockCompressor {
+ public:
+  explicit Lz4BlockCompressor(const CompressionAlgorithm& algo)
+      : algo_(algo) {}
+  ~Lz4BlockCompressor() override {
+    if (hc_) {
+      LZ4_freeStreamHC(hc_);
+    }
+  }
+
+  size_t Compress(std::string_view input,
+                  size_t /* block_length */,
+                  uint8_t* out,
+                  size_t capacity) override {
+    int ret = 0;
+    // LZ4 spec enforces that last op of a compressed block must be an insert op
+    // of at least 5 bytes. Compressors will try to conform to that requirement
+    // if the input size is just right. We don't want that. So always give a
+    // little bit more data.
+    switch (int src_size = input.size(); algo_.type()) {
+      case CompressionAlgorithm::LZ4HC:
+        if (hc_ == nullptr) {
+          hc_ = LZ4_createStreamHC();
+          if (hc_ == nullptr) {
+            LOG(ERROR) << "Failed to create an LZ4HC stream.";
+            return 0;
+          }
+        }
+        ret = LZ4_compress_HC_destSize(hc_,
+                                       input.data(),
+                                       reinterpret_cast<char*>(out),
+                                       &src_size,
+                                       capacity,
+                                       algo_.level());
+        break;
+      case CompressionAlgorithm::LZ4:
+        ret = LZ4_compress_destSize(input.data(),
+                                    reinterpret_cast<char*>(out),
+                                    &src_size,
+                                    capacity);
+        break;
+      default:
+        LOG(ERROR) << "Unrecognized compression algorithm: " << algo_.type();
+        return 0;
+    }
+    return std::max(ret, 0);
+  }
+
+  bool Decompress(std::string_view cluster,
+                  uint8_t* out,
+                  size_t length) override {
+    const int bytes_decompressed =
+        LZ4_decompress_safe_partial(cluster.data(),
+                                    reinterpret_cast<char*>(out),
+                                    cluster.size(),
+                                    length,
+                                    length);
+    if (bytes_decompressed < 0 ||
+        static_cast<size_t>(bytes_decompressed) != length) {
+      LOG(ERROR) << "LZ4_decompress_safe_partial returned "
+                 << bytes_decompressed << ", expected " << length;
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  const CompressionAlgorithm algo_;
+  LZ4_streamHC_t* hc_{nullptr};
+};
+
+class ZstdBlockCompressor : public BlockCompressor {
+  struct ZstdDeleter {
+    void operator()(ZSTD_CCtx* p) { ZSTD_freeCCtx(p); }
+    void operator()(ZSTD_DCtx* p) { ZSTD_freeDCtx(p); }
+  };
+
+ public:
+  explicit ZstdBlockCompressor(const CompressionAlgorithm& algo)
+      : level_(algo.level()) {}
+  ~ZstdBlockCompressor() override = default;
+
+  size_t Compress(std::string_view input,
+                  size_t block_length,
+                  uint8_t* out,
+                  size_t capacity) override {
+    if (cctx_ == nullptr) {
+      cctx_.reset(ZSTD_createCCtx());
+      if (cctx_ == nullptr ||
+          ZSTD_isError(ZSTD_CCtx_setParameter(
+              cctx_.get(), ZSTD_c_compressionLevel, level_))) {
+        LOG(ERROR) << "Failed to create a zstd context of level " << level_;
+        cctx_.reset();
+        return 0;
+      }
+    }
+    // mkfs.erofs searches for the largest input whose ZSTD_compress2() output
+    // fits in the cluster, so compressing the block the same way gives the
+    // same output.
+    buffer_.resize(ZSTD_compressBound(block_length));
+    const size_t size = ZSTD_compress2(cctx_.get(),
+                                       buffer_.data(),
+                                       buffer_.size(),
+                                       input.data(),
+                                       block_length);
+    if (ZSTD_isError(size)) {
+      LOG(ERROR) << "ZSTD_compress2 returned " << ZSTD_getErrorName(size);
+      return 0;
+    }
+    const size_t bytes_written = std::min(size, capacity);
+    std::copy_n(buffer_.data(), bytes_written, out);
+    return bytes_written;
+  }
+
+  bool Decompress(std::string_view cluster,
+                  uint8_t* out,
+                  size_t length) override {
+    if (dctx_ == nullptr) {
+      dctx_.reset(ZSTD_createDCtx());
+      TEST_AND_RETURN_FALSE(dctx_ != nullptr);
+    }
+    TEST_AND_RETURN_FALSE(!ZSTD_isError(
+        ZSTD_DCtx_reset(dctx_.get(), ZSTD_reset_session_only)));
+    // Streamed, to stop after |length| bytes like LZ4 partial decoding, even
+    // if the frame holds more.
+    ZSTD_inBuffer input{cluster.data(), cluster.size(), 0};
+    ZSTD_outBuffer output{out, length, 0};
+    while (output.pos < output.size) {
+      const size_t input_pos = input.pos;
+      const size_t output_pos = output.pos;
+      const size_t ret = ZSTD_decompressStream(dctx_.get(), &output, &input);
+      if (ZSTD_isError(ret)) {
+        LOG(ERROR) << "ZSTD_decompressStream returned "
+                   << ZSTD_getErrorName(ret);
+        return false;
+      }
+      if (ret == 0 || (input.pos == input_pos && output.pos == output_pos)) {
+        break;
+      }
+    }
+    if (output.pos != length) {
+      LOG(ERROR) << "Decompressed " << output.pos << " bytes, expected "
+                 << length;
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  const int level_;
+  std::unique_ptr<ZSTD_CCtx, ZstdDeleter> cctx_;
+  std::unique_ptr<ZSTD_DCtx, ZstdDeleter> dctx_;
+  Blob buffer_;
+};
+
+}  // namespace
+
+std::unique_ptr<BlockCompressor> CreateBlockCompressor(
+    const CompressionAlgorithm& algo) {
+  switch (algo.type()) {
+    case CompressionAlgorithm::UNCOMPRESSED:
+    case CompressionAlgorithm::LZ4:
+    case CompressionAlgorithm::LZ4HC:
+      return std::make_unique<Lz4BlockCompressor>(algo);
+    case CompressionAlgorithm::ZSTD:
+      return std::make_unique<ZstdBlockCompressor>(algo);
+    default:
+      LOG(ERROR) << "Unsupported compression algorithm: " << algo.type();
+      return nullptr;
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,61 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_LZ4DIFF_BLOCK_COMPRESSOR_H_
+#define UPDATE_ENGINE_LZ4DIFF_BLOCK_COMPRESSOR_H_
+
+#include <memory>
+#include <string_view>
+
+#include "lz4diff_format.h"
+
+namespace chromeos_update_engine {
+
+// Compresses and decompresses the physical clusters of an EROFS file for one
+// compression algorithm, the way mkfs.erofs does. An instance keeps the state
+// of the compressor between blocks, so it must only be used by one thread at a
+// time.
+class BlockCompressor {
+ public:
+  virtual ~BlockCompressor() = default;
+
+  // Compresses the |block_length| first bytes of |input| into at most
+  // |capacity| bytes at |out|, returning the number of bytes written, or 0 on
+  // failure. |input| extends past the block, for the algorithms that compress
+  // as much input as fits like mkfs.erofs does for LZ4. Output that doesn't
+  // fit may be truncated, as the generator patches any difference with the
+  // original cluster.
+  virtual size_t Compress(std::string_view input,
+                          size_t block_length,
+                          uint8_t* out,
+                          size_t capacity) = 0;
+
+  // Decompresses the first |length| bytes of the data compressed in |cluster|,
+  // which has no zero padding, into |out|.
+  virtual bool Decompress(std::string_view cluster,
+                          uint8_t* out,
+                          size_t length) = 0;
+};
+
+// Returns the compressor of |algo|, or nullptr if it isn't supported. For
+// UNCOMPRESSED, passed by the callers not knowing the algorithm of blocks they
+// only decompress, the compressor decompresses LZ4 and fails to compress.
+std::unique_ptr<BlockCompressor> CreateBlockCompressor(
+    const CompressionAlgorithm& algo);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_LZ4DIFF_BLOCK_COMPRESSOR_H_
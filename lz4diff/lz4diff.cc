@@ -26,18 +26,114 @@
 #include <lz4.h>
 #include <lz4hc.h>
 
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
 #include "update_engine/common/utils.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_cache.h"
 #include "lz4diff/lz4diff.pb.h"
 #include "lz4diff_format.h"
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// Changing how the postfix patches are generated must bump this, to not reuse
+// the patches of the previous generator.
+constexpr uint32_t kPostfixCacheFormatVersion = 1;
+
+// Bytes of postfix patches kept in the memo, past which new ones are only
+// stored in the diff cache.
+constexpr size_t kMaxPostfixMemoSize = 64 * 1024 * 1024;
+
+// Postfix patches of the blocks diffed so far by this process, shared by the
+// threads diffing files, as identical blocks show up in many files.
+struct PostfixMemo {
+  std::mutex mutex;
+  std::unordered_map<std::string, std::string> patches;
+  size_t size{0};
+};
+
+PostfixMemo* GetPostfixMemo() {
+  static PostfixMemo* memo = new PostfixMemo();
+  return memo;
+}
+
+// Returns the key of the postfix patch from the |recompressed_block| to the
+// |target_block|. The patch only depends on these two, while the recompressed
+// block itself depends on all the data after it, so it's keyed by the
+// recompressed bytes rather than the uncompressed ones.
+std::string PostfixCacheKey(const Blob& recompressed_block_hash,
+                            std::string_view target_block) {
+  Blob target_block_hash;
+  CHECK(HashCalculator::RawHashOfBytes(
+      target_block.data(), target_block.size(), &target_block_hash));
+  HashCalculator hasher;
+  CHECK(hasher.Update(&kPostfixCacheFormatVersion,
+                      sizeof(kPostfixCacheFormatVersion)));
+  CHECK(hasher.Update(recompressed_block_hash.data(),
+                      recompressed_block_hash.size()));
+  CHECK(hasher.Update(target_block_hash.data(), target_block_hash.size()));
+  CHECK(hasher.Finalize());
+  return utils::HexEncode(hasher.raw_hash());
+}
+
+// Generates the bsdiff patch from |recompressed_block| to |target_block|, or
+// finds it in the memo or |cache|.
+bool GeneratePostfixPatch(std::string_view recompressed_block,
+                          const Blob& recompressed_block_hash,
+                          std::string_view target_block,
+                          DiffCacheInterface* cache,
+                          std::string* patch_content) {
+  const std::string key =
+      PostfixCacheKey(recompressed_block_hash, target_block);
+  auto* memo = GetPostfixMemo();
+  {
+    std::lock_guard<std::mutex> lock(memo->mutex);
+    auto it = memo->patches.find(key);
+    if (it != memo->patches.end()) {
+      *patch_content = it->second;
+      return true;
+    }
+  }
+  Blob cached_patch;
+  if (cache && cache->Lookup(key, &cached_patch)) {
+    patch_content->assign(cached_patch.begin(), cached_patch.end());
+  } else {
+    ScopedTempFile patch;
+    int err = bsdiff::bsdiff(
+        reinterpret_cast<const unsigned char*>(recompressed_block.data()),
+        recompressed_block.size(),
+        reinterpret_cast<const unsigned char*>(target_block.data()),
+        target_block.size(),
+        patch.path().c_str(),
+        nullptr);
+    CHECK_EQ(err, 0);
+    LOG(WARNING) << "Recompress Postfix patch size: "
+                 << utils::FileSize(patch.path());
+    TEST_AND_RETURN_FALSE(utils::ReadFile(patch.path(), patch_content));
+    if (cache) {
+      cache->Store(key, Blob(patch_content->begin(), patch_content->end()));
+    }
+  }
+  std::lock_guard<std::mutex> lock(memo->mutex);
+  if (memo->size + patch_content->size() <= kMaxPostfixMemoSize &&
+      memo->patches.emplace(key, *patch_content).second) {
+    memo->size += patch_content->size();
+  }
+  return true;
+}
+
+}  // namespace
+
 bool StoreDstCompressedFileInfo(std::string_view recompressed_blob,
                                 std::string_view target_blob,
                                 const CompressedFile& dst_file_info,
+                                DiffCacheInterface* cache,
                                 Lz4diffHeader* output) {
   *output->mutable_dst_info()->mutable_algo() = dst_file_info.algo;
   output->mutable_dst_info()->set_zero_padding_enabled(
@@ -54,27 +150,17 @@ bool StoreDstCompressedFileInfo(std::string_view recompressed_blob,
     CHECK_LT(offset, recompressed_blob.size());
     auto s1 = recompressed_blob.substr(offset, block.compressed_length);
     auto s2 = target_blob.substr(offset, block.compressed_length);
-    if (s1 != s2) {
-      ScopedTempFile patch;
-      int err =
-          bsdiff::bsdiff(reinterpret_cast<const unsigned char*>(s1.data()),
-                         s1.size(),
-                         reinterpret_cast<const unsigned char*>(s2.data()),
-                         s2.size(),
-                         patch.path().c_str(),
-                         nullptr);
-      CHECK_EQ(err, 0);
-      LOG(WARNING) << "Recompress Postfix patch size: "
-                   << utils::FileSize(patch.path());
-      std::string patch_content;
-      TEST_AND_RETURN_FALSE(utils::ReadFile(patch.path(), &patch_content));
-      pb_block.set_postfix_bspatch(std::move(patch_content));
-    }
     // Include recompressed blob hash, so we can determine if the device
     // produces same compressed output
     Blob recompressed_blob_hash;
     TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
         s1.data(), s1.length(), &recompressed_blob_hash));
+    if (s1 != s2) {
+      std::string patch_content;
+      TEST_AND_RETURN_FALSE(GeneratePostfixPatch(
+          s1, recompressed_blob_hash, s2, cache, &patch_content));
+      pb_block.set_postfix_bspatch(std::move(patch_content));
+    }
     pb_block.set_sha256_hash(recompressed_blob_hash.data(),
                              recompressed_blob_hash.size());
 
@@ -182,14 +268,19 @@ bool Lz4Diff(std::string_view src,
              const CompressedFile& src_file_info,
              const CompressedFile& dst_file_info,
              Blob* output,
-             InstallOperation::Type* op_type) noexcept {
+             InstallOperation::Type* op_type,
+             DiffCacheInterface* cache) noexcept {
   const auto& src_block_info = src_file_info.blocks;
   const auto& dst_block_info = dst_file_info.blocks;
 
-  auto decompressed_src = TryDecompressBlob(
-      src, src_block_info, src_file_info.zero_padding_enabled);
-  auto decompressed_dst = TryDecompressBlob(
-      dst, dst_block_info, dst_file_info.zero_padding_enabled);
+  auto decompressed_src = TryDecompressBlob(src,
+                                            src_block_info,
+                                            src_file_info.zero_padding_enabled,
+                                            src_file_info.algo);
+  auto decompressed_dst = TryDecompressBlob(dst,
+                                            dst_block_info,
+                                            dst_file_info.zero_padding_enabled,
+                                            dst_file_info.algo);
   if (decompressed_src.empty() || decompressed_dst.empty()) {
     LOG(ERROR) << "Failed to decompress input data";
     return false;
@@ -225,8 +316,8 @@ bool Lz4Diff(std::string_view src,
   TEST_AND_RETURN_FALSE(recompressed_blob.size() > 0);
 
   StoreSrcCompressedFileInfo(src_file_info, &header);
-  StoreDstCompressedFileInfo(
-      ToStringView(recompressed_blob), dst, dst_file_info, &header);
+  TEST_AND_RETURN_FALSE(StoreDstCompressedFileInfo(
+      ToStringView(recompressed_blob), dst, dst_file_info, cache, &header));
   return ConstructLz4diffPatch(std::move(patch_data), header, output);
 }
 
@@ -235,13 +326,15 @@ bool Lz4Diff(const Blob& src,
              const CompressedFile& src_file_info,
              const CompressedFile& dst_file_info,
              Blob* output,
-             InstallOperation::Type* op_type) noexcept {
+             InstallOperation::Type* op_type,
+             DiffCacheInterface* cache) noexcept {
   return Lz4Diff(ToStringView(src),
                  ToStringView(dst),
                  src_file_info,
                  dst_file_info,
                  output,
-                 op_type);
+                 op_type,
+                 cache);
 }
 
 }  // namespace chromeos_update_engine
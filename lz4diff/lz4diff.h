@@ -26,19 +26,25 @@
 
 namespace chromeos_update_engine {
 
+class DiffCacheInterface;
+
+// Postfix patches of the recompressed blocks are looked up in and stored to
+// |cache| if not null.
 bool Lz4Diff(std::string_view src,
              std::string_view dst,
              const CompressedFile& src_file_info,
              const CompressedFile& dst_file_info,
              Blob* output,
-             InstallOperation::Type* op_type = nullptr) noexcept;
+             InstallOperation::Type* op_type = nullptr,
+             DiffCacheInterface* cache = nullptr) noexcept;
 
 bool Lz4Diff(const Blob& src,
              const Blob& dst,
              const CompressedFile& src_file_info,
              const CompressedFile& dst_file_info,
              Blob* output,
-             InstallOperation::Type* op_type = nullptr) noexcept;
+             InstallOperation::Type* op_type = nullptr,
+             DiffCacheInterface* cache = nullptr) noexcept;
 
 }  // namespace chromeos_update_engine
 
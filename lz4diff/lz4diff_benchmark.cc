@@ -0,0 +1,320 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Measures Lz4Diff and Lz4Patch on the compressed files of a pair of EROFS
+// images, against bsdiff of the compressed data as the generator would do
+// otherwise. For each file present in both images, prints one JSON object per
+// line with the patch sizes, the time taken and the peak RSS of each step,
+// then a last object with the totals, to compare versions and tunings.
+//
+// Usage: lz4diff_benchmark <src EROFS image> <dst EROFS image> [file ...]
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/strings/stringprintf.h>
+#include <base/time/time.h>
+#include <bsdiff/bsdiff.h>
+#include <bsdiff/bspatch.h>
+#include <bsdiff/patch_writer.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/lz4diff/lz4diff.h"
+#include "update_engine/lz4diff/lz4patch.h"
+#include "update_engine/payload_generator/erofs_filesystem.h"
+#include "update_engine/payload_generator/filesystem_interface.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The quality lz4diff compresses its inner bsdiff patches with.
+constexpr int kBsdiffBrotliQuality = 9;
+
+// What one diff or patch step took.
+struct StepResult {
+  double ms{};
+  uint64_t peak_rss_kb{};
+};
+
+struct MethodResult {
+  string op;
+  uint64_t patch_size{};
+  StepResult diff;
+  StepResult patch;
+  bool verified{};
+};
+
+// Resets the peak RSS of the process to its current RSS, so that the peak
+// read after a step is the one of the step. Without it, as on kernels not
+// supporting it, the peak is the one of the whole run.
+void ResetPeakRss() {
+  static bool supported = true;
+  if (supported && !utils::WriteFile("/proc/self/clear_refs", "5", 1)) {
+    LOG(WARNING) << "Can't reset the peak RSS, reporting the peak of the run.";
+    supported = false;
+  }
+}
+
+uint64_t PeakRssKb() {
+  string status;
+  if (!base::ReadFileToString(base::FilePath("/proc/self/status"), &status)) {
+    return 0;
+  }
+  const auto pos = status.find("VmHWM:");
+  uint64_t kb = 0;
+  if (pos == string::npos ||
+      sscanf(status.c_str() + pos, "VmHWM: %" SCNu64, &kb) != 1) {
+    return 0;
+  }
+  return kb;
+}
+
+// Runs |step|, returning whether it succeeded and filling |result|.
+template <typename Step>
+bool MeasureStep(Step step, StepResult* result) {
+  ResetPeakRss();
+  const auto start = base::TimeTicks::Now();
+  const bool success = step();
+  result->ms = (base::TimeTicks::Now() - start).InMillisecondsF();
+  result->peak_rss_kb = PeakRssKb();
+  return success;
+}
+
+bool Bsdiff(const Blob& src, const Blob& dst, Blob* patch) {
+  ScopedTempFile patch_file("lz4diff_benchmark_bsdiff.XXXXXX");
+  bsdiff::BsdiffPatchWriter patch_writer(patch_file.path(),
+                                         {bsdiff::CompressorType::kBrotli},
+                                         kBsdiffBrotliQuality);
+  TEST_AND_RETURN_FALSE(0 == bsdiff::bsdiff(src.data(),
+                                            src.size(),
+                                            dst.data(),
+                                            dst.size(),
+                                            &patch_writer,
+                                            nullptr));
+  return utils::ReadFile(patch_file.path(), patch);
+}
+
+bool Bspatch(const Blob& src, const Blob& patch, Blob* output) {
+  output->clear();
+  return 0 == bsdiff::bspatch(src.data(),
+                              src.size(),
+                              patch.data(),
+                              patch.size(),
+                              [output](const uint8_t* data, size_t size) {
+                                output->insert(
+                                    output->end(), data, data + size);
+                                return size;
+                              });
+}
+
+MethodResult BenchmarkLz4diff(const Blob& src,
+                              const Blob& dst,
+                              const FilesystemInterface::File& src_file,
+                              const FilesystemInterface::File& dst_file) {
+  MethodResult result;
+  Blob patch;
+  InstallOperation::Type op_type = InstallOperation::REPLACE;
+  if (!MeasureStep(
+          [&] {
+            return Lz4Diff(src,
+                           dst,
+                           src_file.compressed_file_info,
+                           dst_file.compressed_file_info,
+                           &patch,
+                           &op_type);
+          },
+          &result.diff)) {
+    LOG(ERROR) << "Lz4Diff failed for " << dst_file.name;
+    return result;
+  }
+  result.op = InstallOperation::Type_Name(op_type);
+  result.patch_size = patch.size();
+  Blob output;
+  result.verified =
+      MeasureStep([&] { return Lz4Patch(src, patch, &output); },
+                  &result.patch) &&
+      output == dst;
+  return result;
+}
+
+MethodResult BenchmarkBsdiff(const Blob& src, const Blob& dst) {
+  MethodResult result;
+  result.op = InstallOperation::Type_Name(InstallOperation::SOURCE_BSDIFF);
+  Blob patch;
+  if (!MeasureStep([&] { return Bsdiff(src, dst, &patch); }, &result.diff)) {
+    return result;
+  }
+  result.patch_size = patch.size();
+  Blob output;
+  result.verified =
+      MeasureStep([&] { return Bspatch(src, patch, &output); },
+                  &result.patch) &&
+      output == dst;
+  return result;
+}
+
+string JsonString(std::string_view str) {
+  string out = "\"";
+  for (const char c : str) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      out += base::StringPrintf("\\u%04x", c);
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+string StepJson(const StepResult& step) {
+  return base::StringPrintf(
+      "{\"ms\":%.3f,\"peak_rss_kb\":%" PRIu64 "}", step.ms, step.peak_rss_kb);
+}
+
+string MethodJson(const MethodResult& method) {
+  return base::StringPrintf("{\"op\":%s,\"patch_size\":%" PRIu64
+                            ",\"diff\":%s,\"patch\":%s,\"verified\":%s}",
+                            JsonString(method.op).c_str(),
+                            method.patch_size,
+                            StepJson(method.diff).c_str(),
+                            StepJson(method.patch).c_str(),
+                            method.verified ? "true" : "false");
+}
+
+void AccumulateStep(const StepResult& step, StepResult* total) {
+  total->ms += step.ms;
+  total->peak_rss_kb = std::max(total->peak_rss_kb, step.peak_rss_kb);
+}
+
+// Adds the sizes and times of |method| to |total|, keeping the largest peak.
+void Accumulate(const MethodResult& method, MethodResult* total) {
+  total->patch_size += method.patch_size;
+  AccumulateStep(method.diff, &total->diff);
+  AccumulateStep(method.patch, &total->patch);
+  total->verified = total->verified && method.verified;
+}
+
+bool GetCompressedFiles(const string& image_path,
+                        vector<FilesystemInterface::File>* files) {
+  auto fs = ErofsFilesystem::CreateFromFile(image_path);
+  if (fs == nullptr) {
+    LOG(ERROR) << "Failed to open EROFS image " << image_path;
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(fs->GetFiles(files));
+  files->erase(std::remove_if(files->begin(),
+                              files->end(),
+                              [](const auto& file) {
+                                return file.compressed_file_info.blocks.empty();
+                              }),
+               files->end());
+  return true;
+}
+
+int RunBenchmark(const string& src_image_path,
+                 const string& dst_image_path,
+                 const vector<string>& file_names) {
+  vector<FilesystemInterface::File> src_files;
+  vector<FilesystemInterface::File> dst_files;
+  if (!GetCompressedFiles(src_image_path, &src_files) ||
+      !GetCompressedFiles(dst_image_path, &dst_files)) {
+    return 1;
+  }
+  uint64_t total_src_size = 0;
+  uint64_t total_dst_size = 0;
+  MethodResult total_lz4diff;
+  MethodResult total_bsdiff;
+  total_lz4diff.verified = total_bsdiff.verified = true;
+  size_t num_files = 0;
+  for (const auto& dst_file : dst_files) {
+    if (!file_names.empty() &&
+        std::find(file_names.begin(), file_names.end(), dst_file.name) ==
+            file_names.end()) {
+      continue;
+    }
+    const auto src_file =
+        std::find_if(src_files.begin(),
+                     src_files.end(),
+                     [&dst_file](const auto& file) {
+                       return file.name == dst_file.name;
+                     });
+    if (src_file == src_files.end()) {
+      continue;
+    }
+    Blob src;
+    Blob dst;
+    if (!utils::ReadExtents(
+            src_image_path, src_file->extents, &src, kBlockSize) ||
+        !utils::ReadExtents(
+            dst_image_path, dst_file.extents, &dst, kBlockSize)) {
+      LOG(ERROR) << "Failed to read " << dst_file.name;
+      return 1;
+    }
+    const MethodResult lz4diff =
+        BenchmarkLz4diff(src, dst, *src_file, dst_file);
+    const MethodResult bsdiff = BenchmarkBsdiff(src, dst);
+    printf("{\"file\":%s,\"src_size\":%zu,\"dst_size\":%zu,"
+           "\"lz4diff\":%s,\"bsdiff\":%s}\n",
+           JsonString(dst_file.name).c_str(),
+           src.size(),
+           dst.size(),
+           MethodJson(lz4diff).c_str(),
+           MethodJson(bsdiff).c_str());
+    fflush(stdout);
+    total_src_size += src.size();
+    total_dst_size += dst.size();
+    Accumulate(lz4diff, &total_lz4diff);
+    Accumulate(bsdiff, &total_bsdiff);
+    num_files++;
+  }
+  printf("{\"total\":{\"files\":%zu,\"src_size\":%" PRIu64
+         ",\"dst_size\":%" PRIu64 ",\"lz4diff\":%s,\"bsdiff\":%s}}\n",
+         num_files,
+         total_src_size,
+         total_dst_size,
+         MethodJson(total_lz4diff).c_str(),
+         MethodJson(total_bsdiff).c_str());
+  return total_lz4diff.verified && total_bsdiff.verified ? 0 : 1;
+}
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, const char** argv) {
+  if (argc < 3) {
+    fprintf(stderr,
+            "Usage: %s <src EROFS image> <dst EROFS image> [file ...]\n",
+            argv[0]);
+    return 2;
+  }
+  return chromeos_update_engine::RunBenchmark(
+      argv[1], argv[2], std::vector<std::string>(argv + 3, argv + argc));
+}
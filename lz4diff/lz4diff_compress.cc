@@ -21,12 +21,127 @@
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 
+#include <algorithm>
+#include <functional>
+#include <thread>
+
 #include <base/logging.h>
-#include <lz4.h>
-#include <lz4hc.h>
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// Blocks are compressed and decompressed on up to this many threads. Kept low
+// as on device this runs alongside the rest of the update.
+constexpr size_t kMaxBlockThreads = 4;
+
+// Output bytes of the blocks compressed at once before passing them to the
+// sink, bounding the memory used while keeping the threads busy.
+constexpr size_t kCompressBatchSize = 1024 * 1024;
+
+// Fewer threads are used when they would have fewer blocks each than this,
+// as starting one would cost more than processing the blocks.
+constexpr size_t kMinBlocksPerThread = 8;
+
+size_t MaxBlockThreads() {
+  return std::clamp<size_t>(
+      std::thread::hardware_concurrency(), 1, kMaxBlockThreads);
+}
+
+// Calls |process_block| with each block index from 0 to |num_blocks| - 1 and
+// the index of the thread it runs on, below |max_threads|. Thread i processes
+// blocks i, i + n, ... of the n threads used, the first one being the calling
+// thread. Returns whether all the calls returned true.
+bool ForEachBlockOnThreads(
+    size_t num_blocks,
+    size_t max_threads,
+    const std::function<bool(size_t thread, size_t block)>& process_block) {
+  const size_t num_threads =
+      std::clamp<size_t>(num_blocks / kMinBlocksPerThread, 1, max_threads);
+  std::vector<char> errors(num_threads, false);
+  auto process_blocks = [&](size_t thread) {
+    for (size_t i = thread; i < num_blocks; i += num_threads) {
+      if (!process_block(thread, i)) {
+        errors[thread] = true;
+        return;
+      }
+    }
+  };
+  std::vector<std::thread> threads;
+  threads.reserve(num_threads - 1);
+  for (size_t thread = 1; thread < num_threads; thread++) {
+    threads.emplace_back(process_blocks, thread);
+  }
+  process_blocks(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return std::find(errors.begin(), errors.end(), true) == errors.end();
+}
+
+size_t BlockOutputLength(const CompressedBlock& block) {
+  return block.IsCompressed() ? block.compressed_length
+                              : block.uncompressed_length;
+}
+
+// Writes the BlockOutputLength() bytes of |block| to |out|, compressing the
+// block of |blob| with |*compressor|, created on first use.
+bool CompressBlock(std::string_view blob,
+                   size_t uncompressed_size,
+                   const CompressedBlock& block,
+                   const bool zero_padding_enabled,
+                   const CompressionAlgorithm& compression_algo,
+                   std::unique_ptr<BlockCompressor>* compressor,
+                   uint8_t* out) {
+  if (!block.IsCompressed()) {
+    const auto uncompressed_block =
+        blob.substr(block.uncompressed_offset, block.uncompressed_length);
+    std::copy(uncompressed_block.begin(), uncompressed_block.end(), out);
+    return true;
+  }
+
+  if (*compressor == nullptr) {
+    *compressor = CreateBlockCompressor(compression_algo);
+    TEST_AND_RETURN_FALSE(*compressor != nullptr);
+  }
+  const size_t ret = (*compressor)->Compress(
+      blob.substr(block.uncompressed_offset,
+                  uncompressed_size - block.uncompressed_offset),
+      block.uncompressed_length,
+      out,
+      block.compressed_length);
+  TEST_GT(ret, 0);
+  const uint64_t bytes_written = ret;
+  // Last block may have trailing zeros
+  TEST_LE(bytes_written, block.compressed_length);
+  if (bytes_written < block.compressed_length) {
+    if (zero_padding_enabled) {
+      const auto padding = block.compressed_length - bytes_written;
+      std::memmove(out + padding, out, bytes_written);
+      std::fill(out, out + padding, 0);
+    } else {
+      std::fill(out + bytes_written, out + block.compressed_length, 0);
+    }
+  }
+  return true;
+}
+
+// Returns the number of zeros before the data of compressed |cluster|, which
+// EROFS pads at the front when |zero_padding_enabled|.
+size_t ZeroPaddingLength(std::string_view cluster,
+                         const bool zero_padding_enabled) {
+  size_t inputmargin = 0;
+  if (zero_padding_enabled) {
+    while (inputmargin < std::min(kBlockSize, cluster.size()) &&
+           cluster[inputmargin] == 0) {
+      inputmargin++;
+    }
+  }
+  return inputmargin;
+}
+
+}  // namespace
+
 bool TryCompressBlob(std::string_view blob,
                      const std::vector<CompressedBlock>& block_info,
                      const bool zero_padding_enabled,
@@ -38,78 +153,39 @@ bool TryCompressBlob(std::string_view blob,
         << "Compressed block info is expected to be sorted.";
     uncompressed_size += block.uncompressed_length;
   }
-  auto hc = LZ4_createStreamHC();
-  DEFER {
-    if (hc) {
-      LZ4_freeStreamHC(hc);
-      hc = nullptr;
-    }
-  };
-  size_t compressed_offset = 0;
-  Blob block_buffer;
-  for (const auto& block : block_info) {
-    const auto uncompressed_block =
-        blob.substr(block.uncompressed_offset, block.uncompressed_length);
-    if (!block.IsCompressed()) {
-      TEST_EQ(sink(reinterpret_cast<const uint8_t*>(uncompressed_block.data()),
-                   uncompressed_block.size()),
-              uncompressed_block.size());
-      continue;
-    }
-    block_buffer.resize(block.compressed_length);
-    // Execute the increment at end of each loop
-    DEFER {
-      compressed_offset += block.compressed_length;
-      block_buffer.clear();
-    };
+  TEST_LE(uncompressed_size, blob.size());
 
-    int ret = 0;
-    // LZ4 spec enforces that last op of a compressed block must be an insert op
-    // of at least 5 bytes. Compressors will try to conform to that requirement
-    // if the input size is just right. We don't want that. So always give a
-    // little bit more data.
-    switch (int src_size = uncompressed_size - block.uncompressed_offset;
-            compression_algo.type()) {
-      case CompressionAlgorithm::LZ4HC:
-        ret = LZ4_compress_HC_destSize(
-            hc,
-            uncompressed_block.data(),
-            reinterpret_cast<char*>(block_buffer.data()),
-            &src_size,
-            block.compressed_length,
-            compression_algo.level());
-        break;
-      case CompressionAlgorithm::LZ4:
-        ret =
-            LZ4_compress_destSize(uncompressed_block.data(),
-                                  reinterpret_cast<char*>(block_buffer.data()),
-                                  &src_size,
-                                  block.compressed_length);
-        break;
-      default:
-        LOG(ERROR) << "Unrecognized compression algorithm: "
-                   << compression_algo.type();
-        return {};
-    }
-    TEST_GT(ret, 0);
-    const uint64_t bytes_written = ret;
-    // Last block may have trailing zeros
-    TEST_LE(bytes_written, block.compressed_length);
-    if (bytes_written < block.compressed_length) {
-      if (zero_padding_enabled) {
-        const auto padding = block.compressed_length - bytes_written;
-        std::memmove(
-            block_buffer.data() + padding, block_buffer.data(), bytes_written);
-        std::fill(block_buffer.data(), block_buffer.data() + padding, 0);
-
-      } else {
-        std::fill(block_buffer.data() + bytes_written,
-                  block_buffer.data() + block.compressed_length,
-                  0);
-      }
+  // Blocks are compressed independently of each other, each thread with its
+  // own compressor, into precomputed offsets of the batch buffer.
+  const size_t max_threads = MaxBlockThreads();
+  std::vector<std::unique_ptr<BlockCompressor>> compressors(max_threads);
+  std::vector<size_t> block_offsets;
+  Blob batch_buffer;
+  for (size_t batch_begin = 0; batch_begin < block_info.size();) {
+    size_t batch_end = batch_begin;
+    size_t batch_size = 0;
+    block_offsets.clear();
+    while (batch_end < block_info.size() &&
+           (batch_end == batch_begin || batch_size < kCompressBatchSize)) {
+      block_offsets.push_back(batch_size);
+      batch_size += BlockOutputLength(block_info[batch_end++]);
     }
-    TEST_EQ(sink(block_buffer.data(), block_buffer.size()),
-            block_buffer.size());
+    batch_buffer.resize(batch_size);
+    TEST_AND_RETURN_FALSE(ForEachBlockOnThreads(
+        batch_end - batch_begin,
+        max_threads,
+        [&](size_t thread, size_t i) {
+          return CompressBlock(blob,
+                               uncompressed_size,
+                               block_info[batch_begin + i],
+                               zero_padding_enabled,
+                               compression_algo,
+                               &compressors[thread],
+                               batch_buffer.data() + block_offsets[i]);
+        }));
+    TEST_EQ(sink(batch_buffer.data(), batch_buffer.size()),
+            batch_buffer.size());
+    batch_begin = batch_end;
   }
   // Any trailing data will be copied to the output buffer.
   TEST_EQ(
@@ -150,7 +226,8 @@ Blob TryCompressBlob(std::string_view blob,
 
 Blob TryDecompressBlob(std::string_view blob,
                        const std::vector<CompressedBlock>& block_info,
-                       const bool zero_padding_enabled) {
+                       const bool zero_padding_enabled,
+                       const CompressionAlgorithm& compression_algo) {
   if (block_info.empty()) {
     return {};
   }
@@ -168,50 +245,56 @@ Blob TryDecompressBlob(std::string_view blob,
               << compressed_size << ", actual size: " << blob.size();
     return {};
   }
-  Blob output;
-  output.reserve(uncompressed_size);
+  // The blocks are independent, and decompressed in parallel at their offset
+  // in the output. LZ4_decompress_safe_partial() is used for verified input
+  // too: LZ4's unchecked decoder is deprecated and not faster, and it would
+  // need the exact size of each LZ4 stream, which EROFS doesn't record.
+  std::vector<size_t> compressed_offsets;
+  compressed_offsets.reserve(block_info.size());
   size_t compressed_offset = 0;
   for (const auto& block : block_info) {
-    std::string_view cluster =
-        blob.substr(compressed_offset, block.compressed_length);
-    if (!block.IsCompressed()) {
-      CHECK_NE(cluster.size(), 0UL);
-      output.insert(output.end(), cluster.begin(), cluster.end());
-      compressed_offset += cluster.size();
-      continue;
-    }
-    size_t inputmargin = 0;
-    if (zero_padding_enabled) {
-      while (inputmargin < std::min(kBlockSize, cluster.size()) &&
-             cluster[inputmargin] == 0) {
-        inputmargin++;
-      }
-    }
-    output.resize(output.size() + block.uncompressed_length);
-
-    const auto bytes_decompressed = LZ4_decompress_safe_partial(
-        cluster.data() + inputmargin,
-        reinterpret_cast<char*>(output.data()) + output.size() -
-            block.uncompressed_length,
-        cluster.size() - inputmargin,
-        block.uncompressed_length,
-        block.uncompressed_length);
-    if (bytes_decompressed < 0) {
-      LOG(FATAL) << "Failed to decompress, " << bytes_decompressed
-                 << ", output_cursor = "
-                 << output.size() - block.uncompressed_length
-                 << ", input_cursor = " << compressed_offset
-                 << ", blob.size() = " << blob.size()
-                 << ", cluster_size = " << block.compressed_length
-                 << ", dest capacity = " << block.uncompressed_length
-                 << ", input margin = " << inputmargin << " "
-                 << HashCalculator::SHA256Digest(cluster) << " "
-                 << HashCalculator::SHA256Digest(blob);
-      return {};
-    }
+    compressed_offsets.push_back(compressed_offset);
     compressed_offset += block.compressed_length;
-    CHECK_EQ(static_cast<uint64_t>(bytes_decompressed),
-             block.uncompressed_length);
+  }
+  const size_t max_threads = MaxBlockThreads();
+  std::vector<std::unique_ptr<BlockCompressor>> decompressors(max_threads);
+  Blob output(uncompressed_size);
+  const bool success = ForEachBlockOnThreads(
+      block_info.size(), max_threads, [&](size_t thread, size_t i) {
+        const auto& block = block_info[i];
+        std::string_view cluster =
+            blob.substr(compressed_offsets[i], block.compressed_length);
+        uint8_t* out = output.data() + block.uncompressed_offset;
+        if (!block.IsCompressed()) {
+          CHECK_NE(cluster.size(), 0UL);
+          CHECK_EQ(cluster.size(), block.uncompressed_length);
+          std::copy(cluster.begin(), cluster.end(), out);
+          return true;
+        }
+        auto& decompressor = decompressors[thread];
+        if (decompressor == nullptr) {
+          decompressor = CreateBlockCompressor(compression_algo);
+          TEST_AND_RETURN_FALSE(decompressor != nullptr);
+        }
+        const size_t inputmargin =
+            ZeroPaddingLength(cluster, zero_padding_enabled);
+        if (!decompressor->Decompress(
+                cluster.substr(inputmargin), out, block.uncompressed_length)) {
+          LOG(FATAL) << "Failed to decompress"
+                     << ", output_cursor = " << block.uncompressed_offset
+                     << ", input_cursor = " << compressed_offsets[i]
+                     << ", blob.size() = " << blob.size()
+                     << ", cluster_size = " << block.compressed_length
+                     << ", dest capacity = " << block.uncompressed_length
+                     << ", input margin = " << inputmargin << " "
+                     << HashCalculator::SHA256Digest(cluster) << " "
+                     << HashCalculator::SHA256Digest(blob);
+          return false;
+        }
+        return true;
+      });
+  if (!success) {
+    return {};
   }
   CHECK_EQ(output.size(), uncompressed_size);
 
@@ -228,9 +311,120 @@ Blob TryDecompressBlob(std::string_view blob,
 
 Blob TryDecompressBlob(const Blob& blob,
                        const std::vector<CompressedBlock>& block_info,
-                       const bool zero_padding_enabled) {
+                       const bool zero_padding_enabled,
+                       const CompressionAlgorithm& compression_algo) {
   return TryDecompressBlob(
-      ToStringView(blob), block_info, zero_padding_enabled);
+      ToStringView(blob), block_info, zero_padding_enabled, compression_algo);
+}
+
+std::unique_ptr<DecompressedBlobReader> DecompressedBlobReader::Create(
+    std::string_view blob,
+    std::vector<CompressedBlock> block_info,
+    bool zero_padding_enabled,
+    const CompressionAlgorithm& compression_algo) {
+  if (block_info.empty()) {
+    LOG(ERROR) << "No compressed blocks to read.";
+    return nullptr;
+  }
+  auto decompressor = CreateBlockCompressor(compression_algo);
+  if (decompressor == nullptr) {
+    return nullptr;
+  }
+  uint64_t uncompressed_size = 0;
+  uint64_t compressed_size = 0;
+  std::vector<uint64_t> compressed_offsets;
+  compressed_offsets.reserve(block_info.size());
+  for (const auto& block : block_info) {
+    if (block.uncompressed_offset != uncompressed_size ||
+        (!block.IsCompressed() &&
+         block.compressed_length != block.uncompressed_length)) {
+      LOG(ERROR) << "Unexpected compressed block " << block << " at offset "
+                 << uncompressed_size;
+      return nullptr;
+    }
+    compressed_offsets.push_back(compressed_size);
+    uncompressed_size += block.uncompressed_length;
+    compressed_size += block.compressed_length;
+  }
+  if (blob.size() != compressed_size) {
+    LOG(ERROR) << "Compressed blocks take " << compressed_size
+               << " bytes, data has " << blob.size() << " bytes.";
+    return nullptr;
+  }
+  return std::unique_ptr<DecompressedBlobReader>(
+      new DecompressedBlobReader(blob,
+                                 std::move(block_info),
+                                 std::move(compressed_offsets),
+                                 zero_padding_enabled,
+                                 std::move(decompressor)));
+}
+
+DecompressedBlobReader::DecompressedBlobReader(
+    std::string_view blob,
+    std::vector<CompressedBlock> block_info,
+    std::vector<uint64_t> compressed_offsets,
+    bool zero_padding_enabled,
+    std::unique_ptr<BlockCompressor> decompressor)
+    : blob_(blob),
+      block_info_(std::move(block_info)),
+      compressed_offsets_(std::move(compressed_offsets)),
+      zero_padding_enabled_(zero_padding_enabled),
+      decompressor_(std::move(decompressor)),
+      size_(block_info_.back().uncompressed_offset +
+            block_info_.back().uncompressed_length) {}
+
+bool DecompressedBlobReader::Read(uint64_t offset,
+                                  void* buffer,
+                                  size_t length) {
+  TEST_AND_RETURN_FALSE(offset <= size_ && length <= size_ - offset);
+  auto out = static_cast<uint8_t*>(buffer);
+  while (length > 0) {
+    // The last block starting at or before |offset|, which holds it as blocks
+    // are contiguous.
+    const auto it = std::upper_bound(
+        block_info_.begin(),
+        block_info_.end(),
+        offset,
+        [](uint64_t offset, const CompressedBlock& block) {
+          return offset < block.uncompressed_offset;
+        });
+    const size_t index = it - block_info_.begin() - 1;
+    TEST_AND_RETURN_FALSE(LoadBlock(index));
+    const uint64_t block_offset =
+        offset - block_info_[index].uncompressed_offset;
+    const size_t bytes =
+        std::min<uint64_t>(length, block_data_.size() - block_offset);
+    std::copy_n(block_data_.data() + block_offset, bytes, out);
+    out += bytes;
+    offset += bytes;
+    length -= bytes;
+  }
+  return true;
+}
+
+bool DecompressedBlobReader::LoadBlock(size_t index) {
+  if (index == loaded_block_) {
+    return true;
+  }
+  loaded_block_ = SIZE_MAX;
+  const auto& block = block_info_[index];
+  const auto cluster =
+      blob_.substr(compressed_offsets_[index], block.compressed_length);
+  block_data_.resize(block.uncompressed_length);
+  if (!block.IsCompressed()) {
+    std::copy(cluster.begin(), cluster.end(), block_data_.begin());
+  } else {
+    const size_t inputmargin =
+        ZeroPaddingLength(cluster, zero_padding_enabled_);
+    if (!decompressor_->Decompress(cluster.substr(inputmargin),
+                                   block_data_.data(),
+                                   block.uncompressed_length)) {
+      LOG(ERROR) << "Failed to decompress " << block;
+      return false;
+    }
+  }
+  loaded_block_ = index;
+  return true;
 }
 
 std::ostream& operator<<(std::ostream& out, const CompressedBlock& block) {
@@ -17,7 +17,11 @@
 #ifndef UPDATE_ENGINE_LZ4DIFF_LZ4DIFF_COMPRESS_H_
 #define UPDATE_ENGINE_LZ4DIFF_LZ4DIFF_COMPRESS_H_
 
+#include "block_compressor.h"
 #include "lz4diff_format.h"
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <string_view>
 
 namespace chromeos_update_engine {
@@ -43,12 +47,58 @@ bool TryCompressBlob(std::string_view blob,
                      const CompressionAlgorithm compression_algo,
                      const SinkFunc& sink);
 
-Blob TryDecompressBlob(std::string_view blob,
-                       const std::vector<CompressedBlock>& block_info,
-                       const bool zero_padding_enabled);
-Blob TryDecompressBlob(const Blob& blob,
-                       const std::vector<CompressedBlock>& block_info,
-                       const bool zero_padding_enabled);
+// The blocks compressed with |compression_algo|, LZ4 if UNCOMPRESSED.
+Blob TryDecompressBlob(
+    std::string_view blob,
+    const std::vector<CompressedBlock>& block_info,
+    const bool zero_padding_enabled,
+    const CompressionAlgorithm& compression_algo = CompressionAlgorithm());
+Blob TryDecompressBlob(
+    const Blob& blob,
+    const std::vector<CompressedBlock>& block_info,
+    const bool zero_padding_enabled,
+    const CompressionAlgorithm& compression_algo = CompressionAlgorithm());
+
+// Gives random access to the data |TryDecompressBlob| returns for |blob|,
+// decompressing the blocks as they are read. Only the last block read is kept
+// decompressed in memory, rather than the whole blob.
+class DecompressedBlobReader {
+ public:
+  // Returns nullptr if |blob| doesn't hold exactly the blocks of |block_info|.
+  // |blob| must outlive the reader.
+  static std::unique_ptr<DecompressedBlobReader> Create(
+      std::string_view blob,
+      std::vector<CompressedBlock> block_info,
+      bool zero_padding_enabled,
+      const CompressionAlgorithm& compression_algo = CompressionAlgorithm());
+
+  // Size of the decompressed data.
+  uint64_t size() const { return size_; }
+
+  // Reads |length| bytes of decompressed data at |offset| into |buffer|.
+  bool Read(uint64_t offset, void* buffer, size_t length);
+
+ private:
+  DecompressedBlobReader(std::string_view blob,
+                         std::vector<CompressedBlock> block_info,
+                         std::vector<uint64_t> compressed_offsets,
+                         bool zero_padding_enabled,
+                         std::unique_ptr<BlockCompressor> decompressor);
+
+  // Decompresses block |index| into |block_data_| if not already there.
+  bool LoadBlock(size_t index);
+
+  const std::string_view blob_;
+  const std::vector<CompressedBlock> block_info_;
+  // Offset in |blob_| of each block of |block_info_|.
+  const std::vector<uint64_t> compressed_offsets_;
+  const bool zero_padding_enabled_;
+  const std::unique_ptr<BlockCompressor> decompressor_;
+  const uint64_t size_;
+
+  size_t loaded_block_{SIZE_MAX};
+  Blob block_data_;
+};
 
 std::ostream& operator<<(std::ostream& out, const CompressedBlockInfo& info);
 
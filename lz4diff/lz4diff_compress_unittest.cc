@@ -29,6 +29,8 @@
 #include <gtest/gtest.h>
 #include <erofs/internal.h>
 #include <erofs/io.h>
+#include <lz4.h>
+#include <lz4hc.h>
 
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
@@ -111,6 +113,171 @@ TEST_F(Lz4diffCompressTest, ExtractElfBinary) {
   ASSERT_EQ(decompressed_blob, expected_blob);
 }
 
+// Many blocks, so that they are compressed on several threads and batches, are
+// expected to compress as when done one at a time.
+TEST_F(Lz4diffCompressTest, CompressMatchesSerialCompression) {
+  constexpr size_t kNumBlocks = 600;
+  constexpr size_t kUncompressedLength = 4 * kBlockSize;
+  string data;
+  for (size_t i = 0; data.size() < kNumBlocks * kUncompressedLength; i++) {
+    data += base::StringPrintf("line %zu of block %zu\n", i % 97, i / 300);
+  }
+  data.resize(kNumBlocks * kUncompressedLength);
+  vector<CompressedBlock> block_info;
+  for (size_t i = 0; i < kNumBlocks; i++) {
+    // Every 50th block is stored uncompressed.
+    block_info.emplace_back(i * kUncompressedLength,
+                            i % 50 ? kBlockSize : kUncompressedLength,
+                            kUncompressedLength);
+  }
+
+  LZ4_streamHC_t* hc = LZ4_createStreamHC();
+  ASSERT_NE(nullptr, hc);
+  DEFER {
+    LZ4_freeStreamHC(hc);
+  };
+  for (auto type : {CompressionAlgorithm::LZ4HC, CompressionAlgorithm::LZ4}) {
+    for (bool zero_padding : {false, true}) {
+      CompressionAlgorithm algo;
+      algo.set_type(type);
+      algo.set_level(9);
+      Blob expected;
+      for (const auto& block : block_info) {
+        auto remaining = std::string_view(data).substr(
+            block.uncompressed_offset, block.uncompressed_length);
+        if (!block.IsCompressed()) {
+          expected.insert(expected.end(), remaining.begin(), remaining.end());
+          continue;
+        }
+        Blob out(block.compressed_length);
+        int src_size = data.size() - block.uncompressed_offset;
+        int bytes_written =
+            type == CompressionAlgorithm::LZ4HC
+                ? LZ4_compress_HC_destSize(hc,
+                                           remaining.data(),
+                                           reinterpret_cast<char*>(out.data()),
+                                           &src_size,
+                                           out.size(),
+                                           algo.level())
+                : LZ4_compress_destSize(remaining.data(),
+                                        reinterpret_cast<char*>(out.data()),
+                                        &src_size,
+                                        out.size());
+        ASSERT_GT(bytes_written, 0);
+        if (zero_padding) {
+          std::rotate(out.begin(), out.begin() + bytes_written, out.end());
+        }
+        expected.insert(expected.end(), out.begin(), out.end());
+      }
+      EXPECT_EQ(expected, TryCompressBlob(data, block_info, zero_padding, algo))
+          << "algorithm " << type << ", zero padding " << zero_padding;
+    }
+  }
+}
+
+TEST_F(Lz4diffCompressTest, DecompressedBlobReaderMatchesDecompressBlob) {
+  constexpr size_t kNumBlocks = 64;
+  constexpr size_t kUncompressedLength = 4 * kBlockSize;
+  for (bool zero_padding : {false, true}) {
+    Blob blob;
+    vector<CompressedBlock> block_info;
+    for (size_t i = 0; i < kNumBlocks; i++) {
+      string data;
+      while (data.size() < kUncompressedLength) {
+        data += base::StringPrintf("block %zu, offset %zu\n", i, data.size());
+      }
+      data.resize(kUncompressedLength);
+      // Every 5th block is stored uncompressed.
+      if (i % 5 == 0) {
+        block_info.emplace_back(
+            i * kUncompressedLength, kUncompressedLength, kUncompressedLength);
+        blob.insert(blob.end(), data.begin(), data.end());
+        continue;
+      }
+      Blob cluster(kUncompressedLength);
+      const int bytes_written =
+          LZ4_compress_default(data.data(),
+                               reinterpret_cast<char*>(cluster.data()),
+                               data.size(),
+                               cluster.size());
+      ASSERT_GT(bytes_written, 0);
+      cluster.resize(utils::RoundUp<size_t>(bytes_written, kBlockSize));
+      ASSERT_LT(cluster.size(), kUncompressedLength);
+      if (zero_padding) {
+        std::rotate(
+            cluster.begin(), cluster.begin() + bytes_written, cluster.end());
+      }
+      block_info.emplace_back(
+          i * kUncompressedLength, cluster.size(), kUncompressedLength);
+      blob.insert(blob.end(), cluster.begin(), cluster.end());
+    }
+    const Blob expected = TryDecompressBlob(blob, block_info, zero_padding);
+    ASSERT_EQ(kNumBlocks * kUncompressedLength, expected.size());
+
+    auto reader = DecompressedBlobReader::Create(
+        ToStringView(blob), block_info, zero_padding);
+    ASSERT_NE(nullptr, reader);
+    EXPECT_EQ(expected.size(), reader->size());
+    // Reads within a block, across blocks, backwards and of everything.
+    for (auto [offset, length] : vector<std::pair<size_t, size_t>>{
+             {100, 200},
+             {kUncompressedLength - 10, 3 * kUncompressedLength},
+             {0, 1},
+             {expected.size() - 5, 5},
+             {0, expected.size()}}) {
+      Blob data(length);
+      ASSERT_TRUE(reader->Read(offset, data.data(), length));
+      EXPECT_EQ(Blob(expected.begin() + offset,
+                     expected.begin() + offset + length),
+                data);
+    }
+    Blob data(2);
+    EXPECT_FALSE(reader->Read(expected.size() - 1, data.data(), 2));
+
+    EXPECT_EQ(nullptr,
+              DecompressedBlobReader::Create(
+                  ToStringView(blob).substr(1), block_info, zero_padding));
+    EXPECT_EQ(nullptr,
+              DecompressedBlobReader::Create(ToStringView(blob), {}, false));
+  }
+}
+
+TEST_F(Lz4diffCompressTest, ZstdRoundTrip) {
+  constexpr size_t kNumBlocks = 32;
+  constexpr size_t kUncompressedLength = 4 * kBlockSize;
+  string data;
+  for (size_t i = 0; data.size() < kNumBlocks * kUncompressedLength; i++) {
+    data += base::StringPrintf("line %zu of block %zu\n", i % 97, i / 300);
+  }
+  data.resize(kNumBlocks * kUncompressedLength);
+  vector<CompressedBlock> block_info;
+  for (size_t i = 0; i < kNumBlocks; i++) {
+    // Every 8th block is stored uncompressed.
+    block_info.emplace_back(i * kUncompressedLength,
+                            i % 8 ? kBlockSize : kUncompressedLength,
+                            kUncompressedLength);
+  }
+  CompressionAlgorithm algo;
+  algo.set_type(CompressionAlgorithm::ZSTD);
+  algo.set_level(3);
+  for (bool zero_padding : {false, true}) {
+    const Blob blob = TryCompressBlob(data, block_info, zero_padding, algo);
+    ASSERT_EQ(kNumBlocks * kUncompressedLength -
+                  (kNumBlocks - kNumBlocks / 8) * 3 * kBlockSize,
+              blob.size());
+    const Blob decompressed =
+        TryDecompressBlob(blob, block_info, zero_padding, algo);
+    EXPECT_EQ(data, ToStringView(decompressed));
+
+    auto reader = DecompressedBlobReader::Create(
+        ToStringView(blob), block_info, zero_padding, algo);
+    ASSERT_NE(nullptr, reader);
+    Blob read(reader->size());
+    ASSERT_TRUE(reader->Read(0, read.data(), read.size()));
+    EXPECT_EQ(decompressed, read);
+  }
+}
+
 }  // namespace
 
 }  // namespace chromeos_update_engine
@@ -21,6 +21,7 @@
 #include <string>
 #include <vector>
 
+#include <base/files/scoped_temp_dir.h>
 #include <base/format_macros.h>
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
@@ -36,6 +37,7 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/lz4diff/lz4diff_compress.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_cache.h"
 #include "update_engine/payload_generator/erofs_filesystem.h"
 #include "update_engine/payload_generator/extent_utils.h"
 
@@ -103,6 +105,22 @@ TEST_F(Lz4diffTest, DiffElfBinary) {
   Blob patched_new_data;
   ASSERT_TRUE(Lz4Patch(old_data, diff_blob, &patched_new_data));
   ASSERT_EQ(patched_new_data, new_data);
+
+  // Postfix patches found in the memo or the cache give the same diff.
+  base::ScopedTempDir cache_dir;
+  ASSERT_TRUE(cache_dir.CreateUniqueTempDir());
+  DirectoryDiffCache cache(cache_dir.GetPath().value());
+  for (int i = 0; i < 2; i++) {
+    Blob cached_diff_blob;
+    ASSERT_TRUE(Lz4Diff(old_data,
+                        new_data,
+                        old_delta_generator.compressed_file_info,
+                        new_delta_generator.compressed_file_info,
+                        &cached_diff_blob,
+                        nullptr,
+                        &cache));
+    EXPECT_EQ(diff_blob, cached_diff_blob);
+  }
 }
 
 }  // namespace
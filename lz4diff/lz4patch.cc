@@ -21,6 +21,7 @@
 #include <fcntl.h>
 
 #include <algorithm>
+#include <memory>
 #include <string_view>
 
 #include <bsdiff/bspatch.h>
@@ -66,12 +67,16 @@ struct Lz4diffPatch {
 
 // Utility class to interact with puffin API. C++ does not have standard
 // Read/Write trait. So everybody invent their own file descriptor wrapper.
-class StringViewStream : public puffin::StreamInterface {
+// This one reads the decompressed source blob, one block at a time.
+class DecompressedBlobStream : public puffin::StreamInterface {
  public:
-  ~StringViewStream() override = default;
+  explicit DecompressedBlobStream(
+      std::unique_ptr<DecompressedBlobReader> reader)
+      : reader_(std::move(reader)) {}
+  ~DecompressedBlobStream() override = default;
 
   bool GetSize(uint64_t* size) const override {
-    *size = read_memory_.size();
+    *size = reader_->size();
     return true;
   }
 
@@ -82,17 +87,14 @@ class StringViewStream : public puffin::StreamInterface {
 
   bool Seek(uint64_t offset) override {
     TEST_AND_RETURN_FALSE(open_);
-    uint64_t size;
-    GetSize(&size);
-    TEST_AND_RETURN_FALSE(offset <= size);
+    TEST_AND_RETURN_FALSE(offset <= reader_->size());
     offset_ = offset;
     return true;
   }
 
   bool Read(void* buffer, size_t length) override {
     TEST_AND_RETURN_FALSE(open_);
-    TEST_AND_RETURN_FALSE(offset_ + length <= read_memory_.size());
-    memcpy(buffer, read_memory_.data() + offset_, length);
+    TEST_AND_RETURN_FALSE(reader_->Read(offset_, buffer, length));
     offset_ += length;
     return true;
   }
@@ -107,20 +109,65 @@ class StringViewStream : public puffin::StreamInterface {
     return true;
   }
 
-  constexpr StringViewStream(std::string_view read_memory)
-      : read_memory_(read_memory) {
-    CHECK(!read_memory.empty());
-  }
-
  private:
-  // The memory buffer for reading.
-  std::string_view read_memory_;
+  std::unique_ptr<DecompressedBlobReader> reader_;
 
   // The current offset.
   uint64_t offset_{};
   bool open_{true};
 };
 
+// The same for bsdiff, reading the decompressed source blob or appending to
+// the decompressed destination blob.
+class DecompressedBlobFile : public bsdiff::FileInterface {
+ public:
+  explicit DecompressedBlobFile(std::unique_ptr<DecompressedBlobReader> reader)
+      : reader_(std::move(reader)) {}
+  explicit DecompressedBlobFile(Blob* output) : output_(output) {}
+  ~DecompressedBlobFile() override = default;
+
+  bool Read(void* buf, size_t count, size_t* bytes_read) override {
+    TEST_AND_RETURN_FALSE(reader_ != nullptr);
+    count = std::min<uint64_t>(count, reader_->size() - offset_);
+    TEST_AND_RETURN_FALSE(reader_->Read(offset_, buf, count));
+    *bytes_read = count;
+    offset_ += count;
+    return true;
+  }
+
+  bool Write(const void* buf, size_t count, size_t* bytes_written) override {
+    TEST_AND_RETURN_FALSE(output_ != nullptr);
+    const auto data = static_cast<const uint8_t*>(buf);
+    output_->insert(output_->end(), data, data + count);
+    *bytes_written = count;
+    return true;
+  }
+
+  bool Seek(off_t pos) override {
+    TEST_AND_RETURN_FALSE(pos >= 0);
+    if (reader_ == nullptr) {
+      // Writes only append to the output.
+      TEST_AND_RETURN_FALSE(static_cast<uint64_t>(pos) == output_->size());
+      return true;
+    }
+    TEST_AND_RETURN_FALSE(static_cast<uint64_t>(pos) <= reader_->size());
+    offset_ = pos;
+    return true;
+  }
+
+  bool Close() override { return true; }
+
+  bool GetSize(uint64_t* size) override {
+    *size = reader_ ? reader_->size() : output_->size();
+    return true;
+  }
+
+ private:
+  std::unique_ptr<DecompressedBlobReader> reader_;
+  Blob* output_{nullptr};
+  uint64_t offset_{};
+};
+
 bool ParseLz4DifffPatch(std::string_view patch_data, Lz4diffPatch* output) {
   CHECK_NE(output, nullptr);
   if (!android::base::StartsWith(patch_data, kLz4diffMagic)) {
@@ -169,17 +216,36 @@ bool bspatch(std::string_view input_data,
   return err == 0;
 }
 
-bool puffpatch(std::string_view input_data,
+bool bspatch(std::unique_ptr<DecompressedBlobReader> input,
+             std::string_view patch_data,
+             Blob* output) {
+  CHECK_NE(output, nullptr);
+  output->clear();
+  CHECK_GT(patch_data.size(), 0UL);
+  std::unique_ptr<bsdiff::FileInterface> input_file =
+      std::make_unique<DecompressedBlobFile>(std::move(input));
+  std::unique_ptr<bsdiff::FileInterface> output_file =
+      std::make_unique<DecompressedBlobFile>(output);
+  int err =
+      bsdiff::bspatch(std::move(input_file),
+                      std::move(output_file),
+                      reinterpret_cast<const uint8_t*>(patch_data.data()),
+                      patch_data.size());
+  return err == 0;
+}
+
+bool puffpatch(std::unique_ptr<DecompressedBlobReader> input,
                std::string_view patch_data,
                Blob* output) {
   // Cache size has a big impact on speed of puffpatch, use a default of 5MB to
   // match update_engine behavior.
   static constexpr size_t kPuffPatchCacheSize = 5 * 1024 * 1024;
-  return puffin::PuffPatch(std::make_unique<StringViewStream>(input_data),
-                           puffin::MemoryStream::CreateForWrite(output),
-                           reinterpret_cast<const uint8_t*>(patch_data.data()),
-                           patch_data.size(),
-                           kPuffPatchCacheSize);
+  return puffin::PuffPatch(
+      std::make_unique<DecompressedBlobStream>(std::move(input)),
+      puffin::MemoryStream::CreateForWrite(output),
+      reinterpret_cast<const uint8_t*>(patch_data.data()),
+      patch_data.size(),
+      kPuffPatchCacheSize);
 }
 
 std::vector<CompressedBlock> ToCompressedBlockVec(
@@ -222,17 +288,17 @@ size_t GetDecompressedSize(
   return decompressed_size;
 }
 
-bool ApplyInnerPatch(Blob decompressed_src,
+bool ApplyInnerPatch(std::unique_ptr<DecompressedBlobReader> src,
                      const Lz4diffPatch& patch,
                      Blob* decompressed_dst) {
   switch (patch.pb_header.inner_type()) {
     case InnerPatchType::BSDIFF:
-      TEST_AND_RETURN_FALSE(bspatch(
-          ToStringView(decompressed_src), patch.inner_patch, decompressed_dst));
+      TEST_AND_RETURN_FALSE(
+          bspatch(std::move(src), patch.inner_patch, decompressed_dst));
       break;
     case InnerPatchType::PUFFDIFF:
-      TEST_AND_RETURN_FALSE(puffpatch(
-          ToStringView(decompressed_src), patch.inner_patch, decompressed_dst));
+      TEST_AND_RETURN_FALSE(
+          puffpatch(std::move(src), patch.inner_patch, decompressed_dst));
       break;
     default:
       LOG(ERROR) << "Unsupported patch type: " << patch.pb_header.inner_type();
@@ -246,17 +312,22 @@ bool ApplyInnerPatch(Blob decompressed_src,
 bool Lz4Patch(std::string_view src_data,
               const Lz4diffPatch& patch,
               const SinkFunc& sink) {
-  auto decompressed_src = TryDecompressBlob(
+  // The source is decompressed block by block as the inner patch reads it.
+  // The destination is recompressed from all of its decompressed data, as
+  // the compressor is given the rest of the data after each block.
+  auto src = DecompressedBlobReader::Create(
       src_data,
       ToCompressedBlockVec(patch.pb_header.src_info().block_info()),
-      patch.pb_header.src_info().zero_padding_enabled());
-  TEST_AND_RETURN_FALSE(!decompressed_src.empty());
+      patch.pb_header.src_info().zero_padding_enabled(),
+      patch.pb_header.src_info().algo());
+  TEST_AND_RETURN_FALSE(src != nullptr);
   Blob decompressed_dst;
   const auto decompressed_dst_size =
       GetDecompressedSize(patch.pb_header.dst_info().block_info());
   decompressed_dst.reserve(decompressed_dst_size);
 
-  ApplyInnerPatch(std::move(decompressed_src), patch, &decompressed_dst);
+  TEST_AND_RETURN_FALSE(
+      ApplyInnerPatch(std::move(src), patch, &decompressed_dst));
 
   if (!HasPosfixPatches(patch)) {
     return TryCompressBlob(
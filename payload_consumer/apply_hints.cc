@@ -0,0 +1,171 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/apply_hints.h"
+
+#include <algorithm>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/block_cache_file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using google::protobuf::RepeatedPtrField;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The source blocks read ahead, that the prefetch window is sized for.
+constexpr uint64_t kPrefetchWindowBytes = 16 * 1024 * 1024;
+
+}  // namespace
+
+uint64_t GetApplyMemory(const InstallOperation& operation, size_t block_size) {
+  const uint64_t src_size =
+      utils::BlocksInExtents(operation.src_extents()) * block_size;
+  const uint64_t dst_size =
+      utils::BlocksInExtents(operation.dst_extents()) * block_size;
+  switch (operation.type()) {
+    case InstallOperation::REPLACE:
+      return operation.data_length();
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+    case InstallOperation::REPLACE_ZSTD:
+      return operation.data_length() + dst_size;
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+      return 0;
+    case InstallOperation::SOURCE_COPY:
+      return src_size;
+    default:
+      // The diff operations hold their patch, source and target at once.
+      return operation.data_length() + src_size + dst_size;
+  }
+}
+
+void ComputeApplyHints(const RepeatedPtrField<InstallOperation>& operations,
+                       size_t block_size,
+                       uint64_t num_source_blocks,
+                       PartitionUpdate::ApplyHints* hints) {
+  hints->Clear();
+  uint64_t peak_apply_memory = 0;
+  for (const InstallOperation& operation : operations) {
+    peak_apply_memory =
+        std::max(peak_apply_memory, GetApplyMemory(operation, block_size));
+  }
+  hints->set_peak_apply_memory(peak_apply_memory);
+
+  // The same blocks as the source cache would find.
+  const vector<bool> reused_blocks = BlockCacheFileDescriptor::FindReusedBlocks(
+      operations, num_source_blocks);
+  for (uint64_t block = 0; block < reused_blocks.size(); block++) {
+    if (!reused_blocks[block])
+      continue;
+    const int num_extents = hints->reused_source_extents_size();
+    Extent* last = num_extents > 0
+                       ? hints->mutable_reused_source_extents(num_extents - 1)
+                       : nullptr;
+    if (last && last->start_block() + last->num_blocks() == block) {
+      last->set_num_blocks(last->num_blocks() + 1);
+    } else {
+      *hints->add_reused_source_extents() = ExtentForRange(block, 1);
+    }
+  }
+
+  // Like the pipeline, an operation without target extents conflicts with
+  // every other one.
+  ExtentRanges group_blocks;
+  uint32_t group_size = 0;
+  bool ends_group = false;
+  for (const InstallOperation& operation : operations) {
+    bool conflicts = ends_group || operation.dst_extents().empty();
+    for (const Extent& extent : operation.dst_extents()) {
+      conflicts = conflicts || group_blocks.OverlapsWithExtent(extent);
+    }
+    if (conflicts && group_size > 0) {
+      hints->add_concurrency_groups(group_size);
+      group_blocks = ExtentRanges();
+      group_size = 0;
+    }
+    group_size++;
+    for (const Extent& extent : operation.dst_extents()) {
+      group_blocks.AddExtent(extent);
+    }
+    ends_group = operation.dst_extents().empty();
+  }
+  if (group_size > 0)
+    hints->add_concurrency_groups(group_size);
+
+  // As many operations as read kPrefetchWindowBytes of source on average.
+  uint64_t num_source_ops = 0;
+  uint64_t source_bytes = 0;
+  for (const InstallOperation& operation : operations) {
+    if (operation.src_extents().empty())
+      continue;
+    num_source_ops++;
+    source_bytes +=
+        utils::BlocksInExtents(operation.src_extents()) * block_size;
+  }
+  if (num_source_ops > 0 && source_bytes > 0) {
+    const uint64_t window =
+        num_source_ops * kPrefetchWindowBytes / source_bytes;
+    hints->set_prefetch_window(
+        std::clamp<uint64_t>(window, 1, num_source_ops));
+  }
+}
+
+vector<bool> GetReusedSourceBlocks(const PartitionUpdate::ApplyHints& hints,
+                                   uint64_t num_blocks) {
+  if (hints.reused_source_extents().empty())
+    return {};
+  vector<bool> reused_blocks(num_blocks);
+  for (const Extent& extent : hints.reused_source_extents()) {
+    if (extent.start_block() >= num_blocks)
+      continue;
+    const uint64_t end_block =
+        std::min(extent.start_block() + extent.num_blocks(), num_blocks);
+    for (uint64_t block = extent.start_block(); block < end_block; block++) {
+      reused_blocks[block] = true;
+    }
+  }
+  return reused_blocks;
+}
+
+size_t GetPrefetchWindow(const PartitionUpdate& partition, size_t default_ops) {
+  const uint32_t window = partition.apply_hints().prefetch_window();
+  return window > 0 ? window : default_ops;
+}
+
+size_t GetApplyWorkersForMemory(const PartitionUpdate& partition,
+                                size_t max_workers,
+                                uint64_t memory_budget) {
+  const uint64_t peak_memory = partition.apply_hints().peak_apply_memory();
+  if (peak_memory == 0)
+    return max_workers;
+  return std::clamp<uint64_t>(memory_budget / peak_memory, 1, max_workers);
+}
+
+bool HasConcurrentOperations(const PartitionUpdate& partition) {
+  const auto& groups = partition.apply_hints().concurrency_groups();
+  return groups.empty() ||
+         std::any_of(groups.begin(), groups.end(), [](uint32_t group_size) {
+           return group_size > 1;
+         });
+}
+
+}  // namespace chromeos_update_engine
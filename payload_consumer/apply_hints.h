@@ -0,0 +1,69 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_APPLY_HINTS_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_APPLY_HINTS_H_
+
+#include <vector>
+
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+// PartitionUpdate.apply_hints tell the client what the generator knows about
+// applying the operations of a partition: how much memory they take, which
+// source blocks they read again, which of them may run concurrently and how
+// far ahead their source is worth reading. The generator computes them from
+// the operations, and the client falls back to its own settings without
+// them.
+
+namespace chromeos_update_engine {
+
+// Returns the memory in bytes applying |operation| takes at most, on blocks
+// of |block_size| bytes.
+uint64_t GetApplyMemory(const InstallOperation& operation, size_t block_size);
+
+// Fills |hints| for the |operations| of a partition, on blocks of
+// |block_size| bytes and with |num_source_blocks| blocks in the source
+// partition.
+void ComputeApplyHints(
+    const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+    size_t block_size,
+    uint64_t num_source_blocks,
+    PartitionUpdate::ApplyHints* hints);
+
+// Returns whether each of the first |num_blocks| blocks is in the hinted
+// reused_source_extents of |hints|, or an empty vector without such hints.
+std::vector<bool> GetReusedSourceBlocks(
+    const PartitionUpdate::ApplyHints& hints, uint64_t num_blocks);
+
+// Returns the number of operations of |partition| to read the source of
+// ahead, |default_ops| without a hint.
+size_t GetPrefetchWindow(const PartitionUpdate& partition, size_t default_ops);
+
+// Returns how many of |max_workers| may apply operations of |partition| at
+// once with at most |memory_budget| bytes for them, at least one.
+size_t GetApplyWorkersForMemory(const PartitionUpdate& partition,
+                                size_t max_workers,
+                                uint64_t memory_budget);
+
+// Returns whether some of the operations of |partition| may be applied
+// concurrently, which is assumed without hints.
+bool HasConcurrentOperations(const PartitionUpdate& partition);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_APPLY_HINTS_H_
@@ -0,0 +1,125 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/apply_hints.h"
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using google::protobuf::RepeatedPtrField;
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kBlockSize = 4096;
+
+InstallOperation MakeOperation(InstallOperation::Type type,
+                               std::vector<Extent> src_extents,
+                               std::vector<Extent> dst_extents,
+                               uint64_t data_length = 0) {
+  InstallOperation operation;
+  operation.set_type(type);
+  StoreExtents(src_extents, operation.mutable_src_extents());
+  StoreExtents(dst_extents, operation.mutable_dst_extents());
+  if (data_length > 0)
+    operation.set_data_length(data_length);
+  return operation;
+}
+}  // namespace
+
+class ApplyHintsTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    *operations_.Add() = MakeOperation(InstallOperation::SOURCE_COPY,
+                                       {ExtentForRange(0, 4)},
+                                       {ExtentForRange(10, 4)});
+    *operations_.Add() = MakeOperation(InstallOperation::SOURCE_BSDIFF,
+                                       {ExtentForRange(2, 4)},
+                                       {ExtentForRange(20, 2)},
+                                       100);
+    // Overlaps the target of the first operation.
+    *operations_.Add() = MakeOperation(
+        InstallOperation::REPLACE, {}, {ExtentForRange(12, 2)}, 500);
+    *operations_.Add() =
+        MakeOperation(InstallOperation::ZERO, {}, {ExtentForRange(30, 1)});
+  }
+
+  RepeatedPtrField<InstallOperation> operations_;
+};
+
+TEST_F(ApplyHintsTest, GetApplyMemoryTest) {
+  EXPECT_EQ(4 * kBlockSize, GetApplyMemory(operations_[0], kBlockSize));
+  EXPECT_EQ(100 + 6 * kBlockSize, GetApplyMemory(operations_[1], kBlockSize));
+  EXPECT_EQ(500u, GetApplyMemory(operations_[2], kBlockSize));
+  EXPECT_EQ(0u, GetApplyMemory(operations_[3], kBlockSize));
+}
+
+TEST_F(ApplyHintsTest, ComputeApplyHintsTest) {
+  PartitionUpdate partition;
+  ComputeApplyHints(
+      operations_, kBlockSize, 16, partition.mutable_apply_hints());
+  const PartitionUpdate::ApplyHints& hints = partition.apply_hints();
+  EXPECT_EQ(100 + 6 * kBlockSize, hints.peak_apply_memory());
+  ASSERT_EQ(1, hints.reused_source_extents_size());
+  EXPECT_EQ(ExtentForRange(2, 2), hints.reused_source_extents(0));
+  ASSERT_EQ(2, hints.concurrency_groups_size());
+  EXPECT_EQ(2u, hints.concurrency_groups(0));
+  EXPECT_EQ(2u, hints.concurrency_groups(1));
+  // Both source operations read far less than the prefetch window.
+  EXPECT_EQ(2u, hints.prefetch_window());
+
+  const std::vector<bool> reused_blocks = GetReusedSourceBlocks(hints, 16);
+  ASSERT_EQ(16u, reused_blocks.size());
+  for (uint64_t block = 0; block < reused_blocks.size(); block++) {
+    EXPECT_EQ(block == 2 || block == 3, reused_blocks[block]) << block;
+  }
+  EXPECT_TRUE(HasConcurrentOperations(partition));
+  EXPECT_EQ(2u, GetPrefetchWindow(partition, 8));
+}
+
+TEST_F(ApplyHintsTest, OperationsWithoutTargetTest) {
+  RepeatedPtrField<InstallOperation> operations;
+  *operations.Add() = MakeOperation(InstallOperation::REPLACE, {}, {}, 10);
+  *operations.Add() = MakeOperation(
+      InstallOperation::REPLACE, {}, {ExtentForRange(0, 1)}, 10);
+  PartitionUpdate partition;
+  ComputeApplyHints(operations, kBlockSize, 0, partition.mutable_apply_hints());
+  ASSERT_EQ(2, partition.apply_hints().concurrency_groups_size());
+  EXPECT_FALSE(HasConcurrentOperations(partition));
+  EXPECT_FALSE(partition.apply_hints().has_prefetch_window());
+}
+
+TEST_F(ApplyHintsTest, WithoutHintsTest) {
+  PartitionUpdate partition;
+  EXPECT_TRUE(GetReusedSourceBlocks(partition.apply_hints(), 16).empty());
+  EXPECT_EQ(8u, GetPrefetchWindow(partition, 8));
+  EXPECT_EQ(4u, GetApplyWorkersForMemory(partition, 4, 1024));
+  EXPECT_TRUE(HasConcurrentOperations(partition));
+}
+
+TEST_F(ApplyHintsTest, GetApplyWorkersForMemoryTest) {
+  PartitionUpdate partition;
+  partition.mutable_apply_hints()->set_peak_apply_memory(1024);
+  EXPECT_EQ(3u, GetApplyWorkersForMemory(partition, 4, 3 * 1024));
+  EXPECT_EQ(4u, GetApplyWorkersForMemory(partition, 4, 64 * 1024));
+  EXPECT_EQ(1u, GetApplyWorkersForMemory(partition, 4, 100));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,193 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/async_cow_writer.h"
+
+#include <vector>
+
+#include <base/logging.h>
+
+#include "update_engine/common/trace.h"
+
+using android::snapshot::CowSizeInfo;
+using android::snapshot::ICowReader;
+using android::snapshot::ICowWriter;
+
+namespace chromeos_update_engine {
+
+AsyncCowWriter::AsyncCowWriter(std::unique_ptr<ICowWriter> cow_writer,
+                               size_t max_queued_bytes)
+    : cow_writer_(std::move(cow_writer)),
+      max_queued_bytes_(max_queued_bytes),
+      thread_(&AsyncCowWriter::WorkLoop, this) {}
+
+AsyncCowWriter::~AsyncCowWriter() {
+  LOG_IF(ERROR, !Drain()) << "Failed to write to the COW image";
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  thread_.join();
+}
+
+bool AsyncCowWriter::AddCopy(uint64_t new_block,
+                             uint64_t old_block,
+                             uint64_t num_blocks) {
+  return Queue(0, [new_block, old_block, num_blocks](ICowWriter* writer) {
+    return writer->AddCopy(new_block, old_block, num_blocks);
+  });
+}
+
+bool AsyncCowWriter::AddRawBlocks(uint64_t new_block_start,
+                                  const void* data,
+                                  size_t size) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  return Queue(size,
+               [new_block_start, blocks = std::vector<uint8_t>(
+                                     bytes, bytes + size)](ICowWriter* writer) {
+                 return writer->AddRawBlocks(
+                     new_block_start, blocks.data(), blocks.size());
+               });
+}
+
+bool AsyncCowWriter::AddXorBlocks(uint32_t new_block_start,
+                                  const void* data,
+                                  size_t size,
+                                  uint32_t old_block,
+                                  uint16_t offset) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  return Queue(size,
+               [new_block_start,
+                blocks = std::vector<uint8_t>(bytes, bytes + size),
+                old_block,
+                offset](ICowWriter* writer) {
+                 return writer->AddXorBlocks(new_block_start,
+                                             blocks.data(),
+                                             blocks.size(),
+                                             old_block,
+                                             offset);
+               });
+}
+
+bool AsyncCowWriter::AddZeroBlocks(uint64_t new_block_start,
+                                   uint64_t num_blocks) {
+  return Queue(0, [new_block_start, num_blocks](ICowWriter* writer) {
+    return writer->AddZeroBlocks(new_block_start, num_blocks);
+  });
+}
+
+bool AsyncCowWriter::AddLabel(uint64_t label) {
+  return Drain() && cow_writer_->AddLabel(label);
+}
+
+bool AsyncCowWriter::AddSequenceData(size_t num_ops, const uint32_t* data) {
+  return Queue(num_ops * sizeof(uint32_t),
+               [ops = std::vector<uint32_t>(data, data + num_ops)](
+                   ICowWriter* writer) {
+                 return writer->AddSequenceData(ops.size(), ops.data());
+               });
+}
+
+bool AsyncCowWriter::Finalize() {
+  return Drain() && cow_writer_->Finalize();
+}
+
+uint32_t AsyncCowWriter::GetBlockSize() const {
+  return cow_writer_->GetBlockSize();
+}
+
+std::optional<uint32_t> AsyncCowWriter::GetMaxBlocks() const {
+  return cow_writer_->GetMaxBlocks();
+}
+
+std::unique_ptr<ICowReader> AsyncCowWriter::OpenReader() {
+  if (!Drain()) {
+    return nullptr;
+  }
+  return cow_writer_->OpenReader();
+}
+
+std::unique_ptr<FileDescriptor> AsyncCowWriter::OpenFileDescriptor(
+    const std::optional<std::string>& source_device) {
+  if (!Drain()) {
+    return nullptr;
+  }
+  return cow_writer_->OpenFileDescriptor(source_device);
+}
+
+CowSizeInfo AsyncCowWriter::GetCowSizeInfo() const {
+  Drain();
+  return cow_writer_->GetCowSizeInfo();
+}
+
+bool AsyncCowWriter::Queue(size_t size, Call call) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    // A call larger than the whole queue still goes once the queue is empty.
+    cond_.wait(lock, [this, size] {
+      return failed_ || queued_bytes_ == 0 ||
+             queued_bytes_ + size <= max_queued_bytes_;
+    });
+    if (failed_) {
+      return false;
+    }
+    queue_.emplace_back(size, std::move(call));
+    queued_bytes_ += size;
+    UE_TRACE_COUNTER("cow_queued_bytes", queued_bytes_);
+  }
+  cond_.notify_all();
+  return true;
+}
+
+bool AsyncCowWriter::Drain() const {
+  UE_TRACE_SCOPE("cow_drain");
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this] { return queue_.empty() && !busy_; });
+  return !failed_;
+}
+
+void AsyncCowWriter::WorkLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cond_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return;
+    }
+    auto [size, call] = std::move(queue_.front());
+    queue_.pop_front();
+    // Once a call failed, the ones queued after it are dropped.
+    const bool run = !failed_;
+    busy_ = true;
+    lock.unlock();
+    bool success = true;
+    if (run) {
+      UE_TRACE_SCOPE("cow_write");
+      success = call(cow_writer_.get());
+    }
+    lock.lock();
+    busy_ = false;
+    queued_bytes_ -= size;
+    UE_TRACE_COUNTER("cow_queued_bytes", queued_bytes_);
+    if (!success) {
+      LOG(ERROR) << "Failed to write to the COW image";
+      failed_ = true;
+    }
+    cond_.notify_all();
+  }
+}
+
+}  // namespace chromeos_update_engine
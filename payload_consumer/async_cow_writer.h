@@ -0,0 +1,109 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_COW_WRITER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_COW_WRITER_H_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <base/macros.h>
+#include <libsnapshot/cow_writer.h>
+
+namespace chromeos_update_engine {
+
+// An ICowWriter which hands the blocks written to it over to another
+// ICowWriter on a worker thread, so that compressing them into the COW image
+// overlaps with applying the next install operations instead of holding them
+// up. The wrapped writer sees the exact same sequence of calls, in the same
+// order, as it would without this class, so the COW image is byte for byte
+// the same.
+//
+// The data of queued calls is copied, up to |max_queued_bytes| of it; further
+// calls block until the worker catches up. A call failing on the worker is
+// reported by the next call made, and every call after it fails. AddLabel(),
+// Finalize() and the calls reading the COW image first wait for all queued
+// calls to complete, so a label is only added, and a checkpoint only taken,
+// once everything written before it is in the COW image.
+class AsyncCowWriter final : public android::snapshot::ICowWriter {
+ public:
+  AsyncCowWriter(std::unique_ptr<android::snapshot::ICowWriter> cow_writer,
+                 size_t max_queued_bytes);
+  ~AsyncCowWriter() override;
+
+  bool AddCopy(uint64_t new_block,
+               uint64_t old_block,
+               uint64_t num_blocks) override;
+  bool AddRawBlocks(uint64_t new_block_start,
+                    const void* data,
+                    size_t size) override;
+  bool AddXorBlocks(uint32_t new_block_start,
+                    const void* data,
+                    size_t size,
+                    uint32_t old_block,
+                    uint16_t offset) override;
+  bool AddZeroBlocks(uint64_t new_block_start, uint64_t num_blocks) override;
+  bool AddLabel(uint64_t label) override;
+  bool AddSequenceData(size_t num_ops, const uint32_t* data) override;
+  bool Finalize() override;
+
+  uint32_t GetBlockSize() const override;
+  std::optional<uint32_t> GetMaxBlocks() const override;
+  std::unique_ptr<android::snapshot::ICowReader> OpenReader() override;
+  std::unique_ptr<FileDescriptor> OpenFileDescriptor(
+      const std::optional<std::string>& source_device) override;
+  android::snapshot::CowSizeInfo GetCowSizeInfo() const override;
+
+ private:
+  using Call = std::function<bool(android::snapshot::ICowWriter*)>;
+
+  // Queues |call|, which holds |size| bytes of data, blocking while the queue
+  // is full. Returns false if an earlier call failed.
+  bool Queue(size_t size, Call call);
+
+  // Blocks until every queued call completed. Returns false if one failed.
+  bool Drain() const;
+
+  void WorkLoop();
+
+  std::unique_ptr<android::snapshot::ICowWriter> cow_writer_;
+  const size_t max_queued_bytes_;
+
+  mutable std::mutex mutex_;
+  mutable std::condition_variable cond_;
+  std::deque<std::pair<size_t, Call>> queue_;
+  // Bytes of data held by |queue_| and the call running, if any.
+  size_t queued_bytes_{0};
+  bool busy_{false};
+  bool failed_{false};
+  bool stopping_{false};
+
+  std::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncCowWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_COW_WRITER_H_
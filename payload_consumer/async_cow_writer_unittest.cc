@@ -0,0 +1,83 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/async_cow_writer.h"
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <libsnapshot/mock_cow_writer.h>
+
+using android::snapshot::MockCowWriter;
+using testing::_;
+using testing::InSequence;
+using testing::Invoke;
+using testing::Return;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+}  // namespace
+
+// The wrapped writer gets the same calls in the same order, with the data as
+// it was when each call was made.
+TEST(AsyncCowWriterTest, ForwardsCallsInOrderTest) {
+  auto cow_writer = std::make_unique<MockCowWriter>();
+  std::vector<uint8_t> written;
+  {
+    InSequence seq;
+    EXPECT_CALL(*cow_writer, AddCopy(10, 20, 2)).WillOnce(Return(true));
+    EXPECT_CALL(*cow_writer, AddRawBlocks(0, _, kBlockSize))
+        .WillOnce(Invoke([&written](uint64_t, const void* data, size_t size) {
+          const uint8_t* bytes = static_cast<const uint8_t*>(data);
+          written.assign(bytes, bytes + size);
+          return true;
+        }));
+    EXPECT_CALL(*cow_writer, AddZeroBlocks(5, 3)).WillOnce(Return(true));
+    EXPECT_CALL(*cow_writer, AddLabel(1)).WillOnce(Return(true));
+    EXPECT_CALL(*cow_writer, Finalize()).WillOnce(Return(true));
+  }
+
+  AsyncCowWriter writer(std::move(cow_writer), 2 * kBlockSize);
+  std::vector<uint8_t> block(kBlockSize, 0x11);
+  EXPECT_TRUE(writer.AddCopy(10, 20, 2));
+  EXPECT_TRUE(writer.AddRawBlocks(0, block.data(), block.size()));
+  // The caller may reuse its buffer right away.
+  std::fill(block.begin(), block.end(), 0x22);
+  EXPECT_TRUE(writer.AddZeroBlocks(5, 3));
+  EXPECT_TRUE(writer.AddLabel(1));
+  EXPECT_EQ(std::vector<uint8_t>(kBlockSize, 0x11), written);
+  EXPECT_TRUE(writer.Finalize());
+}
+
+// A failing call fails the calls made after it, and the ones queued after it
+// never reach the wrapped writer.
+TEST(AsyncCowWriterTest, FailureTest) {
+  auto cow_writer = std::make_unique<MockCowWriter>();
+  EXPECT_CALL(*cow_writer, AddZeroBlocks(0, 1)).WillOnce(Return(false));
+  EXPECT_CALL(*cow_writer, AddLabel(_)).Times(0);
+
+  AsyncCowWriter writer(std::move(cow_writer), kBlockSize);
+  EXPECT_TRUE(writer.AddZeroBlocks(0, 1));
+  EXPECT_FALSE(writer.AddLabel(1));
+  EXPECT_FALSE(writer.AddZeroBlocks(1, 1));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,144 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/async_io_uring.h"
+
+#include <errno.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <base/bind.h>
+#include <base/location.h>
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+namespace chromeos_update_engine {
+
+std::unique_ptr<AsyncIoUring> AsyncIoUring::Create(unsigned queue_depth) {
+  auto ring =
+      io_uring_cpp::IoUringInterface::CreateLinuxIoUring(queue_depth, 0);
+  if (!ring) {
+    PLOG(WARNING) << "Unable to set up io_uring";
+    return nullptr;
+  }
+  android::base::unique_fd event_fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  if (event_fd < 0) {
+    PLOG(ERROR) << "Unable to create an eventfd";
+    return nullptr;
+  }
+  const auto err = ring->RegisterEventFd(event_fd.get());
+  if (!err.IsOk()) {
+    LOG(ERROR) << "Unable to register an eventfd with io_uring: " << err;
+    return nullptr;
+  }
+  return std::unique_ptr<AsyncIoUring>(
+      new AsyncIoUring(std::move(ring), std::move(event_fd)));
+}
+
+AsyncIoUring::AsyncIoUring(
+    std::unique_ptr<io_uring_cpp::IoUringInterface> ring,
+    android::base::unique_fd event_fd)
+    : ring_(std::move(ring)), event_fd_(std::move(event_fd)) {
+  watcher_ = base::FileDescriptorWatcher::WatchReadable(
+      event_fd_.get(),
+      base::BindRepeating(&AsyncIoUring::OnEventFdReadable,
+                          base::Unretained(this)));
+}
+
+AsyncIoUring::~AsyncIoUring() {
+  watcher_.reset();
+  // The operations never submitted go away with the ring.
+  while (running_operations_ > 0) {
+    const auto cqe = ring_->PopCQE();
+    if (cqe.IsErr()) {
+      LOG(ERROR) << "Failed to wait for io_uring completions: "
+                 << cqe.GetError();
+      break;
+    }
+    running_operations_--;
+  }
+}
+
+bool AsyncIoUring::Queue(io_uring_cpp::IoUringSQE sqe,
+                         CompletionCallback callback) {
+  if (!sqe.IsOk()) {
+    return false;
+  }
+  const uint64_t user_data = next_user_data_++;
+  sqe.SetData(user_data);
+  callbacks_.emplace(user_data, std::move(callback));
+  if (!submit_task_.IsScheduled()) {
+    // Whatever else is queued during this turn of the loop goes along.
+    ignore_result(submit_task_.PostTask(FROM_HERE, [this] { Submit(); }));
+  }
+  return true;
+}
+
+bool AsyncIoUring::Submit() {
+  size_t queued = ring_->SQEReady();
+  while (queued > 0) {
+    const auto result = ring_->Submit();
+    if (result.ErrCode() < 0 || result.EntriesSubmitted() == 0) {
+      errno = result.ErrCode() < 0 ? -result.ErrCode() : EAGAIN;
+      PLOG(ERROR) << "Failed to submit " << queued << " io_uring operations";
+      return false;
+    }
+    const size_t submitted = result.EntriesSubmitted();
+    running_operations_ += submitted;
+    queued -= std::min(queued, submitted);
+  }
+  return true;
+}
+
+void AsyncIoUring::OnEventFdReadable() {
+  // Resets the eventfd. Completions posted from now on signal it again.
+  uint64_t count = 0;
+  if (HANDLE_EINTR(read(event_fd_.get(), &count, sizeof(count))) < 0 &&
+      errno != EAGAIN) {
+    PLOG(WARNING) << "Unable to read the io_uring eventfd";
+  }
+
+  std::vector<std::pair<CompletionCallback, int>> completed;
+  while (running_operations_ > 0 && ring_->PeekCQE().IsOk()) {
+    // Doesn't wait, as a completion is ready.
+    const auto cqe = ring_->PopCQE();
+    if (cqe.IsErr()) {
+      LOG(ERROR) << "Failed to get an io_uring completion: " << cqe.GetError();
+      break;
+    }
+    running_operations_--;
+    const auto& result = cqe.GetResult();
+    auto it = callbacks_.find(result.GetData<uint64_t>());
+    if (it == callbacks_.end()) {
+      LOG(ERROR) << "Completion of an unknown io_uring operation";
+      continue;
+    }
+    completed.emplace_back(std::move(it->second), result.res);
+    callbacks_.erase(it);
+  }
+
+  // The callbacks may queue more operations, or destroy this object, so
+  // nothing else is done once they start.
+  for (auto& [callback, res] : completed) {
+    std::move(callback).Run(res);
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,95 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_IO_URING_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_IO_URING_H_
+
+#include <map>
+#include <memory>
+
+#include <android-base/unique_fd.h>
+#include <base/callback.h>
+#include <base/files/file_descriptor_watcher_posix.h>
+#include <base/macros.h>
+#include <liburing_cpp/IoUring.h>
+
+#include "update_engine/common/scoped_task_id.h"
+
+namespace chromeos_update_engine {
+
+// An io_uring whose operations complete on the message loop: an eventfd
+// registered with the ring is watched like any other file descriptor, and
+// the callback of each operation is called with its result once it
+// completes, so that deep queues of I/O don't block the loop.
+//
+// The operations queued during a turn of the loop are submitted together on
+// the next one, or by Submit().
+class AsyncIoUring {
+ public:
+  // Called with the result of the operation: the number of bytes
+  // transferred, or a negative errno.
+  using CompletionCallback = base::OnceCallback<void(int res)>;
+
+  // Returns nullptr if io_uring isn't available. Must be called on the
+  // message loop the callbacks are called on.
+  static std::unique_ptr<AsyncIoUring> Create(unsigned queue_depth);
+
+  // Waits for the operations still running, as the kernel may still be using
+  // their buffers, without calling their callbacks.
+  ~AsyncIoUring();
+
+  // The ring to prepare the operations with, before passing their SQE to
+  // Queue(). SQE user data is used by this class and must not be set.
+  io_uring_cpp::IoUringInterface* ring() { return ring_.get(); }
+
+  // Queues the operation of |sqe| to be submitted, with the |callback| to
+  // call once it completes. Returns false if |sqe| isn't valid, which is
+  // the case when the submission queue is full: Submit() the queued
+  // operations to make room before trying again.
+  bool Queue(io_uring_cpp::IoUringSQE sqe, CompletionCallback callback);
+
+  // Submits the queued operations now. Returns false on failure, leaving
+  // the operations not submitted queued.
+  bool Submit();
+
+  // The number of operations queued or running.
+  size_t pending_operations() const { return callbacks_.size(); }
+
+ private:
+  AsyncIoUring(std::unique_ptr<io_uring_cpp::IoUringInterface> ring,
+               android::base::unique_fd event_fd);
+
+  // Calls the callbacks of the completed operations.
+  void OnEventFdReadable();
+
+  std::unique_ptr<io_uring_cpp::IoUringInterface> ring_;
+  android::base::unique_fd event_fd_;
+  std::unique_ptr<base::FileDescriptorWatcher::Controller> watcher_;
+
+  // The callbacks of the operations queued or running, by SQE user data.
+  std::map<uint64_t, CompletionCallback> callbacks_;
+  uint64_t next_user_data_{0};
+
+  // The number of operations submitted and not completed yet.
+  size_t running_operations_{0};
+  ScopedTaskId submit_task_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncIoUring);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_ASYNC_IO_URING_H_
@@ -0,0 +1,163 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/async_io_uring.h"
+
+#include <fcntl.h>
+
+#include <vector>
+
+#include <android-base/unique_fd.h>
+#include <base/bind.h>
+#if BASE_VER < 780000  // Android
+#include <base/message_loop/message_loop.h>
+#endif  // BASE_VER < 780000
+#if BASE_VER >= 780000  // Chrome OS
+#include <base/task/single_thread_task_executor.h>
+#endif  // BASE_VER >= 780000
+#include <brillo/message_loops/base_message_loop.h>
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using brillo::MessageLoop;
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kNumBlocks = 16;
+}  // namespace
+
+class AsyncIoUringTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    data_.resize(kBlockSize * kNumBlocks);
+    test_utils::FillWithData(&data_);
+    ASSERT_TRUE(test_utils::WriteFileVector(temp_file_.path(), data_));
+    fd_.reset(open(temp_file_.path().c_str(), O_RDONLY | O_CLOEXEC));
+    ASSERT_GE(fd_, 0);
+    ring_ = AsyncIoUring::Create(8);
+    if (!ring_) {
+      GTEST_SKIP() << "io_uring isn't supported by the kernel";
+    }
+  }
+
+  // Queues the read of the |block|-th block of the file into |out|, calling
+  // |done| once it completed.
+  bool QueueRead(size_t block,
+                 brillo::Blob* out,
+                 AsyncIoUring::CompletionCallback done) {
+    out->resize(kBlockSize);
+    return ring_->Queue(
+        ring_->ring()->PrepRead(
+            fd_.get(), out->data(), kBlockSize, block * kBlockSize),
+        std::move(done));
+  }
+
+  brillo::Blob Block(size_t block) const {
+    return brillo::Blob(data_.begin() + block * kBlockSize,
+                        data_.begin() + (block + 1) * kBlockSize);
+  }
+
+#if BASE_VER < 780000  // Android
+  base::MessageLoopForIO base_loop_;
+  brillo::BaseMessageLoop loop_{&base_loop_};
+#else   // Chrome OS
+  base::SingleThreadTaskExecutor base_loop_{base::MessagePumpType::IO};
+  brillo::BaseMessageLoop loop_{base_loop_.task_runner()};
+#endif  // BASE_VER < 780000
+  brillo::Blob data_;
+  ScopedTempFile temp_file_{"AsyncIoUring-file.XXXXXX"};
+  android::base::unique_fd fd_;
+  std::unique_ptr<AsyncIoUring> ring_;
+};
+
+TEST_F(AsyncIoUringTest, ReadsCompleteOnLoopTest) {
+  std::vector<brillo::Blob> out(3);
+  std::vector<int> results;
+  const size_t blocks[] = {5, 0, 11};
+  for (size_t i = 0; i < 3; i++) {
+    ASSERT_TRUE(QueueRead(blocks[i],
+                          &out[i],
+                          base::BindOnce(
+                              [](std::vector<int>* results, int res) {
+                                results->push_back(res);
+                                if (results->size() == 3)
+                                  MessageLoop::current()->BreakLoop();
+                              },
+                              &results)));
+  }
+  EXPECT_EQ(3u, ring_->pending_operations());
+  // Nothing completes before the loop runs.
+  EXPECT_TRUE(results.empty());
+  loop_.Run();
+
+  EXPECT_EQ(std::vector<int>(3, static_cast<int>(kBlockSize)), results);
+  EXPECT_EQ(0u, ring_->pending_operations());
+  for (size_t i = 0; i < 3; i++) {
+    EXPECT_EQ(Block(blocks[i]), out[i]);
+  }
+}
+
+TEST_F(AsyncIoUringTest, CallbackQueuesMoreTest) {
+  // Reads the blocks one after the other, each from the callback of the
+  // previous one.
+  brillo::Blob out;
+  brillo::Blob read_data;
+  size_t next_block = 0;
+  base::RepeatingCallback<void(int)> on_read;
+  on_read = base::BindRepeating(
+      [](AsyncIoUringTest* test,
+         brillo::Blob* out,
+         brillo::Blob* read_data,
+         size_t* next_block,
+         base::RepeatingCallback<void(int)>* on_read,
+         int res) {
+        ASSERT_EQ(static_cast<int>(kBlockSize), res);
+        read_data->insert(read_data->end(), out->begin(), out->end());
+        if (++*next_block == kNumBlocks) {
+          MessageLoop::current()->BreakLoop();
+          return;
+        }
+        ASSERT_TRUE(test->QueueRead(*next_block, out, *on_read));
+      },
+      this,
+      &out,
+      &read_data,
+      &next_block,
+      &on_read);
+  ASSERT_TRUE(QueueRead(0, &out, on_read));
+  loop_.Run();
+  EXPECT_EQ(data_, read_data);
+}
+
+TEST_F(AsyncIoUringTest, DestroyWithRunningOperationsTest) {
+  brillo::Blob out;
+  bool called = false;
+  ASSERT_TRUE(QueueRead(
+      3,
+      &out,
+      base::BindOnce([](bool* called, int res) { *called = true; }, &called)));
+  ASSERT_TRUE(ring_->Submit());
+  ring_.reset();
+  EXPECT_FALSE(called);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,311 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/block_cache_file_descriptor.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+namespace chromeos_update_engine {
+
+BlockCacheFileDescriptor::BlockCacheFileDescriptor(FileDescriptorPtr fd,
+                                                   size_t block_size,
+                                                   size_t cache_size)
+    : fd_(std::move(fd)),
+      block_size_(block_size),
+      capacity_(cache_size / block_size),
+      hot_capacity_(capacity_ * 3 / 4) {}
+
+BlockCacheFileDescriptor::~BlockCacheFileDescriptor() {
+  if (hits_ + misses_ > 0) {
+    LOG(INFO) << "Source block cache: " << hits_ << " hits, " << misses_
+              << " misses";
+  }
+}
+
+bool BlockCacheFileDescriptor::Open(const char* path, int flags, mode_t mode) {
+  offset_ = 0;
+  return fd_->Open(path, flags, mode);
+}
+
+bool BlockCacheFileDescriptor::Open(const char* path, int flags) {
+  offset_ = 0;
+  return fd_->Open(path, flags);
+}
+
+ssize_t BlockCacheFileDescriptor::Read(void* buf, size_t count) {
+  if (ReadBatch({{offset_, buf, count}})) {
+    offset_ += count;
+    return count;
+  }
+  // Most likely a read past the end of the file, which returns whatever is
+  // left.
+  if (fd_->Seek(offset_, SEEK_SET) != offset_) {
+    return -1;
+  }
+  const ssize_t bytes_read = fd_->Read(buf, count);
+  if (bytes_read > 0) {
+    offset_ += bytes_read;
+  }
+  return bytes_read;
+}
+
+ssize_t BlockCacheFileDescriptor::Write(const void* buf, size_t count) {
+  Invalidate(offset_, count);
+  if (fd_->Seek(offset_, SEEK_SET) != offset_) {
+    return -1;
+  }
+  const ssize_t bytes_written = fd_->Write(buf, count);
+  if (bytes_written > 0) {
+    offset_ += bytes_written;
+  }
+  return bytes_written;
+}
+
+off64_t BlockCacheFileDescriptor::Seek(off64_t offset, int whence) {
+  off64_t new_offset = -1;
+  switch (whence) {
+    case SEEK_SET:
+      new_offset = offset;
+      break;
+    case SEEK_CUR:
+      new_offset = offset_ + offset;
+      break;
+    default:
+      new_offset = fd_->Seek(offset, whence);
+      if (new_offset < 0) {
+        return -1;
+      }
+  }
+  if (new_offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  offset_ = new_offset;
+  return offset_;
+}
+
+bool BlockCacheFileDescriptor::BlkIoctl(int request,
+                                        uint64_t start,
+                                        uint64_t length,
+                                        int* result) {
+  Invalidate(start, length);
+  return fd_->BlkIoctl(request, start, length, result);
+}
+
+bool BlockCacheFileDescriptor::Close() {
+  hot_.clear();
+  cold_.clear();
+  index_.clear();
+  return fd_->Close();
+}
+
+bool BlockCacheFileDescriptor::ReadBatch(
+    const std::vector<FileIoRequest>& requests) {
+  if (capacity_ == 0) {
+    return fd_->ReadBatch(requests);
+  }
+  // Read the whole blocks missing from the cache into |scratch|, merging the
+  // ones next to each other so that the underlying descriptor still gets
+  // large requests.
+  std::unordered_map<uint64_t, size_t> missing;
+  std::vector<FileIoRequest> reads;
+  std::vector<size_t> read_scratch_offsets;
+  size_t scratch_size = 0;
+  for (const FileIoRequest& request : requests) {
+    if (request.count == 0) {
+      continue;
+    }
+    const uint64_t first_block = request.offset / block_size_;
+    const uint64_t last_block =
+        (request.offset + request.count - 1) / block_size_;
+    for (uint64_t block = first_block; block <= last_block; block++) {
+      if (index_.count(block) || missing.count(block)) {
+        continue;
+      }
+      missing[block] = scratch_size;
+      const off64_t offset = block * block_size_;
+      if (!reads.empty() &&
+          reads.back().offset + static_cast<off64_t>(reads.back().count) ==
+              offset) {
+        reads.back().count += block_size_;
+      } else {
+        reads.push_back({offset, nullptr, block_size_});
+        read_scratch_offsets.push_back(scratch_size);
+      }
+      scratch_size += block_size_;
+    }
+  }
+  brillo::Blob scratch(scratch_size);
+  for (size_t i = 0; i < reads.size(); i++) {
+    reads[i].buf = scratch.data() + read_scratch_offsets[i];
+  }
+  if (!reads.empty() && !fd_->ReadBatch(reads)) {
+    // A partial block at the end of the file can't be cached.
+    return fd_->ReadBatch(requests);
+  }
+
+  // Copy out everything before adding the blocks read to the cache, as that
+  // may evict some of the blocks of |requests|.
+  for (const FileIoRequest& request : requests) {
+    uint8_t* buf = static_cast<uint8_t*>(request.buf);
+    off64_t offset = request.offset;
+    size_t count = request.count;
+    while (count > 0) {
+      const uint64_t block = offset / block_size_;
+      const size_t block_offset = offset % block_size_;
+      const size_t size = std::min(count, block_size_ - block_offset);
+      const auto missing_it = missing.find(block);
+      if (missing_it != missing.end()) {
+        memcpy(buf, scratch.data() + missing_it->second + block_offset, size);
+        misses_++;
+      } else {
+        const auto entry = index_.at(block);
+        memcpy(buf, entry->data.data() + block_offset, size);
+        Touch(entry);
+        hits_++;
+      }
+      buf += size;
+      offset += size;
+      count -= size;
+    }
+  }
+  for (const auto& [block, scratch_offset] : missing) {
+    Insert(block, scratch.data() + scratch_offset);
+  }
+  return true;
+}
+
+void BlockCacheFileDescriptor::SetReusedBlocks(
+    std::vector<bool> reused_blocks) {
+  reused_blocks_ = std::move(reused_blocks);
+}
+
+void BlockCacheFileDescriptor::Invalidate(uint64_t offset, uint64_t length) {
+  if (length == 0 || index_.empty()) {
+    return;
+  }
+  const uint64_t first_block = offset / block_size_;
+  const uint64_t last_block = (offset + length - 1) / block_size_;
+  if (last_block - first_block >= index_.size()) {
+    for (auto it = index_.begin(); it != index_.end();) {
+      const auto entry = (it++)->second;
+      if (entry->block >= first_block && entry->block <= last_block) {
+        Erase(entry);
+      }
+    }
+    return;
+  }
+  for (uint64_t block = first_block; block <= last_block; block++) {
+    const auto it = index_.find(block);
+    if (it != index_.end()) {
+      Erase(it->second);
+    }
+  }
+}
+
+std::vector<bool> BlockCacheFileDescriptor::FindReusedBlocks(
+    const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+    uint64_t num_blocks) {
+  // Number of operations reading each block, up to 2.
+  std::vector<uint8_t> reads(num_blocks, 0);
+  for (const InstallOperation& operation : operations) {
+    for (const Extent& extent : operation.src_extents()) {
+      if (extent.start_block() == kSparseHole ||
+          extent.start_block() >= num_blocks) {
+        continue;
+      }
+      const uint64_t end_block =
+          std::min(extent.start_block() + extent.num_blocks(), num_blocks);
+      for (uint64_t block = extent.start_block(); block < end_block; block++) {
+        reads[block] = std::min(reads[block] + 1, 2);
+      }
+    }
+  }
+  std::vector<bool> reused_blocks(num_blocks);
+  for (uint64_t block = 0; block < num_blocks; block++) {
+    reused_blocks[block] = reads[block] > 1;
+  }
+  return reused_blocks;
+}
+
+bool BlockCacheFileDescriptor::IsReused(uint64_t block) const {
+  // Without hints, any block read again is assumed to be read more often.
+  return reused_blocks_.empty() ||
+         (block < reused_blocks_.size() && reused_blocks_[block]);
+}
+
+void BlockCacheFileDescriptor::Touch(EntryList::iterator entry) {
+  if (entry->hot) {
+    hot_.splice(hot_.begin(), hot_, entry);
+  } else if (IsReused(entry->block)) {
+    MakeHot(entry);
+  } else {
+    cold_.splice(cold_.begin(), cold_, entry);
+  }
+}
+
+void BlockCacheFileDescriptor::MakeHot(EntryList::iterator entry) {
+  if (entry->hot) {
+    hot_.splice(hot_.begin(), hot_, entry);
+  } else {
+    hot_.splice(hot_.begin(), cold_, entry);
+    entry->hot = true;
+  }
+  // Demote the least recently used hot blocks to the cold segment, where they
+  // get evicted first.
+  while (hot_.size() > hot_capacity_) {
+    const auto last = std::prev(hot_.end());
+    last->hot = false;
+    cold_.splice(cold_.begin(), hot_, last);
+  }
+}
+
+void BlockCacheFileDescriptor::Insert(uint64_t block, const uint8_t* data) {
+  if (capacity_ == 0) {
+    return;
+  }
+  brillo::Blob buffer;
+  if (index_.size() >= capacity_) {
+    // Evict the least recently used block, reusing its memory.
+    const auto victim =
+        cold_.empty() ? std::prev(hot_.end()) : std::prev(cold_.end());
+    buffer = std::move(victim->data);
+    Erase(victim);
+  }
+  buffer.assign(data, data + block_size_);
+  cold_.push_front({block, false, std::move(buffer)});
+  index_[block] = cold_.begin();
+  // Blocks known to be read again are kept longer right away.
+  if (!reused_blocks_.empty() && IsReused(block)) {
+    MakeHot(cold_.begin());
+  }
+}
+
+void BlockCacheFileDescriptor::Erase(EntryList::iterator entry) {
+  index_.erase(entry->block);
+  (entry->hot ? hot_ : cold_).erase(entry);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,126 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_BLOCK_CACHE_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_BLOCK_CACHE_FILE_DESCRIPTOR_H_
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Keeps up to |cache_size| bytes of the blocks read through it in memory.
+// Meant for source partitions: the operations of a delta payload often read
+// the same source blocks, and every operation reads its source twice, once to
+// check its hash and once to apply it.
+//
+// The cache is a segmented LRU. Blocks start in a cold segment and move to a
+// hot one, which takes up to 3/4 of the cache, when they are read again, so
+// that a long run of blocks read once doesn't push out the ones read over and
+// over. If the blocks read by more than one operation are known in advance,
+// see SetReusedBlocks(), only those are ever moved to the hot segment.
+//
+// Writes go through to the underlying descriptor and drop the blocks they
+// touch. Not thread safe.
+class BlockCacheFileDescriptor : public FileDescriptor {
+ public:
+  BlockCacheFileDescriptor(FileDescriptorPtr fd,
+                           size_t block_size,
+                           size_t cache_size);
+  ~BlockCacheFileDescriptor() override;
+
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override;
+  bool Flush() override { return fd_->Flush(); }
+  bool Close() override;
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+  // The blocks missing from the cache are read with a single ReadBatch() of
+  // the underlying descriptor.
+  bool ReadBatch(const std::vector<FileIoRequest>& requests) override;
+
+  // Sets the blocks worth keeping, |reused_blocks[i]| telling whether block i
+  // is read by more than one operation.
+  void SetReusedBlocks(std::vector<bool> reused_blocks);
+
+  // Drops the cached blocks overlapping the |length| bytes at |offset|, for
+  // when they are modified other than through this descriptor.
+  void Invalidate(uint64_t offset, uint64_t length);
+
+  // Number of blocks read from the cache and from the underlying descriptor.
+  uint64_t hits() const { return hits_; }
+  uint64_t misses() const { return misses_; }
+
+  // Returns whether each of the first |num_blocks| blocks is read by more
+  // than one of |operations|, for SetReusedBlocks().
+  static std::vector<bool> FindReusedBlocks(
+      const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+      uint64_t num_blocks);
+
+ private:
+  struct Entry {
+    uint64_t block;
+    bool hot;
+    brillo::Blob data;
+  };
+  using EntryList = std::list<Entry>;
+
+  bool IsReused(uint64_t block) const;
+  // Moves the entry of a block just read from the cache to the front of its
+  // segment, or to the hot segment.
+  void Touch(EntryList::iterator entry);
+  void MakeHot(EntryList::iterator entry);
+  // Adds |block|, which isn't cached, with the data at |data|.
+  void Insert(uint64_t block, const uint8_t* data);
+  void Erase(EntryList::iterator entry);
+
+  FileDescriptorPtr fd_;
+  const size_t block_size_;
+  // Maximum number of blocks cached, and in the hot segment.
+  const size_t capacity_;
+  const size_t hot_capacity_;
+
+  // Most recently used first.
+  EntryList hot_;
+  EntryList cold_;
+  std::unordered_map<uint64_t, EntryList::iterator> index_;
+  std::vector<bool> reused_blocks_;
+
+  off64_t offset_{0};
+  uint64_t hits_{0};
+  uint64_t misses_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(BlockCacheFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_BLOCK_CACHE_FILE_DESCRIPTOR_H_
@@ -0,0 +1,188 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/block_cache_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/fake_file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kBlockSize = 4096;
+// (offset, length) as recorded by FakeFileDescriptor.
+using ReadOp = std::pair<uint64_t, uint64_t>;
+}  // namespace
+
+class BlockCacheFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override { Open(8); }
+
+  void Open(size_t cache_blocks) {
+    fake_fd_ = std::make_shared<FakeFileDescriptor>();
+    cache_fd_ = std::make_unique<BlockCacheFileDescriptor>(
+        fake_fd_, kBlockSize, cache_blocks * kBlockSize);
+    ASSERT_TRUE(cache_fd_->Open("/dev/null", O_RDONLY));
+  }
+
+  // Reads |count| blocks from |block| and checks the data.
+  void ReadBlocks(uint64_t block, size_t count) {
+    brillo::Blob data(count * kBlockSize);
+    ASSERT_TRUE(
+        cache_fd_->ReadBatch({{static_cast<off64_t>(block * kBlockSize),
+                               data.data(),
+                               data.size()}}));
+    const brillo::Blob expected =
+        FakeFileDescriptorData((block + count) * kBlockSize);
+    ASSERT_EQ(brillo::Blob(expected.begin() + block * kBlockSize,
+                           expected.end()),
+              data);
+  }
+
+  size_t NumReadOps() const { return fake_fd_->GetReadOps().size(); }
+
+  std::shared_ptr<FakeFileDescriptor> fake_fd_;
+  std::unique_ptr<BlockCacheFileDescriptor> cache_fd_;
+};
+
+TEST_F(BlockCacheFileDescriptorTest, UnalignedReadsTest) {
+  const brillo::Blob expected = FakeFileDescriptorData(kBlockSize * 4);
+  brillo::Blob first(kBlockSize + 10);
+  brillo::Blob second(100);
+  const off64_t second_offset = 3 * kBlockSize - 50;
+  ASSERT_TRUE(cache_fd_->ReadBatch({{10, first.data(), first.size()},
+                                    {second_offset, second.data(), 100}}));
+  EXPECT_EQ(
+      brillo::Blob(expected.begin() + 10, expected.begin() + 20 + kBlockSize),
+      first);
+  EXPECT_EQ(brillo::Blob(expected.begin() + 3 * kBlockSize - 50,
+                         expected.begin() + 3 * kBlockSize + 50),
+            second);
+
+  // The same through Seek() and Read().
+  brillo::Blob data(kBlockSize);
+  ASSERT_EQ(static_cast<off64_t>(kBlockSize / 2),
+            cache_fd_->Seek(kBlockSize / 2, SEEK_SET));
+  ASSERT_EQ(static_cast<ssize_t>(data.size()),
+            cache_fd_->Read(data.data(), data.size()));
+  EXPECT_EQ(brillo::Blob(expected.begin() + kBlockSize / 2,
+                         expected.begin() + kBlockSize * 3 / 2),
+            data);
+  EXPECT_EQ(static_cast<off64_t>(kBlockSize * 3 / 2),
+            cache_fd_->Seek(0, SEEK_CUR));
+}
+
+TEST_F(BlockCacheFileDescriptorTest, CachedBlocksAreNotReadAgainTest) {
+  ReadBlocks(0, 4);
+  EXPECT_EQ(0u, cache_fd_->hits());
+  EXPECT_EQ(4u, cache_fd_->misses());
+  const size_t num_read_ops = NumReadOps();
+
+  ReadBlocks(0, 4);
+  ReadBlocks(1, 2);
+  EXPECT_EQ(num_read_ops, NumReadOps());
+  EXPECT_EQ(6u, cache_fd_->hits());
+  EXPECT_EQ(4u, cache_fd_->misses());
+}
+
+TEST_F(BlockCacheFileDescriptorTest, MissingBlocksAreMergedTest) {
+  ReadBlocks(1, 1);
+  const size_t num_read_ops = NumReadOps();
+  ReadBlocks(0, 5);
+  const vector<ReadOp> read_ops = fake_fd_->GetReadOps();
+  ASSERT_EQ(num_read_ops + 2, read_ops.size());
+  EXPECT_EQ(ReadOp(0, kBlockSize), read_ops[num_read_ops]);
+  EXPECT_EQ(ReadOp(2 * kBlockSize, 3 * kBlockSize),
+            read_ops[num_read_ops + 1]);
+}
+
+TEST_F(BlockCacheFileDescriptorTest, BlocksReadAgainOutliveOthersTest) {
+  Open(4);
+  ReadBlocks(0, 1);
+  ReadBlocks(0, 1);
+  // A long run of blocks read once only evicts cold blocks.
+  ReadBlocks(10, 8);
+  const size_t num_read_ops = NumReadOps();
+  ReadBlocks(0, 1);
+  EXPECT_EQ(num_read_ops, NumReadOps());
+}
+
+TEST_F(BlockCacheFileDescriptorTest, ReusedBlocksHintTest) {
+  google::protobuf::RepeatedPtrField<InstallOperation> operations;
+  *operations.Add()->add_src_extents() = ExtentForRange(0, 2);
+  *operations.Add()->add_src_extents() = ExtentForRange(1, 2);
+  *operations.Add()->add_src_extents() = ExtentForRange(20, 10);
+  const vector<bool> reused_blocks =
+      BlockCacheFileDescriptor::FindReusedBlocks(operations, 25);
+  vector<bool> expected(25, false);
+  expected[1] = true;
+  EXPECT_EQ(expected, reused_blocks);
+
+  Open(4);
+  cache_fd_->SetReusedBlocks(reused_blocks);
+  // Block 1 is kept from its first read, while block 0 isn't despite being
+  // read again.
+  ReadBlocks(0, 2);
+  ReadBlocks(0, 1);
+  ReadBlocks(10, 8);
+  size_t num_read_ops = NumReadOps();
+  ReadBlocks(1, 1);
+  EXPECT_EQ(num_read_ops, NumReadOps());
+  ReadBlocks(0, 1);
+  EXPECT_EQ(num_read_ops + 1, NumReadOps());
+}
+
+TEST_F(BlockCacheFileDescriptorTest, InvalidateTest) {
+  ReadBlocks(0, 4);
+  const size_t num_read_ops = NumReadOps();
+  cache_fd_->Invalidate(kBlockSize + 1, 10);
+  ReadBlocks(0, 4);
+  const vector<ReadOp> read_ops = fake_fd_->GetReadOps();
+  ASSERT_EQ(num_read_ops + 1, read_ops.size());
+  EXPECT_EQ(ReadOp(kBlockSize, kBlockSize), read_ops.back());
+}
+
+TEST_F(BlockCacheFileDescriptorTest, PartialBlockAtEndOfFileTest) {
+  fake_fd_->SetFileSize(kBlockSize + 100);
+  const brillo::Blob expected = FakeFileDescriptorData(kBlockSize + 100);
+  brillo::Blob data(kBlockSize);
+  ASSERT_EQ(static_cast<off64_t>(kBlockSize),
+            cache_fd_->Seek(kBlockSize, SEEK_SET));
+  ASSERT_EQ(100, cache_fd_->Read(data.data(), data.size()));
+  EXPECT_EQ(brillo::Blob(expected.begin() + kBlockSize, expected.end()),
+            brillo::Blob(data.begin(), data.begin() + 100));
+}
+
+TEST_F(BlockCacheFileDescriptorTest, NoCacheTest) {
+  Open(0);
+  ReadBlocks(0, 2);
+  const size_t num_read_ops = NumReadOps();
+  ReadBlocks(0, 2);
+  EXPECT_LT(num_read_ops, NumReadOps());
+  EXPECT_EQ(0u, cache_fd_->hits() + cache_fd_->misses());
+}
+
+}  // namespace chromeos_update_engine
@@ -21,6 +21,7 @@
 #include <algorithm>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/update_metadata.pb.h"
@@ -31,7 +32,21 @@ bool BlockExtentWriter::Init(
     const google::protobuf::RepeatedPtrField<Extent>& extents,
     uint32_t block_size) {
   TEST_NE(extents.size(), 0);
-  extents_ = extents;
+  // Extents continuing where the previous one ends are written as one, so
+  // that their blocks go out in a single WriteExtent() call.
+  extents_.Clear();
+  for (const Extent& extent : extents) {
+    if (!extents_.empty()) {
+      Extent* last = &extents_[extents_.size() - 1];
+      if (last->start_block() != kSparseHole &&
+          extent.start_block() != kSparseHole &&
+          last->start_block() + last->num_blocks() == extent.start_block()) {
+        last->set_num_blocks(last->num_blocks() + extent.num_blocks());
+        continue;
+      }
+    }
+    *extents_.Add() = extent;
+  }
   cur_extent_idx_ = 0;
   buffer_.clear();
   buffer_.reserve(block_size);
@@ -39,65 +54,46 @@ bool BlockExtentWriter::Init(
   return true;
 }
 
-bool BlockExtentWriter::WriteExtent(const void* bytes, const size_t count) {
+bool BlockExtentWriter::WriteExtentv(const std::vector<iovec>& iov,
+                                     const Extent& extent,
+                                     size_t block_size) {
+  uint64_t block = extent.start_block();
+  for (const iovec& piece : iov) {
+    if (piece.iov_len == 0) {
+      continue;
+    }
+    TEST_EQ(piece.iov_len % block_size, 0U);
+    const uint64_t num_blocks = piece.iov_len / block_size;
+    TEST_AND_RETURN_FALSE(WriteExtent(
+        piece.iov_base, ExtentForRange(block, num_blocks), block_size));
+    block += num_blocks;
+  }
+  TEST_EQ(block, extent.start_block() + extent.num_blocks());
+  return true;
+}
+
+bool BlockExtentWriter::WriteBlocks(const std::vector<iovec>& iov) {
+  size_t count = 0;
+  for (const iovec& piece : iov) {
+    count += piece.iov_len;
+  }
   const auto& cur_extent = extents_[cur_extent_idx_];
   const auto write_extent =
       ExtentForRange(cur_extent.start_block() + offset_in_extent_ / block_size_,
-                     count / kBlockSize);
+                     count / block_size_);
   offset_in_extent_ += count;
   if (offset_in_extent_ == cur_extent.num_blocks() * block_size_) {
     NextExtent();
   }
-  return WriteExtent(bytes, write_extent, block_size_);
-}
-
-size_t BlockExtentWriter::ConsumeWithBuffer(const uint8_t* const data,
-                                            const size_t count) {
-  if (cur_extent_idx_ >= static_cast<size_t>(extents_.size())) {
-    if (count > 0) {
-      LOG(ERROR) << "Exhausted all blocks, but still have " << count
-                 << " bytes pending for write";
-    }
-    return 0;
+  const bool success =
+      iov.size() == 1
+          ? WriteExtent(iov[0].iov_base, write_extent, block_size_)
+          : WriteExtentv(iov, write_extent, block_size_);
+  if (!success) {
+    LOG(ERROR) << "WriteExtent(" << write_extent.start_block() << ", "
+               << write_extent.num_blocks() << ") failed.";
   }
-  const auto& cur_extent = extents_[cur_extent_idx_];
-  const auto cur_extent_size =
-      static_cast<size_t>(cur_extent.num_blocks() * block_size_);
-
-  const auto write_size =
-      std::min(cur_extent_size - offset_in_extent_, BUFFER_SIZE);
-  if (buffer_.empty() && count >= write_size) {
-    if (!WriteExtent(data, write_size)) {
-      LOG(ERROR) << "WriteExtent(" << cur_extent.start_block() << ", "
-                 << write_size << ") failed.";
-      // return value is expected to be greater than 0. Return 0 to signal error
-      // condition
-      return 0;
-    }
-    return write_size;
-  }
-  if (buffer_.size() >= write_size) {
-    LOG(ERROR)
-        << "Data left in buffer should never be >= write_size, otherwise "
-           "we should have send that data to CowWriter. Buffer size: "
-        << buffer_.size() << " write_size: " << write_size;
-  }
-  const size_t bytes_to_copy =
-      std::min<size_t>(count, write_size - buffer_.size());
-  TEST_GT(bytes_to_copy, 0U);
-
-  buffer_.insert(buffer_.end(), data, data + bytes_to_copy);
-  TEST_LE(buffer_.size(), write_size);
-
-  if (buffer_.size() == write_size) {
-    if (!WriteExtent(buffer_.data(), write_size)) {
-      LOG(ERROR) << "WriteExtent(" << cur_extent.start_block() << ", "
-                 << cur_extent.num_blocks() << ") failed.";
-      return 0;
-    }
-    buffer_.clear();
-  }
-  return bytes_to_copy;
+  return success;
 }
 
 // Returns true on success.
@@ -106,16 +102,50 @@ size_t BlockExtentWriter::ConsumeWithBuffer(const uint8_t* const data,
 // class, otherwise raw data will be stored. Caller should find ways to use
 // COW_COPY whenever possible.
 bool BlockExtentWriter::Write(const void* bytes, size_t count) {
-  if (count == 0) {
-    return true;
-  }
-
   auto data = static_cast<const uint8_t*>(bytes);
   while (count > 0) {
-    const auto bytes_written = ConsumeWithBuffer(data, count);
-    TEST_AND_RETURN_FALSE(bytes_written > 0);
-    data += bytes_written;
-    count -= bytes_written;
+    if (cur_extent_idx_ >= static_cast<size_t>(extents_.size())) {
+      LOG(ERROR) << "Exhausted all blocks, but still have " << count
+                 << " bytes pending for write";
+      return false;
+    }
+    const auto& cur_extent = extents_[cur_extent_idx_];
+    const size_t extent_left =
+        cur_extent.num_blocks() * block_size_ - offset_in_extent_;
+    // Extents are made of whole blocks, so a partial block never spans two.
+    const size_t max_run = std::min(extent_left, BUFFER_SIZE);
+    if (!buffer_.empty()) {
+      const size_t head = std::min(count, block_size_ - buffer_.size());
+      buffer_.insert(buffer_.end(), data, data + head);
+      data += head;
+      count -= head;
+      if (buffer_.size() < block_size_) {
+        return true;
+      }
+      // The completed block goes out along with the whole blocks following
+      // it, which aren't copied.
+      const size_t run =
+          std::min(count - count % block_size_, max_run - block_size_);
+      std::vector<iovec> iov = {{buffer_.data(), block_size_}};
+      if (run > 0) {
+        iov.push_back({const_cast<uint8_t*>(data), run});
+      }
+      TEST_AND_RETURN_FALSE(WriteBlocks(iov));
+      buffer_.clear();
+      data += run;
+      count -= run;
+      continue;
+    }
+    const size_t run = std::min(count - count % block_size_, max_run);
+    if (run > 0) {
+      TEST_AND_RETURN_FALSE(WriteBlocks({{const_cast<uint8_t*>(data), run}}));
+      data += run;
+      count -= run;
+      continue;
+    }
+    // Less than a block, kept until the rest of the block is given.
+    buffer_.assign(data, data + count);
+    count = 0;
   }
   return true;
 }
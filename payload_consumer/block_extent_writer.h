@@ -17,6 +17,8 @@
 #ifndef UPDATE_ENGINE_BLOCK_EXTENT_WRITER_H_
 #define UPDATE_ENGINE_BLOCK_EXTENT_WRITER_H_
 
+#include <sys/uio.h>
+
 #include <cstdint>
 #include <vector>
 
@@ -25,7 +27,10 @@
 
 namespace chromeos_update_engine {
 
-// Cache data upto size of one extent before writing.
+// Sends the data to WriteExtent() a whole number of blocks at a time, up to
+// BUFFER_SIZE bytes and one extent per call. Runs of whole blocks are passed
+// straight from the data given to Write(), only the partial blocks at the
+// start and end of a Write() call are copied to a buffer.
 class BlockExtentWriter : public chromeos_update_engine::ExtentWriter {
  public:
   static constexpr size_t BUFFER_SIZE = 1024 * 1024;
@@ -42,18 +47,24 @@ class BlockExtentWriter : public chromeos_update_engine::ExtentWriter {
   virtual bool WriteExtent(const void* bytes,
                            const Extent& extent,
                            size_t block_size) = 0;
+  // Same, with the data of |extent| in the pieces of |iov|, each a whole
+  // number of blocks. Calls WriteExtent() for each piece unless overridden.
+  virtual bool WriteExtentv(const std::vector<iovec>& iov,
+                            const Extent& extent,
+                            size_t block_size);
   size_t BlockSize() const { return block_size_; }
 
  private:
-  bool WriteExtent(const void* bytes, size_t count);
+  // Writes the next blocks of the current extent from |iov|, moving on to the
+  // next extent once this one is written.
+  bool WriteBlocks(const std::vector<iovec>& iov);
   bool NextExtent();
-  [[nodiscard]] size_t ConsumeWithBuffer(const uint8_t* const bytes,
-                                         const size_t count);
   // It's a non-owning pointer, because PartitionWriter owns the CowWruter. This
   // allows us to use a single instance of CowWriter for all operations applied
   // to the same partition.
   google::protobuf::RepeatedPtrField<Extent> extents_;
   size_t cur_extent_idx_{};
+  // The start of a block whose end wasn't given yet, less than a block.
   std::vector<uint8_t> buffer_;
   size_t block_size_{};
   size_t offset_in_extent_{};
@@ -0,0 +1,87 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// BlockExtentWriter splitting the data of an operation in its extents, for
+// extents of every length and writes of every size, as the VABC partition
+// writer gets them from the decompressors and patchers.
+
+#include <string.h>
+
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/block_extent_writer.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kBlocksPerIteration = 4096;
+
+// Copies the data of each extent to the place of the extent in |target|.
+class CopyingBlockExtentWriter : public BlockExtentWriter {
+ public:
+  explicit CopyingBlockExtentWriter(brillo::Blob* target) : target_(target) {}
+
+  bool WriteExtent(const void* bytes,
+                   const Extent& extent,
+                   size_t block_size) override {
+    memcpy(target_->data() + extent.start_block() * block_size,
+           bytes,
+           extent.num_blocks() * block_size);
+    return true;
+  }
+
+ private:
+  brillo::Blob* target_;
+};
+
+// The arguments are the number of blocks of the extents, the fewer the more
+// fragmented the target, then the size of the writes.
+void BM_BlockExtentWriterWrite(benchmark::State& state) {
+  const size_t extent_blocks = state.range(0);
+  // Every other run of |extent_blocks| blocks, so that they don't merge.
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  for (size_t block = 0; block < kBlocksPerIteration; block += extent_blocks)
+    *extents.Add() = ExtentForRange(block * 2, extent_blocks);
+  brillo::Blob target(kBlocksPerIteration * 2 * kBlockSize);
+  const brillo::Blob data(kBlocksPerIteration * kBlockSize, 0x5a);
+  const size_t write_size = state.range(1);
+  for (auto _ : state) {
+    CopyingBlockExtentWriter writer(&target);
+    if (!writer.Init(extents, kBlockSize)) {
+      state.SkipWithError("Init() failed");
+      break;
+    }
+    for (size_t done = 0; done < data.size(); done += write_size) {
+      if (!writer.Write(data.data() + done, write_size)) {
+        state.SkipWithError("Write() failed");
+        return;
+      }
+    }
+    benchmark::DoNotOptimize(target.data());
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+
+}  // namespace
+
+BENCHMARK(BM_BlockExtentWriterWrite)
+    ->ArgsProduct({{1, 16, 256, 4096}, {4096, 65536, 1 << 20}});
+
+}  // namespace chromeos_update_engine
@@ -94,6 +94,27 @@ TEST_F(BlockExtentWriterTest, LongExtentTest) {
   ASSERT_TRUE(writer.Write(buffer.data(), BlockExtentWriter::BUFFER_SIZE * 2));
 }
 
+// Extents continuing each other are written together.
+TEST_F(BlockExtentWriterTest, ContiguousExtentsTest) {
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  *extents.Add() = ExtentForRange(10, 1);
+  *extents.Add() = ExtentForRange(11, 2);
+  *extents.Add() = ExtentForRange(20, 1);
+  MockBlockExtentWriter writer;
+  ASSERT_TRUE(writer.Init(extents, kBlockSize));
+  std::string buffer;
+  buffer.resize(kBlockSize * 4);
+  EXPECT_CALL(writer,
+              WriteExtent(buffer.data(), ExtentForRange(10, 3), kBlockSize))
+      .WillOnce(Return(true));
+  EXPECT_CALL(writer,
+              WriteExtent(static_cast<void*>(buffer.data() + kBlockSize * 3),
+                          ExtentForRange(20, 1),
+                          kBlockSize))
+      .WillOnce(Return(true));
+  ASSERT_TRUE(writer.Write(buffer.data(), buffer.size()));
+}
+
 TEST_F(BlockExtentWriterTest, LongExtentMultiCall) {
   google::protobuf::RepeatedPtrField<Extent> extents;
   static constexpr auto BLOCKS_PER_BUFFER =
@@ -143,11 +164,18 @@ TEST_F(BlockExtentWriterTest, SingleBufferMultiCall) {
   FillArbitraryData(&buffer);
 
   ON_CALL(writer, WriteExtent(_, _, _)).WillByDefault(Return(true));
+  // Whole blocks are passed on as they are given, without waiting to fill a
+  // buffer.
   EXPECT_CALL(writer,
-              WriteExtent(_, ExtentForRange(10, BLOCKS_PER_BUFFER), kBlockSize))
-      .WillOnce([&buffer](const void* data, const Extent& extent, size_t) {
-        return memcmp(data, buffer.data(), buffer.size()) == 0;
-      });
+              WriteExtent(static_cast<void*>(buffer.data()),
+                          ExtentForRange(10, BLOCKS_PER_BUFFER - 1),
+                          kBlockSize));
+  EXPECT_CALL(writer,
+              WriteExtent(static_cast<void*>(buffer.data() +
+                                             BlockExtentWriter::BUFFER_SIZE -
+                                             kBlockSize),
+                          ExtentForRange(10 + BLOCKS_PER_BUFFER - 1, 1),
+                          kBlockSize));
 
   ASSERT_TRUE(
       writer.Write(buffer.data(), BlockExtentWriter::BUFFER_SIZE - kBlockSize));
@@ -181,4 +209,38 @@ TEST_F(BlockExtentWriterTest, MultiBufferMultiCall) {
   ASSERT_TRUE(writer.Write(buffer.data(), kBlockSize));
 }
 
+// Only the partial blocks at the ends of a write are copied, the whole blocks
+// in between are passed on from the data written.
+TEST_F(BlockExtentWriterTest, UnalignedWritesTest) {
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  *extents.Add() = ExtentForRange(10, 4);
+  MockBlockExtentWriter writer;
+  ASSERT_TRUE(writer.Init(extents, kBlockSize));
+  std::string buffer;
+  buffer.resize(kBlockSize * 4);
+  FillArbitraryData(&buffer);
+
+  const auto matches = [&buffer](size_t block) {
+    return [&buffer, block](const void* data, const Extent& extent, size_t) {
+      return memcmp(data,
+                    buffer.data() + block * kBlockSize,
+                    extent.num_blocks() * kBlockSize) == 0;
+    };
+  };
+  EXPECT_CALL(writer, WriteExtent(_, ExtentForRange(10, 1), kBlockSize))
+      .WillOnce(matches(0));
+  EXPECT_CALL(writer,
+              WriteExtent(static_cast<void*>(buffer.data() + kBlockSize),
+                          ExtentForRange(11, 2),
+                          kBlockSize))
+      .WillOnce(Return(true));
+  EXPECT_CALL(writer, WriteExtent(_, ExtentForRange(13, 1), kBlockSize))
+      .WillOnce(matches(3));
+
+  const size_t half = kBlockSize / 2;
+  ASSERT_TRUE(writer.Write(buffer.data(), half));
+  ASSERT_TRUE(writer.Write(buffer.data() + half, kBlockSize * 3));
+  ASSERT_TRUE(writer.Write(buffer.data() + half + kBlockSize * 3, half));
+}
+
 }  // namespace chromeos_update_engine
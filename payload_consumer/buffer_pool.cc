@@ -0,0 +1,89 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/buffer_pool.h"
+
+#include <utility>
+
+namespace chromeos_update_engine {
+
+BufferPool::Buffer::Buffer(BufferPool* pool, brillo::Blob blob)
+    : pool_(pool), blob_(std::move(blob)) {}
+
+BufferPool::Buffer::Buffer(Buffer&& other)
+    : pool_(other.pool_), blob_(std::move(other.blob_)) {
+  other.pool_ = nullptr;
+}
+
+BufferPool::Buffer& BufferPool::Buffer::operator=(Buffer&& other) {
+  if (this != &other) {
+    Release();
+    pool_ = other.pool_;
+    blob_ = std::move(other.blob_);
+    other.pool_ = nullptr;
+  }
+  return *this;
+}
+
+BufferPool::Buffer::~Buffer() {
+  Release();
+}
+
+void BufferPool::Buffer::Release() {
+  if (pool_) {
+    pool_->Release(std::move(blob_));
+    pool_ = nullptr;
+  }
+  blob_ = brillo::Blob();
+}
+
+BufferPool::BufferPool(size_t max_buffers, size_t max_bytes)
+    : max_buffers_(max_buffers), max_bytes_(max_bytes) {}
+
+BufferPool::Buffer BufferPool::Acquire(size_t size) {
+  acquires_++;
+  auto best = buffers_.end();
+  for (auto it = buffers_.begin(); it != buffers_.end(); ++it) {
+    if (it->capacity() >= size &&
+        (best == buffers_.end() || it->capacity() < best->capacity())) {
+      best = it;
+    }
+  }
+  brillo::Blob blob;
+  if (best != buffers_.end()) {
+    kept_bytes_ -= best->capacity();
+    blob = std::move(*best);
+    buffers_.erase(best);
+  } else {
+    allocations_++;
+  }
+  // Growing within the capacity only zeroes the new bytes, shrinking leaves
+  // the memory allocated.
+  blob.resize(size);
+  return Buffer(this, std::move(blob));
+}
+
+void BufferPool::Release(brillo::Blob blob) {
+  const size_t capacity = blob.capacity();
+  if (capacity == 0 || buffers_.size() >= max_buffers_ ||
+      kept_bytes_ + capacity > max_bytes_) {
+    return;
+  }
+  kept_bytes_ += capacity;
+  buffers_.push_back(std::move(blob));
+}
+
+}  // namespace chromeos_update_engine
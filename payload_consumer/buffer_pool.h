@@ -0,0 +1,90 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_BUFFER_POOL_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_BUFFER_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// Hands out the large buffers operations need for their source data, patches
+// and outputs, and takes them back once the operation is done with them, so
+// that applying one operation after the other reuses the same memory instead
+// of allocating and freeing megabytes each time.
+//
+// Up to |max_buffers| returned buffers adding up to no more than |max_bytes|
+// are kept; the others are freed right away, which bounds the memory held in
+// between operations. Not thread safe.
+class BufferPool {
+ public:
+  // A buffer taken from the pool, given back when destroyed.
+  class Buffer {
+   public:
+    Buffer() = default;
+    Buffer(Buffer&& other);
+    Buffer& operator=(Buffer&& other);
+    ~Buffer();
+
+    brillo::Blob* get() { return &blob_; }
+    brillo::Blob& operator*() { return blob_; }
+    brillo::Blob* operator->() { return &blob_; }
+
+   private:
+    friend class BufferPool;
+    Buffer(BufferPool* pool, brillo::Blob blob);
+    void Release();
+
+    BufferPool* pool_{nullptr};
+    brillo::Blob blob_;
+
+    DISALLOW_COPY_AND_ASSIGN(Buffer);
+  };
+
+  BufferPool(size_t max_buffers, size_t max_bytes);
+
+  // Returns a buffer of |size| bytes, whose contents are unspecified. It
+  // reuses the smallest kept buffer large enough, if any.
+  Buffer Acquire(size_t size);
+
+  // Number of Acquire() calls, and how many of them had to allocate memory.
+  uint64_t acquires() const { return acquires_; }
+  uint64_t allocations() const { return allocations_; }
+  // Bytes of memory held by the buffers kept.
+  size_t kept_bytes() const { return kept_bytes_; }
+
+ private:
+  void Release(brillo::Blob blob);
+
+  const size_t max_buffers_;
+  const size_t max_bytes_;
+
+  std::vector<brillo::Blob> buffers_;
+  size_t kept_bytes_{0};
+  uint64_t acquires_{0};
+  uint64_t allocations_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(BufferPool);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_BUFFER_POOL_H_
@@ -0,0 +1,97 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/buffer_pool.h"
+
+#include <utility>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(BufferPoolTest, BuffersReusedTest) {
+  BufferPool pool(2, 1024);
+  const uint8_t* data = nullptr;
+  {
+    BufferPool::Buffer buffer = pool.Acquire(100);
+    EXPECT_EQ(100u, buffer->size());
+    data = buffer->data();
+  }
+  EXPECT_EQ(1u, pool.allocations());
+  EXPECT_GE(pool.kept_bytes(), 100u);
+
+  // Smaller buffers come out of the same memory.
+  {
+    BufferPool::Buffer buffer = pool.Acquire(50);
+    EXPECT_EQ(50u, buffer->size());
+    EXPECT_EQ(data, buffer->data());
+    EXPECT_EQ(0u, pool.kept_bytes());
+  }
+  EXPECT_EQ(2u, pool.acquires());
+  EXPECT_EQ(1u, pool.allocations());
+
+  // That one is too small for this, and stays in the pool.
+  BufferPool::Buffer large = pool.Acquire(200);
+  EXPECT_EQ(200u, large->size());
+  EXPECT_EQ(2u, pool.allocations());
+  EXPECT_GE(pool.kept_bytes(), 100u);
+}
+
+TEST(BufferPoolTest, SmallestFittingBufferUsedTest) {
+  BufferPool pool(4, 4096);
+  {
+    BufferPool::Buffer small = pool.Acquire(100);
+    BufferPool::Buffer large = pool.Acquire(1000);
+  }
+  BufferPool::Buffer buffer = pool.Acquire(80);
+  EXPECT_LT(buffer->capacity(), 1000u);
+  BufferPool::Buffer other = pool.Acquire(500);
+  EXPECT_GE(other->capacity(), 1000u);
+  EXPECT_EQ(2u, pool.allocations());
+}
+
+TEST(BufferPoolTest, LimitsTest) {
+  BufferPool pool(2, 1024);
+  // Too large to be kept.
+  { BufferPool::Buffer buffer = pool.Acquire(2048); }
+  EXPECT_EQ(0u, pool.kept_bytes());
+
+  {
+    BufferPool::Buffer first = pool.Acquire(10);
+    BufferPool::Buffer second = pool.Acquire(10);
+    BufferPool::Buffer third = pool.Acquire(10);
+  }
+  BufferPool::Buffer first = pool.Acquire(10);
+  BufferPool::Buffer second = pool.Acquire(10);
+  BufferPool::Buffer third = pool.Acquire(10);
+  EXPECT_EQ(5u, pool.allocations());
+}
+
+TEST(BufferPoolTest, MovedBufferReleasedOnceTest) {
+  BufferPool pool(4, 4096);
+  {
+    BufferPool::Buffer buffer = pool.Acquire(100);
+    BufferPool::Buffer moved = std::move(buffer);
+    BufferPool::Buffer assigned;
+    assigned = std::move(moved);
+    EXPECT_EQ(100u, assigned->size());
+  }
+  BufferPool::Buffer first = pool.Acquire(100);
+  BufferPool::Buffer second = pool.Acquire(100);
+  EXPECT_EQ(2u, pool.allocations());
+}
+
+}  // namespace chromeos_update_engine
@@ -14,17 +14,101 @@
 // limitations under the License.
 //
 
+#include <algorithm>
+#include <atomic>
+
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/bzip_extent_writer.h"
 
 using google::protobuf::RepeatedPtrField;
+using std::vector;
 
 namespace chromeos_update_engine {
 
 namespace {
 const brillo::Blob::size_type kOutputBufferLength = 16 * 1024;
+
+// The stream header is "BZh" followed by the block size, '1' to '9' for 100 to
+// 900 KB. Each block then starts with |kBlockMagic| and its CRC, and the stream
+// ends with |kEndMagic|, the CRC of the whole stream and the padding to the
+// next byte. None of these are byte aligned.
+constexpr size_t kHeaderBits = 32;
+constexpr size_t kMagicBits = 48;
+constexpr size_t kCrcBits = 32;
+constexpr uint64_t kBlockMagic = 0x314159265359;
+constexpr uint64_t kEndMagic = 0x177245385090;
+
+// Returns the |num_bits| bits of |data| from the bit |pos|, most significant
+// bit first as in bzip2 streams.
+uint64_t ReadBits(const uint8_t* data, uint64_t pos, size_t num_bits) {
+  uint64_t value = 0;
+  for (uint64_t bit = pos; bit < pos + num_bits; bit++) {
+    value = (value << 1) | ((data[bit / 8] >> (7 - bit % 8)) & 1);
+  }
+  return value;
+}
+
+// Appends bits to a buffer, most significant bit first.
+class BitWriter {
+ public:
+  explicit BitWriter(brillo::Blob* out) : out_(out) {}
+
+  void WriteBits(uint64_t value, size_t num_bits) {
+    for (size_t i = num_bits; i > 0; i--) {
+      WriteBit((value >> (i - 1)) & 1);
+    }
+  }
+
+  // Copies the bits [begin, end) of |data|.
+  void CopyBits(const uint8_t* data, uint64_t begin, uint64_t end) {
+    // Bit by bit up to a byte boundary of |data|, then a byte at a time.
+    for (; begin < end && begin % 8 != 0; begin++) {
+      WriteBit((data[begin / 8] >> (7 - begin % 8)) & 1);
+    }
+    for (; begin + 8 <= end; begin += 8) {
+      WriteBits(data[begin / 8], 8);
+    }
+    WriteBits(ReadBits(data, begin, end - begin), end - begin);
+  }
+
+ private:
+  void WriteBit(uint8_t bit) {
+    if (num_bits_ % 8 == 0)
+      out_->push_back(0);
+    out_->back() |= bit << (7 - num_bits_ % 8);
+    num_bits_++;
+  }
+
+  brillo::Blob* out_;
+  uint64_t num_bits_{0};
+};
+
+// Decompresses the whole bzip2 stream |in| into |out|, failing if it is
+// truncated or decompresses to more than |max_output_size| bytes.
+bool DecompressStream(const brillo::Blob& in,
+                      size_t max_output_size,
+                      brillo::Blob* out) {
+  bz_stream stream{};
+  TEST_AND_RETURN_FALSE(BZ2_bzDecompressInit(&stream, 0, 0) == BZ_OK);
+  stream.next_in = reinterpret_cast<char*>(const_cast<uint8_t*>(in.data()));
+  stream.avail_in = in.size();
+  int rc = BZ_OK;
+  while (rc == BZ_OK && out->size() < max_output_size) {
+    const size_t offset = out->size();
+    out->resize(std::min(offset + 16 * kOutputBufferLength, max_output_size));
+    stream.next_out = reinterpret_cast<char*>(out->data() + offset);
+    stream.avail_out = out->size() - offset;
+    rc = BZ2_bzDecompress(&stream);
+    out->resize(out->size() - stream.avail_out);
+    if (rc == BZ_OK && out->size() == offset && stream.avail_in == 0)
+      break;  // truncated
+  }
+  BZ2_bzDecompressEnd(&stream);
+  return rc == BZ_STREAM_END;
 }
 
+}  // namespace
+
 BzipExtentWriter::~BzipExtentWriter() {
   TEST_AND_RETURN(BZ2_bzDecompressEnd(&stream_) == BZ_OK);
   TEST_AND_RETURN(input_buffer_.empty());
@@ -85,4 +169,81 @@ bool BzipExtentWriter::Write(const void* bytes, size_t count) {
   return true;
 }
 
+bool BzipDecompressBlocks(const void* data,
+                          size_t size,
+                          size_t max_output_size,
+                          ForkJoinPool* pool,
+                          vector<brillo::Blob>* blocks) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  if (size * 8 < kHeaderBits || bytes[0] != 'B' || bytes[1] != 'Z' ||
+      bytes[2] != 'h' || bytes[3] < '1' || bytes[3] > '9') {
+    return false;
+  }
+
+  // Look for the magic numbers at every bit. The end of each block is the
+  // start of the next one, or of the end of the stream.
+  vector<uint64_t> starts;
+  uint64_t end = 0;
+  uint64_t window = 0;
+  for (uint64_t bit = 0; bit < size * 8 && end == 0; bit++) {
+    window = ((window << 1) | ((bytes[bit / 8] >> (7 - bit % 8)) & 1)) &
+             ((uint64_t{1} << kMagicBits) - 1);
+    if (bit + 1 < kHeaderBits + kMagicBits)
+      continue;
+    if (window == kBlockMagic) {
+      starts.push_back(bit + 1 - kMagicBits);
+    } else if (window == kEndMagic) {
+      end = bit + 1 - kMagicBits;
+    }
+  }
+  // A stream of a single block gains nothing, and one followed by anything
+  // else is left to libbz2.
+  if (starts.size() < 2 || starts[0] != kHeaderBits || end == 0 ||
+      (end + kMagicBits + kCrcBits + 7) / 8 != size) {
+    return false;
+  }
+  // The magic numbers may also show up in the compressed data, which would
+  // make the CRC of the stream differ from the one of these blocks.
+  uint32_t stream_crc = 0;
+  for (uint64_t start : starts) {
+    stream_crc = (stream_crc << 1) | (stream_crc >> 31);
+    stream_crc ^= ReadBits(bytes, start + kMagicBits, kCrcBits);
+  }
+  if (stream_crc != ReadBits(bytes, end + kMagicBits, kCrcBits)) {
+    LOG(INFO) << "The bzip2 stream doesn't split into blocks as expected.";
+    return false;
+  }
+
+  // Each block is decoded as a stream of its own, ending with the CRC of the
+  // only block. Blocks are handed out one at a time, as their sizes vary.
+  blocks->clear();
+  blocks->resize(starts.size());
+  std::atomic<size_t> next_block{0};
+  TEST_AND_RETURN_FALSE(pool->Run(
+      std::min(starts.size(), pool->num_threads()), [&](size_t /* task */) {
+        for (size_t i = next_block++; i < starts.size(); i = next_block++) {
+          const uint64_t block_end =
+              i + 1 < starts.size() ? starts[i + 1] : end;
+          brillo::Blob stream(bytes, bytes + kHeaderBits / 8);
+          BitWriter writer(&stream);
+          writer.CopyBits(bytes, starts[i], block_end);
+          writer.WriteBits(kEndMagic, kMagicBits);
+          writer.WriteBits(ReadBits(bytes, starts[i] + kMagicBits, kCrcBits),
+                           kCrcBits);
+          if (!DecompressStream(stream, max_output_size, &(*blocks)[i])) {
+            LOG(ERROR) << "Failed to decompress block " << i
+                       << " of the bzip2 stream.";
+            return false;
+          }
+        }
+        return true;
+      }));
+  size_t output_size = 0;
+  for (const brillo::Blob& block : *blocks) {
+    output_size += block.size();
+  }
+  TEST_AND_RETURN_FALSE(output_size <= max_output_size);
+  return true;
+}
+
 }  // namespace chromeos_update_engine
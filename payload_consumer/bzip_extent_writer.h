@@ -20,10 +20,12 @@
 #include <bzlib.h>
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include <brillo/secure_blob.h>
 
 #include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/fork_join_pool.h"
 
 // BzipExtentWriter is a concrete ExtentWriter subclass that bzip-decompresses
 // what it's given in Write. It passes the decompressed data to an underlying
@@ -49,6 +51,19 @@ class BzipExtentWriter : public ExtentWriter {
   brillo::Blob input_buffer_;
 };
 
+// Decompresses the bzip2 stream |data| of |size| bytes by decoding each of its
+// blocks, which don't depend on each other, on one of the threads of |pool|.
+// The output of the blocks is stored in |blocks| in order. Returns false if the
+// stream doesn't split into at least two blocks whose checksums match, if a
+// block fails to decode or if the output would be larger than
+// |max_output_size|, in which case the stream has to be decompressed in one
+// go.
+bool BzipDecompressBlocks(const void* data,
+                          size_t size,
+                          size_t max_output_size,
+                          ForkJoinPool* pool,
+                          std::vector<brillo::Blob>* blocks);
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_BZIP_EXTENT_WRITER_H_
@@ -27,6 +27,8 @@
 
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/fork_join_pool.h"
+#include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 
@@ -111,4 +113,59 @@ TEST_F(BzipExtentWriterTest, ChunkedTest) {
   test_utils::ExpectVectorsEq(decompressed_data, output);
 }
 
+TEST_F(BzipExtentWriterTest, DecompressBlocksTest) {
+  // Several blocks of 900 KB.
+  brillo::Blob data(3 * 1024 * 1024);
+  test_utils::FillWithData(&data);
+  brillo::Blob compressed_data;
+  ASSERT_TRUE(BzipCompress(data, &compressed_data));
+
+  ForkJoinPool pool(3);
+  vector<brillo::Blob> blocks;
+  ASSERT_TRUE(BzipDecompressBlocks(compressed_data.data(),
+                                   compressed_data.size(),
+                                   data.size(),
+                                   &pool,
+                                   &blocks));
+  EXPECT_GT(blocks.size(), 1u);
+  brillo::Blob output;
+  for (const brillo::Blob& block : blocks) {
+    output.insert(output.end(), block.begin(), block.end());
+  }
+  test_utils::ExpectVectorsEq(data, output);
+
+  // The output doesn't fit.
+  EXPECT_FALSE(BzipDecompressBlocks(compressed_data.data(),
+                                    compressed_data.size(),
+                                    data.size() - 1,
+                                    &pool,
+                                    &blocks));
+}
+
+TEST_F(BzipExtentWriterTest, DecompressBlocksFailureTest) {
+  ForkJoinPool pool(2);
+  vector<brillo::Blob> blocks;
+  // A single block is left to BzipExtentWriter.
+  brillo::Blob data(1024);
+  test_utils::FillWithData(&data);
+  brillo::Blob compressed_data;
+  ASSERT_TRUE(BzipCompress(data, &compressed_data));
+  EXPECT_FALSE(BzipDecompressBlocks(compressed_data.data(),
+                                    compressed_data.size(),
+                                    data.size(),
+                                    &pool,
+                                    &blocks));
+
+  // A corrupted block fails to decode.
+  data.resize(2 * 1024 * 1024);
+  test_utils::FillWithData(&data);
+  ASSERT_TRUE(BzipCompress(data, &compressed_data));
+  compressed_data[compressed_data.size() / 2] ^= 0x10;
+  EXPECT_FALSE(BzipDecompressBlocks(compressed_data.data(),
+                                    compressed_data.size(),
+                                    data.size(),
+                                    &pool,
+                                    &blocks));
+}
+
 }  // namespace chromeos_update_engine
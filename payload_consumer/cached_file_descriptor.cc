@@ -19,6 +19,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <utility>
 
 #include <base/logging.h>
 
@@ -26,6 +27,28 @@
 
 namespace chromeos_update_engine {
 
+CachedFileDescriptorBase::CachedFileDescriptorBase(size_t cache_size,
+                                                   size_t num_buffers)
+    : cache_(cache_size), num_buffers_(std::max<size_t>(num_buffers, 1)) {
+  for (size_t i = 1; i < num_buffers_; i++)
+    free_buffers_.emplace_back(cache_size);
+}
+
+CachedFileDescriptorBase::~CachedFileDescriptorBase() {
+  StopWorker();
+}
+
+void CachedFileDescriptorBase::StopWorker() {
+  if (!thread_.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  thread_.join();
+}
+
 off64_t CachedFileDescriptorBase::Seek(off64_t offset, int whence) {
   // Only support SEEK_SET and SEEK_CUR. I think these two would be enough. If
   // we want to support SEEK_END then we have to figure out the size of the
@@ -33,7 +56,15 @@ off64_t CachedFileDescriptorBase::Seek(off64_t offset, int whence) {
   CHECK(whence == SEEK_SET || whence == SEEK_CUR);
   off64_t next_offset = whence == SEEK_SET ? offset : offset_ + offset;
 
-  if (next_offset != offset_) {
+  if (next_offset != offset_ && num_buffers_ > 1) {
+    // The worker writes the cached bytes where they go, so there is no need
+    // to wait for it.
+    if (!QueueCache()) {
+      return -1;
+    }
+    offset_ = next_offset;
+    fd_moved_ = true;
+  } else if (next_offset != offset_) {
     // We sought somewhere other than what we are now. So we have to flush and
     // move to the new offset.
     if (!FlushCache()) {
@@ -60,28 +91,63 @@ ssize_t CachedFileDescriptorBase::Write(const void* buf, size_t count) {
              bytes_to_cache);
       total_bytes_wrote += bytes_to_cache;
       bytes_cached_ += bytes_to_cache;
+      offset_ += bytes_to_cache;
     }
     if (bytes_cached_ == cache_.size()) {
       // Cache is full; write it to the |fd_| as long as you can.
-      if (!FlushCache()) {
+      if (!(num_buffers_ > 1 ? QueueCache() : FlushCache())) {
         return -1;
       }
     }
   }
-  offset_ += total_bytes_wrote;
   return total_bytes_wrote;
 }
 
+ssize_t CachedFileDescriptorBase::Read(void* buf, size_t count) {
+  if (!Drain()) {
+    return -1;
+  }
+  return GetFd()->Read(buf, count);
+}
+
+bool CachedFileDescriptorBase::BlkIoctl(int request,
+                                        uint64_t start,
+                                        uint64_t length,
+                                        int* result) {
+  if (!Drain()) {
+    return false;
+  }
+  return GetFd()->BlkIoctl(request, start, length, result);
+}
+
+bool CachedFileDescriptorBase::ReadBatch(
+    const std::vector<FileIoRequest>& requests) {
+  if (!FlushCache()) {
+    return false;
+  }
+  const bool success = GetFd()->ReadBatch(requests);
+  // Later cached writes are flushed at the current position of |GetFd()|, so
+  // put it back where this descriptor expects it to be.
+  if (GetFd()->Seek(offset_, SEEK_SET) != offset_) {
+    return false;
+  }
+  return success;
+}
+
 bool CachedFileDescriptorBase::Flush() {
   return FlushCache() && GetFd()->Flush();
 }
 
 bool CachedFileDescriptorBase::Close() {
+  const bool flushed = FlushCache();
   offset_ = 0;
-  return FlushCache() && GetFd()->Close();
+  return flushed && GetFd()->Close();
 }
 
 bool CachedFileDescriptorBase::FlushCache() {
+  if (num_buffers_ > 1) {
+    return QueueCache() && Drain();
+  }
   size_t begin = 0;
   while (begin < bytes_cached_) {
     auto bytes_wrote =
@@ -96,6 +162,86 @@ bool CachedFileDescriptorBase::FlushCache() {
   return true;
 }
 
+bool CachedFileDescriptorBase::QueueCache() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!failed_ && bytes_cached_ > 0) {
+    if (!thread_.joinable()) {
+      thread_ =
+          std::thread(&CachedFileDescriptorBase::WorkLoop, this, GetFd());
+    }
+    cond_.wait(lock, [this] { return failed_ || !free_buffers_.empty(); });
+  }
+  if (failed_) {
+    errno = error_;
+    return false;
+  }
+  if (bytes_cached_ == 0) {
+    return true;
+  }
+  queue_.push_back({offset_ - static_cast<off64_t>(bytes_cached_),
+                    std::move(cache_),
+                    bytes_cached_});
+  cache_ = std::move(free_buffers_.back());
+  free_buffers_.pop_back();
+  bytes_cached_ = 0;
+  fd_moved_ = true;
+  cond_.notify_all();
+  return true;
+}
+
+bool CachedFileDescriptorBase::Drain() {
+  if (thread_.joinable()) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return queue_.empty() && !busy_; });
+    if (failed_) {
+      errno = error_;
+      return false;
+    }
+  }
+  if (!fd_moved_) {
+    return true;
+  }
+  fd_moved_ = false;
+  const off64_t cache_offset = offset_ - bytes_cached_;
+  return GetFd()->Seek(cache_offset, SEEK_SET) == cache_offset;
+}
+
+void CachedFileDescriptorBase::WorkLoop(FileDescriptor* fd) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cond_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return;
+    }
+    PendingWrite write = std::move(queue_.front());
+    queue_.pop_front();
+    busy_ = true;
+    // Everything queued after a failed write is dropped.
+    const bool skip = failed_;
+    lock.unlock();
+
+    bool success = true;
+    int error = 0;
+    if (!skip) {
+      success = fd->Seek(write.offset, SEEK_SET) == write.offset &&
+                utils::WriteAll(fd, write.data.data(), write.size);
+      error = errno;
+      if (!success) {
+        PLOG(ERROR) << "Failed to flush cached data!";
+      }
+    }
+
+    lock.lock();
+    if (!success && !failed_) {
+      failed_ = true;
+      error_ = error;
+    }
+    free_buffers_.push_back(std::move(write.data));
+    busy_ = false;
+    cond_.notify_all();
+  }
+}
+
 void UnownedCachedFileDescriptor::SetFD(FileDescriptor* fd) {
   fd_ = fd;
 }
@@ -20,7 +20,11 @@
 #include <errno.h>
 #include <sys/types.h>
 
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <brillo/secure_blob.h>
@@ -29,10 +33,20 @@
 
 namespace chromeos_update_engine {
 
+// Caches the writes following each other in the file, writing them out once
+// |cache_size| bytes of them were cached or when writing elsewhere.
+//
+// With |num_buffers| above one, the buffers filled are written out on a
+// worker thread while the next ones are filled, instead of holding up the
+// caller, up to |num_buffers| of |cache_size| bytes each in all. The calls
+// passed through, and Flush(), first wait for the worker to write everything
+// queued, Flush() being the barrier for the data to be on the disk. A write
+// failing on the worker fails the next call made. The underlying descriptor
+// must then only be used through this one.
 class CachedFileDescriptorBase : public FileDescriptor {
  public:
-  explicit CachedFileDescriptorBase(size_t cache_size) : cache_(cache_size) {}
-  ~CachedFileDescriptorBase() override = default;
+  explicit CachedFileDescriptorBase(size_t cache_size, size_t num_buffers = 1);
+  ~CachedFileDescriptorBase() override;
 
   bool Open(const char* path, int flags, mode_t mode) override {
     return GetFd()->Open(path, flags, mode);
@@ -40,41 +54,81 @@ class CachedFileDescriptorBase : public FileDescriptor {
   bool Open(const char* path, int flags) override {
     return GetFd()->Open(path, flags);
   }
-  ssize_t Read(void* buf, size_t count) override {
-    return GetFd()->Read(buf, count);
-  }
+  ssize_t Read(void* buf, size_t count) override;
   ssize_t Write(const void* buf, size_t count) override;
   off64_t Seek(off64_t offset, int whence) override;
   uint64_t BlockDevSize() override { return GetFd()->BlockDevSize(); }
   bool BlkIoctl(int request,
                 uint64_t start,
                 uint64_t length,
-                int* result) override {
-    return GetFd()->BlkIoctl(request, start, length, result);
-  }
+                int* result) override;
   bool Flush() override;
   bool Close() override;
   bool IsSettingErrno() override { return GetFd()->IsSettingErrno(); }
   bool IsOpen() override { return GetFd()->IsOpen(); }
+  // Reads may hit blocks still sitting in the cache, so flush it first.
+  // Writes keep the default implementation, which goes through the cache.
+  bool ReadBatch(const std::vector<FileIoRequest>& requests) override;
 
  protected:
   virtual FileDescriptor* GetFd() = 0;
 
+  // Stops the worker, once it wrote everything queued. Called by the
+  // subclasses using several buffers before their descriptor goes away.
+  void StopWorker();
+
  private:
+  // A buffer queued to be written by the worker.
+  struct PendingWrite {
+    off64_t offset;
+    brillo::Blob data;
+    size_t size;
+  };
+
   // Internal flush without the need to call |fd_->Flush()|.
   bool FlushCache();
 
+  // Hands the cached bytes over to the worker, taking a free buffer in place
+  // of |cache_|, blocking until there is one. Returns false if an earlier
+  // write failed.
+  bool QueueCache();
+
+  // Blocks until the worker wrote everything queued, and puts the underlying
+  // descriptor where writing the cache would start. Returns false if a write
+  // failed.
+  bool Drain();
+
+  void WorkLoop(FileDescriptor* fd);
+
   brillo::Blob cache_;
   size_t bytes_cached_{0};
+  // The offset in the file past the bytes cached.
   off64_t offset_{0};
 
+  const size_t num_buffers_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<PendingWrite> queue_;
+  std::vector<brillo::Blob> free_buffers_;
+  bool busy_{false};
+  bool failed_{false};
+  int error_{0};
+  bool stopping_{false};
+  // Whether the underlying descriptor may not be where writing the cache
+  // would start any more, with the worker writing elsewhere or a seek.
+  bool fd_moved_{false};
+  std::thread thread_;
+
   DISALLOW_COPY_AND_ASSIGN(CachedFileDescriptorBase);
 };
 
 class CachedFileDescriptor final : public CachedFileDescriptorBase {
  public:
-  CachedFileDescriptor(FileDescriptorPtr fd, size_t cache_size)
-      : CachedFileDescriptorBase(cache_size), fd_(fd) {}
+  CachedFileDescriptor(FileDescriptorPtr fd,
+                       size_t cache_size,
+                       size_t num_buffers = 1)
+      : CachedFileDescriptorBase(cache_size, num_buffers), fd_(fd) {}
+  ~CachedFileDescriptor() override { StopWorker(); }
 
  protected:
   virtual FileDescriptor* GetFd() { return fd_.get(); }
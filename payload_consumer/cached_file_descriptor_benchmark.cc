@@ -0,0 +1,80 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// CachedFileDescriptor writing a file in writes of every size, with caches of
+// every size, against writing it directly, as its cache is meant to save the
+// system calls of the small writes of the operations.
+
+#include <fcntl.h>
+
+#include <memory>
+
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/cached_file_descriptor.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kBytesPerIteration = 16 * 1024 * 1024;
+
+bool WriteFile(FileDescriptor* fd, const brillo::Blob& buffer) {
+  if (fd->Seek(0, SEEK_SET) != 0)
+    return false;
+  for (size_t done = 0; done < kBytesPerIteration; done += buffer.size()) {
+    if (fd->Write(buffer.data(), buffer.size()) !=
+        static_cast<ssize_t>(buffer.size())) {
+      return false;
+    }
+  }
+  return fd->Flush();
+}
+
+// The arguments are the size of the writes, then of the cache, or 0 to write
+// to the file directly.
+void BM_CachedFileDescriptorWrite(benchmark::State& state) {
+  ScopedTempFile file("CachedFileDescriptorBenchmark.XXXXXX");
+  auto base_fd = std::make_shared<EintrSafeFileDescriptor>();
+  if (!base_fd->Open(file.path().c_str(), O_RDWR)) {
+    state.SkipWithError("Failed to open the file");
+    return;
+  }
+  std::unique_ptr<CachedFileDescriptor> cached_fd;
+  FileDescriptor* fd = base_fd.get();
+  if (state.range(1) > 0) {
+    cached_fd = std::make_unique<CachedFileDescriptor>(base_fd, state.range(1));
+    fd = cached_fd.get();
+  }
+  const brillo::Blob buffer(state.range(0), 0x5a);
+  for (auto _ : state) {
+    if (!WriteFile(fd, buffer)) {
+      state.SkipWithError("Failed to write the file");
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * kBytesPerIteration);
+}
+
+}  // namespace
+
+BENCHMARK(BM_CachedFileDescriptorWrite)
+    ->ArgsProduct({{512, 4096, 65536, 1 << 20}, {0, 65536, 1 << 20}});
+
+}  // namespace chromeos_update_engine
@@ -43,7 +43,7 @@ const size_t kRandomIterations = 1000;
 class CachedFileDescriptorTest : public ::testing::Test {
  public:
   void Open() {
-    cfd_.reset(new CachedFileDescriptor(fd_, kCacheSize));
+    cfd_.reset(new CachedFileDescriptor(fd_, kCacheSize, num_buffers_));
     EXPECT_TRUE(cfd_->Open(temp_file_.path().c_str(), O_RDWR, 0600));
   }
 
@@ -75,9 +75,16 @@ class CachedFileDescriptorTest : public ::testing::Test {
   FileDescriptorPtr fd_{new EintrSafeFileDescriptor};
   ScopedTempFile temp_file_{"CachedFileDescriptor-file.XXXXXX"};
   int value_{1};
+  size_t num_buffers_{1};
   FileDescriptorPtr cfd_;
 };
 
+// Writes the buffers filled in the background.
+class AsyncCachedFileDescriptorTest : public CachedFileDescriptorTest {
+ public:
+  AsyncCachedFileDescriptorTest() { num_buffers_ = 3; }
+};
+
 TEST_F(CachedFileDescriptorTest, IsOpenTest) {
   EXPECT_TRUE(cfd_->IsOpen());
 }
@@ -201,4 +208,53 @@ TEST_F(CachedFileDescriptorTest, SeekAfterWriteTest) {
   EXPECT_EQ(blob_in, blob_out);
 }
 
+TEST_F(AsyncCachedFileDescriptorTest, RandomWriteTest) {
+  EXPECT_EQ(cfd_->Seek(0, SEEK_SET), 0);
+
+  brillo::Blob blob_in(kFileSize, 0);
+  uint32_t rand_seed = time(nullptr);
+  for (size_t idx = 0; idx < kRandomIterations; idx++) {
+    size_t start = rand_r(&rand_seed) % blob_in.size();
+    size_t size = rand_r(&rand_seed) % (blob_in.size() - start);
+    std::fill_n(&blob_in[start], size, idx % 256);
+    EXPECT_EQ(cfd_->Seek(start, SEEK_SET), static_cast<off64_t>(start));
+    Write(&blob_in[start], size);
+  }
+  // The later writes win over the earlier ones queued before them.
+  EXPECT_TRUE(cfd_->Flush());
+
+  brillo::Blob blob_out;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
+  EXPECT_EQ(blob_in, blob_out);
+}
+
+TEST_F(AsyncCachedFileDescriptorTest, ReadAfterWriteTest) {
+  off64_t seek = 10;
+  brillo::Blob blob_in(kFileSize, 0);
+  std::fill_n(&blob_in[seek], kCacheSize * 5 / 2, value_);
+  EXPECT_EQ(cfd_->Seek(seek, SEEK_SET), seek);
+  Write(&blob_in[seek], kCacheSize * 5 / 2);
+
+  // Reading waits for the queued buffers to be written.
+  EXPECT_EQ(cfd_->Seek(0, SEEK_SET), 0);
+  brillo::Blob blob_out(kFileSize);
+  ssize_t bytes_read = 0;
+  EXPECT_TRUE(
+      utils::ReadAll(cfd_, blob_out.data(), blob_out.size(), 0, &bytes_read));
+  EXPECT_EQ(static_cast<ssize_t>(kFileSize), bytes_read);
+  EXPECT_EQ(blob_in, blob_out);
+}
+
+TEST_F(AsyncCachedFileDescriptorTest, FlushBarrierTest) {
+  brillo::Blob blob_in(kFileSize, value_);
+  EXPECT_EQ(cfd_->Seek(0, SEEK_SET), 0);
+  Write(blob_in.data(), blob_in.size());
+  EXPECT_TRUE(cfd_->Flush());
+
+  // Everything written before Flush() is in the file once it returns.
+  brillo::Blob blob_out;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
+  EXPECT_EQ(blob_in, blob_out);
+}
+
 }  // namespace chromeos_update_engine
@@ -16,6 +16,9 @@
 
 #include "update_engine/payload_consumer/certificate_parser_interface.h"
 
+#include <fcntl.h>
+#include <sys/stat.h>
+
 #include <string>
 
 #include <gmock/gmock.h>
@@ -58,4 +61,27 @@ TEST(CertificateParserAndroidTest, VerifySignature) {
   ASSERT_TRUE(verifier->VerifyRawSignature(sig_blob, hash_blob, nullptr));
 }
 
+TEST(CertificateParserAndroidTest, CachedInstanceFromZipPath) {
+  ScopedTempFile zip_file("otacerts.XXXXXX");
+  std::string zip_data;
+  ASSERT_TRUE(utils::ReadFile(
+      test_utils::GetBuildArtifactsPath(kUnittestOtacertsPath), &zip_data));
+  ASSERT_TRUE(utils::WriteFile(
+      zip_file.path().c_str(), zip_data.data(), zip_data.size()));
+
+  auto verifier =
+      PayloadVerifier::GetCachedInstanceFromZipPath(zip_file.path());
+  ASSERT_TRUE(verifier != nullptr);
+  EXPECT_EQ(verifier,
+            PayloadVerifier::GetCachedInstanceFromZipPath(zip_file.path()));
+
+  // A modified file is parsed again.
+  struct timespec times[2] = {{0, UTIME_NOW}, {12345, 0}};
+  ASSERT_EQ(0, utimensat(AT_FDCWD, zip_file.path().c_str(), times, 0));
+  auto new_verifier =
+      PayloadVerifier::GetCachedInstanceFromZipPath(zip_file.path());
+  ASSERT_TRUE(new_verifier != nullptr);
+  EXPECT_NE(verifier, new_verifier);
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,84 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/checkpoint_committer.h"
+
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/trace.h"
+
+namespace chromeos_update_engine {
+
+CheckpointCommitter::CheckpointCommitter(PrefsInterface* prefs)
+    : prefs_(prefs), thread_(&CheckpointCommitter::WorkLoop, this) {}
+
+CheckpointCommitter::~CheckpointCommitter() {
+  LOG_IF(ERROR, !Wait()) << "Failed to persist the update progress";
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  thread_.join();
+}
+
+void CheckpointCommitter::Commit(PrefsInterface::Changes changes) {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return !pending_ && !busy_; });
+    pending_ = std::move(changes);
+  }
+  cond_.notify_all();
+}
+
+bool CheckpointCommitter::Wait() {
+  UE_TRACE_SCOPE("checkpoint_wait");
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this] { return !pending_ && !busy_; });
+  const bool success = !failed_;
+  failed_ = false;
+  return success;
+}
+
+void CheckpointCommitter::WorkLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cond_.wait(lock, [this] { return stopping_ || pending_; });
+    if (!pending_) {
+      return;
+    }
+    PrefsInterface::Changes changes = std::move(*pending_);
+    pending_.reset();
+    busy_ = true;
+    lock.unlock();
+    bool success;
+    {
+      UE_TRACE_SCOPE("checkpoint_commit");
+      success = prefs_->SetKeys(changes);
+    }
+    lock.lock();
+    busy_ = false;
+    if (!success) {
+      LOG(ERROR) << "Failed to persist the update progress";
+      failed_ = true;
+    }
+    cond_.notify_all();
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,77 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_CHECKPOINT_COMMITTER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_CHECKPOINT_COMMITTER_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+#include <base/macros.h>
+
+#include "update_engine/common/prefs_interface.h"
+
+namespace chromeos_update_engine {
+
+// Persists the checkpoints of the update progress to the prefs on a worker
+// thread, so that applying the next install operations overlaps with the
+// fsync of the prefs journal instead of waiting for it.
+//
+// A checkpoint is a snapshot of the progress taken in memory: the keys to
+// write and their values, which the worker passes to PrefsInterface::SetKeys().
+// The worker doesn't use the prefs transactions, which belong to the thread
+// of the message loop, so the keys that thread changes meanwhile aren't part
+// of the checkpoint, nor lost if it fails. At most one checkpoint is in
+// progress at a time: the next one, and every other change of the progress,
+// first waits for it to complete, so the checkpoints are persisted in order
+// and the progress saved never goes backwards. The caller makes the data of
+// the install operations a checkpoint counts durable before committing it.
+class CheckpointCommitter final {
+ public:
+  explicit CheckpointCommitter(PrefsInterface* prefs);
+  ~CheckpointCommitter();
+
+  // Waits for the checkpoint in progress, then starts persisting |changes| on
+  // the worker thread.
+  void Commit(PrefsInterface::Changes changes);
+
+  // Blocks until the checkpoint in progress, if any, is persisted. Returns
+  // false if one committed since the last call failed.
+  bool Wait();
+
+ private:
+  void WorkLoop();
+
+  PrefsInterface* prefs_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  // The checkpoint to persist, and whether it is being persisted.
+  std::optional<PrefsInterface::Changes> pending_;
+  bool busy_{false};
+  bool failed_{false};
+  bool stopping_{false};
+
+  std::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(CheckpointCommitter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_CHECKPOINT_COMMITTER_H_
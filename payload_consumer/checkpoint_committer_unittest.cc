@@ -0,0 +1,176 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/checkpoint_committer.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <base/files/scoped_temp_dir.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/fake_prefs.h"
+#include "update_engine/common/prefs.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr char kKey[] = "checkpoint-key";
+constexpr char kOtherKey[] = "other-key";
+constexpr char kDeferredKey[] = "deferred-key";
+
+// Records the checkpoints persisted, slower than they are committed so that
+// the next commit has to wait, and fails the next one when asked.
+class RecordingPrefs : public FakePrefs {
+ public:
+  bool SetKeys(const Changes& changes) override {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    written.push_back(*changes.at(kKey));
+    if (fail_next) {
+      fail_next = false;
+      return false;
+    }
+    return FakePrefs::SetKeys(changes);
+  }
+
+  std::vector<std::string> written;
+  bool fail_next{false};
+};
+
+// Holds the checkpoints in SetKeys() until released, then persists them.
+class BlockingPrefs : public Prefs {
+ public:
+  bool SetKeys(const Changes& changes) override {
+    std::unique_lock<std::mutex> lock(mutex_);
+    blocked_ = true;
+    cond_.notify_all();
+    cond_.wait(lock, [this] { return released_; });
+    lock.unlock();
+    return Prefs::SetKeys(changes);
+  }
+
+  void WaitUntilBlocked() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return blocked_; });
+  }
+
+  void Release() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      released_ = true;
+    }
+    cond_.notify_all();
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool blocked_{false};
+  bool released_{false};
+};
+}  // namespace
+
+// The checkpoints are persisted one after the other, in the order committed.
+TEST(CheckpointCommitterTest, PersistsInOrderTest) {
+  RecordingPrefs prefs;
+  {
+    CheckpointCommitter committer(&prefs);
+    for (int64_t i = 1; i <= 10; i++) {
+      committer.Commit({{kKey, std::to_string(i)}});
+    }
+    EXPECT_TRUE(committer.Wait());
+    int64_t value = 0;
+    EXPECT_TRUE(prefs.GetInt64(kKey, &value));
+    EXPECT_EQ(10, value);
+  }
+  EXPECT_EQ((std::vector<std::string>{
+                "1", "2", "3", "4", "5", "6", "7", "8", "9", "10"}),
+            prefs.written);
+}
+
+// A checkpoint failing is reported once, by the next Wait().
+TEST(CheckpointCommitterTest, ReportsFailureTest) {
+  RecordingPrefs prefs;
+  prefs.fail_next = true;
+  CheckpointCommitter committer(&prefs);
+  committer.Commit({{kKey, "1"}});
+  committer.Commit({{kKey, "2"}});
+  EXPECT_FALSE(committer.Wait());
+  EXPECT_TRUE(committer.Wait());
+  int64_t value = 0;
+  EXPECT_TRUE(prefs.GetInt64(kKey, &value));
+  EXPECT_EQ(2, value);
+}
+
+// The destructor persists the checkpoint in progress.
+TEST(CheckpointCommitterTest, DestructorWaitsTest) {
+  RecordingPrefs prefs;
+  {
+    CheckpointCommitter committer(&prefs);
+    committer.Commit({{kKey, "1"}});
+  }
+  EXPECT_TRUE(prefs.Exists(kKey));
+}
+
+// The keys written on the thread of the message loop while a checkpoint is
+// persisted, off it, are persisted besides it.
+TEST(CheckpointCommitterTest, MainThreadWritesDuringCommitTest) {
+  brillo::FakeMessageLoop loop(nullptr);
+  loop.SetAsCurrent();
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  {
+    BlockingPrefs prefs;
+    ASSERT_TRUE(prefs.Init(temp_dir.GetPath()));
+    prefs.SetDurability(kDeferredKey, PrefsInterface::Durability::kDeferred);
+    // Schedules the flush of the deferred writes on the loop.
+    EXPECT_TRUE(prefs.SetInt64(kDeferredKey, 1));
+    EXPECT_TRUE(loop.PendingTasks());
+
+    CheckpointCommitter committer(&prefs);
+    committer.Commit({{kKey, "1"}});
+    prefs.WaitUntilBlocked();
+    EXPECT_TRUE(prefs.SetInt64(kOtherKey, 2));
+    EXPECT_TRUE(prefs.SetInt64(kDeferredKey, 3));
+    prefs.Release();
+    EXPECT_TRUE(committer.Wait());
+
+    int64_t value = 0;
+    EXPECT_TRUE(prefs.GetInt64(kOtherKey, &value));
+    EXPECT_EQ(2, value);
+    EXPECT_TRUE(prefs.GetInt64(kDeferredKey, &value));
+    EXPECT_EQ(3, value);
+    EXPECT_TRUE(prefs.GetInt64(kKey, &value));
+    EXPECT_EQ(1, value);
+  }
+  EXPECT_FALSE(loop.PendingTasks());
+
+  Prefs prefs;
+  ASSERT_TRUE(prefs.Init(temp_dir.GetPath()));
+  int64_t value = 0;
+  EXPECT_TRUE(prefs.GetInt64(kOtherKey, &value));
+  EXPECT_EQ(2, value);
+  EXPECT_TRUE(prefs.GetInt64(kDeferredKey, &value));
+  EXPECT_EQ(3, value);
+  EXPECT_TRUE(prefs.GetInt64(kKey, &value));
+  EXPECT_EQ(1, value);
+}
+
+}  // namespace chromeos_update_engine
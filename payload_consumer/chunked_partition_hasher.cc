@@ -0,0 +1,133 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/chunked_partition_hasher.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/trace.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// The size of a SHA-256 hash.
+constexpr size_t kHashSize = 32;
+}  // namespace
+
+ChunkedPartitionHasher::ChunkedPartitionHasher(std::string path,
+                                               uint64_t size,
+                                               uint64_t chunk_size,
+                                               size_t num_workers,
+                                               bool use_direct_io)
+    : path_(std::move(path)),
+      size_(size),
+      chunk_size_(chunk_size),
+      num_chunks_(chunk_size > 0 ? utils::DivRoundUp(size, chunk_size) : 0),
+      use_direct_io_(use_direct_io),
+      chunk_hashes_(num_chunks_ * kHashSize) {
+  if (chunk_size_ == 0) {
+    LOG(ERROR) << "Invalid hash chunk size 0";
+    failed_ = true;
+    return;
+  }
+  num_workers = std::max<size_t>(
+      std::min<uint64_t>(num_workers, num_chunks_), 1);
+  for (size_t i = 0; i < num_workers; i++) {
+    workers_.emplace_back(&ChunkedPartitionHasher::WorkerLoop, this);
+  }
+}
+
+ChunkedPartitionHasher::~ChunkedPartitionHasher() {
+  cancelled_ = true;
+  Wait();
+}
+
+bool ChunkedPartitionHasher::HashFile(const std::string& path,
+                                      uint64_t size,
+                                      uint64_t chunk_size,
+                                      size_t num_workers,
+                                      brillo::Blob* hash) {
+  ChunkedPartitionHasher hasher(path, size, chunk_size, num_workers);
+  hasher.Wait();
+  return hasher.GetHash(hash);
+}
+
+void ChunkedPartitionHasher::Wait() {
+  for (auto& worker : workers_) {
+    if (worker.joinable())
+      worker.join();
+  }
+}
+
+bool ChunkedPartitionHasher::GetHash(brillo::Blob* hash) const {
+  CHECK(IsDone());
+  TEST_AND_RETURN_FALSE(!failed_);
+  return HashCalculator::RawHashOfData(chunk_hashes_, hash);
+}
+
+void ChunkedPartitionHasher::WorkerLoop() {
+  if (!HashChunks())
+    failed_ = true;
+  num_workers_done_++;
+}
+
+bool ChunkedPartitionHasher::HashChunks() {
+  std::unique_ptr<EintrSafeFileDescriptor> fd;
+  if (use_direct_io_) {
+    fd = std::make_unique<DirectIoFileDescriptor>();
+  } else {
+    fd = std::make_unique<EintrSafeFileDescriptor>();
+  }
+  if (!fd->Open(path_.c_str(), O_RDONLY)) {
+    PLOG(ERROR) << "Unable to open " << path_ << " for reading.";
+    return false;
+  }
+  brillo::Blob chunk(std::min(chunk_size_, size_));
+  while (!cancelled_ && !failed_) {
+    const uint64_t index = next_++;
+    if (index >= num_chunks_)
+      return true;
+    UE_TRACE_SCOPE("hash_chunk");
+    const uint64_t offset = index * chunk_size_;
+    const size_t length = std::min(chunk_size_, size_ - offset);
+    ssize_t bytes_read = 0;
+    if (!utils::PReadAll(fd.get(), chunk.data(), length, offset, &bytes_read) ||
+        static_cast<size_t>(bytes_read) != length) {
+      LOG(ERROR) << "Failed to read " << length << " bytes at " << offset
+                 << " of " << path_;
+      return false;
+    }
+    brillo::Blob hash;
+    TEST_AND_RETURN_FALSE(
+        HashCalculator::RawHashOfBytes(chunk.data(), length, &hash));
+    TEST_AND_RETURN_FALSE(hash.size() == kHashSize);
+    std::copy(
+        hash.begin(), hash.end(), chunk_hashes_.begin() + index * kHashSize);
+    bytes_hashed_ += length;
+  }
+  return !cancelled_ && !failed_;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,98 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_CHUNKED_PARTITION_HASHER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_CHUNKED_PARTITION_HASHER_H_
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// Computes the chunked hash of the first |size| bytes of a partition: the
+// SHA-256 of the SHA-256 hashes of its consecutive chunks of |chunk_size|
+// bytes, the last one possibly shorter, as in PartitionInfo.chunked_hash.
+// Unlike the SHA-256 of the whole partition, the chunks are read and hashed
+// in any order, here on |num_workers| worker threads with an fd each, taking
+// the next chunk not started yet as they become idle. With |use_direct_io|,
+// the partition is read with O_DIRECT.
+class ChunkedPartitionHasher {
+ public:
+  static constexpr uint64_t kDefaultChunkSize = 2 * 1024 * 1024;  // bytes
+
+  ChunkedPartitionHasher(std::string path,
+                         uint64_t size,
+                         uint64_t chunk_size,
+                         size_t num_workers,
+                         bool use_direct_io = false);
+  // Cancels the hashing if still running and waits for the workers.
+  ~ChunkedPartitionHasher();
+
+  // Computes the chunked hash of |path| on |num_workers| threads, returning
+  // once done.
+  static bool HashFile(const std::string& path,
+                       uint64_t size,
+                       uint64_t chunk_size,
+                       size_t num_workers,
+                       brillo::Blob* hash);
+
+  // Number of bytes hashed so far.
+  uint64_t bytes_hashed() const { return bytes_hashed_; }
+
+  // Whether all the chunks have been hashed, or the hashing failed.
+  bool IsDone() const { return num_workers_done_ == workers_.size(); }
+
+  // Waits for the workers to be done.
+  void Wait();
+
+  // Returns the chunked hash in |*hash|, or false if the partition couldn't
+  // be hashed. Only valid once IsDone().
+  bool GetHash(brillo::Blob* hash) const;
+
+ private:
+  void WorkerLoop();
+  bool HashChunks();
+
+  const std::string path_;
+  const uint64_t size_;
+  const uint64_t chunk_size_;
+  const uint64_t num_chunks_;
+  const bool use_direct_io_;
+
+  // The hashes of the chunks, one after the other. Each one is only written
+  // by the worker hashing that chunk.
+  brillo::Blob chunk_hashes_;
+
+  // The next chunk to hash.
+  std::atomic<uint64_t> next_{0};
+  std::atomic<size_t> num_workers_done_{0};
+  std::atomic<uint64_t> bytes_hashed_{0};
+  std::atomic<bool> failed_{false};
+  std::atomic<bool> cancelled_{false};
+
+  std::vector<std::thread> workers_;
+
+  DISALLOW_COPY_AND_ASSIGN(ChunkedPartitionHasher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_CHUNKED_PARTITION_HASHER_H_
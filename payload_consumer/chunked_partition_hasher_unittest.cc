@@ -0,0 +1,111 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/chunked_partition_hasher.h"
+
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// The chunked hash of the first |size| bytes of |data|, computed in order.
+brillo::Blob ExpectedChunkedHash(const brillo::Blob& data,
+                                 size_t size,
+                                 size_t chunk_size) {
+  brillo::Blob chunk_hashes;
+  for (size_t offset = 0; offset < size; offset += chunk_size) {
+    brillo::Blob hash;
+    EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+        data.data() + offset, std::min(chunk_size, size - offset), &hash));
+    chunk_hashes.insert(chunk_hashes.end(), hash.begin(), hash.end());
+  }
+  brillo::Blob hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(chunk_hashes, &hash));
+  return hash;
+}
+}  // namespace
+
+TEST(ChunkedPartitionHasherTest, HashesChunksTest) {
+  ScopedTempFile file("hasher_part.XXXXXX");
+  brillo::Blob data(1024 * 1024);
+  test_utils::FillWithData(&data);
+  ASSERT_TRUE(test_utils::WriteFileVector(file.path(), data));
+
+  ChunkedPartitionHasher hasher(file.path(), data.size(), 64 * 1024, 3);
+  hasher.Wait();
+  ASSERT_TRUE(hasher.IsDone());
+  EXPECT_EQ(data.size(), hasher.bytes_hashed());
+  brillo::Blob hash;
+  ASSERT_TRUE(hasher.GetHash(&hash));
+  EXPECT_EQ(ExpectedChunkedHash(data, data.size(), 64 * 1024), hash);
+}
+
+TEST(ChunkedPartitionHasherTest, ShorterLastChunkTest) {
+  ScopedTempFile file("hasher_part.XXXXXX");
+  brillo::Blob data(300 * 1024 + 17);
+  test_utils::FillWithData(&data);
+  ASSERT_TRUE(test_utils::WriteFileVector(file.path(), data));
+  // Only hash a prefix of the file.
+  const size_t size = data.size() - 1000;
+
+  brillo::Blob hash;
+  ASSERT_TRUE(
+      ChunkedPartitionHasher::HashFile(file.path(), size, 64 * 1024, 4, &hash));
+  EXPECT_EQ(ExpectedChunkedHash(data, size, 64 * 1024), hash);
+
+  // The chunk size is part of the hash.
+  brillo::Blob other_hash;
+  ASSERT_TRUE(ChunkedPartitionHasher::HashFile(
+      file.path(), size, 128 * 1024, 4, &other_hash));
+  EXPECT_NE(hash, other_hash);
+}
+
+TEST(ChunkedPartitionHasherTest, DirectIoTest) {
+  ScopedTempFile file("hasher_part.XXXXXX");
+  brillo::Blob data(1024 * 1024 + 17);
+  test_utils::FillWithData(&data);
+  ASSERT_TRUE(test_utils::WriteFileVector(file.path(), data));
+
+  ChunkedPartitionHasher hasher(file.path(), data.size(), 256 * 1024, 2, true);
+  hasher.Wait();
+  brillo::Blob hash;
+  ASSERT_TRUE(hasher.GetHash(&hash));
+  EXPECT_EQ(ExpectedChunkedHash(data, data.size(), 256 * 1024), hash);
+}
+
+TEST(ChunkedPartitionHasherTest, ShortFileTest) {
+  ScopedTempFile file("hasher_part.XXXXXX");
+  brillo::Blob data(4096);
+  test_utils::FillWithData(&data);
+  ASSERT_TRUE(test_utils::WriteFileVector(file.path(), data));
+
+  ChunkedPartitionHasher hasher(file.path(), 2 * data.size(), 1024, 2);
+  hasher.Wait();
+  ASSERT_TRUE(hasher.IsDone());
+  brillo::Blob hash;
+  EXPECT_FALSE(hasher.GetHash(&hash));
+}
+
+}  // namespace chromeos_update_engine
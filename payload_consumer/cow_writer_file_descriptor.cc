@@ -22,6 +22,7 @@
 
 #include <base/logging.h>
 
+#include "update_engine/common/trace.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 
@@ -86,6 +87,7 @@ ssize_t CowWriterFileDescriptor::Read(void* buf, size_t count) {
 ssize_t CowWriterFileDescriptor::Write(const void* buf, size_t count) {
   auto offset = cow_reader_->Seek(0, SEEK_CUR);
   CHECK_EQ(offset % cow_writer_->GetBlockSize(), 0);
+  UE_TRACE_SCOPE("cow_write");
   auto success = cow_writer_->AddRawBlocks(
       offset / cow_writer_->GetBlockSize(), buf, count);
   if (success) {
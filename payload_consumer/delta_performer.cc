@@ -17,10 +17,12 @@
 #include "update_engine/payload_consumer/delta_performer.h"
 
 #include <linux/fs.h>
+#include <sys/statvfs.h>
 
 #include <algorithm>
 #include <chrono>
 #include <cstring>
+#include <future>
 #include <memory>
 #include <set>
 #include <string>
@@ -39,6 +41,7 @@
 #include <bsdiff/bspatch.h>
 #include <google/protobuf/repeated_field.h>
 #include <puffin/puffpatch.h>
+#include <verity/hash_tree_builder.h>
 
 #include "libsnapshot/cow_format.h"
 #include "update_engine/common/constants.h"
@@ -46,11 +49,19 @@
 #include "update_engine/common/error_code.h"
 #include "update_engine/common/error_code_utils.h"
 #include "update_engine/common/hardware_interface.h"
+#include "update_engine/common/payload_spill_cache.h"
 #include "update_engine/common/prefs_interface.h"
 #include "update_engine/common/terminator.h"
+#include "update_engine/common/trace.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/apply_hints.h"
+#include "update_engine/payload_consumer/operations_section.h"
+#include "update_engine/payload_consumer/packed_extents.h"
+#include "update_engine/payload_consumer/parallel_hash_tree_builder.h"
+#include "update_engine/payload_consumer/parallel_partition_hasher.h"
 #include "update_engine/payload_consumer/partition_update_generator_interface.h"
 #include "update_engine/payload_consumer/partition_writer.h"
+#include "update_engine/payload_consumer/source_hash_index.h"
 #include "update_engine/update_metadata.pb.h"
 #if USE_FEC
 #include "update_engine/payload_consumer/fec_file_descriptor.h"
@@ -69,10 +80,31 @@ const unsigned DeltaPerformer::kProgressLogTimeoutSeconds = 30;
 const unsigned DeltaPerformer::kProgressDownloadWeight = 50;
 const unsigned DeltaPerformer::kProgressOperationsWeight = 50;
 const uint64_t DeltaPerformer::kCheckpointFrequencySeconds = 1;
+const uint64_t DeltaPerformer::kMinStreamedReplaceSize = 1024 * 1024;  // 1 MiB
+const size_t DeltaPerformer::kQueuedBytesHighWatermark = 24 * 1024 * 1024;
+const size_t DeltaPerformer::kQueuedBytesLowWatermark = 8 * 1024 * 1024;
+const uint64_t DeltaPerformer::kMinFreeSpaceAfterUncompressedCow =
+    4ULL * 1024 * 1024 * 1024;  // 4 GiB
 
 namespace {
 const int kUpdateStateOperationInvalid = -1;
 const int kMaxResumedUpdateFailures = 10;
+// Upper bound on the operation data held by the install operation pipeline.
+const size_t kPipelineMaxBytesInFlight = 32 * 1024 * 1024;
+// The bound once the memory pressure is critical, enough for the typical
+// operation to still be queued while the previous one is applied.
+const size_t kPipelineMinBytesInFlight = 2 * 1024 * 1024;
+// The memory the apply workers may take together, by the peak apply memory
+// the generator hints for the operations of the partition.
+const uint64_t kApplyMemoryBudget = 256 * 1024 * 1024;
+// How often the memory pressure is read while applying the payload.
+constexpr base::TimeDelta kMemoryPressureCheckInterval =
+    base::TimeDelta::FromSeconds(1);
+// Upper bound on the number of ZERO and DISCARD operations applied together,
+// so that the progress still gets checkpointed along the way.
+const size_t kMaxZeroOrDiscardBatchSize = 1024;
+// The filesystem holding the COW images of the snapshots not fitting in super.
+constexpr char kCowImagesFilesystem[] = "/data";
 
 }  // namespace
 
@@ -204,13 +236,27 @@ int DeltaPerformer::Close() {
   // Checkpoint update progress before canceling, so that subsequent attempts
   // can resume from exactly where update_engine left last time.
   CheckpointUpdateProgress(true);
+  const bool discard_replace = replace_writer_ != nullptr;
+  if (discard_replace) {
+    LOG(INFO) << "Discarding partially applied operation "
+              << next_operation_num_ << " after " << replace_bytes_written_
+              << " bytes";
+    replace_writer_.reset();
+  }
   int err = -CloseCurrentPartition();
+  // The writer opened ahead is closed with the partitions it never got to.
+  if (next_partition_writer_.valid()) {
+    next_partition_writer_.get();
+  }
+  // No operation is in flight anymore.
+  install_plan_->operation_stats.Merge(operation_tracer_.TakeStats());
   LOG_IF(ERROR,
          !payload_hash_calculator_.Finalize() ||
              !signed_hash_calculator_.Finalize())
       << "Unable to finalize the hash.";
-  if (!buffer_.empty()) {
-    LOG(INFO) << "Discarding " << buffer_.size() << " unused downloaded bytes";
+  if (!buffer_.empty() || discard_replace) {
+    LOG_IF(INFO, !buffer_.empty())
+        << "Discarding " << buffer_.size() << " unused downloaded bytes";
     if (err >= 0)
       err = 1;
   }
@@ -221,11 +267,143 @@ int DeltaPerformer::CloseCurrentPartition() {
   if (!partition_writer_) {
     return 0;
   }
+  if (pipeline_) {
+    // Queued operations may still reference the writers.
+    pipeline_->Drain();
+  }
+  RecordCopiedPartitionHash();
   int err = partition_writer_->Close();
   partition_writer_ = nullptr;
+  for (auto& writer : worker_partition_writers_) {
+    const int worker_err = writer->Close();
+    if (err >= 0)
+      err = worker_err;
+  }
+  worker_partition_writers_.clear();
   return err;
 }
 
+void DeltaPerformer::RecordCopiedPartitionHash() {
+  if (current_partition_ >= partitions_.size())
+    return;
+  size_t num_previous_partitions =
+      install_plan_->partitions.size() - partitions_.size();
+  InstallPlan::Partition& install_part =
+      install_plan_->partitions[num_previous_partitions + current_partition_];
+  if (!install_part.untouched)
+    return;
+  brillo::Blob hash;
+  for (auto writer : GetPartitionWriters()) {
+    if (writer->GetCopiedPartitionHash(&hash)) {
+      install_part.source_hash = hash;
+      install_part.target_hash = std::move(hash);
+      return;
+    }
+  }
+}
+
+bool DeltaPerformer::HashAppliedUntouchedPartitions(
+    uint64_t num_applied_operations) {
+  size_t num_previous_partitions =
+      install_plan_->partitions.size() - partitions_.size();
+  uint64_t num_operations = 0;
+  for (size_t i = 0; i < partitions_.size(); i++) {
+    num_operations += GetNumOperations(partitions_[i]);
+    if (num_operations > num_applied_operations)
+      break;
+    InstallPlan::Partition& install_part =
+        install_plan_->partitions[num_previous_partitions + i];
+    if (!install_part.untouched || !install_part.target_hash.empty())
+      continue;
+    LOG(INFO) << "Hashing untouched partition " << install_part.name
+              << " copied before resuming";
+    brillo::Blob hash;
+    if (HashCalculator::RawHashOfFile(install_part.source_path,
+                                      install_part.source_size,
+                                      &hash,
+                                      install_part.hash_algorithm) !=
+        static_cast<off_t>(install_part.source_size)) {
+      LOG(ERROR) << "Failed to hash " << install_part.source_path;
+      return false;
+    }
+    install_part.source_hash = hash;
+    install_part.target_hash = std::move(hash);
+  }
+  return true;
+}
+
+void DeltaPerformer::StartHashingCurrentPartition() {
+  if (!install_plan_->overlap_verification ||
+      current_partition_ >= partitions_.size()) {
+    return;
+  }
+  size_t num_previous_partitions =
+      install_plan_->partitions.size() - partitions_.size();
+  InstallPlan::Partition& install_part =
+      install_plan_->partitions[num_previous_partitions + current_partition_];
+  if (install_part.target_path.empty() || install_part.target_size == 0) {
+    return;
+  }
+  // The verity data of the partition is only written once it is verified,
+  // and a VABC snapshot is only readable once all the partitions are written.
+  if (install_plan_->write_verity && !install_part.verity_data_in_payload &&
+      (install_part.hash_tree_size > 0 || install_part.fec_size > 0)) {
+    return;
+  }
+  auto dynamic_control = boot_control_->GetDynamicPartitionControl();
+  if (dynamic_control->UpdateUsesSnapshotCompression() &&
+      IsDynamicPartition(install_part.name, install_plan_->target_slot)) {
+    return;
+  }
+  LOG(INFO) << "Hashing partition " << install_part.name
+            << " in the background";
+  install_part.target_hasher = std::make_shared<ParallelPartitionHasher>(
+      std::vector<ParallelPartitionHasher::Partition>{
+          {install_part.target_path,
+           install_part.target_size,
+           install_part.hash_algorithm}},
+      1,
+      install_plan_->use_direct_io);
+}
+
+void DeltaPerformer::StartInlineHashTree(size_t next_op_index) {
+  size_t num_previous_partitions =
+      install_plan_->partitions.size() - partitions_.size();
+  InstallPlan::Partition& install_part =
+      install_plan_->partitions[num_previous_partitions + current_partition_];
+  install_part.inline_hash_tree_builder.reset();
+  // The blocks written before resuming aren't hashed.
+  if (!install_plan_->inline_hash_tree ||
+      !install_plan_->verity_root_verification || next_op_index > 0 ||
+      (install_plan_->is_resume && install_plan_->resume_operation_bytes > 0) ||
+      !install_plan_->write_verity || install_part.verity_data_in_payload ||
+      install_part.hash_tree_size == 0 ||
+      install_part.update_hash_tree_from_source) {
+    return;
+  }
+  auto dynamic_control = boot_control_->GetDynamicPartitionControl();
+  if (!dynamic_control->UpdateUsesSnapshotCompression() ||
+      !IsDynamicPartition(install_part.name, install_plan_->target_slot)) {
+    return;
+  }
+  const EVP_MD* md =
+      HashTreeBuilder::HashFunction(install_part.hash_tree_algorithm);
+  if (md == nullptr) {
+    return;
+  }
+  // The writers hash the blocks on their own thread.
+  auto builder = std::make_shared<ParallelHashTreeBuilder>(
+      install_part.block_size, md, 1);
+  if (install_part.hash_tree_data_offset % install_part.block_size != 0 ||
+      !builder->Initialize(install_part.hash_tree_data_size,
+                           install_part.hash_tree_salt)) {
+    return;
+  }
+  LOG(INFO) << "Building the hash tree of " << install_part.name
+            << " while writing it";
+  install_part.inline_hash_tree_builder = std::move(builder);
+}
+
 bool DeltaPerformer::OpenCurrentPartition() {
   if (current_partition_ >= partitions_.size())
     return false;
@@ -236,25 +414,159 @@ bool DeltaPerformer::OpenCurrentPartition() {
   const InstallPlan::Partition& install_part =
       install_plan_->partitions[num_previous_partitions + current_partition_];
   auto dynamic_control = boot_control_->GetDynamicPartitionControl();
-  partition_writer_ = CreatePartitionWriter(
-      partition,
-      install_part,
-      dynamic_control,
-      block_size_,
-      interactive_,
-      IsDynamicPartition(install_part.name, install_plan_->target_slot));
+  const size_t puffpatch_cache_budget = GetPuffpatchCacheBudget();
   // Open source fds if we have a delta payload, or for partitions in the
   // partial update.
   const bool source_may_exist = manifest_.partial_update() ||
                                 payload_->type == InstallPayloadType::kDelta;
   const size_t partition_operation_num = GetPartitionOperationNum();
 
-  TEST_AND_RETURN_FALSE(partition_writer_->Init(
-      install_plan_, source_may_exist, partition_operation_num));
+  partition_writer_ = TakeNextPartitionWriter();
+  if (partition_writer_) {
+    LOG(INFO) << "Using the writer of " << partition.partition_name()
+              << " opened while applying the previous partition";
+  } else {
+    StartInlineHashTree(partition_operation_num);
+    partition_writer_ = CreatePartitionWriter(
+        partition,
+        install_part,
+        dynamic_control,
+        block_size_,
+        interactive_,
+        IsDynamicPartition(install_part.name, install_plan_->target_slot));
+    partition_writer_->SetPuffpatchCacheBudget(puffpatch_cache_budget);
+
+    // Give every extra apply worker its own writer, so that operations
+    // touching different blocks don't serialize on a single writer. Not
+    // worth it when the hints tell that the operations all depend on the
+    // previous one.
+    if (install_plan_->pipelined_apply && install_plan_->apply_workers > 1 &&
+        HasConcurrentOperations(partition) &&
+        partition_writer_->EnableConcurrentOperations()) {
+      for (size_t i = 1; i < install_plan_->apply_workers; i++) {
+        auto writer = CreatePartitionWriter(
+            partition,
+            install_part,
+            dynamic_control,
+            block_size_,
+            interactive_,
+            IsDynamicPartition(install_part.name, install_plan_->target_slot));
+        TEST_AND_RETURN_FALSE(writer->EnableConcurrentOperations());
+        writer->SetPuffpatchCacheBudget(puffpatch_cache_budget);
+        TEST_AND_RETURN_FALSE(writer->Init(
+            install_plan_, source_may_exist, partition_operation_num));
+        worker_partition_writers_.push_back(std::move(writer));
+      }
+      LOG(INFO) << "Applying operations to " << partition.partition_name()
+                << " with " << install_plan_->apply_workers << " writers";
+    }
+
+    TEST_AND_RETURN_FALSE(partition_writer_->Init(
+        install_plan_, source_may_exist, partition_operation_num));
+  }
+  if (pipeline_) {
+    // The operations of this partition may take more or less memory.
+    pipeline_->SetLimits(GetPipelineMaxBytesInFlight(),
+                         GetPipelineApplyWorkers());
+  }
+  OpenNextPartitionWriter(source_may_exist, puffpatch_cache_budget);
   CheckpointUpdateProgress(true);
   return true;
 }
 
+void DeltaPerformer::OpenNextPartitionWriter(bool source_may_exist,
+                                             size_t puffpatch_cache_budget) {
+  // The next partition with operations, skipping those without any like
+  // Write() does.
+  size_t next_partition = current_partition_ + 1;
+  while (next_partition < partitions_.size() &&
+         acc_num_operations_[next_partition] ==
+             acc_num_operations_[next_partition - 1]) {
+    next_partition++;
+  }
+  if (next_partition >= partitions_.size()) {
+    return;
+  }
+  // The operations of the next partition aren't known before its turn.
+  if (HasPendingOperationsSection(partitions_[next_partition])) {
+    return;
+  }
+  // The writers of the extra apply workers are set up together with the
+  // first one.
+  if (install_plan_->pipelined_apply && install_plan_->apply_workers > 1) {
+    return;
+  }
+  const PartitionUpdate& partition = partitions_[next_partition];
+  const size_t num_previous_partitions =
+      install_plan_->partitions.size() - partitions_.size();
+  const InstallPlan::Partition& install_part =
+      install_plan_->partitions[num_previous_partitions + next_partition];
+  auto dynamic_control = boot_control_->GetDynamicPartitionControl();
+  const bool is_dynamic_partition =
+      IsDynamicPartition(install_part.name, install_plan_->target_slot);
+  // Opening a VABC writer goes through the snapshot manager, which only the
+  // thread applying the operations uses.
+  if (dynamic_control && dynamic_control->UpdateUsesSnapshotCompression() &&
+      is_dynamic_partition) {
+    return;
+  }
+
+  next_writer_partition_ = next_partition;
+  next_partition_writer_ = std::async(
+      std::launch::async,
+      [&partition,
+       &install_part,
+       dynamic_control,
+       block_size = block_size_,
+       interactive = interactive_,
+       is_dynamic_partition,
+       install_plan = install_plan_,
+       source_may_exist,
+       puffpatch_cache_budget]() -> std::unique_ptr<PartitionWriterInterface> {
+        UE_TRACE_SCOPE("open_next_partition");
+        auto writer = CreatePartitionWriter(partition,
+                                            install_part,
+                                            dynamic_control,
+                                            block_size,
+                                            interactive,
+                                            is_dynamic_partition);
+        writer->SetPuffpatchCacheBudget(puffpatch_cache_budget);
+        // Partitions are applied from their first operation, the progress
+        // only resumes in the middle of the current one.
+        if (!writer->Init(install_plan, source_may_exist, 0)) {
+          LOG(WARNING) << "Unable to open " << partition.partition_name()
+                       << " ahead, opening it once its turn comes";
+          return nullptr;
+        }
+        return writer;
+      });
+}
+
+std::unique_ptr<PartitionWriterInterface>
+DeltaPerformer::TakeNextPartitionWriter() {
+  if (!next_partition_writer_.valid()) {
+    return nullptr;
+  }
+  auto writer = next_partition_writer_.get();
+  if (next_writer_partition_ != current_partition_ ||
+      GetPartitionOperationNum() != 0) {
+    return nullptr;
+  }
+  return writer;
+}
+
+std::vector<PartitionWriterInterface*> DeltaPerformer::GetPartitionWriters()
+    const {
+  std::vector<PartitionWriterInterface*> writers;
+  if (partition_writer_) {
+    writers.push_back(partition_writer_.get());
+  }
+  for (const auto& writer : worker_partition_writers_) {
+    writers.push_back(writer.get());
+  }
+  return writers;
+}
+
 size_t DeltaPerformer::GetPartitionOperationNum() {
   return next_operation_num_ -
          (current_partition_ ? acc_num_operations_[current_partition_ - 1] : 0);
@@ -279,6 +591,33 @@ void LogPartitionInfo(const vector<PartitionUpdate>& partitions) {
   }
 }
 
+// The manifest last parsed in this process, and the hash of the metadata it
+// was parsed from. Attempts to apply the same payload again, such as resumes
+// and retries, copy it rather than parsing the metadata again, which takes
+// a while for payloads with many operations.
+struct ParsedManifest {
+  brillo::Blob metadata_hash;
+  DeltaArchiveManifest manifest;
+};
+
+ParsedManifest* GetParsedManifest() {
+  static ParsedManifest* parsed_manifest = new ParsedManifest();
+  return parsed_manifest;
+}
+
+void ReleaseParsedManifest() {
+  ParsedManifest* parsed_manifest = GetParsedManifest();
+  parsed_manifest->metadata_hash.clear();
+  // Swapped out rather than cleared, to free its memory.
+  DeltaArchiveManifest().Swap(&parsed_manifest->manifest);
+}
+
+// Frees the elements of |field|, which Clear() keeps allocated for reuse.
+template <typename T>
+void ReleaseRepeatedField(google::protobuf::RepeatedPtrField<T>* field) {
+  google::protobuf::RepeatedPtrField<T>().Swap(field);
+}
+
 }  // namespace
 
 bool DeltaPerformer::IsHeaderParsed() const {
@@ -380,10 +719,27 @@ MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
   }
 
   // The payload metadata is deemed valid, it's safe to parse the protobuf.
-  if (!payload_metadata_.GetManifest(payload, &manifest_)) {
-    LOG(ERROR) << "Unable to parse manifest in update file.";
-    *error = ErrorCode::kDownloadManifestParseError;
-    return MetadataParseResult::kError;
+  // The signature was checked anyway, the metadata only has to be the same
+  // for the manifest parsed before to be used.
+  ParsedManifest* parsed_manifest = GetParsedManifest();
+  brillo::Blob metadata_hash;
+  if (!HashCalculator::RawHashOfBytes(payload.data(),
+                                      metadata_size_ + metadata_signature_size_,
+                                      &metadata_hash)) {
+    metadata_hash.clear();
+  }
+  if (!metadata_hash.empty() &&
+      metadata_hash == parsed_manifest->metadata_hash) {
+    LOG(INFO) << "Using the manifest parsed by a previous attempt.";
+    manifest_ = parsed_manifest->manifest;
+  } else {
+    if (!payload_metadata_.GetManifest(payload, &manifest_)) {
+      LOG(ERROR) << "Unable to parse manifest in update file.";
+      *error = ErrorCode::kDownloadManifestParseError;
+      return MetadataParseResult::kError;
+    }
+    parsed_manifest->metadata_hash = std::move(metadata_hash);
+    parsed_manifest->manifest = manifest_;
   }
 
   manifest_parsed_ = true;
@@ -453,6 +809,15 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
   total_bytes_received_ += count;
   UpdateOverallProgress(false, "Completed ");
 
+  if (!manifest_valid_ && !prewarm_started_) {
+    // What doesn't depend on the manifest is done while receiving it.
+    prewarm_started_ = true;
+    if (install_plan_->target_slot != BootControlInterface::kInvalidSlot) {
+      boot_control_->GetDynamicPartitionControl()->PrewarmForUpdate(
+          boot_control_->GetCurrentSlot(), install_plan_->target_slot);
+    }
+  }
+
   while (!manifest_valid_) {
     bool insufficient_bytes = false;
     if (!ParseManifest(&c_bytes, &count, error, &insufficient_bytes)) {
@@ -474,8 +839,11 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     // We know there are more operations to perform because we didn't reach the
     // |num_total_operations_| limit yet.
     if (next_operation_num_ >= acc_num_operations_[current_partition_]) {
-      if (partition_writer_) {
-        if (!partition_writer_->FinishedInstallOps()) {
+      if (!DrainPipeline(error)) {
+        return false;
+      }
+      for (auto writer : GetPartitionWriters()) {
+        if (!writer->FinishedInstallOps()) {
           *error = ErrorCode::kDownloadWriteError;
           return false;
         }
@@ -487,10 +855,26 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
                    << strerror(-err);
         return false;
       }
+      StartHashingCurrentPartition();
+      // The operations of the partition are only needed while applying it.
+      auto* finished_operations =
+          partitions_[current_partition_].mutable_operations();
+      ReleaseRepeatedField(finished_operations);
       // Skip until there are operations for current_partition_.
       while (next_operation_num_ >= acc_num_operations_[current_partition_]) {
         current_partition_++;
       }
+    }
+    if (!partition_writer_) {
+      // The operations of the partition may have to be received first.
+      bool insufficient_bytes = false;
+      if (!ParseCurrentOperationsSection(
+              &c_bytes, &count, error, &insufficient_bytes)) {
+        return false;
+      }
+      if (insufficient_bytes) {
+        return true;
+      }
       if (!OpenCurrentPartition()) {
         *error = ErrorCode::kInstallDeviceOpenError;
         return false;
@@ -499,15 +883,91 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
 
     const InstallOperation& op =
         partitions_[current_partition_].operations(GetPartitionOperationNum());
+    CheckMemoryPressure();
+    // Get the source of the next operations coming while waiting for the
+    // data of this one.
+    partition_writer_->PrefetchSource(GetPartitionOperationNum());
+    if (wait_op_num_ != next_operation_num_) {
+      wait_op_num_ = next_operation_num_;
+      wait_start_ = base::TimeTicks::Now();
+    }
 
-    CopyDataToBuffer(&c_bytes, &count, op.data_length());
+    if (!replace_writer_ && resume_replace_bytes_ > 0) {
+      if (!ResumeReplaceOperation(op, error)) {
+        LOG(ERROR) << "unable to resume operation: " << *error;
+        return false;
+      }
+    } else if (!replace_writer_ && ShouldStreamReplaceOperation(op, count)) {
+      // The operations queued before may write the same blocks.
+      if (install_plan_->pipelined_apply && !DrainPipeline(error)) {
+        return false;
+      }
+      // Falls back to buffering the data if the writer doesn't support
+      // taking it in pieces.
+      replace_writer_ = partition_writer_->CreateReplaceExtentWriter(op);
+      replace_hash_calculator_ =
+          std::make_unique<HashCalculator>(install_plan_->hash_algorithm);
+      replace_bytes_written_ = 0;
+    }
+    const bool streamed = replace_writer_ != nullptr;
+    if (streamed) {
+      if (!StreamReplaceOperation(op, &c_bytes, &count, error)) {
+        LOG(ERROR) << "unable to process operation: " << *error;
+        return false;
+      }
+      // Wait for the rest of the operation's data.
+      if (replace_writer_)
+        return true;
+    } else if (!install_plan_->pipelined_apply && buffer_.empty() &&
+               op.data_length() > 0 && op.data_offset() == buffer_offset_ &&
+               count >= op.data_length()) {
+      // All of the operation's data is in |bytes|, use it from there instead
+      // of copying it to |buffer_| first. The pipeline has to own the data of
+      // the operations it queues, so this only applies to ProcessOperation().
+      op_data_ = reinterpret_cast<const uint8_t*>(c_bytes);
+      op_data_size_ = op.data_length();
+      c_bytes += op_data_size_;
+      count -= op_data_size_;
+    } else {
+      CopyDataToBuffer(&c_bytes, &count, op.data_length());
 
-    // Check whether we received all of the next operation's data payload.
-    if (!CanPerformInstallOperation(op))
-      return true;
-    if (!ProcessOperation(&op, error)) {
-      LOG(ERROR) << "unable to process operation: " << *error;
-      return false;
+      // Check whether we received all of the next operation's data payload.
+      if (!CanPerformInstallOperation(op))
+        return true;
+      op_data_ = buffer_.data();
+      op_data_size_ = buffer_.size();
+    }
+    if (!streamed) {
+      // Streamed operations are applied while their data arrives, so there
+      // is no waiting to speak of.
+      operation_tracer_.Add(op.type(),
+                            OperationPhase::kWaitForData,
+                            base::TimeTicks::Now() - wait_start_);
+    }
+    if (install_plan_->pipelined_apply && !streamed) {
+      if (!QueueOperation(op, error)) {
+        LOG(ERROR) << "unable to queue operation: " << *error;
+        return false;
+      }
+    } else if (!streamed) {
+      const size_t zero_batch_size = GetZeroOrDiscardBatchSize();
+      const size_t batch_size =
+          zero_batch_size > 1 ? zero_batch_size : GetSourceCopyBatchSize();
+      if (batch_size > 1) {
+        const bool batch_result =
+            zero_batch_size > 1
+                ? ProcessZeroOrDiscardOperations(batch_size, error)
+                : ProcessSourceCopyOperations(batch_size, error);
+        if (!batch_result) {
+          LOG(ERROR) << "unable to process operations: " << *error;
+          return false;
+        }
+        // The last one is accounted for below.
+        next_operation_num_ += batch_size - 1;
+      } else if (!ProcessOperation(&op, error)) {
+        LOG(ERROR) << "unable to process operation: " << *error;
+        return false;
+      }
     }
 
     next_operation_num_++;
@@ -515,10 +975,17 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     CheckpointUpdateProgress(false);
   }
 
-  if (partition_writer_) {
-    TEST_AND_RETURN_FALSE(partition_writer_->FinishedInstallOps());
+  if (!DrainPipeline(error)) {
+    return false;
+  }
+  for (auto writer : GetPartitionWriters()) {
+    TEST_AND_RETURN_FALSE(writer->FinishedInstallOps());
   }
-  CloseCurrentPartition();
+  if (CloseCurrentPartition() == 0) {
+    StartHashingCurrentPartition();
+  }
+  // The payload was applied, it won't be parsed again.
+  ReleaseParsedManifest();
 
   // In major version 2, we don't add unused operation to the payload.
   // If we already extracted the signature we should skip this step.
@@ -589,64 +1056,15 @@ bool DeltaPerformer::ParseManifest(const char** c_bytes,
   DiscardBuffer(false, metadata_size_);
 
   block_size_ = manifest_.block_size();
+  install_plan_->hash_algorithm = GetDataHashAlgorithm(manifest_);
 
   if (!install_plan_->spl_downgrade && !CheckSPLDowngrade()) {
     *error = ErrorCode::kPayloadTimestampError;
     return false;
   }
 
-  // update estimate_cow_size if VABC is disabled
-  // new_cow_size per partition = partition_size - (#blocks in Copy
-  // operations part of the partition)
-  if (install_plan_->vabc_none) {
-    LOG(INFO) << "Setting Virtual AB Compression algorithm to none. This "
-                 "would also disable VABC XOR as XOR only saves space if "
-                 "compression is enabled.";
-    manifest_.mutable_dynamic_partition_metadata()->set_vabc_compression_param(
-        "none");
-    for (auto& partition : *manifest_.mutable_partitions()) {
-      if (!partition.has_estimate_cow_size()) {
-        continue;
-      }
-      auto new_cow_size = partition.new_partition_info().size();
-      for (const auto& operation : partition.merge_operations()) {
-        if (operation.type() == CowMergeOperation::COW_COPY) {
-          new_cow_size -=
-              operation.dst_extent().num_blocks() * manifest_.block_size();
-        }
-      }
-      // Remove all COW_XOR merge ops, as XOR without compression is useless.
-      // It increases CPU usage but does not reduce space usage at all.
-      auto&& merge_ops = *partition.mutable_merge_operations();
-      merge_ops.erase(std::remove_if(merge_ops.begin(),
-                                     merge_ops.end(),
-                                     [](const auto& op) {
-                                       return op.type() ==
-                                              CowMergeOperation::COW_XOR;
-                                     }),
-                      merge_ops.end());
-
-      // Every block written to COW device will come with a header which
-      // stores src/dst block info along with other data.
-      const auto cow_metadata_size = partition.new_partition_info().size() /
-                                     manifest_.block_size() *
-                                     sizeof(android::snapshot::CowOperation);
-      // update_engine will emit a label op every op or every two seconds,
-      // whichever one is longer. In the worst case, we add 1 label per
-      // InstallOp. So take size of label ops into account.
-      const auto label_ops_size =
-          partition.operations_size() * sizeof(android::snapshot::CowOperation);
-      // Adding extra 2MB headroom just for any unexpected space usage.
-      // If we overrun reserved COW size, entire OTA will fail
-      // and no way for user to retry OTA
-      partition.set_estimate_cow_size(new_cow_size + (1024 * 1024 * 2) +
-                                      cow_metadata_size + label_ops_size);
-      // Setting op count max to 0 will defer to num_blocks as the op buffer
-      // size.
-      partition.set_estimate_op_count_max(0);
-      LOG(INFO) << "New COW size for partition " << partition.partition_name()
-                << " is " << partition.estimate_cow_size();
-    }
+  if (install_plan_->vabc_none || ShouldDisableVabcCompression()) {
+    DisableVabcCompression();
   }
   if (install_plan_->disable_vabc) {
     manifest_.mutable_dynamic_partition_metadata()->set_vabc_enabled(false);
@@ -667,6 +1085,24 @@ bool DeltaPerformer::ParseManifest(const char** c_bytes,
     LOG(INFO) << "Attempting to enable batched writes for VABC";
   }
 
+  // Without compression, the snapshots of Virtual A/B are sized from the
+  // operations of the partitions, which the manifest has to hold then.
+  auto dynamic_control = boot_control_->GetDynamicPartitionControl();
+  if (std::any_of(manifest_.partitions().begin(),
+                  manifest_.partitions().end(),
+                  [](const PartitionUpdate& partition) {
+                    return partition.has_operations_section();
+                  }) &&
+      install_plan_->target_slot != BootControlInterface::kInvalidSlot &&
+      dynamic_control->GetVirtualAbFeatureFlag().IsEnabled() &&
+      !(dynamic_control->GetVirtualAbCompressionFeatureFlag().IsEnabled() &&
+        manifest_.dynamic_partition_metadata().vabc_enabled())) {
+    LOG(ERROR) << "Operations sections aren't supported on Virtual A/B "
+               << "without compression.";
+    *error = ErrorCode::kDownloadManifestParseError;
+    return false;
+  }
+
   // This populates |partitions_| and the |install_plan.partitions| with the
   // list of partitions from the manifest.
   if (!ParseManifestPartitions(error))
@@ -675,12 +1111,17 @@ bool DeltaPerformer::ParseManifest(const char** c_bytes,
   // |install_plan.partitions| was filled in, nothing need to be done here if
   // the payload was already applied, returns false to terminate http fetcher,
   // but keep |error| as ErrorCode::kSuccess.
-  if (payload_->already_applied)
+  if (payload_->already_applied) {
+    if (!HashAppliedUntouchedPartitions(
+            std::numeric_limits<uint64_t>::max())) {
+      *error = ErrorCode::kDownloadStateInitializationError;
+    }
     return false;
+  }
 
   num_total_operations_ = 0;
   for (const auto& partition : partitions_) {
-    num_total_operations_ += partition.operations_size();
+    num_total_operations_ += GetNumOperations(partition);
     acc_num_operations_.push_back(num_total_operations_);
   }
 
@@ -696,8 +1137,15 @@ bool DeltaPerformer::ParseManifest(const char** c_bytes,
     LOG(ERROR) << "Unable to prime the update state.";
     return false;
   }
+  if (!HashAppliedUntouchedPartitions(next_operation_num_)) {
+    *error = ErrorCode::kDownloadStateInitializationError;
+    return false;
+  }
 
-  if (next_operation_num_ < acc_num_operations_[current_partition_]) {
+  // A partition whose operations weren't received yet is opened once they
+  // are, by Write().
+  if (next_operation_num_ < acc_num_operations_[current_partition_] &&
+      !HasPendingOperationsSection(partitions_[current_partition_])) {
     if (!OpenCurrentPartition()) {
       *error = ErrorCode::kInstallDeviceOpenError;
       return false;
@@ -709,6 +1157,62 @@ bool DeltaPerformer::ParseManifest(const char** c_bytes,
   LOG(INFO) << "Starting to apply update payload operations";
   return true;
 }
+
+bool DeltaPerformer::ParseCurrentOperationsSection(const char** c_bytes,
+                                                   size_t* count,
+                                                   ErrorCode* error,
+                                                   bool* insufficient_bytes) {
+  PartitionUpdate& partition = partitions_[current_partition_];
+  if (!HasPendingOperationsSection(partition))
+    return true;
+  const PartitionUpdate::OperationsSection& section =
+      partition.operations_section();
+  if (buffer_offset_ > section.offset()) {
+    // Resuming past the section, which was saved once received.
+    string saved_section;
+    if (!prefs_->GetString(kPrefsUpdateStateOperationsSection,
+                           &saved_section) ||
+        !ParseOperationsSection(saved_section.data(),
+                                saved_section.size(),
+                                install_plan_->hash_algorithm,
+                                &partition)) {
+      LOG(ERROR) << "Unable to load the saved operations section of "
+                 << partition.partition_name();
+      *error = ErrorCode::kDownloadStateInitializationError;
+      return false;
+    }
+    return true;
+  }
+  if (buffer_offset_ != section.offset()) {
+    LOG(ERROR) << "The operations section of " << partition.partition_name()
+               << " is at offset " << section.offset()
+               << " but expected at offset " << buffer_offset_;
+    *error = ErrorCode::kDownloadManifestParseError;
+    return false;
+  }
+  CopyDataToBuffer(c_bytes, count, section.size());
+  if (buffer_.size() < section.size()) {
+    *insufficient_bytes = true;
+    return true;
+  }
+  if (!ParseOperationsSection(buffer_.data(),
+                              buffer_.size(),
+                              install_plan_->hash_algorithm,
+                              &partition)) {
+    *error = ErrorCode::kDownloadOperationHashMismatch;
+    return false;
+  }
+  LOG(INFO) << "Received the " << partition.operations_size()
+            << " operations of " << partition.partition_name();
+  auto begin = reinterpret_cast<const char*>(buffer_.data());
+  LOG_IF(WARNING,
+         !prefs_->SetString(kPrefsUpdateStateOperationsSection,
+                            {begin, buffer_.size()}))
+      << "Unable to save the operations section.";
+  DiscardBuffer(true, buffer_.size());
+  return true;
+}
+
 bool DeltaPerformer::ProcessOperation(const InstallOperation* op,
                                       ErrorCode* error) {
   // Validate the operation unconditionally. This helps prevent the
@@ -719,7 +1223,11 @@ bool DeltaPerformer::ProcessOperation(const InstallOperation* op,
   // Note: Validate must be called only if CanPerformInstallOperation is
   // called. Otherwise, we might be failing operations before even if there
   // isn't sufficient data to compute the proper hash.
-  *error = ValidateOperationHash(*op);
+  ScopedOperationTrace trace(&operation_tracer_, op->type());
+  {
+    ScopedOperationPhase hash_phase(OperationPhase::kHash);
+    *error = ValidateOperationHash(*op);
+  }
   if (*error != ErrorCode::kSuccess) {
     if (install_plan_->hash_checks_mandatory) {
       LOG(ERROR) << "Mandatory operation hash check failed";
@@ -736,6 +1244,7 @@ bool DeltaPerformer::ProcessOperation(const InstallOperation* op,
       ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
 
   base::TimeTicks op_start_time = base::TimeTicks::Now();
+  ScopedOperationPhase apply_phase(OperationPhase::kApply);
 
   bool op_result{};
   const string op_name = InstallOperationTypeName(op->type());
@@ -743,6 +1252,7 @@ bool DeltaPerformer::ProcessOperation(const InstallOperation* op,
     case InstallOperation::REPLACE:
     case InstallOperation::REPLACE_BZ:
     case InstallOperation::REPLACE_XZ:
+    case InstallOperation::REPLACE_ZSTD:
       op_result = PerformReplaceOperation(*op);
       OP_DURATION_HISTOGRAM("REPLACE", op_start_time);
       break;
@@ -773,14 +1283,534 @@ bool DeltaPerformer::ProcessOperation(const InstallOperation* op,
   return true;
 }
 
+size_t DeltaPerformer::GetSourceCopyBatchSize() {
+  if (install_plan_->source_copy_batch_size == 0) {
+    return 1;
+  }
+  const PartitionUpdate& partition = partitions_[current_partition_];
+  uint64_t batch_bytes = 0;
+  size_t num_ops = 0;
+  for (size_t i = GetPartitionOperationNum();
+       i < static_cast<size_t>(partition.operations_size());
+       i++) {
+    const InstallOperation& op = partition.operations(i);
+    if (op.type() != InstallOperation::SOURCE_COPY || op.data_length() > 0) {
+      break;
+    }
+    batch_bytes += utils::BlocksInExtents(op.src_extents()) * block_size_;
+    if (num_ops > 0 && batch_bytes > install_plan_->source_copy_batch_size) {
+      break;
+    }
+    num_ops++;
+  }
+  return std::max<size_t>(num_ops, 1);
+}
+
+bool DeltaPerformer::ProcessSourceCopyOperations(size_t num_ops,
+                                                 ErrorCode* error) {
+  const PartitionUpdate& partition = partitions_[current_partition_];
+  const size_t first_op = GetPartitionOperationNum();
+  vector<const InstallOperation*> ops;
+  ops.reserve(num_ops);
+  for (size_t i = first_op; i < first_op + num_ops; i++) {
+    const InstallOperation& op = partition.operations(i);
+    if (op.has_src_length())
+      TEST_AND_RETURN_FALSE(op.src_length() % block_size_ == 0);
+    if (op.has_dst_length())
+      TEST_AND_RETURN_FALSE(op.dst_length() % block_size_ == 0);
+    ops.push_back(&op);
+  }
+  // These operations have no data whose hash to check.
+
+  // Makes sure we unblock exit when these operations complete.
+  ScopedTerminatorExitUnblocker exit_unblocker =
+      ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
+
+  ScopedOperationTrace trace(&operation_tracer_, InstallOperation::SOURCE_COPY);
+  ScopedOperationPhase apply_phase(OperationPhase::kApply);
+  base::TimeTicks op_start_time = base::TimeTicks::Now();
+  const bool op_result =
+      partition_writer_->PerformSourceCopyOperations(ops, error);
+  OP_DURATION_HISTOGRAM("SOURCE_COPY", op_start_time);
+  return HandleOpResult(op_result, "SOURCE_COPY", error);
+}
+
+size_t DeltaPerformer::GetZeroOrDiscardBatchSize() {
+  const PartitionUpdate& partition = partitions_[current_partition_];
+  size_t num_ops = 0;
+  for (size_t i = GetPartitionOperationNum();
+       i < static_cast<size_t>(partition.operations_size()) &&
+       num_ops < kMaxZeroOrDiscardBatchSize;
+       i++) {
+    const InstallOperation& op = partition.operations(i);
+    if ((op.type() != InstallOperation::ZERO &&
+         op.type() != InstallOperation::DISCARD) ||
+        op.data_length() > 0) {
+      break;
+    }
+    num_ops++;
+  }
+  return std::max<size_t>(num_ops, 1);
+}
+
+bool DeltaPerformer::ProcessZeroOrDiscardOperations(size_t num_ops,
+                                                    ErrorCode* error) {
+  const PartitionUpdate& partition = partitions_[current_partition_];
+  const size_t first_op = GetPartitionOperationNum();
+  vector<const InstallOperation*> ops;
+  ops.reserve(num_ops);
+  for (size_t i = first_op; i < first_op + num_ops; i++) {
+    const InstallOperation& op = partition.operations(i);
+    // These operations have no blob.
+    TEST_AND_RETURN_FALSE(!op.has_data_offset());
+    TEST_AND_RETURN_FALSE(!op.has_data_length());
+    ops.push_back(&op);
+  }
+
+  // Makes sure we unblock exit when these operations complete.
+  ScopedTerminatorExitUnblocker exit_unblocker =
+      ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
+
+  ScopedOperationTrace trace(&operation_tracer_, ops.front()->type());
+  ScopedOperationPhase apply_phase(OperationPhase::kApply);
+  base::TimeTicks op_start_time = base::TimeTicks::Now();
+  const bool op_result = partition_writer_->PerformZeroOrDiscardOperations(ops);
+  OP_DURATION_HISTOGRAM("ZERO_OR_DISCARD", op_start_time);
+  return HandleOpResult(op_result, "ZERO_OR_DISCARD", error);
+}
+
+void DeltaPerformer::CheckMemoryPressure() {
+  if (!install_plan_->memory_pressure_aware) {
+    return;
+  }
+  const base::TimeTicks now = base::TimeTicks::Now();
+  if (!memory_pressure_monitor_) {
+    memory_pressure_monitor_ = std::make_unique<MemoryPressureMonitor>();
+  } else if (now - last_memory_pressure_check_ <
+             kMemoryPressureCheckInterval) {
+    return;
+  }
+  last_memory_pressure_check_ = now;
+  const MemoryPressureMonitor::Level level =
+      memory_pressure_monitor_->GetLevel();
+  if (level == memory_pressure_level_) {
+    return;
+  }
+  LOG(INFO) << "Memory pressure went from "
+            << MemoryPressureMonitor::LevelName(memory_pressure_level_)
+            << " to " << MemoryPressureMonitor::LevelName(level);
+  memory_pressure_level_ = level;
+  if (pipeline_) {
+    pipeline_->SetLimits(GetPipelineMaxBytesInFlight(),
+                         GetPipelineApplyWorkers());
+  }
+  // The writers of the pipeline get the new budget with the next partition,
+  // as they may be applying operations right now.
+  if (!install_plan_->pipelined_apply) {
+    partition_writer_->SetPuffpatchCacheBudget(GetPuffpatchCacheBudget());
+  }
+}
+
+size_t DeltaPerformer::GetPipelineMaxBytesInFlight() const {
+  switch (memory_pressure_level_) {
+    case MemoryPressureMonitor::Level::kNone:
+      return kPipelineMaxBytesInFlight;
+    case MemoryPressureMonitor::Level::kModerate:
+      return kPipelineMaxBytesInFlight / 4;
+    case MemoryPressureMonitor::Level::kCritical:
+      return kPipelineMinBytesInFlight;
+  }
+  return kPipelineMinBytesInFlight;
+}
+
+size_t DeltaPerformer::GetPipelineApplyWorkers() const {
+  // Every worker holds the data of the operation it applies, and the buffers
+  // to apply it.
+  size_t workers = 1;
+  uint64_t memory_budget = kApplyMemoryBudget;
+  switch (memory_pressure_level_) {
+    case MemoryPressureMonitor::Level::kNone:
+      workers = install_plan_->apply_workers;
+      break;
+    case MemoryPressureMonitor::Level::kModerate:
+      workers = std::max<size_t>(install_plan_->apply_workers / 2, 1);
+      // Cut like the bytes in flight, see GetPipelineMaxBytesInFlight().
+      memory_budget /= 4;
+      break;
+    case MemoryPressureMonitor::Level::kCritical:
+      return 1;
+  }
+  if (current_partition_ >= partitions_.size()) {
+    return workers;
+  }
+  return GetApplyWorkersForMemory(
+      partitions_[current_partition_], workers, memory_budget);
+}
+
+size_t DeltaPerformer::GetPuffpatchCacheBudget() const {
+  return memory_pressure_level_ == MemoryPressureMonitor::Level::kNone
+             ? hardware_->GetPuffpatchCacheBudget()
+             : 0;
+}
+
+bool DeltaPerformer::ShouldStreamReplaceOperation(const InstallOperation& op,
+                                                  size_t count) const {
+  // Short of memory, the data of large operations isn't held at once, even
+  // if that means waiting for the pipeline to apply the operations queued.
+  const bool low_memory =
+      memory_pressure_level_ == MemoryPressureMonitor::Level::kCritical;
+  if (!(install_plan_->stream_replace_operations || low_memory) ||
+      (install_plan_->pipelined_apply && !low_memory)) {
+    return false;
+  }
+  if (op.type() != InstallOperation::REPLACE &&
+      op.type() != InstallOperation::REPLACE_BZ &&
+      op.type() != InstallOperation::REPLACE_XZ &&
+      op.type() != InstallOperation::REPLACE_ZSTD) {
+    return false;
+  }
+  // Operations whose data is all at hand are applied straight from it.
+  return op.data_length() >= kMinStreamedReplaceSize && buffer_.empty() &&
+         op.data_offset() == buffer_offset_ && count > 0 &&
+         count < op.data_length();
+}
+
+bool DeltaPerformer::StreamReplaceOperation(const InstallOperation& op,
+                                            const char** c_bytes,
+                                            size_t* count,
+                                            ErrorCode* error) {
+  // The output of REPLACE operations is their data as is, so the blocks
+  // written so far and the data received so far line up.
+  const uint64_t checkpoint_size =
+      op.type() == InstallOperation::REPLACE &&
+              install_plan_->replace_checkpoint_size % block_size_ == 0
+          ? install_plan_->replace_checkpoint_size
+          : 0;
+  while (*count > 0 && replace_bytes_written_ < op.data_length()) {
+    uint64_t size =
+        std::min<uint64_t>(*count, op.data_length() - replace_bytes_written_);
+    if (checkpoint_size > 0) {
+      size = std::min(
+          size, checkpoint_size - replace_bytes_written_ % checkpoint_size);
+    }
+    // On failure |replace_writer_| is kept, so that no checkpoint covers the
+    // part of the data already accounted for in the payload hashes.
+    if (!replace_hash_calculator_->Update(*c_bytes, size) ||
+        !replace_writer_->Write(*c_bytes, size)) {
+      *error = ErrorCode::kDownloadOperationExecutionError;
+      return false;
+    }
+    HashCalculator::UpdateAll(
+        {&payload_hash_calculator_, &signed_hash_calculator_}, *c_bytes, size);
+    *c_bytes += size;
+    *count -= size;
+    replace_bytes_written_ += size;
+    if (checkpoint_size > 0 && replace_bytes_written_ % checkpoint_size == 0 &&
+        replace_bytes_written_ < op.data_length()) {
+      CheckpointReplaceOperation(op);
+    }
+  }
+  if (replace_bytes_written_ < op.data_length()) {
+    return true;
+  }
+
+  // Makes sure we unblock exit when this operation completes.
+  ScopedTerminatorExitUnblocker exit_unblocker =
+      ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
+
+  // Unlike ProcessOperation(), the data can only be checked after it went
+  // through the decompressor, but still before the operation is reported as
+  // applied.
+  if (!replace_hash_calculator_->Finalize()) {
+    *error = ErrorCode::kDownloadOperationHashVerificationError;
+    return false;
+  }
+  *error = CheckOperationHash(
+      op, replace_hash_calculator_->raw_hash(), next_operation_num_);
+  if (*error != ErrorCode::kSuccess) {
+    if (install_plan_->hash_checks_mandatory) {
+      LOG(ERROR) << "Mandatory operation hash check failed";
+      return false;
+    }
+
+    // For non-mandatory cases, just send a UMA stat.
+    LOG(WARNING) << "Ignoring operation validation errors";
+    *error = ErrorCode::kSuccess;
+  }
+  replace_writer_.reset();
+  replace_hash_calculator_.reset();
+  replace_bytes_written_ = 0;
+  buffer_offset_ += op.data_length();
+  return true;
+}
+
+bool DeltaPerformer::ResumeReplaceOperation(const InstallOperation& op,
+                                            ErrorCode* error) {
+  *error = ErrorCode::kDownloadStateInitializationError;
+  TEST_AND_RETURN_FALSE(op.type() == InstallOperation::REPLACE);
+  TEST_AND_RETURN_FALSE(op.data_offset() == buffer_offset_);
+  TEST_AND_RETURN_FALSE(resume_replace_bytes_ < op.data_length());
+  TEST_AND_RETURN_FALSE(resume_replace_bytes_ % block_size_ == 0);
+  LOG(INFO) << "Resuming operation " << next_operation_num_ << " after "
+            << resume_replace_bytes_ << " bytes";
+
+  // Write the rest of the data to the blocks following the ones written.
+  InstallOperation remaining = op;
+  remaining.clear_dst_extents();
+  uint64_t blocks_written = resume_replace_bytes_ / block_size_;
+  for (const Extent& extent : op.dst_extents()) {
+    if (blocks_written >= extent.num_blocks()) {
+      blocks_written -= extent.num_blocks();
+      continue;
+    }
+    Extent* rest = remaining.add_dst_extents();
+    rest->set_start_block(extent.start_block() + blocks_written);
+    rest->set_num_blocks(extent.num_blocks() - blocks_written);
+    blocks_written = 0;
+  }
+  remaining.set_data_length(op.data_length() - resume_replace_bytes_);
+
+  replace_writer_ = partition_writer_->CreateReplaceExtentWriter(remaining);
+  replace_hash_calculator_ =
+      std::make_unique<HashCalculator>(install_plan_->hash_algorithm);
+  TEST_AND_RETURN_FALSE(replace_writer_ != nullptr);
+  TEST_AND_RETURN_FALSE(
+      replace_hash_calculator_->SetContext(resume_replace_hash_context_));
+  replace_bytes_written_ = resume_replace_bytes_;
+  resume_replace_bytes_ = 0;
+  resume_replace_hash_context_.clear();
+  install_plan_->resume_operation_bytes = 0;
+  *error = ErrorCode::kSuccess;
+  return true;
+}
+
+bool DeltaPerformer::CheckpointReplaceOperation(const InstallOperation& op) {
+  // Keep the update from being stopped between writing out the blocks and
+  // saving the progress that counts them.
+  Terminator::set_exit_blocked(true);
+  ScopedTerminatorExitUnblocker exit_unblocker =
+      ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
+  // The checkpoint in progress must not overwrite this one.
+  if (checkpoint_committer_) {
+    LOG_IF(WARNING, !checkpoint_committer_->Wait())
+        << "Failed to persist the previous checkpoint";
+  }
+  if (!partition_writer_->CheckpointPartialOperation(GetPartitionOperationNum(),
+                                                     replace_bytes_written_)) {
+    LOG(WARNING) << "Unable to checkpoint operation " << next_operation_num_
+                 << " after " << replace_bytes_written_ << " bytes";
+    return false;
+  }
+  LOG_IF(WARNING, !prefs_->StartTransaction())
+      << "unable to start transaction in checkpointing";
+  DEFER {
+    prefs_->CancelTransaction();
+  };
+  TEST_AND_RETURN_FALSE(prefs_->SetString(
+      kPrefsUpdateStateSHA256Context, payload_hash_calculator_.GetContext()));
+  TEST_AND_RETURN_FALSE(
+      prefs_->SetString(kPrefsUpdateStateSignedSHA256Context,
+                        signed_hash_calculator_.GetContext()));
+  TEST_AND_RETURN_FALSE(
+      prefs_->SetInt64(kPrefsUpdateStateNextDataOffset,
+                       buffer_offset_ + replace_bytes_written_));
+  TEST_AND_RETURN_FALSE(
+      prefs_->SetInt64(kPrefsUpdateStateNextDataLength,
+                       op.data_length() - replace_bytes_written_));
+  TEST_AND_RETURN_FALSE(prefs_->SetInt64(kPrefsUpdateStatePartialOperationBytes,
+                                         replace_bytes_written_));
+  TEST_AND_RETURN_FALSE(
+      prefs_->SetString(kPrefsUpdateStatePartialOperationHashContext,
+                        replace_hash_calculator_->GetContext()));
+  TEST_AND_RETURN_FALSE(
+      prefs_->SetInt64(kPrefsUpdateStateNextOperation, next_operation_num_));
+  // The next checkpoint between operations has to save everything again.
+  last_updated_operation_num_ = std::numeric_limits<uint64_t>::max();
+  if (!prefs_->SubmitTransaction()) {
+    LOG(ERROR) << "Failed to submit transaction in checkpointing";
+  }
+  return true;
+}
+
+bool DeltaPerformer::QueueOperation(const InstallOperation& op,
+                                    ErrorCode* error) {
+  // Check the same preconditions as the Perform*Operation() methods while
+  // |buffer_| still holds the data of |op|.
+  bool takes_data = false;
+  switch (op.type()) {
+    case InstallOperation::REPLACE:
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+    case InstallOperation::REPLACE_ZSTD:
+      TEST_AND_RETURN_FALSE(buffer_.size() >= op.data_length());
+      takes_data = true;
+      break;
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+      TEST_AND_RETURN_FALSE(!op.has_data_offset());
+      TEST_AND_RETURN_FALSE(!op.has_data_length());
+      break;
+    case InstallOperation::SOURCE_COPY:
+      break;
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+    case InstallOperation::PUFFDIFF:
+    case InstallOperation::ZUCCHINI:
+    case InstallOperation::LZ4DIFF_PUFFDIFF:
+    case InstallOperation::LZ4DIFF_BSDIFF:
+      TEST_AND_RETURN_FALSE(buffer_offset_ == op.data_offset());
+      TEST_AND_RETURN_FALSE(buffer_.size() >= op.data_length());
+      takes_data = true;
+      break;
+    default:
+      return HandleOpResult(
+          false, InstallOperationTypeName(op.type()).c_str(), error);
+  }
+  if (op.has_src_length())
+    TEST_AND_RETURN_FALSE(op.src_length() % block_size_ == 0);
+  if (op.has_dst_length())
+    TEST_AND_RETURN_FALSE(op.dst_length() % block_size_ == 0);
+
+  brillo::Blob data;
+  if (takes_data) {
+    // Account for the blob the way DiscardBuffer() does after a synchronous
+    // operation, then move it into the pipeline. Checkpoints drain the
+    // pipeline first, so the saved hash contexts and data offset never get
+    // ahead of the operations that were actually applied.
+    buffer_offset_ += buffer_.size();
+    HashCalculator::UpdateAll(
+        {&payload_hash_calculator_, &signed_hash_calculator_},
+        buffer_.data(),
+        buffer_.size());
+    data.swap(buffer_);
+  }
+
+  if (!pipeline_) {
+    pipeline_ = std::make_unique<InstallOperationPipeline>(
+        kPipelineMaxBytesInFlight, install_plan_->apply_workers);
+    pipeline_->SetLimits(GetPipelineMaxBytesInFlight(),
+                         GetPipelineApplyWorkers());
+  }
+
+  const InstallOperation* op_ptr = &op;
+  const size_t op_num = next_operation_num_;
+  const size_t partition_op_num = GetPartitionOperationNum();
+  const string partition_name =
+      partitions_[current_partition_].partition_name();
+  vector<PartitionWriterInterface*> writers = GetPartitionWriters();
+  // Without a writer per worker, leave out the destination extents so that
+  // the pipeline applies the operation strictly in order.
+  vector<Extent> dst_extents;
+  if (writers.size() > 1) {
+    dst_extents.assign(op.dst_extents().begin(), op.dst_extents().end());
+  }
+
+  auto verify = [this, op_ptr, op_num](const brillo::Blob& blob) {
+    // See ProcessOperation() for why this is done unconditionally.
+    ScopedOperationTrace trace(&operation_tracer_, op_ptr->type());
+    ScopedOperationPhase hash_phase(OperationPhase::kHash);
+    ErrorCode result =
+        ValidateOperationHash(*op_ptr, blob.data(), blob.size(), op_num);
+    if (result != ErrorCode::kSuccess) {
+      if (install_plan_->hash_checks_mandatory) {
+        LOG(ERROR) << "Mandatory operation hash check failed";
+        return result;
+      }
+      LOG(WARNING) << "Ignoring operation validation errors";
+    }
+    return ErrorCode::kSuccess;
+  };
+  OperationTracer* tracer = &operation_tracer_;
+  auto apply = [writers,
+                tracer,
+                op_ptr,
+                op_num,
+                partition_op_num,
+                partition_name](const brillo::Blob& blob, size_t worker) {
+    PartitionWriterInterface* writer = writers[worker % writers.size()];
+    ScopedOperationTrace trace(tracer, op_ptr->type());
+    ScopedOperationPhase apply_phase(OperationPhase::kApply);
+    base::TimeTicks op_start_time = base::TimeTicks::Now();
+    ErrorCode result = ErrorCode::kSuccess;
+    bool op_result{};
+    const string op_name = InstallOperationTypeName(op_ptr->type());
+    switch (op_ptr->type()) {
+      case InstallOperation::REPLACE:
+      case InstallOperation::REPLACE_BZ:
+      case InstallOperation::REPLACE_XZ:
+      case InstallOperation::REPLACE_ZSTD:
+        op_result =
+            writer->PerformReplaceOperation(*op_ptr, blob.data(), blob.size());
+        OP_DURATION_HISTOGRAM("REPLACE", op_start_time);
+        break;
+      case InstallOperation::ZERO:
+      case InstallOperation::DISCARD:
+        op_result = writer->PerformZeroOrDiscardOperation(*op_ptr);
+        OP_DURATION_HISTOGRAM("ZERO_OR_DISCARD", op_start_time);
+        break;
+      case InstallOperation::SOURCE_COPY:
+        op_result = writer->PerformSourceCopyOperation(*op_ptr, &result);
+        OP_DURATION_HISTOGRAM("SOURCE_COPY", op_start_time);
+        break;
+      default:
+        op_result = writer->PerformDiffOperation(
+            *op_ptr, &result, blob.data(), blob.size());
+        OP_DURATION_HISTOGRAM(op_name, op_start_time);
+        break;
+    }
+    if (op_result)
+      return ErrorCode::kSuccess;
+
+    LOG(ERROR) << "Failed to perform " << op_name << " operation " << op_num
+               << ", which is the operation " << partition_op_num
+               << " in partition \"" << partition_name << "\"";
+    if (result == ErrorCode::kSuccess)
+      result = ErrorCode::kDownloadOperationExecutionError;
+    return result;
+  };
+
+  // The operation counts as done as far as exiting is concerned: an exit
+  // between here and the next checkpoint just replays it on resume.
+  ScopedTerminatorExitUnblocker exit_unblocker =
+      ScopedTerminatorExitUnblocker();  // Avoids a compiler unused var bug.
+
+  if (!pipeline_->Submit(op_num,
+                         std::move(data),
+                         std::move(dst_extents),
+                         std::move(verify),
+                         std::move(apply))) {
+    *error = pipeline_->error();
+    LOG(ERROR) << "Not queueing operation " << op_num
+               << " after failure of operation "
+               << pipeline_->failed_op_index();
+    return false;
+  }
+  return true;
+}
+
+bool DeltaPerformer::DrainPipeline(ErrorCode* error) {
+  if (!pipeline_) {
+    return true;
+  }
+  const ErrorCode pipeline_error = pipeline_->Drain();
+  if (pipeline_error == ErrorCode::kSuccess) {
+    return true;
+  }
+  LOG(ERROR) << "Queued operation " << pipeline_->failed_op_index()
+             << " failed: " << utils::ErrorCodeToString(pipeline_error);
+  *error = pipeline_error;
+  return false;
+}
+
 bool DeltaPerformer::IsManifestValid() {
   return manifest_valid_;
 }
 
-bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
-  partitions_.assign(manifest_.partitions().begin(),
-                     manifest_.partitions().end());
+size_t DeltaPerformer::GetQueuedBytes() const {
+  return pipeline_ ? pipeline_->bytes_in_flight() : 0;
+}
 
+bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
   // For VAB and partial updates, the partition preparation will copy the
   // dynamic partitions metadata to the target metadata slot, and rename the
   // slot suffix of the partitions in the metadata.
@@ -798,10 +1828,16 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
     }
   }
 
-  // Partitions in manifest are no longer needed after preparing partitions.
-  manifest_.clear_partitions();
+  // Partitions in manifest are no longer needed after preparing partitions,
+  // so they are moved rather than copied.
+  partitions_.clear();
+  partitions_.resize(manifest_.partitions_size());
+  for (int i = 0; i < manifest_.partitions_size(); i++)
+    partitions_[i].Swap(manifest_.mutable_partitions(i));
+  ReleaseRepeatedField(manifest_.mutable_partitions());
   // TODO(xunchang) TBD: allow partial update only on devices with dynamic
   // partition.
+  size_t num_untouched_static_partitions = 0;
   if (manifest_.partial_update()) {
     std::set<std::string> touched_partitions;
     for (const auto& partition_update : partitions_) {
@@ -822,6 +1858,7 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
       *error = ErrorCode::kDownloadStateInitializationError;
       return false;
     }
+    num_untouched_static_partitions = untouched_static_partitions.size();
     partitions_.insert(partitions_.end(),
                        untouched_static_partitions.begin(),
                        untouched_static_partitions.end());
@@ -849,6 +1886,25 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
           partitions_, boot_control_, block_size_, error)) {
     return false;
   }
+  // The untouched static partitions come last, see above.
+  for (size_t i = install_plan_->partitions.size() -
+                  num_untouched_static_partitions;
+       i < install_plan_->partitions.size();
+       i++) {
+    install_plan_->partitions[i].untouched = true;
+  }
+  // The index only has the partitions of the current slot.
+  if (install_plan_->source_slot == boot_control_->GetCurrentSlot()) {
+    for (auto& install_part : install_plan_->partitions) {
+      install_part.source_hash_indexed =
+          IsSourceHashIndexed(prefs_,
+                              install_part,
+                              install_plan_->source_slot,
+                              hardware_->GetBuildTimestamp());
+      LOG_IF(INFO, install_part.source_hash_indexed)
+          << "The source of " << install_part.name << " matches the index.";
+    }
+  }
   const auto duration = std::chrono::system_clock::now() - start;
   LOG(INFO)
       << "ParsePartitions done. took "
@@ -856,8 +1912,9 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
       << " ms";
 
   auto&& has_verity = [](const auto& part) {
-    return part.fec_extent().num_blocks() > 0 ||
-           part.hash_tree_extent().num_blocks() > 0;
+    return !part.verity_data_in_payload() &&
+           (part.fec_extent().num_blocks() > 0 ||
+            part.hash_tree_extent().num_blocks() > 0);
   };
   if (!std::any_of(partitions_.begin(), partitions_.end(), has_verity)) {
     install_plan_->write_verity = false;
@@ -867,6 +1924,107 @@ bool DeltaPerformer::ParseManifestPartitions(ErrorCode* error) {
   return true;
 }
 
+uint64_t DeltaPerformer::GetUncompressedCowSize(
+    const PartitionUpdate& partition, uint64_t block_size) {
+  // new_cow_size per partition = partition_size - (#blocks in Copy
+  // operations part of the partition)
+  auto new_cow_size = partition.new_partition_info().size();
+  for (const auto& operation : partition.merge_operations()) {
+    if (operation.type() == CowMergeOperation::COW_COPY) {
+      new_cow_size -= operation.dst_extent().num_blocks() * block_size;
+    }
+  }
+  // Every block written to COW device will come with a header which
+  // stores src/dst block info along with other data.
+  const auto cow_metadata_size = partition.new_partition_info().size() /
+                                 block_size *
+                                 sizeof(android::snapshot::CowOperation);
+  // update_engine will emit a label op every op or every two seconds,
+  // whichever one is longer. In the worst case, we add 1 label per
+  // InstallOp. So take size of label ops into account.
+  const auto label_ops_size =
+      GetNumOperations(partition) * sizeof(android::snapshot::CowOperation);
+  // Adding extra 2MB headroom just for any unexpected space usage.
+  // If we overrun reserved COW size, entire OTA will fail
+  // and no way for user to retry OTA
+  return new_cow_size + (1024 * 1024 * 2) + cow_metadata_size +
+         label_ops_size;
+}
+
+bool DeltaPerformer::CanDisableVabcCompression(
+    const DeltaArchiveManifest& manifest, uint64_t free_space) {
+  const auto& dynamic_metadata = manifest.dynamic_partition_metadata();
+  if (!dynamic_metadata.vabc_enabled() ||
+      dynamic_metadata.vabc_compression_param() == "none") {
+    return false;
+  }
+  uint64_t cow_size = 0;
+  for (const auto& partition : manifest.partitions()) {
+    if (partition.has_estimate_cow_size()) {
+      cow_size += GetUncompressedCowSize(partition, manifest.block_size());
+    }
+  }
+  return free_space >= cow_size + kMinFreeSpaceAfterUncompressedCow;
+}
+
+bool DeltaPerformer::ShouldDisableVabcCompression() {
+  if (!install_plan_->vabc_auto_compression) {
+    return false;
+  }
+  // The snapshots of the update being resumed were created with the choice
+  // made when it started, which their merge goes on with.
+  bool disabled = false;
+  if (install_plan_->is_resume &&
+      prefs_->GetBoolean(kPrefsVabcCompressionDisabled, &disabled)) {
+    return disabled;
+  }
+  // The COW images beyond the free space of super go to /data.
+  uint64_t free_space = 0;
+  struct statvfs stats;
+  if (statvfs(kCowImagesFilesystem, &stats) == 0) {
+    free_space = static_cast<uint64_t>(stats.f_bavail) * stats.f_frsize;
+  } else {
+    PLOG(WARNING) << "Unable to get the free space of "
+                  << kCowImagesFilesystem;
+  }
+  disabled = CanDisableVabcCompression(manifest_, free_space);
+  LOG(INFO) << (disabled ? "Leaving" : "Not leaving")
+            << " the COW uncompressed with " << free_space
+            << " bytes free for it";
+  prefs_->SetBoolean(kPrefsVabcCompressionDisabled, disabled);
+  return disabled;
+}
+
+void DeltaPerformer::DisableVabcCompression() {
+  LOG(INFO) << "Setting Virtual AB Compression algorithm to none. This "
+               "would also disable VABC XOR as XOR only saves space if "
+               "compression is enabled.";
+  manifest_.mutable_dynamic_partition_metadata()->set_vabc_compression_param(
+      "none");
+  for (auto& partition : *manifest_.mutable_partitions()) {
+    if (!partition.has_estimate_cow_size()) {
+      continue;
+    }
+    // Remove all COW_XOR merge ops, as XOR without compression is useless.
+    // It increases CPU usage but does not reduce space usage at all.
+    auto&& merge_ops = *partition.mutable_merge_operations();
+    merge_ops.erase(std::remove_if(merge_ops.begin(),
+                                   merge_ops.end(),
+                                   [](const auto& op) {
+                                     return op.type() ==
+                                            CowMergeOperation::COW_XOR;
+                                   }),
+                    merge_ops.end());
+    partition.set_estimate_cow_size(
+        GetUncompressedCowSize(partition, manifest_.block_size()));
+    // Setting op count max to 0 will defer to num_blocks as the op buffer
+    // size.
+    partition.set_estimate_op_count_max(0);
+    LOG(INFO) << "New COW size for partition " << partition.partition_name()
+              << " is " << partition.estimate_cow_size();
+  }
+}
+
 bool DeltaPerformer::PreparePartitionsForUpdate(uint64_t* required_size,
                                                 ErrorCode* error) {
   // Call static PreparePartitionsForUpdate with hash from
@@ -953,16 +2111,17 @@ bool DeltaPerformer::PerformReplaceOperation(
     const InstallOperation& operation) {
   CHECK(operation.type() == InstallOperation::REPLACE ||
         operation.type() == InstallOperation::REPLACE_BZ ||
-        operation.type() == InstallOperation::REPLACE_XZ);
+        operation.type() == InstallOperation::REPLACE_XZ ||
+        operation.type() == InstallOperation::REPLACE_ZSTD);
 
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  TEST_AND_RETURN_FALSE(op_data_size_ >= operation.data_length());
 
   TEST_AND_RETURN_FALSE(partition_writer_->PerformReplaceOperation(
-      operation, buffer_.data(), buffer_.size()));
+      operation, op_data_, op_data_size_));
   // Update buffer
-  DiscardBuffer(true, buffer_.size());
+  DiscardOperationData();
   return true;
 }
 
@@ -1014,15 +2173,15 @@ bool DeltaPerformer::PerformDiffOperation(const InstallOperation& operation,
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
   TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
-  TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
+  TEST_AND_RETURN_FALSE(op_data_size_ >= operation.data_length());
   if (operation.has_src_length())
     TEST_AND_RETURN_FALSE(operation.src_length() % block_size_ == 0);
   if (operation.has_dst_length())
     TEST_AND_RETURN_FALSE(operation.dst_length() % block_size_ == 0);
 
   TEST_AND_RETURN_FALSE(partition_writer_->PerformDiffOperation(
-      operation, error, buffer_.data(), buffer_.size()));
-  DiscardBuffer(true, buffer_.size());
+      operation, error, op_data_, op_data_size_));
+  DiscardOperationData();
   return true;
 }
 
@@ -1058,13 +2217,13 @@ bool DeltaPerformer::GetPublicKey(string* out_public_key) {
   return true;
 }
 
-std::pair<std::unique_ptr<PayloadVerifier>, bool>
+std::pair<std::shared_ptr<const PayloadVerifier>, bool>
 DeltaPerformer::CreatePayloadVerifier() {
   if (utils::FileExists(update_certificates_path_.c_str())) {
     LOG(INFO) << "Verifying using certificates: " << update_certificates_path_;
-    return {
-        PayloadVerifier::CreateInstanceFromZipPath(update_certificates_path_),
-        true};
+    return {PayloadVerifier::GetCachedInstanceFromZipPath(
+                update_certificates_path_),
+            true};
   }
 
   string public_key;
@@ -1078,7 +2237,7 @@ DeltaPerformer::CreatePayloadVerifier() {
     return {nullptr, false};
   }
   LOG(INFO) << "Verifing using public key: " << public_key;
-  return {PayloadVerifier::CreateInstance(public_key), true};
+  return {PayloadVerifier::GetCachedInstance(public_key), true};
 }
 
 ErrorCode DeltaPerformer::ValidateManifest() {
@@ -1131,6 +2290,42 @@ ErrorCode DeltaPerformer::ValidateManifest() {
                  << kMaxSupportedMinorPayloadVersion << "].";
       return ErrorCode::kUnsupportedMinorPayloadVersion;
     }
+    if (manifest_.data_hash_algorithm() != DeltaArchiveManifest::SHA256 &&
+        manifest_.minor_version() < kDataHashAlgorithmMinorPayloadVersion) {
+      LOG(ERROR) << "Manifest contains a data hash algorithm, which isn't "
+                 << "supported before minor version "
+                 << kDataHashAlgorithmMinorPayloadVersion << ".";
+      return ErrorCode::kUnsupportedMinorPayloadVersion;
+    }
+    if (manifest_.minor_version() < kOperationsSectionMinorPayloadVersion &&
+        std::any_of(manifest_.partitions().begin(),
+                    manifest_.partitions().end(),
+                    [](const PartitionUpdate& partition) {
+                      return partition.has_operations_section();
+                    })) {
+      LOG(ERROR) << "Manifest contains operations sections, which aren't "
+                 << "supported before minor version "
+                 << kOperationsSectionMinorPayloadVersion << ".";
+      return ErrorCode::kUnsupportedMinorPayloadVersion;
+    }
+  }
+  // Full payloads, with their minor version of 0, don't pack them either.
+  if (manifest_.minor_version() < kPackedExtentsMinorPayloadVersion &&
+      HasPackedExtents(manifest_)) {
+    LOG(ERROR) << "Manifest contains packed extents, which aren't supported "
+               << "before minor version " << kPackedExtentsMinorPayloadVersion
+               << ".";
+    return ErrorCode::kUnsupportedMinorPayloadVersion;
+  }
+
+  for (const PartitionUpdate& partition : manifest_.partitions()) {
+    if (partition.has_operations_section() &&
+        (partition.operations_size() > 0 ||
+         partition.operations_section().num_operations() == 0)) {
+      LOG(ERROR) << "The operations section of "
+                 << partition.partition_name() << " is invalid.";
+      return ErrorCode::kDownloadManifestParseError;
+    }
   }
 
   ErrorCode error_code = CheckTimestampError();
@@ -1246,6 +2441,33 @@ ErrorCode DeltaPerformer::CheckTimestampError() const {
 
 ErrorCode DeltaPerformer::ValidateOperationHash(
     const InstallOperation& operation) {
+  return ValidateOperationHash(
+      operation, op_data_, op_data_size_, next_operation_num_);
+}
+
+ErrorCode DeltaPerformer::ValidateOperationHash(
+    const InstallOperation& operation,
+    const uint8_t* data,
+    size_t size,
+    size_t operation_num) const {
+  brillo::Blob calculated_op_hash;
+  if (operation.data_sha256_hash().size() &&
+      (size < operation.data_length() ||
+       !HashCalculator::RawHashOfBytes(data,
+                                       operation.data_length(),
+                                       &calculated_op_hash,
+                                       install_plan_->hash_algorithm))) {
+    LOG(ERROR) << "Unable to compute actual hash of operation "
+               << operation_num;
+    return ErrorCode::kDownloadOperationHashVerificationError;
+  }
+  return CheckOperationHash(operation, calculated_op_hash, operation_num);
+}
+
+ErrorCode DeltaPerformer::CheckOperationHash(
+    const InstallOperation& operation,
+    const brillo::Blob& calculated_op_hash,
+    size_t operation_num) const {
   if (!operation.data_sha256_hash().size()) {
     if (!operation.data_length()) {
       // Operations that do not have any data blob won't have any operation
@@ -1268,15 +2490,15 @@ ErrorCode DeltaPerformer::ValidateOperationHash(
     if (manifest_.signatures_offset() &&
         manifest_.signatures_offset() == operation.data_offset()) {
       LOG(INFO) << "Skipping hash verification for signature operation "
-                << next_operation_num_ + 1;
+                << operation_num + 1;
     } else {
       if (install_plan_->hash_checks_mandatory) {
         LOG(ERROR) << "Missing mandatory operation hash for operation "
-                   << next_operation_num_ + 1;
+                   << operation_num + 1;
         return ErrorCode::kDownloadOperationHashMissingError;
       }
 
-      LOG(WARNING) << "Cannot validate operation " << next_operation_num_ + 1
+      LOG(WARNING) << "Cannot validate operation " << operation_num + 1
                    << " as there's no operation hash in manifest";
     }
     return ErrorCode::kSuccess;
@@ -1287,17 +2509,9 @@ ErrorCode DeltaPerformer::ValidateOperationHash(
                           (operation.data_sha256_hash().data() +
                            operation.data_sha256_hash().size()));
 
-  brillo::Blob calculated_op_hash;
-  if (!HashCalculator::RawHashOfBytes(
-          buffer_.data(), operation.data_length(), &calculated_op_hash)) {
-    LOG(ERROR) << "Unable to compute actual hash of operation "
-               << next_operation_num_;
-    return ErrorCode::kDownloadOperationHashVerificationError;
-  }
-
   if (calculated_op_hash != expected_op_hash) {
     LOG(ERROR) << "Hash verification failed for operation "
-               << next_operation_num_
+               << operation_num
                << ". Expected hash = " << HexEncode(expected_op_hash);
     LOG(ERROR) << "Calculated hash over " << operation.data_length()
                << " bytes at offset: " << operation.data_offset() << " = "
@@ -1376,13 +2590,31 @@ void DeltaPerformer::DiscardBuffer(bool do_advance_offset,
     buffer_offset_ += buffer_.size();
 
   // Hash the content.
-  payload_hash_calculator_.Update(buffer_.data(), buffer_.size());
-  signed_hash_calculator_.Update(buffer_.data(), signed_hash_buffer_size);
+  if (signed_hash_buffer_size == buffer_.size()) {
+    HashCalculator::UpdateAll(
+        {&payload_hash_calculator_, &signed_hash_calculator_},
+        buffer_.data(),
+        buffer_.size());
+  } else {
+    payload_hash_calculator_.Update(buffer_.data(), buffer_.size());
+    signed_hash_calculator_.Update(buffer_.data(), signed_hash_buffer_size);
+  }
 
   // Swap content with an empty vector to ensure that all memory is released.
   brillo::Blob().swap(buffer_);
 }
 
+void DeltaPerformer::DiscardOperationData() {
+  buffer_offset_ += op_data_size_;
+  HashCalculator::UpdateAll(
+      {&payload_hash_calculator_, &signed_hash_calculator_},
+      op_data_,
+      op_data_size_);
+  op_data_ = nullptr;
+  op_data_size_ = 0;
+  brillo::Blob().swap(buffer_);
+}
+
 bool DeltaPerformer::CanResumeUpdate(PrefsInterface* prefs,
                                      const string& update_check_response_hash) {
   int64_t next_operation = kUpdateStateOperationInvalid;
@@ -1461,6 +2693,9 @@ bool DeltaPerformer::ResetUpdateProgress(
   if (!quick) {
     prefs->SetInt64(kPrefsUpdateStateNextDataOffset, -1);
     prefs->SetInt64(kPrefsUpdateStateNextDataLength, 0);
+    prefs->SetInt64(kPrefsUpdateStatePartialOperationBytes, 0);
+    prefs->SetString(kPrefsUpdateStatePartialOperationHashContext, "");
+    prefs->Delete(kPrefsUpdateStateOperationsSection);
     prefs->SetString(kPrefsUpdateStateSHA256Context, "");
     prefs->SetString(kPrefsUpdateStateSignedSHA256Context, "");
     prefs->SetString(kPrefsUpdateStateSignatureBlob, "");
@@ -1469,6 +2704,8 @@ bool DeltaPerformer::ResetUpdateProgress(
     prefs->SetInt64(kPrefsResumedUpdateFailures, 0);
     prefs->Delete(kPrefsPostInstallSucceeded);
     prefs->Delete(kPrefsVerityWritten);
+    prefs->Delete(kPrefsVabcCompressionDisabled);
+    PayloadSpillCache::Delete(prefs);
     if (!skip_dynamic_partititon_metadata_updated) {
       LOG(INFO) << "Resetting recorded hash for prepared partitions.";
       prefs->Delete(kPrefsDynamicPartitionMetadataUpdated);
@@ -1487,40 +2724,44 @@ bool DeltaPerformer::ShouldCheckpoint() {
 }
 
 bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
-  if (!force && !ShouldCheckpoint()) {
+  if (!force && (install_plan_->minimal_checkpoints || !ShouldCheckpoint())) {
+    return false;
+  }
+  // The checkpoints are persisted in order, and this one may only save what
+  // changed since the last one if that one was.
+  if (!checkpoint_committer_) {
+    checkpoint_committer_ = std::make_unique<CheckpointCommitter>(prefs_);
+  } else if (!checkpoint_committer_->Wait()) {
+    last_updated_operation_num_ = std::numeric_limits<uint64_t>::max();
+  }
+  if (replace_writer_) {
+    // The payload hashes cover the part of the current operation's data that
+    // was already written, so there is no consistent progress to save until
+    // the operation completes. Resuming restarts from the last checkpoint.
+    LOG(INFO) << "Not checkpointing in the middle of operation "
+              << next_operation_num_;
     return false;
   }
+  if (resume_replace_bytes_ > 0) {
+    // The saved progress is already past the start of the operation.
+    LOG(INFO) << "Not checkpointing before resuming operation "
+              << next_operation_num_;
+    return false;
+  }
+  if (pipeline_ && pipeline_->Drain() != ErrorCode::kSuccess) {
+    // The in-memory progress already covers the failed operation and the
+    // ones queued after it; keep the last good checkpoint instead.
+    LOG(WARNING) << "Not checkpointing past failed operation "
+                 << pipeline_->failed_op_index();
+    return false;
+  }
+  UE_TRACE_SCOPE("checkpoint");
   Terminator::set_exit_blocked(true);
-  LOG_IF(WARNING, !prefs_->StartTransaction())
-      << "unable to start transaction in checkpointing";
-  DEFER {
-    prefs_->CancelTransaction();
-  };
+  // The progress is snapshotted here, to be written to the prefs at once.
+  PrefsInterface::Changes changes;
   if (last_updated_operation_num_ != next_operation_num_ || force) {
-    if (!signatures_message_data_.empty()) {
-      // Save the signature blob because if the update is interrupted after the
-      // download phase we don't go through this path anymore. Some alternatives
-      // to consider:
-      //
-      // 1. On resume, re-download the signature blob from the server and
-      // re-verify it.
-      //
-      // 2. Verify the signature as soon as it's received and don't checkpoint
-      // the blob and the signed sha-256 context.
-      LOG_IF(WARNING,
-             !prefs_->SetString(kPrefsUpdateStateSignatureBlob,
-                                signatures_message_data_))
-          << "Unable to store the signature blob.";
-    }
-    TEST_AND_RETURN_FALSE(prefs_->SetString(
-        kPrefsUpdateStateSHA256Context, payload_hash_calculator_.GetContext()));
-    TEST_AND_RETURN_FALSE(
-        prefs_->SetString(kPrefsUpdateStateSignedSHA256Context,
-                          signed_hash_calculator_.GetContext()));
-    TEST_AND_RETURN_FALSE(
-        prefs_->SetInt64(kPrefsUpdateStateNextDataOffset, buffer_offset_));
-    last_updated_operation_num_ = next_operation_num_;
-
+    int64_t next_data_length = 0;
+    bool waiting_for_operations = false;
     if (next_operation_num_ < num_total_operations_) {
       size_t partition_index = current_partition_;
       while (next_operation_num_ >= acc_num_operations_[partition_index]) {
@@ -1529,27 +2770,63 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
       const size_t partition_operation_num =
           next_operation_num_ -
           (partition_index ? acc_num_operations_[partition_index - 1] : 0);
-      const InstallOperation& op =
-          partitions_[partition_index].operations(partition_operation_num);
-      TEST_AND_RETURN_FALSE(
-          prefs_->SetInt64(kPrefsUpdateStateNextDataLength, op.data_length()));
-    } else {
-      TEST_AND_RETURN_FALSE(
-          prefs_->SetInt64(kPrefsUpdateStateNextDataLength, 0));
+      // The operations of the next partition may not be received yet.
+      waiting_for_operations =
+          HasPendingOperationsSection(partitions_[partition_index]);
+      if (!waiting_for_operations) {
+        const InstallOperation& op =
+            partitions_[partition_index].operations(partition_operation_num);
+        next_data_length = op.data_length();
+      }
     }
+    // The data of the operations done has to be durable before the progress
+    // counting them is.
     if (partition_writer_) {
-      partition_writer_->CheckpointUpdateProgress(GetPartitionOperationNum());
+      for (auto writer : GetPartitionWriters()) {
+        writer->CheckpointUpdateProgress(GetPartitionOperationNum());
+      }
     } else {
-      CHECK_EQ(next_operation_num_, num_total_operations_)
+      CHECK(waiting_for_operations ||
+            next_operation_num_ == num_total_operations_)
           << "Partition writer is null, we are expected to finish all "
              "operations: "
           << next_operation_num_ << "/" << num_total_operations_;
     }
+    last_updated_operation_num_ = next_operation_num_;
+
+    if (!signatures_message_data_.empty()) {
+      // Save the signature blob because if the update is interrupted after
+      // the download phase we don't go through this path anymore. Some
+      // alternatives to consider:
+      //
+      // 1. On resume, re-download the signature blob from the server and
+      // re-verify it.
+      //
+      // 2. Verify the signature as soon as it's received and don't
+      // checkpoint the blob and the signed sha-256 context.
+      changes[kPrefsUpdateStateSignatureBlob] = signatures_message_data_;
+    }
+    changes[kPrefsUpdateStateSHA256Context] =
+        payload_hash_calculator_.GetContext();
+    changes[kPrefsUpdateStateSignedSHA256Context] =
+        signed_hash_calculator_.GetContext();
+    changes[kPrefsUpdateStateNextDataOffset] =
+        base::NumberToString(buffer_offset_);
+    changes[kPrefsUpdateStatePartialOperationBytes] = "0";
+    changes[kPrefsUpdateStateNextDataLength] =
+        base::NumberToString(next_data_length);
+  }
+  changes[kPrefsUpdateStateNextOperation] =
+      base::NumberToString(next_operation_num_);
+  // The checkpoints taken between operations are persisted while the next
+  // ones are applied, the others before returning.
+  if (!force) {
+    checkpoint_committer_->Commit(std::move(changes));
+    return true;
   }
-  TEST_AND_RETURN_FALSE(
-      prefs_->SetInt64(kPrefsUpdateStateNextOperation, next_operation_num_));
-  if (!prefs_->SubmitTransaction()) {
-    LOG(ERROR) << "Failed to submit transaction in checkpointing";
+  if (!prefs_->SetKeys(changes)) {
+    last_updated_operation_num_ = std::numeric_limits<uint64_t>::max();
+    return false;
   }
   return true;
 }
@@ -1572,6 +2849,22 @@ bool DeltaPerformer::PrimeUpdateState() {
       next_data_offset >= 0);
   buffer_offset_ = next_data_offset;
 
+  // When interrupted in the middle of a REPLACE operation, |buffer_offset_|
+  // stays at the start of its data until it completes.
+  int64_t partial_operation_bytes = 0;
+  if (prefs_->GetInt64(kPrefsUpdateStatePartialOperationBytes,
+                       &partial_operation_bytes) &&
+      partial_operation_bytes > 0) {
+    TEST_AND_RETURN_FALSE(partial_operation_bytes <= next_data_offset);
+    TEST_AND_RETURN_FALSE(
+        prefs_->GetString(kPrefsUpdateStatePartialOperationHashContext,
+                          &resume_replace_hash_context_) &&
+        !resume_replace_hash_context_.empty());
+    resume_replace_bytes_ = partial_operation_bytes;
+    buffer_offset_ = next_data_offset - partial_operation_bytes;
+    install_plan_->resume_operation_bytes = resume_replace_bytes_;
+  }
+
   // The signed hash context and the signature blob may be empty if the
   // interrupted update didn't reach the signature.
   string signed_hash_context;
@@ -1602,7 +2895,7 @@ bool DeltaPerformer::PrimeUpdateState() {
 
   // Advance the download progress to reflect what doesn't need to be
   // re-downloaded.
-  total_bytes_received_ += buffer_offset_;
+  total_bytes_received_ += next_data_offset;
 
   // Speculatively count the resume as a failure.
   int64_t resumed_update_failures{};
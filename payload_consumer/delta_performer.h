@@ -19,6 +19,7 @@
 
 #include <inttypes.h>
 
+#include <future>
 #include <limits>
 #include <memory>
 #include <string>
@@ -31,9 +32,13 @@
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/memory_pressure_monitor.h"
 #include "update_engine/common/platform_constants.h"
+#include "update_engine/payload_consumer/checkpoint_committer.h"
 #include "update_engine/payload_consumer/file_writer.h"
+#include "update_engine/payload_consumer/install_operation_pipeline.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/operation_stats.h"
 #include "update_engine/payload_consumer/partition_writer_interface.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
@@ -63,6 +68,18 @@ class DeltaPerformer : public FileWriter {
   static const unsigned kProgressDownloadWeight;
   static const unsigned kProgressOperationsWeight;
   static const uint64_t kCheckpointFrequencySeconds;
+  // Minimum data size of the REPLACE operations applied while their data is
+  // received when |stream_replace_operations| is set in the install plan.
+  static const uint64_t kMinStreamedReplaceSize;
+  // Bounds on the operation data queued for the pipelined apply. Once above
+  // the high one, the download should wait for the queue to get below the low
+  // one. The high one is under the budget of the pipeline, so that queueing
+  // an operation rarely blocks the download thread.
+  static const size_t kQueuedBytesHighWatermark;
+  static const size_t kQueuedBytesLowWatermark;
+  // The free space left for the device once the COW of the snapshots takes
+  // its uncompressed size, for |vabc_auto_compression| to leave it so.
+  static const uint64_t kMinFreeSpaceAfterUncompressedCow;
 
   DeltaPerformer(
       PrefsInterface* prefs,
@@ -80,7 +97,8 @@ class DeltaPerformer : public FileWriter {
         install_plan_(install_plan),
         payload_(payload),
         update_certificates_path_(std::move(update_certificates_path)),
-        interactive_(interactive) {
+        interactive_(interactive),
+        operation_tracer_(install_plan->trace_operations) {
     CHECK(install_plan_);
   }
 
@@ -104,13 +122,51 @@ class DeltaPerformer : public FileWriter {
   // work. Returns whether the required file descriptors were successfully open.
   bool OpenCurrentPartition();
 
+  // Opens the writer of the partition applied after the current one on
+  // another thread, so that opening its devices overlaps with applying the
+  // current partition instead of adding up after it.
+  void OpenNextPartitionWriter(bool source_may_exist,
+                               size_t puffpatch_cache_budget);
+
+  // Returns the writer opened by OpenNextPartitionWriter(), once it is, if it
+  // is the one of |current_partition_| and opened fine, or nullptr.
+  std::unique_ptr<PartitionWriterInterface> TakeNextPartitionWriter();
+
   // Closes the current partition file descriptors if open. Returns 0 on success
   // or -errno on error.
   int CloseCurrentPartition();
 
+  // Starts hashing the target of |current_partition_|, once it is closed, in
+  // the background for FilesystemVerifierAction when the install plan asks
+  // for it and the partition is eligible.
+  void StartHashingCurrentPartition();
+
+  // Sets up the hash tree of |current_partition_| built by its VABC writer
+  // from the data it writes, when the install plan asks for it and the
+  // partition is applied from its first operation, |next_op_index| being 0.
+  void StartInlineHashTree(size_t next_op_index);
+
+  // Sets the source and target hashes of |current_partition_|, an untouched
+  // partition of a partial update, to the hash computed while copying it.
+  void RecordCopiedPartitionHash();
+
+  // Hashes the source of the untouched partitions of a partial update whose
+  // copy is among the first |num_applied_operations| operations, applied
+  // before the update resumed, since their hash couldn't be computed while
+  // copying them. Returns false on failure.
+  bool HashAppliedUntouchedPartitions(uint64_t num_applied_operations);
+
   // Returns |true| only if the manifest has been processed and it's valid.
   bool IsManifestValid();
 
+  // Returns the partitions of the payload and their operations. Only valid
+  // once the manifest is.
+  const std::vector<PartitionUpdate>& partitions() const { return partitions_; }
+
+  // Returns the size of the operation data received and queued for the
+  // pipelined apply, but not applied yet. Always 0 without |pipelined_apply|.
+  size_t GetQueuedBytes() const;
+
   // Verifies the downloaded payload against the signed hash included in the
   // payload, against the update check hash and size using the public key and
   // returns ErrorCode::kSuccess on success, an error code on failure.
@@ -167,6 +223,12 @@ class DeltaPerformer : public FileWriter {
   // Return true if header parsing is finished and no errors occurred.
   bool IsHeaderParsed() const;
 
+  // Returns the size of the metadata and of its signature, after which the
+  // data blobs start. Only known once the header was parsed.
+  uint64_t GetFullMetadataSize() const {
+    return metadata_size_ + metadata_signature_size_;
+  }
+
   // Checkpoints the update progress into persistent storage to allow this
   // update attempt to be resumed after reboot.
   // If |force| is false, checkpoint may be throttled.
@@ -192,6 +254,18 @@ class DeltaPerformer : public FileWriter {
       uint64_t* required_size,
       ErrorCode* error = nullptr);
 
+  // Returns the size of the COW of |partition| once written without
+  // compression, including the headers of its operations and some headroom.
+  static uint64_t GetUncompressedCowSize(const PartitionUpdate& partition,
+                                         uint64_t block_size);
+
+  // Whether the COW of the VABC partitions of |manifest| may be written
+  // without compression, given |free_space| bytes free for the COW images:
+  // when the payload compresses it, and the uncompressed COW still leaves
+  // |kMinFreeSpaceAfterUncompressedCow| free.
+  static bool CanDisableVabcCompression(const DeltaArchiveManifest& manifest,
+                                        uint64_t free_space);
+
  protected:
   // Exposed as virtual for testing purposes.
   virtual std::unique_ptr<PartitionWriterInterface> CreatePartitionWriter(
@@ -211,6 +285,7 @@ class DeltaPerformer : public FileWriter {
   friend class DeltaPerformerIntegrationTest;
   FRIEND_TEST(DeltaPerformerTest, BrilloMetadataSignatureSizeTest);
   FRIEND_TEST(DeltaPerformerTest, BrilloParsePayloadMetadataTest);
+  FRIEND_TEST(DeltaPerformerTest, ReusesParsedManifestTest);
   FRIEND_TEST(DeltaPerformerTest, UsePublicKeyFromResponse);
 
   // Obtain the operation index for current partition. If all operations for
@@ -251,8 +326,85 @@ class DeltaPerformer : public FileWriter {
                      ErrorCode* error,
                      bool* should_return);
 
+  // Parses the operations section of |current_partition_|, if it has one not
+  // parsed yet, from the bytes received or from the prefs when resuming past
+  // it. Sets |insufficient_bytes| if the section wasn't received in full yet.
+  bool ParseCurrentOperationsSection(const char** c_bytes,
+                                     size_t* count,
+                                     ErrorCode* error,
+                                     bool* insufficient_bytes);
+
   // Process one InstallOperation
   bool ProcessOperation(const InstallOperation* op, ErrorCode* error);
+
+  // Returns how many operations, starting from the next one, make up a run
+  // of SOURCE_COPY operations to apply together through
+  // ProcessSourceCopyOperations(). 1 when the next operation is applied on
+  // its own.
+  size_t GetSourceCopyBatchSize();
+  // Applies the next |num_ops| operations, all SOURCE_COPY, as one unit.
+  bool ProcessSourceCopyOperations(size_t num_ops, ErrorCode* error);
+  // Same for runs of ZERO and DISCARD operations, whose target blocks are
+  // merged across the operations.
+  size_t GetZeroOrDiscardBatchSize();
+  bool ProcessZeroOrDiscardOperations(size_t num_ops, ErrorCode* error);
+
+  // Pipelined counterpart of ProcessOperation(). Takes the data of |op| out
+  // of |buffer_|, accounts for it in the payload hashes and hands |op| over
+  // to |pipeline_|, which verifies and applies it in the background. Returns
+  // false if |op| is malformed or an earlier queued operation failed.
+  bool QueueOperation(const InstallOperation& op, ErrorCode* error);
+
+  // Whether |install_plan_->vabc_auto_compression| leaves the COW of the
+  // update uncompressed, as chosen when the update started for the update
+  // being resumed. Records the choice in the prefs.
+  bool ShouldDisableVabcCompression();
+
+  // Sets the compression of the COW in |manifest_| to "none", along with the
+  // COW size estimates of the partitions.
+  void DisableVabcCompression();
+
+  // Reads the memory pressure, at most once every
+  // |kMemoryPressureCheckInterval|, when |install_plan_->memory_pressure_aware|
+  // is set, and applies the limits of the new level if it changed.
+  void CheckMemoryPressure();
+
+  // The limits on the memory held to apply the payload at the current
+  // |memory_pressure_level_|.
+  size_t GetPipelineMaxBytesInFlight() const;
+  size_t GetPipelineApplyWorkers() const;
+  size_t GetPuffpatchCacheBudget() const;
+
+  // Returns whether |op| should be applied through StreamReplaceOperation()
+  // given the |count| bytes of its data at hand.
+  bool ShouldStreamReplaceOperation(const InstallOperation& op,
+                                    size_t count) const;
+
+  // Writes the next bytes of the data of the REPLACE operation |op| out of
+  // the |*count| bytes at |*c_bytes| to |replace_writer_|, and completes |op|
+  // once all of its data is written, in which case |replace_writer_| is
+  // reset. Returns false on failure.
+  bool StreamReplaceOperation(const InstallOperation& op,
+                              const char** c_bytes,
+                              size_t* count,
+                              ErrorCode* error);
+
+  // Sets up |replace_writer_| to write the rest of the REPLACE operation |op|
+  // interrupted after |resume_replace_bytes_| bytes. Returns false on failure.
+  bool ResumeReplaceOperation(const InstallOperation& op, ErrorCode* error);
+
+  // Saves the progress made through the REPLACE operation |op| streamed to
+  // |replace_writer_|, for the update to resume from there. Returns false if
+  // the progress couldn't be saved.
+  bool CheckpointReplaceOperation(const InstallOperation& op);
+
+  // Waits for all operations queued by QueueOperation() to complete. Returns
+  // false and sets |*error| if any of them failed.
+  bool DrainPipeline(ErrorCode* error);
+
+  // Returns |partition_writer_| followed by |worker_partition_writers_|, or an
+  // empty list if no partition is open.
+  std::vector<PartitionWriterInterface*> GetPartitionWriters() const;
   // Checks the integrity of the payload manifest. Returns true upon success,
   // false otherwise.
   ErrorCode ValidateManifest();
@@ -261,6 +413,18 @@ class DeltaPerformer : public FileWriter {
   // matches what's specified in the manifest in the payload.
   // Returns ErrorCode::kSuccess on match or a suitable error code otherwise.
   ErrorCode ValidateOperationHash(const InstallOperation& operation);
+  // Same as above, but validates the |size| bytes at |data| instead of the
+  // data of the current operation and uses |operation_num| in log messages.
+  // Safe to call from the pipeline threads.
+  ErrorCode ValidateOperationHash(const InstallOperation& operation,
+                                  const uint8_t* data,
+                                  size_t size,
+                                  size_t operation_num) const;
+  // Same as above, given the |calculated_op_hash| of the operation's data,
+  // which is only used if the operation has a hash.
+  ErrorCode CheckOperationHash(const InstallOperation& operation,
+                               const brillo::Blob& calculated_op_hash,
+                               size_t operation_num) const;
 
   // Returns true on success.
   bool PerformInstallOperation(const InstallOperation& operation);
@@ -287,6 +451,10 @@ class DeltaPerformer : public FileWriter {
   // accordingly.
   void DiscardBuffer(bool do_advance_offset, size_t signed_hash_buffer_size);
 
+  // Same as DiscardBuffer(true, ...), for the data of the operation which was
+  // just performed, wherever it is.
+  void DiscardOperationData();
+
   // Primes the required update state. Returns true if the update state was
   // successfully initialized to a saved resume state or if the update is a new
   // update. Returns false otherwise.
@@ -301,9 +469,11 @@ class DeltaPerformer : public FileWriter {
 
   // Creates a PayloadVerifier from the zip file containing certificates. If the
   // path to the zip file doesn't exist, falls back to use the public key.
-  // Returns a tuple with the created PayloadVerifier and if we should perform
-  // the verification.
-  std::pair<std::unique_ptr<PayloadVerifier>, bool> CreatePayloadVerifier();
+  // Returns a tuple with the PayloadVerifier and if we should perform the
+  // verification. The verifier is shared with the other instances using the
+  // same keys, which are only parsed once.
+  std::pair<std::shared_ptr<const PayloadVerifier>, bool>
+  CreatePayloadVerifier();
 
   // After install_plan_ is filled with partition names and sizes, initialize
   // metadata of partitions and map necessary devices before opening devices.
@@ -349,6 +519,8 @@ class DeltaPerformer : public FileWriter {
   DeltaArchiveManifest manifest_;
   bool manifest_parsed_{false};
   bool manifest_valid_{false};
+  // Whether the dynamic partitions were asked to prewarm for the update.
+  bool prewarm_started_{false};
   uint64_t metadata_size_{0};
   uint32_t metadata_signature_size_{0};
   uint64_t major_payload_version_{0};
@@ -381,10 +553,19 @@ class DeltaPerformer : public FileWriter {
   brillo::Blob buffer_;
   // Offset of buffer_ in the binary blobs section of the update.
   uint64_t buffer_offset_{0};
+  // Data of the operation being performed by ProcessOperation(). This is
+  // |buffer_|, unless all of it arrived in a single Write() call while
+  // |buffer_| was empty, in which case it points into the bytes passed to
+  // Write() to save copying them.
+  const uint8_t* op_data_{nullptr};
+  size_t op_data_size_{0};
 
   // Last |next_operation_num_| value updated as part of the progress update.
   uint64_t last_updated_operation_num_{std::numeric_limits<uint64_t>::max()};
 
+  // Persists the checkpoints taken between operations in the background.
+  std::unique_ptr<CheckpointCommitter> checkpoint_committer_;
+
   // The block size (parsed from the manifest).
   uint32_t block_size_{0};
 
@@ -433,6 +614,46 @@ class DeltaPerformer : public FileWriter {
   base::TimeTicks update_checkpoint_time_;
 
   std::unique_ptr<PartitionWriterInterface> partition_writer_;
+  // Additional writers for the current partition, one per extra apply worker
+  // of |pipeline_|, when the partition supports concurrent operations.
+  std::vector<std::unique_ptr<PartitionWriterInterface>>
+      worker_partition_writers_;
+
+  // The writer being opened for the partition |next_writer_partition_|.
+  std::future<std::unique_ptr<PartitionWriterInterface>>
+      next_partition_writer_;
+  size_t next_writer_partition_{0};
+  // Writer of the REPLACE operation being applied by StreamReplaceOperation(),
+  // along with the hash and size of the data written to it so far. No progress
+  // is checkpointed while it's set, as the payload hashes already cover part
+  // of the data of the operation, other than by CheckpointReplaceOperation().
+  std::unique_ptr<ExtentWriter> replace_writer_;
+  std::unique_ptr<HashCalculator> replace_hash_calculator_;
+  uint64_t replace_bytes_written_{0};
+  // When resuming in the middle of the REPLACE operation |next_operation_num_|,
+  // the bytes of it already written and the context of its hash at that point.
+  uint64_t resume_replace_bytes_{0};
+  std::string resume_replace_hash_context_;
+
+  // Times the operations applied, on this thread or by |pipeline_|, until
+  // Close() adds them to |install_plan_->operation_stats|. The data of
+  // operation |wait_op_num_| has been awaited since |wait_start_|.
+  OperationTracer operation_tracer_;
+  size_t wait_op_num_{std::numeric_limits<size_t>::max()};
+  base::TimeTicks wait_start_;
+
+  // Applies operations in the background when
+  // |install_plan_->pipelined_apply| is set. Created on first use. Declared
+  // after the partition writers so that it is torn down, and stops touching
+  // them, first.
+  std::unique_ptr<InstallOperationPipeline> pipeline_;
+
+  // Reads the memory pressure when |install_plan_->memory_pressure_aware| is
+  // set, last at |last_memory_pressure_check_|. Created on first use.
+  std::unique_ptr<MemoryPressureMonitor> memory_pressure_monitor_;
+  MemoryPressureMonitor::Level memory_pressure_level_{
+      MemoryPressureMonitor::Level::kNone};
+  base::TimeTicks last_memory_pressure_check_;
 
   DISALLOW_COPY_AND_ASSIGN(DeltaPerformer);
 };
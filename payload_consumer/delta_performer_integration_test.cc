@@ -61,9 +61,10 @@ using test_utils::kRandomString;
 using test_utils::ScopedLoopMounter;
 using test_utils::System;
 using testing::_;
+using testing::Contains;
 using testing::IsEmpty;
+using testing::Key;
 using testing::NiceMock;
-using testing::Not;
 using testing::Return;
 
 static const uint32_t kDefaultKernelSize = 4096;  // Something small for a test
@@ -737,17 +738,10 @@ static void ApplyDeltaFile(bool full_kernel,
       prefs,
       SetInt64(kPrefsManifestSignatureSize, state->metadata_signature_size))
       .WillOnce(Return(true));
-  EXPECT_CALL(prefs, SetInt64(kPrefsUpdateStateNextOperation, _))
-      .WillRepeatedly(Return(true));
   EXPECT_CALL(prefs, GetInt64(kPrefsUpdateStateNextOperation, _))
       .WillOnce(Return(false));
-  EXPECT_CALL(prefs, SetInt64(kPrefsUpdateStateNextDataOffset, _))
-      .WillRepeatedly(Return(true));
-  EXPECT_CALL(prefs, SetInt64(kPrefsUpdateStateNextDataLength, _))
-      .WillRepeatedly(Return(true));
-  EXPECT_CALL(prefs, SetString(kPrefsUpdateStateSHA256Context, _))
-      .WillRepeatedly(Return(true));
-  EXPECT_CALL(prefs, SetString(kPrefsUpdateStateSignedSHA256Context, _))
+  // The checkpoints of the progress.
+  EXPECT_CALL(prefs, SetKeys(Contains(Key(kPrefsUpdateStateNextOperation))))
       .WillRepeatedly(Return(true));
   EXPECT_CALL(prefs, SetString(kPrefsDynamicPartitionMetadataUpdated, _))
       .WillRepeatedly(Return(true));
@@ -757,8 +751,7 @@ static void ApplyDeltaFile(bool full_kernel,
                                         state->metadata_size)))
       .WillRepeatedly(Return(true));
   if (op_hash_test == kValidOperationData && signature_test != kSignatureNone) {
-    EXPECT_CALL(prefs,
-                SetString(kPrefsUpdateStateSignatureBlob, Not(IsEmpty())))
+    EXPECT_CALL(prefs, SetKeys(Contains(Key(kPrefsUpdateStateSignatureBlob))))
         .WillRepeatedly(Return(true));
   }
 
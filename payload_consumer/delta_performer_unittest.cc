@@ -22,6 +22,7 @@
 #include <algorithm>
 #include <map>
 #include <memory>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -48,12 +49,14 @@
 #include "update_engine/common/testing_constants.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/mock_partition_writer.h"
+#include "update_engine/payload_consumer/packed_extents.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/payload_file.h"
 #include "update_engine/payload_generator/payload_signer.h"
+#include "update_engine/payload_generator/zstd_compress.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -550,6 +553,25 @@ TEST_F(DeltaPerformerTest, ReplaceXzOperationTest) {
   EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
 }
 
+TEST_F(DeltaPerformerTest, ReplaceZstdOperationTest) {
+  brillo::Blob expected_data =
+      brillo::Blob(std::begin(kRandomString), std::end(kRandomString));
+  expected_data.resize(4096);  // block size
+  brillo::Blob zstd_data;
+  EXPECT_TRUE(ZstdCompress(expected_data, &zstd_data));
+
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(zstd_data.size());
+  aop.op.set_type(InstallOperation::REPLACE_ZSTD);
+  vector<AnnotatedOperation> aops = {aop};
+
+  brillo::Blob payload_data = GeneratePayload(zstd_data, aops, false);
+
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
 TEST_F(DeltaPerformerTest, ZeroOperationTest) {
   brillo::Blob existing_data = brillo::Blob(4096 * 10, 'a');
   brillo::Blob expected_data = existing_data;
@@ -572,6 +594,206 @@ TEST_F(DeltaPerformerTest, ZeroOperationTest) {
             ApplyPayloadToData(payload_data, "/dev/null", existing_data, true));
 }
 
+TEST_F(DeltaPerformerTest, ReplaceOperationSplitWritesTest) {
+  brillo::Blob expected_data(4096 * 2);
+  for (size_t i = 0; i < expected_data.size(); i++) {
+    // Make the two blocks differ.
+    expected_data[i] = static_cast<uint8_t>(
+        kRandomString[i % sizeof(kRandomString)] + i / 4096);
+  }
+  vector<AnnotatedOperation> aops;
+  for (size_t i = 0; i < 2; i++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(i, 1);
+    aop.op.set_data_offset(i * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+  brillo::Blob payload_data = GeneratePayload(expected_data, aops, true);
+  payload_.size = payload_data.size();
+
+  ScopedTempFile new_part("Partition-XXXXXX");
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameRoot, install_plan_.target_slot, new_part.path());
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+
+  // The first operation is applied straight from the bytes of the first
+  // Write(), the second one is buffered across both of them.
+  const auto blobs_start = std::search(payload_data.begin(),
+                                       payload_data.end(),
+                                       expected_data.begin(),
+                                       expected_data.end());
+  ASSERT_NE(payload_data.end(), blobs_start);
+  const size_t split = blobs_start - payload_data.begin() + 4096 + 100;
+  EXPECT_TRUE(performer_.Write(payload_data.data(), split));
+  EXPECT_TRUE(performer_.Write(payload_data.data() + split,
+                               payload_data.size() - split));
+  EXPECT_EQ(0, performer_.Close());
+
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(new_part.path(), &partition_data));
+  EXPECT_EQ(expected_data, partition_data);
+
+  brillo::Blob payload_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(payload_data, &payload_hash));
+  EXPECT_EQ(ErrorCode::kSuccess,
+            performer_.VerifyPayload(payload_hash, payload_data.size()));
+}
+
+TEST_F(DeltaPerformerTest, ReplaceBzOperationStreamedTest) {
+  // Random data doesn't compress, so the operation is large enough to be
+  // applied while its data is received.
+  std::mt19937 random(42);
+  brillo::Blob expected_data(DeltaPerformer::kMinStreamedReplaceSize +
+                             4096 * 16);
+  for (uint8_t& b : expected_data) {
+    b = static_cast<uint8_t>(random());
+  }
+  brillo::Blob bz_data;
+  ASSERT_TRUE(BzipCompress(expected_data, &bz_data));
+  ASSERT_GE(bz_data.size(), DeltaPerformer::kMinStreamedReplaceSize);
+
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, expected_data.size() / 4096);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(bz_data.size());
+  aop.op.set_type(InstallOperation::REPLACE_BZ);
+  brillo::Blob payload_data = GeneratePayload(bz_data, {aop}, true);
+  payload_.size = payload_data.size();
+  install_plan_.stream_replace_operations = true;
+
+  ScopedTempFile new_part("Partition-XXXXXX");
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameRoot, install_plan_.target_slot, new_part.path());
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+
+  // Pass the payload in pieces much smaller than the operation.
+  const size_t kChunkSize = 64 * 1024;
+  for (size_t offset = 0; offset < payload_data.size(); offset += kChunkSize) {
+    ASSERT_TRUE(performer_.Write(
+        payload_data.data() + offset,
+        std::min(kChunkSize, payload_data.size() - offset)));
+  }
+  EXPECT_EQ(0, performer_.Close());
+
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(new_part.path(), &partition_data));
+  EXPECT_EQ(expected_data, partition_data);
+
+  brillo::Blob payload_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(payload_data, &payload_hash));
+  EXPECT_EQ(ErrorCode::kSuccess,
+            performer_.VerifyPayload(payload_hash, payload_data.size()));
+}
+
+TEST_F(DeltaPerformerTest, ReplaceOperationStreamedHashMismatchTest) {
+  brillo::Blob expected_data(DeltaPerformer::kMinStreamedReplaceSize);
+  test_utils::FillWithData(&expected_data);
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, expected_data.size() / 4096);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  brillo::Blob payload_data = GeneratePayload(expected_data, {aop}, true);
+  payload_.size = payload_data.size();
+  install_plan_.hash_checks_mandatory = true;
+  install_plan_.stream_replace_operations = true;
+
+  ScopedTempFile new_part("Partition-XXXXXX");
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameRoot, install_plan_.target_slot, new_part.path());
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+
+  // Corrupt the last byte of the operation's data, which is only noticed
+  // once all of it is written.
+  const auto blob_start = std::search(payload_data.begin(),
+                                      payload_data.end(),
+                                      expected_data.begin(),
+                                      expected_data.end());
+  ASSERT_NE(payload_data.end(), blob_start);
+  const size_t blob_end =
+      blob_start - payload_data.begin() + aop.op.data_length();
+  payload_data[blob_end - 1] ^= 0xff;
+
+  const size_t split = blob_end - 4096;
+  ASSERT_TRUE(performer_.Write(payload_data.data(), split));
+  ErrorCode error{};
+  EXPECT_FALSE(performer_.Write(
+      payload_data.data() + split, payload_data.size() - split, &error));
+  EXPECT_EQ(ErrorCode::kDownloadOperationHashMismatch, error);
+  EXPECT_NE(0, performer_.Close());
+
+  // The progress saved still points at the start of the operation.
+  int64_t next_operation = -1;
+  int64_t next_data_offset = -1;
+  EXPECT_TRUE(
+      prefs_.GetInt64(kPrefsUpdateStateNextOperation, &next_operation));
+  EXPECT_TRUE(
+      prefs_.GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset));
+  EXPECT_EQ(0, next_operation);
+  EXPECT_EQ(0, next_data_offset);
+}
+
+TEST_F(DeltaPerformerTest, ReplaceOperationStreamedCheckpointTest) {
+  brillo::Blob expected_data(DeltaPerformer::kMinStreamedReplaceSize * 2 +
+                             4096);
+  test_utils::FillWithData(&expected_data);
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, expected_data.size() / 4096);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  brillo::Blob payload_data = GeneratePayload(expected_data, {aop}, true);
+  payload_.size = payload_data.size();
+  install_plan_.stream_replace_operations = true;
+  install_plan_.replace_checkpoint_size =
+      DeltaPerformer::kMinStreamedReplaceSize;
+
+  ScopedTempFile new_part("Partition-XXXXXX");
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameRoot, install_plan_.target_slot, new_part.path());
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+
+  // Stop a bit after the first checkpoint in the operation.
+  const auto blob_start = std::search(payload_data.begin(),
+                                      payload_data.end(),
+                                      expected_data.begin(),
+                                      expected_data.end());
+  ASSERT_NE(payload_data.end(), blob_start);
+  const size_t split = blob_start - payload_data.begin() +
+                       install_plan_.replace_checkpoint_size + 4096;
+  const size_t kChunkSize = 64 * 1024;
+  for (size_t offset = 0; offset < split; offset += kChunkSize) {
+    ASSERT_TRUE(performer_.Write(payload_data.data() + offset,
+                                 std::min(kChunkSize, split - offset)));
+  }
+  performer_.Close();
+
+  // The progress saved points at the checkpoint in the operation.
+  int64_t next_operation = -1;
+  int64_t next_data_offset = -1;
+  int64_t partial_operation_bytes = -1;
+  std::string hash_context;
+  EXPECT_TRUE(
+      prefs_.GetInt64(kPrefsUpdateStateNextOperation, &next_operation));
+  EXPECT_TRUE(
+      prefs_.GetInt64(kPrefsUpdateStateNextDataOffset, &next_data_offset));
+  EXPECT_TRUE(prefs_.GetInt64(kPrefsUpdateStatePartialOperationBytes,
+                              &partial_operation_bytes));
+  EXPECT_TRUE(prefs_.GetString(kPrefsUpdateStatePartialOperationHashContext,
+                               &hash_context));
+  EXPECT_EQ(0, next_operation);
+  EXPECT_EQ(static_cast<int64_t>(install_plan_.replace_checkpoint_size),
+            next_data_offset);
+  EXPECT_EQ(next_data_offset, partial_operation_bytes);
+  EXPECT_FALSE(hash_context.empty());
+}
+
 TEST_F(DeltaPerformerTest, SourceCopyOperationTest) {
   brillo::Blob expected_data(std::begin(kRandomString),
                              std::end(kRandomString));
@@ -655,6 +877,108 @@ TEST_F(DeltaPerformerTest, SourceHashMismatchTest) {
   EXPECT_EQ(brillo::Blob{}, ApplyPayload(payload_data, source.path(), false));
 }
 
+TEST_F(DeltaPerformerTest, PipelinedApplyTest) {
+  install_plan_.pipelined_apply = true;
+  brillo::Blob expected_data(std::begin(kRandomString),
+                             std::end(kRandomString));
+  expected_data.resize(4096 * 2);  // two blocks
+  brillo::Blob src_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+      expected_data.data(), 4096, &src_hash));
+
+  vector<AnnotatedOperation> aops;
+  AnnotatedOperation copy_aop;
+  *(copy_aop.op.add_src_extents()) = ExtentForRange(0, 1);
+  *(copy_aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  copy_aop.op.set_type(InstallOperation::SOURCE_COPY);
+  copy_aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+  aops.push_back(copy_aop);
+
+  AnnotatedOperation replace_aop;
+  *(replace_aop.op.add_dst_extents()) = ExtentForRange(1, 1);
+  replace_aop.op.set_data_offset(0);
+  replace_aop.op.set_data_length(4096);
+  replace_aop.op.set_type(InstallOperation::REPLACE);
+  aops.push_back(replace_aop);
+
+  ScopedTempFile source("Source-XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileVector(source.path(), expected_data));
+
+  PartitionConfig old_part(kPartitionNameRoot);
+  old_part.path = source.path();
+  old_part.size = expected_data.size();
+
+  brillo::Blob payload_data =
+      GeneratePayload(brillo::Blob(expected_data.begin() + 4096,
+                                   expected_data.end()),
+                      aops,
+                      false,
+                      &old_part);
+
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, source.path(), true));
+}
+
+TEST_F(DeltaPerformerTest, PipelinedParallelApplyTest) {
+  install_plan_.pipelined_apply = true;
+  install_plan_.apply_workers = 4;
+  constexpr size_t kNumBlocks = 16;
+  brillo::Blob expected_data(kNumBlocks * 4096);
+  for (size_t i = 0; i < expected_data.size(); i++) {
+    // Make every block differ from the others.
+    expected_data[i] = static_cast<uint8_t>(
+        kRandomString[i % sizeof(kRandomString)] + i / 4096);
+  }
+
+  // One REPLACE operation per block, written in reverse block order.
+  vector<AnnotatedOperation> aops;
+  for (size_t i = 0; i < kNumBlocks; i++) {
+    AnnotatedOperation aop;
+    *(aop.op.add_dst_extents()) = ExtentForRange(kNumBlocks - 1 - i, 1);
+    aop.op.set_data_offset(i * 4096);
+    aop.op.set_data_length(4096);
+    aop.op.set_type(InstallOperation::REPLACE);
+    aops.push_back(aop);
+  }
+  brillo::Blob blob_data;
+  for (size_t i = 0; i < kNumBlocks; i++) {
+    const auto block = expected_data.begin() + (kNumBlocks - 1 - i) * 4096;
+    blob_data.insert(blob_data.end(), block, block + 4096);
+  }
+
+  brillo::Blob payload_data = GeneratePayload(blob_data, aops, false);
+
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
+TEST_F(DeltaPerformerTest, PipelinedApplyFailureTest) {
+  install_plan_.pipelined_apply = true;
+  brillo::Blob expected_data = {'f', 'o', 'o'};
+  brillo::Blob actual_data = {'b', 'a', 'r'};
+  expected_data.resize(4096);  // block size
+  actual_data.resize(4096);    // block size
+
+  AnnotatedOperation aop;
+  *(aop.op.add_src_extents()) = ExtentForRange(0, 1);
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_type(InstallOperation::SOURCE_COPY);
+  brillo::Blob src_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(expected_data, &src_hash));
+  aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+
+  ScopedTempFile source("Source-XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileVector(source.path(), actual_data));
+
+  PartitionConfig old_part(kPartitionNameRoot);
+  old_part.path = source.path();
+  old_part.size = actual_data.size();
+
+  brillo::Blob payload_data =
+      GeneratePayload(brillo::Blob(), {aop}, false, &old_part);
+
+  // The failure surfaces from the pipeline, and nothing gets written.
+  EXPECT_EQ(brillo::Blob{}, ApplyPayload(payload_data, source.path(), false));
+}
+
 TEST_F(DeltaPerformerTest, ExtentsToByteStringTest) {
   uint64_t test[] = {1, 1, 4, 2, 0, 1};
   static_assert(base::size(test) % 2 == 0, "Array size uneven");
@@ -723,6 +1047,76 @@ TEST_F(DeltaPerformerTest, ValidateManifestDeltaMinGoodTest) {
                         ErrorCode::kSuccess);
 }
 
+TEST_F(DeltaPerformerTest, ValidateManifestDeltaDataHashAlgorithmTest) {
+  DeltaArchiveManifest manifest;
+  auto part = manifest.add_partitions();
+  part->set_partition_name("rootfs");
+  part->mutable_old_partition_info();
+  part->mutable_new_partition_info();
+  manifest.set_data_hash_algorithm(DeltaArchiveManifest::BLAKE2B_256);
+  manifest.set_minor_version(kDataHashAlgorithmMinorPayloadVersion);
+  RunManifestValidation(manifest,
+                        kBrilloMajorPayloadVersion,
+                        InstallPayloadType::kDelta,
+                        ErrorCode::kSuccess);
+
+  manifest.set_minor_version(kDataHashAlgorithmMinorPayloadVersion - 1);
+  RunManifestValidation(manifest,
+                        kBrilloMajorPayloadVersion,
+                        InstallPayloadType::kDelta,
+                        ErrorCode::kUnsupportedMinorPayloadVersion);
+}
+
+TEST_F(DeltaPerformerTest, ValidateManifestPackedExtentsTest) {
+  DeltaArchiveManifest manifest;
+  auto part = manifest.add_partitions();
+  part->set_partition_name("rootfs");
+  part->mutable_old_partition_info();
+  part->mutable_new_partition_info();
+  auto op = part->add_operations();
+  op->set_type(InstallOperation::SOURCE_COPY);
+  PackExtents({}, op->mutable_packed_src_extents());
+  manifest.set_minor_version(kPackedExtentsMinorPayloadVersion);
+  RunManifestValidation(manifest,
+                        kBrilloMajorPayloadVersion,
+                        InstallPayloadType::kDelta,
+                        ErrorCode::kSuccess);
+
+  manifest.set_minor_version(kPackedExtentsMinorPayloadVersion - 1);
+  RunManifestValidation(manifest,
+                        kBrilloMajorPayloadVersion,
+                        InstallPayloadType::kDelta,
+                        ErrorCode::kUnsupportedMinorPayloadVersion);
+}
+
+TEST_F(DeltaPerformerTest, ValidateManifestOperationsSectionTest) {
+  DeltaArchiveManifest manifest;
+  auto part = manifest.add_partitions();
+  part->set_partition_name("rootfs");
+  part->mutable_old_partition_info();
+  part->mutable_new_partition_info();
+  part->mutable_operations_section()->set_num_operations(2);
+  manifest.set_minor_version(kOperationsSectionMinorPayloadVersion);
+  RunManifestValidation(manifest,
+                        kBrilloMajorPayloadVersion,
+                        InstallPayloadType::kDelta,
+                        ErrorCode::kSuccess);
+
+  manifest.set_minor_version(kOperationsSectionMinorPayloadVersion - 1);
+  RunManifestValidation(manifest,
+                        kBrilloMajorPayloadVersion,
+                        InstallPayloadType::kDelta,
+                        ErrorCode::kUnsupportedMinorPayloadVersion);
+
+  // The operations are either in the manifest or in the section.
+  manifest.set_minor_version(kOperationsSectionMinorPayloadVersion);
+  manifest.mutable_partitions(0)->add_operations();
+  RunManifestValidation(manifest,
+                        kBrilloMajorPayloadVersion,
+                        InstallPayloadType::kDelta,
+                        ErrorCode::kDownloadManifestParseError);
+}
+
 TEST_F(DeltaPerformerTest, ValidateManifestFullUnsetMinorVersion) {
   // The Manifest we are validating.
   DeltaArchiveManifest manifest;
@@ -934,6 +1328,44 @@ TEST_F(DeltaPerformerTest, BrilloParsePayloadMetadataTest) {
   EXPECT_EQ(ErrorCode::kSuccess, error);
 }
 
+TEST_F(DeltaPerformerTest, ReusesParsedManifestTest) {
+  brillo::Blob payload_data = GeneratePayload(
+      {}, {}, true, kBrilloMajorPayloadVersion, kSourceMinorPayloadVersion);
+  install_plan_.hash_checks_mandatory = true;
+  payload_.size = payload_data.size();
+  ErrorCode error{};
+  EXPECT_EQ(MetadataParseResult::kSuccess,
+            performer_.ParsePayloadMetadata(payload_data, &error));
+
+  // Another attempt at the same payload gets the same manifest.
+  DeltaPerformer performer(&prefs_,
+                           &fake_boot_control_,
+                           &fake_hardware_,
+                           &mock_delegate_,
+                           &install_plan_,
+                           &payload_,
+                           false /* interactive */,
+                           "" /* Update certs path */);
+  EXPECT_EQ(MetadataParseResult::kSuccess,
+            performer.ParsePayloadMetadata(payload_data, &error));
+  EXPECT_EQ(performer_.manifest_.SerializeAsString(),
+            performer.manifest_.SerializeAsString());
+
+  // The metadata signature is still checked.
+  payload_.metadata_signature = kBogusMetadataSignature1;
+  DeltaPerformer bad_signature_performer(&prefs_,
+                                         &fake_boot_control_,
+                                         &fake_hardware_,
+                                         &mock_delegate_,
+                                         &install_plan_,
+                                         &payload_,
+                                         false /* interactive */,
+                                         "" /* Update certs path */);
+  EXPECT_EQ(MetadataParseResult::kError,
+            bad_signature_performer.ParsePayloadMetadata(payload_data, &error));
+  EXPECT_EQ(ErrorCode::kDownloadMetadataSignatureMismatch, error);
+}
+
 TEST_F(DeltaPerformerTest, BadDeltaMagicTest) {
   EXPECT_TRUE(performer_.Write("junk", 4));
   EXPECT_FALSE(performer_.Write("morejunk", 8));
@@ -1196,4 +1628,83 @@ TEST_F(DeltaPerformerTest, SetNextOpIndex) {
   ASSERT_EQ(indices[indices.size() - 1], 2UL);
 }
 
+TEST_F(DeltaPerformerTest, MinimalCheckpointsTest) {
+  install_plan_.minimal_checkpoints = true;
+  TestDeltaPerformer delta_performer{&prefs_,
+                                     &fake_boot_control_,
+                                     &fake_hardware_,
+                                     &mock_delegate_,
+                                     &install_plan_,
+                                     &payload_,
+                                     false};
+  brillo::Blob expected_data(std::begin(kRandomString),
+                             std::end(kRandomString));
+  expected_data.resize(4096 * 2);  // block size
+
+  ScopedTempFile source("Source-XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileVector(source.path(), expected_data));
+
+  PartitionConfig old_part(kPartitionNameRoot);
+  old_part.path = source.path();
+  old_part.size = expected_data.size();
+
+  delta_performer.partition_writers_[kPartitionNameRoot] =
+      std::make_unique<MockPartitionWriter>();
+  auto& writer1 = *delta_performer.partition_writers_[kPartitionNameRoot];
+
+  std::vector<size_t> indices;
+  EXPECT_CALL(writer1, CheckpointUpdateProgress(_))
+      .WillRepeatedly(
+          [&indices](size_t index) mutable { indices.emplace_back(index); });
+  EXPECT_CALL(writer1, Init(_, true, _)).Times(1).WillOnce(Return(true));
+  EXPECT_CALL(writer1, PerformSourceCopyOperation(_, _))
+      .Times(2)
+      .WillRepeatedly(Return(true));
+
+  brillo::Blob payload_data = GeneratePayload(
+      brillo::Blob(),
+      {GetSourceCopyOp(0, 0, expected_data.data(), 4096),
+       GetSourceCopyOp(1, 1, expected_data.data() + 4096, 4096)},
+      false,
+      &old_part);
+
+  ApplyPayloadToData(&delta_performer, payload_data, source.path(), {}, true);
+  ASSERT_GT(indices.size(), 0UL);
+  // Only the partition was checkpointed, not the operations along the way.
+  EXPECT_EQ(indices.end(), std::find(indices.begin(), indices.end(), 1UL));
+}
+
+TEST_F(DeltaPerformerTest, CanDisableVabcCompressionTest) {
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(4096);
+  auto* dynamic_metadata = manifest.mutable_dynamic_partition_metadata();
+  dynamic_metadata->set_vabc_enabled(true);
+  dynamic_metadata->set_vabc_compression_param("lz4");
+  auto* partition = manifest.add_partitions();
+  partition->mutable_new_partition_info()->set_size(1024 * 1024 * 1024);
+  partition->set_estimate_cow_size(256 * 1024 * 1024);
+  const uint64_t full_cow_size =
+      DeltaPerformer::GetUncompressedCowSize(*partition, 4096);
+  ASSERT_GT(full_cow_size, 1024ULL * 1024 * 1024);
+  // The blocks copied don't take space in the COW.
+  auto* merge_op = partition->add_merge_operations();
+  merge_op->set_type(CowMergeOperation::COW_COPY);
+  *merge_op->mutable_dst_extent() = ExtentForRange(0, 1024);
+  const uint64_t cow_size =
+      DeltaPerformer::GetUncompressedCowSize(*partition, 4096);
+  ASSERT_EQ(full_cow_size - 1024 * 4096, cow_size);
+
+  const uint64_t needed =
+      cow_size + DeltaPerformer::kMinFreeSpaceAfterUncompressedCow;
+  EXPECT_TRUE(DeltaPerformer::CanDisableVabcCompression(manifest, needed));
+  EXPECT_FALSE(
+      DeltaPerformer::CanDisableVabcCompression(manifest, needed - 1));
+
+  dynamic_metadata->set_vabc_compression_param("none");
+  EXPECT_FALSE(DeltaPerformer::CanDisableVabcCompression(manifest, needed));
+  dynamic_metadata->set_vabc_compression_param("lz4");
+  dynamic_metadata->set_vabc_enabled(false);
+  EXPECT_FALSE(DeltaPerformer::CanDisableVabcCompression(manifest, needed));
+}
+
 }  // namespace chromeos_update_engine
@@ -17,7 +17,9 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_MAP_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_MAP_H_
 
-#include <map>
+#include <algorithm>
+#include <cstdint>
+#include <optional>
 #include <utility>
 #include <vector>
 
@@ -32,48 +34,55 @@ namespace chromeos_update_engine {
 // Currently the only usecase is for VABCPartitionWriter to keep track of which
 // block belongs to which merge operation. Therefore this class only contains
 // the minimal set of functions needed.
-template <typename T, typename Comparator = ExtentLess>
+//
+// The extents are kept in a flat array sorted by start block, so every lookup
+// is a single binary search followed by a scan of the entries it overlaps.
+// Adding extents in increasing order is the fast path; adding one in front of
+// others moves the ones after it.
+template <typename T>
 class ExtentMap {
  public:
-  bool AddExtent(const Extent& extent, T&& value) {
-    if (set_.OverlapsWithExtent(extent)) {
+  bool AddExtent(const Extent& extent, T value) {
+    if (extent.num_blocks() == 0) {
       return false;
     }
-    const auto& [it, inserted] = map_.insert({extent, std::forward<T>(value)});
-    if (inserted) {
-      set_.AddExtent(extent);
+    const uint64_t start = extent.start_block();
+    const uint64_t end = start + extent.num_blocks();
+    // The first entry ending after |extent| starts.
+    auto it = FirstEndingAfter(start);
+    if (it != entries_.end() && it->start < end) {
+      return false;
     }
-    return inserted;
+    entries_.insert(it, {start, end, std::move(value)});
+    return true;
   }
 
-  size_t size() const { return map_.size(); }
+  size_t size() const { return entries_.size(); }
 
   // Return a pointer to entry which is intersecting |extent|. If T is already
   // a pointer type, return T on success. This function always return
   // |nullptr| on failure. Therefore you cannot store nullptr as an entry.
   std::optional<T> Get(const Extent& extent) const {
-    const auto it = map_.find(extent);
-    if (it == map_.end()) {
-      for (const auto& ext : set_.GetCandidateRange(extent)) {
-        // Sometimes there are operations like
-        // map.AddExtent({0, 5}, 42);
-        // map.Get({2, 1})
-        // If the querying extent is completely covered within the key, we still
-        // consdier this to be a valid query.
-
-        if (ExtentContains(ext, extent)) {
-          return map_.at(ext);
-        }
-        if (ExtentRanges::ExtentsOverlap(ext, extent)) {
-          LOG(WARNING) << "Looking up a partially intersecting extent isn't "
-                          "supported by "
-                          "this data structure. Querying extent: "
-                       << extent << ", partial match in map: " << ext;
-        }
+    const uint64_t start = extent.start_block();
+    const uint64_t end = start + extent.num_blocks();
+    for (auto it = FirstEndingAfter(start);
+         it != entries_.end() && it->start < end;
+         ++it) {
+      // Sometimes there are operations like
+      // map.AddExtent({0, 5}, 42);
+      // map.Get({2, 1})
+      // If the querying extent is completely covered within the key, we still
+      // consdier this to be a valid query.
+      if (it->start <= start && end <= it->end) {
+        return {it->value};
       }
-      return {};
+      LOG(WARNING) << "Looking up a partially intersecting extent isn't "
+                      "supported by "
+                      "this data structure. Querying extent: "
+                   << extent << ", partial match in map: "
+                   << ExtentForRange(it->start, it->end - it->start);
     }
-    return {it->second};
+    return {};
   }
 
   // Return a set of extents that are contained in this extent map.
@@ -86,19 +95,58 @@ class ExtentMap {
   // E.g. extent map contains [0,5] and [10,15], GetIntersectingExtents([3, 12])
   // would return [3,5] and [10,12]
   std::vector<Extent> GetIntersectingExtents(const Extent& extent) const {
-    return set_.GetIntersectingExtents(extent);
+    const uint64_t start = extent.start_block();
+    const uint64_t end = start + extent.num_blocks();
+    std::vector<Extent> result;
+    for (auto it = FirstEndingAfter(start);
+         it != entries_.end() && it->start < end;
+         ++it) {
+      const uint64_t overlap_start = std::max(start, it->start);
+      result.push_back(ExtentForRange(
+          overlap_start, std::min(end, it->end) - overlap_start));
+    }
+    return result;
   }
 
   // Complement of |GetIntersectingExtents|, return vector of extents which are
   // part of |extent| but not covered by this map.
   std::vector<Extent> GetNonIntersectingExtents(const Extent& extent) const {
-    return FilterExtentRanges({extent}, set_);
+    uint64_t start = extent.start_block();
+    const uint64_t end = start + extent.num_blocks();
+    std::vector<Extent> result;
+    for (auto it = FirstEndingAfter(start);
+         it != entries_.end() && it->start < end;
+         ++it) {
+      if (it->start > start) {
+        result.push_back(ExtentForRange(start, it->start - start));
+      }
+      start = it->end;
+    }
+    if (start < end) {
+      result.push_back(ExtentForRange(start, end - start));
+    }
+    return result;
   }
 
  private:
-  // Get a range of exents that potentially intersect with parameter |extent|
-  std::map<Extent, T, Comparator> map_;
-  ExtentRanges set_{false};
+  struct Entry {
+    uint64_t start;
+    uint64_t end;
+    T value;
+  };
+  using Iterator = typename std::vector<Entry>::const_iterator;
+
+  // Returns the first entry ending after |block|. Since the entries are
+  // disjoint, they are sorted by their end as well.
+  Iterator FirstEndingAfter(uint64_t block) const {
+    return std::upper_bound(
+        entries_.begin(),
+        entries_.end(),
+        block,
+        [](uint64_t b, const Entry& entry) { return b < entry.end; });
+  }
+
+  std::vector<Entry> entries_;
 };
 }  // namespace chromeos_update_engine
 
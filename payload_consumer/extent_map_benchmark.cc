@@ -0,0 +1,102 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// ExtentMap lookups, as done by the VABC partition writer for every extent of
+// every operation, for maps of every size and queries spanning more and more
+// of their entries.
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "update_engine/payload_consumer/extent_map.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// A map of |count| extents of 4 blocks with 4 blocks between them.
+ExtentMap<size_t> BuildMap(size_t count) {
+  ExtentMap<size_t> map;
+  for (size_t i = 0; i < count; i++)
+    map.AddExtent(ExtentForRange(i * 8, 4), i);
+  return map;
+}
+
+// Extents covering |span| entries of a map of |count| entries, in random
+// order.
+vector<Extent> Queries(size_t count, size_t span) {
+  vector<Extent> queries;
+  for (size_t i = 0; i + span <= count; i += span)
+    queries.push_back(ExtentForRange(i * 8, span * 8 - 4));
+  std::shuffle(queries.begin(), queries.end(), std::mt19937(42));
+  return queries;
+}
+
+void BM_ExtentMapAddExtent(benchmark::State& state) {
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(BuildMap(state.range(0)));
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+void BM_ExtentMapGet(benchmark::State& state) {
+  const auto map = BuildMap(state.range(0));
+  const vector<Extent> queries = Queries(state.range(0), 1);
+  for (auto _ : state) {
+    for (const auto& query : queries)
+      benchmark::DoNotOptimize(map.Get(query));
+  }
+  state.SetItemsProcessed(state.iterations() * queries.size());
+}
+
+// The second argument is the number of entries each query intersects, how
+// fragmented the extents looked up are.
+void BM_ExtentMapGetIntersectingExtents(benchmark::State& state) {
+  const auto map = BuildMap(state.range(0));
+  const vector<Extent> queries = Queries(state.range(0), state.range(1));
+  for (auto _ : state) {
+    for (const auto& query : queries)
+      benchmark::DoNotOptimize(map.GetIntersectingExtents(query));
+  }
+  state.SetItemsProcessed(state.iterations() * queries.size());
+}
+
+void BM_ExtentMapGetNonIntersectingExtents(benchmark::State& state) {
+  const auto map = BuildMap(state.range(0));
+  const vector<Extent> queries = Queries(state.range(0), state.range(1));
+  for (auto _ : state) {
+    for (const auto& query : queries)
+      benchmark::DoNotOptimize(map.GetNonIntersectingExtents(query));
+  }
+  state.SetItemsProcessed(state.iterations() * queries.size());
+}
+
+}  // namespace
+
+BENCHMARK(BM_ExtentMapAddExtent)->Range(1 << 8, 1 << 16);
+BENCHMARK(BM_ExtentMapGet)->Range(1 << 8, 1 << 16);
+BENCHMARK(BM_ExtentMapGetIntersectingExtents)
+    ->Ranges({{1 << 8, 1 << 16}, {1, 64}});
+BENCHMARK(BM_ExtentMapGetNonIntersectingExtents)
+    ->Ranges({{1 << 8, 1 << 16}, {1, 64}});
+
+}  // namespace chromeos_update_engine
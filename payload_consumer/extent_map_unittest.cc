@@ -158,4 +158,24 @@ TEST_F(ExtentMapTest, GetTouchingExtents) {
   ASSERT_EQ(extents[1], ExtentForRange(10, 5));
 }
 
+TEST_F(ExtentMapTest, AddOutOfOrder) {
+  ASSERT_TRUE(map_.AddExtent(ExtentForRange(20, 5), 3));
+  ASSERT_TRUE(map_.AddExtent(ExtentForRange(0, 5), 1));
+  ASSERT_TRUE(map_.AddExtent(ExtentForRange(10, 5), 2));
+  ASSERT_FALSE(map_.AddExtent(ExtentForRange(4, 2), 4));
+  ASSERT_FALSE(map_.AddExtent(ExtentForRange(8, 20), 4));
+  ASSERT_FALSE(map_.AddExtent(ExtentForRange(30, 0), 4));
+  ASSERT_EQ(map_.size(), 3UL);
+
+  ASSERT_EQ(map_.Get(ExtentForRange(1, 2)), std::optional<int>{1});
+  ASSERT_EQ(map_.Get(ExtentForRange(10, 5)), std::optional<int>{2});
+  ASSERT_EQ(map_.Get(ExtentForRange(24, 1)), std::optional<int>{3});
+  ASSERT_EQ(map_.GetIntersectingExtents(ExtentForRange(3, 20)),
+            (std::vector<Extent>{ExtentForRange(3, 2),
+                                 ExtentForRange(10, 5),
+                                 ExtentForRange(20, 3)}));
+  ASSERT_EQ(map_.GetNonIntersectingExtents(ExtentForRange(3, 20)),
+            (std::vector<Extent>{ExtentForRange(5, 5), ExtentForRange(15, 5)}));
+}
+
 }  // namespace chromeos_update_engine
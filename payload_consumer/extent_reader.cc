@@ -32,14 +32,18 @@ bool DirectExtentReader::Init(FileDescriptorPtr fd,
                               const RepeatedPtrField<Extent>& extents,
                               uint32_t block_size) {
   fd_ = fd;
-  extents_ = extents;
+  extents_ = ToBlockExtents(extents);
   block_size_ = block_size;
-  cur_extent_ = extents_.begin();
+  cur_extent_ = 0;
+  cur_extent_bytes_read_ = 0;
+  offset_ = 0;
 
+  extents_upper_bounds_.clear();
   extents_upper_bounds_.reserve(extents_.size() + 1);
   // We add this pad as the first element to not bother with boundary checks
   // later.
   extents_upper_bounds_.emplace_back(0);
+  total_size_ = 0;
   for (const auto& extent : extents_) {
     total_size_ += extent.num_blocks() * block_size_;
     extents_upper_bounds_.emplace_back(total_size_);
@@ -54,47 +58,98 @@ bool DirectExtentReader::Seek(uint64_t offset) {
   }
   // The first item is zero and upper_bound never returns it because it always
   // return the item which is greater than the given value.
-  auto extent_idx =
+  cur_extent_ =
       std::upper_bound(
           extents_upper_bounds_.begin(), extents_upper_bounds_.end(), offset) -
       extents_upper_bounds_.begin() - 1;
-  cur_extent_ = std::next(extents_.begin(), extent_idx);
   offset_ = offset;
-  cur_extent_bytes_read_ = offset_ - extents_upper_bounds_[extent_idx];
+  cur_extent_bytes_read_ = offset_ - extents_upper_bounds_[cur_extent_];
   return true;
 }
 
 bool DirectExtentReader::Read(void* buffer, size_t count) {
   auto bytes = reinterpret_cast<uint8_t*>(buffer);
+  // Read the pieces of all the extents covered by this call at once.
+  requests_.clear();
   uint64_t bytes_read = 0;
   while (bytes_read < count) {
-    if (cur_extent_ == extents_.end()) {
-      TEST_AND_RETURN_FALSE(bytes_read == count);
-    }
-    uint64_t cur_extent_bytes_left =
-        cur_extent_->num_blocks() * block_size_ - cur_extent_bytes_read_;
+    TEST_AND_RETURN_FALSE(cur_extent_ < extents_.size());
+    const BlockExtent& extent = extents_[cur_extent_];
+    const uint64_t extent_size = extent.num_blocks() * block_size_;
     uint64_t bytes_to_read =
-        std::min(count - bytes_read, cur_extent_bytes_left);
-
-    ssize_t out_bytes_read;
-    TEST_AND_RETURN_FALSE(utils::ReadAll(
-        fd_,
-        bytes + bytes_read,
-        bytes_to_read,
-        cur_extent_->start_block() * block_size_ + cur_extent_bytes_read_,
-        &out_bytes_read));
-    TEST_AND_RETURN_FALSE(out_bytes_read ==
-                          static_cast<ssize_t>(bytes_to_read));
+        std::min(count - bytes_read, extent_size - cur_extent_bytes_read_);
+
+    if (bytes_to_read > 0) {
+      requests_.push_back(
+          {static_cast<off64_t>(extent.start_block() * block_size_ +
+                                cur_extent_bytes_read_),
+           bytes + bytes_read,
+           static_cast<size_t>(bytes_to_read)});
+    }
 
     bytes_read += bytes_to_read;
     cur_extent_bytes_read_ += bytes_to_read;
     offset_ += bytes_to_read;
-    if (cur_extent_bytes_read_ == cur_extent_->num_blocks() * block_size_) {
+    if (cur_extent_bytes_read_ == extent_size) {
       // We have to advance the cur_extent_;
       cur_extent_++;
       cur_extent_bytes_read_ = 0;
     }
   }
+  TEST_AND_RETURN_FALSE_ERRNO(fd_->ReadBatch(requests_));
+  return true;
+}
+
+bool ReadAheadExtentReader::Init(FileDescriptorPtr fd,
+                                 const RepeatedPtrField<Extent>& extents,
+                                 uint32_t block_size) {
+  TEST_AND_RETURN_FALSE(reader_.Init(fd, extents, block_size));
+  block_size_ = block_size;
+  total_size_ = utils::BlocksInExtents(extents) * block_size;
+  offset_ = 0;
+  window_offset_ = 0;
+  window_size_ = 0;
+  return true;
+}
+
+bool ReadAheadExtentReader::Seek(uint64_t offset) {
+  TEST_AND_RETURN_FALSE(offset <= total_size_);
+  offset_ = offset;
+  return true;
+}
+
+bool ReadAheadExtentReader::Read(void* buffer, size_t count) {
+  auto bytes = static_cast<uint8_t*>(buffer);
+  while (count > 0) {
+    if (offset_ >= window_offset_ && offset_ < window_offset_ + window_size_) {
+      const size_t window_bytes = std::min<uint64_t>(
+          count, window_offset_ + window_size_ - offset_);
+      std::copy_n(window_.data() + (offset_ - window_offset_),
+                  window_bytes,
+                  bytes);
+      bytes += window_bytes;
+      count -= window_bytes;
+      offset_ += window_bytes;
+      continue;
+    }
+    TEST_AND_RETURN_FALSE(count <= total_size_ - offset_);
+    // The window has to reach past |offset_| once aligned.
+    TEST_AND_RETURN_FALSE(block_size_ > 0 && window_.size() >= block_size_);
+    if (count >= window_.size()) {
+      TEST_AND_RETURN_FALSE(reader_.Seek(offset_));
+      TEST_AND_RETURN_FALSE(reader_.Read(bytes, count));
+      offset_ += count;
+      return true;
+    }
+    window_offset_ = offset_ - offset_ % block_size_;
+    window_size_ =
+        std::min<uint64_t>(window_.size(), total_size_ - window_offset_);
+    TEST_AND_RETURN_FALSE(reader_.Seek(window_offset_));
+    if (!reader_.Read(window_.data(), window_size_)) {
+      window_size_ = 0;
+      return false;
+    }
+  }
   return true;
 }
 
@@ -19,7 +19,10 @@
 
 #include <vector>
 
+#include <brillo/secure_blob.h>
+
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -43,7 +46,9 @@ class ExtentReader {
 };
 
 // DirectExtentReader is probably the simplest ExtentReader implementation.
-// It reads the data directly from the extents.
+// It reads the data directly from the extents, which it keeps in a flat table
+// along with their offsets in the concatenated data, so that seeking is a
+// binary search.
 class DirectExtentReader : public ExtentReader {
  public:
   DirectExtentReader() = default;
@@ -57,11 +62,11 @@ class DirectExtentReader : public ExtentReader {
 
  private:
   FileDescriptorPtr fd_{nullptr};
-  google::protobuf::RepeatedPtrField<Extent> extents_;
+  std::vector<BlockExtent> extents_;
   size_t block_size_{0};
 
-  // Current extent being read from |fd_|.
-  google::protobuf::RepeatedPtrField<Extent>::iterator cur_extent_;
+  // Index in |extents_| of the extent being read from |fd_|.
+  size_t cur_extent_{0};
 
   // Bytes read from |cur_extent_| thus far.
   uint64_t cur_extent_bytes_read_{0};
@@ -74,9 +79,43 @@ class DirectExtentReader : public ExtentReader {
   std::vector<uint64_t> extents_upper_bounds_;
   uint64_t total_size_{0};
 
+  // The requests of the last Read(), kept to reuse their memory.
+  std::vector<FileIoRequest> requests_;
+
   DISALLOW_COPY_AND_ASSIGN(DirectExtentReader);
 };
 
+// An ExtentReader reading the extents through a window of up to |window_size|
+// bytes, read at once from a block boundary at or before the first byte not in
+// the window yet. The small reads close to each other of bspatch and
+// puffpatch are then served from memory. Reads at least as large as the
+// window go straight to the extents.
+class ReadAheadExtentReader : public ExtentReader {
+ public:
+  explicit ReadAheadExtentReader(size_t window_size)
+      : window_(window_size) {}
+  ~ReadAheadExtentReader() override = default;
+
+  bool Init(FileDescriptorPtr fd,
+            const google::protobuf::RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override;
+  bool Seek(uint64_t offset) override;
+  bool Read(void* bytes, size_t count) override;
+
+ private:
+  DirectExtentReader reader_;
+  uint32_t block_size_{0};
+  uint64_t total_size_{0};
+  uint64_t offset_{0};
+
+  // The bytes from |window_offset_| held in |window_|.
+  brillo::Blob window_;
+  uint64_t window_offset_{0};
+  uint64_t window_size_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(ReadAheadExtentReader);
+};
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_EXTENT_READER_H_
@@ -167,4 +167,36 @@ TEST_F(ExtentReaderTest, RandomReadTest) {
   }
 }
 
+TEST_F(ExtentReaderTest, ReadAheadRandomReadTest) {
+  vector<Extent> extents = {ExtentForRange(0, 0),
+                            ExtentForRange(1, 3),
+                            ExtentForRange(6, 0),
+                            ExtentForRange(8, 5),
+                            ExtentForRange(20, 2)};
+  // A window of a few blocks, smaller than the extents.
+  ReadAheadExtentReader reader(3 * kBlockSize + 1);
+  EXPECT_TRUE(reader.Init(fd_, {extents.begin(), extents.end()}, kBlockSize));
+
+  brillo::Blob result;
+  ReadExtents(extents, &result);
+
+  brillo::Blob blob(utils::BlocksInExtents(extents) * kBlockSize);
+  srand(time(nullptr));
+  uint32_t rand_seed;
+  for (size_t idx = 0; idx < kRandomIterations; idx++) {
+    // Mostly reads smaller than the window, some larger.
+    size_t start = rand_r(&rand_seed) % blob.size();
+    size_t size = rand_r(&rand_seed) % (blob.size() - start);
+    if (idx % 4 != 0)
+      size = min<size_t>(size, kBlockSize);
+    EXPECT_TRUE(reader.Seek(start));
+    EXPECT_TRUE(reader.Read(blob.data(), size));
+    for (size_t i = 0; i < size; i++) {
+      ASSERT_EQ(blob[i], result[start + i]);
+    }
+  }
+  EXPECT_TRUE(reader.Seek(blob.size() - 1));
+  EXPECT_FALSE(reader.Read(blob.data(), 2));
+}
+
 }  // namespace chromeos_update_engine
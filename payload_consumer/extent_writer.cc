@@ -21,8 +21,10 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <vector>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/operation_stats.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 
 using std::min;
@@ -33,6 +35,9 @@ bool DirectExtentWriter::Write(const void* bytes, size_t count) {
   if (count == 0)
     return true;
   const char* c_bytes = reinterpret_cast<const char*>(bytes);
+  // Collect the pieces of every extent touched by this call, and hand them to
+  // |fd_| at once.
+  std::vector<FileIoRequest> requests;
   size_t bytes_written = 0;
   while (bytes_written < count) {
     TEST_AND_RETURN_FALSE(cur_extent_ != extents_.end());
@@ -47,10 +52,9 @@ bool DirectExtentWriter::Write(const void* bytes, size_t count) {
     if (cur_extent_->start_block() != kSparseHole) {
       const off64_t offset =
           cur_extent_->start_block() * block_size_ + extent_bytes_written_;
-      TEST_AND_RETURN_FALSE_ERRNO(fd_->Seek(offset, SEEK_SET) !=
-                                  static_cast<off64_t>(-1));
-      TEST_AND_RETURN_FALSE(
-          utils::WriteAll(fd_, c_bytes + bytes_written, bytes_to_write));
+      requests.push_back({offset,
+                          const_cast<char*>(c_bytes + bytes_written),
+                          bytes_to_write});
     }
     bytes_written += bytes_to_write;
     extent_bytes_written_ += bytes_to_write;
@@ -62,6 +66,8 @@ bool DirectExtentWriter::Write(const void* bytes, size_t count) {
       cur_extent_++;
     }
   }
+  ScopedOperationPhase write_phase(OperationPhase::kWrite);
+  TEST_AND_RETURN_FALSE_ERRNO(fd_->WriteBatch(requests));
   return true;
 }
 
@@ -19,11 +19,13 @@
 
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include <base/logging.h>
 #include <brillo/secure_blob.h>
 
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/update_metadata.pb.h"
 
 // ExtentWriter is an abstract class which synchronously writes to a given
@@ -55,7 +57,7 @@ class DirectExtentWriter : public ExtentWriter {
   bool Init(const google::protobuf::RepeatedPtrField<Extent>& extents,
             uint32_t block_size) override {
     block_size_ = block_size;
-    extents_ = extents;
+    extents_ = ToBlockExtents(extents);
     cur_extent_ = extents_.begin();
     return true;
   }
@@ -67,9 +69,9 @@ class DirectExtentWriter : public ExtentWriter {
   size_t block_size_{0};
   // Bytes written into |cur_extent_| thus far.
   uint64_t extent_bytes_written_{0};
-  google::protobuf::RepeatedPtrField<Extent> extents_;
+  std::vector<BlockExtent> extents_;
   // The next call to write should correspond to |cur_extents_|.
-  google::protobuf::RepeatedPtrField<Extent>::iterator cur_extent_;
+  std::vector<BlockExtent>::const_iterator cur_extent_;
 };
 
 }  // namespace chromeos_update_engine
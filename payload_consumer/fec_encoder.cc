@@ -0,0 +1,216 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/fec_encoder.h"
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+#include <algorithm>
+
+#include <base/logging.h>
+#include <fec/ecc.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Number of codewords whose parity registers are kept together, small enough
+// for the registers to stay in L1.
+constexpr size_t kTileSize = 256;
+
+// Picks the field polynomial out of the arguments of init_rs_char().
+constexpr unsigned int FieldPolynomial(int /* symsize */,
+                                       int gfpoly,
+                                       int /* fcr */,
+                                       int /* prim */,
+                                       int /* nroots */,
+                                       int /* pad */) {
+  return gfpoly;
+}
+
+// Multiplies |a| and |b| in GF(2^8) modulo |field_polynomial|.
+uint8_t GfMultiply(uint8_t a, uint8_t b, unsigned int field_polynomial) {
+  unsigned int x = a;
+  unsigned int result = 0;
+  for (; b != 0; b >>= 1) {
+    if (b & 1) {
+      result ^= x;
+    }
+    x <<= 1;
+    if (x & 0x100) {
+      x ^= field_polynomial;
+    }
+  }
+  return result;
+}
+
+// If |accumulate|, |dst| ^= c * |src|, otherwise |dst| = c * |src|, for |size|
+// bytes, c being given by the nibble tables |low| and |high|.
+template <bool accumulate>
+void MultiplyRegion(const uint8_t* low,
+                    const uint8_t* high,
+                    const uint8_t* src,
+                    uint8_t* dst,
+                    size_t size) {
+  size_t i = 0;
+#if defined(__aarch64__)
+  const uint8x16_t low_table = vld1q_u8(low);
+  const uint8x16_t high_table = vld1q_u8(high);
+  const uint8x16_t mask = vdupq_n_u8(0x0f);
+  for (; i + 16 <= size; i += 16) {
+    const uint8x16_t v = vld1q_u8(src + i);
+    uint8x16_t product =
+        veorq_u8(vqtbl1q_u8(low_table, vandq_u8(v, mask)),
+                 vqtbl1q_u8(high_table, vshrq_n_u8(v, 4)));
+    if (accumulate) {
+      product = veorq_u8(product, vld1q_u8(dst + i));
+    }
+    vst1q_u8(dst + i, product);
+  }
+#elif defined(__SSSE3__)
+  const __m128i low_table =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(low));
+  const __m128i high_table =
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(high));
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  for (; i + 16 <= size; i += 16) {
+    const __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+    const __m128i high_nibbles = _mm_and_si128(_mm_srli_epi64(v, 4), mask);
+    __m128i product =
+        _mm_xor_si128(_mm_shuffle_epi8(low_table, _mm_and_si128(v, mask)),
+                      _mm_shuffle_epi8(high_table, high_nibbles));
+    if (accumulate) {
+      product = _mm_xor_si128(
+          product, _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i)));
+    }
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), product);
+  }
+#endif
+  for (; i < size; i++) {
+    const uint8_t product = low[src[i] & 0x0f] ^ high[src[i] >> 4];
+    dst[i] = accumulate ? dst[i] ^ product : product;
+  }
+}
+
+void XorRegion(const uint8_t* src, uint8_t* dst, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    dst[i] ^= src[i];
+  }
+}
+}  // namespace
+
+FecEncoder::FecEncoder(size_t fec_roots,
+                       size_t block_size,
+                       size_t num_threads)
+    : fec_roots_(fec_roots),
+      block_size_(block_size),
+      rs_n_(FEC_RSM - fec_roots),
+      rs_char_(nullptr, &free_rs_char),
+      scratch_(std::max<size_t>(num_threads, 1)),
+      pool_(num_threads) {}
+
+bool FecEncoder::Init() {
+  TEST_AND_RETURN_FALSE(fec_roots_ < FEC_RSM);
+  rs_char_.reset(init_rs_char(FEC_PARAMS(fec_roots_)));
+  TEST_AND_RETURN_FALSE(rs_char_ != nullptr);
+
+  // encode_rs_char() is linear, and a codeword whose only non zero data byte
+  // is a final 1 has the generator polynomial as parity, highest degree first.
+  // Taking the polynomial from libfec keeps the parity identical to it.
+  brillo::Blob impulse(rs_n_, 0);
+  impulse.back() = 1;
+  brillo::Blob generator(fec_roots_);
+  encode_rs_char(rs_char_.get(), impulse.data(), generator.data());
+  const unsigned int field_polynomial = FieldPolynomial(FEC_PARAMS(0));
+  multipliers_.resize(fec_roots_);
+  for (size_t i = 0; i < fec_roots_; i++) {
+    const uint8_t coefficient = generator[fec_roots_ - 1 - i];
+    for (uint8_t x = 0; x < 16; x++) {
+      multipliers_[i].low[x] = GfMultiply(coefficient, x, field_polynomial);
+      multipliers_[i].high[x] =
+          GfMultiply(coefficient, x << 4, field_polynomial);
+    }
+  }
+  for (auto& scratch : scratch_) {
+    scratch.resize(fec_roots_ * kTileSize);
+  }
+  return true;
+}
+
+bool FecEncoder::Encode(const uint8_t* data, uint8_t* fec) {
+  TEST_AND_RETURN_FALSE(rs_char_ != nullptr);
+  if (fec_roots_ == 0) {
+    return true;
+  }
+  const size_t num_tiles = utils::DivRoundUp(block_size_, kTileSize);
+  const size_t num_slices = std::min(pool_.num_threads(), num_tiles);
+  const size_t slice_size =
+      utils::DivRoundUp(num_tiles, num_slices) * kTileSize;
+  return pool_.Run(num_slices, [&](size_t slice) {
+    const size_t first = std::min(slice * slice_size, block_size_);
+    const size_t last = std::min(first + slice_size, block_size_);
+    EncodeRange(data, first, last, fec, scratch_[slice].data());
+    return true;
+  });
+}
+
+void FecEncoder::EncodeRange(const uint8_t* data,
+                             size_t first,
+                             size_t last,
+                             uint8_t* fec,
+                             uint8_t* scratch) const {
+  for (size_t tile = first; tile < last; tile += kTileSize) {
+    const size_t size = std::min(kTileSize, last - tile);
+    // |scratch| holds the shift registers of the codewords of the tile, one
+    // row per parity byte. The rows are used as a ring buffer, |head| being
+    // the row that is shifted out next.
+    std::fill(scratch, scratch + fec_roots_ * kTileSize, 0);
+    size_t head = 0;
+    for (size_t j = 0; j < rs_n_; j++) {
+      // The feedback of each codeword is written over the row shifted out.
+      uint8_t* feedback = scratch + head * kTileSize;
+      XorRegion(data + j * block_size_ + tile, feedback, size);
+      for (size_t i = 1; i < fec_roots_; i++) {
+        const auto& multiplier = multipliers_[fec_roots_ - i];
+        MultiplyRegion<true>(multiplier.low,
+                             multiplier.high,
+                             feedback,
+                             scratch + (head + i) % fec_roots_ * kTileSize,
+                             size);
+      }
+      MultiplyRegion<false>(multipliers_[0].low,
+                            multipliers_[0].high,
+                            feedback,
+                            feedback,
+                            size);
+      head = (head + 1) % fec_roots_;
+    }
+    for (size_t k = 0; k < size; k++) {
+      uint8_t* parity = fec + (tile + k) * fec_roots_;
+      for (size_t i = 0; i < fec_roots_; i++) {
+        parity[i] = scratch[(head + i) % fec_roots_ * kTileSize + k];
+      }
+    }
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,90 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_FEC_ENCODER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_FEC_ENCODER_H_
+
+#include <memory>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+extern "C" {
+#include <fec.h>
+}
+
+#include "update_engine/payload_consumer/fork_join_pool.h"
+
+namespace chromeos_update_engine {
+
+// Computes the Reed-Solomon parity of one round of verity FEC, that is
+// |block_size| codewords of rs_n() bytes, with the exact same output as
+// calling encode_rs_char() from libfec on each codeword.
+//
+// Instead of encoding one codeword at a time, the encoder runs the shift
+// register of every codeword side by side, one data block at a time, so that
+// the GF(2^8) multiplications work on whole runs of bytes and can use NEON or
+// SSSE3 table lookups. The codewords are also split across |num_threads|
+// threads.
+class FecEncoder {
+ public:
+  FecEncoder(size_t fec_roots, size_t block_size, size_t num_threads);
+
+  // Returns false if libfec doesn't support |fec_roots| parity bytes.
+  bool Init();
+
+  // Number of data bytes of each codeword, i.e. the number of data blocks of
+  // each round.
+  size_t rs_n() const { return rs_n_; }
+
+  // Encodes the rs_n() blocks at |data|, byte k of block j being byte j of
+  // codeword k, and writes the |fec_roots| parity bytes of codeword k to
+  // |fec| + k * |fec_roots|.
+  bool Encode(const uint8_t* data, uint8_t* fec);
+
+ private:
+  // Multiplication by one of the coefficients of the generator polynomial,
+  // as two lookup tables of 16 entries, one for each nibble.
+  struct Multiplier {
+    uint8_t low[16];
+    uint8_t high[16];
+  };
+
+  // Encodes codewords [first, last) using |scratch| for their parity.
+  void EncodeRange(const uint8_t* data,
+                   size_t first,
+                   size_t last,
+                   uint8_t* fec,
+                   uint8_t* scratch) const;
+
+  const size_t fec_roots_;
+  const size_t block_size_;
+  const size_t rs_n_;
+
+  std::unique_ptr<void, decltype(&free_rs_char)> rs_char_;
+  // |multipliers_[i]| multiplies by the coefficient of x^i of the generator
+  // polynomial.
+  std::vector<Multiplier> multipliers_;
+  // Parity registers of each thread.
+  std::vector<brillo::Blob> scratch_;
+  ForkJoinPool pool_;
+
+  DISALLOW_COPY_AND_ASSIGN(FecEncoder);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_FEC_ENCODER_H_
@@ -0,0 +1,89 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/fec_encoder.h"
+
+#include <memory>
+
+#include <brillo/secure_blob.h>
+#include <fec/ecc.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+
+namespace chromeos_update_engine {
+
+class FecEncoderTest : public ::testing::Test {
+ protected:
+  // Checks that FecEncoder gives the same parity as encode_rs_char() for a
+  // round of random data.
+  void TestMatchesLibfec(size_t fec_roots,
+                         size_t block_size,
+                         size_t num_threads) {
+    FecEncoder encoder(fec_roots, block_size, num_threads);
+    ASSERT_TRUE(encoder.Init());
+    const size_t rs_n = encoder.rs_n();
+    ASSERT_EQ(FEC_RSM - fec_roots, rs_n);
+
+    brillo::Blob data(rs_n * block_size);
+    test_utils::FillWithData(&data);
+    brillo::Blob fec(block_size * fec_roots);
+    ASSERT_TRUE(encoder.Encode(data.data(), fec.data()));
+
+    std::unique_ptr<void, decltype(&free_rs_char)> rs_char(
+        init_rs_char(FEC_PARAMS(fec_roots)), &free_rs_char);
+    ASSERT_NE(nullptr, rs_char);
+    brillo::Blob expected(fec.size());
+    brillo::Blob rs_block(rs_n);
+    for (size_t k = 0; k < block_size; k++) {
+      for (size_t j = 0; j < rs_n; j++) {
+        rs_block[j] = data[j * block_size + k];
+      }
+      encode_rs_char(
+          rs_char.get(), rs_block.data(), expected.data() + k * fec_roots);
+    }
+    ASSERT_EQ(expected, fec);
+  }
+};
+
+TEST_F(FecEncoderTest, TwoRootsTest) {
+  TestMatchesLibfec(2, 4096, 4);
+}
+
+TEST_F(FecEncoderTest, ManyRootsTest) {
+  TestMatchesLibfec(24, 4096, 4);
+  TestMatchesLibfec(64, 4096, 3);
+}
+
+TEST_F(FecEncoderTest, SingleThreadTest) {
+  TestMatchesLibfec(2, 4096, 1);
+}
+
+TEST_F(FecEncoderTest, UnalignedBlockSizeTest) {
+  // Not a multiple of the vector or tile sizes.
+  TestMatchesLibfec(8, 1000, 4);
+}
+
+TEST_F(FecEncoderTest, ZeroDataTest) {
+  FecEncoder encoder(2, 4096, 2);
+  ASSERT_TRUE(encoder.Init());
+  brillo::Blob data(encoder.rs_n() * 4096, 0);
+  brillo::Blob fec(4096 * 2, 0xff);
+  ASSERT_TRUE(encoder.Encode(data.data(), fec.data()));
+  ASSERT_EQ(brillo::Blob(fec.size(), 0), fec);
+}
+
+}  // namespace chromeos_update_engine
@@ -16,6 +16,11 @@
 
 #include "update_engine/payload_consumer/fec_file_descriptor.h"
 
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
 #include <base/logging.h>
 
 namespace chromeos_update_engine {
@@ -42,11 +47,63 @@ bool FecFileDescriptor::Open(const char* path, int flags, mode_t mode) {
   }
 
   dev_size_ = status.data_size;
+  offset_ = 0;
+  windows_.clear();
   return true;
 }
 
+const FecFileDescriptor::Window* FecFileDescriptor::GetWindow(
+    uint64_t offset) {
+  auto it = std::find_if(
+      windows_.begin(), windows_.end(), [offset](const Window& window) {
+        return window.offset == offset;
+      });
+  if (it != windows_.end()) {
+    if (it != windows_.begin()) {
+      Window window = std::move(*it);
+      windows_.erase(it);
+      windows_.push_front(std::move(window));
+    }
+    return &windows_.front();
+  }
+
+  Window window{offset,
+                brillo::Blob(std::min<uint64_t>(kReadWindowSize,
+                                                dev_size_ - offset))};
+  for (size_t read = 0; read < window.data.size();) {
+    ssize_t ret = fh_.pread(
+        window.data.data() + read, window.data.size() - read, offset + read);
+    if (ret <= 0)
+      return nullptr;
+    read += ret;
+  }
+  if (windows_.size() >= kMaxCachedWindows)
+    windows_.pop_back();
+  windows_.push_front(std::move(window));
+  return &windows_.front();
+}
+
 ssize_t FecFileDescriptor::Read(void* buf, size_t count) {
-  return fh_.read(buf, count);
+  if (offset_ >= dev_size_)
+    return 0;
+  count = std::min<uint64_t>(count, dev_size_ - offset_);
+  const Window* window = nullptr;
+  if (count < kReadWindowSize)
+    window = GetWindow(offset_ - offset_ % kReadWindowSize);
+  if (!window) {
+    // A window failing to decode may still have the bytes asked for
+    // correctable.
+    ssize_t ret = fh_.pread(buf, count, offset_);
+    if (ret > 0)
+      offset_ += ret;
+    return ret;
+  }
+  // A read crossing the end of the window is a short one.
+  const size_t start = offset_ - window->offset;
+  count = std::min(count, window->data.size() - start);
+  memcpy(buf, window->data.data() + start, count);
+  offset_ += count;
+  return count;
 }
 
 ssize_t FecFileDescriptor::Write(const void* buf, size_t count) {
@@ -55,10 +112,21 @@ ssize_t FecFileDescriptor::Write(const void* buf, size_t count) {
 }
 
 off64_t FecFileDescriptor::Seek(off64_t offset, int whence) {
-  if (fh_.seek(offset, whence)) {
-    return offset;
+  off64_t base = 0;
+  if (whence == SEEK_CUR) {
+    base = offset_;
+  } else if (whence == SEEK_END) {
+    base = dev_size_;
+  } else if (whence != SEEK_SET) {
+    errno = EINVAL;
+    return -1;
   }
-  return -1;
+  if (base + offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  offset_ = base + offset;
+  return offset_;
 }
 
 uint64_t FecFileDescriptor::BlockDevSize() {
@@ -74,6 +142,7 @@ bool FecFileDescriptor::BlkIoctl(int request,
 }
 
 bool FecFileDescriptor::Close() {
+  windows_.clear();
   return fh_.close();
 }
 
@@ -17,6 +17,9 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_FEC_FILE_DESCRIPTOR_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_FEC_FILE_DESCRIPTOR_H_
 
+#include <deque>
+
+#include <brillo/secure_blob.h>
 #include <fec/io.h>
 
 #include "update_engine/payload_consumer/file_descriptor.h"
@@ -30,8 +33,18 @@
 namespace chromeos_update_engine {
 
 // An error corrected file based on FEC.
+//
+// libfec checks and decodes every read on its own, with a large overhead for
+// small reads, and spreads the large ones over several threads. The small
+// reads are therefore served from windows read at once, the most recent of
+// which are kept decoded.
 class FecFileDescriptor : public FileDescriptor {
  public:
+  // The size of the windows the small reads are served from, and how many
+  // of them are kept.
+  static constexpr size_t kReadWindowSize = 1024 * 1024;  // bytes
+  static constexpr size_t kMaxCachedWindows = 4;
+
   FecFileDescriptor() = default;
   ~FecFileDescriptor() = default;
 
@@ -56,8 +69,21 @@ class FecFileDescriptor : public FileDescriptor {
   }
 
  protected:
+  struct Window {
+    uint64_t offset;
+    brillo::Blob data;
+  };
+
+  // Returns the window starting at |offset|, reading it if it isn't cached,
+  // or nullptr if it couldn't be read.
+  const Window* GetWindow(uint64_t offset);
+
   fec::io fh_;
   uint64_t dev_size_{0};
+  // The offset of the next read.
+  uint64_t offset_{0};
+  // The windows read, most recently used first.
+  std::deque<Window> windows_;
 };
 
 }  // namespace chromeos_update_engine
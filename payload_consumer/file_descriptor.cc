@@ -17,18 +17,220 @@
 #include "update_engine/payload_consumer/file_descriptor.h"
 
 #include <fcntl.h>
+#include <limits.h>
 #include <linux/fs.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+
 #include <base/posix/eintr_wrapper.h>
 
+#include "update_engine/common/trace.h"
 #include "update_engine/common/utils.h"
 
 namespace chromeos_update_engine {
 
+namespace {
+// Calls preadv()/pwritev() until every buffer of |iov| is transferred,
+// resuming after short transfers and splitting at IOV_MAX.
+bool TransferAllV(int fd, off64_t offset, std::vector<iovec> iov, bool write) {
+  size_t first = 0;
+  while (true) {
+    while (first < iov.size() && iov[first].iov_len == 0) {
+      first++;
+    }
+    if (first == iov.size()) {
+      return true;
+    }
+    const int iovcnt = std::min<size_t>(iov.size() - first, IOV_MAX);
+    const ssize_t rc =
+        write ? HANDLE_EINTR(pwritev64(fd, &iov[first], iovcnt, offset))
+              : HANDLE_EINTR(preadv64(fd, &iov[first], iovcnt, offset));
+    TEST_AND_RETURN_FALSE_ERRNO(rc >= 0);
+    if (rc == 0) {
+      LOG(ERROR) << "Unexpected end of file at offset " << offset;
+      return false;
+    }
+    offset += rc;
+    size_t done = rc;
+    while (done >= iov[first].iov_len) {
+      done -= iov[first].iov_len;
+      iov[first].iov_len = 0;
+      if (++first == iov.size()) {
+        break;
+      }
+    }
+    if (done > 0) {
+      iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + done;
+      iov[first].iov_len -= done;
+    }
+  }
+}
+
+// Sorts |requests| by offset and calls |transfer| once for each run of
+// requests which are contiguous in the file.
+template <typename Transfer>
+bool ForEachContiguousRun(const std::vector<FileIoRequest>& requests,
+                          Transfer transfer) {
+  std::vector<const FileIoRequest*> sorted;
+  sorted.reserve(requests.size());
+  for (const auto& request : requests) {
+    if (request.count > 0) {
+      sorted.push_back(&request);
+    }
+  }
+  std::sort(sorted.begin(),
+            sorted.end(),
+            [](const FileIoRequest* a, const FileIoRequest* b) {
+              return a->offset < b->offset;
+            });
+  std::vector<iovec> iov;
+  off64_t run_offset = 0;
+  off64_t run_end = 0;
+  for (const auto* request : sorted) {
+    if (!iov.empty() && request->offset != run_end) {
+      TEST_AND_RETURN_FALSE(transfer(run_offset, iov));
+      iov.clear();
+    }
+    if (iov.empty()) {
+      run_offset = run_end = request->offset;
+    }
+    // Buffers which are adjacent in memory as well need a single iovec.
+    const char* buf_end =
+        iov.empty() ? nullptr
+                    : static_cast<char*>(iov.back().iov_base) +
+                          iov.back().iov_len;
+    if (buf_end != nullptr && buf_end == request->buf) {
+      iov.back().iov_len += request->count;
+    } else {
+      iov.push_back({request->buf, request->count});
+    }
+    run_end += request->count;
+  }
+  return iov.empty() || transfer(run_offset, iov);
+}
+
+bool IsDirectIoAligned(uint64_t value) {
+  return value % DirectIoFileDescriptor::kDirectIoAlignment == 0;
+}
+
+// Calls pread()/pwrite() until |count| bytes are transferred or the end of
+// the file is reached. With |direct|, a transfer ending unaligned can only be
+// the end of the file, which O_DIRECT wouldn't let us read further anyway.
+ssize_t TransferAll(
+    int fd, off64_t offset, void* buf, size_t count, bool write, bool direct) {
+  uint8_t* bytes = static_cast<uint8_t*>(buf);
+  size_t done = 0;
+  while (done < count) {
+    const ssize_t rc =
+        write ? HANDLE_EINTR(pwrite64(fd, bytes + done, count - done, offset))
+              : HANDLE_EINTR(pread64(fd, bytes + done, count - done, offset));
+    if (rc < 0) {
+      return -1;
+    }
+    done += rc;
+    offset += rc;
+    if (rc == 0 || (direct && !IsDirectIoAligned(rc))) {
+      break;
+    }
+  }
+  return done;
+}
+
+// Aligned bounce buffers for DirectIoFileDescriptor requests whose memory
+// isn't aligned, shared between all descriptors and threads.
+class BounceBufferPool {
+ public:
+  static constexpr size_t kBufferSize = 1024 * 1024;
+
+  struct FreeDeleter {
+    void operator()(uint8_t* buffer) const { free(buffer); }
+  };
+  using Buffer = std::unique_ptr<uint8_t, FreeDeleter>;
+
+  static BounceBufferPool* Get() {
+    static BounceBufferPool pool;
+    return &pool;
+  }
+
+  Buffer Acquire() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!free_buffers_.empty()) {
+        Buffer buffer = std::move(free_buffers_.back());
+        free_buffers_.pop_back();
+        return buffer;
+      }
+    }
+    void* buffer = nullptr;
+    if (posix_memalign(&buffer,
+                       DirectIoFileDescriptor::kDirectIoAlignment,
+                       kBufferSize) != 0) {
+      LOG(ERROR) << "Failed to allocate a direct I/O bounce buffer";
+      return nullptr;
+    }
+    return Buffer(static_cast<uint8_t*>(buffer));
+  }
+
+  void Release(Buffer buffer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_buffers_.size() < kMaxFreeBuffers) {
+      free_buffers_.push_back(std::move(buffer));
+    }
+  }
+
+ private:
+  static constexpr size_t kMaxFreeBuffers = 8;
+
+  std::mutex mutex_;
+  std::vector<Buffer> free_buffers_;
+};
+}  // namespace
+
+bool FileDescriptor::ReadBatch(const std::vector<FileIoRequest>& requests) {
+  for (const auto& request : requests) {
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::ReadAll(
+        this, request.buf, request.count, request.offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(request.count));
+  }
+  return true;
+}
+
+bool FileDescriptor::WriteBatch(const std::vector<FileIoRequest>& requests) {
+  for (const auto& request : requests) {
+    TEST_AND_RETURN_FALSE_ERRNO(Seek(request.offset, SEEK_SET) ==
+                                request.offset);
+    TEST_AND_RETURN_FALSE(utils::WriteAll(this, request.buf, request.count));
+  }
+  return true;
+}
+
+bool FileDescriptor::ReadV(off64_t offset, const std::vector<iovec>& iov) {
+  for (const auto& vec : iov) {
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(
+        utils::ReadAll(this, vec.iov_base, vec.iov_len, offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(vec.iov_len));
+    offset += vec.iov_len;
+  }
+  return true;
+}
+
+bool FileDescriptor::WriteV(off64_t offset, const std::vector<iovec>& iov) {
+  TEST_AND_RETURN_FALSE_ERRNO(Seek(offset, SEEK_SET) == offset);
+  for (const auto& vec : iov) {
+    TEST_AND_RETURN_FALSE(utils::WriteAll(this, vec.iov_base, vec.iov_len));
+  }
+  return true;
+}
+
 EintrSafeFileDescriptor::~EintrSafeFileDescriptor() {
   if (IsOpen()) {
     Close();
@@ -134,21 +336,199 @@ bool EintrSafeFileDescriptor::Flush() {
   CHECK_GE(fd_, 0);
   // Implemented as a No-Op, as delta_performer typically uses |O_DSYNC|, except
   // in interactive settings.
+  UE_TRACE_SCOPE("fsync");
   fsync(fd_);
   return true;
 }
 
+bool EintrSafeFileDescriptor::ReadBatch(
+    const std::vector<FileIoRequest>& requests) {
+  return ForEachContiguousRun(
+      requests, [this](off64_t offset, const std::vector<iovec>& iov) {
+        return ReadV(offset, iov);
+      });
+}
+
+bool EintrSafeFileDescriptor::WriteBatch(
+    const std::vector<FileIoRequest>& requests) {
+  return ForEachContiguousRun(
+      requests, [this](off64_t offset, const std::vector<iovec>& iov) {
+        return WriteV(offset, iov);
+      });
+}
+
+bool EintrSafeFileDescriptor::ReadV(off64_t offset,
+                                    const std::vector<iovec>& iov) {
+  CHECK_GE(fd_, 0);
+  return TransferAllV(fd_, offset, iov, false);
+}
+
+bool EintrSafeFileDescriptor::WriteV(off64_t offset,
+                                     const std::vector<iovec>& iov) {
+  CHECK_GE(fd_, 0);
+  return TransferAllV(fd_, offset, iov, true);
+}
+
 bool EintrSafeFileDescriptor::Close() {
   if (fd_ < 0) {
     return false;
   }
   // https://stackoverflow.com/questions/705454/does-linux-guarantee-the-contents-of-a-file-is-flushed-to-disc-after-close
   // |close()| doesn't imply |fsync()|, we need to do it manually.
-  fsync(fd_);
+  {
+    UE_TRACE_SCOPE("fsync");
+    fsync(fd_);
+  }
   if (IGNORE_EINTR(close(fd_)))
     return false;
   fd_ = -1;
   return true;
 }
 
+bool DirectIoFileDescriptor::Open(const char* path, int flags, mode_t mode) {
+  direct_ = EintrSafeFileDescriptor::Open(path, flags | O_DIRECT, mode);
+  if (direct_ || errno != EINVAL) {
+    return direct_;
+  }
+  LOG(WARNING) << "O_DIRECT isn't supported for " << path
+               << ", falling back to buffered I/O";
+  return EintrSafeFileDescriptor::Open(path, flags, mode);
+}
+
+bool DirectIoFileDescriptor::Open(const char* path, int flags) {
+  direct_ = EintrSafeFileDescriptor::Open(path, flags | O_DIRECT);
+  if (direct_ || errno != EINVAL) {
+    return direct_;
+  }
+  LOG(WARNING) << "O_DIRECT isn't supported for " << path
+               << ", falling back to buffered I/O";
+  return EintrSafeFileDescriptor::Open(path, flags);
+}
+
+ssize_t DirectIoFileDescriptor::Read(void* buf, size_t count) {
+  if (!direct_) {
+    return EintrSafeFileDescriptor::Read(buf, count);
+  }
+  const off64_t offset = Seek(0, SEEK_CUR);
+  if (offset < 0) {
+    return -1;
+  }
+  const ssize_t bytes_read = Transfer(offset, buf, count, false);
+  if (bytes_read > 0 && Seek(offset + bytes_read, SEEK_SET) < 0) {
+    return -1;
+  }
+  return bytes_read;
+}
+
+ssize_t DirectIoFileDescriptor::Write(const void* buf, size_t count) {
+  if (!direct_) {
+    return EintrSafeFileDescriptor::Write(buf, count);
+  }
+  const off64_t offset = Seek(0, SEEK_CUR);
+  if (offset < 0) {
+    return -1;
+  }
+  const ssize_t bytes_written =
+      Transfer(offset, const_cast<void*>(buf), count, true);
+  if (bytes_written > 0 && Seek(offset + bytes_written, SEEK_SET) < 0) {
+    return -1;
+  }
+  return bytes_written;
+}
+
+bool DirectIoFileDescriptor::Close() {
+  direct_ = false;
+  return EintrSafeFileDescriptor::Close();
+}
+
+bool DirectIoFileDescriptor::ReadV(off64_t offset,
+                                   const std::vector<iovec>& iov) {
+  return TransferV(offset, iov, false);
+}
+
+bool DirectIoFileDescriptor::WriteV(off64_t offset,
+                                    const std::vector<iovec>& iov) {
+  return TransferV(offset, iov, true);
+}
+
+bool DirectIoFileDescriptor::TransferV(off64_t offset,
+                                       const std::vector<iovec>& iov,
+                                       bool write) {
+  const bool aligned =
+      IsDirectIoAligned(offset) &&
+      std::all_of(iov.begin(), iov.end(), [](const iovec& vec) {
+        return IsDirectIoAligned(reinterpret_cast<uintptr_t>(vec.iov_base)) &&
+               IsDirectIoAligned(vec.iov_len);
+      });
+  if (!direct_ || aligned) {
+    return write ? EintrSafeFileDescriptor::WriteV(offset, iov)
+                 : EintrSafeFileDescriptor::ReadV(offset, iov);
+  }
+  CHECK_GE(fd_, 0);
+  for (const iovec& vec : iov) {
+    TEST_AND_RETURN_FALSE_ERRNO(
+        Transfer(offset, vec.iov_base, vec.iov_len, write) ==
+        static_cast<ssize_t>(vec.iov_len));
+    offset += vec.iov_len;
+  }
+  return true;
+}
+
+ssize_t DirectIoFileDescriptor::Transfer(off64_t offset,
+                                         void* buf,
+                                         size_t count,
+                                         bool write) {
+  if (!IsDirectIoAligned(offset) || !IsDirectIoAligned(count)) {
+    return TransferBuffered(offset, buf, count, write);
+  }
+  if (IsDirectIoAligned(reinterpret_cast<uintptr_t>(buf))) {
+    return TransferAll(fd_, offset, buf, count, write, true);
+  }
+  BounceBufferPool* pool = BounceBufferPool::Get();
+  BounceBufferPool::Buffer bounce = pool->Acquire();
+  if (!bounce) {
+    return -1;
+  }
+  uint8_t* bytes = static_cast<uint8_t*>(buf);
+  size_t done = 0;
+  while (done < count) {
+    const size_t size = std::min(count - done, BounceBufferPool::kBufferSize);
+    if (write) {
+      memcpy(bounce.get(), bytes + done, size);
+    }
+    const ssize_t rc =
+        TransferAll(fd_, offset + done, bounce.get(), size, write, true);
+    if (rc < 0) {
+      pool->Release(std::move(bounce));
+      return -1;
+    }
+    if (!write) {
+      memcpy(bytes + done, bounce.get(), rc);
+    }
+    done += rc;
+    if (static_cast<size_t>(rc) < size) {
+      break;
+    }
+  }
+  pool->Release(std::move(bounce));
+  return done;
+}
+
+ssize_t DirectIoFileDescriptor::TransferBuffered(off64_t offset,
+                                                 void* buf,
+                                                 size_t count,
+                                                 bool write) {
+  const int flags = fcntl(fd_, F_GETFL, 0);
+  if (flags == -1 || fcntl(fd_, F_SETFL, flags & ~O_DIRECT) == -1) {
+    PLOG(ERROR) << "Couldn't clear O_DIRECT on fd " << fd_;
+    return -1;
+  }
+  const ssize_t rc = TransferAll(fd_, offset, buf, count, write, false);
+  if (fcntl(fd_, F_SETFL, flags) == -1) {
+    PLOG(ERROR) << "Couldn't restore O_DIRECT on fd " << fd_;
+    return -1;
+  }
+  return rc;
+}
+
 }  // namespace chromeos_update_engine
@@ -19,7 +19,9 @@
 
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <memory>
+#include <vector>
 
 #include <android-base/macros.h>
 
@@ -45,6 +47,14 @@ namespace chromeos_update_engine {
 class FileDescriptor;
 using FileDescriptorPtr = std::shared_ptr<FileDescriptor>;
 
+// A single positional read or write, as passed to the batch methods of
+// FileDescriptor. Writes only read from |buf|.
+struct FileIoRequest {
+  off64_t offset;
+  void* buf;
+  size_t count;
+};
+
 // An abstract class defining the file descriptor API.
 class FileDescriptor {
  public:
@@ -110,12 +120,33 @@ class FileDescriptor {
   // instance.
   virtual int Fd() { return -1; }
 
+  // Reads |count| bytes at |offset| into |buf| for each of |requests|.
+  // Implementations may service the requests in any order and at the same
+  // time, so they must not overlap. Returns true only if every request was
+  // read in full. The file offset after this call is unspecified. The default
+  // implementation seeks and reads once per request.
+  virtual bool ReadBatch(const std::vector<FileIoRequest>& requests);
+
+  // Writes |count| bytes from |buf| at |offset| for each of |requests|, with
+  // the same rules as ReadBatch().
+  virtual bool WriteBatch(const std::vector<FileIoRequest>& requests);
+
+  // Scatter/gather I/O: reads the file range starting at |offset| into the
+  // buffers of |iov| in order, filling each one. Returns true only if every
+  // buffer was filled. The file offset after this call is unspecified. The
+  // default implementation seeks and reads once per buffer.
+  virtual bool ReadV(off64_t offset, const std::vector<iovec>& iov);
+
+  // Writes the buffers of |iov| back to back to the file starting at
+  // |offset|, with the same rules as ReadV().
+  virtual bool WriteV(off64_t offset, const std::vector<iovec>& iov);
+
  private:
   DISALLOW_COPY_AND_ASSIGN(FileDescriptor);
 };
 
 // A simple EINTR-immune wrapper implementation around standard system calls.
-class EintrSafeFileDescriptor final : public FileDescriptor {
+class EintrSafeFileDescriptor : public FileDescriptor {
  public:
   EintrSafeFileDescriptor() : fd_(-1) {}
   ~EintrSafeFileDescriptor();
@@ -136,11 +167,53 @@ class EintrSafeFileDescriptor final : public FileDescriptor {
   bool IsSettingErrno() override { return true; }
   bool IsOpen() override { return (fd_ >= 0); }
   int Fd() override { return fd_; }
+  // Requests which are contiguous in the file are merged and transferred with
+  // a single preadv()/pwritev(), so the file offset is left untouched.
+  bool ReadBatch(const std::vector<FileIoRequest>& requests) override;
+  bool WriteBatch(const std::vector<FileIoRequest>& requests) override;
+  bool ReadV(off64_t offset, const std::vector<iovec>& iov) override;
+  bool WriteV(off64_t offset, const std::vector<iovec>& iov) override;
 
  protected:
   int fd_;
 };
 
+// An EintrSafeFileDescriptor opened with O_DIRECT, so that its reads and
+// writes bypass the page cache instead of evicting the working set of the
+// running system. Requests whose offset and size are aligned to
+// |kDirectIoAlignment| go straight to the device, through a bounce buffer
+// from a shared pool when the memory isn't aligned. The rare other requests
+// clear O_DIRECT while they run. Falls back to buffered I/O on file systems
+// without O_DIRECT support.
+class DirectIoFileDescriptor : public EintrSafeFileDescriptor {
+ public:
+  static constexpr size_t kDirectIoAlignment = 4096;
+
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  bool Close() override;
+  bool ReadV(off64_t offset, const std::vector<iovec>& iov) override;
+  bool WriteV(off64_t offset, const std::vector<iovec>& iov) override;
+
+  // Whether the file was opened with O_DIRECT.
+  bool is_direct() const { return direct_; }
+
+ private:
+  // Transfers |count| bytes at |offset|, stopping early only at the end of
+  // the file. Returns the number of bytes transferred, or -1 on error.
+  ssize_t Transfer(off64_t offset, void* buf, size_t count, bool write);
+  // Same as Transfer() for requests which can't use O_DIRECT.
+  ssize_t TransferBuffered(off64_t offset,
+                           void* buf,
+                           size_t count,
+                           bool write);
+  bool TransferV(off64_t offset, const std::vector<iovec>& iov, bool write);
+
+  bool direct_{false};
+};
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_FILE_DESCRIPTOR_H_
@@ -0,0 +1,172 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+class EintrSafeFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    data_.resize(64 * 1024);
+    for (size_t i = 0; i < data_.size(); i++) {
+      data_[i] = static_cast<uint8_t>(i * 13 + i / 251);
+    }
+    ASSERT_TRUE(test_utils::WriteFileVector(temp_file_.path(), data_));
+    ASSERT_TRUE(fd_.Open(temp_file_.path().c_str(), O_RDWR));
+  }
+
+  brillo::Blob data_;
+  ScopedTempFile temp_file_{"EintrSafeFileDescriptor-file.XXXXXX"};
+  EintrSafeFileDescriptor fd_;
+};
+
+TEST_F(EintrSafeFileDescriptorTest, ReadVTest) {
+  brillo::Blob first(100), second(0), third(5000);
+  ASSERT_TRUE(fd_.ReadV(1000,
+                        {{first.data(), first.size()},
+                         {second.data(), second.size()},
+                         {third.data(), third.size()}}));
+  ASSERT_EQ(brillo::Blob(data_.begin() + 1000, data_.begin() + 1100), first);
+  ASSERT_EQ(brillo::Blob(data_.begin() + 1100, data_.begin() + 6100), third);
+}
+
+TEST_F(EintrSafeFileDescriptorTest, ReadVPastEndFailsTest) {
+  brillo::Blob buf(200);
+  ASSERT_FALSE(fd_.ReadV(data_.size() - 100, {{buf.data(), buf.size()}}));
+}
+
+TEST_F(EintrSafeFileDescriptorTest, WriteVTest) {
+  brillo::Blob first(10, 'a'), second(20, 'b');
+  ASSERT_TRUE(fd_.WriteV(
+      50, {{first.data(), first.size()}, {second.data(), second.size()}}));
+  ASSERT_TRUE(fd_.Close());
+
+  std::copy(first.begin(), first.end(), data_.begin() + 50);
+  std::copy(second.begin(), second.end(), data_.begin() + 60);
+  brillo::Blob contents;
+  ASSERT_TRUE(utils::ReadFile(temp_file_.path(), &contents));
+  ASSERT_EQ(data_, contents);
+}
+
+TEST_F(EintrSafeFileDescriptorTest, ReadBatchMergesContiguousRequestsTest) {
+  // Out of order requests, some of them contiguous in the file, into separate
+  // buffers.
+  brillo::Blob a(4096), b(4096), c(100), d(8192);
+  ASSERT_TRUE(fd_.ReadBatch({{8192, b.data(), b.size()},
+                             {40000, c.data(), c.size()},
+                             {4096, a.data(), a.size()},
+                             {12288, d.data(), d.size()},
+                             {0, nullptr, 0}}));
+  ASSERT_EQ(brillo::Blob(data_.begin() + 4096, data_.begin() + 8192), a);
+  ASSERT_EQ(brillo::Blob(data_.begin() + 8192, data_.begin() + 12288), b);
+  ASSERT_EQ(brillo::Blob(data_.begin() + 40000, data_.begin() + 40100), c);
+  ASSERT_EQ(brillo::Blob(data_.begin() + 12288, data_.begin() + 20480), d);
+}
+
+TEST_F(EintrSafeFileDescriptorTest, WriteBatchTest) {
+  brillo::Blob buf(300, 'z');
+  // Contiguous both in the file and in memory.
+  ASSERT_TRUE(fd_.WriteBatch({{100, buf.data() + 100, 200},
+                              {0, buf.data(), 100},
+                              {1000, buf.data(), 1}}));
+  ASSERT_TRUE(fd_.Close());
+
+  std::fill(data_.begin(), data_.begin() + 300, 'z');
+  data_[1000] = 'z';
+  brillo::Blob contents;
+  ASSERT_TRUE(utils::ReadFile(temp_file_.path(), &contents));
+  ASSERT_EQ(data_, contents);
+}
+
+class DirectIoFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Not a multiple of the alignment, so that the file ends with a partial
+    // block.
+    data_.resize(64 * 1024 + 100);
+    for (size_t i = 0; i < data_.size(); i++) {
+      data_[i] = static_cast<uint8_t>(i * 7 + i / 253);
+    }
+    ASSERT_TRUE(test_utils::WriteFileVector(temp_file_.path(), data_));
+    ASSERT_TRUE(fd_.Open(temp_file_.path().c_str(), O_RDWR));
+  }
+
+  void ExpectFileContents() {
+    ASSERT_TRUE(fd_.Close());
+    brillo::Blob contents;
+    ASSERT_TRUE(utils::ReadFile(temp_file_.path(), &contents));
+    ASSERT_EQ(data_, contents);
+  }
+
+  static constexpr size_t kAlignment =
+      DirectIoFileDescriptor::kDirectIoAlignment;
+
+  brillo::Blob data_;
+  ScopedTempFile temp_file_{"DirectIoFileDescriptor-file.XXXXXX"};
+  DirectIoFileDescriptor fd_;
+};
+
+TEST_F(DirectIoFileDescriptorTest, ReadBatchTest) {
+  // The first buffer is unaligned in memory, the second one isn't aligned in
+  // the file.
+  brillo::Blob a(2 * kAlignment + 1), b(100);
+  ASSERT_TRUE(fd_.ReadBatch({{kAlignment, a.data() + 1, 2 * kAlignment},
+                             {10000, b.data(), b.size()}}));
+  EXPECT_EQ(brillo::Blob(data_.begin() + kAlignment,
+                         data_.begin() + 3 * kAlignment),
+            brillo::Blob(a.begin() + 1, a.end()));
+  EXPECT_EQ(brillo::Blob(data_.begin() + 10000, data_.begin() + 10100), b);
+}
+
+TEST_F(DirectIoFileDescriptorTest, ReadPastEndTest) {
+  brillo::Blob buf(2 * kAlignment + 1);
+  const off64_t offset = 15 * kAlignment;
+  ASSERT_EQ(offset, fd_.Seek(offset, SEEK_SET));
+  ASSERT_EQ(static_cast<ssize_t>(kAlignment + 100),
+            fd_.Read(buf.data() + 1, 2 * kAlignment));
+  EXPECT_EQ(brillo::Blob(data_.begin() + offset, data_.end()),
+            brillo::Blob(buf.begin() + 1, buf.begin() + 1 + kAlignment + 100));
+  EXPECT_EQ(static_cast<off64_t>(data_.size()), fd_.Seek(0, SEEK_CUR));
+}
+
+TEST_F(DirectIoFileDescriptorTest, WriteTest) {
+  brillo::Blob buf(3 * kAlignment + 1, 'x');
+  ASSERT_TRUE(fd_.WriteBatch({{0, buf.data() + 1, kAlignment},
+                              {5 * kAlignment, buf.data(), 3 * kAlignment},
+                              {50, buf.data(), 10}}));
+  ASSERT_EQ(static_cast<off64_t>(10 * kAlignment + 1),
+            fd_.Seek(10 * kAlignment + 1, SEEK_SET));
+  ASSERT_EQ(10, fd_.Write(buf.data(), 10));
+
+  std::fill_n(data_.begin(), kAlignment, 'x');
+  std::fill_n(data_.begin() + 5 * kAlignment, 3 * kAlignment, 'x');
+  std::fill_n(data_.begin() + 10 * kAlignment + 1, 10, 'x');
+  ExpectFileContents();
+}
+
+}  // namespace chromeos_update_engine
@@ -16,14 +16,20 @@
 
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 
+#include <errno.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
 #include <algorithm>
 
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/extent_reader.h"
 #include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 
 using google::protobuf::RepeatedPtrField;
 using std::min;
@@ -35,6 +41,35 @@ namespace {
 // Size of the buffer used to copy blocks.
 const uint64_t kMaxCopyBufferSize = 1024 * 1024;
 
+// Copies |count| bytes at |src_offset| in |src_fd| to |tgt_offset| in
+// |tgt_fd| without them leaving the kernel.
+bool CopyFileRange(int src_fd,
+                   off64_t src_offset,
+                   int tgt_fd,
+                   off64_t tgt_offset,
+                   size_t count) {
+  while (count > 0) {
+    // Not every libc has a copy_file_range() wrapper.
+    const ssize_t copied = HANDLE_EINTR(syscall(__NR_copy_file_range,
+                                                src_fd,
+                                                &src_offset,
+                                                tgt_fd,
+                                                &tgt_offset,
+                                                count,
+                                                0));
+    if (copied < 0) {
+      return false;
+    }
+    if (copied == 0) {
+      // The source ended early.
+      errno = EIO;
+      return false;
+    }
+    count -= copied;
+  }
+  return true;
+}
+
 }  // namespace
 namespace fd_utils {
 
@@ -42,7 +77,8 @@ bool CommonHashExtents(FileDescriptorPtr source,
                        const RepeatedPtrField<Extent>& src_extents,
                        ExtentWriter* writer,
                        uint64_t block_size,
-                       brillo::Blob* hash_out) {
+                       brillo::Blob* hash_out,
+                       HashAlgorithm algorithm) {
   auto total_blocks = utils::BlocksInExtents(src_extents);
   auto buffer_blocks = kMaxCopyBufferSize / block_size;
   // Ensure we copy at least one block at a time.
@@ -53,7 +89,7 @@ bool CommonHashExtents(FileDescriptorPtr source,
   DirectExtentReader reader;
   TEST_AND_RETURN_FALSE(reader.Init(source, src_extents, block_size));
 
-  HashCalculator source_hasher;
+  HashCalculator source_hasher(algorithm);
   while (total_blocks > 0) {
     auto read_blocks = std::min(total_blocks, buffer_blocks);
     TEST_AND_RETURN_FALSE(reader.Read(buf.data(), read_blocks * block_size));
@@ -75,12 +111,63 @@ bool CommonHashExtents(FileDescriptorPtr source,
   return true;
 }
 
+bool CopyExtentsInKernel(FileDescriptorPtr source,
+                         const RepeatedPtrField<Extent>& src_extents,
+                         FileDescriptorPtr target,
+                         const RepeatedPtrField<Extent>& tgt_extents,
+                         uint64_t block_size) {
+  const int src_fd = source->Fd();
+  const int tgt_fd = target->Fd();
+  if (src_fd < 0 || tgt_fd < 0) {
+    errno = EBADF;
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(utils::BlocksInExtents(src_extents) ==
+                        utils::BlocksInExtents(tgt_extents));
+  auto src = src_extents.begin();
+  auto tgt = tgt_extents.begin();
+  uint64_t src_done = 0;
+  uint64_t tgt_done = 0;
+  while (src != src_extents.end() && tgt != tgt_extents.end()) {
+    if (src->start_block() == kSparseHole) {
+      errno = EINVAL;
+      return false;
+    }
+    const uint64_t num_blocks =
+        std::min(src->num_blocks() - src_done, tgt->num_blocks() - tgt_done);
+    if (tgt->start_block() != kSparseHole &&
+        !CopyFileRange(src_fd,
+                       (src->start_block() + src_done) * block_size,
+                       tgt_fd,
+                       (tgt->start_block() + tgt_done) * block_size,
+                       num_blocks * block_size)) {
+      return false;
+    }
+    src_done += num_blocks;
+    tgt_done += num_blocks;
+    if (src_done == src->num_blocks()) {
+      src++;
+      src_done = 0;
+    }
+    if (tgt_done == tgt->num_blocks()) {
+      tgt++;
+      tgt_done = 0;
+    }
+  }
+  return true;
+}
+
 bool CopyAndHashExtents(FileDescriptorPtr source,
                         const RepeatedPtrField<Extent>& src_extents,
                         FileDescriptorPtr target,
                         const RepeatedPtrField<Extent>& tgt_extents,
                         uint64_t block_size,
                         brillo::Blob* hash_out) {
+  if (hash_out == nullptr &&
+      CopyExtentsInKernel(
+          source, src_extents, target, tgt_extents, block_size)) {
+    return true;
+  }
   DirectExtentWriter writer{target};
   TEST_AND_RETURN_FALSE(writer.Init(tgt_extents, block_size));
   TEST_AND_RETURN_FALSE(utils::BlocksInExtents(src_extents) ==
@@ -93,8 +180,10 @@ bool CopyAndHashExtents(FileDescriptorPtr source,
 bool ReadAndHashExtents(FileDescriptorPtr source,
                         const RepeatedPtrField<Extent>& extents,
                         uint64_t block_size,
-                        brillo::Blob* hash_out) {
-  return CommonHashExtents(source, extents, nullptr, block_size, hash_out);
+                        brillo::Blob* hash_out,
+                        HashAlgorithm algorithm) {
+  return CommonHashExtents(
+      source, extents, nullptr, block_size, hash_out, algorithm);
 }
 
 }  // namespace fd_utils
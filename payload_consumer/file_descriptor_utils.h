@@ -19,6 +19,7 @@
 
 #include <brillo/secure_blob.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/update_metadata.pb.h"
@@ -26,12 +27,29 @@
 namespace chromeos_update_engine {
 namespace fd_utils {
 
+// Reads the blocks of |src_extents| from |source|, writing them to |writer| if
+// not null, and stores their hash with |algorithm| in |hash_out| if not null.
 bool CommonHashExtents(
     FileDescriptorPtr source,
     const google::protobuf::RepeatedPtrField<Extent>& src_extents,
     ExtentWriter* writer,
     uint64_t block_size,
-    brillo::Blob* hash_out);
+    brillo::Blob* hash_out,
+    HashAlgorithm algorithm = HashAlgorithm::kSha256);
+
+// Copies blocks from the |source| file to the |target| file like
+// CopyAndHashExtents(), but with copy_file_range() so that the data stays in
+// the kernel, which may even offload the copy to the storage. Both files must
+// wrap a plain file descriptor, and writes through them must not be buffered.
+// Returns false with errno set if the copy fails, for example with EINVAL or
+// EXDEV when the kernel can't copy between those files, in which case part
+// of the blocks may have been copied already.
+bool CopyExtentsInKernel(
+    FileDescriptorPtr source,
+    const google::protobuf::RepeatedPtrField<Extent>& src_extents,
+    FileDescriptorPtr target,
+    const google::protobuf::RepeatedPtrField<Extent>& tgt_extents,
+    uint64_t block_size);
 
 // Copy blocks from the |source| file to the |target| file and hashes the
 // contents. The blocks to copy from the |source| to the |target| files are
@@ -41,7 +59,8 @@ bool CommonHashExtents(
 // is passed as |block_size|. In case of error reading or writing, returns
 // false and the value pointed by |hash_out| is undefined.
 // The |source| and |target| files must be different, or otherwise |src_extents|
-// and |tgt_extents| must not overlap.
+// and |tgt_extents| must not overlap. Without |hash_out|, the blocks are copied
+// with CopyExtentsInKernel() when possible.
 bool CopyAndHashExtents(
     FileDescriptorPtr source,
     const google::protobuf::RepeatedPtrField<Extent>& src_extents,
@@ -58,7 +77,8 @@ bool ReadAndHashExtents(
     FileDescriptorPtr source,
     const google::protobuf::RepeatedPtrField<Extent>& extents,
     uint64_t block_size,
-    brillo::Blob* hash_out);
+    brillo::Blob* hash_out,
+    HashAlgorithm algorithm = HashAlgorithm::kSha256);
 
 }  // namespace fd_utils
 }  // namespace chromeos_update_engine
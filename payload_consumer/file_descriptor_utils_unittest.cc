@@ -16,6 +16,7 @@
 
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 
+#include <errno.h>
 #include <fcntl.h>
 
 #include <string>
@@ -117,6 +118,31 @@ TEST_F(FileDescriptorUtilsTest, CopyAndHashExtentsWithoutHashingTest) {
   ExpectTarget("00000001000200030004");
 }
 
+// Test that the kernel copies the blocks between plain files.
+TEST_F(FileDescriptorUtilsTest, CopyExtentsInKernelTest) {
+  ScopedTempFile src_file("fd_src.XXXXXX");
+  ASSERT_TRUE(
+      utils::WriteFile(src_file.path().c_str(), "00000001000200030004", 20));
+  FileDescriptorPtr source(new EintrSafeFileDescriptor());
+  ASSERT_TRUE(source->Open(src_file.path().c_str(), O_RDONLY));
+  auto src_extents = CreateExtentList({{1, 1}, {4, 1}, {2, 2}, {0, 1}});
+  auto tgt_extents = CreateExtentList({{0, 5}});
+
+  ASSERT_TRUE(fd_utils::CopyExtentsInKernel(
+      source, src_extents, target_, tgt_extents, 4));
+  ExpectTarget("00010004000200030000");
+}
+
+// The kernel can't copy from a file descriptor it doesn't know about.
+TEST_F(FileDescriptorUtilsTest, CopyExtentsInKernelWithoutFdTest) {
+  auto extents = CreateExtentList({{0, 5}});
+
+  errno = 0;
+  EXPECT_FALSE(
+      fd_utils::CopyExtentsInKernel(source_, extents, target_, extents, 4));
+  EXPECT_EQ(EBADF, errno);
+}
+
 // CopyAndHash() can take different number of extents in the source and target
 // files, as long as the number of blocks is the same. Test that it handles it
 // properly.
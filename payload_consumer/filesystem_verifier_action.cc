@@ -24,13 +24,16 @@
 
 #include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <memory>
 #include <numeric>
 #include <string>
+#include <thread>
 #include <utility>
 
 #include <base/bind.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_util.h>
 #include <brillo/data_encoding.h>
 #include <brillo/message_loops/message_loop.h>
@@ -38,6 +41,7 @@
 #include <brillo/streams/file_stream.h>
 
 #include "update_engine/common/error_code.h"
+#include "update_engine/common/trace.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/install_plan.h"
@@ -79,9 +83,28 @@ using std::string;
 namespace chromeos_update_engine {
 
 namespace {
-const off_t kReadFileBufferSize = 128 * 1024;
 constexpr float kVerityProgressPercent = 0.3;
 constexpr float kEncodeFECPercent = 0.3;
+// How often progress is reported while partitions are hashed in parallel.
+constexpr auto kParallelHashingPollInterval =
+    base::TimeDelta::FromMilliseconds(100);
+// The fewest workers hashing the chunks of a partition, as long as there are
+// as many CPUs.
+constexpr size_t kMinChunkedHashWorkers = 4;
+
+// Adds the time it is in scope to |total|.
+class ScopedStepTimer {
+ public:
+  explicit ScopedStepTimer(base::TimeDelta* total)
+      : total_(total), start_(base::TimeTicks::Now()) {}
+  ~ScopedStepTimer() { *total_ += base::TimeTicks::Now() - start_; }
+
+ private:
+  base::TimeDelta* total_;
+  base::TimeTicks start_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedStepTimer);
+};
 
 }  // namespace
 
@@ -115,6 +138,13 @@ void FilesystemVerifierAction::PerformAction() {
                    std::plus<size_t>());
 
   install_plan_.Dump();
+  // Checking the extents of the untouched dynamic partitions only reads the
+  // metadata of the super partition. Do it before hashing the others, so that
+  // a mismatch fails the action right away.
+  if (!VerifyUntouchedPartitions()) {
+    abort_action_completer.set_code(ErrorCode::kFilesystemVerifierError);
+    return;
+  }
   // If we are not writing verity, just map all partitions once at the
   // beginning.
   // No need to re-map for each partition, because we are not writing any new
@@ -123,7 +153,11 @@ void FilesystemVerifierAction::PerformAction() {
       !install_plan_.write_verity) {
     dynamic_control_->MapAllPartitions();
   }
-  StartPartitionHashing();
+  if (ShouldHashInParallel()) {
+    StartParallelHashing();
+  } else {
+    StartPartitionHashing();
+  }
   abort_action_completer.set_should_complete(false);
 }
 
@@ -133,13 +167,25 @@ void FilesystemVerifierAction::TerminateProcessing() {
 }
 
 void FilesystemVerifierAction::Cleanup(ErrorCode code) {
+  parallel_hasher_.reset();
+  chunked_hasher_.reset();
+  for (auto& partition : install_plan_.partitions) {
+    partition.target_hasher.reset();
+    partition.inline_hash_tree_builder.reset();
+  }
+  verity_extents_.clear();
+  // Stop reading before the fd goes away.
+  read_ahead_.reset();
   partition_fd_.reset();
   // This memory is not used anymore.
   buffer_.clear();
 
-  // If we didn't write verity, partitions were maped. Releaase resource now.
+  // If we didn't write verity, partitions were maped. Once verified, they
+  // are left mapped for the postinstall action to reuse, which unmaps them
+  // when done. Release them now otherwise.
   if (!install_plan_.write_verity &&
-      dynamic_control_->UpdateUsesSnapshotCompression()) {
+      dynamic_control_->UpdateUsesSnapshotCompression() &&
+      (cancelled_ || code != ErrorCode::kSuccess)) {
     LOG(INFO) << "Not writing verity and VABC is enabled, unmapping all "
                  "partitions";
     dynamic_control_->UnmapAllPartitions();
@@ -148,7 +194,7 @@ void FilesystemVerifierAction::Cleanup(ErrorCode code) {
   if (cancelled_)
     return;
   if (code == ErrorCode::kSuccess && HasOutputPipe())
-    SetOutputObject(install_plan_);
+    SetOutputObject(std::move(install_plan_));
   UpdateProgress(1.0);
   processor_->ActionComplete(this, code);
 }
@@ -207,7 +253,11 @@ bool FilesystemVerifierAction::InitializeFdVABC(bool should_write_verity) {
 }
 
 bool FilesystemVerifierAction::InitializeFd(const std::string& part_path) {
-  partition_fd_ = std::make_unique<EintrSafeFileDescriptor>();
+  if (install_plan_.use_direct_io) {
+    partition_fd_ = std::make_unique<DirectIoFileDescriptor>();
+  } else {
+    partition_fd_ = std::make_unique<EintrSafeFileDescriptor>();
+  }
   const bool write_verity = ShouldWriteVerity();
   int flags = write_verity ? O_RDWR : O_RDONLY;
   if (!utils::SetBlockDeviceReadOnly(part_path, !write_verity)) {
@@ -221,9 +271,7 @@ bool FilesystemVerifierAction::InitializeFd(const std::string& part_path) {
   return true;
 }
 
-void FilesystemVerifierAction::WriteVerityData(FileDescriptor* fd,
-                                               void* buffer,
-                                               const size_t buffer_size) {
+void FilesystemVerifierAction::WriteVerityData(FileDescriptor* fd) {
   if (verity_writer_->FECFinished()) {
     LOG(INFO) << "EncodeFEC is completed. Resuming other tasks";
     if (dynamic_control_->UpdateUsesSnapshotCompression()) {
@@ -234,9 +282,13 @@ void FilesystemVerifierAction::WriteVerityData(FileDescriptor* fd,
         return;
       }
     }
-    HashPartition(0, partition_size_, buffer, buffer_size);
+    if (VerifyVerityRoot())
+      return;
+    HashPartition(hash_with_verity_ ? filesystem_data_end_ : 0,
+                  partition_size_);
     return;
   }
+  ScopedStepTimer timer(&step_times_.fec);
   if (!verity_writer_->IncrementalFinalize(fd, fd)) {
     LOG(ERROR) << "Failed to write verity data";
     Cleanup(ErrorCode::kVerityCalculationError);
@@ -247,46 +299,55 @@ void FilesystemVerifierAction::WriteVerityData(FileDescriptor* fd,
       FROM_HERE,
       base::BindOnce(&FilesystemVerifierAction::WriteVerityData,
                      base::Unretained(this),
-                     fd,
-                     buffer,
-                     buffer_size)));
+                     fd)));
 }
 
 void FilesystemVerifierAction::WriteVerityAndHashPartition(
-    const off64_t start_offset,
-    const off64_t end_offset,
-    void* buffer,
-    const size_t buffer_size) {
+    const off64_t start_offset, const off64_t end_offset) {
   auto fd = partition_fd_.get();
   TEST_AND_RETURN(fd != nullptr);
   if (start_offset >= end_offset) {
     LOG_IF(WARNING, start_offset > end_offset)
         << "start_offset is greater than end_offset : " << start_offset << " > "
         << end_offset;
-    WriteVerityData(fd, buffer, buffer_size);
+    // The verity data is written to |fd|, so stop reading from it first.
+    read_ahead_.reset();
+    if (!verity_extents_.empty()) {
+      const uint64_t block_size =
+          install_plan_.partitions[partition_index_].block_size;
+      const Extent extent = verity_extents_.front();
+      verity_extents_.erase(verity_extents_.begin());
+      WriteVerityAndHashPartition(
+          extent.start_block() * block_size,
+          (extent.start_block() + extent.num_blocks()) * block_size);
+      return;
+    }
+    WriteVerityData(fd);
     return;
   }
-  const auto cur_offset = fd->Seek(start_offset, SEEK_SET);
-  if (cur_offset != start_offset) {
-    PLOG(ERROR) << "Failed to seek to offset: " << start_offset;
-    Cleanup(ErrorCode::kVerityCalculationError);
-    return;
+  if (!read_ahead_) {
+    read_ahead_ =
+        std::make_unique<ReadAheadReader>(fd, start_offset, end_offset);
   }
-  const auto read_size =
-      std::min<size_t>(buffer_size, end_offset - start_offset);
-  const auto bytes_read = fd->Read(buffer, read_size);
-  if (bytes_read < 0 || static_cast<size_t>(bytes_read) != read_size) {
-    PLOG(ERROR) << "Failed to read offset " << start_offset << " expected "
-                << read_size << " bytes, actual: " << bytes_read;
+  UE_TRACE_SCOPE("verity_chunk");
+  ScopedStepTimer timer(&step_times_.hash_tree);
+  if (!read_ahead_->Next(&buffer_) || buffer_.empty()) {
+    LOG(ERROR) << "Failed to read offset " << start_offset << " expected "
+               << (end_offset - start_offset) << " more bytes";
     Cleanup(ErrorCode::kVerityCalculationError);
     return;
   }
-  if (!verity_writer_->Update(
-          start_offset, static_cast<const uint8_t*>(buffer), read_size)) {
+  const auto bytes_read = buffer_.size();
+  if (!verity_writer_->Update(start_offset, buffer_.data(), bytes_read)) {
     LOG(ERROR) << "VerityWriter::Update() failed";
     Cleanup(ErrorCode::kVerityCalculationError);
     return;
   }
+  if (hash_with_verity_ && !hasher_->Update(buffer_.data(), bytes_read)) {
+    LOG(ERROR) << "Hasher updated failed on offset" << start_offset;
+    Cleanup(ErrorCode::kFilesystemVerifierError);
+    return;
+  }
   UpdatePartitionProgress((start_offset + bytes_read) * 1.0f / partition_size_ *
                           kVerityProgressPercent);
   CHECK(pending_task_id_.PostTask(
@@ -294,45 +355,77 @@ void FilesystemVerifierAction::WriteVerityAndHashPartition(
       base::BindOnce(&FilesystemVerifierAction::WriteVerityAndHashPartition,
                      base::Unretained(this),
                      start_offset + bytes_read,
-                     end_offset,
-                     buffer,
-                     buffer_size)));
+                     end_offset)));
 }
 
 void FilesystemVerifierAction::HashPartition(const off64_t start_offset,
-                                             const off64_t end_offset,
-                                             void* buffer,
-                                             const size_t buffer_size) {
+                                             const off64_t end_offset) {
   auto fd = partition_fd_.get();
   TEST_AND_RETURN(fd != nullptr);
   if (start_offset >= end_offset) {
     LOG_IF(WARNING, start_offset > end_offset)
         << "start_offset is greater than end_offset : " << start_offset << " > "
         << end_offset;
+    read_ahead_.reset();
     FinishPartitionHashing();
     return;
   }
-  const auto cur_offset = fd->Seek(start_offset, SEEK_SET);
-  if (cur_offset != start_offset) {
-    PLOG(ERROR) << "Failed to seek to offset: " << start_offset;
-    Cleanup(ErrorCode::kFilesystemVerifierError);
+  if (start_offset == 0 && !read_ahead_ && ShouldHashChunks()) {
+    StartChunkedHashing();
     return;
   }
-  const auto read_size =
-      std::min<size_t>(buffer_size, end_offset - start_offset);
-  const auto bytes_read = fd->Read(buffer, read_size);
-  if (bytes_read < 0 || static_cast<size_t>(bytes_read) != read_size) {
-    PLOG(ERROR) << "Failed to read offset " << start_offset << " expected "
-                << read_size << " bytes, actual: " << bytes_read;
+  if (!read_ahead_) {
+    read_ahead_ =
+        std::make_unique<ReadAheadReader>(fd, start_offset, end_offset);
+  }
+  UE_TRACE_SCOPE("hash_chunk");
+  ScopedStepTimer timer(&step_times_.hash);
+  if (!read_ahead_->Next(&buffer_) || buffer_.empty()) {
+    LOG(ERROR) << "Failed to read offset " << start_offset << " expected "
+               << (end_offset - start_offset) << " more bytes";
     Cleanup(ErrorCode::kFilesystemVerifierError);
     return;
   }
-  if (!hasher_->Update(buffer, read_size)) {
+  const auto bytes_read = buffer_.size();
+  if (!hasher_->Update(buffer_.data(), bytes_read)) {
     LOG(ERROR) << "Hasher updated failed on offset" << start_offset;
     Cleanup(ErrorCode::kFilesystemVerifierError);
     return;
   }
-  const auto progress = (start_offset + bytes_read) * 1.0f / partition_size_;
+  UpdateHashingProgress((start_offset + bytes_read) * 1.0f / partition_size_);
+  CHECK(pending_task_id_.PostTask(
+      FROM_HERE,
+      base::BindOnce(&FilesystemVerifierAction::HashPartition,
+                     base::Unretained(this),
+                     start_offset + bytes_read,
+                     end_offset)));
+}
+
+void FilesystemVerifierAction::DropVerifiedPages() {
+  if (!install_plan_.postinstall_cache_warming)
+    return;
+  const InstallPlan::Partition& partition =
+      install_plan_.partitions[partition_index_];
+  const auto& part_path = IsVABC(partition) ? partition.readonly_target_path
+                                            : partition.target_path;
+  if (part_path.empty())
+    return;
+  // The page cache of the device is shared by all the fds reading it, but not
+  // with the filesystem mounted for postinstall, which has its own.
+  int fd = HANDLE_EINTR(open(part_path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) {
+    PLOG(WARNING) << "Failed to open " << part_path;
+    return;
+  }
+  ScopedFdCloser fd_closer(&fd);
+  const int err = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  if (err != 0) {
+    LOG(WARNING) << "posix_fadvise(POSIX_FADV_DONTNEED) failed on "
+                 << part_path << ": " << strerror(err);
+  }
+}
+
+void FilesystemVerifierAction::UpdateHashingProgress(double progress) {
   // If we are writing verity, then the progress bar will be split between
   // verity writes and partition hashing. Otherwise, the entire progress bar is
   // dedicated to partition hashing for smooth progress.
@@ -343,37 +436,94 @@ void FilesystemVerifierAction::HashPartition(const off64_t start_offset,
   } else {
     UpdatePartitionProgress(progress);
   }
-  CHECK(pending_task_id_.PostTask(
-      FROM_HERE,
-      base::BindOnce(&FilesystemVerifierAction::HashPartition,
-                     base::Unretained(this),
-                     start_offset + bytes_read,
-                     end_offset,
-                     buffer,
-                     buffer_size)));
+}
+
+bool FilesystemVerifierAction::ShouldHashChunks() {
+  const InstallPlan::Partition& partition =
+      install_plan_.partitions[partition_index_];
+  // With VABC, the verity data just written is only read back through the
+  // COW fd, not from the device of the partition.
+  return verifier_step_ == VerifierStep::kVerifyTargetHash &&
+         partition.target_hash_chunk_size > 0 &&
+         !partition.target_chunked_hash.empty() &&
+         !GetPartitionPath().empty() &&
+         !(IsVABC(partition) && ShouldWriteVerity());
+}
+
+void FilesystemVerifierAction::StartChunkedHashing() {
+  const InstallPlan::Partition& partition =
+      install_plan_.partitions[partition_index_];
+  const size_t num_workers = std::max<size_t>(
+      install_plan_.verify_workers,
+      std::clamp<size_t>(
+          std::thread::hardware_concurrency(), 1, kMinChunkedHashWorkers));
+  LOG(INFO) << "Hashing the " << partition.target_hash_chunk_size
+            << " bytes chunks of partition " << partition.name << " with "
+            << num_workers << " workers";
+  chunked_hashing_start_ = base::TimeTicks::Now();
+  chunked_hasher_ =
+      std::make_unique<ChunkedPartitionHasher>(GetPartitionPath(),
+                                               partition_size_,
+                                               partition.target_hash_chunk_size,
+                                               num_workers,
+                                               install_plan_.use_direct_io);
+  CheckChunkedHashing();
+}
+
+void FilesystemVerifierAction::CheckChunkedHashing() {
+  if (partition_size_ > 0) {
+    UpdateHashingProgress(chunked_hasher_->bytes_hashed() * 1.0 /
+                          partition_size_);
+  }
+  if (!chunked_hasher_->IsDone()) {
+    CHECK(pending_task_id_.PostTask(
+        FROM_HERE,
+        base::BindOnce(&FilesystemVerifierAction::CheckChunkedHashing,
+                       base::Unretained(this)),
+        kParallelHashingPollInterval));
+    return;
+  }
+  step_times_.hash += base::TimeTicks::Now() - chunked_hashing_start_;
+  const InstallPlan::Partition& partition =
+      install_plan_.partitions[partition_index_];
+  brillo::Blob hash;
+  const bool success = chunked_hasher_->GetHash(&hash);
+  chunked_hasher_.reset();
+  if (!success) {
+    LOG(ERROR) << "Failed to hash the chunks of partition " << partition.name;
+    Cleanup(ErrorCode::kFilesystemVerifierError);
+    return;
+  }
+  LOG(INFO) << "Chunked hash of " << partition.name << ": "
+            << HexEncode(hash);
+  CheckPartitionHash(hash, partition.target_chunked_hash);
+}
+
+bool FilesystemVerifierAction::VerifyUntouchedPartitions() {
+  if (install_plan_.untouched_dynamic_partitions.empty())
+    return true;
+  LOG(INFO) << "Verifying extents of untouched dynamic partitions ["
+            << base::JoinString(install_plan_.untouched_dynamic_partitions,
+                                ", ")
+            << "]";
+  return dynamic_control_->VerifyExtentsForUntouchedPartitions(
+      install_plan_.source_slot,
+      install_plan_.target_slot,
+      install_plan_.untouched_dynamic_partitions);
 }
 
 void FilesystemVerifierAction::StartPartitionHashing() {
   if (partition_index_ == install_plan_.partitions.size()) {
-    if (!install_plan_.untouched_dynamic_partitions.empty()) {
-      LOG(INFO) << "Verifying extents of untouched dynamic partitions ["
-                << base::JoinString(install_plan_.untouched_dynamic_partitions,
-                                    ", ")
-                << "]";
-      if (!dynamic_control_->VerifyExtentsForUntouchedPartitions(
-              install_plan_.source_slot,
-              install_plan_.target_slot,
-              install_plan_.untouched_dynamic_partitions)) {
-        Cleanup(ErrorCode::kFilesystemVerifierError);
-        return;
-      }
-    }
-
     Cleanup(ErrorCode::kSuccess);
     return;
   }
   const InstallPlan::Partition& partition =
       install_plan_.partitions[partition_index_];
+  if (verifier_step_ == VerifierStep::kVerifyTargetHash &&
+      partition.target_hasher) {
+    CheckEarlyHash();
+    return;
+  }
   const auto& part_path = GetPartitionPath();
   partition_size_ = GetPartitionSize();
 
@@ -403,8 +553,7 @@ void FilesystemVerifierAction::StartPartitionHashing() {
     Cleanup(ErrorCode::kFilesystemVerifierError);
     return;
   }
-  buffer_.resize(kReadFileBufferSize);
-  hasher_ = std::make_unique<HashCalculator>();
+  hasher_ = std::make_unique<HashCalculator>(partition.hash_algorithm);
 
   offset_ = 0;
   filesystem_data_end_ = partition_size_;
@@ -420,17 +569,191 @@ void FilesystemVerifierAction::StartPartitionHashing() {
   }
   if (ShouldWriteVerity()) {
     LOG(INFO) << "Verity writes enabled on partition " << partition.name;
+    // No need to hash the partition when checking the root digest of its hash
+    // tree. Reading all the filesystem data to hash it otherwise, the hash
+    // tree is built from it too.
+    hash_with_verity_ = !CanVerifyVerityRoot();
+    if (hash_with_verity_) {
+      install_plan_.partitions[partition_index_]
+          .inline_hash_tree_builder.reset();
+    }
     if (!verity_writer_->Init(partition)) {
       LOG(INFO) << "Verity writes enabled on partition " << partition.name;
       Cleanup(ErrorCode::kVerityCalculationError);
       return;
     }
-    WriteVerityAndHashPartition(
-        0, filesystem_data_end_, buffer_.data(), buffer_.size());
+    verity_extents_.clear();
+    if (!hash_with_verity_ &&
+        verity_writer_->GetMissingExtents(&verity_extents_)) {
+      LOG(INFO) << "Reading the " << utils::BlocksInExtents(verity_extents_)
+                << " blocks of " << partition.name
+                << " not written by the update for its hash tree";
+      WriteVerityAndHashPartition(0, 0);
+      return;
+    }
+    WriteVerityAndHashPartition(0, filesystem_data_end_);
   } else {
     LOG(INFO) << "Verity writes disabled on partition " << partition.name;
-    HashPartition(0, partition_size_, buffer_.data(), buffer_.size());
+    HashPartition(0, partition_size_);
+  }
+}
+
+bool FilesystemVerifierAction::ShouldHashInParallel() const {
+  if (install_plan_.verify_workers <= 1 ||
+      install_plan_.partitions.size() <= 1) {
+    return false;
+  }
+  // The partitions hashed while the update was applied are checked one at a
+  // time as their hashes become available.
+  if (std::any_of(install_plan_.partitions.begin(),
+                  install_plan_.partitions.end(),
+                  [](const InstallPlan::Partition& partition) {
+                    return partition.target_hasher != nullptr;
+                  })) {
+    return false;
+  }
+  if (!install_plan_.write_verity) {
+    return true;
+  }
+  // Verity data is written one partition at a time, and with VABC doing so
+  // remaps all the partitions, so none of that can overlap with hashing.
+  if (dynamic_control_->UpdateUsesSnapshotCompression()) {
+    return false;
+  }
+  return std::none_of(install_plan_.partitions.begin(),
+                      install_plan_.partitions.end(),
+                      [](const InstallPlan::Partition& partition) {
+                        return partition.hash_tree_size > 0 ||
+                               partition.fec_size > 0;
+                      });
+}
+
+void FilesystemVerifierAction::StartParallelHashing() {
+  std::vector<ParallelPartitionHasher::Partition> partitions;
+  for (const auto& partition : install_plan_.partitions) {
+    const auto& part_path = IsVABC(partition) ? partition.readonly_target_path
+                                              : partition.target_path;
+    if (part_path.empty() && partition.target_size > 0) {
+      LOG(ERROR) << "Cannot hash partition " << partition.name
+                 << " because its device path cannot be determined.";
+      Cleanup(ErrorCode::kFilesystemVerifierError);
+      return;
+    }
+    if (!part_path.empty() &&
+        !utils::SetBlockDeviceReadOnly(part_path, true)) {
+      LOG(WARNING) << "Failed to set block device " << part_path
+                   << " as readonly";
+    }
+    partitions.push_back(
+        {part_path, partition.target_size, partition.hash_algorithm});
+  }
+  LOG(INFO) << "Hashing " << partitions.size() << " partitions with up to "
+            << install_plan_.verify_workers << " workers";
+  parallel_hashing_start_ = base::TimeTicks::Now();
+  parallel_hasher_ = std::make_unique<ParallelPartitionHasher>(
+      std::move(partitions),
+      install_plan_.verify_workers,
+      install_plan_.use_direct_io);
+  CheckParallelHashing();
+}
+
+void FilesystemVerifierAction::CheckParallelHashing() {
+  if (partition_weight_.back() > 0) {
+    UpdateProgress(parallel_hasher_->bytes_hashed() * 1.0 /
+                   partition_weight_.back());
+  }
+  if (!parallel_hasher_->IsDone()) {
+    CHECK(pending_task_id_.PostTask(
+        FROM_HERE,
+        base::BindOnce(&FilesystemVerifierAction::CheckParallelHashing,
+                       base::Unretained(this)),
+        kParallelHashingPollInterval));
+    return;
   }
+  step_times_.hash += base::TimeTicks::Now() - parallel_hashing_start_;
+  // Go through the results in order, so that the first mismatch is reported
+  // like in the sequential case.
+  for (partition_index_ = 0; partition_index_ < install_plan_.partitions.size();
+       partition_index_++) {
+    const InstallPlan::Partition& partition =
+        install_plan_.partitions[partition_index_];
+    const auto& part_path = IsVABC(partition) ? partition.readonly_target_path
+                                              : partition.target_path;
+    if (partition.target_size == 0 && part_path.empty()) {
+      LOG(INFO) << "Skip hashing partition " << partition_index_ << " ("
+                << partition.name << ") because size is 0.";
+      continue;
+    }
+    brillo::Blob hash;
+    if (!parallel_hasher_->GetHash(partition_index_, &hash)) {
+      LOG(ERROR) << "Failed to hash partition " << partition.name;
+      Cleanup(ErrorCode::kFilesystemVerifierError);
+      return;
+    }
+    LOG(INFO) << "Hash of " << partition.name << ": " << HexEncode(hash);
+    if (partition.target_hash != hash) {
+      LOG(ERROR) << "New '" << partition.name
+                 << "' partition verification failed.";
+      parallel_hasher_.reset();
+      if (partition.source_hash.empty()) {
+        // No need to verify source if it is a full payload.
+        Cleanup(ErrorCode::kNewRootfsVerificationError);
+        return;
+      }
+      // Check whether the source partition is the culprit, as in
+      // FinishPartitionHashing().
+      verifier_step_ = VerifierStep::kVerifySourceHash;
+      StartPartitionHashing();
+      return;
+    }
+    DropVerifiedPages();
+  }
+  parallel_hasher_.reset();
+  // All partitions match; this completes the action.
+  StartPartitionHashing();
+}
+
+void FilesystemVerifierAction::CheckEarlyHash() {
+  InstallPlan::Partition& partition =
+      install_plan_.partitions[partition_index_];
+  if (partition.target_size > 0) {
+    UpdatePartitionProgress(partition.target_hasher->bytes_hashed() * 1.0 /
+                            partition.target_size);
+  }
+  if (!partition.target_hasher->IsDone()) {
+    CHECK(pending_task_id_.PostTask(
+        FROM_HERE,
+        base::BindOnce(&FilesystemVerifierAction::CheckEarlyHash,
+                       base::Unretained(this)),
+        kParallelHashingPollInterval));
+    return;
+  }
+  brillo::Blob hash;
+  const bool success = partition.target_hasher->GetHash(0, &hash);
+  partition.target_hasher.reset();
+  if (!success) {
+    LOG(WARNING) << "Failed to hash partition " << partition.name
+                 << " in the background, hashing it again.";
+    StartPartitionHashing();
+    return;
+  }
+  LOG(INFO) << "Hash of " << partition.name << ": " << HexEncode(hash);
+  if (partition.target_hash != hash) {
+    LOG(ERROR) << "New '" << partition.name
+               << "' partition verification failed.";
+    if (partition.source_hash.empty()) {
+      // No need to verify source if it is a full payload.
+      Cleanup(ErrorCode::kNewRootfsVerificationError);
+      return;
+    }
+    // Check whether the source partition is the culprit, as in
+    // FinishPartitionHashing().
+    verifier_step_ = VerifierStep::kVerifySourceHash;
+  } else {
+    DropVerifiedPages();
+    partition_index_++;
+  }
+  StartPartitionHashing();
 }
 
 bool FilesystemVerifierAction::IsVABC(
@@ -471,10 +794,50 @@ bool FilesystemVerifierAction::ShouldWriteVerity() {
   const InstallPlan::Partition& partition =
       install_plan_.partitions[partition_index_];
   return verifier_step_ == VerifierStep::kVerifyTargetHash &&
-         install_plan_.write_verity &&
+         install_plan_.write_verity && !partition.verity_data_in_payload &&
          (partition.hash_tree_size > 0 || partition.fec_size > 0);
 }
 
+bool FilesystemVerifierAction::CanVerifyVerityRoot() const {
+  const InstallPlan::Partition& partition =
+      install_plan_.partitions[partition_index_];
+  if (!install_plan_.verity_root_verification ||
+      partition.hash_tree_root_digest.empty() ||
+      partition.hash_tree_data_offset != 0 ||
+      partition.hash_tree_data_size != partition.hash_tree_offset) {
+    return false;
+  }
+  const uint64_t hash_tree_end =
+      partition.hash_tree_offset + partition.hash_tree_size;
+  if (partition.fec_size == 0)
+    return partition_size_ == hash_tree_end;
+  return partition.fec_offset == hash_tree_end &&
+         partition_size_ == partition.fec_offset + partition.fec_size;
+}
+
+bool FilesystemVerifierAction::VerifyVerityRoot() {
+  if (!CanVerifyVerityRoot())
+    return false;
+  const InstallPlan::Partition& partition =
+      install_plan_.partitions[partition_index_];
+  brillo::Blob root_digest;
+  if (!verity_writer_->GetHashTreeRootDigest(&root_digest)) {
+    LOG(INFO) << "No hash tree root digest of " << partition.name
+              << ", hashing the partition.";
+    return false;
+  }
+  LOG(INFO) << "Hash tree root digest of " << partition.name << ": "
+            << HexEncode(root_digest);
+  if (root_digest != partition.hash_tree_root_digest) {
+    LOG(WARNING) << "Hash tree root digest of " << partition.name
+                 << " doesn't match, hashing the partition.";
+    return false;
+  }
+  // The tree and the FEC data following the data were just written from it.
+  CheckPartitionHash(root_digest, partition.hash_tree_root_digest);
+  return true;
+}
+
 void FilesystemVerifierAction::FinishPartitionHashing() {
   if (!hasher_->Finalize()) {
     LOG(ERROR) << "Unable to finalize the hash.";
@@ -485,12 +848,32 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
       install_plan_.partitions[partition_index_];
   LOG(INFO) << "Hash of " << partition.name << ": "
             << HexEncode(hasher_->raw_hash());
+  CheckPartitionHash(hasher_->raw_hash(),
+                     verifier_step_ == VerifierStep::kVerifyTargetHash
+                         ? partition.target_hash
+                         : partition.source_hash);
+}
 
+void FilesystemVerifierAction::CheckPartitionHash(
+    const brillo::Blob& hash, const brillo::Blob& expected_hash) {
+  const InstallPlan::Partition& partition =
+      install_plan_.partitions[partition_index_];
   switch (verifier_step_) {
     case VerifierStep::kVerifyTargetHash:
-      if (partition.target_hash != hasher_->raw_hash()) {
+      if (hash != expected_hash) {
         LOG(ERROR) << "New '" << partition.name
                    << "' partition verification failed.";
+        if (ShouldWriteVerity() && (partition.update_hash_tree_from_source ||
+                                    partition.update_fec_from_source)) {
+          // The verity data of the source partition may have been off where
+          // it wasn't checked, write it again from scratch.
+          LOG(WARNING) << "Writing the verity data of " << partition.name
+                       << " from scratch";
+          auto& install_part = install_plan_.partitions[partition_index_];
+          install_part.update_hash_tree_from_source = false;
+          install_part.update_fec_from_source = false;
+          break;
+        }
         if (partition.source_hash.empty()) {
           // No need to verify source if it is a full payload.
           Cleanup(ErrorCode::kNewRootfsVerificationError);
@@ -502,11 +885,12 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
         // source partition does not match either.
         verifier_step_ = VerifierStep::kVerifySourceHash;
       } else {
+        DropVerifiedPages();
         partition_index_++;
       }
       break;
     case VerifierStep::kVerifySourceHash:
-      if (partition.source_hash != hasher_->raw_hash()) {
+      if (hash != expected_hash) {
         LOG(ERROR) << "Old '" << partition.name
                    << "' partition verification failed.";
         LOG(ERROR) << "This is a server-side error due to mismatched delta"
@@ -519,9 +903,9 @@ void FilesystemVerifierAction::FinishPartitionHashing() {
                       " means that the delta I've been given doesn't match my"
                       " existing system. The "
                    << partition.name << " partition I have has hash: "
-                   << Base64Encode(hasher_->raw_hash())
+                   << Base64Encode(hash)
                    << " but the update expected me to have "
-                   << Base64Encode(partition.source_hash) << " .";
+                   << Base64Encode(expected_hash) << " .";
         LOG(INFO) << "To get the checksum of the " << partition.name
                   << " partition run this command: dd if="
                   << partition.source_path
@@ -25,13 +25,17 @@
 #include <utility>
 #include <vector>
 
+#include <base/time/time.h>
 #include <brillo/message_loops/message_loop.h>
 
 #include "update_engine/common/action.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/scoped_task_id.h"
+#include "update_engine/payload_consumer/chunked_partition_hasher.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/parallel_partition_hasher.h"
+#include "update_engine/payload_consumer/read_ahead_reader.h"
 #include "update_engine/payload_consumer/verity_writer_interface.h"
 
 // This action will hash all the partitions of the target slot involved in the
@@ -84,23 +88,70 @@ class FilesystemVerifierAction : public InstallPlanAction {
   static std::string StaticType() { return "FilesystemVerifierAction"; }
   std::string Type() const override { return StaticType(); }
 
+  // The time spent on each step of the verification, over all the partitions.
+  struct StepTimes {
+    // Reading the partitions up to their hash tree and building it.
+    base::TimeDelta hash_tree;
+    // Writing the hash trees, and encoding and writing the FEC data.
+    base::TimeDelta fec;
+    // Reading and hashing the partitions.
+    base::TimeDelta hash;
+  };
+  const StepTimes& step_times() const { return step_times_; }
+
  private:
   friend class FilesystemVerifierActionTestDelegate;
   // Wrapper function that schedules calls of EncodeFEC. Returns true on success
-  void WriteVerityData(FileDescriptor* fd,
-                       void* buffer,
-                       const size_t buffer_size);
+  void WriteVerityData(FileDescriptor* fd);
+  // Both read [start_offset, end_offset) of |partition_fd_| through
+  // |read_ahead_|, one chunk per message loop iteration. The former goes on
+  // with the |verity_extents_| left afterwards.
   void WriteVerityAndHashPartition(const off64_t start_offset,
-                                   const off64_t end_offset,
-                                   void* buffer,
-                                   const size_t buffer_size);
-  void HashPartition(const off64_t start_offset,
-                     const off64_t end_offset,
-                     void* buffer,
-                     const size_t buffer_size);
+                                   const off64_t end_offset);
+  void HashPartition(const off64_t start_offset, const off64_t end_offset);
+  // Drops the pages of the target of the current partition, once verified,
+  // from the page cache when the install plan asks for it.
+  void DropVerifiedPages();
+  // Reports the progress of hashing the current partition, |progress| being
+  // the fraction of it hashed.
+  void UpdateHashingProgress(double progress);
 
   // Return true if we need to write verity bytes.
   bool ShouldWriteVerity();
+
+  // Whether the current partition, whose verity data was just written, is
+  // made only of the data covered by its hash tree followed by that verity
+  // data, so that checking the root digest of the hash tree built checks it
+  // all.
+  bool CanVerifyVerityRoot() const;
+  // Checks the root digest of the hash tree built for the current partition
+  // against the one in the manifest, when possible. Returns true if it matches
+  // and the action moved on to the next partition; the partition is hashed
+  // whole otherwise.
+  bool VerifyVerityRoot();
+
+  // Whether the target partitions can all be hashed at the same time, by
+  // |parallel_hasher_|.
+  bool ShouldHashInParallel() const;
+  // Starts hashing every target partition concurrently.
+  void StartParallelHashing();
+  // Reports the progress of |parallel_hasher_|, and checks the hashes once it
+  // is done.
+  void CheckParallelHashing();
+  // Whether the current target partition can be checked against its chunked
+  // hash, by |chunked_hasher_| instead of |hasher_|.
+  bool ShouldHashChunks();
+  // Starts hashing the chunks of the current partition concurrently.
+  void StartChunkedHashing();
+  // Reports the progress of |chunked_hasher_|, and checks the hash once it is
+  // done.
+  void CheckChunkedHashing();
+  // Reports the progress of the |target_hasher| of the current partition,
+  // started while the update was applied, and checks its hash once it is done.
+  void CheckEarlyHash();
+  // Checks that the extents of the dynamic partitions the update doesn't touch
+  // are the same in the target slot as in the source slot.
+  bool VerifyUntouchedPartitions();
   // Starts the hashing of the current partition. If there aren't any partitions
   // remaining to be hashed, it finishes the action.
   void StartPartitionHashing();
@@ -115,6 +166,11 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // and continue checking the next one.
   void FinishPartitionHashing();
 
+  // Checks the |hash| of the current partition against |expected_hash|, and
+  // continues with the next partition or step accordingly.
+  void CheckPartitionHash(const brillo::Blob& hash,
+                          const brillo::Blob& expected_hash);
+
   // Cleans up all the variables we use for async operations and tells the
   // ActionProcessor we're done w/ |code| as passed in. |cancelled_| should be
   // true if TerminateProcessing() was called.
@@ -142,7 +198,11 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // verity writer might attempt to write to this fd, if verity is enabled.
   std::unique_ptr<FileDescriptor> partition_fd_;
 
-  // Buffer for storing data we read.
+  // Reads |partition_fd_| ahead of hashing. While set, nobody else may use
+  // |partition_fd_|.
+  std::unique_ptr<ReadAheadReader> read_ahead_;
+
+  // The chunk we are currently hashing, as returned by |read_ahead_|.
   brillo::Blob buffer_;
 
   bool cancelled_{false};  // true if the action has been cancelled.
@@ -150,6 +210,13 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // Calculates the hash of the data.
   std::unique_ptr<HashCalculator> hasher_;
 
+  // Hashes all the target partitions when verifying them concurrently.
+  std::unique_ptr<ParallelPartitionHasher> parallel_hasher_;
+
+  // Hashes the chunks of the current partition, when its chunked hash is
+  // checked.
+  std::unique_ptr<ChunkedPartitionHasher> chunked_hasher_;
+
   // Write verity data of the current partition.
   std::unique_ptr<VerityWriterInterface> verity_writer_;
 
@@ -169,6 +236,14 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // The end offset of filesystem data, first byte position of hashtree.
   uint64_t filesystem_data_end_{0};
 
+  // Whether the filesystem data is hashed as it is read to build the hash
+  // tree, so that only the verity data is read again to hash the partition.
+  bool hash_with_verity_{false};
+
+  // The blocks left to read for the hash tree when it was partly built as the
+  // partition was written, instead of all the filesystem data.
+  std::vector<Extent> verity_extents_;
+
   // An observer that observes progress updates of this action.
   FilesystemVerifyDelegate* delegate_{};
 
@@ -181,6 +256,12 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // partitions.
   std::vector<size_t> partition_weight_;
 
+  StepTimes step_times_;
+  // When the partitions started to be hashed in parallel.
+  base::TimeTicks parallel_hashing_start_;
+  // When the chunks of the current partition started to be hashed.
+  base::TimeTicks chunked_hashing_start_;
+
   DISALLOW_COPY_AND_ASSIGN(FilesystemVerifierAction);
 };
 
@@ -418,6 +418,26 @@ TEST_F(FilesystemVerifierActionTest, NonExistentDriveTest) {
   EXPECT_EQ(ErrorCode::kFilesystemVerifierError, delegate.code_);
 }
 
+TEST_F(FilesystemVerifierActionTest, UntouchedPartitionsMismatchTest) {
+  install_plan_.untouched_dynamic_partitions = {"vendor"};
+  AddFakePartition(&install_plan_, "system");
+  NiceMock<MockDynamicPartitionControl> dynamic_control;
+  EXPECT_CALL(dynamic_control,
+              VerifyExtentsForUntouchedPartitions(
+                  _, _, std::vector<std::string>{"vendor"}))
+      .WillOnce(Return(false));
+
+  BuildActions(install_plan_, &dynamic_control);
+
+  FilesystemVerifierActionTest2Delegate delegate;
+  processor_.set_delegate(&delegate);
+
+  processor_.StartProcessing();
+  EXPECT_FALSE(processor_.IsRunning());
+  EXPECT_TRUE(delegate.ran_);
+  EXPECT_EQ(ErrorCode::kFilesystemVerifierError, delegate.code_);
+}
+
 TEST_F(FilesystemVerifierActionTest, RunAsRootVerifyHashTest) {
   ASSERT_EQ(0U, getuid());
   EXPECT_TRUE(DoTest(false, false));
@@ -496,6 +516,112 @@ TEST_F(FilesystemVerifierActionTest, RunAsRootWriteVerityTest) {
   EXPECT_TRUE(delegate.ran());
   EXPECT_EQ(ErrorCode::kSuccess, delegate.code());
 }
+
+TEST_F(FilesystemVerifierActionTest, RunAsRootVerityRootVerificationTest) {
+  ScopedTempFile part_file("part_file.XXXXXX");
+  constexpr size_t filesystem_size = 200 * 4096;
+  constexpr size_t part_size = 256 * 4096;
+  brillo::Blob part_data(filesystem_size, 0x1);
+  part_data.resize(part_size);
+  ASSERT_TRUE(test_utils::WriteFileVector(part_file.path(), part_data));
+  string target_path;
+  test_utils::ScopedLoopbackDeviceBinder target_device(
+      part_file.path(), true, &target_path);
+
+  InstallPlan::Partition part;
+  part.name = "part";
+  part.target_path = target_path;
+  part.target_size = part_size;
+  part.block_size = 4096;
+  part.hash_tree_algorithm = "sha256";
+  part.hash_tree_data_offset = 0;
+  part.hash_tree_data_size = filesystem_size;
+  part.hash_tree_offset = filesystem_size;
+  part.hash_tree_size =
+      HashTreeBuilder::CalculateSize(filesystem_size, 4096, HASH_SIZE);
+  part.hash_tree_salt = {0x01, 0x23, 0x45, 0x67};
+  part.fec_data_offset = 0;
+  part.fec_data_size = filesystem_size + part.hash_tree_size;
+  part.fec_offset = part.fec_data_size;
+  part.fec_size = 2 * 4096;
+  part.fec_roots = 2;
+  // Only made of the data covered by the hash tree and the verity data.
+  part.target_size = part.fec_offset + part.fec_size;
+  HashTreeBuilder builder(4096, HashTreeBuilder::HashFunction("sha256"));
+  ASSERT_TRUE(builder.Initialize(filesystem_size, part.hash_tree_salt));
+  ASSERT_TRUE(builder.Update(part_data.data(), filesystem_size));
+  ASSERT_TRUE(builder.BuildHashTree());
+  part.hash_tree_root_digest.assign(builder.root_hash().begin(),
+                                    builder.root_hash().end());
+  // The partition isn't hashed, so the target hash doesn't matter.
+  part.target_hash = brillo::Blob(32, 0);
+  install_plan_.partitions = {part};
+  install_plan_.verity_root_verification = true;
+
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  EXPECT_FALSE(processor_.IsRunning());
+  EXPECT_TRUE(delegate.ran());
+  EXPECT_EQ(ErrorCode::kSuccess, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, RunAsRootVerityRootMismatchTest) {
+  ScopedTempFile part_file("part_file.XXXXXX");
+  constexpr size_t filesystem_size = 200 * 4096;
+  constexpr size_t part_size = 256 * 4096;
+  brillo::Blob part_data(filesystem_size, 0x1);
+  part_data.resize(part_size);
+  ASSERT_TRUE(test_utils::WriteFileVector(part_file.path(), part_data));
+  string target_path;
+  test_utils::ScopedLoopbackDeviceBinder target_device(
+      part_file.path(), true, &target_path);
+
+  InstallPlan::Partition part;
+  part.name = "part";
+  part.target_path = target_path;
+  part.target_size = part_size;
+  part.block_size = 4096;
+  part.hash_tree_algorithm = "sha256";
+  part.hash_tree_data_offset = 0;
+  part.hash_tree_data_size = filesystem_size;
+  part.hash_tree_offset = filesystem_size;
+  part.hash_tree_size =
+      HashTreeBuilder::CalculateSize(filesystem_size, 4096, HASH_SIZE);
+  part.hash_tree_salt = {0x01, 0x23, 0x45, 0x67};
+  part.hash_tree_root_digest = brillo::Blob(32, 0);
+  part.target_size = part.hash_tree_offset + part.hash_tree_size;
+  // A full payload, so the source partition isn't checked.
+  part.target_hash = brillo::Blob(32, 0);
+  install_plan_.partitions = {part};
+  install_plan_.verity_root_verification = true;
+
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  // The partition is hashed whole after the root digest mismatch.
+  EXPECT_FALSE(processor_.IsRunning());
+  EXPECT_TRUE(delegate.ran());
+  EXPECT_EQ(ErrorCode::kNewRootfsVerificationError, delegate.code());
+}
 #endif  // __ANDROID__
 
 TEST_F(FilesystemVerifierActionTest, RunAsRootSkipWriteVerityTest) {
@@ -543,6 +669,53 @@ TEST_F(FilesystemVerifierActionTest, RunAsRootSkipWriteVerityTest) {
   ASSERT_EQ(ErrorCode::kSuccess, delegate.code());
 }
 
+TEST_F(FilesystemVerifierActionTest, RunAsRootVerityDataInPayloadTest) {
+  ScopedTempFile part_file("part_file.XXXXXX");
+  constexpr size_t filesystem_size = 200 * 4096;
+  constexpr size_t part_size = 256 * 4096;
+  brillo::Blob part_data(part_size);
+  test_utils::FillWithData(&part_data);
+  ASSERT_TRUE(test_utils::WriteFileVector(part_file.path(), part_data));
+  string target_path;
+  test_utils::ScopedLoopbackDeviceBinder target_device(
+      part_file.path(), true, &target_path);
+
+  install_plan_.write_verity = true;
+  InstallPlan::Partition part;
+  part.name = "part";
+  part.target_path = target_path;
+  part.target_size = part_size;
+  part.block_size = 4096;
+  part.hash_tree_data_offset = 0;
+  part.hash_tree_data_size = filesystem_size;
+  part.hash_tree_offset = filesystem_size;
+  part.hash_tree_size = 3 * 4096;
+  part.fec_data_offset = 0;
+  part.fec_data_size = filesystem_size + part.hash_tree_size;
+  part.fec_offset = part.fec_data_size;
+  part.fec_size = 2 * 4096;
+  // The payload wrote the verity data, which is left as is.
+  part.verity_data_in_payload = true;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(part_data, &part.target_hash));
+  install_plan_.partitions = {part};
+
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kSuccess, delegate.code());
+}
+
 void FilesystemVerifierActionTest::DoTestVABC(bool clear_target_hash,
                                               bool enable_verity) {
   auto part_ptr = AddFakePartition(&install_plan_);
@@ -685,4 +858,207 @@ TEST_F(FilesystemVerifierActionTest, VABC_Verity_Target_Mismatch) {
   DoTestVABC(true, true);
 }
 
+TEST_F(FilesystemVerifierActionTest, ParallelHashingTest) {
+  std::vector<std::unique_ptr<ScopedTempFile>> part_files;
+  install_plan_.verify_workers = 3;
+  for (size_t i = 0; i < 4; i++) {
+    part_files.push_back(
+        std::make_unique<ScopedTempFile>("parallel_part.XXXXXX"));
+    brillo::Blob part_data((i + 1) * 100 * 4096 + i);
+    test_utils::FillWithData(&part_data);
+    ASSERT_TRUE(
+        test_utils::WriteFileVector(part_files.back()->path(), part_data));
+    InstallPlan::Partition part;
+    part.name = "part" + std::to_string(i);
+    part.target_path = part_files.back()->path();
+    part.target_size = part_data.size();
+    ASSERT_TRUE(HashCalculator::RawHashOfData(part_data, &part.target_hash));
+    install_plan_.partitions.push_back(part);
+  }
+
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kSuccess, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, ParallelHashingMismatchTest) {
+  install_plan_.verify_workers = 2;
+  AddFakePartition(&install_plan_, "part0");
+  AddFakePartition(&install_plan_, "part1");
+  // A full payload, so the source partition isn't checked.
+  for (auto& part : install_plan_.partitions) {
+    part.source_hash.clear();
+  }
+  install_plan_.partitions[1].target_hash[0] ^= 1;
+
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kNewRootfsVerificationError, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, EarlyHashTest) {
+  std::vector<std::unique_ptr<ScopedTempFile>> part_files;
+  for (size_t i = 0; i < 2; i++) {
+    part_files.push_back(std::make_unique<ScopedTempFile>("early_part.XXXXXX"));
+    brillo::Blob part_data((i + 1) * 100 * 4096);
+    test_utils::FillWithData(&part_data);
+    ASSERT_TRUE(
+        test_utils::WriteFileVector(part_files.back()->path(), part_data));
+    InstallPlan::Partition part;
+    part.name = "part" + std::to_string(i);
+    part.target_path = part_files.back()->path();
+    part.target_size = part_data.size();
+    ASSERT_TRUE(HashCalculator::RawHashOfData(part_data, &part.target_hash));
+    install_plan_.partitions.push_back(part);
+  }
+  // Only the first partition was hashed while the update was applied, the
+  // other one is hashed by the action.
+  install_plan_.partitions[0].target_hasher =
+      std::make_shared<ParallelPartitionHasher>(
+          std::vector<ParallelPartitionHasher::Partition>{
+              {install_plan_.partitions[0].target_path,
+               install_plan_.partitions[0].target_size}},
+          1);
+
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kSuccess, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, EarlyHashMismatchTest) {
+  ScopedTempFile part_file("early_part.XXXXXX");
+  brillo::Blob part_data(100 * 4096);
+  test_utils::FillWithData(&part_data);
+  ASSERT_TRUE(test_utils::WriteFileVector(part_file.path(), part_data));
+  InstallPlan::Partition part;
+  part.name = "part";
+  part.target_path = part_file.path();
+  part.target_size = part_data.size();
+  ASSERT_TRUE(HashCalculator::RawHashOfData(part_data, &part.target_hash));
+  part.target_hash[0] ^= 1;
+  part.target_hasher = std::make_shared<ParallelPartitionHasher>(
+      std::vector<ParallelPartitionHasher::Partition>{
+          {part.target_path, part.target_size}},
+      1);
+  install_plan_.partitions.push_back(part);
+
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kNewRootfsVerificationError, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, ChunkedHashTest) {
+  ScopedTempFile part_file("chunked_part.XXXXXX");
+  brillo::Blob part_data(100 * 4096 + 17);
+  test_utils::FillWithData(&part_data);
+  ASSERT_TRUE(test_utils::WriteFileVector(part_file.path(), part_data));
+  InstallPlan::Partition part;
+  part.name = "part";
+  part.target_path = part_file.path();
+  part.target_size = part_data.size();
+  // Only the chunked hash is checked; the hash of the whole partition is off.
+  ASSERT_TRUE(HashCalculator::RawHashOfData(part_data, &part.target_hash));
+  part.target_hash[0] ^= 1;
+  part.target_hash_chunk_size = 64 * 1024;
+  ASSERT_TRUE(ChunkedPartitionHasher::HashFile(part.target_path,
+                                               part.target_size,
+                                               part.target_hash_chunk_size,
+                                               1,
+                                               &part.target_chunked_hash));
+  install_plan_.partitions.push_back(part);
+
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kSuccess, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, ChunkedHashMismatchTest) {
+  AddFakePartition(&install_plan_, "part");
+  auto& part = install_plan_.partitions[0];
+  part.source_hash.clear();
+  part.target_hash_chunk_size = 64 * 1024;
+  ASSERT_TRUE(ChunkedPartitionHasher::HashFile(part.target_path,
+                                               part.target_size,
+                                               part.target_hash_chunk_size,
+                                               1,
+                                               &part.target_chunked_hash));
+  part.target_chunked_hash[0] ^= 1;
+
+  BuildActions(install_plan_);
+
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+
+  loop_.PostTask(
+      FROM_HERE,
+      base::Bind(
+          [](ActionProcessor* processor) { processor->StartProcessing(); },
+          base::Unretained(&processor_)));
+  loop_.Run();
+
+  ASSERT_FALSE(processor_.IsRunning());
+  ASSERT_TRUE(delegate.ran());
+  ASSERT_EQ(ErrorCode::kNewRootfsVerificationError, delegate.code());
+}
+
 }  // namespace chromeos_update_engine
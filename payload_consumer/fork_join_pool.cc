@@ -0,0 +1,93 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/fork_join_pool.h"
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+ForkJoinPool::ForkJoinPool(size_t num_threads) {
+  for (size_t i = 1; i < num_threads; i++) {
+    workers_.emplace_back(&ForkJoinPool::WorkerLoop, this, i);
+  }
+}
+
+ForkJoinPool::~ForkJoinPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+bool ForkJoinPool::Run(size_t num_tasks,
+                       const std::function<bool(size_t)>& task) {
+  CHECK_LE(num_tasks, num_threads());
+  if (num_tasks == 0) {
+    return true;
+  }
+  if (num_tasks > 1) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      task_ = &task;
+      num_tasks_ = num_tasks;
+      pending_tasks_ = num_tasks - 1;
+      failed_ = false;
+      run_id_++;
+    }
+    cond_.notify_all();
+  }
+  const bool success = task(0);
+  if (num_tasks == 1) {
+    return success;
+  }
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this] { return pending_tasks_ == 0; });
+  task_ = nullptr;
+  return success && !failed_;
+}
+
+void ForkJoinPool::WorkerLoop(size_t worker) {
+  uint64_t last_run_id = 0;
+  while (true) {
+    const std::function<bool(size_t)>* task = nullptr;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [&] { return stopping_ || run_id_ != last_run_id; });
+      if (stopping_) {
+        return;
+      }
+      last_run_id = run_id_;
+      if (worker >= num_tasks_) {
+        continue;
+      }
+      task = task_;
+    }
+    const bool success = (*task)(worker);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      failed_ |= !success;
+      pending_tasks_--;
+    }
+    cond_.notify_all();
+  }
+}
+
+}  // namespace chromeos_update_engine
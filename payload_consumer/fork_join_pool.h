@@ -0,0 +1,69 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_FORK_JOIN_POOL_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_FORK_JOIN_POOL_H_
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// A fixed set of threads for splitting CPU bound work into a few slices and
+// waiting for all of them, many times over. The threads are kept around
+// between calls to Run(), as starting them each time would cost about as much
+// as the slices of work themselves.
+class ForkJoinPool {
+ public:
+  // |num_threads| includes the calling thread.
+  explicit ForkJoinPool(size_t num_threads);
+  ~ForkJoinPool();
+
+  size_t num_threads() const { return workers_.size() + 1; }
+
+  // Calls |task| once with each of 0 to |num_tasks| - 1, each on a different
+  // thread, task 0 being run on the calling thread. Returns once all of them
+  // are done, and whether they all returned true. |num_tasks| must be at most
+  // num_threads().
+  bool Run(size_t num_tasks, const std::function<bool(size_t)>& task);
+
+ private:
+  void WorkerLoop(size_t worker);
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  // The task of the current call to Run().
+  const std::function<bool(size_t)>* task_{nullptr};
+  size_t num_tasks_{0};
+  // Incremented for each call to Run().
+  uint64_t run_id_{0};
+  // Number of tasks of the current call not finished yet.
+  size_t pending_tasks_{0};
+  bool failed_{false};
+  bool stopping_{false};
+  std::vector<std::thread> workers_;
+
+  DISALLOW_COPY_AND_ASSIGN(ForkJoinPool);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_FORK_JOIN_POOL_H_
@@ -0,0 +1,63 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/fork_join_pool.h"
+
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(ForkJoinPoolTest, RunsEveryTaskTest) {
+  ForkJoinPool pool(4);
+  ASSERT_EQ(4u, pool.num_threads());
+  for (size_t num_tasks = 0; num_tasks <= 4; num_tasks++) {
+    std::vector<int> runs(num_tasks, 0);
+    std::vector<std::thread::id> threads(num_tasks);
+    ASSERT_TRUE(pool.Run(num_tasks, [&](size_t task) {
+      runs[task]++;
+      threads[task] = std::this_thread::get_id();
+      return true;
+    }));
+    ASSERT_EQ(std::vector<int>(num_tasks, 1), runs);
+    if (num_tasks > 0) {
+      ASSERT_EQ(std::this_thread::get_id(), threads[0]);
+    }
+  }
+}
+
+TEST(ForkJoinPoolTest, FailureTest) {
+  ForkJoinPool pool(3);
+  ASSERT_FALSE(pool.Run(3, [](size_t task) { return task != 2; }));
+  ASSERT_FALSE(pool.Run(3, [](size_t task) { return task != 0; }));
+  // A failure doesn't carry over to the next run.
+  ASSERT_TRUE(pool.Run(3, [](size_t) { return true; }));
+}
+
+TEST(ForkJoinPoolTest, SingleThreadTest) {
+  ForkJoinPool pool(1);
+  ASSERT_EQ(1u, pool.num_threads());
+  bool ran = false;
+  ASSERT_TRUE(pool.Run(1, [&](size_t) {
+    ran = true;
+    return true;
+  }));
+  ASSERT_TRUE(ran);
+}
+
+}  // namespace chromeos_update_engine
@@ -20,7 +20,10 @@
 #include <glob.h>
 #include <linux/fs.h>
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -29,8 +32,10 @@
 #include <bsdiff/bspatch.h>
 #include <puffin/brotli_util.h>
 #include <puffin/puffpatch.h>
+#include <zucchini/crc32.h>
 #include <zucchini/patch_reader.h>
 #include <zucchini/zucchini.h>
+#include <zucchini/zucchini_apply.h>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/lz4diff/lz4patch.h"
@@ -41,7 +46,10 @@
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/operation_stats.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/xz_extent_writer.h"
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -108,9 +116,14 @@ class BsdiffExtentFile : public bsdiff::FileInterface {
 // into |target_fd_|.
 class PuffinExtentStream : public puffin::StreamInterface {
  public:
-  // Constructor for creating a stream for reading from an |ExtentReader|.
-  PuffinExtentStream(std::unique_ptr<ExtentReader> reader, uint64_t size)
-      : PuffinExtentStream(std::move(reader), nullptr, size) {}
+  // Constructor for creating a stream for reading from an |ExtentReader|. The
+  // bytes read are added to |bytes_read| if not null.
+  PuffinExtentStream(std::unique_ptr<ExtentReader> reader,
+                     uint64_t size,
+                     uint64_t* bytes_read = nullptr)
+      : PuffinExtentStream(std::move(reader), nullptr, size) {
+    bytes_read_ = bytes_read;
+  }
 
   // Constructor for creating a stream for writing to an |ExtentWriter|.
   PuffinExtentStream(std::unique_ptr<ExtentWriter> writer, uint64_t size)
@@ -144,6 +157,9 @@ class PuffinExtentStream : public puffin::StreamInterface {
     TEST_AND_RETURN_FALSE(is_read_);
     TEST_AND_RETURN_FALSE(reader_->Read(buffer, count));
     offset_ += count;
+    if (bytes_read_) {
+      *bytes_read_ += count;
+    }
     return true;
   }
 
@@ -171,27 +187,155 @@ class PuffinExtentStream : public puffin::StreamInterface {
   uint64_t size_;
   uint64_t offset_;
   bool is_read_;
+  uint64_t* bytes_read_{nullptr};
 
   DISALLOW_COPY_AND_ASSIGN(PuffinExtentStream);
 };
 
+// Gives the source data of an operation read once into a buffer from the
+// pools of the executor, and gives the buffer back when done.
+class BufferedExtentReader : public ExtentReader {
+ public:
+  explicit BufferedExtentReader(BufferPool::Buffer buffer)
+      : buffer_(std::move(buffer)) {}
+  ~BufferedExtentReader() override = default;
+
+  bool Init(FileDescriptorPtr /* fd */,
+            const google::protobuf::RepeatedPtrField<Extent>& /* extents */,
+            uint32_t /* block_size */) override {
+    LOG(ERROR) << "The data of a BufferedExtentReader is given on creation.";
+    return false;
+  }
+
+  bool Seek(uint64_t offset) override {
+    TEST_AND_RETURN_FALSE(offset <= buffer_->size());
+    offset_ = offset;
+    return true;
+  }
+
+  bool Read(void* buffer, size_t count) override {
+    TEST_AND_RETURN_FALSE(count <= buffer_->size() - offset_);
+    std::copy_n(
+        buffer_->data() + offset_, count, static_cast<uint8_t*>(buffer));
+    offset_ += count;
+    return true;
+  }
+
+ private:
+  BufferPool::Buffer buffer_;
+  uint64_t offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(BufferedExtentReader);
+};
+
+namespace {
+
+// Does what zucchini::ApplyBuffer() does, but with the elements of the patch,
+// which cover separate regions of the target, patched on the threads of
+// |pool|.
+bool ApplyZucchiniElements(const zucchini::EnsemblePatchReader& patch_reader,
+                           zucchini::ConstBufferView old_image,
+                           zucchini::MutableBufferView new_image,
+                           ForkJoinPool* pool) {
+  TEST_AND_RETURN_FALSE(patch_reader.CheckOldFile(old_image));
+  TEST_AND_RETURN_FALSE(patch_reader.CheckNewFile(new_image));
+  const auto& elements = patch_reader.elements();
+  for (const auto& element : elements) {
+    const zucchini::ElementMatch match = element.element_match();
+    TEST_AND_RETURN_FALSE(match.old_element.FitsIn(old_image.size()));
+    TEST_AND_RETURN_FALSE(match.new_element.FitsIn(new_image.size()));
+  }
+  // Elements are handed out one at a time, as their sizes vary a lot.
+  std::atomic<size_t> next_element{0};
+  TEST_AND_RETURN_FALSE(pool->Run(
+      std::min(elements.size(), pool->num_threads()),
+      [&](size_t /* task */) {
+        for (size_t i = next_element++; i < elements.size();
+             i = next_element++) {
+          const zucchini::ElementMatch match = elements[i].element_match();
+          if (!zucchini::ApplyElement(match.exe_type(),
+                                      old_image[match.old_element.region()],
+                                      elements[i],
+                                      new_image[match.new_element.region()])) {
+            LOG(ERROR) << "Failed to apply element " << i
+                       << " of the zucchini patch.";
+            return false;
+          }
+        }
+        return true;
+      }));
+  if (zucchini::CalculateCrc32(new_image.begin(), new_image.end()) !=
+      patch_reader.header().new_crc) {
+    LOG(ERROR) << "The zucchini patch gave a target with the wrong CRC.";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
 bool InstallOperationExecutor::ExecuteReplaceOperation(
     const InstallOperation& operation,
     std::unique_ptr<ExtentWriter> writer,
     const void* data) {
-  TEST_AND_RETURN_FALSE(operation.type() == InstallOperation::REPLACE ||
-                        operation.type() == InstallOperation::REPLACE_BZ ||
-                        operation.type() == InstallOperation::REPLACE_XZ);
+  if ((operation.type() == InstallOperation::REPLACE_BZ ||
+       operation.type() == InstallOperation::REPLACE_XZ) &&
+      operation.data_length() >= kMinParallelDecompressSize) {
+    if (decompress_pool_ == nullptr) {
+      decompress_pool_ = std::make_unique<ForkJoinPool>(std::clamp<size_t>(
+          std::thread::hardware_concurrency(), 1, kMaxDecompressThreads));
+    }
+    const size_t max_output_size =
+        utils::BlocksInExtents(operation.dst_extents()) * block_size_;
+    const auto decompress_blocks =
+        operation.type() == InstallOperation::REPLACE_BZ ? BzipDecompressBlocks
+                                                         : XzDecompressBlocks;
+    std::vector<brillo::Blob> blocks;
+    // Falls back to decompressing the stream in one go if it can't be split.
+    if (decompress_blocks(data,
+                          operation.data_length(),
+                          max_output_size,
+                          decompress_pool_.get(),
+                          &blocks)) {
+      TEST_AND_RETURN_FALSE(writer->Init(operation.dst_extents(), block_size_));
+      for (const brillo::Blob& block : blocks) {
+        TEST_AND_RETURN_FALSE(writer->Write(block.data(), block.size()));
+      }
+      return true;
+    }
+  }
+  writer = CreateReplaceExtentWriter(operation, std::move(writer));
+  TEST_AND_RETURN_FALSE(writer != nullptr);
+  TEST_AND_RETURN_FALSE(writer->Write(data, operation.data_length()));
+
+  return true;
+}
+
+std::unique_ptr<ExtentWriter>
+InstallOperationExecutor::CreateReplaceExtentWriter(
+    const InstallOperation& operation, std::unique_ptr<ExtentWriter> writer) {
+  if (operation.type() != InstallOperation::REPLACE &&
+      operation.type() != InstallOperation::REPLACE_BZ &&
+      operation.type() != InstallOperation::REPLACE_XZ &&
+      operation.type() != InstallOperation::REPLACE_ZSTD) {
+    LOG(ERROR) << "Not a replace operation: "
+               << InstallOperationTypeName(operation.type());
+    return nullptr;
+  }
   // Setup the ExtentWriter stack based on the operation type.
   if (operation.type() == InstallOperation::REPLACE_BZ) {
     writer.reset(new BzipExtentWriter(std::move(writer)));
   } else if (operation.type() == InstallOperation::REPLACE_XZ) {
     writer.reset(new XzExtentWriter(std::move(writer)));
+  } else if (operation.type() == InstallOperation::REPLACE_ZSTD) {
+    writer.reset(new ZstdExtentWriter(std::move(writer)));
   }
-  TEST_AND_RETURN_FALSE(writer->Init(operation.dst_extents(), block_size_));
-  TEST_AND_RETURN_FALSE(writer->Write(data, operation.data_length()));
-
-  return true;
+  if (!writer->Init(operation.dst_extents(), block_size_)) {
+    LOG(ERROR) << "Failed to initialize the writer of "
+               << InstallOperationTypeName(operation.type()) << " operation";
+    return nullptr;
+  }
+  return writer;
 }
 
 bool InstallOperationExecutor::ExecuteZeroOrDiscardOperation(
@@ -266,12 +410,10 @@ bool InstallOperationExecutor::ExecuteLz4diffOperation(
     FileDescriptorPtr source_fd,
     const void* data,
     size_t count) {
-  brillo::Blob src_data;
-
-  TEST_AND_RETURN_FALSE(utils::ReadExtents(
-      source_fd, operation.src_extents(), &src_data, block_size_));
+  BufferPool::Buffer src_data;
+  TEST_AND_RETURN_FALSE(ReadSourceData(operation, source_fd, &src_data));
   TEST_AND_RETURN_FALSE(Lz4Patch(
-      ToStringView(src_data),
+      ToStringView(*src_data),
       ToStringView(data, count),
       [writer(writer.get())](const uint8_t* data, size_t size) -> size_t {
         if (!writer->Write(data, size)) {
@@ -288,9 +430,8 @@ bool InstallOperationExecutor::ExecuteSourceBsdiffOperation(
     FileDescriptorPtr source_fd,
     const void* data,
     size_t count) {
-  auto reader = std::make_unique<DirectExtentReader>();
-  TEST_AND_RETURN_FALSE(
-      reader->Init(source_fd, operation.src_extents(), block_size_));
+  auto reader = CreateSourceReader(operation, source_fd);
+  TEST_AND_RETURN_FALSE(reader != nullptr);
   auto src_file = std::make_unique<BsdiffExtentFile>(
       std::move(reader),
       utils::BlocksInExtents(operation.src_extents()) * block_size_);
@@ -312,24 +453,29 @@ bool InstallOperationExecutor::ExecutePuffDiffOperation(
     FileDescriptorPtr source_fd,
     const void* data,
     size_t count) {
-  auto reader = std::make_unique<DirectExtentReader>();
-  TEST_AND_RETURN_FALSE(
-      reader->Init(source_fd, operation.src_extents(), block_size_));
-  puffin::UniqueStreamPtr src_stream(new PuffinExtentStream(
-      std::move(reader),
-      utils::BlocksInExtents(operation.src_extents()) * block_size_));
+  auto reader = CreateSourceReader(operation, source_fd);
+  TEST_AND_RETURN_FALSE(reader != nullptr);
+  const uint64_t src_size =
+      utils::BlocksInExtents(operation.src_extents()) * block_size_;
+  uint64_t src_bytes_read = 0;
+  puffin::UniqueStreamPtr src_stream(
+      new PuffinExtentStream(std::move(reader), src_size, &src_bytes_read));
 
   puffin::UniqueStreamPtr dst_stream(new PuffinExtentStream(
       std::move(writer),
       utils::BlocksInExtents(operation.dst_extents()) * block_size_));
 
-  constexpr size_t kMaxCacheSize = 5 * 1024 * 1024;  // Total 5MB cache.
+  // The puffed deflate streams the cache holds take up to about twice their
+  // compressed size, so a source never needs more than that.
+  const size_t cache_size =
+      std::min<uint64_t>(puffpatch_cache_budget_, 2 * src_size);
   TEST_AND_RETURN_FALSE(
       puffin::PuffPatch(std::move(src_stream),
                         std::move(dst_stream),
                         reinterpret_cast<const uint8_t*>(data),
                         count,
-                        kMaxCacheSize));
+                        cache_size));
+  AddOperationSourceRead(src_size, src_bytes_read);
   return true;
 }
 
@@ -339,23 +485,18 @@ bool InstallOperationExecutor::ExecuteZucchiniOperation(
     FileDescriptorPtr source_fd,
     const void* data,
     size_t count) {
-  uint64_t src_size =
-      utils::BlocksInExtents(operation.src_extents()) * block_size_;
-  brillo::Blob source_bytes(src_size);
-
   // TODO(197361113) either make zucchini stream the read, or use memory mapped
   // files.
-  auto reader = std::make_unique<DirectExtentReader>();
-  TEST_AND_RETURN_FALSE(
-      reader->Init(source_fd, operation.src_extents(), block_size_));
-  TEST_AND_RETURN_FALSE(reader->Seek(0));
-  TEST_AND_RETURN_FALSE(reader->Read(source_bytes.data(), src_size));
+  BufferPool::Buffer source_bytes;
+  TEST_AND_RETURN_FALSE(ReadSourceData(operation, source_fd, &source_bytes));
 
-  brillo::Blob zucchini_patch;
+  // The patch is at least as large as its compressed data.
+  BufferPool::Buffer zucchini_patch = buffer_pool_.Acquire(count);
+  zucchini_patch->clear();
   TEST_AND_RETURN_FALSE(puffin::BrotliDecode(
-      static_cast<const uint8_t*>(data), count, &zucchini_patch));
+      static_cast<const uint8_t*>(data), count, zucchini_patch.get()));
   auto patch_reader = zucchini::EnsemblePatchReader::Create(
-      {zucchini_patch.data(), zucchini_patch.size()});
+      {zucchini_patch->data(), zucchini_patch->size()});
   if (!patch_reader.has_value()) {
     LOG(ERROR) << "Failed to parse the zucchini patch.";
     return false;
@@ -366,19 +507,60 @@ bool InstallOperationExecutor::ExecuteZucchiniOperation(
                         utils::BlocksInExtents(operation.dst_extents()) *
                             block_size_);
 
-  brillo::Blob patched_data(dst_size);
-  auto status =
-      zucchini::ApplyBuffer({source_bytes.data(), source_bytes.size()},
-                            *patch_reader,
-                            {patched_data.data(), patched_data.size()});
-  if (status != zucchini::status::kStatusSuccess) {
-    LOG(ERROR) << "Failed to apply the zucchini patch: " << status;
-    return false;
+  BufferPool::Buffer patched_data = buffer_pool_.Acquire(dst_size);
+  const zucchini::ConstBufferView old_image(source_bytes->data(),
+                                            source_bytes->size());
+  const zucchini::MutableBufferView new_image(patched_data->data(),
+                                              patched_data->size());
+  if (patch_reader->elements().size() > 1) {
+    if (zucchini_pool_ == nullptr) {
+      zucchini_pool_ = std::make_unique<ForkJoinPool>(std::clamp<size_t>(
+          std::thread::hardware_concurrency(), 1, kMaxZucchiniThreads));
+    }
+    TEST_AND_RETURN_FALSE(ApplyZucchiniElements(
+        *patch_reader, old_image, new_image, zucchini_pool_.get()));
+  } else {
+    auto status = zucchini::ApplyBuffer(old_image, *patch_reader, new_image);
+    if (status != zucchini::status::kStatusSuccess) {
+      LOG(ERROR) << "Failed to apply the zucchini patch: " << status;
+      return false;
+    }
   }
 
   TEST_AND_RETURN_FALSE(
-      writer->Write(patched_data.data(), patched_data.size()));
+      writer->Write(patched_data->data(), patched_data->size()));
   return true;
 }
 
+std::unique_ptr<ExtentReader> InstallOperationExecutor::CreateSourceReader(
+    const InstallOperation& operation, FileDescriptorPtr source_fd) {
+  if (utils::BlocksInExtents(operation.src_extents()) * block_size_ <=
+      kMaxBufferedSourceSize) {
+    BufferPool::Buffer buffer;
+    if (!ReadSourceData(operation, source_fd, &buffer)) {
+      return nullptr;
+    }
+    return std::make_unique<BufferedExtentReader>(std::move(buffer));
+  }
+  auto reader = std::make_unique<ReadAheadExtentReader>(kSourceReadAheadSize);
+  if (!reader->Init(source_fd, operation.src_extents(), block_size_)) {
+    return nullptr;
+  }
+  return reader;
+}
+
+bool InstallOperationExecutor::ReadSourceData(const InstallOperation& operation,
+                                              FileDescriptorPtr source_fd,
+                                              BufferPool::Buffer* buffer) {
+  ScopedOperationPhase source_read_phase(OperationPhase::kSourceRead);
+  const uint64_t src_size =
+      utils::BlocksInExtents(operation.src_extents()) * block_size_;
+  *buffer = buffer_pool_.Acquire(src_size);
+  DirectExtentReader reader;
+  TEST_AND_RETURN_FALSE(
+      reader.Init(source_fd, operation.src_extents(), block_size_));
+  TEST_AND_RETURN_FALSE(reader.Seek(0));
+  return reader.Read((*buffer)->data(), src_size);
+}
+
 }  // namespace chromeos_update_engine
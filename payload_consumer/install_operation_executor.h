@@ -19,21 +19,59 @@
 
 #include <memory>
 
+#include "update_engine/payload_consumer/buffer_pool.h"
+#include "update_engine/payload_consumer/extent_reader.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/fork_join_pool.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
 
 class InstallOperationExecutor {
  public:
+  // Buffers kept for the next operations once an operation is done with
+  // them, and how much memory they may hold.
+  static constexpr size_t kMaxPooledBuffers = 4;
+  static constexpr size_t kMaxPooledBytes = 64 * 1024 * 1024;
+  // Sources of bsdiff and puffdiff operations up to this size are read at once
+  // into a pooled buffer, for the many small reads of the patchers to be
+  // served from memory. Larger ones are read as they are patched, through a
+  // read ahead window of kSourceReadAheadSize bytes, which bounds the memory
+  // taken per operation.
+  static constexpr size_t kMaxBufferedSourceSize = 4 * 1024 * 1024;
+  static constexpr size_t kSourceReadAheadSize = 1024 * 1024;
+  // The elements of a zucchini patch are applied on up to this many threads.
+  static constexpr size_t kMaxZucchiniThreads = 4;
+  // The blocks of the data of REPLACE_BZ and REPLACE_XZ operations of at least
+  // this size are decoded on up to this many threads.
+  static constexpr size_t kMinParallelDecompressSize = 256 * 1024;
+  static constexpr size_t kMaxDecompressThreads = 4;
+
+  // How much memory puffpatch may use to cache the source of an operation,
+  // unless set otherwise.
+  static constexpr size_t kDefaultPuffpatchCacheBudget = 5 * 1024 * 1024;
+
   explicit InstallOperationExecutor(size_t block_size)
-      : block_size_(block_size) {}
+      : block_size_(block_size),
+        buffer_pool_(kMaxPooledBuffers, kMaxPooledBytes) {}
+
+  // Sets the most memory puffpatch may use to cache the source of a PUFFDIFF
+  // operation. Operations whose source needs less are given less.
+  void SetPuffpatchCacheBudget(size_t bytes) {
+    puffpatch_cache_budget_ = bytes;
+  }
 
   // data should point to the memory of operation.data_length() bytes
   bool ExecuteReplaceOperation(const InstallOperation& operation,
                                std::unique_ptr<ExtentWriter> writer,
                                const void* data);
+  // Returns |writer| set up to decompress the data of the REPLACE, REPLACE_BZ,
+  // REPLACE_XZ or REPLACE_ZSTD |operation| to its destination extents. The
+  // data can then be passed in as many Write() calls as needed. Returns nullptr
+  // on failure.
+  std::unique_ptr<ExtentWriter> CreateReplaceExtentWriter(
+      const InstallOperation& operation, std::unique_ptr<ExtentWriter> writer);
   bool ExecuteZeroOrDiscardOperation(const InstallOperation& operation,
                                      std::unique_ptr<ExtentWriter> writer);
   bool ExecuteSourceCopyOperation(const InstallOperation& operation,
@@ -67,8 +105,27 @@ class InstallOperationExecutor {
                                FileDescriptorPtr source_fd,
                                const void* data,
                                size_t count);
+  // Returns a reader of the source extents of |operation|, from a buffer of
+  // |buffer_pool_| if small enough. Returns nullptr on failure.
+  std::unique_ptr<ExtentReader> CreateSourceReader(
+      const InstallOperation& operation, FileDescriptorPtr source_fd);
+  // Reads the source extents of |operation| into a buffer from
+  // |buffer_pool_|.
+  bool ReadSourceData(const InstallOperation& operation,
+                      FileDescriptorPtr source_fd,
+                      BufferPool::Buffer* buffer);
 
   size_t block_size_;
+  size_t puffpatch_cache_budget_{kDefaultPuffpatchCacheBudget};
+  // Memory for the source data, patches and outputs of the operations that
+  // work on whole buffers, and for the small sources of bspatch and
+  // puffpatch, which stream to the target.
+  BufferPool buffer_pool_;
+  // Created with the first zucchini patch with several elements.
+  std::unique_ptr<ForkJoinPool> zucchini_pool_;
+  // Created with the first compressed data large enough to be decoded on
+  // several threads.
+  std::unique_ptr<ForkJoinPool> decompress_pool_;
 };
 
 }  // namespace chromeos_update_engine
@@ -268,6 +268,51 @@ TEST_F(InstallOperationExecutorTest, ZucchiniOpTest) {
   ASSERT_EQ(target_data_, patched_data);
 }
 
+TEST_F(InstallOperationExecutorTest, SourceBsdiffOpTest) {
+  std::vector<Extent> src_extents{ExtentForRange(0, NUM_BLOCKS)};
+  std::vector<Extent> dst_extents{ExtentForRange(0, NUM_BLOCKS)};
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kSourceMinorPayloadVersion)};
+  const FilesystemInterface::File empty;
+  diff_utils::BestDiffGenerator best_diff_generator(source_data_,
+                                                    target_data_,
+                                                    src_extents,
+                                                    dst_extents,
+                                                    empty,
+                                                    empty,
+                                                    config);
+  std::vector<uint8_t> patch_data = target_data_;  // Fake the full operation
+  AnnotatedOperation aop;
+  ASSERT_TRUE(best_diff_generator.GenerateBestDiffOperation(
+      {{InstallOperation::SOURCE_BSDIFF, 1024 * BLOCK_SIZE}},
+      &aop,
+      &patch_data));
+  ASSERT_EQ(InstallOperation::SOURCE_BSDIFF, aop.op.type());
+  InstallOperation op;
+  op.set_type(InstallOperation::SOURCE_BSDIFF);
+  *op.mutable_src_extents()->Add() = ExtentForRange(0, NUM_BLOCKS);
+  *op.mutable_dst_extents()->Add() = ExtentForRange(0, NUM_BLOCKS);
+
+  // Applied twice, the second time from the source buffer of the first.
+  for (int i = 0; i < 2; i++) {
+    ScopedTempFile patched{"patched.XXXXXXXX", true};
+    FileDescriptorPtr patched_fd = std::make_shared<EintrSafeFileDescriptor>();
+    patched_fd->Open(patched.path().c_str(), O_RDWR);
+    std::unique_ptr<ExtentWriter> writer(new DirectExtentWriter(patched_fd));
+    writer->Init(op.dst_extents(), BLOCK_SIZE);
+    ASSERT_TRUE(executor_.ExecuteDiffOperation(op,
+                                               std::move(writer),
+                                               source_fd_,
+                                               patch_data.data(),
+                                               patch_data.size()));
+
+    std::vector<uint8_t> patched_data;
+    ASSERT_TRUE(utils::ReadFile(patched.path(), &patched_data));
+    ASSERT_EQ(target_data_, patched_data);
+  }
+}
+
 TEST_F(InstallOperationExecutorTest, GetNthBlockTest) {
   std::vector<Extent> extents;
   extents.emplace_back(ExtentForRange(10, 3));
@@ -0,0 +1,241 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/install_operation_pipeline.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Bounds the number of queued operations, as operations without a data blob
+// don't count against the byte budget.
+constexpr size_t kMaxOperationsInFlight = 1024;
+
+bool Conflicts(const std::vector<Extent>& a, const std::vector<Extent>& b) {
+  if (a.empty() || b.empty()) {
+    return true;
+  }
+  for (const auto& extent_a : a) {
+    for (const auto& extent_b : b) {
+      if (ExtentRanges::ExtentsOverlap(extent_a, extent_b)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+}  // namespace
+
+InstallOperationPipeline::InstallOperationPipeline(size_t max_bytes_in_flight,
+                                                   size_t num_apply_workers)
+    : max_bytes_in_flight_(max_bytes_in_flight) {
+  num_apply_workers = std::max<size_t>(num_apply_workers, 1);
+  num_active_workers_ = num_apply_workers;
+  busy_dst_extents_.resize(num_apply_workers, nullptr);
+  verify_thread_ = std::thread(&InstallOperationPipeline::VerifyLoop, this);
+  for (size_t i = 0; i < num_apply_workers; i++) {
+    apply_threads_.emplace_back(&InstallOperationPipeline::ApplyLoop, this, i);
+  }
+}
+
+InstallOperationPipeline::~InstallOperationPipeline() {
+  Drain();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  verify_thread_.join();
+  for (auto& thread : apply_threads_) {
+    thread.join();
+  }
+}
+
+bool InstallOperationPipeline::Submit(size_t op_index,
+                                      brillo::Blob data,
+                                      std::vector<Extent> dst_extents,
+                                      Step verify,
+                                      ApplyStep apply) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this, &data] {
+    return error_ != ErrorCode::kSuccess || tasks_in_flight_ == 0 ||
+           (tasks_in_flight_ < kMaxOperationsInFlight &&
+            bytes_in_flight_ + data.size() <= max_bytes_in_flight_);
+  });
+  if (error_ != ErrorCode::kSuccess) {
+    return false;
+  }
+  tasks_in_flight_++;
+  bytes_in_flight_ += data.size();
+  verify_queue_.push_back({op_index,
+                           std::move(data),
+                           std::move(dst_extents),
+                           std::move(verify),
+                           std::move(apply)});
+  lock.unlock();
+  cond_.notify_all();
+  return true;
+}
+
+ErrorCode InstallOperationPipeline::Drain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait(lock, [this] { return tasks_in_flight_ == 0; });
+  return error_;
+}
+
+ErrorCode InstallOperationPipeline::error() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return error_;
+}
+
+size_t InstallOperationPipeline::bytes_in_flight() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return bytes_in_flight_;
+}
+
+void InstallOperationPipeline::SetLimits(size_t max_bytes_in_flight,
+                                         size_t num_active_workers) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    max_bytes_in_flight_ = max_bytes_in_flight;
+    num_active_workers_ =
+        std::clamp<size_t>(num_active_workers, 1, apply_threads_.size());
+  }
+  // A higher budget or more workers may let operations go on.
+  cond_.notify_all();
+}
+
+size_t InstallOperationPipeline::failed_op_index() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return failed_op_index_;
+}
+
+void InstallOperationPipeline::RunStep(const std::function<ErrorCode()>& step,
+                                       const Task& task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (IsDroppedLocked(task)) {
+      return;
+    }
+  }
+  const ErrorCode result = step();
+  if (result == ErrorCode::kSuccess) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Keep the error of the earliest failing operation, which is the one the
+  // synchronous path would have reported.
+  if (error_ == ErrorCode::kSuccess || task.op_index < failed_op_index_) {
+    error_ = result;
+    failed_op_index_ = task.op_index;
+  }
+}
+
+bool InstallOperationPipeline::IsDroppedLocked(const Task& task) const {
+  return error_ != ErrorCode::kSuccess && task.op_index >= failed_op_index_;
+}
+
+void InstallOperationPipeline::ReleaseLocked(const Task& task) {
+  CHECK_GT(tasks_in_flight_, 0u);
+  CHECK_GE(bytes_in_flight_, task.data.size());
+  tasks_in_flight_--;
+  bytes_in_flight_ -= task.data.size();
+}
+
+void InstallOperationPipeline::VerifyLoop() {
+  while (true) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this] { return stopping_ || !verify_queue_.empty(); });
+      if (verify_queue_.empty()) {
+        return;
+      }
+      task = std::move(verify_queue_.front());
+      verify_queue_.pop_front();
+    }
+    RunStep([&task] { return task.verify(task.data); }, task);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (IsDroppedLocked(task)) {
+        // Nothing from the failed operation onwards gets applied.
+        ReleaseLocked(task);
+      } else {
+        apply_queue_.push_back(std::move(task));
+      }
+    }
+    cond_.notify_all();
+  }
+}
+
+std::deque<InstallOperationPipeline::Task>::iterator
+InstallOperationPipeline::PickApplyTaskLocked() {
+  for (auto it = apply_queue_.begin(); it != apply_queue_.end(); ++it) {
+    if (IsDroppedLocked(*it)) {
+      // Never runs, so it can't conflict with anything.
+      return it;
+    }
+    const bool blocked =
+        std::any_of(busy_dst_extents_.begin(),
+                    busy_dst_extents_.end(),
+                    [&it](const std::vector<Extent>* busy) {
+                      return busy && Conflicts(*busy, it->dst_extents);
+                    }) ||
+        std::any_of(apply_queue_.begin(), it, [&it](const Task& earlier) {
+          return Conflicts(earlier.dst_extents, it->dst_extents);
+        });
+    if (!blocked) {
+      return it;
+    }
+  }
+  return apply_queue_.end();
+}
+
+void InstallOperationPipeline::ApplyLoop(size_t worker) {
+  while (true) {
+    Task task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      auto it = apply_queue_.end();
+      cond_.wait(lock, [this, &it, worker] {
+        it = worker < num_active_workers_ ? PickApplyTaskLocked()
+                                          : apply_queue_.end();
+        return stopping_ || it != apply_queue_.end();
+      });
+      if (it == apply_queue_.end()) {
+        return;
+      }
+      task = std::move(*it);
+      apply_queue_.erase(it);
+      busy_dst_extents_[worker] = &task.dst_extents;
+    }
+    RunStep([&task, worker] { return task.apply(task.data, worker); }, task);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      busy_dst_extents_[worker] = nullptr;
+      ReleaseLocked(task);
+    }
+    cond_.notify_all();
+  }
+}
+
+}  // namespace chromeos_update_engine
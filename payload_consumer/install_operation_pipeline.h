@@ -0,0 +1,149 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_OPERATION_PIPELINE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_OPERATION_PIPELINE_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/error_code.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// A bounded two stage pipeline used by DeltaPerformer to apply install
+// operations off the download thread. Every submitted operation first runs
+// its |verify| step on the verify thread, then its |apply| step on one of the
+// apply workers, while the caller is free to keep receiving payload data.
+//
+// Verification runs in submission order. The apply workers pick the earliest
+// queued operation whose destination extents overlap neither an operation
+// being applied nor one queued before it, so operations writing the same
+// blocks are still applied in submission order. An operation submitted
+// without destination extents conflicts with everything; with a single apply
+// worker, or with such operations only, the partition writer observes the
+// same sequence of calls as in the synchronous path.
+//
+// The first failing step latches its error code; operations queued before it
+// still run, all operations queued after it are dropped without running, and
+// Submit()/Drain() report the error.
+class InstallOperationPipeline {
+ public:
+  using Step = std::function<ErrorCode(const brillo::Blob& data)>;
+  // |worker| is the index, below num_apply_workers(), of the apply worker
+  // running the step. No two steps run on the same worker at once.
+  using ApplyStep =
+      std::function<ErrorCode(const brillo::Blob& data, size_t worker)>;
+
+  // |max_bytes_in_flight| bounds the total size of the data blobs held by
+  // queued operations. An operation larger than the bound is still admitted
+  // once the pipeline is empty.
+  InstallOperationPipeline(size_t max_bytes_in_flight,
+                           size_t num_apply_workers = 1);
+  ~InstallOperationPipeline();
+
+  // Queues operation |op_index| with its data blob and the extents it writes
+  // to. Blocks while the pipeline is over budget. Returns false if an earlier
+  // operation already failed, in which case nothing is queued.
+  bool Submit(size_t op_index,
+              brillo::Blob data,
+              std::vector<Extent> dst_extents,
+              Step verify,
+              ApplyStep apply);
+
+  // Blocks until every queued operation has either run or been dropped, and
+  // returns the latched error code, or kSuccess.
+  ErrorCode Drain();
+
+  // Returns the latched error code without waiting.
+  ErrorCode error() const;
+
+  // Returns the total size of the data blobs held by queued operations.
+  size_t bytes_in_flight() const;
+
+  // Index of the operation which failed first. Only meaningful when error()
+  // is not kSuccess.
+  size_t failed_op_index() const;
+
+  size_t num_apply_workers() const { return apply_threads_.size(); }
+
+  // Changes the bound on the bytes held by queued operations, and the number
+  // of apply workers picking operations, at least one and at most
+  // num_apply_workers(). The operations already queued or running are left
+  // alone, a lower bound only delays the following Submit() calls.
+  void SetLimits(size_t max_bytes_in_flight, size_t num_active_workers);
+
+ private:
+  struct Task {
+    size_t op_index;
+    brillo::Blob data;
+    std::vector<Extent> dst_extents;
+    Step verify;
+    ApplyStep apply;
+  };
+
+  void VerifyLoop();
+  void ApplyLoop(size_t worker);
+
+  // Runs |step| on |task| unless the pipeline already failed. Must be called
+  // without |mutex_| held.
+  void RunStep(const std::function<ErrorCode()>& step, const Task& task);
+
+  // Returns the first task in |apply_queue_| which may start now, or
+  // |apply_queue_.end()|. Must be called with |mutex_| held.
+  std::deque<Task>::iterator PickApplyTaskLocked();
+
+  // Whether |task| comes at or after the failed operation and must not run.
+  // Must be called with |mutex_| held.
+  bool IsDroppedLocked(const Task& task) const;
+
+  // Releases the budget held by |task|. Must be called with |mutex_| held.
+  void ReleaseLocked(const Task& task);
+
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  size_t max_bytes_in_flight_;
+  // The apply workers with an index below this pick operations, the others
+  // stay idle.
+  size_t num_active_workers_;
+  std::deque<Task> verify_queue_;
+  std::deque<Task> apply_queue_;
+  // Destination extents of the task each apply worker is running, if any.
+  std::vector<const std::vector<Extent>*> busy_dst_extents_;
+  // Number of operations submitted but not yet fully retired.
+  size_t tasks_in_flight_{0};
+  size_t bytes_in_flight_{0};
+  bool stopping_{false};
+  ErrorCode error_{ErrorCode::kSuccess};
+  size_t failed_op_index_{0};
+
+  std::thread verify_thread_;
+  std::vector<std::thread> apply_threads_;
+
+  DISALLOW_COPY_AND_ASSIGN(InstallOperationPipeline);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_OPERATION_PIPELINE_H_
@@ -0,0 +1,238 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/install_operation_pipeline.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+InstallOperationPipeline::Step Succeed() {
+  return [](const brillo::Blob&) { return ErrorCode::kSuccess; };
+}
+
+std::vector<Extent> Blocks(uint64_t start, uint64_t num) {
+  return {ExtentForRange(start, num)};
+}
+}  // namespace
+
+class InstallOperationPipelineTest : public ::testing::Test {
+ protected:
+  InstallOperationPipeline::ApplyStep Record(size_t op_index) {
+    return [this, op_index](const brillo::Blob&, size_t) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      applied_.push_back(op_index);
+      return ErrorCode::kSuccess;
+    };
+  }
+
+  std::mutex mutex_;
+  std::vector<size_t> applied_;
+};
+
+TEST_F(InstallOperationPipelineTest, AppliesInSubmissionOrderTest) {
+  InstallOperationPipeline pipeline(16);
+  for (size_t i = 0; i < 100; i++) {
+    ASSERT_TRUE(pipeline.Submit(
+        i, brillo::Blob(i % 8, 0), Blocks(i, 1), Succeed(), Record(i)));
+  }
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline.Drain());
+  ASSERT_EQ(100u, applied_.size());
+  for (size_t i = 0; i < applied_.size(); i++) {
+    ASSERT_EQ(i, applied_[i]);
+  }
+}
+
+TEST_F(InstallOperationPipelineTest, PassesDataToStepsTest) {
+  InstallOperationPipeline pipeline(1024);
+  const brillo::Blob data{1, 2, 3, 4};
+  auto check = [&data](const brillo::Blob& received) {
+    return received == data ? ErrorCode::kSuccess
+                            : ErrorCode::kDownloadOperationExecutionError;
+  };
+  ASSERT_TRUE(pipeline.Submit(
+      0,
+      data,
+      Blocks(0, 1),
+      check,
+      [&check](const brillo::Blob& received, size_t) {
+        return check(received);
+      }));
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline.Drain());
+}
+
+TEST_F(InstallOperationPipelineTest, OversizedOperationIsAdmittedTest) {
+  InstallOperationPipeline pipeline(4);
+  ASSERT_TRUE(pipeline.Submit(
+      0, brillo::Blob(64, 0), Blocks(0, 1), Succeed(), Record(0)));
+  ASSERT_TRUE(pipeline.Submit(
+      1, brillo::Blob(64, 0), Blocks(1, 1), Succeed(), Record(1)));
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline.Drain());
+  ASSERT_EQ(std::vector<size_t>({0, 1}), applied_);
+}
+
+TEST_F(InstallOperationPipelineTest, BytesInFlightTest) {
+  InstallOperationPipeline pipeline(1024);
+  // Operation 0 holds the apply worker until released, keeping both queued.
+  std::condition_variable cond;
+  bool released = false;
+  ASSERT_TRUE(pipeline.Submit(0,
+                              brillo::Blob(10, 0),
+                              Blocks(0, 1),
+                              Succeed(),
+                              [&](const brillo::Blob&, size_t) {
+                                std::unique_lock<std::mutex> lock(mutex_);
+                                cond.wait(lock,
+                                          [&released] { return released; });
+                                return ErrorCode::kSuccess;
+                              }));
+  ASSERT_TRUE(pipeline.Submit(
+      1, brillo::Blob(20, 0), Blocks(1, 1), Succeed(), Record(1)));
+  ASSERT_EQ(30u, pipeline.bytes_in_flight());
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    released = true;
+  }
+  cond.notify_all();
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline.Drain());
+  ASSERT_EQ(0u, pipeline.bytes_in_flight());
+}
+
+TEST_F(InstallOperationPipelineTest, VerifyFailureSkipsLaterOperationsTest) {
+  InstallOperationPipeline pipeline(1024);
+  ASSERT_TRUE(pipeline.Submit(0, {}, Blocks(0, 1), Succeed(), Record(0)));
+  ASSERT_TRUE(pipeline.Submit(
+      1,
+      {},
+      Blocks(1, 1),
+      [](const brillo::Blob&) {
+        return ErrorCode::kDownloadOperationHashMismatch;
+      },
+      Record(1)));
+  ASSERT_EQ(ErrorCode::kDownloadOperationHashMismatch, pipeline.Drain());
+  ASSERT_EQ(1u, pipeline.failed_op_index());
+  ASSERT_FALSE(pipeline.Submit(2, {}, Blocks(2, 1), Succeed(), Record(2)));
+  ASSERT_EQ(std::vector<size_t>({0}), applied_);
+}
+
+TEST_F(InstallOperationPipelineTest, ApplyFailureIsStickyTest) {
+  InstallOperationPipeline pipeline(1024);
+  ASSERT_TRUE(pipeline.Submit(
+      0, {}, Blocks(0, 1), Succeed(), [](const brillo::Blob&, size_t) {
+        return ErrorCode::kDownloadOperationExecutionError;
+      }));
+  ASSERT_EQ(ErrorCode::kDownloadOperationExecutionError, pipeline.Drain());
+  ASSERT_EQ(ErrorCode::kDownloadOperationExecutionError, pipeline.error());
+  ASSERT_EQ(0u, pipeline.failed_op_index());
+  ASSERT_FALSE(pipeline.Submit(1, {}, Blocks(1, 1), Succeed(), Record(1)));
+  ASSERT_TRUE(applied_.empty());
+}
+
+TEST_F(InstallOperationPipelineTest, DisjointOperationsRunConcurrentlyTest) {
+  InstallOperationPipeline pipeline(1024, 2);
+  ASSERT_EQ(2u, pipeline.num_apply_workers());
+  // Operation 0 only completes once operation 1 has run, which requires the
+  // two to be applied at the same time on different workers.
+  std::condition_variable cond;
+  bool op1_done = false;
+  std::vector<size_t> workers(2);
+  ASSERT_TRUE(pipeline.Submit(
+      0, {}, Blocks(0, 4), Succeed(), [&](const brillo::Blob&, size_t worker) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond.wait(lock, [&op1_done] { return op1_done; });
+        workers[0] = worker;
+        return ErrorCode::kSuccess;
+      }));
+  ASSERT_TRUE(pipeline.Submit(
+      1, {}, Blocks(4, 4), Succeed(), [&](const brillo::Blob&, size_t worker) {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          op1_done = true;
+          workers[1] = worker;
+        }
+        cond.notify_all();
+        return ErrorCode::kSuccess;
+      }));
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline.Drain());
+  ASSERT_NE(workers[0], workers[1]);
+}
+
+TEST_F(InstallOperationPipelineTest, OverlappingOperationsKeepOrderTest) {
+  InstallOperationPipeline pipeline(1024, 4);
+  for (size_t i = 0; i < 50; i++) {
+    // All operations write block 7.
+    ASSERT_TRUE(
+        pipeline.Submit(i, {}, Blocks(7 - i % 8, 8), Succeed(), Record(i)));
+  }
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline.Drain());
+  ASSERT_EQ(50u, applied_.size());
+  for (size_t i = 0; i < applied_.size(); i++) {
+    ASSERT_EQ(i, applied_[i]);
+  }
+}
+
+TEST_F(InstallOperationPipelineTest, OperationsWithoutExtentsKeepOrderTest) {
+  InstallOperationPipeline pipeline(1024, 4);
+  for (size_t i = 0; i < 50; i++) {
+    ASSERT_TRUE(pipeline.Submit(i, {}, {}, Succeed(), Record(i)));
+  }
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline.Drain());
+  ASSERT_EQ(50u, applied_.size());
+  for (size_t i = 0; i < applied_.size(); i++) {
+    ASSERT_EQ(i, applied_[i]);
+  }
+}
+
+TEST_F(InstallOperationPipelineTest, SetLimitsTest) {
+  InstallOperationPipeline pipeline(1024, 4);
+  pipeline.SetLimits(16, 1);
+  std::vector<size_t> workers;
+  for (size_t i = 0; i < 20; i++) {
+    ASSERT_TRUE(pipeline.Submit(
+        i,
+        brillo::Blob(8, 0),
+        Blocks(i, 1),
+        Succeed(),
+        [this, &workers](const brillo::Blob&, size_t worker) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          workers.push_back(worker);
+          return ErrorCode::kSuccess;
+        }));
+    ASSERT_LE(pipeline.bytes_in_flight(), 16u);
+  }
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline.Drain());
+  ASSERT_EQ(20u, workers.size());
+  for (size_t worker : workers) {
+    ASSERT_EQ(0u, worker);
+  }
+  // Back to all the workers.
+  pipeline.SetLimits(1024, 4);
+  for (size_t i = 0; i < 20; i++) {
+    ASSERT_TRUE(pipeline.Submit(i, {}, Blocks(i, 1), Succeed(), Record(i)));
+  }
+  ASSERT_EQ(ErrorCode::kSuccess, pipeline.Drain());
+  ASSERT_EQ(20u, applied_.size());
+}
+
+}  // namespace chromeos_update_engine
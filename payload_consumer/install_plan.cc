@@ -17,7 +17,9 @@
 #include "update_engine/payload_consumer/install_plan.h"
 
 #include <algorithm>
+#include <string>
 #include <utility>
+#include <vector>
 
 #include <base/format_macros.h>
 #include <base/logging.h>
@@ -26,6 +28,8 @@
 #include <base/strings/stringprintf.h>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/update_metadata.pb.h"
 
 using std::string;
@@ -39,6 +43,44 @@ string PayloadUrlsToString(
   return "(" + base::JoinString(payload_urls, ",") + ")";
 }
 
+// Returns the blocks of the |num_blocks| of |partition| which its operations
+// may change from the source partition: all of them, but those copied in
+// place by SOURCE_COPY operations.
+vector<Extent> GetChangedExtents(const PartitionUpdate& partition,
+                                 uint64_t num_blocks) {
+  ExtentRanges changed;
+  changed.AddExtent(ExtentForRange(0, num_blocks));
+  for (const InstallOperation& op : partition.operations()) {
+    if (op.type() != InstallOperation::SOURCE_COPY)
+      continue;
+    int src = 0;
+    int dst = 0;
+    uint64_t src_used = 0;
+    uint64_t dst_used = 0;
+    while (src < op.src_extents_size() && dst < op.dst_extents_size()) {
+      const Extent& src_extent = op.src_extents(src);
+      const Extent& dst_extent = op.dst_extents(dst);
+      const uint64_t src_start = src_extent.start_block() + src_used;
+      const uint64_t dst_start = dst_extent.start_block() + dst_used;
+      const uint64_t len = std::min(src_extent.num_blocks() - src_used,
+                                    dst_extent.num_blocks() - dst_used);
+      if (src_start == dst_start)
+        changed.SubtractExtent(ExtentForRange(dst_start, len));
+      src_used += len;
+      dst_used += len;
+      if (src_used == src_extent.num_blocks()) {
+        src++;
+        src_used = 0;
+      }
+      if (dst_used == dst_extent.num_blocks()) {
+        dst++;
+        dst_used = 0;
+      }
+    }
+  }
+  return {changed.extent_set().begin(), changed.extent_set().end()};
+}
+
 string VectorToString(const vector<std::pair<string, string>>& input,
                       const string& separator) {
   vector<string> vec;
@@ -151,11 +193,35 @@ string InstallPlan::ToString() const {
 
 bool InstallPlan::LoadPartitionsFromSlots(BootControlInterface* boot_control) {
   bool result = true;
+  if (target_slot != BootControlInterface::kInvalidSlot) {
+    // Map the target partitions all at once instead of one at a time below.
+    std::vector<std::string> target_partitions;
+    for (const Partition& partition : partitions) {
+      if (partition.target_size > 0) {
+        target_partitions.push_back(partition.name);
+      }
+    }
+    auto dynamic_control = boot_control->GetDynamicPartitionControl();
+    LOG_IF(WARNING,
+           !target_partitions.empty() && dynamic_control &&
+               !dynamic_control->MapPartitionsForSlot(
+                   target_partitions, target_slot, source_slot))
+        << "Failed to map the target partitions at once, mapping them one "
+           "by one.";
+  }
   for (Partition& partition : partitions) {
+    partition.source_verity_path.clear();
     if (source_slot != BootControlInterface::kInvalidSlot &&
         partition.source_size > 0) {
       TEST_AND_RETURN_FALSE(boot_control->GetPartitionDevice(
           partition.name, source_slot, &partition.source_path));
+      auto dynamic_control = boot_control->GetDynamicPartitionControl();
+      if (verity_source_reads && dynamic_control &&
+          source_slot == boot_control->GetCurrentSlot() &&
+          !dynamic_control->GetVerityDevicePath(
+              partition.name, &partition.source_verity_path)) {
+        partition.source_verity_path.clear();
+      }
     } else {
       partition.source_path.clear();
     }
@@ -179,11 +245,14 @@ bool InstallPlan::Partition::operator==(
   return (name == that.name && source_path == that.source_path &&
           source_size == that.source_size && source_hash == that.source_hash &&
           target_path == that.target_path && target_size == that.target_size &&
-          target_hash == that.target_hash &&
+          target_hash == that.target_hash && untouched == that.untouched &&
+          hash_algorithm == that.hash_algorithm &&
           run_postinstall == that.run_postinstall &&
           postinstall_path == that.postinstall_path &&
           filesystem_type == that.filesystem_type &&
-          postinstall_optional == that.postinstall_optional);
+          postinstall_optional == that.postinstall_optional &&
+          postinstall_independent == that.postinstall_independent &&
+          postinstall_cache_files == that.postinstall_cache_files);
 }
 
 bool InstallPlan::Partition::ParseVerityConfig(
@@ -205,6 +274,8 @@ bool InstallPlan::Partition::ParseVerityConfig(
     hash_tree_algorithm = partition.hash_tree_algorithm();
     hash_tree_salt.assign(partition.hash_tree_salt().begin(),
                           partition.hash_tree_salt().end());
+    hash_tree_root_digest.assign(partition.hash_tree_root_digest().begin(),
+                                 partition.hash_tree_root_digest().end());
   }
   if (partition.has_fec_extent()) {
     Extent extent = partition.fec_data_extent();
@@ -221,6 +292,7 @@ bool InstallPlan::Partition::ParseVerityConfig(
     }
     fec_roots = partition.fec_roots();
   }
+  verity_data_in_payload = partition.verity_data_in_payload();
   return true;
 }
 
@@ -244,6 +316,11 @@ bool InstallPlan::ParseManifestToInstallPlan(
                                             : kPostinstallDefaultScript);
       install_part.filesystem_type = partition.filesystem_type();
       install_part.postinstall_optional = partition.postinstall_optional();
+      install_part.postinstall_independent =
+          partition.postinstall_independent();
+      install_part.postinstall_cache_files.assign(
+          partition.postinstall_cache_files().begin(),
+          partition.postinstall_cache_files().end());
     }
 
     if (partition.has_old_partition_info()) {
@@ -261,14 +338,37 @@ bool InstallPlan::ParseManifestToInstallPlan(
     const PartitionInfo& info = partition.new_partition_info();
     install_part.target_size = info.size();
     install_part.target_hash.assign(info.hash().begin(), info.hash().end());
+    if (info.has_chunked_hash() && info.hash_chunk_size() > 0) {
+      install_part.target_chunked_hash.assign(info.chunked_hash().begin(),
+                                              info.chunked_hash().end());
+      install_part.target_hash_chunk_size = info.hash_chunk_size();
+    }
 
     install_part.block_size = block_size;
+    install_part.hash_algorithm = install_plan->hash_algorithm;
     if (!install_part.ParseVerityConfig(partition)) {
       *error = ErrorCode::kDownloadNewPartitionInfoError;
       LOG(INFO) << "Failed to parse partition `" << partition.partition_name()
                 << "` verity configs";
       return false;
     }
+    // The blocks changed by operations in an operations section aren't known
+    // before the partition is applied.
+    if (install_part.source_size > 0 && !partition.has_operations_section()) {
+      install_part.update_hash_tree_from_source =
+          install_plan->hash_tree_from_source &&
+          install_part.hash_tree_size > 0;
+      install_part.update_fec_from_source =
+          install_plan->fec_from_source && install_part.fec_size > 0;
+      if (install_part.update_hash_tree_from_source ||
+          install_part.update_fec_from_source) {
+        install_part.changed_extents = GetChangedExtents(
+            partition, install_part.target_size / block_size);
+      }
+    }
+
+    if (install_part.fec_size > 0)
+      install_part.fec_buffer_size = install_plan->fec_buffer_size;
 
     install_plan->partitions.push_back(install_part);
   }
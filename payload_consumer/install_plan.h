@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_PLAN_H_
 #define UPDATE_ENGINE_PAYLOAD_CONSUMER_INSTALL_PLAN_H_
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -25,6 +26,8 @@
 
 #include "update_engine/common/action.h"
 #include "update_engine/common/boot_control_interface.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/payload_consumer/operation_stats.h"
 
 // InstallPlan is a simple struct that contains relevant info for many
 // parts of the update system about the install that should happen.
@@ -38,6 +41,9 @@ enum class InstallPayloadType {
 
 std::string InstallPayloadTypeToString(InstallPayloadType type);
 
+class ParallelHashTreeBuilder;
+class ParallelPartitionHasher;
+
 struct InstallPlan {
   InstallPlan() = default;
 
@@ -73,7 +79,16 @@ struct InstallPlan {
       ErrorCode* error);
 
   bool is_resume{false};
+  // The algorithm of the hashes of the data in the payload, passed on to the
+  // partitions parsed after it was set.
+  HashAlgorithm hash_algorithm{HashAlgorithm::kSha256};
+  // When resuming in the middle of an operation, the bytes of its output
+  // already written, see PartitionWriterInterface::CheckpointPartialOperation.
+  uint64_t resume_operation_bytes{0};
   bool vabc_none{false};
+  // Whether the COW is written without compression, as with |vabc_none|, when
+  // the device has plenty of space for it.
+  bool vabc_auto_compression{false};
   bool disable_vabc{false};
   std::string download_url;  // url to download from
   std::string version;       // version we are installing.
@@ -121,8 +136,16 @@ struct InstallPlan {
     std::string name;
 
     std::string source_path;
+    // The dm-verity device of the source partition, when reading it through
+    // the checks of the kernel instead of checking its hashes. See
+    // |verity_source_reads|.
+    std::string source_verity_path;
     uint64_t source_size{0};
     brillo::Blob source_hash;
+    // Whether the source partition was found to hash to |source_hash| while
+    // the device was idle, so that the source hashes of the operations
+    // needn't be checked. See source_hash_index.h.
+    bool source_hash_indexed{false};
 
     // |target_path| is intended to be a path to block device, which you can
     // open with |open| syscall and perform regular unix style read/write.
@@ -134,15 +157,33 @@ struct InstallPlan {
     std::string readonly_target_path;
     uint64_t target_size{0};
     brillo::Blob target_hash;
+    // The chunked hash of the target partition and the size of its chunks, if
+    // in the payload, checked in parallel instead of |target_hash|.
+    brillo::Blob target_chunked_hash;
+    uint64_t target_hash_chunk_size{0};
+    // Whether the partition isn't in the payload of a partial update, so it is
+    // copied whole from the source slot. Its hashes are only known once it was
+    // copied.
+    bool untouched{false};
 
     uint32_t block_size{0};
 
+    // The algorithm of |source_hash|, |target_hash| and of the hashes of the
+    // data of the operations, the |hash_algorithm| of the plan.
+    HashAlgorithm hash_algorithm{HashAlgorithm::kSha256};
+
     // Whether we should run the postinstall script from this partition and the
     // postinstall parameters.
     bool run_postinstall{false};
     std::string postinstall_path;
     std::string filesystem_type;
     bool postinstall_optional{false};
+    // Whether the postinstall step may run at the same time as those of the
+    // other partitions.
+    bool postinstall_independent{false};
+    // The files, relative to the root of the filesystem, the postinstall
+    // program is expected to read.
+    std::vector<std::string> postinstall_cache_files;
 
     // Verity hash tree and FEC config. See update_metadata.proto for details.
     // All offsets and sizes are in bytes.
@@ -152,14 +193,42 @@ struct InstallPlan {
     uint64_t hash_tree_size{0};
     std::string hash_tree_algorithm;
     brillo::Blob hash_tree_salt;
+    brillo::Blob hash_tree_root_digest;
 
     uint64_t fec_data_offset{0};
     uint64_t fec_data_size{0};
     uint64_t fec_offset{0};
     uint64_t fec_size{0};
     uint32_t fec_roots{0};
+    // Whether the operations write the hash tree and FEC data, instead of the
+    // device computing them.
+    bool verity_data_in_payload{false};
+
+    // Whether the hash tree and the FEC data are updated from the ones of the
+    // source partition instead of computed from scratch, see
+    // |hash_tree_from_source| and |fec_from_source|. Only the digests and the
+    // rounds of FEC covering |changed_extents|, the blocks which the
+    // operations may have changed, are computed then.
+    bool update_hash_tree_from_source{false};
+    bool update_fec_from_source{false};
+    // Bytes of data blocks held in memory as they are read for the hash tree,
+    // for the FEC data to be encoded without reading them again. See
+    // |fec_buffer_size|.
+    uint64_t fec_buffer_size{0};
+    std::vector<Extent> changed_extents;
 
     bool ParseVerityConfig(const PartitionUpdate&);
+
+    // Hashes the target partition in the background once it was written, when
+    // |overlap_verification| is set. Not part of the plan, so it isn't
+    // compared by operator==.
+    std::shared_ptr<ParallelPartitionHasher> target_hasher;
+
+    // The hash tree of the data written to the COW image of a VABC partition,
+    // when |inline_hash_tree| is set. The blocks not written, like those
+    // copied from the source partition, are hashed once read back. Not part
+    // of the plan, so it isn't compared by operator==.
+    std::shared_ptr<ParallelHashTreeBuilder> inline_hash_tree_builder;
   };
   std::vector<Partition> partitions;
 
@@ -205,6 +274,143 @@ struct InstallPlan {
 
   // Whether to enable multi-threaded compression on COW writes
   std::optional<bool> enable_threading;
+
+  // Whether DeltaPerformer should verify and apply install operations on
+  // background threads while the payload is still being received.
+  bool pipelined_apply = false;
+
+  // Number of threads applying install operations when |pipelined_apply| is
+  // set. Operations with disjoint destination extents run concurrently on
+  // partitions whose writer supports it.
+  size_t apply_workers = 1;
+
+  // Whether to service batched partition reads and writes through io_uring.
+  bool use_io_uring = false;
+
+  // Whether target partition writes, source partition reads and the reads
+  // verifying the target partitions bypass the page cache with O_DIRECT,
+  // so that applying a large update doesn't evict the working set of the
+  // running system. Ignored for I/O going through io_uring.
+  bool use_direct_io = false;
+
+  // Number of partitions FilesystemVerifierAction hashes at the same time.
+  // Only used when no partition needs its verity data written on device.
+  size_t verify_workers = 1;
+
+  // Whether DeltaPerformer starts hashing each target partition as soon as it
+  // is written, for FilesystemVerifierAction to only check the result. Only
+  // done for partitions without verity data to write on device, and not
+  // backed by a VABC snapshot; the others are hashed after the download.
+  bool overlap_verification = false;
+
+  // Whether DeltaPerformer should decompress and write large REPLACE,
+  // REPLACE_BZ, REPLACE_XZ and REPLACE_ZSTD operations as their data arrives
+  // instead of buffering all of it first. The data is only checked against the
+  // operation hash once all of it is written.
+  bool stream_replace_operations = false;
+
+  // Bytes of source partition blocks each partition writer keeps in memory
+  // for the operations reading them again. 0 disables the cache.
+  size_t source_cache_size = 0;
+
+  // Number of operations in front of the next one to apply whose source
+  // blocks are read ahead, as long as they add up to no more than
+  // |source_prefetch_bytes|. 0 disables read ahead.
+  size_t source_prefetch_ops = 0;
+  uint64_t source_prefetch_bytes = 64 * 1024 * 1024;
+
+  // Bytes of target partition writes held in memory to be sorted and merged
+  // before they are written out, at the latest at the next checkpoint. 0
+  // keeps the default write cache.
+  size_t write_combine_size = 0;
+
+  // Bytes of source data up to which runs of consecutive SOURCE_COPY
+  // operations are applied together, reading all of their source and writing
+  // all of their target at once. 0 applies them one by one.
+  uint64_t source_copy_batch_size = 0;
+
+  // Whether SOURCE_COPY operations on partitions not written through a
+  // snapshot are copied with copy_file_range(), falling back to reading and
+  // writing them once the kernel can't copy between the partitions. Target
+  // partition writes aren't cached then.
+  bool kernel_copy = false;
+
+  // Whether the source partitions of the running slot protected by dm-verity
+  // are read through their verity devices, skipping the source hash checks
+  // of the operations since the kernel fails the reads of corrupted blocks.
+  // Reading the source goes back to checking the hashes after such a failure.
+  bool verity_source_reads = false;
+
+  // Whether the FEC data of the partitions updated by a delta payload is
+  // updated from the one of the source partition, which is checked first,
+  // only encoding the parity of the data the operations changed.
+  bool fec_from_source = false;
+
+  // Whether the hash tree of the partitions updated by a delta payload is
+  // updated from the one of the source partition, which is checked first,
+  // only hashing the data the operations changed.
+  bool hash_tree_from_source = false;
+
+  // Whether the partitions whose hash tree was just built from all their data
+  // are checked against the root digest of the hash tree in the manifest,
+  // instead of hashing them again, when the rest of the partition is the
+  // verity data that was written.
+  bool verity_root_verification = false;
+
+  // Bytes of memory for holding the data of the partitions covered by FEC
+  // while they are read to build their hash tree, so that the FEC data of
+  // that much data is encoded without reading it again. 0 reads it again.
+  size_t fec_buffer_size = 0;
+
+  // Whether the pages of the target partitions read to verify them are dropped
+  // from the page cache, and the |postinstall_cache_files| of the partitions
+  // read ahead once mounted for postinstall, for the postinstall programs to
+  // find what they read in the page cache instead of what was verified.
+  bool postinstall_cache_warming = false;
+
+  // Whether the hash tree of the VABC partitions is built from the data as it
+  // is written to their COW image, when the partitions are checked against
+  // its root digest as per |verity_root_verification|, so that only the
+  // blocks not written are read back from the snapshot to build it.
+  bool inline_hash_tree = false;
+
+  // Whether DeltaPerformer watches the memory pressure while applying the
+  // payload, and gives back the memory it holds for speed while the device is
+  // short of it: fewer bytes and apply workers in the pipeline, no puffpatch
+  // cache, and the REPLACE operations streamed when critical.
+  bool memory_pressure_aware = false;
+
+  // Whether DownloadAction receives the payload in a cache file in the
+  // non-volatile directory, allocated for all of it, and applies it from
+  // there. The download then goes on at the speed of the network while the
+  // apply catches up, and a resume applies what was received already without
+  // downloading it again. Only for payloads of a known size.
+  bool spill_payload = false;
+
+  // Bytes of blocks VABCPartitionWriter queues up for a worker thread to
+  // compress into the COW image while the next operations are applied. 0
+  // writes them to the COW image right away.
+  size_t cow_write_queue_size = 0;
+
+  // Bytes of data of a streamed REPLACE operation after which its progress
+  // is checkpointed, so that resuming continues from there instead of from
+  // the start of the operation. 0 only checkpoints between operations.
+  uint64_t replace_checkpoint_size = 0;
+
+  // Whether DeltaPerformer only checkpoints the progress where it has to, when
+  // opening each partition and once the payload is applied, instead of every
+  // kCheckpointFrequencySeconds. An interrupted update then starts over from
+  // the last partition opened.
+  bool minimal_checkpoints = false;
+
+  // Whether the install operations and their phases show up as trace
+  // sections, on top of being timed in |operation_stats|. The rest of the
+  // trace sections of the update, in common/trace.h, follow it.
+  bool trace_operations = false;
+
+  // How long the install operations applied by DeltaPerformer took, filled
+  // in as each payload is closed.
+  OperationStats operation_stats;
 };
 
 class InstallPlanAction;
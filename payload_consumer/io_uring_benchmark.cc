@@ -0,0 +1,321 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Compares io_uring with the synchronous paths of EintrSafeFileDescriptor and
+// utils::PReadAll()/PWriteAll(), reading and writing a file in blocks of
+// every size, in order or at random, with and without O_DIRECT.
+//
+// The file is a temporary one, unless UE_IO_BENCHMARK_PATH names another one,
+// such as a block device. Its writes are only benchmarked if
+// UE_IO_BENCHMARK_WRITE is set as well, since they overwrite its content.
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+#include <liburing_cpp/IoUring.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+using io_uring_cpp::IoUringInterface;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kTempFileSize = 64 * 1024 * 1024;  // bytes
+// The most bytes transferred per iteration, for large block devices.
+constexpr uint64_t kMaxBytesPerIteration = 256 * 1024 * 1024;
+
+enum class Op { kRead, kWrite };
+
+// The file the benchmarks run on, set up on first use.
+class BenchmarkFile {
+ public:
+  static const BenchmarkFile& Get() {
+    static BenchmarkFile* file = new BenchmarkFile();
+    return *file;
+  }
+
+  const string& path() const { return path_; }
+  uint64_t size() const { return size_; }
+  bool writable() const { return writable_; }
+
+ private:
+  BenchmarkFile() {
+    const char* path = getenv("UE_IO_BENCHMARK_PATH");
+    if (path) {
+      path_ = path;
+      writable_ = getenv("UE_IO_BENCHMARK_WRITE") != nullptr;
+      size_ = std::max<off_t>(utils::FileSize(path_), 0);
+      return;
+    }
+    // Written in full rather than truncated, for the reads not to hit holes.
+    temp_file_ = std::make_unique<ScopedTempFile>(
+        "io_uring_benchmark.XXXXXX", true);
+    path_ = temp_file_->path();
+    const brillo::Blob data(1024 * 1024, 0xaa);
+    for (size_t offset = 0; offset < kTempFileSize; offset += data.size()) {
+      CHECK(utils::PWriteAll(
+          temp_file_->fd(), data.data(), data.size(), offset));
+    }
+    temp_file_->CloseFd();
+    size_ = kTempFileSize;
+    writable_ = true;
+  }
+
+  std::unique_ptr<ScopedTempFile> temp_file_;
+  string path_;
+  uint64_t size_{0};
+  bool writable_{false};
+};
+
+struct FreeDeleter {
+  void operator()(void* ptr) const { free(ptr); }
+};
+
+// Returns |size| bytes aligned for O_DIRECT.
+std::unique_ptr<uint8_t[], FreeDeleter> AlignedBuffer(size_t size) {
+  void* ptr = nullptr;
+  CHECK_EQ(0,
+           posix_memalign(&ptr, DirectIoFileDescriptor::kDirectIoAlignment,
+                          size));
+  memset(ptr, 0x55, size);
+  return std::unique_ptr<uint8_t[], FreeDeleter>(static_cast<uint8_t*>(ptr));
+}
+
+// Returns the offsets of the blocks of |block_size| transferred on every
+// iteration, in order or shuffled.
+vector<uint64_t> BlockOffsets(size_t block_size, bool random) {
+  const uint64_t size =
+      std::min(BenchmarkFile::Get().size(), kMaxBytesPerIteration);
+  vector<uint64_t> offsets;
+  for (uint64_t offset = 0; offset + block_size <= size; offset += block_size)
+    offsets.push_back(offset);
+  if (random)
+    std::shuffle(offsets.begin(), offsets.end(), std::mt19937(42));
+  return offsets;
+}
+
+// Opens the benchmark file for |op|, or skips the benchmark if it can't.
+bool OpenFile(benchmark::State& state, Op op, FileDescriptor* fd) {
+  const BenchmarkFile& file = BenchmarkFile::Get();
+  if (op == Op::kWrite && !file.writable()) {
+    state.SkipWithError("Set UE_IO_BENCHMARK_WRITE to overwrite the file");
+    return false;
+  }
+  if (file.size() == 0 ||
+      !fd->Open(file.path().c_str(), op == Op::kRead ? O_RDONLY : O_RDWR)) {
+    state.SkipWithError("Couldn't open the file");
+    return false;
+  }
+  return true;
+}
+
+// Transfers |count| bytes at |offset| with FileDescriptor::Read()/Write().
+bool Transfer(
+    Op op, FileDescriptor* fd, void* buf, size_t count, off_t offset) {
+  if (fd->Seek(offset, SEEK_SET) != offset)
+    return false;
+  const ssize_t transferred =
+      op == Op::kRead ? fd->Read(buf, count) : fd->Write(buf, count);
+  return transferred == static_cast<ssize_t>(count);
+}
+
+// Same as Transfer(), with utils::PReadAll()/PWriteAll().
+bool PTransfer(Op op, int fd, void* buf, size_t count, off_t offset) {
+  if (op == Op::kWrite)
+    return utils::PWriteAll(fd, buf, count, offset);
+  ssize_t bytes_read = 0;
+  return utils::PReadAll(fd, buf, count, offset, &bytes_read) &&
+         bytes_read == static_cast<ssize_t>(count);
+}
+
+// Queues the transfer of |count| bytes at |offset| on |ring|, from or into
+// the |buf_index|-th registered buffer, or -1 for an unregistered one.
+void QueueTransfer(Op op,
+                   IoUringInterface* ring,
+                   int fd,
+                   void* buf,
+                   size_t count,
+                   off_t offset,
+                   int buf_index,
+                   uint64_t data) {
+  if (buf_index < 0) {
+    (op == Op::kRead ? ring->PrepRead(fd, buf, count, offset)
+                     : ring->PrepWrite(fd, buf, count, offset))
+        .SetData(data);
+  } else {
+    (op == Op::kRead
+         ? ring->PrepReadFixed(fd, buf, count, offset, buf_index)
+         : ring->PrepWriteFixed(fd, buf, count, offset, buf_index))
+        .SetData(data);
+  }
+}
+
+// Transfers the blocks one at a time with FileDescriptor::Read()/Write().
+template <typename Fd, Op op>
+void BM_FileDescriptor(benchmark::State& state) {
+  const size_t block_size = state.range(0);
+  const vector<uint64_t> offsets = BlockOffsets(block_size, state.range(1));
+  Fd fd;
+  if (!OpenFile(state, op, &fd))
+    return;
+  auto buffer = AlignedBuffer(block_size);
+  for (auto _ : state) {
+    for (uint64_t offset : offsets) {
+      if (!Transfer(op, &fd, buffer.get(), block_size, offset)) {
+        state.SkipWithError("I/O error");
+        return;
+      }
+    }
+    if (op == Op::kWrite)
+      fd.Flush();
+  }
+  state.SetBytesProcessed(state.iterations() * offsets.size() * block_size);
+}
+
+// Transfers the blocks one at a time with utils::PReadAll()/PWriteAll().
+template <typename Fd, Op op>
+void BM_PReadWriteAll(benchmark::State& state) {
+  const size_t block_size = state.range(0);
+  const vector<uint64_t> offsets = BlockOffsets(block_size, state.range(1));
+  Fd fd;
+  if (!OpenFile(state, op, &fd))
+    return;
+  auto buffer = AlignedBuffer(block_size);
+  for (auto _ : state) {
+    for (uint64_t offset : offsets) {
+      if (!PTransfer(op, fd.Fd(), buffer.get(), block_size, offset)) {
+        state.SkipWithError("I/O error");
+        return;
+      }
+    }
+    if (op == Op::kWrite)
+      fd.Flush();
+  }
+  state.SetBytesProcessed(state.iterations() * offsets.size() * block_size);
+}
+
+// Transfers the blocks through an io_uring keeping as many of them in flight
+// as its queue depth, each with a buffer of its own, registered with the ring
+// or not.
+template <typename Fd, Op op>
+void BM_IoUring(benchmark::State& state) {
+  const size_t block_size = state.range(0);
+  const vector<uint64_t> offsets = BlockOffsets(block_size, state.range(1));
+  const size_t queue_depth = state.range(2);
+  const bool registered = state.range(3);
+  Fd fd;
+  if (!OpenFile(state, op, &fd))
+    return;
+  auto ring = IoUringInterface::CreateLinuxIoUring(queue_depth, 0);
+  if (!ring) {
+    state.SkipWithError("io_uring isn't supported");
+    return;
+  }
+  auto buffer = AlignedBuffer(block_size * queue_depth);
+  vector<iovec> iovecs(queue_depth);
+  for (size_t i = 0; i < queue_depth; i++)
+    iovecs[i] = {buffer.get() + i * block_size, block_size};
+  if (registered &&
+      !ring->RegisterBuffers(iovecs.data(), iovecs.size()).IsOk()) {
+    state.SkipWithError("Couldn't register the buffers");
+    return;
+  }
+
+  // Queues the transfer of the |index|-th block with the |slot|-th buffer.
+  auto queue = [&](uint64_t slot, size_t index) {
+    QueueTransfer(op,
+                  ring.get(),
+                  fd.Fd(),
+                  iovecs[slot].iov_base,
+                  block_size,
+                  offsets[index],
+                  registered ? slot : -1,
+                  slot);
+  };
+
+  for (auto _ : state) {
+    size_t next = 0;
+    size_t in_flight = 0;
+    for (; next < std::min(queue_depth, offsets.size()); next++, in_flight++)
+      queue(next, next);
+    while (in_flight > 0) {
+      if (ring->SQEReady() > 0 && !ring->SubmitAndWait(1).IsOk()) {
+        state.SkipWithError("Couldn't submit to the io_uring");
+        return;
+      }
+      const auto cqe = ring->PopCQE();
+      if (cqe.IsErr() ||
+          cqe.GetResult().res != static_cast<int32_t>(block_size)) {
+        state.SkipWithError("I/O error");
+        return;
+      }
+      in_flight--;
+      if (next < offsets.size()) {
+        queue(cqe.GetResult().GetData<uint64_t>(), next++);
+        in_flight++;
+      }
+    }
+    if (op == Op::kWrite)
+      fd.Flush();
+  }
+  state.SetBytesProcessed(state.iterations() * offsets.size() * block_size);
+}
+
+// Block sizes, and whether the blocks are transferred at random.
+void SyncArgs(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"block_size", "random"})
+      ->ArgsProduct({{4096, 64 * 1024, 1024 * 1024}, {0, 1}})
+      ->UseRealTime();
+}
+
+// Same as SyncArgs(), with the queue depths and whether the buffers are
+// registered.
+void IoUringArgs(benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"block_size", "random", "queue_depth", "registered"})
+      ->ArgsProduct(
+          {{4096, 64 * 1024, 1024 * 1024}, {0, 1}, {1, 4, 16, 64}, {0, 1}})
+      ->UseRealTime();
+}
+
+}  // namespace
+
+#define IO_BENCHMARKS(Fd, op)                                      \
+  BENCHMARK_TEMPLATE(BM_FileDescriptor, Fd, op)->Apply(SyncArgs); \
+  BENCHMARK_TEMPLATE(BM_PReadWriteAll, Fd, op)->Apply(SyncArgs);  \
+  BENCHMARK_TEMPLATE(BM_IoUring, Fd, op)->Apply(IoUringArgs)
+
+IO_BENCHMARKS(EintrSafeFileDescriptor, Op::kRead);
+IO_BENCHMARKS(EintrSafeFileDescriptor, Op::kWrite);
+IO_BENCHMARKS(DirectIoFileDescriptor, Op::kRead);
+IO_BENCHMARKS(DirectIoFileDescriptor, Op::kWrite);
+
+}  // namespace chromeos_update_engine
+
+BENCHMARK_MAIN();
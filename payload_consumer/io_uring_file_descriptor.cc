@@ -0,0 +1,157 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+
+#include <errno.h>
+
+#include <algorithm>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// io_uring takes 32 bit lengths; anything above is finished synchronously
+// like a short transfer.
+constexpr size_t kMaxRequestSize = 1 << 30;
+}  // namespace
+
+bool IoUringFileDescriptor::InitRing() {
+  if (ring_) {
+    return true;
+  }
+  if (ring_unavailable_) {
+    return false;
+  }
+  ring_ = io_uring_cpp::IoUringInterface::CreateLinuxIoUring(queue_depth_, 0);
+  if (!ring_) {
+    PLOG(WARNING) << "Unable to set up io_uring, using pread/pwrite instead";
+    ring_unavailable_ = true;
+    return false;
+  }
+  return true;
+}
+
+bool IoUringFileDescriptor::ReadBatch(
+    const std::vector<FileIoRequest>& requests) {
+  if (!InitRing()) {
+    return EintrSafeFileDescriptor::ReadBatch(requests);
+  }
+  return SubmitBatch(requests, false);
+}
+
+bool IoUringFileDescriptor::WriteBatch(
+    const std::vector<FileIoRequest>& requests) {
+  if (!InitRing()) {
+    return EintrSafeFileDescriptor::WriteBatch(requests);
+  }
+  return SubmitBatch(requests, true);
+}
+
+bool IoUringFileDescriptor::SubmitBatch(
+    const std::vector<FileIoRequest>& requests, bool write) {
+  CHECK_GE(fd_, 0);
+  bool success = true;
+  size_t begin = 0;
+  while (begin < requests.size()) {
+    const size_t space = ring_->SQELeft();
+    CHECK_GT(space, 0u);
+    const size_t end = std::min(requests.size(), begin + space);
+    for (size_t i = begin; i < end; i++) {
+      const auto& request = requests[i];
+      const unsigned count = std::min(request.count, kMaxRequestSize);
+      auto sqe = write ? ring_->PrepWrite(fd_, request.buf, count,
+                                          request.offset)
+                       : ring_->PrepRead(fd_, request.buf, count,
+                                         request.offset);
+      CHECK(sqe.IsOk());
+      sqe.SetData(i);
+    }
+
+    size_t submitted = 0;
+    int submit_error = 0;
+    while (submitted < end - begin) {
+      const auto result = ring_->Submit();
+      if (result.ErrCode() < 0 || result.EntriesSubmitted() == 0) {
+        submit_error = result.ErrCode() < 0 ? -result.ErrCode() : EAGAIN;
+        break;
+      }
+      submitted += result.EntriesSubmitted();
+    }
+
+    // Always reap what was submitted: the kernel may still be using the
+    // buffers of those requests.
+    if (submitted > 0) {
+      auto cqes = ring_->PopCQE(submitted);
+      if (cqes.IsErr()) {
+        LOG(ERROR) << "Failed to wait for io_uring completions: "
+                   << cqes.GetError();
+        // The ring is in an unknown state; don't use it again.
+        ring_.reset();
+        ring_unavailable_ = true;
+        return false;
+      }
+      for (const auto& cqe : cqes.GetResult()) {
+        const auto index = cqe.GetData<size_t>();
+        success = CompleteRequest(requests[index], cqe.res, write) && success;
+      }
+    }
+    if (submit_error != 0) {
+      errno = submit_error;
+      PLOG(ERROR) << "Failed to submit " << (end - begin - submitted)
+                  << " io_uring requests";
+      // Unsubmitted entries are still queued in the ring; drop it so they
+      // never run.
+      ring_.reset();
+      ring_unavailable_ = true;
+      return false;
+    }
+    begin = end;
+  }
+  return success;
+}
+
+bool IoUringFileDescriptor::CompleteRequest(const FileIoRequest& request,
+                                            int res,
+                                            bool write) {
+  if (res < 0) {
+    errno = -res;
+    PLOG(ERROR) << "io_uring " << (write ? "write" : "read") << " of "
+                << request.count << " bytes at offset " << request.offset
+                << " failed";
+    return false;
+  }
+  const size_t done = res;
+  TEST_AND_RETURN_FALSE(done <= request.count);
+  if (done == request.count) {
+    return true;
+  }
+  auto buf = static_cast<char*>(request.buf) + done;
+  const size_t remaining = request.count - done;
+  const off_t offset = request.offset + done;
+  if (write) {
+    return utils::PWriteAll(fd_, buf, remaining, offset);
+  }
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(
+      utils::PReadAll(fd_, buf, remaining, offset, &bytes_read));
+  return bytes_read == static_cast<ssize_t>(remaining);
+}
+
+}  // namespace chromeos_update_engine
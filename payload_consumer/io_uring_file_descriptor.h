@@ -0,0 +1,68 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
+
+#include <memory>
+#include <vector>
+
+#include <liburing_cpp/IoUring.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// An EintrSafeFileDescriptor which services ReadBatch() and WriteBatch()
+// through an io_uring, so that a batch of N requests costs a handful of
+// syscalls instead of N. Everything else, including single Read()/Write()
+// calls, goes through the regular system calls. If the kernel doesn't
+// support io_uring, the batch methods fall back to pread()/pwrite().
+class IoUringFileDescriptor final : public EintrSafeFileDescriptor {
+ public:
+  static constexpr unsigned kDefaultQueueDepth = 64;
+
+  explicit IoUringFileDescriptor(unsigned queue_depth = kDefaultQueueDepth)
+      : queue_depth_(queue_depth) {}
+  ~IoUringFileDescriptor() override = default;
+
+  bool ReadBatch(const std::vector<FileIoRequest>& requests) override;
+  bool WriteBatch(const std::vector<FileIoRequest>& requests) override;
+
+  // Whether batches actually go through io_uring. Only meaningful after the
+  // first batch.
+  bool UsingIoUring() const { return ring_ != nullptr; }
+
+ private:
+  // Sets up |ring_| on first use. Returns false if io_uring is unavailable.
+  bool InitRing();
+
+  bool SubmitBatch(const std::vector<FileIoRequest>& requests, bool write);
+
+  // Finishes |request| given the result |res| of its io_uring operation,
+  // completing short reads and writes synchronously.
+  bool CompleteRequest(const FileIoRequest& request, int res, bool write);
+
+  const unsigned queue_depth_;
+  std::unique_ptr<io_uring_cpp::IoUringInterface> ring_;
+  bool ring_unavailable_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(IoUringFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_IO_URING_FILE_DESCRIPTOR_H_
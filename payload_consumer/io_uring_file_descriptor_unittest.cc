@@ -0,0 +1,122 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kNumBlocks = 200;
+}  // namespace
+
+class IoUringFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    data_.resize(kBlockSize * kNumBlocks);
+    for (size_t i = 0; i < data_.size(); i++) {
+      data_[i] = static_cast<uint8_t>(i * 7 + i / kBlockSize);
+    }
+    ASSERT_TRUE(test_utils::WriteFileVector(temp_file_.path(), data_));
+  }
+
+  brillo::Blob data_;
+  ScopedTempFile temp_file_{"IoUringFileDescriptor-file.XXXXXX"};
+};
+
+TEST_F(IoUringFileDescriptorTest, ReadBatchTest) {
+  // A queue depth smaller than the batch exercises multiple submissions.
+  IoUringFileDescriptor fd(8);
+  ASSERT_TRUE(fd.Open(temp_file_.path().c_str(), O_RDONLY));
+  ASSERT_EQ(0, fd.Seek(0, SEEK_CUR));
+
+  // Read every other block, in reverse order.
+  brillo::Blob out(kBlockSize * kNumBlocks / 2);
+  std::vector<FileIoRequest> requests;
+  for (size_t i = 0; i < kNumBlocks / 2; i++) {
+    requests.push_back({static_cast<off64_t>((kNumBlocks - 2 - i * 2) *
+                                             kBlockSize),
+                        out.data() + i * kBlockSize,
+                        kBlockSize});
+  }
+  ASSERT_TRUE(fd.ReadBatch(requests));
+  for (size_t i = 0; i < kNumBlocks / 2; i++) {
+    const auto expected = data_.begin() + (kNumBlocks - 2 - i * 2) * kBlockSize;
+    ASSERT_TRUE(std::equal(expected,
+                           expected + kBlockSize,
+                           out.begin() + i * kBlockSize));
+  }
+  ASSERT_TRUE(fd.Close());
+}
+
+TEST_F(IoUringFileDescriptorTest, ReadPastEndFailsTest) {
+  IoUringFileDescriptor fd;
+  ASSERT_TRUE(fd.Open(temp_file_.path().c_str(), O_RDONLY));
+  brillo::Blob out(kBlockSize * 2);
+  ASSERT_FALSE(fd.ReadBatch(
+      {{static_cast<off64_t>((kNumBlocks - 1) * kBlockSize),
+        out.data(),
+        out.size()}}));
+  ASSERT_TRUE(fd.Close());
+}
+
+TEST_F(IoUringFileDescriptorTest, WriteBatchTest) {
+  IoUringFileDescriptor fd(8);
+  ASSERT_TRUE(fd.Open(temp_file_.path().c_str(), O_RDWR));
+
+  brillo::Blob block_a(kBlockSize, 'a');
+  brillo::Blob block_b(kBlockSize * 3, 'b');
+  ASSERT_TRUE(fd.WriteBatch({{0, block_a.data(), block_a.size()},
+                             {static_cast<off64_t>(10 * kBlockSize),
+                              block_b.data(),
+                              block_b.size()}}));
+  ASSERT_TRUE(fd.Close());
+
+  std::copy(block_a.begin(), block_a.end(), data_.begin());
+  std::copy(block_b.begin(), block_b.end(), data_.begin() + 10 * kBlockSize);
+  brillo::Blob contents;
+  ASSERT_TRUE(utils::ReadFile(temp_file_.path(), &contents));
+  ASSERT_EQ(data_, contents);
+}
+
+TEST_F(IoUringFileDescriptorTest, ReadExtentsTest) {
+  FileDescriptorPtr fd = std::make_shared<IoUringFileDescriptor>();
+  ASSERT_TRUE(fd->Open(temp_file_.path().c_str(), O_RDONLY));
+  std::vector<Extent> extents = {ExtentForRange(5, 2), ExtentForRange(1, 1)};
+  brillo::Blob out;
+  ASSERT_TRUE(
+      utils::ReadExtents(fd, extents, &out, 3 * kBlockSize, kBlockSize));
+  brillo::Blob expected(data_.begin() + 5 * kBlockSize,
+                        data_.begin() + 7 * kBlockSize);
+  expected.insert(expected.end(),
+                  data_.begin() + kBlockSize,
+                  data_.begin() + 2 * kBlockSize);
+  ASSERT_EQ(expected, out);
+}
+
+}  // namespace chromeos_update_engine
@@ -45,6 +45,10 @@ class MockPartitionWriter : public PartitionWriter {
               PerformReplaceOperation,
               (const InstallOperation&, const void*, size_t),
               (override));
+  MOCK_METHOD(std::unique_ptr<ExtentWriter>,
+              CreateReplaceExtentWriter,
+              (const InstallOperation&),
+              (override));
   MOCK_METHOD(bool,
               PerformZeroOrDiscardOperation,
               (const InstallOperation&),
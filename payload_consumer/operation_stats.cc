@@ -0,0 +1,226 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_stats.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <utility>
+
+#include <base/strings/stringprintf.h>
+#include <cutils/trace.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using base::TimeDelta;
+using base::TimeTicks;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The operation traced on the current thread.
+thread_local ScopedOperationTrace* current_trace = nullptr;
+}  // namespace
+
+const char* OperationPhaseName(OperationPhase phase) {
+  switch (phase) {
+    case OperationPhase::kWaitForData:
+      return "wait";
+    case OperationPhase::kHash:
+      return "hash";
+    case OperationPhase::kSourceRead:
+      return "source_read";
+    case OperationPhase::kApply:
+      return "apply";
+    case OperationPhase::kWrite:
+      return "write";
+  }
+  return "<unknown_phase>";
+}
+
+void OperationStats::Histogram::Add(TimeDelta duration) {
+  uint64_t us = std::max<int64_t>(duration.InMicroseconds(), 0);
+  size_t bucket = 0;
+  for (; us > 0 && bucket < kNumBuckets - 1; us >>= 1) {
+    bucket++;
+  }
+  buckets[bucket]++;
+  count++;
+  total += duration;
+  max = std::max(max, duration);
+}
+
+void OperationStats::Histogram::Merge(const Histogram& other) {
+  for (size_t i = 0; i < kNumBuckets; i++) {
+    buckets[i] += other.buckets[i];
+  }
+  count += other.count;
+  total += other.total;
+  max = std::max(max, other.max);
+}
+
+TimeDelta OperationStats::Histogram::Percentile(int percentile) const {
+  // The rank of the duration looked for, starting at 1.
+  const uint64_t rank = std::max<uint64_t>((count * percentile + 99) / 100, 1);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kNumBuckets - 1; i++) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      return std::min(TimeDelta::FromMicroseconds(int64_t{1} << i), max);
+    }
+  }
+  return max;
+}
+
+void OperationStats::Add(InstallOperation::Type type,
+                         OperationPhase phase,
+                         TimeDelta duration) {
+  histograms[type][static_cast<size_t>(phase)].Add(duration);
+}
+
+void OperationStats::AddSourceRead(InstallOperation::Type type,
+                                   uint64_t source_size,
+                                   uint64_t bytes_read) {
+  SourceReads& reads = source_reads[type];
+  reads.source_bytes += source_size;
+  reads.bytes_read += bytes_read;
+}
+
+void OperationStats::Merge(const OperationStats& other) {
+  for (const auto& [type, phases] : other.histograms) {
+    PhaseHistograms& ours = histograms[type];
+    for (size_t i = 0; i < kNumOperationPhases; i++) {
+      ours[i].Merge(phases[i]);
+    }
+  }
+  for (const auto& [type, reads] : other.source_reads) {
+    AddSourceRead(type, reads.source_bytes, reads.bytes_read);
+  }
+}
+
+string OperationStats::ToString() const {
+  string result;
+  for (const auto& [type, phases] : histograms) {
+    uint64_t num_ops = 0;
+    for (const Histogram& histogram : phases) {
+      num_ops = std::max(num_ops, histogram.count);
+    }
+    base::StringAppendF(&result,
+                        "%s: %" PRIu64 " operations",
+                        InstallOperationTypeName(type),
+                        num_ops);
+    for (size_t i = 0; i < kNumOperationPhases; i++) {
+      const Histogram& histogram = phases[i];
+      if (histogram.count == 0) {
+        continue;
+      }
+      base::StringAppendF(
+          &result,
+          ", %s %s (p50 %s, p99 %s, max %s)",
+          OperationPhaseName(static_cast<OperationPhase>(i)),
+          utils::FormatTimeDelta(histogram.total).c_str(),
+          utils::FormatTimeDelta(histogram.Percentile(50)).c_str(),
+          utils::FormatTimeDelta(histogram.Percentile(99)).c_str(),
+          utils::FormatTimeDelta(histogram.max).c_str());
+    }
+    const auto reads = source_reads.find(type);
+    if (reads != source_reads.end() && reads->second.source_bytes > 0) {
+      base::StringAppendF(&result,
+                          ", source read %.2fx",
+                          static_cast<double>(reads->second.bytes_read) /
+                              reads->second.source_bytes);
+    }
+    result += "\n";
+  }
+  return result;
+}
+
+void OperationTracer::Add(InstallOperation::Type type,
+                          OperationPhase phase,
+                          TimeDelta duration) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.Add(type, phase, duration);
+}
+
+void OperationTracer::AddSourceRead(InstallOperation::Type type,
+                                    uint64_t source_size,
+                                    uint64_t bytes_read) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.AddSourceRead(type, source_size, bytes_read);
+}
+
+OperationStats OperationTracer::TakeStats() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  OperationStats stats;
+  std::swap(stats, stats_);
+  return stats;
+}
+
+ScopedOperationTrace::ScopedOperationTrace(OperationTracer* tracer,
+                                           InstallOperation::Type type)
+    : tracer_(tracer), type_(type), previous_(current_trace) {
+  current_trace = this;
+  if (tracer_ && tracer_->atrace()) {
+    atrace_begin(ATRACE_TAG_ALWAYS, InstallOperationTypeName(type_));
+  }
+}
+
+ScopedOperationTrace::~ScopedOperationTrace() {
+  if (tracer_ && tracer_->atrace()) {
+    atrace_end(ATRACE_TAG_ALWAYS);
+  }
+  current_trace = previous_;
+}
+
+void AddOperationSourceRead(uint64_t source_size, uint64_t bytes_read) {
+  if (current_trace && current_trace->tracer_) {
+    current_trace->tracer_->AddSourceRead(
+        current_trace->type_, source_size, bytes_read);
+  }
+}
+
+ScopedOperationPhase::ScopedOperationPhase(OperationPhase phase)
+    : trace_(current_trace), phase_(phase) {
+  if (!trace_ || !trace_->tracer_) {
+    trace_ = nullptr;
+    return;
+  }
+  parent_ = trace_->current_phase_;
+  trace_->current_phase_ = this;
+  if (trace_->tracer_->atrace()) {
+    atrace_begin(ATRACE_TAG_ALWAYS, OperationPhaseName(phase_));
+  }
+  start_ = TimeTicks::Now();
+}
+
+ScopedOperationPhase::~ScopedOperationPhase() {
+  if (!trace_) {
+    return;
+  }
+  const TimeDelta elapsed = TimeTicks::Now() - start_;
+  if (trace_->tracer_->atrace()) {
+    atrace_end(ATRACE_TAG_ALWAYS);
+  }
+  trace_->tracer_->Add(trace_->type_, phase_, elapsed - nested_);
+  if (parent_) {
+    parent_->nested_ += elapsed;
+  }
+  trace_->current_phase_ = parent_;
+}
+
+}  // namespace chromeos_update_engine
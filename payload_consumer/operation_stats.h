@@ -0,0 +1,168 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_STATS_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_STATS_H_
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Where the time spent on an install operation goes.
+enum class OperationPhase {
+  // From the operation being the next one to apply until all of its data is
+  // received.
+  kWaitForData,
+  // Checking the hash of the operation data.
+  kHash,
+  // Reading and verifying the source blocks.
+  kSourceRead,
+  // Decompressing or patching, that is everything else applying the
+  // operation does.
+  kApply,
+  // Writing the target blocks.
+  kWrite,
+};
+constexpr size_t kNumOperationPhases =
+    static_cast<size_t>(OperationPhase::kWrite) + 1;
+
+const char* OperationPhaseName(OperationPhase phase);
+
+// Latency histograms of each phase of each type of install operation.
+struct OperationStats {
+  struct Histogram {
+    // Bucket i counts the durations in [2^(i-1), 2^i) microseconds, the last
+    // one everything longer.
+    static constexpr size_t kNumBuckets = 32;
+
+    void Add(base::TimeDelta duration);
+    void Merge(const Histogram& other);
+    // Upper bound of the bucket holding the |percentile|% shortest duration.
+    base::TimeDelta Percentile(int percentile) const;
+
+    std::array<uint64_t, kNumBuckets> buckets{};
+    uint64_t count{0};
+    base::TimeDelta total;
+    base::TimeDelta max;
+  };
+  using PhaseHistograms = std::array<Histogram, kNumOperationPhases>;
+
+  // How much of their source the operations of a type read, see
+  // AddOperationSourceRead().
+  struct SourceReads {
+    uint64_t source_bytes{0};
+    uint64_t bytes_read{0};
+  };
+
+  void Add(InstallOperation::Type type,
+           OperationPhase phase,
+           base::TimeDelta duration);
+  void AddSourceRead(InstallOperation::Type type,
+                     uint64_t source_size,
+                     uint64_t bytes_read);
+  void Merge(const OperationStats& other);
+  bool empty() const { return histograms.empty() && source_reads.empty(); }
+  // One line per operation type, with the total, median, 99th percentile and
+  // maximum time of each phase, and how many times over the source was read.
+  std::string ToString() const;
+
+  std::map<InstallOperation::Type, PhaseHistograms> histograms;
+  std::map<InstallOperation::Type, SourceReads> source_reads;
+};
+
+// Collects the OperationStats of install operations applied on any thread,
+// see ScopedOperationTrace. With |atrace|, the operations and their phases
+// also show up as trace sections.
+class OperationTracer {
+ public:
+  explicit OperationTracer(bool atrace) : atrace_(atrace) {}
+
+  void Add(InstallOperation::Type type,
+           OperationPhase phase,
+           base::TimeDelta duration);
+  void AddSourceRead(InstallOperation::Type type,
+                     uint64_t source_size,
+                     uint64_t bytes_read);
+  // Returns the stats collected so far, and starts over.
+  OperationStats TakeStats();
+  bool atrace() const { return atrace_; }
+
+ private:
+  const bool atrace_;
+  std::mutex mutex_;
+  OperationStats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(OperationTracer);
+};
+
+class ScopedOperationPhase;
+
+// Accounts that the operation traced on the current thread, if any, read
+// |bytes_read| bytes from its source of |source_size| bytes. Reading more than
+// the source means that parts of it were read again, as when puffpatch finds
+// a deflate stream it already decoded out of its cache.
+void AddOperationSourceRead(uint64_t source_size, uint64_t bytes_read);
+
+// While in scope, the ScopedOperationPhase instances on the current thread
+// are accounted to an operation of |type| in |tracer|, which may be null.
+class ScopedOperationTrace {
+ public:
+  ScopedOperationTrace(OperationTracer* tracer, InstallOperation::Type type);
+  ~ScopedOperationTrace();
+
+ private:
+  friend class ScopedOperationPhase;
+  friend void AddOperationSourceRead(uint64_t source_size,
+                                     uint64_t bytes_read);
+
+  OperationTracer* tracer_;
+  InstallOperation::Type type_;
+  ScopedOperationTrace* previous_;
+  ScopedOperationPhase* current_phase_{nullptr};
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedOperationTrace);
+};
+
+// Times |phase| of the operation traced on the current thread, if any, while
+// in scope. The time of nested phases only counts for them, so that applying
+// an operation doesn't include reading its source or writing its target.
+class ScopedOperationPhase {
+ public:
+  explicit ScopedOperationPhase(OperationPhase phase);
+  ~ScopedOperationPhase();
+
+ private:
+  ScopedOperationTrace* trace_;
+  OperationPhase phase_;
+  ScopedOperationPhase* parent_{nullptr};
+  base::TimeTicks start_;
+  base::TimeDelta nested_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedOperationPhase);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATION_STATS_H_
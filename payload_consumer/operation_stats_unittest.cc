@@ -0,0 +1,154 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operation_stats.h"
+
+#include <string>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+using base::TimeDelta;
+
+namespace chromeos_update_engine {
+
+namespace {
+const TimeDelta kSleepTime = TimeDelta::FromMilliseconds(20);
+
+const OperationStats::Histogram& GetHistogram(const OperationStats& stats,
+                                              InstallOperation::Type type,
+                                              OperationPhase phase) {
+  return stats.histograms.at(type)[static_cast<size_t>(phase)];
+}
+}  // namespace
+
+TEST(OperationStatsTest, HistogramTest) {
+  OperationStats::Histogram histogram;
+  for (int i = 0; i < 98; i++) {
+    histogram.Add(TimeDelta::FromMicroseconds(3));
+  }
+  histogram.Add(TimeDelta::FromMicroseconds(100));
+  histogram.Add(TimeDelta::FromMicroseconds(1000));
+  EXPECT_EQ(100u, histogram.count);
+  EXPECT_EQ(98u, histogram.buckets[2]);
+  EXPECT_EQ(1u, histogram.buckets[7]);
+  EXPECT_EQ(1u, histogram.buckets[10]);
+  EXPECT_EQ(TimeDelta::FromMicroseconds(98 * 3 + 1100), histogram.total);
+  EXPECT_EQ(TimeDelta::FromMicroseconds(4), histogram.Percentile(50));
+  EXPECT_EQ(TimeDelta::FromMicroseconds(128), histogram.Percentile(99));
+  // The upper bound of a bucket is never more than the longest duration.
+  EXPECT_EQ(TimeDelta::FromMicroseconds(1000), histogram.Percentile(100));
+
+  OperationStats::Histogram other;
+  other.Add(TimeDelta::FromSeconds(1));
+  other.Add(TimeDelta());
+  histogram.Merge(other);
+  EXPECT_EQ(102u, histogram.count);
+  EXPECT_EQ(1u, histogram.buckets[0]);
+  EXPECT_EQ(TimeDelta::FromSeconds(1), histogram.max);
+}
+
+TEST(OperationStatsTest, MergeTest) {
+  OperationStats stats;
+  stats.Add(InstallOperation::REPLACE,
+            OperationPhase::kApply,
+            TimeDelta::FromMilliseconds(1));
+  OperationStats other;
+  other.Add(InstallOperation::REPLACE,
+            OperationPhase::kApply,
+            TimeDelta::FromMilliseconds(2));
+  other.Add(InstallOperation::SOURCE_BSDIFF,
+            OperationPhase::kSourceRead,
+            TimeDelta::FromMilliseconds(3));
+  stats.Merge(other);
+  EXPECT_EQ(2u, stats.histograms.size());
+  EXPECT_EQ(TimeDelta::FromMilliseconds(3),
+            GetHistogram(
+                stats, InstallOperation::REPLACE, OperationPhase::kApply)
+                .total);
+  EXPECT_EQ(1u,
+            GetHistogram(stats,
+                         InstallOperation::SOURCE_BSDIFF,
+                         OperationPhase::kSourceRead)
+                .count);
+  EXPECT_FALSE(stats.ToString().empty());
+}
+
+TEST(OperationStatsTest, NestedPhasesTest) {
+  OperationTracer tracer(false);
+  {
+    ScopedOperationTrace trace(&tracer, InstallOperation::SOURCE_COPY);
+    ScopedOperationPhase apply(OperationPhase::kApply);
+    {
+      ScopedOperationPhase source_read(OperationPhase::kSourceRead);
+      std::this_thread::sleep_for(
+          std::chrono::microseconds(kSleepTime.InMicroseconds()));
+    }
+    ScopedOperationPhase write(OperationPhase::kWrite);
+  }
+  // Phases outside of a trace aren't recorded.
+  { ScopedOperationPhase apply(OperationPhase::kApply); }
+
+  const OperationStats stats = tracer.TakeStats();
+  ASSERT_EQ(1u, stats.histograms.size());
+  const auto& source_read = GetHistogram(
+      stats, InstallOperation::SOURCE_COPY, OperationPhase::kSourceRead);
+  const auto& apply = GetHistogram(
+      stats, InstallOperation::SOURCE_COPY, OperationPhase::kApply);
+  EXPECT_EQ(1u, source_read.count);
+  EXPECT_EQ(1u, apply.count);
+  EXPECT_EQ(1u,
+            GetHistogram(
+                stats, InstallOperation::SOURCE_COPY, OperationPhase::kWrite)
+                .count);
+  EXPECT_GE(source_read.total, kSleepTime);
+  EXPECT_LT(apply.total, kSleepTime);
+  EXPECT_TRUE(tracer.TakeStats().empty());
+}
+
+TEST(OperationStatsTest, SourceReadTest) {
+  OperationTracer tracer(false);
+  {
+    ScopedOperationTrace trace(&tracer, InstallOperation::PUFFDIFF);
+    ScopedOperationPhase apply(OperationPhase::kApply);
+    AddOperationSourceRead(100, 150);
+  }
+  {
+    ScopedOperationTrace trace(&tracer, InstallOperation::PUFFDIFF);
+    ScopedOperationPhase apply(OperationPhase::kApply);
+    AddOperationSourceRead(300, 450);
+  }
+  // Reads outside of a trace aren't recorded.
+  AddOperationSourceRead(100, 100);
+
+  OperationStats stats = tracer.TakeStats();
+  ASSERT_EQ(1u, stats.source_reads.size());
+  const auto& reads = stats.source_reads[InstallOperation::PUFFDIFF];
+  EXPECT_EQ(400u, reads.source_bytes);
+  EXPECT_EQ(600u, reads.bytes_read);
+  EXPECT_NE(std::string::npos, stats.ToString().find("source read 1.50x"));
+
+  OperationStats merged;
+  merged.Merge(stats);
+  EXPECT_EQ(600u, merged.source_reads[InstallOperation::PUFFDIFF].bytes_read);
+}
+
+TEST(OperationStatsTest, NullTracerTest) {
+  ScopedOperationTrace trace(nullptr, InstallOperation::REPLACE);
+  ScopedOperationPhase apply(OperationPhase::kApply);
+}
+
+}  // namespace chromeos_update_engine
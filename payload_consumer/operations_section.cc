@@ -0,0 +1,105 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operations_section.h"
+
+#include <base/logging.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/packed_extents.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+uint64_t GetNumOperations(const PartitionUpdate& partition) {
+  if (partition.has_operations_section())
+    return partition.operations_section().num_operations();
+  return partition.operations_size();
+}
+
+bool HasPendingOperationsSection(const PartitionUpdate& partition) {
+  return partition.has_operations_section() &&
+         partition.operations_size() == 0;
+}
+
+bool ParseOperationsSection(const void* data,
+                            size_t size,
+                            HashAlgorithm algorithm,
+                            PartitionUpdate* partition) {
+  const PartitionUpdate::OperationsSection& section =
+      partition->operations_section();
+  TEST_AND_RETURN_FALSE(size == section.size());
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(
+      HashCalculator::RawHashOfBytes(data, size, &hash, algorithm));
+  if (hash != brillo::Blob(section.hash().begin(), section.hash().end())) {
+    LOG(ERROR) << "The operations section of " << partition->partition_name()
+               << " doesn't match its hash.";
+    return false;
+  }
+  InstallOperations operations;
+  TEST_AND_RETURN_FALSE(operations.ParseFromArray(data, size));
+  TEST_AND_RETURN_FALSE(operations.operations_size() > 0 &&
+                        static_cast<uint64_t>(operations.operations_size()) ==
+                            section.num_operations());
+  for (InstallOperation& op : *operations.mutable_operations())
+    TEST_AND_RETURN_FALSE(UnpackOperationExtents(&op));
+  partition->mutable_operations()->Swap(operations.mutable_operations());
+  return true;
+}
+
+bool ParseOperationsSections(const uint8_t* blobs,
+                             size_t blobs_size,
+                             DeltaArchiveManifest* manifest) {
+  const HashAlgorithm algorithm = GetDataHashAlgorithm(*manifest);
+  for (PartitionUpdate& partition : *manifest->mutable_partitions()) {
+    if (!HasPendingOperationsSection(partition))
+      continue;
+    const PartitionUpdate::OperationsSection& section =
+        partition.operations_section();
+    TEST_AND_RETURN_FALSE(section.offset() <= blobs_size &&
+                          section.size() <= blobs_size - section.offset());
+    TEST_AND_RETURN_FALSE(ParseOperationsSection(
+        blobs + section.offset(), section.size(), algorithm, &partition));
+  }
+  return true;
+}
+
+bool MakeOperationsSection(uint64_t offset,
+                           HashAlgorithm algorithm,
+                           PartitionUpdate* partition,
+                           string* section) {
+  TEST_AND_RETURN_FALSE(partition->operations_size() > 0);
+  InstallOperations operations;
+  operations.mutable_operations()->Swap(partition->mutable_operations());
+  TEST_AND_RETURN_FALSE(operations.SerializeToString(section));
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
+      section->data(), section->size(), &hash, algorithm));
+
+  PartitionUpdate::OperationsSection* info =
+      partition->mutable_operations_section();
+  info->set_offset(offset);
+  info->set_size(section->size());
+  info->set_hash(hash.data(), hash.size());
+  info->set_num_operations(operations.operations_size());
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,66 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATIONS_SECTION_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATIONS_SECTION_H_
+
+#include <string>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/update_metadata.pb.h"
+
+// Since kOperationsSectionMinorPayloadVersion, the operations of a partition
+// may be in an operations section in the data blobs, right before the blobs
+// of the partition, instead of in the manifest. The manifest keeps their
+// number and the hash of the section, which is parsed once it is received,
+// just before applying the partition.
+
+namespace chromeos_update_engine {
+
+// Returns the number of operations of |partition|, counting those of its
+// operations section even if it wasn't parsed yet.
+uint64_t GetNumOperations(const PartitionUpdate& partition);
+
+// Returns whether the operations of |partition| are in an operations section
+// which wasn't parsed yet.
+bool HasPendingOperationsSection(const PartitionUpdate& partition);
+
+// Checks the |size| bytes at |data| against the hash with |algorithm| of the
+// operations section of |partition|, and sets the operations of |partition|
+// to those of the section, with their extents unpacked.
+bool ParseOperationsSection(const void* data,
+                            size_t size,
+                            HashAlgorithm algorithm,
+                            PartitionUpdate* partition);
+
+// Parses the operations sections of all the partitions of |manifest| from the
+// |blobs_size| bytes of data blobs at |blobs|, for the tools which have the
+// whole payload at hand.
+bool ParseOperationsSections(const uint8_t* blobs,
+                             size_t blobs_size,
+                             DeltaArchiveManifest* manifest);
+
+// Moves the operations of |partition|, which must have some, to a new
+// operations section stored at |offset| in the data blobs, whose bytes are
+// stored in |*section|.
+bool MakeOperationsSection(uint64_t offset,
+                           HashAlgorithm algorithm,
+                           PartitionUpdate* partition,
+                           std::string* section);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_OPERATIONS_SECTION_H_
@@ -0,0 +1,108 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/operations_section.h"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/packed_extents.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+PartitionUpdate MakePartition(size_t num_operations) {
+  PartitionUpdate partition;
+  partition.set_partition_name("system");
+  for (size_t i = 0; i < num_operations; i++) {
+    InstallOperation* op = partition.add_operations();
+    op->set_type(InstallOperation::REPLACE);
+    op->set_data_offset(i * 100);
+    op->set_data_length(100);
+    *op->add_dst_extents() = ExtentForRange(i * 10, 10);
+  }
+  return partition;
+}
+
+}  // namespace
+
+TEST(OperationsSectionTest, RoundTripTest) {
+  const PartitionUpdate expected = MakePartition(3);
+  PartitionUpdate partition = expected;
+  PackOperationExtents(partition.mutable_operations(0));
+  string section;
+  ASSERT_TRUE(MakeOperationsSection(
+      1234, HashAlgorithm::kSha256, &partition, &section));
+  EXPECT_EQ(0, partition.operations_size());
+  EXPECT_EQ(1234u, partition.operations_section().offset());
+  EXPECT_EQ(section.size(), partition.operations_section().size());
+  EXPECT_EQ(3u, GetNumOperations(partition));
+  EXPECT_TRUE(HasPendingOperationsSection(partition));
+
+  ASSERT_TRUE(ParseOperationsSection(
+      section.data(), section.size(), HashAlgorithm::kSha256, &partition));
+  EXPECT_FALSE(HasPendingOperationsSection(partition));
+  EXPECT_EQ(3u, GetNumOperations(partition));
+  ASSERT_EQ(expected.operations_size(), partition.operations_size());
+  for (int i = 0; i < expected.operations_size(); i++) {
+    EXPECT_EQ(expected.operations(i).SerializeAsString(),
+              partition.operations(i).SerializeAsString());
+  }
+}
+
+TEST(OperationsSectionTest, CorruptedSectionTest) {
+  PartitionUpdate partition = MakePartition(2);
+  string section;
+  ASSERT_TRUE(MakeOperationsSection(
+      0, HashAlgorithm::kBlake2b256, &partition, &section));
+  // The hash is computed with the algorithm of the payload.
+  PartitionUpdate copy = partition;
+  EXPECT_FALSE(ParseOperationsSection(
+      section.data(), section.size(), HashAlgorithm::kSha256, &copy));
+  section[0] ^= 1;
+  EXPECT_FALSE(ParseOperationsSection(
+      section.data(), section.size(), HashAlgorithm::kBlake2b256, &partition));
+  EXPECT_FALSE(ParseOperationsSection(section.data(),
+                                      section.size() - 1,
+                                      HashAlgorithm::kBlake2b256,
+                                      &partition));
+  EXPECT_TRUE(HasPendingOperationsSection(partition));
+}
+
+TEST(OperationsSectionTest, ParseManifestSectionsTest) {
+  DeltaArchiveManifest manifest;
+  *manifest.add_partitions() = MakePartition(2);
+  *manifest.add_partitions() = MakePartition(0);
+  manifest.mutable_partitions(1)->set_partition_name("vendor");
+  string section;
+  ASSERT_TRUE(MakeOperationsSection(
+      4, HashAlgorithm::kSha256, manifest.mutable_partitions(0), &section));
+  const string blobs = "blob" + section + "more";
+  // Sections past the end of the blobs are rejected.
+  EXPECT_FALSE(ParseOperationsSections(
+      reinterpret_cast<const uint8_t*>(blobs.data()), 4, &manifest));
+  ASSERT_TRUE(ParseOperationsSections(
+      reinterpret_cast<const uint8_t*>(blobs.data()), blobs.size(), &manifest));
+  EXPECT_EQ(2, manifest.partitions(0).operations_size());
+  EXPECT_EQ(0, manifest.partitions(1).operations_size());
+}
+
+}  // namespace chromeos_update_engine
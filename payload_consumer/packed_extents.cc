@@ -0,0 +1,151 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/packed_extents.h"
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+void AppendVarint(uint64_t value, string* out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+bool ReadVarint(const string& in, size_t* pos, uint64_t* value) {
+  *value = 0;
+  for (size_t shift = 0; shift < 64; shift += 7) {
+    TEST_AND_RETURN_FALSE(*pos < in.size());
+    const uint8_t byte = static_cast<uint8_t>(in[(*pos)++]);
+    // The tenth byte only holds the top bit.
+    TEST_AND_RETURN_FALSE(shift < 63 || byte <= 1);
+    *value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return true;
+  }
+  return false;
+}
+
+}  // namespace
+
+void PackExtents(const Extents& extents, string* packed) {
+  packed->clear();
+  AppendVarint(extents.size(), packed);
+  uint64_t end = 0;
+  for (const Extent& extent : extents) {
+    // The differences wrap around, so that any start block is encoded.
+    const int64_t delta = static_cast<int64_t>(extent.start_block() - end);
+    AppendVarint((static_cast<uint64_t>(delta) << 1) ^
+                     static_cast<uint64_t>(delta >> 63),
+                 packed);
+    AppendVarint(extent.num_blocks(), packed);
+    end = extent.start_block() + extent.num_blocks();
+  }
+}
+
+bool UnpackExtents(const string& packed, Extents* extents) {
+  extents->Clear();
+  size_t pos = 0;
+  uint64_t count;
+  TEST_AND_RETURN_FALSE(ReadVarint(packed, &pos, &count));
+  // Each extent takes at least two bytes, which bounds the allocation.
+  TEST_AND_RETURN_FALSE(count <= (packed.size() - pos) / 2);
+  extents->Reserve(count);
+  uint64_t end = 0;
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t zigzag, num_blocks;
+    TEST_AND_RETURN_FALSE(ReadVarint(packed, &pos, &zigzag));
+    TEST_AND_RETURN_FALSE(ReadVarint(packed, &pos, &num_blocks));
+    const uint64_t delta = (zigzag >> 1) ^ (0 - (zigzag & 1));
+    Extent* extent = extents->Add();
+    extent->set_start_block(end + delta);
+    extent->set_num_blocks(num_blocks);
+    end = extent->start_block() + num_blocks;
+  }
+  TEST_AND_RETURN_FALSE(pos == packed.size());
+  return true;
+}
+
+void PackOperationExtents(InstallOperation* operation) {
+  if (operation->src_extents_size() > 0) {
+    PackExtents(operation->src_extents(),
+                operation->mutable_packed_src_extents());
+    operation->clear_src_extents();
+  }
+  if (operation->dst_extents_size() > 0) {
+    PackExtents(operation->dst_extents(),
+                operation->mutable_packed_dst_extents());
+    operation->clear_dst_extents();
+  }
+}
+
+void PackManifestExtents(DeltaArchiveManifest* manifest) {
+  for (auto& partition : *manifest->mutable_partitions()) {
+    for (auto& operation : *partition.mutable_operations())
+      PackOperationExtents(&operation);
+  }
+}
+
+bool UnpackOperationExtents(InstallOperation* operation) {
+  if (operation->has_packed_src_extents()) {
+    TEST_AND_RETURN_FALSE(operation->src_extents_size() == 0);
+    TEST_AND_RETURN_FALSE(UnpackExtents(operation->packed_src_extents(),
+                                        operation->mutable_src_extents()));
+    operation->clear_packed_src_extents();
+  }
+  if (operation->has_packed_dst_extents()) {
+    TEST_AND_RETURN_FALSE(operation->dst_extents_size() == 0);
+    TEST_AND_RETURN_FALSE(UnpackExtents(operation->packed_dst_extents(),
+                                        operation->mutable_dst_extents()));
+    operation->clear_packed_dst_extents();
+  }
+  return true;
+}
+
+bool UnpackManifestExtents(DeltaArchiveManifest* manifest) {
+  for (auto& partition : *manifest->mutable_partitions()) {
+    for (auto& operation : *partition.mutable_operations()) {
+      if (!UnpackOperationExtents(&operation)) {
+        LOG(ERROR) << "Invalid packed extents in partition "
+                   << partition.partition_name();
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool HasPackedExtents(const DeltaArchiveManifest& manifest) {
+  for (const auto& partition : manifest.partitions()) {
+    for (const auto& operation : partition.operations()) {
+      if (operation.has_packed_src_extents() ||
+          operation.has_packed_dst_extents())
+        return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace chromeos_update_engine
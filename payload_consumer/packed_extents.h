@@ -0,0 +1,62 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PACKED_EXTENTS_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PACKED_EXTENTS_H_
+
+#include <string>
+
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+// Since kPackedExtentsMinorPayloadVersion, the extents of the operations are
+// in InstallOperation.packed_src_extents and packed_dst_extents instead of
+// src_extents and dst_extents: the number of extents as a varint, followed
+// for each extent by the difference between its start block and the end of
+// the previous one, zigzag encoded, and its number of blocks, both varints.
+// The extents of an operation mostly follow each other closely, which makes
+// these a few bytes each instead of the Extent messages.
+
+namespace chromeos_update_engine {
+
+using Extents = google::protobuf::RepeatedPtrField<Extent>;
+
+// Encodes |extents| into |*packed|.
+void PackExtents(const Extents& extents, std::string* packed);
+
+// Decodes the extents encoded in |packed| into |*extents|. Returns false if
+// |packed| isn't a valid encoding.
+bool UnpackExtents(const std::string& packed, Extents* extents);
+
+// Moves the src_extents and dst_extents of |operation|, or of all the
+// operations of |manifest|, to their packed fields.
+void PackOperationExtents(InstallOperation* operation);
+void PackManifestExtents(DeltaArchiveManifest* manifest);
+
+// Moves the packed extents of |operation|, or of all the operations of
+// |manifest|, back to src_extents and dst_extents, for the rest of the code to
+// use. Operations without packed extents are left alone. Returns false if the
+// packed extents are invalid, or an operation has both kinds of extents.
+bool UnpackOperationExtents(InstallOperation* operation);
+bool UnpackManifestExtents(DeltaArchiveManifest* manifest);
+
+// Whether an operation of |manifest| has packed extents.
+bool HasPackedExtents(const DeltaArchiveManifest& manifest);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PACKED_EXTENTS_H_
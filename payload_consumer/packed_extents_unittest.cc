@@ -0,0 +1,132 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/packed_extents.h"
+
+#include <limits>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+Extents MakeExtents(std::initializer_list<Extent> list) {
+  Extents extents;
+  for (const Extent& extent : list)
+    *extents.Add() = extent;
+  return extents;
+}
+
+void ExpectExtentsEq(const Extents& expected, const Extents& actual) {
+  ASSERT_EQ(expected.size(), actual.size());
+  for (int i = 0; i < expected.size(); i++)
+    EXPECT_EQ(expected[i], actual[i]) << "extent " << i;
+}
+
+}  // namespace
+
+TEST(PackedExtentsTest, RoundTripTest) {
+  constexpr uint64_t kMax = std::numeric_limits<uint64_t>::max();
+  const Extents extents = MakeExtents({ExtentForRange(10, 5),
+                                       ExtentForRange(16, 1),
+                                       ExtentForRange(3, 2),
+                                       ExtentForRange(1ULL << 40, 1 << 20),
+                                       ExtentForRange(0, 0),
+                                       ExtentForRange(kMax, 1)});
+  string packed;
+  PackExtents(extents, &packed);
+  Extents unpacked;
+  ASSERT_TRUE(UnpackExtents(packed, &unpacked));
+  ExpectExtentsEq(extents, unpacked);
+
+  PackExtents({}, &packed);
+  EXPECT_EQ(string(1, '\0'), packed);
+  ASSERT_TRUE(UnpackExtents(packed, &unpacked));
+  EXPECT_EQ(0, unpacked.size());
+}
+
+TEST(PackedExtentsTest, SmallerThanExtentsTest) {
+  Extents extents;
+  for (uint64_t block = 100000; block < 200000; block += 100)
+    *extents.Add() = ExtentForRange(block, 90);
+  string packed;
+  PackExtents(extents, &packed);
+  InstallOperation op;
+  *op.mutable_dst_extents() = extents;
+  // Two bytes per extent after the first one, instead of eight.
+  EXPECT_EQ(2 + 4 + 999u * 2, packed.size());
+  EXPECT_LT(packed.size() * 2, op.ByteSizeLong());
+}
+
+TEST(PackedExtentsTest, InvalidTest) {
+  string packed;
+  PackExtents(MakeExtents({ExtentForRange(10, 5), ExtentForRange(20, 5)}),
+              &packed);
+  Extents unpacked;
+  // Truncated, with trailing bytes, or with too many extents.
+  EXPECT_FALSE(UnpackExtents(packed.substr(0, packed.size() - 1), &unpacked));
+  EXPECT_FALSE(UnpackExtents(packed + '\0', &unpacked));
+  packed[0] = 100;
+  EXPECT_FALSE(UnpackExtents(packed, &unpacked));
+  EXPECT_FALSE(UnpackExtents("", &unpacked));
+  // A varint longer than 64 bits.
+  EXPECT_FALSE(UnpackExtents(string("\x01") + string(10, '\xff') + '\x01' +
+                                 '\x01',
+                             &unpacked));
+}
+
+TEST(PackedExtentsTest, ManifestTest) {
+  DeltaArchiveManifest manifest;
+  PartitionUpdate* partition = manifest.add_partitions();
+  partition->set_partition_name("system");
+  InstallOperation* copy = partition->add_operations();
+  copy->set_type(InstallOperation::SOURCE_COPY);
+  *copy->add_src_extents() = ExtentForRange(40, 8);
+  *copy->add_dst_extents() = ExtentForRange(0, 4);
+  *copy->add_dst_extents() = ExtentForRange(8, 4);
+  InstallOperation* zero = partition->add_operations();
+  zero->set_type(InstallOperation::ZERO);
+  *zero->add_dst_extents() = ExtentForRange(20, 100);
+  const DeltaArchiveManifest original = manifest;
+
+  PackManifestExtents(&manifest);
+  EXPECT_EQ(0, copy->src_extents_size());
+  EXPECT_EQ(0, copy->dst_extents_size());
+  EXPECT_TRUE(copy->has_packed_src_extents());
+  EXPECT_FALSE(zero->has_packed_src_extents());
+  EXPECT_TRUE(zero->has_packed_dst_extents());
+
+  ASSERT_TRUE(UnpackManifestExtents(&manifest));
+  EXPECT_EQ(original.SerializeAsString(), manifest.SerializeAsString());
+  // Manifests without packed extents are left alone.
+  ASSERT_TRUE(UnpackManifestExtents(&manifest));
+  EXPECT_EQ(original.SerializeAsString(), manifest.SerializeAsString());
+}
+
+TEST(PackedExtentsTest, BothKindsOfExtentsTest) {
+  InstallOperation op;
+  *op.add_dst_extents() = ExtentForRange(0, 4);
+  PackExtents(op.dst_extents(), op.mutable_packed_dst_extents());
+  EXPECT_FALSE(UnpackOperationExtents(&op));
+}
+
+}  // namespace chromeos_update_engine
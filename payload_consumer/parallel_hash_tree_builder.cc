@@ -0,0 +1,361 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/parallel_hash_tree_builder.h"
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+size_t RoundUpToPowerOfTwo(size_t n) {
+  size_t result = 1;
+  while (result < n) {
+    result <<= 1;
+  }
+  return result;
+}
+}  // namespace
+
+ParallelHashTreeBuilder::ParallelHashTreeBuilder(size_t block_size,
+                                                 const EVP_MD* md,
+                                                 size_t num_threads)
+    : block_size_(block_size),
+      md_(md),
+      digest_size_(EVP_MD_size(md)),
+      digest_stride_(RoundUpToPowerOfTwo(digest_size_)),
+      pool_(num_threads) {
+  CHECK_LT(digest_stride_ * 2, block_size_);
+}
+
+uint64_t ParallelHashTreeBuilder::CalculateSize(uint64_t data_size) const {
+  uint64_t total = 0;
+  uint64_t level_size = data_size;
+  do {
+    level_size =
+        utils::RoundUp(level_size / block_size_ * digest_stride_, block_size_);
+    total += level_size;
+  } while (level_size > block_size_);
+  return total;
+}
+
+bool ParallelHashTreeBuilder::Initialize(uint64_t data_size,
+                                         const brillo::Blob& salt) {
+  if (data_size == 0 || data_size % block_size_ != 0) {
+    LOG(ERROR) << "Invalid verity data size " << data_size
+               << " for block size " << block_size_;
+    return false;
+  }
+  data_size_ = data_size;
+  salt_ = salt;
+  blocks_hashed_ = 0;
+  leftover_.clear();
+  levels_.clear();
+  from_tree_ = false;
+  dirty_leaves_.clear();
+  hashed_blocks_.clear();
+  // Digests are written straight into the zero filled base level, so that it
+  // only needs to be padded if some data is missing.
+  levels_.emplace_back(
+      utils::RoundUp(data_size / block_size_ * digest_stride_, block_size_));
+  return true;
+}
+
+bool ParallelHashTreeBuilder::InitializeFromTree(const brillo::Blob& tree) {
+  TEST_AND_RETURN_FALSE(levels_.size() == 1 && blocks_hashed_ == 0);
+  if (tree.size() != CalculateSize(data_size_)) {
+    LOG(WARNING) << "Hash tree of " << tree.size() << " bytes instead of "
+                 << CalculateSize(data_size_);
+    return false;
+  }
+  vector<uint64_t> level_sizes;
+  uint64_t level_size = data_size_;
+  do {
+    level_size =
+        utils::RoundUp(level_size / block_size_ * digest_stride_, block_size_);
+    level_sizes.push_back(level_size);
+  } while (level_size > block_size_);
+  // The root level comes first on disk.
+  vector<brillo::Blob> levels(level_sizes.size());
+  uint64_t offset = tree.size();
+  for (size_t i = 0; i < levels.size(); i++) {
+    offset -= level_sizes[i];
+    levels[i].assign(tree.begin() + offset,
+                     tree.begin() + offset + level_sizes[i]);
+  }
+  for (size_t i = 0; i + 1 < levels.size(); i++) {
+    brillo::Blob next_level(levels[i + 1].size());
+    TEST_AND_RETURN_FALSE(HashBlocks(
+        levels[i].data(), levels[i].size() / block_size_, next_level.data()));
+    if (next_level != levels[i + 1]) {
+      LOG(WARNING) << "Level " << i + 1 << " of the hash tree doesn't match "
+                   << "the level below";
+      return false;
+    }
+  }
+  levels_ = std::move(levels);
+  from_tree_ = true;
+  dirty_leaves_.assign(levels_[0].size() / block_size_, false);
+  return true;
+}
+
+bool ParallelHashTreeBuilder::SkipBlocks(uint64_t num_blocks) {
+  TEST_AND_RETURN_FALSE(from_tree_ && leftover_.empty());
+  TEST_AND_RETURN_FALSE(blocks_hashed_ + num_blocks <=
+                        data_size_ / block_size_);
+  blocks_hashed_ += num_blocks;
+  return true;
+}
+
+bool ParallelHashTreeBuilder::CheckBlock(uint64_t block,
+                                         const uint8_t* data) const {
+  TEST_AND_RETURN_FALSE(from_tree_ && block < data_size_ / block_size_);
+  brillo::Blob digest(digest_stride_);
+  TEST_AND_RETURN_FALSE(HashBlocksOnThisThread(data, 1, digest.data()));
+  return std::equal(digest.begin(),
+                    digest.begin() + digest_size_,
+                    levels_[0].begin() + block * digest_stride_);
+}
+
+bool ParallelHashTreeBuilder::Update(const uint8_t* data, size_t size) {
+  TEST_AND_RETURN_FALSE(levels_.size() == 1 || from_tree_);
+  TEST_AND_RETURN_FALSE(hashed_blocks_.empty());
+  if (!leftover_.empty()) {
+    const size_t append_size = std::min(size, block_size_ - leftover_.size());
+    leftover_.insert(leftover_.end(), data, data + append_size);
+    data += append_size;
+    size -= append_size;
+    if (leftover_.size() < block_size_) {
+      return true;
+    }
+    brillo::Blob block = std::move(leftover_);
+    leftover_.clear();
+    TEST_AND_RETURN_FALSE(Update(block.data(), block.size()));
+  }
+  const size_t num_blocks = size / block_size_;
+  if (blocks_hashed_ + num_blocks > data_size_ / block_size_) {
+    LOG(ERROR) << "Verity data is larger than the expected " << data_size_
+               << " bytes.";
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(
+      HashBlocks(data,
+                 num_blocks,
+                 levels_[0].data() + blocks_hashed_ * digest_stride_));
+  if (from_tree_ && num_blocks > 0) {
+    const size_t digests_per_block = block_size_ / digest_stride_;
+    std::fill(dirty_leaves_.begin() + blocks_hashed_ / digests_per_block,
+              dirty_leaves_.begin() +
+                  (blocks_hashed_ + num_blocks - 1) / digests_per_block + 1,
+              true);
+  }
+  blocks_hashed_ += num_blocks;
+  const size_t remaining = size % block_size_;
+  leftover_.assign(data + size - remaining, data + size);
+  return true;
+}
+
+bool ParallelHashTreeBuilder::UpdateBlocksAt(uint64_t block,
+                                             const uint8_t* data,
+                                             size_t num_blocks) {
+  TEST_AND_RETURN_FALSE(levels_.size() == 1 && !from_tree_);
+  TEST_AND_RETURN_FALSE(block + num_blocks <= data_size_ / block_size_);
+  // The digests go to their own place in the base level, only the bitmap is
+  // shared between the threads.
+  TEST_AND_RETURN_FALSE(HashBlocksOnThisThread(
+      data, num_blocks, levels_[0].data() + block * digest_stride_));
+  std::lock_guard<std::mutex> lock(hashed_blocks_mutex_);
+  TEST_AND_RETURN_FALSE(leftover_.empty() &&
+                        (!hashed_blocks_.empty() || blocks_hashed_ == 0));
+  if (hashed_blocks_.empty())
+    hashed_blocks_.assign(data_size_ / block_size_, false);
+  for (uint64_t i = block; i < block + num_blocks; i++) {
+    if (!hashed_blocks_[i]) {
+      hashed_blocks_[i] = true;
+      blocks_hashed_++;
+    }
+  }
+  return true;
+}
+
+bool ParallelHashTreeBuilder::ZeroBlocksAt(uint64_t block,
+                                           uint64_t num_blocks) {
+  TEST_AND_RETURN_FALSE(block + num_blocks <= data_size_ / block_size_);
+  if (num_blocks == 0)
+    return true;
+  // Every block of zeros has the same digest.
+  const brillo::Blob zeros(block_size_);
+  TEST_AND_RETURN_FALSE(UpdateBlocksAt(block, zeros.data(), 1));
+  const uint8_t* digest = levels_[0].data() + block * digest_stride_;
+  for (uint64_t i = block + 1; i < block + num_blocks; i++) {
+    std::copy(digest,
+              digest + digest_stride_,
+              levels_[0].data() + i * digest_stride_);
+  }
+  std::lock_guard<std::mutex> lock(hashed_blocks_mutex_);
+  for (uint64_t i = block + 1; i < block + num_blocks; i++) {
+    if (!hashed_blocks_[i]) {
+      hashed_blocks_[i] = true;
+      blocks_hashed_++;
+    }
+  }
+  return true;
+}
+
+vector<Extent> ParallelHashTreeBuilder::GetMissingBlocks() const {
+  std::lock_guard<std::mutex> lock(hashed_blocks_mutex_);
+  const uint64_t num_blocks = data_size_ / block_size_;
+  if (hashed_blocks_.empty())
+    return {ExtentForRange(0, num_blocks)};
+  vector<Extent> missing;
+  for (uint64_t first = 0; first < num_blocks;) {
+    if (hashed_blocks_[first]) {
+      first++;
+      continue;
+    }
+    uint64_t last = first;
+    while (last < num_blocks && !hashed_blocks_[last])
+      last++;
+    missing.push_back(ExtentForRange(first, last - first));
+    first = last;
+  }
+  return missing;
+}
+
+bool ParallelHashTreeBuilder::BuildHashTree() {
+  TEST_AND_RETURN_FALSE(levels_.size() == 1 || from_tree_);
+  if (!leftover_.empty()) {
+    LOG(ERROR) << leftover_.size() << " bytes data left from last Update().";
+    return false;
+  }
+  if (blocks_hashed_ * block_size_ != data_size_) {
+    LOG(ERROR) << "Only " << blocks_hashed_ * block_size_ << " of "
+               << data_size_ << " bytes of verity data were hashed.";
+    return false;
+  }
+  if (from_tree_) {
+    // Only the blocks above updated digests change, one run of consecutive
+    // ones at a time.
+    const size_t digests_per_block = block_size_ / digest_stride_;
+    vector<bool> dirty = std::move(dirty_leaves_);
+    dirty_leaves_.clear();
+    for (size_t i = 0; i + 1 < levels_.size(); i++) {
+      vector<bool> next_dirty(levels_[i + 1].size() / block_size_, false);
+      for (size_t first = 0; first < dirty.size();) {
+        if (!dirty[first]) {
+          first++;
+          continue;
+        }
+        size_t last = first;
+        while (last < dirty.size() && dirty[last])
+          last++;
+        TEST_AND_RETURN_FALSE(
+            HashBlocks(levels_[i].data() + first * block_size_,
+                       last - first,
+                       levels_[i + 1].data() + first * digest_stride_));
+        std::fill(next_dirty.begin() + first / digests_per_block,
+                  next_dirty.begin() + (last - 1) / digests_per_block + 1,
+                  true);
+        first = last;
+      }
+      dirty = std::move(next_dirty);
+    }
+    return true;
+  }
+  while (levels_.back().size() > block_size_) {
+    const size_t num_blocks = levels_.back().size() / block_size_;
+    brillo::Blob next_level(
+        utils::RoundUp(num_blocks * digest_stride_, block_size_));
+    TEST_AND_RETURN_FALSE(
+        HashBlocks(levels_.back().data(), num_blocks, next_level.data()));
+    levels_.push_back(std::move(next_level));
+  }
+  return true;
+}
+
+bool ParallelHashTreeBuilder::GetRootDigest(brillo::Blob* digest) const {
+  TEST_AND_RETURN_FALSE(!levels_.empty() &&
+                        levels_.back().size() == block_size_);
+  brillo::Blob root(digest_stride_);
+  TEST_AND_RETURN_FALSE(
+      HashBlocksOnThisThread(levels_.back().data(), 1, root.data()));
+  root.resize(digest_size_);
+  *digest = std::move(root);
+  return true;
+}
+
+bool ParallelHashTreeBuilder::WriteHashTree(
+    const std::function<bool(const void*, size_t)>& callback) const {
+  TEST_AND_RETURN_FALSE(!levels_.empty());
+  for (auto it = levels_.rbegin(); it != levels_.rend(); ++it) {
+    TEST_AND_RETURN_FALSE(callback(it->data(), it->size()));
+  }
+  return true;
+}
+
+bool ParallelHashTreeBuilder::HashBlocks(const uint8_t* data,
+                                         size_t num_blocks,
+                                         uint8_t* out) {
+  const size_t num_slices =
+      std::min<size_t>(pool_.num_threads(),
+                       utils::DivRoundUp(num_blocks, kMinBlocksPerThread));
+  if (num_slices <= 1) {
+    return HashBlocksOnThisThread(data, num_blocks, out);
+  }
+  const size_t slice_blocks = utils::DivRoundUp(num_blocks, num_slices);
+  return pool_.Run(num_slices, [&](size_t slice) {
+    const size_t first = std::min(slice * slice_blocks, num_blocks);
+    const size_t last = std::min(first + slice_blocks, num_blocks);
+    return HashBlocksOnThisThread(
+        data + first * block_size_, last - first, out + first * digest_stride_);
+  });
+}
+
+bool ParallelHashTreeBuilder::HashBlocksOnThisThread(const uint8_t* data,
+                                                     size_t num_blocks,
+                                                     uint8_t* out) const {
+  if (num_blocks == 0) {
+    return true;
+  }
+  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+  TEST_AND_RETURN_FALSE(ctx != nullptr);
+  int ret = 1;
+  for (size_t i = 0; i < num_blocks && ret == 1; i++) {
+    unsigned int digest_size = 0;
+    ret &= EVP_DigestInit_ex(ctx, md_, nullptr);
+    ret &= EVP_DigestUpdate(ctx, salt_.data(), salt_.size());
+    ret &= EVP_DigestUpdate(ctx, data + i * block_size_, block_size_);
+    ret &= EVP_DigestFinal_ex(ctx, out + i * digest_stride_, &digest_size);
+    ret &= digest_size == digest_size_;
+    // The padding after each digest is already zero.
+  }
+  EVP_MD_CTX_free(ctx);
+  if (ret != 1) {
+    LOG(ERROR) << "Failed to compute verity hash tree digests.";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
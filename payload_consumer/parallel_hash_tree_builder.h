@@ -0,0 +1,143 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PARALLEL_HASH_TREE_BUILDER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PARALLEL_HASH_TREE_BUILDER_H_
+
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+#include <openssl/evp.h>
+
+#include "update_engine/payload_consumer/fork_join_pool.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Builds a dm-verity hash tree, with the same layout and output as
+// HashTreeBuilder from libverity_tree, but hashes the blocks of each Update()
+// and of each tree level on a pool of threads. Digests are computed with
+// BoringSSL, which uses the ARMv8 crypto extensions or SHA-NI when the CPU
+// has them.
+class ParallelHashTreeBuilder {
+ public:
+  // Batches smaller than this many blocks are hashed on the calling thread.
+  static constexpr size_t kMinBlocksPerThread = 16;
+
+  // |num_threads| includes the calling thread.
+  ParallelHashTreeBuilder(size_t block_size,
+                          const EVP_MD* md,
+                          size_t num_threads);
+
+  // Returns the size of the hash tree of |data_size| bytes of data.
+  uint64_t CalculateSize(uint64_t data_size) const;
+
+  // Prepares to hash |data_size| bytes, which must be a multiple of the block
+  // size, with |salt| prepended to every block.
+  bool Initialize(uint64_t data_size, const brillo::Blob& salt);
+
+  // Starts from |tree|, the hash tree of data of the same size laid out as on
+  // disk, once Initialize() was called. Checks that its upper levels match its
+  // leaves, leaving the builder as it was otherwise. The digests of the data
+  // blocks passed to SkipBlocks() are then kept from |tree|, and
+  // BuildHashTree() only hashes again the tree blocks above updated digests.
+  bool InitializeFromTree(const brillo::Blob& tree);
+
+  // Hashes the next |size| bytes of data. |size| doesn't have to be a multiple
+  // of the block size.
+  bool Update(const uint8_t* data, size_t size);
+
+  // Keeps the digests of the next |num_blocks| data blocks from the tree
+  // passed to InitializeFromTree(), instead of hashing them.
+  bool SkipBlocks(uint64_t num_blocks);
+
+  // Returns whether the digest of data block |block| in the tree passed to
+  // InitializeFromTree() is the one of the block at |data|.
+  bool CheckBlock(uint64_t block, const uint8_t* data) const;
+
+  // Hashes the |num_blocks| data blocks at |data| as data blocks |block|
+  // onwards, for data which comes out of order, once Initialize() was called.
+  // Blocks passed again get the digest of their last data. Hashes on the
+  // calling thread, and may be called from several threads at once, but not
+  // together with Update().
+  bool UpdateBlocksAt(uint64_t block, const uint8_t* data, size_t num_blocks);
+
+  // Same, for |num_blocks| data blocks of zeros.
+  bool ZeroBlocksAt(uint64_t block, uint64_t num_blocks);
+
+  // Returns the runs of data blocks not passed to UpdateBlocksAt() or
+  // ZeroBlocksAt() yet, all of them if neither was called.
+  std::vector<Extent> GetMissingBlocks() const;
+
+  // Builds the upper levels of the tree once all the data has been passed to
+  // Update(), or to UpdateBlocksAt() and ZeroBlocksAt().
+  bool BuildHashTree();
+
+  // Returns in |*digest| the root digest of the tree, the one of its top
+  // block, once BuildHashTree() was called.
+  bool GetRootDigest(brillo::Blob* digest) const;
+
+  // Passes the tree to |callback|, one level at a time, root level first, as
+  // it is laid out on disk.
+  bool WriteHashTree(
+      const std::function<bool(const void*, size_t)>& callback) const;
+
+ private:
+  // Writes the digests of the |num_blocks| blocks at |data| to |out|,
+  // |digest_stride_| bytes apart, spreading the work across the pool.
+  bool HashBlocks(const uint8_t* data, size_t num_blocks, uint8_t* out);
+  // Hashes the blocks on the calling thread.
+  bool HashBlocksOnThisThread(const uint8_t* data,
+                              size_t num_blocks,
+                              uint8_t* out) const;
+
+  const size_t block_size_;
+  const EVP_MD* const md_;
+  const size_t digest_size_;
+  // |digest_size_| rounded up to a power of two.
+  const size_t digest_stride_;
+
+  brillo::Blob salt_;
+  uint64_t data_size_{0};
+  // Number of data blocks hashed so far.
+  uint64_t blocks_hashed_{0};
+  // Data of a partial block from the last Update().
+  brillo::Blob leftover_;
+  // The levels of the tree, leaves first. Each one is padded to a multiple of
+  // the block size.
+  std::vector<brillo::Blob> levels_;
+
+  // Set by InitializeFromTree(), and the leaf blocks with digests updated
+  // since.
+  bool from_tree_{false};
+  std::vector<bool> dirty_leaves_;
+
+  // The data blocks passed to UpdateBlocksAt() and ZeroBlocksAt(), whose
+  // count is |blocks_hashed_|. Empty until one of them is called.
+  mutable std::mutex hashed_blocks_mutex_;
+  std::vector<bool> hashed_blocks_;
+
+  ForkJoinPool pool_;
+
+  DISALLOW_COPY_AND_ASSIGN(ParallelHashTreeBuilder);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PARALLEL_HASH_TREE_BUILDER_H_
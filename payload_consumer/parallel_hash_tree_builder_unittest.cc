@@ -0,0 +1,202 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/parallel_hash_tree_builder.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+#include <verity/hash_tree_builder.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Small blocks give trees with several levels without needing much data.
+constexpr size_t kBlockSize = 1024;
+
+// Returns the hash tree |builder| writes.
+template <typename Builder>
+bool GetHashTree(Builder* builder, brillo::Blob* tree) {
+  return builder->WriteHashTree([tree](const void* data, size_t size) {
+    const auto bytes = static_cast<const uint8_t*>(data);
+    tree->insert(tree->end(), bytes, bytes + size);
+    return true;
+  });
+}
+}  // namespace
+
+class ParallelHashTreeBuilderTest : public ::testing::Test {
+ protected:
+  // Checks that ParallelHashTreeBuilder gives the same tree and root digest as
+  // libverity for |data|, passed to Update() |update_size| bytes at a time.
+  void TestMatchesHashTreeBuilder(const std::string& algorithm,
+                                  const brillo::Blob& salt,
+                                  const brillo::Blob& data,
+                                  size_t update_size,
+                                  size_t num_threads) {
+    const EVP_MD* md = HashTreeBuilder::HashFunction(algorithm);
+    ASSERT_NE(nullptr, md);
+
+    HashTreeBuilder expected_builder(kBlockSize, md);
+    ASSERT_TRUE(expected_builder.Initialize(data.size(), salt));
+    ASSERT_TRUE(expected_builder.Update(data.data(), data.size()));
+    ASSERT_TRUE(expected_builder.BuildHashTree());
+    brillo::Blob expected;
+    ASSERT_TRUE(GetHashTree(&expected_builder, &expected));
+
+    ParallelHashTreeBuilder builder(kBlockSize, md, num_threads);
+    ASSERT_TRUE(builder.Initialize(data.size(), salt));
+    for (size_t offset = 0; offset < data.size(); offset += update_size) {
+      const size_t size = std::min(update_size, data.size() - offset);
+      ASSERT_TRUE(builder.Update(data.data() + offset, size));
+    }
+    ASSERT_TRUE(builder.BuildHashTree());
+    brillo::Blob tree;
+    ASSERT_TRUE(GetHashTree(&builder, &tree));
+
+    ASSERT_EQ(expected, tree);
+    ASSERT_EQ(expected_builder.CalculateSize(data.size()), tree.size());
+    ASSERT_EQ(tree.size(), builder.CalculateSize(data.size()));
+
+    brillo::Blob root_digest;
+    ASSERT_TRUE(builder.GetRootDigest(&root_digest));
+    ASSERT_EQ(brillo::Blob(expected_builder.root_hash().begin(),
+                           expected_builder.root_hash().end()),
+              root_digest);
+  }
+
+  brillo::Blob salt_{0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef};
+};
+
+TEST_F(ParallelHashTreeBuilderTest, SingleBlockTest) {
+  brillo::Blob data(kBlockSize);
+  test_utils::FillWithData(&data);
+  TestMatchesHashTreeBuilder("sha256", salt_, data, data.size(), 4);
+}
+
+TEST_F(ParallelHashTreeBuilderTest, MultipleLevelsSHA256Test) {
+  // Three levels of 32 digests per block.
+  brillo::Blob data(2000 * kBlockSize);
+  test_utils::FillWithData(&data);
+  TestMatchesHashTreeBuilder("sha256", salt_, data, data.size(), 4);
+}
+
+TEST_F(ParallelHashTreeBuilderTest, MultipleLevelsSHA1Test) {
+  brillo::Blob data(2000 * kBlockSize);
+  test_utils::FillWithData(&data);
+  TestMatchesHashTreeBuilder("sha1", salt_, data, data.size(), 4);
+}
+
+TEST_F(ParallelHashTreeBuilderTest, NoSaltTest) {
+  brillo::Blob data(300 * kBlockSize);
+  test_utils::FillWithData(&data);
+  TestMatchesHashTreeBuilder("sha256", {}, data, data.size(), 3);
+}
+
+TEST_F(ParallelHashTreeBuilderTest, UnalignedUpdatesTest) {
+  brillo::Blob data(1000 * kBlockSize);
+  test_utils::FillWithData(&data);
+  TestMatchesHashTreeBuilder("sha256", salt_, data, 100, 4);
+  TestMatchesHashTreeBuilder("sha256", salt_, data, 70 * kBlockSize + 1, 4);
+}
+
+TEST_F(ParallelHashTreeBuilderTest, SingleThreadTest) {
+  brillo::Blob data(500 * kBlockSize);
+  test_utils::FillWithData(&data);
+  TestMatchesHashTreeBuilder("sha256", salt_, data, data.size(), 1);
+}
+
+TEST_F(ParallelHashTreeBuilderTest, InitializeUnalignedSizeFailsTest) {
+  ParallelHashTreeBuilder builder(
+      kBlockSize, HashTreeBuilder::HashFunction("sha256"), 2);
+  ASSERT_FALSE(builder.Initialize(kBlockSize + 1, salt_));
+  ASSERT_FALSE(builder.Initialize(0, salt_));
+}
+
+TEST_F(ParallelHashTreeBuilderTest, MissingDataFailsTest) {
+  brillo::Blob data(10 * kBlockSize + 100);
+  ParallelHashTreeBuilder builder(
+      kBlockSize, HashTreeBuilder::HashFunction("sha256"), 2);
+  ASSERT_TRUE(builder.Initialize(11 * kBlockSize, salt_));
+  ASSERT_TRUE(builder.Update(data.data(), data.size()));
+  ASSERT_FALSE(builder.BuildHashTree());
+}
+
+TEST_F(ParallelHashTreeBuilderTest, OutOfOrderBlocksTest) {
+  brillo::Blob data(2000 * kBlockSize);
+  test_utils::FillWithData(&data);
+  std::fill(
+      data.begin() + 100 * kBlockSize, data.begin() + 400 * kBlockSize, 0);
+  const EVP_MD* md = HashTreeBuilder::HashFunction("sha256");
+  HashTreeBuilder expected_builder(kBlockSize, md);
+  ASSERT_TRUE(expected_builder.Initialize(data.size(), salt_));
+  ASSERT_TRUE(expected_builder.Update(data.data(), data.size()));
+  ASSERT_TRUE(expected_builder.BuildHashTree());
+  brillo::Blob expected;
+  ASSERT_TRUE(GetHashTree(&expected_builder, &expected));
+
+  ParallelHashTreeBuilder builder(kBlockSize, md, 4);
+  ASSERT_TRUE(builder.Initialize(data.size(), salt_));
+  EXPECT_EQ(std::vector<Extent>{ExtentForRange(0, 2000)},
+            builder.GetMissingBlocks());
+  // The last blocks first, some of them written twice.
+  const brillo::Blob garbage(50 * kBlockSize, 0xff);
+  ASSERT_TRUE(builder.UpdateBlocksAt(1500, garbage.data(), 50));
+  ASSERT_TRUE(builder.UpdateBlocksAt(
+      1000, data.data() + 1000 * kBlockSize, 1000));
+  ASSERT_TRUE(builder.ZeroBlocksAt(100, 300));
+  EXPECT_EQ(
+      (std::vector<Extent>{ExtentForRange(0, 100), ExtentForRange(400, 600)}),
+      builder.GetMissingBlocks());
+  ASSERT_FALSE(builder.BuildHashTree());
+  ASSERT_TRUE(builder.UpdateBlocksAt(0, data.data(), 100));
+  ASSERT_TRUE(
+      builder.UpdateBlocksAt(400, data.data() + 400 * kBlockSize, 600));
+  EXPECT_TRUE(builder.GetMissingBlocks().empty());
+  ASSERT_TRUE(builder.BuildHashTree());
+  brillo::Blob tree;
+  ASSERT_TRUE(GetHashTree(&builder, &tree));
+  ASSERT_EQ(expected, tree);
+}
+
+TEST_F(ParallelHashTreeBuilderTest, OutOfOrderBlocksPastEndFailsTest) {
+  brillo::Blob data(2 * kBlockSize);
+  ParallelHashTreeBuilder builder(
+      kBlockSize, HashTreeBuilder::HashFunction("sha256"), 2);
+  ASSERT_TRUE(builder.Initialize(10 * kBlockSize, salt_));
+  ASSERT_FALSE(builder.UpdateBlocksAt(9, data.data(), 2));
+  ASSERT_FALSE(builder.ZeroBlocksAt(5, 6));
+  // Not to be mixed with Update().
+  ASSERT_TRUE(builder.UpdateBlocksAt(0, data.data(), 2));
+  ASSERT_FALSE(builder.Update(data.data(), data.size()));
+}
+
+TEST_F(ParallelHashTreeBuilderTest, TooMuchDataFailsTest) {
+  brillo::Blob data(11 * kBlockSize);
+  ParallelHashTreeBuilder builder(
+      kBlockSize, HashTreeBuilder::HashFunction("sha256"), 2);
+  ASSERT_TRUE(builder.Initialize(10 * kBlockSize, salt_));
+  ASSERT_FALSE(builder.Update(data.data(), data.size()));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,123 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/parallel_partition_hasher.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <memory>
+#include <numeric>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/trace.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/read_ahead_reader.h"
+
+namespace chromeos_update_engine {
+
+ParallelPartitionHasher::ParallelPartitionHasher(
+    std::vector<Partition> partitions, size_t num_workers, bool use_direct_io)
+    : partitions_(std::move(partitions)),
+      use_direct_io_(use_direct_io),
+      order_(partitions_.size()),
+      results_(partitions_.size()) {
+  std::iota(order_.begin(), order_.end(), 0);
+  std::stable_sort(order_.begin(), order_.end(), [this](size_t a, size_t b) {
+    return partitions_[a].size > partitions_[b].size;
+  });
+  num_workers = std::min(std::max<size_t>(num_workers, 1), partitions_.size());
+  for (size_t i = 0; i < num_workers; i++) {
+    workers_.emplace_back(&ParallelPartitionHasher::WorkerLoop, this);
+  }
+}
+
+ParallelPartitionHasher::~ParallelPartitionHasher() {
+  cancelled_ = true;
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+bool ParallelPartitionHasher::GetHash(size_t index, brillo::Blob* hash) const {
+  CHECK(IsDone());
+  CHECK_LT(index, results_.size());
+  TEST_AND_RETURN_FALSE(results_[index].success);
+  *hash = results_[index].hash;
+  return true;
+}
+
+void ParallelPartitionHasher::WorkerLoop() {
+  while (true) {
+    const size_t position = next_++;
+    if (position >= order_.size()) {
+      return;
+    }
+    const size_t index = order_[position];
+    auto& result = results_[index];
+    result.success = HashPartition(partitions_[index], &result.hash);
+    num_done_++;
+  }
+}
+
+bool ParallelPartitionHasher::HashPartition(const Partition& partition,
+                                            brillo::Blob* hash) {
+  if (cancelled_) {
+    return false;
+  }
+  HashCalculator hasher(partition.algorithm);
+  if (partition.size == 0) {
+    TEST_AND_RETURN_FALSE(hasher.Finalize());
+    *hash = hasher.raw_hash();
+    return true;
+  }
+  std::unique_ptr<EintrSafeFileDescriptor> fd;
+  if (use_direct_io_) {
+    fd = std::make_unique<DirectIoFileDescriptor>();
+  } else {
+    fd = std::make_unique<EintrSafeFileDescriptor>();
+  }
+  if (!fd->Open(partition.path.c_str(), O_RDONLY)) {
+    PLOG(ERROR) << "Unable to open " << partition.path << " for reading.";
+    return false;
+  }
+  {
+    ReadAheadReader reader(fd.get(), 0, partition.size);
+    brillo::Blob chunk;
+    while (!cancelled_) {
+      UE_TRACE_SCOPE("hash_chunk");
+      if (!reader.Next(&chunk)) {
+        LOG(ERROR) << "Failed to read " << partition.path;
+        return false;
+      }
+      if (chunk.empty()) {
+        break;
+      }
+      TEST_AND_RETURN_FALSE(hasher.Update(chunk.data(), chunk.size()));
+      bytes_hashed_ += chunk.size();
+    }
+  }
+  TEST_AND_RETURN_FALSE(!cancelled_);
+  TEST_AND_RETURN_FALSE(hasher.Finalize());
+  *hash = hasher.raw_hash();
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,90 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_PARALLEL_PARTITION_HASHER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_PARALLEL_PARTITION_HASHER_H_
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/hash_calculator.h"
+
+namespace chromeos_update_engine {
+
+// Computes the hash of the first |size| bytes of several partitions at the
+// same time. Each partition is read and hashed on one of |num_workers| worker
+// threads, with its own fd and HashCalculator. Larger partitions are started
+// first so that the workers finish at about the same time. With
+// |use_direct_io|, partitions are read with O_DIRECT.
+class ParallelPartitionHasher {
+ public:
+  struct Partition {
+    std::string path;
+    uint64_t size;
+    HashAlgorithm algorithm{HashAlgorithm::kSha256};
+  };
+
+  ParallelPartitionHasher(std::vector<Partition> partitions,
+                          size_t num_workers,
+                          bool use_direct_io = false);
+  // Cancels partitions which are still being hashed and waits for the workers.
+  ~ParallelPartitionHasher();
+
+  // Total number of bytes hashed so far, over all partitions.
+  uint64_t bytes_hashed() const { return bytes_hashed_; }
+
+  // Whether every partition has been hashed, or failed to.
+  bool IsDone() const { return num_done_ == partitions_.size(); }
+
+  // Returns the hash of partition |index| in |*hash|, or false if it couldn't
+  // be hashed. Only valid once IsDone().
+  bool GetHash(size_t index, brillo::Blob* hash) const;
+
+ private:
+  struct Result {
+    bool success{false};
+    brillo::Blob hash;
+  };
+
+  void WorkerLoop();
+  bool HashPartition(const Partition& partition, brillo::Blob* hash);
+
+  const std::vector<Partition> partitions_;
+  const bool use_direct_io_;
+  // Indices of |partitions_|, largest partition first.
+  std::vector<size_t> order_;
+  // Each entry is only written by the worker hashing that partition.
+  std::vector<Result> results_;
+
+  // Position in |order_| of the next partition to hash.
+  std::atomic<size_t> next_{0};
+  std::atomic<size_t> num_done_{0};
+  std::atomic<uint64_t> bytes_hashed_{0};
+  std::atomic<bool> cancelled_{false};
+
+  std::vector<std::thread> workers_;
+
+  DISALLOW_COPY_AND_ASSIGN(ParallelPartitionHasher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PARALLEL_PARTITION_HASHER_H_
@@ -0,0 +1,111 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/parallel_partition_hasher.h"
+
+#include <unistd.h>
+
+#include <memory>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+void WaitUntilDone(const ParallelPartitionHasher& hasher) {
+  while (!hasher.IsDone()) {
+    usleep(1000);
+  }
+}
+}  // namespace
+
+TEST(ParallelPartitionHasherTest, HashesAllPartitionsTest) {
+  std::vector<std::unique_ptr<ScopedTempFile>> files;
+  std::vector<ParallelPartitionHasher::Partition> partitions;
+  std::vector<brillo::Blob> expected_hashes;
+  uint64_t total_size = 0;
+  for (size_t i = 0; i < 5; i++) {
+    files.push_back(std::make_unique<ScopedTempFile>("hasher_part.XXXXXX"));
+    brillo::Blob data(i * 300 * 1024 + 17);
+    test_utils::FillWithData(&data);
+    ASSERT_TRUE(test_utils::WriteFileVector(files.back()->path(), data));
+    // Only hash a prefix of the last partition.
+    const size_t size = i == 4 ? data.size() / 2 : data.size();
+    partitions.push_back({files.back()->path(), size});
+    brillo::Blob hash;
+    ASSERT_TRUE(HashCalculator::RawHashOfBytes(data.data(), size, &hash));
+    expected_hashes.push_back(hash);
+    total_size += size;
+  }
+
+  ParallelPartitionHasher hasher(partitions, 3);
+  WaitUntilDone(hasher);
+  EXPECT_EQ(total_size, hasher.bytes_hashed());
+  for (size_t i = 0; i < partitions.size(); i++) {
+    brillo::Blob hash;
+    ASSERT_TRUE(hasher.GetHash(i, &hash));
+    EXPECT_EQ(expected_hashes[i], hash);
+  }
+}
+
+TEST(ParallelPartitionHasherTest, DirectIoTest) {
+  ScopedTempFile file("hasher_part.XXXXXX");
+  brillo::Blob data(1024 * 1024 + 17);
+  test_utils::FillWithData(&data);
+  ASSERT_TRUE(test_utils::WriteFileVector(file.path(), data));
+  brillo::Blob expected_hash;
+  ASSERT_TRUE(
+      HashCalculator::RawHashOfBytes(data.data(), data.size(), &expected_hash));
+
+  ParallelPartitionHasher hasher({{file.path(), data.size()}}, 1, true);
+  WaitUntilDone(hasher);
+  brillo::Blob hash;
+  ASSERT_TRUE(hasher.GetHash(0, &hash));
+  EXPECT_EQ(expected_hash, hash);
+}
+
+TEST(ParallelPartitionHasherTest, ReportsFailedPartitionTest) {
+  ScopedTempFile file("hasher_part.XXXXXX");
+  brillo::Blob data(4096);
+  ASSERT_TRUE(test_utils::WriteFileVector(file.path(), data));
+
+  ParallelPartitionHasher hasher({{file.path(), data.size()},
+                                  {"/no/such/file", 4096},
+                                  {file.path(), data.size() + 1}},
+                                 2);
+  WaitUntilDone(hasher);
+  brillo::Blob hash;
+  EXPECT_TRUE(hasher.GetHash(0, &hash));
+  EXPECT_FALSE(hasher.GetHash(1, &hash));
+  EXPECT_FALSE(hasher.GetHash(2, &hash));
+}
+
+TEST(ParallelPartitionHasherTest, CancelTest) {
+  ScopedTempFile file("hasher_part.XXXXXX");
+  brillo::Blob data(8 * 1024 * 1024);
+  ASSERT_TRUE(test_utils::WriteFileVector(file.path(), data));
+  // Destroying the hasher right away must not hang or crash.
+  ParallelPartitionHasher hasher(
+      {{file.path(), data.size()}, {file.path(), data.size()}}, 2);
+}
+
+}  // namespace chromeos_update_engine
@@ -26,7 +26,6 @@
 #include <base/strings/string_split.h>
 
 #include "update_engine/common/boot_control_interface.h"
-#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 
 namespace chromeos_update_engine {
@@ -129,19 +128,10 @@ PartitionUpdateGeneratorAndroid::CreatePartitionUpdate(
     int64_t partition_size) {
   PartitionUpdate partition_update;
   partition_update.set_partition_name(partition_name);
-  auto old_partition_info = partition_update.mutable_old_partition_info();
-  old_partition_info->set_size(partition_size);
-
-  auto raw_hash = CalculateHashForPartition(source_device, partition_size);
-  if (!raw_hash.has_value()) {
-    LOG(ERROR) << "Failed to calculate hash for partition " << source_device
-               << " size: " << partition_size;
-    return {};
-  }
-  old_partition_info->set_hash(raw_hash->data(), raw_hash->size());
-  auto new_partition_info = partition_update.mutable_new_partition_info();
-  new_partition_info->set_size(partition_size);
-  new_partition_info->set_hash(raw_hash->data(), raw_hash->size());
+  // The partitions are left without a hash, which is computed while copying
+  // them rather than by reading them once more here.
+  partition_update.mutable_old_partition_info()->set_size(partition_size);
+  partition_update.mutable_new_partition_info()->set_size(partition_size);
 
   auto copy_operation = partition_update.add_operations();
   copy_operation->set_type(InstallOperation::SOURCE_COPY);
@@ -155,25 +145,6 @@ PartitionUpdateGeneratorAndroid::CreatePartitionUpdate(
   return partition_update;
 }
 
-std::optional<brillo::Blob>
-PartitionUpdateGeneratorAndroid::CalculateHashForPartition(
-    const std::string& block_device, int64_t partition_size) {
-  // TODO(xunchang) compute the hash with ecc partitions first, the hashing
-  // behavior should match the one in SOURCE_COPY. Also, we don't have the
-  // correct hash for source partition.
-  // An alternative way is to verify the written bytes match the read bytes
-  // during filesystem verification. This could probably save us a read of
-  // partitions here.
-  brillo::Blob raw_hash;
-  if (HashCalculator::RawHashOfFile(block_device, partition_size, &raw_hash) !=
-      partition_size) {
-    LOG(ERROR) << "Failed to calculate hash for " << block_device;
-    return std::nullopt;
-  }
-
-  return raw_hash;
-}
-
 namespace partition_update_generator {
 std::unique_ptr<PartitionUpdateGeneratorInterface> Create(
     BootControlInterface* boot_control, size_t block_size) {
@@ -22,7 +22,6 @@
 #include <string>
 #include <vector>
 
-#include <brillo/secure_blob.h>
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
 #include "update_engine/common/boot_control_interface.h"
@@ -49,16 +48,15 @@ class PartitionUpdateGeneratorAndroid
   FRIEND_TEST(PartitionUpdateGeneratorAndroidTest, CreatePartitionUpdate);
 
   // Creates a PartitionUpdate object for a given partition to update from
-  // source to target. Returns std::nullopt on failure.
+  // source to target, copying all of it. Its PartitionInfo have no hash, the
+  // writer computes it while copying the partition. Returns std::nullopt on
+  // failure.
   std::optional<PartitionUpdate> CreatePartitionUpdate(
       const std::string& partition_name,
       const std::string& source_device,
       const std::string& target_device,
       int64_t partition_size);
 
-  std::optional<brillo::Blob> CalculateHashForPartition(
-      const std::string& block_device, int64_t partition_size);
-
   BootControlInterface* boot_control_;
   size_t block_size_;
 };
@@ -33,19 +33,49 @@
 #include <base/strings/stringprintf.h>
 
 #include "update_engine/common/error_code.h"
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/apply_hints.h"
 #include "update_engine/payload_consumer/cached_file_descriptor.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
 #include "update_engine/payload_consumer/install_operation_executor.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
 #include "update_engine/payload_consumer/mount_history.h"
+#include "update_engine/payload_consumer/operation_stats.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/write_combining_file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 
 namespace chromeos_update_engine {
 
 namespace {
 constexpr uint64_t kCacheSize = 1024 * 1024;  // 1MB
+// The cached writes are written out in the background, while up to this many
+// buffers of |kCacheSize| bytes are filled.
+constexpr size_t kCacheBuffers = 4;
+// The size of the buffer of zeros written where the device can't zero or
+// discard blocks itself.
+constexpr size_t kZeroBufferSize = 256 * 1024;
+
+// Writes zeros to the blocks of |extent| through |fd|, from a buffer shared by
+// all of these writes.
+bool WriteZeros(const FileDescriptorPtr& fd,
+                const Extent& extent,
+                size_t block_size) {
+  static const uint8_t kZeros[kZeroBufferSize] = {};
+  uint64_t offset = extent.start_block() * block_size;
+  uint64_t remaining = extent.num_blocks() * block_size;
+  while (remaining > 0) {
+    const size_t count = std::min<uint64_t>(remaining, sizeof(kZeros));
+    TEST_AND_RETURN_FALSE(utils::PWriteAll(fd, kZeros, count, offset));
+    offset += count;
+    remaining -= count;
+  }
+  return true;
+}
 
 // Discard the tail of the block device referenced by |fd|, from the offset
 // |data_size| until the end of the block device. Returns whether the data was
@@ -87,16 +117,34 @@ bool DiscardPartitionTail(const FileDescriptorPtr& fd, uint64_t data_size) {
 FileDescriptorPtr OpenFile(const char* path,
                            int mode,
                            bool cache_writes,
+                           size_t write_combine_size,
+                           bool use_io_uring,
+                           bool use_direct_io,
                            int* err) {
   // Try to mark the block device read-only based on the mode. Ignore any
   // failure since this won't work when passing regular files.
   bool read_only = (mode & O_ACCMODE) == O_RDONLY;
   utils::SetBlockDeviceReadOnly(path, read_only);
 
-  FileDescriptorPtr fd(new EintrSafeFileDescriptor());
+  FileDescriptorPtr fd;
+  if (use_io_uring) {
+    fd = std::make_shared<IoUringFileDescriptor>();
+  } else if (use_direct_io) {
+    fd = std::make_shared<DirectIoFileDescriptor>();
+  } else {
+    fd = std::make_shared<EintrSafeFileDescriptor>();
+  }
   if (cache_writes && !read_only) {
-    fd = FileDescriptorPtr(new CachedFileDescriptor(fd, kCacheSize));
-    LOG(INFO) << "Caching writes.";
+    if (write_combine_size > 0) {
+      fd = std::make_shared<WriteCombiningFileDescriptor>(fd,
+                                                          write_combine_size);
+      LOG(INFO) << "Combining up to " << write_combine_size / 1024
+                << " KiB of writes.";
+    } else {
+      fd = FileDescriptorPtr(
+          new CachedFileDescriptor(fd, kCacheSize, kCacheBuffers));
+      LOG(INFO) << "Caching writes.";
+    }
   }
   if (!fd->Open(path, mode, 000)) {
     *err = errno;
@@ -116,7 +164,8 @@ PartitionWriter::PartitionWriter(
     : partition_update_(partition_update),
       install_part_(install_part),
       dynamic_control_(dynamic_control),
-      verified_source_fd_(block_size, install_part.source_path),
+      verified_source_fd_(
+          block_size, install_part.source_path, install_part.hash_algorithm),
       interactive_(is_interactive),
       block_size_(block_size),
       install_op_executor_(block_size) {}
@@ -133,7 +182,7 @@ bool PartitionWriter::OpenSourcePartition(uint32_t source_slot,
   }
   if (install_part_.source_size > 0 && !install_part_.source_path.empty()) {
     source_path_ = install_part_.source_path;
-    if (!verified_source_fd_.Open()) {
+    if (!verified_source_fd_.Open(use_io_uring_, use_direct_io_)) {
       LOG(ERROR) << "Unable to open source partition " << install_part_.name
                  << " on slot " << BootControlInterface::SlotName(source_slot)
                  << ", file " << source_path_;
@@ -149,6 +198,26 @@ bool PartitionWriter::Init(const InstallPlan* install_plan,
   const PartitionUpdate& partition = partition_update_;
   uint32_t source_slot = install_plan->source_slot;
   uint32_t target_slot = install_plan->target_slot;
+  use_io_uring_ = install_plan->use_io_uring;
+  use_direct_io_ = install_plan->use_direct_io;
+  kernel_copy_ = install_plan->kernel_copy;
+  if (install_plan->source_cache_size > 0) {
+    verified_source_fd_.EnableCache(install_plan->source_cache_size,
+                                    partition,
+                                    install_part_.source_size);
+  }
+  if (install_plan->source_prefetch_ops > 0) {
+    verified_source_fd_.EnablePrefetch(
+        partition.operations(),
+        GetPrefetchWindow(partition, install_plan->source_prefetch_ops),
+        install_plan->source_prefetch_bytes);
+  }
+  if (!install_part_.source_verity_path.empty()) {
+    verified_source_fd_.EnableVerityReads(install_part_.source_verity_path);
+  }
+  if (install_part_.source_hash_indexed) {
+    verified_source_fd_.EnableIndexedSource();
+  }
   TEST_AND_RETURN_FALSE(OpenSourcePartition(source_slot, source_may_exist));
 
   // We shouldn't open the source partition in certain cases, e.g. some dynamic
@@ -165,7 +234,16 @@ bool PartitionWriter::Init(const InstallPlan* install_plan,
   LOG(INFO) << "Opening " << target_path_ << " partition with"
             << (interactive_ ? "out" : "") << " O_DSYNC";
 
-  target_fd_ = OpenFile(target_path_.c_str(), flags, true, &err);
+  // A cached write could land after a later, overlapping write issued through
+  // another instance or copied by the kernel; only cache when this instance
+  // is the sole writer.
+  target_fd_ = OpenFile(target_path_.c_str(),
+                        flags,
+                        !concurrent_operations_ && !kernel_copy_,
+                        install_plan->write_combine_size,
+                        use_io_uring_,
+                        use_direct_io_,
+                        &err);
   if (!target_fd_) {
     LOG(ERROR) << "Unable to open target partition "
                << partition.partition_name() << " on slot "
@@ -193,30 +271,61 @@ bool PartitionWriter::PerformReplaceOperation(const InstallOperation& operation,
       operation, std::move(writer), data);
 }
 
+std::unique_ptr<ExtentWriter> PartitionWriter::CreateReplaceExtentWriter(
+    const InstallOperation& operation) {
+  return install_op_executor_.CreateReplaceExtentWriter(
+      operation, CreateBaseExtentWriter());
+}
+
 bool PartitionWriter::PerformZeroOrDiscardOperation(
     const InstallOperation& operation) {
+  return PerformZeroOrDiscardOperations({&operation});
+}
+
+bool PartitionWriter::PerformZeroOrDiscardOperations(
+    const std::vector<const InstallOperation*>& operations) {
+  // The blocks to discard and to zero, merged across the operations. The
+  // discards go first, so that a block both discarded and zeroed reads back as
+  // zeros whichever operation came last, which is a valid outcome of a
+  // discard too.
+  ExtentRanges discarded;
+  ExtentRanges zeroed;
+  for (const InstallOperation* operation : operations) {
+    TEST_AND_RETURN_FALSE(operation->type() == InstallOperation::ZERO ||
+                          operation->type() == InstallOperation::DISCARD);
+    ExtentRanges* ranges =
+        operation->type() == InstallOperation::ZERO ? &zeroed : &discarded;
+    for (const Extent& extent : operation->dst_extents()) {
+      ranges->AddExtent(extent);
+    }
+  }
+
+  for (const auto& [ranges, name] : {std::make_pair(&discarded, "BLKDISCARD"),
+                                     std::make_pair(&zeroed, "BLKZEROOUT")}) {
 #ifdef BLKZEROOUT
-  int request =
-      (operation.type() == InstallOperation::ZERO ? BLKZEROOUT : BLKDISCARD);
+    const int request = ranges == &zeroed ? BLKZEROOUT : BLKDISCARD;
 #else   // !defined(BLKZEROOUT)
-  auto writer = CreateBaseExtentWriter();
-  return install_op_executor_.ExecuteZeroOrDiscardOperation(operation,
-                                                            writer.get());
+    // BlkIoctl() fails without BLKZEROOUT, the blocks are written instead.
+    const int request = BLKDISCARD;
 #endif  // !defined(BLKZEROOUT)
-
-  for (const Extent& extent : operation.dst_extents()) {
-    const uint64_t start = extent.start_block() * block_size_;
-    const uint64_t length = extent.num_blocks() * block_size_;
-    int result = 0;
-    if (target_fd_->BlkIoctl(request, start, length, &result) && result == 0) {
-      continue;
+    bool use_ioctl = true;
+    for (const Extent& extent : ranges->extent_set()) {
+      if (use_ioctl) {
+        const uint64_t start = extent.start_block() * block_size_;
+        const uint64_t length = extent.num_blocks() * block_size_;
+        int result = 0;
+        if (target_fd_->BlkIoctl(request, start, length, &result) &&
+            result == 0) {
+          continue;
+        }
+        // In case of failure, we fall back to writing 0s for the remainder of
+        // these blocks.
+        PLOG(WARNING) << name << " failed. Falling back to write 0s for "
+                      << "remainder of these operations.";
+        use_ioctl = false;
+      }
+      TEST_AND_RETURN_FALSE(WriteZeros(target_fd_, extent, block_size_));
     }
-    // In case of failure, we fall back to writing 0 for the entire operation.
-    PLOG(WARNING) << "BlkIoctl failed. Falling back to write 0s for remainder "
-                     "of this operation.";
-    auto writer = CreateBaseExtentWriter();
-    return install_op_executor_.ExecuteZeroOrDiscardOperation(
-        operation, std::move(writer));
   }
   return true;
 }
@@ -228,6 +337,27 @@ bool PartitionWriter::PerformSourceCopyOperation(
   // decide it the operation should be skipped.
   const PartitionUpdate& partition = partition_update_;
 
+  if (IsUnhashedPartitionCopy(operation)) {
+    // The hash the partition is verified against is computed from the bytes
+    // copied, instead of reading the whole source partition once more ahead
+    // of the copy. This is done through memory, the kernel can't hash them.
+    const FileDescriptorPtr source_fd = verified_source_fd_.source_fd();
+    TEST_AND_RETURN_FALSE(source_fd != nullptr);
+    auto writer = CreateBaseExtentWriter();
+    TEST_AND_RETURN_FALSE(writer->Init(operation.dst_extents(), block_size_));
+    ScopedOperationPhase write_phase(OperationPhase::kWrite);
+    brillo::Blob hash;
+    TEST_AND_RETURN_FALSE(
+        fd_utils::CommonHashExtents(source_fd,
+                                    operation.src_extents(),
+                                    writer.get(),
+                                    block_size_,
+                                    &hash,
+                                    install_part_.hash_algorithm));
+    copied_partition_hash_ = std::move(hash);
+    return true;
+  }
+
   // Invoke ChooseSourceFD with original operation, so that it can properly
   // verify source hashes. Optimized operation might contain a smaller set of
   // extents, or completely empty.
@@ -245,11 +375,177 @@ bool PartitionWriter::PerformSourceCopyOperation(
       partition.partition_name(), operation, &buf);
   const InstallOperation& optimized = should_optimize ? buf : operation;
 
+  if (kernel_copy_) {
+    ScopedOperationPhase write_phase(OperationPhase::kWrite);
+    if (fd_utils::CopyExtentsInKernel(source_fd,
+                                      optimized.src_extents(),
+                                      target_fd_,
+                                      optimized.dst_extents(),
+                                      block_size_)) {
+      return true;
+    }
+    // Whatever stops the kernel from copying between these partitions, such
+    // as them being block devices it can't copy between, applies to the rest
+    // of the operations as well.
+    PLOG(WARNING) << "Unable to copy " << partition.partition_name()
+                  << " blocks in the kernel, copying them through memory";
+    kernel_copy_ = false;
+  }
+
   auto writer = CreateBaseExtentWriter();
   return install_op_executor_.ExecuteSourceCopyOperation(
       optimized, std::move(writer), source_fd);
 }
 
+bool PartitionWriter::IsUnhashedPartitionCopy(
+    const InstallOperation& operation) const {
+  if (!install_part_.untouched || !install_part_.target_hash.empty() ||
+      install_part_.source_size != install_part_.target_size) {
+    return false;
+  }
+  const uint64_t num_blocks = install_part_.target_size / block_size_;
+  const auto covers_partition = [num_blocks](const auto& extents) {
+    return extents.size() == 1 && extents[0].start_block() == 0 &&
+           extents[0].num_blocks() == num_blocks;
+  };
+  return covers_partition(operation.src_extents()) &&
+         covers_partition(operation.dst_extents());
+}
+
+bool PartitionWriter::GetCopiedPartitionHash(brillo::Blob* hash) const {
+  if (copied_partition_hash_.empty())
+    return false;
+  *hash = copied_partition_hash_;
+  return true;
+}
+
+bool PartitionWriter::PerformSourceCopyOperations(
+    const std::vector<const InstallOperation*>& operations, ErrorCode* error) {
+  const auto perform_each = [this, &operations, error]() {
+    return PartitionWriterInterface::PerformSourceCopyOperations(operations,
+                                                                 error);
+  };
+  const FileDescriptorPtr source_fd = verified_source_fd_.source_fd();
+  ExtentRanges source_ranges;
+  for (const InstallOperation* operation : operations) {
+    // Without a source hash, ChooseSourceFD() prefers the error corrected
+    // source partition. Copies done by the kernel are applied one by one.
+    if (source_fd == nullptr || !operation->has_src_sha256_hash() ||
+        kernel_copy_) {
+      return perform_each();
+    }
+    for (const Extent& extent : operation->src_extents()) {
+      if (extent.start_block() == kSparseHole) {
+        return perform_each();
+      }
+    }
+    source_ranges.AddRepeatedExtents(operation->src_extents());
+  }
+
+  // Read all the source blocks at once. |runs| maps the first block of each
+  // run of them to its offset in |source_copy_buffer_|.
+  std::vector<std::pair<uint64_t, uint64_t>> runs;
+  std::vector<FileIoRequest> requests;
+  source_copy_buffer_.resize(source_ranges.blocks() * block_size_);
+  uint64_t buffer_offset = 0;
+  for (const Extent& extent : source_ranges.extent_set()) {
+    runs.emplace_back(extent.start_block(), buffer_offset);
+    requests.push_back(
+        {static_cast<off64_t>(extent.start_block() * block_size_),
+         source_copy_buffer_.data() + buffer_offset,
+         static_cast<size_t>(extent.num_blocks() * block_size_)});
+    buffer_offset += extent.num_blocks() * block_size_;
+  }
+  {
+    ScopedOperationPhase source_read_phase(OperationPhase::kSourceRead);
+    if (!source_fd->ReadBatch(requests)) {
+      PLOG(WARNING) << "Failed to read the source of " << operations.size()
+                    << " SOURCE_COPY operations at once";
+      return perform_each();
+    }
+  }
+  // Returns the data of the source block |block|, which was read.
+  const auto source_data = [this, &runs](uint64_t block) {
+    auto run = std::upper_bound(runs.begin(),
+                                runs.end(),
+                                std::make_pair(block, UINT64_MAX)) -
+               1;
+    return source_copy_buffer_.data() + run->second +
+           (block - run->first) * block_size_;
+  };
+
+  // dm-verity already checked the blocks read, if the source is read
+  // through it, and the index the whole source.
+  if (!verified_source_fd_.skip_source_hashes()) {
+    for (const InstallOperation* operation : operations) {
+      HashCalculator hasher(install_part_.hash_algorithm);
+      for (const Extent& extent : operation->src_extents()) {
+        hasher.Update(source_data(extent.start_block()),
+                      extent.num_blocks() * block_size_);
+      }
+      if (!hasher.Finalize() ||
+          hasher.raw_hash() !=
+              brillo::Blob(operation->src_sha256_hash().begin(),
+                           operation->src_sha256_hash().end())) {
+        return perform_each();
+      }
+    }
+  }
+
+  // Pair up the source and target blocks of each operation.
+  requests.clear();
+  for (const InstallOperation* operation : operations) {
+    InstallOperation buf;
+    const bool should_optimize = dynamic_control_->OptimizeOperation(
+        partition_update_.partition_name(), *operation, &buf);
+    const InstallOperation& optimized = should_optimize ? buf : *operation;
+    TEST_AND_RETURN_FALSE(utils::BlocksInExtents(optimized.src_extents()) ==
+                          utils::BlocksInExtents(optimized.dst_extents()));
+    auto src = optimized.src_extents().begin();
+    auto dst = optimized.dst_extents().begin();
+    uint64_t src_done = 0;
+    uint64_t dst_done = 0;
+    while (src != optimized.src_extents().end() &&
+           dst != optimized.dst_extents().end()) {
+      const uint64_t num_blocks = std::min(src->num_blocks() - src_done,
+                                           dst->num_blocks() - dst_done);
+      if (dst->start_block() != kSparseHole) {
+        requests.push_back(
+            {static_cast<off64_t>((dst->start_block() + dst_done) *
+                                  block_size_),
+             source_data(src->start_block() + src_done),
+             static_cast<size_t>(num_blocks * block_size_)});
+      }
+      src_done += num_blocks;
+      dst_done += num_blocks;
+      if (src_done == src->num_blocks()) {
+        src++;
+        src_done = 0;
+      }
+      if (dst_done == dst->num_blocks()) {
+        dst++;
+        dst_done = 0;
+      }
+    }
+  }
+  // Sorted by offset, copies next to each other in the target become a single
+  // write. Operations writing the same blocks have to stay in order.
+  std::stable_sort(requests.begin(),
+                   requests.end(),
+                   [](const FileIoRequest& a, const FileIoRequest& b) {
+                     return a.offset < b.offset;
+                   });
+  for (size_t i = 1; i < requests.size(); i++) {
+    if (requests[i - 1].offset + static_cast<off64_t>(requests[i - 1].count) >
+        requests[i].offset) {
+      return perform_each();
+    }
+  }
+  ScopedOperationPhase write_phase(OperationPhase::kWrite);
+  TEST_AND_RETURN_FALSE_ERRNO(target_fd_->WriteBatch(requests));
+  return true;
+}
+
 bool PartitionWriter::PerformDiffOperation(const InstallOperation& operation,
                                            ErrorCode* error,
                                            const void* data,
@@ -290,6 +586,13 @@ void PartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
   }
 }
 
+bool PartitionWriter::CheckpointPartialOperation(size_t op_index,
+                                                 uint64_t bytes) {
+  // The blocks are written in place, so there is nothing to keep track of
+  // besides them being written out.
+  return !target_fd_ || target_fd_->Flush();
+}
+
 std::unique_ptr<ExtentWriter> PartitionWriter::CreateBaseExtentWriter() {
   return std::make_unique<DirectExtentWriter>(target_fd_);
 }
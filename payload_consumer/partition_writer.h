@@ -63,6 +63,14 @@ class PartitionWriter : public PartitionWriterInterface {
   //   |next_op_index| is index of next operation that should be applied.
   // |next_op_index-1| is the last operation that is already applied.
   void CheckpointUpdateProgress(size_t next_op_index) override;
+  [[nodiscard]] bool CheckpointPartialOperation(size_t op_index,
+                                                uint64_t bytes) override;
+  void PrefetchSource(size_t next_op_index) override {
+    verified_source_fd_.Prefetch(next_op_index);
+  }
+  void SetPuffpatchCacheBudget(size_t bytes) override {
+    install_op_executor_.SetPuffpatchCacheBudget(bytes);
+  }
 
   // Close partition writer, when calling this function there's no guarantee
   // that all |InstallOperations| are sent to |PartitionWriter|. This function
@@ -75,21 +83,44 @@ class PartitionWriter : public PartitionWriterInterface {
   [[nodiscard]] bool PerformReplaceOperation(const InstallOperation& operation,
                                              const void* data,
                                              size_t count) override;
+  [[nodiscard]] std::unique_ptr<ExtentWriter> CreateReplaceExtentWriter(
+      const InstallOperation& operation) override;
   [[nodiscard]] bool PerformZeroOrDiscardOperation(
       const InstallOperation& operation) override;
+  // Merges the target blocks of all of |operations| into as few ranges as
+  // possible and zeroes or discards each range with a single ioctl, writing
+  // zeros where the device doesn't support it.
+  [[nodiscard]] bool PerformZeroOrDiscardOperations(
+      const std::vector<const InstallOperation*>& operations) override;
 
   [[nodiscard]] bool PerformSourceCopyOperation(
       const InstallOperation& operation, ErrorCode* error) override;
+  // Reads the source blocks of all of |operations| at once, checks their
+  // source hashes from memory and writes all of their target blocks in one
+  // batch, which the target descriptor merges into as few writes as the
+  // layout allows. Falls back to one operation at a time if a source hash
+  // doesn't match, so that the error corrected source is used.
+  [[nodiscard]] bool PerformSourceCopyOperations(
+      const std::vector<const InstallOperation*>& operations,
+      ErrorCode* error) override;
   [[nodiscard]] bool PerformDiffOperation(const InstallOperation& operation,
                                           ErrorCode* error,
                                           const void* data,
                                           size_t count) override;
+  bool GetCopiedPartitionHash(brillo::Blob* hash) const override;
 
   // |DeltaPerformer| calls this when all Install Ops are sent to partition
   // writer. No |Perform*Operation| methods will be called in the future, and
   // the partition writer is expected to be closed soon.
   [[nodiscard]] bool FinishedInstallOps() override { return true; }
 
+  // Every instance has its own file descriptors, so this only has to make sure
+  // no write is held back in a cache past the end of its operation.
+  [[nodiscard]] bool EnableConcurrentOperations() override {
+    concurrent_operations_ = true;
+    return true;
+  }
+
  private:
   friend class PartitionWriterTest;
   FRIEND_TEST(PartitionWriterTest, ChooseSourceFDTest);
@@ -101,6 +132,10 @@ class PartitionWriter : public PartitionWriterInterface {
 
   [[nodiscard]] std::unique_ptr<ExtentWriter> CreateBaseExtentWriter();
 
+  // Whether |operation| copies the whole source partition to the target
+  // partition, an untouched one whose hash isn't known yet.
+  bool IsUnhashedPartitionCopy(const InstallOperation& operation) const;
+
   const PartitionUpdate& partition_update_;
   const InstallPlan::Partition& install_part_;
   DynamicPartitionControlInterface* dynamic_control_;
@@ -112,11 +147,30 @@ class PartitionWriter : public PartitionWriterInterface {
   FileDescriptorPtr target_fd_;
   const bool interactive_;
   const size_t block_size_;
+  // Whether other instances may write to the target partition concurrently.
+  // Disables write caching on |target_fd_|.
+  bool concurrent_operations_{false};
+  // Whether batched I/O on the source and target partitions uses io_uring.
+  bool use_io_uring_{false};
+  // Whether the source and target partitions are opened with O_DIRECT.
+  bool use_direct_io_{false};
+  // Whether SOURCE_COPY operations are tried with an in-kernel copy first.
+  // Also disables write caching on |target_fd_|, whose buffered writes could
+  // otherwise land after the copies.
+  bool kernel_copy_{false};
+
+  // The hash of the source partition computed while copying all of it, see
+  // GetCopiedPartitionHash().
+  brillo::Blob copied_partition_hash_;
 
   // This instance handles decompression/bsdfif/puffdiff. It's responsible for
   // constructing data which should be written to target partition, actual
   // "writing" is handled by |PartitionWriter|
   InstallOperationExecutor install_op_executor_;
+
+  // The source blocks read by PerformSourceCopyOperations(), kept to be
+  // reused by the next batch.
+  brillo::Blob source_copy_buffer_;
 };
 
 namespace partition_writer {
@@ -18,11 +18,14 @@
 #define UPDATE_ENGINE_PARTITION_WRITER_INTERFACE_H_
 
 #include <cstdint>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <brillo/secure_blob.h>
 #include <gtest/gtest_prod.h>
 
+#include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -44,6 +47,25 @@ class PartitionWriterInterface {
   // |next_op_index-1| is the last operation that is already applied.
   virtual void CheckpointUpdateProgress(size_t next_op_index) = 0;
 
+  // Makes the first |bytes| of the output of operation |op_index|, a multiple
+  // of the block size, durable so that the update can resume from there. On
+  // resume, InstallPlan::resume_operation_bytes is set to |bytes| when Init()
+  // is called with |op_index|. Returns false if the writer can't checkpoint
+  // in the middle of an operation.
+  [[nodiscard]] virtual bool CheckpointPartialOperation(size_t op_index,
+                                                        uint64_t bytes) {
+    return false;
+  }
+
+  // Tells that |next_op_index| is the index of the next operation to be
+  // applied, which is used to read the source of the following operations
+  // ahead when enabled. May be called any number of times for each operation.
+  virtual void PrefetchSource(size_t next_op_index) {}
+
+  // Sets the most memory puffpatch may use to cache the source of a PUFFDIFF
+  // operation, see HardwareInterface::GetPuffpatchCacheBudget().
+  virtual void SetPuffpatchCacheBudget(size_t bytes) {}
+
   // Close partition writer, when calling this function there's no guarantee
   // that all |InstallOperations| are sent to |PartitionWriter|. This function
   // will be called even if we are pausing/aborting the update.
@@ -56,19 +78,68 @@ class PartitionWriterInterface {
       const InstallOperation& operation, const void* data, size_t count) = 0;
   [[nodiscard]] virtual bool PerformZeroOrDiscardOperation(
       const InstallOperation& operation) = 0;
+  // Performs the consecutive ZERO and DISCARD |operations|. Writers that can
+  // merge the blocks of many operations override this. On failure any number
+  // of the operations may have been applied.
+  [[nodiscard]] virtual bool PerformZeroOrDiscardOperations(
+      const std::vector<const InstallOperation*>& operations) {
+    for (const InstallOperation* operation : operations) {
+      if (!PerformZeroOrDiscardOperation(*operation))
+        return false;
+    }
+    return true;
+  }
+
+  // Returns a writer applying the REPLACE, REPLACE_BZ, REPLACE_XZ or
+  // REPLACE_ZSTD |operation| from its data passed in any number of pieces, so
+  // that the operation can be applied while its data is still being received.
+  // The operation is applied once all of its data is written and the writer is
+  // destroyed. Returns nullptr if the writer doesn't support that, in which
+  // case PerformReplaceOperation() must be used.
+  [[nodiscard]] virtual std::unique_ptr<ExtentWriter> CreateReplaceExtentWriter(
+      const InstallOperation& operation) {
+    return nullptr;
+  }
 
   [[nodiscard]] virtual bool PerformSourceCopyOperation(
       const InstallOperation& operation, ErrorCode* error) = 0;
+  // Performs the consecutive SOURCE_COPY |operations| in order. Writers that
+  // can copy the blocks of many operations at once override this. On failure
+  // any number of the operations may have been applied.
+  [[nodiscard]] virtual bool PerformSourceCopyOperations(
+      const std::vector<const InstallOperation*>& operations,
+      ErrorCode* error) {
+    for (const InstallOperation* operation : operations) {
+      if (!PerformSourceCopyOperation(*operation, error))
+        return false;
+    }
+    return true;
+  }
   [[nodiscard]] virtual bool PerformDiffOperation(
       const InstallOperation& operation,
       ErrorCode* error,
       const void* data,
       size_t count) = 0;
 
+  // Returns in |hash| the hash of the source partition, computed while a
+  // SOURCE_COPY operation copied all of it to a target partition without a
+  // hash to verify it against, as generated for the partitions not in a
+  // partial update. Returns false if no such copy was done.
+  virtual bool GetCopiedPartitionHash(brillo::Blob* hash) const {
+    return false;
+  }
+
   // |DeltaPerformer| calls this when all Install Ops are sent to partition
   // writer. No |Perform*Operation| methods will be called in the future, and
   // the partition writer is expected to be closed soon.
   [[nodiscard]] virtual bool FinishedInstallOps() = 0;
+
+  // Must be called before |Init|. Prepares the writer for operations with
+  // disjoint destination extents being applied at the same time through other
+  // writer instances of the same partition. Returns false if the writer
+  // doesn't support that, in which case all operations must be applied in
+  // order through a single instance.
+  [[nodiscard]] virtual bool EnableConcurrentOperations() { return false; }
 };
 }  // namespace chromeos_update_engine
 
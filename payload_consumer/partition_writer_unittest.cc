@@ -14,11 +14,14 @@
 // limitations under the License.
 //
 
+#include <algorithm>
 #include <memory>
+#include <utility>
 #include <vector>
 
 #include <brillo/secure_blob.h>
 #include <gtest/gtest.h>
+#include <openssl/evp.h>
 
 #include "update_engine/common/dynamic_partition_control_stub.h"
 #include "update_engine/common/error_code.h"
@@ -32,6 +35,7 @@
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_consumer/partition_writer.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/source_hash_tree.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
@@ -60,6 +64,31 @@ class PartitionWriterTest : public testing::Test {
     return writer_.verified_source_fd_.source_ecc_recovered_failures_;
   }
 
+  // Sets the hash tree of the source partition to the one of |data|, unsalted.
+  void SetSourceHashTree(const brillo::Blob& data) {
+    brillo::Blob digests;
+    for (size_t offset = 0; offset < data.size(); offset += kBlockSize) {
+      brillo::Blob digest;
+      ASSERT_TRUE(HashCalculator::RawHashOfBytes(
+          data.data() + offset, kBlockSize, &digest));
+      digests.insert(digests.end(), digest.begin(), digest.end());
+    }
+    ASSERT_TRUE(test_utils::WriteFileVector(hash_tree_file_.path(), digests));
+    auto fd = std::make_shared<EintrSafeFileDescriptor>();
+    ASSERT_TRUE(fd->Open(hash_tree_file_.path().c_str(), O_RDONLY));
+    writer_.verified_source_fd_.source_hash_tree_ =
+        std::make_unique<SourceHashTree>(fd,
+                                         kBlockSize,
+                                         EVP_sha256(),
+                                         brillo::Blob(),
+                                         data.size() / kBlockSize,
+                                         0);
+  }
+
+  bool VerityReads() const {
+    return writer_.verified_source_fd_.verity_reads();
+  }
+
   AnnotatedOperation GenerateSourceCopyOp(const brillo::Blob& copied_data,
                                           bool add_hash,
                                           PartitionConfig* old_part = nullptr) {
@@ -122,6 +151,7 @@ class PartitionWriterTest : public testing::Test {
   DeltaArchiveManifest manifest_{};
   ScopedTempFile source_partition{"source-part-XXXXXX"};
   ScopedTempFile target_partition{"target-part-XXXXXX"};
+  ScopedTempFile hash_tree_file_{"hash-tree-XXXXXX"};
   InstallPlan::Partition install_part_{.source_path = source_partition.path(),
                                        .target_path = target_partition.path()};
   PartitionUpdate partition_update_{};
@@ -162,6 +192,27 @@ TEST_F(PartitionWriterTest, ErrorCorrectionSourceCopyWhenNoHashFallbackTest) {
   ASSERT_EQ(0U, GetSourceEccRecoveredFailures());
 }
 
+// Test that an untouched partition of a partial update is hashed while it is
+// copied, without reading it through the error corrected descriptor.
+TEST_F(PartitionWriterTest, UntouchedPartitionCopyTest) {
+  constexpr size_t kCopyOperationSize = 4 * 4096;
+  brillo::Blob expected_data = FakeFileDescriptorData(kCopyOperationSize);
+  FakeFileDescriptor* fake_fec = SetFakeECCFile(kCopyOperationSize);
+  install_part_.untouched = true;
+
+  auto source_copy_op = GenerateSourceCopyOp(expected_data, false);
+  ASSERT_NO_FATAL_FAILURE();
+  auto output_data = PerformSourceCopyOp(source_copy_op.op, expected_data);
+  ASSERT_NO_FATAL_FAILURE();
+  ASSERT_EQ(output_data, expected_data);
+  ASSERT_TRUE(fake_fec->GetReadOps().empty());
+
+  brillo::Blob expected_hash, hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(expected_data, &expected_hash));
+  ASSERT_TRUE(writer_.GetCopiedPartitionHash(&hash));
+  ASSERT_EQ(expected_hash, hash);
+}
+
 // Test that the error-corrected file descriptor is used to read the partition
 // since the source partition doesn't match the operation hash.
 TEST_F(PartitionWriterTest, ErrorCorrectionSourceCopyFallbackTest) {
@@ -186,6 +237,149 @@ TEST_F(PartitionWriterTest, ErrorCorrectionSourceCopyFallbackTest) {
   EXPECT_EQ(1U, GetSourceEccRecoveredFailures());
 }
 
+// Test that the source is read from the dm-verity device without checking
+// the operation hash against the raw source partition.
+TEST_F(PartitionWriterTest, VeritySourceReadsTest) {
+  constexpr size_t kCopyOperationSize = 4 * 4096;
+  brillo::Blob expected_data = FakeFileDescriptorData(kCopyOperationSize);
+  ScopedTempFile verity("Verity-XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(verity.path(), expected_data));
+  install_part_.source_verity_path = verity.path();
+
+  // The raw source partition doesn't match the operation hash and there is no
+  // error corrected device, so only the verity device has the source.
+  brillo::Blob invalid_data(kCopyOperationSize, 0x55);
+  auto source_copy_op = GenerateSourceCopyOp(expected_data, true);
+  ASSERT_NO_FATAL_FAILURE();
+  auto output_data = PerformSourceCopyOp(source_copy_op.op, invalid_data);
+  ASSERT_NO_FATAL_FAILURE();
+  ASSERT_EQ(output_data, expected_data);
+  EXPECT_TRUE(VerityReads());
+}
+
+// Test that failing to read the dm-verity device falls back to the raw source
+// partition and its hash checks.
+TEST_F(PartitionWriterTest, VeritySourceReadsFallbackTest) {
+  constexpr size_t kCopyOperationSize = 4 * 4096;
+  brillo::Blob expected_data = FakeFileDescriptorData(kCopyOperationSize);
+  // The verity device is shorter than the source of the operation.
+  ScopedTempFile verity("Verity-XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(
+      verity.path(),
+      brillo::Blob(expected_data.begin(),
+                   expected_data.begin() + kCopyOperationSize / 2)));
+  install_part_.source_verity_path = verity.path();
+
+  auto source_copy_op = GenerateSourceCopyOp(expected_data, true);
+  ASSERT_NO_FATAL_FAILURE();
+  auto output_data = PerformSourceCopyOp(source_copy_op.op, expected_data);
+  ASSERT_NO_FATAL_FAILURE();
+  ASSERT_EQ(output_data, expected_data);
+  EXPECT_FALSE(VerityReads());
+}
+
+// Test that the source hashes of a source partition matching the index
+// aren't checked.
+TEST_F(PartitionWriterTest, IndexedSourceTest) {
+  constexpr size_t kCopyOperationSize = 4 * 4096;
+  install_part_.source_hash_indexed = true;
+  FakeFileDescriptor* fake_fec = SetFakeECCFile(kCopyOperationSize);
+  brillo::Blob expected_data = FakeFileDescriptorData(kCopyOperationSize);
+
+  // The raw source is used as is, even though it doesn't match the hash.
+  brillo::Blob raw_data(kCopyOperationSize, 0x55);
+  auto source_copy_op = GenerateSourceCopyOp(expected_data, true);
+  ASSERT_NO_FATAL_FAILURE();
+  auto output_data = PerformSourceCopyOp(source_copy_op.op, raw_data);
+  ASSERT_NO_FATAL_FAILURE();
+  ASSERT_EQ(output_data, raw_data);
+  EXPECT_TRUE(fake_fec->GetReadOps().empty());
+}
+
+// Test that applying SOURCE_COPY operations together writes the same target
+// as applying them one by one.
+TEST_F(PartitionWriterTest, BatchedSourceCopyTest) {
+  constexpr size_t kNumBlocks = 8;
+  brillo::Blob source_data = FakeFileDescriptorData(kNumBlocks * kBlockSize);
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(source_partition.path(), source_data));
+  install_part_.source_size = source_data.size();
+  install_part_.target_size = source_data.size();
+  ASSERT_TRUE(writer_.Init(&install_plan_, true, 0));
+
+  // Each operation copies source blocks [src, src + 2) to [dst, dst + 2).
+  const std::vector<std::pair<uint64_t, uint64_t>> copies = {
+      {0, 4}, {2, 6}, {6, 0}};
+  std::vector<InstallOperation> ops;
+  brillo::Blob expected_data(source_data.size());
+  for (const auto& [src, dst] : copies) {
+    InstallOperation op;
+    op.set_type(InstallOperation::SOURCE_COPY);
+    *op.add_src_extents() = ExtentForRange(src, 2);
+    *op.add_dst_extents() = ExtentForRange(dst, 2);
+    brillo::Blob src_blocks(source_data.begin() + src * kBlockSize,
+                            source_data.begin() + (src + 2) * kBlockSize);
+    brillo::Blob src_hash;
+    ASSERT_TRUE(HashCalculator::RawHashOfData(src_blocks, &src_hash));
+    op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+    std::copy(src_blocks.begin(),
+              src_blocks.end(),
+              expected_data.begin() + dst * kBlockSize);
+    ops.push_back(op);
+  }
+  std::vector<const InstallOperation*> op_ptrs;
+  for (const InstallOperation& op : ops) {
+    op_ptrs.push_back(&op);
+  }
+
+  ErrorCode error = ErrorCode::kSuccess;
+  ASSERT_TRUE(writer_.PerformSourceCopyOperations(op_ptrs, &error));
+  ASSERT_EQ(ErrorCode::kSuccess, error);
+  writer_.CheckpointUpdateProgress(ops.size());
+
+  brillo::Blob output_data;
+  ASSERT_TRUE(utils::ReadFile(target_partition.path(), &output_data));
+  ASSERT_EQ(expected_data, output_data);
+}
+
+// Test that applying ZERO and DISCARD operations together zeroes all of their
+// target blocks, adjacent or not, when the target can't zero them itself.
+TEST_F(PartitionWriterTest, BatchedZeroOrDiscardTest) {
+  constexpr size_t kNumBlocks = 8;
+  brillo::Blob target_data = FakeFileDescriptorData(kNumBlocks * kBlockSize);
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(target_partition.path(), target_data));
+  install_part_.target_size = target_data.size();
+  ASSERT_TRUE(writer_.Init(&install_plan_, false, 0));
+
+  const std::vector<std::pair<InstallOperation::Type, Extent>> zeroes = {
+      {InstallOperation::ZERO, ExtentForRange(1, 2)},
+      {InstallOperation::DISCARD, ExtentForRange(3, 1)},
+      {InstallOperation::ZERO, ExtentForRange(6, 2)}};
+  std::vector<InstallOperation> ops;
+  brillo::Blob expected_data = target_data;
+  for (const auto& [type, extent] : zeroes) {
+    InstallOperation op;
+    op.set_type(type);
+    *op.add_dst_extents() = extent;
+    std::fill_n(expected_data.begin() + extent.start_block() * kBlockSize,
+                extent.num_blocks() * kBlockSize,
+                0);
+    ops.push_back(op);
+  }
+  std::vector<const InstallOperation*> op_ptrs;
+  for (const InstallOperation& op : ops) {
+    op_ptrs.push_back(&op);
+  }
+
+  ASSERT_TRUE(writer_.PerformZeroOrDiscardOperations(op_ptrs));
+  writer_.CheckpointUpdateProgress(ops.size());
+
+  brillo::Blob output_data;
+  ASSERT_TRUE(utils::ReadFile(target_partition.path(), &output_data));
+  ASSERT_EQ(expected_data, output_data);
+}
+
 TEST_F(PartitionWriterTest, ChooseSourceFDTest) {
   constexpr size_t kSourceSize = 4 * 4096;
   ScopedTempFile source("Source-XXXXXX");
@@ -217,4 +411,45 @@ TEST_F(PartitionWriterTest, ChooseSourceFDTest) {
   ASSERT_EQ(1U, GetSourceEccRecoveredFailures());
 }
 
+// Test that only the source blocks which don't match the hash tree of the
+// source partition are read from the error corrected device, and written back.
+TEST_F(PartitionWriterTest, ChooseSourceFDCorrectsCorruptedBlocksTest) {
+  constexpr size_t kSourceSize = 4 * 4096;
+  brillo::Blob expected_data = FakeFileDescriptorData(kSourceSize);
+  brillo::Blob corrupted_data = expected_data;
+  std::fill(corrupted_data.begin() + 2 * 4096,
+            corrupted_data.begin() + 3 * 4096,
+            0x55);
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(source_partition.path(), corrupted_data));
+
+  writer_.verified_source_fd_.source_fd_ =
+      std::make_shared<EintrSafeFileDescriptor>();
+  writer_.verified_source_fd_.source_fd_->Open(source_partition.path().c_str(),
+                                               O_RDONLY);
+  FakeFileDescriptor* fake_fec = SetFakeECCFile(kSourceSize);
+  SetSourceHashTree(expected_data);
+  ASSERT_NO_FATAL_FAILURE();
+
+  InstallOperation op;
+  *(op.add_src_extents()) = ExtentForRange(0, kSourceSize / 4096);
+  brillo::Blob src_hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(expected_data, &src_hash));
+  op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+
+  ErrorCode error = ErrorCode::kSuccess;
+  ASSERT_EQ(writer_.ChooseSourceFD(op, &error),
+            writer_.verified_source_fd_.source_fd_);
+  ASSERT_EQ(ErrorCode::kSuccess, error);
+  // Only the corrupted block was read through the error corrected device.
+  ASSERT_EQ(1U, fake_fec->GetReadOps().size());
+  EXPECT_EQ(std::make_pair<uint64_t, uint64_t>(2 * 4096, 4096),
+            fake_fec->GetReadOps()[0]);
+  EXPECT_EQ(1U, GetSourceEccRecoveredFailures());
+
+  brillo::Blob source_data;
+  ASSERT_TRUE(utils::ReadFile(source_partition.path(), &source_data));
+  EXPECT_EQ(expected_data, source_data);
+}
+
 }  // namespace chromeos_update_engine
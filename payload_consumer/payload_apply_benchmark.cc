@@ -0,0 +1,612 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Applies a payload to image files or block devices the way an update does,
+// through DeltaPerformer then FilesystemVerifierAction, and reports for each
+// phase of it the time taken, the throughput, the CPU time, the peak RSS and
+// the read and write system calls: receiving the manifest, applying the
+// operations and verifying the partitions. The time of the operations is
+// broken down per type and per step as in OperationStats, the one of the
+// checkpoints and of the hash tree, FEC and hash steps of the verification is
+// reported on its own. With --json, prints all of it as one JSON object, to
+// compare versions and tunings.
+//
+// Usage: payload_apply_benchmark --payload=<payload.bin> --output_dir=<dir>
+//            [--input_dir=<dir>] [--json]
+//
+// The target of each partition is <output_dir>/<partition>.img, which may be a
+// symlink to a block device, and its source <input_dir>/<partition>.img.
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <base/bind.h>
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/files/scoped_temp_dir.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_split.h>
+#include <base/strings/stringprintf.h>
+#include <base/time/time.h>
+#include <brillo/message_loops/base_message_loop.h>
+#include <gflags/gflags.h>
+#include <xz.h>
+
+#include "update_engine/common/action_processor.h"
+#include "update_engine/common/download_action.h"
+#include "update_engine/common/fake_boot_control.h"
+#include "update_engine/common/fake_hardware.h"
+#include "update_engine/common/prefs.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/delta_performer.h"
+#include "update_engine/payload_consumer/filesystem_verifier_action.h"
+#include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/operation_stats.h"
+#include "update_engine/payload_consumer/operations_section.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/update_metadata.pb.h"
+
+DEFINE_string(payload, "", "Path to payload.bin");
+DEFINE_string(input_dir,
+              "",
+              "Directory of the source images, required for a delta payload");
+DEFINE_string(output_dir, "", "Directory of the target images");
+DEFINE_string(prefs_dir,
+              "",
+              "Directory to checkpoint the progress to, a temporary one by "
+              "default");
+DEFINE_uint64(chunk_size,
+              1024 * 1024,
+              "Number of bytes of the payload passed to DeltaPerformer at "
+              "once, as a download does");
+DEFINE_bool(write_verity, true, "Compute the hash tree and FEC data");
+DEFINE_bool(json, false, "Print the results as one JSON object");
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The resources used by the process up to some point.
+struct Usage {
+  base::TimeTicks time;
+  base::TimeDelta cpu;
+  uint64_t read_syscalls{};
+  uint64_t write_syscalls{};
+};
+
+struct PhaseResult {
+  string name;
+  uint64_t bytes{};
+  base::TimeDelta time;
+  base::TimeDelta cpu;
+  uint64_t peak_rss_kb{};
+  uint64_t read_syscalls{};
+  uint64_t write_syscalls{};
+};
+
+// Resets the peak RSS of the process to its current RSS, so that the peak
+// read after a phase is the one of the phase. Without it, as on kernels not
+// supporting it, the peak is the one of the whole run.
+void ResetPeakRss() {
+  static bool supported = true;
+  if (supported && !utils::WriteFile("/proc/self/clear_refs", "5", 1)) {
+    LOG(WARNING) << "Can't reset the peak RSS, reporting the peak of the run.";
+    supported = false;
+  }
+}
+
+uint64_t PeakRssKb() {
+  string status;
+  if (!base::ReadFileToString(base::FilePath("/proc/self/status"), &status)) {
+    return 0;
+  }
+  const auto pos = status.find("VmHWM:");
+  uint64_t kb = 0;
+  if (pos == string::npos ||
+      sscanf(status.c_str() + pos, "VmHWM: %" SCNu64, &kb) != 1) {
+    return 0;
+  }
+  return kb;
+}
+
+Usage GetUsage() {
+  Usage usage;
+  usage.time = base::TimeTicks::Now();
+  struct rusage rusage {};
+  if (getrusage(RUSAGE_SELF, &rusage) == 0) {
+    usage.cpu = base::TimeDelta::FromTimeVal(rusage.ru_utime) +
+                base::TimeDelta::FromTimeVal(rusage.ru_stime);
+  }
+  // The system calls reading and writing of all the threads.
+  string io;
+  if (base::ReadFileToString(base::FilePath("/proc/self/io"), &io)) {
+    base::StringPairs pairs;
+    base::SplitStringIntoKeyValuePairs(io, ':', '\n', &pairs);
+    for (const auto& [key, value] : pairs) {
+      string trimmed;
+      base::TrimWhitespaceASCII(value, base::TRIM_ALL, &trimmed);
+      if (key == "syscr") {
+        base::StringToUint64(trimmed, &usage.read_syscalls);
+      } else if (key == "syscw") {
+        base::StringToUint64(trimmed, &usage.write_syscalls);
+      }
+    }
+  }
+  return usage;
+}
+
+// Runs |phase| over |bytes| bytes, returning whether it succeeded and filling
+// |result|.
+template <typename Phase>
+bool MeasurePhase(const string& name,
+                  uint64_t bytes,
+                  Phase phase,
+                  PhaseResult* result) {
+  ResetPeakRss();
+  const Usage start = GetUsage();
+  const bool success = phase();
+  const Usage end = GetUsage();
+  result->name = name;
+  result->bytes = bytes;
+  result->time = end.time - start.time;
+  result->cpu = end.cpu - start.cpu;
+  result->peak_rss_kb = PeakRssKb();
+  result->read_syscalls = end.read_syscalls - start.read_syscalls;
+  result->write_syscalls = end.write_syscalls - start.write_syscalls;
+  return success;
+}
+
+double MegabytesPerSecond(uint64_t bytes, base::TimeDelta time) {
+  return time.is_zero() ? 0 : bytes / time.InSecondsF() / 1024 / 1024;
+}
+
+// Prefs timing the checkpoints, the transactions and SetKeys() calls
+// DeltaPerformer writes its progress with.
+class TimedPrefs : public PrefsInterface {
+ public:
+  explicit TimedPrefs(PrefsInterface* prefs) : prefs_(prefs) {}
+
+  bool GetString(std::string_view key, string* value) const override {
+    return prefs_->GetString(key, value);
+  }
+  bool SetString(std::string_view key, std::string_view value) override {
+    return prefs_->SetString(key, value);
+  }
+  bool GetInt64(std::string_view key, int64_t* value) const override {
+    return prefs_->GetInt64(key, value);
+  }
+  bool SetInt64(std::string_view key, const int64_t value) override {
+    return prefs_->SetInt64(key, value);
+  }
+  bool GetBoolean(std::string_view key, bool* value) const override {
+    return prefs_->GetBoolean(key, value);
+  }
+  bool SetBoolean(std::string_view key, const bool value) override {
+    return prefs_->SetBoolean(key, value);
+  }
+  bool Exists(std::string_view key) const override {
+    return prefs_->Exists(key);
+  }
+  bool Delete(std::string_view key) override { return prefs_->Delete(key); }
+  bool Delete(std::string_view pref_key,
+              const vector<string>& nss) override {
+    return prefs_->Delete(pref_key, nss);
+  }
+  bool GetSubKeys(std::string_view ns, vector<string>* keys) const override {
+    return prefs_->GetSubKeys(ns, keys);
+  }
+  void AddObserver(std::string_view key,
+                   ObserverInterface* observer) override {
+    prefs_->AddObserver(key, observer);
+  }
+  void RemoveObserver(std::string_view key,
+                      ObserverInterface* observer) override {
+    prefs_->RemoveObserver(key, observer);
+  }
+  bool StartTransaction() override {
+    transaction_start_ = base::TimeTicks::Now();
+    return prefs_->StartTransaction();
+  }
+  bool CancelTransaction() override {
+    const bool success = prefs_->CancelTransaction();
+    EndTransaction();
+    return success;
+  }
+  bool SubmitTransaction() override {
+    const bool success = prefs_->SubmitTransaction();
+    EndTransaction();
+    return success;
+  }
+  bool SetKeys(const Changes& changes) override {
+    transaction_start_ = base::TimeTicks::Now();
+    const bool success = prefs_->SetKeys(changes);
+    EndTransaction();
+    return success;
+  }
+  void SetDurability(std::string_view key, Durability durability) override {
+    prefs_->SetDurability(key, durability);
+  }
+  bool FlushDeferredWrites() override { return prefs_->FlushDeferredWrites(); }
+
+  uint64_t checkpoints() const { return checkpoints_; }
+  base::TimeDelta checkpoint_time() const { return checkpoint_time_; }
+
+ private:
+  void EndTransaction() {
+    checkpoints_++;
+    checkpoint_time_ += base::TimeTicks::Now() - transaction_start_;
+  }
+
+  PrefsInterface* prefs_;
+  base::TimeTicks transaction_start_;
+  uint64_t checkpoints_{0};
+  base::TimeDelta checkpoint_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(TimedPrefs);
+};
+
+class BenchmarkDownloadDelegate : public DownloadActionDelegate {
+ public:
+  void BytesReceived(uint64_t bytes_progressed,
+                     uint64_t bytes_received,
+                     uint64_t total) override {}
+  bool ShouldCancel(ErrorCode* cancel_reason) override { return false; }
+  void DownloadComplete() override {}
+};
+
+class VerifyProcessorDelegate : public ActionProcessorDelegate {
+ public:
+  void ProcessingDone(const ActionProcessor* processor,
+                      ErrorCode code) override {
+    code_ = code;
+    brillo::MessageLoop::current()->BreakLoop();
+  }
+  void ProcessingStopped(const ActionProcessor* processor) override {
+    brillo::MessageLoop::current()->BreakLoop();
+  }
+  void ActionCompleted(ActionProcessor* processor,
+                       AbstractAction* action,
+                       ErrorCode code) override {
+    if (action->Type() == FilesystemVerifierAction::StaticType()) {
+      step_times_ =
+          static_cast<FilesystemVerifierAction*>(action)->step_times();
+    }
+  }
+
+  ErrorCode code_{ErrorCode::kError};
+  FilesystemVerifierAction::StepTimes step_times_;
+};
+
+// Creates the target image of |partition| in |output_dir| if needed, with the
+// size of the partition if it is a file, and sets it and the source image up
+// in |boot_control|.
+bool SetUpPartition(const PartitionUpdate& partition,
+                    const InstallPlan& install_plan,
+                    FakeBootControl* boot_control) {
+  const string image_name = partition.partition_name() + ".img";
+  const string target_path =
+      base::FilePath(FLAGS_output_dir).Append(image_name).value();
+  int fd = open(target_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    PLOG(ERROR) << "Failed to open " << target_path;
+    return false;
+  }
+  ScopedFdCloser closer(&fd);
+  struct stat st {};
+  TEST_AND_RETURN_FALSE_ERRNO(fstat(fd, &st) == 0);
+  if (S_ISREG(st.st_mode)) {
+    TEST_AND_RETURN_FALSE_ERRNO(
+        ftruncate(fd, partition.new_partition_info().size()) == 0);
+  }
+  boot_control->SetPartitionDevice(
+      partition.partition_name(), install_plan.target_slot, target_path);
+  if (partition.has_old_partition_info()) {
+    boot_control->SetPartitionDevice(
+        partition.partition_name(),
+        install_plan.source_slot,
+        base::FilePath(FLAGS_input_dir).Append(image_name).value());
+  }
+  return true;
+}
+
+string PhaseText(const PhaseResult& phase) {
+  return base::StringPrintf(
+      "%s: %" PRIu64 " bytes in %s, %.2f MB/s, cpu %s, peak RSS %" PRIu64
+      " KiB, %" PRIu64 " reads, %" PRIu64 " writes",
+      phase.name.c_str(),
+      phase.bytes,
+      utils::FormatTimeDelta(phase.time).c_str(),
+      MegabytesPerSecond(phase.bytes, phase.time),
+      utils::FormatTimeDelta(phase.cpu).c_str(),
+      phase.peak_rss_kb,
+      phase.read_syscalls,
+      phase.write_syscalls);
+}
+
+string PhaseJson(const PhaseResult& phase) {
+  return base::StringPrintf(
+      "{\"phase\":\"%s\",\"bytes\":%" PRIu64
+      ",\"seconds\":%.6f,\"mb_per_s\":%.3f,\"cpu_seconds\":%.6f,"
+      "\"peak_rss_kb\":%" PRIu64 ",\"read_syscalls\":%" PRIu64
+      ",\"write_syscalls\":%" PRIu64 "}",
+      phase.name.c_str(),
+      phase.bytes,
+      phase.time.InSecondsF(),
+      MegabytesPerSecond(phase.bytes, phase.time),
+      phase.cpu.InSecondsF(),
+      phase.peak_rss_kb,
+      phase.read_syscalls,
+      phase.write_syscalls);
+}
+
+// The operations of a type per step, and the throughput over the bytes they
+// wrote, not counting the time waiting for their data.
+string OperationsJson(const OperationStats& stats,
+                      const std::map<InstallOperation::Type, uint64_t>& bytes) {
+  string json = "[";
+  for (const auto& [type, phases] : stats.histograms) {
+    uint64_t count = 0;
+    base::TimeDelta busy;
+    string steps;
+    for (size_t i = 0; i < kNumOperationPhases; i++) {
+      const auto phase = static_cast<OperationPhase>(i);
+      count = std::max(count, phases[i].count);
+      if (phase != OperationPhase::kWaitForData) {
+        busy += phases[i].total;
+      }
+      base::StringAppendF(&steps,
+                          "%s\"%s\":%.6f",
+                          i == 0 ? "" : ",",
+                          OperationPhaseName(phase),
+                          phases[i].total.InSecondsF());
+    }
+    const auto it = bytes.find(type);
+    const uint64_t type_bytes = it == bytes.end() ? 0 : it->second;
+    base::StringAppendF(&json,
+                        "%s{\"type\":\"%s\",\"count\":%" PRIu64
+                        ",\"bytes\":%" PRIu64 ",\"mb_per_s\":%.3f,%s}",
+                        json.size() == 1 ? "" : ",",
+                        InstallOperationTypeName(type),
+                        count,
+                        type_bytes,
+                        MegabytesPerSecond(type_bytes, busy),
+                        steps.c_str());
+  }
+  return json + "]";
+}
+
+int RunBenchmark() {
+  PayloadMetadata metadata;
+  DeltaArchiveManifest manifest;
+  Signatures metadata_signatures;
+  if (!metadata.ParsePayloadFile(
+          FLAGS_payload, &manifest, &metadata_signatures)) {
+    LOG(ERROR) << "Failed to parse " << FLAGS_payload;
+    return 1;
+  }
+  int payload_fd = open(FLAGS_payload.c_str(), O_RDONLY | O_CLOEXEC);
+  if (payload_fd < 0) {
+    PLOG(ERROR) << "Failed to open " << FLAGS_payload;
+    return 1;
+  }
+  ScopedFdCloser payload_closer(&payload_fd);
+  const uint64_t payload_size = utils::FileSize(payload_fd);
+  auto* payload = static_cast<uint8_t*>(
+      mmap(nullptr, payload_size, PROT_READ, MAP_PRIVATE, payload_fd, 0));
+  if (payload == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to mmap() " << FLAGS_payload;
+    return 1;
+  }
+  auto munmap_deleter = [payload_size](uint8_t* payload) {
+    munmap(payload, payload_size);
+  };
+  std::unique_ptr<uint8_t, decltype(munmap_deleter)> munmapper{
+      payload, munmap_deleter};
+  // Only for the statistics below, the performer parses them on its own.
+  const uint64_t data_begin =
+      metadata.GetMetadataSize() + metadata.GetMetadataSignatureSize();
+  if (data_begin > payload_size ||
+      !ParseOperationsSections(
+          payload + data_begin, payload_size - data_begin, &manifest)) {
+    LOG(ERROR) << "Failed to parse the operations sections of "
+               << FLAGS_payload;
+    return 1;
+  }
+
+  bool is_delta = false;
+  uint64_t target_size = 0;
+  std::map<InstallOperation::Type, uint64_t> operation_bytes;
+  for (const auto& partition : manifest.partitions()) {
+    is_delta = is_delta || partition.has_old_partition_info();
+    target_size += partition.new_partition_info().size();
+    for (const auto& op : partition.operations()) {
+      for (const auto& extent : op.dst_extents()) {
+        operation_bytes[op.type()] +=
+            extent.num_blocks() * manifest.block_size();
+      }
+    }
+  }
+  if (is_delta && FLAGS_input_dir.empty()) {
+    LOG(ERROR) << "--input_dir is required for a delta payload.";
+    return 1;
+  }
+
+  InstallPlan install_plan;
+  install_plan.source_slot = is_delta ? 0 : BootControlInterface::kInvalidSlot;
+  install_plan.target_slot = 1;
+  install_plan.write_verity = FLAGS_write_verity;
+  install_plan.payloads = {{.size = payload_size,
+                            .metadata_size = metadata.GetMetadataSize(),
+                            .type = is_delta ? InstallPayloadType::kDelta
+                                             : InstallPayloadType::kFull}};
+  FakeBootControl boot_control;
+  FakeHardware hardware;
+  for (const auto& partition : manifest.partitions()) {
+    if (!SetUpPartition(partition, install_plan, &boot_control)) {
+      return 1;
+    }
+  }
+
+  base::ScopedTempDir temp_prefs_dir;
+  base::FilePath prefs_dir(FLAGS_prefs_dir);
+  if (prefs_dir.empty()) {
+    CHECK(temp_prefs_dir.CreateUniqueTempDir());
+    prefs_dir = temp_prefs_dir.GetPath();
+  }
+  Prefs file_prefs;
+  if (!file_prefs.Init(prefs_dir)) {
+    LOG(ERROR) << "Failed to initialize the prefs in " << prefs_dir.value();
+    return 1;
+  }
+  TimedPrefs prefs(&file_prefs);
+
+  xz_crc32_init();
+  BenchmarkDownloadDelegate download_delegate;
+  DeltaPerformer performer(&prefs,
+                           &boot_control,
+                           &hardware,
+                           &download_delegate,
+                           &install_plan,
+                           &install_plan.payloads[0],
+                           false /* interactive */,
+                           "");
+  vector<PhaseResult> phases(3);
+  ErrorCode error = ErrorCode::kSuccess;
+  const uint64_t metadata_end =
+      metadata.GetMetadataSize() + metadata.GetMetadataSignatureSize();
+  if (!MeasurePhase(
+          "manifest",
+          metadata_end,
+          [&] { return performer.Write(payload, metadata_end, &error); },
+          &phases[0])) {
+    LOG(ERROR) << "Failed to parse the manifest: "
+               << utils::ErrorCodeToString(error);
+    return 1;
+  }
+  if (!MeasurePhase(
+          "operations",
+          payload_size - metadata_end,
+          [&] {
+            for (uint64_t offset = metadata_end; offset < payload_size;
+                 offset += FLAGS_chunk_size) {
+              const size_t count =
+                  std::min<uint64_t>(FLAGS_chunk_size, payload_size - offset);
+              if (!performer.Write(payload + offset, count, &error)) {
+                return false;
+              }
+            }
+            return performer.Close() == 0;
+          },
+          &phases[1])) {
+    LOG(ERROR) << "Failed to apply the payload: "
+               << utils::ErrorCodeToString(error);
+    return 1;
+  }
+
+  brillo::BaseMessageLoop loop;
+  loop.SetAsCurrent();
+  ActionProcessor processor;
+  VerifyProcessorDelegate verify_delegate;
+  processor.set_delegate(&verify_delegate);
+  auto install_plan_action = std::make_unique<InstallPlanAction>(install_plan);
+  auto verifier_action = std::make_unique<FilesystemVerifierAction>(
+      boot_control.GetDynamicPartitionControl());
+  BondActions(install_plan_action.get(), verifier_action.get());
+  processor.EnqueueAction(std::move(install_plan_action));
+  processor.EnqueueAction(std::move(verifier_action));
+  if (!MeasurePhase(
+          "verify",
+          target_size,
+          [&] {
+            loop.PostTask(FROM_HERE,
+                          base::Bind(&ActionProcessor::StartProcessing,
+                                     base::Unretained(&processor)));
+            loop.Run();
+            return verify_delegate.code_ == ErrorCode::kSuccess;
+          },
+          &phases[2])) {
+    LOG(ERROR) << "Failed to verify the partitions: "
+               << utils::ErrorCodeToString(verify_delegate.code_);
+    return 1;
+  }
+
+  const auto& steps = verify_delegate.step_times_;
+  if (FLAGS_json) {
+    string phases_json;
+    for (const auto& phase : phases) {
+      phases_json += (phases_json.empty() ? "" : ",") + PhaseJson(phase);
+    }
+    printf("{\"payload_size\":%" PRIu64 ",\"phases\":[%s],\"operations\":%s,"
+           "\"checkpoints\":{\"count\":%" PRIu64 ",\"seconds\":%.6f},"
+           "\"verify_steps\":{\"hash_tree\":%.6f,\"fec\":%.6f,"
+           "\"hash\":%.6f}}\n",
+           payload_size,
+           phases_json.c_str(),
+           OperationsJson(install_plan.operation_stats, operation_bytes)
+               .c_str(),
+           prefs.checkpoints(),
+           prefs.checkpoint_time().InSecondsF(),
+           steps.hash_tree.InSecondsF(),
+           steps.fec.InSecondsF(),
+           steps.hash.InSecondsF());
+    return 0;
+  }
+  for (const auto& phase : phases) {
+    printf("%s\n", PhaseText(phase).c_str());
+  }
+  printf("%s", install_plan.operation_stats.ToString().c_str());
+  printf("checkpoints: %" PRIu64 " in %s\n",
+         prefs.checkpoints(),
+         utils::FormatTimeDelta(prefs.checkpoint_time()).c_str());
+  printf("verify steps: hash tree %s, fec %s, hash %s\n",
+         utils::FormatTimeDelta(steps.hash_tree).c_str(),
+         utils::FormatTimeDelta(steps.fec).c_str(),
+         utils::FormatTimeDelta(steps.hash).c_str());
+  return 0;
+}
+
+}  // namespace
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char* argv[]) {
+  gflags::SetUsageMessage(
+      "Applies a payload and reports the time and resources of each phase");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_payload.empty() || FLAGS_output_dir.empty()) {
+    LOG(ERROR) << "--payload and --output_dir are required.";
+    return 2;
+  }
+  return chromeos_update_engine::RunBenchmark();
+}
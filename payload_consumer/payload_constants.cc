@@ -37,7 +37,8 @@ const uint32_t kPartialUpdateMinorPayloadVersion = 7;
 const uint32_t kZucchiniMinorPayloadVersion = 8;
 
 const uint32_t kMinSupportedMinorPayloadVersion = kSourceMinorPayloadVersion;
-const uint32_t kMaxSupportedMinorPayloadVersion = kLZ4DIFFMinorPayloadVersion;
+const uint32_t kMaxSupportedMinorPayloadVersion =
+    kOperationsSectionMinorPayloadVersion;
 
 const uint64_t kMaxPayloadHeaderSize = 24;
 
@@ -62,6 +63,8 @@ const char* InstallOperationTypeName(InstallOperation::Type op_type) {
       return "DISCARD";
     case InstallOperation::REPLACE_XZ:
       return "REPLACE_XZ";
+    case InstallOperation::REPLACE_ZSTD:
+      return "REPLACE_ZSTD";
     case InstallOperation::PUFFDIFF:
       return "PUFFDIFF";
     case InstallOperation::BROTLI_BSDIFF:
@@ -79,4 +82,14 @@ const char* InstallOperationTypeName(InstallOperation::Type op_type) {
   return "<unknown_op>";
 }
 
+HashAlgorithm GetDataHashAlgorithm(const DeltaArchiveManifest& manifest) {
+  switch (manifest.data_hash_algorithm()) {
+    case DeltaArchiveManifest::BLAKE2B_256:
+      return HashAlgorithm::kBlake2b256;
+    case DeltaArchiveManifest::SHA256:
+      break;
+  }
+  return HashAlgorithm::kSha256;
+}
+
 };  // namespace chromeos_update_engine
@@ -21,6 +21,7 @@
 
 #include <limits>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -65,6 +66,22 @@ extern const uint32_t kZucchiniMinorPayloadVersion;
 // THe minor version that allows LZ4DIFF operation
 constexpr uint32_t kLZ4DIFFMinorPayloadVersion = 9;
 
+// The minor version that allows REPLACE_ZSTD operation.
+constexpr uint32_t kZstdMinorPayloadVersion = 10;
+
+// The minor version that specifies PartitionInfo.chunked_hash.
+constexpr uint32_t kChunkedHashMinorPayloadVersion = 11;
+
+// The minor version that allows InstallOperation.packed_src_extents and
+// packed_dst_extents.
+constexpr uint32_t kPackedExtentsMinorPayloadVersion = 12;
+
+// The minor version that allows DeltaArchiveManifest.data_hash_algorithm.
+constexpr uint32_t kDataHashAlgorithmMinorPayloadVersion = 13;
+
+// The minor version that allows PartitionUpdate.operations_section.
+constexpr uint32_t kOperationsSectionMinorPayloadVersion = 14;
+
 // The minimum and maximum supported minor version.
 extern const uint32_t kMinSupportedMinorPayloadVersion;
 extern const uint32_t kMaxSupportedMinorPayloadVersion;
@@ -88,6 +105,9 @@ const uint64_t kSparseHole = std::numeric_limits<uint64_t>::max();
 // Return the name of the operation type.
 const char* InstallOperationTypeName(InstallOperation::Type op_type);
 
+// Returns the algorithm of the hashes of the data in |manifest|.
+HashAlgorithm GetDataHashAlgorithm(const DeltaArchiveManifest& manifest);
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_PAYLOAD_CONSTANTS_H_
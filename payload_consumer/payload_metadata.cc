@@ -24,6 +24,7 @@
 #include "update_engine/common/constants.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/packed_extents.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
 
@@ -149,8 +150,13 @@ bool PayloadMetadata::GetManifest(const unsigned char* payload,
                                   DeltaArchiveManifest* out_manifest) const {
   uint64_t manifest_offset = GetManifestOffset();
   CHECK_GE(size, manifest_offset + manifest_size_);
-  return out_manifest->ParseFromArray(&payload[manifest_offset],
-                                      manifest_size_);
+  TEST_AND_RETURN_FALSE(
+      out_manifest->ParseFromArray(&payload[manifest_offset], manifest_size_));
+  // The packed extents of older payloads are left for ValidateManifest() to
+  // reject.
+  if (out_manifest->minor_version() < kPackedExtentsMinorPayloadVersion)
+    return true;
+  return UnpackManifestExtents(out_manifest);
 }
 
 ErrorCode PayloadMetadata::ValidateMetadataSignature(
@@ -85,7 +85,8 @@ class PayloadMetadata {
   // yet parsed, returns zero.
   uint32_t GetMetadataSignatureSize() const { return metadata_signature_size_; }
 
-  // Set |*out_manifest| to the manifest in |payload|.
+  // Set |*out_manifest| to the manifest in |payload|, with the packed extents
+  // of its operations moved to their src_extents and dst_extents.
   // Returns true on success.
   bool GetManifest(const brillo::Blob& payload,
                    DeltaArchiveManifest* out_manifest) const;
@@ -16,6 +16,11 @@
 
 #include "update_engine/payload_consumer/payload_verifier.h"
 
+#include <sys/stat.h>
+
+#include <map>
+#include <mutex>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -49,6 +54,43 @@ const uint8_t kSHA256DigestInfoPrefix[] = {
     0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20,
 };
 
+// A verifier made from a key source, and the stamp of the file it was read
+// from, which must still be the same for the verifier to be reused.
+struct CachedVerifier {
+  std::string stamp;
+  std::shared_ptr<const PayloadVerifier> verifier;
+};
+
+// The identity and modification time of |path|, or an empty string if it
+// can't be read.
+std::string GetFileStamp(const std::string& path) {
+  struct stat st {};
+  if (stat(path.c_str(), &st) != 0)
+    return "";
+  return std::to_string(st.st_dev) + ":" + std::to_string(st.st_ino) + ":" +
+         std::to_string(st.st_size) + ":" + std::to_string(st.st_mtim.tv_sec) +
+         "." + std::to_string(st.st_mtim.tv_nsec);
+}
+
+// Returns the verifier cached for |key| with the same |stamp|, or calls
+// |create| and caches the verifier it makes. Failures aren't cached.
+template <typename Create>
+std::shared_ptr<const PayloadVerifier> GetCachedVerifier(
+    const std::string& key, const std::string& stamp, Create create) {
+  static std::mutex mutex;
+  static std::map<std::string, CachedVerifier> cache;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = cache.find(key);
+  if (it != cache.end() && it->second.stamp == stamp)
+    return it->second.verifier;
+  std::shared_ptr<const PayloadVerifier> verifier = create();
+  if (!verifier)
+    return nullptr;
+  cache[key] = {stamp, verifier};
+  return verifier;
+}
+
 }  // namespace
 
 std::unique_ptr<PayloadVerifier> PayloadVerifier::CreateInstance(
@@ -93,6 +135,27 @@ std::unique_ptr<PayloadVerifier> PayloadVerifier::CreateInstanceFromZipPath(
       new PayloadVerifier(std::move(public_keys)));
 }
 
+std::shared_ptr<const PayloadVerifier> PayloadVerifier::GetCachedInstance(
+    const std::string& pem_public_key) {
+  return GetCachedVerifier("pem:" + pem_public_key, "", [&pem_public_key]() {
+    return CreateInstance(pem_public_key);
+  });
+}
+
+std::shared_ptr<const PayloadVerifier>
+PayloadVerifier::GetCachedInstanceFromZipPath(
+    const std::string& certificate_zip_path) {
+  // Taken before parsing, so that a file replaced in the meantime is parsed
+  // again the next time.
+  std::string stamp = GetFileStamp(certificate_zip_path);
+  if (stamp.empty())
+    return CreateInstanceFromZipPath(certificate_zip_path);
+  return GetCachedVerifier(
+      "zip:" + certificate_zip_path, stamp, [&certificate_zip_path]() {
+        return CreateInstanceFromZipPath(certificate_zip_path);
+      });
+}
+
 bool PayloadVerifier::VerifySignature(
     const string& signature_proto, const brillo::Blob& sha256_hash_data) const {
   LOG(INFO) << "Payload signature verification skipped";
@@ -53,6 +53,15 @@ class PayloadVerifier {
   static std::unique_ptr<PayloadVerifier> CreateInstanceFromZipPath(
       const std::string& certificate_zip_path);
 
+  // Same as CreateInstance() and CreateInstanceFromZipPath(), but the
+  // verifiers are kept for the lifetime of the process and shared, so that the
+  // keys are only parsed again when |pem_public_key| is another key, or the
+  // zip file was modified since.
+  static std::shared_ptr<const PayloadVerifier> GetCachedInstance(
+      const std::string& pem_public_key);
+  static std::shared_ptr<const PayloadVerifier> GetCachedInstanceFromZipPath(
+      const std::string& certificate_zip_path);
+
   // Interprets |signature_proto| as a protocol buffer containing the
   // |Signatures| message and decrypts each signature data using the stored
   // public key. Pads the 32 bytes |sha256_hash_data| to 256 or 512 bytes
@@ -21,16 +21,20 @@
 #include <stdlib.h>
 #include <selinux/selinux.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <cmath>
 #include <fstream>
 #include <string>
+#include <vector>
 
 #include <base/files/file_path.h>
 #include <base/files/file_util.h>
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/stl_util.h>
 #include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
@@ -50,11 +54,51 @@ namespace {
 // sample_images.sh file.
 const int kPostinstallStatusFd = 3;
 
+// The most bytes of the files a postinstall program reads to read ahead.
+constexpr int64_t kMaxPostinstallCacheBytes = 256 * 1024 * 1024;
+
 static constexpr bool Contains(std::string_view haystack,
                                std::string_view needle) {
   return haystack.find(needle) != std::string::npos;
 }
 
+// Has the kernel read ahead the |files|, relative to |mount_point|, for the
+// postinstall program to find them in the page cache.
+static void WarmPostinstallCache(const std::string& mount_point,
+                                 const std::vector<std::string>& files) {
+  int64_t total_bytes = 0;
+  size_t num_files = 0;
+  for (const auto& file : files) {
+    const base::FilePath file_path(file);
+    if (file_path.IsAbsolute() || file_path.ReferencesParent()) {
+      LOG(WARNING) << "Not reading ahead invalid postinstall file " << file;
+      continue;
+    }
+    const std::string path =
+        base::FilePath(mount_point).Append(file_path).value();
+    int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd < 0) {
+      PLOG(WARNING) << "Failed to open " << path;
+      continue;
+    }
+    chromeos_update_engine::ScopedFdCloser fd_closer(&fd);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+      continue;
+    if (total_bytes + st.st_size > kMaxPostinstallCacheBytes) {
+      LOG(INFO) << "Postinstall files past " << file << " not read ahead";
+      break;
+    }
+    // Only starts reading, asynchronously.
+    if (posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) == 0) {
+      total_bytes += st.st_size;
+      num_files++;
+    }
+  }
+  LOG(INFO) << "Reading ahead " << num_files << " postinstall files, "
+            << total_bytes << " bytes";
+}
+
 static void LogBuildInfoForPartition(std::string_view mount_point) {
   static constexpr std::array<std::string_view, 3> kBuildPropFiles{
       "build.prop", "etc/build.prop", "system/build.prop"};
@@ -82,6 +126,62 @@ namespace chromeos_update_engine {
 using std::string;
 using std::vector;
 
+namespace {
+
+// Reads what is available on the progress |fd| into |buffer| and moves the
+// complete lines of it to |lines|. Returns false once the fd reached EOF or
+// failed, so it isn't worth watching anymore.
+bool ReadProgressLines(int fd, string* buffer, vector<string>* lines) {
+  char buf[1024];
+  size_t bytes_read;
+  do {
+    bytes_read = 0;
+    bool eof;
+    bool ok = utils::ReadAll(fd, buf, base::size(buf), &bytes_read, &eof);
+    buffer->append(buf, bytes_read);
+    // Process every line.
+    vector<string> new_lines = base::SplitString(
+        *buffer, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
+    if (!new_lines.empty()) {
+      *buffer = new_lines.back();
+      new_lines.pop_back();
+      lines->insert(lines->end(), new_lines.begin(), new_lines.end());
+    }
+    if (!ok || eof)
+      return false;
+  } while (bytes_read);
+  return true;
+}
+
+// Parses a "global_progress <frac>" line of a postinstall program.
+bool ParseProgressLine(const string& line, double* frac) {
+  double value = 0;
+  if (sscanf(line.c_str(), "global_progress %lf", &value) != 1 ||
+      std::isnan(value)) {
+    return false;
+  }
+  *frac = std::clamp(value, 0., 1.);
+  return true;
+}
+
+ErrorCode GetPostinstallErrorCode(int return_code) {
+  if (return_code == 3) {
+    // This special return code means that we tried to update firmware,
+    // but couldn't because we booted from FW B, and we need to reboot
+    // to get back to FW A.
+    return ErrorCode::kPostinstallBootedFromFirmwareB;
+  }
+  if (return_code == 4) {
+    // This special return code means that we tried to update firmware,
+    // but couldn't because we booted from FW B, and we need to reboot
+    // to get back to FW A.
+    return ErrorCode::kPostinstallFirmwareRONotUpdatable;
+  }
+  return ErrorCode::kPostinstallRunnerError;
+}
+
+}  // namespace
+
 PostinstallRunnerAction::PostinstallRunnerAction(
     BootControlInterface* boot_control, HardwareInterface* hardware)
     : boot_control_(boot_control), hardware_(hardware) {
@@ -98,9 +198,13 @@ PostinstallRunnerAction::PostinstallRunnerAction(
 }
 
 void PostinstallRunnerAction::EnsureUnmounted() {
-  if (utils::IsMountpoint(fs_mount_dir_)) {
-    LOG(INFO) << "Found previously mounted filesystem at " << fs_mount_dir_;
-    utils::UnmountFilesystem(fs_mount_dir_);
+  EnsureUnmounted(fs_mount_dir_);
+}
+
+void PostinstallRunnerAction::EnsureUnmounted(const std::string& mount_dir) {
+  if (utils::IsMountpoint(mount_dir)) {
+    LOG(INFO) << "Found previously mounted filesystem at " << mount_dir;
+    utils::UnmountFilesystem(mount_dir);
   }
 }
 
@@ -156,11 +260,21 @@ void PostinstallRunnerAction::PerformAction() {
   accumulated_weight_ = 0;
   ReportProgress(0);
 
+  spare_mount_dirs_.clear();
+  for (size_t i = 1; i < kMaxConcurrentPostinstall; i++) {
+    const string mount_dir = fs_mount_dir_ + "_" + std::to_string(i);
+    if (base::DirectoryExists(base::FilePath(mount_dir))) {
+      EnsureUnmounted(mount_dir);
+      spare_mount_dirs_.push_back(mount_dir);
+    }
+  }
+
   PerformPartitionPostinstall();
 }
 
 bool PostinstallRunnerAction::MountPartition(
-    const InstallPlan::Partition& partition) noexcept {
+    const InstallPlan::Partition& partition,
+    const std::string& mount_dir) noexcept {
   // Perform post-install for the current_partition_ partition. At this point we
   // need to call CompletePartitionPostinstall to complete the operation and
   // cleanup.
@@ -171,14 +285,14 @@ bool PostinstallRunnerAction::MountPartition(
     return false;
   }
 
-  if (!utils::FileExists(fs_mount_dir_.c_str())) {
-    LOG(ERROR) << "Mount point " << fs_mount_dir_
+  if (!utils::FileExists(mount_dir.c_str())) {
+    LOG(ERROR) << "Mount point " << mount_dir
                << " does not exist, mount call will fail";
     return false;
   }
-  // Double check that the fs_mount_dir is not busy with a previous mounted
+  // Double check that the mount_dir is not busy with a previous mounted
   // filesystem from a previous crashed postinstall step.
-  EnsureUnmounted();
+  EnsureUnmounted(mount_dir);
 
 #ifdef __ANDROID__
 #if !defined(__ANDROID_RECOVERY__)
@@ -223,7 +337,7 @@ bool PostinstallRunnerAction::MountPartition(
     }
     // Mount the target partition R/W
     LOG(INFO) << "Running backuptool scripts";
-    utils::MountFilesystem(mountable_device, fs_mount_dir_, MS_NOATIME | MS_NODEV | MS_NODIRATIME,
+    utils::MountFilesystem(mountable_device, mount_dir, MS_NOATIME | MS_NODEV | MS_NODIRATIME,
                            partition.filesystem_type, "seclabel");
 
     // Switch to a permissive domain
@@ -233,7 +347,9 @@ bool PostinstallRunnerAction::MountPartition(
     }
 
     // Run backuptool script
-    int ret = system("/postinstall/system/bin/backuptool_postinstall.sh");
+    const string backuptool =
+        mount_dir + "/system/bin/backuptool_postinstall.sh";
+    int ret = system(backuptool.c_str());
     if (ret == -1 || WEXITSTATUS(ret) != 0) {
       LOG(ERROR) << "Backuptool postinstall step failed. ret=" << ret;
     }
@@ -247,7 +363,7 @@ bool PostinstallRunnerAction::MountPartition(
     LOG(INFO) << "Skipping backuptool scripts";
   }
 
-  utils::UnmountFilesystem(fs_mount_dir_);
+  utils::UnmountFilesystem(mount_dir);
 #endif  // !__ANDROID_RECOVERY__
 
   // In Chromium OS, the postinstall step is allowed to write to the block
@@ -262,7 +378,7 @@ bool PostinstallRunnerAction::MountPartition(
 
   if (!utils::MountFilesystem(
           mountable_device,
-          fs_mount_dir_,
+          mount_dir,
           MS_RDONLY,
           partition.filesystem_type,
           hardware_->GetPartitionMountOptions(partition.name))) {
@@ -277,65 +393,119 @@ void PostinstallRunnerAction::PerformPartitionPostinstall() {
     return CompletePostinstall(ErrorCode::kSuccess);
   }
 
-  // Skip all the partitions that don't have a post-install step.
-  while (current_partition_ < install_plan_.partitions.size() &&
-         !install_plan_.partitions[current_partition_].run_postinstall) {
-    VLOG(1) << "Skipping post-install on partition "
-            << install_plan_.partitions[current_partition_].name;
-    // Attempt to mount a device if it has postinstall script configured, even
-    // if we want to skip running postinstall script.
-    // This is because we've seen bugs like b/198787355 which is only triggered
-    // when you attempt to mount a device. If device fails to mount, it will
-    // likely fail to mount during boot anyway, so it's better to catch any
-    // issues earlier.
-    // It's possible that some of the partitions aren't mountable, but these
-    // partitions shouldn't have postinstall configured. Therefore we guard this
-    // logic with |postinstall_path.empty()|.
-    const auto& partition = install_plan_.partitions[current_partition_];
-    if (!partition.postinstall_path.empty()) {
-      const auto mountable_device = partition.readonly_target_path;
-      if (!MountPartition(partition)) {
-        return CompletePostinstall(ErrorCode::kPostInstallMountError);
-      }
-      LogBuildInfoForPartition(fs_mount_dir_);
-      if (!utils::UnmountFilesystem(fs_mount_dir_)) {
-        return CompletePartitionPostinstall(
-            1, "Error unmounting the device " + mountable_device);
+  while (true) {
+    // Skip all the partitions that don't have a post-install step.
+    while (current_partition_ < install_plan_.partitions.size() &&
+           !install_plan_.partitions[current_partition_].run_postinstall) {
+      VLOG(1) << "Skipping post-install on partition "
+              << install_plan_.partitions[current_partition_].name;
+      // Attempt to mount a device if it has postinstall script configured,
+      // even if we want to skip running postinstall script.
+      // This is because we've seen bugs like b/198787355 which is only
+      // triggered when you attempt to mount a device. If device fails to
+      // mount, it will likely fail to mount during boot anyway, so it's better
+      // to catch any issues earlier.
+      // It's possible that some of the partitions aren't mountable, but these
+      // partitions shouldn't have postinstall configured. Therefore we guard
+      // this logic with |postinstall_path.empty()|.
+      const auto& partition = install_plan_.partitions[current_partition_];
+      if (!partition.postinstall_path.empty()) {
+        const auto mountable_device = partition.readonly_target_path;
+        if (!MountPartition(partition, fs_mount_dir_)) {
+          return CompletePostinstall(ErrorCode::kPostInstallMountError);
+        }
+        LogBuildInfoForPartition(fs_mount_dir_);
+        if (!utils::UnmountFilesystem(fs_mount_dir_)) {
+          return CompletePartitionPostinstall(
+              1, "Error unmounting the device " + mountable_device);
+        }
       }
+      current_partition_++;
+    }
+    if (current_partition_ == install_plan_.partitions.size()) {
+      if (jobs_.empty())
+        return CompletePostinstall(ErrorCode::kSuccess);
+      LOG(INFO) << "Waiting for " << jobs_.size()
+                << " post-install steps running in the background.";
+      return;
     }
+    if (!install_plan_.partitions[current_partition_]
+             .postinstall_independent ||
+        spare_mount_dirs_.empty()) {
+      break;
+    }
+    // The weight of the partition is accounted for once its step is done.
+    if (!StartPostinstallJob(current_partition_))
+      return;
     current_partition_++;
   }
-  if (current_partition_ == install_plan_.partitions.size())
-    return CompletePostinstall(ErrorCode::kSuccess);
 
-  const InstallPlan::Partition& partition =
-      install_plan_.partitions[current_partition_];
-
-  const string mountable_device = partition.readonly_target_path;
   // Perform post-install for the current_partition_ partition. At this point we
   // need to call CompletePartitionPostinstall to complete the operation and
   // cleanup.
-
-  if (!MountPartition(partition)) {
-    CompletePostinstall(ErrorCode::kPostInstallMountError);
+  current_progress_ = 0;
+  ErrorCode error = ErrorCode::kSuccess;
+  current_command_ = StartPostinstallCommand(
+      current_partition_,
+      fs_mount_dir_,
+      base::Bind(&PostinstallRunnerAction::CompletePartitionPostinstall,
+                 base::Unretained(this)),
+      &error);
+  if (error != ErrorCode::kSuccess) {
+    return CompletePostinstall(error);
+  }
+  if (!current_command_) {
+    CompletePartitionPostinstall(1, "Postinstall didn't launch");
     return;
   }
-  LogBuildInfoForPartition(fs_mount_dir_);
+
+  // Monitor the status file descriptor.
+  progress_fd_ =
+      Subprocess::Get().GetPipeFd(current_command_, kPostinstallStatusFd);
+  int fd_flags = fcntl(progress_fd_, F_GETFL, 0) | O_NONBLOCK;
+  if (HANDLE_EINTR(fcntl(progress_fd_, F_SETFL, fd_flags)) < 0) {
+    PLOG(ERROR) << "Unable to set non-blocking I/O mode on fd " << progress_fd_;
+  }
+
+  progress_controller_ = base::FileDescriptorWatcher::WatchReadable(
+      progress_fd_,
+      base::BindRepeating(&PostinstallRunnerAction::OnProgressFdReady,
+                          base::Unretained(this)));
+}
+
+pid_t PostinstallRunnerAction::StartPostinstallCommand(
+    size_t partition_index,
+    const std::string& mount_dir,
+    const base::Callback<void(int, const std::string&)>& callback,
+    ErrorCode* error) {
+  const InstallPlan::Partition& partition =
+      install_plan_.partitions[partition_index];
+
+  const string mountable_device = partition.readonly_target_path;
+  if (!MountPartition(partition, mount_dir)) {
+    *error = ErrorCode::kPostInstallMountError;
+    return 0;
+  }
+  LogBuildInfoForPartition(mount_dir);
+  if (install_plan_.postinstall_cache_warming &&
+      !partition.postinstall_cache_files.empty()) {
+    WarmPostinstallCache(mount_dir, partition.postinstall_cache_files);
+  }
   base::FilePath postinstall_path(partition.postinstall_path);
   if (postinstall_path.IsAbsolute()) {
     LOG(ERROR) << "Invalid absolute path passed to postinstall, use a relative"
                   "path instead: "
                << partition.postinstall_path;
-    return CompletePostinstall(ErrorCode::kPostinstallRunnerError);
+    *error = ErrorCode::kPostinstallRunnerError;
+    return 0;
   }
 
-  string abs_path =
-      base::FilePath(fs_mount_dir_).Append(postinstall_path).value();
-  if (!base::StartsWith(
-          abs_path, fs_mount_dir_, base::CompareCase::SENSITIVE)) {
+  string abs_path = base::FilePath(mount_dir).Append(postinstall_path).value();
+  if (!base::StartsWith(abs_path, mount_dir, base::CompareCase::SENSITIVE)) {
     LOG(ERROR) << "Invalid relative postinstall path: "
                << partition.postinstall_path;
-    return CompletePostinstall(ErrorCode::kPostinstallRunnerError);
+    *error = ErrorCode::kPostinstallRunnerError;
+    return 0;
   }
 
   LOG(INFO) << "Performing postinst (" << partition.postinstall_path << " at "
@@ -360,66 +530,95 @@ void PostinstallRunnerAction::PerformPartitionPostinstall() {
   command.push_back(partition.target_path);
 #endif  // __ANDROID__
 
-  current_command_ = Subprocess::Get().ExecFlags(
-      command,
-      Subprocess::kRedirectStderrToStdout,
-      {kPostinstallStatusFd},
-      base::Bind(&PostinstallRunnerAction::CompletePartitionPostinstall,
-                 base::Unretained(this)));
+  pid_t pid = Subprocess::Get().ExecFlags(command,
+                                          Subprocess::kRedirectStderrToStdout,
+                                          {kPostinstallStatusFd},
+                                          callback);
   // Subprocess::Exec should never return a negative process id.
-  CHECK_GE(current_command_, 0);
+  CHECK_GE(pid, 0);
+  return pid;
+}
 
-  if (!current_command_) {
-    CompletePartitionPostinstall(1, "Postinstall didn't launch");
-    return;
+bool PostinstallRunnerAction::StartPostinstallJob(size_t partition) {
+  auto job = std::make_unique<PostinstallJob>();
+  job->partition = partition;
+  job->mount_dir = spare_mount_dirs_.back();
+  spare_mount_dirs_.pop_back();
+  LOG(INFO) << "Running the post-install step of "
+            << install_plan_.partitions[partition].name << " in the background"
+            << " at " << job->mount_dir;
+
+  ErrorCode error = ErrorCode::kSuccess;
+  job->command = StartPostinstallCommand(
+      partition,
+      job->mount_dir,
+      base::Bind(&PostinstallRunnerAction::CompletePostinstallJob,
+                 base::Unretained(this),
+                 base::Unretained(job.get())),
+      &error);
+  PostinstallJob* job_ptr = job.get();
+  jobs_.push_back(std::move(job));
+  if (error != ErrorCode::kSuccess) {
+    CompletePostinstall(error);
+    return false;
   }
-
-  // Monitor the status file descriptor.
-  progress_fd_ =
-      Subprocess::Get().GetPipeFd(current_command_, kPostinstallStatusFd);
-  int fd_flags = fcntl(progress_fd_, F_GETFL, 0) | O_NONBLOCK;
-  if (HANDLE_EINTR(fcntl(progress_fd_, F_SETFL, fd_flags)) < 0) {
-    PLOG(ERROR) << "Unable to set non-blocking I/O mode on fd " << progress_fd_;
+  if (!job_ptr->command) {
+    LOG(ERROR) << "Postinstall didn't launch";
+    error = FinishPostinstallJob(job_ptr, 1);
+    if (error != ErrorCode::kSuccess) {
+      CompletePostinstall(error);
+      return false;
+    }
+    return true;
   }
 
-  progress_controller_ = base::FileDescriptorWatcher::WatchReadable(
-      progress_fd_,
-      base::BindRepeating(&PostinstallRunnerAction::OnProgressFdReady,
-                          base::Unretained(this)));
+  job_ptr->progress_fd =
+      Subprocess::Get().GetPipeFd(job_ptr->command, kPostinstallStatusFd);
+  int fd_flags = fcntl(job_ptr->progress_fd, F_GETFL, 0) | O_NONBLOCK;
+  if (HANDLE_EINTR(fcntl(job_ptr->progress_fd, F_SETFL, fd_flags)) < 0) {
+    PLOG(ERROR) << "Unable to set non-blocking I/O mode on fd "
+                << job_ptr->progress_fd;
+  }
+  job_ptr->progress_controller = base::FileDescriptorWatcher::WatchReadable(
+      job_ptr->progress_fd,
+      base::BindRepeating(&PostinstallRunnerAction::OnJobProgressFdReady,
+                          base::Unretained(this),
+                          base::Unretained(job_ptr)));
+  return true;
 }
 
 void PostinstallRunnerAction::OnProgressFdReady() {
-  char buf[1024];
-  size_t bytes_read;
-  do {
-    bytes_read = 0;
-    bool eof;
-    bool ok =
-        utils::ReadAll(progress_fd_, buf, base::size(buf), &bytes_read, &eof);
-    progress_buffer_.append(buf, bytes_read);
-    // Process every line.
-    vector<string> lines = base::SplitString(
-        progress_buffer_, "\n", base::KEEP_WHITESPACE, base::SPLIT_WANT_ALL);
-    if (!lines.empty()) {
-      progress_buffer_ = lines.back();
-      lines.pop_back();
-      for (const auto& line : lines) {
-        ProcessProgressLine(line);
-      }
-    }
-    if (!ok || eof) {
-      // There was either an error or an EOF condition, so we are done watching
-      // the file descriptor.
-      progress_controller_.reset();
-      return;
-    }
-  } while (bytes_read);
+  vector<string> lines;
+  const bool done = !ReadProgressLines(progress_fd_, &progress_buffer_, &lines);
+  for (const auto& line : lines) {
+    ProcessProgressLine(line);
+  }
+  if (done) {
+    // There was either an error or an EOF condition, so we are done watching
+    // the file descriptor.
+    progress_controller_.reset();
+  }
+}
+
+void PostinstallRunnerAction::OnJobProgressFdReady(PostinstallJob* job) {
+  vector<string> lines;
+  const bool done =
+      !ReadProgressLines(job->progress_fd, &job->progress_buffer, &lines);
+  bool updated = false;
+  for (const auto& line : lines) {
+    updated |= ParseProgressLine(line, &job->progress);
+  }
+  if (updated) {
+    ReportProgress(current_progress_);
+  }
+  if (done) {
+    job->progress_controller.reset();
+  }
 }
 
 bool PostinstallRunnerAction::ProcessProgressLine(const string& line) {
   double frac = 0;
-  if (sscanf(line.c_str(), "global_progress %lf", &frac) == 1 &&
-      !std::isnan(frac)) {
+  if (ParseProgressLine(line, &frac)) {
     ReportProgress(frac);
     return true;
   }
@@ -428,20 +627,26 @@ bool PostinstallRunnerAction::ProcessProgressLine(const string& line) {
 }
 
 void PostinstallRunnerAction::ReportProgress(double frac) {
+  if (!std::isfinite(frac) || frac < 0)
+    frac = 0;
+  if (frac > 1)
+    frac = 1;
+  current_progress_ = frac;
   if (!delegate_)
     return;
-  if (current_partition_ >= partition_weight_.size() || total_weight_ == 0) {
+  if (total_weight_ == 0 ||
+      (current_partition_ >= partition_weight_.size() && jobs_.empty())) {
     delegate_->ProgressUpdate(1.);
     return;
   }
-  if (!std::isfinite(frac) || frac < 0)
-    frac = 0;
-  if (frac > 1)
-    frac = 1;
-  double postinst_action_progress =
-      (accumulated_weight_ + partition_weight_[current_partition_] * frac) /
-      total_weight_;
-  delegate_->ProgressUpdate(postinst_action_progress);
+  double done_weight = accumulated_weight_;
+  if (current_partition_ < partition_weight_.size()) {
+    done_weight += partition_weight_[current_partition_] * frac;
+  }
+  for (const auto& job : jobs_) {
+    done_weight += partition_weight_[job->partition] * job->progress;
+  }
+  delegate_->ProgressUpdate(done_weight / total_weight_);
 }
 
 void PostinstallRunnerAction::Cleanup() {
@@ -462,6 +667,13 @@ void PostinstallRunnerAction::Cleanup() {
   progress_buffer_.clear();
 }
 
+void PostinstallRunnerAction::CleanupJob(PostinstallJob* job) {
+  utils::UnmountFilesystem(job->mount_dir);
+  job->progress_fd = -1;
+  job->progress_controller.reset();
+  spare_mount_dirs_.push_back(job->mount_dir);
+}
+
 void PostinstallRunnerAction::CompletePartitionPostinstall(
     int return_code, const string& output) {
   current_command_ = 0;
@@ -469,28 +681,12 @@ void PostinstallRunnerAction::CompletePartitionPostinstall(
 
   if (return_code != 0) {
     LOG(ERROR) << "Postinst command failed with code: " << return_code;
-    ErrorCode error_code = ErrorCode::kPostinstallRunnerError;
-
-    if (return_code == 3) {
-      // This special return code means that we tried to update firmware,
-      // but couldn't because we booted from FW B, and we need to reboot
-      // to get back to FW A.
-      error_code = ErrorCode::kPostinstallBootedFromFirmwareB;
-    }
-
-    if (return_code == 4) {
-      // This special return code means that we tried to update firmware,
-      // but couldn't because we booted from FW B, and we need to reboot
-      // to get back to FW A.
-      error_code = ErrorCode::kPostinstallFirmwareRONotUpdatable;
-    }
-
     // If postinstall script for this partition is optional we can ignore the
     // result.
     if (install_plan_.partitions[current_partition_].postinstall_optional) {
       LOG(INFO) << "Ignoring postinstall failure since it is optional";
     } else {
-      return CompletePostinstall(error_code);
+      return CompletePostinstall(GetPostinstallErrorCode(return_code));
     }
   }
   accumulated_weight_ += partition_weight_[current_partition_];
@@ -500,6 +696,77 @@ void PostinstallRunnerAction::CompletePartitionPostinstall(
   PerformPartitionPostinstall();
 }
 
+ErrorCode PostinstallRunnerAction::FinishPostinstallJob(PostinstallJob* job,
+                                                        int return_code) {
+  const size_t partition = job->partition;
+  CleanupJob(job);
+  jobs_.erase(std::find_if(jobs_.begin(),
+                           jobs_.end(),
+                           [job](const auto& other) {
+                             return other.get() == job;
+                           }));
+
+  if (return_code != 0) {
+    LOG(ERROR) << "Postinst command of "
+               << install_plan_.partitions[partition].name
+               << " failed with code: " << return_code;
+    if (!install_plan_.partitions[partition].postinstall_optional) {
+      return GetPostinstallErrorCode(return_code);
+    }
+    LOG(INFO) << "Ignoring postinstall failure since it is optional";
+  }
+  accumulated_weight_ += partition_weight_[partition];
+  return ErrorCode::kSuccess;
+}
+
+void PostinstallRunnerAction::CompletePostinstallJob(PostinstallJob* job,
+                                                     int return_code,
+                                                     const string& output) {
+  job->command = 0;
+  ErrorCode error = FinishPostinstallJob(job, return_code);
+  if (error != ErrorCode::kSuccess) {
+    return CompletePostinstall(error);
+  }
+  if (current_partition_ == install_plan_.partitions.size() && jobs_.empty()) {
+    return CompletePostinstall(ErrorCode::kSuccess);
+  }
+  ReportProgress(current_progress_);
+}
+
+void PostinstallRunnerAction::KillPostinstallCommands() {
+  // Calling KillExec() will discard the callbacks we registered and therefore
+  // the unretained references to this object.
+  for (const auto& job : jobs_) {
+    if (job->command) {
+      Subprocess::Get().KillExec(job->command);
+      // A suspended command needs to be resumed to process the SIGTERM.
+      if (job->is_command_suspended && kill(job->command, SIGCONT) != 0) {
+        PLOG(ERROR) << "Couldn't resume child process " << job->command;
+      }
+      job->command = 0;
+    }
+    CleanupJob(job.get());
+  }
+  jobs_.clear();
+
+  if (!current_command_)
+    return;
+  Subprocess::Get().KillExec(current_command_);
+
+  // If the command has been suspended, resume it after KillExec() so that the
+  // process can process the SIGTERM sent by KillExec().
+  if (is_current_command_suspended_) {
+    if (kill(current_command_, SIGCONT) != 0) {
+      PLOG(ERROR) << "Couldn't resume child process " << current_command_;
+    } else {
+      is_current_command_suspended_ = false;
+    }
+  }
+
+  current_command_ = 0;
+  Cleanup();
+}
+
 PostinstallRunnerAction::~PostinstallRunnerAction() {
   if (!install_plan_.partitions.empty()) {
     auto dynamic_control = boot_control_->GetDynamicPartitionControl();
@@ -510,6 +777,10 @@ PostinstallRunnerAction::~PostinstallRunnerAction() {
 }
 
 void PostinstallRunnerAction::CompletePostinstall(ErrorCode error_code) {
+  // The steps still running in the background don't matter anymore.
+  if (error_code != ErrorCode::kSuccess)
+    KillPostinstallCommands();
+
   // We only attempt to mark the new slot as active if all the postinstall
   // steps succeeded.
   DEFER {
@@ -556,6 +827,15 @@ void PostinstallRunnerAction::CompletePostinstall(ErrorCode error_code) {
 }
 
 void PostinstallRunnerAction::SuspendAction() {
+  for (const auto& job : jobs_) {
+    if (!job->command)
+      continue;
+    if (kill(job->command, SIGSTOP) != 0) {
+      PLOG(ERROR) << "Couldn't pause child process " << job->command;
+    } else {
+      job->is_command_suspended = true;
+    }
+  }
   if (!current_command_)
     return;
   if (kill(current_command_, SIGSTOP) != 0) {
@@ -566,6 +846,15 @@ void PostinstallRunnerAction::SuspendAction() {
 }
 
 void PostinstallRunnerAction::ResumeAction() {
+  for (const auto& job : jobs_) {
+    if (!job->command)
+      continue;
+    if (kill(job->command, SIGCONT) != 0) {
+      PLOG(ERROR) << "Couldn't resume child process " << job->command;
+    } else {
+      job->is_command_suspended = false;
+    }
+  }
   if (!current_command_)
     return;
   if (kill(current_command_, SIGCONT) != 0) {
@@ -576,20 +865,7 @@ void PostinstallRunnerAction::ResumeAction() {
 }
 
 void PostinstallRunnerAction::TerminateProcessing() {
-  if (!current_command_)
-    return;
-  // Calling KillExec() will discard the callback we registered and therefore
-  // the unretained reference to this object.
-  Subprocess::Get().KillExec(current_command_);
-
-  // If the command has been suspended, resume it after KillExec() so that the
-  // process can process the SIGTERM sent by KillExec().
-  if (is_current_command_suspended_) {
-    ResumeAction();
-  }
-
-  current_command_ = 0;
-  Cleanup();
+  KillPostinstallCommands();
 }
 
 }  // namespace chromeos_update_engine
@@ -33,6 +33,13 @@
 
 // The Postinstall Runner Action is responsible for running the postinstall
 // script of a successfully downloaded update.
+//
+// The postinstall steps run one after the other, mounted at the mount point,
+// except for those of the partitions declaring them independent. These run in
+// the background at the same time as the others, as long as there is one of
+// the spare mount points "<mount point>_1" ... "<mount point>_<N>" free for
+// them, N being kMaxConcurrentPostinstall - 1. A device opts in by providing
+// these mount points.
 
 namespace chromeos_update_engine {
 
@@ -65,17 +72,71 @@ class PostinstallRunnerAction : public InstallPlanAction {
   static std::string StaticType() { return "PostinstallRunnerAction"; }
   std::string Type() const override { return StaticType(); }
 
+  // The most postinstall steps running at once.
+  static constexpr size_t kMaxConcurrentPostinstall = 4;
+
  private:
   friend class PostinstallRunnerActionTest;
   FRIEND_TEST(PostinstallRunnerActionTest, ProcessProgressLineTest);
+  FRIEND_TEST(PostinstallRunnerActionTest, ProgressWithBackgroundStepsTest);
+
+  // A postinstall step of an independent partition, running in the
+  // background.
+  struct PostinstallJob {
+    // The index of the partition in the InstallPlan.
+    size_t partition;
+    std::string mount_dir;
+    pid_t command{0};
+    bool is_command_suspended{false};
+    // The progress reported by the postinstall program, between 0 and 1.
+    double progress{0};
+    int progress_fd{-1};
+    std::unique_ptr<base::FileDescriptorWatcher::Controller>
+        progress_controller;
+    std::string progress_buffer;
+  };
 
   // exposed for testing purposes only
   void SetMountDir(std::string dir) { fs_mount_dir_ = std::move(dir); }
   void EnsureUnmounted();
+  void EnsureUnmounted(const std::string& mount_dir);
 
   void PerformPartitionPostinstall();
-  [[nodiscard]] bool MountPartition(
-      const InstallPlan::Partition& partition) noexcept;
+  [[nodiscard]] bool MountPartition(const InstallPlan::Partition& partition,
+                                    const std::string& mount_dir) noexcept;
+
+  // Mounts the partition |partition| at |mount_dir| and starts its postinstall
+  // program with |callback|. Returns the pid of the program, or 0 and sets
+  // |error| on failure.
+  pid_t StartPostinstallCommand(
+      size_t partition,
+      const std::string& mount_dir,
+      const base::Callback<void(int, const std::string&)>& callback,
+      ErrorCode* error);
+
+  // Starts the postinstall step of the partition |partition| in the
+  // background on one of the |spare_mount_dirs_|. Returns false if it failed
+  // to, after completing the action.
+  bool StartPostinstallJob(size_t partition);
+
+  // Subprocess::Exec callback of the postinstall steps in the background.
+  void CompletePostinstallJob(PostinstallJob* job,
+                              int return_code,
+                              const std::string& output);
+
+  // Cleans up after |job| once its program ended with |return_code|, and
+  // forgets about it. Returns the error the step failed with, unless optional.
+  ErrorCode FinishPostinstallJob(PostinstallJob* job, int return_code);
+
+  // Called whenever the progress file descriptor of |job| has data available
+  // to read.
+  void OnJobProgressFdReady(PostinstallJob* job);
+
+  // Unmounts the partition of |job| and releases its mount point.
+  void CleanupJob(PostinstallJob* job);
+
+  // Kills the postinstall programs still running, and cleans up after them.
+  void KillPostinstallCommands();
 
   // Called whenever the |progress_fd_| has data available to read.
   void OnProgressFdReady();
@@ -89,7 +150,7 @@ class PostinstallRunnerAction : public InstallPlanAction {
 
   // Report the progress to the delegate given that the postinstall operation
   // for |current_partition_| has a current progress of |frac|, a value between
-  // 0 and 1 for that step.
+  // 0 and 1 for that step, on top of the progress of the |jobs_|.
   void ReportProgress(double frac);
 
   // Cleanup the setup made when running postinstall for a given partition.
@@ -120,10 +181,19 @@ class PostinstallRunnerAction : public InstallPlanAction {
   // The sum of all the weights in |partition_weight_|.
   double total_weight_{0};
 
-  // The sum of all the weights in |partition_weight_| up to but not including
-  // the |current_partition_|.
+  // The sum of the weights in |partition_weight_| of the partitions done,
+  // those up to but not including the |current_partition_| which don't have
+  // a step running in the background.
   double accumulated_weight_{0};
 
+  // The progress of the postinstall step of |current_partition_|.
+  double current_progress_{0};
+
+  // The postinstall steps running in the background, and the mount points
+  // free for more of them.
+  std::vector<std::unique_ptr<PostinstallJob>> jobs_;
+  std::vector<std::string> spare_mount_dirs_;
+
   // The delegate used to notify of progress updates, if any.
   DelegateInterface* delegate_{nullptr};
 
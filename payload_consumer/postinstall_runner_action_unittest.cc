@@ -276,6 +276,38 @@ TEST_F(PostinstallRunnerActionTest, ProcessProgressLineTest) {
 
 // Test that postinstall succeeds in the simple case of running the default
 // /postinst command which only exits 0.
+TEST_F(PostinstallRunnerActionTest, ProgressWithBackgroundStepsTest) {
+  PostinstallRunnerAction action(&fake_boot_control_, &fake_hardware_);
+  testing::StrictMock<MockPostinstallRunnerActionDelegate> mock_delegate_;
+  action.set_delegate(&mock_delegate_);
+
+  // The first partition runs in the background, the second is done.
+  action.current_partition_ = 2;
+  action.partition_weight_ = {2, 1, 5};
+  action.accumulated_weight_ = 1;
+  action.total_weight_ = 8;
+  auto job = std::make_unique<PostinstallRunnerAction::PostinstallJob>();
+  job->partition = 0;
+  job->progress = 0.5;
+  action.jobs_.push_back(std::move(job));
+
+  // 50% of the first and 20% of the last is (1 + 1 + 1) / 8 of the total.
+  EXPECT_CALL(mock_delegate_, ProgressUpdate(0.375));
+  action.ProcessProgressLine("global_progress 0.2");
+  testing::Mock::VerifyAndClearExpectations(&mock_delegate_);
+
+  // The last one done, the first one still counts.
+  action.current_partition_ = 3;
+  action.accumulated_weight_ = 6;
+  EXPECT_CALL(mock_delegate_, ProgressUpdate(0.875));
+  action.ReportProgress(0);
+  testing::Mock::VerifyAndClearExpectations(&mock_delegate_);
+
+  action.jobs_.clear();
+  EXPECT_CALL(mock_delegate_, ProgressUpdate(1.));
+  action.ReportProgress(0);
+}
+
 TEST_F(PostinstallRunnerActionTest, RunAsRootSimpleTest) {
   ScopedLoopbackDeviceBinder loop(postinstall_image_, false, nullptr);
 
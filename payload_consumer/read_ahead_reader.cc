@@ -0,0 +1,151 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/read_ahead_reader.h"
+
+#include <algorithm>
+#include <chrono>
+#include <utility>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+// Number of chunks read at each chunk size before deciding whether to grow it.
+constexpr size_t kProbeChunks = 8;
+// Minimum throughput gain for a larger chunk size to be worth it.
+constexpr double kMinImprovement = 1.1;
+}  // namespace
+
+ReadAheadReader::ReadAheadReader(FileDescriptor* fd,
+                                 off64_t start_offset,
+                                 off64_t end_offset,
+                                 size_t chunks_ahead)
+    : fd_(fd),
+      offset_(start_offset),
+      end_offset_(end_offset),
+      chunks_ahead_(std::max<size_t>(chunks_ahead, 1)) {
+  thread_ = std::thread(&ReadAheadReader::ReadLoop, this);
+}
+
+ReadAheadReader::~ReadAheadReader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  thread_.join();
+}
+
+bool ReadAheadReader::Next(brillo::Blob* chunk) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (!chunk->empty()) {
+    free_buffers_.push_back(std::move(*chunk));
+  }
+  chunk->clear();
+  cond_.wait(lock, [this] { return failed_ || finished_ || !ready_.empty(); });
+  if (!ready_.empty()) {
+    *chunk = std::move(ready_.front());
+    ready_.pop_front();
+    lock.unlock();
+    cond_.notify_all();
+    return true;
+  }
+  return !failed_;
+}
+
+size_t ReadAheadReader::AdaptChunkSize(size_t last_chunk_size,
+                                       int64_t read_time_us) {
+  if (tuning_done_) {
+    return chunk_size_;
+  }
+  probe_chunks_++;
+  probe_bytes_ += last_chunk_size;
+  probe_time_us_ += read_time_us;
+  if (probe_chunks_ < kProbeChunks) {
+    return chunk_size_;
+  }
+  const double throughput =
+      static_cast<double>(probe_bytes_) / std::max<int64_t>(probe_time_us_, 1);
+  if (chunk_size_ < kMaxChunkSize &&
+      throughput > last_throughput_ * kMinImprovement) {
+    last_throughput_ = throughput;
+    chunk_size_ *= 2;
+  } else {
+    if (throughput < last_throughput_) {
+      // The previous size was faster.
+      chunk_size_ /= 2;
+    }
+    tuning_done_ = true;
+    LOG(INFO) << "Reading ahead in chunks of " << chunk_size_ << " bytes";
+  }
+  probe_chunks_ = 0;
+  probe_bytes_ = 0;
+  probe_time_us_ = 0;
+  return chunk_size_;
+}
+
+void ReadAheadReader::ReadLoop() {
+  size_t chunk_size = chunk_size_;
+  while (offset_ < end_offset_) {
+    brillo::Blob buffer;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock,
+                 [this] { return stopping_ || ready_.size() < chunks_ahead_; });
+      if (stopping_) {
+        return;
+      }
+      if (!free_buffers_.empty()) {
+        buffer = std::move(free_buffers_.back());
+        free_buffers_.pop_back();
+      }
+    }
+    const size_t read_size =
+        std::min<uint64_t>(chunk_size, end_offset_ - offset_);
+    buffer.resize(read_size);
+    const auto start = std::chrono::steady_clock::now();
+    if (!fd_->ReadBatch({{offset_, buffer.data(), read_size}})) {
+      PLOG(ERROR) << "Failed to read " << read_size << " bytes at offset "
+                  << offset_;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        failed_ = true;
+      }
+      cond_.notify_all();
+      return;
+    }
+    const auto read_time_us =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start)
+            .count();
+    offset_ += read_size;
+    chunk_size = AdaptChunkSize(read_size, read_time_us);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ready_.push_back(std::move(buffer));
+    }
+    cond_.notify_all();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_ = true;
+  }
+  cond_.notify_all();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,97 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_READ_AHEAD_READER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_READ_AHEAD_READER_H_
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// Reads a byte range of a FileDescriptor sequentially on a background thread,
+// keeping a few chunks ahead of the consumer, so that the disk stays busy
+// while the consumer processes the previous chunk.
+//
+// The chunk size starts at |kMinChunkSize| and is doubled, up to
+// |kMaxChunkSize|, for as long as doing so improves read throughput.
+class ReadAheadReader {
+ public:
+  static constexpr size_t kMinChunkSize = 128 * 1024;
+  static constexpr size_t kMaxChunkSize = 2 * 1024 * 1024;
+  static constexpr size_t kDefaultChunksAhead = 2;
+
+  // Starts reading [|start_offset|, |end_offset|) of |fd|. |fd| must outlive
+  // this object, and must not be used by anyone else until it is destroyed.
+  ReadAheadReader(FileDescriptor* fd,
+                  off64_t start_offset,
+                  off64_t end_offset,
+                  size_t chunks_ahead = kDefaultChunksAhead);
+  // Stops reading ahead. Waits for the read in progress, if any.
+  ~ReadAheadReader();
+
+  // Waits for the next chunk of the range and swaps it into |*chunk|. The
+  // previous contents of |*chunk| are recycled as a read buffer. |*chunk| is
+  // left empty once the whole range has been returned. Returns false if
+  // reading failed.
+  bool Next(brillo::Blob* chunk);
+
+ private:
+  void ReadLoop();
+
+  // Returns the size of the next chunk to read, given that the last one took
+  // |read_time_us| microseconds. Only called from the reader thread.
+  size_t AdaptChunkSize(size_t last_chunk_size, int64_t read_time_us);
+
+  FileDescriptor* const fd_;
+  // The next offset to read; only accessed by the reader thread.
+  off64_t offset_;
+  const off64_t end_offset_;
+  const size_t chunks_ahead_;
+
+  // State of the chunk size tuning; only accessed by the reader thread.
+  size_t chunk_size_{kMinChunkSize};
+  size_t probe_chunks_{0};
+  uint64_t probe_bytes_{0};
+  int64_t probe_time_us_{0};
+  double last_throughput_{0};
+  bool tuning_done_{false};
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  // Chunks read but not yet returned by Next(), in order.
+  std::deque<brillo::Blob> ready_;
+  // Buffers handed back by Next() for reuse.
+  std::vector<brillo::Blob> free_buffers_;
+  bool finished_{false};
+  bool failed_{false};
+  bool stopping_{false};
+
+  std::thread thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReadAheadReader);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_READ_AHEAD_READER_H_
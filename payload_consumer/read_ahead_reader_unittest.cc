@@ -0,0 +1,96 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/read_ahead_reader.h"
+
+#include <fcntl.h>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+class ReadAheadReaderTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Not a multiple of any chunk size, and large enough for the chunk size
+    // tuning to kick in.
+    data_.resize(10 * 1024 * 1024 + 512);
+    test_utils::FillWithData(&data_);
+    ASSERT_TRUE(test_utils::WriteFileVector(temp_file_.path(), data_));
+    ASSERT_TRUE(fd_.Open(temp_file_.path().c_str(), O_RDONLY));
+  }
+
+  // Reads everything |reader| returns.
+  bool ReadAll(ReadAheadReader* reader, brillo::Blob* out) {
+    brillo::Blob chunk;
+    while (true) {
+      TEST_AND_RETURN_FALSE(reader->Next(&chunk));
+      if (chunk.empty()) {
+        return true;
+      }
+      out->insert(out->end(), chunk.begin(), chunk.end());
+    }
+  }
+
+  brillo::Blob data_;
+  ScopedTempFile temp_file_{"ReadAheadReader-file.XXXXXX"};
+  EintrSafeFileDescriptor fd_;
+};
+
+TEST_F(ReadAheadReaderTest, ReadsWholeRangeTest) {
+  ReadAheadReader reader(&fd_, 0, data_.size());
+  brillo::Blob out;
+  ASSERT_TRUE(ReadAll(&reader, &out));
+  ASSERT_EQ(data_, out);
+}
+
+TEST_F(ReadAheadReaderTest, ReadsPartialRangeTest) {
+  ReadAheadReader reader(&fd_, 4096, 1024 * 1024 + 10, 1);
+  brillo::Blob out;
+  ASSERT_TRUE(ReadAll(&reader, &out));
+  const auto end = data_.begin() + 1024 * 1024 + 10;
+  ASSERT_EQ(brillo::Blob(data_.begin() + 4096, end), out);
+}
+
+TEST_F(ReadAheadReaderTest, EmptyRangeTest) {
+  ReadAheadReader reader(&fd_, 100, 100);
+  brillo::Blob chunk;
+  ASSERT_TRUE(reader.Next(&chunk));
+  ASSERT_TRUE(chunk.empty());
+}
+
+TEST_F(ReadAheadReaderTest, ReadPastEndFailsTest) {
+  ReadAheadReader reader(&fd_, 0, data_.size() + 1);
+  brillo::Blob out;
+  ASSERT_FALSE(ReadAll(&reader, &out));
+  ASSERT_GE(data_.size(), out.size());
+}
+
+TEST_F(ReadAheadReaderTest, StopsEarlyTest) {
+  brillo::Blob chunk;
+  {
+    ReadAheadReader reader(&fd_, 0, data_.size());
+    ASSERT_TRUE(reader.Next(&chunk));
+    ASSERT_FALSE(chunk.empty());
+  }
+  ASSERT_EQ(brillo::Blob(data_.begin(), data_.begin() + chunk.size()), chunk);
+}
+
+}  // namespace chromeos_update_engine
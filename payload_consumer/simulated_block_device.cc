@@ -0,0 +1,275 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/simulated_block_device.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <base/logging.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+void SleepFor(base::TimeDelta time) {
+  std::this_thread::sleep_for(std::chrono::microseconds(time.InMicroseconds()));
+}
+
+}  // namespace
+
+StorageProfile StorageProfile::Emmc() {
+  return {
+      .read_latency = base::TimeDelta::FromMicroseconds(120),
+      .write_latency = base::TimeDelta::FromMicroseconds(200),
+      .random_access_penalty = base::TimeDelta::FromMicroseconds(80),
+      .read_bandwidth = 250 * 1024 * 1024,
+      .write_bandwidth = 120 * 1024 * 1024,
+      .flush_latency = base::TimeDelta::FromMilliseconds(5),
+      .queue_depth = 1,
+  };
+}
+
+StorageProfile StorageProfile::Ufs() {
+  return {
+      .read_latency = base::TimeDelta::FromMicroseconds(60),
+      .write_latency = base::TimeDelta::FromMicroseconds(40),
+      .random_access_penalty = base::TimeDelta::FromMicroseconds(20),
+      .read_bandwidth = 1800LL * 1024 * 1024,
+      .write_bandwidth = 1000LL * 1024 * 1024,
+      .flush_latency = base::TimeDelta::FromMilliseconds(1),
+      .queue_depth = 32,
+  };
+}
+
+SimulatedBlockDevice::SimulatedBlockDevice(const StorageProfile& profile,
+                                           uint64_t size)
+    : profile_(profile), data_(size) {
+  CHECK_GT(profile_.queue_depth, 0u);
+}
+
+base::TimeDelta SimulatedBlockDevice::elapsed() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return elapsed_;
+}
+
+SimulatedBlockDevice::Stats SimulatedBlockDevice::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+bool SimulatedBlockDevice::Open(const char* path, int flags, mode_t mode) {
+  if (open_) {
+    errno = EBUSY;
+    return false;
+  }
+  open_ = true;
+  offset_ = 0;
+  return true;
+}
+
+ssize_t SimulatedBlockDevice::Read(void* buf, size_t count) {
+  off64_t offset;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    offset = offset_;
+  }
+  // Reads past the end of the device stop there.
+  if (static_cast<uint64_t>(offset) >= data_.size()) {
+    return 0;
+  }
+  count = std::min<uint64_t>(count, data_.size() - offset);
+  if (count > 0 && !Transfer({{offset, buf, count}}, false, false)) {
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  offset_ = offset + count;
+  return count;
+}
+
+ssize_t SimulatedBlockDevice::Write(const void* buf, size_t count) {
+  off64_t offset;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    offset = offset_;
+  }
+  if (count > 0 &&
+      !Transfer({{offset, const_cast<void*>(buf), count}}, true, false)) {
+    errno = ENOSPC;
+    return -1;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  offset_ = offset + count;
+  return count;
+}
+
+off64_t SimulatedBlockDevice::Seek(off64_t offset, int whence) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  switch (whence) {
+    case SEEK_SET:
+      break;
+    case SEEK_CUR:
+      offset += offset_;
+      break;
+    case SEEK_END:
+      offset += data_.size();
+      break;
+    default:
+      errno = EINVAL;
+      return -1;
+  }
+  if (offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  return offset_ = offset;
+}
+
+bool SimulatedBlockDevice::Flush() {
+  base::TimeDelta time;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.flushes++;
+    if (dirty_) {
+      time = profile_.flush_latency;
+      dirty_ = false;
+    }
+    elapsed_ += time;
+  }
+  if (sleep_) {
+    SleepFor(time);
+  }
+  return open_;
+}
+
+bool SimulatedBlockDevice::Close() {
+  if (!open_) {
+    errno = EBADF;
+    return false;
+  }
+  open_ = false;
+  return true;
+}
+
+bool SimulatedBlockDevice::ReadBatch(
+    const std::vector<FileIoRequest>& requests) {
+  return Transfer(requests, false, false);
+}
+
+bool SimulatedBlockDevice::WriteBatch(
+    const std::vector<FileIoRequest>& requests) {
+  return Transfer(requests, true, false);
+}
+
+bool SimulatedBlockDevice::ReadV(off64_t offset,
+                                 const std::vector<iovec>& iov) {
+  std::vector<FileIoRequest> requests;
+  for (const auto& vec : iov) {
+    requests.push_back({offset, vec.iov_base, vec.iov_len});
+    offset += vec.iov_len;
+  }
+  return Transfer(requests, false, true);
+}
+
+bool SimulatedBlockDevice::WriteV(off64_t offset,
+                                  const std::vector<iovec>& iov) {
+  std::vector<FileIoRequest> requests;
+  for (const auto& vec : iov) {
+    requests.push_back({offset, vec.iov_base, vec.iov_len});
+    offset += vec.iov_len;
+  }
+  return Transfer(requests, true, true);
+}
+
+bool SimulatedBlockDevice::Transfer(const std::vector<FileIoRequest>& requests,
+                                    bool write,
+                                    bool vectored) {
+  for (const auto& request : requests) {
+    if (request.offset < 0 ||
+        static_cast<uint64_t>(request.offset) + request.count > data_.size()) {
+      LOG(ERROR) << "Request of " << request.count << " bytes at "
+                 << request.offset << " is past the end of the device.";
+      return false;
+    }
+  }
+  const base::TimeDelta latency =
+      write ? profile_.write_latency : profile_.read_latency;
+  const uint64_t bandwidth =
+      write ? profile_.write_bandwidth : profile_.read_bandwidth;
+
+  base::TimeDelta time;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // The requests are served |queue_depth| at a time, each wave taking the
+    // latency of its slowest request, and all of them transfer their bytes
+    // over the same bandwidth.
+    base::TimeDelta wave_latency;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < requests.size(); i++) {
+      const auto& request = requests[i];
+      uint8_t* device_data = data_.data() + request.offset;
+      if (write) {
+        memcpy(device_data, request.buf, request.count);
+      } else {
+        memcpy(request.buf, device_data, request.count);
+      }
+      bytes += request.count;
+      // The buffers of a scatter/gather request follow each other, and only
+      // the first one pays the latency of the request.
+      if (vectored && i > 0) {
+        next_offset_ = request.offset + request.count;
+        continue;
+      }
+      base::TimeDelta request_latency = latency;
+      if (request.offset != next_offset_) {
+        request_latency += profile_.random_access_penalty;
+        stats_.random_accesses++;
+      }
+      next_offset_ = request.offset + request.count;
+      wave_latency = std::max(wave_latency, request_latency);
+      if ((i + 1) % profile_.queue_depth == 0 || i + 1 == requests.size()) {
+        time += wave_latency;
+        wave_latency = base::TimeDelta();
+      }
+    }
+    if (vectored) {
+      time += wave_latency;
+    }
+    if (bandwidth > 0) {
+      time += base::TimeDelta::FromMicroseconds(bytes * 1000000 / bandwidth);
+    }
+    elapsed_ += time;
+    const size_t num_requests = vectored ? 1 : requests.size();
+    if (write) {
+      stats_.writes += num_requests;
+      stats_.bytes_written += bytes;
+      dirty_ = dirty_ || bytes > 0;
+    } else {
+      stats_.reads += num_requests;
+      stats_.bytes_read += bytes;
+    }
+  }
+  if (sleep_) {
+    SleepFor(time);
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,132 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SIMULATED_BLOCK_DEVICE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SIMULATED_BLOCK_DEVICE_H_
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <base/time/time.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// How long the requests to a storage device take.
+struct StorageProfile {
+  // The time a request takes besides transferring its bytes, and the extra
+  // time when it doesn't start where the previous one ended.
+  base::TimeDelta read_latency;
+  base::TimeDelta write_latency;
+  base::TimeDelta random_access_penalty;
+  // The transfer rates, in bytes per second.
+  uint64_t read_bandwidth{0};
+  uint64_t write_bandwidth{0};
+  // The time a flush takes when there were writes since the previous one.
+  base::TimeDelta flush_latency;
+  // The most requests of a batch the device works on at once, paying their
+  // latency together. The transfers still share the bandwidth.
+  size_t queue_depth{1};
+
+  // Typical eMMC 5.1 and UFS 3.1 storage.
+  static StorageProfile Emmc();
+  static StorageProfile Ufs();
+};
+
+// An in-memory block device taking the time of a StorageProfile for its
+// requests. The time is simulated, so that tests and benchmarks of the I/O
+// patterns of the update are deterministic: it only adds up in elapsed(),
+// unless the device sleeps for it as well. The device may be used from any
+// thread, its requests are served one at a time.
+class SimulatedBlockDevice : public FileDescriptor {
+ public:
+  struct Stats {
+    uint64_t reads{0};
+    uint64_t writes{0};
+    uint64_t bytes_read{0};
+    uint64_t bytes_written{0};
+    // The requests not starting where the previous one ended.
+    uint64_t random_accesses{0};
+    uint64_t flushes{0};
+  };
+
+  SimulatedBlockDevice(const StorageProfile& profile, uint64_t size);
+  ~SimulatedBlockDevice() override = default;
+
+  // Also sleeps for the time the requests take, for benchmarks measuring the
+  // wall time.
+  void set_sleep(bool sleep) { sleep_ = sleep; }
+
+  // The total time the requests took.
+  base::TimeDelta elapsed() const;
+  Stats stats() const;
+  // The content of the device.
+  const brillo::Blob& data() const { return data_; }
+
+  // FileDescriptor overrides.
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override {
+    return Open(path, flags, 0);
+  }
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  uint64_t BlockDevSize() override { return data_.size(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    return false;
+  }
+  bool Flush() override;
+  bool Close() override;
+  bool IsSettingErrno() override { return true; }
+  bool IsOpen() override { return open_; }
+  bool ReadBatch(const std::vector<FileIoRequest>& requests) override;
+  bool WriteBatch(const std::vector<FileIoRequest>& requests) override;
+  bool ReadV(off64_t offset, const std::vector<iovec>& iov) override;
+  bool WriteV(off64_t offset, const std::vector<iovec>& iov) override;
+
+ private:
+  // Copies the bytes of |requests| from or to the device, and accounts for
+  // the time they take as one batch, or as a single request spanning all of
+  // them if |vectored|. Returns false if one is out of bounds.
+  bool Transfer(const std::vector<FileIoRequest>& requests,
+                bool write,
+                bool vectored);
+
+  const StorageProfile profile_;
+  brillo::Blob data_;
+  bool open_{false};
+  bool sleep_{false};
+
+  mutable std::mutex mutex_;
+  off64_t offset_{0};
+  // Where the previous request ended.
+  off64_t next_offset_{0};
+  bool dirty_{false};
+  base::TimeDelta elapsed_;
+  Stats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(SimulatedBlockDevice);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SIMULATED_BLOCK_DEVICE_H_
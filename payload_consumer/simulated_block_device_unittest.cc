@@ -0,0 +1,114 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/simulated_block_device.h"
+
+#include <fcntl.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+
+using base::TimeDelta;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class SimulatedBlockDeviceTest : public ::testing::Test {
+ protected:
+  StorageProfile profile_{
+      .read_latency = TimeDelta::FromMicroseconds(10),
+      .write_latency = TimeDelta::FromMicroseconds(20),
+      .random_access_penalty = TimeDelta::FromMicroseconds(100),
+      .read_bandwidth = 1000000,
+      .write_bandwidth = 500000,
+      .flush_latency = TimeDelta::FromMilliseconds(1),
+      .queue_depth = 4,
+  };
+};
+
+TEST_F(SimulatedBlockDeviceTest, SequentialReadTest) {
+  SimulatedBlockDevice device(profile_, 8192);
+  ASSERT_TRUE(device.Open("", O_RDONLY));
+  brillo::Blob buf(1024);
+  EXPECT_EQ(1024, device.Read(buf.data(), buf.size()));
+  EXPECT_EQ(1024, device.Read(buf.data(), buf.size()));
+  // The latency of both reads and 2048 bytes at 1 byte per microsecond.
+  EXPECT_EQ(TimeDelta::FromMicroseconds(2068), device.elapsed());
+  EXPECT_EQ(2u, device.stats().reads);
+  EXPECT_EQ(0u, device.stats().random_accesses);
+
+  // Reads stop at the end of the device.
+  EXPECT_EQ(8192 - 1000, device.Seek(-1000, SEEK_END));
+  EXPECT_EQ(1000, device.Read(buf.data(), buf.size()));
+  EXPECT_EQ(0, device.Read(buf.data(), buf.size()));
+}
+
+TEST_F(SimulatedBlockDeviceTest, RandomBatchTest) {
+  SimulatedBlockDevice device(profile_, 100000);
+  brillo::Blob buf(8000);
+  vector<FileIoRequest> requests;
+  for (size_t i = 0; i < 8; i++) {
+    requests.push_back({static_cast<off64_t>(10000 * (i + 1)),
+                        buf.data() + 1000 * i,
+                        1000});
+  }
+  ASSERT_TRUE(device.ReadBatch(requests));
+  // Two waves of four random reads, then 8000 bytes.
+  EXPECT_EQ(TimeDelta::FromMicroseconds(2 * 110 + 8000), device.elapsed());
+  EXPECT_EQ(8u, device.stats().random_accesses);
+}
+
+TEST_F(SimulatedBlockDeviceTest, WriteAndReadBackTest) {
+  SimulatedBlockDevice device(profile_, 4096);
+  brillo::Blob data(2048);
+  test_utils::FillWithData(&data);
+  ASSERT_TRUE(device.WriteBatch({{1024, data.data(), 1024},
+                                 {3072, data.data() + 1024, 1024}}));
+  brillo::Blob read(2048);
+  ASSERT_TRUE(
+      device.ReadV(1024, {{read.data(), 512}, {read.data() + 512, 512}}));
+  ASSERT_TRUE(device.ReadBatch({{3072, read.data() + 1024, 1024}}));
+  EXPECT_EQ(data, read);
+  EXPECT_EQ(2u, device.stats().writes);
+  // The scatter/gather read is a single request.
+  EXPECT_EQ(2u, device.stats().reads);
+}
+
+TEST_F(SimulatedBlockDeviceTest, FlushTest) {
+  SimulatedBlockDevice device(profile_, 4096);
+  ASSERT_TRUE(device.Open("", O_RDWR));
+  EXPECT_TRUE(device.Flush());
+  EXPECT_EQ(TimeDelta(), device.elapsed());
+  brillo::Blob data(500, 1);
+  EXPECT_EQ(500, device.Write(data.data(), data.size()));
+  EXPECT_TRUE(device.Flush());
+  // The write latency, 500 bytes at half a byte per microsecond and the
+  // flush.
+  EXPECT_EQ(TimeDelta::FromMicroseconds(20 + 1000 + 1000), device.elapsed());
+  EXPECT_EQ(2u, device.stats().flushes);
+}
+
+TEST_F(SimulatedBlockDeviceTest, OutOfBoundsTest) {
+  SimulatedBlockDevice device(profile_, 4096);
+  brillo::Blob buf(1024);
+  EXPECT_FALSE(device.ReadBatch({{4000, buf.data(), buf.size()}}));
+  EXPECT_EQ(TimeDelta(), device.elapsed());
+}
+
+}  // namespace chromeos_update_engine
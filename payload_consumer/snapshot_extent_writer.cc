@@ -18,18 +18,89 @@
 
 #include <algorithm>
 #include <cstdint>
+#include <cstring>
 
 #include <libsnapshot/cow_writer.h>
 
+#include "update_engine/common/trace.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/operation_stats.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
 
+namespace {
+
+enum class BlockKind {
+  kData,
+  kZero,
+  // The same as in the source partition.
+  kUnchanged,
+};
+
+}  // namespace
+
 bool SnapshotExtentWriter::WriteExtent(const void* bytes,
                                        const Extent& extent,
                                        size_t block_size) {
-  return cow_writer_->AddRawBlocks(
-      extent.start_block(), bytes, extent.num_blocks() * block_size);
+  ScopedOperationPhase write_phase(OperationPhase::kWrite);
+  UE_TRACE_SCOPE("cow_write");
+  const auto data = static_cast<const uint8_t*>(bytes);
+  const uint64_t num_blocks = extent.num_blocks();
+  std::vector<bool> unchanged(num_blocks);
+  if (source_fd_) {
+    for (const auto& overlap : source_blocks_.GetIntersectingExtents(extent)) {
+      source_buffer_.resize(overlap.num_blocks() * block_size);
+      ssize_t bytes_read = 0;
+      TEST_AND_RETURN_FALSE(utils::ReadAll(source_fd_,
+                                           source_buffer_.data(),
+                                           source_buffer_.size(),
+                                           overlap.start_block() * block_size,
+                                           &bytes_read));
+      TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) ==
+                            source_buffer_.size());
+      const uint64_t first = overlap.start_block() - extent.start_block();
+      for (uint64_t i = 0; i < overlap.num_blocks(); i++) {
+        unchanged[first + i] =
+            memcmp(data + (first + i) * block_size,
+                   source_buffer_.data() + i * block_size,
+                   block_size) == 0;
+      }
+    }
+  }
+  // The runs of zero blocks are written as COW zero operations, which spares
+  // the compressor a block it would gain nothing on and takes no space in the
+  // COW device.
+  const auto kind = [&](uint64_t i) {
+    if (unchanged[i]) {
+      return BlockKind::kUnchanged;
+    }
+    return utils::IsZero(data + i * block_size, block_size) ? BlockKind::kZero
+                                                            : BlockKind::kData;
+  };
+  uint64_t start = 0;
+  while (start < num_blocks) {
+    const BlockKind start_kind = kind(start);
+    uint64_t end = start + 1;
+    while (end < num_blocks && kind(end) == start_kind) {
+      end++;
+    }
+    const uint64_t new_block = extent.start_block() + start;
+    switch (start_kind) {
+      case BlockKind::kUnchanged:
+        break;
+      case BlockKind::kZero:
+        TEST_AND_RETURN_FALSE(
+            cow_writer_->AddZeroBlocks(new_block, end - start));
+        break;
+      case BlockKind::kData:
+        TEST_AND_RETURN_FALSE(cow_writer_->AddRawBlocks(
+            new_block, data + start * block_size, (end - start) * block_size));
+        break;
+    }
+    start = end;
+  }
+  return true;
 }
 
 }  // namespace chromeos_update_engine
@@ -18,11 +18,14 @@
 #define UPDATE_ENGINE_SNAPSHOT_EXTENT_WRITER_H_
 
 #include <cstdint>
+#include <utility>
 #include <vector>
 
 #include <libsnapshot/cow_writer.h>
 
 #include "update_engine/payload_consumer/block_extent_writer.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
@@ -31,12 +34,25 @@ class SnapshotExtentWriter final : public BlockExtentWriter {
  public:
   explicit SnapshotExtentWriter(android::snapshot::ICowWriter* cow_writer)
       : cow_writer_(cow_writer) {}
+  // The blocks of |source_blocks| whose new data is the same as in
+  // |source_fd| are left out of the COW, since the snapshot reads them from
+  // the source partition, like those of in place SOURCE_COPY operations.
+  SnapshotExtentWriter(android::snapshot::ICowWriter* cow_writer,
+                       FileDescriptorPtr source_fd,
+                       ExtentRanges source_blocks)
+      : cow_writer_(cow_writer),
+        source_fd_(std::move(source_fd)),
+        source_blocks_(std::move(source_blocks)) {}
   bool WriteExtent(const void* bytes,
                    const Extent& extent,
                    size_t block_size) override;
 
  private:
   android::snapshot::ICowWriter* cow_writer_;
+  FileDescriptorPtr source_fd_;
+  ExtentRanges source_blocks_;
+  // The source data of the blocks of the extent being written.
+  std::vector<uint8_t> source_buffer_;
 };
 
 }  // namespace chromeos_update_engine
@@ -14,6 +14,8 @@
 // limitations under the License.
 //
 
+#include <fcntl.h>
+
 #include <array>
 #include <cstring>
 #include <map>
@@ -26,6 +28,9 @@
 #include <google/protobuf/message_lite.h>
 #include <libsnapshot/cow_writer.h>
 
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/snapshot_extent_writer.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/update_metadata.pb.h"
@@ -193,6 +198,8 @@ TEST_F(SnapshotExtentWriterTest, WriteAcrossBlockBoundary) {
   buf[231] = 123;
   buf[buf.size() - 1] = 255;
   buf[kBlockSize - 1] = 254;
+  // No zero block, which would be written as a zero operation.
+  buf[kBlockSize + 1] = 253;
 
   writer_.Write(buf.data(), kBlockSize - 1);
   ASSERT_TRUE(cow_writer_.operations_.empty())
@@ -209,4 +216,50 @@ TEST_F(SnapshotExtentWriterTest, WriteAcrossBlockBoundary) {
                      cow_writer_.operations_[125].data.end());
   ASSERT_EQ(buf, actual_data);
 }
+
+TEST_F(SnapshotExtentWriterTest, ZeroBlocksTest) {
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  AddExtent(&extents, 123, 4);
+  writer_.Init(extents, kBlockSize);
+
+  std::vector<uint8_t> buf(kBlockSize * 4, 0);
+  buf[kBlockSize * 2 + 5] = 1;
+
+  ASSERT_TRUE(writer_.Write(buf.data(), buf.size()));
+  ASSERT_EQ(cow_writer_.operations_.size(), 3U);
+  ASSERT_EQ(cow_writer_.operations_[123].type, FakeCowWriter::CowOp::COW_ZERO);
+  ASSERT_EQ(std::vector<uint8_t>(buf.begin() + kBlockSize * 2,
+                                 buf.begin() + kBlockSize * 3),
+            cow_writer_.operations_[125].data);
+  ASSERT_EQ(cow_writer_.operations_[126].type, FakeCowWriter::CowOp::COW_ZERO);
+}
+
+TEST_F(SnapshotExtentWriterTest, UnchangedBlocksTest) {
+  // Only block 1 of the source changes.
+  std::vector<uint8_t> source(kBlockSize * 4);
+  test_utils::FillWithData(&source);
+  ScopedTempFile source_file("source.XXXXXX");
+  ASSERT_TRUE(utils::WriteFile(
+      source_file.path().c_str(), source.data(), source.size()));
+  auto source_fd = std::make_shared<EintrSafeFileDescriptor>();
+  ASSERT_TRUE(source_fd->Open(source_file.path().c_str(), O_RDONLY));
+
+  // Block 3 is written too, but isn't one of the |source_blocks|.
+  ExtentRanges source_blocks;
+  source_blocks.AddExtent(ExtentForRange(0, 3));
+  SnapshotExtentWriter writer(&cow_writer_, source_fd, source_blocks);
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  AddExtent(&extents, 0, 4);
+  writer.Init(extents, kBlockSize);
+
+  std::vector<uint8_t> buf = source;
+  buf[kBlockSize + 1] ^= 1;
+  ASSERT_TRUE(writer.Write(buf.data(), buf.size()));
+  ASSERT_EQ(cow_writer_.operations_.size(), 2U);
+  ASSERT_EQ(std::vector<uint8_t>(buf.begin() + kBlockSize,
+                                 buf.begin() + kBlockSize * 2),
+            cow_writer_.operations_[1].data);
+  ASSERT_EQ(std::vector<uint8_t>(buf.begin() + kBlockSize * 3, buf.end()),
+            cow_writer_.operations_[3].data);
+}
 }  // namespace chromeos_update_engine
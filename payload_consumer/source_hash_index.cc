@@ -0,0 +1,212 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_hash_index.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <base/bind.h>
+#include <base/format_macros.h>
+#include <base/location.h>
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+#include <base/strings/string_util.h>
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/common/constants.h"
+#include "update_engine/common/utils.h"
+
+using brillo::MessageLoop;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+string GetIndexKey(const string& name) {
+  return PrefsInterface::CreateSubKey({kPrefsSourceHashIndex, name});
+}
+
+// The start of the records made on |slot| and the build of
+// |build_timestamp|.
+string MakeRecordPrefix(BootControlInterface::Slot slot,
+                        int64_t build_timestamp) {
+  return base::StringPrintf("%u %" PRId64 " ", slot, build_timestamp);
+}
+
+// The record of a partition, what identifies the partition and its content.
+string MakeRecord(BootControlInterface::Slot slot,
+                  int64_t build_timestamp,
+                  uint64_t size,
+                  HashAlgorithm algorithm,
+                  const brillo::Blob& hash) {
+  return MakeRecordPrefix(slot, build_timestamp) +
+         base::StringPrintf(
+             "%" PRIu64 " %d ", size, static_cast<int>(algorithm)) +
+         base::HexEncode(hash.data(), hash.size());
+}
+
+}  // namespace
+
+bool IsSourceHashIndexed(PrefsInterface* prefs,
+                         const InstallPlan::Partition& partition,
+                         BootControlInterface::Slot slot,
+                         int64_t build_timestamp) {
+  if (partition.source_size == 0 || partition.source_hash.empty())
+    return false;
+  string record;
+  return prefs->GetString(GetIndexKey(partition.name), &record) &&
+         record == MakeRecord(slot,
+                              build_timestamp,
+                              partition.source_size,
+                              partition.hash_algorithm,
+                              partition.source_hash);
+}
+
+bool StoreSourceHashIndex(PrefsInterface* prefs,
+                          const string& name,
+                          BootControlInterface::Slot slot,
+                          int64_t build_timestamp,
+                          uint64_t size,
+                          HashAlgorithm algorithm,
+                          const brillo::Blob& hash) {
+  return prefs->SetString(
+      GetIndexKey(name),
+      MakeRecord(slot, build_timestamp, size, algorithm, hash));
+}
+
+void ClearSourceHashIndex(PrefsInterface* prefs) {
+  vector<string> keys;
+  if (!prefs->GetSubKeys(kPrefsSourceHashIndex, &keys))
+    return;
+  for (const string& key : keys) {
+    prefs->Delete(key);
+  }
+}
+
+SourceHashIndexer::SourceHashIndexer(PrefsInterface* prefs,
+                                     BootControlInterface::Slot slot,
+                                     int64_t build_timestamp,
+                                     vector<Partition> partitions,
+                                     base::Closure done_callback)
+    : prefs_(prefs),
+      slot_(slot),
+      build_timestamp_(build_timestamp),
+      partitions_(std::move(partitions)),
+      done_callback_(std::move(done_callback)) {}
+
+SourceHashIndexer::~SourceHashIndexer() {
+  Stop();
+}
+
+void SourceHashIndexer::Start() {
+  if (running() || done())
+    return;
+  ScheduleNextChunk();
+}
+
+void SourceHashIndexer::Stop() {
+  if (!running())
+    return;
+  MessageLoop::current()->CancelTask(task_);
+  task_ = MessageLoop::kTaskIdNull;
+}
+
+void SourceHashIndexer::ScheduleNextChunk() {
+  task_ = MessageLoop::current()->PostTask(
+      FROM_HERE,
+      base::Bind(&SourceHashIndexer::HashNextChunk, base::Unretained(this)));
+}
+
+bool SourceHashIndexer::OpenNextPartition() {
+  for (; next_partition_ < partitions_.size(); next_partition_++) {
+    const Partition& partition = partitions_[next_partition_];
+    string record;
+    if (prefs_->GetString(GetIndexKey(partition.name), &record) &&
+        base::StartsWith(record,
+                         MakeRecordPrefix(slot_, build_timestamp_),
+                         base::CompareCase::SENSITIVE)) {
+      // Indexed before on this build.
+      continue;
+    }
+    const off_t size = utils::FileSize(partition.path);
+    if (size <= 0) {
+      LOG(WARNING) << "Not indexing " << partition.name << " at "
+                   << partition.path << ", its size is unknown.";
+      continue;
+    }
+    fd_ = std::make_shared<EintrSafeFileDescriptor>();
+    if (!fd_->Open(partition.path.c_str(), O_RDONLY)) {
+      PLOG(WARNING) << "Not indexing " << partition.name << ", failed to open "
+                    << partition.path;
+      fd_.reset();
+      continue;
+    }
+    size_ = size;
+    offset_ = 0;
+    hasher_ = std::make_unique<HashCalculator>(HashAlgorithm::kSha256);
+    return true;
+  }
+  return false;
+}
+
+void SourceHashIndexer::HashNextChunk() {
+  task_ = MessageLoop::kTaskIdNull;
+  if (!fd_ && !OpenNextPartition()) {
+    LOG(INFO) << "Indexed the hashes of the partitions of slot " << slot_;
+    if (!done_callback_.is_null())
+      done_callback_.Run();
+    return;
+  }
+  const Partition& partition = partitions_[next_partition_];
+  buffer_.resize(std::min<uint64_t>(kChunkSize, size_ - offset_));
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(
+          fd_, buffer_.data(), buffer_.size(), offset_, &bytes_read) ||
+      bytes_read != static_cast<ssize_t>(buffer_.size()) ||
+      !hasher_->Update(buffer_.data(), buffer_.size())) {
+    LOG(WARNING) << "Not indexing " << partition.name << ", failed to read "
+                 << partition.path << " at " << offset_;
+    offset_ = size_;
+    hasher_.reset();
+  } else {
+    offset_ += buffer_.size();
+  }
+  if (offset_ >= size_) {
+    if (hasher_ && hasher_->Finalize()) {
+      if (StoreSourceHashIndex(prefs_,
+                               partition.name,
+                               slot_,
+                               build_timestamp_,
+                               size_,
+                               hasher_->algorithm(),
+                               hasher_->raw_hash())) {
+        LOG(INFO) << "Indexed the hash of " << partition.name;
+      }
+    }
+    fd_->Close();
+    fd_.reset();
+    hasher_.reset();
+    next_partition_++;
+  }
+  ScheduleNextChunk();
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,129 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_HASH_INDEX_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_HASH_INDEX_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/callback.h>
+#include <base/macros.h>
+#include <brillo/message_loops/message_loop.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/boot_control_interface.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/prefs_interface.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/install_plan.h"
+
+// The source hash index records the hash of the whole of each partition of
+// the current slot, computed in the background while the device is idle. A
+// source partition hashing to the |source_hash| the payload expects is the
+// exact one the payload was generated from, so the source hashes of its
+// operations needn't be checked again while it is applied. The records are
+// only valid for the slot and the build they were computed on: the
+// partitions of the current slot aren't written to until the next update.
+
+namespace chromeos_update_engine {
+
+// Returns whether the index recorded that the source partition of
+// |partition| in |slot|, on the build of |build_timestamp|, hashes to its
+// |source_hash|.
+bool IsSourceHashIndexed(PrefsInterface* prefs,
+                         const InstallPlan::Partition& partition,
+                         BootControlInterface::Slot slot,
+                         int64_t build_timestamp);
+
+// Records that partition |name| of |size| bytes in |slot|, on the build of
+// |build_timestamp|, hashes to |hash| with |algorithm|.
+bool StoreSourceHashIndex(PrefsInterface* prefs,
+                          const std::string& name,
+                          BootControlInterface::Slot slot,
+                          int64_t build_timestamp,
+                          uint64_t size,
+                          HashAlgorithm algorithm,
+                          const brillo::Blob& hash);
+
+// Forgets all the records of the index.
+void ClearSourceHashIndex(PrefsInterface* prefs);
+
+// Hashes the partitions of a slot not indexed yet in the background, a chunk
+// at a time on the current message loop, and records their hashes.
+class SourceHashIndexer {
+ public:
+  struct Partition {
+    std::string name;
+    std::string path;
+  };
+
+  // The partitions are hashed with SHA-256, the algorithm of most payloads.
+  static constexpr size_t kChunkSize = 1024 * 1024;  // bytes
+
+  // |done_callback| is called once all the |partitions| of |slot| were
+  // indexed, if set.
+  SourceHashIndexer(PrefsInterface* prefs,
+                    BootControlInterface::Slot slot,
+                    int64_t build_timestamp,
+                    std::vector<Partition> partitions,
+                    base::Closure done_callback = base::Closure());
+  ~SourceHashIndexer();
+
+  // Starts hashing the partitions, or resumes where Stop() left off.
+  void Start();
+  // Pauses hashing the partitions, keeping the progress made.
+  void Stop();
+
+  bool running() const { return task_ != brillo::MessageLoop::kTaskIdNull; }
+  // Whether all the partitions were indexed, or failed to be.
+  bool done() const { return next_partition_ >= partitions_.size(); }
+
+ private:
+  // Hashes the next chunk of the partition being indexed and schedules the
+  // following one, until all the partitions are done.
+  void HashNextChunk();
+
+  // Opens the next partition not indexed yet. Returns false if there is none
+  // left.
+  bool OpenNextPartition();
+
+  void ScheduleNextChunk();
+
+  PrefsInterface* prefs_;
+  const BootControlInterface::Slot slot_;
+  const int64_t build_timestamp_;
+  const std::vector<Partition> partitions_;
+  const base::Closure done_callback_;
+
+  // The index in |partitions_| of the partition being hashed, open in |fd_|,
+  // and the offset of the next chunk to read from it.
+  size_t next_partition_{0};
+  FileDescriptorPtr fd_;
+  uint64_t size_{0};
+  uint64_t offset_{0};
+  std::unique_ptr<HashCalculator> hasher_;
+  brillo::Blob buffer_;
+
+  brillo::MessageLoop::TaskId task_{brillo::MessageLoop::kTaskIdNull};
+
+  DISALLOW_COPY_AND_ASSIGN(SourceHashIndexer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_HASH_INDEX_H_
@@ -0,0 +1,132 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_hash_index.h"
+
+#include <vector>
+
+#include <base/bind.h>
+#include <brillo/message_loops/fake_message_loop.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/fake_prefs.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const BootControlInterface::Slot kSlot = 1;
+const int64_t kBuildTimestamp = 1234567890;
+}  // namespace
+
+class SourceHashIndexTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    loop_.SetAsCurrent();
+    // Not a multiple of the chunk size.
+    data_.resize(SourceHashIndexer::kChunkSize * 2 + 4096);
+    test_utils::FillWithData(&data_);
+    ASSERT_TRUE(test_utils::WriteFileVector(partition_file_.path(), data_));
+    partition_.name = "system";
+    partition_.source_size = data_.size();
+    ASSERT_TRUE(
+        HashCalculator::RawHashOfData(data_, &partition_.source_hash));
+  }
+
+  void TearDown() override { EXPECT_FALSE(loop_.PendingTasks()); }
+
+  void RunIndexer(SourceHashIndexer* indexer) {
+    indexer->Start();
+    while (loop_.RunOnce(false)) {
+    }
+  }
+
+  brillo::FakeMessageLoop loop_{nullptr};
+  FakePrefs prefs_;
+  brillo::Blob data_;
+  ScopedTempFile partition_file_{"source-hash-index-XXXXXX"};
+  InstallPlan::Partition partition_;
+};
+
+TEST_F(SourceHashIndexTest, StoreTest) {
+  EXPECT_FALSE(
+      IsSourceHashIndexed(&prefs_, partition_, kSlot, kBuildTimestamp));
+  ASSERT_TRUE(StoreSourceHashIndex(&prefs_,
+                                   partition_.name,
+                                   kSlot,
+                                   kBuildTimestamp,
+                                   partition_.source_size,
+                                   HashAlgorithm::kSha256,
+                                   partition_.source_hash));
+  EXPECT_TRUE(IsSourceHashIndexed(&prefs_, partition_, kSlot, kBuildTimestamp));
+  // Only for the same slot and build.
+  EXPECT_FALSE(IsSourceHashIndexed(&prefs_, partition_, 0, kBuildTimestamp));
+  EXPECT_FALSE(
+      IsSourceHashIndexed(&prefs_, partition_, kSlot, kBuildTimestamp + 1));
+
+  InstallPlan::Partition other = partition_;
+  other.source_hash[0] ^= 1;
+  EXPECT_FALSE(IsSourceHashIndexed(&prefs_, other, kSlot, kBuildTimestamp));
+  other = partition_;
+  other.hash_algorithm = HashAlgorithm::kBlake2b256;
+  EXPECT_FALSE(IsSourceHashIndexed(&prefs_, other, kSlot, kBuildTimestamp));
+
+  ClearSourceHashIndex(&prefs_);
+  EXPECT_FALSE(
+      IsSourceHashIndexed(&prefs_, partition_, kSlot, kBuildTimestamp));
+}
+
+TEST_F(SourceHashIndexTest, IndexerTest) {
+  bool done = false;
+  SourceHashIndexer indexer(
+      &prefs_,
+      kSlot,
+      kBuildTimestamp,
+      {{"missing", "/dev/null/missing"},
+       {partition_.name, partition_file_.path()}},
+      base::Bind([](bool* done) { *done = true; }, &done));
+  RunIndexer(&indexer);
+  EXPECT_TRUE(done);
+  EXPECT_TRUE(indexer.done());
+  EXPECT_FALSE(indexer.running());
+  EXPECT_TRUE(IsSourceHashIndexed(&prefs_, partition_, kSlot, kBuildTimestamp));
+}
+
+TEST_F(SourceHashIndexTest, IndexerStopTest) {
+  SourceHashIndexer indexer(&prefs_,
+                            kSlot,
+                            kBuildTimestamp,
+                            {{partition_.name, partition_file_.path()}});
+  indexer.Start();
+  // Hashes the first chunk only.
+  EXPECT_TRUE(loop_.RunOnce(false));
+  indexer.Stop();
+  EXPECT_FALSE(loop_.PendingTasks());
+  EXPECT_FALSE(indexer.done());
+  EXPECT_FALSE(
+      IsSourceHashIndexed(&prefs_, partition_, kSlot, kBuildTimestamp));
+
+  // Resumes from the second chunk.
+  RunIndexer(&indexer);
+  EXPECT_TRUE(indexer.done());
+  EXPECT_TRUE(IsSourceHashIndexed(&prefs_, partition_, kSlot, kBuildTimestamp));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,193 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_hash_tree.h"
+
+#include <string.h>
+
+#include <string>
+#include <utility>
+
+#include <base/logging.h>
+#include <libavb/libavb.h>
+#include <verity/hash_tree_builder.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Largest vbmeta image read from an AVB footer.
+constexpr uint64_t kMaxVbmetaSize = 1024 * 1024;  // bytes
+
+size_t RoundUpToPowerOfTwo(size_t n) {
+  size_t result = 1;
+  while (result < n) {
+    result <<= 1;
+  }
+  return result;
+}
+
+struct HashtreeInfo {
+  bool found{false};
+  AvbHashtreeDescriptor descriptor;
+  std::string algorithm;
+  brillo::Blob salt;
+};
+
+bool HashtreeDescriptorCallback(const AvbDescriptor* descriptor,
+                                void* user_data) {
+  AvbDescriptor desc;
+  if (!avb_descriptor_validate_and_byteswap(descriptor, &desc))
+    return false;
+  if (desc.tag != AVB_DESCRIPTOR_TAG_HASHTREE)
+    return true;
+  HashtreeInfo* info = static_cast<HashtreeInfo*>(user_data);
+  if (!avb_hashtree_descriptor_validate_and_byteswap(
+          reinterpret_cast<const AvbHashtreeDescriptor*>(descriptor),
+          &info->descriptor)) {
+    return false;
+  }
+  const char* algorithm =
+      reinterpret_cast<const char*>(info->descriptor.hash_algorithm);
+  info->algorithm.assign(
+      algorithm, strnlen(algorithm, sizeof(info->descriptor.hash_algorithm)));
+  const uint8_t* salt = reinterpret_cast<const uint8_t*>(descriptor) +
+                        sizeof(AvbHashtreeDescriptor) +
+                        info->descriptor.partition_name_len;
+  info->salt.assign(salt, salt + info->descriptor.salt_len);
+  info->found = true;
+  // Stops at the first hashtree descriptor.
+  return false;
+}
+
+}  // namespace
+
+std::unique_ptr<SourceHashTree> SourceHashTree::Load(FileDescriptorPtr fd,
+                                                     size_t block_size) {
+  const off64_t size = fd->Seek(0, SEEK_END);
+  if (size < static_cast<off64_t>(sizeof(AvbFooter)))
+    return nullptr;
+  brillo::Blob buffer(sizeof(AvbFooter));
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(fd,
+                       buffer.data(),
+                       buffer.size(),
+                       size - sizeof(AvbFooter),
+                       &bytes_read) ||
+      bytes_read != static_cast<ssize_t>(buffer.size()) ||
+      memcmp(buffer.data(), AVB_FOOTER_MAGIC, AVB_FOOTER_MAGIC_LEN) != 0) {
+    return nullptr;
+  }
+  AvbFooter footer;
+  if (!avb_footer_validate_and_byteswap(
+          reinterpret_cast<const AvbFooter*>(buffer.data()), &footer) ||
+      footer.vbmeta_size > kMaxVbmetaSize ||
+      footer.vbmeta_offset + footer.vbmeta_size >
+          static_cast<uint64_t>(size)) {
+    LOG(WARNING) << "Invalid AVB footer.";
+    return nullptr;
+  }
+
+  buffer.resize(footer.vbmeta_size);
+  if (!utils::PReadAll(fd,
+                       buffer.data(),
+                       buffer.size(),
+                       footer.vbmeta_offset,
+                       &bytes_read) ||
+      bytes_read != static_cast<ssize_t>(buffer.size())) {
+    PLOG(WARNING) << "Failed to read the vbmeta image.";
+    return nullptr;
+  }
+  HashtreeInfo info;
+  avb_descriptor_foreach(
+      buffer.data(), buffer.size(), HashtreeDescriptorCallback, &info);
+  if (!info.found)
+    return nullptr;
+
+  const AvbHashtreeDescriptor& hashtree = info.descriptor;
+  const EVP_MD* md = HashTreeBuilder::HashFunction(info.algorithm);
+  if (hashtree.dm_verity_version != 1 || md == nullptr ||
+      hashtree.data_block_size != block_size ||
+      hashtree.hash_block_size != block_size ||
+      hashtree.image_size % block_size != 0) {
+    LOG(WARNING) << "Unsupported hash tree: version "
+                 << hashtree.dm_verity_version << ", " << info.algorithm
+                 << " of " << hashtree.data_block_size << " bytes blocks.";
+    return nullptr;
+  }
+  // The levels are laid out from the root down, the base level last.
+  const uint64_t num_blocks = hashtree.image_size / block_size;
+  const uint64_t digests_size = utils::RoundUp(
+      num_blocks * RoundUpToPowerOfTwo(EVP_MD_size(md)), block_size);
+  if (digests_size > hashtree.tree_size ||
+      hashtree.tree_offset + hashtree.tree_size > static_cast<uint64_t>(size)) {
+    LOG(WARNING) << "Invalid hash tree of " << hashtree.tree_size
+                 << " bytes at " << hashtree.tree_offset;
+    return nullptr;
+  }
+  return std::make_unique<SourceHashTree>(
+      std::move(fd),
+      block_size,
+      md,
+      std::move(info.salt),
+      num_blocks,
+      hashtree.tree_offset + hashtree.tree_size - digests_size);
+}
+
+SourceHashTree::SourceHashTree(FileDescriptorPtr fd,
+                               size_t block_size,
+                               const EVP_MD* md,
+                               brillo::Blob salt,
+                               uint64_t num_blocks,
+                               uint64_t digests_offset)
+    : fd_(std::move(fd)),
+      block_size_(block_size),
+      md_(md),
+      digest_size_(EVP_MD_size(md)),
+      digest_stride_(RoundUpToPowerOfTwo(digest_size_)),
+      salt_(std::move(salt)),
+      num_blocks_(num_blocks),
+      digests_offset_(digests_offset) {}
+
+bool SourceHashTree::VerifyBlock(uint64_t block, const uint8_t* data) const {
+  if (block >= num_blocks_)
+    return false;
+  uint8_t expected[EVP_MAX_MD_SIZE];
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(fd_,
+                       expected,
+                       digest_size_,
+                       digests_offset_ + block * digest_stride_,
+                       &bytes_read) ||
+      bytes_read != static_cast<ssize_t>(digest_size_)) {
+    PLOG(WARNING) << "Failed to read the digest of block " << block;
+    return false;
+  }
+  uint8_t digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_size = 0;
+  EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+  bool ret = EVP_DigestInit_ex(ctx, md_, nullptr) &&
+             EVP_DigestUpdate(ctx, salt_.data(), salt_.size()) &&
+             EVP_DigestUpdate(ctx, data, block_size_) &&
+             EVP_DigestFinal_ex(ctx, digest, &digest_size);
+  EVP_MD_CTX_free(ctx);
+  return ret && digest_size == digest_size_ &&
+         memcmp(digest, expected, digest_size_) == 0;
+}
+
+}  // namespace chromeos_update_engine
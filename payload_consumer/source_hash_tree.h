@@ -0,0 +1,74 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_HASH_TREE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_HASH_TREE_H_
+
+#include <cstdint>
+#include <memory>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+#include <openssl/evp.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// The dm-verity hash tree of a partition, found from the hashtree descriptor
+// in the AVB footer of the partition, to tell which of its blocks are
+// corrupted. Only the base level of the tree, holding the digest of every
+// data block, is read, and it isn't checked against the root digest: blocks
+// found this way must still be checked against the hashes of the payload.
+class SourceHashTree {
+ public:
+  // Finds the hash tree of the partition |fd| of |block_size| bytes blocks,
+  // which must stay open. Returns null if there is none.
+  static std::unique_ptr<SourceHashTree> Load(FileDescriptorPtr fd,
+                                              size_t block_size);
+
+  // The tree of |num_blocks| data blocks hashed with |md| after |salt|, whose
+  // base level is at |digests_offset| in |fd|.
+  SourceHashTree(FileDescriptorPtr fd,
+                 size_t block_size,
+                 const EVP_MD* md,
+                 brillo::Blob salt,
+                 uint64_t num_blocks,
+                 uint64_t digests_offset);
+
+  uint64_t num_blocks() const { return num_blocks_; }
+
+  // Returns whether the block of data |data| matches the digest of block
+  // |block| of the partition.
+  bool VerifyBlock(uint64_t block, const uint8_t* data) const;
+
+ private:
+  const FileDescriptorPtr fd_;
+  const size_t block_size_;
+  const EVP_MD* const md_;
+  const size_t digest_size_;
+  // The digests are padded to a power of two.
+  const size_t digest_stride_;
+  const brillo::Blob salt_;
+  const uint64_t num_blocks_;
+  const uint64_t digests_offset_;
+
+  DISALLOW_COPY_AND_ASSIGN(SourceHashTree);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_HASH_TREE_H_
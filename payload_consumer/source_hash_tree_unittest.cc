@@ -0,0 +1,101 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_hash_tree.h"
+
+#include <fcntl.h>
+
+#include <memory>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+#include <openssl/evp.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/payload_consumer/fake_file_descriptor.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kNumBlocks = 4;
+}  // namespace
+
+class SourceHashTreeTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    data_ = FakeFileDescriptorData(kNumBlocks * kBlockSize);
+    // The digests of the blocks, after |kDigestsOffset| bytes.
+    brillo::Blob tree(kDigestsOffset);
+    for (size_t block = 0; block < kNumBlocks; block++) {
+      brillo::Blob salted_block = salt_;
+      salted_block.insert(salted_block.end(),
+                          data_.begin() + block * kBlockSize,
+                          data_.begin() + (block + 1) * kBlockSize);
+      brillo::Blob digest;
+      ASSERT_TRUE(HashCalculator::RawHashOfData(salted_block, &digest));
+      tree.insert(tree.end(), digest.begin(), digest.end());
+    }
+    ASSERT_TRUE(test_utils::WriteFileVector(tree_file_.path(), tree));
+    fd_ = std::make_shared<EintrSafeFileDescriptor>();
+    ASSERT_TRUE(fd_->Open(tree_file_.path().c_str(), O_RDONLY));
+  }
+
+  static constexpr uint64_t kDigestsOffset = 100;
+
+  brillo::Blob data_;
+  brillo::Blob salt_{1, 2, 3, 4};
+  ScopedTempFile tree_file_{"hash-tree-XXXXXX"};
+  FileDescriptorPtr fd_;
+};
+
+TEST_F(SourceHashTreeTest, VerifyBlockTest) {
+  SourceHashTree tree(
+      fd_, kBlockSize, EVP_sha256(), salt_, kNumBlocks, kDigestsOffset);
+  EXPECT_EQ(kNumBlocks, tree.num_blocks());
+  for (size_t block = 0; block < kNumBlocks; block++) {
+    EXPECT_TRUE(tree.VerifyBlock(block, data_.data() + block * kBlockSize));
+  }
+  // The data of another block, or corrupted data, don't match.
+  EXPECT_FALSE(tree.VerifyBlock(1, data_.data()));
+  brillo::Blob corrupted(data_.begin(), data_.begin() + kBlockSize);
+  corrupted[10] ^= 1;
+  EXPECT_FALSE(tree.VerifyBlock(0, corrupted.data()));
+  // Nor are blocks past the end of the tree.
+  EXPECT_FALSE(tree.VerifyBlock(kNumBlocks, data_.data()));
+}
+
+TEST_F(SourceHashTreeTest, WrongSaltTest) {
+  SourceHashTree tree(fd_,
+                      kBlockSize,
+                      EVP_sha256(),
+                      brillo::Blob(),
+                      kNumBlocks,
+                      kDigestsOffset);
+  EXPECT_FALSE(tree.VerifyBlock(0, data_.data()));
+}
+
+TEST_F(SourceHashTreeTest, LoadWithoutFooterTest) {
+  ScopedTempFile partition("partition-XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(partition.path(), data_));
+  auto fd = std::make_shared<EintrSafeFileDescriptor>();
+  ASSERT_TRUE(fd->Open(partition.path().c_str(), O_RDONLY));
+  EXPECT_EQ(nullptr, SourceHashTree::Load(fd, kBlockSize));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,108 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_prefetcher.h"
+
+#include <fcntl.h>
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+namespace chromeos_update_engine {
+
+SourcePrefetcher::SourcePrefetcher(
+    const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+    size_t block_size,
+    size_t max_ops,
+    uint64_t max_bytes,
+    ReadAheadFunction read_ahead)
+    : operations_(operations),
+      block_size_(block_size),
+      max_ops_(max_ops),
+      max_bytes_(max_bytes),
+      read_ahead_(std::move(read_ahead)) {
+  source_bytes_.reserve(operations_.size() + 1);
+  source_bytes_.push_back(0);
+  for (const InstallOperation& operation : operations_) {
+    uint64_t num_blocks = 0;
+    for (const Extent& extent : operation.src_extents()) {
+      num_blocks += extent.num_blocks();
+    }
+    source_bytes_.push_back(source_bytes_.back() + num_blocks * block_size_);
+  }
+}
+
+SourcePrefetcher::ReadAheadFunction SourcePrefetcher::FadviseReadAhead(
+    int fd) {
+  return [fd](uint64_t offset, uint64_t length) {
+    const int err = posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+    if (err != 0) {
+      LOG(WARNING) << "posix_fadvise(POSIX_FADV_WILLNEED) failed: "
+                   << strerror(err) << ", not reading source data ahead";
+      return false;
+    }
+    return true;
+  };
+}
+
+void SourcePrefetcher::Prefetch(size_t next_op_index) {
+  if (failed_ || max_ops_ == 0) {
+    return;
+  }
+  const size_t num_ops = static_cast<size_t>(operations_.size());
+  size_t end = std::min(next_op_index, num_ops);
+  while (end < num_ops && end - next_op_index < max_ops_ &&
+         (end == next_op_index ||
+          source_bytes_[end + 1] - source_bytes_[next_op_index] <=
+              max_bytes_)) {
+    end++;
+  }
+  for (size_t i = std::max(prefetched_end_, next_op_index); i < end; i++) {
+    // Merge the extents next to each other, which is how most operations
+    // read their source.
+    uint64_t start_block = 0;
+    uint64_t num_blocks = 0;
+    for (const Extent& extent : operations_[i].src_extents()) {
+      if (extent.start_block() == kSparseHole) {
+        continue;
+      }
+      if (num_blocks > 0 && start_block + num_blocks == extent.start_block()) {
+        num_blocks += extent.num_blocks();
+        continue;
+      }
+      if (num_blocks > 0 &&
+          !read_ahead_(start_block * block_size_, num_blocks * block_size_)) {
+        failed_ = true;
+        return;
+      }
+      start_block = extent.start_block();
+      num_blocks = extent.num_blocks();
+    }
+    if (num_blocks > 0 &&
+        !read_ahead_(start_block * block_size_, num_blocks * block_size_)) {
+      failed_ = true;
+      return;
+    }
+  }
+  prefetched_end_ = std::max(prefetched_end_, end);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,77 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_PREFETCHER_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_PREFETCHER_H_
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include <base/macros.h>
+#include <google/protobuf/repeated_field.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Asks for the source blocks of the operations about to be applied to be
+// read ahead, so that they are already in the page cache by the time the
+// data of the operations is received. The window of operations read ahead
+// goes from the next operation to apply up to |max_ops| operations or
+// |max_bytes| bytes of source data, whichever comes first, but always covers
+// the next operation.
+class SourcePrefetcher {
+ public:
+  // Starts reading ahead |length| bytes at |offset| of the source partition.
+  // Returns false if read ahead isn't supported, which stops the prefetcher.
+  using ReadAheadFunction = std::function<bool(uint64_t offset,
+                                               uint64_t length)>;
+
+  SourcePrefetcher(
+      const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+      size_t block_size,
+      size_t max_ops,
+      uint64_t max_bytes,
+      ReadAheadFunction read_ahead);
+
+  // Returns a ReadAheadFunction issuing posix_fadvise(POSIX_FADV_WILLNEED) on
+  // |fd|, which must outlive it.
+  static ReadAheadFunction FadviseReadAhead(int fd);
+
+  // Reads ahead the source of the operations in the window starting at
+  // |next_op_index| which weren't read ahead yet.
+  void Prefetch(size_t next_op_index);
+
+ private:
+  const google::protobuf::RepeatedPtrField<InstallOperation>& operations_;
+  const size_t block_size_;
+  const size_t max_ops_;
+  const uint64_t max_bytes_;
+  ReadAheadFunction read_ahead_;
+
+  // |source_bytes_[i]| is the size of the source of the first i operations.
+  std::vector<uint64_t> source_bytes_;
+  // Operations before this one were already read ahead.
+  size_t prefetched_end_{0};
+  bool failed_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(SourcePrefetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_SOURCE_PREFETCHER_H_
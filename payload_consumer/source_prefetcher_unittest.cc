@@ -0,0 +1,128 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/source_prefetcher.h"
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kBlockSize = 4096;
+// (offset, length) in blocks, as passed to the ReadAheadFunction.
+using ReadAhead = std::pair<uint64_t, uint64_t>;
+}  // namespace
+
+class SourcePrefetcherTest : public ::testing::Test {
+ protected:
+  // Adds an operation reading |num_blocks| blocks from |start_block|.
+  void AddOperation(uint64_t start_block, uint64_t num_blocks) {
+    *operations_.Add()->add_src_extents() =
+        ExtentForRange(start_block, num_blocks);
+  }
+
+  void CreatePrefetcher(size_t max_ops, uint64_t max_blocks) {
+    prefetcher_ = std::make_unique<SourcePrefetcher>(
+        operations_,
+        kBlockSize,
+        max_ops,
+        max_blocks * kBlockSize,
+        [this](uint64_t offset, uint64_t length) {
+          EXPECT_EQ(0u, offset % kBlockSize);
+          EXPECT_EQ(0u, length % kBlockSize);
+          read_aheads_.emplace_back(offset / kBlockSize, length / kBlockSize);
+          return read_ahead_result_;
+        });
+  }
+
+  google::protobuf::RepeatedPtrField<InstallOperation> operations_;
+  std::unique_ptr<SourcePrefetcher> prefetcher_;
+  vector<ReadAhead> read_aheads_;
+  bool read_ahead_result_{true};
+};
+
+TEST_F(SourcePrefetcherTest, WindowLimitedByOperationsTest) {
+  for (uint64_t i = 0; i < 5; i++) {
+    AddOperation(i * 10, 1);
+  }
+  CreatePrefetcher(2, 100);
+  prefetcher_->Prefetch(0);
+  EXPECT_EQ((vector<ReadAhead>{{0, 1}, {10, 1}}), read_aheads_);
+
+  // Only the operation entering the window is read ahead.
+  read_aheads_.clear();
+  prefetcher_->Prefetch(1);
+  prefetcher_->Prefetch(1);
+  EXPECT_EQ((vector<ReadAhead>{{20, 1}}), read_aheads_);
+
+  read_aheads_.clear();
+  prefetcher_->Prefetch(4);
+  prefetcher_->Prefetch(5);
+  EXPECT_EQ((vector<ReadAhead>{{40, 1}}), read_aheads_);
+}
+
+TEST_F(SourcePrefetcherTest, WindowLimitedByBytesTest) {
+  AddOperation(0, 4);
+  AddOperation(10, 4);
+  AddOperation(20, 4);
+  CreatePrefetcher(10, 10);
+  prefetcher_->Prefetch(0);
+  EXPECT_EQ((vector<ReadAhead>{{0, 4}, {10, 4}}), read_aheads_);
+}
+
+TEST_F(SourcePrefetcherTest, NextOperationAlwaysReadAheadTest) {
+  AddOperation(0, 20);
+  AddOperation(20, 1);
+  CreatePrefetcher(10, 10);
+  prefetcher_->Prefetch(0);
+  EXPECT_EQ((vector<ReadAhead>{{0, 20}}), read_aheads_);
+}
+
+TEST_F(SourcePrefetcherTest, AdjacentExtentsMergedTest) {
+  InstallOperation* operation = operations_.Add();
+  *operation->add_src_extents() = ExtentForRange(0, 2);
+  *operation->add_src_extents() = ExtentForRange(2, 3);
+  *operation->add_src_extents() = ExtentForRange(kSparseHole, 1);
+  *operation->add_src_extents() = ExtentForRange(8, 1);
+  // Operations without source, like REPLACE, are skipped.
+  operations_.Add();
+  CreatePrefetcher(10, 100);
+  prefetcher_->Prefetch(0);
+  EXPECT_EQ((vector<ReadAhead>{{0, 5}, {8, 1}}), read_aheads_);
+}
+
+TEST_F(SourcePrefetcherTest, StopsOnFailureTest) {
+  AddOperation(0, 1);
+  AddOperation(10, 1);
+  AddOperation(20, 1);
+  CreatePrefetcher(1, 100);
+  read_ahead_result_ = false;
+  prefetcher_->Prefetch(0);
+  prefetcher_->Prefetch(1);
+  prefetcher_->Prefetch(2);
+  EXPECT_EQ((vector<ReadAhead>{{0, 1}}), read_aheads_);
+}
+
+}  // namespace chromeos_update_engine
@@ -16,6 +16,7 @@
 
 #include "update_engine/payload_consumer/vabc_partition_writer.h"
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <utility>
@@ -26,10 +27,15 @@
 #include <libsnapshot/cow_writer.h>
 
 #include "update_engine/common/cow_operation_convert.h"
+#include "update_engine/common/trace.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/apply_hints.h"
+#include "update_engine/payload_consumer/async_cow_writer.h"
+#include "update_engine/payload_consumer/block_extent_writer.h"
 #include "update_engine/payload_consumer/extent_map.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_consumer/parallel_hash_tree_builder.h"
 #include "update_engine/payload_consumer/snapshot_extent_writer.h"
 #include "update_engine/payload_consumer/xor_extent_writer.h"
 #include "update_engine/payload_generator/extent_ranges.h"
@@ -60,22 +66,99 @@ namespace chromeos_update_engine {
 // label to |InitializeWithAppend|. The CowWriter will retain all data before
 // label 3, Which contains all operation 2's data, but none of operation 3's
 // data.
+// Large operations may also be checkpointed part way through, with a label
+// from |PartialOperationLabel|. Resuming from it keeps the blocks of the
+// operation written before the label.
 
 using android::snapshot::ICowWriter;
+
+// Label following the first |blocks| blocks written by operation |op_index|.
+// These are above |kEndOfInstallLabel| so they never collide with operation
+// indices.
+static uint64_t PartialOperationLabel(size_t op_index, uint64_t blocks) {
+  return (kEndOfInstallLabel << 1) + (static_cast<uint64_t>(op_index) << 24) +
+         blocks;
+}
 using ::google::protobuf::RepeatedPtrField;
 
 // Compute XOR map, a map from dst extent to corresponding merge operation
-static ExtentMap<const CowMergeOperation*, ExtentLess> ComputeXorMap(
+static ExtentMap<const CowMergeOperation*> ComputeXorMap(
     const RepeatedPtrField<CowMergeOperation>& merge_ops) {
-  ExtentMap<const CowMergeOperation*, ExtentLess> xor_map;
+  // Merge operations are in merge order, add them in block order so that
+  // every extent goes at the end of the map.
+  std::vector<const CowMergeOperation*> xor_ops;
   for (const auto& merge_op : merge_ops) {
     if (merge_op.type() == CowMergeOperation::COW_XOR) {
-      xor_map.AddExtent(merge_op.dst_extent(), &merge_op);
+      xor_ops.push_back(&merge_op);
     }
   }
+  std::stable_sort(xor_ops.begin(),
+                   xor_ops.end(),
+                   [](const CowMergeOperation* a, const CowMergeOperation* b) {
+                     return a->dst_extent().start_block() <
+                            b->dst_extent().start_block();
+                   });
+  ExtentMap<const CowMergeOperation*> xor_map;
+  for (const CowMergeOperation* merge_op : xor_ops) {
+    xor_map.AddExtent(merge_op->dst_extent(), merge_op);
+  }
   return xor_map;
 }
 
+// Passes the blocks of |extent| at |data|, or zeros if null, which are part of
+// the hash tree data of |install_part| to its inline hash tree builder.
+static bool HashWrittenBlocks(const InstallPlan::Partition& install_part,
+                              const Extent& extent,
+                              const void* data) {
+  const uint64_t block_size = install_part.block_size;
+  const uint64_t data_start = install_part.hash_tree_data_offset / block_size;
+  const uint64_t data_end =
+      data_start + install_part.hash_tree_data_size / block_size;
+  const uint64_t start = std::max(extent.start_block(), data_start);
+  const uint64_t end =
+      std::min(extent.start_block() + extent.num_blocks(), data_end);
+  if (start >= end) {
+    return true;
+  }
+  auto builder = install_part.inline_hash_tree_builder.get();
+  if (data == nullptr) {
+    return builder->ZeroBlocksAt(start - data_start, end - start);
+  }
+  return builder->UpdateBlocksAt(
+      start - data_start,
+      static_cast<const uint8_t*>(data) +
+          (start - extent.start_block()) * block_size,
+      end - start);
+}
+
+namespace {
+// Hashes the blocks written by |writer| into the inline hash tree of the
+// partition, as they pass.
+class HashTreeExtentWriter : public BlockExtentWriter {
+ public:
+  HashTreeExtentWriter(std::unique_ptr<ExtentWriter> writer,
+                       const InstallPlan::Partition& install_part)
+      : writer_(std::move(writer)), install_part_(install_part) {}
+
+  bool Init(const RepeatedPtrField<Extent>& extents,
+            uint32_t block_size) override {
+    return BlockExtentWriter::Init(extents, block_size) &&
+           writer_->Init(extents, block_size);
+  }
+
+  bool WriteExtent(const void* bytes,
+                   const Extent& extent,
+                   size_t block_size) override {
+    return HashWrittenBlocks(install_part_, extent, bytes) &&
+           writer_->Write(bytes, extent.num_blocks() * block_size);
+  }
+
+ private:
+  std::unique_ptr<ExtentWriter> writer_;
+  const InstallPlan::Partition& install_part_;
+};
+}  // namespace
+
 VABCPartitionWriter::VABCPartitionWriter(
     const PartitionUpdate& partition_update,
     const InstallPlan::Partition& install_part,
@@ -220,7 +303,26 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
   TEST_AND_RETURN_FALSE(install_plan != nullptr);
   if (source_may_exist && install_part_.source_size > 0) {
     TEST_AND_RETURN_FALSE(!install_part_.source_path.empty());
-    TEST_AND_RETURN_FALSE(verified_source_fd_.Open());
+    if (install_plan->source_cache_size > 0) {
+      verified_source_fd_.EnableCache(install_plan->source_cache_size,
+                                      partition_update_,
+                                      install_part_.source_size);
+    }
+    if (install_plan->source_prefetch_ops > 0) {
+      verified_source_fd_.EnablePrefetch(
+          partition_update_.operations(),
+          GetPrefetchWindow(partition_update_,
+                            install_plan->source_prefetch_ops),
+          install_plan->source_prefetch_bytes);
+    }
+    if (!install_part_.source_verity_path.empty()) {
+      verified_source_fd_.EnableVerityReads(install_part_.source_verity_path);
+    }
+    if (install_part_.source_hash_indexed) {
+      verified_source_fd_.EnableIndexedSource();
+    }
+    TEST_AND_RETURN_FALSE(
+        verified_source_fd_.Open(false, install_plan->use_direct_io));
   }
   std::optional<std::string> source_path;
   if (!install_part_.source_path.empty()) {
@@ -233,7 +335,14 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
   // |next_op_index_| is still 0. In this case we discard previously written
   // SOURCE_COPY, and start over.
   std::optional<uint64_t> label;
-  if (install_plan->is_resume && next_op_index > 0) {
+  if (install_plan->is_resume && install_plan->resume_operation_bytes > 0) {
+    LOG(INFO) << "Resuming update on partition `"
+              << partition_update_.partition_name() << "` op index "
+              << next_op_index << " after "
+              << install_plan->resume_operation_bytes << " bytes";
+    label = PartialOperationLabel(
+        next_op_index, install_plan->resume_operation_bytes / block_size_);
+  } else if (install_plan->is_resume && next_op_index > 0) {
     LOG(INFO) << "Resuming update on partition `"
               << partition_update_.partition_name() << "` op index "
               << next_op_index;
@@ -243,6 +352,14 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
   cow_writer_ =
       dynamic_control_->OpenCowWriter(install_part_.name, source_path, label);
   TEST_AND_RETURN_FALSE(cow_writer_ != nullptr);
+  if (install_plan->cow_write_queue_size > 0) {
+    LOG(INFO) << "Writing to the COW image of "
+              << partition_update_.partition_name()
+              << " on a worker thread, queueing up to "
+              << install_plan->cow_write_queue_size / 1024 << " KiB";
+    cow_writer_ = std::make_unique<AsyncCowWriter>(
+        std::move(cow_writer_), install_plan->cow_write_queue_size);
+  }
 
   if (label) {
     return true;
@@ -330,7 +447,17 @@ bool VABCPartitionWriter::WriteMergeSequence(
 }
 
 std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateBaseExtentWriter() {
-  return std::make_unique<SnapshotExtentWriter>(cow_writer_.get());
+  return WrapExtentWriter(
+      std::make_unique<SnapshotExtentWriter>(cow_writer_.get()));
+}
+
+std::unique_ptr<ExtentWriter> VABCPartitionWriter::WrapExtentWriter(
+    std::unique_ptr<ExtentWriter> writer) {
+  if (!install_part_.inline_hash_tree_builder) {
+    return writer;
+  }
+  return std::make_unique<HashTreeExtentWriter>(std::move(writer),
+                                                install_part_);
 }
 
 [[nodiscard]] bool VABCPartitionWriter::PerformZeroOrDiscardOperation(
@@ -338,6 +465,9 @@ std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateBaseExtentWriter() {
   for (const auto& extent : operation.dst_extents()) {
     TEST_AND_RETURN_FALSE(
         cow_writer_->AddZeroBlocks(extent.start_block(), extent.num_blocks()));
+    if (install_part_.inline_hash_tree_builder) {
+      TEST_AND_RETURN_FALSE(HashWrittenBlocks(install_part_, extent, nullptr));
+    }
   }
   return true;
 }
@@ -363,6 +493,12 @@ bool VABCPartitionWriter::PerformReplaceOperation(const InstallOperation& op,
   return executor_.ExecuteReplaceOperation(op, std::move(writer), data);
 }
 
+std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateReplaceExtentWriter(
+    const InstallOperation& operation) {
+  return executor_.CreateReplaceExtentWriter(operation,
+                                             CreateBaseExtentWriter());
+}
+
 bool VABCPartitionWriter::PerformDiffOperation(
     const InstallOperation& operation,
     ErrorCode* error,
@@ -373,16 +509,26 @@ bool VABCPartitionWriter::PerformDiffOperation(
   TEST_AND_RETURN_FALSE(source_fd != nullptr);
   TEST_AND_RETURN_FALSE(source_fd->IsOpen());
 
-  std::unique_ptr<ExtentWriter> writer =
-      IsXorEnabled() ? std::make_unique<XORExtentWriter>(
-                           operation,
-                           source_fd,
-                           cow_writer_.get(),
-                           xor_map_,
-                           partition_update_.old_partition_info().size())
-                     : CreateBaseExtentWriter();
+  std::unique_ptr<ExtentWriter> writer;
+  if (IsXorEnabled()) {
+    writer = std::make_unique<XORExtentWriter>(
+        operation,
+        source_fd,
+        cow_writer_.get(),
+        xor_map_,
+        partition_update_.old_partition_info().size());
+  } else {
+    // The blocks the operation patches in place are often left as they were,
+    // like the unmodified parts of a file, for which there is then nothing
+    // to write. The executor just read their source data, which makes
+    // comparing it cheap.
+    ExtentRanges source_blocks;
+    source_blocks.AddRepeatedExtents(operation.src_extents());
+    writer = std::make_unique<SnapshotExtentWriter>(
+        cow_writer_.get(), source_fd, std::move(source_blocks));
+  }
   return executor_.ExecuteDiffOperation(
-      operation, std::move(writer), source_fd, data, count);
+      operation, WrapExtentWriter(std::move(writer)), source_fd, data, count);
 }
 
 void VABCPartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
@@ -391,13 +537,26 @@ void VABCPartitionWriter::CheckpointUpdateProgress(size_t next_op_index) {
   // if cow_writer_ failed, that means Init() failed. This function shouldn't be
   // called if Init() fails.
   TEST_AND_RETURN(cow_writer_ != nullptr);
+  UE_TRACE_SCOPE("cow_label");
   cow_writer_->AddLabel(next_op_index);
 }
 
+bool VABCPartitionWriter::CheckpointPartialOperation(size_t op_index,
+                                                     uint64_t bytes) {
+  TEST_AND_RETURN_FALSE(cow_writer_ != nullptr);
+  TEST_AND_RETURN_FALSE(bytes % block_size_ == 0);
+  // Operations with more blocks than the label has room for only checkpoint
+  // once complete.
+  const uint64_t blocks = bytes / block_size_;
+  TEST_AND_RETURN_FALSE(blocks < (1U << 24));
+  return cow_writer_->AddLabel(PartialOperationLabel(op_index, blocks));
+}
+
 [[nodiscard]] bool VABCPartitionWriter::FinishedInstallOps() {
   // Add a hardcoded magic label to indicate end of all install ops. This label
   // is needed by filesystem verification, don't remove.
   TEST_AND_RETURN_FALSE(cow_writer_ != nullptr);
+  UE_TRACE_SCOPE("cow_finalize");
   TEST_AND_RETURN_FALSE(cow_writer_->AddLabel(kEndOfInstallLabel));
   TEST_AND_RETURN_FALSE(cow_writer_->Finalize());
 
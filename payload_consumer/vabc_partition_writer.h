@@ -62,6 +62,8 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
   [[nodiscard]] bool PerformReplaceOperation(const InstallOperation& operation,
                                              const void* data,
                                              size_t count) override;
+  [[nodiscard]] std::unique_ptr<ExtentWriter> CreateReplaceExtentWriter(
+      const InstallOperation& operation) override;
 
   [[nodiscard]] bool PerformDiffOperation(const InstallOperation& operation,
                                           ErrorCode* error,
@@ -69,6 +71,14 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
                                           size_t count) override;
 
   void CheckpointUpdateProgress(size_t next_op_index) override;
+  [[nodiscard]] bool CheckpointPartialOperation(size_t op_index,
+                                                uint64_t bytes) override;
+  void PrefetchSource(size_t next_op_index) override {
+    verified_source_fd_.Prefetch(next_op_index);
+  }
+  void SetPuffpatchCacheBudget(size_t bytes) override {
+    executor_.SetPuffpatchCacheBudget(bytes);
+  }
 
   [[nodiscard]] bool FinishedInstallOps() override;
   int Close() override;
@@ -84,6 +94,10 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
   std::unique_ptr<android::snapshot::ICowWriter> cow_writer_;
 
   [[nodiscard]] std::unique_ptr<ExtentWriter> CreateBaseExtentWriter();
+  // Returns |writer|, hashing the blocks it writes into the inline hash tree
+  // of the partition if it has one.
+  [[nodiscard]] std::unique_ptr<ExtentWriter> WrapExtentWriter(
+      std::unique_ptr<ExtentWriter> writer);
 
   const PartitionUpdate& partition_update_;
   const InstallPlan::Partition& install_part_;
@@ -94,7 +108,7 @@ class VABCPartitionWriter final : public PartitionWriterInterface {
   const size_t block_size_;
   InstallOperationExecutor executor_;
   VerifiedSourceFd verified_source_fd_;
-  ExtentMap<const CowMergeOperation*, ExtentLess> xor_map_;
+  ExtentMap<const CowMergeOperation*> xor_map_;
   ExtentRanges copy_blocks_;
 };
 
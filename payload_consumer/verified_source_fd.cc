@@ -18,6 +18,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <algorithm>
 #include <memory>
 #include <utility>
 #include <vector>
@@ -29,10 +30,16 @@
 #include "update_engine/common/error_code.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/apply_hints.h"
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/io_uring_file_descriptor.h"
+#include "update_engine/payload_consumer/operation_stats.h"
 #include "update_engine/payload_consumer/partition_writer.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/source_prefetcher.h"
+#include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/update_metadata.pb.h"
 #if USE_FEC
 #include "update_engine/payload_consumer/fec_file_descriptor.h"
@@ -66,6 +73,112 @@ bool VerifiedSourceFd::OpenCurrentECCPartition() {
   return !source_ecc_open_failure_;
 }
 
+bool VerifiedSourceFd::LoadSourceHashTree() {
+  if (source_hash_tree_)
+    return true;
+  if (source_hash_tree_load_failure_)
+    return false;
+  auto fd = std::make_shared<EintrSafeFileDescriptor>();
+  if (fd->Open(source_path_.c_str(), O_RDONLY)) {
+    source_hash_tree_ = SourceHashTree::Load(fd, block_size_);
+  }
+  if (!source_hash_tree_) {
+    LOG(INFO) << "No hash tree found in " << source_path_
+              << ", correcting whole operations.";
+    source_hash_tree_load_failure_ = true;
+    return false;
+  }
+  return true;
+}
+
+bool VerifiedSourceFd::RecoverCorruptedSourceBlocks(
+    const InstallOperation& operation) {
+  if (!LoadSourceHashTree())
+    return false;
+  for (const Extent& extent : operation.src_extents()) {
+    if (extent.start_block() == kSparseHole)
+      return false;
+  }
+  std::vector<unsigned char> source_data;
+  if (!utils::ReadExtents(
+          source_fd_, operation.src_extents(), &source_data, block_size_)) {
+    return false;
+  }
+
+  // Checks all the blocks first, for the corrupted ones not corrected yet to
+  // be decoded in runs of consecutive blocks, libfec being much faster with
+  // large reads than with one block at a time.
+  std::vector<bool> corrupted;
+  std::vector<Extent> undecoded_extents;
+  const uint8_t* block_data = source_data.data();
+  for (const Extent& extent : operation.src_extents()) {
+    for (uint64_t block = extent.start_block();
+         block < extent.start_block() + extent.num_blocks();
+         block++, block_data += block_size_) {
+      corrupted.push_back(!source_hash_tree_->VerifyBlock(block, block_data));
+      if (corrupted.back() && corrected_blocks_.count(block) == 0)
+        AppendBlockToExtents(&undecoded_extents, block);
+    }
+  }
+  for (const Extent& extent : undecoded_extents) {
+    brillo::Blob data(extent.num_blocks() * block_size_);
+    ssize_t bytes_read = 0;
+    if (!utils::PReadAll(source_ecc_fd_,
+                         data.data(),
+                         data.size(),
+                         extent.start_block() * block_size_,
+                         &bytes_read) ||
+        bytes_read != static_cast<ssize_t>(data.size())) {
+      LOG(WARNING) << "Unable to correct source blocks " << extent;
+      return false;
+    }
+    for (uint64_t i = 0; i < extent.num_blocks(); i++) {
+      const uint64_t block = extent.start_block() + i;
+      const uint8_t* block_bytes = data.data() + i * block_size_;
+      if (!source_hash_tree_->VerifyBlock(block, block_bytes)) {
+        LOG(WARNING) << "Unable to correct source block " << block;
+        return false;
+      }
+      corrected_blocks_.emplace(
+          block, brillo::Blob(block_bytes, block_bytes + block_size_));
+    }
+  }
+
+  std::vector<Extent> corrupted_extents;
+  std::vector<unsigned char> corrected_data;
+  uint8_t* data = source_data.data();
+  size_t index = 0;
+  for (const Extent& extent : operation.src_extents()) {
+    for (uint64_t block = extent.start_block();
+         block < extent.start_block() + extent.num_blocks();
+         block++, data += block_size_) {
+      if (!corrupted[index++])
+        continue;
+      const brillo::Blob& corrected = corrected_blocks_[block];
+      std::copy(corrected.begin(), corrected.end(), data);
+      corrected_data.insert(
+          corrected_data.end(), corrected.begin(), corrected.end());
+      AppendBlockToExtents(&corrupted_extents, block);
+    }
+  }
+
+  brillo::Blob source_hash;
+  if (!HashCalculator::RawHashOfData(
+          source_data, &source_hash, hash_algorithm_) ||
+      source_hash != brillo::Blob(operation.src_sha256_hash().begin(),
+                                  operation.src_sha256_hash().end())) {
+    return false;
+  }
+  if (corrupted_extents.empty())
+    return true;
+  LOG(WARNING) << "Corrected " << corrected_data.size() / block_size_
+               << " corrupted source blocks: " << corrupted_extents;
+  return WriteBackCorrectedSourceBlocks(
+      corrected_data,
+      google::protobuf::RepeatedPtrField<Extent>(corrupted_extents.begin(),
+                                                 corrupted_extents.end()));
+}
+
 bool VerifiedSourceFd::WriteBackCorrectedSourceBlocks(
     const std::vector<unsigned char>& source_data,
     const google::protobuf::RepeatedPtrField<Extent>& extents) {
@@ -78,6 +191,13 @@ bool VerifiedSourceFd::WriteBackCorrectedSourceBlocks(
   DirectExtentWriter writer(fd);
   TEST_AND_RETURN_FALSE(writer.Init(extents, block_size_));
   TEST_AND_RETURN_FALSE(writer.Write(source_data.data(), source_data.size()));
+  if (source_cache_) {
+    // The cache still holds the blocks that failed verification.
+    for (const Extent& extent : extents) {
+      source_cache_->Invalidate(extent.start_block() * block_size_,
+                                extent.num_blocks() * block_size_);
+    }
+  }
   return true;
 }
 
@@ -87,9 +207,22 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
     LOG(ERROR) << "ChooseSourceFD fail: source_fd_ == nullptr";
     return nullptr;
   }
+  ScopedOperationPhase source_read_phase(OperationPhase::kSourceRead);
   if (error) {
     *error = ErrorCode::kSuccess;
   }
+  if (verity_reads_) {
+    // dm-verity already checked the blocks read, or failed the read.
+    if (fd_utils::ReadAndHashExtents(
+            source_fd_, operation.src_extents(), block_size_, nullptr)) {
+      return source_fd_;
+    }
+    FallBackFromVerity();
+  }
+  if (indexed_source_) {
+    // The whole source partition matched the payload when it was indexed.
+    return source_fd_;
+  }
   if (!operation.has_src_sha256_hash()) {
     // When the operation doesn't include a source hash, we attempt the error
     // corrected device first since we can't verify the block in the raw device
@@ -109,8 +242,11 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
   brillo::Blob source_hash;
   brillo::Blob expected_source_hash(operation.src_sha256_hash().begin(),
                                     operation.src_sha256_hash().end());
-  if (fd_utils::ReadAndHashExtents(
-          source_fd_, operation.src_extents(), block_size_, &source_hash) &&
+  if (fd_utils::ReadAndHashExtents(source_fd_,
+                                   operation.src_extents(),
+                                   block_size_,
+                                   &source_hash,
+                                   hash_algorithm_) &&
       source_hash == expected_source_hash) {
     return source_fd_;
   }
@@ -133,12 +269,23 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
                << base::HexEncode(expected_source_hash.data(),
                                   expected_source_hash.size());
 
+  // Decoding only the corrupted blocks is much faster than decoding the whole
+  // source of the operation.
+  if (RecoverCorruptedSourceBlocks(operation)) {
+    source_ecc_recovered_failures_++;
+    if (error) {
+      *error = ErrorCode::kSuccess;
+    }
+    return source_fd_;
+  }
+
   std::vector<unsigned char> source_data;
   if (!utils::ReadExtents(
           source_ecc_fd_, operation.src_extents(), &source_data, block_size_)) {
     return nullptr;
   }
-  if (!HashCalculator::RawHashOfData(source_data, &source_hash)) {
+  if (!HashCalculator::RawHashOfData(
+          source_data, &source_hash, hash_algorithm_)) {
     return nullptr;
   }
   if (PartitionWriter::ValidateSourceHash(
@@ -155,14 +302,97 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
   return nullptr;
 }
 
-bool VerifiedSourceFd::Open() {
-  source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
-  if (source_fd_ == nullptr)
+bool VerifiedSourceFd::OpenSourceFd(const std::string& path) {
+  if (use_io_uring_) {
+    source_fd_ = std::make_shared<IoUringFileDescriptor>();
+  } else if (use_direct_io_) {
+    source_fd_ = std::make_shared<DirectIoFileDescriptor>();
+  } else {
+    source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
+  }
+  const FileDescriptorPtr raw_fd = source_fd_;
+  source_cache_.reset();
+  prefetcher_.reset();
+  if (cache_size_ > 0) {
+    source_cache_ = std::make_shared<BlockCacheFileDescriptor>(
+        source_fd_, block_size_, cache_size_);
+    // Kept for the raw source partition in case of FallBackFromVerity().
+    source_cache_->SetReusedBlocks(verity_reads_ ? reused_blocks_
+                                                 : std::move(reused_blocks_));
+    source_fd_ = source_cache_;
+  }
+  if (!source_fd_->Open(path.c_str(), O_RDONLY)) {
+    PLOG(ERROR) << "Failed to open " << path;
     return false;
-  if (!source_fd_->Open(source_path_.c_str(), O_RDONLY)) {
-    PLOG(ERROR) << "Failed to open " << source_path_;
+  }
+  if (prefetch_operations_ != nullptr && raw_fd->Fd() >= 0 &&
+      !use_direct_io_) {
+    // Reads with O_DIRECT wouldn't find the data read ahead in the page
+    // cache.
+    prefetcher_ = std::make_unique<SourcePrefetcher>(
+        *prefetch_operations_,
+        block_size_,
+        prefetch_max_ops_,
+        prefetch_max_bytes_,
+        SourcePrefetcher::FadviseReadAhead(raw_fd->Fd()));
   }
   return true;
 }
 
+bool VerifiedSourceFd::Open(bool use_io_uring, bool use_direct_io) {
+  use_io_uring_ = use_io_uring;
+  use_direct_io_ = use_direct_io;
+  if (!verity_path_.empty()) {
+    verity_reads_ = true;
+    if (OpenSourceFd(verity_path_)) {
+      LOG(INFO) << "Reading " << source_path_ << " through " << verity_path_
+                << " without checking the source hashes.";
+      return true;
+    }
+    verity_reads_ = false;
+  }
+  OpenSourceFd(source_path_);
+  LOG_IF(INFO, indexed_source_ && source_fd_)
+      << "Reading " << source_path_
+      << " without checking the source hashes, as indexed.";
+  return source_fd_ != nullptr;
+}
+
+void VerifiedSourceFd::FallBackFromVerity() {
+  LOG(WARNING) << "Failed to read the source blocks from " << verity_path_
+               << ", reading " << source_path_
+               << " and checking the source hashes from now on.";
+  verity_reads_ = false;
+  // The source may be corrupted after all.
+  indexed_source_ = false;
+  OpenSourceFd(source_path_);
+}
+
+void VerifiedSourceFd::EnablePrefetch(
+    const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+    size_t max_ops,
+    uint64_t max_bytes) {
+  prefetch_operations_ = &operations;
+  prefetch_max_ops_ = max_ops;
+  prefetch_max_bytes_ = max_bytes;
+}
+
+void VerifiedSourceFd::Prefetch(size_t next_op_index) {
+  if (prefetcher_) {
+    prefetcher_->Prefetch(next_op_index);
+  }
+}
+
+void VerifiedSourceFd::EnableCache(size_t cache_size,
+                                   const PartitionUpdate& partition,
+                                   uint64_t source_size) {
+  cache_size_ = cache_size;
+  const uint64_t num_blocks = utils::DivRoundUp(source_size, block_size_);
+  reused_blocks_ = GetReusedSourceBlocks(partition.apply_hints(), num_blocks);
+  if (reused_blocks_.empty()) {
+    reused_blocks_ = BlockCacheFileDescriptor::FindReusedBlocks(
+        partition.operations(), num_blocks);
+  }
+}
+
 }  // namespace chromeos_update_engine
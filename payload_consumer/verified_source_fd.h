@@ -18,35 +18,121 @@
 
 #include <cstddef>
 
+#include <map>
+#include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <gtest/gtest_prod.h>
 #include <update_engine/update_metadata.pb.h>
 
 #include "update_engine/common/error_code.h"
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/payload_consumer/block_cache_file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/source_hash_tree.h"
+#include "update_engine/payload_consumer/source_prefetcher.h"
 
 namespace chromeos_update_engine {
 
 class VerifiedSourceFd {
  public:
-  explicit VerifiedSourceFd(size_t block_size, std::string source_path)
-      : block_size_(block_size), source_path_(std::move(source_path)) {}
+  // The source hashes of the operations are checked with |hash_algorithm|.
+  VerifiedSourceFd(size_t block_size,
+                   std::string source_path,
+                   HashAlgorithm hash_algorithm = HashAlgorithm::kSha256)
+      : block_size_(block_size),
+        source_path_(std::move(source_path)),
+        hash_algorithm_(hash_algorithm) {}
   FileDescriptorPtr ChooseSourceFD(const InstallOperation& operation,
                                    ErrorCode* error);
 
-  [[nodiscard]] bool Open();
+  // Opens the source partition. With |use_io_uring|, batched reads of the
+  // raw source go through io_uring. Otherwise, |use_direct_io| opens it with
+  // O_DIRECT, which also disables read ahead.
+  [[nodiscard]] bool Open(bool use_io_uring = false,
+                          bool use_direct_io = false);
+
+  // Keeps up to |cache_size| bytes of the source blocks read in memory,
+  // favoring the ones that more than one of the operations of |partition|
+  // read, as its apply hints tell if it has them. Must be called before
+  // Open().
+  void EnableCache(size_t cache_size,
+                   const PartitionUpdate& partition,
+                   uint64_t source_size);
+
+  // Reads ahead the source blocks of up to |max_ops| of |operations|, or
+  // |max_bytes| of them, in front of the one passed to Prefetch(). Must be
+  // called before Open(), and |operations| must outlive this object.
+  void EnablePrefetch(
+      const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+      size_t max_ops,
+      uint64_t max_bytes);
+  // Tells that operation |next_op_index| is the next one to be applied.
+  void Prefetch(size_t next_op_index);
+
+  // Reads the source partition through its dm-verity device |verity_path|,
+  // without checking the source hashes, until reading it fails. Must be
+  // called before Open().
+  void EnableVerityReads(std::string verity_path) {
+    verity_path_ = std::move(verity_path);
+  }
+
+  // Doesn't check the source hashes of the operations, the source partition
+  // being the one of the payload as the source hash index tells, until
+  // reading the dm-verity device fails. Must be called before Open().
+  void EnableIndexedSource() { indexed_source_ = true; }
+
+  // The source partition, for callers checking the source hashes of what
+  // they read from it themselves, unless skip_source_hashes(). Null until
+  // Open() succeeds.
+  FileDescriptorPtr source_fd() const { return source_fd_; }
+  // Whether source_fd() is the dm-verity device, whose reads of corrupted
+  // blocks fail.
+  bool verity_reads() const { return verity_reads_; }
+  // Whether the source hashes of the operations needn't be checked.
+  bool skip_source_hashes() const { return verity_reads_ || indexed_source_; }
 
  private:
   bool WriteBackCorrectedSourceBlocks(
       const std::vector<unsigned char>& source_data,
       const google::protobuf::RepeatedPtrField<Extent>& extents);
   bool OpenCurrentECCPartition();
+  // Loads the hash tree of the source partition, once.
+  bool LoadSourceHashTree();
+  // Finds the blocks of the source of |operation| which don't match the hash
+  // tree of the source partition, corrects only those through the error
+  // corrected device and writes them back. Returns whether the source then
+  // matches the operation hash.
+  bool RecoverCorruptedSourceBlocks(const InstallOperation& operation);
+  // Opens |path| as the source partition, behind the cache and the read
+  // ahead if enabled. Returns whether it could be opened.
+  bool OpenSourceFd(const std::string& path);
+  // Goes back to reading the raw source partition and checking its hashes,
+  // after reading the dm-verity device failed.
+  void FallBackFromVerity();
   const size_t block_size_;
   const std::string source_path_;
+  const HashAlgorithm hash_algorithm_;
   FileDescriptorPtr source_ecc_fd_;
   FileDescriptorPtr source_fd_;
+  bool use_io_uring_{false};
+  bool use_direct_io_{false};
+  // Set by EnableVerityReads(), and whether |source_fd_| reads it.
+  std::string verity_path_;
+  bool verity_reads_{false};
+  // Set by EnableIndexedSource().
+  bool indexed_source_{false};
+  // In front of the raw source partition when EnableCache() was called.
+  std::shared_ptr<BlockCacheFileDescriptor> source_cache_;
+  size_t cache_size_{0};
+  std::vector<bool> reused_blocks_;
+  const google::protobuf::RepeatedPtrField<InstallOperation>*
+      prefetch_operations_{nullptr};
+  size_t prefetch_max_ops_{0};
+  uint64_t prefetch_max_bytes_{0};
+  std::unique_ptr<SourcePrefetcher> prefetcher_;
 
   friend class PartitionWriterTest;
   FRIEND_TEST(PartitionWriterTest, ChooseSourceFDTest);
@@ -58,6 +144,14 @@ class VerifiedSourceFd {
   // Used to avoid re-opening the same source partition if it is not actually
   // error corrected.
   bool source_ecc_open_failure_{false};
+
+  // The hash tree of the source partition, once loaded, and whether it
+  // couldn't be.
+  std::unique_ptr<SourceHashTree> source_hash_tree_;
+  bool source_hash_tree_load_failure_{false};
+  // The source blocks corrected by RecoverCorruptedSourceBlocks(), for the
+  // next operations reading them in case they couldn't be written back.
+  std::map<uint64_t, brillo::Blob> corrected_blocks_;
 };
 }  // namespace chromeos_update_engine
 
@@ -20,6 +20,7 @@
 
 #include <algorithm>
 #include <memory>
+#include <thread>
 #include <utility>
 
 #include <base/logging.h>
@@ -35,6 +36,25 @@ extern "C" {
 
 namespace chromeos_update_engine {
 
+namespace {
+// Computing the hash tree or FEC on more threads than this doesn't go any
+// faster, as it becomes limited by how fast the partition can be read.
+constexpr size_t kMaxVerityThreads = 4;
+
+// The number of rounds of the FEC data of the source partition checked before
+// updating it.
+constexpr size_t kSourceCheckRounds = 4;
+
+// The number of digests of the hash tree of the source partition checked
+// before updating it.
+constexpr size_t kSourceCheckBlocks = 16;
+
+size_t GetVerityThreads() {
+  return std::clamp<size_t>(
+      std::thread::hardware_concurrency(), 1, kMaxVerityThreads);
+}
+}  // namespace
+
 bool IncrementalEncodeFEC::Init(const uint64_t _data_offset,
                                 const uint64_t _data_size,
                                 const uint64_t _fec_offset,
@@ -51,19 +71,195 @@ bool IncrementalEncodeFEC::Init(const uint64_t _data_offset,
   block_size_ = _block_size;
   verify_mode_ = _verify_mode;
   current_round_ = 0;
+  source_fd_.reset();
+  changed_blocks_ = ExtentRanges();
+  changed_rounds_.clear();
+  check_rounds_.clear();
+  buffered_rounds_ = 0;
+  round_buffer_.clear();
+  buffered_blocks_.clear();
+  buffered_block_counts_.clear();
+  TEST_AND_RETURN_FALSE(data_size_ % block_size_ == 0);
+  TEST_AND_RETURN_FALSE(fec_roots_ >= 0 && fec_roots_ < FEC_RSM);
   // This is the N in RS(M, N), which is the number of bytes for each rs block.
   rs_n_ = FEC_RSM - fec_roots_;
-  rs_char_.reset(init_rs_char(FEC_PARAMS(fec_roots_)));
+  // Don't start any threads for partitions without FEC.
+  encoder_ = std::make_unique<FecEncoder>(
+      fec_roots_, block_size_, fec_size_ == 0 ? 1 : GetVerityThreads());
+  TEST_AND_RETURN_FALSE(encoder_->Init());
   rs_blocks_.resize(block_size_ * rs_n_);
-  buffer_.resize(block_size_, 0);
   fec_.resize(block_size_ * fec_roots_);
   fec_read_.resize(fec_.size());
-  TEST_AND_RETURN_FALSE(data_size_ % block_size_ == 0);
-  TEST_AND_RETURN_FALSE(fec_roots_ >= 0 && fec_roots_ < FEC_RSM);
 
   num_rounds_ = utils::DivRoundUp(data_size_ / block_size_, rs_n_);
   TEST_AND_RETURN_FALSE(num_rounds_ * fec_roots_ * block_size_ == fec_size_);
-  TEST_AND_RETURN_FALSE(rs_char_ != nullptr);
+  return true;
+}
+
+bool IncrementalEncodeFEC::InitFromSource(
+    FileDescriptorPtr source_fd, const std::vector<Extent>& changed_extents) {
+  TEST_AND_RETURN_FALSE(source_fd != nullptr && !verify_mode_);
+  TEST_AND_RETURN_FALSE(data_offset_ % block_size_ == 0);
+  const uint64_t data_start = data_offset_ / block_size_;
+  const uint64_t data_blocks = data_size_ / block_size_;
+  ExtentRanges changed;
+  for (const Extent& extent : changed_extents) {
+    const uint64_t start = std::max(extent.start_block(), data_start);
+    const uint64_t end = std::min(extent.start_block() + extent.num_blocks(),
+                                  data_start + data_blocks);
+    if (start < end)
+      changed.AddExtent(ExtentForRange(start - data_start, end - start));
+  }
+  // Updating a block reads it from both partitions, against reading every
+  // block once when encoding from scratch.
+  if (changed.blocks() * 2 >= data_blocks) {
+    LOG(INFO) << changed.blocks() << " of the " << data_blocks
+              << " blocks covered by FEC changed, encoding it from scratch";
+    return false;
+  }
+  // Round i holds the data blocks i + j * |num_rounds_|.
+  changed_rounds_.assign(num_rounds_, false);
+  for (const Extent& extent : changed.extent_set()) {
+    if (extent.num_blocks() >= num_rounds_) {
+      std::fill(changed_rounds_.begin(), changed_rounds_.end(), true);
+      break;
+    }
+    for (uint64_t block = extent.start_block();
+         block < extent.start_block() + extent.num_blocks();
+         block++) {
+      changed_rounds_[block % num_rounds_] = true;
+    }
+  }
+  const size_t num_checks = std::min(kSourceCheckRounds, num_rounds_);
+  check_rounds_.clear();
+  for (size_t i = 0; i < num_checks; i++)
+    check_rounds_.push_back(i * num_rounds_ / num_checks);
+  LOG(INFO) << "Updating the FEC data of the source partition, "
+            << std::count(changed_rounds_.begin(), changed_rounds_.end(), true)
+            << " of " << num_rounds_ << " rounds changed";
+  changed_blocks_ = std::move(changed);
+  source_fd_ = std::move(source_fd);
+  return true;
+}
+
+void IncrementalEncodeFEC::InitBuffer(size_t max_size) {
+  const size_t round_size = rs_n_ * block_size_;
+  if (from_source() || verify_mode_ || data_offset_ % block_size_ != 0 ||
+      round_size == 0) {
+    return;
+  }
+  buffered_rounds_ = std::min<size_t>(num_rounds_, max_size / round_size);
+  if (buffered_rounds_ == 0)
+    return;
+  round_buffer_.assign(buffered_rounds_ * round_size, 0);
+  buffered_blocks_.assign(buffered_rounds_ * rs_n_, false);
+  buffered_block_counts_.assign(buffered_rounds_, 0);
+  LOG(INFO) << "Buffering the data of " << buffered_rounds_ << " of the "
+            << num_rounds_ << " rounds of FEC";
+}
+
+void IncrementalEncodeFEC::BufferData(uint64_t offset,
+                                      const uint8_t* data,
+                                      size_t size) {
+  if (buffered_rounds_ == 0)
+    return;
+  // Only the whole blocks within the data covered by FEC.
+  const uint64_t end = std::min(offset + size, data_offset_ + data_size_);
+  uint64_t block_offset =
+      std::max(utils::RoundUp(offset, block_size_), data_offset_);
+  for (; block_offset + block_size_ <= end; block_offset += block_size_) {
+    // Round i holds the data blocks i + j * |num_rounds_|.
+    const uint64_t block = (block_offset - data_offset_) / block_size_;
+    const size_t round = block % num_rounds_;
+    if (round >= buffered_rounds_)
+      continue;
+    const size_t index = round * rs_n_ + block / num_rounds_;
+    if (!buffered_blocks_[index]) {
+      buffered_blocks_[index] = true;
+      buffered_block_counts_[round]++;
+    }
+    const uint8_t* src = data + (block_offset - offset);
+    std::copy(
+        src, src + block_size_, round_buffer_.data() + index * block_size_);
+  }
+}
+
+const uint8_t* IncrementalEncodeFEC::GetBufferedRound(size_t round) const {
+  if (round >= buffered_rounds_)
+    return nullptr;
+  // The blocks past the end of the data are 0.
+  const uint64_t data_blocks = data_size_ / block_size_;
+  const size_t num_blocks =
+      data_blocks > round ? utils::DivRoundUp(data_blocks - round, num_rounds_)
+                          : 0;
+  if (buffered_block_counts_[round] != num_blocks)
+    return nullptr;
+  return round_buffer_.data() + round * rs_n_ * block_size_;
+}
+
+bool IncrementalEncodeFEC::ReadRound(FileDescriptor* fd,
+                                     size_t round,
+                                     uint8_t* blocks) {
+  for (size_t j = 0; j < rs_n_; j++) {
+    uint64_t offset =
+        fec_ecc_interleave(round * rs_n_ * block_size_ + j, rs_n_, num_rounds_);
+    // Block j holds byte j of each rs block.
+    uint8_t* block = blocks + j * block_size_;
+    // Don't read past |data_size|, treat them as 0.
+    if (offset >= data_size_) {
+      std::fill(block, block + block_size_, 0);
+    } else {
+      ssize_t bytes_read = 0;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(
+          fd, block, block_size_, data_offset_ + offset, &bytes_read));
+      TEST_AND_RETURN_FALSE(bytes_read >= 0);
+      TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == block_size_);
+    }
+  }
+  return true;
+}
+
+bool IncrementalEncodeFEC::EncodeRoundFromSource() {
+  ssize_t bytes_read = 0;
+  if (!changed_rounds_[current_round_]) {
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        source_fd_, fec_.data(), fec_.size(), fec_offset_, &bytes_read));
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == fec_.size());
+    return true;
+  }
+  // Encodes the difference between the target and source blocks, the
+  // unchanged ones being 0.
+  std::fill(rs_blocks_.begin(), rs_blocks_.end(), 0);
+  brillo::Blob source_block(block_size_);
+  for (size_t j = 0; j < rs_n_; j++) {
+    uint64_t offset = fec_ecc_interleave(
+        current_round_ * rs_n_ * block_size_ + j, rs_n_, num_rounds_);
+    if (offset >= data_size_ ||
+        !changed_blocks_.ContainsBlock(offset / block_size_)) {
+      continue;
+    }
+    uint8_t* block = rs_blocks_.data() + j * block_size_;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        read_fd_, block, block_size_, data_offset_ + offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == block_size_);
+    TEST_AND_RETURN_FALSE(utils::PReadAll(source_fd_,
+                                          source_block.data(),
+                                          block_size_,
+                                          data_offset_ + offset,
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == block_size_);
+    for (size_t k = 0; k < block_size_; k++)
+      block[k] ^= source_block[k];
+  }
+  TEST_AND_RETURN_FALSE(encoder_->Encode(rs_blocks_.data(), fec_.data()));
+  TEST_AND_RETURN_FALSE(utils::PReadAll(source_fd_,
+                                        fec_read_.data(),
+                                        fec_read_.size(),
+                                        fec_offset_,
+                                        &bytes_read));
+  TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == fec_read_.size());
+  for (size_t k = 0; k < fec_.size(); k++)
+    fec_[k] ^= fec_read_[k];
   return true;
 }
 
@@ -74,37 +270,49 @@ bool IncrementalEncodeFEC::Compute(FileDescriptor* _read_fd,
     write_fd_ = _write_fd;
     cache_fd_.SetFD(write_fd_);
     write_fd_ = &cache_fd_;
-  } else if (current_step_ == EncodeFECStep::kEncodeRoundStep) {
-    // Encodes |block_size| number of rs blocks each round so that we can read
-    // one block each time instead of 1 byte to increase random read
-    // performance. This uses about 1 MiB memory for 4K block size.
-    for (size_t j = 0; j < rs_n_; j++) {
-      uint64_t offset = fec_ecc_interleave(
-          current_round_ * rs_n_ * block_size_ + j, rs_n_, num_rounds_);
-      // Don't read past |data_size|, treat them as 0.
-      if (offset >= data_size_) {
-        std::fill(buffer_.begin(), buffer_.end(), 0);
-      } else {
+  } else if (current_step_ == EncodeFECStep::kCheckSourceStep) {
+    // Checks one of the rounds of the source partition at a time.
+    if (source_fd_ && !check_rounds_.empty()) {
+      const size_t round = check_rounds_.back();
+      check_rounds_.pop_back();
+      // The source partition may be smaller, or hold FEC data laid out
+      // differently.
+      bool matches = ReadRound(source_fd_.get(), round, rs_blocks_.data());
+      if (matches) {
+        TEST_AND_RETURN_FALSE(
+            encoder_->Encode(rs_blocks_.data(), fec_.data()));
         ssize_t bytes_read = 0;
-        TEST_AND_RETURN_FALSE(utils::PReadAll(read_fd_,
-                                              buffer_.data(),
-                                              buffer_.size(),
-                                              data_offset_ + offset,
-                                              &bytes_read));
-        TEST_AND_RETURN_FALSE(bytes_read >= 0);
-        TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) ==
-                              buffer_.size());
+        matches = utils::PReadAll(source_fd_,
+                                  fec_read_.data(),
+                                  fec_read_.size(),
+                                  fec_offset_ + round * fec_.size(),
+                                  &bytes_read) &&
+                  static_cast<size_t>(bytes_read) == fec_read_.size() &&
+                  fec_ == fec_read_;
       }
-      for (size_t k = 0; k < buffer_.size(); k++) {
-        rs_blocks_[k * rs_n_ + j] = buffer_[k];
+      if (!matches) {
+        LOG(WARNING) << "The FEC data of the source partition doesn't match "
+                        "its data, encoding it from scratch";
+        source_fd_.reset();
+        check_rounds_.clear();
       }
     }
-    for (size_t j = 0; j < block_size_; j++) {
-      // Encode [j * rs_n_ : (j + 1) * rs_n_) in |rs_blocks| and write
-      // |fec_roots| number of parity bytes to |j * fec_roots| in |fec|.
-      encode_rs_char(rs_char_.get(),
-                     rs_blocks_.data() + j * rs_n_,
-                     fec_.data() + j * fec_roots_);
+  } else if (current_step_ == EncodeFECStep::kEncodeRoundStep) {
+    if (source_fd_) {
+      TEST_AND_RETURN_FALSE(EncodeRoundFromSource());
+    } else {
+      // Encodes |block_size| number of rs blocks each round so that we can
+      // read one block each time instead of 1 byte to increase random read
+      // performance. This uses about 1 MiB memory for 4K block size.
+      const uint8_t* blocks = GetBufferedRound(current_round_);
+      if (blocks == nullptr) {
+        TEST_AND_RETURN_FALSE(
+            ReadRound(read_fd_, current_round_, rs_blocks_.data()));
+        blocks = rs_blocks_.data();
+      }
+      // Write |fec_roots| number of parity bytes of rs block j to
+      // |j * fec_roots| in |fec|.
+      TEST_AND_RETURN_FALSE(encoder_->Encode(blocks, fec_.data()));
     }
 
     if (verify_mode_) {
@@ -128,6 +336,13 @@ bool IncrementalEncodeFEC::Compute(FileDescriptor* _read_fd,
     }
     fec_offset_ += fec_.size();
     current_round_++;
+    if (current_round_ == buffered_rounds_) {
+      // Done with the buffered rounds.
+      buffered_rounds_ = 0;
+      brillo::Blob().swap(round_buffer_);
+      buffered_blocks_.clear();
+      buffered_block_counts_.clear();
+    }
   } else if (current_step_ == EncodeFECStep::kWriteStep) {
     write_fd_->Flush();
   }
@@ -137,6 +352,9 @@ bool IncrementalEncodeFEC::Compute(FileDescriptor* _read_fd,
 // update the current state of EncodeFEC. Can be changed to have smaller steps
 void IncrementalEncodeFEC::UpdateState() {
   if (current_step_ == EncodeFECStep::kInitFDStep) {
+    current_step_ = EncodeFECStep::kCheckSourceStep;
+  } else if (current_step_ == EncodeFECStep::kCheckSourceStep &&
+             check_rounds_.empty()) {
     current_step_ = EncodeFECStep::kEncodeRoundStep;
   } else if (current_step_ == EncodeFECStep::kEncodeRoundStep &&
              current_round_ == num_rounds_) {
@@ -173,7 +391,24 @@ bool VerityWriterAndroid::Init(const InstallPlan::Partition& partition) {
                                         partition_->fec_roots,
                                         partition_->block_size,
                                         false /* verify_mode */));
+  if (partition_->update_fec_from_source && partition_->fec_size != 0 &&
+      !partition_->source_path.empty()) {
+    auto source_fd = std::make_shared<EintrSafeFileDescriptor>();
+    if (source_fd->Open(partition_->source_path.c_str(), O_RDONLY)) {
+      encodeFEC_.InitFromSource(std::move(source_fd),
+                                partition_->changed_extents);
+    } else {
+      PLOG(WARNING) << "Failed to open " << partition_->source_path
+                    << ", encoding the FEC data from scratch";
+    }
+  }
+  if (partition_->fec_size != 0 && partition_->fec_buffer_size > 0) {
+    encodeFEC_.InitBuffer(partition_->fec_buffer_size);
+  }
   hash_tree_written_ = false;
+  hash_tree_root_digest_.clear();
+  inline_hash_tree_ = false;
+  hash_tree_builder_.reset();
   if (partition_->hash_tree_size != 0) {
     auto hash_function =
         HashTreeBuilder::HashFunction(partition_->hash_tree_algorithm);
@@ -182,8 +417,10 @@ bool VerityWriterAndroid::Init(const InstallPlan::Partition& partition) {
                  << partition_->hash_tree_algorithm;
       return false;
     }
-    hash_tree_builder_ = std::make_unique<HashTreeBuilder>(
-        partition_->block_size, hash_function);
+    hash_tree_builder_ = std::make_unique<ParallelHashTreeBuilder>(
+        partition_->block_size,
+        hash_function,
+        GetVerityThreads());
     TEST_AND_RETURN_FALSE(hash_tree_builder_->Initialize(
         partition_->hash_tree_data_size, partition_->hash_tree_salt));
     if (hash_tree_builder_->CalculateSize(partition_->hash_tree_data_size) !=
@@ -194,15 +431,133 @@ bool VerityWriterAndroid::Init(const InstallPlan::Partition& partition) {
                         partition_->hash_tree_data_size);
       return false;
     }
+    if (partition_->inline_hash_tree_builder &&
+        partition_->hash_tree_data_offset % partition_->block_size == 0) {
+      LOG(INFO) << "Using the hash tree built while writing "
+                << partition_->name;
+      hash_tree_builder_ = partition_->inline_hash_tree_builder;
+      inline_hash_tree_ = true;
+    }
+  }
+  hash_tree_from_source_ = false;
+  hash_tree_changed_blocks_ = ExtentRanges();
+  if (hash_tree_builder_ && !inline_hash_tree_ &&
+      partition_->update_hash_tree_from_source &&
+      !partition_->source_path.empty() && !InitHashTreeFromSource()) {
+    LOG(INFO) << "Computing the hash tree from scratch";
+    TEST_AND_RETURN_FALSE(hash_tree_builder_->Initialize(
+        partition_->hash_tree_data_size, partition_->hash_tree_salt));
   }
   total_offset_ = 0;
   return true;
 }
 
+bool VerityWriterAndroid::InitHashTreeFromSource() {
+  const uint64_t block_size = partition_->block_size;
+  TEST_AND_RETURN_FALSE(partition_->hash_tree_data_offset % block_size == 0);
+  const uint64_t data_start = partition_->hash_tree_data_offset / block_size;
+  const uint64_t data_blocks = partition_->hash_tree_data_size / block_size;
+  ExtentRanges changed;
+  for (const Extent& extent : partition_->changed_extents) {
+    const uint64_t start = std::max(extent.start_block(), data_start);
+    const uint64_t end = std::min(extent.start_block() + extent.num_blocks(),
+                                  data_start + data_blocks);
+    if (start < end)
+      changed.AddExtent(ExtentForRange(start - data_start, end - start));
+  }
+  if (changed.blocks() == data_blocks)
+    return false;
+
+  EintrSafeFileDescriptor source_fd;
+  if (!source_fd.Open(partition_->source_path.c_str(), O_RDONLY)) {
+    PLOG(WARNING) << "Failed to open " << partition_->source_path;
+    return false;
+  }
+  // The source partition must have the hash tree of its data at the same
+  // place, with the same salt.
+  brillo::Blob tree(partition_->hash_tree_size);
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(&source_fd,
+                       tree.data(),
+                       tree.size(),
+                       partition_->hash_tree_offset,
+                       &bytes_read) ||
+      static_cast<size_t>(bytes_read) != tree.size() ||
+      !hash_tree_builder_->InitializeFromTree(tree)) {
+    return false;
+  }
+  brillo::Blob block(block_size);
+  for (size_t i = 0; i < kSourceCheckBlocks; i++) {
+    const uint64_t data_block = i * data_blocks / kSourceCheckBlocks;
+    if (changed.ContainsBlock(data_block))
+      continue;
+    if (!utils::PReadAll(&source_fd,
+                         block.data(),
+                         block.size(),
+                         (data_start + data_block) * block_size,
+                         &bytes_read) ||
+        static_cast<size_t>(bytes_read) != block.size() ||
+        !hash_tree_builder_->CheckBlock(data_block, block.data())) {
+      LOG(WARNING) << "The hash tree of the source partition doesn't match "
+                      "its data";
+      return false;
+    }
+  }
+  LOG(INFO) << "Updating the hash tree of the source partition, "
+            << changed.blocks() << " of " << data_blocks
+            << " blocks changed";
+  hash_tree_from_source_ = true;
+  hash_tree_changed_blocks_ = std::move(changed);
+  return true;
+}
+
+bool VerityWriterAndroid::UpdateHashTree(uint64_t offset,
+                                         const uint8_t* buffer,
+                                         size_t size) {
+  const uint64_t block_size = partition_->block_size;
+  const uint64_t data_offset = offset - partition_->hash_tree_data_offset;
+  if (inline_hash_tree_) {
+    TEST_AND_RETURN_FALSE(data_offset % block_size == 0 &&
+                          size % block_size == 0);
+    return hash_tree_builder_->UpdateBlocksAt(
+        data_offset / block_size, buffer, size / block_size);
+  }
+  // Updates from the source partition only as long as the data comes in
+  // whole blocks.
+  if (hash_tree_from_source_ &&
+      (data_offset % block_size != 0 || size % block_size != 0)) {
+    LOG(WARNING) << "Data not aligned to blocks, hashing the rest of it";
+    hash_tree_from_source_ = false;
+  }
+  if (!hash_tree_from_source_)
+    return hash_tree_builder_->Update(buffer, size);
+  // One run of blocks which changed or didn't at a time.
+  const uint64_t first_block = data_offset / block_size;
+  const uint64_t num_blocks = size / block_size;
+  for (uint64_t start = 0; start < num_blocks;) {
+    const bool changed =
+        hash_tree_changed_blocks_.ContainsBlock(first_block + start);
+    uint64_t end = start + 1;
+    while (end < num_blocks &&
+           hash_tree_changed_blocks_.ContainsBlock(first_block + end) ==
+               changed) {
+      end++;
+    }
+    if (changed) {
+      TEST_AND_RETURN_FALSE(hash_tree_builder_->Update(
+          buffer + start * block_size, (end - start) * block_size));
+    } else {
+      TEST_AND_RETURN_FALSE(hash_tree_builder_->SkipBlocks(end - start));
+    }
+    start = end;
+  }
+  return true;
+}
+
 bool VerityWriterAndroid::Update(const uint64_t offset,
                                  const uint8_t* buffer,
                                  size_t size) {
-  if (offset != total_offset_) {
+  if (offset != total_offset_ && !inline_hash_tree_) {
     LOG(ERROR) << "Sequential read expected, expected to read at: "
                << total_offset_ << " actual read occurs at: " << offset;
     return false;
@@ -221,8 +576,9 @@ bool VerityWriterAndroid::Update(const uint64_t offset,
     }
     const uint64_t end_offset = std::min(offset + size, hash_tree_data_end);
     if (start_offset < end_offset) {
-      TEST_AND_RETURN_FALSE(hash_tree_builder_->Update(
-          buffer + start_offset - offset, end_offset - start_offset));
+      TEST_AND_RETURN_FALSE(UpdateHashTree(start_offset,
+                                           buffer + start_offset - offset,
+                                           end_offset - start_offset));
 
       if (end_offset == hash_tree_data_end) {
         LOG(INFO)
@@ -230,6 +586,9 @@ bool VerityWriterAndroid::Update(const uint64_t offset,
       }
     }
   }
+  if (partition_->fec_size != 0) {
+    encodeFEC_.BufferData(offset, buffer, size);
+  }
   total_offset_ += size;
 
   return true;
@@ -238,7 +597,7 @@ bool VerityWriterAndroid::Finalize(FileDescriptor* read_fd,
                                    FileDescriptor* write_fd) {
   const auto hash_tree_data_end =
       partition_->hash_tree_data_offset + partition_->hash_tree_data_size;
-  if (total_offset_ < hash_tree_data_end) {
+  if (total_offset_ < hash_tree_data_end && !inline_hash_tree_) {
     LOG(ERROR) << "Read up to " << total_offset_
                << " when we are expecting to read everything "
                   "before "
@@ -281,7 +640,8 @@ bool VerityWriterAndroid::IncrementalFinalize(FileDescriptor* read_fd,
     LOG(INFO) << "Completing prework in Finalize";
     const auto hash_tree_data_end =
         partition_->hash_tree_data_offset + partition_->hash_tree_data_size;
-    if (total_offset_ < hash_tree_data_end) {
+    // The inline hash tree checks that it got all the blocks when built.
+    if (total_offset_ < hash_tree_data_end && !inline_hash_tree_) {
       LOG(ERROR) << "Read up to " << total_offset_
                  << " when we are expecting to read everything "
                     "before "
@@ -295,12 +655,22 @@ bool VerityWriterAndroid::IncrementalFinalize(FileDescriptor* read_fd,
       TEST_AND_RETURN_FALSE(hash_tree_builder_->BuildHashTree());
       TEST_AND_RETURN_FALSE_ERRNO(
           write_fd->Seek(partition_->hash_tree_offset, SEEK_SET));
-      auto success =
-          hash_tree_builder_->WriteHashTree([write_fd](auto data, auto size) {
+      // The hash tree is usually covered by FEC too.
+      uint64_t tree_offset = partition_->hash_tree_offset;
+      auto success = hash_tree_builder_->WriteHashTree(
+          [this, write_fd, &tree_offset](auto data, auto size) {
+            encodeFEC_.BufferData(
+                tree_offset, static_cast<const uint8_t*>(data), size);
+            tree_offset += size;
             return utils::WriteAll(write_fd, data, size);
           });
       // hashtree builder already prints error messages.
       TEST_AND_RETURN_FALSE(success);
+      // Digests kept from the source tree weren't computed from the data.
+      if (!hash_tree_from_source_ &&
+          !hash_tree_builder_->GetRootDigest(&hash_tree_root_digest_)) {
+        hash_tree_root_digest_.clear();
+      }
       hash_tree_builder_.reset();
     }
     hash_tree_written_ = true;
@@ -321,6 +691,27 @@ bool VerityWriterAndroid::FECFinished() const {
   return false;
 }
 
+bool VerityWriterAndroid::GetMissingExtents(
+    std::vector<Extent>* extents) const {
+  if (!inline_hash_tree_ || !hash_tree_builder_)
+    return false;
+  const uint64_t data_start =
+      partition_->hash_tree_data_offset / partition_->block_size;
+  extents->clear();
+  for (const Extent& extent : hash_tree_builder_->GetMissingBlocks()) {
+    extents->push_back(ExtentForRange(data_start + extent.start_block(),
+                                      extent.num_blocks()));
+  }
+  return true;
+}
+
+bool VerityWriterAndroid::GetHashTreeRootDigest(brillo::Blob* digest) const {
+  if (!hash_tree_written_ || hash_tree_root_digest_.empty())
+    return false;
+  *digest = hash_tree_root_digest_;
+  return true;
+}
+
 double VerityWriterAndroid::GetProgress() {
   return encodeFEC_.ReportProgress();
 }
@@ -342,9 +733,8 @@ bool VerityWriterAndroid::EncodeFEC(FileDescriptor* read_fd,
   uint64_t rounds = utils::DivRoundUp(data_size / block_size, rs_n);
   TEST_AND_RETURN_FALSE(rounds * fec_roots * block_size == fec_size);
 
-  std::unique_ptr<void, decltype(&free_rs_char)> rs_char(
-      init_rs_char(FEC_PARAMS(fec_roots)), &free_rs_char);
-  TEST_AND_RETURN_FALSE(rs_char != nullptr);
+  FecEncoder encoder(fec_roots, block_size, GetVerityThreads());
+  TEST_AND_RETURN_FALSE(encoder.Init());
   // Cache at most 1MB of fec data, in VABC, we need to re-open fd if we
   // perform a read() operation after write(). So reduce the number of writes
   // can save unnecessary re-opens.
@@ -355,34 +745,27 @@ bool VerityWriterAndroid::EncodeFEC(FileDescriptor* read_fd,
     // Encodes |block_size| number of rs blocks each round so that we can read
     // one block each time instead of 1 byte to increase random read
     // performance. This uses about 1 MiB memory for 4K block size.
+    // Block j holds byte j of each rs block.
     brillo::Blob rs_blocks(block_size * rs_n);
     for (size_t j = 0; j < rs_n; j++) {
-      brillo::Blob buffer(block_size, 0);
       uint64_t offset =
           fec_ecc_interleave(i * rs_n * block_size + j, rs_n, rounds);
       // Don't read past |data_size|, treat them as 0.
       if (offset < data_size) {
         ssize_t bytes_read = 0;
         TEST_AND_RETURN_FALSE(utils::PReadAll(read_fd,
-                                              buffer.data(),
-                                              buffer.size(),
+                                              rs_blocks.data() + j * block_size,
+                                              block_size,
                                               data_offset + offset,
                                               &bytes_read));
         TEST_AND_RETURN_FALSE(bytes_read >= 0);
-        TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == buffer.size());
-      }
-      for (size_t k = 0; k < buffer.size(); k++) {
-        rs_blocks[k * rs_n + j] = buffer[k];
+        TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == block_size);
       }
     }
+    // Write |fec_roots| number of parity bytes of rs block j to
+    // |j * fec_roots| in |fec|.
     brillo::Blob fec(block_size * fec_roots);
-    for (size_t j = 0; j < block_size; j++) {
-      // Encode [j * rs_n : (j + 1) * rs_n) in |rs_blocks| and write
-      // |fec_roots| number of parity bytes to |j * fec_roots| in |fec|.
-      encode_rs_char(rs_char.get(),
-                     rs_blocks.data() + j * rs_n,
-                     fec.data() + j * fec_roots);
-    }
+    TEST_AND_RETURN_FALSE(encoder.Encode(rs_blocks.data(), fec.data()));
 
     if (verify_mode) {
       brillo::Blob fec_read(fec.size());
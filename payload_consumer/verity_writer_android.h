@@ -19,6 +19,7 @@
 
 #include <memory>
 #include <string>
+#include <vector>
 
 #include <verity/hash_tree_builder.h>
 #include <base/logging.h>
@@ -30,19 +31,22 @@ extern "C" {
 
 #include "payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/cached_file_descriptor.h"
+#include "update_engine/payload_consumer/fec_encoder.h"
+#include "update_engine/payload_consumer/parallel_hash_tree_builder.h"
 #include "update_engine/payload_consumer/verity_writer_interface.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 
 namespace chromeos_update_engine {
 enum class EncodeFECStep {
   kInitFDStep,
+  kCheckSourceStep,
   kEncodeRoundStep,
   kWriteStep,
   kComplete
 };
 class IncrementalEncodeFEC {
  public:
-  IncrementalEncodeFEC()
-      : rs_char_(nullptr, &free_rs_char), cache_fd_(nullptr, 1 * (1 << 20)) {}
+  IncrementalEncodeFEC() : cache_fd_(nullptr, 1 * (1 << 20)) {}
   // Initialize all member variables needed to performe FEC Computation
   bool Init(const uint64_t _data_offset,
             const uint64_t _data_size,
@@ -51,6 +55,27 @@ class IncrementalEncodeFEC {
             const uint64_t _fec_roots,
             const uint64_t _block_size,
             const bool _verify_mode);
+  // Updates the FEC data of |source_fd| instead of encoding it from scratch,
+  // once the parity of a few rounds of |source_fd| was checked to match its
+  // data. Reed-Solomon codes being linear, the parity of a round only changes
+  // by the parity of the difference between the target and source data. Only
+  // the rounds covering |changed_extents|, the blocks of the target partition
+  // which may differ from the source one, are encoded then, reading their
+  // changed blocks only; the parity of the others is copied. Returns false,
+  // encoding from scratch, if the changed blocks are too many for it to be
+  // worth it.
+  bool InitFromSource(FileDescriptorPtr source_fd,
+                      const std::vector<Extent>& changed_extents);
+  // Whether the FEC data is updated from the source partition.
+  bool from_source() const { return source_fd_ != nullptr; }
+  // Holds the data blocks of as many of the first rounds as fit in
+  // |max_size| bytes as they are passed to BufferData(), so that those rounds
+  // are encoded without reading their blocks again. The other rounds, and
+  // those with blocks which weren't passed, are read as usual.
+  void InitBuffer(size_t max_size);
+  // Passes the |size| bytes at |data| starting at |offset| in the partition,
+  // keeping the whole blocks of the buffered rounds.
+  void BufferData(uint64_t offset, const uint8_t* data, size_t size);
   bool Compute(FileDescriptor* _read_fd, FileDescriptor* _write_fd);
   void UpdateState();
   bool Finished() const;
@@ -58,8 +83,15 @@ class IncrementalEncodeFEC {
   double ReportProgress() const;
 
  private:
+  // Reads the rs_n_ data blocks of round |round| from |fd| to |blocks|.
+  bool ReadRound(FileDescriptor* fd, size_t round, uint8_t* blocks);
+  // Encodes the parity of |current_round_| to |fec_| from the one of the
+  // source partition.
+  bool EncodeRoundFromSource();
+  // Returns the data blocks of |round| if they were all buffered, or nullptr.
+  const uint8_t* GetBufferedRound(size_t round) const;
+
   brillo::Blob rs_blocks_;
-  brillo::Blob buffer_;
   brillo::Blob fec_;
   brillo::Blob fec_read_;
   EncodeFECStep current_step_;
@@ -75,8 +107,25 @@ class IncrementalEncodeFEC {
   uint64_t block_size_;
   size_t rs_n_;
   bool verify_mode_;
-  std::unique_ptr<void, decltype(&free_rs_char)> rs_char_;
+  std::unique_ptr<FecEncoder> encoder_;
   UnownedCachedFileDescriptor cache_fd_;
+
+  // Set when updating the FEC data from the source partition.
+  FileDescriptorPtr source_fd_;
+  // The data blocks, relative to |data_offset_|, which may have changed from
+  // the source partition, and the rounds of FEC covering them.
+  ExtentRanges changed_blocks_;
+  std::vector<bool> changed_rounds_;
+  // The rounds of |source_fd_| left to check before updating its FEC data.
+  std::vector<size_t> check_rounds_;
+
+  // The data blocks of the first |buffered_rounds_| rounds, laid out like
+  // |rs_blocks_| one round after the other, which of them were passed to
+  // BufferData() and how many per round.
+  size_t buffered_rounds_{0};
+  brillo::Blob round_buffer_;
+  std::vector<bool> buffered_blocks_;
+  std::vector<size_t> buffered_block_counts_;
 };
 
 class VerityWriterAndroid : public VerityWriterInterface {
@@ -91,6 +140,8 @@ class VerityWriterAndroid : public VerityWriterInterface {
                            FileDescriptor* write_fd) override;
   double GetProgress() override;
   bool FECFinished() const override;
+  bool GetHashTreeRootDigest(brillo::Blob* digest) const override;
+  bool GetMissingExtents(std::vector<Extent>* extents) const override;
   // Read [data_offset : data_offset + data_size) from |path| and encode FEC
   // data, if |verify_mode|, then compare the encoded FEC with the one in
   // |path|, otherwise write the encoded FEC to |path|. We can't encode as we go
@@ -116,12 +167,33 @@ class VerityWriterAndroid : public VerityWriterInterface {
                         bool verify_mode);
 
  private:
+  // Starts the hash tree from the one of the source partition, once a few of
+  // its digests were checked to match the data of the source partition, for
+  // Update() to only hash the blocks which may have changed. Returns false,
+  // hashing every block, if it didn't.
+  bool InitHashTreeFromSource();
+
+  // Passes the data at |buffer| of |size| bytes starting at |offset| in the
+  // partition to the hash tree builder, hashing only the changed blocks when
+  // the hash tree is updated from the source partition.
+  bool UpdateHashTree(uint64_t offset, const uint8_t* buffer, size_t size);
+
   // stores the state of EncodeFEC
   IncrementalEncodeFEC encodeFEC_;
   bool hash_tree_written_ = false;
   const InstallPlan::Partition* partition_ = nullptr;
 
-  std::unique_ptr<HashTreeBuilder> hash_tree_builder_;
+  // Shared with the partition when it is its inline hash tree.
+  std::shared_ptr<ParallelHashTreeBuilder> hash_tree_builder_;
+  // Set when |hash_tree_builder_| is the inline hash tree of the partition,
+  // for Update() to pass it the blocks not written, in any order.
+  bool inline_hash_tree_ = false;
+  // Set when updating the hash tree from the source partition, along with the
+  // data blocks, relative to |hash_tree_data_offset|, which may have changed.
+  bool hash_tree_from_source_ = false;
+  ExtentRanges hash_tree_changed_blocks_;
+  // The root digest of the hash tree written, when built from all the data.
+  brillo::Blob hash_tree_root_digest_;
   uint64_t total_offset_ = 0;
   DISALLOW_COPY_AND_ASSIGN(VerityWriterAndroid);
 };
@@ -18,12 +18,19 @@
 
 #include <fcntl.h>
 
+#include <algorithm>
+#include <memory>
+#include <vector>
+
 #include <brillo/secure_blob.h>
 #include <gtest/gtest.h>
 
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_consumer/parallel_hash_tree_builder.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
 
 namespace chromeos_update_engine {
 
@@ -42,6 +49,188 @@ class VerityWriterAndroidTest : public ::testing::Test {
     partition_fd_->Open(partition_.target_path.c_str(), O_RDWR);
   }
 
+  // Updates the FEC data of a partition from its source partition, where
+  // two data blocks changed, and checks that it matches the one encoded from
+  // scratch.
+  void TestFECFromSource(bool valid_source_fec) {
+    constexpr size_t kDataBlocks = 600;
+    constexpr size_t kBlockSize = 4096;
+    partition_.hash_tree_size = 0;
+    partition_.hash_tree_data_size = 0;
+    partition_.hash_tree_offset = 0;
+    partition_.fec_data_offset = 0;
+    partition_.fec_data_size = kDataBlocks * kBlockSize;
+    partition_.fec_offset = partition_.fec_data_size;
+    // 3 rounds of 253 blocks.
+    partition_.fec_size = 3 * 2 * kBlockSize;
+
+    ScopedTempFile source_file("source.XXXXXX");
+    brillo::Blob source_data(partition_.fec_offset + partition_.fec_size);
+    test_utils::FillWithData(&source_data);
+    ASSERT_TRUE(test_utils::WriteFileVector(source_file.path(), source_data));
+    if (valid_source_fec) {
+      ASSERT_TRUE(VerityWriterAndroid::EncodeFEC(source_file.path(),
+                                                 partition_.fec_data_offset,
+                                                 partition_.fec_data_size,
+                                                 partition_.fec_offset,
+                                                 partition_.fec_size,
+                                                 partition_.fec_roots,
+                                                 kBlockSize,
+                                                 false /* verify_mode */));
+    }
+    ASSERT_TRUE(utils::ReadFile(source_file.path(), &source_data));
+
+    brillo::Blob part_data = source_data;
+    std::fill_n(part_data.begin() + 5 * kBlockSize, kBlockSize, 0x55);
+    std::fill_n(part_data.begin() + 400 * kBlockSize + 7, 100, 0xaa);
+    // The FEC data of the target partition is left over from another build.
+    std::fill(part_data.begin() + partition_.fec_offset, part_data.end(), 0xff);
+    ASSERT_TRUE(test_utils::WriteFileVector(partition_.target_path, part_data));
+
+    ScopedTempFile expected_file("expected.XXXXXX");
+    ASSERT_TRUE(test_utils::WriteFileVector(expected_file.path(), part_data));
+    ASSERT_TRUE(VerityWriterAndroid::EncodeFEC(expected_file.path(),
+                                               partition_.fec_data_offset,
+                                               partition_.fec_data_size,
+                                               partition_.fec_offset,
+                                               partition_.fec_size,
+                                               partition_.fec_roots,
+                                               kBlockSize,
+                                               false /* verify_mode */));
+
+    partition_.source_path = source_file.path();
+    partition_.update_fec_from_source = true;
+    partition_.changed_extents = {ExtentForRange(5, 1),
+                                  ExtentForRange(400, 1)};
+    ASSERT_TRUE(verity_writer_.Init(partition_));
+    while (!verity_writer_.FECFinished()) {
+      ASSERT_TRUE(verity_writer_.IncrementalFinalize(partition_fd_.get(),
+                                                     partition_fd_.get()));
+    }
+    brillo::Blob actual_part, expected_part;
+    ASSERT_TRUE(utils::ReadFile(partition_.target_path, &actual_part));
+    ASSERT_TRUE(utils::ReadFile(expected_file.path(), &expected_part));
+    ASSERT_EQ(expected_part, actual_part);
+  }
+
+  // Writes the hash tree and the FEC data of a partition, passing the data to
+  // Update() |update_size| bytes at a time with room to buffer two of the
+  // three rounds of FEC, and checks that they match the ones written without
+  // buffering.
+  void TestFECBuffer(size_t update_size) {
+    constexpr size_t kDataBlocks = 600;
+    constexpr size_t kBlockSize = 4096;
+    partition_.hash_tree_algorithm = "sha256";
+    partition_.hash_tree_data_size = kDataBlocks * kBlockSize;
+    partition_.hash_tree_offset = partition_.hash_tree_data_size;
+    partition_.hash_tree_size = HashTreeBuilder::CalculateSize(
+        partition_.hash_tree_data_size, kBlockSize, 32);
+    partition_.fec_data_offset = 0;
+    partition_.fec_data_size =
+        partition_.hash_tree_offset + partition_.hash_tree_size;
+    partition_.fec_offset = partition_.fec_data_size;
+    // 3 rounds of 253 blocks.
+    partition_.fec_size = 3 * 2 * kBlockSize;
+    partition_.fec_buffer_size = 2 * 253 * kBlockSize;
+
+    brillo::Blob part_data(partition_.fec_offset + partition_.fec_size);
+    test_utils::FillWithData(&part_data);
+    ASSERT_TRUE(test_utils::WriteFileVector(partition_.target_path, part_data));
+
+    ScopedTempFile expected_file("expected.XXXXXX");
+    ASSERT_TRUE(test_utils::WriteFileVector(expected_file.path(), part_data));
+    {
+      InstallPlan::Partition expected_partition = partition_;
+      expected_partition.fec_buffer_size = 0;
+      VerityWriterAndroid expected_writer;
+      ASSERT_TRUE(expected_writer.Init(expected_partition));
+      ASSERT_NO_FATAL_FAILURE(
+          WriteHashTree(expected_file.path(), &expected_writer));
+    }
+
+    ASSERT_TRUE(verity_writer_.Init(partition_));
+    for (size_t offset = 0; offset < partition_.hash_tree_offset;
+         offset += update_size) {
+      const size_t size =
+          std::min(update_size, partition_.hash_tree_offset - offset);
+      ASSERT_TRUE(
+          verity_writer_.Update(offset, part_data.data() + offset, size));
+    }
+    while (!verity_writer_.FECFinished()) {
+      ASSERT_TRUE(verity_writer_.IncrementalFinalize(partition_fd_.get(),
+                                                     partition_fd_.get()));
+    }
+    brillo::Blob actual_part, expected_part;
+    ASSERT_TRUE(utils::ReadFile(partition_.target_path, &actual_part));
+    ASSERT_TRUE(utils::ReadFile(expected_file.path(), &expected_part));
+    ASSERT_EQ(expected_part, actual_part);
+  }
+
+  // Writes the hash tree of the partition at |path| with |writer|.
+  void WriteHashTree(const std::string& path, VerityWriterAndroid* writer) {
+    brillo::Blob data;
+    ASSERT_TRUE(utils::ReadFile(path, &data));
+    EintrSafeFileDescriptor fd;
+    ASSERT_TRUE(fd.Open(path.c_str(), O_RDWR));
+    ASSERT_TRUE(writer->Update(0, data.data(), partition_.hash_tree_offset));
+    ASSERT_TRUE(writer->Finalize(&fd, &fd));
+  }
+
+  // Updates the hash tree of a partition from its source partition, where a
+  // data block changed, and checks that it matches the one built from
+  // scratch.
+  void TestHashTreeFromSource(bool valid_source_tree) {
+    constexpr size_t kBlockSize = 4096;
+    partition_.hash_tree_algorithm = "sha256";
+    partition_.hash_tree_data_size = 300 * kBlockSize;
+    partition_.hash_tree_offset = partition_.hash_tree_data_size;
+    // 3 blocks of digests, and the root block.
+    partition_.hash_tree_size = 4 * kBlockSize;
+
+    ScopedTempFile source_file("source.XXXXXX");
+    brillo::Blob source_data(partition_.hash_tree_offset +
+                             partition_.hash_tree_size);
+    test_utils::FillWithData(&source_data);
+    ASSERT_TRUE(test_utils::WriteFileVector(source_file.path(), source_data));
+    {
+      InstallPlan::Partition source_partition = partition_;
+      if (!valid_source_tree)
+        source_partition.hash_tree_salt = {0x12, 0x34};
+      VerityWriterAndroid source_writer;
+      ASSERT_TRUE(source_writer.Init(source_partition));
+      ASSERT_NO_FATAL_FAILURE(
+          WriteHashTree(source_file.path(), &source_writer));
+    }
+    ASSERT_TRUE(utils::ReadFile(source_file.path(), &source_data));
+
+    brillo::Blob part_data = source_data;
+    std::fill_n(part_data.begin() + 10 * kBlockSize, kBlockSize, 0x55);
+    // The hash tree of the target partition is left over from another build.
+    std::fill(
+        part_data.begin() + partition_.hash_tree_offset, part_data.end(), 0xff);
+    ASSERT_TRUE(test_utils::WriteFileVector(partition_.target_path, part_data));
+
+    ScopedTempFile expected_file("expected.XXXXXX");
+    ASSERT_TRUE(test_utils::WriteFileVector(expected_file.path(), part_data));
+    {
+      VerityWriterAndroid expected_writer;
+      ASSERT_TRUE(expected_writer.Init(partition_));
+      ASSERT_NO_FATAL_FAILURE(
+          WriteHashTree(expected_file.path(), &expected_writer));
+    }
+
+    partition_.source_path = source_file.path();
+    partition_.update_hash_tree_from_source = true;
+    partition_.changed_extents = {ExtentForRange(10, 1)};
+    ASSERT_TRUE(verity_writer_.Init(partition_));
+    ASSERT_NO_FATAL_FAILURE(WriteHashTree(partition_.target_path,
+                                          &verity_writer_));
+    brillo::Blob actual_part, expected_part;
+    ASSERT_TRUE(utils::ReadFile(partition_.target_path, &actual_part));
+    ASSERT_TRUE(utils::ReadFile(expected_file.path(), &expected_part));
+    ASSERT_EQ(expected_part, actual_part);
+  }
+
   VerityWriterAndroid verity_writer_;
   InstallPlan::Partition partition_;
   FileDescriptorPtr partition_fd_;
@@ -183,4 +372,76 @@ TEST_F(VerityWriterAndroidTest, HashTreeDisabled) {
       verity_writer_.Finalize(partition_fd_.get(), partition_fd_.get()));
 }
 
+TEST_F(VerityWriterAndroidTest, FECFromSourceTest) {
+  TestFECFromSource(true);
+}
+
+TEST_F(VerityWriterAndroidTest, FECFromInvalidSourceTest) {
+  // The source FEC data doesn't match, so it is encoded from scratch.
+  TestFECFromSource(false);
+}
+
+TEST_F(VerityWriterAndroidTest, FECBufferTest) {
+  TestFECBuffer(64 * 1024);
+}
+
+TEST_F(VerityWriterAndroidTest, FECBufferUnalignedUpdatesTest) {
+  // The blocks split across updates are read from the partition.
+  TestFECBuffer(10000);
+}
+
+TEST_F(VerityWriterAndroidTest, HashTreeFromSourceTest) {
+  TestHashTreeFromSource(true);
+}
+
+TEST_F(VerityWriterAndroidTest, HashTreeFromInvalidSourceTest) {
+  // The source hash tree was built with another salt, so it is built from
+  // scratch.
+  TestHashTreeFromSource(false);
+}
+
+TEST_F(VerityWriterAndroidTest, InlineHashTreeTest) {
+  constexpr size_t kBlockSize = 4096;
+  partition_.hash_tree_algorithm = "sha256";
+  partition_.hash_tree_data_size = 300 * kBlockSize;
+  partition_.hash_tree_offset = partition_.hash_tree_data_size;
+  partition_.hash_tree_size = 4 * kBlockSize;
+  brillo::Blob part_data(partition_.hash_tree_offset +
+                         partition_.hash_tree_size);
+  test_utils::FillWithData(&part_data);
+  std::fill_n(part_data.begin() + 250 * kBlockSize, 50 * kBlockSize, 0);
+  ASSERT_TRUE(test_utils::WriteFileVector(partition_.target_path, part_data));
+
+  ScopedTempFile expected_file("expected.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(expected_file.path(), part_data));
+  {
+    VerityWriterAndroid expected_writer;
+    ASSERT_TRUE(expected_writer.Init(partition_));
+    ASSERT_NO_FATAL_FAILURE(
+        WriteHashTree(expected_file.path(), &expected_writer));
+  }
+
+  // Blocks 100 to 300 were written by the update, the others copied.
+  auto builder = std::make_shared<ParallelHashTreeBuilder>(
+      kBlockSize, HashTreeBuilder::HashFunction("sha256"), 1);
+  ASSERT_TRUE(builder->Initialize(partition_.hash_tree_data_size,
+                                  partition_.hash_tree_salt));
+  ASSERT_TRUE(builder->ZeroBlocksAt(250, 50));
+  ASSERT_TRUE(builder->UpdateBlocksAt(
+      100, part_data.data() + 100 * kBlockSize, 150));
+  partition_.inline_hash_tree_builder = builder;
+  ASSERT_TRUE(verity_writer_.Init(partition_));
+  std::vector<Extent> extents;
+  ASSERT_TRUE(verity_writer_.GetMissingExtents(&extents));
+  ASSERT_EQ(std::vector<Extent>{ExtentForRange(0, 100)}, extents);
+  ASSERT_TRUE(verity_writer_.Update(0, part_data.data(), 100 * kBlockSize));
+  ASSERT_TRUE(
+      verity_writer_.Finalize(partition_fd_.get(), partition_fd_.get()));
+
+  brillo::Blob actual_part, expected_part;
+  ASSERT_TRUE(utils::ReadFile(partition_.target_path, &actual_part));
+  ASSERT_TRUE(utils::ReadFile(expected_file.path(), &expected_part));
+  ASSERT_EQ(expected_part, actual_part);
+}
+
 }  // namespace chromeos_update_engine
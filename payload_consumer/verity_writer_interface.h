@@ -19,6 +19,7 @@
 
 #include <cstdint>
 #include <memory>
+#include <vector>
 
 #include <base/macros.h>
 
@@ -58,6 +59,20 @@ class VerityWriterInterface {
   // Gets progress report on FEC write
   virtual double GetProgress() = 0;
 
+  // Returns in |*digest| the root digest of the hash tree built from all the
+  // data passed to Update(), once written. Returns false if there is none.
+  virtual bool GetHashTreeRootDigest(brillo::Blob* digest) const {
+    return false;
+  }
+
+  // Returns in |*extents| the blocks of the partition Update() still needs the
+  // data of, in any order, when the hash tree was partly built as the
+  // partition was written. Returns false if Update() needs all the data, in
+  // order.
+  virtual bool GetMissingExtents(std::vector<Extent>* extents) const {
+    return false;
+  }
+
  protected:
   VerityWriterInterface() = default;
 
@@ -0,0 +1,221 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/write_combining_file_descriptor.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+WriteCombiningFileDescriptor::WriteCombiningFileDescriptor(
+    FileDescriptorPtr fd, size_t buffer_size)
+    : fd_(std::move(fd)), buffer_size_(buffer_size) {}
+
+WriteCombiningFileDescriptor::~WriteCombiningFileDescriptor() {
+  LOG_IF(ERROR, !runs_.empty())
+      << "Dropping " << bytes_buffered_ << " bytes of buffered writes";
+  if (writes_ > 0) {
+    LOG(INFO) << "Combined " << writes_ << " writes into " << combined_writes_;
+  }
+}
+
+bool WriteCombiningFileDescriptor::Open(const char* path,
+                                        int flags,
+                                        mode_t mode) {
+  offset_ = 0;
+  return fd_->Open(path, flags, mode);
+}
+
+bool WriteCombiningFileDescriptor::Open(const char* path, int flags) {
+  offset_ = 0;
+  return fd_->Open(path, flags);
+}
+
+ssize_t WriteCombiningFileDescriptor::Read(void* buf, size_t count) {
+  if (!FlushBuffer() || fd_->Seek(offset_, SEEK_SET) != offset_) {
+    return -1;
+  }
+  const ssize_t bytes_read = fd_->Read(buf, count);
+  if (bytes_read > 0) {
+    offset_ += bytes_read;
+  }
+  return bytes_read;
+}
+
+ssize_t WriteCombiningFileDescriptor::Write(const void* buf, size_t count) {
+  if (!Buffer(offset_, buf, count)) {
+    return -1;
+  }
+  offset_ += count;
+  return count;
+}
+
+off64_t WriteCombiningFileDescriptor::Seek(off64_t offset, int whence) {
+  off64_t new_offset = -1;
+  switch (whence) {
+    case SEEK_SET:
+      new_offset = offset;
+      break;
+    case SEEK_CUR:
+      new_offset = offset_ + offset;
+      break;
+    default:
+      new_offset = fd_->Seek(offset, whence);
+      if (new_offset < 0) {
+        return -1;
+      }
+  }
+  if (new_offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  offset_ = new_offset;
+  return offset_;
+}
+
+bool WriteCombiningFileDescriptor::BlkIoctl(int request,
+                                            uint64_t start,
+                                            uint64_t length,
+                                            int* result) {
+  // The ioctl must not be undone by earlier writes landing after it.
+  return FlushBuffer() && fd_->BlkIoctl(request, start, length, result);
+}
+
+bool WriteCombiningFileDescriptor::Flush() {
+  return FlushBuffer() && fd_->Flush();
+}
+
+bool WriteCombiningFileDescriptor::Close() {
+  const bool flushed = FlushBuffer();
+  runs_.clear();
+  bytes_buffered_ = 0;
+  offset_ = 0;
+  return fd_->Close() && flushed;
+}
+
+bool WriteCombiningFileDescriptor::ReadBatch(
+    const std::vector<FileIoRequest>& requests) {
+  return FlushBuffer() && fd_->ReadBatch(requests);
+}
+
+bool WriteCombiningFileDescriptor::WriteBatch(
+    const std::vector<FileIoRequest>& requests) {
+  for (const FileIoRequest& request : requests) {
+    TEST_AND_RETURN_FALSE(Buffer(request.offset, request.buf, request.count));
+  }
+  return true;
+}
+
+bool WriteCombiningFileDescriptor::ReadV(off64_t offset,
+                                         const std::vector<iovec>& iov) {
+  return FlushBuffer() && fd_->ReadV(offset, iov);
+}
+
+bool WriteCombiningFileDescriptor::WriteV(off64_t offset,
+                                          const std::vector<iovec>& iov) {
+  for (const iovec& vec : iov) {
+    TEST_AND_RETURN_FALSE(Buffer(offset, vec.iov_base, vec.iov_len));
+    offset += vec.iov_len;
+  }
+  return true;
+}
+
+bool WriteCombiningFileDescriptor::Buffer(off64_t offset,
+                                          const void* buf,
+                                          size_t count) {
+  if (count == 0) {
+    return true;
+  }
+  writes_++;
+  if (count >= buffer_size_) {
+    // Too large to gain anything from being buffered.
+    TEST_AND_RETURN_FALSE(FlushBuffer());
+    combined_writes_++;
+    return fd_->WriteBatch({{offset, const_cast<void*>(buf), count}});
+  }
+
+  // Merge the write with every run it overlaps or touches: the one starting
+  // before it, if it reaches |offset|, and the ones starting up to its end.
+  const off64_t end = offset + count;
+  auto it = runs_.upper_bound(offset);
+  if (it != runs_.begin()) {
+    const auto prev = std::prev(it);
+    if (prev->first + static_cast<off64_t>(prev->second.size()) >= offset) {
+      it = prev;
+    }
+  }
+  off64_t start = offset;
+  brillo::Blob merged;
+  if (it != runs_.end() && it->first < offset) {
+    // Reuse the memory of the run the write goes into or extends.
+    start = it->first;
+    merged = std::move(it->second);
+    bytes_buffered_ -= merged.size();
+    it = runs_.erase(it);
+  }
+  off64_t merged_end =
+      std::max(end, start + static_cast<off64_t>(merged.size()));
+  for (; it != runs_.end() && it->first <= end; it = runs_.erase(it)) {
+    merged_end = std::max(
+        merged_end, it->first + static_cast<off64_t>(it->second.size()));
+    merged.resize(merged_end - start);
+    memcpy(merged.data() + (it->first - start),
+           it->second.data(),
+           it->second.size());
+    bytes_buffered_ -= it->second.size();
+  }
+  merged.resize(merged_end - start);
+  memcpy(merged.data() + (offset - start), buf, count);
+  bytes_buffered_ += merged.size();
+  runs_.emplace_hint(it, start, std::move(merged));
+
+  if (bytes_buffered_ >= buffer_size_) {
+    TEST_AND_RETURN_FALSE(FlushBuffer());
+  }
+  return true;
+}
+
+bool WriteCombiningFileDescriptor::FlushBuffer() {
+  if (runs_.empty()) {
+    return true;
+  }
+  std::vector<FileIoRequest> requests;
+  requests.reserve(runs_.size());
+  for (auto& [offset, data] : runs_) {
+    requests.push_back({offset, data.data(), data.size()});
+  }
+  if (!fd_->WriteBatch(requests)) {
+    PLOG(ERROR) << "Failed to write " << bytes_buffered_
+                << " bytes of buffered writes";
+    return false;
+  }
+  combined_writes_ += runs_.size();
+  runs_.clear();
+  bytes_buffered_ = 0;
+  return true;
+}
+
+}  // namespace chromeos_update_engine
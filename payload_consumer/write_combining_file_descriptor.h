@@ -0,0 +1,91 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_WRITE_COMBINING_FILE_DESCRIPTOR_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_WRITE_COMBINING_FILE_DESCRIPTOR_H_
+
+#include <map>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+
+namespace chromeos_update_engine {
+
+// Holds up to |buffer_size| bytes of writes in memory and hands them to the
+// underlying descriptor sorted by offset, with the writes next to each other
+// merged into one. Unlike CachedFileDescriptor, which only merges writes that
+// follow each other in the file, this combines the small, scattered writes of
+// many operations, which often end up filling the same region of the
+// partition, into a few large writes.
+//
+// Later writes win over earlier ones they overlap. Any read, ioctl or Flush()
+// writes the buffered data out first, so the descriptor behaves as if every
+// write went through right away. Buffered data that couldn't be written is
+// kept for the next attempt. Not thread safe.
+class WriteCombiningFileDescriptor : public FileDescriptor {
+ public:
+  WriteCombiningFileDescriptor(FileDescriptorPtr fd, size_t buffer_size);
+  ~WriteCombiningFileDescriptor() override;
+
+  bool Open(const char* path, int flags, mode_t mode) override;
+  bool Open(const char* path, int flags) override;
+  ssize_t Read(void* buf, size_t count) override;
+  ssize_t Write(const void* buf, size_t count) override;
+  off64_t Seek(off64_t offset, int whence) override;
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override;
+  bool Flush() override;
+  bool Close() override;
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+  bool ReadBatch(const std::vector<FileIoRequest>& requests) override;
+  bool WriteBatch(const std::vector<FileIoRequest>& requests) override;
+  bool ReadV(off64_t offset, const std::vector<iovec>& iov) override;
+  bool WriteV(off64_t offset, const std::vector<iovec>& iov) override;
+
+  // Number of writes received, and passed on to the underlying descriptor.
+  uint64_t writes() const { return writes_; }
+  uint64_t combined_writes() const { return combined_writes_; }
+
+ private:
+  // Adds the |count| bytes at |buf| to be written at |offset|, writing the
+  // buffer out if it gets full.
+  bool Buffer(off64_t offset, const void* buf, size_t count);
+  // Writes out all the buffered data, without flushing |fd_|.
+  bool FlushBuffer();
+
+  FileDescriptorPtr fd_;
+  const size_t buffer_size_;
+
+  // Runs of buffered data by offset. Runs never overlap nor touch each other.
+  std::map<off64_t, brillo::Blob> runs_;
+  size_t bytes_buffered_{0};
+
+  off64_t offset_{0};
+  uint64_t writes_{0};
+  uint64_t combined_writes_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(WriteCombiningFileDescriptor);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_WRITE_COMBINING_FILE_DESCRIPTOR_H_
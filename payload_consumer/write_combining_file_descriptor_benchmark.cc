@@ -0,0 +1,93 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// WriteCombiningFileDescriptor against writing straight to the device, on
+// simulated eMMC and UFS storage, for the scattered block writes of the
+// operations of a delta payload. The time reported is the simulated time of
+// the device, so the results are the same on every machine.
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/simulated_block_device.h"
+#include "update_engine/payload_consumer/write_combining_file_descriptor.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kDeviceBlocks = 16384;
+
+// The arguments are the storage, 0 for eMMC and 1 for UFS, then the size of
+// the buffer of the WriteCombiningFileDescriptor, or 0 to write to the device
+// directly.
+void BM_ScatteredBlockWrites(benchmark::State& state) {
+  const StorageProfile profile =
+      state.range(0) == 0 ? StorageProfile::Emmc() : StorageProfile::Ufs();
+  vector<size_t> blocks(kDeviceBlocks);
+  for (size_t i = 0; i < blocks.size(); i++)
+    blocks[i] = i;
+  std::shuffle(blocks.begin(), blocks.end(), std::mt19937(42));
+  const brillo::Blob data(kBlockSize, 0x5a);
+
+  for (auto _ : state) {
+    auto device = std::make_shared<SimulatedBlockDevice>(
+        profile, kDeviceBlocks * kBlockSize);
+    std::unique_ptr<WriteCombiningFileDescriptor> combining_fd;
+    FileDescriptor* fd = device.get();
+    if (state.range(1) > 0) {
+      combining_fd = std::make_unique<WriteCombiningFileDescriptor>(
+          device, state.range(1));
+      fd = combining_fd.get();
+    }
+    if (!fd->Open("", O_RDWR)) {
+      state.SkipWithError("Failed to open the device");
+      break;
+    }
+    for (const size_t block : blocks) {
+      if (fd->Seek(block * kBlockSize, SEEK_SET) < 0 ||
+          fd->Write(data.data(), data.size()) !=
+              static_cast<ssize_t>(data.size())) {
+        state.SkipWithError("Failed to write");
+        return;
+      }
+    }
+    fd->Flush();
+    fd->Close();
+    state.SetIterationTime(device->elapsed().InSecondsF());
+    state.counters["device_writes"] = device->stats().writes;
+  }
+  state.SetBytesProcessed(state.iterations() * kDeviceBlocks * kBlockSize);
+}
+
+}  // namespace
+
+BENCHMARK(BM_ScatteredBlockWrites)
+    ->ArgsProduct({{0, 1}, {0, 1 << 20, 16 << 20}})
+    ->UseManualTime()
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace chromeos_update_engine
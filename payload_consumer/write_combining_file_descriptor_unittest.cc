@@ -0,0 +1,192 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/write_combining_file_descriptor.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const size_t kBufferSize = 100;
+const size_t kFileSize = 1024;
+// (offset, length) of a write reaching the underlying descriptor.
+using WriteOp = std::pair<uint64_t, uint64_t>;
+
+// A file held in memory, recording the writes it gets.
+class MemoryFileDescriptor : public FileDescriptor {
+ public:
+  MemoryFileDescriptor() : data_(kFileSize, 0) {}
+
+  bool Open(const char* path, int flags, mode_t mode) override {
+    open_ = true;
+    return true;
+  }
+  bool Open(const char* path, int flags) override {
+    return Open(path, flags, 0);
+  }
+  ssize_t Read(void* buf, size_t count) override {
+    count = std::min(count, data_.size() - offset_);
+    memcpy(buf, data_.data() + offset_, count);
+    offset_ += count;
+    return count;
+  }
+  ssize_t Write(const void* buf, size_t count) override {
+    if (offset_ + count > data_.size()) {
+      return -1;
+    }
+    write_ops_.emplace_back(offset_, count);
+    memcpy(data_.data() + offset_, buf, count);
+    offset_ += count;
+    return count;
+  }
+  off64_t Seek(off64_t offset, int whence) override {
+    if (whence != SEEK_SET) {
+      return -1;
+    }
+    offset_ = offset;
+    return offset_;
+  }
+  uint64_t BlockDevSize() override { return 0; }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    return false;
+  }
+  bool Flush() override { return true; }
+  bool Close() override {
+    open_ = false;
+    return true;
+  }
+  bool IsSettingErrno() override { return false; }
+  bool IsOpen() override { return open_; }
+
+  const brillo::Blob& data() const { return data_; }
+  const vector<WriteOp>& write_ops() const { return write_ops_; }
+
+ private:
+  brillo::Blob data_;
+  size_t offset_{0};
+  bool open_{false};
+  vector<WriteOp> write_ops_;
+};
+}  // namespace
+
+class WriteCombiningFileDescriptorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    memory_fd_ = std::make_shared<MemoryFileDescriptor>();
+    fd_ = std::make_unique<WriteCombiningFileDescriptor>(memory_fd_,
+                                                          kBufferSize);
+    ASSERT_TRUE(fd_->Open("/dev/null", O_RDWR));
+    expected_.assign(kFileSize, 0);
+  }
+
+  // Writes |count| bytes of |value| at |offset| through |fd_|, and to
+  // |expected_|.
+  void WriteAt(off64_t offset, size_t count, uint8_t value) {
+    brillo::Blob data(count, value);
+    ASSERT_TRUE(fd_->WriteBatch({{offset, data.data(), data.size()}}));
+    std::fill_n(expected_.begin() + offset, count, value);
+  }
+
+  std::shared_ptr<MemoryFileDescriptor> memory_fd_;
+  std::unique_ptr<WriteCombiningFileDescriptor> fd_;
+  brillo::Blob expected_;
+};
+
+TEST_F(WriteCombiningFileDescriptorTest, ScatteredWritesMergedTest) {
+  WriteAt(30, 10, 3);
+  WriteAt(10, 10, 1);
+  WriteAt(60, 10, 6);
+  WriteAt(20, 10, 2);
+  WriteAt(0, 10, 0xff);
+  EXPECT_TRUE(memory_fd_->write_ops().empty());
+
+  ASSERT_TRUE(fd_->Flush());
+  EXPECT_EQ((vector<WriteOp>{{0, 40}, {60, 10}}), memory_fd_->write_ops());
+  EXPECT_EQ(expected_, memory_fd_->data());
+  EXPECT_EQ(5u, fd_->writes());
+  EXPECT_EQ(2u, fd_->combined_writes());
+}
+
+TEST_F(WriteCombiningFileDescriptorTest, LaterWritesWinTest) {
+  WriteAt(10, 20, 1);
+  WriteAt(20, 20, 2);
+  WriteAt(0, 15, 3);
+  WriteAt(50, 10, 4);
+  // Covers the run at 50 and touches the merged one.
+  WriteAt(40, 30, 5);
+  WriteAt(12, 2, 6);
+
+  ASSERT_TRUE(fd_->Flush());
+  EXPECT_EQ((vector<WriteOp>{{0, 70}}), memory_fd_->write_ops());
+  EXPECT_EQ(expected_, memory_fd_->data());
+}
+
+TEST_F(WriteCombiningFileDescriptorTest, FullBufferWrittenOutTest) {
+  for (size_t i = 0; i < 10; i++) {
+    WriteAt(i * 20, 10, i + 1);
+  }
+  // The tenth write filled the buffer.
+  EXPECT_EQ(10u, memory_fd_->write_ops().size());
+  EXPECT_EQ(expected_, memory_fd_->data());
+
+  // Writes larger than the buffer go through right away.
+  WriteAt(0, 10, 11);
+  WriteAt(200, kBufferSize, 12);
+  ASSERT_EQ(12u, memory_fd_->write_ops().size());
+  EXPECT_EQ(WriteOp(200, kBufferSize), memory_fd_->write_ops().back());
+  EXPECT_EQ(expected_, memory_fd_->data());
+}
+
+TEST_F(WriteCombiningFileDescriptorTest, ReadsSeeBufferedWritesTest) {
+  WriteAt(100, 10, 1);
+  brillo::Blob data(20);
+  ASSERT_TRUE(fd_->ReadBatch({{95, data.data(), data.size()}}));
+  EXPECT_EQ(brillo::Blob(expected_.begin() + 95, expected_.begin() + 115),
+            data);
+
+  WriteAt(120, 10, 2);
+  ASSERT_EQ(130, fd_->Seek(130, SEEK_SET));
+  ASSERT_EQ(10, fd_->Write(data.data(), 10));
+  std::copy_n(data.begin(), 10, expected_.begin() + 130);
+  ASSERT_EQ(120, fd_->Seek(-20, SEEK_CUR));
+  ASSERT_EQ(20, fd_->Read(data.data(), data.size()));
+  EXPECT_EQ(brillo::Blob(expected_.begin() + 120, expected_.begin() + 140),
+            data);
+  EXPECT_EQ(140, fd_->Seek(0, SEEK_CUR));
+}
+
+TEST_F(WriteCombiningFileDescriptorTest, CloseWritesOutBufferTest) {
+  WriteAt(0, 10, 1);
+  ASSERT_TRUE(fd_->Close());
+  EXPECT_FALSE(fd_->IsOpen());
+  EXPECT_EQ(expected_, memory_fd_->data());
+}
+
+}  // namespace chromeos_update_engine
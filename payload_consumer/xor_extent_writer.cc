@@ -25,45 +25,85 @@
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
-bool XORExtentWriter::WriteXorCowOp(const uint8_t* bytes,
-                                    const size_t size,
-                                    const Extent& xor_ext,
-                                    const size_t src_offset) {
-  xor_block_data.resize(BlockSize() * xor_ext.num_blocks());
-  const auto src_block = src_offset / BlockSize();
-  ssize_t bytes_read = 0;
-  TEST_AND_RETURN_FALSE_ERRNO(utils::PReadAll(source_fd_,
-                                              xor_block_data.data(),
-                                              xor_block_data.size(),
-                                              src_offset,
-                                              &bytes_read));
-  if (bytes_read != static_cast<ssize_t>(xor_block_data.size())) {
-    LOG(ERROR) << "bytes_read: " << bytes_read << ", expected to read "
-               << xor_block_data.size() << " at block " << src_block
-               << " offset " << src_offset % BlockSize();
+
+namespace {
+// The source block XORed into the first block of |xor_ext|, part of the
+// destination of |merge_op|.
+uint64_t SourceBlock(const Extent& xor_ext, const CowMergeOperation* merge_op) {
+  return merge_op->src_extent().start_block() + xor_ext.start_block() -
+         merge_op->dst_extent().start_block();
+}
+}  // namespace
+
+bool XORExtentWriter::WriteXorCowOps() {
+  if (xor_ops_.empty()) {
+    return true;
+  }
+  // The source blocks under all the XOR blocks, each read once even when
+  // unaligned source offsets share it between two ops, and in one batch.
+  ExtentRanges source_blocks;
+  for (const auto& xor_op : xor_ops_) {
+    const uint64_t first_block = xor_op.src_offset / BlockSize();
+    const uint64_t end_block = utils::DivRoundUp(
+        xor_op.src_offset + xor_op.xor_ext.num_blocks() * BlockSize(),
+        BlockSize());
+    source_blocks.AddExtent(
+        ExtentForRange(first_block, end_block - first_block));
+  }
+  source_extents_.assign(source_blocks.extent_set().begin(),
+                         source_blocks.extent_set().end());
+  source_data_.resize(source_blocks.blocks() * BlockSize());
+  read_requests_.clear();
+  uint64_t buffer_offset = 0;
+  for (const auto& extent : source_extents_) {
+    read_requests_.push_back({static_cast<off64_t>(extent.start_block() *
+                                                   BlockSize()),
+                              source_data_.data() + buffer_offset,
+                              extent.num_blocks() * BlockSize()});
+    buffer_offset += extent.num_blocks() * BlockSize();
+  }
+  if (!source_fd_->ReadBatch(read_requests_)) {
+    PLOG(ERROR) << "Failed to read the source blocks of "
+                << source_extents_.size() << " extents for XOR ops";
     return false;
   }
 
-  std::transform(xor_block_data.cbegin(),
-                 xor_block_data.cbegin() + xor_block_data.size(),
-                 bytes,
-                 xor_block_data.begin(),
-                 std::bit_xor<unsigned char>{});
-  TEST_AND_RETURN_FALSE(cow_writer_->AddXorBlocks(xor_ext.start_block(),
-                                                  xor_block_data.data(),
-                                                  xor_block_data.size(),
-                                                  src_block,
-                                                  src_offset % BlockSize()));
+  for (const auto& xor_op : xor_ops_) {
+    // The source extent holding all the bytes XORed into |xor_op|.
+    const uint64_t src_block = xor_op.src_offset / BlockSize();
+    const auto next = std::upper_bound(
+        source_extents_.begin(),
+        source_extents_.end(),
+        src_block,
+        [](uint64_t block, const Extent& extent) {
+          return block < extent.start_block();
+        });
+    TEST_AND_RETURN_FALSE(next != source_extents_.begin());
+    const auto& request = read_requests_[next - source_extents_.begin() - 1];
+    const auto source = static_cast<const uint8_t*>(request.buf) +
+                        (xor_op.src_offset - request.offset);
+
+    xor_block_data.resize(BlockSize() * xor_op.xor_ext.num_blocks());
+    std::transform(source,
+                   source + xor_block_data.size(),
+                   xor_op.bytes,
+                   xor_block_data.begin(),
+                   std::bit_xor<unsigned char>{});
+    TEST_AND_RETURN_FALSE(
+        cow_writer_->AddXorBlocks(xor_op.xor_ext.start_block(),
+                                  xor_block_data.data(),
+                                  xor_block_data.size(),
+                                  src_block,
+                                  xor_op.src_offset % BlockSize()));
+  }
+  xor_ops_.clear();
   return true;
 }
 
-bool XORExtentWriter::WriteXorExtent(const uint8_t* bytes,
-                                     const size_t size,
-                                     const Extent& xor_ext,
-                                     const CowMergeOperation* merge_op) {
-  const auto src_block = merge_op->src_extent().start_block() +
-                         xor_ext.start_block() -
-                         merge_op->dst_extent().start_block();
+bool XORExtentWriter::AddXorExtent(const uint8_t* bytes,
+                                   const Extent& xor_ext,
+                                   const CowMergeOperation* merge_op) {
+  const auto src_block = SourceBlock(xor_ext, merge_op);
   const auto read_end_offset =
       (src_block + xor_ext.num_blocks()) * BlockSize() + merge_op->src_offset();
   const auto is_out_of_bound_read =
@@ -85,23 +125,20 @@ bool XORExtentWriter::WriteXorExtent(const uint8_t* bytes,
     Extent non_oob_extent =
         ExtentForRange(xor_ext.start_block(), xor_ext.num_blocks() - 1);
     if (non_oob_extent.num_blocks() > 0) {
-      TEST_AND_RETURN_FALSE(
-          WriteXorCowOp(bytes,
-                        BlockSize() * non_oob_extent.num_blocks(),
-                        non_oob_extent,
-                        src_block * BlockSize() + merge_op->src_offset()));
+      xor_ops_.push_back(
+          {bytes,
+           non_oob_extent,
+           src_block * BlockSize() + merge_op->src_offset()});
     }
     const Extent last_block =
         ExtentForRange(xor_ext.start_block() + xor_ext.num_blocks() - 1, 1);
-    TEST_AND_RETURN_FALSE(
-        WriteXorCowOp(bytes + (xor_ext.num_blocks() - 1) * BlockSize(),
-                      BlockSize(),
-                      last_block,
-                      (src_block + xor_ext.num_blocks() - 1) * BlockSize()));
+    xor_ops_.push_back({bytes + (xor_ext.num_blocks() - 1) * BlockSize(),
+                        last_block,
+                        (src_block + xor_ext.num_blocks() - 1) * BlockSize()});
     return true;
   }
-  TEST_AND_RETURN_FALSE(WriteXorCowOp(
-      bytes, size, xor_ext, src_block * BlockSize() + merge_op->src_offset()));
+  xor_ops_.push_back(
+      {bytes, xor_ext, src_block * BlockSize() + merge_op->src_offset()});
   return true;
 }
 
@@ -110,6 +147,23 @@ bool XORExtentWriter::WriteExtent(const void* bytes,
                                   const Extent& extent,
                                   const size_t size) {
   const auto xor_extents = xor_map_.GetIntersectingExtents(extent);
+  xor_ops_.clear();
+  // The run of XOR blocks not written yet, and the merge op it starts with.
+  Extent run_ext;
+  const CowMergeOperation* run_op = nullptr;
+  const auto write_run = [&]() {
+    if (run_op == nullptr) {
+      return true;
+    }
+    const auto i = run_ext.start_block() - extent.start_block();
+    const auto dst_block_data =
+        static_cast<const unsigned char*>(bytes) + i * BlockSize();
+    if (!AddXorExtent(dst_block_data, run_ext, run_op)) {
+      LOG(ERROR) << "Failed to write XOR extent " << run_ext;
+      return false;
+    }
+    return true;
+  };
   for (const auto& xor_ext : xor_extents) {
     const auto merge_op_opt = xor_map_.Get(xor_ext);
     if (!merge_op_opt.has_value()) {
@@ -140,17 +194,22 @@ bool XORExtentWriter::WriteExtent(const void* bytes,
                  << xor_ext << " xor_map extent: " << merge_op->dst_extent();
       return false;
     }
-    const auto i = xor_ext.start_block() - extent.start_block();
-    const auto dst_block_data =
-        static_cast<const unsigned char*>(bytes) + i * BlockSize();
-    if (!WriteXorExtent(dst_block_data,
-                        xor_ext.num_blocks() * BlockSize(),
-                        xor_ext,
-                        merge_op)) {
-      LOG(ERROR) << "Failed to write XOR extent " << xor_ext;
-      return false;
+    // Merge ops next to each other, reading source blocks next to each other
+    // at the same offset, make a single run of XOR blocks.
+    if (run_op != nullptr &&
+        run_ext.start_block() + run_ext.num_blocks() == xor_ext.start_block() &&
+        SourceBlock(run_ext, run_op) + run_ext.num_blocks() ==
+            SourceBlock(xor_ext, merge_op) &&
+        run_op->src_offset() == merge_op->src_offset()) {
+      run_ext.set_num_blocks(run_ext.num_blocks() + xor_ext.num_blocks());
+      continue;
     }
+    TEST_AND_RETURN_FALSE(write_run());
+    run_ext = xor_ext;
+    run_op = merge_op;
   }
+  TEST_AND_RETURN_FALSE(write_run());
+  TEST_AND_RETURN_FALSE(WriteXorCowOps());
   const auto replace_extents = xor_map_.GetNonIntersectingExtents(extent);
   return WriteReplaceExtents(replace_extents, extent, bytes, size);
 }
@@ -22,6 +22,7 @@
 #include "common/utils.h"
 #include "update_engine/payload_consumer/block_extent_writer.h"
 #include "update_engine/payload_consumer/extent_map.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
 
 #include <update_engine/update_metadata.pb.h>
 #include <libsnapshot/cow_writer.h>
@@ -56,19 +57,30 @@ class XORExtentWriter : public BlockExtentWriter {
                            const Extent& extent,
                            const void* bytes,
                            size_t size);
-  bool WriteXorExtent(const uint8_t* bytes,
-                      const size_t size,
-                      const Extent& xor_ext,
-                      const CowMergeOperation* merge_op);
-  bool WriteXorCowOp(const uint8_t* bytes,
-                     const size_t size,
-                     const Extent& xor_ext,
-                     size_t src_offset);
+  // An XOR block run of the extent being written, and the offset in the
+  // source partition of the bytes XORed into it.
+  struct XorOp {
+    const uint8_t* bytes;
+    Extent xor_ext;
+    uint64_t src_offset;
+  };
+
+  // Adds the XOR ops of the blocks |xor_ext| of |merge_op| to |xor_ops_|.
+  bool AddXorExtent(const uint8_t* bytes,
+                    const Extent& xor_ext,
+                    const CowMergeOperation* merge_op);
+  // Reads the source data of all the |xor_ops_| at once and writes them.
+  bool WriteXorCowOps();
   const google::protobuf::RepeatedPtrField<Extent>& src_extents_;
   const FileDescriptorPtr source_fd_;
   const ExtentMap<const CowMergeOperation*>& xor_map_;
   android::snapshot::ICowWriter* cow_writer_;
   std::vector<uint8_t> xor_block_data;
+  std::vector<XorOp> xor_ops_;
+  // The source blocks of |xor_ops_|, their data and the reads of it.
+  std::vector<Extent> source_extents_;
+  std::vector<uint8_t> source_data_;
+  std::vector<FileIoRequest> read_requests_;
   const size_t partition_size_;
 };
 
@@ -134,6 +134,35 @@ TEST_F(XorExtentWriterTest, StreamTest) {
   ASSERT_TRUE(writer_.Write(zeros->data(), 9 * kBlockSize));
 }
 
+// Merge ops continuing each other in both the source and the target, at the
+// same offset, are written as a single run of XOR blocks.
+TEST_F(XorExtentWriterTest, ContiguousMergeOpsTest) {
+  constexpr auto COW_XOR = CowMergeOperation::COW_XOR;
+  const auto op1 = CreateCowMergeOperation(
+      ExtentForRange(10, 2), ExtentForRange(100, 2), COW_XOR, 5);
+  ASSERT_TRUE(xor_map_.AddExtent(op1.dst_extent(), &op1));
+  const auto op2 = CreateCowMergeOperation(
+      ExtentForRange(12, 2), ExtentForRange(102, 2), COW_XOR, 5);
+  ASSERT_TRUE(xor_map_.AddExtent(op2.dst_extent(), &op2));
+  // Same offset, but its source doesn't follow the one of |op2|.
+  const auto op3 = CreateCowMergeOperation(
+      ExtentForRange(20, 1), ExtentForRange(104, 1), COW_XOR, 5);
+  ASSERT_TRUE(xor_map_.AddExtent(op3.dst_extent(), &op3));
+  *op_.add_src_extents() = ExtentForRange(10, 5);
+  *op_.add_dst_extents() = ExtentForRange(100, 5);
+  XORExtentWriter writer_{
+      op_, source_fd_, &cow_writer_, xor_map_, NUM_BLOCKS * kBlockSize};
+
+  EXPECT_CALL(cow_writer_, AddXorBlocks(100, _, kBlockSize * 4, 10, 5))
+      .WillOnce(Return(true));
+  EXPECT_CALL(cow_writer_, AddXorBlocks(104, _, kBlockSize, 20, 5))
+      .WillOnce(Return(true));
+
+  auto zeros = utils::GetReadonlyZeroBlock(kBlockSize * 5);
+  ASSERT_TRUE(writer_.Init(op_.dst_extents(), kBlockSize));
+  ASSERT_TRUE(writer_.Write(zeros->data(), 5 * kBlockSize));
+}
+
 TEST_F(XorExtentWriterTest, SubsetExtentTest) {
   constexpr auto COW_XOR = CowMergeOperation::COW_XOR;
   ON_CALL(cow_writer_, AddXorBlocks(_, _, _, _, _)).WillByDefault(Return(true));
@@ -293,4 +322,45 @@ TEST_F(XorExtentWriterTest, LastMultiBlockTest) {
   ASSERT_TRUE(writer_.Write(op_data.data(), op_data.size()));
 }
 
+TEST_F(XorExtentWriterTest, SharedSourceBlockTest) {
+  constexpr auto COW_XOR = CowMergeOperation::COW_XOR;
+  // Both ops read from block 6, at different offsets.
+  const auto op1 = CreateCowMergeOperation(
+      ExtentForRange(5, 1), ExtentForRange(100, 1), COW_XOR, 100);
+  ASSERT_TRUE(xor_map_.AddExtent(op1.dst_extent(), &op1));
+  const auto op2 = CreateCowMergeOperation(
+      ExtentForRange(6, 1), ExtentForRange(101, 1), COW_XOR, 200);
+  ASSERT_TRUE(xor_map_.AddExtent(op2.dst_extent(), &op2));
+  *op_.add_src_extents() = ExtentForRange(5, 2);
+  *op_.add_dst_extents() = ExtentForRange(100, 2);
+  XORExtentWriter writer_{
+      op_, source_fd_, &cow_writer_, xor_map_, NUM_BLOCKS * kBlockSize};
+
+  // The target data is zeros, so the XOR data is the source data.
+  auto&& verify_source_data = [source_fd_(source_fd_)](
+                                  uint32_t new_block_start,
+                                  const void* data,
+                                  size_t size,
+                                  uint32_t old_block,
+                                  uint16_t offset) -> bool {
+    std::vector<uint8_t> source_data(size);
+    ssize_t bytes_read{};
+    TEST_AND_RETURN_FALSE_ERRNO(utils::PReadAll(source_fd_,
+                                                source_data.data(),
+                                                source_data.size(),
+                                                old_block * kBlockSize + offset,
+                                                &bytes_read));
+    TEST_EQ(bytes_read, static_cast<ssize_t>(source_data.size()));
+    return memcmp(source_data.data(), data, size) == 0;
+  };
+  EXPECT_CALL(cow_writer_, AddXorBlocks(100, _, kBlockSize, 5, 100))
+      .WillOnce(verify_source_data);
+  EXPECT_CALL(cow_writer_, AddXorBlocks(101, _, kBlockSize, 6, 200))
+      .WillOnce(verify_source_data);
+
+  auto zeros = utils::GetReadonlyZeroBlock(kBlockSize * 2);
+  ASSERT_TRUE(writer_.Init(op_.dst_extents(), kBlockSize));
+  ASSERT_TRUE(writer_.Write(zeros->data(), zeros->size()));
+}
+
 }  // namespace chromeos_update_engine
@@ -14,10 +14,14 @@
 // limitations under the License.
 //
 
+#include <algorithm>
+#include <atomic>
+
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/xz_extent_writer.h"
 
 using google::protobuf::RepeatedPtrField;
+using std::vector;
 
 namespace chromeos_update_engine {
 
@@ -51,6 +55,131 @@ const char* XzErrorString(enum xz_ret error) {
   }
 #undef __XZ_ERROR_STRING_CASE
 }
+
+// The stream header is the magic bytes, the stream flags and their CRC32. The
+// footer is the CRC32 of what follows, the size of the index, the stream flags
+// again and the footer magic bytes.
+constexpr size_t kStreamHeaderSize = 12;
+constexpr size_t kStreamFooterSize = 12;
+constexpr uint8_t kHeaderMagic[] = {0xfd, '7', 'z', 'X', 'Z', 0x00};
+constexpr uint8_t kFooterMagic[] = {'Y', 'Z'};
+
+// The size and uncompressed size of a block, as listed in the index.
+struct XzBlock {
+  uint64_t offset;
+  uint64_t unpadded_size;
+  uint64_t uncompressed_size;
+};
+
+uint64_t RoundUpToFour(uint64_t value) {
+  return (value + 3) & ~uint64_t{3};
+}
+
+uint32_t ReadLE32(const uint8_t* data) {
+  return data[0] | (data[1] << 8) | (data[2] << 16) |
+         (static_cast<uint32_t>(data[3]) << 24);
+}
+
+void AppendLE32(uint32_t value, brillo::Blob* out) {
+  for (size_t i = 0; i < 4; i++) {
+    out->push_back((value >> (8 * i)) & 0xff);
+  }
+}
+
+// Reads the variable length integer at |*pos| of |data|, up to |end|.
+bool ReadVarint(const uint8_t* data, size_t end, size_t* pos, uint64_t* value) {
+  *value = 0;
+  for (size_t i = 0; i < 9 && *pos < end; i++) {
+    const uint8_t byte = data[(*pos)++];
+    *value |= static_cast<uint64_t>(byte & 0x7f) << (7 * i);
+    if ((byte & 0x80) == 0)
+      return byte != 0 || i == 0;
+  }
+  return false;
+}
+
+void AppendVarint(uint64_t value, brillo::Blob* out) {
+  while (value >= 0x80) {
+    out->push_back((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out->push_back(value);
+}
+
+// Parses the index of the xz stream |data| into |blocks|.
+bool ParseXzIndex(const uint8_t* data, size_t size, vector<XzBlock>* blocks) {
+  if (size < kStreamHeaderSize + kStreamFooterSize ||
+      !std::equal(std::begin(kHeaderMagic), std::end(kHeaderMagic), data)) {
+    return false;
+  }
+  // A single stream without padding, whose flags match.
+  const uint8_t* footer = data + size - kStreamFooterSize;
+  if (!std::equal(
+          std::begin(kFooterMagic), std::end(kFooterMagic), footer + 10) ||
+      footer[8] != data[6] || footer[9] != data[7] ||
+      xz_crc32(footer + 4, 6, 0) != ReadLE32(footer)) {
+    return false;
+  }
+  const uint64_t index_size = (uint64_t{ReadLE32(footer + 4)} + 1) * 4;
+  if (index_size > size - kStreamHeaderSize - kStreamFooterSize)
+    return false;
+  const size_t index_start = size - kStreamFooterSize - index_size;
+  const size_t index_end = index_start + index_size - 4;
+  if (data[index_start] != 0 ||
+      xz_crc32(data + index_start, index_size - 4, 0) !=
+          ReadLE32(data + index_end)) {
+    return false;
+  }
+
+  size_t pos = index_start + 1;
+  uint64_t num_blocks = 0;
+  TEST_AND_RETURN_FALSE(ReadVarint(data, index_end, &pos, &num_blocks));
+  TEST_AND_RETURN_FALSE(num_blocks <= index_size / 2);
+  blocks->clear();
+  uint64_t offset = kStreamHeaderSize;
+  for (uint64_t i = 0; i < num_blocks; i++) {
+    XzBlock block{offset, 0, 0};
+    TEST_AND_RETURN_FALSE(
+        ReadVarint(data, index_end, &pos, &block.unpadded_size));
+    TEST_AND_RETURN_FALSE(
+        ReadVarint(data, index_end, &pos, &block.uncompressed_size));
+    TEST_AND_RETURN_FALSE(block.unpadded_size > 0 &&
+                          block.unpadded_size <= index_start - offset);
+    offset += RoundUpToFour(block.unpadded_size);
+    blocks->push_back(block);
+  }
+  // The blocks take all of the space up to the index.
+  return offset == index_start;
+}
+
+// Returns the stream of the xz stream |data| made of its single |block|: the
+// same header, the block and an index and footer of their own.
+brillo::Blob MakeSingleBlockStream(const uint8_t* data, const XzBlock& block) {
+  brillo::Blob stream(data, data + kStreamHeaderSize);
+  stream.insert(stream.end(),
+                data + block.offset,
+                data + block.offset + RoundUpToFour(block.unpadded_size));
+  const size_t index_start = stream.size();
+  stream.push_back(0);
+  AppendVarint(1, &stream);
+  AppendVarint(block.unpadded_size, &stream);
+  AppendVarint(block.uncompressed_size, &stream);
+  stream.resize(index_start + RoundUpToFour(stream.size() - index_start));
+  AppendLE32(
+      xz_crc32(stream.data() + index_start, stream.size() - index_start, 0),
+      &stream);
+  const size_t index_size = stream.size() - index_start;
+
+  brillo::Blob footer;
+  AppendLE32(index_size / 4 - 1, &footer);
+  footer.push_back(data[6]);
+  footer.push_back(data[7]);
+  AppendLE32(xz_crc32(footer.data(), footer.size(), 0), &stream);
+  stream.insert(stream.end(), footer.begin(), footer.end());
+  stream.insert(stream.end(), std::begin(kFooterMagic), std::end(kFooterMagic));
+  return stream;
+}
+
 }  // namespace
 
 XzExtentWriter::~XzExtentWriter() {
@@ -113,4 +242,59 @@ bool XzExtentWriter::Write(const void* bytes, size_t count) {
   return true;
 }
 
+bool XzDecompressBlocks(const void* data,
+                        size_t size,
+                        size_t max_output_size,
+                        ForkJoinPool* pool,
+                        vector<brillo::Blob>* blocks) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  vector<XzBlock> xz_blocks;
+  if (!ParseXzIndex(bytes, size, &xz_blocks) || xz_blocks.size() < 2)
+    return false;
+  uint64_t output_size = 0;
+  for (const XzBlock& block : xz_blocks) {
+    output_size += block.uncompressed_size;
+  }
+  TEST_AND_RETURN_FALSE(output_size <= max_output_size);
+
+  // Each block is decoded as a stream of its own, into a buffer of the size
+  // listed in the index. Blocks are handed out one at a time.
+  blocks->clear();
+  blocks->resize(xz_blocks.size());
+  std::atomic<size_t> next_block{0};
+  return pool->Run(
+      std::min(xz_blocks.size(), pool->num_threads()), [&](size_t /* task */) {
+        for (size_t i = next_block++; i < xz_blocks.size();
+             i = next_block++) {
+          const brillo::Blob stream =
+              MakeSingleBlockStream(bytes, xz_blocks[i]);
+          brillo::Blob& output = (*blocks)[i];
+          output.resize(xz_blocks[i].uncompressed_size);
+          std::unique_ptr<xz_dec, void (*)(xz_dec*)> decoder(
+              xz_dec_init(XZ_DYNALLOC, kXzMaxDictSize), &xz_dec_end);
+          TEST_AND_RETURN_FALSE(decoder != nullptr);
+          xz_buf request{};
+          request.in = stream.data();
+          request.in_size = stream.size();
+          request.out = output.data();
+          request.out_size = output.size();
+          xz_ret ret = XZ_OK;
+          size_t in_pos = 0;
+          size_t out_pos = 0;
+          do {
+            in_pos = request.in_pos;
+            out_pos = request.out_pos;
+            ret = xz_dec_run(decoder.get(), &request);
+          } while (ret == XZ_OK &&
+                   (request.in_pos != in_pos || request.out_pos != out_pos));
+          if (ret != XZ_STREAM_END || request.out_pos != output.size()) {
+            LOG(ERROR) << "Failed to decompress block " << i
+                       << " of the xz stream: " << XzErrorString(ret);
+            return false;
+          }
+        }
+        return true;
+      });
+}
+
 }  // namespace chromeos_update_engine
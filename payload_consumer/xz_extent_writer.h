@@ -21,10 +21,12 @@
 
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include <brillo/secure_blob.h>
 
 #include "update_engine/payload_consumer/extent_writer.h"
+#include "update_engine/payload_consumer/fork_join_pool.h"
 
 // XzExtentWriter is a concrete ExtentWriter subclass that xz-decompresses
 // what it's given in Write using xz-embedded. Note that xz-embedded only
@@ -57,6 +59,18 @@ class XzExtentWriter : public ExtentWriter {
   DISALLOW_COPY_AND_ASSIGN(XzExtentWriter);
 };
 
+// Decompresses the xz stream |data| of |size| bytes made of several blocks,
+// as listed in its index, by decoding each block on one of the threads of
+// |pool|. The output of the blocks is stored in |blocks| in order. Returns
+// false if the stream has a single block or isn't a single stream, if a block
+// fails to decode or if the output would be larger than |max_output_size|, in
+// which case the stream has to be decompressed in one go.
+bool XzDecompressBlocks(const void* data,
+                        size_t size,
+                        size_t max_output_size,
+                        ForkJoinPool* pool,
+                        std::vector<brillo::Blob>* blocks);
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_XZ_EXTENT_WRITER_H_
@@ -22,6 +22,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <vector>
 
 #include <base/memory/ptr_util.h>
 #include <gtest/gtest.h>
@@ -29,6 +30,8 @@
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/fake_extent_writer.h"
+#include "update_engine/payload_consumer/fork_join_pool.h"
+#include "update_engine/payload_generator/xz.h"
 
 namespace chromeos_update_engine {
 
@@ -148,4 +151,49 @@ TEST_F(XzExtentWriterTest, PartialDataIsKept) {
   EXPECT_EQ(expected_data, fake_extent_writer_->WrittenData());
 }
 
+TEST_F(XzExtentWriterTest, DecompressBlocksTest) {
+  brillo::Blob data(1024 * 1024);
+  test_utils::FillWithData(&data);
+  brillo::Blob compressed;
+  ASSERT_TRUE(XzCompress(data, 256 * 1024, &compressed));
+
+  ForkJoinPool pool(3);
+  std::vector<brillo::Blob> blocks;
+  ASSERT_TRUE(XzDecompressBlocks(
+      compressed.data(), compressed.size(), data.size(), &pool, &blocks));
+  EXPECT_EQ(4u, blocks.size());
+  brillo::Blob output;
+  for (const brillo::Blob& block : blocks) {
+    output.insert(output.end(), block.begin(), block.end());
+  }
+  EXPECT_EQ(data, output);
+
+  // The output doesn't fit.
+  EXPECT_FALSE(XzDecompressBlocks(
+      compressed.data(), compressed.size(), data.size() - 1, &pool, &blocks));
+
+  // The stream still decompresses in one go.
+  WriteAll(compressed);
+  EXPECT_EQ(data, fake_extent_writer_->WrittenData());
+}
+
+TEST_F(XzExtentWriterTest, DecompressBlocksFailureTest) {
+  ForkJoinPool pool(2);
+  std::vector<brillo::Blob> blocks;
+  brillo::Blob data(1024 * 1024);
+  test_utils::FillWithData(&data);
+  // A single block is left to XzExtentWriter.
+  brillo::Blob compressed;
+  ASSERT_TRUE(XzCompress(data, &compressed));
+  EXPECT_FALSE(XzDecompressBlocks(
+      compressed.data(), compressed.size(), data.size(), &pool, &blocks));
+
+  // The header of the first block, right after the stream header, fails its
+  // CRC check once corrupted.
+  ASSERT_TRUE(XzCompress(data, 256 * 1024, &compressed));
+  compressed[13] ^= 0x10;
+  EXPECT_FALSE(XzDecompressBlocks(
+      compressed.data(), compressed.size(), data.size(), &pool, &blocks));
+}
+
 }  // namespace chromeos_update_engine
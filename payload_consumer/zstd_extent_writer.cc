@@ -0,0 +1,65 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+
+#include "update_engine/common/utils.h"
+
+using google::protobuf::RepeatedPtrField;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The decoder needs a window of up to 2^|kZstdMaxWindowLog| bytes in RAM. The
+// generator compresses with level 19, whose window is at most 8 MiB, in line
+// with the 9 MiB "level 6" xz streams need.
+const int kZstdMaxWindowLog = 23;
+}  // namespace
+
+bool ZstdExtentWriter::Init(const RepeatedPtrField<Extent>& extents,
+                            uint32_t block_size) {
+  stream_.reset(ZSTD_createDCtx());
+  TEST_AND_RETURN_FALSE(stream_ != nullptr);
+  TEST_AND_RETURN_FALSE(!ZSTD_isError(ZSTD_DCtx_setParameter(
+      stream_.get(), ZSTD_d_windowLogMax, kZstdMaxWindowLog)));
+  output_buffer_.resize(ZSTD_DStreamOutSize());
+  return underlying_writer_->Init(extents, block_size);
+}
+
+bool ZstdExtentWriter::Write(const void* bytes, size_t count) {
+  ZSTD_inBuffer input{bytes, count, 0};
+  for (;;) {
+    ZSTD_outBuffer output{output_buffer_.data(), output_buffer_.size(), 0};
+    size_t ret = ZSTD_decompressStream(stream_.get(), &output, &input);
+    if (ZSTD_isError(ret)) {
+      LOG(ERROR) << "ZSTD_decompressStream returned "
+                 << ZSTD_getErrorName(ret);
+      return false;
+    }
+    if (output.pos > 0) {
+      TEST_AND_RETURN_FALSE(
+          underlying_writer_->Write(output_buffer_.data(), output.pos));
+    }
+    // A full output buffer may leave decoded data in the context, so only
+    // stop once all the input is consumed and the output wasn't filled.
+    if (input.pos == input.size && output.pos < output.size) {
+      break;
+    }
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
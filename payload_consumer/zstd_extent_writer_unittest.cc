@@ -0,0 +1,100 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/zstd_extent_writer.h"
+
+#include <zstd.h>
+
+#include <memory>
+
+#include <base/memory/ptr_util.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/payload_consumer/fake_extent_writer.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+brillo::Blob ZstdCompressData(const brillo::Blob& data, int level) {
+  brillo::Blob compressed(ZSTD_compressBound(data.size()));
+  size_t size = ZSTD_compress(
+      compressed.data(), compressed.size(), data.data(), data.size(), level);
+  EXPECT_FALSE(ZSTD_isError(size));
+  compressed.resize(size);
+  return compressed;
+}
+
+}  // namespace
+
+class ZstdExtentWriterTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    fake_extent_writer_ = new FakeExtentWriter();
+    zstd_writer_.reset(
+        new ZstdExtentWriter(base::WrapUnique(fake_extent_writer_)));
+    // Bigger than the internal output buffer.
+    sample_data_.resize(1024 * 1024);
+    test_utils::FillWithData(&sample_data_);
+  }
+
+  // Owned by |zstd_writer_|. This object is invalidated after |zstd_writer_|
+  // is deleted.
+  FakeExtentWriter* fake_extent_writer_{nullptr};
+  std::unique_ptr<ZstdExtentWriter> zstd_writer_;
+
+  brillo::Blob sample_data_;
+};
+
+TEST_F(ZstdExtentWriterTest, CreateAndDestroy) {
+  // Test that no Init() or End() called doesn't crash the program.
+  EXPECT_FALSE(fake_extent_writer_->InitCalled());
+}
+
+TEST_F(ZstdExtentWriterTest, CompressedSampleData) {
+  brillo::Blob compressed = ZstdCompressData(sample_data_, 19);
+  EXPECT_TRUE(zstd_writer_->Init({}, 1024));
+  EXPECT_TRUE(zstd_writer_->Write(compressed.data(), compressed.size()));
+  EXPECT_TRUE(fake_extent_writer_->InitCalled());
+  EXPECT_EQ(sample_data_, fake_extent_writer_->WrittenData());
+}
+
+TEST_F(ZstdExtentWriterTest, HighlyRedundantData) {
+  // A few bytes of input decode to many full output buffers.
+  brillo::Blob data(8 * 1024 * 1024, 'a');
+  brillo::Blob compressed = ZstdCompressData(data, 19);
+  EXPECT_TRUE(zstd_writer_->Init({}, 1024));
+  EXPECT_TRUE(zstd_writer_->Write(compressed.data(), compressed.size()));
+  EXPECT_EQ(data, fake_extent_writer_->WrittenData());
+}
+
+TEST_F(ZstdExtentWriterTest, GarbageDataRejected) {
+  EXPECT_TRUE(zstd_writer_->Init({}, 1024));
+  // The sample_data_ is not compressed.
+  EXPECT_FALSE(zstd_writer_->Write(sample_data_.data(), sample_data_.size()));
+}
+
+TEST_F(ZstdExtentWriterTest, PartialDataIsKept) {
+  brillo::Blob compressed = ZstdCompressData(sample_data_, 3);
+  EXPECT_TRUE(zstd_writer_->Init({}, 1024));
+  for (uint8_t byte : compressed) {
+    EXPECT_TRUE(zstd_writer_->Write(&byte, 1));
+  }
+  EXPECT_EQ(sample_data_, fake_extent_writer_->WrittenData());
+}
+
+}  // namespace chromeos_update_engine
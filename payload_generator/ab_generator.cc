@@ -17,8 +17,11 @@
 #include "update_engine/payload_generator/ab_generator.h"
 
 #include <algorithm>
+#include <limits>
+#include <numeric>
 #include <utility>
 
+#include <base/format_macros.h>
 #include <base/strings/stringprintf.h>
 
 #include "update_engine/common/hash_calculator.h"
@@ -27,6 +30,9 @@
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 
 using chromeos_update_engine::diff_utils::IsAReplaceOperation;
 using std::string;
@@ -34,6 +40,48 @@ using std::vector;
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// The cost model of GetOperationCost(), in blocks applied. The fixed cost of
+// an operation, for checking its hashes, checkpointing the progress, labeling
+// it in the COW and setting up its writer, about what applying this many
+// blocks takes.
+constexpr uint64_t kOperationOverheadBlocks = 32;
+// The cost of each extent, read or written with its own request.
+constexpr uint64_t kExtentOverheadBlocks = 1;
+// Every block past the target size of an operation costs as much again in
+// pipelining and in progress redone after resuming in the middle of it.
+constexpr uint64_t kOversizedBlockCost = 1;
+
+// Whether |op| is one the granularity is optimized for.
+bool IsResizableOperation(const InstallOperation& op) {
+  return op.type() == InstallOperation::SOURCE_COPY ||
+         IsAReplaceOperation(op.type());
+}
+
+// A summary of |aops| for the logs, with the costs for operations of
+// |target_blocks| blocks.
+string GetOperationsSummary(const vector<AnnotatedOperation>& aops,
+                            size_t target_blocks) {
+  uint64_t num_blocks = 0;
+  uint64_t data_size = 0;
+  uint64_t cost = 0;
+  for (const AnnotatedOperation& aop : aops) {
+    num_blocks += utils::BlocksInExtents(aop.op.dst_extents());
+    data_size += aop.op.data_length();
+    cost += ABGenerator::GetOperationCost(aop.op, target_blocks);
+  }
+  return base::StringPrintf("%zu operations of %" PRIu64
+                            " blocks on average, %" PRIu64
+                            " bytes of data, costing %" PRIu64 " blocks",
+                            aops.size(),
+                            aops.empty() ? 0 : num_blocks / aops.size(),
+                            data_size,
+                            cost);
+}
+
+}  // namespace
+
 bool ABGenerator::GenerateOperations(const PayloadGenerationConfig& config,
                                      const PartitionConfig& old_part,
                                      const PartitionConfig& new_part,
@@ -72,15 +120,72 @@ bool ABGenerator::GenerateOperations(const PayloadGenerationConfig& config,
       aops, config.version, merge_chunk_blocks, new_part.path, blob_file));
   LOG(INFO) << aops->size() << " operations after merge.";
 
+  if (config.target_operation_size > 0) {
+    const size_t target_blocks =
+        config.target_operation_size / config.block_size;
+    const string before = GetOperationsSummary(*aops, target_blocks);
+    TEST_AND_RETURN_FALSE(OptimizeOperationGranularity(
+        aops,
+        config.version,
+        target_blocks,
+        hard_chunk_blocks == -1 ? std::numeric_limits<size_t>::max()
+                                : static_cast<size_t>(hard_chunk_blocks),
+        new_part.path,
+        blob_file));
+    LOG(INFO) << "Optimized the granularity of the operations of "
+              << new_part.name << " from " << before << " to "
+              << GetOperationsSummary(*aops, target_blocks);
+  }
+
   if (config.version.minor >= kOpSrcHashMinorPayloadVersion)
-    TEST_AND_RETURN_FALSE(AddSourceHash(aops, old_part.path));
+    TEST_AND_RETURN_FALSE(
+        AddSourceHash(aops, old_part.path, config.data_hash_algorithm));
+
+  // Once merged, which only merges operations next to each other in the
+  // destination.
+  if (config.operation_order == PartitionUpdate::SOURCE)
+    SortOperationsBySource(aops);
 
   return true;
 }
 
 void ABGenerator::SortOperationsByDestination(
     vector<AnnotatedOperation>* aops) {
-  sort(aops->begin(), aops->end(), diff_utils::CompareAopsByDestination);
+  // Sort the indexes rather than the operations, so that every operation is
+  // moved once instead of swapped around by the sort.
+  vector<size_t> order(aops->size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [aops](size_t a, size_t b) {
+    return diff_utils::CompareAopsByDestination((*aops)[a], (*aops)[b]);
+  });
+  vector<AnnotatedOperation> sorted_aops;
+  sorted_aops.reserve(aops->size());
+  for (size_t index : order) {
+    sorted_aops.push_back(std::move((*aops)[index]));
+  }
+  *aops = std::move(sorted_aops);
+}
+
+void ABGenerator::SortOperationsBySource(vector<AnnotatedOperation>* aops) {
+  vector<uint64_t> keys(aops->size());
+  uint64_t key = 0;
+  for (size_t i = 0; i < aops->size(); i++) {
+    const InstallOperation& op = (*aops)[i].op;
+    if (op.src_extents_size() > 0)
+      key = op.src_extents(0).start_block();
+    keys[i] = key;
+  }
+  vector<size_t> order(aops->size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&keys](size_t a, size_t b) {
+    return keys[a] < keys[b];
+  });
+  vector<AnnotatedOperation> sorted_aops;
+  sorted_aops.reserve(aops->size());
+  for (size_t index : order) {
+    sorted_aops.push_back(std::move((*aops)[index]));
+  }
+  *aops = std::move(sorted_aops);
 }
 
 bool ABGenerator::FragmentOperations(const PayloadVersion& version,
@@ -88,7 +193,8 @@ bool ABGenerator::FragmentOperations(const PayloadVersion& version,
                                      const string& target_part_path,
                                      BlobFileWriter* blob_file) {
   vector<AnnotatedOperation> fragmented_aops;
-  for (const AnnotatedOperation& aop : *aops) {
+  fragmented_aops.reserve(aops->size());
+  for (AnnotatedOperation& aop : *aops) {
     // Only do split if the operation has more than one dst extents.
     if (aop.op.dst_extents_size() > 1) {
       if (aop.op.type() == InstallOperation::SOURCE_COPY) {
@@ -101,7 +207,7 @@ bool ABGenerator::FragmentOperations(const PayloadVersion& version,
         continue;
       }
     }
-    fragmented_aops.push_back(aop);
+    fragmented_aops.push_back(std::move(aop));
   }
   *aops = std::move(fragmented_aops);
   return true;
@@ -109,11 +215,11 @@ bool ABGenerator::FragmentOperations(const PayloadVersion& version,
 
 bool ABGenerator::SplitSourceCopy(const AnnotatedOperation& original_aop,
                                   vector<AnnotatedOperation>* result_aops) {
-  InstallOperation original_op = original_aop.op;
+  const InstallOperation& original_op = original_aop.op;
   TEST_AND_RETURN_FALSE(original_op.type() == InstallOperation::SOURCE_COPY);
   // Keeps track of the index of curr_src_ext.
   int curr_src_ext_index = 0;
-  Extent curr_src_ext = original_op.src_extents(curr_src_ext_index);
+  BlockExtent curr_src_ext(original_op.src_extents(curr_src_ext_index));
   for (int i = 0; i < original_op.dst_extents_size(); i++) {
     const Extent& dst_ext = original_op.dst_extents(i);
     // The new operation which will have only one dst extent.
@@ -123,22 +229,21 @@ bool ABGenerator::SplitSourceCopy(const AnnotatedOperation& original_aop,
       if (curr_src_ext.num_blocks() <= blocks_left) {
         // If the curr_src_ext is smaller than dst_ext, add it.
         blocks_left -= curr_src_ext.num_blocks();
-        *(new_op.add_src_extents()) = curr_src_ext;
+        *(new_op.add_src_extents()) = curr_src_ext.ToExtent();
         if (curr_src_ext_index + 1 < original_op.src_extents().size()) {
-          curr_src_ext = original_op.src_extents(++curr_src_ext_index);
+          curr_src_ext =
+              BlockExtent(original_op.src_extents(++curr_src_ext_index));
         } else {
           break;
         }
       } else {
         // Split src_exts that are bigger than the dst_ext we're dealing with.
-        Extent first_ext;
-        first_ext.set_num_blocks(blocks_left);
-        first_ext.set_start_block(curr_src_ext.start_block());
-        *(new_op.add_src_extents()) = first_ext;
+        *(new_op.add_src_extents()) =
+            ExtentForRange(curr_src_ext.start_block(), blocks_left);
         // Keep the second half of the split op.
-        curr_src_ext.set_num_blocks(curr_src_ext.num_blocks() - blocks_left);
-        curr_src_ext.set_start_block(curr_src_ext.start_block() + blocks_left);
-        blocks_left -= first_ext.num_blocks();
+        curr_src_ext = BlockExtent(curr_src_ext.start_block() + blocks_left,
+                                   curr_src_ext.num_blocks() - blocks_left);
+        blocks_left = 0;
       }
     }
     // Fix up our new operation and add it to the results.
@@ -146,9 +251,9 @@ bool ABGenerator::SplitSourceCopy(const AnnotatedOperation& original_aop,
     *(new_op.add_dst_extents()) = dst_ext;
 
     AnnotatedOperation new_aop;
-    new_aop.op = new_op;
+    new_aop.op = std::move(new_op);
     new_aop.name = base::StringPrintf("%s:%d", original_aop.name.c_str(), i);
-    result_aops->push_back(new_aop);
+    result_aops->push_back(std::move(new_aop));
   }
   if (curr_src_ext_index != original_op.src_extents().size() - 1) {
     LOG(FATAL) << "Incorrectly split SOURCE_COPY operation. Did not use all "
@@ -162,7 +267,7 @@ bool ABGenerator::SplitAReplaceOp(const PayloadVersion& version,
                                   const string& target_part_path,
                                   vector<AnnotatedOperation>* result_aops,
                                   BlobFileWriter* blob_file) {
-  InstallOperation original_op = original_aop.op;
+  const InstallOperation& original_op = original_aop.op;
   TEST_AND_RETURN_FALSE(IsAReplaceOperation(original_op.type()));
   const bool is_replace = original_op.type() == InstallOperation::REPLACE;
 
@@ -182,12 +287,12 @@ bool ABGenerator::SplitAReplaceOp(const PayloadVersion& version,
     }
 
     AnnotatedOperation new_aop;
-    new_aop.op = new_op;
+    new_aop.op = std::move(new_op);
     new_aop.name = base::StringPrintf("%s:%d", original_aop.name.c_str(), i);
     TEST_AND_RETURN_FALSE(
         AddDataAndSetType(&new_aop, version, target_part_path, blob_file));
 
-    result_aops->push_back(new_aop);
+    result_aops->push_back(std::move(new_aop));
   }
   return true;
 }
@@ -198,9 +303,10 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
                                   const string& target_part_path,
                                   BlobFileWriter* blob_file) {
   vector<AnnotatedOperation> new_aops;
-  for (const AnnotatedOperation& curr_aop : *aops) {
+  new_aops.reserve(aops->size());
+  for (AnnotatedOperation& curr_aop : *aops) {
     if (new_aops.empty()) {
-      new_aops.push_back(curr_aop);
+      new_aops.push_back(std::move(curr_aop));
       continue;
     }
     AnnotatedOperation& last_aop = new_aops.back();
@@ -208,7 +314,7 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
 
     if (last_aop.op.dst_extents_size() <= 0 ||
         curr_aop.op.dst_extents_size() <= 0) {
-      new_aops.push_back(curr_aop);
+      new_aops.push_back(std::move(curr_aop));
       continue;
     }
     uint32_t last_dst_idx = last_aop.op.dst_extents_size() - 1;
@@ -230,8 +336,9 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
       // merge), are contiguous, are fragmented to have one destination extent,
       // and their combined block count would be less than chunk size, merge
       // them.
-      last_aop.name = base::StringPrintf(
-          "%s,%s", last_aop.name.c_str(), curr_aop.name.c_str());
+      // Appended in place, as reformatting the whole name every time is
+      // quadratic in the number of operations merged.
+      last_aop.name.append(",").append(curr_aop.name);
 
       if (is_delta_op) {
         ExtendExtents(last_aop.op.mutable_src_extents(),
@@ -244,21 +351,163 @@ bool ABGenerator::MergeOperations(vector<AnnotatedOperation>* aops,
         last_aop.op.set_data_length(0);
     } else {
       // Otherwise just include the extent as is.
-      new_aops.push_back(curr_aop);
+      new_aops.push_back(std::move(curr_aop));
     }
   }
 
   // Set the blobs for REPLACE/REPLACE_BZ/REPLACE_XZ operations that have been
-  // merged.
-  for (AnnotatedOperation& curr_aop : new_aops) {
-    if (curr_aop.op.data_length() == 0 &&
-        IsAReplaceOperation(curr_aop.op.type())) {
-      TEST_AND_RETURN_FALSE(
-          AddDataAndSetType(&curr_aop, version, target_part_path, blob_file));
+  // merged. Each of them reads and compresses its data again, so they are done
+  // in parallel.
+  vector<char> errors(new_aops.size());
+  {
+    TaskScheduler::TaskGroup data_tasks;
+    for (size_t i = 0; i < new_aops.size(); i++) {
+      AnnotatedOperation* curr_aop = &new_aops[i];
+      if (curr_aop->op.data_length() == 0 &&
+          IsAReplaceOperation(curr_aop->op.type())) {
+        data_tasks.Add([&, i, curr_aop] {
+          errors[i] = !AddDataAndSetType(
+              curr_aop, version, target_part_path, blob_file);
+        });
+      }
     }
+    data_tasks.Wait();
   }
+  TEST_AND_RETURN_FALSE(std::find(errors.begin(), errors.end(), true) ==
+                        errors.end());
 
-  *aops = new_aops;
+  *aops = std::move(new_aops);
+  return true;
+}
+
+uint64_t ABGenerator::GetOperationCost(const InstallOperation& op,
+                                       size_t target_blocks) {
+  const uint64_t num_blocks = utils::BlocksInExtents(op.dst_extents());
+  const uint64_t oversized_blocks =
+      num_blocks > target_blocks ? num_blocks - target_blocks : 0;
+  const uint64_t num_extents = op.src_extents_size() + op.dst_extents_size();
+  return kOperationOverheadBlocks + num_blocks +
+         kExtentOverheadBlocks * num_extents +
+         kOversizedBlockCost * oversized_blocks;
+}
+
+bool ABGenerator::OptimizeOperationGranularity(
+    vector<AnnotatedOperation>* aops,
+    const PayloadVersion& version,
+    size_t target_blocks,
+    size_t max_blocks,
+    const string& target_part_path,
+    BlobFileWriter* blob_file) {
+  TEST_AND_RETURN_FALSE(target_blocks > 0);
+  vector<AnnotatedOperation> new_aops;
+  new_aops.reserve(aops->size());
+  for (AnnotatedOperation& curr_aop : *aops) {
+    const InstallOperation& op = curr_aop.op;
+    const uint64_t num_blocks = utils::BlocksInExtents(op.dst_extents());
+    if (!IsResizableOperation(op) || num_blocks <= target_blocks) {
+      new_aops.push_back(std::move(curr_aop));
+      continue;
+    }
+    // Split in parts of |target_blocks| blocks, if they cost less.
+    vector<Extent> src_extents, dst_extents;
+    ExtentsToVector(op.src_extents(), &src_extents);
+    ExtentsToVector(op.dst_extents(), &dst_extents);
+    vector<AnnotatedOperation> parts;
+    uint64_t parts_cost = 0;
+    for (uint64_t offset = 0; offset < num_blocks; offset += target_blocks) {
+      AnnotatedOperation part;
+      part.name =
+          base::StringPrintf("%s:%zu", curr_aop.name.c_str(), parts.size());
+      part.op.set_type(op.type());
+      StoreExtents(ExtentsSublist(dst_extents, offset, target_blocks),
+                   part.op.mutable_dst_extents());
+      if (op.type() == InstallOperation::SOURCE_COPY) {
+        StoreExtents(ExtentsSublist(src_extents, offset, target_blocks),
+                     part.op.mutable_src_extents());
+      }
+      parts_cost += GetOperationCost(part.op, target_blocks);
+      parts.push_back(std::move(part));
+    }
+    if (parts_cost >= GetOperationCost(op, target_blocks)) {
+      new_aops.push_back(std::move(curr_aop));
+      continue;
+    }
+    // The data of the REPLACE_* parts is added below.
+    for (AnnotatedOperation& part : parts) {
+      new_aops.push_back(std::move(part));
+    }
+  }
+  *aops = std::move(new_aops);
+
+  new_aops.clear();
+  new_aops.reserve(aops->size());
+  for (AnnotatedOperation& curr_aop : *aops) {
+    if (new_aops.empty()) {
+      new_aops.push_back(std::move(curr_aop));
+      continue;
+    }
+    AnnotatedOperation& last_aop = new_aops.back();
+    const InstallOperation& last_op = last_aop.op;
+    const InstallOperation& curr_op = curr_aop.op;
+    const bool is_copy = curr_op.type() == InstallOperation::SOURCE_COPY &&
+                         last_op.type() == InstallOperation::SOURCE_COPY;
+    const bool is_replace = IsAReplaceOperation(curr_op.type()) &&
+                            IsAReplaceOperation(last_op.type());
+    if ((!is_copy && !is_replace) || last_op.dst_extents().empty() ||
+        curr_op.dst_extents().empty()) {
+      new_aops.push_back(std::move(curr_aop));
+      continue;
+    }
+    const Extent& last_extent =
+        last_op.dst_extents(last_op.dst_extents_size() - 1);
+    const bool contiguous = last_extent.start_block() +
+                                last_extent.num_blocks() ==
+                            curr_op.dst_extents(0).start_block();
+    InstallOperation merged_op = last_op;
+    if (is_copy) {
+      // The COW merge sequence needs a single destination extent.
+      if (!contiguous || last_op.dst_extents_size() != 1 ||
+          curr_op.dst_extents_size() != 1) {
+        new_aops.push_back(std::move(curr_aop));
+        continue;
+      }
+      ExtendExtents(merged_op.mutable_src_extents(), curr_op.src_extents());
+    }
+    ExtendExtents(merged_op.mutable_dst_extents(), curr_op.dst_extents());
+    if (utils::BlocksInExtents(merged_op.dst_extents()) > max_blocks ||
+        GetOperationCost(merged_op, target_blocks) >=
+            GetOperationCost(last_op, target_blocks) +
+                GetOperationCost(curr_op, target_blocks)) {
+      new_aops.push_back(std::move(curr_aop));
+      continue;
+    }
+    last_aop.name.append(",").append(curr_aop.name);
+    last_aop.op = std::move(merged_op);
+    // Set the data length to zero so we know to add the blob later.
+    if (is_replace)
+      last_aop.op.set_data_length(0);
+  }
+
+  // Set the blobs of the REPLACE_* operations split or merged, in parallel.
+  vector<char> errors(new_aops.size());
+  {
+    TaskScheduler::TaskGroup data_tasks;
+    for (size_t i = 0; i < new_aops.size(); i++) {
+      AnnotatedOperation* curr_aop = &new_aops[i];
+      if (curr_aop->op.data_length() == 0 &&
+          IsAReplaceOperation(curr_aop->op.type())) {
+        data_tasks.Add([&, i, curr_aop] {
+          errors[i] = !AddDataAndSetType(
+              curr_aop, version, target_part_path, blob_file);
+        });
+      }
+    }
+    data_tasks.Wait();
+  }
+  TEST_AND_RETURN_FALSE(std::find(errors.begin(), errors.end(), true) ==
+                        errors.end());
+
+  *aops = std::move(new_aops);
   return true;
 }
 
@@ -290,23 +539,41 @@ bool ABGenerator::AddDataAndSetType(AnnotatedOperation* aop,
 }
 
 bool ABGenerator::AddSourceHash(vector<AnnotatedOperation>* aops,
-                                const string& source_part_path) {
-  for (AnnotatedOperation& aop : *aops) {
-    if (aop.op.src_extents_size() == 0)
-      continue;
-
-    vector<Extent> src_extents;
-    ExtentsToVector(aop.op.src_extents(), &src_extents);
-    brillo::Blob src_data, src_hash;
-    uint64_t src_length =
-        aop.op.has_src_length()
-            ? aop.op.src_length()
-            : utils::BlocksInExtents(aop.op.src_extents()) * kBlockSize;
-    TEST_AND_RETURN_FALSE(utils::ReadExtents(
-        source_part_path, src_extents, &src_data, src_length, kBlockSize));
-    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(src_data, &src_hash));
-    aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+                                const string& source_part_path,
+                                HashAlgorithm algorithm) {
+  vector<char> errors(aops->size());
+  {
+    TaskScheduler::TaskGroup hash_tasks;
+    for (size_t i = 0; i < aops->size(); i++) {
+      AnnotatedOperation* aop = &(*aops)[i];
+      if (aop->op.src_extents_size() == 0)
+        continue;
+      hash_tasks.Add([&errors, &source_part_path, algorithm, i, aop] {
+        errors[i] = !AddOperationSourceHash(aop, source_part_path, algorithm);
+      });
+    }
+    hash_tasks.Wait();
   }
+  TEST_AND_RETURN_FALSE(std::find(errors.begin(), errors.end(), true) ==
+                        errors.end());
+  return true;
+}
+
+bool ABGenerator::AddOperationSourceHash(AnnotatedOperation* aop,
+                                         const string& source_part_path,
+                                         HashAlgorithm algorithm) {
+  vector<Extent> src_extents;
+  ExtentsToVector(aop->op.src_extents(), &src_extents);
+  brillo::Blob src_data, src_hash;
+  uint64_t src_length =
+      aop->op.has_src_length()
+          ? aop->op.src_length()
+          : utils::BlocksInExtents(aop->op.src_extents()) * kBlockSize;
+  TEST_AND_RETURN_FALSE(utils::ReadExtents(
+      source_part_path, src_extents, &src_data, src_length, kBlockSize));
+  TEST_AND_RETURN_FALSE(
+      HashCalculator::RawHashOfData(src_data, &src_hash, algorithm));
+  aop->op.set_src_sha256_hash(src_hash.data(), src_hash.size());
   return true;
 }
 
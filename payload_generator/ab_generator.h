@@ -72,6 +72,12 @@ class ABGenerator : public OperationsGenerator {
   static void SortOperationsByDestination(
       std::vector<AnnotatedOperation>* aops);
 
+  // Sorts the operations |aops|, in destination order, by the first block of
+  // their source, so that applying them reads the source partition as
+  // sequentially as possible. An operation without a source stays after the
+  // one it followed.
+  static void SortOperationsBySource(std::vector<AnnotatedOperation>* aops);
+
   // Takes an SOURCE_COPY install operation, |aop|, and adds one operation for
   // each dst extent in |aop| to |ops|. The new operations added to |ops| will
   // have only one dst extent. The src extents are split so the number of blocks
@@ -109,10 +115,33 @@ class ABGenerator : public OperationsGenerator {
                               const std::string& target_part,
                               BlobFileWriter* blob_file);
 
-  // Takes a vector of AnnotatedOperations |aops|, adds source hash to all
-  // operations that have src_extents.
+  // Takes a sorted (by first destination extent) vector of operations |aops|
+  // and splits or merges its SOURCE_COPY and REPLACE_* operations toward
+  // |target_blocks| blocks each, where GetOperationCost() estimates applying
+  // them costs less. More operations cost more of the fixed overhead of each
+  // one on the device, while larger ones make the pipelining and the
+  // checkpoints coarser. Operations are split in parts of |target_blocks|
+  // blocks, and consecutive operations of the same kind merged, SOURCE_COPY
+  // ones only if they write next to each other. The operations are kept to
+  // at most |max_blocks| blocks.
+  static bool OptimizeOperationGranularity(
+      std::vector<AnnotatedOperation>* aops,
+      const PayloadVersion& version,
+      size_t target_blocks,
+      size_t max_blocks,
+      const std::string& target_part_path,
+      BlobFileWriter* blob_file);
+
+  // Returns the estimated cost of applying |op| on the device, in blocks
+  // applied, for operations of |target_blocks| blocks.
+  static uint64_t GetOperationCost(const InstallOperation& op,
+                                   size_t target_blocks);
+
+  // Takes a vector of AnnotatedOperations |aops|, adds source hash with
+  // |algorithm| to all operations that have src_extents.
   static bool AddSourceHash(std::vector<AnnotatedOperation>* aops,
-                            const std::string& source_part_path);
+                            const std::string& source_part_path,
+                            HashAlgorithm algorithm = HashAlgorithm::kSha256);
 
  private:
   // Adds the data payload for a REPLACE/REPLACE_BZ/REPLACE_XZ operation |aop|
@@ -127,6 +156,12 @@ class ABGenerator : public OperationsGenerator {
                                 const std::string& target_part_path,
                                 BlobFileWriter* blob_file);
 
+  // Sets the source hash of |aop|, which must have src_extents, from the data
+  // in |source_part_path|.
+  static bool AddOperationSourceHash(AnnotatedOperation* aop,
+                                     const std::string& source_part_path,
+                                     HashAlgorithm algorithm);
+
   DISALLOW_COPY_AND_ASSIGN(ABGenerator);
 };
 
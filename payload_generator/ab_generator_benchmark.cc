@@ -0,0 +1,111 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Measures the post-processing passes of ABGenerator over the operations of a
+// synthetic partition, with the names and extents of real file operations.
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include <base/strings/stringprintf.h>
+#include <benchmark/benchmark.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/ab_generator.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Returns |count| SOURCE_COPY operations of 4 blocks in random order, writing
+// contiguous blocks. Every other operation has 2 destination extents, as when
+// a file is fragmented.
+vector<AnnotatedOperation> ShuffledOperations(size_t count) {
+  vector<AnnotatedOperation> aops(count);
+  for (size_t i = 0; i < count; i++) {
+    AnnotatedOperation& aop = aops[i];
+    aop.name = base::StringPrintf("/system/app/App%zu/App%zu.apk", i, i);
+    aop.op.set_type(InstallOperation::SOURCE_COPY);
+    *aop.op.add_src_extents() = ExtentForRange(count * 4 + i * 4, 4);
+    if (i % 2) {
+      *aop.op.add_dst_extents() = ExtentForRange(i * 4, 2);
+      *aop.op.add_dst_extents() = ExtentForRange(i * 4 + 2, 2);
+    } else {
+      *aop.op.add_dst_extents() = ExtentForRange(i * 4, 4);
+    }
+  }
+  std::shuffle(aops.begin(), aops.end(), std::mt19937(42));
+  return aops;
+}
+
+void BM_FragmentOperations(benchmark::State& state) {
+  const vector<AnnotatedOperation> aops = ShuffledOperations(state.range(0));
+  const PayloadVersion version(kBrilloMajorPayloadVersion,
+                               kSourceMinorPayloadVersion);
+  for (auto _ : state) {
+    state.PauseTiming();
+    vector<AnnotatedOperation> fragmented = aops;
+    state.ResumeTiming();
+    benchmark::DoNotOptimize(ABGenerator::FragmentOperations(
+        version, &fragmented, "", nullptr));
+  }
+  state.SetItemsProcessed(state.iterations() * aops.size());
+}
+
+void BM_SortOperationsByDestination(benchmark::State& state) {
+  const vector<AnnotatedOperation> aops = ShuffledOperations(state.range(0));
+  for (auto _ : state) {
+    state.PauseTiming();
+    vector<AnnotatedOperation> sorted = aops;
+    state.ResumeTiming();
+    ABGenerator::SortOperationsByDestination(&sorted);
+    benchmark::DoNotOptimize(sorted);
+  }
+  state.SetItemsProcessed(state.iterations() * aops.size());
+}
+
+void BM_MergeOperations(benchmark::State& state) {
+  vector<AnnotatedOperation> aops = ShuffledOperations(state.range(0));
+  const PayloadVersion version(kBrilloMajorPayloadVersion,
+                               kSourceMinorPayloadVersion);
+  ABGenerator::FragmentOperations(version, &aops, "", nullptr);
+  ABGenerator::SortOperationsByDestination(&aops);
+  for (auto _ : state) {
+    state.PauseTiming();
+    vector<AnnotatedOperation> merged = aops;
+    state.ResumeTiming();
+    // Merge up to 2 MiB of blocks, the default soft chunk size.
+    benchmark::DoNotOptimize(
+        ABGenerator::MergeOperations(&merged, version, 512, "", nullptr));
+  }
+  state.SetItemsProcessed(state.iterations() * aops.size());
+}
+
+}  // namespace
+
+BENCHMARK(BM_FragmentOperations)->Arg(500000)->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_SortOperationsByDestination)
+    ->Arg(500000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_MergeOperations)->Arg(500000)->Unit(benchmark::kMillisecond);
+
+}  // namespace chromeos_update_engine
+
+BENCHMARK_MAIN();
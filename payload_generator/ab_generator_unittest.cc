@@ -22,6 +22,7 @@
 
 #include <random>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -31,6 +32,7 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/xz.h"
@@ -428,6 +430,30 @@ TEST_F(ABGeneratorTest, SortOperationsByDestinationTest) {
   EXPECT_EQ(second_aop.name, aops[2].name);
 }
 
+TEST_F(ABGeneratorTest, SortOperationsBySourceTest) {
+  vector<AnnotatedOperation> aops;
+  auto add_aop = [&aops](const string& name, int64_t src_block) {
+    AnnotatedOperation aop;
+    aop.name = name;
+    if (src_block >= 0)
+      *(aop.op.add_src_extents()) = ExtentForRange(src_block, 1);
+    *(aop.op.add_dst_extents()) = ExtentForRange(aops.size(), 1);
+    aops.push_back(aop);
+  };
+  add_aop("a", 20);
+  add_aop("b", 5);
+  // Without a source, stays after "b".
+  add_aop("c", -1);
+  add_aop("d", 10);
+  add_aop("e", 5);
+
+  ABGenerator::SortOperationsBySource(&aops);
+  vector<string> names;
+  for (const AnnotatedOperation& aop : aops)
+    names.push_back(aop.name);
+  EXPECT_EQ((vector<string>{"b", "c", "e", "d", "a"}), names);
+}
+
 TEST_F(ABGeneratorTest, MergeSourceCopyOperationsTest) {
   vector<AnnotatedOperation> aops;
   InstallOperation first_op;
@@ -541,6 +567,111 @@ TEST_F(ABGeneratorTest, NoMergeOperationsTest) {
   EXPECT_EQ(4U, aops.size());
 }
 
+TEST_F(ABGeneratorTest, GetOperationCostTest) {
+  InstallOperation op;
+  op.set_type(InstallOperation::SOURCE_COPY);
+  *(op.add_src_extents()) = ExtentForRange(0, 10);
+  *(op.add_dst_extents()) = ExtentForRange(20, 10);
+  // The overhead of the operation and its extents, and its blocks.
+  EXPECT_EQ(44U, ABGenerator::GetOperationCost(op, 16));
+  // And the blocks past the target.
+  EXPECT_EQ(46U, ABGenerator::GetOperationCost(op, 8));
+}
+
+TEST_F(ABGeneratorTest, OptimizeSourceCopyGranularityTest) {
+  vector<AnnotatedOperation> aops;
+  const vector<std::pair<Extent, Extent>> extents = {
+      {ExtentForRange(1000, 256), ExtentForRange(0, 256)},
+      {ExtentForRange(2000, 10), ExtentForRange(256, 10)},
+      {ExtentForRange(3000, 10), ExtentForRange(266, 10)},
+      // Not next to the previous one.
+      {ExtentForRange(4000, 10), ExtentForRange(300, 10)}};
+  for (const auto& [src_extent, dst_extent] : extents) {
+    AnnotatedOperation aop;
+    aop.op.set_type(InstallOperation::SOURCE_COPY);
+    *(aop.op.add_src_extents()) = src_extent;
+    *(aop.op.add_dst_extents()) = dst_extent;
+    aop.name = std::to_string(aops.size() + 1);
+    aops.push_back(aop);
+  }
+  uint64_t cost = 0;
+  for (const AnnotatedOperation& aop : aops)
+    cost += ABGenerator::GetOperationCost(aop.op, 64);
+
+  BlobFileWriter blob_file(0, nullptr);
+  PayloadVersion version(kBrilloMajorPayloadVersion,
+                         kSourceMinorPayloadVersion);
+  EXPECT_TRUE(ABGenerator::OptimizeOperationGranularity(
+      &aops, version, 64, 1024, "", &blob_file));
+
+  // The large operation is split, and its last part merged with the small
+  // ones following it, a bit over the target for less overhead.
+  ASSERT_EQ(5U, aops.size());
+  for (size_t i = 0; i < 3; i++) {
+    EXPECT_EQ("1:" + std::to_string(i), aops[i].name);
+    ASSERT_EQ(1, aops[i].op.src_extents_size());
+    EXPECT_TRUE(ExtentEquals(aops[i].op.src_extents(0), 1000 + i * 64, 64));
+    ASSERT_EQ(1, aops[i].op.dst_extents_size());
+    EXPECT_TRUE(ExtentEquals(aops[i].op.dst_extents(0), i * 64, 64));
+  }
+  EXPECT_EQ("1:3,2,3", aops[3].name);
+  ASSERT_EQ(3, aops[3].op.src_extents_size());
+  EXPECT_TRUE(ExtentEquals(aops[3].op.src_extents(0), 1192, 64));
+  EXPECT_TRUE(ExtentEquals(aops[3].op.src_extents(1), 2000, 10));
+  EXPECT_TRUE(ExtentEquals(aops[3].op.src_extents(2), 3000, 10));
+  ASSERT_EQ(1, aops[3].op.dst_extents_size());
+  EXPECT_TRUE(ExtentEquals(aops[3].op.dst_extents(0), 192, 84));
+  EXPECT_EQ("4", aops[4].name);
+
+  uint64_t new_cost = 0;
+  for (const AnnotatedOperation& aop : aops)
+    new_cost += ABGenerator::GetOperationCost(aop.op, 64);
+  EXPECT_LT(new_cost, cost);
+}
+
+TEST_F(ABGeneratorTest, OptimizeReplaceGranularityTest) {
+  const size_t part_num_blocks = 214;
+  brillo::Blob part_data(part_num_blocks * kBlockSize);
+  test_utils::FillWithData(&part_data);
+  ScopedTempFile part_file("OptimizeReplaceGranularityTest_part.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(part_file.path(), part_data));
+  ScopedTempFile data_file("OptimizeReplaceGranularityTest_data.XXXXXX");
+  int data_fd = open(data_file.path().c_str(), O_RDWR, 000);
+  EXPECT_GE(data_fd, 0);
+  ScopedFdCloser data_fd_closer(&data_fd);
+  off_t data_file_size = 0;
+  BlobFileWriter blob_file(data_fd, &data_file_size);
+
+  vector<AnnotatedOperation> aops(2);
+  aops[0].name = "a";
+  aops[0].op.set_type(InstallOperation::REPLACE);
+  *(aops[0].op.add_dst_extents()) = ExtentForRange(0, 200);
+  aops[0].op.set_data_length(200 * kBlockSize);
+  // Not next to the first one, which REPLACE operations may still merge.
+  aops[1].name = "b";
+  aops[1].op.set_type(InstallOperation::REPLACE);
+  *(aops[1].op.add_dst_extents()) = ExtentForRange(210, 4);
+  aops[1].op.set_data_length(4 * kBlockSize);
+
+  PayloadVersion version(kBrilloMajorPayloadVersion,
+                         kSourceMinorPayloadVersion);
+  EXPECT_TRUE(ABGenerator::OptimizeOperationGranularity(
+      &aops, version, 64, 1024, part_file.path(), &blob_file));
+
+  // The short last part is merged back, with the second operation.
+  ASSERT_EQ(3U, aops.size());
+  EXPECT_EQ("a:0", aops[0].name);
+  EXPECT_EQ("a:1", aops[1].name);
+  EXPECT_EQ("a:2,a:3,b", aops[2].name);
+  ASSERT_EQ(2, aops[2].op.dst_extents_size());
+  EXPECT_TRUE(ExtentEquals(aops[2].op.dst_extents(0), 128, 72));
+  EXPECT_TRUE(ExtentEquals(aops[2].op.dst_extents(1), 210, 4));
+  for (const AnnotatedOperation& aop : aops) {
+    EXPECT_TRUE(diff_utils::IsAReplaceOperation(aop.op.type()));
+    EXPECT_GT(aop.op.data_length(), 0U);
+  }
+}
+
 TEST_F(ABGeneratorTest, AddSourceHashTest) {
   vector<AnnotatedOperation> aops;
   InstallOperation first_op;
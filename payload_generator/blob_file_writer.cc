@@ -21,12 +21,16 @@
 namespace chromeos_update_engine {
 
 off_t BlobFileWriter::StoreBlob(const brillo::Blob& blob) {
-  base::AutoLock auto_lock(blob_mutex_);
-  if (!utils::PWriteAll(blob_fd_, blob.data(), blob.size(), *blob_file_size_))
+  // Reserve the range of the blob, so that it is written without waiting for
+  // the other blobs being stored.
+  const off_t result = next_offset_.fetch_add(static_cast<off_t>(blob.size()));
+  if (!utils::PWriteAll(blob_fd_, blob.data(), blob.size(), result))
     return -1;
 
-  off_t result = *blob_file_size_;
-  *blob_file_size_ += blob.size();
+  base::AutoLock auto_lock(blob_mutex_);
+  const off_t blob_end = result + static_cast<off_t>(blob.size());
+  if (*blob_file_size_ < blob_end)
+    *blob_file_size_ = blob_end;
 
   stored_blobs_++;
   if (total_blobs_ > 0 && (10 * (stored_blobs_ - 1) / total_blobs_) !=
@@ -17,6 +17,8 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOB_FILE_WRITER_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOB_FILE_WRITER_H_
 
+#include <atomic>
+
 #include <base/macros.h>
 
 #include <base/synchronization/lock.h>
@@ -27,12 +29,16 @@ namespace chromeos_update_engine {
 class BlobFileWriter {
  public:
   // Create the BlobFileWriter object that will manage the blobs stored to
-  // |blob_fd| in a thread safe way.
+  // |blob_fd| in a thread safe way. The blobs are appended from offset
+  // |*blob_file_size|, which is set to the end of the blobs stored.
   BlobFileWriter(int blob_fd, off_t* blob_file_size)
-      : blob_fd_(blob_fd), blob_file_size_(blob_file_size) {}
+      : next_offset_(blob_file_size ? *blob_file_size : 0),
+        blob_fd_(blob_fd),
+        blob_file_size_(blob_file_size) {}
 
   // Store the passed |blob| in the blob file. Returns the offset at which it
-  // was stored, or -1 in case of failure.
+  // was stored, or -1 in case of failure. Blobs stored at the same time are
+  // written concurrently, each to the range of the file reserved for it.
   off_t StoreBlob(const brillo::Blob& blob);
 
   // Increase |total_blobs| by |increment|. Thread safe.
@@ -42,8 +48,12 @@ class BlobFileWriter {
   size_t total_blobs_{0};
   size_t stored_blobs_{0};
 
-  // The file and its size are protected with the |blob_mutex_|.
+  // The offset of the next blob to store.
+  std::atomic<off_t> next_offset_;
+
   int blob_fd_;
+  // The size of the file, as well as the counts of blobs, are protected with
+  // the |blob_mutex_|, which isn't held while writing.
   off_t* blob_file_size_;
 
   base::Lock blob_mutex_;
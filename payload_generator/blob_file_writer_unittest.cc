@@ -17,6 +17,8 @@
 #include "update_engine/payload_generator/blob_file_writer.h"
 
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -49,4 +51,44 @@ TEST(BlobFileWriterTest, SimpleTest) {
   EXPECT_EQ(blob, stored_blob);
 }
 
+TEST(BlobFileWriterTest, ConcurrentTest) {
+  ScopedTempFile blob_file("BlobFileWriterTest.XXXXXX", true);
+  off_t blob_file_size = 0;
+  BlobFileWriter blob_file_writer(blob_file.fd(), &blob_file_size);
+
+  constexpr size_t kNumThreads = 8;
+  constexpr size_t kBlobsPerThread = 16;
+  std::vector<brillo::Blob> blobs(kNumThreads * kBlobsPerThread);
+  for (size_t i = 0; i < blobs.size(); i++) {
+    blobs[i].resize(100 + i);
+    FillWithData(&blobs[i]);
+    blobs[i][0] = i;
+  }
+  std::vector<off_t> offsets(blobs.size(), -1);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < kNumThreads; t++) {
+    threads.emplace_back([&, t] {
+      for (size_t i = t * kBlobsPerThread; i < (t + 1) * kBlobsPerThread; i++)
+        offsets[i] = blob_file_writer.StoreBlob(blobs[i]);
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+
+  off_t total_size = 0;
+  for (size_t i = 0; i < blobs.size(); i++) {
+    ASSERT_NE(-1, offsets[i]);
+    brillo::Blob stored_blob(blobs[i].size());
+    ssize_t bytes_read;
+    ASSERT_TRUE(utils::PReadAll(blob_file.fd(),
+                                stored_blob.data(),
+                                stored_blob.size(),
+                                offsets[i],
+                                &bytes_read));
+    EXPECT_EQ(blobs[i], stored_blob);
+    total_size += blobs[i].size();
+  }
+  EXPECT_EQ(total_size, blob_file_size);
+}
+
 }  // namespace chromeos_update_engine
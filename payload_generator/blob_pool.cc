@@ -0,0 +1,154 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/blob_pool.h"
+
+#include <malloc.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Returns the size class of the blobs of at least |size| bytes.
+size_t ClassForSize(size_t size) {
+  size_t size_class = 0;
+  while ((BlobPool::kMinBlobSize << size_class) < size)
+    size_class++;
+  return size_class;
+}
+
+// Returns the largest size class of the blobs |capacity| bytes fit.
+size_t ClassForCapacity(size_t capacity) {
+  size_t size_class = 0;
+  while (size_class + 1 < BlobPool::kNumClasses &&
+         (BlobPool::kMinBlobSize << (size_class + 1)) <= capacity) {
+    size_class++;
+  }
+  return size_class;
+}
+
+}  // namespace
+
+BlobPool::ThreadCache::ThreadCache() {
+  BlobPool* pool = BlobPool::Get();
+  std::lock_guard<std::mutex> lock(pool->mutex_);
+  pool->thread_caches_.push_back(this);
+}
+
+BlobPool::ThreadCache::~ThreadCache() {
+  BlobPool* pool = BlobPool::Get();
+  std::lock_guard<std::mutex> lock(pool->mutex_);
+  auto& caches = pool->thread_caches_;
+  caches.erase(std::remove(caches.begin(), caches.end(), this), caches.end());
+}
+
+BlobPool* BlobPool::Get() {
+  // Never destroyed, the threads may still release blobs at exit.
+  static BlobPool* pool = new BlobPool();
+  return pool;
+}
+
+BlobPool::ThreadCache* BlobPool::GetThreadCache() {
+  thread_local ThreadCache cache;
+  return &cache;
+}
+
+brillo::Blob BlobPool::Acquire(size_t size) {
+  brillo::Blob blob;
+  if (size < kMinBlobSize || size > kMaxBlobSize) {
+    blob.reserve(size);
+    return blob;
+  }
+  const size_t size_class = ClassForSize(size);
+  ThreadCache* cache = GetThreadCache();
+  {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    if (cache->blobs[size_class].capacity() > 0) {
+      return std::move(cache->blobs[size_class]);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& free_blobs = free_blobs_[size_class];
+    if (!free_blobs.empty()) {
+      blob = std::move(free_blobs.back());
+      free_blobs.pop_back();
+      pooled_bytes_ -= blob.capacity();
+      return blob;
+    }
+  }
+  blob.reserve(kMinBlobSize << size_class);
+  return blob;
+}
+
+void BlobPool::Release(brillo::Blob&& blob) {
+  brillo::Blob released = std::move(blob);
+  const size_t capacity = released.capacity();
+  if (capacity < kMinBlobSize || capacity > kMaxBlobSize)
+    return;
+  released.clear();
+  const size_t size_class = ClassForCapacity(capacity);
+  ThreadCache* cache = GetThreadCache();
+  {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    if (cache->blobs[size_class].capacity() == 0) {
+      cache->blobs[size_class] = std::move(released);
+      return;
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (pooled_bytes_ + capacity > max_pooled_bytes_)
+    return;
+  pooled_bytes_ += capacity;
+  free_blobs_[size_class].push_back(std::move(released));
+}
+
+void BlobPool::Trim() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (ThreadCache* cache : thread_caches_) {
+      std::lock_guard<std::mutex> cache_lock(cache->mutex);
+      for (auto& cached_blob : cache->blobs)
+        brillo::Blob().swap(cached_blob);
+    }
+    for (auto& free_blobs : free_blobs_)
+      std::vector<brillo::Blob>().swap(free_blobs);
+    pooled_bytes_ = 0;
+  }
+#ifdef __GLIBC__
+  malloc_trim(0);
+#endif
+}
+
+uint64_t BlobPool::max_pooled_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return max_pooled_bytes_;
+}
+
+void BlobPool::set_max_pooled_bytes(uint64_t max_pooled_bytes) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_pooled_bytes_ = max_pooled_bytes;
+}
+
+uint64_t BlobPool::pooled_bytes() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pooled_bytes_;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,115 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOB_POOL_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOB_POOL_H_
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+namespace chromeos_update_engine {
+
+// A pool of the large buffers the generator workers read the old and new data
+// into, so that they are reused rather than freed and allocated again. With
+// many threads, malloc serves them from per-thread arenas that fragment, and
+// the generator ends up taking much more memory than the data it holds.
+//
+// The buffers are kept by size class, powers of two from kMinBlobSize up to
+// kMaxBlobSize. Each thread keeps one buffer per size class for itself, and
+// gives the others to the pool shared by all threads, which keeps up to
+// max_pooled_bytes() of them. Trim() frees all of them and returns the free
+// memory to the OS. Thread safe.
+class BlobPool {
+ public:
+  static constexpr size_t kMinBlobSize = 64 * 1024;           // bytes
+  static constexpr size_t kMaxBlobSize = 256 * 1024 * 1024;   // bytes
+  static constexpr uint64_t kDefaultMaxPooledBytes = 1024 * 1024 * 1024;
+
+  // Returns the pool of the process.
+  static BlobPool* Get();
+
+  // Returns an empty blob with room for at least |size| bytes, from the pool
+  // if it has one.
+  brillo::Blob Acquire(size_t size);
+
+  // Gives |blob| back to the pool, which frees it if it is too small or too
+  // large to be pooled, or the pool is full.
+  void Release(brillo::Blob&& blob);
+
+  // Frees all the pooled blobs, those kept by the threads included, and
+  // returns the free memory of the heap to the OS.
+  void Trim();
+
+  uint64_t max_pooled_bytes() const;
+  void set_max_pooled_bytes(uint64_t max_pooled_bytes);
+
+  // The bytes of the blobs pooled, not counting those kept by the threads.
+  uint64_t pooled_bytes() const;
+
+  // The number of size classes.
+  static constexpr size_t kNumClasses = 13;
+  static_assert(kMinBlobSize << (kNumClasses - 1) == kMaxBlobSize);
+
+ private:
+  // The blobs a thread keeps for itself, one per size class. Its mutex is
+  // only contended by Trim().
+  struct ThreadCache {
+    ThreadCache();
+    ~ThreadCache();
+    std::mutex mutex;
+    std::array<brillo::Blob, kNumClasses> blobs;
+  };
+
+  BlobPool() = default;
+
+  ThreadCache* GetThreadCache();
+
+  mutable std::mutex mutex_;
+  std::array<std::vector<brillo::Blob>, kNumClasses> free_blobs_;
+  uint64_t pooled_bytes_{0};
+  uint64_t max_pooled_bytes_{kDefaultMaxPooledBytes};
+  // The caches of the threads alive, for Trim() to free them.
+  std::vector<ThreadCache*> thread_caches_;
+
+  DISALLOW_COPY_AND_ASSIGN(BlobPool);
+};
+
+// A blob of the BlobPool, given back to it when going out of scope.
+class PooledBlob {
+ public:
+  explicit PooledBlob(size_t size) : blob_(BlobPool::Get()->Acquire(size)) {}
+  ~PooledBlob() { BlobPool::Get()->Release(std::move(blob_)); }
+
+  brillo::Blob* get() { return &blob_; }
+  brillo::Blob& operator*() { return blob_; }
+  brillo::Blob* operator->() { return &blob_; }
+
+ private:
+  brillo::Blob blob_;
+
+  DISALLOW_COPY_AND_ASSIGN(PooledBlob);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOB_POOL_H_
@@ -0,0 +1,105 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/blob_pool.h"
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+class BlobPoolTest : public ::testing::Test {
+ protected:
+  void SetUp() override { pool_->Trim(); }
+  void TearDown() override {
+    pool_->set_max_pooled_bytes(BlobPool::kDefaultMaxPooledBytes);
+    pool_->Trim();
+  }
+
+  BlobPool* pool_ = BlobPool::Get();
+};
+
+TEST_F(BlobPoolTest, AcquireTest) {
+  brillo::Blob blob = pool_->Acquire(100000);
+  EXPECT_TRUE(blob.empty());
+  EXPECT_GE(blob.capacity(), 100000u);
+
+  // Outside of the size classes.
+  blob = pool_->Acquire(100);
+  EXPECT_GE(blob.capacity(), 100u);
+}
+
+TEST_F(BlobPoolTest, ReuseTest) {
+  brillo::Blob blob = pool_->Acquire(2 * BlobPool::kMinBlobSize);
+  blob.resize(2 * BlobPool::kMinBlobSize, 1);
+  const uint8_t* data = blob.data();
+  pool_->Release(std::move(blob));
+
+  // Kept by this thread, in the size class of the blobs asked for.
+  blob = pool_->Acquire(2 * BlobPool::kMinBlobSize - 1);
+  EXPECT_EQ(data, blob.data());
+  EXPECT_TRUE(blob.empty());
+  EXPECT_EQ(0u, pool_->pooled_bytes());
+}
+
+TEST_F(BlobPoolTest, SharedBetweenThreadsTest) {
+  brillo::Blob first = pool_->Acquire(BlobPool::kMinBlobSize);
+  brillo::Blob second = pool_->Acquire(BlobPool::kMinBlobSize);
+  const uint8_t* data = second.data();
+  pool_->Release(std::move(first));
+  pool_->Release(std::move(second));
+  EXPECT_GE(pool_->pooled_bytes(), BlobPool::kMinBlobSize);
+
+  const uint8_t* other_data = nullptr;
+  std::thread thread([this, &other_data] {
+    brillo::Blob blob = pool_->Acquire(BlobPool::kMinBlobSize);
+    other_data = blob.data();
+  });
+  thread.join();
+  EXPECT_EQ(data, other_data);
+  EXPECT_EQ(0u, pool_->pooled_bytes());
+}
+
+TEST_F(BlobPoolTest, MaxPooledBytesTest) {
+  pool_->set_max_pooled_bytes(0);
+  brillo::Blob first = pool_->Acquire(BlobPool::kMinBlobSize);
+  brillo::Blob second = pool_->Acquire(BlobPool::kMinBlobSize);
+  pool_->Release(std::move(first));
+  pool_->Release(std::move(second));
+  EXPECT_EQ(0u, pool_->pooled_bytes());
+}
+
+TEST_F(BlobPoolTest, SmallBlobsAreNotPooledTest) {
+  for (int i = 0; i < 2; i++) {
+    brillo::Blob blob(1024);
+    pool_->Release(std::move(blob));
+  }
+  EXPECT_EQ(0u, pool_->pooled_bytes());
+}
+
+TEST_F(BlobPoolTest, TrimTest) {
+  brillo::Blob first = pool_->Acquire(BlobPool::kMinBlobSize);
+  brillo::Blob second = pool_->Acquire(BlobPool::kMinBlobSize);
+  pool_->Release(std::move(first));
+  pool_->Release(std::move(second));
+  EXPECT_GT(pool_->pooled_bytes(), 0u);
+
+  pool_->Trim();
+  EXPECT_EQ(0u, pool_->pooled_bytes());
+}
+
+}  // namespace chromeos_update_engine
@@ -20,29 +20,95 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <functional>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 
 using std::string;
 using std::vector;
 
 namespace {
 
-size_t HashValue(const brillo::Blob& blob) {
-  std::hash<string> hash_fn;
-  return hash_fn(string(blob.begin(), blob.end()));
+// Blocks read from disk at once by AddManyDiskBlocks().
+constexpr size_t kReadChunkSize = 16 * 1024 * 1024;
+// Blocks hashed by each task of AddManyDiskBlocks().
+constexpr size_t kHashSliceBlocks = 512;
+// Most BlockMappings MapPartitionBlocks() maps blocks into at once.
+constexpr size_t kMaxBlockMappingShards = 64;
+
+size_t HashValue(const uint8_t* data, size_t size) {
+  return std::hash<std::string_view>()(
+      std::string_view(reinterpret_cast<const char*>(data), size));
 }
 
 }  // namespace
 
 namespace chromeos_update_engine {
 
+namespace {
+
+// Blocks read from disk at once, with the hash of each of them and whether
+// they are all zeros.
+struct BlockChunk {
+  brillo::Blob data;
+  vector<size_t> hashes;
+  // Not vector<bool>, as its elements are written concurrently.
+  vector<uint8_t> zeros;
+  size_t blocks_read{0};
+};
+
+// Reads up to |num_blocks| blocks of |block_size| bytes from |fd| at
+// |byte_offset| into |chunk|, stopping at the end of the file, and hashes them
+// on the threads of the TaskScheduler.
+bool ReadChunk(int fd,
+               off_t byte_offset,
+               size_t num_blocks,
+               size_t block_size,
+               BlockChunk* chunk) {
+  chunk->data.resize(num_blocks * block_size);
+  chunk->hashes.resize(num_blocks);
+  chunk->zeros.resize(num_blocks);
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
+                                        chunk->data.data(),
+                                        num_blocks * block_size,
+                                        byte_offset,
+                                        &bytes_read));
+  chunk->blocks_read = bytes_read / block_size;
+  TaskScheduler::TaskGroup hash_tasks;
+  for (size_t slice = 0; slice < chunk->blocks_read;
+       slice += kHashSliceBlocks) {
+    hash_tasks.Add([chunk, block_size, slice] {
+      const size_t end = std::min(slice + kHashSliceBlocks, chunk->blocks_read);
+      for (size_t i = slice; i < end; i++) {
+        const uint8_t* data = chunk->data.data() + i * block_size;
+        chunk->hashes[i] = HashValue(data, block_size);
+        chunk->zeros[i] = utils::IsZero(data, block_size);
+      }
+    });
+  }
+  hash_tasks.Wait();
+  return true;
+}
+
+}  // namespace
+
 BlockMapping::BlockId BlockMapping::AddBlock(const brillo::Blob& block_data) {
-  return AddBlock(-1, 0, block_data);
+  if (block_data.size() != block_size_)
+    return -1;
+  return AddHashedBlock(-1,
+                        0,
+                        block_data.data(),
+                        HashValue(block_data.data(), block_size_),
+                        utils::IsZero(block_data.data(), block_size_));
 }
 
 BlockMapping::BlockId BlockMapping::AddDiskBlock(int fd, off_t byte_offset) {
@@ -52,7 +118,11 @@ BlockMapping::BlockId BlockMapping::AddDiskBlock(int fd, off_t byte_offset) {
     return -1;
   if (static_cast<size_t>(bytes_read) != block_size_)
     return -1;
-  return AddBlock(fd, byte_offset, blob);
+  return AddHashedBlock(fd,
+                        byte_offset,
+                        blob.data(),
+                        HashValue(blob.data(), block_size_),
+                        utils::IsZero(blob.data(), block_size_));
 }
 
 bool BlockMapping::AddManyDiskBlocks(int fd,
@@ -60,34 +130,52 @@ bool BlockMapping::AddManyDiskBlocks(int fd,
                                      size_t num_blocks,
                                      vector<BlockId>* block_ids) {
   bool ret = true;
-  block_ids->resize(num_blocks);
-  for (size_t block = 0; block < num_blocks; block++) {
-    (*block_ids)[block] =
-        AddDiskBlock(fd, initial_byte_offset + block * block_size_);
-    ret = ret && (*block_ids)[block] != -1;
+  block_ids->assign(num_blocks, -1);
+  const size_t chunk_blocks = std::max<size_t>(kReadChunkSize / block_size_, 1);
+  BlockChunk chunk;
+  for (size_t first = 0; first < num_blocks; first += chunk_blocks) {
+    // Read and hash many blocks at once, and only then add them one after
+    // another so that block ids are assigned in order.
+    const size_t blocks = std::min(chunk_blocks, num_blocks - first);
+    const off_t chunk_offset = initial_byte_offset + first * block_size_;
+    TEST_AND_RETURN_FALSE(
+        ReadChunk(fd, chunk_offset, blocks, block_size_, &chunk));
+    for (size_t i = 0; i < chunk.blocks_read; i++) {
+      (*block_ids)[first + i] =
+          AddHashedBlock(fd,
+                         chunk_offset + i * block_size_,
+                         chunk.data.data() + i * block_size_,
+                         chunk.hashes[i],
+                         chunk.zeros[i]);
+      ret = ret && (*block_ids)[first + i] != -1;
+    }
+    // Blocks past the end of the file are left as -1.
+    ret = ret && chunk.blocks_read == blocks;
   }
   return ret;
 }
 
-BlockMapping::BlockId BlockMapping::AddBlock(int fd,
-                                             off_t byte_offset,
-                                             const brillo::Blob& block_data) {
-  if (block_data.size() != block_size_)
-    return -1;
-  size_t h = HashValue(block_data);
+BlockMapping::BlockId BlockMapping::AddHashedBlock(int fd,
+                                                   off_t byte_offset,
+                                                   const uint8_t* block_data,
+                                                   size_t hash,
+                                                   bool is_zero) {
+  // All zero blocks are common enough to skip looking them up.
+  if (is_zero && zero_block_id_ != -1)
+    return zero_block_id_;
 
   // We either reuse a UniqueBlock or create a new one. If we need a new
   // UniqueBlock it could also be part of a new or existing bucket (if there is
   // a hash collision).
   vector<UniqueBlock>* bucket = nullptr;
 
-  auto mapping_it = mapping_.find(h);
+  auto mapping_it = mapping_.find(hash);
   if (mapping_it == mapping_.end()) {
-    bucket = &mapping_[h];
+    bucket = &mapping_[hash];
   } else {
     for (UniqueBlock& existing_block : mapping_it->second) {
       bool equals = false;
-      if (!existing_block.CompareData(block_data, &equals))
+      if (!existing_block.CompareData(block_data, block_size_, &equals))
         return -1;
       if (equals)
         return existing_block.block_id;
@@ -106,25 +194,27 @@ BlockMapping::BlockId BlockMapping::AddBlock(int fd,
   new_ublock->block_id = used_block_ids++;
   // We need to cache blocks that are not referencing any disk location.
   if (fd == -1)
-    new_ublock->block_data = block_data;
+    new_ublock->block_data.assign(block_data, block_data + block_size_);
+  if (is_zero)
+    zero_block_id_ = new_ublock->block_id;
 
   return new_ublock->block_id;
 }
 
-bool BlockMapping::UniqueBlock::CompareData(const brillo::Blob& other_block,
+bool BlockMapping::UniqueBlock::CompareData(const uint8_t* other_block,
+                                            size_t block_size,
                                             bool* equals) {
   if (!block_data.empty()) {
-    *equals = block_data == other_block;
+    *equals = memcmp(block_data.data(), other_block, block_size) == 0;
     return true;
   }
-  const size_t block_size = other_block.size();
   brillo::Blob blob(block_size);
   ssize_t bytes_read = 0;
   if (!utils::PReadAll(fd, blob.data(), block_size, byte_offset, &bytes_read))
     return false;
   if (static_cast<size_t>(bytes_read) != block_size)
     return false;
-  *equals = blob == other_block;
+  *equals = memcmp(blob.data(), other_block, block_size) == 0;
 
   // We increase the number of times we had to read this block from disk and
   // we cache this block based on that. This caching method is optimized for
@@ -144,18 +234,116 @@ bool MapPartitionBlocks(const string& old_part,
                         size_t block_size,
                         vector<BlockMapping::BlockId>* old_block_ids,
                         vector<BlockMapping::BlockId>* new_block_ids) {
-  BlockMapping mapping(block_size);
-  if (mapping.AddBlock(brillo::Blob(block_size, '\0')) != 0)
-    return false;
+  // Blocks are sharded by hash, so that equal blocks always land in the same
+  // shard and the shards can be mapped concurrently. Each shard numbers its
+  // blocks in order of first appearance; merging these orders gives the ids a
+  // single BlockMapping would have given, whatever the number of shards.
+  const size_t num_shards = std::clamp<size_t>(
+      TaskScheduler::Get()->num_threads(), 1, kMaxBlockMappingShards);
+  vector<BlockMapping> shards(num_shards, BlockMapping(block_size));
+  // The position of the first block with each id of each shard, the zero block
+  // being position 0, followed by the old then the new blocks.
+  vector<vector<uint64_t>> first_positions(num_shards);
+
+  const brillo::Blob zero_block(block_size, '\0');
+  const size_t zero_hash = HashValue(zero_block.data(), block_size);
+  TEST_AND_RETURN_FALSE(shards[zero_hash % num_shards].AddHashedBlock(
+                            -1, 0, zero_block.data(), zero_hash, true) == 0);
+  first_positions[zero_hash % num_shards].push_back(0);
+
   int old_fd = HANDLE_EINTR(open(old_part.c_str(), O_RDONLY));
   int new_fd = HANDLE_EINTR(open(new_part.c_str(), O_RDONLY));
   ScopedFdCloser old_fd_closer(&old_fd);
   ScopedFdCloser new_fd_closer(&new_fd);
 
-  TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
-      old_fd, 0, old_size / block_size, old_block_ids));
-  TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
-      new_fd, 0, new_size / block_size, new_block_ids));
+  // Maps the |num_blocks| blocks of |fd| starting at |first_position|, storing
+  // in |block_ids| the id of each block within the shard stored in
+  // |block_shards|.
+  auto map_blocks = [&](int fd,
+                        size_t num_blocks,
+                        uint64_t first_position,
+                        vector<BlockMapping::BlockId>* block_ids,
+                        vector<uint16_t>* block_shards) {
+    block_ids->assign(num_blocks, -1);
+    block_shards->assign(num_blocks, 0);
+    const size_t chunk_blocks =
+        std::max<size_t>(kReadChunkSize / block_size, 1);
+    BlockChunk chunk;
+    std::atomic<bool> failed{false};
+    for (size_t first = 0; first < num_blocks; first += chunk_blocks) {
+      const size_t blocks = std::min(chunk_blocks, num_blocks - first);
+      const off_t chunk_offset = first * block_size;
+      TEST_AND_RETURN_FALSE(
+          ReadChunk(fd, chunk_offset, blocks, block_size, &chunk));
+      TEST_AND_RETURN_FALSE(chunk.blocks_read == blocks);
+      TaskScheduler::TaskGroup shard_tasks;
+      for (size_t shard = 0; shard < num_shards; shard++) {
+        shard_tasks.Add([&, shard] {
+          for (size_t i = 0; i < blocks; i++) {
+            if (chunk.hashes[i] % num_shards != shard) {
+              continue;
+            }
+            const BlockMapping::BlockId id =
+                shards[shard].AddHashedBlock(fd,
+                                             chunk_offset + i * block_size,
+                                             chunk.data.data() + i * block_size,
+                                             chunk.hashes[i],
+                                             chunk.zeros[i]);
+            if (id == -1) {
+              failed = true;
+              return;
+            }
+            if (static_cast<size_t>(id) == first_positions[shard].size()) {
+              first_positions[shard].push_back(first_position + first + i);
+            }
+            (*block_ids)[first + i] = id;
+            (*block_shards)[first + i] = shard;
+          }
+        });
+      }
+      shard_tasks.Wait();
+      TEST_AND_RETURN_FALSE(!failed);
+    }
+    return true;
+  };
+
+  const size_t old_num_blocks = old_size / block_size;
+  vector<uint16_t> old_block_shards;
+  vector<uint16_t> new_block_shards;
+  TEST_AND_RETURN_FALSE(map_blocks(
+      old_fd, old_num_blocks, 1, old_block_ids, &old_block_shards));
+  TEST_AND_RETURN_FALSE(map_blocks(new_fd,
+                                   new_size / block_size,
+                                   1 + old_num_blocks,
+                                   new_block_ids,
+                                   &new_block_shards));
+
+  // Give the final ids in order of first position across all the shards.
+  vector<vector<BlockMapping::BlockId>> shard_ids(num_shards);
+  vector<size_t> next(num_shards, 0);
+  BlockMapping::BlockId next_id = 0;
+  while (true) {
+    size_t best = num_shards;
+    for (size_t shard = 0; shard < num_shards; shard++) {
+      if (next[shard] < first_positions[shard].size() &&
+          (best == num_shards ||
+           first_positions[shard][next[shard]] <
+               first_positions[best][next[best]])) {
+        best = shard;
+      }
+    }
+    if (best == num_shards) {
+      break;
+    }
+    shard_ids[best].push_back(next_id++);
+    next[best]++;
+  }
+  for (size_t i = 0; i < old_block_ids->size(); i++) {
+    (*old_block_ids)[i] = shard_ids[old_block_shards[i]][(*old_block_ids)[i]];
+  }
+  for (size_t i = 0; i < new_block_ids->size(); i++) {
+    (*new_block_ids)[i] = shard_ids[new_block_shards[i]][(*new_block_ids)[i]];
+  }
   return true;
 }
 
@@ -52,24 +52,33 @@ class BlockMapping {
   // This is a helper method to add |num_blocks| contiguous blocks reading them
   // from the file descriptor |fd| starting at offset |initial_byte_offset|.
   // Returns whether it succeeded to add all the disk blocks and stores in
-  // |block_ids| the block id for each one of the added blocks.
+  // |block_ids| the block id for each one of the added blocks. The blocks are
+  // read in large chunks and hashed on the threads of the TaskScheduler.
   bool AddManyDiskBlocks(int fd,
                          off_t initial_byte_offset,
                          size_t num_blocks,
                          std::vector<BlockId>* block_ids);
 
+  // Add a single block passed in |block_data|, of |block_size_| bytes, whose
+  // hash is |hash| as hashed by this class and which is all zeros if
+  // |is_zero|. If |fd| is not -1, the block can be discarded to save RAM and
+  // retrieved later from |fd| at the position |byte_offset|.
+  BlockId AddHashedBlock(int fd,
+                         off_t byte_offset,
+                         const uint8_t* block_data,
+                         size_t hash,
+                         bool is_zero);
+
  private:
   FRIEND_TEST(BlockMappingTest, BlocksAreNotKeptInMemory);
 
-  // Add a single block passed in |block_data|. If |fd| is not -1, the block
-  // can be discarded to save RAM and retrieved later from |fd| at the position
-  // |byte_offset|.
-  BlockId AddBlock(int fd, off_t byte_offset, const brillo::Blob& block_data);
-
   size_t block_size_;
 
   BlockId used_block_ids{0};
 
+  // The block id of the block with all zeros, if added yet.
+  BlockId zero_block_id_{-1};
+
   // The UniqueBlock represents the data of a block associated to a unique
   // block id.
   struct UniqueBlock {
@@ -85,10 +94,12 @@ class BlockMapping {
     // Number of times we have seen this data block. Used for caching.
     uint32_t times_read{0};
 
-    // Compares the UniqueBlock data with the other_block data and stores if
-    // they are equal in |equals|. Returns whether there was an error reading
-    // the block from disk while comparing it.
-    bool CompareData(const brillo::Blob& other_block, bool* equals);
+    // Compares the UniqueBlock data with the |block_size| bytes of
+    // |other_block| and stores if they are equal in |equals|. Returns whether
+    // there was an error reading the block from disk while comparing it.
+    bool CompareData(const uint8_t* other_block,
+                     size_t block_size,
+                     bool* equals);
   };
 
   // A mapping from hash values to possible block ids.
@@ -100,7 +111,9 @@ class BlockMapping {
 // with the same data will have the same block id and vice versa, regardless of
 // the partition they are on.
 // The block ids number 0 corresponds to the block with all zeros, but any
-// other block id number is assigned randomly.
+// other block id number is assigned randomly. The blocks are mapped
+// concurrently into shards of blocks with the same hash, with the same result
+// as when mapping them one at a time.
 bool MapPartitionBlocks(const std::string& old_part,
                         const std::string& new_part,
                         size_t old_size,
@@ -0,0 +1,107 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// MapPartitionBlocks() on a pair of images, the first step of every delta
+// partition, with more and more of the blocks of the new image found in the
+// old one, and AddBlock() for a mapping of every size.
+
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/block_mapping.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kBlockSize = 4096;
+constexpr size_t kImageBlocks = 8192;
+
+brillo::Blob RandomBlocks(size_t num_blocks, std::mt19937* generator) {
+  brillo::Blob data(num_blocks * kBlockSize);
+  std::generate(data.begin(), data.end(), std::ref(*generator));
+  return data;
+}
+
+// The argument is the percentage of the blocks of the new image which are
+// blocks of the old image, moved.
+void BM_MapPartitionBlocks(benchmark::State& state) {
+  std::mt19937 generator(42);
+  const brillo::Blob old_data = RandomBlocks(kImageBlocks, &generator);
+  brillo::Blob new_data = RandomBlocks(kImageBlocks, &generator);
+  const size_t moved_blocks = kImageBlocks * state.range(0) / 100;
+  for (size_t i = 0; i < moved_blocks; i++) {
+    const size_t old_block = generator() % kImageBlocks;
+    std::copy_n(old_data.begin() + old_block * kBlockSize,
+                kBlockSize,
+                new_data.begin() + i * kBlockSize);
+  }
+  ScopedTempFile old_file("BlockMappingBenchmark_old.XXXXXX");
+  ScopedTempFile new_file("BlockMappingBenchmark_new.XXXXXX");
+  CHECK(utils::WriteFile(
+      old_file.path().c_str(), old_data.data(), old_data.size()));
+  CHECK(utils::WriteFile(
+      new_file.path().c_str(), new_data.data(), new_data.size()));
+
+  for (auto _ : state) {
+    vector<BlockMapping::BlockId> old_block_ids;
+    vector<BlockMapping::BlockId> new_block_ids;
+    if (!MapPartitionBlocks(old_file.path(),
+                            new_file.path(),
+                            old_data.size(),
+                            new_data.size(),
+                            kBlockSize,
+                            &old_block_ids,
+                            &new_block_ids)) {
+      state.SkipWithError("MapPartitionBlocks() failed");
+      break;
+    }
+    benchmark::DoNotOptimize(new_block_ids.data());
+  }
+  state.SetBytesProcessed(state.iterations() *
+                          (old_data.size() + new_data.size()));
+}
+
+void BM_BlockMappingAddBlock(benchmark::State& state) {
+  std::mt19937 generator(42);
+  vector<brillo::Blob> blocks(state.range(0));
+  for (auto& block : blocks)
+    block = RandomBlocks(1, &generator);
+  for (auto _ : state) {
+    BlockMapping mapping(kBlockSize);
+    for (const auto& block : blocks)
+      benchmark::DoNotOptimize(mapping.AddBlock(block));
+  }
+  state.SetItemsProcessed(state.iterations() * blocks.size());
+}
+
+}  // namespace
+
+BENCHMARK(BM_MapPartitionBlocks)
+    ->DenseRange(0, 100, 50)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_BlockMappingAddBlock)->Range(1 << 8, 1 << 14);
+
+}  // namespace chromeos_update_engine
@@ -84,6 +84,33 @@ TEST_F(BlockMappingTest, BlocksAreNotKeptInMemory) {
   }
 }
 
+TEST_F(BlockMappingTest, AddManyDiskBlocksAcrossHashSlices) {
+  // Enough blocks to be hashed by several tasks, repeating every 7 blocks.
+  constexpr size_t kNumBlocks = 2000;
+  string contents(kNumBlocks * block_size_, '\0');
+  for (size_t i = 0; i < contents.size(); ++i)
+    contents[i] = (i / block_size_) % 7;
+  test_utils::WriteFileString(old_part_.path(), contents);
+  int old_fd = HANDLE_EINTR(open(old_part_.path().c_str(), O_RDONLY));
+  ScopedFdCloser old_fd_closer(&old_fd);
+
+  EXPECT_EQ(0, bm_.AddBlock(brillo::Blob(block_size_, '\0')));
+  vector<BlockMapping::BlockId> ids;
+  EXPECT_TRUE(bm_.AddManyDiskBlocks(old_fd, 0, kNumBlocks, &ids));
+  ASSERT_EQ(kNumBlocks, ids.size());
+  for (size_t i = 0; i < kNumBlocks; ++i) {
+    // Ids are given in order of first appearance, 0 being the zero block.
+    EXPECT_EQ(static_cast<BlockMapping::BlockId>(i % 7), ids[i]) << i;
+  }
+
+  // Blocks past the end of the file fail.
+  EXPECT_FALSE(bm_.AddManyDiskBlocks(old_fd, 0, kNumBlocks + 2, &ids));
+  ASSERT_EQ(kNumBlocks + 2, ids.size());
+  EXPECT_EQ(static_cast<BlockMapping::BlockId>((kNumBlocks - 1) % 7),
+            ids[kNumBlocks - 1]);
+  EXPECT_EQ(-1, ids[kNumBlocks]);
+}
+
 TEST_F(BlockMappingTest, MapPartitionBlocks) {
   // A string with 10 blocks where all the blocks are different.
   string old_contents(10 * block_size_, '\0');
@@ -112,4 +139,39 @@ TEST_F(BlockMappingTest, MapPartitionBlocks) {
   EXPECT_EQ((vector<BlockMapping::BlockId>{0, 11, 12, 13, 1, 2}), new_ids);
 }
 
+TEST_F(BlockMappingTest, MapPartitionBlocksMatchesSequentialMapping) {
+  // Enough blocks for every shard to get many of them, repeating at different
+  // rates in the old and new partitions and with some zero blocks.
+  constexpr size_t kNumBlocks = 3000;
+  string old_contents(kNumBlocks * block_size_, '\0');
+  string new_contents(kNumBlocks * block_size_, '\0');
+  for (size_t i = 0; i < old_contents.size(); ++i) {
+    old_contents[i] = (i / block_size_ * 31) % 97;
+    new_contents[i] = (i / block_size_ * 17) % 113;
+  }
+  test_utils::WriteFileString(old_part_.path(), old_contents);
+  test_utils::WriteFileString(new_part_.path(), new_contents);
+
+  vector<BlockMapping::BlockId> old_ids, new_ids;
+  EXPECT_TRUE(MapPartitionBlocks(old_part_.path(),
+                                 new_part_.path(),
+                                 old_contents.size(),
+                                 new_contents.size(),
+                                 block_size_,
+                                 &old_ids,
+                                 &new_ids));
+
+  // A single BlockMapping gives the same ids.
+  int old_fd = HANDLE_EINTR(open(old_part_.path().c_str(), O_RDONLY));
+  ScopedFdCloser old_fd_closer(&old_fd);
+  int new_fd = HANDLE_EINTR(open(new_part_.path().c_str(), O_RDONLY));
+  ScopedFdCloser new_fd_closer(&new_fd);
+  EXPECT_EQ(0, bm_.AddBlock(brillo::Blob(block_size_, '\0')));
+  vector<BlockMapping::BlockId> expected_old_ids, expected_new_ids;
+  EXPECT_TRUE(bm_.AddManyDiskBlocks(old_fd, 0, kNumBlocks, &expected_old_ids));
+  EXPECT_TRUE(bm_.AddManyDiskBlocks(new_fd, 0, kNumBlocks, &expected_new_ids));
+  EXPECT_EQ(expected_old_ids, old_ids);
+  EXPECT_EQ(expected_new_ids, new_ids);
+}
+
 }  // namespace chromeos_update_engine
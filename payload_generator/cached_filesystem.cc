@@ -0,0 +1,313 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/cached_filesystem.h"
+
+#include <string.h>
+
+#include <type_traits>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// "UEFS" when stored in little endian.
+constexpr uint32_t kCachedFilesystemMagic = 0x53464555;
+
+// Changing the serialized format, or how any of the filesystems is parsed,
+// must bump this, to not reuse the file lists of the previous generator.
+constexpr uint32_t kCachedFilesystemFormatVersion = 1;
+
+// Appends fixed-width host order values to a blob. The cache is only read back
+// by the generator that wrote it, so there is no need for a portable encoding.
+class BlobWriter {
+ public:
+  explicit BlobWriter(brillo::Blob* out) : out_(out) {}
+
+  template <typename T>
+  void Write(T value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    const auto* bytes = reinterpret_cast<const uint8_t*>(&value);
+    out_->insert(out_->end(), bytes, bytes + sizeof(value));
+  }
+
+  void WriteString(const string& str) {
+    Write<uint64_t>(str.size());
+    out_->insert(out_->end(), str.begin(), str.end());
+  }
+
+ private:
+  brillo::Blob* out_;
+};
+
+// Reads back the values of a BlobWriter, failing instead of reading past the
+// end of the blob.
+class BlobReader {
+ public:
+  explicit BlobReader(const brillo::Blob& data) : data_(data) {}
+
+  template <typename T>
+  bool Read(T* value) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    TEST_AND_RETURN_FALSE(data_.size() - offset_ >= sizeof(*value));
+    memcpy(value, data_.data() + offset_, sizeof(*value));
+    offset_ += sizeof(*value);
+    return true;
+  }
+
+  bool ReadString(string* str) {
+    uint64_t size{};
+    TEST_AND_RETURN_FALSE(Read(&size));
+    TEST_AND_RETURN_FALSE(data_.size() - offset_ >= size);
+    str->assign(reinterpret_cast<const char*>(data_.data() + offset_), size);
+    offset_ += size;
+    return true;
+  }
+
+  // Reads the element count of a vector. Every element takes at least one
+  // byte, so a corrupted count can't make the caller allocate a huge vector.
+  bool ReadCount(uint64_t* count) {
+    TEST_AND_RETURN_FALSE(Read(count));
+    TEST_AND_RETURN_FALSE(*count <= data_.size() - offset_);
+    return true;
+  }
+
+  bool AtEnd() const { return offset_ == data_.size(); }
+
+ private:
+  const brillo::Blob& data_;
+  size_t offset_{};
+};
+
+void WriteStat(BlobWriter* writer, const struct stat& st) {
+  writer->Write<uint64_t>(st.st_ino);
+  writer->Write<uint32_t>(st.st_mode);
+  writer->Write<uint64_t>(st.st_nlink);
+  writer->Write<uint32_t>(st.st_uid);
+  writer->Write<uint32_t>(st.st_gid);
+  writer->Write<int64_t>(st.st_size);
+  writer->Write<int64_t>(st.st_blksize);
+  writer->Write<int64_t>(st.st_blocks);
+  writer->Write<int64_t>(st.st_atime);
+  writer->Write<int64_t>(st.st_mtime);
+  writer->Write<int64_t>(st.st_ctime);
+}
+
+bool ReadStat(BlobReader* reader, struct stat* st) {
+  uint64_t ino{}, nlink{};
+  uint32_t mode{}, uid{}, gid{};
+  int64_t size{}, blksize{}, blocks{}, atime{}, mtime{}, ctime{};
+  TEST_AND_RETURN_FALSE(reader->Read(&ino) && reader->Read(&mode) &&
+                        reader->Read(&nlink) && reader->Read(&uid) &&
+                        reader->Read(&gid) && reader->Read(&size) &&
+                        reader->Read(&blksize) && reader->Read(&blocks) &&
+                        reader->Read(&atime) && reader->Read(&mtime) &&
+                        reader->Read(&ctime));
+  st->st_ino = ino;
+  st->st_mode = mode;
+  st->st_nlink = nlink;
+  st->st_uid = uid;
+  st->st_gid = gid;
+  st->st_size = size;
+  st->st_blksize = blksize;
+  st->st_blocks = blocks;
+  st->st_atime = atime;
+  st->st_mtime = mtime;
+  st->st_ctime = ctime;
+  return true;
+}
+
+void WriteFile(BlobWriter* writer, const FilesystemInterface::File& file) {
+  WriteStat(writer, file.file_stat);
+  writer->WriteString(file.name);
+
+  writer->Write<uint64_t>(file.extents.size());
+  for (const auto& extent : file.extents) {
+    writer->Write<uint64_t>(extent.start_block());
+    writer->Write<uint64_t>(extent.num_blocks());
+  }
+
+  writer->Write<uint8_t>(file.is_compressed);
+  writer->Write<uint64_t>(file.deflates.size());
+  for (const auto& deflate : file.deflates) {
+    writer->Write<uint64_t>(deflate.offset);
+    writer->Write<uint64_t>(deflate.length);
+  }
+
+  const auto& info = file.compressed_file_info;
+  writer->Write<uint64_t>(info.blocks.size());
+  for (const auto& block : info.blocks) {
+    writer->Write<uint64_t>(block.uncompressed_offset);
+    writer->Write<uint64_t>(block.compressed_length);
+    writer->Write<uint64_t>(block.uncompressed_length);
+  }
+  writer->Write<int32_t>(info.algo.type());
+  writer->Write<int32_t>(info.algo.level());
+  writer->Write<uint8_t>(info.zero_padding_enabled);
+}
+
+bool ReadFile(BlobReader* reader, FilesystemInterface::File* file) {
+  TEST_AND_RETURN_FALSE(ReadStat(reader, &file->file_stat));
+  TEST_AND_RETURN_FALSE(reader->ReadString(&file->name));
+
+  uint64_t count{};
+  TEST_AND_RETURN_FALSE(reader->ReadCount(&count));
+  file->extents.reserve(count);
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t start_block{}, num_blocks{};
+    TEST_AND_RETURN_FALSE(reader->Read(&start_block) &&
+                          reader->Read(&num_blocks));
+    file->extents.push_back(ExtentForRange(start_block, num_blocks));
+  }
+
+  uint8_t is_compressed{};
+  TEST_AND_RETURN_FALSE(reader->Read(&is_compressed));
+  file->is_compressed = is_compressed;
+  TEST_AND_RETURN_FALSE(reader->ReadCount(&count));
+  file->deflates.reserve(count);
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t offset{}, length{};
+    TEST_AND_RETURN_FALSE(reader->Read(&offset) && reader->Read(&length));
+    file->deflates.emplace_back(offset, length);
+  }
+
+  auto* info = &file->compressed_file_info;
+  TEST_AND_RETURN_FALSE(reader->ReadCount(&count));
+  info->blocks.reserve(count);
+  for (uint64_t i = 0; i < count; i++) {
+    uint64_t offset{}, compressed_length{}, uncompressed_length{};
+    TEST_AND_RETURN_FALSE(reader->Read(&offset) &&
+                          reader->Read(&compressed_length) &&
+                          reader->Read(&uncompressed_length));
+    info->blocks.emplace_back(offset, compressed_length, uncompressed_length);
+  }
+  int32_t algo_type{}, algo_level{};
+  uint8_t zero_padding_enabled{};
+  TEST_AND_RETURN_FALSE(reader->Read(&algo_type) &&
+                        reader->Read(&algo_level) &&
+                        reader->Read(&zero_padding_enabled));
+  TEST_AND_RETURN_FALSE(CompressionAlgorithm::Type_IsValid(algo_type));
+  info->algo.set_type(static_cast<CompressionAlgorithm::Type>(algo_type));
+  info->algo.set_level(algo_level);
+  info->zero_padding_enabled = zero_padding_enabled;
+  return true;
+}
+
+template <typename T>
+bool HashValue(HashCalculator* hasher, const T& value) {
+  return hasher->Update(&value, sizeof(value));
+}
+
+bool HashString(HashCalculator* hasher, const string& str) {
+  return HashValue(hasher, static_cast<uint64_t>(str.size())) &&
+         hasher->Update(str.data(), str.size());
+}
+
+}  // namespace
+
+bool CachedFilesystem::Serialize(const FilesystemInterface& fs,
+                                 brillo::Blob* out) {
+  vector<File> files;
+  TEST_AND_RETURN_FALSE(fs.GetFiles(&files));
+
+  out->clear();
+  BlobWriter writer(out);
+  writer.Write(kCachedFilesystemMagic);
+  writer.Write(kCachedFilesystemFormatVersion);
+  writer.Write<uint64_t>(fs.GetBlockSize());
+  writer.Write<uint64_t>(fs.GetBlockCount());
+  writer.Write<uint64_t>(files.size());
+  for (const auto& file : files) {
+    WriteFile(&writer, file);
+  }
+  return true;
+}
+
+std::unique_ptr<CachedFilesystem> CachedFilesystem::Deserialize(
+    const brillo::Blob& data) {
+  BlobReader reader(data);
+  uint32_t magic{};
+  if (!reader.Read(&magic) || magic != kCachedFilesystemMagic) {
+    LOG(ERROR) << "Not a cached filesystem.";
+    return nullptr;
+  }
+  uint32_t version{};
+  if (!reader.Read(&version) || version != kCachedFilesystemFormatVersion) {
+    LOG(ERROR) << "Unsupported cached filesystem version " << version;
+    return nullptr;
+  }
+
+  std::unique_ptr<CachedFilesystem> result(new CachedFilesystem());
+  uint64_t num_files{};
+  if (!reader.Read(&result->block_size_) ||
+      !reader.Read(&result->block_count_) || !reader.ReadCount(&num_files)) {
+    return nullptr;
+  }
+  result->files_.resize(num_files);
+  for (auto& file : result->files_) {
+    if (!ReadFile(&reader, &file)) {
+      LOG(ERROR) << "Truncated cached filesystem.";
+      return nullptr;
+    }
+  }
+  if (!reader.AtEnd()) {
+    LOG(ERROR) << "Trailing data after the cached filesystem.";
+    return nullptr;
+  }
+  return result;
+}
+
+bool CachedFilesystem::GetFiles(vector<File>* files) const {
+  *files = files_;
+  return true;
+}
+
+string FilesystemCacheKey(const PartitionConfig& part) {
+  HashCalculator hasher;
+  CHECK(HashValue(&hasher, kCachedFilesystemFormatVersion));
+  // The raw filesystem fallback is named after the partition and sized after
+  // |part.size| rather than the image.
+  CHECK(HashString(&hasher, part.name));
+  CHECK(HashValue(&hasher, part.size));
+  CHECK(HashValue(&hasher,
+                  static_cast<int32_t>(part.erofs_compression_param.type())));
+  CHECK(HashValue(&hasher, part.erofs_compression_param.level()));
+  CHECK(HashValue(&hasher, static_cast<uint8_t>(!part.mapfile_path.empty())));
+  if (!part.mapfile_path.empty() &&
+      hasher.UpdateFile(part.mapfile_path, -1) < 0) {
+    LOG(WARNING) << "Failed to hash " << part.mapfile_path;
+    return "";
+  }
+  if (hasher.UpdateFile(part.path, -1) < 0) {
+    LOG(WARNING) << "Failed to hash " << part.path;
+    return "";
+  }
+  CHECK(hasher.Finalize());
+  return utils::HexEncode(hasher.raw_hash());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,70 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_CACHED_FILESYSTEM_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_CACHED_FILESYSTEM_H_
+
+// A FilesystemInterface replaying the file list of a previously parsed
+// filesystem, so that generating several payloads from the same image parses
+// it only once.
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_generator/filesystem_interface.h"
+
+namespace chromeos_update_engine {
+
+struct PartitionConfig;
+
+class CachedFilesystem : public FilesystemInterface {
+ public:
+  // Serializes the block size, block count and files of |fs| into |out|.
+  static bool Serialize(const FilesystemInterface& fs, brillo::Blob* out);
+
+  // Creates a CachedFilesystem from the output of Serialize(). Returns nullptr
+  // if |data| is truncated or was written by a different format version.
+  static std::unique_ptr<CachedFilesystem> Deserialize(
+      const brillo::Blob& data);
+
+  ~CachedFilesystem() override = default;
+
+  // FilesystemInterface overrides.
+  size_t GetBlockSize() const override { return block_size_; }
+  size_t GetBlockCount() const override { return block_count_; }
+  bool GetFiles(std::vector<File>* files) const override;
+
+ private:
+  CachedFilesystem() = default;
+
+  uint64_t block_size_{};
+  uint64_t block_count_{};
+  std::vector<File> files_;
+
+  DISALLOW_COPY_AND_ASSIGN(CachedFilesystem);
+};
+
+// Returns the key of the filesystem parsed from |part| in a cache, covering the
+// image content and every PartitionConfig field the parsers depend on. Returns
+// an empty string if the image couldn't be read.
+std::string FilesystemCacheKey(const PartitionConfig& part);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_CACHED_FILESYSTEM_H_
@@ -0,0 +1,221 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/cached_filesystem.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/diff_cache.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/fake_filesystem.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// A filesystem returning the given files, for the fields FakeFilesystem
+// doesn't set.
+class ListFilesystem : public FilesystemInterface {
+ public:
+  explicit ListFilesystem(vector<File> files) : files_(std::move(files)) {}
+
+  size_t GetBlockSize() const override { return kBlockSize; }
+  size_t GetBlockCount() const override { return 100; }
+  bool GetFiles(vector<File>* files) const override {
+    *files = files_;
+    return true;
+  }
+
+ private:
+  vector<File> files_;
+};
+
+void ExpectSameFiles(const FilesystemInterface& expected,
+                     const FilesystemInterface& actual) {
+  EXPECT_EQ(expected.GetBlockSize(), actual.GetBlockSize());
+  EXPECT_EQ(expected.GetBlockCount(), actual.GetBlockCount());
+  vector<FilesystemInterface::File> expected_files, actual_files;
+  ASSERT_TRUE(expected.GetFiles(&expected_files));
+  ASSERT_TRUE(actual.GetFiles(&actual_files));
+  ASSERT_EQ(expected_files.size(), actual_files.size());
+  for (size_t i = 0; i < expected_files.size(); i++) {
+    const auto& want = expected_files[i];
+    const auto& got = actual_files[i];
+    EXPECT_EQ(want.name, got.name);
+    EXPECT_EQ(want.file_stat.st_ino, got.file_stat.st_ino);
+    EXPECT_EQ(want.file_stat.st_mode, got.file_stat.st_mode);
+    EXPECT_EQ(want.file_stat.st_size, got.file_stat.st_size);
+    EXPECT_EQ(want.extents, got.extents);
+    EXPECT_EQ(want.is_compressed, got.is_compressed);
+    EXPECT_EQ(want.deflates, got.deflates);
+    const auto& want_info = want.compressed_file_info;
+    const auto& got_info = got.compressed_file_info;
+    ASSERT_EQ(want_info.blocks.size(), got_info.blocks.size());
+    for (size_t j = 0; j < want_info.blocks.size(); j++) {
+      EXPECT_EQ(want_info.blocks[j].uncompressed_offset,
+                got_info.blocks[j].uncompressed_offset);
+      EXPECT_EQ(want_info.blocks[j].compressed_length,
+                got_info.blocks[j].compressed_length);
+      EXPECT_EQ(want_info.blocks[j].uncompressed_length,
+                got_info.blocks[j].uncompressed_length);
+    }
+    EXPECT_EQ(want_info.algo.type(), got_info.algo.type());
+    EXPECT_EQ(want_info.algo.level(), got_info.algo.level());
+    EXPECT_EQ(want_info.zero_padding_enabled, got_info.zero_padding_enabled);
+  }
+}
+
+}  // namespace
+
+class CachedFilesystemTest : public ::testing::Test {};
+
+TEST_F(CachedFilesystemTest, SerializeRoundTrip) {
+  FakeFilesystem fs(kBlockSize, 50);
+  fs.AddFile("/foo", {ExtentForRange(1, 2), ExtentForRange(10, 1)});
+  fs.AddFile("/bar", {});
+  fs.AddFile("<free-space>", {ExtentForRange(20, 30)});
+
+  brillo::Blob data;
+  ASSERT_TRUE(CachedFilesystem::Serialize(fs, &data));
+  auto cached = CachedFilesystem::Deserialize(data);
+  ASSERT_NE(nullptr, cached);
+  ExpectSameFiles(fs, *cached);
+}
+
+TEST_F(CachedFilesystemTest, SerializeCompressionInfo) {
+  FilesystemInterface::File file;
+  file.name = "/lib/foo.so";
+  file.file_stat.st_ino = 42;
+  file.file_stat.st_mode = S_IFREG | 0644;
+  file.file_stat.st_size = 3 * kBlockSize;
+  file.extents = {ExtentForRange(5, 2)};
+  file.is_compressed = true;
+  file.deflates = {{8, 800}, {1000, 64}};
+  file.compressed_file_info.blocks = {{0, 4096, 8192}, {8192, 2000, 4096}};
+  file.compressed_file_info.algo.set_type(CompressionAlgorithm::LZ4HC);
+  file.compressed_file_info.algo.set_level(9);
+  file.compressed_file_info.zero_padding_enabled = true;
+  ListFilesystem fs({file});
+
+  brillo::Blob data;
+  ASSERT_TRUE(CachedFilesystem::Serialize(fs, &data));
+  auto cached = CachedFilesystem::Deserialize(data);
+  ASSERT_NE(nullptr, cached);
+  ExpectSameFiles(fs, *cached);
+}
+
+TEST_F(CachedFilesystemTest, DeserializeRejectsCorruptedData) {
+  FakeFilesystem fs(kBlockSize, 50);
+  fs.AddFile("/foo", {ExtentForRange(1, 2)});
+  brillo::Blob data;
+  ASSERT_TRUE(CachedFilesystem::Serialize(fs, &data));
+
+  EXPECT_EQ(nullptr, CachedFilesystem::Deserialize({}));
+  for (size_t size : {size_t{4}, size_t{8}, data.size() / 2, data.size() - 1}) {
+    EXPECT_EQ(nullptr,
+              CachedFilesystem::Deserialize(
+                  brillo::Blob(data.begin(), data.begin() + size)));
+  }
+  brillo::Blob trailing = data;
+  trailing.push_back(0);
+  EXPECT_EQ(nullptr, CachedFilesystem::Deserialize(trailing));
+  brillo::Blob bad_magic = data;
+  bad_magic[0] ^= 1;
+  EXPECT_EQ(nullptr, CachedFilesystem::Deserialize(bad_magic));
+}
+
+TEST_F(CachedFilesystemTest, KeyDependsOnImageAndConfig) {
+  ScopedTempFile image("CachedFilesystemTest_image.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(image.path(),
+                                          brillo::Blob(kBlockSize * 4, 1)));
+  PartitionConfig part("system");
+  part.path = image.path();
+  part.size = kBlockSize * 4;
+  const string key = FilesystemCacheKey(part);
+  ASSERT_FALSE(key.empty());
+  EXPECT_EQ(key, FilesystemCacheKey(part));
+
+  part.name = "vendor";
+  EXPECT_NE(key, FilesystemCacheKey(part));
+  part.name = "system";
+  part.size = kBlockSize * 2;
+  EXPECT_NE(key, FilesystemCacheKey(part));
+  part.size = kBlockSize * 4;
+  part.erofs_compression_param.set_level(4);
+  EXPECT_NE(key, FilesystemCacheKey(part));
+  part.erofs_compression_param = PartitionConfig::GetDefaultCompressionParam();
+  EXPECT_EQ(key, FilesystemCacheKey(part));
+
+  ASSERT_TRUE(test_utils::WriteFileVector(image.path(),
+                                          brillo::Blob(kBlockSize * 4, 2)));
+  EXPECT_NE(key, FilesystemCacheKey(part));
+
+  part.path = "/non/existent/image";
+  EXPECT_TRUE(FilesystemCacheKey(part).empty());
+}
+
+TEST_F(CachedFilesystemTest, OpenFilesystemUsesCache) {
+  base::ScopedTempDir cache_dir;
+  ASSERT_TRUE(cache_dir.CreateUniqueTempDir());
+  auto cache =
+      std::make_shared<DirectoryDiffCache>(cache_dir.GetPath().value());
+  ScopedTempFile image("CachedFilesystemTest_image.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(image.path(),
+                                          brillo::Blob(kBlockSize * 4, 0)));
+  PartitionConfig part("system");
+  part.path = image.path();
+  part.size = kBlockSize * 4;
+  part.filesystem_cache = cache;
+
+  // The raw filesystem parsed on the first open is stored in the cache.
+  ASSERT_TRUE(part.OpenFilesystem());
+  EXPECT_EQ(4u, part.fs_interface->GetBlockCount());
+  brillo::Blob data;
+  ASSERT_TRUE(cache->Lookup(FilesystemCacheKey(part), &data));
+  auto cached = CachedFilesystem::Deserialize(data);
+  ASSERT_NE(nullptr, cached);
+  ExpectSameFiles(*part.fs_interface, *cached);
+
+  // Later opens read the cached entry instead of parsing the image.
+  FakeFilesystem fake(kBlockSize, 4);
+  fake.AddFile("/cached", {ExtentForRange(0, 4)});
+  ASSERT_TRUE(CachedFilesystem::Serialize(fake, &data));
+  ASSERT_TRUE(cache->Store(FilesystemCacheKey(part), data));
+  ASSERT_TRUE(part.OpenFilesystem());
+  ExpectSameFiles(fake, *part.fs_interface);
+
+  // Invalid entries are ignored.
+  ASSERT_TRUE(cache->Store(FilesystemCacheKey(part), {1, 2, 3}));
+  ASSERT_TRUE(part.OpenFilesystem());
+  vector<FilesystemInterface::File> files;
+  ASSERT_TRUE(part.fs_interface->GetFiles(&files));
+  ASSERT_EQ(1u, files.size());
+  EXPECT_EQ("<system-partition>", files[0].name);
+}
+
+}  // namespace chromeos_update_engine
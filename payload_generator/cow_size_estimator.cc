@@ -18,11 +18,13 @@
 
 #include <algorithm>
 #include <functional>
+#include <mutex>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <android-base/unique_fd.h>
+#include <base/threading/simple_thread.h>
 #include <libsnapshot/cow_writer.h>
 #include <libsnapshot/cow_format.h>
 
@@ -36,20 +38,25 @@ namespace chromeos_update_engine {
 using android::snapshot::CreateCowEstimator;
 using android::snapshot::ICowWriter;
 
-bool CowDryRun(
-    FileDescriptorPtr source_fd,
-    FileDescriptorPtr target_fd,
+namespace {
+
+// Size of the chunks of raw blocks estimated independently.
+constexpr size_t kRawChunkSize = 2 * 1024 * 1024;  // 2 MiB
+
+// Writes the merge sequence, the COW_COPY and COW_XOR operations and the ZERO
+// operations to |cow_writer|, and the blocks they cover to |visited_out|.
+bool AddMergeAndZeroOps(
+    const FileDescriptorPtr& source_fd,
+    const FileDescriptorPtr& target_fd,
     const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
     const google::protobuf::RepeatedPtrField<CowMergeOperation>&
         merge_operations,
     const size_t block_size,
-    android::snapshot::ICowWriter* cow_writer,
-    const size_t partition_size,
-    const bool xor_enabled) {
-  CHECK_NE(target_fd, nullptr);
-  CHECK(target_fd->IsOpen());
+    ICowWriter* cow_writer,
+    const bool xor_enabled,
+    ExtentRanges* visited_out) {
+  ExtentRanges& visited = *visited_out;
   VABCPartitionWriter::WriteMergeSequence(merge_operations, cow_writer);
-  ExtentRanges visited;
   for (const auto& op : merge_operations) {
     if (op.type() == CowMergeOperation::COW_COPY) {
       visited.AddExtent(op.dst_extent());
@@ -115,23 +122,144 @@ bool CowDryRun(
     }
   }
   cow_writer->AddLabel(0);
-  const size_t last_block = partition_size / block_size;
-  const auto unvisited_extents =
-      FilterExtentRanges({ExtentForRange(0, last_block)}, visited);
-  for (const auto& ext : unvisited_extents) {
+  return true;
+}
+
+// Writes the target data of |extents| to |cow_writer| as raw blocks. Reads
+// from |target_fd| are serialized with |read_lock|, if any, since they move
+// the file offset.
+bool AddRawExtents(const FileDescriptorPtr& target_fd,
+                   const std::vector<Extent>& extents,
+                   const size_t block_size,
+                   ICowWriter* cow_writer,
+                   std::mutex* read_lock) {
+  for (const auto& ext : extents) {
     std::vector<unsigned char> data(ext.num_blocks() * block_size);
     ssize_t bytes_read = 0;
-    if (!utils::PReadAll(target_fd,
-                         data.data(),
-                         data.size(),
-                         ext.start_block() * block_size,
-                         &bytes_read)) {
-      PLOG(ERROR) << "Failed to read new block data at " << ext;
-      return false;
+    {
+      std::unique_lock<std::mutex> lock;
+      if (read_lock) {
+        lock = std::unique_lock<std::mutex>(*read_lock);
+      }
+      if (!utils::PReadAll(target_fd,
+                           data.data(),
+                           data.size(),
+                           ext.start_block() * block_size,
+                           &bytes_read)) {
+        PLOG(ERROR) << "Failed to read new block data at " << ext;
+        return false;
+      }
     }
     cow_writer->AddRawBlocks(ext.start_block(), data.data(), data.size());
     cow_writer->AddLabel(0);
   }
+  return true;
+}
+
+// Estimates the size the raw blocks of one chunk add to a COW image, that is
+// the size of an estimator they are written to minus the size of an empty
+// one.
+class RawChunkEstimator : public base::DelegateSimpleThread::Delegate {
+ public:
+  RawChunkEstimator(const FileDescriptorPtr& target_fd,
+                    std::vector<Extent> extents,
+                    const size_t block_size,
+                    uint32_t cow_version,
+                    const android::snapshot::CowOptions& options,
+                    const android::snapshot::CowSizeInfo& empty_size,
+                    std::mutex* read_lock)
+      : target_fd_(target_fd),
+        extents_(std::move(extents)),
+        block_size_(block_size),
+        cow_version_(cow_version),
+        options_(options),
+        empty_size_(empty_size),
+        read_lock_(read_lock) {}
+  RawChunkEstimator(RawChunkEstimator&&) = default;
+  ~RawChunkEstimator() override = default;
+
+  // Overrides DelegateSimpleThread::Delegate.
+  void Run() override {
+    auto cow_writer = CreateCowEstimator(cow_version_, options_);
+    CHECK_NE(cow_writer, nullptr) << "Could not create cow estimator";
+    CHECK(AddRawExtents(
+        target_fd_, extents_, block_size_, cow_writer.get(), read_lock_));
+    CHECK(cow_writer->Finalize());
+    const auto size = cow_writer->GetCowSizeInfo();
+    cow_size_ = size.cow_size - std::min(size.cow_size, empty_size_.cow_size);
+    op_count_ = size.op_count_max -
+                std::min(size.op_count_max, empty_size_.op_count_max);
+  }
+
+  uint64_t cow_size() const { return cow_size_; }
+  uint64_t op_count() const { return op_count_; }
+
+ private:
+  const FileDescriptorPtr& target_fd_;
+  std::vector<Extent> extents_;
+  size_t block_size_;
+  uint32_t cow_version_;
+  const android::snapshot::CowOptions& options_;
+  const android::snapshot::CowSizeInfo& empty_size_;
+  std::mutex* read_lock_;
+
+  uint64_t cow_size_{0};
+  uint64_t op_count_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(RawChunkEstimator);
+};
+
+// Splits |extents| in chunks of at most |chunk_blocks| blocks.
+std::vector<std::vector<Extent>> SplitInChunks(
+    const std::vector<Extent>& extents, const uint64_t chunk_blocks) {
+  std::vector<std::vector<Extent>> chunks;
+  uint64_t chunk_left = 0;
+  for (const auto& ext : extents) {
+    uint64_t start = ext.start_block();
+    uint64_t num_blocks = ext.num_blocks();
+    while (num_blocks > 0) {
+      if (chunk_left == 0) {
+        chunks.emplace_back();
+        chunk_left = chunk_blocks;
+      }
+      const uint64_t count = std::min(num_blocks, chunk_left);
+      chunks.back().push_back(ExtentForRange(start, count));
+      start += count;
+      num_blocks -= count;
+      chunk_left -= count;
+    }
+  }
+  return chunks;
+}
+
+}  // namespace
+
+bool CowDryRun(
+    FileDescriptorPtr source_fd,
+    FileDescriptorPtr target_fd,
+    const google::protobuf::RepeatedPtrField<InstallOperation>& operations,
+    const google::protobuf::RepeatedPtrField<CowMergeOperation>&
+        merge_operations,
+    const size_t block_size,
+    android::snapshot::ICowWriter* cow_writer,
+    const size_t partition_size,
+    const bool xor_enabled) {
+  CHECK_NE(target_fd, nullptr);
+  CHECK(target_fd->IsOpen());
+  ExtentRanges visited;
+  TEST_AND_RETURN_FALSE(AddMergeAndZeroOps(source_fd,
+                                           target_fd,
+                                           operations,
+                                           merge_operations,
+                                           block_size,
+                                           cow_writer,
+                                           xor_enabled,
+                                           &visited));
+  const size_t last_block = partition_size / block_size;
+  const auto unvisited_extents =
+      FilterExtentRanges({ExtentForRange(0, last_block)}, visited);
+  TEST_AND_RETURN_FALSE(AddRawExtents(
+      target_fd, unvisited_extents, block_size, cow_writer, nullptr));
 
   return cow_writer->Finalize();
 }
@@ -147,26 +275,99 @@ android::snapshot::CowSizeInfo EstimateCowSizeInfo(
     const size_t partition_size,
     const bool xor_enabled,
     uint32_t cow_version,
-    uint64_t compression_factor) {
+    uint64_t compression_factor,
+    size_t max_threads,
+    uint32_t sample_interval) {
   android::snapshot::CowOptions options{
       .block_size = static_cast<uint32_t>(block_size),
       .compression = std::move(compression),
       .max_blocks = (partition_size / block_size),
       .compression_factor = compression_factor};
-  // b/322279333 use 4096 as estimation until we have an updated estimation
-  // algorithm
-  options.compression_factor = block_size;
   auto cow_writer = CreateCowEstimator(cow_version, options);
   CHECK_NE(cow_writer, nullptr) << "Could not create cow estimator";
-  CHECK(CowDryRun(source_fd,
-                  target_fd,
-                  operations,
-                  merge_operations,
-                  block_size,
-                  cow_writer.get(),
-                  partition_size,
-                  xor_enabled));
-  return cow_writer->GetCowSizeInfo();
+  if (max_threads <= 1 && sample_interval <= 1) {
+    CHECK(CowDryRun(source_fd,
+                    target_fd,
+                    operations,
+                    merge_operations,
+                    block_size,
+                    cow_writer.get(),
+                    partition_size,
+                    xor_enabled));
+    return cow_writer->GetCowSizeInfo();
+  }
+  sample_interval = std::max<uint32_t>(sample_interval, 1);
+
+  CHECK_NE(target_fd, nullptr);
+  CHECK(target_fd->IsOpen());
+  ExtentRanges visited;
+  CHECK(AddMergeAndZeroOps(source_fd,
+                           target_fd,
+                           operations,
+                           merge_operations,
+                           block_size,
+                           cow_writer.get(),
+                           xor_enabled,
+                           &visited));
+  CHECK(cow_writer->Finalize());
+  auto size_info = cow_writer->GetCowSizeInfo();
+
+  auto empty_writer = CreateCowEstimator(cow_version, options);
+  CHECK_NE(empty_writer, nullptr) << "Could not create cow estimator";
+  CHECK(empty_writer->Finalize());
+  const auto empty_size = empty_writer->GetCowSizeInfo();
+
+  // The raw blocks compress independently of each other, estimate them in
+  // chunks of their own in parallel and add up the results.
+  const size_t last_block = partition_size / block_size;
+  const auto chunks = SplitInChunks(
+      FilterExtentRanges({ExtentForRange(0, last_block)}, visited),
+      std::max<size_t>(kRawChunkSize / block_size, 1));
+  std::mutex read_lock;
+  std::vector<RawChunkEstimator> estimators;
+  uint64_t total_blocks = 0;
+  uint64_t sampled_blocks = 0;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    const uint64_t chunk_blocks = utils::BlocksInExtents(chunks[i]);
+    total_blocks += chunk_blocks;
+    if (i % sample_interval != 0) {
+      continue;
+    }
+    sampled_blocks += chunk_blocks;
+    estimators.emplace_back(target_fd,
+                            chunks[i],
+                            block_size,
+                            cow_version,
+                            options,
+                            empty_size,
+                            &read_lock);
+  }
+  if (!estimators.empty()) {
+    base::DelegateSimpleThreadPool thread_pool(
+        "cow-size-estimator",
+        std::min(std::max<size_t>(max_threads, 1), estimators.size()));
+    thread_pool.Start();
+    for (auto& estimator : estimators) {
+      thread_pool.AddWork(&estimator);
+    }
+    thread_pool.JoinAll();
+  }
+
+  uint64_t raw_cow_size = 0;
+  uint64_t raw_op_count = 0;
+  for (const auto& estimator : estimators) {
+    raw_cow_size += estimator.cow_size();
+    raw_op_count += estimator.op_count();
+  }
+  if (sampled_blocks > 0 && sampled_blocks < total_blocks) {
+    LOG(INFO) << "Extrapolating the COW size of " << total_blocks
+              << " raw blocks from " << sampled_blocks << " sampled ones";
+    raw_cow_size = raw_cow_size * total_blocks / sampled_blocks;
+    raw_op_count = raw_op_count * total_blocks / sampled_blocks;
+  }
+  size_info.cow_size += raw_cow_size;
+  size_info.op_count_max += raw_op_count;
+  return size_info;
 }
 
 }  // namespace chromeos_update_engine
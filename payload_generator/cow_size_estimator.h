@@ -28,6 +28,11 @@ namespace chromeos_update_engine {
 // generators to put an estimate cow size in OTA payload. When installing an OTA
 // update, libsnapshot will take this estimate as a hint to allocate spaces.
 // If |xor_enabled| is true, then |source_fd| must be non-null.
+// The blocks written as raw data, which is where most of the compression time
+// goes, are split in chunks estimated on up to |max_threads| threads. With a
+// |sample_interval| greater than 1, only one chunk out of |sample_interval| is
+// compressed and the size of the others is extrapolated from them.
+// |compression_factor| is the largest number of bytes compressed at once.
 android::snapshot::CowSizeInfo EstimateCowSizeInfo(
     FileDescriptorPtr source_fd,
     FileDescriptorPtr target_fd,
@@ -39,7 +44,9 @@ android::snapshot::CowSizeInfo EstimateCowSizeInfo(
     const size_t partition_size,
     bool xor_enabled,
     uint32_t cow_version,
-    uint64_t compression_factor);
+    uint64_t compression_factor,
+    size_t max_threads,
+    uint32_t sample_interval);
 
 // Convert InstallOps to CowOps and apply the converted cow op to |cow_writer|
 bool CowDryRun(
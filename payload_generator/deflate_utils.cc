@@ -17,17 +17,21 @@
 #include "update_engine/payload_generator/deflate_utils.h"
 
 #include <algorithm>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <utility>
 
 #include <base/files/file_util.h>
 #include <base/logging.h>
 #include <base/strings/string_util.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/squashfs_filesystem.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "update_engine/update_metadata.pb.h"
 
 using puffin::BitExtent;
@@ -113,6 +117,69 @@ bool IsBitExtentInExtent(const Extent& extent, const BitExtent& bit_extent) {
 // Returns whether the given file |name| has an extension listed in
 // |extensions|.
 
+// The deflates found in the zip and gzip files read so far, relative to the
+// start of the file and keyed by its content. The same files are usually in
+// both the source and the target images, and sometimes in several places of
+// one image.
+struct DeflateMemo {
+  std::mutex mutex;
+  std::unordered_map<string, vector<BitExtent>> deflates;
+};
+
+DeflateMemo* GetDeflateMemo() {
+  static DeflateMemo* memo = new DeflateMemo();
+  return memo;
+}
+
+// Sets the deflates of |file|, a zip or gzip file in the |part_path| image,
+// relative to the start of the partition.
+bool LocateFileDeflates(const string& part_path,
+                        FilesystemInterface::File* file) {
+  const uint64_t size = kBlockSize * utils::BlocksInExtents(file->extents);
+  TaskScheduler::MemoryReservation reservation(size);
+  brillo::Blob data;
+  TEST_AND_RETURN_FALSE(
+      utils::ReadExtents(part_path, file->extents, &data, size, kBlockSize));
+  // |data| read from disk always has size multiple of kBlockSize. So it
+  // might contain trailing garbage data and confuse the gzip/zip
+  // processors. Trim them.
+  if (file->file_stat.st_size > 0 &&
+      static_cast<size_t>(file->file_stat.st_size) < data.size()) {
+    data.resize(file->file_stat.st_size);
+  }
+
+  // Zip and gzip files are parsed differently, so the key includes the kind
+  // of file it was parsed as.
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(data, &hash));
+  const bool is_zip = IsFileExtensions(
+      file->name, {".apk", ".zip", ".jar", ".zvoice", ".apex", "capex"});
+  const string key = string(is_zip ? "zip:" : "gzip:") + utils::HexEncode(hash);
+  auto* memo = GetDeflateMemo();
+  vector<BitExtent> deflates;
+  bool found = false;
+  {
+    std::lock_guard<std::mutex> lock(memo->mutex);
+    auto it = memo->deflates.find(key);
+    if (it != memo->deflates.end()) {
+      deflates = it->second;
+      found = true;
+    }
+  }
+  if (!found) {
+    TEST_AND_RETURN_FALSE(
+        DeflatePreprocessFileData(file->name, data, &deflates));
+    std::lock_guard<std::mutex> lock(memo->mutex);
+    memo->deflates.emplace(key, deflates);
+  }
+  // Shift the deflate's extent to the offset starting from the beginning
+  // of the current partition; and the delta processor will align the
+  // extents in a continuous buffer later.
+  TEST_AND_RETURN_FALSE(ShiftBitExtentsOverExtents(file->extents, &deflates));
+  file->deflates = std::move(deflates);
+  return true;
+}
+
 }  // namespace
 
 constexpr base::StringPiece ToStringPiece(std::string_view s) {
@@ -304,6 +371,8 @@ bool PreprocessPartitionFiles(const PartitionConfig& part,
   part.fs_interface->GetFiles(&tmp_files);
   result_files->reserve(tmp_files.size());
 
+  // Indexes in |result_files| of the files to search for deflates.
+  vector<size_t> deflate_files;
   for (auto& file : tmp_files) {
     auto is_regular_file = IsRegularFile(file);
 
@@ -345,36 +414,30 @@ bool PreprocessPartitionFiles(const PartitionConfig& part,
           file.name, {".apk", ".zip", ".jar", ".zvoice", ".apex", "capex"});
       bool is_gzip = IsFileExtensions(file.name, {".gz", ".gzip", ".tgz"});
       if (is_zip || is_gzip) {
-        brillo::Blob data;
-        TEST_AND_RETURN_FALSE(utils::ReadExtents(
-            part.path,
-            file.extents,
-            &data,
-            kBlockSize * utils::BlocksInExtents(file.extents),
-            kBlockSize));
-        // |data| read from disk always has size multiple of kBlockSize. So it
-        // might contain trailing garbage data and confuse the gzip/zip
-        // processors. Trim them.
-        if (file.file_stat.st_size > 0 &&
-            static_cast<size_t>(file.file_stat.st_size) < data.size()) {
-          data.resize(file.file_stat.st_size);
-        }
-        vector<puffin::BitExtent> deflates;
-        if (!DeflatePreprocessFileData(file.name, data, &deflates)) {
-          LOG(ERROR) << "Failed to preprocess deflate data in partition "
-                     << part.name;
-          return false;
-        }
-        // Shift the deflate's extent to the offset starting from the beginning
-        // of the current partition; and the delta processor will align the
-        // extents in a continuous buffer later.
-        TEST_AND_RETURN_FALSE(
-            ShiftBitExtentsOverExtents(file.extents, &deflates));
-        file.deflates = std::move(deflates);
+        deflate_files.push_back(result_files->size());
       }
     }
 
-    result_files->push_back(file);
+    result_files->push_back(std::move(file));
+  }
+
+  // Locating the deflates inflates every stream of the file, so the files are
+  // searched in parallel.
+  vector<char> errors(deflate_files.size());
+  {
+    TaskScheduler::TaskGroup deflate_tasks;
+    for (size_t i = 0; i < deflate_files.size(); i++) {
+      auto* file = &(*result_files)[deflate_files[i]];
+      deflate_tasks.Add([&part, &errors, i, file] {
+        errors[i] = !LocateFileDeflates(part.path, file);
+      });
+    }
+    deflate_tasks.Wait();
+  }
+  if (std::find(errors.begin(), errors.end(), true) != errors.end()) {
+    LOG(ERROR) << "Failed to preprocess deflate data in partition "
+               << part.name;
+    return false;
   }
   return true;
 }
@@ -19,6 +19,8 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <memory>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -28,6 +30,8 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
 
 using puffin::BitExtent;
 using puffin::ByteExtent;
@@ -36,6 +40,46 @@ using std::vector;
 namespace chromeos_update_engine {
 namespace deflate_utils {
 
+namespace {
+
+// gzip of "update_engine " repeated 64 times.
+const uint8_t kGzipData[] = {
+    0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x2b,
+    0x2d, 0x48, 0x49, 0x2c, 0x49, 0x8d, 0x4f, 0xcd, 0x4b, 0xcf, 0xcc,
+    0x4b, 0x55, 0x28, 0x1d, 0xe5, 0x8d, 0xf2, 0x46, 0x79, 0x74, 0xe4,
+    0x01, 0x00, 0x28, 0x97, 0xdd, 0x7d, 0x80, 0x03, 0x00, 0x00};
+
+// A filesystem of regular files, each given by its name and extents.
+class RegularFilesFilesystem : public FilesystemInterface {
+ public:
+  RegularFilesFilesystem(uint64_t block_count,
+                         const vector<std::pair<std::string, Extent>>& files)
+      : block_count_(block_count) {
+    for (const auto& [name, extent] : files) {
+      File file;
+      file.name = name;
+      file.extents = {extent};
+      file.file_stat.st_ino = files_.size() + 1;
+      file.file_stat.st_mode = S_IFREG | 0644;
+      file.file_stat.st_size = sizeof(kGzipData);
+      files_.push_back(file);
+    }
+  }
+
+  size_t GetBlockSize() const override { return kBlockSize; }
+  size_t GetBlockCount() const override { return block_count_; }
+  bool GetFiles(vector<File>* files) const override {
+    *files = files_;
+    return true;
+  }
+
+ private:
+  uint64_t block_count_;
+  vector<File> files_;
+};
+
+}  // namespace
+
 // This creates a sudo-random BitExtents from ByteExtents for simpler testing.
 vector<BitExtent> ByteToBitExtent(const vector<ByteExtent>& byte_extents) {
   vector<BitExtent> bit_extents;
@@ -186,5 +230,52 @@ TEST(DeflateUtilsTest, CompactBoundaryTest) {
   EXPECT_EQ(out_deflates, expected_out_deflates);
 }
 
+TEST(DeflateUtilsTest, PreprocessPartitionFilesTest) {
+  // The same gzip data in blocks 1, 2 and 4, named as gzip files but for the
+  // one in block 2.
+  brillo::Blob image(kBlockSize * 6);
+  for (uint64_t block : {1, 2, 4}) {
+    std::copy(std::begin(kGzipData),
+              std::end(kGzipData),
+              image.begin() + block * kBlockSize);
+  }
+  ScopedTempFile image_file("DeflateUtilsTest_image.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(image_file.path(), image));
+  PartitionConfig part("system");
+  part.path = image_file.path();
+  part.size = image.size();
+  part.fs_interface = std::make_unique<RegularFilesFilesystem>(
+      6,
+      vector<std::pair<std::string, Extent>>{
+          {"/a.gz", ExtentForRange(1, 1)},
+          {"/b.txt", ExtentForRange(2, 1)},
+          {"/c.gz", ExtentForRange(4, 1)}});
+
+  vector<FilesystemInterface::File> files;
+  ASSERT_TRUE(PreprocessPartitionFiles(part, &files, true));
+  ASSERT_EQ(3u, files.size());
+  EXPECT_EQ("/a.gz", files[0].name);
+  EXPECT_EQ("/b.txt", files[1].name);
+  EXPECT_EQ("/c.gz", files[2].name);
+
+  // The deflate stream starts after the 10 bytes gzip header, relative to the
+  // start of the partition.
+  ASSERT_EQ(1u, files[0].deflates.size());
+  EXPECT_EQ((kBlockSize + 10) * 8, files[0].deflates[0].offset);
+  EXPECT_TRUE(files[1].deflates.empty());
+  ASSERT_EQ(1u, files[2].deflates.size());
+  EXPECT_EQ(files[0].deflates[0].offset + 3 * kBlockSize * 8,
+            files[2].deflates[0].offset);
+  EXPECT_EQ(files[0].deflates[0].length, files[2].deflates[0].length);
+
+  // Without extracting deflates, no file is even read.
+  files.clear();
+  ASSERT_TRUE(PreprocessPartitionFiles(part, &files, false));
+  ASSERT_EQ(3u, files.size());
+  for (const auto& file : files) {
+    EXPECT_TRUE(file.deflates.empty());
+  }
+}
+
 }  // namespace deflate_utils
 }  // namespace chromeos_update_engine
@@ -24,6 +24,7 @@
 
 #include <algorithm>
 #include <memory>
+#include <numeric>
 #include <string>
 #include <utility>
 #include <vector>
@@ -38,11 +39,16 @@
 #include "update_engine/payload_generator/ab_generator.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/blob_file_writer.h"
+#include "update_engine/payload_generator/blob_pool.h"
 #include "update_engine/payload_generator/cow_size_estimator.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/full_update_generator.h"
+#include "update_engine/payload_generator/generation_profile.h"
+#include "update_engine/payload_generator/mapped_image.h"
 #include "update_engine/payload_generator/merge_sequence_generator.h"
 #include "update_engine/payload_generator/payload_file.h"
+#include "update_engine/payload_generator/payload_splicer.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "update_engine/update_metadata.pb.h"
 
 using std::string;
@@ -76,7 +82,8 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
       std::vector<AnnotatedOperation>* aops,
       std::vector<CowMergeOperation>* cow_merge_sequence,
       android::snapshot::CowSizeInfo* cow_info,
-      std::unique_ptr<chromeos_update_engine::OperationsGenerator> strategy)
+      std::unique_ptr<chromeos_update_engine::OperationsGenerator> strategy,
+      std::vector<const PayloadSplicer*> splicers)
       : config_(config),
         old_part_(old_part),
         new_part_(new_part),
@@ -84,20 +91,44 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
         aops_(aops),
         cow_merge_sequence_(cow_merge_sequence),
         cow_info_(cow_info),
-        strategy_(std::move(strategy)) {}
+        strategy_(std::move(strategy)),
+        splicers_(std::move(splicers)) {}
   PartitionProcessor(PartitionProcessor&&) noexcept = default;
 
   void Run() override {
     LOG(INFO) << "Started an async task to process partition "
               << new_part_.name;
-    bool success = strategy_->GenerateOperations(
-        config_, old_part_, new_part_, file_writer_, aops_);
+    for (const PayloadSplicer* splicer : splicers_) {
+      if (splicer->ReusePartition(config_,
+                                  old_part_,
+                                  new_part_,
+                                  file_writer_,
+                                  aops_,
+                                  cow_merge_sequence_,
+                                  cow_info_)) {
+        return;
+      }
+    }
+    bool success;
+    {
+      ScopedGenerationPhase phase(new_part_.name,
+                                  GenerationPhase::kGenerateOperations);
+      success = strategy_->GenerateOperations(
+          config_, old_part_, new_part_, file_writer_, aops_);
+    }
     if (!success) {
       // ABORT the entire process, so that developer can look
       // at recent logs and diagnose what happened
       LOG(FATAL) << "GenerateOperations(" << old_part_.name << ", "
                  << new_part_.name << ") failed";
     }
+    // The buffers of the diffs of this partition aren't needed anymore, and
+    // those of the partitions still being diffed are allocated again.
+    BlobPool::Get()->Trim();
+    if (!old_part_.path.empty()) {
+      MappedImage::Forget(old_part_.path);
+    }
+    MappedImage::Forget(new_part_.path);
 
     bool snapshot_enabled =
         config_.target.dynamic_partition_metadata &&
@@ -110,13 +141,20 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
       return;
     }
     if (!old_part_.path.empty()) {
+      ScopedGenerationPhase phase(new_part_.name,
+                                  GenerationPhase::kMergeSequence);
       auto generator = MergeSequenceGenerator::Create(*aops_, new_part_.name);
       if (!generator || !generator->Generate(cow_merge_sequence_)) {
         LOG(FATAL) << "Failed to generate merge sequence";
       }
+      if (config_.cow_merge_order_layout) {
+        SortOperationsByMergeSequence(*cow_merge_sequence_, aops_);
+      }
     }
 
     LOG(INFO) << "Estimating COW size for partition: " << new_part_.name;
+    ScopedGenerationPhase cow_phase(new_part_.name,
+                                    GenerationPhase::kCowEstimation);
     // Need the contents of source/target image bytes when doing
     // dry run.
     auto target_fd = std::make_unique<EintrSafeFileDescriptor>();
@@ -134,17 +172,29 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
       source_fd->Open(old_part_.path.c_str(), O_RDONLY);
     }
 
+    const auto& dap_metadata = *config_.target.dynamic_partition_metadata;
+    // b/322279333 use 4096 as estimation until we have an updated estimation
+    // algorithm, unless asked to estimate with the compression factor the
+    // device compresses with.
+    uint64_t compression_factor = config_.block_size;
+    if (config_.cow_estimate_with_compression_factor &&
+        dap_metadata.compression_factor() > 0) {
+      compression_factor = dap_metadata.compression_factor();
+    }
     *cow_info_ = EstimateCowSizeInfo(
         std::move(source_fd),
         std::move(target_fd),
         std::move(operations),
         {cow_merge_sequence_->begin(), cow_merge_sequence_->end()},
         config_.block_size,
-        config_.target.dynamic_partition_metadata->vabc_compression_param(),
+        dap_metadata.vabc_compression_param(),
         new_part_.size,
         config_.enable_vabc_xor,
-        config_.target.dynamic_partition_metadata->cow_version(),
-        config_.target.dynamic_partition_metadata->compression_factor());
+        dap_metadata.cow_version(),
+        compression_factor,
+        config_.max_threads > 0 ? config_.max_threads
+                                : diff_utils::GetMaxThreads(),
+        config_.cow_estimate_sample_interval);
 
     // ops buffer size == 0 for v2 version of cow format
     LOG(INFO) << "Estimated COW size for partition: " << new_part_.name << " "
@@ -161,6 +211,8 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
   std::vector<CowMergeOperation>* cow_merge_sequence_;
   android::snapshot::CowSizeInfo* cow_info_;
   std::unique_ptr<chromeos_update_engine::OperationsGenerator> strategy_;
+  // The payloads to reuse the partition from, if found in one of them.
+  const std::vector<const PayloadSplicer*> splicers_;
   DISALLOW_COPY_AND_ASSIGN(PartitionProcessor);
 };
 
@@ -174,10 +226,39 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
     return false;
   }
 
+  // All the partitions, files and chunks of files share the threads of a
+  // single scheduler, rather than each partition starting its own.
+  if (config.max_threads > 0) {
+    TaskScheduler::SetDefaultNumThreads(config.max_threads);
+  }
+  TaskScheduler::Get()->SetMemoryBudget(config.max_memory);
+
   // Create empty payload file object.
   PayloadFile payload;
   TEST_AND_RETURN_FALSE(payload.Init(config));
 
+  std::vector<std::unique_ptr<PayloadSplicer>> splicers;
+  std::vector<const PayloadSplicer*> compatible_splicers;
+  for (const string& reuse_payload_path : config.reuse_payload_paths) {
+    splicers.push_back(PayloadSplicer::Open(reuse_payload_path));
+    TEST_AND_RETURN_FALSE(splicers.back() != nullptr);
+    if (!splicers.back()->IsCompatible(config)) {
+      LOG(WARNING) << "Not reusing any partition of " << reuse_payload_path;
+      continue;
+    }
+    compatible_splicers.push_back(splicers.back().get());
+  }
+
+  // The partitions to generate, all of them unless generating a shard.
+  std::vector<size_t> partitions(config.target.partitions.size());
+  std::iota(partitions.begin(), partitions.end(), 0);
+  if (config.num_shards > 1) {
+    partitions = config.GetShardPartitions();
+    LOG(INFO) << "Generating the " << partitions.size()
+              << " partitions of shard " << config.shard_index << " out of "
+              << config.num_shards;
+  }
+
   ScopedTempFile data_file("CrAU_temp_data.XXXXXX", true);
   {
     off_t data_file_size = 0;
@@ -197,14 +278,11 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
         config.target.partitions.size());
 
     std::vector<PartitionProcessor> partition_tasks{};
-    auto thread_count = std::min<int>(diff_utils::GetMaxThreads(),
-                                      config.target.partitions.size());
-    base::DelegateSimpleThreadPool thread_pool{"partition-thread-pool",
-                                               thread_count};
-    for (size_t i = 0; i < config.target.partitions.size(); i++) {
+    for (size_t i : partitions) {
       const PartitionConfig& old_part =
           config.is_delta ? config.source.partitions[i] : empty_part;
       const PartitionConfig& new_part = config.target.partitions[i];
+      GenerationProfile::Get()->SetPartitionPath(new_part.path, new_part.name);
       LOG(INFO) << "Partition name: " << new_part.name;
       LOG(INFO) << "Partition size: " << new_part.size;
       LOG(INFO) << "Block count: " << new_part.size / config.block_size;
@@ -230,15 +308,16 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
                                                    &all_aops[i],
                                                    &all_merge_sequences[i],
                                                    &all_cow_info[i],
-                                                   std::move(strategy)));
+                                                   std::move(strategy),
+                                                   compatible_splicers));
     }
-    thread_pool.Start();
+    TaskScheduler::TaskGroup partition_group;
     for (auto& processor : partition_tasks) {
-      thread_pool.AddWork(&processor);
+      partition_group.Add([&processor] { processor.Run(); });
     }
-    thread_pool.JoinAll();
+    partition_group.Wait();
 
-    for (size_t i = 0; i < config.target.partitions.size(); i++) {
+    for (size_t i : partitions) {
       const PartitionConfig& old_part =
           config.is_delta ? config.source.partitions[i] : empty_part;
       const PartitionConfig& new_part = config.target.partitions[i];
@@ -30,6 +30,8 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <array>
+#include <cmath>
 #include <functional>
 #include <limits>
 #include <list>
@@ -61,13 +63,24 @@
 #include "update_engine/lz4diff/lz4diff.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/ab_generator.h"
+#include "update_engine/payload_generator/blob_pool.h"
 #include "update_engine/payload_generator/block_mapping.h"
 #include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_cache.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/file_similarity_index.h"
+#include "update_engine/payload_generator/generation_profile.h"
+#include "update_engine/payload_generator/mapped_image.h"
+#include "update_engine/payload_generator/parallel_suffix_array.h"
+#include "update_engine/payload_generator/flat_extent_ranges.h"
+#include "update_engine/payload_generator/suffix_array_cache.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "update_engine/payload_generator/xz.h"
+#include "update_engine/payload_generator/zstd_compress.h"
+#include "update_engine/payload_generator/zucchini_generator.h"
 
 using std::list;
 using std::map;
@@ -95,6 +108,58 @@ const uint64_t kMaxZucchiniDestinationSize = 150 * 1024 * 1024;  // bytes
 
 const int kBrotliCompressionQuality = 11;
 
+// Returns a rough peak memory use of diffing |old_size| bytes into |new_size|
+// bytes with |type|, besides the old and new data themselves.
+uint64_t EstimateDiffMemory(InstallOperation::Type type,
+                            uint64_t old_size,
+                            uint64_t new_size) {
+  switch (type) {
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+      // The 64 bit suffix array of the old data, and the patch streams.
+      return 8 * old_size + 2 * new_size;
+    case InstallOperation::PUFFDIFF:
+    case InstallOperation::LZ4DIFF_BSDIFF:
+    case InstallOperation::LZ4DIFF_PUFFDIFF:
+      // A bsdiff of the decompressed data, taken as three times bigger.
+      return 3 * (old_size + new_size) +
+             EstimateDiffMemory(
+                 InstallOperation::SOURCE_BSDIFF, 3 * old_size, 3 * new_size);
+    case InstallOperation::ZUCCHINI:
+      // The suffix array of the old file to diff the data between executable
+      // elements, which reserve their own memory while diffed.
+      return 6 * old_size + 2 * new_size;
+    default:
+      return 0;
+  }
+}
+
+// Large files diffed in chunks use as source of each chunk this many chunks
+// worth of the old file, so that data which moved by less than a chunk is
+// still found.
+const uint64_t kLargeFileWindowChunks = 3;
+
+// Returns the blocks of |old_extents| to diff the new chunk of |chunk_blocks|
+// at |chunk_offset| of a file of |new_blocks| blocks against: a window of
+// |window_blocks| at the same relative position in the old file.
+vector<Extent> OldWindowForChunk(const vector<Extent>& old_extents,
+                                 uint64_t chunk_offset,
+                                 uint64_t chunk_blocks,
+                                 uint64_t new_blocks,
+                                 uint64_t window_blocks) {
+  const uint64_t old_blocks = utils::BlocksInExtents(old_extents);
+  window_blocks = std::min(window_blocks, old_blocks);
+  if (window_blocks == 0) {
+    return {};
+  }
+  const uint64_t center = static_cast<uint64_t>(
+      (chunk_offset + chunk_blocks / 2.0) * old_blocks / new_blocks);
+  const uint64_t start =
+      std::min(center - std::min(center, window_blocks / 2),
+               old_blocks - window_blocks);
+  return ExtentsSublist(old_extents, start, window_blocks);
+}
+
 // Storing a diff operation has more overhead over replace operation in the
 // manifest, we need to store an additional src_sha256_hash which is 32 bytes
 // and not compressible, and also src_extents which could use anywhere from a
@@ -123,6 +188,37 @@ bool IsDiffOperationBetter(const InstallOperation& op,
          old_blob_size;
 }
 
+// Returns a rough estimate of the CPU time a device takes to apply an
+// operation of type |type|, relative to that of a SOURCE_BSDIFF one producing
+// the same data. PUFFDIFF inflates both the source and the target and deflates
+// the target again, and ZUCCHINI disassembles the source.
+double RelativeApplyCost(InstallOperation::Type type) {
+  switch (type) {
+    case InstallOperation::REPLACE:
+    case InstallOperation::SOURCE_COPY:
+      return 0;
+    case InstallOperation::REPLACE_ZSTD:
+      return 0.1;
+    case InstallOperation::REPLACE_XZ:
+      return 0.4;
+    case InstallOperation::REPLACE_BZ:
+      return 0.6;
+    case InstallOperation::SOURCE_BSDIFF:
+    case InstallOperation::BROTLI_BSDIFF:
+      return 1;
+    case InstallOperation::LZ4DIFF_BSDIFF:
+      return 1.5;
+    case InstallOperation::ZUCCHINI:
+      return 3;
+    case InstallOperation::PUFFDIFF:
+      return 5;
+    case InstallOperation::LZ4DIFF_PUFFDIFF:
+      return 5.5;
+    default:
+      return 1;
+  }
+}
+
 // Returns the levenshtein distance between string |a| and |b|.
 // https://en.wikipedia.org/wiki/Levenshtein_distance
 int LevenshteinDistance(const string& a, const string& b) {
@@ -161,6 +257,35 @@ static bool ShouldCreateNewOp(const std::vector<CowMergeOperation>& ops,
          dst_extent.start_block() + dst_extent.num_blocks() != dst_block;
 }
 
+// GetNthBlock() for all the blocks of |extents|, through a binary search of
+// the index of the first block of each extent rather than a walk over them.
+class BlockIndex {
+ public:
+  explicit BlockIndex(const google::protobuf::RepeatedPtrField<Extent>& extents)
+      : extents_(extents) {
+    first_blocks_.reserve(extents.size());
+    for (const auto& extent : extents) {
+      first_blocks_.push_back(num_blocks_);
+      num_blocks_ += extent.num_blocks();
+    }
+  }
+
+  size_t GetNthBlock(size_t n) const {
+    if (n >= num_blocks_) {
+      return std::numeric_limits<size_t>::max();
+    }
+    // The last extent starting at or before |n|, which can't be empty.
+    const auto it =
+        std::upper_bound(first_blocks_.begin(), first_blocks_.end(), n) - 1;
+    return extents_[it - first_blocks_.begin()].start_block() + n - *it;
+  }
+
+ private:
+  const google::protobuf::RepeatedPtrField<Extent>& extents_;
+  std::vector<size_t> first_blocks_;
+  size_t num_blocks_{0};
+};
+
 void AppendXorBlock(std::vector<CowMergeOperation>* ops,
                     size_t src_block,
                     size_t dst_block,
@@ -216,14 +341,25 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
   if (!old_block_info_.blocks.empty() && !new_block_info_.blocks.empty() &&
       config_.OperationEnabled(InstallOperation::LZ4DIFF_BSDIFF) &&
       config_.OperationEnabled(InstallOperation::LZ4DIFF_PUFFDIFF)) {
+    TaskScheduler::MemoryReservation reservation(
+        old_data_.size() + new_data_.size() +
+        EstimateDiffMemory(InstallOperation::LZ4DIFF_PUFFDIFF,
+                           old_data_.size(),
+                           new_data_.size()));
     brillo::Blob patch;
     InstallOperation::Type op_type{};
-    if (Lz4Diff(old_data_,
-                new_data_,
-                old_block_info_,
-                new_block_info_,
-                &patch,
-                &op_type)) {
+    const base::TimeTicks lz4diff_start = base::TimeTicks::Now();
+    const bool lz4diff_success = Lz4Diff(old_data_,
+                                         new_data_,
+                                         old_block_info_,
+                                         new_block_info_,
+                                         &patch,
+                                         &op_type,
+                                         config_.diff_cache.get());
+    diff_times_.emplace_back(
+        lz4diff_success ? op_type : InstallOperation::LZ4DIFF_PUFFDIFF,
+        base::TimeTicks::Now() - lz4diff_start);
+    if (lz4diff_success) {
       aop->op.set_type(op_type);
       // LZ4DIFF is likely significantly better than BSDIFF/PUFFDIFF when
       // working with EROFS. So no need to even try other diffing algorithms.
@@ -236,6 +372,13 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
                                         utils::BlocksInExtents(dst_extents_)) *
                                kBlockSize;
 
+  struct Candidate {
+    InstallOperation_Type type;
+    brillo::Blob patch;
+    bool success;
+    base::TimeDelta time;
+  };
+  vector<Candidate> candidates;
   for (auto [op_type, limit] : diff_candidates) {
     if (!config_.OperationEnabled(op_type)) {
       continue;
@@ -254,30 +397,117 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
       op_type = InstallOperation::BROTLI_BSDIFF;
     }
 
-    switch (op_type) {
+    // zip files are ignored for now. We expect puffin to perform better on
+    // those. Investigate whether puffin over zucchini yields better results on
+    // those.
+    if (op_type == InstallOperation::ZUCCHINI &&
+        !deflate_utils::IsFileExtensions(
+            aop->name,
+            {".ko",
+             ".so",
+             ".art",
+             ".odex",
+             ".vdex",
+             "<kernel>",
+             "<modem-partition>",
+             /*, ".capex",".jar", ".apk", ".apex"*/})) {
+      continue;
+    }
+    candidates.push_back({op_type, {}, false, {}});
+  }
+
+  auto generate = [this](Candidate* candidate) {
+    const base::TimeTicks start = base::TimeTicks::Now();
+    std::string cache_key;
+    if (config_.diff_cache) {
+      cache_key = DiffCacheKey(candidate->type,
+                               config_,
+                               old_data_,
+                               new_data_,
+                               old_deflates_,
+                               new_deflates_);
+      if (config_.diff_cache->Lookup(cache_key, &candidate->patch)) {
+        candidate->success = true;
+        candidate->time = base::TimeTicks::Now() - start;
+        return;
+      }
+    }
+    switch (candidate->type) {
       case InstallOperation::SOURCE_BSDIFF:
       case InstallOperation::BROTLI_BSDIFF:
-        TEST_AND_RETURN_FALSE(
-            TryBsdiffAndUpdateOperation(op_type, aop, data_blob));
+        candidate->success = GenerateBsdiff(candidate->type, &candidate->patch);
         break;
       case InstallOperation::PUFFDIFF:
-        TEST_AND_RETURN_FALSE(TryPuffdiffAndUpdateOperation(aop, data_blob));
+        candidate->success = GeneratePuffdiff(&candidate->patch);
         break;
       case InstallOperation::ZUCCHINI:
-        TEST_AND_RETURN_FALSE(TryZucchiniAndUpdateOperation(aop, data_blob));
+        candidate->success = GenerateZucchini(&candidate->patch);
         break;
       default:
         NOTREACHED();
     }
+    if (config_.diff_cache && candidate->success &&
+        !candidate->patch.empty()) {
+      config_.diff_cache->Store(cache_key, candidate->patch);
+    }
+    candidate->time = base::TimeTicks::Now() - start;
+  };
+  // The algorithms only read the old and new data, so they are run at the
+  // same time, mostly to not wait on each other for the few huge files. They
+  // wait for their memory to fit in the budget of the scheduler, if any.
+  uint64_t memory = old_data_.size() + new_data_.size();
+  for (const auto& candidate : candidates) {
+    memory +=
+        EstimateDiffMemory(candidate.type, old_data_.size(), new_data_.size());
+  }
+  TaskScheduler::MemoryReservation reservation(memory);
+  if (candidates.size() == 1) {
+    generate(&candidates[0]);
+  } else {
+    TaskScheduler::TaskGroup candidate_tasks;
+    for (auto& candidate : candidates) {
+      candidate_tasks.Add([&generate, &candidate] { generate(&candidate); });
+    }
+    candidate_tasks.Wait();
+  }
+
+  // The size of a |type| operation with a blob of |blob_size| bytes, plus its
+  // apply time counted as bytes of data for the target devices.
+  const auto cost = [this](InstallOperation::Type type, size_t blob_size) {
+    return blob_size + static_cast<size_t>(config_.apply_cost_weight *
+                                           RelativeApplyCost(type) *
+                                           new_data_.size());
+  };
+
+  // Pick the best patch in the order of |diff_candidates|, the same one as if
+  // they had been tried one after another.
+  InstallOperation& operation = aop->op;
+  bool bsdiff_picked = false;
+  for (auto& candidate : candidates) {
+    diff_times_.emplace_back(candidate.type, candidate.time);
+    TEST_AND_RETURN_FALSE(candidate.success);
+    if (!candidate.patch.empty() &&
+        IsDiffOperationBetter(operation,
+                              cost(operation.type(), data_blob->size()),
+                              cost(candidate.type, candidate.patch.size()),
+                              src_extents_.size())) {
+      operation.set_type(candidate.type);
+      *data_blob = std::move(candidate.patch);
+      bsdiff_picked = candidate.type == InstallOperation::SOURCE_BSDIFF ||
+                      candidate.type == InstallOperation::BROTLI_BSDIFF;
+    }
   }
 
+  // VABC XOR won't work with compressed files just yet.
+  if (config_.enable_vabc_xor && bsdiff_picked) {
+    StoreExtents(src_extents_, operation.mutable_src_extents());
+    diff_utils::PopulateXorOps(aop, *data_blob);
+  }
   return true;
 }
 
-bool BestDiffGenerator::TryBsdiffAndUpdateOperation(
-    InstallOperation_Type operation_type,
-    AnnotatedOperation* aop,
-    brillo::Blob* data_blob) {
+bool BestDiffGenerator::GenerateBsdiff(InstallOperation_Type operation_type,
+                                       brillo::Blob* patch_data) const {
   base::FilePath patch;
   TEST_AND_RETURN_FALSE(base::CreateTemporaryFile(&patch));
   ScopedPathUnlinker unlinker(patch.value());
@@ -290,38 +520,32 @@ bool BestDiffGenerator::TryBsdiffAndUpdateOperation(
     bsdiff_patch_writer = bsdiff::CreateBsdiffPatchWriter(patch.value());
   }
 
-  brillo::Blob bsdiff_delta;
-  TEST_AND_RETURN_FALSE(0 == bsdiff::bsdiff(old_data_.data(),
-                                            old_data_.size(),
-                                            new_data_.data(),
-                                            new_data_.size(),
-                                            bsdiff_patch_writer.get(),
-                                            nullptr));
-
-  TEST_AND_RETURN_FALSE(utils::ReadFile(patch.value(), &bsdiff_delta));
-  TEST_AND_RETURN_FALSE(!bsdiff_delta.empty());
-
-  InstallOperation& operation = aop->op;
-  if (IsDiffOperationBetter(operation,
-                            data_blob->size(),
-                            bsdiff_delta.size(),
-                            src_extents_.size())) {
-    // VABC XOR won't work with compressed files just yet.
-    if (config_.enable_vabc_xor) {
-      StoreExtents(src_extents_, operation.mutable_src_extents());
-      diff_utils::PopulateXorOps(aop, bsdiff_delta);
-    }
-    operation.set_type(operation_type);
-    *data_blob = std::move(bsdiff_delta);
+  const bool parallel =
+      config_.parallel_suffix_array_min_size > 0 &&
+      old_data_.size() >= config_.parallel_suffix_array_min_size;
+  if (config_.suffix_array_cache) {
+    TEST_AND_RETURN_FALSE(config_.suffix_array_cache->Bsdiff(
+        old_data_, new_data_, bsdiff_patch_writer.get(), parallel));
+  } else if (parallel) {
+    TEST_AND_RETURN_FALSE(
+        ParallelBsdiff(old_data_, new_data_, bsdiff_patch_writer.get()));
+  } else {
+    TEST_AND_RETURN_FALSE(0 == bsdiff::bsdiff(old_data_.data(),
+                                              old_data_.size(),
+                                              new_data_.data(),
+                                              new_data_.size(),
+                                              bsdiff_patch_writer.get(),
+                                              nullptr));
   }
+
+  TEST_AND_RETURN_FALSE(utils::ReadFile(patch.value(), patch_data));
+  TEST_AND_RETURN_FALSE(!patch_data->empty());
   return true;
 }
 
-bool BestDiffGenerator::TryPuffdiffAndUpdateOperation(AnnotatedOperation* aop,
-                                                      brillo::Blob* data_blob) {
+bool BestDiffGenerator::GeneratePuffdiff(brillo::Blob* patch_data) const {
   // Only Puffdiff if both files have at least one deflate left.
   if (!old_deflates_.empty() && !new_deflates_.empty()) {
-    brillo::Blob puffdiff_delta;
     ScopedTempFile temp_file("puffdiff-delta.XXXXXX");
     // Perform PuffDiff operation.
     TEST_AND_RETURN_FALSE(puffin::PuffDiff(old_data_,
@@ -330,42 +554,18 @@ bool BestDiffGenerator::TryPuffdiffAndUpdateOperation(AnnotatedOperation* aop,
                                            new_deflates_,
                                            GetUsableCompressorTypes(),
                                            temp_file.path(),
-                                           &puffdiff_delta));
-    TEST_AND_RETURN_FALSE(!puffdiff_delta.empty());
-
-    InstallOperation& operation = aop->op;
-    if (IsDiffOperationBetter(operation,
-                              data_blob->size(),
-                              puffdiff_delta.size(),
-                              src_extents_.size())) {
-      operation.set_type(InstallOperation::PUFFDIFF);
-      *data_blob = std::move(puffdiff_delta);
-    }
+                                           patch_data));
+    TEST_AND_RETURN_FALSE(!patch_data->empty());
   }
   return true;
 }
 
-bool BestDiffGenerator::TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
-                                                      brillo::Blob* data_blob) {
-  // zip files are ignored for now. We expect puffin to perform better on those.
-  // Investigate whether puffin over zucchini yields better results on those.
-  if (!deflate_utils::IsFileExtensions(
-          aop->name,
-          {".ko",
-           ".so",
-           ".art",
-           ".odex",
-           ".vdex",
-           "<kernel>",
-           "<modem-partition>",
-           /*, ".capex",".jar", ".apk", ".apex"*/})) {
-    return true;
-  }
+bool BestDiffGenerator::GenerateZucchini(brillo::Blob* patch_data) const {
   zucchini::ConstBufferView src_bytes(old_data_.data(), old_data_.size());
   zucchini::ConstBufferView dst_bytes(new_data_.data(), new_data_.size());
 
   zucchini::EnsemblePatchWriter patch_writer(src_bytes, dst_bytes);
-  auto status = zucchini::GenerateBuffer(src_bytes, dst_bytes, &patch_writer);
+  auto status = GenerateZucchiniPatch(src_bytes, dst_bytes, &patch_writer);
   TEST_AND_RETURN_FALSE(status == zucchini::status::kStatusSuccess);
 
   brillo::Blob zucchini_delta(patch_writer.SerializedSize());
@@ -374,19 +574,8 @@ bool BestDiffGenerator::TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
   // Compress the delta with brotli.
   // TODO(197361113) support compressing the delta with different algorithms,
   // similar to the usage in puffin.
-  brillo::Blob compressed_delta;
   TEST_AND_RETURN_FALSE(puffin::BrotliEncode(
-      zucchini_delta.data(), zucchini_delta.size(), &compressed_delta));
-
-  InstallOperation& operation = aop->op;
-  if (IsDiffOperationBetter(operation,
-                            data_blob->size(),
-                            compressed_delta.size(),
-                            src_extents_.size())) {
-    operation.set_type(InstallOperation::ZUCCHINI);
-    *data_blob = std::move(compressed_delta);
-  }
-
+      zucchini_delta.data(), zucchini_delta.size(), patch_data));
   return true;
 }
 
@@ -474,8 +663,11 @@ void FileDeltaProcessor::Run() {
     return;
   }
 
+  const base::TimeDelta duration = base::TimeTicks::Now() - start;
+  GenerationProfile::Get()->AddFile(
+      new_part_, name_, new_extents_blocks_, duration);
   LOG(INFO) << "Encoded file " << name_ << " (" << new_extents_blocks_
-            << " blocks) in " << (base::TimeTicks::Now() - start);
+            << " blocks) in " << duration;
 }
 
 bool FileDeltaProcessor::MergeOperation(vector<AnnotatedOperation>* aops) {
@@ -514,7 +706,7 @@ FilesystemInterface::File GetOldFile(
 }
 
 std::vector<Extent> RemoveDuplicateBlocks(const std::vector<Extent>& extents) {
-  ExtentRanges extent_set;
+  FlatExtentRanges extent_set;
   std::vector<Extent> ret;
   for (const auto& extent : extents) {
     auto vec = FilterExtentRanges({extent}, extent_set);
@@ -538,9 +730,11 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
   ExtentRanges new_visited_blocks;
 
   // If verity is enabled, mark those blocks as visited to skip generating
-  // operations for them.
-  if (version.minor >= kVerityMinorPayloadVersion &&
-      !new_part.verity.IsEmpty()) {
+  // operations for them, unless the hash tree and FEC data are shipped in the
+  // payload.
+  const bool has_verity = version.minor >= kVerityMinorPayloadVersion &&
+                          !new_part.verity.IsEmpty();
+  if (has_verity) {
     LOG(INFO) << "Skipping verity hash tree blocks: "
               << ExtentsToString({new_part.verity.hash_tree_extent});
     new_visited_blocks.AddExtent(new_part.verity.hash_tree_extent);
@@ -554,8 +748,12 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
 
   TEST_AND_RETURN_FALSE(new_part.fs_interface);
   vector<FilesystemInterface::File> new_files;
-  TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
-      new_part, &new_files, puffdiff_allowed));
+  {
+    ScopedGenerationPhase phase(new_part.name,
+                                GenerationPhase::kDeflatePreprocessing);
+    TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
+        new_part, &new_files, puffdiff_allowed));
+  }
 
   ExtentRanges old_zero_blocks;
   // Prematurely removing moved blocks will render compression info useless.
@@ -570,6 +768,7 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
       });
   if (!config.OperationEnabled(InstallOperation::LZ4DIFF_BSDIFF) ||
       no_compressed_files) {
+    ScopedGenerationPhase phase(new_part.name, GenerationPhase::kBlockMapping);
     TEST_AND_RETURN_FALSE(DeltaMovedAndZeroBlocks(aops,
                                                   old_part.path,
                                                   new_part.path,
@@ -586,12 +785,17 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
   map<string, FilesystemInterface::File> old_files_map;
   if (old_part.fs_interface) {
     vector<FilesystemInterface::File> old_files;
+    ScopedGenerationPhase phase(new_part.name,
+                                GenerationPhase::kDeflatePreprocessing);
     TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
         old_part, &old_files, puffdiff_allowed));
     for (const FilesystemInterface::File& file : old_files)
       old_files_map[file.name] = file;
   }
 
+  // Built once a new file doesn't have an old file of the same name.
+  std::unique_ptr<FileSimilarityIndex> old_files_index;
+
   list<FileDeltaProcessor> file_delta_processors;
 
   // The processing is very straightforward here, we generate operations for
@@ -613,8 +817,27 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     if (new_file_extents.empty())
       continue;
 
+    // A new file without an old file of the same name, often a renamed or
+    // moved one, is diffed against the old file with the most similar data,
+    // if any.
+    const FilesystemInterface::File* similar_file = nullptr;
+    if (!old_files_map.empty() && old_files_map.count(new_file.name) == 0) {
+      if (!old_files_index) {
+        ScopedGenerationPhase phase(new_part.name,
+                                    GenerationPhase::kFileMatching);
+        old_files_index = std::make_unique<FileSimilarityIndex>();
+        TEST_AND_RETURN_FALSE(
+            old_files_index->Init(old_part.path, old_files_map));
+      }
+      TEST_AND_RETURN_FALSE(old_files_index->FindSimilarFile(
+          new_part.path, new_file, &similar_file));
+      if (similar_file) {
+        LOG(INFO) << "Using " << similar_file->name << " as source for "
+                  << new_file.name << " for their similar data";
+      }
+    }
     FilesystemInterface::File old_file =
-        GetOldFile(old_files_map, new_file.name);
+        similar_file ? *similar_file : GetOldFile(old_files_map, new_file.name);
     old_visited_blocks.AddExtents(old_file.extents);
 
     // TODO(b/177104308) Filtering |new_file_extents| might confuse puffdiff, as
@@ -643,6 +866,28 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                                        hard_chunk_blocks,
                                        blob_file);
   }
+  // The verity data of the new image is written in full, as it changes
+  // entirely along with the data it covers.
+  if (has_verity && new_part.verity.data_in_payload) {
+    const std::pair<Extent, const char*> verity_extents[] = {
+        {new_part.verity.hash_tree_extent, "<verity-hash-tree>"},
+        {new_part.verity.fec_extent, "<verity-fec>"}};
+    for (const auto& [extent, name] : verity_extents) {
+      if (extent.num_blocks() == 0)
+        continue;
+      File new_file;
+      new_file.name = name;
+      new_file.extents = {extent};
+      file_delta_processors.emplace_back(old_part.path,
+                                         new_part.path,
+                                         config,
+                                         File(),
+                                         std::move(new_file),
+                                         name,  // operation name
+                                         hard_chunk_blocks,
+                                         blob_file);
+    }
+  }
   // Process all the blocks not included in any file. We provided all the unused
   // blocks in the old partition as available data.
   vector<Extent> new_unvisited = {
@@ -675,25 +920,20 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                                        blob_file);
   }
 
-  size_t max_threads = GetMaxThreads();
-
-  if (config.max_threads > 0) {
-    max_threads = config.max_threads;
-  }
-
   // Sort the files in descending order based on number of new blocks to make
-  // sure we start the largest ones first.
-  if (file_delta_processors.size() > max_threads) {
+  // sure we start the largest ones first. The files share the threads of the
+  // process wide scheduler with the other partitions.
+  TaskScheduler* scheduler = TaskScheduler::Get();
+  if (file_delta_processors.size() > scheduler->num_threads()) {
     file_delta_processors.sort(std::greater<FileDeltaProcessor>());
   }
 
-  base::DelegateSimpleThreadPool thread_pool("incremental-update-generator",
-                                             max_threads);
-  thread_pool.Start();
+  ScopedGenerationPhase diff_phase(new_part.name, GenerationPhase::kDiff);
+  TaskScheduler::TaskGroup file_tasks(scheduler);
   for (auto& processor : file_delta_processors) {
-    thread_pool.AddWork(&processor);
+    file_tasks.Add([&processor] { processor.Run(); });
   }
-  thread_pool.JoinAll();
+  file_tasks.Wait();
 
   for (auto& processor : file_delta_processors) {
     TEST_AND_RETURN_FALSE(processor.MergeOperation(aops));
@@ -863,8 +1103,6 @@ bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
   const auto& new_extents = new_file.extents;
   const auto& name = new_file.name;
 
-  brillo::Blob data;
-
   uint64_t total_blocks = utils::BlocksInExtents(new_extents);
   if (chunk_blocks == 0) {
     LOG(ERROR) << "Invalid number of chunk_blocks. Cannot be 0.";
@@ -873,47 +1111,92 @@ bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
 
   if (chunk_blocks == -1)
     chunk_blocks = total_blocks;
+  if (total_blocks == 0)
+    return true;
 
-  for (uint64_t block_offset = 0; block_offset < total_blocks;
-       block_offset += chunk_blocks) {
+  // Large files are split further, trading a little payload size for diffing
+  // them on many threads. LZ4DIFF needs the whole compressed file.
+  const uint64_t large_chunk_blocks =
+      config.large_file_chunk_size / config.block_size;
+  const bool large_file = large_chunk_blocks > 0 &&
+                          total_blocks > large_chunk_blocks &&
+                          static_cast<uint64_t>(chunk_blocks) >
+                              large_chunk_blocks &&
+                          new_file.compressed_file_info.blocks.empty();
+  if (large_file) {
+    LOG(INFO) << "Diffing " << name << " (" << total_blocks
+              << " blocks) in chunks of " << large_chunk_blocks << " blocks";
+    chunk_blocks = large_chunk_blocks;
+  }
+
+  // Chunks of big files are diffed independently, so they are run as tasks of
+  // their own and their operations put back in order once all are done.
+  const uint64_t num_chunks = (total_blocks + chunk_blocks - 1) / chunk_blocks;
+  vector<AnnotatedOperation> chunk_aops(num_chunks);
+  // Not vector<bool>, as its elements can't be written concurrently.
+  vector<uint8_t> chunk_done(num_chunks, false);
+  auto diff_chunk = [&](uint64_t chunk) {
+    const uint64_t block_offset = chunk * chunk_blocks;
     // Split the old/new file in the same chunks. Note that this could drop
     // some information from the old file used for the new chunk. If the old
     // file is smaller (or even empty when there's no old file) the chunk will
-    // also be empty.
-    vector<Extent> old_extents_chunk =
-        ExtentsSublist(old_extents, block_offset, chunk_blocks);
+    // also be empty. Chunks of large files get a window of the old file
+    // overlapping the neighbouring chunks instead.
     vector<Extent> new_extents_chunk =
         ExtentsSublist(new_extents, block_offset, chunk_blocks);
+    vector<Extent> old_extents_chunk =
+        large_file ? OldWindowForChunk(
+                         old_extents,
+                         block_offset,
+                         utils::BlocksInExtents(new_extents_chunk),
+                         total_blocks,
+                         kLargeFileWindowChunks * chunk_blocks)
+                   : ExtentsSublist(old_extents, block_offset, chunk_blocks);
     NormalizeExtents(&old_extents_chunk);
     NormalizeExtents(&new_extents_chunk);
 
     // Now, insert into the list of operations.
-    AnnotatedOperation aop;
+    AnnotatedOperation& aop = chunk_aops[chunk];
     aop.name = new_file.name;
-    TEST_AND_RETURN_FALSE(ReadExtentsToDiff(old_part,
-                                            new_part,
-                                            old_extents_chunk,
-                                            new_extents_chunk,
-                                            old_file,
-                                            new_file,
-                                            config,
-                                            &data,
-                                            &aop));
+    brillo::Blob data;
+    TEST_AND_RETURN(ReadExtentsToDiff(old_part,
+                                      new_part,
+                                      old_extents_chunk,
+                                      new_extents_chunk,
+                                      old_file,
+                                      new_file,
+                                      config,
+                                      &data,
+                                      &aop));
 
     // Check if the operation writes nothing.
     if (aop.op.dst_extents_size() == 0) {
       LOG(ERROR) << "Empty non-MOVE operation";
-      return false;
+      return;
     }
 
-    if (static_cast<uint64_t>(chunk_blocks) < total_blocks) {
-      aop.name = base::StringPrintf(
-          "%s:%" PRIu64, name.c_str(), block_offset / chunk_blocks);
+    if (num_chunks > 1) {
+      aop.name = base::StringPrintf("%s:%" PRIu64, name.c_str(), chunk);
     }
 
     // Write the data
-    TEST_AND_RETURN_FALSE(aop.SetOperationBlob(data, blob_file));
-    aops->emplace_back(aop);
+    TEST_AND_RETURN(aop.SetOperationBlob(data, blob_file));
+    BlobPool::Get()->Release(std::move(data));
+    chunk_done[chunk] = true;
+  };
+
+  if (num_chunks == 1) {
+    diff_chunk(0);
+  } else {
+    TaskScheduler::TaskGroup chunk_tasks;
+    for (uint64_t chunk = 0; chunk < num_chunks; chunk++) {
+      chunk_tasks.Add([&diff_chunk, chunk] { diff_chunk(chunk); });
+    }
+    chunk_tasks.Wait();
+  }
+  for (uint64_t chunk = 0; chunk < num_chunks; chunk++) {
+    TEST_AND_RETURN_FALSE(chunk_done[chunk]);
+    aops->emplace_back(std::move(chunk_aops[chunk]));
   }
   return true;
 }
@@ -922,12 +1205,50 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
                                const PayloadVersion& version,
                                brillo::Blob* out_blob,
                                InstallOperation::Type* out_type) {
+  PayloadGenerationConfig config;
+  config.version = version;
+  return GenerateBestFullOperation(new_data, config, out_blob, out_type);
+}
+
+double EstimateEntropy(const brillo::Blob& data) {
+  // The samples are windows of this many bytes.
+  constexpr size_t kWindowSize = 4096;
+  std::array<size_t, 256> counts{};
+  size_t total = 0;
+  const auto count_bytes = [&](size_t offset, size_t size) {
+    for (size_t i = offset; i < offset + size; i++) {
+      counts[data[i]]++;
+    }
+    total += size;
+  };
+  if (data.size() <= kEntropySampleSize) {
+    count_bytes(0, data.size());
+  } else {
+    const size_t num_windows = kEntropySampleSize / kWindowSize;
+    for (size_t i = 0; i < num_windows; i++) {
+      count_bytes((data.size() - kWindowSize) * i / (num_windows - 1),
+                  kWindowSize);
+    }
+  }
+  double entropy = 0;
+  for (size_t count : counts) {
+    if (count > 0) {
+      const double p = static_cast<double>(count) / total;
+      entropy -= p * std::log2(p);
+    }
+  }
+  return entropy;
+}
+
+bool GenerateBestFullOperation(const brillo::Blob& new_data,
+                               const PayloadGenerationConfig& config,
+                               brillo::Blob* out_blob,
+                               InstallOperation::Type* out_type) {
   if (new_data.empty())
     return false;
 
-  if (version.OperationAllowed(InstallOperation::ZERO) &&
-      std::all_of(
-          new_data.begin(), new_data.end(), [](uint8_t x) { return x == 0; })) {
+  if (config.OperationEnabled(InstallOperation::ZERO) &&
+      utils::IsZero(new_data.data(), new_data.size())) {
     // The read buffer is all zeros, so produce a ZERO operation. No need to
     // check other types of operations in this case.
     *out_blob = brillo::Blob();
@@ -935,12 +1256,54 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
     return true;
   }
 
+  // Data already compressed, like most of the contents of APKs and media
+  // files, doesn't compress any further, which the entropy of a sample of it
+  // tells for a fraction of the cost of trying the compressors. Smaller data
+  // is just as cheap to compress.
+  if (config.incompressible_entropy > 0 &&
+      new_data.size() >= kEntropySampleSize &&
+      EstimateEntropy(new_data) >= config.incompressible_entropy) {
+    *out_type = InstallOperation::REPLACE;
+    *out_blob = new_data;
+    return true;
+  }
+
   bool out_blob_set = false;
 
+  // zstd decompresses several times faster than xz for a similar size, so
+  // when enabled it replaces the xz and bzip2 candidates.
+  bool try_zstd = config.OperationEnabled(InstallOperation::REPLACE_ZSTD);
+  if (try_zstd) {
+    brillo::Blob new_data_zstd;
+    if (ZstdCompress(new_data, &new_data_zstd) && !new_data_zstd.empty()) {
+      *out_type = InstallOperation::REPLACE_ZSTD;
+      *out_blob = std::move(new_data_zstd);
+      out_blob_set = true;
+    }
+  }
+
+  // The xz and bzip2 candidates don't depend on each other, so compress with
+  // bzip2 on another thread of the scheduler while this one runs xz. The
+  // choice between them is the same as if they ran one after the other.
+  bool try_xz =
+      !try_zstd && config.OperationEnabled(InstallOperation::REPLACE_XZ);
+  bool try_bz =
+      !try_zstd && config.OperationEnabled(InstallOperation::REPLACE_BZ);
+  brillo::Blob new_data_bz;
+  bool bz_success = false;
+  auto compress_bz = [&new_data, &new_data_bz, &bz_success] {
+    bz_success = BzipCompress(new_data, &new_data_bz) && !new_data_bz.empty();
+  };
+  TaskScheduler::TaskGroup bz_task;
+  if (try_bz && try_xz) {
+    bz_task.Add(compress_bz);
+  }
+
   // Try compressing |new_data| with xz first.
-  if (version.OperationAllowed(InstallOperation::REPLACE_XZ)) {
+  if (try_xz) {
     brillo::Blob new_data_xz;
-    if (XzCompress(new_data, &new_data_xz) && !new_data_xz.empty()) {
+    if (XzCompress(new_data, config.xz_block_size, &new_data_xz) &&
+        !new_data_xz.empty()) {
       *out_type = InstallOperation::REPLACE_XZ;
       *out_blob = std::move(new_data_xz);
       out_blob_set = true;
@@ -948,11 +1311,15 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
   }
 
   // Try compressing it with bzip2.
-  if (version.OperationAllowed(InstallOperation::REPLACE_BZ)) {
-    brillo::Blob new_data_bz;
+  if (try_bz) {
+    if (try_xz) {
+      bz_task.Wait();
+    } else {
+      compress_bz();
+    }
     // TODO(deymo): Implement some heuristic to determine if it is worth trying
     // to compress the blob with bzip2 if we already have a good REPLACE_XZ.
-    if (BzipCompress(new_data, &new_data_bz) && !new_data_bz.empty() &&
+    if (bz_success &&
         (!out_blob_set || out_blob->size() > new_data_bz.size())) {
       // A REPLACE_BZ is better or nothing else was set.
       *out_type = InstallOperation::REPLACE_BZ;
@@ -985,6 +1352,8 @@ bool PopulateXorOps(AnnotatedOperation* aop, const uint8_t* data, size_t size) {
   size_t total_xor_blocks = 0;
   const auto new_file_size =
       utils::BlocksInExtents(aop->op.dst_extents()) * kBlockSize;
+  const BlockIndex src_blocks(aop->op.src_extents());
+  const BlockIndex dst_blocks(aop->op.dst_extents());
   while (new_off < new_file_size) {
     if (!patch_reader.ParseControlEntry(&entry)) {
       LOG(ERROR)
@@ -1004,11 +1373,10 @@ bool PopulateXorOps(AnnotatedOperation* aop, const uint8_t* data, size_t size) {
       // Append chunk_size/kBlockSize number of XOR blocks, subject to rounding
       // rules: if decimal part of that division is >= 0.5, round up.
       for (size_t i = 0; i < xor_blocks; i++) {
-        AppendXorBlock(
-            &xor_ops,
-            GetNthBlock(aop->op.src_extents(), src_off / kBlockSize),
-            GetNthBlock(aop->op.dst_extents(), dst_off_aligned / kBlockSize),
-            src_off % kBlockSize);
+        AppendXorBlock(&xor_ops,
+                       src_blocks.GetNthBlock(src_off / kBlockSize),
+                       dst_blocks.GetNthBlock(dst_off_aligned / kBlockSize),
+                       src_off % kBlockSize);
         src_off += kBlockSize;
         dst_off_aligned += kBlockSize;
       }
@@ -1058,42 +1426,48 @@ bool ReadExtentsToDiff(const string& old_part,
   // All operations have dst_extents.
   StoreExtents(dst_extents, operation.mutable_dst_extents());
 
-  // Read in bytes from new data.
-  brillo::Blob new_data;
-  TEST_AND_RETURN_FALSE(utils::ReadExtents(new_part,
-                                           dst_extents,
-                                           &new_data,
-                                           kBlockSize * blocks_to_write,
-                                           kBlockSize));
-  TEST_AND_RETURN_FALSE(!new_data.empty());
+  // The blocks are read from mappings of the images, which also compares them
+  // without reading them into memory. The mappings are shared by all the
+  // operations of the partition.
+  TEST_AND_RETURN_FALSE(blocks_to_write > 0);
+  auto new_image = MappedImage::Get(new_part);
+  TEST_AND_RETURN_FALSE(new_image);
+  std::shared_ptr<const MappedImage> old_image;
+  if (blocks_to_read > 0) {
+    old_image = MappedImage::Get(old_part);
+    TEST_AND_RETURN_FALSE(old_image);
+  }
 
   // Data blob that will be written to delta file.
   brillo::Blob data_blob;
 
-  // Try generating a full operation for the given new data, regardless of the
-  // old_data.
-  InstallOperation::Type op_type{};
-  TEST_AND_RETURN_FALSE(
-      GenerateBestFullOperation(new_data, version, &data_blob, &op_type));
-  operation.set_type(op_type);
-
-  if (blocks_to_read > 0) {
-    brillo::Blob old_data;
-    // Read old data.
-    TEST_AND_RETURN_FALSE(utils::ReadExtents(old_part,
-                                             src_extents,
-                                             &old_data,
-                                             kBlockSize * blocks_to_read,
-                                             kBlockSize));
-    if (old_data == new_data) {
-      // No change in data.
-      operation.set_type(InstallOperation::SOURCE_COPY);
-      data_blob = brillo::Blob();
-    } else if (IsDiffOperationBetter(
-                   operation, data_blob.size(), 0, src_extents.size())) {
-      // No point in trying diff if zero blob size diff operation is
-      // still worse than replace.
-
+  if (old_image && new_image->ExtentsEqual(
+                       dst_extents, *old_image, src_extents, kBlockSize)) {
+    // No change in data.
+    operation.set_type(InstallOperation::SOURCE_COPY);
+  } else {
+    // Read in bytes from new data.
+    PooledBlob pooled_new_data(blocks_to_write * kBlockSize);
+    brillo::Blob& new_data = *pooled_new_data;
+    TEST_AND_RETURN_FALSE(
+        new_image->ReadExtents(dst_extents, kBlockSize, &new_data));
+    TEST_AND_RETURN_FALSE(!new_data.empty());
+
+    // Try generating a full operation for the given new data, regardless of
+    // the old_data.
+    InstallOperation::Type op_type{};
+    TEST_AND_RETURN_FALSE(
+        GenerateBestFullOperation(new_data, config, &data_blob, &op_type));
+    operation.set_type(op_type);
+
+    // No point in trying diff if zero blob size diff operation is still worse
+    // than replace.
+    if (old_image && IsDiffOperationBetter(
+                         operation, data_blob.size(), 0, src_extents.size())) {
+      PooledBlob pooled_old_data(blocks_to_read * kBlockSize);
+      brillo::Blob& old_data = *pooled_old_data;
+      TEST_AND_RETURN_FALSE(
+          old_image->ReadExtents(src_extents, kBlockSize, &old_data));
       BestDiffGenerator best_diff_generator(old_data,
                                             new_data,
                                             src_extents,
@@ -1101,7 +1475,12 @@ bool ReadExtentsToDiff(const string& old_part,
                                             old_file,
                                             new_file,
                                             config);
-      if (!best_diff_generator.GenerateBestDiffOperation(&aop, &data_blob)) {
+      const bool success =
+          best_diff_generator.GenerateBestDiffOperation(&aop, &data_blob);
+      for (const auto& [type, time] : best_diff_generator.diff_times()) {
+        GenerationProfile::Get()->AddDiff(new_part, new_file.name, type, time);
+      }
+      if (!success) {
         LOG(INFO) << "Failed to generate diff for " << new_file.name;
         return false;
       }
@@ -1135,10 +1514,18 @@ bool ReadExtentsToDiff(const string& old_part,
   return true;
 }
 
+double EstimateApplyCost(const InstallOperation& op, size_t block_size) {
+  uint64_t dst_blocks = 0;
+  for (const Extent& extent : op.dst_extents())
+    dst_blocks += extent.num_blocks();
+  return RelativeApplyCost(op.type()) * dst_blocks * block_size;
+}
+
 bool IsAReplaceOperation(InstallOperation::Type op_type) {
   return (op_type == InstallOperation::REPLACE ||
           op_type == InstallOperation::REPLACE_BZ ||
-          op_type == InstallOperation::REPLACE_XZ);
+          op_type == InstallOperation::REPLACE_XZ ||
+          op_type == InstallOperation::REPLACE_ZSTD);
 }
 
 bool IsNoSourceOperation(InstallOperation::Type op_type) {
@@ -1146,9 +1533,11 @@ bool IsNoSourceOperation(InstallOperation::Type op_type) {
           op_type == InstallOperation::DISCARD);
 }
 
-bool InitializePartitionInfo(const PartitionConfig& part, PartitionInfo* info) {
+bool InitializePartitionInfo(const PartitionConfig& part,
+                             PartitionInfo* info,
+                             HashAlgorithm algorithm) {
   info->set_size(part.size);
-  HashCalculator hasher;
+  HashCalculator hasher(algorithm);
   TEST_AND_RETURN_FALSE(hasher.UpdateFile(part.path, part.size) ==
                         static_cast<off_t>(part.size));
   TEST_AND_RETURN_FALSE(hasher.Finalize());
@@ -1159,8 +1548,8 @@ bool InitializePartitionInfo(const PartitionConfig& part, PartitionInfo* info) {
   return true;
 }
 
-bool CompareAopsByDestination(AnnotatedOperation first_aop,
-                              AnnotatedOperation second_aop) {
+bool CompareAopsByDestination(const AnnotatedOperation& first_aop,
+                              const AnnotatedOperation& second_aop) {
   // We want empty operations to be at the end of the payload.
   if (!first_aop.op.dst_extents().size() || !second_aop.op.dst_extents().size())
     return ((!first_aop.op.dst_extents().size()) <
@@ -22,6 +22,7 @@
 #include <utility>
 #include <vector>
 
+#include <base/time/time.h>
 #include <brillo/secure_blob.h>
 #include <puffin/puffdiff.h>
 
@@ -79,7 +80,9 @@ bool DeltaMovedAndZeroBlocks(std::vector<AnnotatedOperation>* aops,
 
 // For a given file |name| append operations to |aops| to produce it in the
 // |new_part|. The file will be split in chunks of |chunk_blocks| blocks each
-// or treated as a single chunk if |chunk_blocks| is -1. The file data is
+// or treated as a single chunk if |chunk_blocks| is -1, or in chunks of
+// |config.large_file_chunk_size| if smaller and the file is bigger. The chunks
+// are diffed concurrently. The file data is
 // stored in |new_part| in the blocks described by |new_extents| and, if it
 // exists, the old version exists in |old_part| in the blocks described by
 // |old_extents|. The operations added to |aops| reference the data blob
@@ -123,19 +126,37 @@ bool GenerateBestFullOperation(const brillo::Blob& new_data,
                                brillo::Blob* out_blob,
                                InstallOperation::Type* out_type);
 
+// Like the above, but only uses the operations enabled in |config|, which
+// include the optional ones such as REPLACE_ZSTD.
+bool GenerateBestFullOperation(const brillo::Blob& new_data,
+                               const PayloadGenerationConfig& config,
+                               brillo::Blob* out_blob,
+                               InstallOperation::Type* out_type);
+
+// Returns the Shannon entropy in bits per byte of the bytes of |data|, or of
+// kEntropySampleSize bytes sampled evenly over it if larger.
+constexpr size_t kEntropySampleSize = 64 * 1024;  // bytes
+double EstimateEntropy(const brillo::Blob& data);
+
+// Returns a rough estimate of the time a device takes to apply |op|, in
+// bytes of target data a SOURCE_BSDIFF operation writes in the same time.
+double EstimateApplyCost(const InstallOperation& op, size_t block_size);
+
 // Returns whether |op_type| is one of the REPLACE full operations.
 bool IsAReplaceOperation(InstallOperation::Type op_type);
 
 // Returns true if an operation with type |op_type| has no |src_extents|.
 bool IsNoSourceOperation(InstallOperation::Type op_type);
 
+// Sets the size of |partition| in |info| and its hash with |algorithm|.
 bool InitializePartitionInfo(const PartitionConfig& partition,
-                             PartitionInfo* info);
+                             PartitionInfo* info,
+                             HashAlgorithm algorithm = HashAlgorithm::kSha256);
 
 // Compare two AnnotatedOperations by the start block of the first Extent in
 // their destination extents.
-bool CompareAopsByDestination(AnnotatedOperation first_aop,
-                              AnnotatedOperation second_aop);
+bool CompareAopsByDestination(const AnnotatedOperation& first_aop,
+                              const AnnotatedOperation& second_aop);
 
 // Returns whether the filesystem is an ext[234] filesystem. In case of failure,
 // such as if the file |device| doesn't exists or can't be read, it returns
@@ -218,15 +239,21 @@ class BestDiffGenerator {
       AnnotatedOperation* aop,
       brillo::Blob* data_blob);
 
+  // The time each algorithm tried by GenerateBestDiffOperation() took.
+  const std::vector<std::pair<InstallOperation::Type, base::TimeDelta>>&
+  diff_times() const {
+    return diff_times_;
+  }
+
  private:
   std::vector<bsdiff::CompressorType> GetUsableCompressorTypes() const;
-  bool TryBsdiffAndUpdateOperation(InstallOperation_Type operation_type,
-                                   AnnotatedOperation* aop,
-                                   brillo::Blob* data_blob);
-  bool TryPuffdiffAndUpdateOperation(AnnotatedOperation* aop,
-                                     brillo::Blob* data_blob);
-  bool TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
-                                     brillo::Blob* data_blob);
+  // Each of these stores in |patch_data| the patch of one algorithm, or
+  // leaves it empty if the algorithm doesn't apply to this data. They may be
+  // called concurrently.
+  bool GenerateBsdiff(InstallOperation_Type operation_type,
+                      brillo::Blob* patch_data) const;
+  bool GeneratePuffdiff(brillo::Blob* patch_data) const;
+  bool GenerateZucchini(brillo::Blob* patch_data) const;
 
   const brillo::Blob& old_data_;
   const brillo::Blob& new_data_;
@@ -237,6 +264,7 @@ class BestDiffGenerator {
   const CompressedFile& old_block_info_;
   const CompressedFile& new_block_info_;
   const PayloadGenerationConfig& config_;
+  std::vector<std::pair<InstallOperation::Type, base::TimeDelta>> diff_times_;
 };
 
 }  // namespace diff_utils
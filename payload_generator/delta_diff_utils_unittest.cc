@@ -17,6 +17,8 @@
 #include "update_engine/payload_generator/delta_diff_utils.h"
 
 #include <algorithm>
+#include <atomic>
+#include <memory>
 #include <random>
 #include <string>
 #include <vector>
@@ -30,10 +32,13 @@
 #include "payload_generator/filesystem_interface.h"
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/bzip.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_cache.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/fake_filesystem.h"
+#include "update_engine/payload_generator/xz.h"
 
 using std::string;
 using std::vector;
@@ -186,6 +191,35 @@ TEST_F(DeltaDiffUtilsTest, SkipVerityExtentsTest) {
   }
 }
 
+TEST_F(DeltaDiffUtilsTest, ShipVerityExtentsTest) {
+  new_part_.verity.hash_tree_extent = ExtentForRange(20, 30);
+  new_part_.verity.fec_extent = ExtentForRange(40, 50);
+  new_part_.verity.data_in_payload = true;
+
+  BlobFileWriter blob_file(tmp_blob_file_.fd(), &blob_size_);
+  ASSERT_TRUE(diff_utils::DeltaReadPartition(
+      &aops_,
+      old_part_,
+      new_part_,
+      -1,
+      -1,
+      {.version = PayloadVersion(kMaxSupportedMajorPayloadVersion,
+                                 kVerityMinorPayloadVersion)},
+      &blob_file));
+  ExtentRanges verity_blocks;
+  for (const auto& aop : aops_) {
+    if (aop.name != "<verity-hash-tree>" && aop.name != "<verity-fec>")
+      continue;
+    // Written in full, not diffed against the old partition.
+    EXPECT_EQ(0, aop.op.src_extents_size());
+    verity_blocks.AddRepeatedExtents(aop.op.dst_extents());
+  }
+  ExtentRanges expected;
+  expected.AddExtent(new_part_.verity.hash_tree_extent);
+  expected.AddExtent(new_part_.verity.fec_extent);
+  EXPECT_EQ(expected.extent_set(), verity_blocks.extent_set());
+}
+
 TEST_F(DeltaDiffUtilsTest, ReplaceSmallTest) {
   // The old file is on a different block than the new one.
   vector<Extent> old_extents = {ExtentForRange(1, 1)};
@@ -345,6 +379,56 @@ TEST_F(DeltaDiffUtilsTest, BrotliBsdiffTest) {
   ASSERT_EQ(InstallOperation::BROTLI_BSDIFF, op.type());
 }
 
+TEST_F(DeltaDiffUtilsTest, LargeFileChunksDiffAgainstOldWindow) {
+  // The new file is the old one moved by one block, so that every chunk but
+  // the last is found in the old file, just not at the same offset.
+  constexpr uint64_t kFileBlocks = 8;
+  brillo::Blob old_data(kFileBlocks * kBlockSize);
+  std::mt19937 gen(12345);
+  std::generate(old_data.begin(), old_data.end(), gen);
+  brillo::Blob new_data(old_data.begin() + kBlockSize, old_data.end());
+  new_data.resize(old_data.size());
+  std::generate(new_data.end() - kBlockSize, new_data.end(), gen);
+
+  File old_file;
+  old_file.name = "file";
+  old_file.extents = {ExtentForRange(10, kFileBlocks)};
+  File new_file;
+  new_file.name = "file";
+  new_file.extents = {ExtentForRange(30, kFileBlocks)};
+  ASSERT_TRUE(
+      WriteExtents(old_part_.path, old_file.extents, kBlockSize, old_data));
+  ASSERT_TRUE(
+      WriteExtents(new_part_.path, new_file.extents, kBlockSize, new_data));
+
+  BlobFileWriter blob_file(tmp_blob_file_.fd(), &blob_size_);
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kSourceMinorPayloadVersion)};
+  config.large_file_chunk_size = 2 * kBlockSize;
+  ASSERT_TRUE(diff_utils::DeltaReadFile(&aops_,
+                                        old_part_.path,
+                                        new_part_.path,
+                                        old_file,
+                                        new_file,
+                                        -1,
+                                        config,
+                                        &blob_file));
+
+  ASSERT_EQ(4u, aops_.size());
+  for (size_t i = 0; i < aops_.size(); i++) {
+    const auto& op = aops_[i].op;
+    EXPECT_EQ(base::StringPrintf("file:%zu", i), aops_[i].name);
+    EXPECT_EQ(InstallOperation::SOURCE_BSDIFF, op.type());
+    ASSERT_EQ(1, op.dst_extents_size());
+    EXPECT_EQ(ExtentForRange(30 + i * 2, 2), op.dst_extents(0));
+    // Windows of three chunks, kept within the old file.
+    EXPECT_EQ(6u, utils::BlocksInExtents(op.src_extents()));
+  }
+  EXPECT_EQ(ExtentForRange(10, 6), aops_[0].op.src_extents(0));
+  EXPECT_EQ(ExtentForRange(12, 6), aops_[3].op.src_extents(0));
+}
+
 TEST_F(DeltaDiffUtilsTest, GenerateBestDiffOperation_Zucchini) {
   // Makes sure SOURCE_BSDIFF operations are emitted whenever src_ops_allowed
   // is true. It is the same setup as BsdiffSmallTest, which checks
@@ -389,6 +473,207 @@ TEST_F(DeltaDiffUtilsTest, GenerateBestDiffOperation_Zucchini) {
   ASSERT_EQ(InstallOperation::ZUCCHINI, op.type());
 }
 
+TEST_F(DeltaDiffUtilsTest, GenerateBestDiffOperation_PicksSmallestCandidate) {
+  // The candidates are generated concurrently, the result must still be the
+  // smallest patch, the first one in case of a tie.
+  brillo::Blob dst_data_blob(kBlockSize * 4);
+  test_utils::FillWithData(&dst_data_blob);
+  brillo::Blob src_data_blob = dst_data_blob;
+  src_data_blob[0]++;
+  src_data_blob[kBlockSize * 2]++;
+
+  vector<Extent> old_extents = {ExtentForRange(1, 4)};
+  vector<Extent> new_extents = {ExtentForRange(8, 4)};
+  const FilesystemInterface::File empty;
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kZucchiniMinorPayloadVersion)};
+  diff_utils::BestDiffGenerator best_diff_generator(src_data_blob,
+                                                    dst_data_blob,
+                                                    old_extents,
+                                                    new_extents,
+                                                    empty,
+                                                    empty,
+                                                    config);
+  auto generate = [&](const std::vector<std::pair<InstallOperation_Type,
+                                                  size_t>>& candidates,
+                      AnnotatedOperation* aop,
+                      brillo::Blob* data) {
+    aop->name = "data.so";
+    *data = dst_data_blob;  // Fake the full operation
+    ASSERT_TRUE(
+        best_diff_generator.GenerateBestDiffOperation(candidates, aop, data));
+  };
+
+  AnnotatedOperation bsdiff_aop, zucchini_aop, best_aop;
+  brillo::Blob bsdiff_data, zucchini_data, best_data;
+  generate({{InstallOperation::SOURCE_BSDIFF, 1024 * 1024}},
+           &bsdiff_aop,
+           &bsdiff_data);
+  generate({{InstallOperation::ZUCCHINI, 1024 * 1024}},
+           &zucchini_aop,
+           &zucchini_data);
+  generate({{InstallOperation::SOURCE_BSDIFF, 1024 * 1024},
+            {InstallOperation::ZUCCHINI, 1024 * 1024}},
+           &best_aop,
+           &best_data);
+
+  const auto& expected =
+      zucchini_data.size() < bsdiff_data.size() ? zucchini_aop : bsdiff_aop;
+  EXPECT_EQ(expected.op.type(), best_aop.op.type());
+  EXPECT_EQ(std::min(bsdiff_data.size(), zucchini_data.size()),
+            best_data.size());
+}
+
+TEST_F(DeltaDiffUtilsTest, GenerateBestFullOperation_PicksSmallestCompression) {
+  // The xz and bzip2 candidates are compressed concurrently, the result must
+  // still be the smallest one, xz in case of a tie.
+  brillo::Blob data(kBlockSize * 64);
+  test_utils::FillWithData(&data);
+  brillo::Blob xz_blob, bz_blob;
+  ASSERT_TRUE(XzCompress(data, &xz_blob));
+  ASSERT_TRUE(BzipCompress(data, &bz_blob));
+
+  brillo::Blob blob;
+  InstallOperation::Type type;
+  ASSERT_TRUE(diff_utils::GenerateBestFullOperation(
+      data,
+      PayloadVersion(kBrilloMajorPayloadVersion, kFullPayloadMinorVersion),
+      &blob,
+      &type));
+  if (bz_blob.size() < xz_blob.size()) {
+    EXPECT_EQ(InstallOperation::REPLACE_BZ, type);
+    EXPECT_EQ(bz_blob, blob);
+  } else {
+    EXPECT_EQ(InstallOperation::REPLACE_XZ, type);
+    EXPECT_EQ(xz_blob, blob);
+  }
+}
+
+TEST_F(DeltaDiffUtilsTest, GenerateBestFullOperation_IncompressibleData) {
+  brillo::Blob data(kBlockSize * 64);
+  std::mt19937 random(1234);
+  for (auto& byte : data) {
+    byte = random();
+  }
+  EXPECT_GT(diff_utils::EstimateEntropy(data), 7.99);
+
+  brillo::Blob blob;
+  InstallOperation::Type type;
+  ASSERT_TRUE(diff_utils::GenerateBestFullOperation(
+      data,
+      PayloadVersion(kBrilloMajorPayloadVersion, kFullPayloadMinorVersion),
+      &blob,
+      &type));
+  EXPECT_EQ(InstallOperation::REPLACE, type);
+  EXPECT_EQ(data, blob);
+
+  // Data repeating a short pattern still gets compressed.
+  test_utils::FillWithData(&data);
+  EXPECT_LT(diff_utils::EstimateEntropy(data), 7.99);
+  ASSERT_TRUE(diff_utils::GenerateBestFullOperation(
+      data,
+      PayloadVersion(kBrilloMajorPayloadVersion, kFullPayloadMinorVersion),
+      &blob,
+      &type));
+  EXPECT_NE(InstallOperation::REPLACE, type);
+}
+
+TEST_F(DeltaDiffUtilsTest, GenerateBestFullOperation_Zstd) {
+  brillo::Blob data(kBlockSize * 64);
+  test_utils::FillWithData(&data);
+  PayloadGenerationConfig config{
+      .version =
+          PayloadVersion(kBrilloMajorPayloadVersion, kFullPayloadMinorVersion)};
+
+  brillo::Blob blob;
+  InstallOperation::Type type;
+  ASSERT_TRUE(
+      diff_utils::GenerateBestFullOperation(data, config, &blob, &type));
+  EXPECT_NE(InstallOperation::REPLACE_ZSTD, type);
+
+  config.enable_zstd = true;
+  ASSERT_TRUE(
+      diff_utils::GenerateBestFullOperation(data, config, &blob, &type));
+  EXPECT_EQ(InstallOperation::REPLACE_ZSTD, type);
+  EXPECT_LT(blob.size(), data.size());
+
+  // Delta payloads only allow it from kZstdMinorPayloadVersion.
+  config.version.minor = kLZ4DIFFMinorPayloadVersion;
+  ASSERT_TRUE(
+      diff_utils::GenerateBestFullOperation(data, config, &blob, &type));
+  EXPECT_NE(InstallOperation::REPLACE_ZSTD, type);
+  config.version.minor = kZstdMinorPayloadVersion;
+  ASSERT_TRUE(
+      diff_utils::GenerateBestFullOperation(data, config, &blob, &type));
+  EXPECT_EQ(InstallOperation::REPLACE_ZSTD, type);
+}
+
+namespace {
+
+// A cache returning |patch| for every key.
+class FakeDiffCache : public DiffCacheInterface {
+ public:
+  bool Lookup(const std::string& key, brillo::Blob* patch) override {
+    lookups_++;
+    *patch = patch_;
+    return !patch_.empty();
+  }
+  bool Store(const std::string& key, const brillo::Blob& patch) override {
+    stores_++;
+    return true;
+  }
+
+  brillo::Blob patch_;
+  std::atomic<size_t> lookups_{0};
+  std::atomic<size_t> stores_{0};
+};
+
+}  // namespace
+
+TEST_F(DeltaDiffUtilsTest, GenerateBestDiffOperation_DiffCache) {
+  brillo::Blob dst_data_blob(kBlockSize);
+  test_utils::FillWithData(&dst_data_blob);
+  brillo::Blob src_data_blob = dst_data_blob;
+  src_data_blob[0]++;
+
+  vector<Extent> old_extents = {ExtentForRange(1, 1)};
+  vector<Extent> new_extents = {ExtentForRange(2, 1)};
+  const FilesystemInterface::File empty;
+  auto cache = std::make_shared<FakeDiffCache>();
+  PayloadGenerationConfig config{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kSourceMinorPayloadVersion),
+      .diff_cache = cache};
+  diff_utils::BestDiffGenerator best_diff_generator(src_data_blob,
+                                                    dst_data_blob,
+                                                    old_extents,
+                                                    new_extents,
+                                                    empty,
+                                                    empty,
+                                                    config);
+
+  // A miss generates the patch and stores it.
+  AnnotatedOperation aop;
+  brillo::Blob data = dst_data_blob;  // Fake the full operation
+  ASSERT_TRUE(best_diff_generator.GenerateBestDiffOperation(
+      {{InstallOperation::SOURCE_BSDIFF, 1024 * 1024}}, &aop, &data));
+  EXPECT_EQ(InstallOperation::SOURCE_BSDIFF, aop.op.type());
+  EXPECT_EQ(1u, cache->lookups_);
+  EXPECT_EQ(1u, cache->stores_);
+
+  // A hit uses the cached patch as is.
+  cache->patch_ = {1, 2, 3};
+  aop = {};
+  data = dst_data_blob;
+  ASSERT_TRUE(best_diff_generator.GenerateBestDiffOperation(
+      {{InstallOperation::SOURCE_BSDIFF, 1024 * 1024}}, &aop, &data));
+  EXPECT_EQ(InstallOperation::SOURCE_BSDIFF, aop.op.type());
+  EXPECT_EQ(cache->patch_, data);
+  EXPECT_EQ(2u, cache->lookups_);
+  EXPECT_EQ(1u, cache->stores_);
+}
+
 TEST_F(DeltaDiffUtilsTest, GenerateBestDiffOperation_FullOperationBetter) {
   // Makes sure SOURCE_BSDIFF operations are emitted whenever src_ops_allowed
   // is true. It is the same setup as BsdiffSmallTest, which checks
@@ -788,6 +1073,34 @@ TEST_F(DeltaDiffUtilsTest, XorOpsTargetNotAligned) {
   ASSERT_EQ(aop.xor_ops[0].dst_extent().start_block(), 501UL);
 }
 
+TEST_F(DeltaDiffUtilsTest, XorOpsFragmentedExtents) {
+  ScopedTempFile patch_file;
+  bsdiff::BsdiffPatchWriter writer{patch_file.path()};
+  ASSERT_TRUE(writer.Init(kBlockSize * 20));
+  ASSERT_TRUE(writer.AddControlEntry(ControlEntry(kBlockSize * 20, 0, 0)));
+  ASSERT_TRUE(writer.Close());
+
+  std::string patch_data;
+  utils::ReadFile(patch_file.path(), &patch_data);
+
+  AnnotatedOperation aop;
+  for (size_t i = 0; i < 20; i++) {
+    *aop.op.add_src_extents() = ExtentForRange(100 + 2 * i, 1);
+    *aop.op.add_dst_extents() = ExtentForRange(500 + 3 * i, 1);
+  }
+
+  ASSERT_TRUE(diff_utils::PopulateXorOps(
+      &aop,
+      reinterpret_cast<const uint8_t*>(patch_data.data()),
+      patch_data.size()));
+  ASSERT_EQ(aop.xor_ops.size(), 20UL);
+  for (size_t i = 0; i < 20; i++) {
+    ASSERT_EQ(aop.xor_ops[i].src_extent().start_block(), 100 + 2 * i);
+    ASSERT_EQ(aop.xor_ops[i].dst_extent().start_block(), 500 + 3 * i);
+    ASSERT_EQ(aop.xor_ops[i].src_offset(), 0UL);
+  }
+}
+
 TEST_F(DeltaDiffUtilsTest, XorOpsStrided) {
   ScopedTempFile patch_file;
   bsdiff::BsdiffPatchWriter writer{patch_file.path()};
@@ -0,0 +1,133 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_cache.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Changing how any of the patches is generated must bump this, to not reuse
+// the patches of the previous generator.
+constexpr uint32_t kDiffCacheFormatVersion = 1;
+
+template <typename T>
+bool HashValue(HashCalculator* hasher, const T& value) {
+  return hasher->Update(&value, sizeof(value));
+}
+
+bool HashBlob(HashCalculator* hasher, const brillo::Blob& blob) {
+  return HashValue(hasher, static_cast<uint64_t>(blob.size())) &&
+         hasher->Update(blob.data(), blob.size());
+}
+
+bool HashDeflates(HashCalculator* hasher,
+                  const std::vector<puffin::BitExtent>& deflates) {
+  TEST_AND_RETURN_FALSE(
+      HashValue(hasher, static_cast<uint64_t>(deflates.size())));
+  for (const auto& deflate : deflates) {
+    TEST_AND_RETURN_FALSE(HashValue(hasher, deflate.offset));
+    TEST_AND_RETURN_FALSE(HashValue(hasher, deflate.length));
+  }
+  return true;
+}
+
+}  // namespace
+
+bool DirectoryDiffCache::Lookup(const std::string& key, brillo::Blob* patch) {
+  const auto path = PathForKey(key);
+  if (!utils::FileExists(path.c_str())) {
+    return false;
+  }
+  if (!utils::ReadFile(path, patch) || patch->empty()) {
+    LOG(WARNING) << "Ignoring unreadable diff cache entry " << path;
+    patch->clear();
+    return false;
+  }
+  return true;
+}
+
+bool DirectoryDiffCache::Store(const std::string& key,
+                               const brillo::Blob& patch) {
+  const auto path = PathForKey(key);
+  const base::FilePath dir = base::FilePath(path).DirName();
+  if (!base::CreateDirectory(dir)) {
+    PLOG(WARNING) << "Failed to create " << dir.value();
+    return false;
+  }
+  // Written aside and renamed, so that generators sharing the directory never
+  // read a partial patch.
+  base::FilePath temp_path;
+  if (!base::CreateTemporaryFileInDir(dir, &temp_path)) {
+    PLOG(WARNING) << "Failed to create a temporary file in " << dir.value();
+    return false;
+  }
+  if (!utils::WriteFile(
+          temp_path.value().c_str(), patch.data(), patch.size())) {
+    PLOG(WARNING) << "Failed to write " << temp_path.value();
+    unlink(temp_path.value().c_str());
+    return false;
+  }
+  if (rename(temp_path.value().c_str(), path.c_str()) != 0) {
+    PLOG(WARNING) << "Failed to rename " << temp_path.value() << " to " << path;
+    unlink(temp_path.value().c_str());
+    return false;
+  }
+  return true;
+}
+
+std::string DirectoryDiffCache::PathForKey(const std::string& key) const {
+  // Spread the entries in subdirectories, to keep each of them small.
+  return base::FilePath(directory_)
+      .Append(key.substr(0, 2))
+      .Append(key)
+      .value();
+}
+
+std::string DiffCacheKey(InstallOperation::Type type,
+                         const PayloadGenerationConfig& config,
+                         const brillo::Blob& old_data,
+                         const brillo::Blob& new_data,
+                         const std::vector<puffin::BitExtent>& old_deflates,
+                         const std::vector<puffin::BitExtent>& new_deflates) {
+  HashCalculator hasher;
+  CHECK(HashValue(&hasher, kDiffCacheFormatVersion));
+  CHECK(HashValue(&hasher, static_cast<int32_t>(type)));
+  CHECK(HashValue(&hasher, config.version.major));
+  CHECK(HashValue(&hasher, config.version.minor));
+  CHECK(HashValue(&hasher, static_cast<uint64_t>(config.compressors.size())));
+  for (auto compressor : config.compressors) {
+    CHECK(HashValue(&hasher, compressor));
+  }
+  CHECK(HashBlob(&hasher, old_data));
+  CHECK(HashBlob(&hasher, new_data));
+  CHECK(HashDeflates(&hasher, old_deflates));
+  CHECK(HashDeflates(&hasher, new_deflates));
+  CHECK(hasher.Finalize());
+  return utils::HexEncode(hasher.raw_hash());
+}
+
+}  // namespace chromeos_update_engine
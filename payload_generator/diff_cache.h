@@ -0,0 +1,78 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
+
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+#include <puffin/puffdiff.h>
+
+#include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Stores diff patches under a key derived from everything the patch depends
+// on, so that payloads generated from overlapping images don't diff the same
+// files again. Implementations must be thread safe.
+class DiffCacheInterface {
+ public:
+  virtual ~DiffCacheInterface() = default;
+
+  // Returns whether a patch is stored for |key|, and stores it in |patch|.
+  virtual bool Lookup(const std::string& key, brillo::Blob* patch) = 0;
+
+  // Stores |patch| for |key|. Returns false on failure, which shouldn't fail
+  // the payload generation.
+  virtual bool Store(const std::string& key, const brillo::Blob& patch) = 0;
+};
+
+// A cache of one file per patch in a local directory. The directory can be
+// shared by concurrent generators, and mirrored to or from a remote store.
+class DirectoryDiffCache : public DiffCacheInterface {
+ public:
+  explicit DirectoryDiffCache(const std::string& directory)
+      : directory_(directory) {}
+  ~DirectoryDiffCache() override = default;
+
+  bool Lookup(const std::string& key, brillo::Blob* patch) override;
+  bool Store(const std::string& key, const brillo::Blob& patch) override;
+
+ private:
+  std::string PathForKey(const std::string& key) const;
+
+  const std::string directory_;
+
+  DISALLOW_COPY_AND_ASSIGN(DirectoryDiffCache);
+};
+
+// Returns the cache key of the |type| patch from |old_data| to |new_data|, with
+// the given deflate streams, for the payload version and compressors of
+// |config|.
+std::string DiffCacheKey(InstallOperation::Type type,
+                         const PayloadGenerationConfig& config,
+                         const brillo::Blob& old_data,
+                         const brillo::Blob& new_data,
+                         const std::vector<puffin::BitExtent>& old_deflates,
+                         const std::vector<puffin::BitExtent>& new_deflates);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DIFF_CACHE_H_
@@ -0,0 +1,82 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/diff_cache.h"
+
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+namespace chromeos_update_engine {
+
+class DiffCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override { ASSERT_TRUE(cache_dir_.CreateUniqueTempDir()); }
+
+  std::string Key(InstallOperation::Type type,
+                  const brillo::Blob& old_data,
+                  const brillo::Blob& new_data,
+                  const std::vector<puffin::BitExtent>& deflates = {}) {
+    return DiffCacheKey(type, config_, old_data, new_data, deflates, deflates);
+  }
+
+  base::ScopedTempDir cache_dir_;
+  PayloadGenerationConfig config_{
+      .version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                kZucchiniMinorPayloadVersion)};
+};
+
+TEST_F(DiffCacheTest, StoreAndLookup) {
+  DirectoryDiffCache cache(cache_dir_.GetPath().value());
+  const std::string key = Key(InstallOperation::PUFFDIFF, {1, 2}, {3, 4});
+  brillo::Blob patch;
+  EXPECT_FALSE(cache.Lookup(key, &patch));
+
+  const brillo::Blob stored = {5, 6, 7};
+  ASSERT_TRUE(cache.Store(key, stored));
+  ASSERT_TRUE(cache.Lookup(key, &patch));
+  EXPECT_EQ(stored, patch);
+
+  // Another cache over the same directory sees the patch too.
+  DirectoryDiffCache other_cache(cache_dir_.GetPath().value());
+  patch.clear();
+  ASSERT_TRUE(other_cache.Lookup(key, &patch));
+  EXPECT_EQ(stored, patch);
+}
+
+TEST_F(DiffCacheTest, KeyDependsOnEveryInput) {
+  const brillo::Blob old_data = {1, 2, 3};
+  const brillo::Blob new_data = {4, 5, 6};
+  const std::string key =
+      Key(InstallOperation::BROTLI_BSDIFF, old_data, new_data);
+  EXPECT_EQ(key, Key(InstallOperation::BROTLI_BSDIFF, old_data, new_data));
+
+  EXPECT_NE(key, Key(InstallOperation::PUFFDIFF, old_data, new_data));
+  EXPECT_NE(key, Key(InstallOperation::BROTLI_BSDIFF, new_data, old_data));
+  EXPECT_NE(key, Key(InstallOperation::BROTLI_BSDIFF, old_data, {4, 5}));
+  EXPECT_NE(
+      key,
+      Key(InstallOperation::BROTLI_BSDIFF, old_data, new_data, {{8, 16}}));
+  // Data moved from one blob to the other.
+  EXPECT_NE(Key(InstallOperation::BROTLI_BSDIFF, {1, 2}, {3}),
+            Key(InstallOperation::BROTLI_BSDIFF, {1}, {2, 3}));
+
+  config_.compressors = {bsdiff::CompressorType::kBrotli};
+  EXPECT_NE(key, Key(InstallOperation::BROTLI_BSDIFF, old_data, new_data));
+}
+
+}  // namespace chromeos_update_engine
@@ -20,9 +20,10 @@
 #include <fcntl.h>
 #include <time.h>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <string>
-#include <mutex>
 
 #include <android-base/unique_fd.h>
 #include <erofs/dir.h>
@@ -38,11 +39,15 @@
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 
 namespace chromeos_update_engine {
 
 namespace {
 
+// Number of files whose blocks are mapped by each task.
+constexpr size_t kErofsFilesPerTask = 64;
+
 static constexpr int GetOccupiedSize(const struct erofs_inode* inode,
                                      size_t block_size,
                                      erofs_off_t* size) {
@@ -217,49 +222,21 @@ bool ErofsFilesystem::GetFiles(struct erofs_sb_info* sbi,
                                const std::string& filename,
                                std::vector<File>* files,
                                const CompressionAlgorithm& algo) {
-  size_t unaligned_bytes = 0;
-  const auto block_size = 1UL << sbi->blkszbits;
+  // Walking the directories only reads small directory blocks, so it stays on
+  // this thread and just lists the regular files in the walk order. Reading
+  // their inodes and mapping their blocks, which for compressed files means
+  // decoding all their compression indexes, is done in parallel below.
+  struct RegularFile {
+    erofs_nid_t nid;
+    std::string path;
+  };
+  std::vector<RegularFile> regular_files;
   const auto err = erofs_iterate_root_dir(
       sbi, [&](struct erofs_iterate_dir_context* p_info) {
         const auto& info = *p_info;
-        if (info.ctx.de_ftype != EROFS_FT_REG_FILE) {
-          return 0;
-        }
-        struct erofs_inode inode {};
-        inode.nid = info.ctx.de_nid;
-        inode.sbi = sbi;
-        int err = erofs_read_inode_from_disk(&inode);
-        if (err) {
-          LOG(ERROR) << "Failed to read inode " << inode.nid;
-          return err;
-        }
-        const auto uncompressed_size = inode.i_size;
-        erofs_off_t compressed_size = 0;
-        if (uncompressed_size == 0) {
-          return 0;
-        }
-        err = GetOccupiedSize(&inode, block_size, &compressed_size);
-        if (err) {
-          LOG(FATAL) << "Failed to get occupied size for " << filename;
-          return err;
+        if (info.ctx.de_ftype == EROFS_FT_REG_FILE) {
+          regular_files.push_back({info.ctx.de_nid, info.path});
         }
-        // For EROFS_INODE_FLAT_INLINE , most blocks are stored on aligned
-        // addresses. Except the last block, which is stored right after the
-        // inode. These nodes will have a slight amount of data unaligned, which
-        // is fine.
-
-        File file;
-        file.name = info.path;
-        file.compressed_file_info.zero_padding_enabled =
-            erofs_sb_has_lz4_0padding(sbi);
-        file.is_compressed = compressed_size != uncompressed_size;
-
-        file.file_stat.st_size = uncompressed_size;
-        file.file_stat.st_ino = inode.nid;
-        FillExtentInfo(&file, filename, &inode, &unaligned_bytes);
-        file.compressed_file_info.algo = algo;
-
-        files->emplace_back(std::move(file));
         return 0;
       });
   if (err) {
@@ -267,8 +244,71 @@ bool ErofsFilesystem::GetFiles(struct erofs_sb_info* sbi,
     return false;
   }
 
-  for (auto& file : *files) {
-    NormalizeExtents(&file.extents);
+  // The erofs-utils calls below only pread() through |sbi| and keep their
+  // mapping state in the inode and map they are passed, so each task works on
+  // its own files. Every file has a slot, so the result keeps the walk order.
+  const auto block_size = 1UL << sbi->blkszbits;
+  std::vector<File> file_slots(regular_files.size());
+  std::vector<int> errors(regular_files.size(), 0);
+  std::atomic<size_t> unaligned_bytes{0};
+  auto map_files = [&](size_t begin, size_t end) {
+    size_t task_unaligned_bytes = 0;
+    for (size_t i = begin; i < end; i++) {
+      struct erofs_inode inode {};
+      inode.nid = regular_files[i].nid;
+      inode.sbi = sbi;
+      errors[i] = erofs_read_inode_from_disk(&inode);
+      if (errors[i]) {
+        LOG(ERROR) << "Failed to read inode " << inode.nid;
+        continue;
+      }
+      const auto uncompressed_size = inode.i_size;
+      erofs_off_t compressed_size = 0;
+      if (uncompressed_size == 0) {
+        continue;
+      }
+      errors[i] = GetOccupiedSize(&inode, block_size, &compressed_size);
+      if (errors[i]) {
+        LOG(FATAL) << "Failed to get occupied size for " << filename;
+        continue;
+      }
+      // For EROFS_INODE_FLAT_INLINE , most blocks are stored on aligned
+      // addresses. Except the last block, which is stored right after the
+      // inode. These nodes will have a slight amount of data unaligned, which
+      // is fine.
+
+      File& file = file_slots[i];
+      file.name = std::move(regular_files[i].path);
+      file.compressed_file_info.zero_padding_enabled =
+          erofs_sb_has_lz4_0padding(sbi);
+      file.is_compressed = compressed_size != uncompressed_size;
+
+      file.file_stat.st_size = uncompressed_size;
+      file.file_stat.st_ino = inode.nid;
+      FillExtentInfo(&file, filename, &inode, &task_unaligned_bytes);
+      file.compressed_file_info.algo = algo;
+      NormalizeExtents(&file.extents);
+    }
+    unaligned_bytes += task_unaligned_bytes;
+  };
+  {
+    TaskScheduler::TaskGroup map_tasks;
+    for (size_t begin = 0; begin < regular_files.size();
+         begin += kErofsFilesPerTask) {
+      size_t end = std::min(begin + kErofsFilesPerTask, regular_files.size());
+      map_tasks.Add([&map_files, begin, end] { map_files(begin, end); });
+    }
+    map_tasks.Wait();
+  }
+
+  for (size_t i = 0; i < file_slots.size(); i++) {
+    if (errors[i]) {
+      return false;
+    }
+    // Empty files are skipped, their slot has no name.
+    if (!file_slots[i].name.empty()) {
+      files->emplace_back(std::move(file_slots[i]));
+    }
   }
   LOG(INFO) << "EROFS image " << filename << " has " << unaligned_bytes
             << " unaligned bytes, which is "
@@ -27,10 +27,10 @@ namespace chromeos_update_engine {
 class ErofsFilesystem final : public FilesystemInterface {
  public:
   // Creates an ErofsFilesystem from a erofs formatted filesystem stored in a
-  // file. The file doesn't need to be loop-back mounted. Since erofs-utils
-  // library functions are not concurrency safe(can't be used in multi-threaded
-  // context, can't even work with multiple EROFS images concurrently on 1
-  // thread), this function takes a global mutex.
+  // file. The file doesn't need to be loop-back mounted. The blocks of the
+  // files are mapped on the threads of the TaskScheduler, each file by a
+  // single thread, through erofs-utils calls that only read the image and the
+  // inode and map they are passed.
   static std::unique_ptr<ErofsFilesystem> CreateFromFile(
       const std::string& filename,
       const CompressionAlgorithm& algo =
@@ -124,4 +124,28 @@ TEST_F(ErofsFilesystemTest, ParseGeneratedImages) {
   ASSERT_EQ(compressed_size, total_blocks * kBlockSize);
 }
 
+TEST_F(ErofsFilesystemTest, ParseIsDeterministic) {
+  // The files are mapped in parallel, they must still come in the same order
+  // with the same blocks every time.
+  const auto build_path = GetBuildArtifactsPath("gen/erofs_new.img");
+  vector<vector<ErofsFilesystem::File>> parses(2);
+  for (auto& files : parses) {
+    auto fs = ErofsFilesystem::CreateFromFile(build_path);
+    ASSERT_NE(fs, nullptr);
+    ASSERT_TRUE(fs->GetFiles(&files));
+  }
+  ASSERT_EQ(parses[0].size(), parses[1].size());
+  for (size_t i = 0; i < parses[0].size(); i++) {
+    EXPECT_EQ(parses[0][i].name, parses[1][i].name);
+    EXPECT_EQ(parses[0][i].extents, parses[1][i].extents);
+    const auto& blocks0 = parses[0][i].compressed_file_info.blocks;
+    const auto& blocks1 = parses[1][i].compressed_file_info.blocks;
+    ASSERT_EQ(blocks0.size(), blocks1.size());
+    for (size_t j = 0; j < blocks0.size(); j++) {
+      EXPECT_EQ(blocks0[j].uncompressed_offset, blocks1[j].uncompressed_offset);
+      EXPECT_EQ(blocks0[j].compressed_length, blocks1[j].compressed_length);
+    }
+  }
+}
+
 }  // namespace chromeos_update_engine
@@ -28,8 +28,10 @@
 #pragma clang diagnostic pop
 #endif
 
+#include <algorithm>
 #include <map>
 #include <set>
+#include <utility>
 
 #include <base/logging.h>
 #include <base/strings/stringprintf.h>
@@ -37,6 +39,7 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "update_engine/update_metadata.pb.h"
 
 using std::set;
@@ -83,95 +86,67 @@ int AddMetadataBlocks(ext2_filsys fs,
   return 0;
 }
 
-struct UpdateFileAndAppendState {
-  std::map<ext2_ino_t, FilesystemInterface::File>* inodes = nullptr;
-  set<ext2_ino_t>* used_inodes = nullptr;
-  vector<FilesystemInterface::File>* files = nullptr;
-  ext2_filsys filsys;
+// Frees an ext2_filsys opened read-only.
+struct FilsysDeleter {
+  void operator()(ext2_filsys filsys) const { ext2fs_free(filsys); }
 };
+using ScopedFilsys = unique_ptr<struct_ext2_filsys, FilsysDeleter>;
 
-int UpdateFileAndAppend(ext2_ino_t dir,
-                        int entry,
-                        struct ext2_dir_entry* dirent,
-                        int offset,
-                        int blocksize,
-                        char* buf,
-                        void* priv_data) {
-  UpdateFileAndAppendState* state =
-      static_cast<UpdateFileAndAppendState*>(priv_data);
-  uint32_t file_type = dirent->name_len >> 8;
-  // Directories can't have hard links, and they are added from the outer loop.
-  if (file_type == EXT2_FT_DIR)
-    return 0;
-
-  auto ino_file = state->inodes->find(dirent->inode);
-  if (ino_file == state->inodes->end())
-    return 0;
-  auto dir_file = state->inodes->find(dir);
-  if (dir_file == state->inodes->end())
-    return 0;
-  string basename(dirent->name, dirent->name_len & 0xff);
-  ino_file->second.name = dir_file->second.name;
-  if (dir_file->second.name != "/")
-    ino_file->second.name += "/";
-  ino_file->second.name += basename;
-
-  // Append this file to the output. If the file has a hard link, it will be
-  // added twice to the output, but with different names, which is ok. That will
-  // help identify all the versions of the same file.
-  state->files->push_back(ino_file->second);
-  state->used_inodes->insert(dirent->inode);
-  return 0;
-}
-
-}  // namespace
-
-unique_ptr<Ext2Filesystem> Ext2Filesystem::CreateFromFile(
-    const string& filename) {
-  if (filename.empty())
-    return nullptr;
-  unique_ptr<Ext2Filesystem> result(new Ext2Filesystem());
-  result->filename_ = filename;
-
+// Opens the filesystem in |filename| read-only. Each thread scanning the
+// filesystem uses a handle of its own, libext2fs handles not being safe to
+// share between threads.
+ScopedFilsys OpenFilesystem(const string& filename) {
+  ext2_filsys filsys = nullptr;
   errcode_t err = ext2fs_open(filename.c_str(),
                               0,  // flags (read only)
                               0,  // superblock block number
                               0,  // block_size (autodetect)
                               unix_io_manager,
-                              &result->filsys_);
+                              &filsys);
   if (err) {
     LOG(ERROR) << "Opening ext2fs " << filename;
     return nullptr;
   }
-  return result;
+  return ScopedFilsys(filsys);
 }
 
-Ext2Filesystem::~Ext2Filesystem() {
-  ext2fs_free(filsys_);
-}
-
-size_t Ext2Filesystem::GetBlockSize() const {
-  return filsys_->blocksize;
-}
-
-size_t Ext2Filesystem::GetBlockCount() const {
-  return ext2fs_blocks_count(filsys_->super);
-}
-
-bool Ext2Filesystem::GetFiles(vector<File>* files) const {
-  TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_read_inode_bitmap(filsys_));
-
-  ext2_inode_scan iscan;
-  TEST_AND_RETURN_FALSE_ERRCODE(
-      ext2fs_open_inode_scan(filsys_, 0 /* buffer_blocks */, &iscan));
-
-  std::map<ext2_ino_t, File> inodes;
-
-  // List of directories. We need to first parse all the files in a directory
-  // to later fix the absolute paths.
+// The inodes in use found in a range of block groups.
+struct InodeScanResult {
+  std::map<ext2_ino_t, FilesystemInterface::File> inodes;
+  // The directories, in inode order.
   vector<ext2_ino_t> directories;
-
+  // The indirect blocks of the files.
   set<uint64_t> inode_blocks;
+};
+
+// Reads the inodes in use of the block groups [|first_group|, |end_group|)
+// of the filesystem in |filename|, with their blocks, into |result|.
+bool ScanInodes(const string& filename,
+                dgrp_t first_group,
+                dgrp_t end_group,
+                InodeScanResult* result) {
+  ScopedFilsys filsys = OpenFilesystem(filename);
+  TEST_AND_RETURN_FALSE(filsys);
+  TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_read_inode_bitmap(filsys.get()));
+
+  // Read the inode table a whole block group at a time, instead of the few
+  // blocks of the default buffer.
+  ext2_inode_scan iscan;
+  TEST_AND_RETURN_FALSE_ERRCODE(ext2fs_open_inode_scan(
+      filsys.get(), filsys->inode_blocks_per_group, &iscan));
+  if (first_group > 0) {
+    errcode_t error = ext2fs_inode_scan_goto_blockgroup(iscan, first_group);
+    if (error) {
+      LOG(ERROR) << "Failed to go to block group " << first_group << " ("
+                 << error << ")";
+      ext2fs_close_inode_scan(iscan);
+      return false;
+    }
+  }
+  const ext2_ino_t last_ino =
+      std::min<uint64_t>(static_cast<uint64_t>(end_group) *
+                             EXT2_INODES_PER_GROUP(filsys->super),
+                         filsys->super->s_inodes_count);
 
   // Iterator
   ext2_ino_t it_ino;
@@ -185,14 +160,14 @@ bool Ext2Filesystem::GetFiles(vector<File>* files) const {
       ok = false;
       break;
     }
-    if (it_ino == 0)
+    if (it_ino == 0 || it_ino > last_ino)
       break;
 
     // Skip inodes that are not in use.
-    if (!ext2fs_test_inode_bitmap(filsys_->inode_map, it_ino))
+    if (!ext2fs_test_inode_bitmap(filsys->inode_map, it_ino))
       continue;
 
-    File& file = inodes[it_ino];
+    FilesystemInterface::File& file = result->inodes[it_ino];
     if (it_ino == EXT2_RESIZE_INO) {
       file.name = "<group-descriptors>";
     } else {
@@ -206,15 +181,16 @@ bool Ext2Filesystem::GetFiles(vector<File>* files) const {
     file.file_stat.st_uid = it_inode.i_uid;
     file.file_stat.st_gid = it_inode.i_gid;
     file.file_stat.st_size = it_inode.i_size;
-    file.file_stat.st_blksize = filsys_->blocksize;
+    file.file_stat.st_blksize = filsys->blocksize;
     file.file_stat.st_blocks = it_inode.i_blocks;
     file.file_stat.st_atime = it_inode.i_atime;
     file.file_stat.st_mtime = it_inode.i_mtime;
     file.file_stat.st_ctime = it_inode.i_ctime;
 
-    bool is_dir = (ext2fs_check_directory(filsys_, it_ino) == 0);
-    if (is_dir)
-      directories.push_back(it_ino);
+    // The same test as ext2fs_check_directory(), without reading the inode
+    // again.
+    if (LINUX_S_ISDIR(it_inode.i_mode))
+      result->directories.push_back(it_ino);
 
     if (!ext2fs_inode_has_valid_blocks(&it_inode))
       continue;
@@ -224,7 +200,7 @@ bool Ext2Filesystem::GetFiles(vector<File>* files) const {
     // and triple indirect blocks (no data blocks). For directories and
     // the journal, all blocks are considered metadata blocks.
     int flags = it_ino < EXT2_GOOD_OLD_FIRST_INO ? 0 : BLOCK_FLAG_DATA_ONLY;
-    error = ext2fs_block_iterate2(filsys_,
+    error = ext2fs_block_iterate2(filsys.get(),
                                   it_ino,
                                   flags,
                                   nullptr,  // block_buf
@@ -237,52 +213,246 @@ bool Ext2Filesystem::GetFiles(vector<File>* files) const {
       continue;
     }
     if (it_ino >= EXT2_GOOD_OLD_FIRST_INO) {
-      ext2fs_block_iterate2(
-          filsys_, it_ino, 0, nullptr, AddMetadataBlocks, &inode_blocks);
+      ext2fs_block_iterate2(filsys.get(),
+                            it_ino,
+                            0,
+                            nullptr,
+                            AddMetadataBlocks,
+                            &result->inode_blocks);
     }
   }
   ext2fs_close_inode_scan(iscan);
-  if (!ok)
-    return false;
+  return ok;
+}
+
+// An entry of a directory.
+struct DirEntry {
+  ext2_ino_t inode;
+  uint32_t file_type;
+  // Whether it is one of the "." and ".." entries.
+  bool is_dot;
+  string name;
+};
+
+int CollectDirEntry(ext2_ino_t dir,
+                    int entry,
+                    struct ext2_dir_entry* dirent,
+                    int offset,
+                    int blocksize,
+                    char* buf,
+                    void* priv_data) {
+  vector<DirEntry>* entries = static_cast<vector<DirEntry>*>(priv_data);
+  entries->push_back({dirent->inode,
+                      static_cast<uint32_t>(dirent->name_len >> 8),
+                      entry != DIRENT_OTHER_FILE,
+                      string(dirent->name, dirent->name_len & 0xff)});
+  return 0;
+}
+
+// Reads the entries of the directories |dirs| of the filesystem in
+// |filename| into |entries|, one list per directory.
+bool ReadDirEntries(const string& filename,
+                    const ext2_ino_t* dirs,
+                    size_t num_dirs,
+                    vector<DirEntry>* entries) {
+  ScopedFilsys filsys = OpenFilesystem(filename);
+  TEST_AND_RETURN_FALSE(filsys);
+  for (size_t i = 0; i < num_dirs; i++) {
+    errcode_t error = ext2fs_dir_iterate2(filsys.get(),
+                                          dirs[i],
+                                          0,
+                                          nullptr /* block_buf */,
+                                          CollectDirEntry,
+                                          &entries[i]);
+    if (error) {
+      LOG(WARNING) << "Failed to enumerate files in directory inode "
+                   << dirs[i] << " (error " << error << ")";
+    }
+  }
+  return true;
+}
+
+// Splits [0, |count|) in up to |max_chunks| ranges of about the same size and
+// adds a task running |fn| on each one to |tasks|.
+void AddChunkTasks(size_t count,
+                   size_t max_chunks,
+                   TaskScheduler::TaskGroup* tasks,
+                   std::function<void(size_t, size_t, size_t)> fn) {
+  size_t num_chunks = std::max<size_t>(1, std::min(count, max_chunks));
+  for (size_t i = 0; i < num_chunks; i++) {
+    tasks->Add([fn, i, begin = count * i / num_chunks,
+                end = count * (i + 1) / num_chunks] { fn(i, begin, end); });
+  }
+}
+
+}  // namespace
+
+unique_ptr<Ext2Filesystem> Ext2Filesystem::CreateFromFile(
+    const string& filename) {
+  if (filename.empty())
+    return nullptr;
+  unique_ptr<Ext2Filesystem> result(new Ext2Filesystem());
+  result->filename_ = filename;
+
+  result->filsys_ = OpenFilesystem(filename).release();
+  if (!result->filsys_)
+    return nullptr;
+  return result;
+}
+
+Ext2Filesystem::~Ext2Filesystem() {
+  ext2fs_free(filsys_);
+}
+
+size_t Ext2Filesystem::GetBlockSize() const {
+  return filsys_->blocksize;
+}
+
+size_t Ext2Filesystem::GetBlockCount() const {
+  return ext2fs_blocks_count(filsys_->super);
+}
+
+bool Ext2Filesystem::GetFiles(vector<File>* files) const {
+  const size_t num_threads = TaskScheduler::Get()->num_threads();
+
+  // Scan the inode tables of ranges of block groups in parallel.
+  vector<InodeScanResult> scans(
+      std::max<size_t>(1, std::min<size_t>(filsys_->group_desc_count,
+                                           num_threads)));
+  vector<char> scans_ok(scans.size());
+  {
+    TaskScheduler::TaskGroup tasks;
+    AddChunkTasks(filsys_->group_desc_count,
+                  scans.size(),
+                  &tasks,
+                  [&](size_t chunk, size_t begin, size_t end) {
+                    scans_ok[chunk] =
+                        ScanInodes(filename_, begin, end, &scans[chunk]);
+                  });
+  }
+  for (char ok : scans_ok) {
+    TEST_AND_RETURN_FALSE(ok);
+  }
+
+  std::map<ext2_ino_t, File> inodes;
+
+  // List of directories. We need to first parse all the files in a directory
+  // to later fix the absolute paths.
+  vector<ext2_ino_t> directories;
+
+  set<uint64_t> inode_blocks;
+
+  for (InodeScanResult& scan : scans) {
+    inodes.insert(std::make_move_iterator(scan.inodes.begin()),
+                  std::make_move_iterator(scan.inodes.end()));
+    directories.insert(
+        directories.end(), scan.directories.begin(), scan.directories.end());
+    inode_blocks.insert(scan.inode_blocks.begin(), scan.inode_blocks.end());
+  }
+  scans.clear();
+
+  // Read the entries of all the directories in parallel.
+  vector<vector<DirEntry>> dir_entries(directories.size());
+  vector<char> dirs_ok(num_threads);
+  {
+    TaskScheduler::TaskGroup tasks;
+    AddChunkTasks(directories.size(),
+                  num_threads,
+                  &tasks,
+                  [&](size_t chunk, size_t begin, size_t end) {
+                    dirs_ok[chunk] = ReadDirEntries(filename_,
+                                                    directories.data() + begin,
+                                                    end - begin,
+                                                    dir_entries.data() + begin);
+                  });
+  }
+  for (size_t i = 0; i < std::min(directories.size(), num_threads); i++) {
+    TEST_AND_RETURN_FALSE(dirs_ok[i]);
+  }
+
+  // Resolve the path of every directory at once from the entries of their
+  // parents, instead of looking up its parents for each one. The root is its
+  // own parent.
+  std::map<ext2_ino_t, std::pair<ext2_ino_t, const string*>> parents;
+  for (size_t i = 0; i < directories.size(); i++) {
+    for (const DirEntry& entry : dir_entries[i]) {
+      auto ino_file = inodes.find(entry.inode);
+      if (!entry.is_dot && ino_file != inodes.end() &&
+          S_ISDIR(ino_file->second.file_stat.st_mode)) {
+        parents.emplace(entry.inode,
+                        std::make_pair(directories[i], &entry.name));
+      }
+    }
+  }
+  // The path of each directory, empty if it can't be reached from the root.
+  std::map<ext2_ino_t, string> dir_names = {{EXT2_ROOT_INO, "/"}};
+  auto resolve_dir_name = [&](ext2_ino_t dir_ino) -> const string& {
+    // Walk up to the first directory with a known path, then back down.
+    vector<ext2_ino_t> chain;
+    auto known = dir_names.find(dir_ino);
+    while (known == dir_names.end()) {
+      auto parent = parents.find(dir_ino);
+      if (parent == parents.end() || chain.size() > directories.size()) {
+        known = dir_names.emplace(dir_ino, "").first;
+        break;
+      }
+      chain.push_back(dir_ino);
+      dir_ino = parent->second.first;
+      known = dir_names.find(dir_ino);
+    }
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+      string name;
+      if (!known->second.empty()) {
+        name = known->second;
+        if (name != "/")
+          name += "/";
+        name += *parents[*it].second;
+      }
+      known = dir_names.emplace(*it, std::move(name)).first;
+    }
+    return known->second;
+  };
 
   // The set of inodes already added to the output. There can be less elements
   // here than in files since the later can contain repeated inodes due to
   // hardlink files.
   set<ext2_ino_t> used_inodes;
 
-  UpdateFileAndAppendState priv_data;
-  priv_data.inodes = &inodes;
-  priv_data.used_inodes = &used_inodes;
-  priv_data.files = files;
-  priv_data.filsys = filsys_;
-
   files->clear();
   // Iterate over all the files of each directory to update the name and add it.
-  for (ext2_ino_t dir_ino : directories) {
-    char* dir_name = nullptr;
-    errcode_t error = ext2fs_get_pathname(filsys_, dir_ino, 0, &dir_name);
-    if (error) {
+  for (size_t i = 0; i < directories.size(); i++) {
+    ext2_ino_t dir_ino = directories[i];
+    File& dir_file = inodes[dir_ino];
+    const string& dir_name = resolve_dir_name(dir_ino);
+    if (dir_name.empty()) {
       // Not being able to read a directory name is not a fatal error, it is
       // just skiped.
-      LOG(WARNING) << "Reading directory name on inode " << dir_ino
-                   << " (error " << error << ")";
-      inodes[dir_ino].name = base::StringPrintf("<dir-%u>", dir_ino);
+      LOG(WARNING) << "Reading directory name on inode " << dir_ino;
+      dir_file.name = base::StringPrintf("<dir-%u>", dir_ino);
     } else {
-      inodes[dir_ino].name = dir_name;
-      files->push_back(inodes[dir_ino]);
+      dir_file.name = dir_name;
+      files->push_back(dir_file);
       used_inodes.insert(dir_ino);
     }
-    ext2fs_free_mem(&dir_name);
-
-    error = ext2fs_dir_iterate2(filsys_,
-                                dir_ino,
-                                0,
-                                nullptr /* block_buf */,
-                                UpdateFileAndAppend,
-                                &priv_data);
-    if (error) {
-      LOG(WARNING) << "Failed to enumerate files in directory "
-                   << inodes[dir_ino].name << " (error " << error << ")";
+
+    for (const DirEntry& entry : dir_entries[i]) {
+      // Directories can't have hard links, and they are added from the outer
+      // loop.
+      if (entry.file_type == EXT2_FT_DIR)
+        continue;
+      auto ino_file = inodes.find(entry.inode);
+      if (ino_file == inodes.end())
+        continue;
+      ino_file->second.name = dir_file.name;
+      if (dir_file.name != "/")
+        ino_file->second.name += "/";
+      ino_file->second.name += entry.name;
+
+      // Append this file to the output. If the file has a hard link, it will
+      // be added twice to the output, but with different names, which is ok.
+      // That will help identify all the versions of the same file.
+      files->push_back(ino_file->second);
+      used_inodes.insert(entry.inode);
     }
   }
 
@@ -0,0 +1,140 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+// Compares ExtentRanges with FlatExtentRanges on the operations the delta
+// generator uses the most, for sets of disjoint extents of every size.
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/flat_extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Returns |count| disjoint extents of 4 blocks with 4 blocks between them, in
+// random order.
+vector<Extent> ShuffledExtents(size_t count) {
+  vector<Extent> extents;
+  extents.reserve(count);
+  for (size_t i = 0; i < count; i++)
+    extents.push_back(ExtentForRange(i * 8, 4));
+  std::shuffle(extents.begin(), extents.end(), std::mt19937(42));
+  return extents;
+}
+
+template <typename Ranges>
+Ranges BuildRanges(const vector<Extent>& extents) {
+  Ranges ranges;
+  for (const auto& extent : extents)
+    ranges.AddExtent(extent);
+  return ranges;
+}
+
+template <typename Ranges>
+void BM_AddExtent(benchmark::State& state) {
+  const vector<Extent> extents = ShuffledExtents(state.range(0));
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(BuildRanges<Ranges>(extents));
+  }
+  state.SetItemsProcessed(state.iterations() * extents.size());
+}
+
+template <typename Ranges>
+void BM_AddExtentInOrder(benchmark::State& state) {
+  vector<Extent> extents = ShuffledExtents(state.range(0));
+  std::sort(extents.begin(), extents.end(), ExtentLess());
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(BuildRanges<Ranges>(extents));
+  }
+  state.SetItemsProcessed(state.iterations() * extents.size());
+}
+
+template <typename Ranges>
+void BM_AddExtents(benchmark::State& state) {
+  const vector<Extent> extents = ShuffledExtents(state.range(0));
+  for (auto _ : state) {
+    Ranges ranges;
+    ranges.AddExtents(extents);
+    benchmark::DoNotOptimize(ranges);
+  }
+  state.SetItemsProcessed(state.iterations() * extents.size());
+}
+
+template <typename Ranges>
+void BM_SubtractExtent(benchmark::State& state) {
+  const vector<Extent> extents = ShuffledExtents(state.range(0));
+  const Ranges full = BuildRanges<Ranges>(extents);
+  for (auto _ : state) {
+    state.PauseTiming();
+    Ranges ranges = full;
+    state.ResumeTiming();
+    // Split every extent in two.
+    for (const auto& extent : extents)
+      ranges.SubtractBlock(extent.start_block() + 1);
+    benchmark::DoNotOptimize(ranges);
+  }
+  state.SetItemsProcessed(state.iterations() * extents.size());
+}
+
+template <typename Ranges>
+void BM_GetIntersectingExtents(benchmark::State& state) {
+  const vector<Extent> extents = ShuffledExtents(state.range(0));
+  const Ranges ranges = BuildRanges<Ranges>(extents);
+  for (auto _ : state) {
+    for (const auto& extent : extents) {
+      benchmark::DoNotOptimize(ranges.GetIntersectingExtents(
+          ExtentForRange(extent.start_block() + 2, 8)));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * extents.size());
+}
+
+template <typename Ranges>
+void BM_FilterExtentRanges(benchmark::State& state) {
+  const vector<Extent> extents = ShuffledExtents(state.range(0));
+  const Ranges ranges = BuildRanges<Ranges>(extents);
+  const vector<Extent> whole{ExtentForRange(0, extents.size() * 8)};
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(FilterExtentRanges(whole, ranges));
+  }
+  state.SetItemsProcessed(state.iterations() * extents.size());
+}
+
+}  // namespace
+
+#define EXTENT_RANGES_BENCHMARK(name)                              \
+  BENCHMARK_TEMPLATE(name, ExtentRanges)->Range(1 << 8, 1 << 16); \
+  BENCHMARK_TEMPLATE(name, FlatExtentRanges)->Range(1 << 8, 1 << 16)
+
+EXTENT_RANGES_BENCHMARK(BM_AddExtent);
+EXTENT_RANGES_BENCHMARK(BM_AddExtentInOrder);
+EXTENT_RANGES_BENCHMARK(BM_AddExtents);
+EXTENT_RANGES_BENCHMARK(BM_SubtractExtent);
+EXTENT_RANGES_BENCHMARK(BM_GetIntersectingExtents);
+EXTENT_RANGES_BENCHMARK(BM_FilterExtentRanges);
+
+}  // namespace chromeos_update_engine
+
+BENCHMARK_MAIN();
@@ -76,6 +76,16 @@ void StoreExtents(const vector<Extent>& extents,
   }
 }
 
+void StoreExtents(const vector<BlockExtent>& extents,
+                  google::protobuf::RepeatedPtrField<Extent>* out) {
+  out->Reserve(out->size() + extents.size());
+  for (const BlockExtent& extent : extents) {
+    Extent* new_extent = out->Add();
+    new_extent->set_start_block(extent.start_block());
+    new_extent->set_num_blocks(extent.num_blocks());
+  }
+}
+
 // Stores all extents in |extents| into |out_vector|.
 void ExtentsToVector(const google::protobuf::RepeatedPtrField<Extent>& extents,
                      vector<Extent>* out_vector) {
@@ -172,6 +182,18 @@ std::ostream& operator<<(std::ostream& out, const Extent& extent) {
   return out;
 }
 
+std::ostream& operator<<(std::ostream& out, const BlockExtent& extent) {
+  out << "(" << extent.start_block() << " - " << extent.num_blocks() << ")";
+  return out;
+}
+
+Extent BlockExtent::ToExtent() const {
+  Extent extent;
+  extent.set_start_block(start_block_);
+  extent.set_num_blocks(num_blocks_);
+  return extent;
+}
+
 template <typename T>
 std::ostream& PrintExtents(std::ostream& out, const T& extents) {
   if (extents.begin() == extents.end()) {
@@ -19,6 +19,7 @@
 
 #include <limits>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include <base/logging.h>
@@ -39,6 +40,53 @@ struct ExtentLess {
   }
 };
 
+// A trivially copyable extent, for the internal loops that handle many of
+// them. It has the accessors of the protobuf Extent, so the templated helpers
+// below accept both; protobuf Extents are only needed in the manifest.
+class BlockExtent {
+ public:
+  constexpr BlockExtent() = default;
+  constexpr BlockExtent(uint64_t start_block, uint64_t num_blocks)
+      : start_block_(start_block), num_blocks_(num_blocks) {}
+  explicit BlockExtent(const Extent& extent)
+      : BlockExtent(extent.start_block(), extent.num_blocks()) {}
+
+  constexpr uint64_t start_block() const { return start_block_; }
+  constexpr uint64_t num_blocks() const { return num_blocks_; }
+  constexpr uint64_t end_block() const { return start_block_ + num_blocks_; }
+  constexpr void set_start_block(uint64_t start_block) {
+    start_block_ = start_block;
+  }
+  constexpr void set_num_blocks(uint64_t num_blocks) {
+    num_blocks_ = num_blocks;
+  }
+
+  Extent ToExtent() const;
+
+  constexpr bool operator==(const BlockExtent& other) const {
+    return start_block_ == other.start_block_ &&
+           num_blocks_ == other.num_blocks_;
+  }
+  constexpr bool operator!=(const BlockExtent& other) const {
+    return !(*this == other);
+  }
+
+ private:
+  uint64_t start_block_{0};
+  uint64_t num_blocks_{0};
+};
+static_assert(std::is_trivially_copyable_v<BlockExtent>);
+
+// Converts a collection (vector or RepeatedPtrField) of Extent to BlockExtents.
+template <typename T>
+std::vector<BlockExtent> ToBlockExtents(const T& extents) {
+  std::vector<BlockExtent> ret;
+  ret.reserve(extents.size());
+  for (const auto& extent : extents)
+    ret.emplace_back(extent.start_block(), extent.num_blocks());
+  return ret;
+}
+
 // |block| must either be the next block in the last extent or a block
 // in the next extent. This function will not handle inserting block
 // into an arbitrary place in the extents.
@@ -66,6 +114,8 @@ std::vector<uint64_t> ExpandExtents(const T& extents) {
 // Stores all Extents in 'extents' into 'out'.
 void StoreExtents(const std::vector<Extent>& extents,
                   google::protobuf::RepeatedPtrField<Extent>* out);
+void StoreExtents(const std::vector<BlockExtent>& extents,
+                  google::protobuf::RepeatedPtrField<Extent>* out);
 
 // Stores all extents in |extents| into |out_vector|.
 void ExtentsToVector(const google::protobuf::RepeatedPtrField<Extent>& extents,
@@ -137,6 +187,7 @@ struct BlockIterator {
 };
 
 std::ostream& operator<<(std::ostream& out, const Extent& extent);
+std::ostream& operator<<(std::ostream& out, const BlockExtent& extent);
 std::ostream& operator<<(std::ostream& out, const std::vector<Extent>& extent);
 std::ostream& operator<<(std::ostream& out, const std::set<Extent>& extents);
 
@@ -162,13 +213,15 @@ size_t GetNthBlock(const Container& extents, const size_t n) {
   return std::numeric_limits<size_t>::max();
 }
 
-constexpr bool ExtentContains(const Extent& extent, size_t block) {
+template <typename E>
+constexpr bool ExtentContains(const E& extent, size_t block) {
   return extent.start_block() <= block &&
          block < extent.start_block() + extent.num_blocks();
 }
 
 // return true iff |big| extent contains |small| extent
-constexpr bool ExtentContains(const Extent& big, const Extent& small) {
+template <typename E>
+constexpr bool ExtentContains(const E& big, const E& small) {
   return big.start_block() <= small.start_block() &&
          small.start_block() + small.num_blocks() <=
              big.start_block() + big.num_blocks();
@@ -153,4 +153,30 @@ TEST(ExtentUtilsTest, ExtentsSublistTest) {
             ExtentsSublist(extents, 14, 100));
 }
 
+TEST(ExtentUtilsTest, BlockExtentTest) {
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  *extents.Add() = ExtentForRange(10, 5);
+  *extents.Add() = ExtentForRange(kSparseHole, 2);
+  *extents.Add() = ExtentForRange(20, 1);
+
+  const vector<BlockExtent> block_extents = ToBlockExtents(extents);
+  EXPECT_EQ((vector<BlockExtent>{{10, 5}, {kSparseHole, 2}, {20, 1}}),
+            block_extents);
+  EXPECT_EQ(8U, utils::BlocksInExtents(block_extents));
+  EXPECT_EQ(ExpandExtents(extents), ExpandExtents(block_extents));
+  EXPECT_EQ(20U, GetNthBlock(block_extents, 7));
+  EXPECT_TRUE(ExtentContains(block_extents[0], 14));
+  EXPECT_FALSE(ExtentContains(block_extents[0], 15));
+  EXPECT_TRUE(ExtentContains(block_extents[0], BlockExtent(11, 4)));
+  EXPECT_EQ(15U, block_extents[0].end_block());
+
+  google::protobuf::RepeatedPtrField<Extent> stored;
+  StoreExtents(block_extents, &stored);
+  ASSERT_EQ(extents.size(), stored.size());
+  for (int i = 0; i < extents.size(); i++) {
+    EXPECT_EQ(extents[i], stored[i]);
+    EXPECT_EQ(extents[i], block_extents[i].ToExtent());
+  }
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,195 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/file_similarity_index.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <string_view>
+
+#include <base/logging.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/task_scheduler.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Blocks of a file read at once.
+constexpr size_t kReadChunkBlocks = 256;
+
+// Added to the block hash for each hash function of the sketch.
+constexpr uint64_t kSeedIncrement = 0x9e3779b97f4a7c15ULL;
+
+// The finalizer of splitmix64, turning the block hashes into the values of
+// independent hash functions.
+uint64_t Mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+}  // namespace
+
+bool FileSimilarityIndex::ComputeSketch(int fd,
+                                        const FilesystemInterface::File& file,
+                                        Sketch* sketch) {
+  sketch->min_hashes.fill(std::numeric_limits<uint64_t>::max());
+  sketch->content_hash = 0;
+  sketch->has_data = false;
+  brillo::Blob buffer;
+  for (const auto& extent : file.extents) {
+    for (uint64_t first = 0; first < extent.num_blocks();
+         first += kReadChunkBlocks) {
+      const uint64_t blocks =
+          std::min<uint64_t>(kReadChunkBlocks, extent.num_blocks() - first);
+      buffer.resize(blocks * kBlockSize);
+      ssize_t bytes_read = 0;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(
+          fd,
+          buffer.data(),
+          buffer.size(),
+          (extent.start_block() + first) * kBlockSize,
+          &bytes_read));
+      TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == buffer.size());
+      for (uint64_t i = 0; i < blocks; i++) {
+        const uint8_t* block = buffer.data() + i * kBlockSize;
+        const uint64_t hash = std::hash<std::string_view>()(std::string_view(
+            reinterpret_cast<const char*>(block), kBlockSize));
+        sketch->content_hash = Mix(sketch->content_hash ^ hash);
+        if (utils::IsZero(block, kBlockSize)) {
+          continue;
+        }
+        sketch->has_data = true;
+        for (size_t k = 0; k < kSketchSize; k++) {
+          auto& min_hash = sketch->min_hashes[k];
+          min_hash = std::min(min_hash, Mix(hash + (k + 1) * kSeedIncrement));
+        }
+      }
+    }
+  }
+  return true;
+}
+
+uint64_t FileSimilarityIndex::BandKey(const Sketch& sketch, size_t band) {
+  uint64_t key = band;
+  for (size_t k = band * kBandSize; k < (band + 1) * kBandSize; k++) {
+    key = Mix(key ^ sketch.min_hashes[k]);
+  }
+  return key;
+}
+
+bool FileSimilarityIndex::Init(
+    const string& old_part,
+    const std::map<string, FilesystemInterface::File>& old_files) {
+  int fd = HANDLE_EINTR(open(old_part.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+
+  files_.clear();
+  for (const auto& [name, file] : old_files) {
+    if (!file.extents.empty()) {
+      files_.push_back(&file);
+    }
+  }
+  sketches_.resize(files_.size());
+  std::atomic<bool> failed{false};
+  {
+    TaskScheduler::TaskGroup sketch_tasks;
+    for (size_t i = 0; i < files_.size(); i++) {
+      sketch_tasks.Add([this, fd, i, &failed] {
+        if (!ComputeSketch(fd, *files_[i], &sketches_[i])) {
+          failed = true;
+        }
+      });
+    }
+  }
+  TEST_AND_RETURN_FALSE(!failed);
+
+  content_hashes_.clear();
+  bands_.clear();
+  for (size_t i = 0; i < files_.size(); i++) {
+    content_hashes_.emplace(sketches_[i].content_hash, i);
+    if (!sketches_[i].has_data) {
+      continue;
+    }
+    for (size_t band = 0; band < kSketchSize / kBandSize; band++) {
+      bands_[BandKey(sketches_[i], band)].push_back(i);
+    }
+  }
+  LOG(INFO) << "Indexed the contents of " << files_.size() << " old files";
+  return true;
+}
+
+bool FileSimilarityIndex::FindSimilarFile(
+    const string& new_part,
+    const FilesystemInterface::File& new_file,
+    const FilesystemInterface::File** old_file) const {
+  *old_file = nullptr;
+  if (files_.empty()) {
+    return true;
+  }
+  int fd = HANDLE_EINTR(open(new_part.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  Sketch sketch;
+  TEST_AND_RETURN_FALSE(ComputeSketch(fd, new_file, &sketch));
+
+  const auto exact = content_hashes_.find(sketch.content_hash);
+  if (exact != content_hashes_.end()) {
+    *old_file = files_[exact->second];
+    return true;
+  }
+  if (!sketch.has_data) {
+    return true;
+  }
+
+  const FilesystemInterface::File* best_file = nullptr;
+  size_t best_matches = 0;
+  for (size_t band = 0; band < kSketchSize / kBandSize; band++) {
+    const auto bucket = bands_.find(BandKey(sketch, band));
+    if (bucket == bands_.end()) {
+      continue;
+    }
+    for (size_t i : bucket->second) {
+      size_t matches = 0;
+      for (size_t k = 0; k < kSketchSize; k++) {
+        matches += sketches_[i].min_hashes[k] == sketch.min_hashes[k];
+      }
+      if (matches > best_matches) {
+        best_matches = matches;
+        best_file = files_[i];
+      }
+    }
+  }
+  if (best_matches >= kMinSimilarity * kSketchSize) {
+    *old_file = best_file;
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,95 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_SIMILARITY_INDEX_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_SIMILARITY_INDEX_H_
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/payload_generator/filesystem_interface.h"
+
+namespace chromeos_update_engine {
+
+// An index of the files of the old partition by their contents, to find the
+// old file most similar to a new file which has no old file of the same name,
+// like renamed or moved files.
+//
+// The similarity of two files is the Jaccard index of the sets of their
+// non-zero blocks, estimated from a MinHash sketch of each file: the smallest
+// value of each of kSketchSize hash functions over its blocks. The sketches
+// are split in bands, and only the old files with the same values as the new
+// file over all of one band are compared to it, which makes a lookup
+// independent of the number of old files.
+class FileSimilarityIndex {
+ public:
+  static constexpr size_t kSketchSize = 32;
+  static constexpr size_t kBandSize = 2;
+  // The estimated similarity below which an old file isn't used.
+  static constexpr double kMinSimilarity = 0.25;
+
+  FileSimilarityIndex() = default;
+
+  // Indexes the files of |old_files|, whose blocks are read from the partition
+  // image |old_part|, on the threads of the TaskScheduler. |old_files| must
+  // outlive the index.
+  bool Init(const std::string& old_part,
+            const std::map<std::string, FilesystemInterface::File>& old_files);
+
+  // Stores in |old_file| the old file with the same data as |new_file|, whose
+  // blocks are read from |new_part|, or else the most similar old file if
+  // similar enough, or nullptr. Returns false on error.
+  bool FindSimilarFile(const std::string& new_part,
+                       const FilesystemInterface::File& new_file,
+                       const FilesystemInterface::File** old_file) const;
+
+ private:
+  struct Sketch {
+    std::array<uint64_t, kSketchSize> min_hashes;
+    // A hash of all the blocks of the file in order, for the exact matches.
+    uint64_t content_hash{0};
+    // Whether the file has non-zero blocks.
+    bool has_data{false};
+  };
+
+  // Computes the |sketch| of the blocks of |file| read from |fd|.
+  static bool ComputeSketch(int fd,
+                            const FilesystemInterface::File& file,
+                            Sketch* sketch);
+
+  // The key of the band |band| of |sketch| in |bands_|.
+  static uint64_t BandKey(const Sketch& sketch, size_t band);
+
+  std::vector<const FilesystemInterface::File*> files_;
+  std::vector<Sketch> sketches_;
+
+  // The index in |files_| of the files by content hash, and of those with
+  // each band of their sketch.
+  std::unordered_map<uint64_t, size_t> content_hashes_;
+  std::unordered_map<uint64_t, std::vector<size_t>> bands_;
+
+  DISALLOW_COPY_AND_ASSIGN(FileSimilarityIndex);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_FILE_SIMILARITY_INDEX_H_
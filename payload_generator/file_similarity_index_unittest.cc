@@ -0,0 +1,127 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/file_similarity_index.h"
+
+#include <algorithm>
+#include <map>
+#include <random>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class FileSimilarityIndexTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    old_image_.resize(kImageBlocks * kBlockSize);
+    new_image_.resize(kImageBlocks * kBlockSize);
+    std::mt19937 random(1234);
+    for (auto& byte : old_image_) {
+      byte = random();
+    }
+    for (auto& byte : new_image_) {
+      byte = random();
+    }
+    AddFile(&old_files_, "a", 0, 10);
+    AddFile(&old_files_, "b", 10, 10);
+  }
+
+  void AddFile(std::map<string, FilesystemInterface::File>* files,
+               const string& name,
+               uint64_t start_block,
+               uint64_t num_blocks) {
+    auto& file = (*files)[name];
+    file.name = name;
+    file.extents = {ExtentForRange(start_block, num_blocks)};
+  }
+
+  // Copies |num_blocks| blocks at |old_block| of the old image into the new
+  // image at |new_block|.
+  void CopyBlocks(uint64_t old_block, uint64_t new_block, uint64_t num_blocks) {
+    std::copy(old_image_.begin() + old_block * kBlockSize,
+              old_image_.begin() + (old_block + num_blocks) * kBlockSize,
+              new_image_.begin() + new_block * kBlockSize);
+  }
+
+  const FilesystemInterface::File* FindSimilarFile(
+      const FilesystemInterface::File& new_file) {
+    ScopedTempFile old_part("old_part.XXXXXX");
+    ScopedTempFile new_part("new_part.XXXXXX");
+    EXPECT_TRUE(utils::WriteFile(
+        old_part.path().c_str(), old_image_.data(), old_image_.size()));
+    EXPECT_TRUE(utils::WriteFile(
+        new_part.path().c_str(), new_image_.data(), new_image_.size()));
+    FileSimilarityIndex index;
+    EXPECT_TRUE(index.Init(old_part.path(), old_files_));
+    const FilesystemInterface::File* old_file = nullptr;
+    EXPECT_TRUE(index.FindSimilarFile(new_part.path(), new_file, &old_file));
+    return old_file;
+  }
+
+  static constexpr uint64_t kImageBlocks = 40;
+  brillo::Blob old_image_;
+  brillo::Blob new_image_;
+  std::map<string, FilesystemInterface::File> old_files_;
+};
+
+TEST_F(FileSimilarityIndexTest, SameDataTest) {
+  CopyBlocks(0, 30, 10);
+  std::map<string, FilesystemInterface::File> new_files;
+  AddFile(&new_files, "renamed", 30, 10);
+  const auto old_file = FindSimilarFile(new_files["renamed"]);
+  ASSERT_NE(nullptr, old_file);
+  EXPECT_EQ("a", old_file->name);
+}
+
+TEST_F(FileSimilarityIndexTest, SimilarDataTest) {
+  // Blocks 12 and 15 of "b" change, and the others move around.
+  CopyBlocks(10, 0, 2);
+  CopyBlocks(13, 2, 2);
+  CopyBlocks(16, 4, 4);
+  std::map<string, FilesystemInterface::File> new_files;
+  AddFile(&new_files, "moved", 0, 10);
+  const auto old_file = FindSimilarFile(new_files["moved"]);
+  ASSERT_NE(nullptr, old_file);
+  EXPECT_EQ("b", old_file->name);
+}
+
+TEST_F(FileSimilarityIndexTest, NoSimilarDataTest) {
+  std::map<string, FilesystemInterface::File> new_files;
+  AddFile(&new_files, "new", 0, 10);
+  EXPECT_EQ(nullptr, FindSimilarFile(new_files["new"]));
+}
+
+TEST_F(FileSimilarityIndexTest, ZeroBlocksTest) {
+  // Zero blocks alone don't make files similar.
+  std::fill(old_image_.begin() + 20 * kBlockSize,
+            old_image_.begin() + 30 * kBlockSize,
+            0);
+  AddFile(&old_files_, "zeros", 20, 10);
+  std::fill(new_image_.begin(), new_image_.begin() + 8 * kBlockSize, 0);
+  std::map<string, FilesystemInterface::File> new_files;
+  AddFile(&new_files, "new", 0, 10);
+  EXPECT_EQ(nullptr, FindSimilarFile(new_files["new"]));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,329 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/flat_extent_ranges.h"
+
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+#include <base/logging.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Returns the extents in [|begin|, |end|) that are neither sparse holes nor
+// empty, sorted by start block.
+template <typename ExtentIterator>
+vector<BlockExtent> SortedRanges(ExtentIterator begin, ExtentIterator end) {
+  vector<BlockExtent> ranges;
+  ranges.reserve(std::distance(begin, end));
+  for (auto it = begin; it != end; ++it) {
+    if (it->start_block() == kSparseHole || it->num_blocks() == 0)
+      continue;
+    ranges.push_back({it->start_block(), it->num_blocks()});
+  }
+  std::sort(ranges.begin(),
+            ranges.end(),
+            [](const BlockExtent& a, const BlockExtent& b) {
+              return a.start_block() < b.start_block();
+            });
+  return ranges;
+}
+
+uint64_t CountBlocks(const vector<BlockExtent>& ranges) {
+  uint64_t blocks = 0;
+  for (const auto& range : ranges)
+    blocks += range.num_blocks();
+  return blocks;
+}
+
+}  // namespace
+
+void FlatExtentRanges::AddBlock(uint64_t block) {
+  AddExtent(ExtentForRange(block, 1));
+}
+
+void FlatExtentRanges::SubtractBlock(uint64_t block) {
+  SubtractExtent(ExtentForRange(block, 1));
+}
+
+vector<BlockExtent>::const_iterator FlatExtentRanges::FirstRangeEndingAfter(
+    uint64_t block, bool touching) const {
+  // The ranges are disjoint, so they are sorted by end block too.
+  return std::partition_point(
+      ranges_.begin(), ranges_.end(), [block, touching](const BlockExtent& r) {
+        return touching ? r.end_block() < block : r.end_block() <= block;
+      });
+}
+
+void FlatExtentRanges::AddExtent(const Extent& extent) {
+  if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+    return;
+
+  uint64_t start = extent.start_block();
+  uint64_t end = start + extent.num_blocks();
+  const auto first = FirstRangeEndingAfter(start, merge_touching_extents_);
+  auto last = first;
+  while (last != ranges_.end() &&
+         (last->start_block() < end ||
+          (merge_touching_extents_ && last->start_block() == end))) {
+    blocks_ -= last->num_blocks();
+    ++last;
+  }
+  if (first == last) {
+    ranges_.insert(first, {start, extent.num_blocks()});
+    blocks_ += extent.num_blocks();
+    return;
+  }
+  start = std::min(start, first->start_block());
+  end = std::max(end, std::prev(last)->end_block());
+  // Replace all the merged ranges with the first one, extended.
+  auto merged = std::prev(ranges_.erase(std::next(first), last));
+  *merged = {start, end - start};
+  blocks_ += end - start;
+}
+
+void FlatExtentRanges::SubtractExtent(const Extent& extent) {
+  if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+    return;
+
+  const uint64_t start = extent.start_block();
+  const uint64_t end = start + extent.num_blocks();
+  const auto first = FirstRangeEndingAfter(start, false);
+  auto last = first;
+  while (last != ranges_.end() && last->start_block() < end) {
+    blocks_ -= last->num_blocks();
+    ++last;
+  }
+  if (first == last)
+    return;
+  // What remains of the first and last overlapping ranges.
+  const uint64_t first_start = first->start_block();
+  const BlockExtent head{first_start,
+                         start > first_start ? start - first_start : 0};
+  const uint64_t last_end = std::prev(last)->end_block();
+  const BlockExtent tail{end, last_end > end ? last_end - end : 0};
+  auto pos = ranges_.erase(first, last);
+  if (tail.num_blocks() > 0)
+    pos = ranges_.insert(pos, tail);
+  if (head.num_blocks() > 0)
+    ranges_.insert(pos, head);
+  blocks_ += head.num_blocks() + tail.num_blocks();
+}
+
+void FlatExtentRanges::AddSortedRanges(const vector<BlockExtent>& ranges) {
+  if (ranges.empty())
+    return;
+  vector<BlockExtent> result;
+  result.reserve(ranges_.size() + ranges.size());
+  auto a = ranges_.begin();
+  auto b = ranges.begin();
+  while (a != ranges_.end() || b != ranges.end()) {
+    const BlockExtent next =
+        b == ranges.end() ||
+                (a != ranges_.end() && a->start_block() <= b->start_block())
+            ? *a++
+            : *b++;
+    if (!result.empty() &&
+        (next.start_block() < result.back().end_block() ||
+         (merge_touching_extents_ &&
+          next.start_block() == result.back().end_block()))) {
+      result.back().set_num_blocks(
+          std::max(result.back().end_block(), next.end_block()) -
+          result.back().start_block());
+    } else {
+      result.push_back(next);
+    }
+  }
+  ranges_ = std::move(result);
+  blocks_ = CountBlocks(ranges_);
+}
+
+void FlatExtentRanges::SubtractSortedRanges(const vector<BlockExtent>& ranges) {
+  if (ranges.empty() || ranges_.empty())
+    return;
+  vector<BlockExtent> result;
+  result.reserve(ranges_.size() + ranges.size());
+  auto b = ranges.begin();
+  for (const auto& range : ranges_) {
+    uint64_t start = range.start_block();
+    const uint64_t end = range.end_block();
+    // Subtracted ranges ending before this one can't overlap the next ones.
+    while (b != ranges.end() && b->end_block() <= start)
+      ++b;
+    for (auto it = b; it != ranges.end() && it->start_block() < end; ++it) {
+      if (it->start_block() > start)
+        result.push_back({start, it->start_block() - start});
+      start = std::max(start, it->end_block());
+      if (start >= end)
+        break;
+    }
+    if (start < end)
+      result.push_back({start, end - start});
+  }
+  ranges_ = std::move(result);
+  blocks_ = CountBlocks(ranges_);
+}
+
+void FlatExtentRanges::AddExtents(const vector<Extent>& extents) {
+  AddSortedRanges(SortedRanges(extents.begin(), extents.end()));
+}
+
+void FlatExtentRanges::SubtractExtents(const vector<Extent>& extents) {
+  SubtractSortedRanges(SortedRanges(extents.begin(), extents.end()));
+}
+
+void FlatExtentRanges::AddRepeatedExtents(
+    const ::google::protobuf::RepeatedPtrField<Extent>& exts) {
+  AddSortedRanges(SortedRanges(exts.begin(), exts.end()));
+}
+
+void FlatExtentRanges::SubtractRepeatedExtents(
+    const ::google::protobuf::RepeatedPtrField<Extent>& exts) {
+  SubtractSortedRanges(SortedRanges(exts.begin(), exts.end()));
+}
+
+void FlatExtentRanges::AddRanges(const FlatExtentRanges& ranges) {
+  AddSortedRanges(ranges.ranges_);
+}
+
+void FlatExtentRanges::SubtractRanges(const FlatExtentRanges& ranges) {
+  SubtractSortedRanges(ranges.ranges_);
+}
+
+void FlatExtentRanges::IntersectRanges(const FlatExtentRanges& ranges) {
+  vector<BlockExtent> result;
+  auto a = ranges_.begin();
+  auto b = ranges.ranges_.begin();
+  while (a != ranges_.end() && b != ranges.ranges_.end()) {
+    const uint64_t start = std::max(a->start_block(), b->start_block());
+    const uint64_t end = std::min(a->end_block(), b->end_block());
+    if (start < end) {
+      if (merge_touching_extents_ && !result.empty() &&
+          result.back().end_block() == start) {
+        result.back().set_num_blocks(result.back().num_blocks() + end -
+                                     start);
+      } else {
+        result.push_back({start, end - start});
+      }
+    }
+    if (a->end_block() < b->end_block())
+      ++a;
+    else
+      ++b;
+  }
+  ranges_ = std::move(result);
+  blocks_ = CountBlocks(ranges_);
+}
+
+bool FlatExtentRanges::OverlapsWithExtent(const Extent& extent) const {
+  if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+    return false;
+  const auto it = FirstRangeEndingAfter(extent.start_block(), false);
+  return it != ranges_.end() &&
+         it->start_block() < extent.start_block() + extent.num_blocks();
+}
+
+bool FlatExtentRanges::ContainsBlock(uint64_t block) const {
+  const auto it = FirstRangeEndingAfter(block, false);
+  return it != ranges_.end() && it->start_block() <= block;
+}
+
+void FlatExtentRanges::Dump() const {
+  LOG(INFO) << "FlatExtentRanges Dump. blocks: " << blocks_;
+  for (const auto& range : ranges_) {
+    LOG(INFO) << "{" << range.start_block() << ", " << range.num_blocks()
+              << "}";
+  }
+}
+
+vector<Extent> FlatExtentRanges::GetExtents() const {
+  vector<Extent> extents;
+  extents.reserve(ranges_.size());
+  for (const auto& range : ranges_)
+    extents.push_back(range.ToExtent());
+  return extents;
+}
+
+vector<Extent> FlatExtentRanges::GetExtentsForBlockCount(
+    uint64_t count) const {
+  CHECK(count <= blocks_);
+  vector<Extent> out;
+  for (auto it = ranges_.begin(); count > 0; ++it) {
+    const uint64_t num_blocks = std::min(count, it->num_blocks());
+    out.push_back(ExtentForRange(it->start_block(), num_blocks));
+    count -= num_blocks;
+  }
+  return out;
+}
+
+vector<Extent> FlatExtentRanges::GetIntersectingExtents(
+    const Extent& extent) const {
+  vector<Extent> result;
+  if (extent.start_block() == kSparseHole || extent.num_blocks() == 0)
+    return result;
+  const uint64_t start = extent.start_block();
+  const uint64_t end = start + extent.num_blocks();
+  for (auto it = FirstRangeEndingAfter(start, false);
+       it != ranges_.end() && it->start_block() < end;
+       ++it) {
+    const uint64_t intersection_start = std::max(start, it->start_block());
+    result.push_back(ExtentForRange(
+        intersection_start,
+        std::min(end, it->end_block()) - intersection_start));
+  }
+  return result;
+}
+
+vector<Extent> FilterExtentRanges(const vector<Extent>& extents,
+                                  const FlatExtentRanges& ranges) {
+  vector<Extent> result;
+  const auto& block_ranges = ranges.ranges();
+  for (const Extent& extent : extents) {
+    if (extent.num_blocks() == 0)
+      continue;
+    if (extent.start_block() == kSparseHole) {
+      result.push_back(extent);
+      continue;
+    }
+    uint64_t start = extent.start_block();
+    const uint64_t end = start + extent.num_blocks();
+    // Cut out every range overlapping |extent|, in order.
+    for (auto it = std::partition_point(block_ranges.begin(),
+                                        block_ranges.end(),
+                                        [start](const BlockExtent& r) {
+                                          return r.end_block() <= start;
+                                        });
+         it != block_ranges.end() && it->start_block() < end;
+         ++it) {
+      if (it->start_block() > start)
+        result.push_back(ExtentForRange(start, it->start_block() - start));
+      start = it->end_block();
+    }
+    if (start < end)
+      result.push_back(ExtentForRange(start, end - start));
+  }
+  return result;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,108 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_FLAT_EXTENT_RANGES_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_FLAT_EXTENT_RANGES_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/update_metadata.pb.h"
+
+// A FlatExtentRanges object is a set of blocks with the same API as
+// ExtentRanges, but kept as a sorted vector of plain BlockExtents
+// instead of a std::set of protobuf Extent messages. Lookups are binary
+// searches over contiguous memory, and adding, subtracting or intersecting
+// many extents at once is a single linear merge. Adding or subtracting a
+// single extent in the middle moves all the ranges after it though, so many
+// unordered extents are better added with AddExtents(). Like ExtentRanges, it
+// ignores sparse hole extents.
+
+namespace chromeos_update_engine {
+
+class FlatExtentRanges {
+ public:
+  FlatExtentRanges() = default;
+  // See ExtentRanges::ExtentRanges(bool).
+  explicit FlatExtentRanges(bool merge_touching_extents)
+      : merge_touching_extents_(merge_touching_extents) {}
+
+  void AddBlock(uint64_t block);
+  void SubtractBlock(uint64_t block);
+  void AddExtent(const Extent& extent);
+  void SubtractExtent(const Extent& extent);
+  // Adding or subtracting many extents at once sorts them and merges them in
+  // a single pass, instead of one binary search and insertion for each.
+  void AddExtents(const std::vector<Extent>& extents);
+  void SubtractExtents(const std::vector<Extent>& extents);
+  void AddRepeatedExtents(
+      const ::google::protobuf::RepeatedPtrField<Extent>& exts);
+  void SubtractRepeatedExtents(
+      const ::google::protobuf::RepeatedPtrField<Extent>& exts);
+  void AddRanges(const FlatExtentRanges& ranges);
+  void SubtractRanges(const FlatExtentRanges& ranges);
+  // Keeps only the blocks that are also in |ranges|.
+  void IntersectRanges(const FlatExtentRanges& ranges);
+
+  // Returns true if the input extent overlaps with the current ranges.
+  bool OverlapsWithExtent(const Extent& extent) const;
+
+  // Returns whether the block |block| is in these ranges.
+  bool ContainsBlock(uint64_t block) const;
+
+  // Dumps contents to the log file. Useful for debugging.
+  void Dump() const;
+
+  uint64_t blocks() const { return blocks_; }
+  // The disjoint ranges of blocks, sorted by start block.
+  const std::vector<BlockExtent>& ranges() const { return ranges_; }
+  // Returns ranges() as Extent messages.
+  std::vector<Extent> GetExtents() const;
+
+  // Returns an ordered vector of extents for |count| blocks, using the first
+  // blocks of these ranges, which are not removed. |count| must be less than
+  // or equal to blocks().
+  std::vector<Extent> GetExtentsForBlockCount(uint64_t count) const;
+
+  // Compute the intersection between these ranges and the |extent| parameter.
+  // If there's no intersection, an empty vector is returned.
+  std::vector<Extent> GetIntersectingExtents(const Extent& extent) const;
+
+ private:
+  // Returns the first range that ends after |block|, or one that ends at
+  // |block| if |touching| is set.
+  std::vector<BlockExtent>::const_iterator FirstRangeEndingAfter(
+      uint64_t block, bool touching) const;
+
+  // Adds or subtracts the ranges in |ranges|, which must be sorted by start
+  // block, and updates blocks_.
+  void AddSortedRanges(const std::vector<BlockExtent>& ranges);
+  void SubtractSortedRanges(const std::vector<BlockExtent>& ranges);
+
+  std::vector<BlockExtent> ranges_;
+  uint64_t blocks_ = 0;
+  bool merge_touching_extents_ = true;
+};
+
+// Filters out from the passed list of extents |extents| all the blocks in
+// |ranges|, like FilterExtentRanges() for an ExtentRanges.
+std::vector<Extent> FilterExtentRanges(const std::vector<Extent>& extents,
+                                       const FlatExtentRanges& ranges);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_FLAT_EXTENT_RANGES_H_
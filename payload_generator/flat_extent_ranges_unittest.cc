@@ -0,0 +1,231 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/flat_extent_ranges.h"
+
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+vector<Extent> ExtentSetToVector(const ExtentRanges& ranges) {
+  return {ranges.extent_set().begin(), ranges.extent_set().end()};
+}
+
+}  // namespace
+
+TEST(FlatExtentRangesTest, SimpleTest) {
+  FlatExtentRanges ranges;
+  ranges.SubtractBlock(2);
+  ASSERT_EQ(vector<Extent>(), ranges.GetExtents());
+
+  ranges.AddBlock(0);
+  ranges.AddBlock(1);
+  ranges.AddBlock(3);
+  ASSERT_EQ((vector<Extent>{ExtentForRange(0, 2), ExtentForRange(3, 1)}),
+            ranges.GetExtents());
+  ranges.AddBlock(2);
+  ranges.AddBlock(kSparseHole);
+  ASSERT_EQ(vector<Extent>{ExtentForRange(0, 4)}, ranges.GetExtents());
+  ranges.SubtractBlock(kSparseHole);
+  ranges.SubtractBlock(2);
+  ASSERT_EQ((vector<Extent>{ExtentForRange(0, 2), ExtentForRange(3, 1)}),
+            ranges.GetExtents());
+  ASSERT_EQ(3UL, ranges.blocks());
+
+  for (uint64_t i = 100; i < 1000; i += 100)
+    ranges.AddExtent(ExtentForRange(i, 50));
+  ranges.SubtractExtent(ExtentForRange(210, 410 - 210));
+  ranges.AddExtent(ExtentForRange(100000, 0));
+  ranges.SubtractExtent(ExtentForRange(3, 0));
+  ASSERT_EQ((vector<Extent>{ExtentForRange(0, 2),
+                            ExtentForRange(3, 1),
+                            ExtentForRange(100, 50),
+                            ExtentForRange(200, 10),
+                            ExtentForRange(410, 40),
+                            ExtentForRange(500, 50),
+                            ExtentForRange(600, 50),
+                            ExtentForRange(700, 50),
+                            ExtentForRange(800, 50),
+                            ExtentForRange(900, 50)}),
+            ranges.GetExtents());
+  ASSERT_EQ(3UL + 50 + 10 + 40 + 5 * 50, ranges.blocks());
+
+  ASSERT_TRUE(ranges.ContainsBlock(449));
+  ASSERT_FALSE(ranges.ContainsBlock(450));
+  ASSERT_TRUE(ranges.OverlapsWithExtent(ExtentForRange(150, 51)));
+  ASSERT_FALSE(ranges.OverlapsWithExtent(ExtentForRange(150, 50)));
+  ASSERT_EQ((vector<Extent>{ExtentForRange(205, 5), ExtentForRange(410, 5)}),
+            ranges.GetIntersectingExtents(ExtentForRange(205, 210)));
+  ASSERT_EQ((vector<Extent>{ExtentForRange(0, 2),
+                            ExtentForRange(3, 1),
+                            ExtentForRange(100, 2)}),
+            ranges.GetExtentsForBlockCount(5));
+}
+
+TEST(FlatExtentRangesTest, AddExtentTouching) {
+  FlatExtentRanges merged;
+  FlatExtentRanges unmerged(false);
+  for (auto* ranges : {&merged, &unmerged}) {
+    ranges->AddExtent(ExtentForRange(5, 5));
+    ranges->AddExtent(ExtentForRange(10, 5));
+    ranges->AddExtent(ExtentForRange(0, 5));
+  }
+  ASSERT_EQ(vector<Extent>{ExtentForRange(0, 15)}, merged.GetExtents());
+  ASSERT_EQ((vector<Extent>{ExtentForRange(0, 5),
+                            ExtentForRange(5, 5),
+                            ExtentForRange(10, 5)}),
+            unmerged.GetExtents());
+  // Overlapping extents are always merged.
+  unmerged.AddExtent(ExtentForRange(4, 2));
+  ASSERT_EQ((vector<Extent>{ExtentForRange(0, 10), ExtentForRange(10, 5)}),
+            unmerged.GetExtents());
+  ASSERT_EQ(15UL, unmerged.blocks());
+}
+
+TEST(FlatExtentRangesTest, SetOperations) {
+  FlatExtentRanges a;
+  a.AddExtents({ExtentForRange(50, 10),
+                ExtentForRange(0, 10),
+                ExtentForRange(5, 10),
+                ExtentForRange(kSparseHole, 4),
+                ExtentForRange(30, 0)});
+  ASSERT_EQ((vector<Extent>{ExtentForRange(0, 15), ExtentForRange(50, 10)}),
+            a.GetExtents());
+
+  FlatExtentRanges b;
+  b.AddExtents({ExtentForRange(10, 45), ExtentForRange(100, 1)});
+
+  FlatExtentRanges intersection = a;
+  intersection.IntersectRanges(b);
+  ASSERT_EQ((vector<Extent>{ExtentForRange(10, 5), ExtentForRange(50, 5)}),
+            intersection.GetExtents());
+  ASSERT_EQ(10UL, intersection.blocks());
+
+  FlatExtentRanges difference = a;
+  difference.SubtractRanges(b);
+  ASSERT_EQ((vector<Extent>{ExtentForRange(0, 10), ExtentForRange(55, 5)}),
+            difference.GetExtents());
+  ASSERT_EQ(15UL, difference.blocks());
+
+  FlatExtentRanges sum = a;
+  sum.AddRanges(b);
+  ASSERT_EQ((vector<Extent>{ExtentForRange(0, 60), ExtentForRange(100, 1)}),
+            sum.GetExtents());
+  ASSERT_EQ(61UL, sum.blocks());
+
+  // Subtracting overlapping extents at once.
+  sum.SubtractExtents({ExtentForRange(20, 10),
+                       ExtentForRange(2, 3),
+                       ExtentForRange(22, 4),
+                       ExtentForRange(25, 10)});
+  ASSERT_EQ((vector<Extent>{ExtentForRange(0, 2),
+                            ExtentForRange(5, 15),
+                            ExtentForRange(35, 25),
+                            ExtentForRange(100, 1)}),
+            sum.GetExtents());
+  ASSERT_EQ(43UL, sum.blocks());
+}
+
+TEST(FlatExtentRangesTest, FilterExtentRanges) {
+  // Two overlapping extents, with three ranges to remove.
+  vector<Extent> extents{ExtentForRange(10, 100),
+                         ExtentForRange(3, 0),
+                         ExtentForRange(kSparseHole, 2),
+                         ExtentForRange(30, 100)};
+  FlatExtentRanges ranges;
+  ranges.AddExtent(ExtentForRange(28, 3));
+  ranges.AddExtent(ExtentForRange(50, 10));
+  ranges.AddExtent(ExtentForRange(70, 10));
+  ranges.AddExtent(ExtentForRange(108, 6));
+  ASSERT_EQ((vector<Extent>{// For the first extent:
+                            ExtentForRange(10, 18),
+                            ExtentForRange(31, 19),
+                            ExtentForRange(60, 10),
+                            ExtentForRange(80, 28),
+                            // The sparse hole is kept:
+                            ExtentForRange(kSparseHole, 2),
+                            // For the second extent:
+                            ExtentForRange(31, 19),
+                            ExtentForRange(60, 10),
+                            ExtentForRange(80, 28),
+                            ExtentForRange(114, 16)}),
+            FilterExtentRanges(extents, ranges));
+}
+
+TEST(FlatExtentRangesTest, MatchesExtentRanges) {
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<uint64_t> start_dist(0, 2000);
+  std::uniform_int_distribution<uint64_t> num_dist(0, 40);
+  std::uniform_int_distribution<int> op_dist(0, 3);
+  for (bool merge_touching : {true, false}) {
+    ExtentRanges expected(merge_touching);
+    FlatExtentRanges ranges(merge_touching);
+    for (int i = 0; i < 5000; i++) {
+      const Extent extent = ExtentForRange(start_dist(gen), num_dist(gen));
+      switch (op_dist(gen)) {
+        case 0:
+        case 1:
+          expected.AddExtent(extent);
+          ranges.AddExtent(extent);
+          break;
+        case 2:
+          expected.SubtractExtent(extent);
+          ranges.SubtractExtent(extent);
+          break;
+        case 3:
+          ASSERT_EQ(expected.GetIntersectingExtents(extent),
+                    ranges.GetIntersectingExtents(extent));
+          ASSERT_EQ(expected.ContainsBlock(extent.start_block()),
+                    ranges.ContainsBlock(extent.start_block()));
+          if (extent.num_blocks() > 0) {
+            ASSERT_EQ(expected.OverlapsWithExtent(extent),
+                      ranges.OverlapsWithExtent(extent));
+          }
+          break;
+      }
+      ASSERT_EQ(expected.blocks(), ranges.blocks());
+    }
+    ASSERT_EQ(ExtentSetToVector(expected), ranges.GetExtents());
+
+    // Batch operations give the same blocks as adding and subtracting the
+    // extents one at a time.
+    vector<Extent> batch;
+    for (int i = 0; i < 500; i++)
+      batch.push_back(ExtentForRange(start_dist(gen), num_dist(gen)));
+    expected.SubtractExtents(batch);
+    ranges.SubtractExtents(batch);
+    ASSERT_EQ(ExtentSetToVector(expected), ranges.GetExtents());
+    ASSERT_EQ(expected.blocks(), ranges.blocks());
+    expected.AddExtents(batch);
+    ranges.AddExtents(batch);
+    ASSERT_EQ(expected.blocks(), ranges.blocks());
+    ASSERT_EQ(FilterExtentRanges({ExtentForRange(0, 3000)}, expected),
+              FilterExtentRanges({ExtentForRange(0, 3000)}, ranges));
+  }
+}
+
+}  // namespace chromeos_update_engine
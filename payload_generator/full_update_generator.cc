@@ -20,18 +20,19 @@
 #include <inttypes.h>
 
 #include <algorithm>
-#include <deque>
 #include <memory>
+#include <mutex>
+#include <utility>
 
 #include <base/format_macros.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
-#include <base/synchronization/lock.h>
-#include <base/threading/simple_thread.h>
 #include <brillo/secure_blob.h>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/blob_pool.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 
 using std::vector;
 
@@ -41,73 +42,146 @@ namespace {
 
 const size_t kDefaultFullChunkSize = 1024 * 1024;  // 1 MiB
 
-// This class encapsulates a full update chunk processing thread work. The
-// processor reads a chunk of data from the input file descriptor and compresses
-// it. The processor will destroy itself when the work is done.
-class ChunkProcessor : public base::DelegateSimpleThread::Delegate {
+// Number of chunks per thread of the TaskScheduler that may be compressed or
+// waiting to be stored at once.
+const size_t kChunksInFlightPerThread = 2;
+
+// Compresses the chunks of a partition, one per operation of |aops|, on the
+// threads of the TaskScheduler and stores their blobs in the order of the
+// operations: a chunk is stored as soon as it and all the chunks before it are
+// compressed. Only a window of |window| chunks following the first chunk not
+// stored yet are compressed or held in memory at once, so the memory used
+// doesn't depend on the size of the partition and the blobs end up in the blob
+// file in the same order as the operations.
+class OrderedChunkWriter {
  public:
-  // Read a chunk of |size| bytes from |fd| starting at offset |offset|.
-  ChunkProcessor(const PayloadVersion& version,
-                 int fd,
-                 off_t offset,
-                 size_t size,
-                 BlobFileWriter* blob_file,
-                 AnnotatedOperation* aop)
-      : version_(version),
+  // The operations in |aops| must already have their extents set. The chunk
+  // of each of them is read from |fd|.
+  OrderedChunkWriter(const PayloadGenerationConfig& config,
+                     int fd,
+                     size_t window,
+                     BlobFileWriter* blob_file,
+                     vector<AnnotatedOperation>* aops)
+      : config_(config),
         fd_(fd),
-        offset_(offset),
-        size_(size),
         blob_file_(blob_file),
-        aop_(aop) {}
-  // We use a default move constructor since all the data members are POD types.
-  ChunkProcessor(ChunkProcessor&&) = default;
-  ~ChunkProcessor() override = default;
-
-  // Overrides DelegateSimpleThread::Delegate.
-  // Run() handles the read from |fd| in a thread-safe way, and stores the
-  // new operation to generate the region starting at |offset| of size |size|
-  // in the output operation |aop|. The associated blob data is stored in
-  // |blob_fd| and |blob_file_size| is updated.
-  void Run() override;
+        aops_(*aops),
+        slots_(std::max<size_t>(window, 1)) {}
+
+  // Compresses and stores all the chunks. The operations of the chunks that
+  // failed are left without a type.
+  void Run();
 
  private:
-  bool ProcessChunk();
+  struct Slot {
+    brillo::Blob blob;
+    bool done{false};
+    bool success{false};
+  };
+
+  // Compresses the chunk of |aops_[chunk]| into its slot, then stores the
+  // chunks that are ready if no other thread is doing it.
+  void ProcessChunk(size_t chunk);
 
-  // Work parameters.
-  const PayloadVersion& version_;
+  bool CompressChunk(size_t chunk, brillo::Blob* blob);
+
+  // Stores the blobs of the done chunks starting at |next_chunk_to_store_|,
+  // queueing the chunks that enter the window. |lock| must hold |mutex_|.
+  void StoreReadyChunks(std::unique_lock<std::mutex>* lock);
+
+  const PayloadGenerationConfig& config_;
   int fd_;
-  off_t offset_;
-  size_t size_;
   BlobFileWriter* blob_file_;
-  AnnotatedOperation* aop_;
+  vector<AnnotatedOperation>& aops_;
+
+  TaskScheduler::TaskGroup chunk_tasks_;
 
-  DISALLOW_COPY_AND_ASSIGN(ChunkProcessor);
+  // Protects the members below.
+  std::mutex mutex_;
+  // The slot of a chunk is |slots_[chunk % slots_.size()]|.
+  vector<Slot> slots_;
+  size_t next_chunk_to_store_{0};
+  // Whether a thread is running StoreReadyChunks().
+  bool storing_{false};
+
+  DISALLOW_COPY_AND_ASSIGN(OrderedChunkWriter);
 };
 
-void ChunkProcessor::Run() {
-  if (!ProcessChunk()) {
-    LOG(ERROR) << "Error processing region at " << offset_ << " of size "
-               << size_;
+void OrderedChunkWriter::Run() {
+  size_t first_chunks = std::min(slots_.size(), aops_.size());
+  for (size_t chunk = 0; chunk < first_chunks; chunk++) {
+    chunk_tasks_.Add([this, chunk] { ProcessChunk(chunk); });
   }
+  chunk_tasks_.Wait();
 }
 
-bool ChunkProcessor::ProcessChunk() {
-  brillo::Blob buffer_in_(size_);
-  brillo::Blob op_blob;
+void OrderedChunkWriter::ProcessChunk(size_t chunk) {
+  brillo::Blob blob;
+  bool success = CompressChunk(chunk, &blob);
+  if (!success) {
+    LOG(ERROR) << "Error processing " << aops_[chunk].name;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  Slot& slot = slots_[chunk % slots_.size()];
+  slot.blob = std::move(blob);
+  slot.success = success;
+  slot.done = true;
+  if (!storing_) {
+    StoreReadyChunks(&lock);
+  }
+}
+
+bool OrderedChunkWriter::CompressChunk(size_t chunk, brillo::Blob* blob) {
+  AnnotatedOperation& aop = aops_[chunk];
+  const Extent& extent = aop.op.dst_extents(0);
+  PooledBlob pooled_buffer_in(extent.num_blocks() * config_.block_size);
+  brillo::Blob& buffer_in = *pooled_buffer_in;
+  buffer_in.resize(extent.num_blocks() * config_.block_size);
+  off_t offset = static_cast<off_t>(extent.start_block()) * config_.block_size;
   ssize_t bytes_read = -1;
   TEST_AND_RETURN_FALSE(utils::PReadAll(
-      fd_, buffer_in_.data(), buffer_in_.size(), offset_, &bytes_read));
-  TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(size_));
+      fd_, buffer_in.data(), buffer_in.size(), offset, &bytes_read));
+  TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(buffer_in.size()));
 
   InstallOperation::Type op_type;
   TEST_AND_RETURN_FALSE(diff_utils::GenerateBestFullOperation(
-      buffer_in_, version_, &op_blob, &op_type));
-
-  aop_->op.set_type(op_type);
-  TEST_AND_RETURN_FALSE(aop_->SetOperationBlob(op_blob, blob_file_));
+      buffer_in, config_, blob, &op_type));
+  aop.op.set_type(op_type);
   return true;
 }
 
+void OrderedChunkWriter::StoreReadyChunks(std::unique_lock<std::mutex>* lock) {
+  storing_ = true;
+  while (next_chunk_to_store_ < aops_.size()) {
+    size_t chunk = next_chunk_to_store_;
+    Slot& slot = slots_[chunk % slots_.size()];
+    if (!slot.done) {
+      break;
+    }
+    brillo::Blob blob = std::move(slot.blob);
+    bool success = slot.success;
+    slot = Slot();
+
+    // Other threads may finish their chunks while this one writes; they only
+    // fill their slots and leave the storing to this loop.
+    lock->unlock();
+    if (success && !aops_[chunk].SetOperationBlob(blob, blob_file_)) {
+      LOG(ERROR) << "Error storing the blob of " << aops_[chunk].name;
+      aops_[chunk].op.clear_type();
+    }
+    BlobPool::Get()->Release(std::move(blob));
+    // |chunk| left the window, so its slot can take the chunk |window| after.
+    size_t new_chunk = chunk + slots_.size();
+    if (new_chunk < aops_.size()) {
+      chunk_tasks_.Add([this, new_chunk] { ProcessChunk(new_chunk); });
+    }
+    lock->lock();
+    next_chunk_to_store_++;
+  }
+  storing_ = false;
+}
+
 }  // namespace
 
 bool FullUpdateGenerator::GenerateOperations(
@@ -136,23 +210,19 @@ bool FullUpdateGenerator::GenerateOperations(
   TEST_AND_RETURN_FALSE(full_chunk_size % config.block_size == 0);
 
   size_t chunk_blocks = full_chunk_size / config.block_size;
-  size_t max_threads = diff_utils::GetMaxThreads();
+  size_t num_threads = TaskScheduler::Get()->num_threads();
   LOG(INFO) << "Compressing partition " << new_part.name << " from "
             << new_part.path << " splitting in chunks of " << chunk_blocks
             << " blocks (" << config.block_size << " bytes each) using "
-            << max_threads << " threads";
+            << num_threads << " threads";
 
   int in_fd = open(new_part.path.c_str(), O_RDONLY, 0);
   TEST_AND_RETURN_FALSE(in_fd >= 0);
   ScopedFdCloser in_fd_closer(&in_fd);
 
-  // We potentially have all the ChunkProcessors in memory but only
-  // |max_threads| will actually hold a block in memory while we process.
   size_t partition_blocks = new_part.size / config.block_size;
   size_t num_chunks = utils::DivRoundUp(partition_blocks, chunk_blocks);
   aops->resize(num_chunks);
-  vector<ChunkProcessor> chunk_processors;
-  chunk_processors.reserve(num_chunks);
   blob_file->IncTotalBlobs(num_chunks);
 
   for (size_t i = 0; i < num_chunks; ++i) {
@@ -162,37 +232,53 @@ bool FullUpdateGenerator::GenerateOperations(
         std::min(chunk_blocks, partition_blocks - i * chunk_blocks);
 
     // Preset all the static information about the operations. The
-    // ChunkProcessor will set the rest.
+    // OrderedChunkWriter will set the rest.
     AnnotatedOperation* aop = aops->data() + i;
     aop->name = base::StringPrintf(
         "<%s-operation-%" PRIuS ">", new_part.name.c_str(), i);
     Extent* dst_extent = aop->op.add_dst_extents();
     dst_extent->set_start_block(start_block);
     dst_extent->set_num_blocks(num_blocks);
-
-    chunk_processors.emplace_back(
-        config.version,
-        in_fd,
-        static_cast<off_t>(start_block) * config.block_size,
-        num_blocks * config.block_size,
-        blob_file,
-        aop);
   }
 
-  // Thread pool used for worker threads.
-  base::DelegateSimpleThreadPool thread_pool("full-update-generator",
-                                             max_threads);
-  thread_pool.Start();
-  for (ChunkProcessor& processor : chunk_processors)
-    thread_pool.AddWork(&processor);
-  thread_pool.JoinAll();
+  OrderedChunkWriter writer(config,
+                            in_fd,
+                            kChunksInFlightPerThread * num_threads,
+                            blob_file,
+                            aops);
+  writer.Run();
 
   // All the operations must have a type set at this point. Otherwise, a
-  // ChunkProcessor failed to complete.
+  // chunk failed to complete.
   for (const AnnotatedOperation& aop : *aops) {
     if (!aop.op.has_type())
       return false;
   }
+
+  // The chunks of zeros following each other take a single ZERO operation,
+  // which has no data to be limited by the chunk size.
+  size_t num_aops = 0;
+  for (AnnotatedOperation& aop : *aops) {
+    if (num_aops > 0 && aop.op.type() == InstallOperation::ZERO) {
+      InstallOperation& last = (*aops)[num_aops - 1].op;
+      Extent* last_extent = last.mutable_dst_extents(0);
+      if (last.type() == InstallOperation::ZERO &&
+          last_extent->start_block() + last_extent->num_blocks() ==
+              aop.op.dst_extents(0).start_block()) {
+        last_extent->set_num_blocks(last_extent->num_blocks() +
+                                    aop.op.dst_extents(0).num_blocks());
+        continue;
+      }
+    }
+    if (&(*aops)[num_aops] != &aop)
+      (*aops)[num_aops] = std::move(aop);
+    num_aops++;
+  }
+  if (num_aops < aops->size()) {
+    LOG(INFO) << "Merged the chunks of zeros of " << new_part.name << " into "
+              << aops->size() - num_aops << " fewer ZERO operations.";
+    aops->resize(num_aops);
+  }
   return true;
 }
 
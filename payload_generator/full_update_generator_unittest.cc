@@ -16,6 +16,7 @@
 
 #include "update_engine/payload_generator/full_update_generator.h"
 
+#include <algorithm>
 #include <memory>
 #include <string>
 #include <vector>
@@ -24,6 +25,7 @@
 
 #include "update_engine/common/test_utils.h"
 #include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 
 using chromeos_update_engine::test_utils::FillWithData;
@@ -90,6 +92,75 @@ TEST_F(FullUpdateGeneratorTest, RunTest) {
   }
 }
 
+// Test that the blobs are stored in the order of the operations, even when the
+// chunks are compressed out of order.
+TEST_F(FullUpdateGeneratorTest, BlobsStoredInOperationOrder) {
+  config_.hard_chunk_size = 16 * 1024;
+  brillo::Blob new_part(4 * 1024 * 1024);
+  FillWithData(&new_part);
+  new_part_conf.size = new_part.size();
+
+  EXPECT_TRUE(test_utils::WriteFileVector(new_part_conf.path, new_part));
+
+  EXPECT_TRUE(generator_.GenerateOperations(config_,
+                                            new_part_conf,  // this is ignored
+                                            new_part_conf,
+                                            blob_file_writer_.get(),
+                                            &aops));
+  EXPECT_EQ(new_part.size() / config_.hard_chunk_size, aops.size());
+  uint64_t next_offset = 0;
+  for (const AnnotatedOperation& aop : aops) {
+    EXPECT_EQ(next_offset, aop.op.data_offset()) << aop.name;
+    next_offset += aop.op.data_length();
+  }
+  EXPECT_EQ(static_cast<uint64_t>(out_blobs_length_), next_offset);
+}
+
+// Test that the chunks of zeros become ZERO operations when enabled, those
+// following each other merged into one.
+TEST_F(FullUpdateGeneratorTest, ZeroChunksTest) {
+  config_.enable_full_zero = true;
+  const size_t chunk_size = config_.hard_chunk_size;
+  brillo::Blob new_part(8 * chunk_size);
+  FillWithData(&new_part);
+  // Chunks 1, 2 and 3, and 6 are zeros.
+  std::fill(
+      new_part.begin() + chunk_size, new_part.begin() + 4 * chunk_size, 0);
+  std::fill(
+      new_part.begin() + 6 * chunk_size, new_part.begin() + 7 * chunk_size, 0);
+  new_part_conf.size = new_part.size();
+
+  EXPECT_TRUE(test_utils::WriteFileVector(new_part_conf.path, new_part));
+
+  EXPECT_TRUE(generator_.GenerateOperations(config_,
+                                            new_part_conf,  // this is ignored
+                                            new_part_conf,
+                                            blob_file_writer_.get(),
+                                            &aops));
+  const uint64_t chunk_blocks = chunk_size / config_.block_size;
+  ASSERT_EQ(6U, aops.size());
+  EXPECT_EQ(InstallOperation::ZERO, aops[1].op.type());
+  EXPECT_FALSE(aops[1].op.has_data_length());
+  EXPECT_EQ(ExtentForRange(chunk_blocks, 3 * chunk_blocks),
+            aops[1].op.dst_extents(0));
+  EXPECT_NE(InstallOperation::ZERO, aops[2].op.type());
+  EXPECT_EQ(InstallOperation::ZERO, aops[4].op.type());
+  EXPECT_EQ(ExtentForRange(6 * chunk_blocks, chunk_blocks),
+            aops[4].op.dst_extents(0));
+
+  // Full payloads don't have ZERO operations by default.
+  config_.enable_full_zero = false;
+  aops.clear();
+  EXPECT_TRUE(generator_.GenerateOperations(config_,
+                                            new_part_conf,
+                                            new_part_conf,
+                                            blob_file_writer_.get(),
+                                            &aops));
+  EXPECT_EQ(8U, aops.size());
+  for (const AnnotatedOperation& aop : aops)
+    EXPECT_NE(InstallOperation::ZERO, aop.op.type());
+}
+
 // Test that if the chunk size is not a divisor of the image size, it handles
 // correctly the last chunk of the partition.
 TEST_F(FullUpdateGeneratorTest, ChunkSizeTooBig) {
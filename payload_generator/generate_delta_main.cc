@@ -43,9 +43,14 @@
 #include "update_engine/payload_consumer/filesystem_verifier_action.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/diff_cache.h"
+#include "update_engine/payload_generator/generation_profile.h"
+#include "update_engine/payload_generator/mapped_image.h"
+#include "update_engine/payload_generator/payload_estimator.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 #include "update_engine/payload_generator/payload_properties.h"
 #include "update_engine/payload_generator/payload_signer.h"
+#include "update_engine/payload_generator/suffix_array_cache.h"
 #include "update_engine/payload_generator/xz.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -374,6 +379,11 @@ DEFINE_string(metadata_signature_file,
 DEFINE_int32(chunk_size,
              200 * 1024 * 1024,
              "Payload chunk size (-1 for whole files)");
+DEFINE_uint64(large_file_chunk_size,
+              0,
+              "Diff files bigger than this many bytes in chunks of that size "
+              "on separate threads, at a small cost in payload size. 0 to diff "
+              "files whole");
 DEFINE_uint64(rootfs_partition_size,
               chromeos_update_engine::kRootFSPartitionSize,
               "RootFS partition size for the image once installed");
@@ -420,6 +430,12 @@ DEFINE_bool(disable_fec_computation,
 DEFINE_bool(disable_verity_computation,
             false,
             "Disables the verity data computation on device.");
+DEFINE_bool(ship_verity_data,
+            false,
+            "Writes the verity hash tree and FEC data of the target image in "
+            "the payload, for the device not to compute them. Makes the "
+            "payload larger, for devices slower to compute them than to "
+            "download them.");
 DEFINE_string(out_maximum_signature_size_file,
               "",
               "Path to the output maximum signature size given a private key.");
@@ -434,6 +450,52 @@ DEFINE_bool(
 DEFINE_bool(enable_vabc_xor,
             false,
             "Whether to use Virtual AB Compression XOR feature");
+DEFINE_bool(cow_merge_order_layout,
+            false,
+            "Whether to order the operations so that Virtual AB Compression "
+            "XOR data is read sequentially when merging");
+DEFINE_string(operation_order,
+              "destination",
+              "The order of the operations of the delta partitions: "
+              "destination, or source to read the source partitions as "
+              "sequentially as possible on the devices where random reads "
+              "are slow. Can't be used with --cow_merge_order_layout.");
+DEFINE_string(diff_cache_dir,
+              "",
+              "Directory of the diff patches cache, shared between payload "
+              "generations of overlapping images. Disabled if empty.");
+DEFINE_string(reuse_payload,
+              "",
+              "Colon ':' separated paths to payloads generated before from the "
+              "same source build, whose partitions which didn't change since "
+              "are copied instead of generated again. They must have been "
+              "generated with the same options. Also merges the payloads of "
+              "the shards generated with --num_shards.");
+DEFINE_bool(load_images_in_memory,
+            false,
+            "Read each image once into memory, backed by huge pages where "
+            "possible, rather than from the page cache. Keeps the images of "
+            "several generations running on the same host from evicting each "
+            "other from the page cache, at the cost of as much memory as the "
+            "images being diffed.");
+DEFINE_uint64(num_shards,
+              1,
+              "Only generate the partitions of the shard --shard_index out of "
+              "this many, for the payloads of all the shards, generated on "
+              "several hosts, to be merged with --reuse_payload.");
+DEFINE_uint64(shard_index, 0, "The shard to generate, see --num_shards.");
+DEFINE_string(filesystem_cache_dir,
+              "",
+              "Directory of the parsed filesystems cache, shared between "
+              "payload generations from the same images. Disabled if empty.");
+DEFINE_uint64(suffix_array_cache_mb,
+              0,
+              "Memory in MiB for keeping bsdiff suffix arrays of old files "
+              "diffed against several new files. 0 to disable.");
+DEFINE_uint64(parallel_suffix_array_min_mb,
+              64,
+              "Size in MiB of the old files from which bsdiff builds their "
+              "suffix array on all the threads. 0 to disable.");
 DEFINE_string(apex_info_file,
               "",
               "Path to META/apex_info.pb found in target build");
@@ -450,6 +512,68 @@ DEFINE_bool(enable_puffdiff,
             "Whether to enable puffdiff feature. Enabling puffdiff will take "
             "longer but generated OTA will be smaller.");
 
+DEFINE_bool(enable_zstd,
+            false,
+            "Whether to compress the full operations with zstd, which "
+            "decompresses faster than xz. Requires minor version 10 or newer "
+            "on delta payloads, and clients supporting it on full payloads.");
+
+DEFINE_bool(enable_full_zero_ops,
+            false,
+            "Whether to write the chunks of zeros of full payloads as ZERO "
+            "operations, which the clients zero without downloading nor "
+            "decompressing anything. Requires clients supporting it on full "
+            "payloads.");
+
+DEFINE_bool(enable_blake2b_hashes,
+            false,
+            "Whether to hash the data of the payload with BLAKE2b-256, which "
+            "clients without SHA instructions compute faster than SHA-256. "
+            "Requires minor version 13 or newer on delta payloads, and "
+            "clients supporting it on full payloads.");
+
+DEFINE_bool(enable_operations_sections,
+            false,
+            "Whether to store the operations of each partition right before "
+            "its data instead of in the manifest, for the clients to start "
+            "applying the payload before they received all of its "
+            "operations. Requires minor version 14 or newer on delta "
+            "payloads, and clients supporting it on full payloads.");
+
+DEFINE_bool(enable_apply_hints,
+            false,
+            "Whether to add hints to the partitions about the memory their "
+            "operations take, the source blocks they read again and which "
+            "of them may be applied concurrently, for the clients to "
+            "schedule applying them.");
+
+DEFINE_uint64(target_operation_size_kb,
+              0,
+              "Size in KiB the SOURCE_COPY and REPLACE operations of delta "
+              "payloads are split or merged toward, where applying them on "
+              "the device is estimated to cost less. 0 keeps them as "
+              "generated.");
+
+DEFINE_uint64(xz_block_size_kb,
+              0,
+              "Size in KiB of the independent blocks REPLACE_XZ data is split "
+              "in, for clients to decode them on several threads. 0 for a "
+              "single block.");
+
+DEFINE_string(target_device_profile,
+              "bandwidth_limited",
+              "The devices the payload is for, to trade its size against the "
+              "time they take to apply it when picking the diff algorithms: "
+              "bandwidth_limited for the smallest payload, cpu_limited to "
+              "avoid the slower algorithms unless they save a lot, or "
+              "balanced in between.");
+DEFINE_double(incompressible_entropy,
+              7.99,
+              "Entropy in bits per byte, estimated from samples, from which "
+              "the data of full operations is stored uncompressed without "
+              "trying the compressors, up to 8 for random data. 0 to always "
+              "try them.");
+
 DEFINE_bool(
     enable_zucchini,
     true,
@@ -458,12 +582,43 @@ DEFINE_bool(
 DEFINE_string(erofs_compression_param,
               "",
               "Compression parameter passed to mkfs.erofs's -z option. "
-              "Example: lz4 lz4hc,9");
+              "Example: lz4 lz4hc,9 zstd,3. zstd needs an update_engine "
+              "supporting it on the target.");
 
 DEFINE_int64(max_threads,
              0,
              "The maximum number of threads allowed for generating "
              "ota.");
+DEFINE_uint64(max_memory,
+              0,
+              "Memory budget in MiB for diffing operations at once, as "
+              "estimated from their sizes and algorithms. 0 for no limit.");
+
+DEFINE_int32(estimate,
+             0,
+             "Instead of generating the payload, estimate its data size, apply "
+             "cost and COW size by only diffing one chunk of file out of this "
+             "many, and print the estimates. To compare generation options in "
+             "a fraction of the time a generation takes. 0 to generate the "
+             "payload.");
+DEFINE_int32(cow_estimate_sample_interval,
+             1,
+             "Only compress one out of this many chunks of raw blocks when "
+             "estimating the COW size, and extrapolate the others. Faster, "
+             "but less accurate.");
+DEFINE_bool(cow_estimate_with_compression_factor,
+            false,
+            "Estimate the COW size with the VABC compression factor instead "
+            "of the block size, for an estimate closer to the size of the COW "
+            "images written on device.");
+DEFINE_string(profile_out,
+              "",
+              "Path to write the time spent generating the payload to, as a "
+              "JSON object with the time of each phase per partition and of "
+              "the files which took the longest.");
+DEFINE_uint64(profile_top_files,
+              20,
+              "Number of the slowest files listed in --profile_out.");
 
 void RoundDownPartitions(const ImageConfig& config) {
   for (const auto& part : config.partitions) {
@@ -520,6 +675,10 @@ int Main(int argc, char** argv) {
 
   logging::InitLogging(log_settings);
 
+  if (!FLAGS_profile_out.empty()) {
+    GenerationProfile::Get()->Enable();
+  }
+
   // Initialize the Xz compressor.
   XzCompressInit();
 
@@ -615,11 +774,46 @@ int Main(int argc, char** argv) {
   }
 
   payload_config.enable_vabc_xor = FLAGS_enable_vabc_xor;
+  payload_config.cow_merge_order_layout = FLAGS_cow_merge_order_layout;
   payload_config.enable_lz4diff = FLAGS_enable_lz4diff;
   payload_config.enable_zucchini = FLAGS_enable_zucchini;
   payload_config.enable_puffdiff = FLAGS_enable_puffdiff;
+  payload_config.enable_zstd = FLAGS_enable_zstd;
+  payload_config.enable_full_zero = FLAGS_enable_full_zero_ops;
+  if (FLAGS_enable_blake2b_hashes)
+    payload_config.data_hash_algorithm = HashAlgorithm::kBlake2b256;
+  payload_config.operations_sections = FLAGS_enable_operations_sections;
+  payload_config.apply_hints = FLAGS_enable_apply_hints;
+  payload_config.xz_block_size = FLAGS_xz_block_size_kb * 1024;
+  payload_config.target_operation_size = FLAGS_target_operation_size_kb * 1024;
+  payload_config.incompressible_entropy = FLAGS_incompressible_entropy;
 
   payload_config.ParseCompressorTypes(FLAGS_compressor_types);
+  if (!payload_config.ParseTargetDeviceProfile(FLAGS_target_device_profile)) {
+    return 1;
+  }
+  if (!payload_config.ParseOperationOrder(FLAGS_operation_order)) {
+    return 1;
+  }
+  if (!FLAGS_diff_cache_dir.empty()) {
+    payload_config.diff_cache =
+        std::make_shared<DirectoryDiffCache>(FLAGS_diff_cache_dir);
+  }
+  if (!FLAGS_reuse_payload.empty()) {
+    payload_config.reuse_payload_paths = base::SplitString(
+        FLAGS_reuse_payload, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+  }
+  payload_config.num_shards = FLAGS_num_shards;
+  if (FLAGS_load_images_in_memory) {
+    MappedImage::SetCacheMode(MappedImage::Mode::kLoaded);
+  }
+  payload_config.shard_index = FLAGS_shard_index;
+  if (FLAGS_suffix_array_cache_mb > 0) {
+    payload_config.suffix_array_cache = std::make_shared<SuffixArrayCache>(
+        FLAGS_suffix_array_cache_mb * 1024 * 1024);
+  }
+  payload_config.parallel_suffix_array_min_size =
+      FLAGS_parallel_suffix_array_min_mb * 1024 * 1024;
 
   if (!FLAGS_new_partitions.empty()) {
     LOG_IF(FATAL, !FLAGS_new_image.empty() || !FLAGS_new_kernel.empty())
@@ -694,6 +888,7 @@ int Main(int argc, char** argv) {
 
   // Use the default soft_chunk_size defined in the config.
   payload_config.hard_chunk_size = FLAGS_chunk_size;
+  payload_config.large_file_chunk_size = FLAGS_large_file_chunk_size;
   payload_config.block_size = kBlockSize;
 
   // The partition size is never passed to the delta_generator, so we
@@ -723,11 +918,20 @@ int Main(int argc, char** argv) {
   payload_config.rootfs_partition_size = FLAGS_rootfs_partition_size;
 
   if (payload_config.is_delta) {
+    std::shared_ptr<DiffCacheInterface> filesystem_cache;
+    if (!FLAGS_filesystem_cache_dir.empty()) {
+      filesystem_cache =
+          std::make_shared<DirectoryDiffCache>(FLAGS_filesystem_cache_dir);
+    }
     // Avoid opening the filesystem interface for full payloads.
-    for (PartitionConfig& part : payload_config.target.partitions)
+    for (PartitionConfig& part : payload_config.target.partitions) {
+      part.filesystem_cache = filesystem_cache;
       CHECK(part.OpenFilesystem());
-    for (PartitionConfig& part : payload_config.source.partitions)
+    }
+    for (PartitionConfig& part : payload_config.source.partitions) {
+      part.filesystem_cache = filesystem_cache;
       CHECK(part.OpenFilesystem());
+    }
   }
 
   payload_config.version.major = FLAGS_major_version;
@@ -765,6 +969,11 @@ int Main(int argc, char** argv) {
   payload_config.security_patch_level = FLAGS_security_patch_level;
 
   payload_config.max_threads = FLAGS_max_threads;
+  payload_config.max_memory = FLAGS_max_memory * 1024 * 1024;
+  payload_config.cow_estimate_sample_interval =
+      std::max(FLAGS_cow_estimate_sample_interval, 1);
+  payload_config.cow_estimate_with_compression_factor =
+      FLAGS_cow_estimate_with_compression_factor;
 
   if (!FLAGS_partition_timestamps.empty()) {
     CHECK(ParsePerPartitionTimestamps(FLAGS_partition_timestamps,
@@ -786,6 +995,12 @@ int Main(int argc, char** argv) {
         payload_config.target.partitions[i].verity.Clear();
       }
     }
+    if (FLAGS_ship_verity_data) {
+      for (PartitionConfig& part : payload_config.target.partitions) {
+        if (!part.verity.IsEmpty())
+          part.verity.data_in_payload = true;
+      }
+    }
   }
 
   LOG(INFO) << "Generating " << (payload_config.is_delta ? "delta" : "full")
@@ -797,11 +1012,26 @@ int Main(int argc, char** argv) {
     return 1;
   }
 
+  if (FLAGS_estimate > 0) {
+    PayloadEstimate estimate;
+    if (!EstimatePayload(payload_config, FLAGS_estimate, &estimate)) {
+      return 1;
+    }
+    printf("%s", estimate.ToString().c_str());
+    return 0;
+  }
+
   uint64_t metadata_size{};
   if (!GenerateUpdatePayloadFile(
           payload_config, FLAGS_out_file, FLAGS_private_key, &metadata_size)) {
     return 1;
   }
+  if (!FLAGS_profile_out.empty()) {
+    const string profile =
+        GenerationProfile::Get()->ToJson(FLAGS_profile_top_files);
+    CHECK(utils::WriteFile(
+        FLAGS_profile_out.c_str(), profile.data(), profile.size()));
+  }
   if (!FLAGS_out_metadata_size_file.empty()) {
     string metadata_size_string = std::to_string(metadata_size);
     CHECK(utils::WriteFile(FLAGS_out_metadata_size_file.c_str(),
@@ -0,0 +1,217 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/generation_profile.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <base/json/string_escape.h>
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+string PhasesJson(
+    const std::array<base::TimeDelta, kNumGenerationPhases>& phases) {
+  string json = "{";
+  for (size_t i = 0; i < kNumGenerationPhases; i++) {
+    if (phases[i].is_zero()) {
+      continue;
+    }
+    base::StringAppendF(&json,
+                        "%s\"%s\":%.6f",
+                        json.size() == 1 ? "" : ",",
+                        GenerationPhaseName(static_cast<GenerationPhase>(i)),
+                        phases[i].InSecondsF());
+  }
+  return json + "}";
+}
+
+template <typename AlgorithmTimes>
+string AlgorithmsJson(const AlgorithmTimes& algorithms) {
+  string json = "{";
+  for (const auto& [type, time] : algorithms) {
+    base::StringAppendF(&json,
+                        "%s\"%s\":{\"count\":%" PRIu64 ",\"seconds\":%.6f}",
+                        json.size() == 1 ? "" : ",",
+                        InstallOperationTypeName(type),
+                        time.count,
+                        time.total.InSecondsF());
+  }
+  return json + "}";
+}
+
+}  // namespace
+
+const char* GenerationPhaseName(GenerationPhase phase) {
+  switch (phase) {
+    case GenerationPhase::kFilesystemParse:
+      return "filesystem_parse";
+    case GenerationPhase::kGenerateOperations:
+      return "generate_operations";
+    case GenerationPhase::kBlockMapping:
+      return "block_mapping";
+    case GenerationPhase::kDeflatePreprocessing:
+      return "deflate_preprocessing";
+    case GenerationPhase::kFileMatching:
+      return "file_matching";
+    case GenerationPhase::kDiff:
+      return "diff";
+    case GenerationPhase::kMergeSequence:
+      return "merge_sequence";
+    case GenerationPhase::kCowEstimation:
+      return "cow_estimation";
+    case GenerationPhase::kBlobReorder:
+      return "blob_reorder";
+    case GenerationPhase::kSigning:
+      return "signing";
+  }
+  return "unknown";
+}
+
+GenerationProfile* GenerationProfile::Get() {
+  // Never destroyed, like the TaskScheduler whose tasks feed it.
+  static GenerationProfile* profile = new GenerationProfile();
+  return profile;
+}
+
+void GenerationProfile::SetPartitionPath(const string& path,
+                                         const string& partition) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  partition_paths_[path] = partition;
+}
+
+const string& GenerationProfile::PartitionName(const string& image_path) const {
+  const auto it = partition_paths_.find(image_path);
+  return it == partition_paths_.end() ? image_path : it->second;
+}
+
+void GenerationProfile::AddPhase(const string& partition,
+                                 GenerationPhase phase,
+                                 base::TimeDelta duration) {
+  if (!enabled_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  partitions_[partition].phases[static_cast<size_t>(phase)] += duration;
+}
+
+void GenerationProfile::AddDiff(const string& image_path,
+                                const string& file,
+                                InstallOperation::Type algorithm,
+                                base::TimeDelta duration) {
+  if (!enabled_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  const string& partition = PartitionName(image_path);
+  for (AlgorithmTimes* algorithms :
+       {&partitions_[partition].algorithms,
+        &files_[{partition, file}].algorithms}) {
+    auto& time = (*algorithms)[algorithm];
+    time.count++;
+    time.total += duration;
+  }
+}
+
+void GenerationProfile::AddFile(const string& image_path,
+                                const string& file,
+                                uint64_t blocks,
+                                base::TimeDelta duration) {
+  if (!enabled_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto& profile = files_[{PartitionName(image_path), file}];
+  profile.blocks += blocks;
+  profile.total += duration;
+}
+
+string GenerationProfile::ToJson(size_t top_files) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  string partitions;
+  string payload_phases = "{}";
+  for (const auto& [name, partition] : partitions_) {
+    if (name.empty()) {
+      payload_phases = PhasesJson(partition.phases);
+      continue;
+    }
+    base::StringAppendF(&partitions,
+                        "%s{\"name\":%s,\"phases\":%s,\"algorithms\":%s}",
+                        partitions.empty() ? "" : ",",
+                        base::GetQuotedJSONString(name).c_str(),
+                        PhasesJson(partition.phases).c_str(),
+                        AlgorithmsJson(partition.algorithms).c_str());
+  }
+
+  vector<const decltype(files_)::value_type*> files;
+  for (const auto& file : files_) {
+    files.push_back(&file);
+  }
+  top_files = std::min(top_files, files.size());
+  std::partial_sort(files.begin(),
+                    files.begin() + top_files,
+                    files.end(),
+                    [](const auto* a, const auto* b) {
+                      return a->second.total > b->second.total;
+                    });
+  string slowest_files;
+  for (size_t i = 0; i < top_files; i++) {
+    const auto& [key, file] = *files[i];
+    base::StringAppendF(&slowest_files,
+                        "%s{\"partition\":%s,\"file\":%s,\"blocks\":%" PRIu64
+                        ",\"seconds\":%.6f,\"algorithms\":%s}",
+                        slowest_files.empty() ? "" : ",",
+                        base::GetQuotedJSONString(key.first).c_str(),
+                        base::GetQuotedJSONString(key.second).c_str(),
+                        file.blocks,
+                        file.total.InSecondsF(),
+                        AlgorithmsJson(file.algorithms).c_str());
+  }
+  return base::StringPrintf(
+      "{\"payload_phases\":%s,\"partitions\":[%s],\"slowest_files\":[%s]}",
+      payload_phases.c_str(),
+      partitions.c_str(),
+      slowest_files.c_str());
+}
+
+ScopedGenerationPhase::ScopedGenerationPhase(const string& partition,
+                                             GenerationPhase phase)
+    : partition_(partition),
+      phase_(phase),
+      enabled_(GenerationProfile::Get()->enabled()) {
+  if (enabled_) {
+    start_ = base::TimeTicks::Now();
+  }
+}
+
+ScopedGenerationPhase::~ScopedGenerationPhase() {
+  if (enabled_) {
+    GenerationProfile::Get()->AddPhase(
+        partition_, phase_, base::TimeTicks::Now() - start_);
+  }
+}
+
+}  // namespace chromeos_update_engine
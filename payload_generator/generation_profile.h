@@ -0,0 +1,151 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATION_PROFILE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATION_PROFILE_H_
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// The steps of generating a payload timed by GenerationProfile.
+enum class GenerationPhase {
+  // Opening the filesystems of the source and target images.
+  kFilesystemParse,
+  // Generating all the operations of a partition, which includes the next
+  // four phases.
+  kGenerateOperations,
+  // Finding the moved and zero blocks.
+  kBlockMapping,
+  // Locating the deflate streams of the files for puffdiff.
+  kDeflatePreprocessing,
+  // Indexing the old files by content, for the new files without an old file
+  // of the same name.
+  kFileMatching,
+  // Diffing the files, see GenerationProfile::AddDiff().
+  kDiff,
+  kMergeSequence,
+  kCowEstimation,
+  // Writing the data blobs in the order of the operations.
+  kBlobReorder,
+  kSigning,
+};
+constexpr size_t kNumGenerationPhases =
+    static_cast<size_t>(GenerationPhase::kSigning) + 1;
+
+const char* GenerationPhaseName(GenerationPhase phase);
+
+// Where the time generating a payload goes: the time of each phase per
+// partition, of each diff algorithm per file, and of each file. Collects
+// nothing until enabled, and may be fed from any thread.
+class GenerationProfile {
+ public:
+  GenerationProfile() = default;
+
+  // The process wide profile.
+  static GenerationProfile* Get();
+
+  void Enable() { enabled_ = true; }
+  bool enabled() const { return enabled_; }
+
+  // Reports the diffs of the files of the image at |path| under |partition|.
+  void SetPartitionPath(const std::string& path, const std::string& partition);
+
+  // Adds |duration| to |phase| of |partition|, empty for the phases of the
+  // whole payload.
+  void AddPhase(const std::string& partition,
+                GenerationPhase phase,
+                base::TimeDelta duration);
+
+  // Adds the time |algorithm| took to diff a chunk of |file| of the image at
+  // |image_path|.
+  void AddDiff(const std::string& image_path,
+               const std::string& file,
+               InstallOperation::Type algorithm,
+               base::TimeDelta duration);
+
+  // Adds the time generating the operations of |file| of the image at
+  // |image_path| took, |blocks| blocks long.
+  void AddFile(const std::string& image_path,
+               const std::string& file,
+               uint64_t blocks,
+               base::TimeDelta duration);
+
+  // Returns the profile as a JSON object, listing the |top_files| files which
+  // took the longest.
+  std::string ToJson(size_t top_files) const;
+
+ private:
+  struct AlgorithmTime {
+    uint64_t count{0};
+    base::TimeDelta total;
+  };
+  using AlgorithmTimes = std::map<InstallOperation::Type, AlgorithmTime>;
+
+  struct FileProfile {
+    uint64_t blocks{0};
+    base::TimeDelta total;
+    AlgorithmTimes algorithms;
+  };
+
+  struct PartitionProfile {
+    std::array<base::TimeDelta, kNumGenerationPhases> phases{};
+    AlgorithmTimes algorithms;
+  };
+
+  // Called with |mutex_| held.
+  const std::string& PartitionName(const std::string& image_path) const;
+
+  std::atomic<bool> enabled_{false};
+  mutable std::mutex mutex_;
+  std::map<std::string, std::string> partition_paths_;
+  std::map<std::string, PartitionProfile> partitions_;
+  // By partition and file name.
+  std::map<std::pair<std::string, std::string>, FileProfile> files_;
+
+  DISALLOW_COPY_AND_ASSIGN(GenerationProfile);
+};
+
+// Adds the time it is in scope to |phase| of |partition| in the process wide
+// GenerationProfile, if enabled.
+class ScopedGenerationPhase {
+ public:
+  ScopedGenerationPhase(const std::string& partition, GenerationPhase phase);
+  ~ScopedGenerationPhase();
+
+ private:
+  const std::string partition_;
+  const GenerationPhase phase_;
+  const bool enabled_;
+  base::TimeTicks start_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedGenerationPhase);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATION_PROFILE_H_
@@ -0,0 +1,82 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/generation_profile.h"
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+using base::TimeDelta;
+using std::string;
+
+namespace chromeos_update_engine {
+
+class GenerationProfileTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    profile_.Enable();
+    profile_.SetPartitionPath("/tmp/system.img", "system");
+  }
+
+  GenerationProfile profile_;
+};
+
+TEST_F(GenerationProfileTest, DisabledTest) {
+  GenerationProfile profile;
+  profile.AddPhase("system", GenerationPhase::kDiff, TimeDelta::FromSeconds(1));
+  profile.AddFile("/tmp/system.img", "foo", 1, TimeDelta::FromSeconds(1));
+  EXPECT_EQ("{\"payload_phases\":{},\"partitions\":[],\"slowest_files\":[]}",
+            profile.ToJson(10));
+}
+
+TEST_F(GenerationProfileTest, PhasesTest) {
+  profile_.AddPhase("", GenerationPhase::kSigning, TimeDelta::FromSeconds(2));
+  profile_.AddPhase(
+      "system", GenerationPhase::kDiff, TimeDelta::FromSeconds(1));
+  profile_.AddPhase(
+      "system", GenerationPhase::kDiff, TimeDelta::FromSeconds(2));
+  const string json = profile_.ToJson(10);
+  EXPECT_NE(string::npos,
+            json.find("\"payload_phases\":{\"signing\":2.000000}"));
+  EXPECT_NE(string::npos,
+            json.find("{\"name\":\"system\",\"phases\":{\"diff\":3.000000}"));
+}
+
+TEST_F(GenerationProfileTest, SlowestFilesTest) {
+  profile_.AddFile("/tmp/system.img", "fast", 1, TimeDelta::FromSeconds(1));
+  profile_.AddFile("/tmp/system.img", "slow", 2, TimeDelta::FromSeconds(3));
+  profile_.AddFile("/tmp/other.img", "medium", 4, TimeDelta::FromSeconds(2));
+  profile_.AddDiff("/tmp/system.img",
+                   "slow",
+                   InstallOperation::BROTLI_BSDIFF,
+                   TimeDelta::FromSeconds(1));
+  profile_.AddDiff("/tmp/system.img",
+                   "slow",
+                   InstallOperation::BROTLI_BSDIFF,
+                   TimeDelta::FromSeconds(1));
+  EXPECT_EQ(
+      "{\"payload_phases\":{},\"partitions\":[{\"name\":\"system\",\"phases\":"
+      "{},\"algorithms\":{\"BROTLI_BSDIFF\":{\"count\":2,\"seconds\":2.000000}"
+      "}}],\"slowest_files\":[{\"partition\":\"system\",\"file\":\"slow\","
+      "\"blocks\":2,\"seconds\":3.000000,\"algorithms\":{\"BROTLI_BSDIFF\":{"
+      "\"count\":2,\"seconds\":2.000000}}},{\"partition\":\"/tmp/other.img\","
+      "\"file\":\"medium\",\"blocks\":4,\"seconds\":2.000000,\"algorithms\":{}"
+      "}]}",
+      profile_.ToJson(2));
+}
+
+}  // namespace chromeos_update_engine
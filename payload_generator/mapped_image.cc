@@ -0,0 +1,234 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/mapped_image.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The images shared by Get(). Each is mapped by the first thread getting it,
+// which the others wait for, without blocking those getting other images.
+struct SharedImage {
+  std::mutex mutex;
+  std::shared_ptr<const MappedImage> image;
+  // The file |image| was mapped from, to map it again if it was replaced or
+  // written to since.
+  struct stat file_stat {};
+};
+
+bool SameFile(const struct stat& a, const struct stat& b) {
+  return a.st_dev == b.st_dev && a.st_ino == b.st_ino &&
+         a.st_size == b.st_size && a.st_mtim.tv_sec == b.st_mtim.tv_sec &&
+         a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+struct ImageCache {
+  std::mutex mutex;
+  MappedImage::Mode mode{MappedImage::Mode::kFile};
+  std::map<string, std::shared_ptr<SharedImage>> images;
+};
+
+ImageCache* GetImageCache() {
+  static ImageCache* cache = new ImageCache();
+  return cache;
+}
+
+// Reads the |size| bytes of |fd| into a new anonymous mapping. Returns
+// MAP_FAILED on failure.
+void* LoadFile(int fd, size_t size) {
+  void* data = mmap(nullptr,
+                    size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS,
+                    -1,
+                    0);
+  if (data == MAP_FAILED)
+    return MAP_FAILED;
+  // Only a hint, huge pages may not be enabled.
+  madvise(data, size, MADV_HUGEPAGE);
+  posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+  ssize_t bytes_read = 0;
+  if (!utils::PReadAll(fd, data, size, 0, &bytes_read) ||
+      bytes_read != static_cast<ssize_t>(size) ||
+      mprotect(data, size, PROT_READ) != 0) {
+    munmap(data, size);
+    return MAP_FAILED;
+  }
+  // The pages of the file aren't needed anymore, leave the memory to the
+  // other images.
+  posix_fadvise(fd, 0, size, POSIX_FADV_DONTNEED);
+  return data;
+}
+
+}  // namespace
+
+std::unique_ptr<MappedImage> MappedImage::Open(const string& path, Mode mode) {
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return nullptr;
+  }
+  ScopedFdCloser fd_closer(&fd);
+  const off_t size = utils::FileSize(fd);
+  if (size < 0) {
+    LOG(ERROR) << "Failed to get the size of " << path;
+    return nullptr;
+  }
+  if (size == 0) {
+    // mmap() fails on empty files, which have no extents to read anyway.
+    return std::unique_ptr<MappedImage>(new MappedImage(nullptr, 0));
+  }
+  void* data = MAP_FAILED;
+  if (mode == Mode::kLoaded) {
+    data = LoadFile(fd, size);
+  } else {
+    data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  if (data == MAP_FAILED) {
+    PLOG(ERROR) << "Failed to map " << path;
+    return nullptr;
+  }
+  return std::unique_ptr<MappedImage>(
+      new MappedImage(static_cast<const uint8_t*>(data), size));
+}
+
+std::shared_ptr<const MappedImage> MappedImage::Get(const string& path) {
+  ImageCache* cache = GetImageCache();
+  std::shared_ptr<SharedImage> shared_image;
+  Mode mode;
+  {
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    auto& entry = cache->images[path];
+    if (!entry)
+      entry = std::make_shared<SharedImage>();
+    shared_image = entry;
+    mode = cache->mode;
+  }
+  struct stat file_stat {};
+  if (stat(path.c_str(), &file_stat) != 0) {
+    PLOG(ERROR) << "Failed to stat " << path;
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> lock(shared_image->mutex);
+  if (!shared_image->image || !SameFile(file_stat, shared_image->file_stat)) {
+    // Left empty on failure, for the next caller to try again.
+    shared_image->image = Open(path, mode);
+    shared_image->file_stat = file_stat;
+  }
+  return shared_image->image;
+}
+
+void MappedImage::Forget(const string& path) {
+  ImageCache* cache = GetImageCache();
+  std::lock_guard<std::mutex> lock(cache->mutex);
+  cache->images.erase(path);
+}
+
+void MappedImage::SetCacheMode(Mode mode) {
+  ImageCache* cache = GetImageCache();
+  std::lock_guard<std::mutex> lock(cache->mutex);
+  cache->mode = mode;
+}
+
+MappedImage::~MappedImage() {
+  if (data_) {
+    munmap(const_cast<uint8_t*>(data_), size_);
+  }
+}
+
+bool MappedImage::ExtentsInImage(const vector<Extent>& extents,
+                                 size_t block_size) const {
+  const uint64_t num_blocks = size_ / block_size;
+  return std::all_of(
+      extents.begin(), extents.end(), [num_blocks](const Extent& extent) {
+        return extent.start_block() <= num_blocks &&
+               extent.num_blocks() <= num_blocks - extent.start_block();
+      });
+}
+
+bool MappedImage::ReadExtents(const vector<Extent>& extents,
+                              size_t block_size,
+                              brillo::Blob* out_data) const {
+  TEST_AND_RETURN_FALSE(ExtentsInImage(extents, block_size));
+  out_data->resize(utils::BlocksInExtents(extents) * block_size);
+  uint8_t* out = out_data->data();
+  for (const Extent& extent : extents) {
+    const size_t bytes = extent.num_blocks() * block_size;
+    memcpy(out, data_ + extent.start_block() * block_size, bytes);
+    out += bytes;
+  }
+  return true;
+}
+
+bool MappedImage::ExtentsEqual(const vector<Extent>& extents,
+                               const MappedImage& other,
+                               const vector<Extent>& other_extents,
+                               size_t block_size) const {
+  if (!ExtentsInImage(extents, block_size) ||
+      !other.ExtentsInImage(other_extents, block_size) ||
+      utils::BlocksInExtents(extents) !=
+          utils::BlocksInExtents(other_extents)) {
+    return false;
+  }
+  // Walk both lists of extents at once, comparing the longest run of blocks
+  // contiguous in both images each time.
+  auto it = extents.begin();
+  auto other_it = other_extents.begin();
+  uint64_t offset = 0, other_offset = 0;
+  while (it != extents.end() && other_it != other_extents.end()) {
+    const uint64_t blocks = std::min(it->num_blocks() - offset,
+                                     other_it->num_blocks() - other_offset);
+    if (blocks > 0 &&
+        memcmp(data_ + (it->start_block() + offset) * block_size,
+               other.data_ + (other_it->start_block() + other_offset) *
+                                 block_size,
+               blocks * block_size) != 0) {
+      return false;
+    }
+    offset += blocks;
+    other_offset += blocks;
+    if (offset == it->num_blocks()) {
+      ++it;
+      offset = 0;
+    }
+    if (other_offset == other_it->num_blocks()) {
+      ++other_it;
+      other_offset = 0;
+    }
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
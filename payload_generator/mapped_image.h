@@ -0,0 +1,99 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_MAPPED_IMAGE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_MAPPED_IMAGE_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// A read-only mapping of a partition image, to access the blocks of extents
+// from the page cache without a read() per extent, and to compare them
+// without copying.
+//
+// The generator gets the images with Get(), which maps each of them once and
+// shares the mapping between all its users until they are done with the
+// image. On hosts running several generations at once, the images may
+// evict each other from the page cache and be read from disk again and
+// again. They can be loaded in memory instead, which takes as much memory as
+// the images but reads each of them from disk once.
+class MappedImage {
+ public:
+  enum class Mode {
+    // Maps the file, reading its pages from the page cache.
+    kFile,
+    // Reads the whole file once into anonymous memory, backed by huge pages
+    // where possible, and drops it from the page cache.
+    kLoaded,
+  };
+
+  // Maps the file or block device at |path|. Returns nullptr on failure.
+  static std::unique_ptr<MappedImage> Open(const std::string& path,
+                                           Mode mode = Mode::kFile);
+
+  // Returns the image at |path|, mapped in the mode set with SetCacheMode(),
+  // kFile by default. The mapping is shared by all the callers until
+  // Forget(). Returns nullptr on failure. Thread safe.
+  static std::shared_ptr<const MappedImage> Get(const std::string& path);
+
+  // Drops the image at |path| from the images Get() shares. It is unmapped
+  // once the callers holding it are done.
+  static void Forget(const std::string& path);
+
+  static void SetCacheMode(Mode mode);
+
+  ~MappedImage();
+
+  size_t size() const { return size_; }
+  const uint8_t* data() const { return data_; }
+
+  // Copies the data of |extents| into |out_data|. Returns false if any of the
+  // extents is beyond the end of the image.
+  bool ReadExtents(const std::vector<Extent>& extents,
+                   size_t block_size,
+                   brillo::Blob* out_data) const;
+
+  // Returns whether |extents| of this image hold the same bytes as
+  // |other_extents| of |other|.
+  bool ExtentsEqual(const std::vector<Extent>& extents,
+                    const MappedImage& other,
+                    const std::vector<Extent>& other_extents,
+                    size_t block_size) const;
+
+ private:
+  MappedImage(const uint8_t* data, size_t size) : data_(data), size_(size) {}
+
+  // Returns whether |extents| are within the image.
+  bool ExtentsInImage(const std::vector<Extent>& extents,
+                      size_t block_size) const;
+
+  const uint8_t* const data_;
+  const size_t size_;
+
+  DISALLOW_COPY_AND_ASSIGN(MappedImage);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_MAPPED_IMAGE_H_
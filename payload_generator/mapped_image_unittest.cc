@@ -0,0 +1,156 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/mapped_image.h"
+
+#include <string.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr size_t kTestBlockSize = 16;
+
+}  // namespace
+
+class MappedImageTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Block i is filled with the byte i.
+    brillo::Blob data;
+    for (uint8_t block = 0; block < 8; block++) {
+      data.insert(data.end(), kTestBlockSize, block);
+    }
+    ASSERT_TRUE(test_utils::WriteFileVector(image_file_.path(), data));
+    image_ = MappedImage::Open(image_file_.path());
+    ASSERT_NE(nullptr, image_);
+  }
+
+  ScopedTempFile image_file_{"MappedImageTest.XXXXXX"};
+  std::unique_ptr<MappedImage> image_;
+};
+
+TEST_F(MappedImageTest, ReadExtents) {
+  EXPECT_EQ(8 * kTestBlockSize, image_->size());
+  brillo::Blob data;
+  ASSERT_TRUE(image_->ReadExtents(
+      {ExtentForRange(5, 1), ExtentForRange(1, 2)}, kTestBlockSize, &data));
+  brillo::Blob expected(kTestBlockSize, 5);
+  expected.insert(expected.end(), kTestBlockSize, 1);
+  expected.insert(expected.end(), kTestBlockSize, 2);
+  EXPECT_EQ(expected, data);
+
+  EXPECT_FALSE(
+      image_->ReadExtents({ExtentForRange(7, 2)}, kTestBlockSize, &data));
+  EXPECT_FALSE(
+      image_->ReadExtents({ExtentForRange(9, 1)}, kTestBlockSize, &data));
+}
+
+TEST_F(MappedImageTest, ExtentsEqual) {
+  // The same blocks, split differently in both lists.
+  EXPECT_TRUE(image_->ExtentsEqual({ExtentForRange(1, 3)},
+                                   *image_,
+                                   {ExtentForRange(1, 1), ExtentForRange(2, 2)},
+                                   kTestBlockSize));
+  EXPECT_TRUE(image_->ExtentsEqual({ExtentForRange(1, 2), ExtentForRange(6, 1)},
+                                   *image_,
+                                   {ExtentForRange(1, 1),
+                                    ExtentForRange(2, 1),
+                                    ExtentForRange(6, 1)},
+                                   kTestBlockSize));
+  EXPECT_FALSE(image_->ExtentsEqual(
+      {ExtentForRange(1, 2)}, *image_, {ExtentForRange(2, 2)}, kTestBlockSize));
+  // Different number of blocks.
+  EXPECT_FALSE(image_->ExtentsEqual(
+      {ExtentForRange(1, 2)}, *image_, {ExtentForRange(1, 3)}, kTestBlockSize));
+  // Out of the image.
+  EXPECT_FALSE(image_->ExtentsEqual(
+      {ExtentForRange(7, 2)}, *image_, {ExtentForRange(7, 2)}, kTestBlockSize));
+}
+
+TEST_F(MappedImageTest, ExtentsEqualAcrossImages) {
+  ScopedTempFile other_file("MappedImageTest_other.XXXXXX");
+  brillo::Blob data(kTestBlockSize, 3);
+  data.insert(data.end(), kTestBlockSize, 4);
+  ASSERT_TRUE(test_utils::WriteFileVector(other_file.path(), data));
+  auto other = MappedImage::Open(other_file.path());
+  ASSERT_NE(nullptr, other);
+
+  EXPECT_TRUE(image_->ExtentsEqual(
+      {ExtentForRange(3, 2)}, *other, {ExtentForRange(0, 2)}, kTestBlockSize));
+  EXPECT_FALSE(image_->ExtentsEqual(
+      {ExtentForRange(4, 1), ExtentForRange(3, 1)},
+      *other,
+      {ExtentForRange(0, 2)},
+      kTestBlockSize));
+}
+
+TEST_F(MappedImageTest, EmptyAndMissingFiles) {
+  ScopedTempFile empty_file("MappedImageTest_empty.XXXXXX");
+  auto empty = MappedImage::Open(empty_file.path());
+  ASSERT_NE(nullptr, empty);
+  EXPECT_EQ(0u, empty->size());
+  brillo::Blob data;
+  EXPECT_FALSE(
+      empty->ReadExtents({ExtentForRange(0, 1)}, kTestBlockSize, &data));
+
+  EXPECT_EQ(nullptr, MappedImage::Open("/non/existent/image"));
+  EXPECT_EQ(nullptr, MappedImage::Get("/non/existent/image"));
+}
+
+TEST_F(MappedImageTest, LoadedImage) {
+  auto loaded =
+      MappedImage::Open(image_file_.path(), MappedImage::Mode::kLoaded);
+  ASSERT_NE(nullptr, loaded);
+  ASSERT_EQ(image_->size(), loaded->size());
+  EXPECT_EQ(0, memcmp(image_->data(), loaded->data(), image_->size()));
+}
+
+TEST_F(MappedImageTest, SharedImage) {
+  auto shared = MappedImage::Get(image_file_.path());
+  ASSERT_NE(nullptr, shared);
+  EXPECT_EQ(shared, MappedImage::Get(image_file_.path()));
+
+  MappedImage::Forget(image_file_.path());
+  auto other = MappedImage::Get(image_file_.path());
+  ASSERT_NE(nullptr, other);
+  EXPECT_NE(shared, other);
+  MappedImage::Forget(image_file_.path());
+}
+
+TEST_F(MappedImageTest, SharedImageMappedAgainWhenReplaced) {
+  auto shared = MappedImage::Get(image_file_.path());
+  ASSERT_NE(nullptr, shared);
+  ASSERT_TRUE(test_utils::WriteFileVector(image_file_.path(),
+                                          brillo::Blob(kTestBlockSize, 9)));
+  auto replaced = MappedImage::Get(image_file_.path());
+  ASSERT_NE(nullptr, replaced);
+  EXPECT_EQ(kTestBlockSize, replaced->size());
+  EXPECT_EQ(9, replaced->data()[0]);
+  MappedImage::Forget(image_file_.path());
+}
+
+}  // namespace chromeos_update_engine
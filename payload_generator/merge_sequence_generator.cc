@@ -196,103 +196,139 @@ std::unique_ptr<MergeSequenceGenerator> MergeSequenceGenerator::Create(
       new MergeSequenceGenerator(sequence, partition_name));
 }
 
-template <typename T>
-CowMergeOperation MaxOutDegree(
-    const T& nodes,
+// Returns the strongly connected components of more than one node of the
+// graph made of the nodes in |incoming_edges| and the edges of |merge_after|
+// between them. These hold every cycle left in the graph; the other nodes are
+// only blocked by them.
+std::vector<std::vector<CowMergeOperation>> FindCycles(
+    const std::map<CowMergeOperation, int>& incoming_edges,
     const std::map<CowMergeOperation, std::set<CowMergeOperation>>&
         merge_after) {
-  // Rationale for this algorithm:
-  // We only need to remove nodes from the graph if the graph contains a cycle.
-  // Any graph of N nodes has cycle iff number of edges >= N.
-  // So, to restore the graph back to an acyclic state, we need to keep removing
-  // edges until we have <N edges left. To minimize the number of nodes removed,
-  // we always remove the node with maximum out degree.
-  CowMergeOperation best;
-  size_t max_out_degree = 0;
-  const auto has_xor =
-      std::any_of(nodes.begin(),
-                  nodes.end(),
-                  [&merge_after](const CowMergeOperation& node) {
-                    if (node.type() != CowMergeOperation::COW_XOR) {
-                      return false;
-                    }
-                    auto it = merge_after.find(node);
-                    if (it == merge_after.end()) {
-                      return false;
-                    }
-                    return it->second.size() > 0;
-                  });
-  for (const auto& op : nodes) {
-    if (has_xor && op.type() != CowMergeOperation::COW_XOR) {
-      continue;
-    }
-    const auto out_degree = merge_after.at(op).size();
-    if (out_degree > max_out_degree) {
-      best = op;
-      max_out_degree = out_degree;
-    } else if (out_degree == max_out_degree) {
-      if (op.src_extent().num_blocks() < best.src_extent().num_blocks()) {
-        best = op;
+  std::vector<CowMergeOperation> nodes;
+  std::map<CowMergeOperation, size_t> node_index;
+  for (const auto& [node, count] : incoming_edges) {
+    node_index.emplace_hint(node_index.end(), node, nodes.size());
+    nodes.push_back(node);
+  }
+  std::vector<std::vector<size_t>> edges(nodes.size());
+  for (size_t i = 0; i < nodes.size(); i++) {
+    for (const auto& blocked : merge_after.at(nodes[i])) {
+      auto it = node_index.find(blocked);
+      if (it != node_index.end()) {
+        edges[i].push_back(it->second);
       }
     }
   }
-  CHECK_NE(max_out_degree, 0UL);
-  return best;
-}
 
-template <typename T>
-struct MapKeyIterator {
-  MapKeyIterator<T>& operator++() {
-    ++it;
-    return *this;
-  }
-  MapKeyIterator<T>& operator--() {
-    --it;
-    return *this;
-  }
-  bool operator==(const MapKeyIterator<T>& rhs) const { return it == rhs.it; }
-  bool operator!=(const MapKeyIterator<T>& rhs) const { return it != rhs.it; }
-  auto&& operator->() const { return it->first; }
-  auto&& operator*() const { return it->first; }
-  T it;
-};
-
-template <typename T, typename U>
-struct MapKeyRange {
-  auto begin() const {
-    return MapKeyIterator<typename std::map<T, U>::const_iterator>{map.begin()};
-  }
-  auto end() const {
-    return MapKeyIterator<typename std::map<T, U>::const_iterator>{map.end()};
+  // Tarjan's algorithm, without recursion since the graph of a partition can
+  // have hundreds of thousands of nodes.
+  constexpr size_t kUnvisited = std::numeric_limits<size_t>::max();
+  std::vector<size_t> order(nodes.size(), kUnvisited);
+  std::vector<size_t> low_link(nodes.size());
+  std::vector<bool> on_stack(nodes.size(), false);
+  std::vector<size_t> stack;
+  // The node being visited and the next of its edges to follow.
+  std::vector<std::pair<size_t, size_t>> frames;
+  size_t next_order = 0;
+  std::vector<std::vector<CowMergeOperation>> cycles;
+  auto visit = [&](size_t node) {
+    order[node] = low_link[node] = next_order++;
+    stack.push_back(node);
+    on_stack[node] = true;
+    frames.emplace_back(node, 0);
+  };
+  for (size_t root = 0; root < nodes.size(); root++) {
+    if (order[root] != kUnvisited) {
+      continue;
+    }
+    visit(root);
+    while (!frames.empty()) {
+      const size_t node = frames.back().first;
+      const size_t edge = frames.back().second++;
+      if (edge < edges[node].size()) {
+        const size_t next = edges[node][edge];
+        if (order[next] == kUnvisited) {
+          visit(next);
+        } else if (on_stack[next]) {
+          low_link[node] = std::min(low_link[node], order[next]);
+        }
+        continue;
+      }
+      frames.pop_back();
+      if (!frames.empty()) {
+        const size_t parent = frames.back().first;
+        low_link[parent] = std::min(low_link[parent], low_link[node]);
+      }
+      if (low_link[node] != order[node]) {
+        continue;
+      }
+      std::vector<CowMergeOperation> component;
+      size_t member;
+      do {
+        member = stack.back();
+        stack.pop_back();
+        on_stack[member] = false;
+        component.push_back(nodes[member]);
+      } while (member != node);
+      if (component.size() > 1) {
+        std::sort(component.begin(), component.end());
+        cycles.push_back(std::move(component));
+      }
+    }
   }
-  std::map<T, U> map;
-};
-
-CowMergeOperation MaxOutDegree(
-    const std::map<CowMergeOperation, int>& incoming_edges,
-    const std::map<CowMergeOperation, std::set<CowMergeOperation>>&
-        merge_after) {
-  return MaxOutDegree(MapKeyRange<CowMergeOperation, int>{incoming_edges},
-                      merge_after);
+  return cycles;
 }
 
-// Given a potentially cyclic graph, return a node to remove to break cycles
-// |incoming_edges| stores nodes' in degree, and |merge_after| is an outgoing
-// edge list. For example, |merge_after[a]| returns all nodes which `a` has an
-// out going edge to.
-// The only requirement of this function is to return a node which is in
-// |incoming_edges| . As long as this is satisfied, merge sequence generation
-// will work. Caller will keep removing nodes returned by this function until
-// the graph has no cycles. However, the choice of which node to remove can
-// greatly impact COW sizes. Nodes removed from the graph will be converted to a
-// COW_REPLACE operation, taking more disk space. So this function should try to
-// pick a node which minimizes number of nodes we have to remove. (Modulo the
-// weight of each node, which is how many blocks a CowMergeOperation touches)
+// Given a strongly connected component |cycle| of the graph, return a node of
+// it to remove to break cycles. |merge_after| is an outgoing edge list. For
+// example, |merge_after[a]| returns all nodes which `a` has an out going edge
+// to.
+// Nodes removed from the graph will be converted to a COW_REPLACE operation,
+// taking more disk space, so this picks the node which removes the most edges
+// of the component per block converted. Since XOR operations don't save as much
+// space as COW_COPY ones do, they are converted first.
 CowMergeOperation PickConvertToRaw(
-    const std::map<CowMergeOperation, int>& incoming_edges,
+    const std::vector<CowMergeOperation>& cycle,
     const std::map<CowMergeOperation, std::set<CowMergeOperation>>&
         merge_after) {
-  return MaxOutDegree(incoming_edges, merge_after);
+  const std::set<CowMergeOperation> members(cycle.begin(), cycle.end());
+  std::map<CowMergeOperation, size_t> degree;
+  for (const auto& node : cycle) {
+    for (const auto& blocked : merge_after.at(node)) {
+      if (members.count(blocked)) {
+        degree[node]++;
+        degree[blocked]++;
+      }
+    }
+  }
+  const auto has_xor =
+      std::any_of(cycle.begin(), cycle.end(), [](const auto& node) {
+        return node.type() == CowMergeOperation::COW_XOR;
+      });
+
+  const CowMergeOperation* best = nullptr;
+  for (const auto& node : cycle) {
+    if (has_xor && node.type() != CowMergeOperation::COW_XOR) {
+      continue;
+    }
+    if (best == nullptr) {
+      best = &node;
+      continue;
+    }
+    // Compare degree(node) / blocks(node) with degree(best) / blocks(best).
+    const uint64_t node_score =
+        degree[node] * best->dst_extent().num_blocks();
+    const uint64_t best_score =
+        degree[*best] * node.dst_extent().num_blocks();
+    if (node_score > best_score ||
+        (node_score == best_score &&
+         node.dst_extent().num_blocks() < best->dst_extent().num_blocks())) {
+      best = &node;
+    }
+  }
+  CHECK(best != nullptr);
+  CHECK_GT(degree[*best], 0UL);
+  return *best;
 }
 
 std::map<CowMergeOperation, std::set<CowMergeOperation>>
@@ -300,46 +336,52 @@ MergeSequenceGenerator::FindDependency(
     const std::vector<CowMergeOperation>& operations) {
   LOG(INFO) << "Finding dependencies";
 
-  // Since the OTA operation may reuse some source blocks, use the binary
-  // search on sorted dst extents to find overlaps.
-  std::map<CowMergeOperation, std::set<CowMergeOperation>> merge_after;
+  // Index the dst extents once. They don't overlap and |operations| is sorted
+  // by dst start block, so both their start and end blocks are sorted, and the
+  // operations a src extent depends on are found with two binary searches.
+  // Since the OTA operation may reuse some source blocks, multiple src extents
+  // may find the same dst extents.
+  std::vector<uint64_t> dst_starts;
+  std::vector<uint64_t> dst_ends;
+  dst_starts.reserve(operations.size());
+  dst_ends.reserve(operations.size());
   for (const auto& op : operations) {
-    // lower bound (inclusive): dst extent's end block >= src extent's start
-    // block.
-    const auto lower_it = std::lower_bound(
-        operations.begin(),
-        operations.end(),
-        op,
-        [](const CowMergeOperation& it, const CowMergeOperation& op) {
-          auto dst_end_block =
-              it.dst_extent().start_block() + it.dst_extent().num_blocks() - 1;
-          return dst_end_block < op.src_extent().start_block();
-        });
-    // upper bound: dst extent's start block > src extent's end block
-    const auto upper_it = std::upper_bound(
-        lower_it,
-        operations.end(),
-        op,
-        [](const CowMergeOperation& op, const CowMergeOperation& it) {
-          auto src_end_block =
-              op.src_extent().start_block() + op.src_extent().num_blocks() - 1;
-          return src_end_block < it.dst_extent().start_block();
-        });
+    dst_starts.push_back(op.dst_extent().start_block());
+    dst_ends.push_back(op.dst_extent().start_block() +
+                       op.dst_extent().num_blocks());
+  }
 
-    // TODO(xunchang) skip inserting the empty set to merge_after.
-    if (lower_it == upper_it) {
-      merge_after.insert({op, {}});
-    } else {
-      std::set<CowMergeOperation> operations(lower_it, upper_it);
-      auto it = operations.find(op);
-      if (it != operations.end()) {
+  std::map<CowMergeOperation, std::set<CowMergeOperation>> merge_after;
+  for (size_t i = 0; i < operations.size(); i++) {
+    const auto& op = operations[i];
+    const uint64_t src_start = op.src_extent().start_block();
+    const uint64_t src_end = src_start + op.src_extent().num_blocks();
+    // lower bound (inclusive): dst extent's end > src extent's start block.
+    const size_t lower =
+        std::upper_bound(dst_ends.begin(), dst_ends.end(), src_start) -
+        dst_ends.begin();
+    // upper bound: dst extent's start block >= src extent's end.
+    const size_t upper =
+        std::lower_bound(
+            dst_starts.begin() + lower, dst_starts.end(), src_end) -
+        dst_starts.begin();
+
+    // The dependencies are in sorted order, so they and the operations are
+    // inserted at the end of their containers in constant time.
+    std::set<CowMergeOperation> blocked;
+    for (size_t j = lower; j < upper; j++) {
+      if (j == i) {
         LOG(INFO) << "Self overlapping " << op;
-        operations.erase(it);
+        continue;
       }
-      auto ret = merge_after.emplace(op, std::move(operations));
-      // Check the insertion indeed happens.
-      CHECK(ret.second) << op;
+      blocked.emplace_hint(blocked.end(), operations[j]);
     }
+    // TODO(xunchang) skip inserting the empty set to merge_after.
+    const bool has_dependency = lower != upper;
+    const size_t size = merge_after.size();
+    merge_after.emplace_hint(merge_after.end(), op, std::move(blocked));
+    // Check the insertion indeed happens.
+    CHECK(!has_dependency || merge_after.size() == size + 1) << op;
   }
 
   return merge_after;
@@ -381,14 +423,21 @@ bool MergeSequenceGenerator::Generate(
       merge_sequence.insert(
           merge_sequence.end(), free_operations.begin(), free_operations.end());
     } else {
-      auto to_convert = PickConvertToRaw(incoming_edges, merge_after_);
-      // The operation we pick must be one of the nodes not already in merge
-      // sequence.
-      CHECK(incoming_edges.find(to_convert) != incoming_edges.end());
-
-      free_operations.insert(to_convert);
-      convert_to_raw.insert(to_convert);
-      LOG(INFO) << "Converting operation to raw " << to_convert;
+      // Every operation left is either in a cycle or blocked by one. Break
+      // each cycle by converting one of its operations to raw; the others
+      // merge once the operations they wait for do.
+      const auto cycles = FindCycles(incoming_edges, merge_after_);
+      CHECK(!cycles.empty());
+      for (const auto& cycle : cycles) {
+        auto to_convert = PickConvertToRaw(cycle, merge_after_);
+        // The operation we pick must be one of the nodes not already in merge
+        // sequence.
+        CHECK(incoming_edges.find(to_convert) != incoming_edges.end());
+
+        free_operations.insert(to_convert);
+        convert_to_raw.insert(to_convert);
+        LOG(INFO) << "Converting operation to raw " << to_convert;
+      }
     }
 
     std::set<CowMergeOperation> next_free_operations;
@@ -454,6 +503,50 @@ bool MergeSequenceGenerator::Generate(
   return true;
 }
 
+void SortOperationsByMergeSequence(
+    const std::vector<CowMergeOperation>& sequence,
+    std::vector<AnnotatedOperation>* aops) {
+  // Each dst block of the sequence belongs to one merge operation. Map the
+  // start block of each to its position and end block.
+  std::map<uint64_t, std::pair<uint64_t, size_t>> merge_positions;
+  for (size_t i = 0; i < sequence.size(); i++) {
+    const auto& dst = sequence[i].dst_extent();
+    merge_positions.emplace(
+        dst.start_block(),
+        std::make_pair(dst.start_block() + dst.num_blocks(), i));
+  }
+  constexpr size_t kNotMerged = std::numeric_limits<size_t>::max();
+  auto merge_position = [&merge_positions](const AnnotatedOperation& aop) {
+    size_t position = kNotMerged;
+    for (const auto& xor_op : aop.xor_ops) {
+      const uint64_t block = xor_op.dst_extent().start_block();
+      auto it = merge_positions.upper_bound(block);
+      if (it == merge_positions.begin()) {
+        continue;
+      }
+      --it;
+      if (block < it->second.first) {
+        position = std::min(position, it->second.second);
+      }
+    }
+    return position;
+  };
+
+  std::vector<std::pair<size_t, AnnotatedOperation>> positioned;
+  positioned.reserve(aops->size());
+  for (auto& aop : *aops) {
+    const size_t position = merge_position(aop);
+    positioned.emplace_back(position, std::move(aop));
+  }
+  std::stable_sort(
+      positioned.begin(),
+      positioned.end(),
+      [](const auto& a, const auto& b) { return a.first < b.first; });
+  for (size_t i = 0; i < positioned.size(); i++) {
+    (*aops)[i] = std::move(positioned[i].second);
+  }
+}
+
 bool MergeSequenceGenerator::ValidateSequence(
     const std::vector<CowMergeOperation>& sequence) {
   LOG(INFO) << "Validating merge sequence";
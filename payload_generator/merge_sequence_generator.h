@@ -91,6 +91,14 @@ class MergeSequenceGenerator {
   const std::string_view partition_name_;
 };
 
+// Stable sorts |aops| so that the operations writing COW_XOR data come first,
+// in the order |sequence| merges them, followed by the others. VABC devices
+// write the COW data of operations in payload order, so this lays out the XOR
+// data in the order snapuserd reads it back when merging.
+void SortOperationsByMergeSequence(
+    const std::vector<CowMergeOperation>& sequence,
+    std::vector<AnnotatedOperation>* aops);
+
 void SplitSelfOverlapping(const Extent& src_extent,
                           const Extent& dst_extent,
                           std::vector<CowMergeOperation>* sequence);
@@ -153,6 +153,29 @@ TEST_F(MergeSequenceGeneratorTest, FindDependency_ReusedSourceBlocks) {
             merge_after.at(transfers[1]));
 }
 
+TEST_F(MergeSequenceGeneratorTest, FindDependencyManyOperations) {
+  // Each operation copies the 2 blocks following the next one's dst extent,
+  // so it depends on the next two operations.
+  constexpr uint64_t kNumOperations = 100000;
+  std::vector<CowMergeOperation> transfers;
+  transfers.reserve(kNumOperations);
+  for (uint64_t i = 0; i < kNumOperations; i++) {
+    transfers.push_back(CreateCowMergeOperation(ExtentForRange(i * 2 + 3, 2),
+                                                ExtentForRange(i * 2, 2)));
+  }
+
+  std::map<CowMergeOperation, std::set<CowMergeOperation>> merge_after;
+  FindDependency(transfers, &merge_after);
+  ASSERT_EQ(kNumOperations, merge_after.size());
+  for (uint64_t i = 0; i < kNumOperations; i++) {
+    std::set<CowMergeOperation> expected;
+    for (uint64_t j = i + 1; j < std::min(i + 3, kNumOperations); j++) {
+      expected.insert(transfers[j]);
+    }
+    ASSERT_EQ(expected, merge_after.at(transfers[i])) << i;
+  }
+}
+
 TEST_F(MergeSequenceGeneratorTest, ValidateSequence) {
   std::vector<CowMergeOperation> transfers = {
       CreateCowMergeOperation(ExtentForRange(10, 10), ExtentForRange(15, 10)),
@@ -206,6 +229,27 @@ TEST_F(MergeSequenceGeneratorTest, GenerateSequenceMultipleCycles) {
   GenerateSequence(transfers);
 }
 
+TEST_F(MergeSequenceGeneratorTest, GenerateSequenceBreaksCyclesOnly) {
+  std::vector<CowMergeOperation> transfers = {
+      // cycle, breaking it on the 2 blocks op is cheapest
+      CreateCowMergeOperation(ExtentForRange(10, 4), ExtentForRange(20, 4)),
+      CreateCowMergeOperation(ExtentForRange(20, 2), ExtentForRange(10, 2)),
+      // blocked by the cycle, and blocking more operations than any of it
+      CreateCowMergeOperation(ExtentForRange(40, 3), ExtentForRange(12, 3)),
+      CreateCowMergeOperation(ExtentForRange(100, 1), ExtentForRange(40, 1)),
+      CreateCowMergeOperation(ExtentForRange(101, 1), ExtentForRange(41, 1)),
+      CreateCowMergeOperation(ExtentForRange(102, 1), ExtentForRange(42, 1)),
+  };
+  std::sort(transfers.begin(), transfers.end());
+  MergeSequenceGenerator generator(transfers, "");
+  std::vector<CowMergeOperation> sequence;
+  ASSERT_TRUE(generator.Generate(&sequence));
+  ASSERT_EQ(transfers.size() - 1, sequence.size());
+  for (const auto& op : sequence) {
+    ASSERT_FALSE(op.dst_extent() == ExtentForRange(10, 2)) << op;
+  }
+}
+
 void ValidateSplitSequence(const Extent& src_extent, const Extent& dst_extent) {
   std::vector<CowMergeOperation> sequence;
   SplitSelfOverlapping(src_extent, dst_extent, &sequence);
@@ -412,6 +456,45 @@ TEST_F(MergeSequenceGeneratorTest, CreateGeneratorXorAlreadyPlusOne) {
   ASSERT_TRUE(generator->ValidateSequence(sequence));
 }
 
+TEST_F(MergeSequenceGeneratorTest, SortOperationsByMergeSequence) {
+  std::vector<AnnotatedOperation> aops(4);
+  aops[0].name = "replace";
+  aops[0].op.set_type(InstallOperation::REPLACE);
+  *aops[0].op.add_dst_extents() = ExtentForRange(0, 10);
+  aops[1].name = "xor_late";
+  aops[1].op.set_type(InstallOperation::SOURCE_BSDIFF);
+  *aops[1].op.add_dst_extents() = ExtentForRange(10, 10);
+  aops[1].xor_ops.push_back(
+      CreateCowMergeOperation(ExtentForRange(50, 10),
+                              ExtentForRange(10, 10),
+                              CowMergeOperation::COW_XOR));
+  aops[2].name = "copy";
+  aops[2].op.set_type(InstallOperation::SOURCE_COPY);
+  *aops[2].op.add_dst_extents() = ExtentForRange(20, 10);
+  aops[3].name = "xor_early";
+  aops[3].op.set_type(InstallOperation::SOURCE_BSDIFF);
+  *aops[3].op.add_dst_extents() = ExtentForRange(30, 10);
+  aops[3].xor_ops.push_back(
+      CreateCowMergeOperation(ExtentForRange(60, 5),
+                              ExtentForRange(32, 5),
+                              CowMergeOperation::COW_XOR));
+
+  const std::vector<CowMergeOperation> sequence = {
+      CreateCowMergeOperation(ExtentForRange(70, 10), ExtentForRange(20, 10)),
+      CreateCowMergeOperation(ExtentForRange(60, 5),
+                              ExtentForRange(32, 5),
+                              CowMergeOperation::COW_XOR),
+      CreateCowMergeOperation(ExtentForRange(50, 10),
+                              ExtentForRange(10, 10),
+                              CowMergeOperation::COW_XOR),
+  };
+  SortOperationsByMergeSequence(sequence, &aops);
+  ASSERT_EQ("xor_early", aops[0].name);
+  ASSERT_EQ("xor_late", aops[1].name);
+  ASSERT_EQ("replace", aops[2].name);
+  ASSERT_EQ("copy", aops[3].name);
+}
+
 TEST_F(MergeSequenceGeneratorTest, ActualPayloadTest) {
   auto payload_path =
       GetBuildArtifactsPath("testdata/cycle_nodes_product_no_xor.bin");
@@ -430,6 +513,17 @@ TEST_F(MergeSequenceGeneratorTest, ActualPayloadTest) {
   MergeSequenceGenerator generator(ops, part.partition_name());
   std::vector<CowMergeOperation> sequence;
   ASSERT_TRUE(generator.Generate(&sequence));
+
+  uint64_t total_blocks = 0;
+  for (const auto& op : generator.GetOperations()) {
+    total_blocks += op.dst_extent().num_blocks();
+  }
+  uint64_t merged_blocks = 0;
+  for (const auto& op : sequence) {
+    merged_blocks += op.dst_extent().num_blocks();
+  }
+  LOG(INFO) << "Converted " << total_blocks - merged_blocks << " out of "
+            << total_blocks << " blocks to raw";
 }
 
 }  // namespace chromeos_update_engine
@@ -0,0 +1,339 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/parallel_suffix_array.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <utility>
+
+#include <base/logging.h>
+#include <bsdiff/bsdiff.h>
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The keys of the first round: the first byte of the suffix and the second
+// one plus one, zero for a suffix of a single byte, which sorts first.
+constexpr size_t kNumFirstKeys = 256 * 257;
+
+// Groups are sorted together in batches of at least this many suffixes, and
+// those of at least kParallelSortMinSize on several threads.
+constexpr size_t kMinBatchSize = 64 * 1024;
+constexpr size_t kParallelSortMinSize = 1024 * 1024;
+
+// The suffixes at positions [start, end) of the suffix array, which share a
+// prefix not telling them apart yet.
+struct Group {
+  uint32_t start;
+  uint32_t end;
+};
+
+// Groups sorted by the same task. The entries of the groups, one after the
+// other, are the rank of their suffix h bytes further, plus one, in the high
+// 32 bits and the position of the suffix in the low ones.
+struct Batch {
+  std::vector<Group> groups;
+  std::vector<uint64_t> entries;
+  // The groups still not sorted once these are.
+  std::vector<Group> new_groups;
+};
+
+// Sorts [begin, end) on the threads of |scheduler|, in pieces merged in
+// pairs.
+void ParallelSort(uint64_t* begin, uint64_t* end, TaskScheduler* scheduler) {
+  const size_t size = end - begin;
+  const size_t num_pieces =
+      std::min(scheduler->num_threads(), size / kMinBatchSize);
+  if (num_pieces < 2) {
+    std::sort(begin, end);
+    return;
+  }
+  std::vector<uint64_t*> bounds;
+  for (size_t i = 0; i <= num_pieces; i++)
+    bounds.push_back(begin + size * i / num_pieces);
+
+  TaskScheduler::TaskGroup tasks(scheduler);
+  for (size_t i = 0; i < num_pieces; i++) {
+    tasks.Add([&bounds, i] { std::sort(bounds[i], bounds[i + 1]); });
+  }
+  tasks.Wait();
+  for (size_t width = 1; width < num_pieces; width *= 2) {
+    for (size_t i = 0; i + width < num_pieces; i += 2 * width) {
+      const size_t last = std::min(i + 2 * width, num_pieces);
+      tasks.Add([&bounds, i, width, last] {
+        std::inplace_merge(bounds[i], bounds[i + width], bounds[last]);
+      });
+    }
+    tasks.Wait();
+  }
+}
+
+class SuffixArraySorter {
+ public:
+  SuffixArraySorter(const uint8_t* text,
+                    uint32_t size,
+                    uint32_t* suffix_array,
+                    TaskScheduler* scheduler)
+      : text_(text),
+        size_(size),
+        suffix_array_(suffix_array),
+        scheduler_(scheduler) {}
+
+  void Sort() {
+    std::vector<Group> groups = SortByFirstBytes();
+    for (uint64_t h = 2; !groups.empty(); h *= 2) {
+      std::vector<Batch> batches = MakeBatches(std::move(groups));
+      TaskScheduler::TaskGroup tasks(scheduler_);
+      // The entries of all the batches are computed before any rank changes.
+      for (Batch& batch : batches) {
+        tasks.Add([this, &batch, h] { SortBatch(&batch, h); });
+      }
+      tasks.Wait();
+      for (Batch& batch : batches) {
+        tasks.Add([this, &batch] { RankBatch(&batch); });
+      }
+      tasks.Wait();
+      groups.clear();
+      for (const Batch& batch : batches) {
+        groups.insert(
+            groups.end(), batch.new_groups.begin(), batch.new_groups.end());
+      }
+    }
+  }
+
+ private:
+  // Counting sort of the suffixes by their first two bytes. Returns the
+  // groups of those sharing them.
+  std::vector<Group> SortByFirstBytes() {
+    auto first_key = [this](uint32_t i) {
+      return text_[i] * 257 + (i + 1 < size_ ? text_[i + 1] + 1 : 0);
+    };
+    std::vector<uint32_t> bucket_starts(kNumFirstKeys + 1, 0);
+    for (uint32_t i = 0; i < size_; i++)
+      bucket_starts[first_key(i) + 1]++;
+    for (size_t key = 0; key < kNumFirstKeys; key++)
+      bucket_starts[key + 1] += bucket_starts[key];
+
+    rank_.resize(size_);
+    std::vector<uint32_t> next = bucket_starts;
+    for (uint32_t i = 0; i < size_; i++) {
+      const size_t key = first_key(i);
+      suffix_array_[next[key]++] = i;
+      // The rank of a suffix is the last position of its group.
+      rank_[i] = bucket_starts[key + 1] - 1;
+    }
+
+    std::vector<Group> groups;
+    for (size_t key = 0; key < kNumFirstKeys; key++) {
+      if (bucket_starts[key + 1] - bucket_starts[key] > 1)
+        groups.push_back({bucket_starts[key], bucket_starts[key + 1]});
+    }
+    return groups;
+  }
+
+  // Splits |groups| in batches of about the same number of suffixes, enough
+  // of them for every thread to have some.
+  std::vector<Batch> MakeBatches(std::vector<Group> groups) const {
+    uint64_t total = 0;
+    for (const Group& group : groups)
+      total += group.end - group.start;
+    const uint64_t batch_size = std::max<uint64_t>(
+        kMinBatchSize, total / (4 * scheduler_->num_threads()));
+
+    std::vector<Batch> batches(1);
+    uint64_t current_size = 0;
+    for (const Group& group : groups) {
+      if (current_size >= batch_size) {
+        batches.emplace_back();
+        current_size = 0;
+      }
+      batches.back().groups.push_back(group);
+      current_size += group.end - group.start;
+    }
+    return batches;
+  }
+
+  // Sorts the suffixes of each group of |batch| by the rank of their suffix
+  // |h| bytes further.
+  void SortBatch(Batch* batch, uint64_t h) const {
+    for (const Group& group : batch->groups) {
+      const size_t offset = batch->entries.size();
+      for (uint32_t k = group.start; k < group.end; k++) {
+        const uint32_t i = suffix_array_[k];
+        const uint64_t key = i + h < size_ ? rank_[i + h] + 1ULL : 0;
+        batch->entries.push_back(key << 32 | i);
+      }
+      uint64_t* begin = batch->entries.data() + offset;
+      uint64_t* end = batch->entries.data() + batch->entries.size();
+      // In runs of a repeated pattern, most suffixes are followed by one of
+      // the same group, and sorting them every round would take n log n time
+      // for each of the log n rounds the run needs. They have the same key,
+      // so only the others are sorted, and they are moved among them.
+      const uint64_t group_key = group.end;
+      uint64_t* middle = std::partition(begin, end, [group_key](uint64_t e) {
+        return (e >> 32) != group_key;
+      });
+      if (static_cast<size_t>(middle - begin) >= kParallelSortMinSize) {
+        ParallelSort(begin, middle, scheduler_);
+      } else {
+        std::sort(begin, middle);
+      }
+      std::rotate(
+          std::lower_bound(begin, middle, group_key << 32), middle, end);
+    }
+  }
+
+  // Stores the sorted suffixes of |batch| and splits its groups by key.
+  void RankBatch(Batch* batch) {
+    const uint64_t* entry = batch->entries.data();
+    for (const Group& group : batch->groups) {
+      uint32_t start = group.start;
+      while (start < group.end) {
+        uint32_t end = start + 1;
+        while (end < group.end && (entry[end - start] >> 32) == (*entry >> 32))
+          end++;
+        for (uint32_t k = start; k < end; k++, entry++) {
+          const uint32_t i = static_cast<uint32_t>(*entry);
+          suffix_array_[k] = i;
+          rank_[i] = end - 1;
+        }
+        if (end - start > 1)
+          batch->new_groups.push_back({start, end});
+        start = end;
+      }
+    }
+    std::vector<uint64_t>().swap(batch->entries);
+  }
+
+  const uint8_t* text_;
+  const uint32_t size_;
+  uint32_t* suffix_array_;
+  TaskScheduler* scheduler_;
+  std::vector<uint32_t> rank_;
+};
+
+// Returns the length of the common prefix of |a| and |b|.
+size_t MatchLength(const uint8_t* a,
+                   size_t a_size,
+                   const uint8_t* b,
+                   size_t b_size) {
+  const size_t size = std::min(a_size, b_size);
+  size_t i = 0;
+  while (i < size && a[i] == b[i])
+    i++;
+  return i;
+}
+
+class ParallelSuffixArrayIndex : public bsdiff::SuffixArrayIndexInterface {
+ public:
+  ParallelSuffixArrayIndex(const uint8_t* text,
+                           size_t size,
+                           std::vector<uint32_t> suffix_array)
+      : text_(text), size_(size), suffix_array_(std::move(suffix_array)) {}
+
+  void SearchPrefix(const uint8_t* target,
+                    size_t length,
+                    size_t* out_length,
+                    uint64_t* out_pos) const override {
+    if (size_ == 0) {
+      *out_length = 0;
+      *out_pos = 0;
+      return;
+    }
+    // The first suffix not sorting before |target|, those starting with it
+    // included. The longest match is either that suffix or the previous one.
+    size_t lo = 0;
+    size_t hi = size_;
+    while (lo < hi) {
+      const size_t mid = lo + (hi - lo) / 2;
+      const uint32_t pos = suffix_array_[mid];
+      const size_t suffix_size = size_ - pos;
+      const int cmp =
+          memcmp(text_ + pos, target, std::min(suffix_size, length));
+      if (cmp < 0 || (cmp == 0 && suffix_size < length)) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    *out_length = 0;
+    *out_pos = suffix_array_[std::min(lo, size_ - 1)];
+    for (size_t k = lo > 0 ? lo - 1 : 0; k <= lo && k < size_; k++) {
+      const uint32_t pos = suffix_array_[k];
+      const size_t match =
+          MatchLength(text_ + pos, size_ - pos, target, length);
+      if (match > *out_length || (match == *out_length && k == lo)) {
+        *out_length = match;
+        *out_pos = pos;
+      }
+    }
+  }
+
+ private:
+  const uint8_t* text_;
+  const size_t size_;
+  const std::vector<uint32_t> suffix_array_;
+};
+
+}  // namespace
+
+bool BuildSuffixArray(const uint8_t* text,
+                      size_t size,
+                      std::vector<uint32_t>* suffix_array,
+                      TaskScheduler* scheduler) {
+  if (size >= std::numeric_limits<uint32_t>::max()) {
+    LOG(ERROR) << "Too large for a 32 bit suffix array: " << size;
+    return false;
+  }
+  suffix_array->resize(size);
+  SuffixArraySorter(text, size, suffix_array->data(), scheduler).Sort();
+  return true;
+}
+
+std::unique_ptr<bsdiff::SuffixArrayIndexInterface>
+CreateParallelSuffixArrayIndex(const uint8_t* text,
+                               size_t size,
+                               TaskScheduler* scheduler) {
+  std::vector<uint32_t> suffix_array;
+  if (!BuildSuffixArray(text, size, &suffix_array, scheduler))
+    return nullptr;
+  return std::make_unique<ParallelSuffixArrayIndex>(
+      text, size, std::move(suffix_array));
+}
+
+bool ParallelBsdiff(const brillo::Blob& old_data,
+                    const brillo::Blob& new_data,
+                    bsdiff::PatchWriterInterface* patch_writer) {
+  std::unique_ptr<bsdiff::SuffixArrayIndexInterface> index =
+      CreateParallelSuffixArrayIndex(old_data.data(), old_data.size());
+  // bsdiff builds its own suffix array if there's none.
+  bsdiff::SuffixArrayIndexInterface* index_ptr = index.get();
+  const bool success = bsdiff::bsdiff(old_data.data(),
+                                      old_data.size(),
+                                      new_data.data(),
+                                      new_data.size(),
+                                      patch_writer,
+                                      &index_ptr) == 0;
+  if (index_ptr != index.get()) {
+    index.reset(index_ptr);
+  }
+  return success;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,61 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PARALLEL_SUFFIX_ARRAY_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_PARALLEL_SUFFIX_ARRAY_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <bsdiff/patch_writer_interface.h>
+#include <bsdiff/suffix_array_index.h>
+
+#include "update_engine/payload_generator/task_scheduler.h"
+
+namespace chromeos_update_engine {
+
+// Sorts the suffixes of the |size| bytes of |text| into |suffix_array| by
+// prefix doubling on the threads of |scheduler|: the suffixes are bucketed by
+// their first two bytes, then each round sorts the groups of suffixes still
+// sharing a prefix of h bytes by the rank of their suffix h bytes further, in
+// parallel, doubling h. Unlike the libdivsufsort bsdiff uses, which runs on a
+// single thread, it takes up to 16 bytes of memory per byte of |text|.
+// Returns false if |text| is too large for 32 bit suffix array entries.
+bool BuildSuffixArray(const uint8_t* text,
+                      size_t size,
+                      std::vector<uint32_t>* suffix_array,
+                      TaskScheduler* scheduler = TaskScheduler::Get());
+
+// Returns a bsdiff suffix array index of |text|, built with
+// BuildSuffixArray(), to pass to bsdiff::bsdiff() instead of letting it build
+// its own. |text| must outlive the index. Returns null on failure.
+std::unique_ptr<bsdiff::SuffixArrayIndexInterface>
+CreateParallelSuffixArrayIndex(const uint8_t* text,
+                               size_t size,
+                               TaskScheduler* scheduler = TaskScheduler::Get());
+
+// Same as bsdiff::bsdiff(), with the suffix array of |old_data| built by
+// CreateParallelSuffixArrayIndex(). Returns whether the patch was written.
+bool ParallelBsdiff(const brillo::Blob& old_data,
+                    const brillo::Blob& new_data,
+                    bsdiff::PatchWriterInterface* patch_writer);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_PARALLEL_SUFFIX_ARRAY_H_
@@ -0,0 +1,157 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/parallel_suffix_array.h"
+
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <vector>
+
+#include <bsdiff/bspatch.h>
+#include <bsdiff/patch_writer_factory.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class ParallelSuffixArrayTest : public ::testing::Test {
+ protected:
+  // Returns the suffix array of |text| sorted the slow way.
+  static vector<uint32_t> SortSuffixes(const brillo::Blob& text) {
+    vector<uint32_t> suffix_array(text.size());
+    std::iota(suffix_array.begin(), suffix_array.end(), 0);
+    std::sort(suffix_array.begin(),
+              suffix_array.end(),
+              [&text](uint32_t a, uint32_t b) {
+                return std::lexicographical_compare(
+                    text.begin() + a, text.end(), text.begin() + b, text.end());
+              });
+    return suffix_array;
+  }
+
+  void ExpectSorted(const brillo::Blob& text) {
+    vector<uint32_t> suffix_array;
+    ASSERT_TRUE(
+        BuildSuffixArray(text.data(), text.size(), &suffix_array, &scheduler_));
+    EXPECT_EQ(SortSuffixes(text), suffix_array);
+  }
+
+  TaskScheduler scheduler_{4};
+  std::mt19937 gen_{1234};
+};
+
+TEST_F(ParallelSuffixArrayTest, RandomTextTest) {
+  for (size_t size : {0, 1, 2, 3, 100, 10000}) {
+    brillo::Blob text(size);
+    for (auto& byte : text)
+      byte = gen_();
+    ExpectSorted(text);
+  }
+}
+
+TEST_F(ParallelSuffixArrayTest, RepetitiveTextTest) {
+  brillo::Blob binary(5000);
+  for (auto& byte : binary)
+    byte = gen_() % 2;
+  ExpectSorted(binary);
+
+  ExpectSorted(brillo::Blob(5000, 0));
+
+  // Runs of zeros between random blocks, as in filesystem images.
+  brillo::Blob runs(5000);
+  for (size_t i = 0; i < runs.size(); i++)
+    runs[i] = (i / 512) % 2 ? gen_() : 0;
+  ExpectSorted(runs);
+}
+
+TEST_F(ParallelSuffixArrayTest, LongRunTest) {
+  // Large enough to be sorted in several batches and pieces.
+  brillo::Blob text(4 * 1024 * 1024, 7);
+  vector<uint32_t> suffix_array;
+  ASSERT_TRUE(
+      BuildSuffixArray(text.data(), text.size(), &suffix_array, &scheduler_));
+  // The shorter suffixes of a run sort first.
+  for (size_t i = 0; i < suffix_array.size(); i++) {
+    ASSERT_EQ(text.size() - 1 - i, suffix_array[i]);
+  }
+}
+
+TEST_F(ParallelSuffixArrayTest, SearchPrefixTest) {
+  brillo::Blob text(10000);
+  for (auto& byte : text)
+    byte = gen_() % 4;
+  auto index =
+      CreateParallelSuffixArrayIndex(text.data(), text.size(), &scheduler_);
+  ASSERT_NE(nullptr, index);
+
+  for (int i = 0; i < 100; i++) {
+    const size_t pos = gen_() % (text.size() - 40);
+    brillo::Blob target(text.begin() + pos, text.begin() + pos + 40);
+    target[gen_() % target.size()] ^= 1;
+
+    size_t longest = 0;
+    for (size_t start = 0; start < text.size(); start++) {
+      size_t match = 0;
+      while (match < target.size() && start + match < text.size() &&
+             text[start + match] == target[match]) {
+        match++;
+      }
+      longest = std::max(longest, match);
+    }
+
+    size_t length;
+    uint64_t found_pos;
+    index->SearchPrefix(target.data(), target.size(), &length, &found_pos);
+    EXPECT_EQ(longest, length);
+    ASSERT_LE(found_pos + length, text.size());
+    EXPECT_TRUE(
+        std::equal(target.begin(), target.begin() + length, &text[found_pos]));
+  }
+}
+
+TEST_F(ParallelSuffixArrayTest, ParallelBsdiffTest) {
+  brillo::Blob old_data(256 * 1024);
+  for (auto& byte : old_data)
+    byte = gen_() % 16;
+  brillo::Blob new_data = old_data;
+  new_data.erase(new_data.begin() + 1000, new_data.begin() + 3000);
+  for (size_t i = 50000; i < 60000; i += 7)
+    new_data[i]++;
+
+  ScopedTempFile patch_file("ParallelSuffixArrayTest-patch-XXXXXX");
+  auto writer = bsdiff::CreateBsdiffPatchWriter(patch_file.path());
+  ASSERT_TRUE(ParallelBsdiff(old_data, new_data, writer.get()));
+  brillo::Blob patch;
+  ASSERT_TRUE(utils::ReadFile(patch_file.path(), &patch));
+
+  brillo::Blob patched;
+  ASSERT_EQ(0,
+            bsdiff::bspatch(old_data.data(),
+                            old_data.size(),
+                            patch.data(),
+                            patch.size(),
+                            [&patched](const uint8_t* data, size_t size) {
+                              patched.insert(patched.end(), data, data + size);
+                              return size;
+                            }));
+  EXPECT_EQ(new_data, patched);
+}
+
+}  // namespace chromeos_update_engine
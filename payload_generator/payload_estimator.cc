@@ -0,0 +1,371 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/payload_estimator.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <base/logging.h>
+#include <base/strings/stringprintf.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/cow_size_estimator.h"
+#include "update_engine/payload_generator/deflate_utils.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/merge_sequence_generator.h"
+#include "update_engine/payload_generator/task_scheduler.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The z value of a 95% confidence interval.
+constexpr double kConfidenceZ = 1.96;
+
+// The metrics estimated, in the order of |PayloadEstimate|.
+constexpr size_t kNumMetrics = 3;
+
+// A chunk of a file, as diffed by DeltaReadFile().
+struct Chunk {
+  FilesystemInterface::File old_file;
+  FilesystemInterface::File new_file;
+  vector<Extent> old_extents;
+  vector<Extent> new_extents;
+  uint64_t num_blocks{0};
+  // The metrics of the chunk, once diffed.
+  double metrics[kNumMetrics]{};
+};
+
+// The estimates of a partition, and their variances.
+struct PartitionEstimate {
+  double values[kNumMetrics]{};
+  double variances[kNumMetrics]{};
+};
+
+bool IsDynamicPartition(const PayloadGenerationConfig& config,
+                        const string& partition_name) {
+  if (!config.target.dynamic_partition_metadata)
+    return false;
+  for (const auto& group : config.target.dynamic_partition_metadata->groups()) {
+    const auto& names = group.partition_names();
+    if (std::find(names.begin(), names.end(), partition_name) != names.end())
+      return true;
+  }
+  return false;
+}
+
+// Returns whether the COW size of |new_part| is estimated, as done by
+// GenerateUpdatePayloadFile().
+bool EstimatesCowSize(const PayloadGenerationConfig& config,
+                      const PartitionConfig& new_part) {
+  const auto& metadata = config.target.dynamic_partition_metadata;
+  return metadata && metadata->snapshot_enabled() &&
+         metadata->vabc_enabled() && IsDynamicPartition(config, new_part.name);
+}
+
+// Returns the estimated size of the COW image of |new_part| written with
+// |aop| only, or with no operation at all if null.
+uint64_t EstimateCowSize(const PayloadGenerationConfig& config,
+                         const PartitionConfig& old_part,
+                         const PartitionConfig& new_part,
+                         const AnnotatedOperation* aop) {
+  google::protobuf::RepeatedPtrField<InstallOperation> operations;
+  vector<CowMergeOperation> merge_sequence;
+  if (aop) {
+    *operations.Add() = aop->op;
+    auto generator = MergeSequenceGenerator::Create({*aop}, new_part.name);
+    if (generator)
+      generator->Generate(&merge_sequence);
+  }
+
+  auto target_fd = std::make_shared<EintrSafeFileDescriptor>();
+  target_fd->Open(new_part.path.c_str(), O_RDONLY);
+  FileDescriptorPtr source_fd;
+  if (config.enable_vabc_xor && !old_part.path.empty()) {
+    source_fd = std::make_shared<EintrSafeFileDescriptor>();
+    source_fd->Open(old_part.path.c_str(), O_RDONLY);
+  }
+  const auto& metadata = *config.target.dynamic_partition_metadata;
+  uint64_t compression_factor = config.block_size;
+  if (config.cow_estimate_with_compression_factor &&
+      metadata.compression_factor() > 0) {
+    compression_factor = metadata.compression_factor();
+  }
+  return EstimateCowSizeInfo(std::move(source_fd),
+                             std::move(target_fd),
+                             operations,
+                             {merge_sequence.begin(), merge_sequence.end()},
+                             config.block_size,
+                             metadata.vabc_compression_param(),
+                             new_part.size,
+                             config.enable_vabc_xor,
+                             metadata.cow_version(),
+                             compression_factor,
+                             1,
+                             1)
+      .cow_size;
+}
+
+// Splits the files of |new_part| in the chunks DeltaReadPartition() diffs.
+bool GetChunks(const PayloadGenerationConfig& config,
+               const PartitionConfig& old_part,
+               const PartitionConfig& new_part,
+               vector<Chunk>* chunks) {
+  const bool puffdiff_allowed =
+      config.OperationEnabled(InstallOperation::PUFFDIFF);
+  vector<FilesystemInterface::File> new_files;
+  TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
+      new_part, &new_files, puffdiff_allowed));
+  std::map<string, FilesystemInterface::File> old_files_map;
+  if (old_part.fs_interface) {
+    vector<FilesystemInterface::File> old_files;
+    TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
+        old_part, &old_files, puffdiff_allowed));
+    for (const FilesystemInterface::File& file : old_files)
+      old_files_map[file.name] = file;
+  }
+
+  uint64_t chunk_blocks = 0;
+  if (config.hard_chunk_size > 0)
+    chunk_blocks = config.hard_chunk_size / config.block_size;
+  const uint64_t large_file_blocks =
+      config.large_file_chunk_size / config.block_size;
+  if (large_file_blocks > 0 &&
+      (chunk_blocks == 0 || large_file_blocks < chunk_blocks)) {
+    chunk_blocks = large_file_blocks;
+  }
+
+  // Blocks shared by several files are only diffed for the first one.
+  ExtentRanges new_visited_blocks;
+  for (const FilesystemInterface::File& new_file : new_files) {
+    vector<Extent> new_extents =
+        FilterExtentRanges(new_file.extents, new_visited_blocks);
+    new_visited_blocks.AddExtents(new_extents);
+    const uint64_t num_blocks = utils::BlocksInExtents(new_extents);
+    if (num_blocks == 0)
+      continue;
+    // Renamed files aren't matched to the old file with the most similar
+    // data, which is about as large as a new file in the payload.
+    const FilesystemInterface::File old_file =
+        diff_utils::GetOldFile(old_files_map, new_file.name);
+    const uint64_t step = chunk_blocks > 0 ? chunk_blocks : num_blocks;
+    for (uint64_t offset = 0; offset < num_blocks; offset += step) {
+      Chunk chunk;
+      chunk.old_file = old_file;
+      chunk.new_file = new_file;
+      chunk.new_extents = ExtentsSublist(new_extents, offset, step);
+      chunk.old_extents = ExtentsSublist(old_file.extents, offset, step);
+      NormalizeExtents(&chunk.old_extents);
+      NormalizeExtents(&chunk.new_extents);
+      chunk.num_blocks = utils::BlocksInExtents(chunk.new_extents);
+      chunks->push_back(std::move(chunk));
+    }
+  }
+  return true;
+}
+
+// Diffs |chunk| and sets its metrics.
+bool DiffChunk(const PayloadGenerationConfig& config,
+               const PartitionConfig& old_part,
+               const PartitionConfig& new_part,
+               bool estimate_cow_size,
+               uint64_t empty_cow_size,
+               Chunk* chunk) {
+  brillo::Blob data;
+  AnnotatedOperation aop;
+  aop.name = chunk->new_file.name;
+  TEST_AND_RETURN_FALSE(diff_utils::ReadExtentsToDiff(old_part.path,
+                                                      new_part.path,
+                                                      chunk->old_extents,
+                                                      chunk->new_extents,
+                                                      chunk->old_file,
+                                                      chunk->new_file,
+                                                      config,
+                                                      &data,
+                                                      &aop));
+  chunk->metrics[0] = data.size();
+  chunk->metrics[1] = diff_utils::EstimateApplyCost(aop.op, config.block_size);
+  if (estimate_cow_size) {
+    const uint64_t cow_size =
+        EstimateCowSize(config, old_part, new_part, &aop);
+    chunk->metrics[2] =
+        cow_size > empty_cow_size ? cow_size - empty_cow_size : 0;
+  }
+  return true;
+}
+
+// Extrapolates the metrics of the |sampled| chunks, out of |num_chunks| chunks
+// of |total_blocks| blocks, with a ratio estimator by number of blocks.
+PartitionEstimate Extrapolate(const vector<Chunk*>& sampled,
+                              size_t num_chunks,
+                              uint64_t total_blocks) {
+  PartitionEstimate estimate;
+  const size_t n = sampled.size();
+  if (n == 0)
+    return estimate;
+  uint64_t sampled_blocks = 0;
+  for (const Chunk* chunk : sampled)
+    sampled_blocks += chunk->num_blocks;
+  const double mean_blocks = static_cast<double>(sampled_blocks) / n;
+  const double sampled_fraction = static_cast<double>(n) / num_chunks;
+
+  for (size_t metric = 0; metric < kNumMetrics; metric++) {
+    double sum = 0;
+    for (const Chunk* chunk : sampled)
+      sum += chunk->metrics[metric];
+    const double ratio = sum / sampled_blocks;
+    estimate.values[metric] = ratio * total_blocks;
+    if (sampled_fraction >= 1)
+      continue;
+    if (n < 2) {
+      // No spread to go by, the estimate may be anything.
+      estimate.variances[metric] = std::pow(estimate.values[metric], 2);
+      continue;
+    }
+    double residuals = 0;
+    for (const Chunk* chunk : sampled) {
+      residuals +=
+          std::pow(chunk->metrics[metric] - ratio * chunk->num_blocks, 2);
+    }
+    const double residual_variance = residuals / (n - 1);
+    estimate.variances[metric] = std::pow(total_blocks / mean_blocks, 2) *
+                                 (1 - sampled_fraction) * residual_variance /
+                                 n;
+  }
+  return estimate;
+}
+
+string FormatValue(const EstimatedValue& value) {
+  const double percent =
+      value.value > 0 ? 100 * value.margin / value.value : 0;
+  return base::StringPrintf(
+      "%.0f +/- %.0f (%.1f%%)", value.value, value.margin, percent);
+}
+
+}  // namespace
+
+string PayloadEstimate::ToString() const {
+  return base::StringPrintf(
+      "Estimated from %zu of %zu chunks of files, at 95%% confidence:\n"
+      "  data size: %s bytes\n"
+      "  apply cost: %s SOURCE_BSDIFF bytes\n"
+      "  COW size: %s bytes\n",
+      sampled_chunks,
+      total_chunks,
+      FormatValue(data_size).c_str(),
+      FormatValue(apply_cost).c_str(),
+      FormatValue(cow_size).c_str());
+}
+
+bool EstimatePayload(const PayloadGenerationConfig& config,
+                     uint32_t sample_interval,
+                     PayloadEstimate* estimate) {
+  TEST_AND_RETURN_FALSE(sample_interval > 0);
+  if (config.max_threads > 0) {
+    TaskScheduler::SetDefaultNumThreads(config.max_threads);
+  }
+  *estimate = PayloadEstimate();
+  double values[kNumMetrics]{};
+  double variances[kNumMetrics]{};
+  PartitionConfig empty_part("");
+
+  for (size_t i = 0; i < config.target.partitions.size(); i++) {
+    const PartitionConfig& old_part =
+        config.is_delta ? config.source.partitions[i] : empty_part;
+    const PartitionConfig& new_part = config.target.partitions[i];
+    if (!new_part.fs_interface) {
+      LOG(WARNING) << "Not estimating " << new_part.name
+                   << " without a filesystem";
+      continue;
+    }
+
+    vector<Chunk> chunks;
+    TEST_AND_RETURN_FALSE(GetChunks(config, old_part, new_part, &chunks));
+    if (chunks.empty())
+      continue;
+    // Sampled evenly over the sizes, the largest chunk included.
+    std::stable_sort(
+        chunks.begin(), chunks.end(), [](const Chunk& a, const Chunk& b) {
+          return a.num_blocks > b.num_blocks;
+        });
+    uint64_t total_blocks = 0;
+    vector<Chunk*> sampled;
+    for (size_t k = 0; k < chunks.size(); k++) {
+      total_blocks += chunks[k].num_blocks;
+      if (k % sample_interval == 0)
+        sampled.push_back(&chunks[k]);
+    }
+
+    const bool estimate_cow_size = EstimatesCowSize(config, new_part);
+    const uint64_t empty_cow_size =
+        estimate_cow_size ? EstimateCowSize(config, old_part, new_part, nullptr)
+                          : 0;
+    // Not vector<bool>, as its elements can't be written concurrently.
+    vector<uint8_t> diffed(sampled.size(), false);
+    {
+      TaskScheduler::TaskGroup tasks;
+      for (size_t k = 0; k < sampled.size(); k++) {
+        tasks.Add([&, k] {
+          diffed[k] = DiffChunk(config,
+                                old_part,
+                                new_part,
+                                estimate_cow_size,
+                                empty_cow_size,
+                                sampled[k]);
+        });
+      }
+      tasks.Wait();
+    }
+    TEST_AND_RETURN_FALSE(
+        std::all_of(diffed.begin(), diffed.end(), [](uint8_t d) { return d; }));
+
+    const PartitionEstimate partition_estimate =
+        Extrapolate(sampled, chunks.size(), total_blocks);
+    for (size_t metric = 0; metric < kNumMetrics; metric++) {
+      values[metric] += partition_estimate.values[metric];
+      variances[metric] += partition_estimate.variances[metric];
+    }
+    LOG(INFO) << "Estimated " << new_part.name << " from " << sampled.size()
+              << " of " << chunks.size() << " chunks: "
+              << partition_estimate.values[0] << " bytes of data";
+    estimate->sampled_chunks += sampled.size();
+    estimate->total_chunks += chunks.size();
+  }
+
+  EstimatedValue* estimated_values[kNumMetrics] = {
+      &estimate->data_size, &estimate->apply_cost, &estimate->cow_size};
+  for (size_t metric = 0; metric < kNumMetrics; metric++) {
+    estimated_values[metric]->value = values[metric];
+    estimated_values[metric]->margin =
+        kConfidenceZ * std::sqrt(variances[metric]);
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,66 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_ESTIMATOR_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_ESTIMATOR_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "update_engine/payload_generator/payload_generation_config.h"
+
+namespace chromeos_update_engine {
+
+// An estimate and the half width of its 95% confidence interval.
+struct EstimatedValue {
+  double value{0};
+  double margin{0};
+};
+
+// What a payload generated with some options would be like, estimated from
+// a sample of the files of its partitions.
+struct PayloadEstimate {
+  // The size of the data blobs, in bytes.
+  EstimatedValue data_size;
+  // The time the devices take to apply the operations, in bytes of target
+  // data written by SOURCE_BSDIFF operations in the same time.
+  EstimatedValue apply_cost;
+  // The size of the COW images, in bytes, 0 without Virtual AB compression.
+  EstimatedValue cow_size;
+
+  // The chunks of files diffed out of all of them.
+  size_t sampled_chunks{0};
+  size_t total_chunks{0};
+
+  std::string ToString() const;
+};
+
+// Estimates the payload generated from |config| by only generating the
+// operations of one chunk of file out of |sample_interval|, in a fraction of
+// the time the whole generation takes, to compare generation options. The
+// chunks are those of DeltaReadFile(), sorted by size, and sampled evenly
+// from the largest one. The estimates of each partition are those chunks
+// extrapolated to all of its files by number of blocks. Blocks not in any
+// file, such as the free ones of the filesystem, aren't accounted for.
+// |config| must have the filesystems of the partitions open.
+bool EstimatePayload(const PayloadGenerationConfig& config,
+                     uint32_t sample_interval,
+                     PayloadEstimate* estimate);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_ESTIMATOR_H_
@@ -0,0 +1,81 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/payload_estimator.h"
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+
+namespace chromeos_update_engine {
+
+class PayloadEstimatorTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    config_.is_delta = false;
+    config_.version.major = kBrilloMajorPayloadVersion;
+    config_.version.minor = kFullPayloadMinorVersion;
+    config_.hard_chunk_size = 64 * 1024;
+    config_.block_size = 4096;
+
+    brillo::Blob part_data(2 * 1024 * 1024);
+    test_utils::FillWithData(&part_data);
+    ASSERT_TRUE(test_utils::WriteFileVector(part_file_.path(), part_data));
+    config_.target.partitions.emplace_back("part");
+    PartitionConfig& part = config_.target.partitions.back();
+    part.path = part_file_.path();
+    part.size = part_data.size();
+    ASSERT_TRUE(part.OpenFilesystem());
+  }
+
+  PayloadGenerationConfig config_;
+  ScopedTempFile part_file_{"PayloadEstimatorTest_part.XXXXXX"};
+};
+
+TEST_F(PayloadEstimatorTest, AllChunksSampledTest) {
+  PayloadEstimate estimate;
+  ASSERT_TRUE(EstimatePayload(config_, 1, &estimate));
+  EXPECT_EQ(32u, estimate.total_chunks);
+  EXPECT_EQ(32u, estimate.sampled_chunks);
+  EXPECT_GT(estimate.data_size.value, 0);
+  EXPECT_EQ(0, estimate.data_size.margin);
+  // No Virtual AB compression.
+  EXPECT_EQ(0, estimate.cow_size.value);
+}
+
+TEST_F(PayloadEstimatorTest, SampledEstimateTest) {
+  PayloadEstimate all;
+  ASSERT_TRUE(EstimatePayload(config_, 1, &all));
+  PayloadEstimate sampled;
+  ASSERT_TRUE(EstimatePayload(config_, 4, &sampled));
+  EXPECT_EQ(32u, sampled.total_chunks);
+  EXPECT_EQ(8u, sampled.sampled_chunks);
+  // The chunks all hold the same kind of data.
+  EXPECT_NEAR(all.data_size.value,
+              sampled.data_size.value,
+              0.1 * all.data_size.value);
+  EXPECT_GE(sampled.data_size.margin, 0);
+  EXPECT_FALSE(sampled.ToString().empty());
+}
+
+TEST_F(PayloadEstimatorTest, InvalidSampleIntervalTest) {
+  PayloadEstimate estimate;
+  EXPECT_FALSE(EstimatePayload(config_, 0, &estimate));
+}
+
+}  // namespace chromeos_update_engine
@@ -26,10 +26,15 @@
 
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/apply_hints.h"
+#include "update_engine/payload_consumer/chunked_partition_hasher.h"
 #include "update_engine/payload_consumer/file_writer.h"
+#include "update_engine/payload_consumer/operations_section.h"
+#include "update_engine/payload_consumer/packed_extents.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/generation_profile.h"
 #include "update_engine/payload_generator/payload_signer.h"
 
 using std::string;
@@ -50,14 +55,15 @@ struct DeltaObject {
   off_t size;
 };
 
-// Writes the uint64_t passed in in host-endian to the file as big-endian.
-// Returns true on success.
-bool WriteUint64AsBigEndian(FileWriter* writer, const uint64_t value) {
+// Appends the uint64_t passed in in host-endian to |out| as big-endian.
+void AppendUint64AsBigEndian(string* out, const uint64_t value) {
   uint64_t value_be = htobe64(value);
-  TEST_AND_RETURN_FALSE(writer->Write(&value_be, sizeof(value_be)));
-  return true;
+  out->append(reinterpret_cast<const char*>(&value_be), sizeof(value_be));
 }
 
+// Size of the buffer used to copy the data blobs into the payload.
+constexpr size_t kBlobCopyBufferSize = 1024 * 1024;
+
 }  // namespace
 
 bool PayloadFile::Init(const PayloadGenerationConfig& config) {
@@ -66,6 +72,12 @@ bool PayloadFile::Init(const PayloadGenerationConfig& config) {
   manifest_.set_minor_version(config.version.minor);
   manifest_.set_block_size(config.block_size);
   manifest_.set_max_timestamp(config.max_timestamp);
+  hash_algorithm_ = config.data_hash_algorithm;
+  if (hash_algorithm_ == HashAlgorithm::kBlake2b256)
+    manifest_.set_data_hash_algorithm(DeltaArchiveManifest::BLAKE2B_256);
+  operations_sections_ = config.operations_sections;
+  apply_hints_ = config.apply_hints;
+  operation_order_ = config.operation_order;
   if (!config.security_patch_level.empty()) {
     manifest_.set_security_patch_level(config.security_patch_level);
   }
@@ -108,11 +120,31 @@ bool PayloadFile::AddPartition(const PartitionConfig& old_conf,
   part.version = new_conf.version;
   part.cow_info = cow_info;
   // Initialize the PartitionInfo objects if present.
-  if (!old_conf.path.empty())
+  if (!old_conf.path.empty()) {
     TEST_AND_RETURN_FALSE(
-        diff_utils::InitializePartitionInfo(old_conf, &part.old_info));
+        diff_utils::InitializePartitionInfo(
+            old_conf, &part.old_info, hash_algorithm_));
+    part.operation_order = operation_order_;
+  }
   TEST_AND_RETURN_FALSE(
-      diff_utils::InitializePartitionInfo(new_conf, &part.new_info));
+      diff_utils::InitializePartitionInfo(
+          new_conf, &part.new_info, hash_algorithm_));
+  // Older clients ignore the chunked hash, which is only sent alongside the
+  // hash of the whole partition.
+  const uint32_t minor = manifest_.minor_version();
+  if (minor == kFullPayloadMinorVersion ||
+      minor >= kChunkedHashMinorPayloadVersion) {
+    brillo::Blob chunked_hash;
+    TEST_AND_RETURN_FALSE(ChunkedPartitionHasher::HashFile(
+        new_conf.path,
+        new_conf.size,
+        ChunkedPartitionHasher::kDefaultChunkSize,
+        diff_utils::GetMaxThreads(),
+        &chunked_hash));
+    part.new_info.set_chunked_hash(chunked_hash.data(), chunked_hash.size());
+    part.new_info.set_hash_chunk_size(
+        ChunkedPartitionHasher::kDefaultChunkSize);
+  }
   part_vec_.push_back(std::move(part));
   return true;
 }
@@ -121,10 +153,17 @@ bool PayloadFile::WritePayload(const string& payload_file,
                                const string& data_blobs_path,
                                const string& private_key_path,
                                uint64_t* metadata_size_out) {
-  // Reorder the data blobs with the manifest_.
-  ScopedTempFile ordered_blobs_file("CrAU_temp_data.ordered.XXXXXX");
-  TEST_AND_RETURN_FALSE(
-      ReorderDataBlobs(data_blobs_path, ordered_blobs_file.path()));
+  // Give the data blobs their offsets in the order of manifest_. They are
+  // copied in that order straight into the payload, without writing a whole
+  // reordered copy of the data blobs first.
+  int blobs_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(blobs_fd >= 0);
+  ScopedFdCloser blobs_fd_closer(&blobs_fd);
+  vector<BlobRange> blob_ranges;
+  {
+    ScopedGenerationPhase phase("", GenerationPhase::kBlobReorder);
+    TEST_AND_RETURN_FALSE(ReorderDataBlobs(blobs_fd, &blob_ranges));
+  }
 
   // Check that install op blobs are in order.
   uint64_t next_blob_offset = 0;
@@ -154,6 +193,9 @@ bool PayloadFile::WritePayload(const string& payload_file,
     if (part.cow_info.op_count_max > 0) {
       partition->set_estimate_op_count_max(part.cow_info.op_count_max);
     }
+    if (part.operation_order != PartitionUpdate::DESTINATION) {
+      partition->set_operation_order(part.operation_order);
+    }
     if (part.postinstall.run) {
       partition->set_run_postinstall(true);
       if (!part.postinstall.path.empty())
@@ -161,6 +203,10 @@ bool PayloadFile::WritePayload(const string& payload_file,
       if (!part.postinstall.filesystem_type.empty())
         partition->set_filesystem_type(part.postinstall.filesystem_type);
       partition->set_postinstall_optional(part.postinstall.optional);
+      if (part.postinstall.independent)
+        partition->set_postinstall_independent(true);
+      for (const auto& file : part.postinstall.cache_files)
+        partition->add_postinstall_cache_files(file);
     }
     if (!part.verity.IsEmpty()) {
       if (part.verity.hash_tree_extent.num_blocks() != 0) {
@@ -171,16 +217,32 @@ bool PayloadFile::WritePayload(const string& payload_file,
         if (!part.verity.hash_tree_salt.empty())
           partition->set_hash_tree_salt(part.verity.hash_tree_salt.data(),
                                         part.verity.hash_tree_salt.size());
+        if (!part.verity.hash_tree_root_digest.empty())
+          partition->set_hash_tree_root_digest(
+              part.verity.hash_tree_root_digest.data(),
+              part.verity.hash_tree_root_digest.size());
       }
       if (part.verity.fec_extent.num_blocks() != 0) {
         *partition->mutable_fec_data_extent() = part.verity.fec_data_extent;
         *partition->mutable_fec_extent() = part.verity.fec_extent;
         partition->set_fec_roots(part.verity.fec_roots);
       }
+      if (part.verity.data_in_payload)
+        partition->set_verity_data_in_payload(true);
     }
     for (const AnnotatedOperation& aop : part.aops) {
       *partition->add_operations() = aop.op;
     }
+    if (apply_hints_) {
+      ComputeApplyHints(partition->operations(),
+                        manifest_.block_size(),
+                        part.old_info.size() / manifest_.block_size(),
+                        partition->mutable_apply_hints());
+    }
+    if (manifest_.minor_version() >= kPackedExtentsMinorPayloadVersion) {
+      for (auto& op : *partition->mutable_operations())
+        PackOperationExtents(&op);
+    }
     for (const auto& merge_op : part.cow_merge_sequence) {
       *partition->add_merge_operations() = merge_op;
     }
@@ -191,6 +253,16 @@ bool PayloadFile::WritePayload(const string& payload_file,
       *(partition->mutable_new_partition_info()) = part.new_info;
   }
 
+  // The operations sections go among the data blobs, and have to outlive
+  // |blob_ranges| pointing to them.
+  vector<string> sections;
+  if (operations_sections_) {
+    uint64_t sections_size = 0;
+    TEST_AND_RETURN_FALSE(
+        MoveOperationsToSections(&blob_ranges, &sections, &sections_size));
+    next_blob_offset += sections_size;
+  }
+
   // Signatures appear at the end of the blobs. Note the offset in the
   // |manifest_|.
   uint64_t signature_blob_length = 0;
@@ -200,12 +272,13 @@ bool PayloadFile::WritePayload(const string& payload_file,
     PayloadSigner::AddSignatureToManifest(
         next_blob_offset, signature_blob_length, &manifest_);
   }
-  WritePayload(payload_file,
-               ordered_blobs_file.path(),
-               private_key_path,
-               major_version_,
-               manifest_,
-               metadata_size_out);
+  TEST_AND_RETURN_FALSE(WritePayloadFromBlobs(payload_file,
+                                              blobs_fd,
+                                              blob_ranges,
+                                              private_key_path,
+                                              major_version_,
+                                              manifest_,
+                                              metadata_size_out));
 
   ReportPayloadUsage(*metadata_size_out);
   return true;
@@ -217,27 +290,38 @@ bool PayloadFile::WritePayload(const std::string& payload_file,
                                uint64_t major_version_,
                                const DeltaArchiveManifest& manifest,
                                uint64_t* metadata_size_out) {
-  std::string serialized_manifest;
-
-  TEST_AND_RETURN_FALSE(manifest.SerializeToString(&serialized_manifest));
-  uint64_t metadata_size =
-      sizeof(kDeltaMagic) + 2 * sizeof(uint64_t) + serialized_manifest.size();
-  LOG(INFO) << "Writing final delta file header...";
-  DirectFileWriter writer;
-  TEST_AND_RETURN_FALSE_ERRNO(writer.Open(payload_file.c_str(),
-                                          O_WRONLY | O_CREAT | O_TRUNC,
-                                          0644) == 0);
-  ScopedFileWriterCloser writer_closer(&writer);
+  int blobs_fd = open(ordered_blobs_file.c_str(), O_RDONLY, 0);
+  ScopedFdCloser blobs_fd_closer(&blobs_fd);
+  TEST_AND_RETURN_FALSE(blobs_fd >= 0);
+  const off_t blobs_size = utils::FileSize(blobs_fd);
+  TEST_AND_RETURN_FALSE(blobs_size >= 0);
+  return WritePayloadFromBlobs(payload_file,
+                               blobs_fd,
+                               {{0, static_cast<uint64_t>(blobs_size)}},
+                               private_key_path,
+                               major_version_,
+                               manifest,
+                               metadata_size_out);
+}
 
-  // Write header
-  TEST_AND_RETURN_FALSE_ERRNO(writer.Write(kDeltaMagic, sizeof(kDeltaMagic)));
+bool PayloadFile::WritePayloadFromBlobs(const std::string& payload_file,
+                                        int blobs_fd,
+                                        const vector<BlobRange>& blob_ranges,
+                                        const std::string& private_key_path,
+                                        uint64_t major_version_,
+                                        const DeltaArchiveManifest& manifest,
+                                        uint64_t* metadata_size_out) {
+  // The header and the manifest are built in memory, so that they can be
+  // hashed without reading them back from |payload_file|.
+  string metadata(kDeltaMagic, sizeof(kDeltaMagic));
 
   // Write major version number
-  TEST_AND_RETURN_FALSE(WriteUint64AsBigEndian(&writer, major_version_));
+  AppendUint64AsBigEndian(&metadata, major_version_);
 
+  string serialized_manifest;
+  TEST_AND_RETURN_FALSE(manifest.SerializeToString(&serialized_manifest));
   // Write protobuf length
-  TEST_AND_RETURN_FALSE(
-      WriteUint64AsBigEndian(&writer, serialized_manifest.size()));
+  AppendUint64AsBigEndian(&metadata, serialized_manifest.size());
 
   // Metadata signature has the same size as payload signature, because they
   // are both the same kind of signature for the same kind of hash.
@@ -247,22 +331,34 @@ bool PayloadFile::WritePayload(const std::string& payload_file,
   // endianess.
   {
     const uint32_t metadata_signature_size = htobe32(signature_blob_length);
-    TEST_AND_RETURN_FALSE_ERRNO(writer.Write(&metadata_signature_size,
-                                             sizeof(metadata_signature_size)));
-    metadata_size += sizeof(metadata_signature_size);
+    metadata.append(reinterpret_cast<const char*>(&metadata_signature_size),
+                    sizeof(metadata_signature_size));
   }
 
   // Write protobuf
-  LOG(INFO) << "Writing final delta file protobuf... "
+  metadata += serialized_manifest;
+  const uint64_t metadata_size = metadata.size();
+
+  LOG(INFO) << "Writing final delta file header and protobuf... "
             << serialized_manifest.size();
-  TEST_AND_RETURN_FALSE_ERRNO(
-      writer.Write(serialized_manifest.data(), serialized_manifest.size()));
+  DirectFileWriter writer;
+  TEST_AND_RETURN_FALSE_ERRNO(writer.Open(payload_file.c_str(),
+                                          O_WRONLY | O_CREAT | O_TRUNC,
+                                          0644) == 0);
+  ScopedFileWriterCloser writer_closer(&writer);
+  TEST_AND_RETURN_FALSE_ERRNO(writer.Write(metadata.data(), metadata.size()));
+
+  // The payload signature covers the metadata and the data blobs up to the
+  // signatures, but not the metadata signature.
+  HashCalculator payload_hasher;
+  TEST_AND_RETURN_FALSE(payload_hasher.Update(metadata.data(), metadata_size));
 
   // Write metadata signature blob.
   if (!private_key_path.empty()) {
+    ScopedGenerationPhase phase("", GenerationPhase::kSigning);
     brillo::Blob metadata_hash;
-    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfFile(
-        payload_file, metadata_size, &metadata_hash));
+    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
+        metadata.data(), metadata_size, &metadata_hash));
     string metadata_signature;
     TEST_AND_RETURN_FALSE(PayloadSigner::SignHashWithKeys(
         metadata_hash, {private_key_path}, &metadata_signature));
@@ -270,32 +366,48 @@ bool PayloadFile::WritePayload(const std::string& payload_file,
         writer.Write(metadata_signature.data(), metadata_signature.size()));
   }
 
-  // Append the data blobs.
+  // Append the data blobs, hashing them as they are written.
   LOG(INFO) << "Writing final delta file data blobs...";
-  int blobs_fd = open(ordered_blobs_file.c_str(), O_RDONLY, 0);
-  ScopedFdCloser blobs_fd_closer(&blobs_fd);
-  TEST_AND_RETURN_FALSE(blobs_fd >= 0);
-  for (;;) {
-    vector<char> buf(1024 * 1024);
-    ssize_t rc = read(blobs_fd, buf.data(), buf.size());
-    if (0 == rc) {
-      // EOF
-      break;
+  const uint64_t signatures_offset = manifest.signatures_offset();
+  uint64_t blobs_written = 0;
+  vector<char> buf(kBlobCopyBufferSize);
+  {
+    // Copying the data blobs in their new order is the bulk of reordering
+    // them.
+    ScopedGenerationPhase phase("", GenerationPhase::kBlobReorder);
+    for (const auto& range : blob_ranges) {
+      for (uint64_t done = 0; done < range.length;) {
+        const size_t to_read =
+            std::min<uint64_t>(buf.size(), range.length - done);
+        const char* data = buf.data();
+        if (range.data) {
+          data = range.data->data() + done;
+        } else {
+          ssize_t bytes_read = 0;
+          TEST_AND_RETURN_FALSE(utils::PReadAll(
+              blobs_fd, buf.data(), to_read, range.offset + done, &bytes_read));
+          TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(to_read));
+        }
+        TEST_AND_RETURN_FALSE_ERRNO(writer.Write(data, to_read));
+        if (blobs_written < signatures_offset) {
+          TEST_AND_RETURN_FALSE(payload_hasher.Update(
+              data,
+              std::min<uint64_t>(to_read, signatures_offset - blobs_written)));
+        }
+        blobs_written += to_read;
+        done += to_read;
+      }
     }
-    TEST_AND_RETURN_FALSE_ERRNO(rc > 0);
-    TEST_AND_RETURN_FALSE_ERRNO(writer.Write(buf.data(), rc));
   }
   // Write payload signature blob.
   if (!private_key_path.empty()) {
+    ScopedGenerationPhase phase("", GenerationPhase::kSigning);
     LOG(INFO) << "Signing the update...";
+    TEST_AND_RETURN_FALSE(blobs_written >= signatures_offset);
+    TEST_AND_RETURN_FALSE(payload_hasher.Finalize());
     string signature;
-    TEST_AND_RETURN_FALSE(PayloadSigner::SignPayload(
-        payload_file,
-        {private_key_path},
-        metadata_size,
-        signature_blob_length,
-        metadata_size + signature_blob_length + manifest.signatures_offset(),
-        &signature));
+    TEST_AND_RETURN_FALSE(PayloadSigner::SignHashWithKeys(
+        payload_hasher.raw_hash(), {private_key_path}, &signature));
     TEST_AND_RETURN_FALSE_ERRNO(
         writer.Write(signature.data(), signature.size()));
   }
@@ -305,46 +417,128 @@ bool PayloadFile::WritePayload(const std::string& payload_file,
   return true;
 }
 
-bool PayloadFile::ReorderDataBlobs(const string& data_blobs_path,
-                                   const string& new_data_blobs_path) {
-  int in_fd = open(data_blobs_path.c_str(), O_RDONLY, 0);
-  TEST_AND_RETURN_FALSE_ERRNO(in_fd >= 0);
-  ScopedFdCloser in_fd_closer(&in_fd);
-
-  DirectFileWriter writer;
-  int rc = writer.Open(
-      new_data_blobs_path.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0644);
-  if (rc != 0) {
-    PLOG(ERROR) << "Error creating " << new_data_blobs_path;
-    return false;
-  }
-  ScopedFileWriterCloser writer_closer(&writer);
+bool PayloadFile::ReorderDataBlobs(int blobs_fd,
+                                   vector<BlobRange>* blob_ranges) {
+  blob_ranges->clear();
   uint64_t out_file_size = 0;
-
   for (auto& part : part_vec_) {
     for (AnnotatedOperation& aop : part.aops) {
       if (!aop.op.has_data_offset())
         continue;
       CHECK(aop.op.has_data_length());
-      brillo::Blob buf(aop.op.data_length());
-      ssize_t rc = pread(in_fd, buf.data(), buf.size(), aop.op.data_offset());
-      TEST_AND_RETURN_FALSE(rc == static_cast<ssize_t>(buf.size()));
-
-      // Add the hash of the data blobs for this operation
-      TEST_AND_RETURN_FALSE(AddOperationHash(&aop.op, buf));
+      // Blobs are hashed with SHA-256 when they are stored, except for the
+      // operations reusing part of the blob of another one.
+      if (!aop.op.has_data_sha256_hash() ||
+          hash_algorithm_ != HashAlgorithm::kSha256) {
+        brillo::Blob buf(aop.op.data_length());
+        ssize_t bytes_read = 0;
+        TEST_AND_RETURN_FALSE(utils::PReadAll(blobs_fd,
+                                              buf.data(),
+                                              buf.size(),
+                                              aop.op.data_offset(),
+                                              &bytes_read));
+        TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(buf.size()));
+        TEST_AND_RETURN_FALSE(AddOperationHash(&aop.op, buf, hash_algorithm_));
+      }
 
+      // Blobs stored one after another stay a single range to copy.
+      if (!blob_ranges->empty() &&
+          blob_ranges->back().offset + blob_ranges->back().length ==
+              aop.op.data_offset()) {
+        blob_ranges->back().length += aop.op.data_length();
+      } else {
+        blob_ranges->push_back({aop.op.data_offset(), aop.op.data_length()});
+      }
       aop.op.set_data_offset(out_file_size);
-      TEST_AND_RETURN_FALSE_ERRNO(writer.Write(buf.data(), buf.size()));
-      out_file_size += buf.size();
+      out_file_size += aop.op.data_length();
+    }
+  }
+  return true;
+}
+
+bool PayloadFile::MoveOperationsToSections(vector<BlobRange>* blob_ranges,
+                                           vector<string>* sections,
+                                           uint64_t* sections_size) {
+  // The offset where the blobs of each partition begin, without the sections.
+  vector<uint64_t> blobs_begin;
+  uint64_t blobs_offset = 0;
+  for (const auto& part : part_vec_) {
+    blobs_begin.push_back(blobs_offset);
+    for (const AnnotatedOperation& aop : part.aops) {
+      if (aop.op.has_data_offset())
+        blobs_offset += aop.op.data_length();
+    }
+  }
+
+  // The sections hold the offsets of the blobs, which move with the size of
+  // the sections before them. They are made again until their sizes settle,
+  // which they do since they only grow with the offsets.
+  sections->assign(part_vec_.size(), string());
+  bool settled = false;
+  while (!settled) {
+    settled = true;
+    uint64_t shift = 0;
+    for (size_t i = 0; i < part_vec_.size(); i++) {
+      if (part_vec_[i].aops.empty())
+        continue;
+      const uint64_t section_offset = blobs_begin[i] + shift;
+      shift += (*sections)[i].size();
+      PartitionUpdate* partition = manifest_.mutable_partitions(i);
+      partition->clear_operations();
+      for (const AnnotatedOperation& aop : part_vec_[i].aops) {
+        InstallOperation* op = partition->add_operations();
+        *op = aop.op;
+        if (op->has_data_offset())
+          op->set_data_offset(op->data_offset() + shift);
+        if (manifest_.minor_version() >= kPackedExtentsMinorPayloadVersion)
+          PackOperationExtents(op);
+      }
+      string section;
+      TEST_AND_RETURN_FALSE(MakeOperationsSection(
+          section_offset, hash_algorithm_, partition, &section));
+      settled = settled && section.size() == (*sections)[i].size();
+      (*sections)[i] = std::move(section);
+    }
+  }
+
+  // The blob ranges are split where the sections go.
+  vector<BlobRange> ranges;
+  auto range = blob_ranges->begin();
+  uint64_t range_used = 0;
+  uint64_t position = 0;
+  *sections_size = 0;
+  for (size_t i = 0; i < sections->size(); i++) {
+    const string& section = (*sections)[i];
+    if (section.empty())
+      continue;
+    while (position < blobs_begin[i]) {
+      TEST_AND_RETURN_FALSE(range != blob_ranges->end());
+      const uint64_t length =
+          std::min(range->length - range_used, blobs_begin[i] - position);
+      ranges.push_back({range->offset + range_used, length});
+      range_used += length;
+      position += length;
+      if (range_used == range->length) {
+        range++;
+        range_used = 0;
+      }
     }
+    ranges.push_back({0, section.size(), &section});
+    *sections_size += section.size();
+  }
+  if (range != blob_ranges->end()) {
+    ranges.push_back({range->offset + range_used, range->length - range_used});
+    ranges.insert(ranges.end(), range + 1, blob_ranges->end());
   }
+  *blob_ranges = std::move(ranges);
   return true;
 }
 
 bool PayloadFile::AddOperationHash(InstallOperation* op,
-                                   const brillo::Blob& buf) {
+                                   const brillo::Blob& buf,
+                                   HashAlgorithm algorithm) {
   brillo::Blob hash;
-  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(buf, &hash));
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(buf, &hash, algorithm));
   op->set_data_sha256_hash(hash.data(), hash.size());
   return true;
 }
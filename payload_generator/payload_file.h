@@ -51,8 +51,9 @@ class PayloadFile {
 
   // Write the payload to the |payload_file| file. The operations reference
   // blobs in the |data_blobs_path| file and the blobs will be reordered in the
-  // payload file to match the order of the operations. The size of the metadata
-  // section of the payload is stored in |metadata_size_out|.
+  // payload file to match the order of the operations, in a single pass that
+  // also hashes and signs the payload. The size of the metadata section of the
+  // payload is stored in |metadata_size_out|.
   bool WritePayload(const std::string& payload_file,
                     const std::string& data_blobs_path,
                     const std::string& private_key_path,
@@ -67,24 +68,57 @@ class PayloadFile {
 
  private:
   FRIEND_TEST(PayloadFileTest, ReorderBlobsTest);
+  FRIEND_TEST(PayloadFileTest, OperationsSectionsTest);
+
+  // A range of |length| bytes at |offset| in a data blobs file, or the bytes
+  // of |data| if set.
+  struct BlobRange {
+    uint64_t offset;
+    uint64_t length;
+    const std::string* data{nullptr};
+  };
 
-  // Computes a SHA256 hash of the given buf and sets the hash value in the
-  // operation so that update_engine could verify. This hash should be set
-  // for all operations that have a non-zero data blob. One exception is the
+  // Writes the payload with |manifest| to |payload_file|, copying its data
+  // blobs from the |blob_ranges| of |blobs_fd| in order. The metadata and
+  // payload are hashed and signed with |private_key_path|, if not empty, as
+  // they are written instead of reading them back.
+  static bool WritePayloadFromBlobs(const std::string& payload_file,
+                                    int blobs_fd,
+                                    const std::vector<BlobRange>& blob_ranges,
+                                    const std::string& private_key_path,
+                                    uint64_t major_version_,
+                                    const DeltaArchiveManifest& manifest,
+                                    uint64_t* metadata_size_out);
+
+  // Computes the hash with |algorithm| of the given buf and sets the hash value
+  // in the operation so that update_engine could verify. This hash should be
+  // set for all operations that have a non-zero data blob. One exception is the
   // fake operation for signature blob because the contents of the signature
   // blob will not be available at payload creation time. So, update_engine will
   // gracefully ignore the fake signature operation.
-  static bool AddOperationHash(InstallOperation* op, const brillo::Blob& buf);
+  static bool AddOperationHash(
+      InstallOperation* op,
+      const brillo::Blob& buf,
+      HashAlgorithm algorithm = HashAlgorithm::kSha256);
 
   // Install operations in the manifest may reference data blobs, which
-  // are in data_blobs_path. This function creates a new data blobs file
-  // with the data blobs in the same order as the referencing install
-  // operations in the manifest. E.g. if manifest[0] has a data blob
-  // "X" at offset 1, manifest[1] has a data blob "Y" at offset 0,
-  // and data_blobs_path's file contains "YX", new_data_blobs_path
-  // will set to be a file that contains "XY".
-  bool ReorderDataBlobs(const std::string& data_blobs_path,
-                        const std::string& new_data_blobs_path);
+  // are in |blobs_fd|. This function gives the data blobs new offsets in the
+  // same order as the referencing install operations in the manifest, and
+  // stores in |blob_ranges| the ranges of |blobs_fd| to copy in that order.
+  // E.g. if manifest[0] has a data blob "X" at offset 1, manifest[1] has a
+  // data blob "Y" at offset 0, and |blobs_fd| contains "YX", the ranges are
+  // {1, 1} and {0, 1}, so the payload contains "XY". Operations whose blob
+  // was not hashed when stored are hashed here.
+  bool ReorderDataBlobs(int blobs_fd, std::vector<BlobRange>* blob_ranges);
+
+  // Moves the operations of the partitions of |manifest_| to the operations
+  // sections stored in |sections|, one per partition with operations, stored
+  // before the blobs of their partition. The blobs are moved after them, and
+  // |blob_ranges| is updated to copy the sections in their place too. The
+  // size of all the sections is stored in |sections_size|.
+  bool MoveOperationsToSections(std::vector<BlobRange>* blob_ranges,
+                                std::vector<std::string>* sections,
+                                uint64_t* sections_size);
 
   // Print in stderr the Payload usage report.
   void ReportPayloadUsage(uint64_t metadata_size) const;
@@ -92,6 +126,15 @@ class PayloadFile {
   // The major_version of the requested payload.
   uint64_t major_version_;
 
+  // The algorithm of the hashes of the data.
+  HashAlgorithm hash_algorithm_{HashAlgorithm::kSha256};
+
+  // Whether the operations go in operations sections.
+  bool operations_sections_{false};
+
+  // Whether the partitions get apply hints.
+  bool apply_hints_{false};
+
   DeltaArchiveManifest manifest_;
 
   // Struct has necessary information to write PartitionUpdate in protobuf.
@@ -111,8 +154,14 @@ class PayloadFile {
     // Per partition timestamp.
     std::string version;
     android::snapshot::CowSizeInfo cow_info;
+    PartitionUpdate::OperationOrder operation_order{
+        PartitionUpdate::DESTINATION};
   };
 
+  // The order of the operations of the delta partitions.
+  PartitionUpdate::OperationOrder operation_order_{
+      PartitionUpdate::DESTINATION};
+
   std::vector<Partition> part_vec_;
 };
 
@@ -16,13 +16,19 @@
 
 #include "update_engine/payload_generator/payload_file.h"
 
+#include <fcntl.h>
+
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <gtest/gtest.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/operations_section.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 
 using std::string;
@@ -44,8 +50,8 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   // Kernel operation 1: [0, 6] kernel
   string orig_data = "kernel abcd";
   EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), orig_data));
-
-  ScopedTempFile new_blobs("ReorderBlobsTest.new.XXXXXX");
+  int orig_fd = HANDLE_EINTR(open(orig_blobs.path().c_str(), O_RDONLY));
+  ScopedFdCloser orig_fd_closer(&orig_fd);
 
   payload_.part_vec_.resize(2);
 
@@ -64,14 +70,33 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   aop.op.set_data_length(6);
   payload_.part_vec_[1].aops = {aop};
 
-  EXPECT_TRUE(payload_.ReorderDataBlobs(orig_blobs.path(), new_blobs.path()));
+  vector<PayloadFile::BlobRange> blob_ranges;
+  EXPECT_TRUE(payload_.ReorderDataBlobs(orig_fd, &blob_ranges));
 
   const vector<AnnotatedOperation>& part0_aops = payload_.part_vec_[0].aops;
   const vector<AnnotatedOperation>& part1_aops = payload_.part_vec_[1].aops;
-  string new_data;
-  EXPECT_TRUE(utils::ReadFile(new_blobs.path(), &new_data));
   // Kernel blobs should appear at the end.
-  EXPECT_EQ("bcdakernel", new_data);
+  ASSERT_EQ(3U, blob_ranges.size());
+  EXPECT_EQ(8U, blob_ranges[0].offset);
+  EXPECT_EQ(3U, blob_ranges[0].length);
+  EXPECT_EQ(7U, blob_ranges[1].offset);
+  EXPECT_EQ(1U, blob_ranges[1].length);
+  EXPECT_EQ(0U, blob_ranges[2].offset);
+  EXPECT_EQ(6U, blob_ranges[2].length);
+
+  // The blobs are copied in that order after the metadata.
+  ScopedTempFile payload("ReorderBlobsTest.payload.XXXXXX");
+  uint64_t metadata_size = 0;
+  EXPECT_TRUE(PayloadFile::WritePayloadFromBlobs(payload.path(),
+                                                 orig_fd,
+                                                 blob_ranges,
+                                                 "",
+                                                 kBrilloMajorPayloadVersion,
+                                                 DeltaArchiveManifest(),
+                                                 &metadata_size));
+  string payload_data;
+  EXPECT_TRUE(utils::ReadFile(payload.path(), &payload_data));
+  EXPECT_EQ("bcdakernel", payload_data.substr(metadata_size));
 
   EXPECT_EQ(2U, part0_aops.size());
   EXPECT_EQ(0U, part0_aops[0].op.data_offset());
@@ -82,6 +107,82 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   EXPECT_EQ(1U, part1_aops.size());
   EXPECT_EQ(4U, part1_aops[0].op.data_offset());
   EXPECT_EQ(6U, part1_aops[0].op.data_length());
+
+  // The blobs were not hashed when stored, so they are hashed here.
+  brillo::Blob expected_hash;
+  EXPECT_TRUE(HashCalculator::RawHashOfData(brillo::Blob{'a'}, &expected_hash));
+  EXPECT_EQ(string(expected_hash.begin(), expected_hash.end()),
+            part0_aops[1].op.data_sha256_hash());
+}
+
+TEST_F(PayloadFileTest, OperationsSectionsTest) {
+  ScopedTempFile orig_blobs("OperationsSectionsTest.orig.XXXXXX");
+  string orig_data = "abcdkernel";
+  EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), orig_data));
+  int orig_fd = HANDLE_EINTR(open(orig_blobs.path().c_str(), O_RDONLY));
+  ScopedFdCloser orig_fd_closer(&orig_fd);
+
+  // Rootfs has two operations with blobs and one without, boot has none and
+  // kernel has one operation with a blob.
+  payload_.part_vec_.resize(3);
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::REPLACE);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(3);
+  payload_.part_vec_[0].aops.push_back(aop);
+  aop.op.set_data_offset(3);
+  aop.op.set_data_length(1);
+  payload_.part_vec_[0].aops.push_back(aop);
+  AnnotatedOperation zero_aop;
+  zero_aop.op.set_type(InstallOperation::ZERO);
+  payload_.part_vec_[0].aops.push_back(zero_aop);
+  aop.op.set_data_offset(4);
+  aop.op.set_data_length(6);
+  payload_.part_vec_[2].aops.push_back(aop);
+  for (const char* name : {"rootfs", "boot", "kernel"})
+    payload_.manifest_.add_partitions()->set_partition_name(name);
+
+  vector<PayloadFile::BlobRange> blob_ranges = {{0, 10}};
+  vector<string> sections;
+  uint64_t sections_size = 0;
+  ASSERT_TRUE(payload_.MoveOperationsToSections(
+      &blob_ranges, &sections, &sections_size));
+  ASSERT_EQ(3U, sections.size());
+  EXPECT_TRUE(sections[1].empty());
+  EXPECT_EQ(sections[0].size() + sections[2].size(), sections_size);
+
+  ScopedTempFile payload("OperationsSectionsTest.payload.XXXXXX");
+  uint64_t metadata_size = 0;
+  EXPECT_TRUE(PayloadFile::WritePayloadFromBlobs(payload.path(),
+                                                 orig_fd,
+                                                 blob_ranges,
+                                                 "",
+                                                 kBrilloMajorPayloadVersion,
+                                                 DeltaArchiveManifest(),
+                                                 &metadata_size));
+  string payload_data;
+  EXPECT_TRUE(utils::ReadFile(payload.path(), &payload_data));
+  const string blobs = payload_data.substr(metadata_size);
+  EXPECT_EQ(sections[0] + "abcd" + sections[2] + "kernel", blobs);
+
+  // The operations point to their blobs after the sections.
+  DeltaArchiveManifest manifest = payload_.manifest_;
+  EXPECT_EQ(0, manifest.partitions(0).operations_size());
+  ASSERT_TRUE(ParseOperationsSections(
+      reinterpret_cast<const uint8_t*>(blobs.data()), blobs.size(), &manifest));
+  const PartitionUpdate& rootfs = manifest.partitions(0);
+  ASSERT_EQ(3, rootfs.operations_size());
+  EXPECT_EQ("abc",
+            blobs.substr(rootfs.operations(0).data_offset(),
+                         rootfs.operations(0).data_length()));
+  EXPECT_EQ(sections[0].size() + 3, rootfs.operations(1).data_offset());
+  EXPECT_FALSE(rootfs.operations(2).has_data_offset());
+  EXPECT_FALSE(manifest.partitions(1).has_operations_section());
+  const PartitionUpdate& kernel = manifest.partitions(2);
+  ASSERT_EQ(1, kernel.operations_size());
+  EXPECT_EQ("kernel",
+            blobs.substr(kernel.operations(0).data_offset(),
+                         kernel.operations(0).data_length()));
 }
 
 }  // namespace chromeos_update_engine
@@ -18,6 +18,7 @@
 
 #include <algorithm>
 #include <charconv>
+#include <numeric>
 #include <utility>
 
 #include <android-base/parseint.h>
@@ -30,10 +31,13 @@
 #include "payload_consumer/payload_constants.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/boot_img_filesystem.h"
+#include "update_engine/payload_generator/cached_filesystem.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/diff_cache.h"
 #include "update_engine/payload_generator/erofs_filesystem.h"
 #include "update_engine/payload_generator/ext2_filesystem.h"
+#include "update_engine/payload_generator/generation_profile.h"
 #include "update_engine/payload_generator/mapfile_filesystem.h"
 #include "update_engine/payload_generator/raw_filesystem.h"
 #include "update_engine/payload_generator/squashfs_filesystem.h"
@@ -44,7 +48,8 @@ using std::string;
 namespace chromeos_update_engine {
 
 bool PostInstallConfig::IsEmpty() const {
-  return !run && path.empty() && filesystem_type.empty() && !optional;
+  return !run && path.empty() && filesystem_type.empty() && !optional &&
+         !independent && cache_files.empty();
 }
 
 bool VerityConfig::IsEmpty() const {
@@ -59,9 +64,11 @@ void VerityConfig::Clear() {
   hash_tree_extent.Clear();
   hash_tree_algorithm.clear();
   hash_tree_salt.clear();
+  hash_tree_root_digest.clear();
   fec_data_extent.Clear();
   fec_extent.Clear();
   fec_roots = 0;
+  data_in_payload = false;
 }
 
 bool PartitionConfig::ValidateExists() const {
@@ -77,7 +84,31 @@ bool PartitionConfig::ValidateExists() const {
 bool PartitionConfig::OpenFilesystem() {
   if (path.empty())
     return true;
+  ScopedGenerationPhase phase(name, GenerationPhase::kFilesystemParse);
   fs_interface.reset();
+  string cache_key;
+  if (filesystem_cache) {
+    cache_key = FilesystemCacheKey(*this);
+    brillo::Blob data;
+    if (!cache_key.empty() && filesystem_cache->Lookup(cache_key, &data)) {
+      fs_interface = CachedFilesystem::Deserialize(data);
+      if (fs_interface) {
+        LOG(INFO) << "Using the cached filesystem of " << path;
+        TEST_AND_RETURN_FALSE(fs_interface->GetBlockSize() == kBlockSize);
+        return true;
+      }
+      LOG(WARNING) << "Ignoring the invalid cached filesystem of " << path;
+    }
+  }
+  TEST_AND_RETURN_FALSE(ParseFilesystem());
+  brillo::Blob data;
+  if (!cache_key.empty() && CachedFilesystem::Serialize(*fs_interface, &data)) {
+    filesystem_cache->Store(cache_key, data);
+  }
+  return true;
+}
+
+bool PartitionConfig::ParseFilesystem() {
   if (diff_utils::IsExtFilesystem(path)) {
     fs_interface = Ext2Filesystem::CreateFromFile(path);
     // TODO(deymo): The delta generator algorithm doesn't support a block size
@@ -148,6 +179,14 @@ bool ImageConfig::LoadPostInstallConfig(const brillo::KeyValueStore& store) {
                     &part.postinstall.filesystem_type);
     store.GetBoolean("POSTINSTALL_OPTIONAL_" + part.name,
                      &part.postinstall.optional);
+    store.GetBoolean("POSTINSTALL_INDEPENDENT_" + part.name,
+                     &part.postinstall.independent);
+    std::string cache_files;
+    if (store.GetString("POSTINSTALL_CACHE_FILES_" + part.name,
+                        &cache_files)) {
+      part.postinstall.cache_files =
+          brillo::string_utils::Split(cache_files, " ");
+    }
   }
   if (!found_postinstall) {
     LOG(ERROR) << "No valid postinstall config found.";
@@ -283,7 +322,12 @@ bool PayloadVersion::Validate() const {
                         minor == kVerityMinorPayloadVersion ||
                         minor == kPartialUpdateMinorPayloadVersion ||
                         minor == kZucchiniMinorPayloadVersion ||
-                        minor == kLZ4DIFFMinorPayloadVersion);
+                        minor == kLZ4DIFFMinorPayloadVersion ||
+                        minor == kZstdMinorPayloadVersion ||
+                        minor == kChunkedHashMinorPayloadVersion ||
+                        minor == kPackedExtentsMinorPayloadVersion ||
+                        minor == kDataHashAlgorithmMinorPayloadVersion ||
+                        minor == kOperationsSectionMinorPayloadVersion);
   return true;
 }
 
@@ -298,6 +342,12 @@ bool PayloadVersion::OperationAllowed(InstallOperation::Type operation) const {
       // payloads.
       return true;
 
+    case InstallOperation::REPLACE_ZSTD:
+      // Full payloads keep their minor version, clients not knowing this
+      // operation fail to parse the manifest before writing anything.
+      return minor == kFullPayloadMinorVersion ||
+             minor >= kZstdMinorPayloadVersion;
+
     case InstallOperation::ZERO:
     case InstallOperation::DISCARD:
       // The implementation of these operations had a bug in earlier versions
@@ -367,12 +417,54 @@ bool PayloadGenerationConfig::Validate() const {
   TEST_AND_RETURN_FALSE(hard_chunk_size == -1 ||
                         hard_chunk_size % block_size == 0);
   TEST_AND_RETURN_FALSE(soft_chunk_size % block_size == 0);
+  TEST_AND_RETURN_FALSE(target_operation_size % block_size == 0);
+  TEST_AND_RETURN_FALSE(large_file_chunk_size % block_size == 0);
 
   TEST_AND_RETURN_FALSE(rootfs_partition_size % block_size == 0);
 
+  // Both reorder the operations.
+  TEST_AND_RETURN_FALSE(!cow_merge_order_layout ||
+                        operation_order == PartitionUpdate::DESTINATION);
+
+  TEST_AND_RETURN_FALSE(num_shards > 0 && shard_index < num_shards);
+
+  if (data_hash_algorithm != HashAlgorithm::kSha256) {
+    TEST_AND_RETURN_FALSE(
+        version.minor == kFullPayloadMinorVersion ||
+        version.minor >= kDataHashAlgorithmMinorPayloadVersion);
+  }
+  if (operations_sections) {
+    TEST_AND_RETURN_FALSE(
+        version.minor == kFullPayloadMinorVersion ||
+        version.minor >= kOperationsSectionMinorPayloadVersion);
+  }
+
   return true;
 }
 
+std::vector<size_t> PayloadGenerationConfig::GetShardPartitions() const {
+  const auto& partitions = target.partitions;
+  std::vector<size_t> by_size(partitions.size());
+  std::iota(by_size.begin(), by_size.end(), 0);
+  std::stable_sort(
+      by_size.begin(), by_size.end(), [&partitions](size_t a, size_t b) {
+        return partitions[a].size > partitions[b].size;
+      });
+
+  std::vector<uint64_t> shard_sizes(num_shards, 0);
+  std::vector<size_t> shard_partitions;
+  for (size_t i : by_size) {
+    const size_t shard =
+        std::min_element(shard_sizes.begin(), shard_sizes.end()) -
+        shard_sizes.begin();
+    shard_sizes[shard] += partitions[i].size;
+    if (shard == shard_index)
+      shard_partitions.push_back(i);
+  }
+  std::sort(shard_partitions.begin(), shard_partitions.end());
+  return shard_partitions;
+}
+
 void PayloadGenerationConfig::ParseCompressorTypes(
     const std::string& compressor_types) {
   auto types = brillo::string_utils::Split(compressor_types, ":");
@@ -392,8 +484,42 @@ void PayloadGenerationConfig::ParseCompressorTypes(
   }
 }
 
+bool PayloadGenerationConfig::ParseTargetDeviceProfile(
+    const std::string& profile) {
+  // With "cpu_limited", a PUFFDIFF operation must save 4% of the size of the
+  // target data over a SOURCE_BSDIFF one to be picked, and 0.8% with
+  // "balanced".
+  if (profile == "bandwidth_limited") {
+    apply_cost_weight = 0;
+  } else if (profile == "balanced") {
+    apply_cost_weight = 0.002;
+  } else if (profile == "cpu_limited") {
+    apply_cost_weight = 0.01;
+  } else {
+    LOG(ERROR) << "Unknown target device profile: " << profile;
+    return false;
+  }
+  return true;
+}
+
+bool PayloadGenerationConfig::ParseOperationOrder(const std::string& order) {
+  if (order == "destination") {
+    operation_order = PartitionUpdate::DESTINATION;
+  } else if (order == "source") {
+    operation_order = PartitionUpdate::SOURCE;
+  } else {
+    LOG(ERROR) << "Unknown operation order: " << order;
+    return false;
+  }
+  return true;
+}
+
 bool PayloadGenerationConfig::OperationEnabled(
     InstallOperation::Type op) const noexcept {
+  if (op == InstallOperation::ZERO &&
+      version.minor == kFullPayloadMinorVersion) {
+    return enable_full_zero;
+  }
   if (!version.OperationAllowed(op)) {
     return false;
   }
@@ -405,11 +531,26 @@ bool PayloadGenerationConfig::OperationEnabled(
       return enable_lz4diff;
     case InstallOperation::PUFFDIFF:
       return enable_puffdiff;
+    case InstallOperation::REPLACE_ZSTD:
+      return enable_zstd;
     default:
       return true;
   }
 }
 
+namespace {
+
+int ParseCompressionLevel(std::string_view level, std::string_view param) {
+  int level_num = 0;
+  const auto [ptr, ec] =
+      std::from_chars(level.data(), level.data() + level.size(), level_num);
+  CHECK_EQ(ec, std::errc()) << "Failed to parse compression level " << level
+                            << ", compression param: " << param;
+  return level_num;
+}
+
+}  // namespace
+
 CompressionAlgorithm PartitionConfig::ParseCompressionParam(
     std::string_view param) {
   CompressionAlgorithm algo;
@@ -426,17 +567,17 @@ CompressionAlgorithm PartitionConfig::ParseCompressionParam(
   } else if (algo_name == "lz4hc") {
     algo.set_type(CompressionAlgorithm::LZ4HC);
     if (pos != std::string::npos) {
-      const auto level = param.substr(pos + 1);
-      int level_num = 0;
-      const auto [ptr, ec] =
-          std::from_chars(level.data(), level.data() + level.size(), level_num);
-      CHECK_EQ(ec, std::errc()) << "Failed to parse compression level " << level
-                                << ", compression param: " << param;
-      algo.set_level(level_num);
+      algo.set_level(ParseCompressionLevel(param.substr(pos + 1), param));
     } else {
       LOG(FATAL) << "Unrecognized compression type: " << algo_name
                  << ", param: " << param;
     }
+  } else if (algo_name == "zstd") {
+    // Without a level, zstd's default level, which 0 selects, is used.
+    algo.set_type(CompressionAlgorithm::ZSTD);
+    if (pos != std::string::npos) {
+      algo.set_level(ParseCompressionLevel(param.substr(pos + 1), param));
+    }
   }
   return algo;
 }
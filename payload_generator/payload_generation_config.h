@@ -27,11 +27,15 @@
 #include <brillo/secure_blob.h>
 
 #include "bsdiff/constants.h"
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
 
+class DiffCacheInterface;
+class SuffixArrayCache;
+
 struct PostInstallConfig {
   // Whether the postinstall config is empty.
   bool IsEmpty() const;
@@ -50,6 +54,14 @@ struct PostInstallConfig {
 
   // Whether this postinstall script should be ignored if it fails.
   bool optional = false;
+
+  // Whether this postinstall script may run at the same time as those of the
+  // other partitions.
+  bool independent = false;
+
+  // The files, relative to the root of this filesystem, the post-install
+  // program is expected to read.
+  std::vector<std::string> cache_files;
 };
 
 // Data will be written to the payload and used for hash tree and FEC generation
@@ -73,6 +85,9 @@ struct VerityConfig {
   // The salt used for verity hash tree.
   brillo::Blob hash_tree_salt;
 
+  // The root digest of the verity hash tree.
+  brillo::Blob hash_tree_root_digest;
+
   // The extent for data covered by FEC.
   Extent fec_data_extent;
 
@@ -81,6 +96,11 @@ struct VerityConfig {
 
   // The number of FEC roots.
   uint32_t fec_roots = 0;
+
+  // Whether the payload writes the hash tree and FEC data from the target
+  // image, for the device not to compute them. Trades payload size for the
+  // time the device spends on them.
+  bool data_in_payload = false;
 };
 
 struct PartitionConfig {
@@ -98,9 +118,14 @@ struct PartitionConfig {
   bool ValidateExists() const;
 
   // Open then filesystem stored in this partition and stores it in
-  // |fs_interface|. Returns whether opening the filesystem worked.
+  // |fs_interface|, reusing the result of a previous generation if it is in
+  // |filesystem_cache|. Returns whether opening the filesystem worked.
   bool OpenFilesystem();
 
+  // Parses the filesystem stored in this partition into |fs_interface|,
+  // falling back to a raw filesystem when no parser recognizes it.
+  bool ParseFilesystem();
+
   // The path to the partition file. This can be a regular file or a block
   // device such as a loop device.
   std::string path;
@@ -122,6 +147,10 @@ struct PartitionConfig {
   // files.
   std::unique_ptr<FilesystemInterface> fs_interface;
 
+  // Cache of the filesystems parsed by previous generations, keyed by the image
+  // content. Disabled if null.
+  std::shared_ptr<DiffCacheInterface> filesystem_cache;
+
   std::string name;
 
   PostInstallConfig postinstall;
@@ -202,6 +231,15 @@ struct PayloadGenerationConfig {
 
   void ParseCompressorTypes(const std::string& compressor_types);
 
+  // Sets |apply_cost_weight| for the devices of |profile|: "bandwidth_limited"
+  // for the smallest payload, "cpu_limited" or "balanced" in between. Returns
+  // false for an unknown profile.
+  bool ParseTargetDeviceProfile(const std::string& profile);
+
+  // Sets |operation_order| from |order|, "destination" or "source". Returns
+  // false for an unknown order.
+  bool ParseOperationOrder(const std::string& order);
+
   // Image information about the new image that's the target of this payload.
   ImageConfig target;
 
@@ -239,6 +277,12 @@ struct PayloadGenerationConfig {
   // chunks.
   size_t soft_chunk_size = 2 * 1024 * 1024;
 
+  // Files bigger than |large_file_chunk_size| are diffed in chunks of that
+  // size on separate threads, each against the part of the old file around
+  // the same relative position. 0 keeps diffing files whole, up to
+  // |hard_chunk_size|.
+  uint64_t large_file_chunk_size = 0;
+
   // TODO(deymo): Remove the block_size member and maybe replace it with a
   // minimum alignment size for blocks (if needed). Algorithms should be able to
   // pick the block_size they want, but for now only 4 KiB is supported.
@@ -255,6 +299,16 @@ struct PayloadGenerationConfig {
   // Whether to enable VABC xor op
   bool enable_vabc_xor = false;
 
+  // Whether to order the operations of VABC partitions so that their COW_XOR
+  // data is written in merge order.
+  bool cow_merge_order_layout = false;
+
+  // The order of the operations of the delta partitions: by destination, or
+  // by source for the devices where reading the source partition at random
+  // holds up applying the payload.
+  PartitionUpdate::OperationOrder operation_order =
+      PartitionUpdate::DESTINATION;
+
   // Whether to enable LZ4diff ops
   bool enable_lz4diff = false;
 
@@ -264,14 +318,102 @@ struct PayloadGenerationConfig {
   // Whether to enable puffdiff ops
   bool enable_puffdiff = true;
 
+  // Whether to enable REPLACE_ZSTD ops
+  bool enable_zstd = false;
+
+  // Whether full payloads may hold ZERO ops for the chunks of zeros, which
+  // clients older than the fix of their implementation fail to apply.
+  bool enable_full_zero = false;
+
+  // The algorithm of the hashes of the data, other than SHA-256 only on full
+  // payloads and minor version 13 or newer.
+  HashAlgorithm data_hash_algorithm = HashAlgorithm::kSha256;
+
+  // Whether the operations of the partitions are stored in operations
+  // sections before their data blobs instead of in the manifest, only on full
+  // payloads and minor version 14 or newer.
+  bool operations_sections = false;
+
+  // The size in bytes the SOURCE_COPY and REPLACE_* operations of delta
+  // payloads are split or merged toward, for the cost of applying them on
+  // the device, or 0 to keep them as generated.
+  size_t target_operation_size = 0;
+
+  // Whether to add the apply hints to the partitions, for the clients to
+  // schedule applying their operations. Older clients ignore them.
+  bool apply_hints = false;
+
+  // The uncompressed size of the blocks of the data of REPLACE_XZ operations,
+  // which clients decode on several threads, or 0 for a single block.
+  size_t xz_block_size = 0;
+
+  // The entropy in bits per byte, estimated from a sample, from which the data
+  // of full operations is stored uncompressed without trying the compressors,
+  // or 0 to always try them. Random data has close to 8 bits per byte.
+  double incompressible_entropy = 7.99;
+
+  // How much the time the devices take to apply an operation counts when
+  // picking the diff algorithm, against the size of its data: its estimated
+  // apply time relative to a SOURCE_BSDIFF one, times this fraction of the
+  // size of the target data, is added to the size of its data. 0 for the
+  // smallest data.
+  double apply_cost_weight = 0;
+
   std::string security_patch_level;
 
   uint32_t max_threads = 0;
 
+  // The memory that diffing operations may take at once, in bytes, as
+  // estimated from their size and algorithms. Operations wait for enough of
+  // it to be free. 0 for no limit.
+  uint64_t max_memory = 0;
+
+  // Only compress one chunk of raw blocks out of this many when estimating
+  // the COW size, and extrapolate the size of the others. 1 compresses all
+  // of them.
+  uint32_t cow_estimate_sample_interval = 1;
+
+  // Estimate the COW size with the compression factor of the dynamic
+  // partition metadata instead of the block size. The estimate matches the
+  // size of the COW images the device writes more closely, so that less of
+  // /data is reserved for them, but leaves them no headroom.
+  bool cow_estimate_with_compression_factor = false;
+
   std::vector<bsdiff::CompressorType> compressors{
       bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli};
 
+  // Where to look up the diff patches before generating them, and to store
+  // them after. May be null.
+  std::shared_ptr<DiffCacheInterface> diff_cache;
+
+  // Payloads generated before from the same source build, whose partitions
+  // which didn't change since are reused instead of generated again. Empty
+  // to generate all of them. These are also the payloads of the shards
+  // merged into the whole payload.
+  std::vector<std::string> reuse_payload_paths;
+
+  // Only generate the partitions of shard |shard_index| out of |num_shards|,
+  // those GetShardPartitions() returns, into a payload of these partitions
+  // only. The payloads of all the shards, generated on different hosts from
+  // the same images and options, are then merged into the payload of all
+  // the partitions by passing them in |reuse_payload_paths|.
+  size_t num_shards = 1;
+  size_t shard_index = 0;
+
+  // Where bsdiff keeps the suffix arrays of old data to diff it against other
+  // new data. May be null.
+  std::shared_ptr<SuffixArrayCache> suffix_array_cache;
+
+  // bsdiff builds the suffix arrays of old data of at least this many bytes
+  // on several threads. 0 to always build them on the thread diffing.
+  uint64_t parallel_suffix_array_min_size = 0;
+
   [[nodiscard]] bool OperationEnabled(InstallOperation::Type op) const noexcept;
+
+  // Returns the indices in |target.partitions| of the partitions of shard
+  // |shard_index|. The partitions are spread over the shards by size, the
+  // largest first, each going to the shard with the least data so far.
+  std::vector<size_t> GetShardPartitions() const;
 };
 
 }  // namespace chromeos_update_engine
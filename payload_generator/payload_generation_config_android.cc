@@ -52,6 +52,9 @@ bool AvbDescriptorCallback(const AvbDescriptor* descriptor, void* user_data) {
                         sizeof(AvbHashtreeDescriptor) +
                         hashtree.partition_name_len;
   part->verity.hash_tree_salt.assign(salt, salt + hashtree.salt_len);
+  const uint8_t* root_digest = salt + hashtree.salt_len;
+  part->verity.hash_tree_root_digest.assign(
+      root_digest, root_digest + hashtree.root_digest_len);
 
   TEST_AND_RETURN_FALSE(hashtree.data_block_size ==
                         part->fs_interface->GetBlockSize());
@@ -195,6 +198,8 @@ bool ImageConfig::LoadVerityConfig() {
           TEST_AND_RETURN_FALSE(
               base::StringToUint64(verity_table[6], &hash_start_block));
           part.verity.hash_tree_algorithm = verity_table[7];
+          TEST_AND_RETURN_FALSE(base::HexStringToBytes(
+              verity_table[8], &part.verity.hash_tree_root_digest));
           TEST_AND_RETURN_FALSE(base::HexStringToBytes(
               verity_table[9], &part.verity.hash_tree_salt));
           auto hash_function =
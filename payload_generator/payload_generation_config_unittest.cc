@@ -16,7 +16,9 @@
 
 #include "update_engine/payload_generator/payload_generation_config.h"
 
+#include <string>
 #include <utility>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -39,6 +41,35 @@ TEST_F(PayloadGenerationConfigTest, SimpleLoadPostInstallConfigTest) {
   EXPECT_EQ("postinstall", image_config.partitions[0].postinstall.path);
   EXPECT_EQ("ext4", image_config.partitions[0].postinstall.filesystem_type);
   EXPECT_TRUE(image_config.partitions[0].postinstall.optional);
+  EXPECT_FALSE(image_config.partitions[0].postinstall.independent);
+}
+
+TEST_F(PayloadGenerationConfigTest, LoadIndependentPostInstallConfigTest) {
+  ImageConfig image_config;
+  image_config.partitions.emplace_back("system");
+  image_config.partitions.emplace_back("product");
+  brillo::KeyValueStore store;
+  EXPECT_TRUE(
+      store.LoadFromString("RUN_POSTINSTALL_system=true\n"
+                           "RUN_POSTINSTALL_product=true\n"
+                           "POSTINSTALL_INDEPENDENT_product=true"));
+  EXPECT_TRUE(image_config.LoadPostInstallConfig(store));
+  EXPECT_FALSE(image_config.partitions[0].postinstall.independent);
+  EXPECT_TRUE(image_config.partitions[1].postinstall.independent);
+}
+
+TEST_F(PayloadGenerationConfigTest, LoadPostInstallCacheFilesTest) {
+  ImageConfig image_config;
+  image_config.partitions.emplace_back("system");
+  brillo::KeyValueStore store;
+  EXPECT_TRUE(store.LoadFromString(
+      "RUN_POSTINSTALL_system=true\n"
+      "POSTINSTALL_CACHE_FILES_system=framework/boot.art "
+      "framework/oat/arm64/services.odex"));
+  EXPECT_TRUE(image_config.LoadPostInstallConfig(store));
+  EXPECT_EQ((std::vector<std::string>{"framework/boot.art",
+                                      "framework/oat/arm64/services.odex"}),
+            image_config.partitions[0].postinstall.cache_files);
 }
 
 TEST_F(PayloadGenerationConfigTest, LoadPostInstallConfigNameMismatchTest) {
@@ -142,4 +173,27 @@ TEST_F(PayloadGenerationConfigTest, ValidateDynamicPartitionMetadataTooBig) {
 
   EXPECT_FALSE(image_config.ValidateDynamicPartitionMetadata());
 }
+
+TEST_F(PayloadGenerationConfigTest, ParseTargetDeviceProfileTest) {
+  PayloadGenerationConfig config;
+  EXPECT_EQ(0, config.apply_cost_weight);
+  ASSERT_TRUE(config.ParseTargetDeviceProfile("cpu_limited"));
+  const double cpu_limited_weight = config.apply_cost_weight;
+  ASSERT_TRUE(config.ParseTargetDeviceProfile("balanced"));
+  EXPECT_GT(cpu_limited_weight, config.apply_cost_weight);
+  EXPECT_GT(config.apply_cost_weight, 0);
+  ASSERT_TRUE(config.ParseTargetDeviceProfile("bandwidth_limited"));
+  EXPECT_EQ(0, config.apply_cost_weight);
+  EXPECT_FALSE(config.ParseTargetDeviceProfile("fast"));
+}
+
+TEST_F(PayloadGenerationConfigTest, ParseOperationOrderTest) {
+  PayloadGenerationConfig config;
+  EXPECT_EQ(PartitionUpdate::DESTINATION, config.operation_order);
+  ASSERT_TRUE(config.ParseOperationOrder("source"));
+  EXPECT_EQ(PartitionUpdate::SOURCE, config.operation_order);
+  ASSERT_TRUE(config.ParseOperationOrder("destination"));
+  EXPECT_EQ(PartitionUpdate::DESTINATION, config.operation_order);
+  EXPECT_FALSE(config.ParseOperationOrder("random"));
+}
 }  // namespace chromeos_update_engine
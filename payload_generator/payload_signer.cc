@@ -17,11 +17,17 @@
 #include "update_engine/payload_generator/payload_signer.h"
 
 #include <endian.h>
+#include <fcntl.h>
 
+#include <algorithm>
+#include <functional>
 #include <memory>
 #include <utility>
 
+#include <base/files/file_path.h>
+#include <base/files/file_util.h>
 #include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
@@ -34,6 +40,9 @@
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/subprocess.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/file_writer.h"
+#include "update_engine/payload_consumer/packed_extents.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/payload_metadata.h"
 #include "update_engine/payload_consumer/payload_verifier.h"
 #include "update_engine/update_metadata.pb.h"
@@ -76,90 +85,96 @@ bool ConvertSignaturesToProtobuf(const vector<brillo::Blob>& signatures,
   return true;
 }
 
-// Given an unsigned payload under |payload_path| and the |payload_signature|
-// and |metadata_signature| generates an updated payload that includes the
-// signatures. It populates |out_metadata_size| with the size of the final
-// manifest after adding the fake signature operation, and
-// |out_signatures_offset| with the expected offset for the new blob, and
-// |out_metadata_signature_size| which will be size of |metadata_signature|
-// if the payload major version supports metadata signature, 0 otherwise.
+// Size of the buffer used to read the data blobs of a payload.
+constexpr size_t kPayloadCopyBufferSize = 1024 * 1024;
+
+// A payload given new signatures: its updated header and manifest, to be
+// followed by the range of the original payload file holding the data blobs.
+struct ResignedPayload {
+  brillo::Blob metadata;
+  uint64_t data_offset{};
+  uint64_t data_length{};
+};
+
+// Reads the metadata of the payload under |payload_path| and updates it for a
+// metadata signature of |metadata_signature_size| bytes and a payload signature
+// of |payload_signature_size| bytes, replacing any existing signatures. Only
+// the metadata is read, so that the data blobs are read once when resigning.
 // Returns true on success, false otherwise.
-bool AddSignatureBlobToPayload(const string& payload_path,
-                               const string& payload_signature,
-                               const string& metadata_signature,
-                               brillo::Blob* out_payload,
-                               uint64_t* out_metadata_size,
-                               uint32_t* out_metadata_signature_size,
-                               uint64_t* out_signatures_offset) {
-  uint64_t manifest_offset = 20;
-  const int kProtobufSizeOffset = 12;
+bool ResignPayloadMetadata(const string& payload_path,
+                           uint32_t metadata_signature_size,
+                           uint64_t payload_signature_size,
+                           ResignedPayload* out_payload) {
+  const uint64_t kProtobufSizeOffset = 12;
 
-  brillo::Blob payload;
-  TEST_AND_RETURN_FALSE(utils::ReadFile(payload_path, &payload));
   PayloadMetadata payload_metadata;
-  TEST_AND_RETURN_FALSE(payload_metadata.ParsePayloadHeader(payload));
-  uint64_t metadata_size = payload_metadata.GetMetadataSize();
-  uint32_t metadata_signature_size =
-      payload_metadata.GetMetadataSignatureSize();
-  // Write metadata signature size in header.
-  uint32_t metadata_signature_size_be = htobe32(metadata_signature.size());
-  memcpy(payload.data() + manifest_offset,
-         &metadata_signature_size_be,
-         sizeof(metadata_signature_size_be));
-  manifest_offset += sizeof(metadata_signature_size_be);
-  // Replace metadata signature.
-  payload.erase(payload.begin() + metadata_size,
-                payload.begin() + metadata_size + metadata_signature_size);
-  payload.insert(payload.begin() + metadata_size,
-                 metadata_signature.begin(),
-                 metadata_signature.end());
-  metadata_signature_size = metadata_signature.size();
-  LOG(INFO) << "Metadata signature size: " << metadata_signature_size;
-
   DeltaArchiveManifest manifest;
-  TEST_AND_RETURN_FALSE(payload_metadata.GetManifest(payload, &manifest));
-
-  // Erase existing signatures.
-  if (manifest.has_signatures_offset()) {
-    payload.resize(manifest.signatures_offset() + metadata_size +
-                   metadata_signature_size);
-  }
+  TEST_AND_RETURN_FALSE(
+      payload_metadata.ParsePayloadFile(payload_path, &manifest, nullptr));
+  const off_t payload_size = utils::FileSize(payload_path);
+  out_payload->data_offset = payload_metadata.GetMetadataSize() +
+                             payload_metadata.GetMetadataSignatureSize();
+  TEST_AND_RETURN_FALSE(payload_size >= 0 &&
+                        static_cast<uint64_t>(payload_size) >=
+                            out_payload->data_offset);
+  // Existing signatures are dropped.
+  out_payload->data_length = manifest.has_signatures_offset()
+                                 ? manifest.signatures_offset()
+                                 : payload_size - out_payload->data_offset;
+  TEST_AND_RETURN_FALSE(out_payload->data_offset + out_payload->data_length <=
+                        static_cast<uint64_t>(payload_size));
+  LOG(INFO) << "Metadata signature size: " << metadata_signature_size;
 
   // Updates the manifest to include the signature operation.
   PayloadSigner::AddSignatureToManifest(
-      payload.size() - metadata_size - metadata_signature_size,
-      payload_signature.size(),
-      &manifest);
-
-  // Updates the payload to include the new manifest.
+      out_payload->data_length, payload_signature_size, &manifest);
+  // The extents were unpacked when parsing the manifest.
+  if (manifest.minor_version() >= kPackedExtentsMinorPayloadVersion)
+    PackManifestExtents(&manifest);
   string serialized_manifest;
   TEST_AND_RETURN_FALSE(manifest.AppendToString(&serialized_manifest));
   LOG(INFO) << "Updated protobuf size: " << serialized_manifest.size();
-  payload.erase(payload.begin() + manifest_offset,
-                payload.begin() + metadata_size);
-  payload.insert(payload.begin() + manifest_offset,
-                 serialized_manifest.begin(),
-                 serialized_manifest.end());
 
-  // Updates the protobuf size.
+  // The header keeps the magic and major version, followed by the new protobuf
+  // and metadata signature sizes.
+  brillo::Blob& metadata = out_payload->metadata;
+  metadata.clear();
+  TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
+      payload_path, 0, kProtobufSizeOffset, &metadata));
+  TEST_AND_RETURN_FALSE(metadata.size() == kProtobufSizeOffset);
   uint64_t size_be = htobe64(serialized_manifest.size());
-  memcpy(&payload[kProtobufSizeOffset], &size_be, sizeof(size_be));
-  metadata_size = serialized_manifest.size() + manifest_offset;
+  const auto* size_bytes = reinterpret_cast<const uint8_t*>(&size_be);
+  metadata.insert(metadata.end(), size_bytes, size_bytes + sizeof(size_be));
+  uint32_t metadata_signature_size_be = htobe32(metadata_signature_size);
+  size_bytes = reinterpret_cast<const uint8_t*>(&metadata_signature_size_be);
+  metadata.insert(metadata.end(),
+                  size_bytes,
+                  size_bytes + sizeof(metadata_signature_size_be));
+  metadata.insert(
+      metadata.end(), serialized_manifest.begin(), serialized_manifest.end());
+  LOG(INFO) << "Updated metadata size: " << metadata.size();
+  return true;
+}
 
-  LOG(INFO) << "Updated payload size: " << payload.size();
-  LOG(INFO) << "Updated metadata size: " << metadata_size;
-  uint64_t signatures_offset =
-      metadata_size + metadata_signature_size + manifest.signatures_offset();
-  LOG(INFO) << "Signature Blob Offset: " << signatures_offset;
-  payload.resize(signatures_offset);
-  payload.insert(payload.begin() + signatures_offset,
-                 payload_signature.begin(),
-                 payload_signature.end());
-
-  *out_payload = std::move(payload);
-  *out_metadata_size = metadata_size;
-  *out_metadata_signature_size = metadata_signature_size;
-  *out_signatures_offset = signatures_offset;
+// Reads |length| bytes of |path| from |offset|, passing them in chunks to
+// |sink|. Returns false if the file is shorter or |sink| fails.
+bool StreamFileRange(const string& path,
+                     uint64_t offset,
+                     uint64_t length,
+                     const std::function<bool(const void*, size_t)>& sink) {
+  int fd = HANDLE_EINTR(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  vector<uint8_t> buf(std::min<uint64_t>(kPayloadCopyBufferSize, length));
+  for (uint64_t done = 0; done < length;) {
+    const size_t to_read = std::min<uint64_t>(buf.size(), length - done);
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(
+        utils::PReadAll(fd, buf.data(), to_read, offset + done, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(to_read));
+    TEST_AND_RETURN_FALSE(sink(buf.data(), to_read));
+    done += to_read;
+  }
   return true;
 }
 
@@ -409,23 +424,28 @@ bool PayloadSigner::HashPayloadForSigning(const string& payload_path,
   TEST_AND_RETURN_FALSE(
       ConvertSignaturesToProtobuf(signatures, signature_sizes, &signature));
 
-  brillo::Blob payload;
-  uint64_t metadata_size, signatures_offset;
-  uint32_t metadata_signature_size;
-  // Prepare payload for hashing.
-  TEST_AND_RETURN_FALSE(AddSignatureBlobToPayload(payload_path,
-                                                  signature,
-                                                  signature,
-                                                  &payload,
-                                                  &metadata_size,
-                                                  &metadata_signature_size,
-                                                  &signatures_offset));
-  TEST_AND_RETURN_FALSE(CalculateHashFromPayload(payload,
-                                                 metadata_size,
-                                                 metadata_signature_size,
-                                                 signatures_offset,
-                                                 out_payload_hash_data,
-                                                 out_metadata_hash));
+  ResignedPayload payload;
+  TEST_AND_RETURN_FALSE(ResignPayloadMetadata(
+      payload_path, signature.size(), signature.size(), &payload));
+  if (out_metadata_hash) {
+    TEST_AND_RETURN_FALSE(
+        HashCalculator::RawHashOfData(payload.metadata, out_metadata_hash));
+  }
+  if (out_payload_hash_data) {
+    // The payload hash skips the metadata signature and payload signature.
+    HashCalculator calc;
+    TEST_AND_RETURN_FALSE(
+        calc.Update(payload.metadata.data(), payload.metadata.size()));
+    TEST_AND_RETURN_FALSE(StreamFileRange(
+        payload_path,
+        payload.data_offset,
+        payload.data_length,
+        [&calc](const void* data, size_t size) {
+          return calc.Update(data, size);
+        }));
+    TEST_AND_RETURN_FALSE(calc.Finalize());
+    *out_payload_hash_data = calc.raw_hash();
+  }
   return true;
 }
 
@@ -436,9 +456,7 @@ bool PayloadSigner::AddSignatureToPayload(
     const vector<brillo::Blob>& metadata_signatures,
     const string& signed_payload_path,
     uint64_t* out_metadata_size) {
-  // TODO(petkov): Reduce memory usage -- the payload is manipulated in memory.
-
-  // Loads the payload and adds the signature op to it.
+  // Loads the payload metadata and adds the signature op to it.
   string payload_signature, metadata_signature;
   TEST_AND_RETURN_FALSE(ConvertSignaturesToProtobuf(
       payload_signatures, padded_signature_sizes, &payload_signature));
@@ -446,20 +464,45 @@ bool PayloadSigner::AddSignatureToPayload(
     TEST_AND_RETURN_FALSE(ConvertSignaturesToProtobuf(
         metadata_signatures, padded_signature_sizes, &metadata_signature));
   }
-  brillo::Blob payload;
-  uint64_t signatures_offset;
-  uint32_t metadata_signature_size;
-  TEST_AND_RETURN_FALSE(AddSignatureBlobToPayload(payload_path,
-                                                  payload_signature,
-                                                  metadata_signature,
-                                                  &payload,
-                                                  out_metadata_size,
-                                                  &metadata_signature_size,
-                                                  &signatures_offset));
-
-  LOG(INFO) << "Signed payload size: " << payload.size();
-  TEST_AND_RETURN_FALSE(utils::WriteFile(
-      signed_payload_path.c_str(), payload.data(), payload.size()));
+  ResignedPayload payload;
+  TEST_AND_RETURN_FALSE(ResignPayloadMetadata(payload_path,
+                                              metadata_signature.size(),
+                                              payload_signature.size(),
+                                              &payload));
+
+  // Written aside and renamed, so that |signed_payload_path| may be
+  // |payload_path|.
+  base::FilePath temp_path;
+  TEST_AND_RETURN_FALSE(base::CreateTemporaryFileInDir(
+      base::FilePath(signed_payload_path).DirName(), &temp_path));
+  ScopedPathUnlinker temp_unlinker(temp_path.value());
+  {
+    DirectFileWriter writer;
+    TEST_AND_RETURN_FALSE_ERRNO(
+        writer.Open(temp_path.value().c_str(), O_WRONLY | O_TRUNC, 0644) == 0);
+    ScopedFileWriterCloser writer_closer(&writer);
+    TEST_AND_RETURN_FALSE_ERRNO(
+        writer.Write(payload.metadata.data(), payload.metadata.size()));
+    TEST_AND_RETURN_FALSE_ERRNO(
+        writer.Write(metadata_signature.data(), metadata_signature.size()));
+    TEST_AND_RETURN_FALSE(StreamFileRange(
+        payload_path,
+        payload.data_offset,
+        payload.data_length,
+        [&writer](const void* data, size_t size) {
+          return writer.Write(data, size);
+        }));
+    TEST_AND_RETURN_FALSE_ERRNO(
+        writer.Write(payload_signature.data(), payload_signature.size()));
+  }
+  TEST_AND_RETURN_FALSE_ERRNO(
+      rename(temp_path.value().c_str(), signed_payload_path.c_str()) == 0);
+  temp_unlinker.set_should_remove(false);
+
+  LOG(INFO) << "Signed payload size: "
+            << payload.metadata.size() + metadata_signature.size() +
+                   payload.data_length + payload_signature.size();
+  *out_metadata_size = payload.metadata.size();
   return true;
 }
 
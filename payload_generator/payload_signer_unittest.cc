@@ -174,4 +174,39 @@ TEST_F(PayloadSignerTest, VerifySignedPayloadTest) {
       payload_file.path(), GetBuildArtifactsPath(kUnittestPublicKeyPath)));
 }
 
+TEST_F(PayloadSignerTest, AddSignatureToPayloadInPlaceTest) {
+  ScopedTempFile payload_file("payload.XXXXXX");
+  PayloadGenerationConfig config;
+  config.version.major = kBrilloMajorPayloadVersion;
+  PayloadFile payload;
+  EXPECT_TRUE(payload.Init(config));
+  uint64_t metadata_size;
+  EXPECT_TRUE(payload.WritePayload(
+      payload_file.path(), "/dev/null", "", &metadata_size));
+
+  const string private_key = GetBuildArtifactsPath(kUnittestPrivateKeyPath);
+  size_t signature_size;
+  ASSERT_TRUE(
+      PayloadSigner::GetMaximumSignatureSize(private_key, &signature_size));
+  // Signing twice replaces the signatures added the first time.
+  for (int i = 0; i < 2; i++) {
+    brillo::Blob payload_hash, metadata_hash;
+    ASSERT_TRUE(PayloadSigner::HashPayloadForSigning(
+        payload_file.path(), {signature_size}, &payload_hash, &metadata_hash));
+    brillo::Blob payload_signature, metadata_signature;
+    ASSERT_TRUE(
+        PayloadSigner::SignHash(payload_hash, private_key, &payload_signature));
+    ASSERT_TRUE(PayloadSigner::SignHash(
+        metadata_hash, private_key, &metadata_signature));
+    ASSERT_TRUE(PayloadSigner::AddSignatureToPayload(payload_file.path(),
+                                                     {signature_size},
+                                                     {payload_signature},
+                                                     {metadata_signature},
+                                                     payload_file.path(),
+                                                     &metadata_size));
+    EXPECT_TRUE(PayloadSigner::VerifySignedPayload(
+        payload_file.path(), GetBuildArtifactsPath(kUnittestPublicKeyPath)));
+  }
+}
+
 }  // namespace chromeos_update_engine
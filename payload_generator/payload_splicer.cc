@@ -0,0 +1,199 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/payload_splicer.h"
+
+#include <fcntl.h>
+
+#include <utility>
+
+#include <base/logging.h>
+#include <base/posix/eintr_wrapper.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+bool SamePartitionInfo(const PartitionInfo& a, const PartitionInfo& b) {
+  return a.size() == b.size() && a.hash() == b.hash();
+}
+
+// Returns whether the Virtual AB settings the COW estimates and merge
+// sequences depend on are the same in |a| and |b|.
+bool SameVirtualAbSettings(const DynamicPartitionMetadata& a,
+                           const DynamicPartitionMetadata& b) {
+  return a.snapshot_enabled() == b.snapshot_enabled() &&
+         a.vabc_enabled() == b.vabc_enabled() &&
+         a.vabc_compression_param() == b.vabc_compression_param() &&
+         a.cow_version() == b.cow_version() &&
+         a.compression_factor() == b.compression_factor();
+}
+
+}  // namespace
+
+std::unique_ptr<PayloadSplicer> PayloadSplicer::Open(
+    const string& payload_path) {
+  std::unique_ptr<PayloadSplicer> splicer(new PayloadSplicer());
+  PayloadMetadata metadata;
+  if (!metadata.ParsePayloadFile(payload_path, &splicer->manifest_, nullptr)) {
+    LOG(ERROR) << "Failed to read the manifest of " << payload_path;
+    return nullptr;
+  }
+  splicer->payload_path_ = payload_path;
+  splicer->major_version_ = metadata.GetMajorVersion();
+  splicer->data_offset_ =
+      metadata.GetMetadataSize() + metadata.GetMetadataSignatureSize();
+  return splicer;
+}
+
+bool PayloadSplicer::IsCompatible(const PayloadGenerationConfig& config) const {
+  if (major_version_ != config.version.major ||
+      manifest_.minor_version() != config.version.minor) {
+    LOG(WARNING) << payload_path_ << " has version " << major_version_ << "."
+                 << manifest_.minor_version() << ", not "
+                 << config.version.major << "." << config.version.minor;
+    return false;
+  }
+  if (manifest_.block_size() != config.block_size) {
+    LOG(WARNING) << payload_path_ << " has a block size of "
+                 << manifest_.block_size() << ", not " << config.block_size;
+    return false;
+  }
+  const auto& dap_metadata = config.target.dynamic_partition_metadata;
+  if (manifest_.has_dynamic_partition_metadata() != (dap_metadata != nullptr) ||
+      (dap_metadata &&
+       !SameVirtualAbSettings(manifest_.dynamic_partition_metadata(),
+                              *dap_metadata))) {
+    LOG(WARNING) << payload_path_ << " has other Virtual AB settings.";
+    return false;
+  }
+  return true;
+}
+
+const PartitionUpdate* PayloadSplicer::FindPartition(
+    const string& name) const {
+  for (const PartitionUpdate& partition : manifest_.partitions()) {
+    if (partition.partition_name() == name)
+      return &partition;
+  }
+  return nullptr;
+}
+
+bool PayloadSplicer::ReusePartition(
+    const PayloadGenerationConfig& config,
+    const PartitionConfig& old_part,
+    const PartitionConfig& new_part,
+    BlobFileWriter* blob_file,
+    vector<AnnotatedOperation>* aops,
+    vector<CowMergeOperation>* merge_sequence,
+    android::snapshot::CowSizeInfo* cow_info) const {
+  const PartitionUpdate* partition = FindPartition(new_part.name);
+  if (partition == nullptr)
+    return false;
+  const bool is_delta = !old_part.path.empty();
+  if (partition->has_old_partition_info() != is_delta)
+    return false;
+  if (is_delta && partition->operation_order() != config.operation_order)
+    return false;
+  const HashAlgorithm hash_algorithm = config.data_hash_algorithm;
+  if (GetDataHashAlgorithm(manifest_) != hash_algorithm)
+    return false;
+  // The operations in an operations section aren't in the manifest read.
+  if (partition->has_operations_section())
+    return false;
+  for (const InstallOperation& op : partition->operations()) {
+    if (!config.OperationEnabled(op.type()))
+      return false;
+  }
+  for (const CowMergeOperation& merge_op : partition->merge_operations()) {
+    if (!config.enable_vabc_xor &&
+        merge_op.type() == CowMergeOperation::COW_XOR) {
+      return false;
+    }
+  }
+
+  PartitionInfo info;
+  if (is_delta) {
+    TEST_AND_RETURN_FALSE(
+        diff_utils::InitializePartitionInfo(old_part, &info, hash_algorithm));
+    if (!SamePartitionInfo(info, partition->old_partition_info()))
+      return false;
+  }
+  TEST_AND_RETURN_FALSE(
+      diff_utils::InitializePartitionInfo(new_part, &info, hash_algorithm));
+  if (!SamePartitionInfo(info, partition->new_partition_info())) {
+    LOG(INFO) << "Partition " << new_part.name << " changed since "
+              << payload_path_;
+    return false;
+  }
+
+  int fd = HANDLE_EINTR(open(payload_path_.c_str(), O_RDONLY));
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  // The blobs stored before a failure are left in |blob_file|, unused.
+  vector<AnnotatedOperation> reused_aops;
+  reused_aops.reserve(partition->operations_size());
+  brillo::Blob blob;
+  for (const InstallOperation& op : partition->operations()) {
+    AnnotatedOperation aop;
+    aop.name = "<reused-" + new_part.name + ">";
+    aop.op = op;
+    if (op.data_length() > 0) {
+      blob.resize(op.data_length());
+      ssize_t bytes_read = 0;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(fd,
+                                            blob.data(),
+                                            blob.size(),
+                                            data_offset_ + op.data_offset(),
+                                            &bytes_read));
+      TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(blob.size()));
+      TEST_AND_RETURN_FALSE(aop.SetOperationBlob(blob, blob_file));
+      if (hash_algorithm != HashAlgorithm::kSha256) {
+        brillo::Blob hash;
+        TEST_AND_RETURN_FALSE(
+            HashCalculator::RawHashOfData(blob, &hash, hash_algorithm));
+        aop.op.set_data_sha256_hash(hash.data(), hash.size());
+      }
+      if (op.has_data_sha256_hash() &&
+          op.data_sha256_hash() != aop.op.data_sha256_hash()) {
+        LOG(ERROR) << "The data of an operation of " << new_part.name
+                   << " doesn't match its hash in " << payload_path_;
+        return false;
+      }
+    }
+    reused_aops.push_back(std::move(aop));
+  }
+
+  *aops = std::move(reused_aops);
+  merge_sequence->assign(partition->merge_operations().begin(),
+                         partition->merge_operations().end());
+  cow_info->cow_size = partition->estimate_cow_size();
+  cow_info->op_count_max = partition->estimate_op_count_max();
+  LOG(INFO) << "Reused the " << aops->size() << " operations of partition "
+            << new_part.name << " from " << payload_path_;
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,89 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_SPLICER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_SPLICER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <libsnapshot/cow_writer.h>
+
+#include "update_engine/payload_generator/annotated_operation.h"
+#include "update_engine/payload_generator/blob_file_writer.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Reuses the partitions of a payload generated before from the same source
+// build, so that only the partitions which changed since are generated again.
+// This happens when a target build is respun with a fix touching only a few
+// partitions. A partition is reused when both its source and target images
+// still hash to the PartitionInfo of the payload, which was generated with the
+// same version, block size and Virtual AB settings. Its operations, merge
+// sequence and COW estimate are copied, and its data blobs copied to the new
+// payload.
+//
+// The payload is trusted to have been generated with the same options
+// otherwise, such as the compressors and the diff algorithms allowed.
+//
+// The payloads of the shards of a payload generated on several hosts, see
+// PayloadGenerationConfig::num_shards, are merged the same way.
+class PayloadSplicer {
+ public:
+  // Reads the manifest of the payload at |payload_path|. Returns null on
+  // failure.
+  static std::unique_ptr<PayloadSplicer> Open(const std::string& payload_path);
+
+  // Returns whether the partitions of the payload may be reused for a payload
+  // generated with |config|.
+  bool IsCompatible(const PayloadGenerationConfig& config) const;
+
+  // Copies the operations of the partition from |old_part| to |new_part| in
+  // the payload to |aops|, their blobs to |blob_file|, and its merge sequence
+  // and COW estimate to |merge_sequence| and |cow_info|. Returns false,
+  // leaving them alone, if the partition changed or isn't in the payload, or
+  // couldn't be copied. Thread safe.
+  bool ReusePartition(const PayloadGenerationConfig& config,
+                      const PartitionConfig& old_part,
+                      const PartitionConfig& new_part,
+                      BlobFileWriter* blob_file,
+                      std::vector<AnnotatedOperation>* aops,
+                      std::vector<CowMergeOperation>* merge_sequence,
+                      android::snapshot::CowSizeInfo* cow_info) const;
+
+ private:
+  PayloadSplicer() = default;
+
+  // Returns the partition |name| in |manifest_|, or null.
+  const PartitionUpdate* FindPartition(const std::string& name) const;
+
+  std::string payload_path_;
+  uint64_t major_version_{0};
+  DeltaArchiveManifest manifest_;
+
+  // The offset in the payload of the data blobs.
+  uint64_t data_offset_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadSplicer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_SPLICER_H_
@@ -0,0 +1,168 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/payload_splicer.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class PayloadSplicerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    config_.is_delta = false;
+    config_.version.major = kBrilloMajorPayloadVersion;
+    config_.version.minor = kFullPayloadMinorVersion;
+    config_.hard_chunk_size = 128 * 1024;
+    config_.block_size = 4096;
+
+    part_data_.resize(1024 * 1024);
+    test_utils::FillWithData(&part_data_);
+    ASSERT_TRUE(test_utils::WriteFileVector(part_file_.path(), part_data_));
+    config_.target.partitions.emplace_back("part");
+    config_.target.partitions.back().path = part_file_.path();
+    config_.target.partitions.back().size = part_data_.size();
+
+    uint64_t metadata_size = 0;
+    ASSERT_TRUE(GenerateUpdatePayloadFile(
+        config_, payload_file_.path(), "", &metadata_size));
+  }
+
+  PayloadGenerationConfig config_;
+  brillo::Blob part_data_;
+  ScopedTempFile part_file_{"PayloadSplicerTest_part.XXXXXX"};
+  ScopedTempFile payload_file_{"PayloadSplicerTest_payload.XXXXXX"};
+
+  vector<AnnotatedOperation> aops_;
+  vector<CowMergeOperation> merge_sequence_;
+  android::snapshot::CowSizeInfo cow_info_{};
+};
+
+TEST_F(PayloadSplicerTest, ReusePartitionTest) {
+  auto splicer = PayloadSplicer::Open(payload_file_.path());
+  ASSERT_NE(nullptr, splicer);
+  EXPECT_TRUE(splicer->IsCompatible(config_));
+
+  ScopedTempFile blob_file("PayloadSplicerTest_blobs.XXXXXX", true);
+  off_t blob_file_size = 0;
+  BlobFileWriter blob_file_writer(blob_file.fd(), &blob_file_size);
+  PartitionConfig empty_part("");
+  EXPECT_TRUE(splicer->ReusePartition(config_,
+                                      empty_part,
+                                      config_.target.partitions[0],
+                                      &blob_file_writer,
+                                      &aops_,
+                                      &merge_sequence_,
+                                      &cow_info_));
+  EXPECT_EQ(part_data_.size() / config_.hard_chunk_size, aops_.size());
+  off_t data_length = 0;
+  for (const AnnotatedOperation& aop : aops_) {
+    data_length += aop.op.data_length();
+  }
+  EXPECT_EQ(data_length, blob_file_size);
+}
+
+TEST_F(PayloadSplicerTest, ChangedPartitionIsNotReusedTest) {
+  auto splicer = PayloadSplicer::Open(payload_file_.path());
+  ASSERT_NE(nullptr, splicer);
+  part_data_[0]++;
+  ASSERT_TRUE(test_utils::WriteFileVector(part_file_.path(), part_data_));
+
+  ScopedTempFile blob_file("PayloadSplicerTest_blobs.XXXXXX", true);
+  off_t blob_file_size = 0;
+  BlobFileWriter blob_file_writer(blob_file.fd(), &blob_file_size);
+  PartitionConfig empty_part("");
+  EXPECT_FALSE(splicer->ReusePartition(config_,
+                                       empty_part,
+                                       config_.target.partitions[0],
+                                       &blob_file_writer,
+                                       &aops_,
+                                       &merge_sequence_,
+                                       &cow_info_));
+  EXPECT_TRUE(aops_.empty());
+  EXPECT_EQ(0, blob_file_size);
+}
+
+TEST_F(PayloadSplicerTest, IncompatibleConfigTest) {
+  auto splicer = PayloadSplicer::Open(payload_file_.path());
+  ASSERT_NE(nullptr, splicer);
+  config_.block_size = 2 * 4096;
+  EXPECT_FALSE(splicer->IsCompatible(config_));
+}
+
+TEST_F(PayloadSplicerTest, ReusedPayloadIsIdenticalTest) {
+  ScopedTempFile new_payload_file("PayloadSplicerTest_payload.XXXXXX");
+  config_.reuse_payload_paths = {payload_file_.path()};
+  uint64_t metadata_size = 0;
+  ASSERT_TRUE(GenerateUpdatePayloadFile(
+      config_, new_payload_file.path(), "", &metadata_size));
+
+  brillo::Blob payload, new_payload;
+  ASSERT_TRUE(utils::ReadFile(payload_file_.path(), &payload));
+  ASSERT_TRUE(utils::ReadFile(new_payload_file.path(), &new_payload));
+  EXPECT_EQ(payload, new_payload);
+}
+
+TEST_F(PayloadSplicerTest, MergedShardsAreIdenticalTest) {
+  ScopedTempFile other_part_file("PayloadSplicerTest_part.XXXXXX");
+  brillo::Blob other_part_data(512 * 1024, 1);
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(other_part_file.path(), other_part_data));
+  config_.target.partitions.emplace_back("other");
+  config_.target.partitions.back().path = other_part_file.path();
+  config_.target.partitions.back().size = other_part_data.size();
+  uint64_t metadata_size = 0;
+  ASSERT_TRUE(GenerateUpdatePayloadFile(
+      config_, payload_file_.path(), "", &metadata_size));
+
+  // Each of the partitions goes to a shard of its own.
+  vector<std::unique_ptr<ScopedTempFile>> shard_files;
+  config_.num_shards = 2;
+  for (size_t shard = 0; shard < config_.num_shards; shard++) {
+    config_.shard_index = shard;
+    EXPECT_EQ(vector<size_t>{shard}, config_.GetShardPartitions());
+    shard_files.push_back(
+        std::make_unique<ScopedTempFile>("PayloadSplicerTest_shard.XXXXXX"));
+    ASSERT_TRUE(GenerateUpdatePayloadFile(
+        config_, shard_files.back()->path(), "", &metadata_size));
+    config_.reuse_payload_paths.push_back(shard_files.back()->path());
+  }
+
+  config_.num_shards = 1;
+  config_.shard_index = 0;
+  ScopedTempFile merged_payload_file("PayloadSplicerTest_payload.XXXXXX");
+  ASSERT_TRUE(GenerateUpdatePayloadFile(
+      config_, merged_payload_file.path(), "", &metadata_size));
+
+  brillo::Blob payload, merged_payload;
+  ASSERT_TRUE(utils::ReadFile(payload_file_.path(), &payload));
+  ASSERT_TRUE(utils::ReadFile(merged_payload_file.path(), &merged_payload));
+  EXPECT_EQ(payload, merged_payload);
+}
+
+}  // namespace chromeos_update_engine
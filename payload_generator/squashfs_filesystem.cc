@@ -17,8 +17,13 @@
 #include "update_engine/payload_generator/squashfs_filesystem.h"
 
 #include <fcntl.h>
+#include <lz4.h>
+#include <zlib.h>
+#include <zstd.h>
 
 #include <algorithm>
+#include <map>
+#include <set>
 #include <string>
 #include <utility>
 
@@ -27,13 +32,14 @@
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
-#include <brillo/streams/file_stream.h>
 
 #include "update_engine/common/subprocess.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/mapped_image.h"
+#include "update_engine/payload_generator/task_scheduler.h"
 #include "update_engine/update_metadata.pb.h"
 
 using base::FilePath;
@@ -50,6 +56,47 @@ namespace {
 constexpr size_t kSquashfsSuperBlockSize = 96;
 constexpr uint64_t kSquashfsCompressedBit = 1 << 24;
 constexpr uint32_t kSquashfsZlibCompression = 1;
+constexpr uint32_t kSquashfsLz4Compression = 5;
+constexpr uint32_t kSquashfsZstdCompression = 6;
+
+// The metadata blocks of the inode and directory tables hold up to 8 KiB,
+// stored after a two bytes header with their size and a bit set if they are
+// stored uncompressed.
+constexpr size_t kSquashfsMetadataSize = 8192;
+constexpr uint16_t kSquashfsMetadataUncompressedBit = 1 << 15;
+
+// The offsets in the super block of the fields only needed to read the
+// tables.
+constexpr size_t kSquashfsFragmentsOffset = 16;
+constexpr size_t kSquashfsRootInodeOffset = 32;
+constexpr size_t kSquashfsBytesUsedOffset = 40;
+constexpr size_t kSquashfsIdTableOffset = 48;
+constexpr size_t kSquashfsXattrTableOffset = 56;
+constexpr size_t kSquashfsInodeTableOffset = 64;
+constexpr size_t kSquashfsDirectoryTableOffset = 72;
+constexpr size_t kSquashfsFragmentTableOffset = 80;
+constexpr size_t kSquashfsLookupTableOffset = 88;
+constexpr uint64_t kSquashfsInvalidTable = ~0ULL;
+
+constexpr uint16_t kSquashfsDirType = 1;
+constexpr uint16_t kSquashfsRegType = 2;
+constexpr uint16_t kSquashfsLDirType = 8;
+constexpr uint16_t kSquashfsLRegType = 9;
+constexpr uint32_t kSquashfsInvalidFragment = 0xffffffff;
+
+// The sizes of the common header of the inodes, of the directory headers and
+// of the directory entries without their name.
+constexpr size_t kSquashfsInodeHeaderSize = 16;
+constexpr size_t kSquashfsDirHeaderSize = 12;
+constexpr size_t kSquashfsDirEntrySize = 8;
+constexpr size_t kSquashfsMaxNameSize = 256;
+
+template <typename T>
+T ReadLE(const uint8_t* data) {
+  T value;
+  memcpy(&value, data, sizeof(T));
+  return value;
+}
 
 bool ReadSquashfsHeader(const brillo::Blob blob,
                         SquashfsFilesystem::SquashfsHeader* header) {
@@ -89,23 +136,10 @@ bool GetFileMapContent(const string& sqfs_path, string* map) {
   return true;
 }
 
-}  // namespace
-
-bool SquashfsFilesystem::Init(const string& map,
-                              const string& sqfs_path,
-                              size_t size,
-                              const SquashfsHeader& header,
-                              bool extract_deflates) {
-  size_ = size;
-
-  bool is_zlib = header.compression_type == kSquashfsZlibCompression;
-  if (!is_zlib) {
-    LOG(WARNING) << "Filesystem is not Gzipped. Not filling deflates!";
-  }
-  vector<puffin::ByteExtent> zlib_blks;
-
-  // Reading files map. For the format of the file map look at the comments for
-  // |CreateFromFileMap()|.
+// Parses the file map |map|. For the format of the file map look at the
+// comments for |CreateFromFileMap()|.
+bool ParseFileMap(const string& map,
+                  vector<SquashfsFilesystem::FileBlocks>* files) {
   auto lines = base::SplitStringPiece(map,
                                       "\n",
                                       base::WhitespaceHandling::KEEP_WHITESPACE,
@@ -118,13 +152,349 @@ bool SquashfsFilesystem::Init(const string& map,
                                base::SplitResult::SPLIT_WANT_NONEMPTY);
     // Only filename is invalid.
     TEST_AND_RETURN_FALSE(splits.size() > 1);
-    uint64_t start;
-    TEST_AND_RETURN_FALSE(base::StringToUint64(splits[1], &start));
-    uint64_t cur_offset = start;
-    bool is_compressed = false;
+    SquashfsFilesystem::FileBlocks file;
+    file.name = splits[0].as_string();
+    TEST_AND_RETURN_FALSE(base::StringToUint64(splits[1], &file.start));
     for (size_t i = 2; i < splits.size(); ++i) {
       uint64_t blk_size;
       TEST_AND_RETURN_FALSE(base::StringToUint64(splits[i], &blk_size));
+      file.block_sizes.push_back(blk_size);
+    }
+    files->push_back(std::move(file));
+  }
+  return true;
+}
+
+// Uncompresses the metadata block |data| of |size| bytes into |out|.
+bool UncompressMetadata(uint16_t compression_type,
+                        const uint8_t* data,
+                        size_t size,
+                        brillo::Blob* out) {
+  out->resize(kSquashfsMetadataSize);
+  switch (compression_type) {
+    case kSquashfsZlibCompression: {
+      uLongf out_size = out->size();
+      TEST_AND_RETURN_FALSE(uncompress(out->data(), &out_size, data, size) ==
+                            Z_OK);
+      out->resize(out_size);
+      return true;
+    }
+    case kSquashfsLz4Compression: {
+      int out_size = LZ4_decompress_safe(reinterpret_cast<const char*>(data),
+                                         reinterpret_cast<char*>(out->data()),
+                                         size,
+                                         out->size());
+      TEST_AND_RETURN_FALSE(out_size >= 0);
+      out->resize(out_size);
+      return true;
+    }
+    case kSquashfsZstdCompression: {
+      size_t out_size = ZSTD_decompress(out->data(), out->size(), data, size);
+      TEST_AND_RETURN_FALSE(!ZSTD_isError(out_size));
+      out->resize(out_size);
+      return true;
+    }
+  }
+  return false;
+}
+
+// A table of metadata blocks of the image, uncompressed in full. The inodes
+// and directories refer to their position in a table with the offset of a
+// metadata block from the start of the table and an offset in the
+// uncompressed data of the block, which Locate() turns into a position in the
+// uncompressed data of the whole table.
+class MetadataTable {
+ public:
+  // Uncompresses the metadata blocks at [|start|, |end|) of |image|, on
+  // several threads.
+  bool Load(const MappedImage& image,
+            uint64_t start,
+            uint64_t end,
+            uint16_t compression_type) {
+    TEST_AND_RETURN_FALSE(start <= end && end <= image.size());
+    vector<uint64_t> blocks;
+    for (uint64_t pos = start; pos < end;) {
+      TEST_AND_RETURN_FALSE(end - pos >= 2);
+      size_t length = ReadLE<uint16_t>(image.data() + pos) &
+                      ~kSquashfsMetadataUncompressedBit;
+      TEST_AND_RETURN_FALSE(length > 0 && length <= kSquashfsMetadataSize &&
+                            length <= end - pos - 2);
+      blocks.push_back(pos);
+      pos += 2 + length;
+    }
+
+    vector<brillo::Blob> uncompressed(blocks.size());
+    vector<char> success(blocks.size());
+    TaskScheduler::TaskGroup tasks;
+    for (size_t i = 0; i < blocks.size(); i++) {
+      tasks.Add([&, i] {
+        const uint8_t* data = image.data() + blocks[i];
+        uint16_t header = ReadLE<uint16_t>(data);
+        size_t length = header & ~kSquashfsMetadataUncompressedBit;
+        if (header & kSquashfsMetadataUncompressedBit) {
+          uncompressed[i].assign(data + 2, data + 2 + length);
+          success[i] = true;
+        } else {
+          success[i] = UncompressMetadata(
+              compression_type, data + 2, length, &uncompressed[i]);
+        }
+      });
+    }
+    tasks.Wait();
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+      TEST_AND_RETURN_FALSE(success[i]);
+      block_positions_[blocks[i] - start] = data_.size();
+      data_.insert(data_.end(), uncompressed[i].begin(), uncompressed[i].end());
+    }
+    return true;
+  }
+
+  // Sets |pos| to the position in the table of |offset| in the metadata block
+  // at |block|.
+  bool Locate(uint64_t block, size_t offset, size_t* pos) const {
+    auto it = block_positions_.find(block);
+    TEST_AND_RETURN_FALSE(it != block_positions_.end());
+    TEST_AND_RETURN_FALSE(offset <= data_.size() - it->second);
+    *pos = it->second + offset;
+    return true;
+  }
+
+  // Returns the |count| bytes at |pos|, or nullptr if they are past the end
+  // of the table.
+  const uint8_t* Get(size_t pos, size_t count) const {
+    if (pos > data_.size() || count > data_.size() - pos) {
+      return nullptr;
+    }
+    return data_.data() + pos;
+  }
+
+ private:
+  brillo::Blob data_;
+
+  // The position in |data_| of each metadata block, by its offset from the
+  // start of the table.
+  std::map<uint64_t, size_t> block_positions_;
+};
+
+// Reads the data blocks of the regular file |name| from its inode at |pos|
+// of |inodes|.
+bool ReadFileInode(const MetadataTable& inodes,
+                   size_t pos,
+                   uint32_t block_size,
+                   const string& name,
+                   vector<SquashfsFilesystem::FileBlocks>* files) {
+  const uint8_t* inode = inodes.Get(pos, kSquashfsInodeHeaderSize);
+  TEST_AND_RETURN_FALSE(inode);
+  uint16_t type = ReadLE<uint16_t>(inode);
+  pos += kSquashfsInodeHeaderSize;
+
+  SquashfsFilesystem::FileBlocks file;
+  file.name = name;
+  uint64_t file_size;
+  uint32_t fragment;
+  if (type == kSquashfsRegType) {
+    // start_block, fragment, offset and file_size.
+    const uint8_t* reg = inodes.Get(pos, 16);
+    TEST_AND_RETURN_FALSE(reg);
+    file.start = ReadLE<uint32_t>(reg);
+    fragment = ReadLE<uint32_t>(reg + 4);
+    file_size = ReadLE<uint32_t>(reg + 12);
+    pos += 16;
+  } else if (type == kSquashfsLRegType) {
+    // start_block, file_size, sparse, nlink, fragment, offset and xattr.
+    const uint8_t* lreg = inodes.Get(pos, 40);
+    TEST_AND_RETURN_FALSE(lreg);
+    file.start = ReadLE<uint64_t>(lreg);
+    file_size = ReadLE<uint64_t>(lreg + 8);
+    fragment = ReadLE<uint32_t>(lreg + 28);
+    pos += 40;
+  } else {
+    LOG(ERROR) << "Unexpected inode type " << type << " for file " << name;
+    return false;
+  }
+
+  // The tail of the file is in a fragment, unless it has none.
+  uint64_t num_blocks = fragment == kSquashfsInvalidFragment
+                            ? utils::DivRoundUp(file_size, block_size)
+                            : file_size / block_size;
+  TEST_AND_RETURN_FALSE(num_blocks <= SIZE_MAX / 4);
+  const uint8_t* block_list = inodes.Get(pos, num_blocks * 4);
+  TEST_AND_RETURN_FALSE(block_list);
+  for (uint64_t i = 0; i < num_blocks; i++) {
+    file.block_sizes.push_back(ReadLE<uint32_t>(block_list + i * 4));
+  }
+  files->push_back(std::move(file));
+  return true;
+}
+
+// Reads the data blocks of all the regular files of the image |image| with
+// the super block |header| from its inode and directory tables, as
+// `unsquashfs -m` would list them.
+bool ReadFileBlocks(const MappedImage& image,
+                    const SquashfsFilesystem::SquashfsHeader& header,
+                    vector<SquashfsFilesystem::FileBlocks>* files) {
+  if (header.compression_type != kSquashfsZlibCompression &&
+      header.compression_type != kSquashfsLz4Compression &&
+      header.compression_type != kSquashfsZstdCompression) {
+    LOG(INFO) << "Squashfs compression " << header.compression_type
+              << " not supported.";
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(image.size() >= kSquashfsSuperBlockSize &&
+                        header.block_size > 0);
+  const uint8_t* super_block = image.data();
+  uint64_t inode_table_start =
+      ReadLE<uint64_t>(super_block + kSquashfsInodeTableOffset);
+  uint64_t directory_table_start =
+      ReadLE<uint64_t>(super_block + kSquashfsDirectoryTableOffset);
+  uint64_t bytes_used =
+      ReadLE<uint64_t>(super_block + kSquashfsBytesUsedOffset);
+  TEST_AND_RETURN_FALSE(bytes_used <= image.size());
+
+  // The directory table ends where the first of the tables following it
+  // starts: the fragment, export, id and xattr tables, in this order, each
+  // with its metadata blocks before the index the super block points to.
+  uint64_t directory_table_end = bytes_used;
+  auto clamp_end = [&](uint64_t pos) {
+    if (pos >= directory_table_start && pos < directory_table_end) {
+      directory_table_end = pos;
+    }
+  };
+  for (size_t offset : {kSquashfsFragmentTableOffset,
+                        kSquashfsLookupTableOffset,
+                        kSquashfsIdTableOffset,
+                        kSquashfsXattrTableOffset}) {
+    uint64_t index = ReadLE<uint64_t>(super_block + offset);
+    if (index == kSquashfsInvalidTable || index >= bytes_used) {
+      continue;
+    }
+    clamp_end(index);
+    bool has_blocks =
+        offset != kSquashfsFragmentTableOffset ||
+        ReadLE<uint32_t>(super_block + kSquashfsFragmentsOffset) > 0;
+    if (offset != kSquashfsXattrTableOffset && has_blocks &&
+        bytes_used - index >= 8) {
+      clamp_end(ReadLE<uint64_t>(image.data() + index));
+    }
+  }
+
+  MetadataTable inodes, directories;
+  TEST_AND_RETURN_FALSE(inodes.Load(image,
+                                    inode_table_start,
+                                    directory_table_start,
+                                    header.compression_type));
+  TEST_AND_RETURN_FALSE(directories.Load(image,
+                                         directory_table_start,
+                                         directory_table_end,
+                                         header.compression_type));
+
+  // Walks the directories from the root, reading the inode of every entry.
+  // The inodes are referred to by the offset of their metadata block in the
+  // upper bits and their offset in the block in the lower 16 bits.
+  struct Directory {
+    uint64_t inode_ref;
+    string path;
+  };
+  vector<Directory> pending = {
+      {ReadLE<uint64_t>(super_block + kSquashfsRootInodeOffset), ""}};
+  std::set<uint64_t> visited;
+  while (!pending.empty()) {
+    Directory dir = std::move(pending.back());
+    pending.pop_back();
+    TEST_AND_RETURN_FALSE(visited.insert(dir.inode_ref).second);
+
+    size_t pos;
+    TEST_AND_RETURN_FALSE(
+        inodes.Locate(dir.inode_ref >> 16, dir.inode_ref & 0xffff, &pos));
+    const uint8_t* inode = inodes.Get(pos, kSquashfsInodeHeaderSize);
+    TEST_AND_RETURN_FALSE(inode);
+    uint16_t type = ReadLE<uint16_t>(inode);
+    pos += kSquashfsInodeHeaderSize;
+    const uint8_t* dir_inode =
+        inodes.Get(pos, type == kSquashfsLDirType ? 24 : 16);
+    TEST_AND_RETURN_FALSE(dir_inode);
+    uint32_t start_block, listing_size;
+    uint16_t offset;
+    if (type == kSquashfsDirType) {
+      // start_block, nlink, file_size, offset and parent_inode.
+      start_block = ReadLE<uint32_t>(dir_inode);
+      listing_size = ReadLE<uint16_t>(dir_inode + 8);
+      offset = ReadLE<uint16_t>(dir_inode + 10);
+    } else if (type == kSquashfsLDirType) {
+      // nlink, file_size, start_block, parent_inode, i_count, offset, xattr.
+      listing_size = ReadLE<uint32_t>(dir_inode + 4);
+      start_block = ReadLE<uint32_t>(dir_inode + 8);
+      offset = ReadLE<uint16_t>(dir_inode + 18);
+    } else {
+      LOG(ERROR) << "Unexpected inode type " << type << " for directory "
+                 << dir.path;
+      return false;
+    }
+
+    // The size of a listing counts three more bytes, for "." and "..".
+    if (listing_size <= 3) {
+      continue;
+    }
+    TEST_AND_RETURN_FALSE(directories.Locate(start_block, offset, &pos));
+    const size_t end = pos + listing_size - 3;
+    while (pos < end) {
+      // count, start_block and inode_number, then |count| + 1 entries.
+      const uint8_t* dir_header = directories.Get(pos, kSquashfsDirHeaderSize);
+      TEST_AND_RETURN_FALSE(dir_header);
+      uint64_t count = ReadLE<uint32_t>(dir_header) + 1ULL;
+      uint64_t inode_block = ReadLE<uint32_t>(dir_header + 4);
+      pos += kSquashfsDirHeaderSize;
+      for (uint64_t i = 0; i < count; i++) {
+        // offset, inode_number, type and size, then the name.
+        const uint8_t* entry = directories.Get(pos, kSquashfsDirEntrySize);
+        TEST_AND_RETURN_FALSE(entry);
+        uint16_t inode_offset = ReadLE<uint16_t>(entry);
+        uint16_t entry_type = ReadLE<uint16_t>(entry + 4);
+        size_t name_size = ReadLE<uint16_t>(entry + 6) + 1;
+        TEST_AND_RETURN_FALSE(name_size <= kSquashfsMaxNameSize);
+        pos += kSquashfsDirEntrySize;
+        const uint8_t* name_data = directories.Get(pos, name_size);
+        TEST_AND_RETURN_FALSE(name_data);
+        pos += name_size;
+
+        string name(reinterpret_cast<const char*>(name_data), name_size);
+        string path = dir.path.empty() ? name : dir.path + "/" + name;
+        if (entry_type == kSquashfsDirType || entry_type == kSquashfsLDirType) {
+          pending.push_back({(inode_block << 16) | inode_offset, path});
+        } else if (entry_type == kSquashfsRegType ||
+                   entry_type == kSquashfsLRegType) {
+          size_t inode_pos;
+          TEST_AND_RETURN_FALSE(
+              inodes.Locate(inode_block, inode_offset, &inode_pos));
+          TEST_AND_RETURN_FALSE(ReadFileInode(
+              inodes, inode_pos, header.block_size, path, files));
+        }
+      }
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+bool SquashfsFilesystem::Init(const vector<FileBlocks>& file_blocks,
+                              const string& sqfs_path,
+                              size_t size,
+                              const SquashfsHeader& header,
+                              bool extract_deflates) {
+  size_ = size;
+
+  bool is_zlib = header.compression_type == kSquashfsZlibCompression;
+  if (!is_zlib) {
+    LOG(WARNING) << "Filesystem is not Gzipped. Not filling deflates!";
+  }
+  vector<puffin::ByteExtent> zlib_blks;
+
+  for (const auto& blocks : file_blocks) {
+    uint64_t cur_offset = blocks.start;
+    bool is_compressed = false;
+    for (uint64_t blk_size : blocks.block_sizes) {
       // TODO(ahassani): For puffin push it into a proper list if uncompressed.
       auto new_blk_size = blk_size & ~kSquashfsCompressedBit;
       TEST_AND_RETURN_FALSE(new_blk_size <= header.block_size);
@@ -139,10 +509,11 @@ bool SquashfsFilesystem::Init(const string& map,
     }
 
     // If size is zero do not add the file.
-    if (cur_offset - start > 0) {
+    if (cur_offset - blocks.start > 0) {
       File file;
-      file.name = splits[0].as_string();
-      file.extents = {ExtentForBytes(kBlockSize, start, cur_offset - start)};
+      file.name = blocks.name;
+      file.extents = {
+          ExtentForBytes(kBlockSize, blocks.start, cur_offset - blocks.start)};
       file.is_compressed = is_compressed;
       files_.emplace_back(file);
     }
@@ -256,37 +627,41 @@ unique_ptr<SquashfsFilesystem> SquashfsFilesystem::CreateFromFile(
   if (sqfs_path.empty())
     return nullptr;
 
-  brillo::StreamPtr sqfs_file =
-      brillo::FileStream::Open(FilePath(sqfs_path),
-                               brillo::Stream::AccessMode::READ,
-                               brillo::FileStream::Disposition::OPEN_EXISTING,
-                               nullptr);
-  if (!sqfs_file) {
+  std::shared_ptr<const MappedImage> image = MappedImage::Get(sqfs_path);
+  if (!image) {
     LOG(ERROR) << "Unable to open " << sqfs_path << " for reading.";
     return nullptr;
   }
 
   SquashfsHeader header;
-  brillo::Blob blob(kSquashfsSuperBlockSize);
-  if (!sqfs_file->ReadAllBlocking(blob.data(), blob.size(), nullptr)) {
-    LOG(ERROR) << "Unable to read from file: " << sqfs_path;
-    return nullptr;
-  }
+  brillo::Blob blob(image->data(),
+                    image->data() +
+                        std::min(image->size(), kSquashfsSuperBlockSize));
   if (!ReadSquashfsHeader(blob, &header) || !CheckHeader(header)) {
     // This is not necessary an error.
     return nullptr;
   }
 
-  // Read the map file.
-  string filemap;
-  if (!GetFileMapContent(sqfs_path, &filemap)) {
-    LOG(ERROR) << "Failed to produce squashfs map file: " << sqfs_path;
-    return nullptr;
+  vector<FileBlocks> file_blocks;
+  if (!ReadFileBlocks(*image, header, &file_blocks)) {
+    LOG(INFO) << "Reading the file map of " << sqfs_path
+              << " with unsquashfs.";
+    file_blocks.clear();
+    // Read the map file.
+    string filemap;
+    if (!GetFileMapContent(sqfs_path, &filemap)) {
+      LOG(ERROR) << "Failed to produce squashfs map file: " << sqfs_path;
+      return nullptr;
+    }
+    if (!ParseFileMap(filemap, &file_blocks)) {
+      LOG(ERROR) << "Failed to parse squashfs map file: " << sqfs_path;
+      return nullptr;
+    }
   }
 
   unique_ptr<SquashfsFilesystem> sqfs(new SquashfsFilesystem());
   if (!sqfs->Init(
-          filemap, sqfs_path, sqfs_file->GetSize(), header, extract_deflates)) {
+          file_blocks, sqfs_path, image->size(), header, extract_deflates)) {
     LOG(ERROR) << "Failed to initialized the Squashfs file system";
     return nullptr;
   }
@@ -301,8 +676,10 @@ unique_ptr<SquashfsFilesystem> SquashfsFilesystem::CreateFromFileMap(
     return nullptr;
   }
 
+  vector<FileBlocks> file_blocks;
   unique_ptr<SquashfsFilesystem> sqfs(new SquashfsFilesystem());
-  if (!sqfs->Init(filemap, "", size, header, false)) {
+  if (!ParseFileMap(filemap, &file_blocks) ||
+      !sqfs->Init(file_blocks, "", size, header, false)) {
     LOG(ERROR) << "Failed to initialize the Squashfs file system using filemap";
     return nullptr;
   }
@@ -51,11 +51,22 @@ class SquashfsFilesystem : public FilesystemInterface {
     uint16_t major_version;
   };
 
+  // The data blocks of a file of the image: the byte address of its first
+  // block and the size of each block as stored in the inode, with the 25th
+  // bit set for the blocks stored uncompressed.
+  struct FileBlocks {
+    std::string name;
+    uint64_t start;
+    std::vector<uint64_t> block_sizes;
+  };
+
   ~SquashfsFilesystem() override = default;
 
   // Creates the file system from the Squashfs file itself. If
   // |extract_deflates| is true, it will process files to find location of all
-  // deflate streams.
+  // deflate streams. The inode and directory tables are read from the image
+  // when their compression is supported (gzip, lz4 and zstd), and from the
+  // file map of `unsquashfs -m` otherwise.
   static std::unique_ptr<SquashfsFilesystem> CreateFromFile(
       const std::string& sqfs_path, bool extract_deflates);
 
@@ -96,7 +107,7 @@ class SquashfsFilesystem : public FilesystemInterface {
   SquashfsFilesystem() = default;
 
   // Initialize and populates the files in the file system.
-  bool Init(const std::string& map,
+  bool Init(const std::vector<FileBlocks>& file_blocks,
             const std::string& sqfs_path,
             size_t size,
             const SquashfsHeader& header,
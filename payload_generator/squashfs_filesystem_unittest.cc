@@ -33,6 +33,7 @@
 
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 
 namespace chromeos_update_engine {
@@ -68,6 +69,144 @@ SquashfsFilesystem::SquashfsHeader GetSimpleHeader() {
   };
 }
 
+// Appends |value| to |blob| in little endian.
+template <typename T>
+void AppendLE(brillo::Blob* blob, T value) {
+  for (size_t i = 0; i < sizeof(T); i++) {
+    blob->push_back(static_cast<uint8_t>(value >> (8 * i)));
+  }
+}
+
+// Appends a metadata block with |data| stored uncompressed.
+void AppendMetadataBlock(brillo::Blob* blob, const brillo::Blob& data) {
+  AppendLE<uint16_t>(blob, data.size() | 0x8000);
+  blob->insert(blob->end(), data.begin(), data.end());
+}
+
+// Appends the common header of an inode: inode_type, mode, uid, guid, mtime
+// and inode_number.
+void AppendInodeHeader(brillo::Blob* blob, uint16_t type, uint32_t number) {
+  AppendLE<uint16_t>(blob, type);
+  AppendLE<uint16_t>(blob, 0644);
+  AppendLE<uint16_t>(blob, 0);
+  AppendLE<uint16_t>(blob, 0);
+  AppendLE<uint32_t>(blob, 0);
+  AppendLE<uint32_t>(blob, number);
+}
+
+// Appends the inode of a regular file starting at |start| with the blocks
+// |block_sizes|.
+void AppendFileInode(brillo::Blob* blob,
+                     uint32_t number,
+                     uint32_t start,
+                     uint32_t fragment,
+                     uint32_t file_size,
+                     const vector<uint32_t>& block_sizes) {
+  AppendInodeHeader(blob, 2, number);
+  AppendLE<uint32_t>(blob, start);
+  AppendLE<uint32_t>(blob, fragment);
+  AppendLE<uint32_t>(blob, 0);
+  AppendLE<uint32_t>(blob, file_size);
+  for (uint32_t block_size : block_sizes) {
+    AppendLE<uint32_t>(blob, block_size);
+  }
+}
+
+// Appends the inode of a directory listed at |listing_offset| of the first
+// block of the directory table.
+void AppendDirInode(brillo::Blob* blob,
+                    uint32_t number,
+                    uint16_t listing_offset,
+                    size_t listing_size) {
+  AppendInodeHeader(blob, 1, number);
+  AppendLE<uint32_t>(blob, 0);
+  AppendLE<uint32_t>(blob, 2);
+  AppendLE<uint16_t>(blob, listing_size + 3);
+  AppendLE<uint16_t>(blob, listing_offset);
+  AppendLE<uint32_t>(blob, 1);
+}
+
+// Appends a directory entry for the inode at |inode_offset| of the first
+// block of the inode table.
+void AppendDirEntry(brillo::Blob* blob,
+                    uint16_t inode_offset,
+                    uint16_t type,
+                    const string& name) {
+  AppendLE<uint16_t>(blob, inode_offset);
+  AppendLE<uint16_t>(blob, 0);
+  AppendLE<uint16_t>(blob, type);
+  AppendLE<uint16_t>(blob, name.size() - 1);
+  blob->insert(blob->end(), name.begin(), name.end());
+}
+
+// Returns a squashfs image of four blocks, with the uncompressed metadata
+// tables of the files:
+//   dir1/file1: one uncompressed block at 4096.
+//   file2: one compressed block at 8192, with its tail in a fragment.
+brillo::Blob BuildSquashfsImage() {
+  brillo::Blob image(kTestBlockSize * 3);
+
+  brillo::Blob inodes;
+  const uint16_t file1_inode = inodes.size();
+  AppendFileInode(&inodes, 1, 4096, 0xffffffff, 4096, {4096 | (1 << 24)});
+  const uint16_t file2_inode = inodes.size();
+  AppendFileInode(&inodes, 2, 8192, 0, 5000, {1000});
+  const uint16_t dir1_inode = inodes.size();
+  const uint16_t root_inode = dir1_inode + 32;
+
+  // Each listing has a header with the number of entries minus one, the
+  // block of their inodes and an inode number.
+  brillo::Blob dirs;
+  const uint16_t dir1_listing = dirs.size();
+  AppendLE<uint32_t>(&dirs, 0);
+  AppendLE<uint32_t>(&dirs, 0);
+  AppendLE<uint32_t>(&dirs, 1);
+  AppendDirEntry(&dirs, file1_inode, 2, "file1");
+  const uint16_t root_listing = dirs.size();
+  AppendLE<uint32_t>(&dirs, 1);
+  AppendLE<uint32_t>(&dirs, 0);
+  AppendLE<uint32_t>(&dirs, 2);
+  AppendDirEntry(&dirs, dir1_inode, 1, "dir1");
+  AppendDirEntry(&dirs, file2_inode, 2, "file2");
+
+  AppendDirInode(&inodes, 3, dir1_listing, root_listing - dir1_listing);
+  AppendDirInode(&inodes, 4, root_listing, dirs.size() - root_listing);
+
+  const uint64_t inode_table_start = image.size();
+  AppendMetadataBlock(&image, inodes);
+  const uint64_t directory_table_start = image.size();
+  AppendMetadataBlock(&image, dirs);
+  const uint64_t id_block = image.size();
+  AppendMetadataBlock(&image, {0, 0, 0, 0});
+  const uint64_t id_table_start = image.size();
+  AppendLE<uint64_t>(&image, id_block);
+  const uint64_t bytes_used = image.size();
+  image.resize(kTestBlockSize * 4);
+
+  brillo::Blob super_block;
+  AppendLE<uint32_t>(&super_block, 0x73717368);
+  AppendLE<uint32_t>(&super_block, 4);     // inodes
+  AppendLE<uint32_t>(&super_block, 0);     // mkfs_time
+  AppendLE<uint32_t>(&super_block, 4096);  // block_size
+  AppendLE<uint32_t>(&super_block, 0);     // fragments
+  AppendLE<uint16_t>(&super_block, 1);     // compression
+  AppendLE<uint16_t>(&super_block, 12);    // block_log
+  AppendLE<uint16_t>(&super_block, 0);     // flags
+  AppendLE<uint16_t>(&super_block, 1);     // no_ids
+  AppendLE<uint16_t>(&super_block, 4);     // s_major
+  AppendLE<uint16_t>(&super_block, 0);     // s_minor
+  AppendLE<uint64_t>(&super_block, root_inode);
+  AppendLE<uint64_t>(&super_block, bytes_used);
+  AppendLE<uint64_t>(&super_block, id_table_start);
+  AppendLE<uint64_t>(&super_block, ~0ULL);  // xattr_id_table_start
+  AppendLE<uint64_t>(&super_block, inode_table_start);
+  AppendLE<uint64_t>(&super_block, directory_table_start);
+  AppendLE<uint64_t>(&super_block, ~0ULL);  // fragment_table_start
+  AppendLE<uint64_t>(&super_block, ~0ULL);  // lookup_table_start
+  std::copy(super_block.begin(), super_block.end(), image.begin());
+  return image;
+}
+
 }  // namespace
 
 class SquashfsFilesystemTest : public ::testing::Test {
@@ -162,6 +301,29 @@ TEST_F(SquashfsFilesystemTest, UpdateEngineConfigTest) {
 }
 #endif  // __CHROMEOS__
 
+TEST_F(SquashfsFilesystemTest, ReadTablesTest) {
+  ScopedTempFile image_file("squashfs_image.XXXXXX");
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(image_file.path(), BuildSquashfsImage()));
+  unique_ptr<SquashfsFilesystem> fs =
+      SquashfsFilesystem::CreateFromFile(image_file.path(), false);
+  CheckSquashfs(fs);
+
+  vector<FilesystemInterface::File> files;
+  ASSERT_TRUE(fs->GetFiles(&files));
+  ASSERT_EQ(4u, files.size());
+  EXPECT_EQ("<metadata-0>", files[0].name);
+  EXPECT_EQ(vector<Extent>{ExtentForRange(0, 1)}, files[0].extents);
+  EXPECT_EQ("dir1/file1", files[1].name);
+  EXPECT_EQ(vector<Extent>{ExtentForRange(1, 1)}, files[1].extents);
+  EXPECT_FALSE(files[1].is_compressed);
+  EXPECT_EQ("file2", files[2].name);
+  EXPECT_EQ(vector<Extent>{ExtentForRange(2, 1)}, files[2].extents);
+  EXPECT_TRUE(files[2].is_compressed);
+  EXPECT_EQ("<metadata-1>", files[3].name);
+  EXPECT_EQ(vector<Extent>{ExtentForRange(3, 1)}, files[3].extents);
+}
+
 TEST_F(SquashfsFilesystemTest, SimpleFileMapTest) {
   string filemap = R"(dir1/file1 96 4000
                       dir1/file2 4096 100)";
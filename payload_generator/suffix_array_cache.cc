@@ -0,0 +1,107 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/suffix_array_cache.h"
+
+#include <bsdiff/bsdiff.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/parallel_suffix_array.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// bsdiff uses 32 bit suffix array entries for data smaller than 2 GiB, plus
+// the copy of the data the cache keeps.
+uint64_t EntrySize(uint64_t data_size) {
+  return data_size * (data_size < (1ULL << 31) ? 5 : 9);
+}
+
+}  // namespace
+
+bool SuffixArrayCache::Bsdiff(const brillo::Blob& old_data,
+                              const brillo::Blob& new_data,
+                              bsdiff::PatchWriterInterface* patch_writer,
+                              bool parallel) {
+  if (EntrySize(old_data.size()) > capacity_) {
+    if (parallel) {
+      return ParallelBsdiff(old_data, new_data, patch_writer);
+    }
+    return bsdiff::bsdiff(old_data.data(),
+                          old_data.size(),
+                          new_data.data(),
+                          new_data.size(),
+                          patch_writer,
+                          nullptr) == 0;
+  }
+
+  brillo::Blob hash;
+  TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(old_data, &hash));
+  std::shared_ptr<Entry> entry = GetEntry(utils::HexEncode(hash), old_data);
+
+  // The first user of the entry builds the suffix array, the others wait for
+  // it rather than building their own.
+  std::unique_lock<std::mutex> lock(entry->mutex);
+  bsdiff::SuffixArrayIndexInterface* index = entry->index.get();
+  if (index) {
+    lock.unlock();
+    hits_++;
+  } else if (parallel) {
+    entry->index = CreateParallelSuffixArrayIndex(entry->old_data.data(),
+                                                  entry->old_data.size());
+    index = entry->index.get();
+  }
+  const bool success = bsdiff::bsdiff(entry->old_data.data(),
+                                      entry->old_data.size(),
+                                      new_data.data(),
+                                      new_data.size(),
+                                      patch_writer,
+                                      &index) == 0;
+  if (lock.owns_lock()) {
+    if (index != entry->index.get()) {
+      entry->index.reset(index);
+    }
+    builds_++;
+  }
+  return success;
+}
+
+std::shared_ptr<SuffixArrayCache::Entry> SuffixArrayCache::GetEntry(
+    const std::string& key, const brillo::Blob& old_data) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->second;
+  }
+
+  auto entry = std::make_shared<Entry>();
+  entry->old_data = old_data;
+  lru_.emplace_front(key, entry);
+  entries_[key] = lru_.begin();
+  size_ += EntrySize(old_data.size());
+  // Evicted entries still in use are freed once their last user is done.
+  while (size_ > capacity_) {
+    size_ -= EntrySize(lru_.back().second->old_data.size());
+    entries_.erase(lru_.back().first);
+    lru_.pop_back();
+  }
+  return entry;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,84 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_SUFFIX_ARRAY_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_SUFFIX_ARRAY_CACHE_H_
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+#include <bsdiff/patch_writer_interface.h>
+#include <bsdiff/suffix_array_index.h>
+
+namespace chromeos_update_engine {
+
+// Keeps the bsdiff suffix arrays of recently diffed old data, by content hash,
+// so that diffing the same old data again skips building its suffix array,
+// the most expensive part of bsdiff on large files. Thread safe.
+class SuffixArrayCache {
+ public:
+  // |capacity| is the memory in bytes the cached suffix arrays and their data
+  // may take.
+  explicit SuffixArrayCache(uint64_t capacity) : capacity_(capacity) {}
+
+  // Same as bsdiff::bsdiff(), reusing or keeping the suffix array of
+  // |old_data|, built with CreateParallelSuffixArrayIndex() if |parallel|.
+  // Returns whether the patch was written.
+  bool Bsdiff(const brillo::Blob& old_data,
+              const brillo::Blob& new_data,
+              bsdiff::PatchWriterInterface* patch_writer,
+              bool parallel = false);
+
+  // Returns the number of suffix arrays built and the number reused.
+  size_t builds() const { return builds_; }
+  size_t hits() const { return hits_; }
+
+ private:
+  struct Entry {
+    std::mutex mutex;
+    // The suffix array points to this copy of the old data, which lives as
+    // long as it does.
+    brillo::Blob old_data;
+    std::unique_ptr<bsdiff::SuffixArrayIndexInterface> index;
+  };
+
+  // Returns the entry of |key|, adding one for |old_data| if there's none.
+  std::shared_ptr<Entry> GetEntry(const std::string& key,
+                                  const brillo::Blob& old_data);
+
+  const uint64_t capacity_;
+
+  std::mutex mutex_;
+  uint64_t size_{0};
+  // Most recently used first.
+  std::list<std::pair<std::string, std::shared_ptr<Entry>>> lru_;
+  std::map<std::string, decltype(lru_)::iterator> entries_;
+  std::atomic<size_t> builds_{0};
+  std::atomic<size_t> hits_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(SuffixArrayCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_SUFFIX_ARRAY_CACHE_H_
@@ -0,0 +1,86 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/suffix_array_cache.h"
+
+#include <memory>
+#include <random>
+
+#include <bsdiff/bsdiff.h>
+#include <bsdiff/patch_writer_factory.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+class SuffixArrayCacheTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    old_data_.resize(64 * 1024);
+    std::mt19937 gen(1234);
+    for (auto& byte : old_data_) {
+      byte = gen();
+    }
+    new_data_ = old_data_;
+    new_data_[100]++;
+    other_new_data_ = old_data_;
+    other_new_data_[5000]++;
+  }
+
+  // Returns the patch from |old_data_| to |new_data|, made with |cache| if not
+  // null.
+  brillo::Blob Diff(SuffixArrayCache* cache, const brillo::Blob& new_data) {
+    ScopedTempFile patch_file("SuffixArrayCacheTest-patch-XXXXXX");
+    auto writer = bsdiff::CreateBsdiffPatchWriter(patch_file.path());
+    if (cache) {
+      EXPECT_TRUE(cache->Bsdiff(old_data_, new_data, writer.get()));
+    } else {
+      EXPECT_EQ(0,
+                bsdiff::bsdiff(old_data_.data(),
+                               old_data_.size(),
+                               new_data.data(),
+                               new_data.size(),
+                               writer.get(),
+                               nullptr));
+    }
+    brillo::Blob patch;
+    EXPECT_TRUE(utils::ReadFile(patch_file.path(), &patch));
+    return patch;
+  }
+
+  brillo::Blob old_data_;
+  brillo::Blob new_data_;
+  brillo::Blob other_new_data_;
+};
+
+TEST_F(SuffixArrayCacheTest, ReusesSuffixArray) {
+  SuffixArrayCache cache(16 * 1024 * 1024);
+  EXPECT_EQ(Diff(nullptr, new_data_), Diff(&cache, new_data_));
+  EXPECT_EQ(Diff(nullptr, other_new_data_), Diff(&cache, other_new_data_));
+  EXPECT_EQ(1u, cache.builds());
+  EXPECT_EQ(1u, cache.hits());
+}
+
+TEST_F(SuffixArrayCacheTest, TooBigForCapacity) {
+  SuffixArrayCache cache(old_data_.size());
+  EXPECT_EQ(Diff(nullptr, new_data_), Diff(&cache, new_data_));
+  EXPECT_EQ(Diff(nullptr, other_new_data_), Diff(&cache, other_new_data_));
+  EXPECT_EQ(0u, cache.builds());
+  EXPECT_EQ(0u, cache.hits());
+}
+
+}  // namespace chromeos_update_engine
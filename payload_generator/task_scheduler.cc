@@ -0,0 +1,200 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/task_scheduler.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "update_engine/payload_generator/delta_diff_utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The scheduler and queue of the worker running on this thread, if any.
+thread_local const TaskScheduler* current_scheduler = nullptr;
+thread_local size_t current_queue = 0;
+// Memory reserved by this thread, in any scheduler.
+thread_local uint64_t thread_memory_reserved = 0;
+
+std::atomic<size_t> default_num_threads{0};
+
+}  // namespace
+
+void TaskScheduler::TaskGroup::Add(Task task) {
+  pending_tasks_++;
+  scheduler_->Post({std::move(task), this});
+}
+
+void TaskScheduler::TaskGroup::Wait() {
+  while (pending_tasks_ > 0) {
+    if (scheduler_->RunOne()) {
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(scheduler_->mutex_);
+    scheduler_->cond_.wait(lock, [this] {
+      return pending_tasks_ == 0 || scheduler_->queued_tasks_ > 0;
+    });
+  }
+}
+
+TaskScheduler::MemoryReservation::MemoryReservation(uint64_t bytes,
+                                                    TaskScheduler* scheduler)
+    : scheduler_(scheduler), bytes_(bytes) {
+  auto fits = [this] {
+    return scheduler_->memory_budget_ == 0 ||
+           scheduler_->memory_reserved_ == 0 || thread_memory_reserved > 0 ||
+           scheduler_->memory_reserved_ + bytes_ <= scheduler_->memory_budget_;
+  };
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(scheduler_->mutex_);
+      if (fits()) {
+        scheduler_->memory_reserved_ += bytes_;
+        break;
+      }
+    }
+    if (scheduler_->RunOne()) {
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(scheduler_->mutex_);
+    scheduler_->cond_.wait(
+        lock, [&] { return fits() || scheduler_->queued_tasks_ > 0; });
+  }
+  thread_memory_reserved += bytes_;
+}
+
+TaskScheduler::MemoryReservation::~MemoryReservation() {
+  thread_memory_reserved -= bytes_;
+  {
+    std::lock_guard<std::mutex> lock(scheduler_->mutex_);
+    scheduler_->memory_reserved_ -= bytes_;
+  }
+  scheduler_->cond_.notify_all();
+}
+
+TaskScheduler::TaskScheduler(size_t num_threads) {
+  num_threads = std::max<size_t>(num_threads, 1);
+  for (size_t i = 0; i <= num_threads; i++) {
+    queues_.push_back(std::make_unique<Queue>());
+  }
+  for (size_t i = 0; i < num_threads; i++) {
+    workers_.emplace_back(&TaskScheduler::WorkerLoop, this, i);
+  }
+}
+
+TaskScheduler::~TaskScheduler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  cond_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+void TaskScheduler::SetDefaultNumThreads(size_t num_threads) {
+  default_num_threads = num_threads;
+}
+
+void TaskScheduler::SetMemoryBudget(uint64_t bytes) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    memory_budget_ = bytes;
+  }
+  cond_.notify_all();
+}
+
+TaskScheduler* TaskScheduler::Get() {
+  // Never destroyed, so that no worker is left running tasks while the
+  // process exits.
+  static TaskScheduler* scheduler = new TaskScheduler(
+      default_num_threads > 0 ? default_num_threads.load()
+                              : diff_utils::GetMaxThreads());
+  return scheduler;
+}
+
+void TaskScheduler::Post(QueuedTask task) {
+  const size_t queue =
+      current_scheduler == this ? current_queue : queues_.size() - 1;
+  {
+    std::lock_guard<std::mutex> lock(queues_[queue]->mutex);
+    queues_[queue]->tasks.push_back(std::move(task));
+    queued_tasks_++;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+  }
+  cond_.notify_all();
+}
+
+bool TaskScheduler::RunOne() {
+  const size_t own_queue =
+      current_scheduler == this ? current_queue : queues_.size() - 1;
+  QueuedTask task;
+  bool found = false;
+  {
+    auto& queue = *queues_[own_queue];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.back());
+      queue.tasks.pop_back();
+      queued_tasks_--;
+      found = true;
+    }
+  }
+  for (size_t i = 1; !found && i < queues_.size(); i++) {
+    auto& queue = *queues_[(own_queue + i) % queues_.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (!queue.tasks.empty()) {
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+      queued_tasks_--;
+      found = true;
+    }
+  }
+  if (!found) {
+    return false;
+  }
+
+  task.task();
+  if (--task.group->pending_tasks_ == 0) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+    }
+    cond_.notify_all();
+  }
+  return true;
+}
+
+void TaskScheduler::WorkerLoop(size_t worker) {
+  current_scheduler = this;
+  current_queue = worker;
+  while (true) {
+    if (RunOne()) {
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return stopping_ || queued_tasks_ > 0; });
+    if (stopping_) {
+      return;
+    }
+  }
+}
+
+}  // namespace chromeos_update_engine
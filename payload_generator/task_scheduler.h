@@ -0,0 +1,141 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_TASK_SCHEDULER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_TASK_SCHEDULER_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+// A fixed set of threads shared by all the parallel work of the payload
+// generator: partitions, files within a partition, and chunks of big files.
+// Each worker has a queue of its own, running first the tasks it added last,
+// and takes the oldest tasks of the other queues when it runs out. Waiting for
+// a TaskGroup runs queued tasks instead of blocking, so tasks may add and wait
+// for tasks of their own without leaving threads idle or deadlocking.
+class TaskScheduler {
+ public:
+  using Task = std::function<void()>;
+
+  // A set of tasks to wait for together.
+  class TaskGroup {
+   public:
+    explicit TaskGroup(TaskScheduler* scheduler = TaskScheduler::Get())
+        : scheduler_(scheduler) {}
+    // Waits for the tasks not waited for yet.
+    ~TaskGroup() { Wait(); }
+
+    // Queues |task| to be run on any thread of the scheduler.
+    void Add(Task task);
+
+    // Returns once all the tasks added so far are done, running queued tasks
+    // in the meantime.
+    void Wait();
+
+   private:
+    friend class TaskScheduler;
+
+    TaskScheduler* scheduler_;
+    std::atomic<size_t> pending_tasks_{0};
+
+    DISALLOW_COPY_AND_ASSIGN(TaskGroup);
+  };
+
+  // Holds |bytes| of the memory budget of the scheduler while it lives. Runs
+  // queued tasks until enough of the budget is free. A reservation bigger than
+  // the whole budget is granted once nothing else is reserved. So is any
+  // reservation made by a thread already holding one, to not deadlock on the
+  // tasks it runs while waiting for a group.
+  class MemoryReservation {
+   public:
+    MemoryReservation(uint64_t bytes,
+                      TaskScheduler* scheduler = TaskScheduler::Get());
+    ~MemoryReservation();
+
+   private:
+    TaskScheduler* scheduler_;
+    const uint64_t bytes_;
+
+    DISALLOW_COPY_AND_ASSIGN(MemoryReservation);
+  };
+
+  explicit TaskScheduler(size_t num_threads);
+  ~TaskScheduler();
+
+  // Sets the number of threads of the process wide scheduler. Only has an
+  // effect before the first call to Get(), which otherwise uses
+  // diff_utils::GetMaxThreads().
+  static void SetDefaultNumThreads(size_t num_threads);
+
+  // Returns the process wide scheduler.
+  static TaskScheduler* Get();
+
+  size_t num_threads() const { return workers_.size(); }
+
+  // Limits the memory held by MemoryReservations at once to |bytes|, 0 for no
+  // limit.
+  void SetMemoryBudget(uint64_t bytes);
+
+ private:
+  struct QueuedTask {
+    Task task;
+    TaskGroup* group;
+  };
+  struct Queue {
+    std::mutex mutex;
+    std::deque<QueuedTask> tasks;
+  };
+
+  void Post(QueuedTask task);
+
+  // Runs one queued task, preferring the newest of the queue of the calling
+  // thread. Returns false if there was none.
+  bool RunOne();
+
+  void WorkerLoop(size_t worker);
+
+  // One queue per worker, and a last one for the tasks added by threads not
+  // belonging to this scheduler.
+  std::vector<std::unique_ptr<Queue>> queues_;
+  // Number of tasks in all of |queues_|.
+  std::atomic<size_t> queued_tasks_{0};
+
+  // Signaled when a task is queued, a group is done or memory is released.
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stopping_{false};
+  uint64_t memory_budget_{0};
+  uint64_t memory_reserved_{0};
+
+  std::vector<std::thread> workers_;
+
+  DISALLOW_COPY_AND_ASSIGN(TaskScheduler);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_TASK_SCHEDULER_H_
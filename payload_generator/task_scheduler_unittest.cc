@@ -0,0 +1,110 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/task_scheduler.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace chromeos_update_engine {
+
+TEST(TaskSchedulerTest, RunsAllTasks) {
+  TaskScheduler scheduler(4);
+  std::vector<size_t> runs(1000, 0);
+  TaskScheduler::TaskGroup group(&scheduler);
+  for (size_t i = 0; i < runs.size(); i++) {
+    group.Add([&runs, i] { runs[i]++; });
+  }
+  group.Wait();
+  for (size_t i = 0; i < runs.size(); i++) {
+    ASSERT_EQ(1u, runs[i]) << "task " << i;
+  }
+}
+
+TEST(TaskSchedulerTest, WaitWithoutTasks) {
+  TaskScheduler scheduler(2);
+  TaskScheduler::TaskGroup group(&scheduler);
+  group.Wait();
+  group.Wait();
+}
+
+// Tasks waiting for tasks of their own must not hold up the threads, even when
+// there are more nested groups than threads.
+TEST(TaskSchedulerTest, NestedGroups) {
+  TaskScheduler scheduler(1);
+  std::atomic<size_t> leaves{0};
+  TaskScheduler::TaskGroup outer(&scheduler);
+  for (size_t i = 0; i < 8; i++) {
+    outer.Add([&scheduler, &leaves] {
+      TaskScheduler::TaskGroup inner(&scheduler);
+      for (size_t j = 0; j < 16; j++) {
+        inner.Add([&leaves] { leaves++; });
+      }
+      inner.Wait();
+    });
+  }
+  outer.Wait();
+  EXPECT_EQ(8u * 16u, leaves);
+}
+
+TEST(TaskSchedulerTest, GroupWaitsOnDestruction) {
+  TaskScheduler scheduler(3);
+  std::atomic<size_t> runs{0};
+  {
+    TaskScheduler::TaskGroup group(&scheduler);
+    for (size_t i = 0; i < 100; i++) {
+      group.Add([&runs] { runs++; });
+    }
+  }
+  EXPECT_EQ(100u, runs);
+}
+
+TEST(TaskSchedulerTest, MemoryBudgetLimitsReservations) {
+  TaskScheduler scheduler(4);
+  scheduler.SetMemoryBudget(100);
+  std::atomic<uint64_t> reserved{0};
+  std::atomic<uint64_t> max_reserved{0};
+  TaskScheduler::TaskGroup group(&scheduler);
+  for (size_t i = 0; i < 20; i++) {
+    group.Add([&] {
+      TaskScheduler::MemoryReservation reservation(40, &scheduler);
+      const uint64_t now = reserved += 40;
+      uint64_t max = max_reserved;
+      while (now > max && !max_reserved.compare_exchange_weak(max, now)) {
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      reserved -= 40;
+    });
+  }
+  group.Wait();
+  EXPECT_LE(max_reserved, 80u);
+  EXPECT_GE(max_reserved, 40u);
+}
+
+TEST(TaskSchedulerTest, OversizedAndNestedReservations) {
+  TaskScheduler scheduler(2);
+  scheduler.SetMemoryBudget(100);
+  // Bigger than the whole budget, but nothing else is reserved.
+  TaskScheduler::MemoryReservation big(500, &scheduler);
+  // Already holding memory on this thread.
+  TaskScheduler::MemoryReservation nested(50, &scheduler);
+}
+
+}  // namespace chromeos_update_engine
@@ -29,6 +29,10 @@ void XzCompressInit();
 // will be the equivalent of running xz -9 --check=none
 bool XzCompress(const brillo::Blob& in, brillo::Blob* out);
 
+// Same, but the stream is made of blocks of |block_size| bytes of |in| which
+// decompress independently of each other, or of a single block if 0.
+bool XzCompress(const brillo::Blob& in, size_t block_size, brillo::Blob* out);
+
 }  // namespace chromeos_update_engine
 
 #endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_XZ_H_
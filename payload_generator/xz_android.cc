@@ -114,6 +114,10 @@ void XzCompressInit() {
 }
 
 bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
+  return XzCompress(in, 0, out);
+}
+
+bool XzCompress(const brillo::Blob& in, size_t block_size, brillo::Blob* out) {
   CHECK(xz_initialized) << "Initialize XzCompress first";
   out->clear();
   if (in.empty())
@@ -140,6 +144,11 @@ bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
   props.lzma2Props = lzma2Props;
 
   props.filterProps.id = GetFilterID(in);
+  // Each block starts with an empty dictionary, which makes the stream a bit
+  // larger but lets the blocks be decoded on several threads.
+  if (block_size > 0 && block_size < in.size()) {
+    props.blockSize = block_size;
+  }
 
   BlobWriterStream out_writer(out);
   BlobReaderStream in_reader(in);
@@ -51,4 +51,9 @@ bool XzCompress(const brillo::Blob& in, brillo::Blob* out) {
   return true;
 }
 
+bool XzCompress(const brillo::Blob& in, size_t block_size, brillo::Blob* out) {
+  // liblzma's single call encoder always writes a single block.
+  return XzCompress(in, out);
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,48 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/zstd_compress.h"
+
+#include <zstd.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+// Level 19 is the strongest level not needing a window bigger than 8 MiB to
+// decompress, the limit of ZstdExtentWriter.
+const int kZstdCompressionLevel = 19;
+}  // namespace
+
+bool ZstdCompress(const brillo::Blob& in, brillo::Blob* out) {
+  TEST_AND_RETURN_FALSE(out);
+  out->clear();
+  if (in.empty())
+    return true;
+
+  out->resize(ZSTD_compressBound(in.size()));
+  size_t size = ZSTD_compress(
+      out->data(), out->size(), in.data(), in.size(), kZstdCompressionLevel);
+  if (ZSTD_isError(size)) {
+    LOG(ERROR) << "ZSTD_compress returned " << ZSTD_getErrorName(size);
+    return false;
+  }
+  out->resize(size);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,141 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/zucchini_generator.h"
+
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <base/logging.h>
+#include <zucchini/element_detection.h>
+#include <zucchini/encoded_view.h>
+#include <zucchini/heuristic_ensemble_matcher.h>
+#include <zucchini/image_index.h>
+#include <zucchini/suffix_array.h>
+#include <zucchini/zucchini_gen.h>
+
+#include "update_engine/payload_generator/task_scheduler.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+uint64_t EstimateZucchiniElementMemory(uint64_t old_size, uint64_t new_size) {
+  // The disassembly and the equivalence maps of both elements.
+  return 12 * (old_size + new_size);
+}
+
+zucchini::status::Code GenerateZucchiniPatch(
+    zucchini::ConstBufferView old_image,
+    zucchini::ConstBufferView new_image,
+    zucchini::EnsemblePatchWriter* patch_writer) {
+  zucchini::HeuristicEnsembleMatcher matcher(nullptr);
+  if (!matcher.RunMatch(old_image, new_image) || matcher.matches().empty()) {
+    return zucchini::GenerateBufferRaw(old_image, new_image, patch_writer);
+  }
+  const vector<zucchini::ElementMatch>& matches = matcher.matches();
+
+  // The patch of every element and gap, by offset in |new_image|, the order
+  // they are written in. The elements are added before being diffed, so that
+  // the tasks only touch the map entry of their own element.
+  std::map<zucchini::offset_t, zucchini::PatchElementWriter> patch_elements;
+  vector<zucchini::PatchElementWriter*> element_writers;
+  for (const auto& match : matches) {
+    auto [it, inserted] = patch_elements.emplace(
+        static_cast<zucchini::offset_t>(match.new_element.region().lo()),
+        zucchini::PatchElementWriter(match));
+    DCHECK(inserted);
+    element_writers.push_back(&it->second);
+  }
+  // Not a vector<bool>, as the tasks set their own entry concurrently.
+  vector<char> element_generated(matches.size());
+  {
+    TaskScheduler::TaskGroup element_tasks;
+    for (size_t i = 0; i < matches.size(); i++) {
+      element_tasks.Add([&, i] {
+        const zucchini::ElementMatch& match = matches[i];
+        const zucchini::BufferRegion old_region = match.old_element.region();
+        const zucchini::BufferRegion new_region = match.new_element.region();
+        TaskScheduler::MemoryReservation reservation(
+            EstimateZucchiniElementMemory(old_region.size, new_region.size));
+        element_generated[i] =
+            zucchini::GenerateExecutableElement(match.exe_type(),
+                                                old_image[old_region],
+                                                new_image[new_region],
+                                                element_writers[i]);
+      });
+    }
+    element_tasks.Wait();
+  }
+
+  // The elements that failed are patched as raw data with the gaps.
+  vector<zucchini::BufferRegion> covered_regions;
+  size_t covered_bytes = 0;
+  for (size_t i = 0; i < matches.size(); i++) {
+    const zucchini::BufferRegion new_region = matches[i].new_element.region();
+    if (element_generated[i]) {
+      covered_regions.push_back(new_region);
+      covered_bytes += new_region.size;
+    } else {
+      LOG(INFO) << "Zucchini failed to diff the element at " << new_region.lo()
+                << ", patching it as raw data.";
+      patch_elements.erase(new_region.lo());
+    }
+  }
+
+  if (covered_bytes < new_image.size()) {
+    // Every gap is diffed against the whole old image, with one suffix array
+    // built once all the elements are done with theirs.
+    const zucchini::Element old_element(old_image.local_region(),
+                                        zucchini::kExeTypeNoOp);
+    zucchini::ImageIndex old_image_index(old_image);
+    zucchini::EncodedView old_view_raw(old_image_index);
+    const vector<zucchini::offset_t> old_sa_raw =
+        zucchini::MakeSuffixArray<zucchini::InducedSuffixSort>(
+            old_view_raw, static_cast<size_t>(old_view_raw.Cardinality()));
+
+    // The matches are sorted by new offset and don't overlap. A last empty
+    // region at the end of |new_image| closes the last gap.
+    covered_regions.push_back({new_image.size(), 0});
+    zucchini::offset_t gap_lo = 0;
+    for (const auto& covered : covered_regions) {
+      const auto gap_hi = static_cast<zucchini::offset_t>(covered.lo());
+      if (gap_hi > gap_lo) {
+        const zucchini::offset_t gap_size = gap_hi - gap_lo;
+        const zucchini::ElementMatch gap_match{
+            {old_element, zucchini::kExeTypeNoOp},
+            {{gap_lo, gap_size}, zucchini::kExeTypeNoOp}};
+        zucchini::PatchElementWriter patch_element(gap_match);
+        if (!zucchini::GenerateRawElement(old_sa_raw,
+                                          old_image,
+                                          new_image[{gap_lo, gap_size}],
+                                          &patch_element)) {
+          return zucchini::status::kStatusFatal;
+        }
+        patch_elements.emplace(gap_lo, std::move(patch_element));
+      }
+      gap_lo = static_cast<zucchini::offset_t>(covered.hi());
+    }
+  }
+
+  for (auto& [new_lo, patch_element] : patch_elements) {
+    patch_writer->AddElement(std::move(patch_element));
+  }
+  return zucchini::status::kStatusSuccess;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,45 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_ZUCCHINI_GENERATOR_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_ZUCCHINI_GENERATOR_H_
+
+#include <cstdint>
+
+#include <zucchini/buffer_view.h>
+#include <zucchini/patch_writer.h>
+#include <zucchini/zucchini.h>
+
+namespace chromeos_update_engine {
+
+// Returns a rough peak memory use of diffing an executable element of
+// |old_size| bytes into one of |new_size| bytes, besides the elements
+// themselves.
+uint64_t EstimateZucchiniElementMemory(uint64_t old_size, uint64_t new_size);
+
+// Same as zucchini::GenerateBuffer(), writing the same patch to
+// |patch_writer|, but diffs the matched executable elements of the images in
+// parallel on the tasks of the TaskScheduler, each holding a memory
+// reservation of its own. The raw data between the elements is then diffed
+// against the whole |old_image| as zucchini does, sharing one suffix array.
+zucchini::status::Code GenerateZucchiniPatch(
+    zucchini::ConstBufferView old_image,
+    zucchini::ConstBufferView new_image,
+    zucchini::EnsemblePatchWriter* patch_writer);
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_ZUCCHINI_GENERATOR_H_
@@ -0,0 +1,76 @@
+//
+// Copyright (C) 2024 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/zucchini_generator.h"
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+#include <zucchini/zucchini.h>
+
+#include "update_engine/common/test_utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+brillo::Blob Serialize(const zucchini::EnsemblePatchWriter& patch_writer) {
+  brillo::Blob patch(patch_writer.SerializedSize());
+  EXPECT_TRUE(patch_writer.SerializeInto({patch.data(), patch.size()}));
+  return patch;
+}
+
+}  // namespace
+
+class ZucchiniGeneratorTest : public ::testing::Test {
+ protected:
+  // Checks that GenerateZucchiniPatch() writes the same patch as
+  // zucchini::GenerateBuffer(), and that it gives back |new_data|.
+  void ExpectSamePatch(const brillo::Blob& old_data,
+                       const brillo::Blob& new_data) {
+    zucchini::ConstBufferView old_image(old_data.data(), old_data.size());
+    zucchini::ConstBufferView new_image(new_data.data(), new_data.size());
+    zucchini::EnsemblePatchWriter expected_writer(old_image, new_image);
+    ASSERT_EQ(zucchini::status::kStatusSuccess,
+              zucchini::GenerateBuffer(old_image, new_image, &expected_writer));
+    zucchini::EnsemblePatchWriter patch_writer(old_image, new_image);
+    ASSERT_EQ(zucchini::status::kStatusSuccess,
+              GenerateZucchiniPatch(old_image, new_image, &patch_writer));
+    const brillo::Blob patch = Serialize(patch_writer);
+    EXPECT_EQ(Serialize(expected_writer), patch);
+
+    auto patch_reader =
+        zucchini::EnsemblePatchReader::Create({patch.data(), patch.size()});
+    ASSERT_TRUE(patch_reader.has_value());
+    brillo::Blob output(new_data.size());
+    EXPECT_EQ(
+        zucchini::status::kStatusSuccess,
+        zucchini::ApplyBuffer(
+            old_image, *patch_reader, {output.data(), output.size()}));
+    EXPECT_EQ(new_data, output);
+  }
+};
+
+TEST_F(ZucchiniGeneratorTest, RawDataTest) {
+  brillo::Blob old_data(64 * 1024);
+  test_utils::FillWithData(&old_data);
+  brillo::Blob new_data = old_data;
+  new_data[100]++;
+  new_data.insert(
+      new_data.begin() + 4096, old_data.begin(), old_data.begin() + 1000);
+  ExpectSamePatch(old_data, new_data);
+}
+
+}  // namespace chromeos_update_engine
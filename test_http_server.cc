@@ -21,6 +21,13 @@
 
 // To use this, simply make an HTTP connection to localhost:port and
 // GET a url.
+//
+// GET /shaped/<size>/<bytes per sec>/<rtt ms>/<jitter ms>/<stall every>/
+// <stall ms> serves <size> bytes like /download/<size> does, over a
+// connection of the given bandwidth, latency and stalls, for the performance
+// of the fetchers to be measured reproducibly. Zero disables the bandwidth
+// cap or the stalls. These connections are served concurrently, each one
+// capped on its own.
 
 #include <err.h>
 #include <errno.h>
@@ -38,13 +45,16 @@
 
 #include <algorithm>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <base/logging.h>
 #include <base/posix/eintr_wrapper.h>
+#include <base/rand_util.h>
 #include <base/strings/string_split.h>
 #include <base/strings/string_util.h>
 #include <base/strings/stringprintf.h>
+#include <base/time/time.h>
 
 #include "update_engine/common/http_common.h"
 
@@ -385,6 +395,107 @@ ssize_t HandleGet(int fd,
   return HandleGet(fd, request, total_length, 0, 0, 0);
 }
 
+// The network conditions a shaped response is served under.
+struct Shape {
+  // The bandwidth of the connection, unlimited if zero.
+  size_t bytes_per_sec{0};
+  // The round trip time before the response starts, varying by up to
+  // |jitter_ms| either way.
+  int rtt_ms{0};
+  int jitter_ms{0};
+  // The connection stalls for |stall_ms| every |stall_every| bytes, if not
+  // zero, like it does while lost packets are retransmitted.
+  size_t stall_every{0};
+  int stall_ms{0};
+};
+
+void SleepFor(base::TimeDelta delay) {
+  if (delay > base::TimeDelta())
+    usleep(delay.InMicroseconds());
+}
+
+// Generates an HTTP response like HandleGet() over a connection with the
+// bandwidth, latency and stalls of |shape|. Returns the total number of bytes
+// delivered or -1 for error.
+ssize_t HandleShapedGet(int fd,
+                        const HttpRequest& request,
+                        const size_t total_length,
+                        const Shape& shape) {
+  int rtt_ms = shape.rtt_ms;
+  if (shape.jitter_ms > 0)
+    rtt_ms += base::RandInt(-shape.jitter_ms, shape.jitter_ms);
+  SleepFor(base::TimeDelta::FromMilliseconds(rtt_ms));
+
+  const size_t start_offset = request.start_offset;
+  size_t end_offset =
+      std::min(request.end_offset > 0 ? static_cast<size_t>(request.end_offset)
+                                      : total_length,
+               total_length);
+  // Leaves the error responses to HandleGet().
+  if (start_offset >= end_offset)
+    return HandleGet(fd, request, total_length);
+
+  ssize_t ret{};
+  size_t written = 0;
+  if ((ret = WriteHeaders(fd, start_offset, end_offset, request.return_code)) <
+      0)
+    return -1;
+  written += ret;
+
+  // The payload goes in slices of a twentieth of a second worth of bytes,
+  // each one sent once the bytes before it would have been at the bandwidth.
+  const size_t slice_size =
+      shape.bytes_per_sec > 0
+          ? std::clamp<size_t>(shape.bytes_per_sec / 20, 1024, 64 * 1024)
+          : 64 * 1024;
+  const base::TimeTicks start_time = base::TimeTicks::Now();
+  base::TimeDelta stalled;
+  size_t sent = 0;
+  size_t since_stall = 0;
+  for (size_t offset = start_offset; offset < end_offset;) {
+    const size_t slice_end = std::min(end_offset, offset + slice_size);
+    if ((ret = WritePayload(fd, offset, slice_end)) !=
+        static_cast<ssize_t>(slice_end - offset))
+      return -1;
+    written += ret;
+    sent += ret;
+    offset = slice_end;
+
+    since_stall += ret;
+    if (shape.stall_every > 0 && since_stall >= shape.stall_every) {
+      since_stall = 0;
+      LOG(INFO) << "stalling for " << shape.stall_ms << " ms";
+      SleepFor(base::TimeDelta::FromMilliseconds(shape.stall_ms));
+      stalled += base::TimeDelta::FromMilliseconds(shape.stall_ms);
+    }
+    if (shape.bytes_per_sec > 0) {
+      SleepFor(start_time + stalled +
+               base::TimeDelta::FromMicroseconds(
+                   sent * base::Time::kMicrosecondsPerSecond /
+                   shape.bytes_per_sec) -
+               base::TimeTicks::Now());
+    }
+  }
+
+  LOG(INFO) << "shaped response complete, " << written
+            << " total bytes written in "
+            << (base::TimeTicks::Now() - start_time).InMilliseconds() << " ms";
+  return written;
+}
+
+// Serves a shaped response and closes the connection, on a thread of its own
+// so that the connections made at the same time each get the bandwidth of
+// |shape|.
+void HandleShapedConnection(int fd,
+                            const HttpRequest& request,
+                            const size_t total_length,
+                            const Shape& shape) {
+  std::thread([fd, request, total_length, shape] {
+    HandleShapedGet(fd, request, total_length, shape);
+    close(fd);
+  }).detach();
+}
+
 // Handles /redirect/<code>/<url> requests by returning the specified
 // redirect <code> with a location pointing to /<url>.
 void HandleRedirect(int fd, const HttpRequest& request) {
@@ -543,6 +654,17 @@ void HandleConnection(int fd) {
               terms.GetSizeT(2),
               terms.GetInt(3),
               terms.GetInt(4));
+  } else if (base::StartsWith(url, "/shaped/", base::CompareCase::SENSITIVE)) {
+    const UrlTerms terms(url, 7);
+    Shape shape;
+    shape.bytes_per_sec = terms.GetSizeT(2);
+    shape.rtt_ms = terms.GetInt(3);
+    shape.jitter_ms = terms.GetInt(4);
+    shape.stall_every = terms.GetSizeT(5);
+    shape.stall_ms = terms.GetInt(6);
+    // The thread serving the response closes the connection.
+    HandleShapedConnection(fd, request, terms.GetSizeT(1), shape);
+    return;
   } else if (url.find("/redirect/") == 0) {
     HandleRedirect(fd, request);
   } else if (url == "/error") {